@@ -482,34 +482,37 @@ static int kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
     return kvm_set_user_memory_region(kml, mem, false);
 }
 
-static int kvm_section_update_flags(KVMMemoryListener *kml,
-                                    MemoryRegionSection *section)
+/* Called with KVMMemoryListener.slots_lock held */
+static int kvm_section_update_flags_locked(KVMMemoryListener *kml,
+                                           MemoryRegionSection *section)
 {
     hwaddr start_addr, size, slot_size;
     KVMSlot *mem;
     int ret = 0;
 
     size = kvm_align_section(section, &start_addr);
-    if (!size) {
-        return 0;
-    }
-
-    kvm_slots_lock();
-
     while (size && !ret) {
         slot_size = MIN(kvm_max_slot_size, size);
         mem = kvm_lookup_matching_slot(kml, start_addr, slot_size);
         if (!mem) {
             /* We don't have a slot if we want to trap every access. */
-            goto out;
+            break;
         }
 
         ret = kvm_slot_update_flags(kml, mem, section->mr);
         start_addr += slot_size;
         size -= slot_size;
     }
+    return ret;
+}
 
-out:
+static int kvm_section_update_flags(KVMMemoryListener *kml,
+                                    MemoryRegionSection *section)
+{
+    int ret;
+
+    kvm_slots_lock();
+    ret = kvm_section_update_flags_locked(kml, section);
     kvm_slots_unlock();
     return ret;
 }
@@ -618,26 +621,28 @@ static bool kvm_slot_get_dirty_log(KVMState *s, KVMSlot *slot)
     return ret == 0;
 }
 
-/* Should be with all slots_lock held for the address spaces. */
-static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
-                                     uint32_t slot_id, uint64_t offset)
+/*
+ * Should be with all slots_lock held for the address spaces.  Returns the
+ * slot a dirty ring entry refers to and its size in pages, or NULL if the
+ * slot is gone.
+ */
+static KVMSlot *kvm_dirty_ring_get_slot(KVMState *s, uint32_t slot,
+                                        uint64_t *npages)
 {
-    KVMMemoryListener *kml;
+    const uint32_t as_id = slot >> 16, slot_id = slot & 0xffff;
     KVMSlot *mem;
 
     if (as_id >= s->nr_as) {
-        return;
+        return NULL;
     }
 
-    kml = s->as[as_id].ml;
-    mem = &kml->slots[slot_id];
-
-    if (!mem->memory_size || offset >=
-        (mem->memory_size / qemu_real_host_page_size())) {
-        return;
+    mem = &s->as[as_id].ml->slots[slot_id];
+    if (!mem->memory_size) {
+        return NULL;
     }
 
-    set_bit(offset, mem->dirty_bmap);
+    *npages = mem->memory_size / qemu_real_host_page_size();
+    return mem;
 }
 
 static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
@@ -672,13 +677,18 @@ static void dirty_gfn_set_collected(struct kvm_dirty_gfn *gfn)
 
 /*
  * Should be with all slots_lock held for the address spaces.  It returns the
- * dirty page we've collected on this dirty ring.
+ * dirty page we've collected on this dirty ring.  Set @atomic if other rings
+ * are reaped concurrently, as they may update the same dirty bitmaps.
  */
-static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu,
+                                        bool atomic)
 {
     struct kvm_dirty_gfn *dirty_gfns = cpu->kvm_dirty_gfns, *cur;
     uint32_t ring_size = s->kvm_dirty_ring_size;
     uint32_t count = 0, fetch = cpu->kvm_fetch_index;
+    uint32_t slot = UINT32_MAX;
+    uint64_t npages = 0;
+    KVMSlot *mem = NULL;
 
     /*
      * It's possible that we race with vcpu creation code where the vcpu is
@@ -697,8 +707,18 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
         if (!dirty_gfn_is_dirtied(cur)) {
             break;
         }
-        kvm_dirty_ring_mark_page(s, cur->slot >> 16, cur->slot & 0xffff,
-                                 cur->offset);
+        /* Consecutive entries mostly hit the same slot. */
+        if (cur->slot != slot) {
+            slot = cur->slot;
+            mem = kvm_dirty_ring_get_slot(s, slot, &npages);
+        }
+        if (mem && cur->offset < npages) {
+            if (atomic) {
+                set_bit_atomic(cur->offset, mem->dirty_bmap);
+            } else {
+                set_bit(cur->offset, mem->dirty_bmap);
+            }
+        }
         dirty_gfn_set_collected(cur);
         trace_kvm_dirty_ring_page(cpu->cpu_index, fetch, cur->offset);
         fetch++;
@@ -710,6 +730,89 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
     return count;
 }
 
+/*
+ * With many vCPUs, the rings are split into groups of consecutive vCPUs
+ * which are reaped by concurrent threads.
+ */
+#define KVM_DIRTY_RING_REAP_GROUP_SIZE   32
+#define KVM_DIRTY_RING_REAP_MAX_THREADS  8
+
+typedef struct KVMDirtyRingReapGroup {
+    KVMState *s;
+    CPUState **cpus;
+    unsigned int nr_cpus;
+    uint64_t total;
+    QemuThread thread;
+} KVMDirtyRingReapGroup;
+
+static void *kvm_dirty_ring_reap_group(void *opaque)
+{
+    KVMDirtyRingReapGroup *group = opaque;
+    unsigned int i;
+
+    for (i = 0; i < group->nr_cpus; i++) {
+        group->total += kvm_dirty_ring_reap_one(group->s, group->cpus[i],
+                                                true);
+    }
+    return NULL;
+}
+
+/* Must be with slots_lock held */
+static uint64_t kvm_dirty_ring_reap_all(KVMState *s)
+{
+    g_autofree KVMDirtyRingReapGroup *groups = NULL;
+    g_autofree CPUState **cpus = NULL;
+    unsigned int nr_cpus = 0, nr_groups, i;
+    uint64_t total = 0;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        nr_cpus++;
+    }
+
+    nr_groups = MIN(DIV_ROUND_UP(nr_cpus, KVM_DIRTY_RING_REAP_GROUP_SIZE),
+                    KVM_DIRTY_RING_REAP_MAX_THREADS);
+    if (nr_groups <= 1) {
+        CPU_FOREACH(cpu) {
+            total += kvm_dirty_ring_reap_one(s, cpu, false);
+        }
+        return total;
+    }
+
+    cpus = g_new(CPUState *, nr_cpus);
+    i = 0;
+    CPU_FOREACH(cpu) {
+        if (i == nr_cpus) {
+            break;
+        }
+        cpus[i++] = cpu;
+    }
+    nr_cpus = i;
+
+    groups = g_new0(KVMDirtyRingReapGroup, nr_groups);
+    for (i = 0; i < nr_groups; i++) {
+        const unsigned int start = i * nr_cpus / nr_groups;
+
+        groups[i].s = s;
+        groups[i].cpus = &cpus[start];
+        groups[i].nr_cpus = (i + 1) * nr_cpus / nr_groups - start;
+        if (i) {
+            qemu_thread_create(&groups[i].thread, "kvm-reap-group",
+                               kvm_dirty_ring_reap_group, &groups[i],
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
+
+    /* The first group is reaped by the calling thread. */
+    kvm_dirty_ring_reap_group(&groups[0]);
+    total = groups[0].total;
+    for (i = 1; i < nr_groups; i++) {
+        qemu_thread_join(&groups[i].thread);
+        total += groups[i].total;
+    }
+    return total;
+}
+
 /* Must be with slots_lock held */
 static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
 {
@@ -720,11 +823,9 @@ static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
     stamp = get_clock();
 
     if (cpu) {
-        total = kvm_dirty_ring_reap_one(s, cpu);
+        total = kvm_dirty_ring_reap_one(s, cpu, false);
     } else {
-        CPU_FOREACH(cpu) {
-            total += kvm_dirty_ring_reap_one(s, cpu);
-        }
+        total = kvm_dirty_ring_reap_all(s);
     }
 
     if (total) {
@@ -1320,9 +1421,11 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
                  * remove the slot.
                  *
                  * Not easy.  Let's cross the fingers until it's fixed.
+                 *
+                 * The dirty rings were reaped once for the whole transaction
+                 * by kvm_region_commit().
                  */
                 if (kvm_state->kvm_dirty_ring_size) {
-                    kvm_dirty_ring_reap_locked(kvm_state, NULL);
                     if (kvm_state->kvm_dirty_ring_with_bitmap) {
                         kvm_slot_sync_dirty_pages(mem);
                         kvm_slot_get_dirty_log(kvm_state, mem);
@@ -1511,12 +1614,29 @@ static void kvm_region_del(MemoryListener *listener,
     QSIMPLEQ_INSERT_TAIL(&kml->transaction_del, update, next);
 }
 
+/*
+ * Whether a removed and an added section map the same RAM at the same guest
+ * address, so that the memslots can stay and only their flags change.  KVM
+ * cannot toggle KVM_MEM_READONLY in place, such changes still go through
+ * removal, which syncs the dirty bits first.
+ */
+static bool kvm_memory_update_in_place(MemoryRegionSection *del,
+                                       MemoryRegionSection *add)
+{
+    return del->mr == add->mr && memory_region_is_ram(add->mr) &&
+           del->readonly == add->readonly &&
+           del->offset_within_region == add->offset_within_region &&
+           del->offset_within_address_space ==
+           add->offset_within_address_space &&
+           int128_eq(del->size, add->size);
+}
+
 static void kvm_region_commit(MemoryListener *listener)
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener,
                                           listener);
     KVMMemoryUpdate *u1, *u2;
-    bool need_inhibit = false;
+    bool need_inhibit = false, need_reap = false;
 
     if (QSIMPLEQ_EMPTY(&kml->transaction_add) &&
         QSIMPLEQ_EMPTY(&kml->transaction_del)) {
@@ -1524,17 +1644,28 @@ static void kvm_region_commit(MemoryListener *listener)
     }
 
     /*
-     * We have to be careful when regions to add overlap with ranges to remove.
-     * We have to simulate atomic KVM memslot updates by making sure no ioctl()
-     * is currently active.
+     * A section that is removed and added again with only attributes changed
+     * that do not matter to KVM (e.g. nonvolatile) is updated in place
+     * instead, so that its memslots never go missing.
      *
-     * The lists are order by addresses, so it's easy to find overlaps.
+     * We have to be careful when other regions to add overlap with ranges to
+     * remove.  We have to simulate atomic KVM memslot updates by making sure
+     * no ioctl() is currently active.
+     *
+     * The lists are order by addresses, so it's easy to find both.
      */
     u1 = QSIMPLEQ_FIRST(&kml->transaction_del);
     u2 = QSIMPLEQ_FIRST(&kml->transaction_add);
     while (u1 && u2) {
         Range r1, r2;
 
+        if (kvm_memory_update_in_place(&u1->section, &u2->section)) {
+            u1->in_place = u2->in_place = true;
+            u1 = QSIMPLEQ_NEXT(u1, next);
+            u2 = QSIMPLEQ_NEXT(u2, next);
+            continue;
+        }
+
         range_init_nofail(&r1, u1->section.offset_within_address_space,
                           int128_get64(u1->section.size));
         range_init_nofail(&r2, u2->section.offset_within_address_space,
@@ -1542,7 +1673,6 @@ static void kvm_region_commit(MemoryListener *listener)
 
         if (range_overlaps_range(&r1, &r2)) {
             need_inhibit = true;
-            break;
         }
         if (range_lob(&r1) < range_lob(&r2)) {
             u1 = QSIMPLEQ_NEXT(u1, next);
@@ -1551,7 +1681,23 @@ static void kvm_region_commit(MemoryListener *listener)
         }
     }
 
+    QSIMPLEQ_FOREACH(u1, &kml->transaction_del, next) {
+        if (!u1->in_place &&
+            memory_region_get_dirty_log_mask(u1->section.mr)) {
+            need_reap = true;
+        }
+    }
+
     kvm_slots_lock();
+
+    /*
+     * Collect the dirty rings once for all memslots that are going away,
+     * rather than once per memslot.
+     */
+    if (need_reap && kvm_state->kvm_dirty_ring_size) {
+        kvm_dirty_ring_reap_locked(kvm_state, NULL);
+    }
+
     if (need_inhibit) {
         accel_ioctl_inhibit_begin();
     }
@@ -1561,7 +1707,9 @@ static void kvm_region_commit(MemoryListener *listener)
         u1 = QSIMPLEQ_FIRST(&kml->transaction_del);
         QSIMPLEQ_REMOVE_HEAD(&kml->transaction_del, next);
 
-        kvm_set_phys_mem(kml, &u1->section, false);
+        if (!u1->in_place) {
+            kvm_set_phys_mem(kml, &u1->section, false);
+        }
         memory_region_unref(u1->section.mr);
 
         g_free(u1);
@@ -1571,7 +1719,13 @@ static void kvm_region_commit(MemoryListener *listener)
         QSIMPLEQ_REMOVE_HEAD(&kml->transaction_add, next);
 
         memory_region_ref(u1->section.mr);
-        kvm_set_phys_mem(kml, &u1->section, true);
+        if (u1->in_place) {
+            if (kvm_section_update_flags_locked(kml, &u1->section) < 0) {
+                abort();
+            }
+        } else {
+            kvm_set_phys_mem(kml, &u1->section, true);
+        }
 
         g_free(u1);
     }
@@ -1814,6 +1968,8 @@ void kvm_init_irq_routing(KVMState *s)
 
     s->irq_routes = g_malloc0(sizeof(*s->irq_routes));
     s->nr_allocated_irq_routes = 0;
+    /* The first commit replaces the kernel's default table in any case */
+    s->irq_routes_dirty = true;
 
     kvm_arch_init_irq_routing(s);
 }
@@ -1830,10 +1986,19 @@ void kvm_irqchip_commit_routes(KVMState *s)
         return;
     }
 
+    /*
+     * Each KVM_SET_GSI_ROUTING rebuilds the whole table in the kernel and
+     * waits for readers of the old one, skip it if nothing changed.
+     */
+    if (!s->irq_routes_dirty) {
+        return;
+    }
+
     s->irq_routes->flags = 0;
     trace_kvm_irqchip_commit_routes();
     ret = kvm_vm_ioctl(s, KVM_SET_GSI_ROUTING, s->irq_routes);
     assert(ret == 0);
+    s->irq_routes_dirty = false;
 }
 
 static void kvm_add_routing_entry(KVMState *s,
@@ -1858,6 +2023,7 @@ static void kvm_add_routing_entry(KVMState *s,
     *new = *entry;
 
     set_gsi(s, entry->gsi);
+    s->irq_routes_dirty = true;
 }
 
 static int kvm_update_routing_entry(KVMState *s,
@@ -1877,6 +2043,7 @@ static int kvm_update_routing_entry(KVMState *s,
         }
 
         *entry = *new_entry;
+        s->irq_routes_dirty = true;
 
         return 0;
     }
@@ -1912,6 +2079,7 @@ void kvm_irqchip_release_virq(KVMState *s, int virq)
         if (e->gsi == virq) {
             s->irq_routes->nr--;
             *e = s->irq_routes->entries[s->irq_routes->nr];
+            s->irq_routes_dirty = true;
         }
     }
     clear_gsi(s, virq);
@@ -184,7 +184,7 @@ static bool tb_lookup_cmp(const void *p, const void *d)
         tb_page_addr0(tb) == desc->page_addr0 &&
         tb->cs_base == desc->cs_base &&
         tb->flags == desc->flags &&
-        tb_cflags(tb) == desc->cflags) {
+        (tb_cflags(tb) & ~CF_TIER0) == desc->cflags) {
         /* check next page if needed */
         tb_page_addr_t tb_phys_page1 = tb_page_addr1(tb);
         if (tb_phys_page1 == -1) {
@@ -235,6 +235,47 @@ static TranslationBlock *tb_htable_lookup(CPUState *cpu, vaddr pc,
     return qht_lookup_custom(&tb_ctx.htable, &desc, h, tb_lookup_cmp);
 }
 
+/*
+ * Translate the blocks that the persistent TB cache remembers for the
+ * page of @pc, now that the guest has started executing that page.
+ * Blocks whose guest code changed since they were saved are skipped.
+ */
+static void tb_cache_prewarm(CPUState *cpu, vaddr pc)
+{
+    uint32_t cflags = curr_cflags(cpu);
+    const TBCacheEntry *e;
+    unsigned int i, nr;
+
+    /* Breakpoints change how blocks are translated */
+    if (!QTAILQ_EMPTY(&cpu->breakpoints)) {
+        return;
+    }
+
+    e = tb_cache_take_page(cpu, pc, &nr);
+    for (i = 0; i < nr; i++, e++) {
+        void *host;
+        int flags;
+
+        if (e->cflags != cflags || e->pc == pc) {
+            continue;
+        }
+        flags = probe_access_flags(cpu_env(cpu), e->pc, 1, MMU_INST_FETCH,
+                                   cpu_mmu_index(cpu, true), true, &host, 0);
+        if ((flags & TLB_INVALID_MASK) || !host ||
+            -(e->pc | TARGET_PAGE_MASK) < e->size ||
+            tb_cache_code_hash(host, e->size) != e->hash) {
+            continue;
+        }
+        if (tb_htable_lookup(cpu, e->pc, e->cs_base, e->flags, cflags)) {
+            continue;
+        }
+
+        mmap_lock();
+        tb_gen_code(cpu, e->pc, e->cs_base, e->flags, cflags);
+        mmap_unlock();
+    }
+}
+
 /* Might cause an exception, so have a longjmp destination ready */
 static inline TranslationBlock *tb_lookup(CPUState *cpu, vaddr pc,
                                           uint64_t cs_base, uint32_t flags,
@@ -255,7 +296,7 @@ static inline TranslationBlock *tb_lookup(CPUState *cpu, vaddr pc,
                jc->array[hash].pc == pc &&
                tb->cs_base == cs_base &&
                tb->flags == flags &&
-               tb_cflags(tb) == cflags)) {
+               (tb_cflags(tb) & ~CF_TIER0) == cflags)) {
         goto hit;
     }
 
@@ -411,6 +452,11 @@ const void *HELPER(lookup_tb_ptr)(CPUArchState *env)
         cpu_loop_exit(cpu);
     }
 
+    /* Let the main loop invalidate code written to with tb_smc_batch */
+    if (unlikely(tb_smc_batch) && tb_smc_pending()) {
+        return tcg_code_gen_epilogue;
+    }
+
     tb = tb_lookup(cpu, pc, cs_base, flags, cflags);
     if (tb == NULL) {
         return tcg_code_gen_epilogue;
@@ -530,24 +576,12 @@ static void cpu_exec_longjmp_cleanup(CPUState *cpu)
     }
 #else
     /*
-     * For softmmu, a tlb_fill fault during translation will land here,
-     * and we need to release any page locks held.  In system mode we
-     * have one tcg_ctx per thread, so we know it was this cpu doing
-     * the translation.
-     *
-     * Alternative 1: Install a cleanup to be called via an exception
-     * handling safe longjmp.  It seems plausible that all our hosts
-     * support such a thing.  We'd have to properly register unwind info
-     * for the JIT for EH, rather that just for GDB.
-     *
-     * Alternative 2: Set and restore cpu->jmp_env in tb_gen_code to
-     * capture the cpu_loop_exit longjmp, perform the cleanup, and
-     * jump again to arrive here.
+     * For softmmu, a tlb_fill fault during translation will land here.
+     * No page locks are held during translation, but the abandoned TB
+     * must be forgotten.  In system mode we have one tcg_ctx per thread,
+     * so we know it was this cpu doing the translation.
      */
-    if (tcg_ctx->gen_tb) {
-        tb_unlock_pages(tcg_ctx->gen_tb);
-        tcg_ctx->gen_tb = NULL;
-    }
+    tcg_ctx->gen_tb = NULL;
 #endif
     if (bql_locked()) {
         bql_unlock();
@@ -724,6 +758,7 @@ static inline bool cpu_handle_exception(CPUState *cpu, int *ret)
         return true;
     }
 
+    tcg_stats_inc(cpu, exceptions);
 #if defined(CONFIG_USER_ONLY)
     /*
      * If user mode only, we simulate a fake exception which will be
@@ -852,6 +887,7 @@ static inline bool cpu_handle_interrupt(CPUState *cpu,
                     tcg_ops->need_replay_interrupt(interrupt_request)) {
                     replay_interrupt();
                 }
+                tcg_stats_inc(cpu, interrupts);
                 /*
                  * After processing the interrupt, ensure an EXCP_DEBUG is
                  * raised when single-stepping so that GDB doesn't miss the
@@ -893,6 +929,37 @@ static inline bool cpu_handle_interrupt(CPUState *cpu,
     return false;
 }
 
+#define tcg_stats_inc(cpu, field) \
+    qatomic_set(&(cpu)->tcg_stats->field, (cpu)->tcg_stats->field + 1)
+
+/*
+ * Record the TB at which a vCPU stopped because the profiling timer
+ * asked it to, see tcg_stats_init().
+ */
+static void tb_profile_sample(CPUState *cpu, TranslationBlock *tb)
+{
+    CPUTCGStats *s = cpu->tcg_stats;
+    uint64_t pc;
+    TBSample *sample;
+
+    if (likely(!qatomic_read(&s->sample))) {
+        return;
+    }
+    qatomic_set(&s->sample, false);
+    pc = log_pc(cpu, tb);
+
+    qemu_mutex_lock(&s->lock);
+    sample = g_hash_table_lookup(s->samples, &pc);
+    if (!sample) {
+        sample = g_new0(TBSample, 1);
+        sample->pc = pc;
+        g_hash_table_insert(s->samples, &sample->pc, sample);
+    }
+    sample->count++;
+    qemu_mutex_unlock(&s->lock);
+    tcg_stats_inc(cpu, nr_samples);
+}
+
 static inline void cpu_loop_exec_tb(CPUState *cpu, TranslationBlock *tb,
                                     vaddr pc, TranslationBlock **last_tb,
                                     int *tb_exit)
@@ -907,6 +974,25 @@ static inline void cpu_loop_exec_tb(CPUState *cpu, TranslationBlock *tb,
     }
 
     *last_tb = NULL;
+    tcg_stats_inc(cpu, exits_requested);
+    tb_profile_sample(cpu, tb);
+    if ((tb_cflags(tb) & CF_TIER0) && qatomic_read(&tb->tier_count) < 0) {
+        /* Hot enough to be retranslated, see tb_tier_up() */
+        return;
+    }
+
+    if (tb_smc_batch) {
+        /*
+         * No icount with tb_smc_batch: the guest wrote to the page of
+         * the TB, see tb_smc_gen_ptr().  Retry a TB that was requested
+         * to be uninterruptible as such.
+         */
+        if (tb_cflags(tb) & CF_NOIRQ) {
+            cpu->cflags_next_tb = tb_cflags(tb) & ~CF_INVALID;
+        }
+        return;
+    }
+
     insns_left = qatomic_read(&cpu->neg.icount_decr.u32);
     if (insns_left < 0) {
         /* Something asked us to stop executing chained TBs; just
@@ -942,6 +1028,42 @@ static inline void cpu_loop_exec_tb(CPUState *cpu, TranslationBlock *tb,
 #endif
 }
 
+/*
+ * Translate new TBs without the optimizer first when tiering is enabled.
+ * Single-instruction and icount TBs stay as they are: they are either
+ * short-lived or must exit for other reasons.
+ */
+static inline uint32_t tb_tier_cflags(uint32_t cflags)
+{
+    if (tcg_tier_threshold &&
+        !(cflags & (CF_COUNT_MASK | CF_USE_ICOUNT | CF_NOIRQ))) {
+        return cflags | CF_TIER0;
+    }
+    return cflags;
+}
+
+/*
+ * Replace a first tier TB that has been entered tcg_tier_threshold times
+ * with a fully optimized translation.  Invalidating it also unchains all
+ * jumps into it, so that they get chained to the new TB instead.
+ */
+static TranslationBlock *tb_tier_up(CPUState *cpu, TranslationBlock *tb,
+                                    vaddr pc, uint64_t cs_base,
+                                    uint32_t flags, uint32_t cflags)
+{
+    CPUJumpCache *jc = cpu->tb_jmp_cache;
+    uint32_t h = tb_jmp_cache_hash_func(pc);
+
+    mmap_lock();
+    tb_phys_invalidate(tb, -1);
+    tb = tb_gen_code(cpu, pc, cs_base, flags, cflags);
+    mmap_unlock();
+
+    jc->array[h].pc = pc;
+    qatomic_set(&jc->array[h].tb, tb);
+    return tb;
+}
+
 /* main execution loop */
 
 static int __attribute__((noinline))
@@ -980,13 +1102,21 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
                 break;
             }
 
+            if (unlikely(tb_smc_batch) && tb_smc_pending()) {
+                tb_smc_flush();
+            }
+
             tb = tb_lookup(cpu, pc, cs_base, flags, cflags);
-            if (tb == NULL) {
+            if (tb && unlikely(tb_cflags(tb) & CF_TIER0) &&
+                qatomic_read(&tb->tier_count) < 0) {
+                tb = tb_tier_up(cpu, tb, pc, cs_base, flags, cflags);
+            } else if (tb == NULL) {
                 CPUJumpCache *jc;
                 uint32_t h;
 
                 mmap_lock();
-                tb = tb_gen_code(cpu, pc, cs_base, flags, cflags);
+                tb = tb_gen_code(cpu, pc, cs_base, flags,
+                                 tb_tier_cflags(cflags));
                 mmap_unlock();
 
                 /*
@@ -997,6 +1127,11 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
                 jc = cpu->tb_jmp_cache;
                 jc->array[h].pc = pc;
                 qatomic_set(&jc->array[h].tb, tb);
+
+                if (tb_cache_enabled) {
+                    tb_cache_record(cpu, tb, pc);
+                    tb_cache_prewarm(cpu, pc);
+                }
             }
 
 #ifndef CONFIG_USER_ONLY
@@ -1074,6 +1209,11 @@ bool tcg_exec_realizefn(CPUState *cpu, Error **errp)
     }
 
     cpu->tb_jmp_cache = g_new0(CPUJumpCache, 1);
+    cpu->tcg_stats = g_new0(CPUTCGStats, 1);
+    qemu_mutex_init(&cpu->tcg_stats->lock);
+    cpu->tcg_stats->samples = g_hash_table_new_full(g_int64_hash,
+                                                    g_int64_equal,
+                                                    NULL, g_free);
     tlb_init(cpu);
 #ifndef CONFIG_USER_ONLY
     tcg_iommu_init_notifier_list(cpu);
@@ -1091,5 +1231,8 @@ void tcg_exec_unrealizefn(CPUState *cpu)
 #endif /* !CONFIG_USER_ONLY */
 
     tlb_destroy(cpu);
+    g_hash_table_destroy(cpu->tcg_stats->samples);
+    qemu_mutex_destroy(&cpu->tcg_stats->lock);
+    g_free(cpu->tcg_stats);
     g_free_rcu(cpu->tb_jmp_cache, rcu);
 }
@@ -240,6 +240,10 @@ static void tlb_mmu_flush_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast)
     desc->vindex = 0;
     memset(fast->table, -1, sizeof_tlb(fast));
     memset(desc->vtable, -1, sizeof(desc->vtable));
+    desc->lindex = 0;
+    for (int i = 0; i < CPU_LTLB_SIZE; i++) {
+        desc->ltable[i].addr = -1;
+    }
 }
 
 static void tlb_flush_one_mmuidx_locked(CPUState *cpu, int mmu_idx,
@@ -274,6 +278,34 @@ static inline void tlb_n_used_entries_dec(CPUState *cpu, uintptr_t mmu_idx)
     cpu->neg.tlb.d[mmu_idx].n_used_entries--;
 }
 
+/*
+ * A flush of @len bytes from @addr, comparing the low @bits of addresses,
+ * in the mmu_idx of @idxmap.  A @len of 0 means the whole of each TLB.
+ */
+typedef struct {
+    vaddr addr;
+    vaddr len;
+    uint16_t idxmap;
+    uint16_t bits;
+} TLBFlushRangeData;
+
+/*
+ * Flushes that other vCPUs asked for and that wait for the next exit of
+ * the target vCPU.  Broadcast TLB maintenance by one guest CPU typically
+ * comes as a storm of single page flushes, which are merged here into
+ * ranges, and turned into full flushes once there are too many of them.
+ */
+#define TLB_PENDING_RANGES 16
+
+typedef struct CPUTLBPendingFlush {
+    /* A tlb_flush_pending_async_work item is queued */
+    bool queued;
+    /* mmu_idx to flush completely */
+    uint16_t full_idxmap;
+    unsigned int nr_ranges;
+    TLBFlushRangeData ranges[TLB_PENDING_RANGES];
+} CPUTLBPendingFlush;
+
 void tlb_init(CPUState *cpu)
 {
     int64_t now = get_clock_realtime();
@@ -283,6 +315,7 @@ void tlb_init(CPUState *cpu)
 
     /* All tlbs are initialized flushed. */
     cpu->neg.tlb.c.dirty = 0;
+    cpu->neg.tlb.c.pending = g_new0(CPUTLBPendingFlush, 1);
 
     for (i = 0; i < NB_MMU_MODES; i++) {
         tlb_mmu_init(&cpu->neg.tlb.d[i], &cpu->neg.tlb.f[i], now);
@@ -294,6 +327,7 @@ void tlb_destroy(CPUState *cpu)
     int i;
 
     qemu_spin_destroy(&cpu->neg.tlb.c.lock);
+    g_free(cpu->neg.tlb.c.pending);
     for (i = 0; i < NB_MMU_MODES; i++) {
         CPUTLBDesc *desc = &cpu->neg.tlb.d[i];
         CPUTLBDescFast *fast = &cpu->neg.tlb.f[i];
@@ -303,21 +337,105 @@ void tlb_destroy(CPUState *cpu)
     }
 }
 
-/* flush_all_helper: run fn across all cpus
- *
- * If the wait flag is set then the src cpu's helper will be queued as
- * "safe" work and the loop exited creating a synchronisation point
- * where all queued work will be finished before execution starts
- * again.
- */
-static void flush_all_helper(CPUState *src, run_on_cpu_func fn,
-                             run_on_cpu_data d)
+static void tlb_flush_by_mmuidx_async_work(CPUState *cpu,
+                                           run_on_cpu_data data);
+static void tlb_flush_range_by_mmuidx_async_0(CPUState *cpu,
+                                              TLBFlushRangeData d);
+
+static void tlb_flush_pending_async_work(CPUState *cpu, run_on_cpu_data data)
+{
+    CPUTLBPendingFlush *pending = cpu->neg.tlb.c.pending;
+    CPUTLBPendingFlush p;
+    unsigned int i;
+
+    qemu_spin_lock(&cpu->neg.tlb.c.lock);
+    p = *pending;
+    pending->queued = false;
+    pending->full_idxmap = 0;
+    pending->nr_ranges = 0;
+    qemu_spin_unlock(&cpu->neg.tlb.c.lock);
+
+    if (p.full_idxmap) {
+        tlb_flush_by_mmuidx_async_work(cpu,
+                                       RUN_ON_CPU_HOST_INT(p.full_idxmap));
+    }
+    for (i = 0; i < p.nr_ranges; i++) {
+        TLBFlushRangeData d = p.ranges[i];
+
+        d.idxmap &= ~p.full_idxmap;
+        if (d.idxmap) {
+            tlb_flush_range_by_mmuidx_async_0(cpu, d);
+        }
+    }
+}
+
+/* Try to extend @r so that it also covers @d */
+static bool tlb_flush_range_merge(TLBFlushRangeData *r,
+                                  const TLBFlushRangeData *d)
+{
+    vaddr r_last = r->addr + r->len - 1;
+    vaddr d_last = d->addr + d->len - 1;
+
+    if (r->idxmap != d->idxmap || r->bits != d->bits ||
+        d->addr > r_last + 1 || r->addr > d_last + 1) {
+        return false;
+    }
+    r->addr = MIN(r->addr, d->addr);
+    r->len = MAX(r_last, d_last) - r->addr + 1;
+    return true;
+}
+
+/* Ask @cpu, which is not the current vCPU, to perform the flush @d */
+static void tlb_queue_flush(CPUState *cpu, const TLBFlushRangeData *d)
+{
+    CPUTLBPendingFlush *p = cpu->neg.tlb.c.pending;
+    bool queue;
+    unsigned int i;
+
+    if (!p) {
+        /* Not realized yet, and TLBs start out empty */
+        return;
+    }
+
+    qemu_spin_lock(&cpu->neg.tlb.c.lock);
+    if (d->len == 0) {
+        p->full_idxmap |= d->idxmap;
+    } else if ((d->idxmap & ~p->full_idxmap) != 0) {
+        for (i = 0; i < p->nr_ranges; i++) {
+            if (tlb_flush_range_merge(&p->ranges[i], d)) {
+                break;
+            }
+        }
+        if (i == p->nr_ranges) {
+            if (i < TLB_PENDING_RANGES) {
+                p->ranges[p->nr_ranges++] = *d;
+            } else {
+                /* Give up on precision */
+                p->full_idxmap |= d->idxmap;
+                for (i = 0; i < p->nr_ranges; i++) {
+                    p->full_idxmap |= p->ranges[i].idxmap;
+                }
+                p->nr_ranges = 0;
+            }
+        }
+    }
+    queue = !p->queued;
+    p->queued = true;
+    qemu_spin_unlock(&cpu->neg.tlb.c.lock);
+
+    if (queue) {
+        async_run_on_cpu(cpu, tlb_flush_pending_async_work, RUN_ON_CPU_NULL);
+    }
+}
+
+/* Queue the flush @d for all cpus but @src */
+static void tlb_queue_flush_others(CPUState *src, const TLBFlushRangeData *d)
 {
     CPUState *cpu;
 
     CPU_FOREACH(cpu) {
         if (cpu != src) {
-            async_run_on_cpu(cpu, fn, d);
+            tlb_queue_flush(cpu, d);
         }
     }
 }
@@ -367,8 +485,9 @@ void tlb_flush_by_mmuidx(CPUState *cpu, uint16_t idxmap)
     tlb_debug("mmu_idx: 0x%" PRIx16 "\n", idxmap);
 
     if (cpu->created && !qemu_cpu_is_self(cpu)) {
-        async_run_on_cpu(cpu, tlb_flush_by_mmuidx_async_work,
-                         RUN_ON_CPU_HOST_INT(idxmap));
+        TLBFlushRangeData d = { .idxmap = idxmap };
+
+        tlb_queue_flush(cpu, &d);
     } else {
         tlb_flush_by_mmuidx_async_work(cpu, RUN_ON_CPU_HOST_INT(idxmap));
     }
@@ -381,12 +500,12 @@ void tlb_flush(CPUState *cpu)
 
 void tlb_flush_by_mmuidx_all_cpus(CPUState *src_cpu, uint16_t idxmap)
 {
-    const run_on_cpu_func fn = tlb_flush_by_mmuidx_async_work;
+    TLBFlushRangeData d = { .idxmap = idxmap };
 
     tlb_debug("mmu_idx: 0x%"PRIx16"\n", idxmap);
 
-    flush_all_helper(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
-    fn(src_cpu, RUN_ON_CPU_HOST_INT(idxmap));
+    tlb_queue_flush_others(src_cpu, &d);
+    tlb_flush_by_mmuidx_async_work(src_cpu, RUN_ON_CPU_HOST_INT(idxmap));
 }
 
 void tlb_flush_all_cpus(CPUState *src_cpu)
@@ -396,12 +515,13 @@ void tlb_flush_all_cpus(CPUState *src_cpu)
 
 void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *src_cpu, uint16_t idxmap)
 {
-    const run_on_cpu_func fn = tlb_flush_by_mmuidx_async_work;
+    TLBFlushRangeData d = { .idxmap = idxmap };
 
     tlb_debug("mmu_idx: 0x%"PRIx16"\n", idxmap);
 
-    flush_all_helper(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
-    async_safe_run_on_cpu(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
+    tlb_queue_flush_others(src_cpu, &d);
+    async_safe_run_on_cpu(src_cpu, tlb_flush_by_mmuidx_async_work,
+                          RUN_ON_CPU_HOST_INT(idxmap));
 }
 
 void tlb_flush_all_cpus_synced(CPUState *src_cpu)
@@ -473,16 +593,66 @@ static inline void tlb_flush_vtlb_page_locked(CPUState *cpu, int mmu_idx,
     tlb_flush_vtlb_page_mask_locked(cpu, mmu_idx, page, -1);
 }
 
-static void tlb_flush_page_locked(CPUState *cpu, int midx, vaddr page)
+/*
+ * Flush the large pages of @midx that intersect [@addr, @last] when
+ * compared under @mask, together with all table entries created for
+ * them.  Return false if the entire tlb must be flushed instead.
+ */
+static bool tlb_flush_large_pages_locked(CPUState *cpu, int midx,
+                                         vaddr addr, vaddr last, vaddr mask)
 {
-    vaddr lp_addr = cpu->neg.tlb.d[midx].large_page_addr;
-    vaddr lp_mask = cpu->neg.tlb.d[midx].large_page_mask;
+    CPUTLBDesc *d = &cpu->neg.tlb.d[midx];
+    size_t n_entries = tlb_n_entries(&cpu->neg.tlb.f[midx]);
+    vaddr first_m = addr & mask, last_m = last & mask;
+
+    /*
+     * Check if we need to flush due to evicted large pages.
+     * Because large_page_mask contains all 1's from the msb,
+     * we only need to test the end of the range.
+     */
+    if ((last & d->large_page_mask) == d->large_page_addr) {
+        tlb_debug("forcing full flush midx %d ("
+                  "%016" VADDR_PRIx "/%016" VADDR_PRIx ")\n",
+                  midx, d->large_page_addr, d->large_page_mask);
+        return false;
+    }
+
+    for (int i = 0; i < CPU_LTLB_SIZE; i++) {
+        CPUTLBLargePage *lp = &d->ltable[i];
+        vaddr lp_last = lp->addr | ~lp->mask;
+        vaddr lp_first_m = lp->addr & mask, lp_last_m = lp_last & mask;
 
-    /* Check if we need to flush due to large pages.  */
-    if ((page & lp_mask) == lp_addr) {
-        tlb_debug("forcing full flush midx %d (%016"
+        if (lp->addr == (vaddr)-1) {
+            continue;
+        }
+        /* Either range may wrap around when compared under @mask.  */
+        if (first_m <= last_m && lp_first_m <= lp_last_m &&
+            (lp_first_m > last_m || lp_last_m < first_m)) {
+            continue;
+        }
+        if ((~lp->mask >> TARGET_PAGE_BITS) >= n_entries) {
+            /* Faster to start over than to test every page.  */
+            return false;
+        }
+
+        tlb_debug("flush large page midx %d (%016"
                   VADDR_PRIx "/%016" VADDR_PRIx ")\n",
-                  midx, lp_addr, lp_mask);
+                  midx, lp->addr, lp->mask);
+        for (vaddr page = lp->addr; page - 1 != lp_last;
+             page += TARGET_PAGE_SIZE) {
+            if (tlb_flush_entry_locked(tlb_entry(cpu, midx, page), page)) {
+                tlb_n_used_entries_dec(cpu, midx);
+            }
+            tlb_flush_vtlb_page_locked(cpu, midx, page);
+        }
+        lp->addr = -1;
+    }
+    return true;
+}
+
+static void tlb_flush_page_locked(CPUState *cpu, int midx, vaddr page)
+{
+    if (!tlb_flush_large_pages_locked(cpu, midx, page, page, -1)) {
         tlb_flush_one_mmuidx_locked(cpu, midx, get_clock_realtime());
     } else {
         if (tlb_flush_entry_locked(tlb_entry(cpu, midx, page), page)) {
@@ -580,22 +750,15 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, vaddr addr, uint16_t idxmap)
 
     if (qemu_cpu_is_self(cpu)) {
         tlb_flush_page_by_mmuidx_async_0(cpu, addr, idxmap);
-    } else if (idxmap < TARGET_PAGE_SIZE) {
-        /*
-         * Most targets have only a few mmu_idx.  In the case where
-         * we can stuff idxmap into the low TARGET_PAGE_BITS, avoid
-         * allocating memory for this operation.
-         */
-        async_run_on_cpu(cpu, tlb_flush_page_by_mmuidx_async_1,
-                         RUN_ON_CPU_TARGET_PTR(addr | idxmap));
     } else {
-        TLBFlushPageByMMUIdxData *d = g_new(TLBFlushPageByMMUIdxData, 1);
+        TLBFlushRangeData d = {
+            .addr = addr,
+            .len = TARGET_PAGE_SIZE,
+            .idxmap = idxmap,
+            .bits = TARGET_LONG_BITS,
+        };
 
-        /* Otherwise allocate a structure, freed by the worker.  */
-        d->addr = addr;
-        d->idxmap = idxmap;
-        async_run_on_cpu(cpu, tlb_flush_page_by_mmuidx_async_2,
-                         RUN_ON_CPU_HOST_PTR(d));
+        tlb_queue_flush(cpu, &d);
     }
 }
 
@@ -607,35 +770,19 @@ void tlb_flush_page(CPUState *cpu, vaddr addr)
 void tlb_flush_page_by_mmuidx_all_cpus(CPUState *src_cpu, vaddr addr,
                                        uint16_t idxmap)
 {
+    TLBFlushRangeData d = {
+        .len = TARGET_PAGE_SIZE,
+        .idxmap = idxmap,
+        .bits = TARGET_LONG_BITS,
+    };
+
     tlb_debug("addr: %016" VADDR_PRIx " mmu_idx:%"PRIx16"\n", addr, idxmap);
 
     /* This should already be page aligned */
     addr &= TARGET_PAGE_MASK;
 
-    /*
-     * Allocate memory to hold addr+idxmap only when needed.
-     * See tlb_flush_page_by_mmuidx for details.
-     */
-    if (idxmap < TARGET_PAGE_SIZE) {
-        flush_all_helper(src_cpu, tlb_flush_page_by_mmuidx_async_1,
-                         RUN_ON_CPU_TARGET_PTR(addr | idxmap));
-    } else {
-        CPUState *dst_cpu;
-
-        /* Allocate a separate data block for each destination cpu.  */
-        CPU_FOREACH(dst_cpu) {
-            if (dst_cpu != src_cpu) {
-                TLBFlushPageByMMUIdxData *d
-                    = g_new(TLBFlushPageByMMUIdxData, 1);
-
-                d->addr = addr;
-                d->idxmap = idxmap;
-                async_run_on_cpu(dst_cpu, tlb_flush_page_by_mmuidx_async_2,
-                                 RUN_ON_CPU_HOST_PTR(d));
-            }
-        }
-    }
-
+    d.addr = addr;
+    tlb_queue_flush_others(src_cpu, &d);
     tlb_flush_page_by_mmuidx_async_0(src_cpu, addr, idxmap);
 }
 
@@ -648,40 +795,36 @@ void tlb_flush_page_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
                                               vaddr addr,
                                               uint16_t idxmap)
 {
+    TLBFlushRangeData d = {
+        .len = TARGET_PAGE_SIZE,
+        .idxmap = idxmap,
+        .bits = TARGET_LONG_BITS,
+    };
+
     tlb_debug("addr: %016" VADDR_PRIx " mmu_idx:%"PRIx16"\n", addr, idxmap);
 
     /* This should already be page aligned */
     addr &= TARGET_PAGE_MASK;
 
+    d.addr = addr;
+    tlb_queue_flush_others(src_cpu, &d);
+
     /*
      * Allocate memory to hold addr+idxmap only when needed.
-     * See tlb_flush_page_by_mmuidx for details.
+     * Most targets have only a few mmu_idx.  In the case where
+     * we can stuff idxmap into the low TARGET_PAGE_BITS, avoid
+     * allocating memory for this operation.
      */
     if (idxmap < TARGET_PAGE_SIZE) {
-        flush_all_helper(src_cpu, tlb_flush_page_by_mmuidx_async_1,
-                         RUN_ON_CPU_TARGET_PTR(addr | idxmap));
         async_safe_run_on_cpu(src_cpu, tlb_flush_page_by_mmuidx_async_1,
                               RUN_ON_CPU_TARGET_PTR(addr | idxmap));
     } else {
-        CPUState *dst_cpu;
-        TLBFlushPageByMMUIdxData *d;
-
-        /* Allocate a separate data block for each destination cpu.  */
-        CPU_FOREACH(dst_cpu) {
-            if (dst_cpu != src_cpu) {
-                d = g_new(TLBFlushPageByMMUIdxData, 1);
-                d->addr = addr;
-                d->idxmap = idxmap;
-                async_run_on_cpu(dst_cpu, tlb_flush_page_by_mmuidx_async_2,
-                                 RUN_ON_CPU_HOST_PTR(d));
-            }
-        }
+        TLBFlushPageByMMUIdxData *p = g_new(TLBFlushPageByMMUIdxData, 1);
 
-        d = g_new(TLBFlushPageByMMUIdxData, 1);
-        d->addr = addr;
-        d->idxmap = idxmap;
+        p->addr = addr;
+        p->idxmap = idxmap;
         async_safe_run_on_cpu(src_cpu, tlb_flush_page_by_mmuidx_async_2,
-                              RUN_ON_CPU_HOST_PTR(d));
+                              RUN_ON_CPU_HOST_PTR(p));
     }
 }
 
@@ -716,15 +859,8 @@ static void tlb_flush_range_locked(CPUState *cpu, int midx,
         return;
     }
 
-    /*
-     * Check if we need to flush due to large pages.
-     * Because large_page_mask contains all 1's from the msb,
-     * we only need to test the end of the range.
-     */
-    if (((addr + len - 1) & d->large_page_mask) == d->large_page_addr) {
-        tlb_debug("forcing full flush midx %d ("
-                  "%016" VADDR_PRIx "/%016" VADDR_PRIx ")\n",
-                  midx, d->large_page_addr, d->large_page_mask);
+    if (!tlb_flush_large_pages_locked(cpu, midx, addr, addr + len - 1,
+                                      mask)) {
         tlb_flush_one_mmuidx_locked(cpu, midx, get_clock_realtime());
         return;
     }
@@ -740,13 +876,6 @@ static void tlb_flush_range_locked(CPUState *cpu, int midx,
     }
 }
 
-typedef struct {
-    vaddr addr;
-    vaddr len;
-    uint16_t idxmap;
-    uint16_t bits;
-} TLBFlushRangeData;
-
 static void tlb_flush_range_by_mmuidx_async_0(CPUState *cpu,
                                               TLBFlushRangeData d)
 {
@@ -822,10 +951,7 @@ void tlb_flush_range_by_mmuidx(CPUState *cpu, vaddr addr,
     if (qemu_cpu_is_self(cpu)) {
         tlb_flush_range_by_mmuidx_async_0(cpu, d);
     } else {
-        /* Otherwise allocate a structure, freed by the worker.  */
-        TLBFlushRangeData *p = g_memdup(&d, sizeof(d));
-        async_run_on_cpu(cpu, tlb_flush_range_by_mmuidx_async_1,
-                         RUN_ON_CPU_HOST_PTR(p));
+        tlb_queue_flush(cpu, &d);
     }
 }
 
@@ -840,7 +966,6 @@ void tlb_flush_range_by_mmuidx_all_cpus(CPUState *src_cpu,
                                         uint16_t idxmap, unsigned bits)
 {
     TLBFlushRangeData d;
-    CPUState *dst_cpu;
 
     /*
      * If all bits are significant, and len is small,
@@ -862,16 +987,7 @@ void tlb_flush_range_by_mmuidx_all_cpus(CPUState *src_cpu,
     d.idxmap = idxmap;
     d.bits = bits;
 
-    /* Allocate a separate data block for each destination cpu.  */
-    CPU_FOREACH(dst_cpu) {
-        if (dst_cpu != src_cpu) {
-            TLBFlushRangeData *p = g_memdup(&d, sizeof(d));
-            async_run_on_cpu(dst_cpu,
-                             tlb_flush_range_by_mmuidx_async_1,
-                             RUN_ON_CPU_HOST_PTR(p));
-        }
-    }
-
+    tlb_queue_flush_others(src_cpu, &d);
     tlb_flush_range_by_mmuidx_async_0(src_cpu, d);
 }
 
@@ -890,7 +1006,6 @@ void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
                                                unsigned bits)
 {
     TLBFlushRangeData d, *p;
-    CPUState *dst_cpu;
 
     /*
      * If all bits are significant, and len is small,
@@ -912,14 +1027,7 @@ void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
     d.idxmap = idxmap;
     d.bits = bits;
 
-    /* Allocate a separate data block for each destination cpu.  */
-    CPU_FOREACH(dst_cpu) {
-        if (dst_cpu != src_cpu) {
-            p = g_memdup(&d, sizeof(d));
-            async_run_on_cpu(dst_cpu, tlb_flush_range_by_mmuidx_async_1,
-                             RUN_ON_CPU_HOST_PTR(p));
-        }
-    }
+    tlb_queue_flush_others(src_cpu, &d);
 
     p = g_memdup(&d, sizeof(d));
     async_safe_run_on_cpu(src_cpu, tlb_flush_range_by_mmuidx_async_1,
@@ -1060,13 +1168,12 @@ void tlb_set_dirty(CPUState *cpu, vaddr addr)
     qemu_spin_unlock(&cpu->neg.tlb.c.lock);
 }
 
-/* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
-static void tlb_add_large_page(CPUState *cpu, int mmu_idx,
-                               vaddr addr, uint64_t size)
+/* Remember the area covered by large pages that are no longer tracked
+   in ltable, and trigger a full TLB flush if these are invalidated.  */
+static void tlb_add_evicted_large_page(CPUState *cpu, int mmu_idx,
+                                       vaddr addr, vaddr lp_mask)
 {
     vaddr lp_addr = cpu->neg.tlb.d[mmu_idx].large_page_addr;
-    vaddr lp_mask = ~(size - 1);
 
     if (lp_addr == (vaddr)-1) {
         /* No previous large page.  */
@@ -1084,6 +1191,73 @@ static void tlb_add_large_page(CPUState *cpu, int mmu_idx,
     cpu->neg.tlb.d[mmu_idx].large_page_mask = lp_mask;
 }
 
+/*
+ * Our TLB entries map a single page, so keep a table of the large pages
+ * that they were created from.  This allows refilling the other pages of
+ * a large page without a page table walk, and flushing just the pages of
+ * one large page when any of them is invalidated.
+ */
+static void tlb_add_large_page(CPUState *cpu, int mmu_idx, vaddr addr,
+                               uint64_t size, const CPUTLBEntryFull *full)
+{
+    CPUTLBDesc *desc = &cpu->neg.tlb.d[mmu_idx];
+    vaddr lp_mask = ~(size - 1);
+    vaddr lp_addr = addr & lp_mask;
+    CPUTLBLargePage *lp = NULL;
+
+    for (int i = 0; i < CPU_LTLB_SIZE; i++) {
+        if (desc->ltable[i].addr == lp_addr &&
+            desc->ltable[i].mask == lp_mask) {
+            lp = &desc->ltable[i];
+            break;
+        }
+    }
+    if (!lp) {
+        lp = &desc->ltable[desc->lindex++ % CPU_LTLB_SIZE];
+        if (lp->addr != (vaddr)-1) {
+            tlb_add_evicted_large_page(cpu, mmu_idx, lp->addr, lp->mask);
+        }
+    }
+
+    lp->addr = lp_addr;
+    lp->mask = lp_mask;
+    lp->full = *full;
+    lp->full.phys_addr = (full->phys_addr & TARGET_PAGE_MASK) -
+                         ((addr & TARGET_PAGE_MASK) - lp_addr);
+}
+
+/*
+ * Return true if @page belongs to a large page in ltable that allows
+ * @access_type, after refilling the tlb entry of @page from it.
+ */
+static bool large_tlb_hit(CPUState *cpu, size_t mmu_idx,
+                          MMUAccessType access_type, vaddr page)
+{
+    static const int access_prot[] = {
+        [MMU_DATA_LOAD] = PAGE_READ,
+        [MMU_DATA_STORE] = PAGE_WRITE,
+        [MMU_INST_FETCH] = PAGE_EXEC,
+    };
+    CPUTLBDesc *desc = &cpu->neg.tlb.d[mmu_idx];
+
+    for (int i = 0; i < CPU_LTLB_SIZE; i++) {
+        CPUTLBLargePage *lp = &desc->ltable[i];
+        CPUTLBEntryFull full;
+
+        if (lp->addr == (vaddr)-1 || (page & lp->mask) != lp->addr ||
+            !(lp->full.prot & access_prot[access_type]) ||
+            (lp->full.prot & PAGE_WRITE_INV)) {
+            continue;
+        }
+
+        full = lp->full;
+        full.phys_addr += page - lp->addr;
+        tlb_set_page_full(cpu, mmu_idx, page, &full);
+        return true;
+    }
+    return false;
+}
+
 static inline void tlb_set_compare(CPUTLBEntryFull *full, CPUTLBEntry *ent,
                                    vaddr address, int flags,
                                    MMUAccessType access_type, bool enable)
@@ -1130,7 +1304,7 @@ void tlb_set_page_full(CPUState *cpu, int mmu_idx,
         sz = TARGET_PAGE_SIZE;
     } else {
         sz = (hwaddr)1 << full->lg_page_size;
-        tlb_add_large_page(cpu, mmu_idx, addr, sz);
+        tlb_add_large_page(cpu, mmu_idx, addr, sz, full);
     }
     addr_page = addr & TARGET_PAGE_MASK;
     paddr_page = full->phys_addr & TARGET_PAGE_MASK;
@@ -1354,14 +1528,15 @@ static void io_failed(CPUState *cpu, CPUTLBEntryFull *full, vaddr addr,
     }
 }
 
-/* Return true if ADDR is present in the victim tlb, and has been copied
-   back to the main tlb.  */
+/* Return true if ADDR is present in the victim tlb or in a large page
+   of the large page table, and has been copied back to the main tlb.  */
 static bool victim_tlb_hit(CPUState *cpu, size_t mmu_idx, size_t index,
                            MMUAccessType access_type, vaddr page)
 {
     size_t vidx;
 
     assert_cpu_is_self(cpu);
+    qatomic_set(&cpu->neg.tlb.c.miss_count, cpu->neg.tlb.c.miss_count + 1);
     for (vidx = 0; vidx < CPU_VTLB_SIZE; ++vidx) {
         CPUTLBEntry *vtlb = &cpu->neg.tlb.d[mmu_idx].vtable[vidx];
         uint64_t cmp = tlb_read_idx(vtlb, access_type);
@@ -1383,6 +1558,10 @@ static bool victim_tlb_hit(CPUState *cpu, size_t mmu_idx, size_t index,
             return true;
         }
     }
+    if (large_tlb_hit(cpu, mmu_idx, access_type, page)) {
+        return true;
+    }
+    qatomic_set(&cpu->neg.tlb.c.fill_count, cpu->neg.tlb.c.fill_count + 1);
     return false;
 }
 
@@ -9,11 +9,35 @@
 #ifndef ACCEL_TCG_INTERNAL_COMMON_H
 #define ACCEL_TCG_INTERNAL_COMMON_H
 
+#include "qemu/thread.h"
 #include "exec/translation-block.h"
 
 extern int64_t max_delay;
 extern int64_t max_advance;
 
+/*
+ * Per-vCPU execution statistics for query-stats.  The counters are only
+ * written by the vCPU thread and read atomically by the monitor.
+ */
+struct CPUTCGStats {
+    size_t exits_requested;
+    size_t exceptions;
+    size_t interrupts;
+    /* Set by the profiling timer, the next requested exit takes a sample */
+    bool sample;
+    size_t nr_samples;
+    QemuMutex lock;
+    /* TBSample by guest pc, protected by lock */
+    GHashTable *samples;
+};
+
+typedef struct TBSample {
+    uint64_t pc;
+    uint64_t count;
+} TBSample;
+
+void tcg_stats_init(uint32_t profile_interval_ms);
+
 /*
  * Return true if CS is not running in parallel with other cpus, either
  * because there are no other cpus or we are within an exclusive context.
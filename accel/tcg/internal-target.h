@@ -43,23 +43,48 @@ void page_table_config_init(void);
  * account for other TBs on the same page, defer undoing any page protection
  * until we receive the write fault.
  */
-static inline void tb_lock_page0(tb_page_addr_t p0)
+static inline void tb_watch_page0(tb_page_addr_t p0)
 {
     page_protect(p0);
 }
 
-static inline void tb_lock_page1(tb_page_addr_t p0, tb_page_addr_t p1)
+static inline void tb_watch_page1(tb_page_addr_t p0, tb_page_addr_t p1)
 {
     page_protect(p1);
 }
 
-static inline void tb_unlock_page1(tb_page_addr_t p0, tb_page_addr_t p1) { }
-static inline void tb_unlock_pages(TranslationBlock *tb) { }
+static inline const unsigned int *tb_smc_gen_ptr(tb_page_addr_t p0,
+                                                 unsigned int *gen)
+{
+    return NULL;
+}
+
+static inline bool tb_smc_pending(void)
+{
+    return false;
+}
+
+static inline void tb_smc_flush(void) { }
 #else
-void tb_lock_page0(tb_page_addr_t);
-void tb_lock_page1(tb_page_addr_t, tb_page_addr_t);
-void tb_unlock_page1(tb_page_addr_t, tb_page_addr_t);
-void tb_unlock_pages(TranslationBlock *);
+/*
+ * For system mode, no page lock is held while translating, so that vCPUs
+ * can translate code of the same pages in parallel.  Instead, the pages'
+ * invalidation generations are noted here, and tb_link_page() refuses the
+ * TB if any of its pages was invalidated in the meantime.
+ */
+void tb_watch_page0(tb_page_addr_t);
+void tb_watch_page1(tb_page_addr_t, tb_page_addr_t);
+
+/*
+ * With tb_smc_batch, a guest write to a page that already had code
+ * written to it does not invalidate TBs.  It only bumps the generation
+ * of the page, and queues the page for tb_smc_flush().  TBs starting on
+ * such a page compare the generation returned by tb_smc_gen_ptr() with
+ * @gen on entry, and leave to the main loop if it changed.
+ */
+const unsigned int *tb_smc_gen_ptr(tb_page_addr_t p0, unsigned int *gen);
+bool tb_smc_pending(void);
+void tb_smc_flush(void);
 #endif
 
 #ifdef CONFIG_SOFTMMU
@@ -80,6 +105,28 @@ bool tb_invalidate_phys_page_unwind(tb_page_addr_t addr, uintptr_t pc);
 void cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
                                uintptr_t host_pc);
 
+/* A translation block saved in the persistent TB cache, see tb-cache.c */
+typedef struct TBCacheEntry {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t size;
+    uint32_t hash;
+} TBCacheEntry;
+
+extern bool tb_cache_enabled;
+
+void tb_cache_init(const char *path);
+uint32_t tb_cache_code_hash(const void *host, uint32_t size);
+void tb_cache_record(CPUState *cpu, TranslationBlock *tb, vaddr pc);
+/*
+ * Return the entries saved for the guest page containing @pc, only the
+ * first time the page is asked for.
+ */
+const TBCacheEntry *tb_cache_take_page(CPUState *cpu, vaddr pc,
+                                       unsigned int *nr);
+
 bool tcg_exec_realizefn(CPUState *cpu, Error **errp);
 void tcg_exec_unrealizefn(CPUState *cpu);
 
@@ -94,6 +141,8 @@ static inline vaddr log_pc(CPUState *cpu, const TranslationBlock *tb)
 }
 
 extern bool one_insn_per_tb;
+extern unsigned int tcg_tier_threshold;
+extern bool tb_smc_batch;
 
 /**
  * tcg_req_mo:
@@ -9,12 +9,14 @@
 #include "qemu/osdep.h"
 #include "qemu/accel.h"
 #include "qemu/qht.h"
+#include "qemu/timer.h"
 #include "qapi/error.h"
 #include "qapi/type-helpers.h"
 #include "qapi/qapi-commands-machine.h"
 #include "monitor/monitor.h"
 #include "sysemu/cpus.h"
 #include "sysemu/cpu-timers.h"
+#include "sysemu/stats.h"
 #include "sysemu/tcg.h"
 #include "tcg/tcg.h"
 #include "internal-common.h"
@@ -242,3 +244,239 @@ static void hmp_tcg_register(void)
 }
 
 type_init(hmp_tcg_register);
+
+/* Number of entries in hot-tb-pcs and hot-tb-samples */
+#define TCG_STATS_HOT_TBS 16
+
+typedef struct TCGStatsDesc {
+    const char *name;
+    StatsType type;
+    bool bytes;
+} TCGStatsDesc;
+
+static const TCGStatsDesc tcg_vm_stats[] = {
+    { "tbs", STATS_TYPE_INSTANT },
+    { "code-size", STATS_TYPE_INSTANT, true },
+    { "tb-flushes", STATS_TYPE_CUMULATIVE },
+    { "tb-invalidations", STATS_TYPE_CUMULATIVE },
+    { "hot-tb-pcs", STATS_TYPE_INSTANT },
+    { "hot-tb-samples", STATS_TYPE_CUMULATIVE },
+};
+
+static const TCGStatsDesc tcg_vcpu_stats[] = {
+    { "tlb-misses", STATS_TYPE_CUMULATIVE },
+    { "tlb-fills", STATS_TYPE_CUMULATIVE },
+    { "tlb-full-flushes", STATS_TYPE_CUMULATIVE },
+    { "tlb-partial-flushes", STATS_TYPE_CUMULATIVE },
+    { "exits-requested", STATS_TYPE_CUMULATIVE },
+    { "exceptions", STATS_TYPE_CUMULATIVE },
+    { "interrupts", STATS_TYPE_CUMULATIVE },
+    { "samples", STATS_TYPE_CUMULATIVE },
+};
+
+static QEMUTimer *tcg_profile_timer;
+static uint32_t tcg_profile_interval;
+
+/*
+ * Ask every running vCPU to leave its TB chain; the TB at which it stops
+ * is recorded by tb_profile_sample().  Sampling costs one exit to the
+ * vCPU loop per vCPU and interval.
+ */
+static void tcg_profile_tick(void *opaque)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (!qatomic_read(&cpu->halted)) {
+            qatomic_set(&cpu->tcg_stats->sample, true);
+            cpu_exit(cpu);
+        }
+    }
+    timer_mod(tcg_profile_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + tcg_profile_interval);
+}
+
+static StatsList *tcg_stats_add(StatsList *list, strList *names,
+                                const char *name, uint64_t value)
+{
+    Stats *stats;
+
+    if (!apply_str_list_filter(name, names)) {
+        return list;
+    }
+    stats = g_new0(Stats, 1);
+    stats->name = g_strdup(name);
+    stats->value = g_new0(StatsValue, 1);
+    stats->value->type = QTYPE_QNUM;
+    stats->value->u.scalar = value;
+    QAPI_LIST_PREPEND(list, stats);
+    return list;
+}
+
+static StatsList *tcg_stats_add_list(StatsList *list, strList *names,
+                                     const char *name, uint64List *values)
+{
+    Stats *stats;
+
+    if (!apply_str_list_filter(name, names)) {
+        qapi_free_uint64List(values);
+        return list;
+    }
+    stats = g_new0(Stats, 1);
+    stats->name = g_strdup(name);
+    stats->value = g_new0(StatsValue, 1);
+    stats->value->type = QTYPE_QLIST;
+    stats->value->u.list = values;
+    QAPI_LIST_PREPEND(list, stats);
+    return list;
+}
+
+static gint tb_sample_cmp(gconstpointer a, gconstpointer b)
+{
+    const TBSample *sa = *(const TBSample **)a;
+    const TBSample *sb = *(const TBSample **)b;
+
+    return sa->count < sb->count ? 1 : sa->count > sb->count ? -1 : 0;
+}
+
+/* Merge the samples of all vCPUs, hottest first */
+static StatsList *tcg_stats_add_hot_tbs(StatsList *list, strList *names)
+{
+    g_autoptr(GHashTable) merged = g_hash_table_new_full(g_int64_hash,
+                                                         g_int64_equal,
+                                                         NULL, g_free);
+    g_autoptr(GPtrArray) sorted = g_ptr_array_new();
+    uint64List *pcs = NULL, *counts = NULL;
+    GHashTableIter iter;
+    TBSample *s, *m;
+    CPUState *cpu;
+    int i;
+
+    CPU_FOREACH(cpu) {
+        CPUTCGStats *stats = cpu->tcg_stats;
+
+        qemu_mutex_lock(&stats->lock);
+        g_hash_table_iter_init(&iter, stats->samples);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&s)) {
+            m = g_hash_table_lookup(merged, &s->pc);
+            if (!m) {
+                m = g_new0(TBSample, 1);
+                m->pc = s->pc;
+                g_hash_table_insert(merged, &m->pc, m);
+            }
+            m->count += s->count;
+        }
+        qemu_mutex_unlock(&stats->lock);
+    }
+
+    g_hash_table_iter_init(&iter, merged);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&m)) {
+        g_ptr_array_add(sorted, m);
+    }
+    g_ptr_array_sort(sorted, tb_sample_cmp);
+
+    for (i = MIN(sorted->len, TCG_STATS_HOT_TBS) - 1; i >= 0; i--) {
+        m = g_ptr_array_index(sorted, i);
+        QAPI_LIST_PREPEND(pcs, m->pc);
+        QAPI_LIST_PREPEND(counts, m->count);
+    }
+    list = tcg_stats_add_list(list, names, "hot-tb-samples", counts);
+    return tcg_stats_add_list(list, names, "hot-tb-pcs", pcs);
+}
+
+static void tcg_query_stats_cb(StatsResultList **result, StatsTarget target,
+                               strList *names, strList *targets,
+                               Error **errp)
+{
+    StatsList *list = NULL;
+    CPUState *cpu;
+
+    switch (target) {
+    case STATS_TARGET_VM:
+        list = tcg_stats_add_hot_tbs(list, names);
+        list = tcg_stats_add(list, names, "tb-invalidations",
+                             qatomic_read(&tb_ctx.tb_phys_invalidate_count));
+        list = tcg_stats_add(list, names, "tb-flushes",
+                             qatomic_read(&tb_ctx.tb_flush_count));
+        list = tcg_stats_add(list, names, "code-size", tcg_code_size());
+        list = tcg_stats_add(list, names, "tbs", tcg_nb_tbs());
+        add_stats_entry(result, STATS_PROVIDER_TCG, NULL, list);
+        break;
+    case STATS_TARGET_VCPU:
+        CPU_FOREACH(cpu) {
+            CPUTCGStats *s = cpu->tcg_stats;
+
+            if (!apply_str_list_filter(cpu->parent_obj.canonical_path,
+                                       targets)) {
+                continue;
+            }
+            list = NULL;
+            list = tcg_stats_add(list, names, "samples",
+                                 qatomic_read(&s->nr_samples));
+            list = tcg_stats_add(list, names, "interrupts",
+                                 qatomic_read(&s->interrupts));
+            list = tcg_stats_add(list, names, "exceptions",
+                                 qatomic_read(&s->exceptions));
+            list = tcg_stats_add(list, names, "exits-requested",
+                                 qatomic_read(&s->exits_requested));
+            list = tcg_stats_add(list, names, "tlb-partial-flushes",
+                qatomic_read(&cpu->neg.tlb.c.part_flush_count));
+            list = tcg_stats_add(list, names, "tlb-full-flushes",
+                qatomic_read(&cpu->neg.tlb.c.full_flush_count));
+            list = tcg_stats_add(list, names, "tlb-fills",
+                                 qatomic_read(&cpu->neg.tlb.c.fill_count));
+            list = tcg_stats_add(list, names, "tlb-misses",
+                                 qatomic_read(&cpu->neg.tlb.c.miss_count));
+            add_stats_entry(result, STATS_PROVIDER_TCG,
+                            cpu->parent_obj.canonical_path, list);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static StatsSchemaValueList *tcg_stats_schema(const TCGStatsDesc *desc,
+                                              size_t n)
+{
+    StatsSchemaValueList *list = NULL;
+    StatsSchemaValue *value;
+
+    while (n--) {
+        value = g_new0(StatsSchemaValue, 1);
+        value->name = g_strdup(desc[n].name);
+        value->type = desc[n].type;
+        if (desc[n].bytes) {
+            value->has_unit = true;
+            value->unit = STATS_UNIT_BYTES;
+        }
+        QAPI_LIST_PREPEND(list, value);
+    }
+    return list;
+}
+
+static void tcg_query_stats_schemas_cb(StatsSchemaList **result,
+                                       Error **errp)
+{
+    add_stats_schema(result, STATS_PROVIDER_TCG, STATS_TARGET_VM,
+                     tcg_stats_schema(tcg_vm_stats,
+                                      ARRAY_SIZE(tcg_vm_stats)));
+    add_stats_schema(result, STATS_PROVIDER_TCG, STATS_TARGET_VCPU,
+                     tcg_stats_schema(tcg_vcpu_stats,
+                                      ARRAY_SIZE(tcg_vcpu_stats)));
+}
+
+void tcg_stats_init(uint32_t profile_interval_ms)
+{
+    add_stats_callbacks(STATS_PROVIDER_TCG, tcg_query_stats_cb,
+                        tcg_query_stats_schemas_cb);
+
+    if (profile_interval_ms) {
+        tcg_profile_interval = profile_interval_ms;
+        tcg_profile_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL,
+                                         tcg_profile_tick, NULL);
+        timer_mod(tcg_profile_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                  tcg_profile_interval);
+    }
+}
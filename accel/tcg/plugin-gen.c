@@ -62,6 +62,7 @@
  * 0: enum plugin_gen_from
  * 1: enum plugin_gen_cb
  * 2: set to 1 for mem callback that is a write, 0 otherwise.
+ * 3: for mem callbacks, the TCGTemp holding the guest address.
  */
 
 enum plugin_gen_from {
@@ -122,8 +123,8 @@ static void gen_empty_udata_cb_no_rwg(void)
 }
 
 /*
- * For now we only support addi_i64.
- * When we support more ops, we can generate one empty inline cb for each.
+ * The add_i64 is turned into a store by copy_set_i64() for
+ * QEMU_PLUGIN_INLINE_STORE_U64.
  */
 static void gen_empty_inline_cb(void)
 {
@@ -184,15 +185,16 @@ static void gen_empty_mem_helper(void)
 }
 
 static void gen_plugin_cb_start(enum plugin_gen_from from,
-                                enum plugin_gen_cb type, unsigned wr)
+                                enum plugin_gen_cb type, unsigned wr,
+                                TCGv_i64 addr)
 {
-    tcg_gen_plugin_cb_start(from, type, wr);
+    tcg_gen_plugin_cb_start(from, type, wr, addr);
 }
 
 static void gen_wrapped(enum plugin_gen_from from,
                         enum plugin_gen_cb type, void (*func)(void))
 {
-    gen_plugin_cb_start(from, type, 0);
+    gen_plugin_cb_start(from, type, 0, NULL);
     func();
     tcg_gen_plugin_cb_end();
 }
@@ -226,11 +228,11 @@ void plugin_gen_empty_mem_callback(TCGv_i64 addr, uint32_t info)
 {
     enum qemu_plugin_mem_rw rw = get_plugin_meminfo_rw(info);
 
-    gen_plugin_cb_start(PLUGIN_GEN_FROM_MEM, PLUGIN_GEN_CB_MEM, rw);
+    gen_plugin_cb_start(PLUGIN_GEN_FROM_MEM, PLUGIN_GEN_CB_MEM, rw, NULL);
     gen_empty_mem_cb(addr, info);
     tcg_gen_plugin_cb_end();
 
-    gen_plugin_cb_start(PLUGIN_GEN_FROM_MEM, PLUGIN_GEN_CB_INLINE, rw);
+    gen_plugin_cb_start(PLUGIN_GEN_FROM_MEM, PLUGIN_GEN_CB_INLINE, rw, addr);
     gen_empty_inline_cb();
     tcg_gen_plugin_cb_end();
 }
@@ -362,6 +364,19 @@ static TCGOp *copy_add_i64(TCGOp **begin_op, TCGOp *op, uint64_t v)
     return op;
 }
 
+/* Like copy_add_i64(), with the loaded value replaced by 0 */
+static TCGOp *copy_set_i64(TCGOp **begin_op, TCGOp *op, uint64_t v)
+{
+    op = copy_add_i64(begin_op, op, v);
+    if (TCG_TARGET_REG_BITS == 32) {
+        op->args[2] = tcgv_i32_arg(tcg_constant_i32(0));
+        op->args[3] = tcgv_i32_arg(tcg_constant_i32(0));
+    } else {
+        op->args[1] = tcgv_i64_arg(tcg_constant_i64(0));
+    }
+    return op;
+}
+
 static TCGOp *copy_mul_i32(TCGOp **begin_op, TCGOp *op, uint32_t v)
 {
     op = copy_op(begin_op, op, INDEX_op_mul_i32);
@@ -445,7 +460,16 @@ static TCGOp *append_inline_cb(const struct qemu_plugin_dyn_cb *cb,
     op = copy_const_ptr(&begin_op, op, ptr + offset);
     op = copy_add_ptr(&begin_op, op);
     op = copy_ld_i64(&begin_op, op);
-    op = copy_add_i64(&begin_op, op, cb->inline_insn.imm);
+    switch (cb->inline_insn.op) {
+    case QEMU_PLUGIN_INLINE_ADD_U64:
+        op = copy_add_i64(&begin_op, op, cb->inline_insn.imm);
+        break;
+    case QEMU_PLUGIN_INLINE_STORE_U64:
+        op = copy_set_i64(&begin_op, op, cb->inline_insn.imm);
+        break;
+    default:
+        g_assert_not_reached();
+    }
     op = copy_st_i64(&begin_op, op);
     return op;
 }
@@ -479,6 +503,187 @@ static TCGOp *append_mem_cb(const struct qemu_plugin_dyn_cb *cb,
     return op;
 }
 
+/*
+ * Conditional callbacks and the recording of memory addresses need
+ * control flow.  Branches and labels cannot be copied from an empty
+ * callback like the ops above, so these are generated in place instead,
+ * right after the empty inline callback they are attached to.  They thus
+ * run after the inline ops of the same instruction or TB.
+ */
+static void gen_start_after_empty_cb(TCGOp *begin_op)
+{
+    TCGOp *end_op = find_op(begin_op, INDEX_op_plugin_cb_end);
+
+    tcg_debug_assert(end_op);
+    tcg_ctx->emit_before_op = QTAILQ_NEXT(end_op, link);
+}
+
+static void gen_end_after_empty_cb(void)
+{
+    tcg_ctx->emit_before_op = NULL;
+}
+
+static TCGOp *gen_last_op(void)
+{
+    if (tcg_ctx->emit_before_op) {
+        return QTAILQ_PREV(tcg_ctx->emit_before_op, link);
+    }
+    return QTAILQ_LAST(&tcg_ctx->ops);
+}
+
+/* Return a pointer to the vCPU's element of @entry */
+static TCGv_ptr gen_plugin_u64_ptr(qemu_plugin_u64 entry)
+{
+    TCGv_ptr ptr = tcg_temp_ebb_new_ptr();
+    TCGv_i32 cpu_index = tcg_temp_ebb_new_i32();
+    GArray *arr = entry.score->data;
+
+    tcg_gen_ld_i32(cpu_index, tcg_env,
+                   -offsetof(ArchCPU, env) + offsetof(CPUState, cpu_index));
+    tcg_gen_muli_i32(cpu_index, cpu_index, g_array_get_element_size(arr));
+    tcg_gen_ext_i32_ptr(ptr, cpu_index);
+    tcg_temp_free_i32(cpu_index);
+    tcg_gen_addi_ptr(ptr, ptr, (intptr_t)(arr->data + entry.offset));
+    return ptr;
+}
+
+static void gen_udata_cb(qemu_plugin_vcpu_udata_cb_t func, void *userp,
+                         bool read_regs)
+{
+    TCGv_i32 cpu_index = tcg_temp_ebb_new_i32();
+    TCGOp *op;
+
+    tcg_gen_ld_i32(cpu_index, tcg_env,
+                   -offsetof(ArchCPU, env) + offsetof(CPUState, cpu_index));
+    if (read_regs) {
+        gen_helper_plugin_vcpu_udata_cb_no_wg(cpu_index,
+                                              tcg_constant_ptr(userp));
+    } else {
+        gen_helper_plugin_vcpu_udata_cb_no_rwg(cpu_index,
+                                               tcg_constant_ptr(userp));
+    }
+    tcg_temp_free_i32(cpu_index);
+
+    /* as in copy_call(), replace the empty helper with the plugin's */
+    op = gen_last_op();
+    tcg_debug_assert(op->opc == INDEX_op_call);
+    op->args[TCGOP_CALLO(op) + TCGOP_CALLI(op)] = (uintptr_t)func;
+}
+
+static TCGCond plugin_cond_to_tcgcond(enum qemu_plugin_cond cond)
+{
+    switch (cond) {
+    case QEMU_PLUGIN_COND_EQ:
+        return TCG_COND_EQ;
+    case QEMU_PLUGIN_COND_NE:
+        return TCG_COND_NE;
+    case QEMU_PLUGIN_COND_LT:
+        return TCG_COND_LTU;
+    case QEMU_PLUGIN_COND_LE:
+        return TCG_COND_LEU;
+    case QEMU_PLUGIN_COND_GT:
+        return TCG_COND_GTU;
+    case QEMU_PLUGIN_COND_GE:
+        return TCG_COND_GEU;
+    default:
+        /* NEVER and ALWAYS are handled at registration */
+        g_assert_not_reached();
+    }
+}
+
+static void gen_cond_cb(const struct qemu_plugin_dyn_cb *cb)
+{
+    TCGLabel *after_cb = gen_new_label();
+    TCGv_ptr ptr = gen_plugin_u64_ptr(cb->cond.entry);
+    TCGv_i64 val = tcg_temp_ebb_new_i64();
+
+    tcg_gen_ld_i64(val, ptr, 0);
+    tcg_gen_brcondi_i64(tcg_invert_cond(plugin_cond_to_tcgcond(cb->cond.cond)),
+                        val, cb->cond.imm, after_cb);
+    tcg_temp_free_i64(val);
+    tcg_temp_free_ptr(ptr);
+    gen_udata_cb(cb->f.vcpu_udata, cb->userp, cb->cond.read_regs);
+    gen_set_label(after_cb);
+}
+
+static void gen_cond_cbs(const GArray *cbs)
+{
+    int i;
+
+    for (i = 0; i < cbs->len; i++) {
+        gen_cond_cb(&g_array_index(cbs, struct qemu_plugin_dyn_cb, i));
+    }
+}
+
+/*
+ * A memory access appends its address to the buffer without branching,
+ * since labels would end the extended basic block in the middle of the
+ * guest instruction.  Instead, the buffer is flushed at the start of the
+ * instruction if its @n_accesses might not fit.
+ */
+static void gen_mem_record_flush(const struct qemu_plugin_dyn_cb *cb,
+                                 unsigned n_accesses)
+{
+    TCGLabel *after_cb;
+    TCGv_ptr ptr;
+    TCGv_i64 count;
+
+    if (n_accesses == 0) {
+        return;
+    }
+    /* the buffer must be able to hold all accesses of one instruction */
+    g_assert(n_accesses <= cb->record.size);
+
+    after_cb = gen_new_label();
+    ptr = gen_plugin_u64_ptr(cb->record.entry);
+    count = tcg_temp_ebb_new_i64();
+    tcg_gen_ld_i64(count, ptr, 0);
+    tcg_gen_brcondi_i64(TCG_COND_LEU, count,
+                        cb->record.size - n_accesses, after_cb);
+    tcg_temp_free_i64(count);
+    tcg_temp_free_ptr(ptr);
+    gen_udata_cb(cb->f.vcpu_udata, cb->userp, false);
+    gen_set_label(after_cb);
+}
+
+static void gen_mem_record(const struct qemu_plugin_dyn_cb *cb, TCGv_i64 addr)
+{
+    TCGv_ptr ptr = gen_plugin_u64_ptr(cb->record.entry);
+    TCGv_ptr slot = tcg_temp_ebb_new_ptr();
+    TCGv_i64 count = tcg_temp_ebb_new_i64();
+    TCGv_i64 offset = tcg_temp_ebb_new_i64();
+
+    /* the buffer follows the count */
+    tcg_gen_ld_i64(count, ptr, 0);
+    tcg_gen_shli_i64(offset, count, 3);
+    tcg_gen_trunc_i64_ptr(slot, offset);
+    tcg_gen_add_ptr(slot, slot, ptr);
+    tcg_gen_st_i64(addr, slot, sizeof(uint64_t));
+    tcg_gen_addi_i64(count, count, 1);
+    tcg_gen_st_i64(count, ptr, 0);
+
+    tcg_temp_free_i64(offset);
+    tcg_temp_free_i64(count);
+    tcg_temp_free_ptr(slot);
+    tcg_temp_free_ptr(ptr);
+}
+
+/* Count the memory accesses that follow @op in its guest instruction */
+static unsigned count_mem_cbs(const TCGOp *op)
+{
+    unsigned n = 0;
+
+    for (op = QTAILQ_NEXT(op, link); op && op->opc != INDEX_op_insn_start;
+         op = QTAILQ_NEXT(op, link)) {
+        if (op->opc == INDEX_op_plugin_cb_start &&
+            op->args[0] == PLUGIN_GEN_FROM_MEM &&
+            op->args[1] == PLUGIN_GEN_CB_MEM) {
+            n++;
+        }
+    }
+    return n;
+}
+
 typedef TCGOp *(*inject_fn)(const struct qemu_plugin_dyn_cb *cb,
                             TCGOp *begin_op, TCGOp *op, int *intp);
 typedef bool (*op_ok_fn)(const TCGOp *op, const struct qemu_plugin_dyn_cb *cb);
@@ -578,12 +783,13 @@ static void inject_mem_enable_helper(struct qemu_plugin_tb *ptb,
                                      struct qemu_plugin_insn *plugin_insn,
                                      TCGOp *begin_op)
 {
-    GArray *cbs[2];
+    GArray *cbs[3];
     GArray *arr;
     size_t n_cbs, i;
 
     cbs[0] = plugin_insn->cbs[PLUGIN_CB_MEM][PLUGIN_CB_REGULAR];
     cbs[1] = plugin_insn->cbs[PLUGIN_CB_MEM][PLUGIN_CB_INLINE];
+    cbs[2] = plugin_insn->cbs[PLUGIN_CB_MEM][PLUGIN_CB_MEM_RECORD];
 
     n_cbs = 0;
     for (i = 0; i < ARRAY_SIZE(cbs); i++) {
@@ -652,6 +858,11 @@ static void plugin_gen_tb_udata_r(const struct qemu_plugin_tb *ptb,
 static void plugin_gen_tb_inline(const struct qemu_plugin_tb *ptb,
                                  TCGOp *begin_op)
 {
+    if (ptb->cbs[PLUGIN_CB_COND] && ptb->cbs[PLUGIN_CB_COND]->len) {
+        gen_start_after_empty_cb(begin_op);
+        gen_cond_cbs(ptb->cbs[PLUGIN_CB_COND]);
+        gen_end_after_empty_cb();
+    }
     inject_inline_cb(ptb->cbs[PLUGIN_CB_INLINE], begin_op, op_ok);
 }
 
@@ -675,6 +886,22 @@ static void plugin_gen_insn_inline(const struct qemu_plugin_tb *ptb,
                                    TCGOp *begin_op, int insn_idx)
 {
     struct qemu_plugin_insn *insn = g_ptr_array_index(ptb->insns, insn_idx);
+    GArray *records = insn->cbs[PLUGIN_CB_MEM][PLUGIN_CB_MEM_RECORD];
+    int i;
+
+    gen_start_after_empty_cb(begin_op);
+    gen_cond_cbs(insn->cbs[PLUGIN_CB_INSN][PLUGIN_CB_COND]);
+    if (records->len) {
+        unsigned n_accesses = count_mem_cbs(begin_op);
+
+        for (i = 0; i < records->len; i++) {
+            gen_mem_record_flush(&g_array_index(records,
+                                                struct qemu_plugin_dyn_cb, i),
+                                 n_accesses);
+        }
+    }
+    gen_end_after_empty_cb();
+
     inject_inline_cb(insn->cbs[PLUGIN_CB_INSN][PLUGIN_CB_INLINE],
                      begin_op, op_ok);
 }
@@ -692,6 +919,21 @@ static void plugin_gen_mem_inline(const struct qemu_plugin_tb *ptb,
     const GArray *cbs;
     struct qemu_plugin_insn *insn = g_ptr_array_index(ptb->insns, insn_idx);
 
+    const GArray *records = insn->cbs[PLUGIN_CB_MEM][PLUGIN_CB_MEM_RECORD];
+    TCGv_i64 addr = temp_tcgv_i64(arg_temp(begin_op->args[3]));
+    int i;
+
+    gen_start_after_empty_cb(begin_op);
+    for (i = 0; i < records->len; i++) {
+        const struct qemu_plugin_dyn_cb *cb =
+            &g_array_index(records, struct qemu_plugin_dyn_cb, i);
+
+        if (op_rw(begin_op, cb)) {
+            gen_mem_record(cb, addr);
+        }
+    }
+    gen_end_after_empty_cb();
+
     cbs = insn->cbs[PLUGIN_CB_MEM][PLUGIN_CB_INLINE];
     inject_inline_cb(cbs, begin_op, op_rw);
 }
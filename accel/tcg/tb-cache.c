@@ -0,0 +1,249 @@
+/*
+ * Persistent translation block cache
+ *
+ * Remembers which translation blocks a run needed, keyed by their lookup
+ * key plus a checksum of the guest code, so that the next run of the same
+ * binary can translate a whole guest page worth of blocks as soon as the
+ * first one on that page is needed, instead of leaving and re-entering
+ * the execution loop for every block during warm-up.
+ *
+ * Host code itself is not saved: it embeds absolute addresses of helpers,
+ * of the TranslationBlock and of CPUArchState fields that change with
+ * every run.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/crc32c.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qom/object.h"
+#include "hw/core/cpu.h"
+#include "exec/cpu-all.h"
+#include "internal-target.h"
+
+#define TB_CACHE_MAGIC      "QEMUTBC1"
+#define TB_CACHE_ENDIAN     0x01020304u
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t endian;
+    uint32_t page_bits;
+    char version[32];
+    char target[16];
+    char cpu_type[64];
+    uint64_t nr_entries;
+} TBCacheHeader;
+
+typedef struct TBCachePage {
+    bool taken;
+    GArray *entries;
+} TBCachePage;
+
+bool tb_cache_enabled;
+
+static QemuMutex tb_cache_lock;
+static char *tb_cache_path;
+static char tb_cache_cpu_type[64];
+static bool tb_cache_cpu_checked;
+/* All known entries, written back at exit */
+static GHashTable *tb_cache_entries;
+/* Entries loaded from the file and not translated yet, by guest page */
+static GHashTable *tb_cache_pages;
+
+static guint tb_cache_entry_hash(gconstpointer key)
+{
+    const TBCacheEntry *e = key;
+
+    return e->pc ^ (e->pc >> 32) ^ e->flags ^ e->cs_base;
+}
+
+static gboolean tb_cache_entry_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, sizeof(TBCacheEntry)) == 0;
+}
+
+static void tb_cache_page_free(gpointer data)
+{
+    TBCachePage *p = data;
+
+    g_array_free(p->entries, true);
+    g_free(p);
+}
+
+uint32_t tb_cache_code_hash(const void *host, uint32_t size)
+{
+    return crc32c(0xffffffff, host, size);
+}
+
+static void tb_cache_header_init(TBCacheHeader *h, const char *cpu_type)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, TB_CACHE_MAGIC, sizeof(h->magic));
+    h->endian = TB_CACHE_ENDIAN;
+    h->page_bits = TARGET_PAGE_BITS;
+    pstrcpy(h->version, sizeof(h->version), QEMU_VERSION);
+    pstrcpy(h->target, sizeof(h->target), TARGET_NAME);
+    pstrcpy(h->cpu_type, sizeof(h->cpu_type), cpu_type);
+}
+
+static void tb_cache_load(void)
+{
+    g_autofree char *buf = NULL;
+    TBCacheHeader expected, *h;
+    const TBCacheEntry *e;
+    gsize len;
+    uint64_t i;
+
+    if (!g_file_get_contents(tb_cache_path, &buf, &len, NULL)) {
+        /* First run */
+        return;
+    }
+
+    h = (TBCacheHeader *)buf;
+    tb_cache_header_init(&expected, "");
+    if (len < sizeof(*h) ||
+        memcmp(h->magic, expected.magic, sizeof(h->magic)) ||
+        h->endian != expected.endian ||
+        h->page_bits != expected.page_bits ||
+        strncmp(h->version, expected.version, sizeof(h->version)) ||
+        strncmp(h->target, expected.target, sizeof(h->target)) ||
+        h->nr_entries > (len - sizeof(*h)) / sizeof(*e)) {
+        warn_report("TB cache '%s' does not match this QEMU binary, "
+                    "it will be rebuilt", tb_cache_path);
+        return;
+    }
+    pstrcpy(tb_cache_cpu_type, sizeof(tb_cache_cpu_type), h->cpu_type);
+
+    e = (const TBCacheEntry *)(h + 1);
+    for (i = 0; i < h->nr_entries; i++, e++) {
+        gpointer page = GUINT_TO_POINTER(e->pc & TARGET_PAGE_MASK);
+        TBCachePage *p = g_hash_table_lookup(tb_cache_pages, page);
+
+        if (!g_hash_table_add(tb_cache_entries, g_memdup2(e, sizeof(*e)))) {
+            continue;
+        }
+        if (!p) {
+            p = g_new0(TBCachePage, 1);
+            p->entries = g_array_new(false, false, sizeof(TBCacheEntry));
+            g_hash_table_insert(tb_cache_pages, page, p);
+        }
+        g_array_append_val(p->entries, *e);
+    }
+}
+
+static void tb_cache_save(void)
+{
+    g_autoptr(GByteArray) buf = g_byte_array_new();
+    g_autoptr(GError) err = NULL;
+    GHashTableIter iter;
+    const char *cpu_type = tb_cache_cpu_type;
+    TBCacheHeader h;
+    gpointer e;
+
+    if (first_cpu) {
+        cpu_type = object_get_typename(OBJECT(first_cpu));
+    }
+
+    qemu_mutex_lock(&tb_cache_lock);
+    tb_cache_header_init(&h, cpu_type);
+    h.nr_entries = g_hash_table_size(tb_cache_entries);
+    g_byte_array_append(buf, (guint8 *)&h, sizeof(h));
+    g_hash_table_iter_init(&iter, tb_cache_entries);
+    while (g_hash_table_iter_next(&iter, &e, NULL)) {
+        g_byte_array_append(buf, e, sizeof(TBCacheEntry));
+    }
+    qemu_mutex_unlock(&tb_cache_lock);
+
+    if (!g_file_set_contents(tb_cache_path, (char *)buf->data, buf->len,
+                             &err)) {
+        warn_report("Could not write TB cache '%s': %s", tb_cache_path,
+                    err->message);
+    }
+}
+
+void tb_cache_init(const char *path)
+{
+    qemu_mutex_init(&tb_cache_lock);
+    tb_cache_path = g_strdup(path);
+    tb_cache_entries = g_hash_table_new_full(tb_cache_entry_hash,
+                                             tb_cache_entry_equal,
+                                             g_free, NULL);
+    tb_cache_pages = g_hash_table_new_full(NULL, NULL, NULL,
+                                           tb_cache_page_free);
+    tb_cache_load();
+    atexit(tb_cache_save);
+    tb_cache_enabled = true;
+}
+
+/*
+ * Entries saved for another CPU model are kept in the file in case that
+ * model is used again, but never translated.
+ */
+static bool tb_cache_check_cpu(CPUState *cpu)
+{
+    if (!tb_cache_cpu_checked) {
+        tb_cache_cpu_checked = true;
+        if (strncmp(tb_cache_cpu_type, object_get_typename(OBJECT(cpu)),
+                    sizeof(tb_cache_cpu_type))) {
+            g_hash_table_remove_all(tb_cache_pages);
+        }
+    }
+    return g_hash_table_size(tb_cache_pages) != 0;
+}
+
+void tb_cache_record(CPUState *cpu, TranslationBlock *tb, vaddr pc)
+{
+    TBCacheEntry e = { 0 };
+    void *host;
+    int flags;
+
+    /* Only blocks that can be checked against a single guest page */
+    if (tb_page_addr0(tb) == -1 || tb_page_addr1(tb) != -1 ||
+        (tb->cflags & ~CF_TIER0) != curr_cflags(cpu)) {
+        return;
+    }
+
+    flags = probe_access_flags(cpu_env(cpu), pc, 1, MMU_INST_FETCH,
+                               cpu_mmu_index(cpu, true), true, &host, 0);
+    if ((flags & TLB_INVALID_MASK) || !host) {
+        return;
+    }
+
+    e.pc = pc;
+    e.cs_base = tb->cs_base;
+    e.flags = tb->flags;
+    e.cflags = tb->cflags & ~CF_TIER0;
+    e.size = tb->size;
+    e.hash = tb_cache_code_hash(host, tb->size);
+
+    qemu_mutex_lock(&tb_cache_lock);
+    if (!g_hash_table_contains(tb_cache_entries, &e)) {
+        g_hash_table_add(tb_cache_entries, g_memdup2(&e, sizeof(e)));
+    }
+    qemu_mutex_unlock(&tb_cache_lock);
+}
+
+const TBCacheEntry *tb_cache_take_page(CPUState *cpu, vaddr pc,
+                                       unsigned int *nr)
+{
+    gpointer page = GUINT_TO_POINTER(pc & TARGET_PAGE_MASK);
+    const TBCacheEntry *ret = NULL;
+    TBCachePage *p;
+
+    *nr = 0;
+    qemu_mutex_lock(&tb_cache_lock);
+    if (tb_cache_check_cpu(cpu)) {
+        p = g_hash_table_lookup(tb_cache_pages, page);
+        if (p && !p->taken) {
+            /* The array stays allocated so that callers need not free it */
+            p->taken = true;
+            ret = &g_array_index(p->entries, TBCacheEntry, 0);
+            *nr = p->entries->len;
+        }
+    }
+    qemu_mutex_unlock(&tb_cache_lock);
+    return ret;
+}
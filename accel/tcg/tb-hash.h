@@ -64,7 +64,8 @@ static inline
 uint32_t tb_hash_func(tb_page_addr_t phys_pc, vaddr pc,
                       uint32_t flags, uint64_t flags2, uint32_t cf_mask)
 {
-    return qemu_xxhash8(phys_pc, pc, flags2, flags, cf_mask);
+    /* A retranslated TB replaces its first tier under the same key */
+    return qemu_xxhash8(phys_pc, pc, flags2, flags, cf_mask & ~CF_TIER0);
 }
 
 #endif
@@ -50,7 +50,8 @@ static bool tb_cmp(const void *ap, const void *bp)
     return ((tb_cflags(a) & CF_PCREL || a->pc == b->pc) &&
             a->cs_base == b->cs_base &&
             a->flags == b->flags &&
-            (tb_cflags(a) & ~CF_INVALID) == (tb_cflags(b) & ~CF_INVALID) &&
+            (tb_cflags(a) & ~(CF_INVALID | CF_TIER0)) ==
+            (tb_cflags(b) & ~(CF_INVALID | CF_TIER0)) &&
             tb_page_addr0(a) == tb_page_addr0(b) &&
             tb_page_addr1(a) == tb_page_addr1(b));
 }
@@ -72,6 +73,11 @@ typedef struct PageDesc PageDesc;
 #define assert_page_locked(pd) tcg_debug_assert(have_mmap_lock())
 
 static inline void tb_lock_pages(const TranslationBlock *tb) { }
+static inline void tb_unlock_pages(const TranslationBlock *tb) { }
+static inline bool tb_pages_changed(const TranslationBlock *tb)
+{
+    return false;
+}
 
 /*
  * For user-only, since we are protecting all of memory with a single lock,
@@ -180,10 +186,24 @@ static void *l1_map[V_L1_MAX_SIZE];
 
 struct PageDesc {
     QemuSpin lock;
+    /* incremented whenever code on the page may change */
+    unsigned int gen;
+    /* set once a vCPU wrote to code on the page, for tb_smc_batch */
+    bool smc;
+    /* set while the page is on tb_smc_pages */
+    bool smc_queued;
+    QSLIST_ENTRY(PageDesc) smc_next;
+    tb_page_addr_t smc_index;
     /* list of TBs intersecting this ram page */
     uintptr_t first_tb;
 };
 
+/* Generations of the pages of the TB being translated by this thread */
+static __thread unsigned int tb_watch_gen[2];
+
+/* Pages written to with tb_smc_batch, whose TBs are not invalidated yet */
+static QSLIST_HEAD(, PageDesc) tb_smc_pages;
+
 void page_table_config_init(void)
 {
     uint32_t v_l1_bits;
@@ -273,7 +293,8 @@ static inline PageDesc *page_find(tb_page_addr_t index)
  * This struct helps us keep track of the locked state of a page, without
  * bloating &struct PageDesc.
  *
- * A page lock protects accesses to all fields of &struct PageDesc.
+ * A page lock protects accesses to all fields of &struct PageDesc, except
+ * that @gen may also be read without it.
  *
  * See also: &struct page_collection.
  */
@@ -397,53 +418,18 @@ static void page_unlock(PageDesc *pd)
     page_unlock__debug(pd);
 }
 
-void tb_lock_page0(tb_page_addr_t paddr)
+void tb_watch_page0(tb_page_addr_t paddr)
 {
-    page_lock(page_find_alloc(paddr >> TARGET_PAGE_BITS, true));
-}
+    PageDesc *pd = page_find_alloc(paddr >> TARGET_PAGE_BITS, true);
 
-void tb_lock_page1(tb_page_addr_t paddr0, tb_page_addr_t paddr1)
-{
-    tb_page_addr_t pindex0 = paddr0 >> TARGET_PAGE_BITS;
-    tb_page_addr_t pindex1 = paddr1 >> TARGET_PAGE_BITS;
-    PageDesc *pd0, *pd1;
-
-    if (pindex0 == pindex1) {
-        /* Identical pages, and the first page is already locked. */
-        return;
-    }
-
-    pd1 = page_find_alloc(pindex1, true);
-    if (pindex0 < pindex1) {
-        /* Correct locking order, we may block. */
-        page_lock(pd1);
-        return;
-    }
-
-    /* Incorrect locking order, we cannot block lest we deadlock. */
-    if (!page_trylock(pd1)) {
-        return;
-    }
-
-    /*
-     * Drop the lock on page0 and get both page locks in the right order.
-     * Restart translation via longjmp.
-     */
-    pd0 = page_find_alloc(pindex0, false);
-    page_unlock(pd0);
-    page_lock(pd1);
-    page_lock(pd0);
-    siglongjmp(tcg_ctx->jmp_trans, -3);
+    tb_watch_gen[0] = qatomic_load_acquire(&pd->gen);
 }
 
-void tb_unlock_page1(tb_page_addr_t paddr0, tb_page_addr_t paddr1)
+void tb_watch_page1(tb_page_addr_t paddr0, tb_page_addr_t paddr1)
 {
-    tb_page_addr_t pindex0 = paddr0 >> TARGET_PAGE_BITS;
-    tb_page_addr_t pindex1 = paddr1 >> TARGET_PAGE_BITS;
+    PageDesc *pd = page_find_alloc(paddr1 >> TARGET_PAGE_BITS, true);
 
-    if (pindex0 != pindex1) {
-        page_unlock(page_find_alloc(pindex1, false));
-    }
+    tb_watch_gen[1] = qatomic_load_acquire(&pd->gen);
 }
 
 static void tb_lock_pages(TranslationBlock *tb)
@@ -467,7 +453,7 @@ static void tb_lock_pages(TranslationBlock *tb)
     page_lock(page_find_alloc(pindex0, true));
 }
 
-void tb_unlock_pages(TranslationBlock *tb)
+static void tb_unlock_pages(TranslationBlock *tb)
 {
     tb_page_addr_t paddr0 = tb_page_addr0(tb);
     tb_page_addr_t paddr1 = tb_page_addr1(tb);
@@ -483,6 +469,42 @@ void tb_unlock_pages(TranslationBlock *tb)
     page_unlock(page_find_alloc(pindex0, false));
 }
 
+/*
+ * Return true if code on the pages of @tb may have changed since
+ * translation started.  Call with the pages of @tb locked.
+ */
+static bool tb_pages_changed(TranslationBlock *tb)
+{
+    tb_page_addr_t paddr1 = tb_page_addr1(tb);
+    tb_page_addr_t pindex0 = tb_page_addr0(tb) >> TARGET_PAGE_BITS;
+    tb_page_addr_t pindex1 = paddr1 >> TARGET_PAGE_BITS;
+
+    if (qatomic_read(&page_find(pindex0)->gen) != tb_watch_gen[0]) {
+        return true;
+    }
+    return paddr1 != -1 && pindex0 != pindex1 &&
+           qatomic_read(&page_find(pindex1)->gen) != tb_watch_gen[1];
+}
+
+const unsigned int *tb_smc_gen_ptr(tb_page_addr_t paddr0, unsigned int *gen)
+{
+    PageDesc *pd;
+
+    if (!tb_smc_batch || paddr0 == -1) {
+        return NULL;
+    }
+    /*
+     * A page becomes smc with its generation bumped, so a translation
+     * that missed it is refused by tb_link_page().
+     */
+    pd = page_find(paddr0 >> TARGET_PAGE_BITS);
+    if (!qatomic_read(&pd->smc)) {
+        return NULL;
+    }
+    *gen = tb_watch_gen[0];
+    return &pd->gen;
+}
+
 static inline struct page_entry *
 page_entry_new(PageDesc *pd, tb_page_addr_t index)
 {
@@ -971,6 +993,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
  * Note that in !user-mode, another thread might have already added a TB
  * for the same block of guest code that @tb corresponds to. In that case,
  * the caller should discard the original @tb, and use instead the returned TB.
+ * Returns NULL if the code of @tb was invalidated while @tb was translated;
+ * the caller should discard @tb and translate again.
  */
 TranslationBlock *tb_link_page(TranslationBlock *tb)
 {
@@ -980,6 +1004,12 @@ TranslationBlock *tb_link_page(TranslationBlock *tb)
     assert_memory_lock();
     tcg_debug_assert(!(tb->cflags & CF_INVALID));
 
+    tb_lock_pages(tb);
+    if (unlikely(tb_pages_changed(tb))) {
+        tb_unlock_pages(tb);
+        return NULL;
+    }
+
     tb_record(tb);
 
     /* add in the hash table */
@@ -1109,6 +1139,9 @@ tb_invalidate_phys_page_range__locked(struct page_collection *pages,
     /* Range may not cross a page. */
     tcg_debug_assert(((start ^ last) & TARGET_PAGE_MASK) == 0);
 
+    /* Make concurrent translations of this page start over */
+    qatomic_inc(&p->gen);
+
     /*
      * We remove all the TBs in the range [start, last].
      * XXX: see if in some cases it could be faster to invalidate all the code
@@ -1207,9 +1240,75 @@ static void tb_invalidate_phys_page_fast__locked(struct page_collection *pages,
     }
 
     assert_page_locked(p);
+    if (tb_smc_batch && p->first_tb) {
+        /* From now on, TBs on the page check its generation on entry */
+        qatomic_set(&p->smc, true);
+    }
     tb_invalidate_phys_page_range__locked(pages, p, start, start + len - 1, ra);
 }
 
+/*
+ * With tb_smc_batch, return true if the write to @addr needs no
+ * invalidation right now: all TBs that start on the page check its
+ * generation on entry, and the page is invalidated as a whole by
+ * tb_smc_flush() once a vCPU gets back to its main loop.
+ */
+static bool tb_smc_defer(tb_page_addr_t addr, uintptr_t retaddr)
+{
+    PageDesc *p = page_find(addr >> TARGET_PAGE_BITS);
+
+    if (!p) {
+        return true;
+    }
+    if (!qatomic_read(&p->smc)) {
+        return false;
+    }
+    /*
+     * TBs that only end on the page do not check its generation, but
+     * they are never chained to in system mode, see cpu_exec_loop().
+     */
+#ifdef TARGET_HAS_PRECISE_SMC
+    if (retaddr) {
+        TranslationBlock *tb = tcg_tb_lookup(retaddr);
+
+        /* The current TB might have to stop right after the write */
+        if (tb && ((tb_page_addr0(tb) ^ addr) < TARGET_PAGE_SIZE ||
+                   (tb_page_addr1(tb) ^ addr) < TARGET_PAGE_SIZE)) {
+            return false;
+        }
+    }
+#endif
+
+    qatomic_inc(&p->gen);
+    if (!qatomic_xchg(&p->smc_queued, true)) {
+        p->smc_index = addr >> TARGET_PAGE_BITS;
+        QSLIST_INSERT_HEAD_ATOMIC(&tb_smc_pages, p, smc_next);
+    }
+    return true;
+}
+
+bool tb_smc_pending(void)
+{
+    return qatomic_read(&tb_smc_pages.slh_first) != NULL;
+}
+
+void tb_smc_flush(void)
+{
+    QSLIST_HEAD(, PageDesc) pages;
+    PageDesc *p;
+
+    QSLIST_MOVE_ATOMIC(&pages, &tb_smc_pages);
+    while ((p = QSLIST_FIRST(&pages)) != NULL) {
+        tb_page_addr_t start = p->smc_index << TARGET_PAGE_BITS;
+
+        QSLIST_REMOVE_HEAD(&pages, smc_next);
+        /* Writes from now on queue the page again */
+        qatomic_set(&p->smc_queued, false);
+        smp_mb();
+        tb_invalidate_phys_range(start, start | ~TARGET_PAGE_MASK);
+    }
+}
+
 /*
  * len must be <= 8 and start must be a multiple of len.
  * Called via softmmu_template.h when code areas are written to with
@@ -1221,6 +1320,10 @@ void tb_invalidate_phys_range_fast(ram_addr_t ram_addr,
 {
     struct page_collection *pages;
 
+    if (tb_smc_batch && tb_smc_defer(ram_addr, retaddr)) {
+        return;
+    }
+
     pages = page_collection_lock(ram_addr, ram_addr + size - 1);
     tb_invalidate_phys_page_fast__locked(pages, ram_addr, size, retaddr);
     page_collection_unlock(pages);
@@ -38,6 +38,7 @@
 #if !defined(CONFIG_USER_ONLY)
 #include "hw/boards.h"
 #endif
+#include "internal-common.h"
 #include "internal-target.h"
 
 struct TCGState {
@@ -47,6 +48,10 @@ struct TCGState {
     bool one_insn_per_tb;
     int splitwx_enabled;
     unsigned long tb_size;
+    char *tb_cache;
+    uint32_t tier_threshold;
+    bool smc_batch;
+    uint32_t profile_interval;
 };
 typedef struct TCGState TCGState;
 
@@ -99,6 +104,8 @@ static void tcg_accel_instance_init(Object *obj)
 
 bool mttcg_enabled;
 bool one_insn_per_tb;
+unsigned int tcg_tier_threshold;
+bool tb_smc_batch;
 
 static int tcg_init_machine(MachineState *ms)
 {
@@ -111,10 +118,19 @@ static int tcg_init_machine(MachineState *ms)
 
     tcg_allowed = true;
     mttcg_enabled = s->mttcg_enabled;
+    tcg_tier_threshold = s->tier_threshold;
+#ifndef CONFIG_USER_ONLY
+    /* TBs leaving early would throw off the instruction count */
+    tb_smc_batch = s->smc_batch && !icount_enabled();
+    tcg_stats_init(s->profile_interval);
+#endif
 
     page_init();
     tb_htable_init();
     tcg_init(s->tb_size * MiB, s->splitwx_enabled, max_cpus);
+    if (s->tb_cache) {
+        tb_cache_init(s->tb_cache);
+    }
 
 #if defined(CONFIG_SOFTMMU)
     /*
@@ -181,6 +197,24 @@ static void tcg_set_tb_size(Object *obj, Visitor *v,
     s->tb_size = value;
 }
 
+static char *tcg_get_tb_cache(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return g_strdup(s->tb_cache);
+}
+
+static void tcg_set_tb_cache(Object *obj, const char *value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    if (tcg_allowed) {
+        error_setg(errp, "cannot change the TB cache after startup");
+        return;
+    }
+    g_free(s->tb_cache);
+    s->tb_cache = g_strdup(value);
+}
+
 static bool tcg_get_splitwx(Object *obj, Error **errp)
 {
     TCGState *s = TCG_STATE(obj);
@@ -193,6 +227,18 @@ static void tcg_set_splitwx(Object *obj, bool value, Error **errp)
     s->splitwx_enabled = value;
 }
 
+static bool tcg_get_smc_batch(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->smc_batch;
+}
+
+static void tcg_set_smc_batch(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    s->smc_batch = value;
+}
+
 static bool tcg_get_one_insn_per_tb(Object *obj, Error **errp)
 {
     TCGState *s = TCG_STATE(obj);
@@ -242,6 +288,29 @@ static void tcg_accel_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "tb-size",
         "TCG translation block cache size");
 
+    object_class_property_add_str(oc, "tb-cache",
+        tcg_get_tb_cache, tcg_set_tb_cache);
+    object_class_property_set_description(oc, "tb-cache",
+        "File that remembers translated blocks across runs");
+
+    object_class_property_add_uint32_ptr(oc, "tier-threshold",
+        offsetof(TCGState, tier_threshold), OBJ_PROP_FLAG_READWRITE);
+    object_class_property_set_description(oc, "tier-threshold",
+        "Translate TBs without optimization first, and optimize them "
+        "after this many entries (0 = always optimize)");
+
+    object_class_property_add_bool(oc, "smc-batch",
+        tcg_get_smc_batch, tcg_set_smc_batch);
+    object_class_property_set_description(oc, "smc-batch",
+        "Defer invalidation of translated code written by the guest "
+        "to the next exit to the main loop");
+
+    object_class_property_add_uint32_ptr(oc, "profile-interval",
+        offsetof(TCGState, profile_interval), OBJ_PROP_FLAG_READWRITE);
+    object_class_property_set_description(oc, "profile-interval",
+        "Sample the translation block each vCPU is executing every "
+        "this many milliseconds of guest time (0 = never)");
+
     object_class_property_add_bool(oc, "split-wx",
         tcg_get_splitwx, tcg_set_splitwx);
     object_class_property_set_description(oc, "split-wx",
@@ -290,7 +290,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
 {
     CPUArchState *env = cpu_env(cpu);
     TranslationBlock *tb, *existing_tb;
-    tb_page_addr_t phys_pc, phys_p2;
+    tb_page_addr_t phys_pc;
     tcg_insn_unit *gen_code_buf;
     int gen_code_size, search_size, max_insns;
     int64_t ti;
@@ -332,10 +332,11 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    tb->tier_count = tcg_tier_threshold;
     tb_set_page_addr0(tb, phys_pc);
     tb_set_page_addr1(tb, -1);
     if (phys_pc != -1) {
-        tb_lock_page0(phys_pc);
+        tb_watch_page0(phys_pc);
     }
 
     tcg_ctx->gen_tb = tb;
@@ -371,7 +372,6 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
             qemu_log_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT,
                           "Restarting code generation for "
                           "code_gen_buffer overflow\n");
-            tb_unlock_pages(tb);
             tcg_ctx->gen_tb = NULL;
             goto buffer_overflow;
 
@@ -397,22 +397,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
              * TODO: Fix all targets that cross pages except with
              * the first insn, at which point this can't be reached.
              */
-            phys_p2 = tb_page_addr1(tb);
-            if (unlikely(phys_p2 != -1)) {
-                tb_unlock_page1(phys_pc, phys_p2);
-                tb_set_page_addr1(tb, -1);
-            }
-            goto restart_translate;
-
-        case -3:
-            /*
-             * We had a page lock ordering problem.  In order to avoid
-             * deadlock we had to drop the lock on page0, which means
-             * that everything we translated so far is compromised.
-             * Restart with locks held on both pages.
-             */
-            qemu_log_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT,
-                          "Restarting code generation with re-locked pages");
+            tb_set_page_addr1(tb, -1);
             goto restart_translate;
 
         default:
@@ -423,7 +408,6 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
 
     search_size = encode_search(tb, (void *)gen_code_buf + gen_code_size);
     if (unlikely(search_size < 0)) {
-        tb_unlock_pages(tb);
         goto buffer_overflow;
     }
     tb->tc.size = gen_code_size;
@@ -551,13 +535,22 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     existing_tb = tb_link_page(tb);
     assert_no_pages_locked();
 
-    /* if the TB already exists, discard what we just translated */
+    /*
+     * If the TB already exists, or if its code was invalidated while we
+     * translated it, discard what we just translated.
+     */
     if (unlikely(existing_tb != tb)) {
         uintptr_t orig_aligned = (uintptr_t)gen_code_buf;
 
         orig_aligned -= ROUND_UP(sizeof(*tb), qemu_icache_linesize);
         qatomic_set(&tcg_ctx->code_gen_ptr, (void *)orig_aligned);
         tcg_tb_remove(tb);
+        if (!existing_tb) {
+            qemu_log_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT,
+                          "Restarting code generation for "
+                          "concurrently modified code\n");
+            goto buffer_overflow;
+        }
         return existing_tb;
     }
     return tb;
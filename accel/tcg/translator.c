@@ -40,6 +40,8 @@ static TCGOp *gen_tb_start(DisasContextBase *db, uint32_t cflags)
 {
     TCGv_i32 count = NULL;
     TCGOp *icount_start_insn = NULL;
+    const unsigned int *smc_gen;
+    unsigned int gen;
 
     if ((cflags & CF_USE_ICOUNT) || !(cflags & CF_NOIRQ)) {
         count = tcg_temp_new_i32();
@@ -72,6 +74,36 @@ static TCGOp *gen_tb_start(DisasContextBase *db, uint32_t cflags)
         tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, tcg_ctx->exitreq_label);
     }
 
+    /*
+     * Leave before executing anything if the guest wrote to the page
+     * since translation.  The main loop then invalidates the TB.
+     */
+    smc_gen = tb_smc_gen_ptr(tb_page_addr0(db->tb), &gen);
+    if (smc_gen) {
+        TCGv_i32 cur = tcg_temp_new_i32();
+
+        if (!tcg_ctx->exitreq_label) {
+            tcg_ctx->exitreq_label = gen_new_label();
+        }
+        tcg_gen_ld_i32(cur, tcg_constant_ptr(smc_gen), 0);
+        tcg_gen_brcondi_i32(TCG_COND_NE, cur, gen, tcg_ctx->exitreq_label);
+    }
+
+    /*
+     * Count entries into a first tier TB, and leave it before executing
+     * anything once the main loop should retranslate it.  Races between
+     * vCPUs only make the count approximate.
+     */
+    if (cflags & CF_TIER0) {
+        TCGv_ptr tb = tcg_constant_ptr(db->tb);
+        TCGv_i32 left = tcg_temp_new_i32();
+
+        tcg_gen_ld_i32(left, tb, offsetof(TranslationBlock, tier_count));
+        tcg_gen_subi_i32(left, left, 1);
+        tcg_gen_st_i32(left, tb, offsetof(TranslationBlock, tier_count));
+        tcg_gen_brcondi_i32(TCG_COND_LT, left, 0, tcg_ctx->exitreq_label);
+    }
+
     if (cflags & CF_USE_ICOUNT) {
         tcg_gen_st16_i32(count, tcg_env,
                          offsetof(ArchCPU, parent_obj.neg.icount_decr.u16.low)
@@ -259,26 +291,21 @@ static void *translator_access(CPUArchState *env, DisasContextBase *db,
              * was MMIO as well, so that we do not cache the TB.
              */
             if (unlikely(new_page1 == -1)) {
-                tb_unlock_pages(tb);
                 tb_set_page_addr0(tb, -1);
                 return NULL;
             }
 
             /*
              * If this is not the first time around, and page1 matches,
-             * then we already have the page locked.  Alternately, we're
+             * then we already watch the page.  Alternately, we're
              * not doing anything to prevent the PTE from changing, so
-             * we might wind up with a different page, requiring us to
-             * re-do the locking.
+             * we might wind up with a different page.
              */
             old_page1 = tb_page_addr1(tb);
             if (likely(new_page1 != old_page1)) {
                 page0 = tb_page_addr0(tb);
-                if (unlikely(old_page1 != -1)) {
-                    tb_unlock_page1(page0, old_page1);
-                }
                 tb_set_page_addr1(tb, new_page1);
-                tb_lock_page1(page0, new_page1);
+                tb_watch_page1(page0, new_page1);
             }
             host = db->host_addr[1];
         }
@@ -23,6 +23,7 @@
 #include "tcg/tcg.h"
 #include "qemu/bitops.h"
 #include "qemu/rcu.h"
+#include "qemu/seqlock.h"
 #include "exec/cpu_ldst.h"
 #include "exec/translate-all.h"
 #include "exec/helper-proto.h"
@@ -145,6 +146,25 @@ typedef struct PageFlagsNode {
 
 static IntervalTreeRoot pageflags_root;
 
+/*
+ * Incremented around every change of pageflags_root, which all happen
+ * with mmap_lock held.  It lets lockless lookups trust that a range is
+ * really unmapped, and validates the per-thread cache of the last node
+ * found, without taking mmap_lock.
+ */
+static QemuSeqLock pageflags_seq;
+
+/* A copy of a PageFlagsNode, valid while pageflags_seq is @seq. */
+typedef struct PageFlagsCache {
+    target_ulong start;
+    target_ulong last;
+    int flags;
+    unsigned seq;
+} PageFlagsCache;
+
+/* An odd sequence never matches, so the cache starts out empty. */
+static __thread PageFlagsCache pageflags_cache = { .seq = 1 };
+
 static PageFlagsNode *pageflags_find(target_ulong start, target_ulong last)
 {
     IntervalTreeNode *n;
@@ -162,6 +182,55 @@ static PageFlagsNode *pageflags_next(PageFlagsNode *p, target_ulong start,
     return n ? container_of(n, PageFlagsNode, itree) : NULL;
 }
 
+/*
+ * Find the first node that overlaps [start,last], and copy it to @pc.
+ * Return false if there is none.
+ *
+ * See util/interval-tree.c re lockless lookups: no false positives but
+ * there are false negatives.  A lookup that finds nothing is only
+ * retried with the mmap lock if the tree changed meanwhile.
+ */
+static bool pageflags_lookup(target_ulong start, target_ulong last,
+                             PageFlagsCache *pc)
+{
+    PageFlagsCache *c = &pageflags_cache;
+    PageFlagsNode *p;
+    unsigned seq;
+
+    seq = seqlock_read_begin(&pageflags_seq);
+    if (c->seq == seq && c->start <= start && start <= c->last) {
+        *pc = *c;
+        if (!seqlock_read_retry(&pageflags_seq, seq)) {
+            return true;
+        }
+    }
+
+    p = pageflags_find(start, last);
+    if (p) {
+        pc->start = p->itree.start;
+        pc->last = p->itree.last;
+        pc->flags = p->flags;
+        if (!seqlock_read_retry(&pageflags_seq, seq)) {
+            pc->seq = seq;
+            *c = *pc;
+        }
+        return true;
+    }
+    if (!seqlock_read_retry(&pageflags_seq, seq) || have_mmap_lock()) {
+        return false;
+    }
+
+    mmap_lock();
+    p = pageflags_find(start, last);
+    if (p) {
+        pc->start = p->itree.start;
+        pc->last = p->itree.last;
+        pc->flags = p->flags;
+    }
+    mmap_unlock();
+    return p != NULL;
+}
+
 int walk_memory_regions(void *priv, walk_memory_regions_fn fn)
 {
     IntervalTreeNode *n;
@@ -208,24 +277,9 @@ void page_dump(FILE *f)
 
 int page_get_flags(target_ulong address)
 {
-    PageFlagsNode *p = pageflags_find(address, address);
+    PageFlagsCache pc;
 
-    /*
-     * See util/interval-tree.c re lockless lookups: no false positives but
-     * there are false negatives.  If we find nothing, retry with the mmap
-     * lock acquired.
-     */
-    if (p) {
-        return p->flags;
-    }
-    if (have_mmap_lock()) {
-        return 0;
-    }
-
-    mmap_lock();
-    p = pageflags_find(address, address);
-    mmap_unlock();
-    return p ? p->flags : 0;
+    return pageflags_lookup(address, address, &pc) ? pc.flags : 0;
 }
 
 /* A subroutine of page_set_flags: insert a new node for [start,last]. */
@@ -508,6 +562,7 @@ void page_set_flags(target_ulong start, target_ulong last, int flags)
         }
     }
 
+    seqlock_write_begin(&pageflags_seq);
     if (!flags || reset) {
         page_reset_target_data(start, last);
         inval_tb |= pageflags_unset(start, last);
@@ -516,6 +571,7 @@ void page_set_flags(target_ulong start, target_ulong last, int flags)
         inval_tb |= pageflags_set_clear(start, last, flags,
                                         ~(reset ? 0 : PAGE_STICKY));
     }
+    seqlock_write_end(&pageflags_seq);
     if (inval_tb) {
         tb_invalidate_phys_range(start, last);
     }
@@ -524,7 +580,7 @@ void page_set_flags(target_ulong start, target_ulong last, int flags)
 bool page_check_range(target_ulong start, target_ulong len, int flags)
 {
     target_ulong last;
-    int locked;  /* tri-state: =0: unlocked, +1: global, -1: local */
+    PageFlagsCache p;
     bool ret;
 
     if (len == 0) {
@@ -536,38 +592,25 @@ bool page_check_range(target_ulong start, target_ulong len, int flags)
         return false; /* wrap around */
     }
 
-    locked = have_mmap_lock();
     while (true) {
-        PageFlagsNode *p = pageflags_find(start, last);
         int missing;
 
-        if (!p) {
-            if (!locked) {
-                /*
-                 * Lockless lookups have false negatives.
-                 * Retry with the lock held.
-                 */
-                mmap_lock();
-                locked = -1;
-                p = pageflags_find(start, last);
-            }
-            if (!p) {
-                ret = false; /* entire region invalid */
-                break;
-            }
+        if (!pageflags_lookup(start, last, &p)) {
+            ret = false; /* entire region invalid */
+            break;
         }
-        if (start < p->itree.start) {
+        if (start < p.start) {
             ret = false; /* initial bytes invalid */
             break;
         }
 
-        missing = flags & ~p->flags;
+        missing = flags & ~p.flags;
         if (missing & ~PAGE_WRITE) {
             ret = false; /* page doesn't match */
             break;
         }
         if (missing & PAGE_WRITE) {
-            if (!(p->flags & PAGE_WRITE_ORG)) {
+            if (!(p.flags & PAGE_WRITE_ORG)) {
                 ret = false; /* page not writable */
                 break;
             }
@@ -585,17 +628,13 @@ bool page_check_range(target_ulong start, target_ulong len, int flags)
             continue;
         }
 
-        if (last <= p->itree.last) {
+        if (last <= p.last) {
             ret = true; /* ok */
             break;
         }
-        start = p->itree.last + 1;
+        start = p.last + 1;
     }
 
-    /* Release the lock if acquired locally. */
-    if (locked < 0) {
-        mmap_unlock();
-    }
     return ret;
 }
 
@@ -679,7 +718,9 @@ void page_protect(tb_page_addr_t address)
     }
 
     if (prot & PAGE_WRITE) {
+        seqlock_write_begin(&pageflags_seq);
         pageflags_set_clear(start, last, 0, PAGE_WRITE);
+        seqlock_write_end(&pageflags_seq);
         mprotect(g2h_untagged(start), last - start + 1,
                  prot & (PAGE_READ | PAGE_EXEC) ? PROT_READ : PROT_NONE);
     }
@@ -734,7 +775,9 @@ int page_unprotect(target_ulong address, uintptr_t pc)
             start = address & TARGET_PAGE_MASK;
             len = TARGET_PAGE_SIZE;
             prot = p->flags | PAGE_WRITE;
+            seqlock_write_begin(&pageflags_seq);
             pageflags_set_clear(start, start + len - 1, PAGE_WRITE, 0);
+            seqlock_write_end(&pageflags_seq);
             current_tb_invalidated = tb_invalidate_phys_page_unwind(start, pc);
         } else {
             start = address & -host_page_size;
@@ -749,8 +792,10 @@ int page_unprotect(target_ulong address, uintptr_t pc)
                     prot |= p->flags;
                     if (p->flags & PAGE_WRITE_ORG) {
                         prot |= PAGE_WRITE;
+                        seqlock_write_begin(&pageflags_seq);
                         pageflags_set_clear(addr, addr + TARGET_PAGE_SIZE - 1,
                                             PAGE_WRITE, 0);
+                        seqlock_write_end(&pageflags_seq);
                     }
                 }
                 /*
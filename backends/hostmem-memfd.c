@@ -17,6 +17,7 @@
 #include "qemu/module.h"
 #include "qapi/error.h"
 #include "qom/object.h"
+#include "migration/cpr.h"
 
 #define TYPE_MEMORY_BACKEND_MEMFD "memory-backend-memfd"
 
@@ -29,6 +30,7 @@ struct HostMemoryBackendMemfd {
     bool hugetlb;
     uint64_t hugetlbsize;
     bool seal;
+    char *cpr_name;
 };
 
 static bool
@@ -44,15 +46,22 @@ memfd_backend_memory_alloc(HostMemoryBackend *backend, Error **errp)
         return false;
     }
 
-    fd = qemu_memfd_create(TYPE_MEMORY_BACKEND_MEMFD, backend->size,
-                           m->hugetlb, m->hugetlbsize, m->seal ?
-                           F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL : 0,
-                           errp);
-    if (fd == -1) {
-        return false;
+    name = host_memory_backend_get_name(backend);
+
+    /* A QEMU started by cpr-exec reuses the memfd, and the guest RAM in it */
+    fd = cpr_find_fd(name, 0);
+    if (fd < 0) {
+        fd = qemu_memfd_create(TYPE_MEMORY_BACKEND_MEMFD, backend->size,
+                               m->hugetlb, m->hugetlbsize, m->seal ?
+                               F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL : 0,
+                               errp);
+        if (fd == -1) {
+            return false;
+        }
+        cpr_save_fd(name, 0, fd);
     }
+    m->cpr_name = g_strdup(name);
 
-    name = host_memory_backend_get_name(backend);
     ram_flags = backend->share ? RAM_SHARED : 0;
     ram_flags |= backend->reserve ? 0 : RAM_NORESERVE;
     return memory_region_init_ram_from_fd(&backend->mr, OBJECT(backend), name,
@@ -126,6 +135,17 @@ memfd_backend_instance_init(Object *obj)
     MEMORY_BACKEND(m)->share = true;
 }
 
+static void
+memfd_backend_instance_finalize(Object *obj)
+{
+    HostMemoryBackendMemfd *m = MEMORY_BACKEND_MEMFD(obj);
+
+    if (m->cpr_name) {
+        cpr_delete_fd(m->cpr_name, 0);
+        g_free(m->cpr_name);
+    }
+}
+
 static void
 memfd_backend_class_init(ObjectClass *oc, void *data)
 {
@@ -157,6 +177,7 @@ static const TypeInfo memfd_backend_info = {
     .name = TYPE_MEMORY_BACKEND_MEMFD,
     .parent = TYPE_MEMORY_BACKEND,
     .instance_init = memfd_backend_instance_init,
+    .instance_finalize = memfd_backend_instance_finalize,
     .class_init = memfd_backend_class_init,
     .instance_size = sizeof(HostMemoryBackendMemfd),
 };
@@ -20,6 +20,8 @@
 #include "qom/object_interfaces.h"
 #include "qemu/mmap-alloc.h"
 #include "qemu/madvise.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
 #include "hw/qdev-core.h"
 
 #ifdef CONFIG_NUMA
@@ -158,6 +160,32 @@ host_memory_backend_set_policy(Object *obj, int policy, Error **errp)
 #endif
 }
 
+static char *host_memory_backend_get_near_device(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return g_strdup(backend->near_device);
+}
+
+static void host_memory_backend_set_near_device(Object *obj, const char *value,
+                                                Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (host_memory_backend_mr_inited(backend)) {
+        error_setg(errp, "cannot change property 'near-device' of %s",
+                   object_get_typename(obj));
+        return;
+    }
+
+#ifdef CONFIG_NUMA
+    g_free(backend->near_device);
+    backend->near_device = g_strdup(value);
+#else
+    error_setg(errp, "NUMA node binding are not supported by this QEMU");
+#endif
+}
+
 static bool host_memory_backend_get_merge(Object *obj, Error **errp)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -217,6 +245,22 @@ static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
     return backend->prealloc;
 }
 
+static bool host_memory_backend_prealloc(HostMemoryBackend *backend,
+                                         void *ptr, uint64_t sz, bool async,
+                                         Error **errp)
+{
+    ThreadContext *tc = backend->prealloc_context ?: backend->near_context;
+    int fd = memory_region_get_fd(&backend->mr);
+
+    if (!tc && backend->n_node_contexts) {
+        return qemu_prealloc_mem_nodes(fd, ptr, sz, backend->prealloc_threads,
+                                       backend->node_contexts,
+                                       backend->n_node_contexts, async, errp);
+    }
+    return qemu_prealloc_mem(fd, ptr, sz, backend->prealloc_threads, tc,
+                             async, errp);
+}
+
 static void host_memory_backend_set_prealloc(Object *obj, bool value,
                                              Error **errp)
 {
@@ -233,12 +277,10 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
     }
 
     if (value && !backend->prealloc) {
-        int fd = memory_region_get_fd(&backend->mr);
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        if (!qemu_prealloc_mem(fd, ptr, sz, backend->prealloc_threads,
-                               backend->prealloc_context, false, errp)) {
+        if (!host_memory_backend_prealloc(backend, ptr, sz, false, errp)) {
             return;
         }
         backend->prealloc = true;
@@ -281,6 +323,14 @@ static void host_memory_backend_init(Object *obj)
     backend->prealloc_threads = machine->smp.cpus;
 }
 
+static void host_memory_backend_finalize(Object *obj)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    g_free(backend->near_device);
+    g_free(backend->node_contexts);
+}
+
 static void host_memory_backend_post_init(Object *obj)
 {
     object_apply_compat_props(obj);
@@ -317,6 +367,134 @@ size_t host_memory_backend_pagesize(HostMemoryBackend *memdev)
     return pagesize;
 }
 
+#ifdef CONFIG_NUMA
+static ThreadContext *
+host_memory_backend_new_node_context(HostMemoryBackend *backend,
+                                     const char *name, int64_t node,
+                                     Error **errp)
+{
+    g_autofree char *node_str = g_strdup_printf("%" PRId64, node);
+    Object *tc = object_new(TYPE_THREAD_CONTEXT);
+
+    object_property_add_child(OBJECT(backend), name, tc);
+    object_unref(tc);
+    if (!object_property_parse(tc, "node-affinity", node_str, errp) ||
+        !user_creatable_complete(USER_CREATABLE(tc), errp)) {
+        object_unparent(tc);
+        return NULL;
+    }
+    return THREAD_CONTEXT(tc);
+}
+
+/*
+ * With a bind or preferred policy over several host nodes, the kernel
+ * allocates each page on the node of the CPU that faults it in, if that
+ * node is in the policy.  Unless a context was given, run preallocation
+ * threads on each node of host-nodes, so that the memory is spread over
+ * them and cleared by local CPUs.  Nodes without CPUs cannot host threads;
+ * then preallocation is left as it was.
+ */
+static void host_memory_backend_add_node_contexts(HostMemoryBackend *backend)
+{
+    ThreadContext **tcs;
+    int n = 0;
+    long node;
+
+    if (!backend->prealloc || backend->prealloc_context ||
+        backend->near_context || backend->n_node_contexts ||
+        (backend->policy != HOST_MEM_POLICY_BIND &&
+         backend->policy != HOST_MEM_POLICY_PREFERRED)) {
+        return;
+    }
+
+    tcs = g_new0(ThreadContext *, bitmap_count_one(backend->host_nodes,
+                                                   MAX_NODES));
+    for (node = find_first_bit(backend->host_nodes, MAX_NODES);
+         node < MAX_NODES;
+         node = find_next_bit(backend->host_nodes, MAX_NODES, node + 1)) {
+        g_autofree char *name = g_strdup_printf("prealloc-context-node%ld",
+                                                node);
+        Error *local_err = NULL;
+
+        tcs[n] = host_memory_backend_new_node_context(backend, name, node,
+                                                      &local_err);
+        if (!tcs[n]) {
+            error_free(local_err);
+            while (n--) {
+                object_unparent(OBJECT(tcs[n]));
+            }
+            g_free(tcs);
+            return;
+        }
+        n++;
+    }
+
+    backend->node_contexts = tcs;
+    backend->n_node_contexts = n;
+}
+
+/*
+ * Bind the memory to the host NUMA node of near-device, given as a host PCI
+ * address like vfio-pci's host= or as a sysfs device path. Unless a context
+ * was given, preallocation threads run on the CPUs of that node too, so that
+ * first touch happens close to the memory.
+ */
+static bool host_memory_backend_apply_near_device(HostMemoryBackend *backend,
+                                                  Error **errp)
+{
+    g_autofree char *path = NULL;
+    g_autofree char *contents = NULL;
+    g_autoptr(GError) gerr = NULL;
+    int64_t node;
+
+    if (!bitmap_empty(backend->host_nodes, MAX_NODES)) {
+        error_setg(errp, "'near-device' and 'host-nodes' are mutually"
+                   " exclusive");
+        return false;
+    }
+
+    if (backend->near_device[0] == '/') {
+        path = g_strdup_printf("%s/numa_node", backend->near_device);
+    } else {
+        path = g_strdup_printf("/sys/bus/pci/devices/%s/numa_node",
+                               backend->near_device);
+    }
+
+    if (!g_file_get_contents(path, &contents, NULL, &gerr)) {
+        error_setg(errp, "cannot get the NUMA node of '%s': %s",
+                   backend->near_device, gerr->message);
+        return false;
+    }
+
+    if (qemu_strtoi64(g_strstrip(contents), NULL, 10, &node) ||
+        node >= MAX_NODES) {
+        error_setg(errp, "invalid NUMA node '%s' for '%s'", contents,
+                   backend->near_device);
+        return false;
+    }
+
+    if (node < 0) {
+        warn_report("'%s' has no host NUMA node, ignoring 'near-device'",
+                    backend->near_device);
+        return true;
+    }
+
+    bitmap_set(backend->host_nodes, node, 1);
+    if (backend->policy == HOST_MEM_POLICY_DEFAULT) {
+        backend->policy = HOST_MEM_POLICY_BIND;
+    }
+
+    if (!backend->prealloc || backend->prealloc_context) {
+        return true;
+    }
+
+    backend->near_context =
+        host_memory_backend_new_node_context(backend, "near-context", node,
+                                             errp);
+    return backend->near_context != NULL;
+}
+#endif
+
 static void
 host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
 {
@@ -343,6 +521,11 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
         qemu_madvise(ptr, sz, QEMU_MADV_DONTDUMP);
     }
 #ifdef CONFIG_NUMA
+    if (backend->near_device &&
+        !host_memory_backend_apply_near_device(backend, errp)) {
+        return;
+    }
+
     unsigned long lastbit = find_last_bit(backend->host_nodes, MAX_NODES);
     /* lastbit == MAX_NODES means maxnode = 0 */
     unsigned long maxnode = (lastbit + 1) % (MAX_NODES + 1);
@@ -395,17 +578,17 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
             return;
         }
     }
+    if (maxnode) {
+        host_memory_backend_add_node_contexts(backend);
+    }
 #endif
     /*
      * Preallocate memory after the NUMA policy has been instantiated.
      * This is necessary to guarantee memory is allocated with
      * specified NUMA policy in place.
      */
-    if (backend->prealloc && !qemu_prealloc_mem(memory_region_get_fd(&backend->mr),
-                                                ptr, sz,
-                                                backend->prealloc_threads,
-                                                backend->prealloc_context,
-                                                async, errp)) {
+    if (backend->prealloc &&
+        !host_memory_backend_prealloc(backend, ptr, sz, async, errp)) {
         return;
     }
 }
@@ -531,6 +714,11 @@ host_memory_backend_class_init(ObjectClass *oc, void *data)
         host_memory_backend_set_policy);
     object_class_property_set_description(oc, "policy",
         "Set the NUMA policy");
+    object_class_property_add_str(oc, "near-device",
+        host_memory_backend_get_near_device,
+        host_memory_backend_set_near_device);
+    object_class_property_set_description(oc, "near-device",
+        "Binds memory to the host NUMA node of a PCI device");
     object_class_property_add_bool(oc, "share",
         host_memory_backend_get_share, host_memory_backend_set_share);
     object_class_property_set_description(oc, "share",
@@ -565,6 +753,7 @@ static const TypeInfo host_memory_backend_info = {
     .instance_size = sizeof(HostMemoryBackend),
     .instance_init = host_memory_backend_init,
     .instance_post_init = host_memory_backend_post_init,
+    .instance_finalize = host_memory_backend_finalize,
     .interfaces = (InterfaceInfo[]) {
         { TYPE_USER_CREATABLE },
         { }
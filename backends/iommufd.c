@@ -16,11 +16,32 @@
 #include "qapi/qmp/qerror.h"
 #include "qemu/module.h"
 #include "qom/object_interfaces.h"
+#include "qemu/async-teardown.h"
 #include "qemu/error-report.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "qapi/visitor.h"
 #include "monitor/monitor.h"
+#include "sysemu/sysemu.h"
 #include "trace.h"
 #include <sys/ioctl.h>
 
+/*
+ * The IOAS mappings, and the memory pinned for them, are only released
+ * when the last reference to the iommufd goes away.  With asynchronous
+ * teardown, let the teardown process keep it so that this doesn't delay
+ * the exit of QEMU.
+ */
+static void iommufd_backend_exit_notify(Notifier *n, void *data)
+{
+    IOMMUFDBackend *be = container_of(n, IOMMUFDBackend, exit_notifier);
+
+    if (be->users && be->fd >= 0) {
+        async_teardown_hand_over_fd(be->fd);
+    }
+}
+
 static void iommufd_backend_init(Object *obj)
 {
     IOMMUFDBackend *be = IOMMUFD_BACKEND(obj);
@@ -28,12 +49,17 @@ static void iommufd_backend_init(Object *obj)
     be->fd = -1;
     be->users = 0;
     be->owned = true;
+    be->dma_map_threads = 1;
+    be->exit_notifier.notify = iommufd_backend_exit_notify;
+    qemu_add_exit_notifier(&be->exit_notifier);
 }
 
 static void iommufd_backend_finalize(Object *obj)
 {
     IOMMUFDBackend *be = IOMMUFD_BACKEND(obj);
 
+    qemu_remove_exit_notifier(&be->exit_notifier);
+
     if (be->owned) {
         close(be->fd);
         be->fd = -1;
@@ -56,6 +82,35 @@ static void iommufd_backend_set_fd(Object *obj, const char *str, Error **errp)
     trace_iommu_backend_set_fd(be->fd);
 }
 
+static void iommufd_backend_get_dma_map_threads(Object *obj, Visitor *v,
+                                                const char *name,
+                                                void *opaque, Error **errp)
+{
+    IOMMUFDBackend *be = IOMMUFD_BACKEND(obj);
+    uint32_t value = be->dma_map_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void iommufd_backend_set_dma_map_threads(Object *obj, Visitor *v,
+                                                const char *name,
+                                                void *opaque, Error **errp)
+{
+    IOMMUFDBackend *be = IOMMUFD_BACKEND(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value || value > IOMMUFD_DMA_MAP_MAX_THREADS) {
+        error_setg(errp, "Property '%s.%s' must be between 1 and %d",
+                   object_get_typename(obj), name,
+                   IOMMUFD_DMA_MAP_MAX_THREADS);
+        return;
+    }
+    be->dma_map_threads = value;
+}
+
 static bool iommufd_backend_can_be_deleted(UserCreatable *uc)
 {
     IOMMUFDBackend *be = IOMMUFD_BACKEND(uc);
@@ -70,6 +125,10 @@ static void iommufd_backend_class_init(ObjectClass *oc, void *data)
     ucc->can_be_deleted = iommufd_backend_can_be_deleted;
 
     object_class_property_add_str(oc, "fd", NULL, iommufd_backend_set_fd);
+    object_class_property_add(oc, "dma-map-threads", "uint32",
+                              iommufd_backend_get_dma_map_threads,
+                              iommufd_backend_set_dma_map_threads,
+                              NULL, NULL);
 }
 
 int iommufd_backend_connect(IOMMUFDBackend *be, Error **errp)
@@ -142,10 +201,11 @@ void iommufd_backend_free_id(IOMMUFDBackend *be, uint32_t id)
     }
 }
 
-int iommufd_backend_map_dma(IOMMUFDBackend *be, uint32_t ioas_id, hwaddr iova,
-                            ram_addr_t size, void *vaddr, bool readonly)
+static int iommufd_backend_map_dma_one(int fd, uint32_t ioas_id, hwaddr iova,
+                                       ram_addr_t size, void *vaddr,
+                                       bool readonly)
 {
-    int ret, fd = be->fd;
+    int ret;
     struct iommu_ioas_map map = {
         .size = sizeof(map),
         .flags = IOMMU_IOAS_MAP_READABLE |
@@ -164,19 +224,161 @@ int iommufd_backend_map_dma(IOMMUFDBackend *be, uint32_t ioas_id, hwaddr iova,
     ret = ioctl(fd, IOMMU_IOAS_MAP, &map);
     trace_iommufd_backend_map_dma(fd, ioas_id, iova, size,
                                   vaddr, readonly, ret);
-    if (ret) {
-        ret = -errno;
+    return ret ? -errno : 0;
+}
+
+/*
+ * Large mappings are split into IOMMUFD_DMA_MAP_CHUNK sized pieces which
+ * are handed out to the worker threads on demand. Every piece becomes its
+ * own IOAS area, which is fine as unmap requests always cover whole
+ * RAM sections and IOMMU_IOAS_UNMAP accepts ranges spanning several areas.
+ */
+typedef struct IOMMUFDMapContext {
+    int fd;
+    uint32_t ioas_id;
+    hwaddr iova;
+    ram_addr_t size;
+    void *vaddr;
+    bool readonly;
+    uint32_t next_chunk;
+    uint32_t nr_chunks;
+    int ret;
+} IOMMUFDMapContext;
+
+static void *iommufd_backend_map_dma_worker(void *opaque)
+{
+    IOMMUFDMapContext *ctx = opaque;
+    uint32_t chunk;
+    int ret;
 
+    while (!qatomic_read(&ctx->ret)) {
+        ram_addr_t offset, len;
+
+        chunk = qatomic_fetch_inc(&ctx->next_chunk);
+        if (chunk >= ctx->nr_chunks) {
+            break;
+        }
+
+        offset = (ram_addr_t)chunk * IOMMUFD_DMA_MAP_CHUNK;
+        len = MIN(IOMMUFD_DMA_MAP_CHUNK, ctx->size - offset);
+        ret = iommufd_backend_map_dma_one(ctx->fd, ctx->ioas_id,
+                                          ctx->iova + offset, len,
+                                          ctx->vaddr + offset, ctx->readonly);
+        if (ret) {
+            qatomic_cmpxchg(&ctx->ret, 0, ret);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int iommufd_backend_map_dma_parallel(IOMMUFDBackend *be,
+                                            uint32_t ioas_id, hwaddr iova,
+                                            ram_addr_t size, void *vaddr,
+                                            bool readonly)
+{
+    IOMMUFDMapContext ctx = {
+        .fd = be->fd,
+        .ioas_id = ioas_id,
+        .iova = iova,
+        .size = size,
+        .vaddr = vaddr,
+        .readonly = readonly,
+        .nr_chunks = DIV_ROUND_UP(size, IOMMUFD_DMA_MAP_CHUNK),
+    };
+    uint32_t nr_threads = MIN(be->dma_map_threads, ctx.nr_chunks);
+    QemuThread *threads = g_new(QemuThread, nr_threads - 1);
+    uint32_t i;
+
+    trace_iommufd_backend_map_dma_parallel(be->fd, ioas_id, iova, size,
+                                           nr_threads, ctx.nr_chunks);
+
+    /* The calling thread takes part in the mapping as well */
+    for (i = 0; i < nr_threads - 1; i++) {
+        qemu_thread_create(&threads[i], "iommufd-map",
+                           iommufd_backend_map_dma_worker, &ctx,
+                           QEMU_THREAD_JOINABLE);
+    }
+    iommufd_backend_map_dma_worker(&ctx);
+    for (i = 0; i < nr_threads - 1; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_free(threads);
+
+    if (ctx.ret) {
+        /* Drop the chunks that did get mapped, leaving nothing behind */
+        struct iommu_ioas_unmap unmap = {
+            .size = sizeof(unmap),
+            .ioas_id = ioas_id,
+            .iova = iova,
+            .length = size,
+        };
+
+        if (ioctl(be->fd, IOMMU_IOAS_UNMAP, &unmap) && errno != ENOENT) {
+            error_report("IOMMU_IOAS_UNMAP of partial mapping failed: %m");
+        }
+    }
+
+    return ctx.ret;
+}
+
+int iommufd_backend_map_dma(IOMMUFDBackend *be, uint32_t ioas_id, hwaddr iova,
+                            ram_addr_t size, void *vaddr, bool readonly)
+{
+    int ret;
+
+    if (be->dma_map_threads > 1 && size >= 2 * IOMMUFD_DMA_MAP_CHUNK) {
+        ret = iommufd_backend_map_dma_parallel(be, ioas_id, iova, size,
+                                               vaddr, readonly);
+    } else {
+        ret = iommufd_backend_map_dma_one(be->fd, ioas_id, iova, size,
+                                          vaddr, readonly);
+    }
+
+    if (ret) {
         /* TODO: Not support mapping hardware PCI BAR region for now. */
-        if (errno == EFAULT) {
-            warn_report("IOMMU_IOAS_MAP failed: %m, PCI BAR?");
+        if (ret == -EFAULT) {
+            warn_report("IOMMU_IOAS_MAP failed: %s, PCI BAR?",
+                        strerror(-ret));
         } else {
-            error_report("IOMMU_IOAS_MAP failed: %m");
+            error_report("IOMMU_IOAS_MAP failed: %s", strerror(-ret));
         }
     }
     return ret;
 }
 
+/*
+ * Map [iova, iova + size) of @dst_ioas_id to the pages that are already
+ * pinned at the same IOVAs in @src_ioas_id.  No error is reported, so
+ * that callers can fall back to iommufd_backend_map_dma().
+ */
+int iommufd_backend_copy_dma(IOMMUFDBackend *be, uint32_t src_ioas_id,
+                             uint32_t dst_ioas_id, hwaddr iova,
+                             ram_addr_t size, bool readonly)
+{
+    int ret, fd = be->fd;
+    struct iommu_ioas_copy copy = {
+        .size = sizeof(copy),
+        .flags = IOMMU_IOAS_MAP_READABLE |
+                 IOMMU_IOAS_MAP_FIXED_IOVA,
+        .dst_ioas_id = dst_ioas_id,
+        .src_ioas_id = src_ioas_id,
+        .length = size,
+        .dst_iova = iova,
+        .src_iova = iova,
+    };
+
+    if (!readonly) {
+        copy.flags |= IOMMU_IOAS_MAP_WRITEABLE;
+    }
+
+    ret = ioctl(fd, IOMMU_IOAS_COPY, &copy);
+    trace_iommufd_backend_copy_dma(fd, src_ioas_id, dst_ioas_id, iova, size,
+                                   readonly, ret);
+    return ret ? -errno : 0;
+}
+
 int iommufd_backend_unmap_dma(IOMMUFDBackend *be, uint32_t ioas_id,
                               hwaddr iova, ram_addr_t size)
 {
@@ -302,6 +504,57 @@ int iommufd_backend_invalidate_dev_cache(IOMMUFDBackend *be, uint32_t dev_id,
     return ret;
 }
 
+int iommufd_backend_set_dirty_tracking(IOMMUFDBackend *be, uint32_t hwpt_id,
+                                       bool start)
+{
+    int ret, fd = be->fd;
+    struct iommu_hwpt_set_dirty_tracking set_dirty = {
+        .size = sizeof(set_dirty),
+        .hwpt_id = hwpt_id,
+        .flags = start ? IOMMU_HWPT_DIRTY_TRACKING_ENABLE : 0,
+    };
+
+    ret = ioctl(fd, IOMMU_HWPT_SET_DIRTY_TRACKING, &set_dirty);
+    trace_iommufd_backend_set_dirty_tracking(fd, hwpt_id, start, ret);
+    if (ret) {
+        ret = -errno;
+        error_report("IOMMU_HWPT_SET_DIRTY_TRACKING(hwpt_id %u) failed: %m",
+                     hwpt_id);
+    }
+
+    return ret;
+}
+
+/*
+ * The kernel only ever sets bits in @data, so the bitmaps of several hwpts
+ * backing the same IOAS can be gathered into a single buffer.
+ */
+int iommufd_backend_get_dirty_bitmap(IOMMUFDBackend *be, uint32_t hwpt_id,
+                                     uint64_t iova, uint64_t size,
+                                     uint64_t page_size, uint64_t *data)
+{
+    int ret, fd = be->fd;
+    struct iommu_hwpt_get_dirty_bitmap get_dirty_bitmap = {
+        .size = sizeof(get_dirty_bitmap),
+        .hwpt_id = hwpt_id,
+        .iova = iova,
+        .length = size,
+        .page_size = page_size,
+        .data = (uintptr_t)data,
+    };
+
+    ret = ioctl(fd, IOMMU_HWPT_GET_DIRTY_BITMAP, &get_dirty_bitmap);
+    trace_iommufd_backend_get_dirty_bitmap(fd, hwpt_id, iova, size,
+                                           page_size, ret);
+    if (ret) {
+        ret = -errno;
+        error_report("IOMMU_HWPT_GET_DIRTY_BITMAP (iova: 0x%"PRIx64
+                     " size: 0x%"PRIx64") failed: %m", iova, size);
+    }
+
+    return ret;
+}
+
 struct IOMMUFDViommu *iommufd_backend_alloc_viommu(IOMMUFDBackend *be,
                                                    uint32_t dev_id,
                                                    uint32_t viommu_type,
@@ -433,7 +686,8 @@ void iommufd_viommu_put_shared_page(IOMMUFDViommu *viommu,
 
 int iommufd_backend_get_device_info(IOMMUFDBackend *be, uint32_t devid,
                                     enum iommu_hw_info_type *type,
-                                    void *data, uint32_t len, Error **errp)
+                                    void *data, uint32_t len,
+                                    uint64_t *caps, Error **errp)
 {
     struct iommu_hw_info info = {
         .size = sizeof(info),
@@ -448,6 +702,9 @@ int iommufd_backend_get_device_info(IOMMUFDBackend *be, uint32_t devid,
         error_setg_errno(errp, errno, "Failed to get hardware info");
     } else {
         *type = info.out_data_type;
+        if (caps) {
+            *caps = info.out_capabilities;
+        }
     }
 
     return ret;
@@ -459,6 +716,7 @@ void hiod_iommufd_init(HIODIOMMUFD *idev, IOMMUFDBackend *iommufd,
     idev->iommufd = iommufd;
     idev->devid = devid;
     idev->ioas_id = ioas_id;
+    idev->dirty_hwpt_id = 0;
 }
 
 int hiod_iommufd_attach_hwpt(HIODIOMMUFD *idev, uint32_t hwpt_id, Error **errp)
@@ -488,7 +746,8 @@ static int hiod_iommufd_get_host_iommu_info(HostIOMMUDevice *hiod,
 
     return iommufd_backend_get_device_info(idev->iommufd, idev->devid,
                                            &info->type, &info->data,
-                                           sizeof(info->data), errp);
+                                           sizeof(info->data), &info->caps,
+                                           errp);
 }
 
 static void hiod_iommufd_class_init(ObjectClass *oc, void *data)
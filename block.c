@@ -428,6 +428,7 @@ BlockDriverState *bdrv_new(void)
 
     qemu_co_mutex_init(&bs->bsc_modify_lock);
     bs->block_status_cache = g_new0(BdrvBlockStatusCache, 1);
+    qemu_mutex_init(&bs->csc_lock);
 
     for (i = 0; i < bdrv_drain_all_count; i++) {
         bdrv_drained_begin(bs);
@@ -2973,6 +2974,11 @@ bdrv_replace_child_noperm(BdrvChild *child, BlockDriverState *new_bs)
         }
     }
 
+    /* The chain below the parent changed */
+    if (child->klass == &child_of_bds) {
+        bdrv_csc_invalidate_range(child->opaque, 0, INT64_MAX);
+    }
+
     /*
      * If the parent was drained through this BdrvChild previously, but new_bs
      * is not drained, allow requests to come in only after the new node has
@@ -5139,6 +5145,7 @@ static void bdrv_close(BlockDriverState *bs)
     bs->full_open_options = NULL;
     g_free(bs->block_status_cache);
     bs->block_status_cache = NULL;
+    qemu_mutex_destroy(&bs->csc_lock);
 
     bdrv_release_named_dirty_bitmaps(bs);
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
@@ -6888,6 +6895,7 @@ int coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs, Error **errp)
 
     if (bs->drv->bdrv_co_invalidate_cache) {
         bs->drv->bdrv_co_invalidate_cache(bs, &local_err);
+        bdrv_csc_invalidate_range(bs, 0, INT64_MAX);
         if (local_err) {
             error_propagate(errp, local_err);
             return -EINVAL;
@@ -8165,6 +8173,7 @@ int bdrv_make_empty(BdrvChild *c, Error **errp)
     }
 
     ret = drv->bdrv_make_empty(c->bs);
+    bdrv_csc_invalidate_range(c->bs, 0, INT64_MAX);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to empty %s",
                          c->bs->filename);
@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "sysemu/qtest.h"
 
@@ -200,6 +201,21 @@ void block_latency_histograms_clear(BlockAcctStats *stats)
     }
 }
 
+/*
+ * Copy the log2 latency histogram of @type, BLOCK_LATENCY_LOG2_BUCKETS
+ * numbers, to @hist.
+ */
+void block_acct_get_latency_log2(BlockAcctStats *stats,
+                                 enum BlockAcctType type, uint64_t *hist)
+{
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    WITH_QEMU_LOCK_GUARD(&stats->lock) {
+        memcpy(hist, stats->latency_log2[type],
+               sizeof(stats->latency_log2[type]));
+    }
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
@@ -229,6 +245,14 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                         latency_ns);
 
         if (!failed || stats->account_failed) {
+            unsigned int bucket = 0;
+
+            if (latency_ns > 1) {
+                bucket = MIN(63 - clz64(latency_ns),
+                             BLOCK_LATENCY_LOG2_BUCKETS - 1);
+            }
+            stats->latency_log2[cookie->type][bucket]++;
+
             stats->total_time_ns[cookie->type] += latency_ns;
             stats->last_access_time_ns = time_ns;
 
@@ -336,6 +336,21 @@ static bool backup_cancel(Job *job, bool force)
     return true;
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+    int64_t chunk_size;
+    uint64_t throughput;
+    int workers;
+
+    block_copy_get_stats(s->bcs, &chunk_size, &workers, &throughput);
+    info->u.backup = (BlockJobInfoBackup) {
+        .chunk_size = chunk_size,
+        .workers = MIN(workers, s->perf.max_workers),
+        .throughput = throughput,
+    };
+}
+
 static const BlockJobDriver backup_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(BackupBlockJob),
@@ -350,6 +365,7 @@ static const BlockJobDriver backup_job_driver = {
         .cancel                 = backup_cancel,
     },
     .set_speed = backup_set_speed,
+    .query = backup_query,
 };
 
 BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
@@ -492,6 +508,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->perf = *perf;
 
     block_copy_set_copy_opts(bcs, perf->use_copy_range, compress);
+    block_copy_set_adaptive(bcs, perf->adaptive);
+    block_copy_set_dedup(bcs, perf->dedup);
     block_copy_set_progress_meter(bcs, &job->common.job.progress);
     block_copy_set_speed(bcs, speed);
 
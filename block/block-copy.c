@@ -18,10 +18,13 @@
 #include "qapi/error.h"
 #include "block/block-copy.h"
 #include "block/block_int-io.h"
+#include "block/dedup.h"
 #include "block/dirty-bitmap.h"
 #include "block/reqlist.h"
 #include "sysemu/block-backend.h"
 #include "qemu/units.h"
+#include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "qemu/co-shared-resource.h"
 #include "qemu/coroutine.h"
 #include "qemu/ratelimit.h"
@@ -36,6 +39,12 @@
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 #define BLOCK_COPY_CLUSTER_SIZE_DEFAULT (1 << 16)
 
+/* Adaptive sizing, see block_copy_adapt() */
+#define BLOCK_COPY_ADAPT_MAX_BUFFER (16 * MiB)
+#define BLOCK_COPY_ADAPT_WINDOW NANOSECONDS_PER_SECOND
+#define BLOCK_COPY_ADAPT_WINDOW_TASKS 4
+#define BLOCK_COPY_ADAPT_STEADY_WINDOWS 10
+
 typedef enum {
     COPY_READ_WRITE_CLUSTER,
     COPY_READ_WRITE,
@@ -44,6 +53,25 @@ typedef enum {
     COPY_RANGE_FULL
 } BlockCopyMethod;
 
+typedef enum {
+    BLOCK_COPY_ADAPT_GROW_CHUNK,
+    BLOCK_COPY_ADAPT_SHRINK_WORKERS,
+    BLOCK_COPY_ADAPT_STEADY,
+} BlockCopyAdaptPhase;
+
+typedef struct BlockCopyAdapt {
+    BlockCopyAdaptPhase phase;
+    int64_t chunk;              /* size of buffered copy requests */
+    int64_t max_chunk;
+    int workers;                /* requests in flight per call */
+    uint64_t base_throughput;   /* before the step being tried, bytes/s */
+    uint64_t throughput;        /* of the last window, bytes/s */
+    int steady_windows;
+    int64_t window_start;
+    uint64_t window_bytes;
+    int window_tasks;
+} BlockCopyAdapt;
+
 static coroutine_fn int block_copy_task_entry(AioTask *task);
 
 typedef struct BlockCopyCallState {
@@ -159,6 +187,17 @@ typedef struct BlockCopyState {
     ProgressMeter *progress;
     SharedResource *mem;
     RateLimit rate_limit;
+
+    /*
+     * The throughput is measured in any case, @adaptive only enables
+     * tuning the chunk size and the number of workers after it.
+     * Protected by lock, and read with atomics by block_copy_get_stats().
+     */
+    bool adaptive;
+    BlockCopyAdapt adapt;
+
+    /* Clusters already written to the target, if deduplicating */
+    BlockDedup *dedup;
 } BlockCopyState;
 
 /* Called with lock held */
@@ -168,6 +207,10 @@ static int64_t block_copy_chunk_size(BlockCopyState *s)
     case COPY_READ_WRITE_CLUSTER:
         return s->cluster_size;
     case COPY_READ_WRITE:
+        if (s->adaptive) {
+            return s->adapt.chunk;
+        }
+        /* fall through */
     case COPY_RANGE_SMALL:
         return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER),
                    s->max_transfer);
@@ -180,6 +223,83 @@ static int64_t block_copy_chunk_size(BlockCopyState *s)
     }
 }
 
+/*
+ * Called with lock held when a task that copied data completes.
+ *
+ * The throughput is measured over windows of at least a second.  When
+ * adaptive, each window judges the step tried in the previous one: first
+ * the chunk size is doubled for as long as it is worth more than 5%, then
+ * the number of workers is halved for as long as it costs less than 5%,
+ * since fewer requests in flight mean less queueing in a slow target.
+ * The first step that does not pay off is undone.  The probing starts
+ * again after a while, or earlier if the throughput drops by a fifth.
+ */
+static void block_copy_adapt(BlockCopyState *s, int64_t bytes)
+{
+    BlockCopyAdapt *a = &s->adapt;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t throughput;
+
+    a->window_bytes += bytes;
+    a->window_tasks++;
+    if (now - a->window_start < BLOCK_COPY_ADAPT_WINDOW ||
+        a->window_tasks < BLOCK_COPY_ADAPT_WINDOW_TASKS) {
+        return;
+    }
+
+    throughput = muldiv64(a->window_bytes, NANOSECONDS_PER_SECOND,
+                          now - a->window_start);
+    qatomic_set(&a->throughput, throughput);
+    a->window_start = now;
+    a->window_bytes = 0;
+    a->window_tasks = 0;
+
+    if (!s->adaptive) {
+        return;
+    }
+
+    switch (a->phase) {
+    case BLOCK_COPY_ADAPT_GROW_CHUNK:
+        if (a->base_throughput && throughput * 20 <= a->base_throughput * 21) {
+            qatomic_set(&a->chunk, a->chunk / 2);
+        } else if (a->chunk * 2 <= a->max_chunk) {
+            a->base_throughput = throughput;
+            qatomic_set(&a->chunk, a->chunk * 2);
+            break;
+        }
+        a->phase = BLOCK_COPY_ADAPT_SHRINK_WORKERS;
+        a->base_throughput = 0;
+        break;
+
+    case BLOCK_COPY_ADAPT_SHRINK_WORKERS:
+        if (a->base_throughput && throughput * 20 < a->base_throughput * 19) {
+            qatomic_set(&a->workers, a->workers * 2);
+        } else if (a->workers > 1) {
+            /* Compare against the throughput before the first step */
+            if (!a->base_throughput) {
+                a->base_throughput = throughput;
+            }
+            qatomic_set(&a->workers, a->workers / 2);
+            break;
+        }
+        a->phase = BLOCK_COPY_ADAPT_STEADY;
+        a->base_throughput = throughput;
+        a->steady_windows = 0;
+        break;
+
+    case BLOCK_COPY_ADAPT_STEADY:
+        if (++a->steady_windows >= BLOCK_COPY_ADAPT_STEADY_WINDOWS ||
+            throughput * 5 < a->base_throughput * 4) {
+            a->phase = BLOCK_COPY_ADAPT_GROW_CHUNK;
+            a->base_throughput = 0;
+            qatomic_set(&a->workers, BLOCK_COPY_MAX_WORKERS);
+        }
+        break;
+    }
+
+    trace_block_copy_adapt(s, throughput, a->chunk, a->workers);
+}
+
 /*
  * Search for the first dirty area in offset/bytes range and create task at
  * the beginning of it.
@@ -269,6 +389,7 @@ void block_copy_state_free(BlockCopyState *s)
     }
 
     ratelimit_destroy(&s->rate_limit);
+    block_dedup_free(s->dedup);
     bdrv_release_dirty_bitmap(s->copy_bitmap);
     shres_destroy(s->mem);
     g_free(s);
@@ -281,6 +402,32 @@ static uint32_t block_copy_max_transfer(BdrvChild *source, BdrvChild *target)
                                      target->bs->bl.max_transfer));
 }
 
+/* Only set before running the job, no need for locking. */
+void block_copy_set_adaptive(BlockCopyState *s, bool adaptive)
+{
+    s->adaptive = adaptive;
+}
+
+/* Only set before running the job, no need for locking. */
+void block_copy_set_dedup(BlockCopyState *s, bool dedup)
+{
+    /* Compressed writes need the data */
+    if (dedup && !(s->write_flags & BDRV_REQ_WRITE_COMPRESSED)) {
+        s->dedup = s->dedup ?: block_dedup_new();
+    } else {
+        block_dedup_free(s->dedup);
+        s->dedup = NULL;
+    }
+}
+
+void block_copy_get_stats(BlockCopyState *s, int64_t *chunk_size,
+                          int *workers, uint64_t *throughput)
+{
+    *chunk_size = qatomic_read(&s->adapt.chunk);
+    *workers = qatomic_read(&s->adapt.workers);
+    *throughput = qatomic_read(&s->adapt.throughput);
+}
+
 void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
                               bool compress)
 {
@@ -419,6 +566,16 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
 
     block_copy_set_copy_opts(s, false, false);
 
+    s->adapt = (BlockCopyAdapt) {
+        .phase = BLOCK_COPY_ADAPT_GROW_CHUNK,
+        .chunk = MIN(MAX(cluster_size, BLOCK_COPY_MAX_BUFFER),
+                     s->max_transfer),
+        .max_chunk = MIN(MAX(cluster_size, BLOCK_COPY_ADAPT_MAX_BUFFER),
+                         s->max_transfer),
+        .workers = BLOCK_COPY_MAX_WORKERS,
+        .window_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME),
+    };
+
     ratelimit_init(&s->rate_limit);
     qemu_co_mutex_init(&s->lock);
     QLIST_INIT(&s->reqs);
@@ -465,6 +622,91 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
     return 0;
 }
 
+static int coroutine_fn GRAPH_RDLOCK
+block_copy_write_run(BlockCopyState *s, int64_t offset, int64_t bytes,
+                     uint8_t *buf)
+{
+    if (!bytes) {
+        return 0;
+    }
+    return bdrv_co_pwrite(s->target, offset, bytes, buf, s->write_flags);
+}
+
+/*
+ * Write @buf to @offset of the target.  Zeroed clusters are written as
+ * zeroes, and clusters with the same content as one written earlier are
+ * copied from there within the target, so that copy offloading can share
+ * the storage.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+block_copy_write_dedup(BlockCopyState *s, int64_t offset, int64_t bytes,
+                       uint8_t *buf)
+{
+    int64_t nr = DIV_ROUND_UP(bytes, s->cluster_size);
+    g_autofree BlockDedupHash *hashes = g_new(BlockDedupHash, nr);
+    g_autofree bool *insert = g_new0(bool, nr);
+    int64_t pos, run = 0, i;
+    int ret;
+
+    for (i = 0, pos = 0; i < nr; i++, pos += s->cluster_size) {
+        int64_t len = MIN(s->cluster_size, bytes - pos);
+        int64_t src;
+
+        if (len < s->cluster_size) {
+            /* Partial cluster at the end of the image */
+            break;
+        }
+
+        if (buffer_is_zero(buf + pos, len)) {
+            ret = block_copy_write_run(s, offset + run, pos - run, buf + run);
+            if (ret < 0) {
+                return ret;
+            }
+            ret = bdrv_co_pwrite_zeroes(s->target, offset + pos, len,
+                                        s->write_flags | BDRV_REQ_MAY_UNMAP);
+            if (ret < 0) {
+                return ret;
+            }
+            run = pos + len;
+            continue;
+        }
+
+        block_dedup_hash(buf + pos, len, &hashes[i]);
+        src = block_dedup_find(s->dedup, &hashes[i]);
+        if (src >= 0) {
+            ret = block_copy_write_run(s, offset + run, pos - run, buf + run);
+            if (ret < 0) {
+                return ret;
+            }
+            run = pos;
+            ret = bdrv_co_copy_range(s->target, src, s->target, offset + pos,
+                                     len, 0, s->write_flags);
+            if (ret >= 0) {
+                trace_block_copy_dedup(s, offset + pos, src);
+                run = pos + len;
+                continue;
+            }
+            /* Write the data instead */
+            trace_block_copy_copy_range_fail(s, offset + pos, ret);
+        }
+        insert[i] = true;
+    }
+
+    ret = block_copy_write_run(s, offset + run, bytes - run, buf + run);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Only now can other requests copy from these clusters */
+    for (i = 0; i < nr; i++) {
+        if (insert[i]) {
+            block_dedup_insert(s->dedup, &hashes[i],
+                               offset + i * s->cluster_size);
+        }
+    }
+    return 0;
+}
+
 /*
  * block_copy_do_copy
  *
@@ -539,8 +781,12 @@ block_copy_do_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
             goto out;
         }
 
-        ret = bdrv_co_pwrite(s->target, offset, nbytes, bounce_buffer,
-                             s->write_flags);
+        if (s->dedup) {
+            ret = block_copy_write_dedup(s, offset, nbytes, bounce_buffer);
+        } else {
+            ret = bdrv_co_pwrite(s->target, offset, nbytes, bounce_buffer,
+                                 s->write_flags);
+        }
         if (ret < 0) {
             trace_block_copy_write_fail(s, offset, ret);
             *error_is_read = false;
@@ -581,8 +827,13 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
                 t->call_state->ret = ret;
                 t->call_state->error_is_read = error_is_read;
             }
-        } else if (s->progress) {
-            progress_work_done(s->progress, t->req.bytes);
+        } else {
+            if (s->progress) {
+                progress_work_done(s->progress, t->req.bytes);
+            }
+            if (t->method != COPY_WRITE_ZEROES) {
+                block_copy_adapt(s, t->req.bytes);
+            }
         }
     }
     co_put_to_shres(s->mem, t->req.bytes);
@@ -796,6 +1047,10 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
         if (!aio && bytes) {
             aio = aio_task_pool_new(call_state->max_workers);
         }
+        if (aio && s->adaptive) {
+            aio_task_pool_set_max_busy_tasks(aio,
+                MIN(call_state->max_workers, qatomic_read(&s->adapt.workers)));
+        }
 
         ret = block_copy_task_run(aio, task);
         if (ret < 0) {
@@ -15,6 +15,7 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "trace.h"
+#include "block/aio_task.h"
 #include "block/block_int.h"
 #include "block/blockjob_int.h"
 #include "qapi/error.h"
@@ -31,6 +32,12 @@ enum {
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
 };
 
+typedef struct CommitRange {
+    int64_t offset;
+    int64_t bytes;
+    QSIMPLEQ_ENTRY(CommitRange) next;
+} CommitRange;
+
 typedef struct CommitBlockJob {
     BlockJob common;
     BlockDriverState *commit_top_bs;
@@ -43,8 +50,99 @@ typedef struct CommitBlockJob {
     bool chain_frozen;
     char *backing_file_str;
     bool backing_mask_protocol;
+
+    int max_workers;
+    int64_t chunk;
+    AioTaskPool *aio;
+    /* Areas to copy again once the job is resumed after an error */
+    QSIMPLEQ_HEAD(, CommitRange) retry;
+    int ret; /* Error that was reported, stop copying */
 } CommitBlockJob;
 
+typedef struct CommitTask {
+    AioTask task;
+    CommitBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+} CommitTask;
+
+static void coroutine_fn commit_error_action(CommitBlockJob *s,
+                                             int64_t offset, int64_t bytes,
+                                             bool error_in_source, int ret)
+{
+    BlockErrorAction action =
+        block_job_error_action(&s->common, s->on_error, error_in_source, -ret);
+    CommitRange *r;
+
+    if (action == BLOCK_ERROR_ACTION_REPORT) {
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+        return;
+    }
+
+    r = g_new(CommitRange, 1);
+    r->offset = offset;
+    r->bytes = bytes;
+    QSIMPLEQ_INSERT_TAIL(&s->retry, r, next);
+}
+
+static int coroutine_fn commit_task_entry(AioTask *task)
+{
+    CommitTask *t = container_of(task, CommitTask, task);
+    CommitBlockJob *s = t->s;
+    QEMU_AUTO_VFREE void *buf = blk_blockalign(s->top, t->bytes);
+    bool error_in_source = true;
+    int ret;
+
+    assert(t->bytes < SIZE_MAX);
+
+    ret = blk_co_pread(s->top, t->offset, t->bytes, buf, 0);
+    if (ret >= 0) {
+        ret = blk_co_pwrite(s->base, t->offset, t->bytes, buf, 0);
+        if (ret < 0) {
+            error_in_source = false;
+        }
+    }
+    if (ret < 0) {
+        commit_error_action(s, t->offset, t->bytes, error_in_source, ret);
+        return 0;
+    }
+
+    /* Publish progress */
+    job_progress_update(&s->common.job, t->bytes);
+    return 0;
+}
+
+/*
+ * Copy the area in the background, after waiting for one of the requests
+ * in flight if there are already max_workers of them.
+ */
+static void coroutine_fn commit_copy(CommitBlockJob *s, int64_t offset,
+                                     int64_t bytes)
+{
+    CommitTask *t = g_new(CommitTask, 1);
+
+    *t = (CommitTask) {
+        .task.func = commit_task_entry,
+        .s = s,
+        .offset = offset,
+        .bytes = bytes,
+    };
+    aio_task_pool_start_task(s->aio, &t->task);
+    block_job_ratelimit_processed_bytes(&s->common, bytes);
+}
+
+/* Requests are not kept in flight while the job is paused */
+static void coroutine_fn commit_pause(Job *job)
+{
+    CommitBlockJob *s = container_of(job, CommitBlockJob, common.job);
+
+    if (s->aio) {
+        aio_task_pool_wait_all(s->aio);
+    }
+}
+
 static int commit_prepare(Job *job)
 {
     CommitBlockJob *s = container_of(job, CommitBlockJob, common.job);
@@ -129,10 +227,10 @@ static void commit_clean(Job *job)
 static int coroutine_fn commit_run(Job *job, Error **errp)
 {
     CommitBlockJob *s = container_of(job, CommitBlockJob, common.job);
-    int64_t offset;
+    CommitRange *r;
+    int64_t offset = 0;
     int ret = 0;
     int64_t n = 0; /* bytes */
-    QEMU_AUTO_VFREE void *buf = NULL;
     int64_t len, base_len;
 
     len = blk_co_getlength(s->top);
@@ -153,55 +251,67 @@ static int coroutine_fn commit_run(Job *job, Error **errp)
         }
     }
 
-    buf = blk_blockalign(s->top, COMMIT_BUFFER_SIZE);
-
-    for (offset = 0; offset < len; offset += n) {
-        bool copy;
-        bool error_in_source = true;
+    s->aio = aio_task_pool_new(s->max_workers);
 
+    for (;;) {
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.  commit_pause() waits for
+         * the requests in flight before the job pauses.
          */
         block_job_ratelimit_sleep(&s->common);
-        if (job_is_cancelled(&s->common.job)) {
+        if (job_is_cancelled(&s->common.job) || s->ret < 0) {
             break;
         }
+
+        r = QSIMPLEQ_FIRST(&s->retry);
+        if (r) {
+            QSIMPLEQ_REMOVE_HEAD(&s->retry, next);
+            commit_copy(s, r->offset, r->bytes);
+            g_free(r);
+            continue;
+        }
+
+        if (offset >= len) {
+            if (aio_task_pool_empty(s->aio)) {
+                break;
+            }
+            /* Failed requests may still have to be retried */
+            aio_task_pool_wait_one(s->aio);
+            continue;
+        }
+
         /* Copy if allocated above the base */
         ret = blk_co_is_allocated_above(s->top, s->base_overlay, true,
-                                        offset, COMMIT_BUFFER_SIZE, &n);
-        copy = (ret > 0);
+                                        offset, s->chunk, &n);
         trace_commit_one_iteration(s, offset, n, ret);
-        if (copy) {
-            assert(n < SIZE_MAX);
-
-            ret = blk_co_pread(s->top, offset, n, buf, 0);
-            if (ret >= 0) {
-                ret = blk_co_pwrite(s->base, offset, n, buf, 0);
-                if (ret < 0) {
-                    error_in_source = false;
-                }
-            }
-        }
         if (ret < 0) {
             BlockErrorAction action =
-                block_job_error_action(&s->common, s->on_error,
-                                       error_in_source, -ret);
+                block_job_error_action(&s->common, s->on_error, true, -ret);
             if (action == BLOCK_ERROR_ACTION_REPORT) {
-                return ret;
-            } else {
-                n = 0;
-                continue;
+                s->ret = ret;
+                break;
             }
+            continue;
         }
-        /* Publish progress */
-        job_progress_update(&s->common.job, n);
-
-        if (copy) {
-            block_job_ratelimit_processed_bytes(&s->common, n);
+        if (ret > 0) {
+            commit_copy(s, offset, n);
+        } else {
+            /* Publish progress */
+            job_progress_update(&s->common.job, n);
         }
+        offset += n;
     }
 
-    return 0;
+    aio_task_pool_wait_all(s->aio);
+    aio_task_pool_free(s->aio);
+    s->aio = NULL;
+
+    while ((r = QSIMPLEQ_FIRST(&s->retry))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->retry, next);
+        g_free(r);
+    }
+
+    return s->ret;
 }
 
 static const BlockJobDriver commit_job_driver = {
@@ -213,7 +323,8 @@ static const BlockJobDriver commit_job_driver = {
         .run           = commit_run,
         .prepare       = commit_prepare,
         .abort         = commit_abort,
-        .clean         = commit_clean
+        .clean         = commit_clean,
+        .pause         = commit_pause,
     },
 };
 
@@ -257,7 +368,8 @@ void commit_start(const char *job_id, BlockDriverState *bs,
                   int creation_flags, int64_t speed,
                   BlockdevOnError on_error, const char *backing_file_str,
                   bool backing_mask_protocol,
-                  const char *filter_node_name, Error **errp)
+                  const char *filter_node_name,
+                  const BackingChainPerf *perf, Error **errp)
 {
     CommitBlockJob *s;
     BlockDriverState *iter;
@@ -278,6 +390,17 @@ void commit_start(const char *job_id, BlockDriverState *bs,
     }
     bdrv_graph_rdunlock_main_loop();
 
+    if (perf->max_workers < 1 || perf->max_workers > INT_MAX) {
+        error_setg(errp, "max-workers must be between 1 and %d", INT_MAX);
+        return;
+    }
+
+    if (perf->max_chunk < 0 || perf->max_chunk > BDRV_REQUEST_MAX_BYTES) {
+        error_setg(errp, "max-chunk must be between 0 (which means the "
+                   "default) and %d", (int)BDRV_REQUEST_MAX_BYTES);
+        return;
+    }
+
     base_size = bdrv_getlength(base);
     if (base_size < 0) {
         error_setg_errno(errp, -base_size, "Could not inquire base image size");
@@ -413,6 +536,9 @@ void commit_start(const char *job_id, BlockDriverState *bs,
     s->backing_file_str = g_strdup(backing_file_str);
     s->backing_mask_protocol = backing_mask_protocol;
     s->on_error = on_error;
+    s->max_workers = perf->max_workers;
+    s->chunk = perf->max_chunk ?: COMMIT_BUFFER_SIZE;
+    QSIMPLEQ_INIT(&s->retry);
 
     trace_commit_start(bs, base, top, s);
     job_start(&s->common.job);
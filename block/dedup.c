@@ -0,0 +1,95 @@
+/*
+ * Table of cluster contents already written to a target
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "block/dedup.h"
+#include "crypto/hash.h"
+#include "qapi/error.h"
+#include "qemu/thread.h"
+
+typedef struct BlockDedupEntry {
+    BlockDedupHash hash;
+    int64_t offset;
+} BlockDedupEntry;
+
+struct BlockDedup {
+    QemuMutex lock;
+    GHashTable *entries;
+};
+
+static guint block_dedup_entry_hash(gconstpointer key)
+{
+    const BlockDedupEntry *e = key;
+    guint h;
+
+    /* The content hash is uniformly distributed already */
+    memcpy(&h, e->hash.data, sizeof(h));
+    return h;
+}
+
+static gboolean block_dedup_entry_equal(gconstpointer a, gconstpointer b)
+{
+    const BlockDedupEntry *x = a, *y = b;
+
+    return !memcmp(&x->hash, &y->hash, sizeof(x->hash));
+}
+
+BlockDedup *block_dedup_new(void)
+{
+    BlockDedup *d = g_new0(BlockDedup, 1);
+
+    qemu_mutex_init(&d->lock);
+    d->entries = g_hash_table_new_full(block_dedup_entry_hash,
+                                       block_dedup_entry_equal,
+                                       g_free, NULL);
+    return d;
+}
+
+void block_dedup_free(BlockDedup *d)
+{
+    if (!d) {
+        return;
+    }
+    g_hash_table_destroy(d->entries);
+    qemu_mutex_destroy(&d->lock);
+    g_free(d);
+}
+
+void block_dedup_hash(const void *buf, size_t len, BlockDedupHash *hash)
+{
+    g_autofree uint8_t *result = NULL;
+    size_t result_len = 0;
+
+    /* SHA-256 is always available, so this cannot fail */
+    qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, buf, len, &result,
+                       &result_len, &error_abort);
+    assert(result_len == sizeof(hash->data));
+    memcpy(hash->data, result, sizeof(hash->data));
+}
+
+int64_t block_dedup_find(BlockDedup *d, const BlockDedupHash *hash)
+{
+    BlockDedupEntry key = { .hash = *hash };
+    BlockDedupEntry *e;
+
+    QEMU_LOCK_GUARD(&d->lock);
+    e = g_hash_table_lookup(d->entries, &key);
+    return e ? e->offset : -1;
+}
+
+void block_dedup_insert(BlockDedup *d, const BlockDedupHash *hash,
+                        int64_t offset)
+{
+    BlockDedupEntry key = { .hash = *hash, .offset = offset };
+
+    QEMU_LOCK_GUARD(&d->lock);
+    /* Keep the first cluster with this content */
+    if (g_hash_table_size(d->entries) >= BLOCK_DEDUP_MAX_ENTRIES ||
+        g_hash_table_contains(d->entries, &key)) {
+        return;
+    }
+    g_hash_table_add(d->entries, g_memdup2(&key, sizeof(key)));
+}
@@ -14,8 +14,11 @@
 #include <sys/eventfd.h>
 
 #include "qapi/error.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qapi-visit-common.h"
 #include "block/export.h"
 #include "qemu/error-report.h"
+#include "sysemu/iothread.h"
 #include "util/block-helpers.h"
 #include "subprojects/libvduse/libvduse.h"
 #include "virtio-blk-handler.h"
@@ -33,6 +36,15 @@ typedef struct VduseBlkExport {
     char *recon_file;
     unsigned int inflight; /* atomic */
     bool vqs_started;
+
+    /* The AioContext of each virtqueue, NULL for the export's AioContext */
+    IOThreadVirtQueueMappingList *iothread_vq_mapping_list;
+    AioContext **vq_aio_context;
+
+    /* Handles a VDUSE message while the virtqueues are paused */
+    Coroutine *dev_co;
+    bool vqs_paused;
+    bool wait_idle; /* atomic */
 } VduseBlkExport;
 
 typedef struct VduseBlkReq {
@@ -54,11 +66,28 @@ static void vduse_blk_inflight_dec(VduseBlkExport *vblk_exp)
         /* Wake AIO_WAIT_WHILE() */
         aio_wait_kick();
 
+        /* Wake vduse_blk_wait_idle() */
+        if (qatomic_xchg(&vblk_exp->wait_idle, false)) {
+            aio_co_wake(vblk_exp->dev_co);
+        }
+
         /* Now the export can be deleted */
         blk_exp_unref(&vblk_exp->export);
     }
 }
 
+static AioContext *vduse_blk_vq_ctx(VduseBlkExport *vblk_exp, VduseVirtq *vq)
+{
+    if (vblk_exp->vq_aio_context) {
+        for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
+            if (vduse_dev_get_queue(vblk_exp->dev, i) == vq) {
+                return vblk_exp->vq_aio_context[i];
+            }
+        }
+    }
+    return vblk_exp->export.ctx;
+}
+
 static void vduse_blk_req_complete(VduseBlkReq *req, size_t in_len)
 {
     vduse_queue_push(req->vq, &req->elem, in_len);
@@ -132,11 +161,15 @@ static void vduse_blk_enable_queue(VduseDev *dev, VduseVirtq *vq)
 {
     VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
 
-    if (!vblk_exp->vqs_started) {
-        return; /* vduse_blk_drained_end() will start vqs later */
+    if (!vblk_exp->vqs_started || vblk_exp->vqs_paused) {
+        /*
+         * vduse_blk_drained_end() or vduse_blk_resume_virtqueues() will
+         * start vqs later
+         */
+        return;
     }
 
-    aio_set_fd_handler(vblk_exp->export.ctx, vduse_queue_get_fd(vq),
+    aio_set_fd_handler(vduse_blk_vq_ctx(vblk_exp, vq), vduse_queue_get_fd(vq),
                        on_vduse_vq_kick, NULL, NULL, NULL, vq);
     /* Make sure we don't miss any kick after reconnecting */
     eventfd_write(vduse_queue_get_fd(vq), 1);
@@ -151,7 +184,7 @@ static void vduse_blk_disable_queue(VduseDev *dev, VduseVirtq *vq)
         return;
     }
 
-    aio_set_fd_handler(vblk_exp->export.ctx, fd,
+    aio_set_fd_handler(vduse_blk_vq_ctx(vblk_exp, vq), fd,
                        NULL, NULL, NULL, NULL, NULL);
 }
 
@@ -160,15 +193,118 @@ static const VduseOps vduse_blk_ops = {
     .disable_queue = vduse_blk_disable_queue,
 };
 
+static void vduse_blk_stop_vq_bh(void *opaque)
+{
+    VduseVirtq *vq = opaque;
+    VduseBlkExport *vblk_exp = vduse_dev_get_priv(vduse_queue_get_dev(vq));
+    int fd = vduse_queue_get_fd(vq);
+
+    if (fd >= 0) {
+        aio_set_fd_handler(qemu_get_current_aio_context(), fd,
+                           NULL, NULL, NULL, NULL, NULL);
+    }
+    vduse_blk_inflight_dec(vblk_exp);
+}
+
+static void vduse_blk_stop_virtqueues_now(VduseBlkExport *vblk_exp)
+{
+    for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
+        VduseVirtq *vq = vduse_dev_get_queue(vblk_exp->dev, i);
+
+        if (vblk_exp->vq_aio_context) {
+            /*
+             * on_vduse_vq_kick() may be running in the virtqueue's thread,
+             * so remove it from there.  The BH counts as in flight.
+             */
+            vduse_blk_inflight_inc(vblk_exp);
+            aio_bh_schedule_oneshot(vblk_exp->vq_aio_context[i],
+                                    vduse_blk_stop_vq_bh, vq);
+        } else {
+            vduse_blk_disable_queue(vblk_exp->dev, vq);
+        }
+    }
+}
+
+static void vduse_blk_start_virtqueues_now(VduseBlkExport *vblk_exp)
+{
+    for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
+        VduseVirtq *vq = vduse_dev_get_queue(vblk_exp->dev, i);
+        vduse_blk_enable_queue(vblk_exp->dev, vq);
+    }
+}
+
+static void on_vduse_dev_kick(void *opaque);
+
+/* Called from vblk_exp->dev_co */
+static void coroutine_fn vduse_blk_wait_idle(VduseBlkExport *vblk_exp)
+{
+    while (qatomic_load_acquire(&vblk_exp->inflight) > 0) {
+        qatomic_set_mb(&vblk_exp->wait_idle, true);
+        if (!qatomic_load_acquire(&vblk_exp->inflight) &&
+            qatomic_xchg(&vblk_exp->wait_idle, false)) {
+            /* The last request completed before seeing wait_idle */
+            break;
+        }
+        qemu_coroutine_yield();
+    }
+}
+
+static void coroutine_fn vduse_blk_dev_co(void *opaque)
+{
+    VduseBlkExport *vblk_exp = opaque;
+
+    /*
+     * Messages can update the IOTLB and the rings, so the virtqueues that
+     * run in other threads must be stopped and idle while handling them.
+     */
+    vblk_exp->vqs_paused = true;
+    if (vblk_exp->vqs_started) {
+        vduse_blk_stop_virtqueues_now(vblk_exp);
+    }
+    vduse_blk_wait_idle(vblk_exp);
+
+    vduse_dev_handler(vblk_exp->dev);
+
+    vblk_exp->vqs_paused = false;
+    if (vblk_exp->vqs_started) {
+        vduse_blk_start_virtqueues_now(vblk_exp);
+    }
+
+    vblk_exp->dev_co = NULL;
+    if (vblk_exp->export.ctx) {
+        aio_set_fd_handler(vblk_exp->export.ctx,
+                           vduse_dev_get_fd(vblk_exp->dev),
+                           on_vduse_dev_kick, NULL, NULL, NULL,
+                           vblk_exp->dev);
+    }
+    aio_wait_kick();
+    blk_exp_unref(&vblk_exp->export);
+}
+
 static void on_vduse_dev_kick(void *opaque)
 {
     VduseDev *dev = opaque;
+    VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
+
+    if (!vblk_exp->vq_aio_context) {
+        vduse_dev_handler(dev);
+        return;
+    }
 
-    vduse_dev_handler(dev);
+    /* vduse_blk_dev_co() reads the next message once it is done */
+    aio_set_fd_handler(vblk_exp->export.ctx, vduse_dev_get_fd(dev),
+                       NULL, NULL, NULL, NULL, NULL);
+    blk_exp_ref(&vblk_exp->export);
+    vblk_exp->dev_co = qemu_coroutine_create(vduse_blk_dev_co, vblk_exp);
+    qemu_coroutine_enter(vblk_exp->dev_co);
 }
 
 static void vduse_blk_attach_ctx(VduseBlkExport *vblk_exp, AioContext *ctx)
 {
+    if (vblk_exp->dev_co) {
+        return; /* vduse_blk_dev_co() will set up the handler */
+    }
+
     aio_set_fd_handler(vblk_exp->export.ctx, vduse_dev_get_fd(vblk_exp->dev),
                        on_vduse_dev_kick, NULL, NULL, NULL,
                        vblk_exp->dev);
@@ -216,22 +352,14 @@ static void vduse_blk_resize(void *opaque)
 
 static void vduse_blk_stop_virtqueues(VduseBlkExport *vblk_exp)
 {
-    for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
-        VduseVirtq *vq = vduse_dev_get_queue(vblk_exp->dev, i);
-        vduse_blk_disable_queue(vblk_exp->dev, vq);
-    }
-
+    vduse_blk_stop_virtqueues_now(vblk_exp);
     vblk_exp->vqs_started = false;
 }
 
 static void vduse_blk_start_virtqueues(VduseBlkExport *vblk_exp)
 {
     vblk_exp->vqs_started = true;
-
-    for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
-        VduseVirtq *vq = vduse_dev_get_queue(vblk_exp->dev, i);
-        vduse_blk_enable_queue(vblk_exp->dev, vq);
-    }
+    vduse_blk_start_virtqueues_now(vblk_exp);
 }
 
 static void vduse_blk_drained_begin(void *opaque)
@@ -255,7 +383,7 @@ static bool vduse_blk_drained_poll(void *opaque)
     BlockExport *exp = opaque;
     VduseBlkExport *vblk_exp = container_of(exp, VduseBlkExport, export);
 
-    return qatomic_read(&vblk_exp->inflight) > 0;
+    return qatomic_read(&vblk_exp->inflight) > 0 || vblk_exp->dev_co;
 }
 
 static const BlockDevOps vduse_block_ops = {
@@ -265,6 +393,19 @@ static const BlockDevOps vduse_block_ops = {
     .drained_poll  = vduse_blk_drained_poll,
 };
 
+static void vduse_blk_vq_aio_context_cleanup(VduseBlkExport *vblk_exp)
+{
+    if (vblk_exp->iothread_vq_mapping_list) {
+        iothread_vq_mapping_cleanup(vblk_exp->iothread_vq_mapping_list);
+        qapi_free_IOThreadVirtQueueMappingList(
+            vblk_exp->iothread_vq_mapping_list);
+        vblk_exp->iothread_vq_mapping_list = NULL;
+    }
+
+    g_free(vblk_exp->vq_aio_context);
+    vblk_exp->vq_aio_context = NULL;
+}
+
 static int vduse_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                                 Error **errp)
 {
@@ -304,6 +445,21 @@ static int vduse_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
             return -EINVAL;
         }
     }
+
+    if (vblk_opts->iothread_vq_mapping) {
+        vblk_exp->vq_aio_context = g_new(AioContext *, num_queues);
+        if (!iothread_vq_mapping_apply(vblk_opts->iothread_vq_mapping,
+                                       vblk_exp->vq_aio_context, num_queues,
+                                       errp)) {
+            g_free(vblk_exp->vq_aio_context);
+            vblk_exp->vq_aio_context = NULL;
+            return -EINVAL;
+        }
+        vblk_exp->iothread_vq_mapping_list =
+            QAPI_CLONE(IOThreadVirtQueueMappingList,
+                       vblk_opts->iothread_vq_mapping);
+    }
+
     vblk_exp->num_queues = num_queues;
     vblk_exp->handler.blk = exp->blk;
     vblk_exp->handler.serial = g_strdup(vblk_opts->serial ?: "");
@@ -384,6 +540,7 @@ err:
     g_free(vblk_exp->recon_file);
 err_dev:
     g_free(vblk_exp->handler.serial);
+    vduse_blk_vq_aio_context_cleanup(vblk_exp);
     return ret;
 }
 
@@ -403,6 +560,7 @@ static void vduse_blk_exp_delete(BlockExport *exp)
     }
     g_free(vblk_exp->recon_file);
     g_free(vblk_exp->handler.serial);
+    vduse_blk_vq_aio_context_cleanup(vblk_exp);
 }
 
 /* Called with exp->ctx acquired */
@@ -0,0 +1,644 @@
+/*
+ * Weighted fair queuing filter driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The nodes of a fair-queue group usually sit on top of one shared node, one
+ * for each tenant. The group lets at most queue-depth requests of its members
+ * reach their children at once and queues the others, so that the order in
+ * which they are dispatched is decided here rather than in the device queue.
+ *
+ * Queued requests are dispatched by start-time fair queuing: each request gets
+ * a start tag, the later of the group's virtual time and the finish tag of the
+ * member's previous request, and a finish tag that is its start tag plus its
+ * cost divided by the member's weight. The request with the lowest start tag
+ * goes first and the virtual time advances to its start tag. A busy member
+ * therefore gets a share of the queue depth proportional to its weight, and
+ * a member that was idle does not accumulate any credit.
+ *
+ * A member with a latency target has its requests dispatched before all
+ * others once they have waited for longer than the target, earliest deadline
+ * first.
+ *
+ * The group is shared between members in different AioContexts and protected
+ * by its own lock. Requests wait in coroutines that are woken with
+ * aio_co_wake().
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+
+#define FAIR_QUEUE_OPT_GROUP            "group"
+#define FAIR_QUEUE_OPT_WEIGHT           "weight"
+#define FAIR_QUEUE_OPT_QUEUE_DEPTH      "queue-depth"
+#define FAIR_QUEUE_OPT_LATENCY_TARGET   "latency-target-us"
+
+enum {
+    FAIR_QUEUE_WEIGHT_DEFAULT = 100,
+    FAIR_QUEUE_WEIGHT_MAX = 10000,
+    FAIR_QUEUE_QUEUE_DEPTH_DEFAULT = 32,
+
+    /*
+     * Cost of a request in bytes on top of its length, so that small
+     * requests and those without data still count
+     */
+    FAIR_QUEUE_REQ_BASE_COST = 4096,
+};
+
+typedef struct FairQueueGroup FairQueueGroup;
+
+typedef struct FairQueueReq {
+    Coroutine *co;
+    uint64_t start_tag;
+    int64_t deadline;       /* INT64_MAX without a latency target */
+    QSIMPLEQ_ENTRY(FairQueueReq) next;
+} FairQueueReq;
+
+typedef struct BDRVFairQueueState {
+    FairQueueGroup *group;
+
+    /* These fields are protected by group->lock */
+    uint32_t weight;
+    int64_t latency_target_ns;  /* 0 if none */
+    uint64_t finish_tag;
+    unsigned drained;           /* requests bypass the queue when nonzero */
+    QSIMPLEQ_HEAD(, FairQueueReq) queued_reqs;
+    QLIST_ENTRY(BDRVFairQueueState) next;
+} BDRVFairQueueState;
+
+struct FairQueueGroup {
+    char *name;                 /* constant during the group's lifetime */
+    unsigned refcnt;            /* protected by the BQL */
+
+    QemuMutex lock;             /* protects the following fields */
+    uint32_t queue_depth;
+    unsigned in_flight;
+    unsigned num_queued;
+    uint64_t vtime;
+    QLIST_HEAD(, BDRVFairQueueState) members;
+
+    QLIST_ENTRY(FairQueueGroup) next; /* protected by the BQL */
+};
+
+/* Protected by the BQL */
+static QLIST_HEAD(, FairQueueGroup) fair_queue_groups =
+    QLIST_HEAD_INITIALIZER(fair_queue_groups);
+
+typedef struct FairQueueOptions {
+    char *group;
+    uint32_t weight;
+    uint32_t queue_depth;       /* 0 if not given */
+    int64_t latency_target_ns;
+} FairQueueOptions;
+
+static QemuOptsList fair_queue_opts = {
+    .name = "fair-queue",
+    .head = QTAILQ_HEAD_INITIALIZER(fair_queue_opts.head),
+    .desc = {
+        {
+            .name = FAIR_QUEUE_OPT_GROUP,
+            .type = QEMU_OPT_STRING,
+            .help = "Name of the fair-queue group",
+        },
+        {
+            .name = FAIR_QUEUE_OPT_WEIGHT,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Share of the group's queue depth (default: 100)",
+        },
+        {
+            .name = FAIR_QUEUE_OPT_QUEUE_DEPTH,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of requests of the group in flight "
+                    "(default: 32)",
+        },
+        {
+            .name = FAIR_QUEUE_OPT_LATENCY_TARGET,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Time after which queued requests go first, in "
+                    "microseconds",
+        },
+        { /* end of list */ }
+    },
+};
+
+/*
+ * If this function succeeds then @fqo->group must be freed by the caller.
+ * If there's an error then @fqo remains unmodified.
+ */
+static int fair_queue_parse_options(QDict *options, FairQueueOptions *fqo,
+                                    Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&fair_queue_opts, NULL, 0, &error_abort);
+    const char *group;
+    uint64_t weight, queue_depth, latency_target;
+    int ret = -EINVAL;
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        goto fin;
+    }
+
+    group = qemu_opt_get(opts, FAIR_QUEUE_OPT_GROUP);
+    if (!group) {
+        error_setg(errp, "Please specify a fair-queue group");
+        goto fin;
+    }
+
+    weight = qemu_opt_get_number(opts, FAIR_QUEUE_OPT_WEIGHT,
+                                 FAIR_QUEUE_WEIGHT_DEFAULT);
+    if (weight < 1 || weight > FAIR_QUEUE_WEIGHT_MAX) {
+        error_setg(errp, "weight must be between 1 and %d",
+                   FAIR_QUEUE_WEIGHT_MAX);
+        goto fin;
+    }
+
+    queue_depth = qemu_opt_get_number(opts, FAIR_QUEUE_OPT_QUEUE_DEPTH, 0);
+    if (qemu_opt_find(opts, FAIR_QUEUE_OPT_QUEUE_DEPTH) &&
+        (queue_depth < 1 || queue_depth > UINT16_MAX)) {
+        error_setg(errp, "queue-depth must be between 1 and %d", UINT16_MAX);
+        goto fin;
+    }
+
+    latency_target = qemu_opt_get_number(opts, FAIR_QUEUE_OPT_LATENCY_TARGET,
+                                         0);
+    if (latency_target > INT64_MAX / SCALE_US) {
+        error_setg(errp, "latency-target-us is too large");
+        goto fin;
+    }
+
+    *fqo = (FairQueueOptions) {
+        .group = g_strdup(group),
+        .weight = weight,
+        .queue_depth = queue_depth,
+        .latency_target_ns = latency_target * SCALE_US,
+    };
+    ret = 0;
+fin:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+/* Called with the BQL held */
+static FairQueueGroup *fair_queue_group_by_name(const char *name)
+{
+    FairQueueGroup *group;
+
+    QLIST_FOREACH(group, &fair_queue_groups, next) {
+        if (!strcmp(group->name, name)) {
+            return group;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Add a node to the group given in @fqo, creating the group if this is its
+ * first member. Called with the BQL held.
+ */
+static int fair_queue_register(BDRVFairQueueState *s, FairQueueOptions *fqo,
+                               Error **errp)
+{
+    FairQueueGroup *group = fair_queue_group_by_name(fqo->group);
+
+    if (group) {
+        if (fqo->queue_depth && fqo->queue_depth != group->queue_depth) {
+            error_setg(errp, "fair-queue group '%s' has queue-depth %" PRIu32,
+                       group->name, group->queue_depth);
+            return -EINVAL;
+        }
+        group->refcnt++;
+    } else {
+        group = g_new0(FairQueueGroup, 1);
+        group->name = g_strdup(fqo->group);
+        group->refcnt = 1;
+        group->queue_depth = fqo->queue_depth ?:
+                             FAIR_QUEUE_QUEUE_DEPTH_DEFAULT;
+        qemu_mutex_init(&group->lock);
+        QLIST_INIT(&group->members);
+        QLIST_INSERT_HEAD(&fair_queue_groups, group, next);
+    }
+
+    s->group = group;
+    s->weight = fqo->weight;
+    s->latency_target_ns = fqo->latency_target_ns;
+    QSIMPLEQ_INIT(&s->queued_reqs);
+
+    WITH_QEMU_LOCK_GUARD(&group->lock) {
+        s->finish_tag = group->vtime;
+        QLIST_INSERT_HEAD(&group->members, s, next);
+    }
+
+    return 0;
+}
+
+/*
+ * Remove a node from its group, which must not have queued requests.
+ * Called with the BQL held.
+ */
+static void fair_queue_unregister(BDRVFairQueueState *s)
+{
+    FairQueueGroup *group = s->group;
+
+    WITH_QEMU_LOCK_GUARD(&group->lock) {
+        assert(QSIMPLEQ_EMPTY(&s->queued_reqs));
+        QLIST_REMOVE(s, next);
+    }
+    s->group = NULL;
+
+    if (--group->refcnt == 0) {
+        assert(group->in_flight == 0);
+        QLIST_REMOVE(group, next);
+        qemu_mutex_destroy(&group->lock);
+        g_free(group->name);
+        g_free(group);
+    }
+}
+
+/*
+ * Pick the next queued request to dispatch: the one with the earliest
+ * expired deadline if there is any, else the one with the lowest start tag.
+ * The requests of each member are in start tag and deadline order, so only
+ * the first one of each member needs to be looked at.
+ *
+ * Called with group->lock held.
+ */
+static FairQueueReq *fair_queue_pick(FairQueueGroup *group,
+                                     BDRVFairQueueState **owner)
+{
+    BDRVFairQueueState *s;
+    FairQueueReq *best = NULL, *expired = NULL;
+    BDRVFairQueueState *best_owner = NULL, *expired_owner = NULL;
+    int64_t now = 0;
+
+    QLIST_FOREACH(s, &group->members, next) {
+        FairQueueReq *req = QSIMPLEQ_FIRST(&s->queued_reqs);
+
+        if (!req) {
+            continue;
+        }
+
+        if (req->deadline != INT64_MAX) {
+            if (!now) {
+                now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            }
+            if (req->deadline <= now &&
+                (!expired || req->deadline < expired->deadline)) {
+                expired = req;
+                expired_owner = s;
+            }
+        }
+
+        if (!best || req->start_tag < best->start_tag) {
+            best = req;
+            best_owner = s;
+        }
+    }
+
+    if (expired) {
+        *owner = expired_owner;
+        return expired;
+    }
+    *owner = best_owner;
+    return best;
+}
+
+/*
+ * Dequeue the requests that can be dispatched now and add them to @wake.
+ * Called with group->lock held.
+ */
+static void fair_queue_dispatch(FairQueueGroup *group,
+                                GSList **wake)
+{
+    while (group->num_queued && group->in_flight < group->queue_depth) {
+        BDRVFairQueueState *owner;
+        FairQueueReq *req = fair_queue_pick(group, &owner);
+
+        QSIMPLEQ_REMOVE_HEAD(&owner->queued_reqs, next);
+        group->num_queued--;
+        group->in_flight++;
+        group->vtime = MAX(group->vtime, req->start_tag);
+        *wake = g_slist_prepend(*wake, req->co);
+    }
+}
+
+static void fair_queue_wake(GSList *wake)
+{
+    for (GSList *l = wake; l; l = l->next) {
+        aio_co_wake(l->data);
+    }
+    g_slist_free(wake);
+}
+
+/*
+ * Wait until the group lets a request of @bytes bytes through. Every call
+ * must be followed by one of fair_queue_co_end().
+ */
+static void coroutine_fn fair_queue_co_begin(BlockDriverState *bs,
+                                             int64_t bytes)
+{
+    BDRVFairQueueState *s = bs->opaque;
+    FairQueueGroup *group = s->group;
+    FairQueueReq req;
+    uint64_t cost;
+
+    qemu_mutex_lock(&group->lock);
+
+    cost = (FAIR_QUEUE_REQ_BASE_COST + (uint64_t)bytes) *
+           FAIR_QUEUE_WEIGHT_MAX / s->weight;
+    req = (FairQueueReq) {
+        .co = qemu_coroutine_self(),
+        .start_tag = MAX(group->vtime, s->finish_tag),
+        .deadline = INT64_MAX,
+    };
+    s->finish_tag = req.start_tag + cost;
+
+    if (s->drained ||
+        (!group->num_queued && group->in_flight < group->queue_depth)) {
+        group->in_flight++;
+        group->vtime = MAX(group->vtime, req.start_tag);
+        qemu_mutex_unlock(&group->lock);
+        return;
+    }
+
+    if (s->latency_target_ns) {
+        req.deadline = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                       s->latency_target_ns;
+    }
+    QSIMPLEQ_INSERT_TAIL(&s->queued_reqs, &req, next);
+    group->num_queued++;
+    qemu_mutex_unlock(&group->lock);
+
+    /* fair_queue_dispatch() has counted the request as in flight */
+    qemu_coroutine_yield();
+}
+
+static void coroutine_fn fair_queue_co_end(BlockDriverState *bs)
+{
+    BDRVFairQueueState *s = bs->opaque;
+    FairQueueGroup *group = s->group;
+    GSList *wake = NULL;
+
+    WITH_QEMU_LOCK_GUARD(&group->lock) {
+        group->in_flight--;
+        fair_queue_dispatch(group, &wake);
+    }
+
+    fair_queue_wake(wake);
+}
+
+static int fair_queue_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVFairQueueState *s = bs->opaque;
+    FairQueueOptions fqo;
+    int ret;
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    bs->supported_write_flags = bs->file->bs->supported_write_flags |
+                                BDRV_REQ_WRITE_UNCHANGED;
+    bs->supported_zero_flags = bs->file->bs->supported_zero_flags |
+                               BDRV_REQ_WRITE_UNCHANGED;
+
+    ret = fair_queue_parse_options(options, &fqo, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = fair_queue_register(s, &fqo, errp);
+    g_free(fqo.group);
+    return ret;
+}
+
+static void fair_queue_close(BlockDriverState *bs)
+{
+    BDRVFairQueueState *s = bs->opaque;
+
+    fair_queue_unregister(s);
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+fair_queue_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+fair_queue_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    int ret;
+
+    fair_queue_co_begin(bs, bytes);
+    ret = bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    fair_queue_co_end(bs);
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+fair_queue_co_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                      QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    int ret;
+
+    fair_queue_co_begin(bs, bytes);
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    fair_queue_co_end(bs);
+
+    return ret;
+}
+
+/* Zeroing, discarding and flushing don't transfer data, they cost the base */
+static int coroutine_fn GRAPH_RDLOCK
+fair_queue_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, BdrvRequestFlags flags)
+{
+    int ret;
+
+    fair_queue_co_begin(bs, 0);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    fair_queue_co_end(bs);
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+fair_queue_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    int ret;
+
+    fair_queue_co_begin(bs, 0);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    fair_queue_co_end(bs);
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+fair_queue_co_pwritev_compressed(BlockDriverState *bs, int64_t offset,
+                                 int64_t bytes, QEMUIOVector *qiov)
+{
+    return fair_queue_co_pwritev(bs, offset, bytes, qiov,
+                                 BDRV_REQ_WRITE_COMPRESSED);
+}
+
+static int coroutine_fn GRAPH_RDLOCK fair_queue_co_flush(BlockDriverState *bs)
+{
+    int ret;
+
+    fair_queue_co_begin(bs, 0);
+    ret = bdrv_co_flush(bs->file->bs);
+    fair_queue_co_end(bs);
+
+    return ret;
+}
+
+static int fair_queue_reopen_prepare(BDRVReopenState *reopen_state,
+                                     BlockReopenQueue *queue, Error **errp)
+{
+    BDRVFairQueueState *s = reopen_state->bs->opaque;
+    FairQueueOptions *fqo = g_new(FairQueueOptions, 1);
+    int ret;
+
+    ret = fair_queue_parse_options(reopen_state->options, fqo, errp);
+    if (ret < 0) {
+        g_free(fqo);
+        return ret;
+    }
+
+    if (strcmp(fqo->group, s->group->name)) {
+        error_setg(errp, "Cannot change the fair-queue group of a node");
+        goto fail;
+    }
+    if (fqo->queue_depth && fqo->queue_depth != s->group->queue_depth) {
+        error_setg(errp, "Cannot change the queue-depth of fair-queue group "
+                   "'%s'", s->group->name);
+        goto fail;
+    }
+
+    reopen_state->opaque = fqo;
+    return 0;
+
+fail:
+    g_free(fqo->group);
+    g_free(fqo);
+    return -EINVAL;
+}
+
+static void fair_queue_reopen_commit(BDRVReopenState *reopen_state)
+{
+    BDRVFairQueueState *s = reopen_state->bs->opaque;
+    FairQueueOptions *fqo = reopen_state->opaque;
+
+    WITH_QEMU_LOCK_GUARD(&s->group->lock) {
+        s->weight = fqo->weight;
+        s->latency_target_ns = fqo->latency_target_ns;
+    }
+
+    g_free(fqo->group);
+    g_free(fqo);
+    reopen_state->opaque = NULL;
+}
+
+static void fair_queue_reopen_abort(BDRVReopenState *reopen_state)
+{
+    FairQueueOptions *fqo = reopen_state->opaque;
+
+    if (fqo) {
+        g_free(fqo->group);
+        g_free(fqo);
+        reopen_state->opaque = NULL;
+    }
+}
+
+/* Let the queued requests of a drained node through, ignoring the others */
+static void fair_queue_drain_begin(BlockDriverState *bs)
+{
+    BDRVFairQueueState *s = bs->opaque;
+    FairQueueGroup *group = s->group;
+    GSList *wake = NULL;
+
+    WITH_QEMU_LOCK_GUARD(&group->lock) {
+        if (s->drained++ == 0) {
+            FairQueueReq *req;
+
+            while ((req = QSIMPLEQ_FIRST(&s->queued_reqs))) {
+                QSIMPLEQ_REMOVE_HEAD(&s->queued_reqs, next);
+                group->num_queued--;
+                group->in_flight++;
+                wake = g_slist_prepend(wake, req->co);
+            }
+        }
+    }
+
+    fair_queue_wake(wake);
+}
+
+static void fair_queue_drain_end(BlockDriverState *bs)
+{
+    BDRVFairQueueState *s = bs->opaque;
+
+    WITH_QEMU_LOCK_GUARD(&s->group->lock) {
+        assert(s->drained);
+        s->drained--;
+    }
+}
+
+static const char *const fair_queue_strong_runtime_opts[] = {
+    FAIR_QUEUE_OPT_GROUP,
+
+    NULL
+};
+
+static BlockDriver bdrv_fair_queue = {
+    .format_name                        =   "fair-queue",
+    .instance_size                      =   sizeof(BDRVFairQueueState),
+
+    .bdrv_open                          =   fair_queue_open,
+    .bdrv_close                         =   fair_queue_close,
+    .bdrv_co_flush                      =   fair_queue_co_flush,
+
+    .bdrv_child_perm                    =   bdrv_default_perms,
+
+    .bdrv_co_getlength                  =   fair_queue_co_getlength,
+
+    .bdrv_co_preadv                     =   fair_queue_co_preadv,
+    .bdrv_co_pwritev                    =   fair_queue_co_pwritev,
+
+    .bdrv_co_pwrite_zeroes              =   fair_queue_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   =   fair_queue_co_pdiscard,
+    .bdrv_co_pwritev_compressed         =   fair_queue_co_pwritev_compressed,
+
+    .bdrv_reopen_prepare                =   fair_queue_reopen_prepare,
+    .bdrv_reopen_commit                 =   fair_queue_reopen_commit,
+    .bdrv_reopen_abort                  =   fair_queue_reopen_abort,
+
+    .bdrv_drain_begin                   =   fair_queue_drain_begin,
+    .bdrv_drain_end                     =   fair_queue_drain_end,
+
+    .is_filter                          =   true,
+    .strong_runtime_opts                =   fair_queue_strong_runtime_opts,
+};
+
+static void bdrv_fair_queue_init(void)
+{
+    bdrv_register(&bdrv_fair_queue);
+}
+
+block_init(bdrv_fair_queue_init);
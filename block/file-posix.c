@@ -160,6 +160,9 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool io_uring_fixed:1;
+    bool use_linux_io_uring_poll:1;
+    int io_uring_sqpoll_cpu;
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
     bool needs_alignment;
@@ -560,6 +563,25 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "x-io-uring-fixed",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest RAM and the file with io_uring "
+                    "(default: off)",
+        },
+        {
+            .name = "x-io-uring-poll",
+            .type = QEMU_OPT_BOOL,
+            .help = "poll the device for io_uring completions (default: off)",
+        },
+        {
+            .name = "x-io-uring-sqpoll-cpu",
+            .type = QEMU_OPT_NUMBER,
+            .help = "CPU of the kernel thread submitting polled requests "
+                    "(default: none)",
+        },
+#endif
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -637,6 +659,22 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+    s->io_uring_fixed = s->use_linux_io_uring &&
+                        qemu_opt_get_bool(opts, "x-io-uring-fixed", false);
+    s->use_linux_io_uring_poll = qemu_opt_get_bool(opts, "x-io-uring-poll",
+                                                   false);
+    s->io_uring_sqpoll_cpu = -1;
+    if (qemu_opt_get(opts, "x-io-uring-sqpoll-cpu")) {
+        uint64_t cpu = qemu_opt_get_number(opts, "x-io-uring-sqpoll-cpu", 0);
+
+        if (!s->use_linux_io_uring_poll || cpu > INT_MAX) {
+            error_setg(errp, "x-io-uring-sqpoll-cpu must be a CPU number and "
+                       "requires x-io-uring-poll=on");
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->io_uring_sqpoll_cpu = cpu;
+    }
 #endif
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
@@ -734,6 +772,15 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         ret = -EINVAL;
         goto fail;
     }
+#else
+    /* The kernel only polls for O_DIRECT requests to block devices */
+    if (s->use_linux_io_uring_poll &&
+        (!s->use_linux_io_uring || !device || !(s->open_flags & O_DIRECT))) {
+        error_setg(errp, "x-io-uring-poll requires aio=io_uring, "
+                         "cache.direct=on and a host block device");
+        ret = -EINVAL;
+        goto fail;
+    }
 #endif /* !defined(CONFIG_LINUX_IO_URING) */
 
     s->has_discard = true;
@@ -805,6 +852,11 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_fixed) {
+        luring_register_fd(s->fd);
+    }
+#endif
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -2450,6 +2502,27 @@ static inline bool raw_check_linux_io_uring(BDRVRawState *s)
     }
     return true;
 }
+
+/* Reads and writes of a node with x-io-uring-poll go to the polled ring */
+static inline bool raw_check_linux_io_uring_poll(BDRVRawState *s)
+{
+    Error *local_err = NULL;
+    AioContext *ctx;
+
+    if (!s->use_linux_io_uring_poll) {
+        return false;
+    }
+
+    ctx = qemu_get_current_aio_context();
+    if (unlikely(!aio_setup_linux_io_uring_poll(ctx, s->io_uring_sqpoll_cpu,
+                                                &local_err))) {
+        error_reportf_err(local_err, "Unable to poll linux io_uring, "
+                                     "falling back to interrupts: ");
+        s->use_linux_io_uring_poll = false;
+        return false;
+    }
+    return true;
+}
 #endif
 
 #ifdef CONFIG_LINUX_AIO
@@ -2505,7 +2578,11 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, int64_t *offset_ptr,
 #ifdef CONFIG_LINUX_IO_URING
     } else if (raw_check_linux_io_uring(s)) {
         assert(qiov->size == bytes);
-        ret = luring_co_submit(bs, s->fd, offset, qiov, type);
+        if (type != QEMU_AIO_ZONE_APPEND && raw_check_linux_io_uring_poll(s)) {
+            ret = luring_co_submit_poll(bs, s->fd, offset, qiov, type);
+        } else {
+            ret = luring_co_submit(bs, s->fd, offset, qiov, type);
+        }
         goto out;
 #endif
 #ifdef CONFIG_LINUX_AIO
@@ -2610,12 +2687,40 @@ static void raw_close(BlockDriverState *bs)
     if (s->fd >= 0) {
 #if defined(CONFIG_BLKZONED)
         g_free(bs->wps);
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+        if (s->io_uring_fixed) {
+            luring_unregister_fd(s->fd);
+        }
 #endif
         qemu_close(s->fd);
         s->fd = -1;
     }
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static bool raw_register_buf(BlockDriverState *bs, void *host, size_t size,
+                             Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /* Failing to pin guest RAM only makes requests use plain buffers */
+    if (s->io_uring_fixed) {
+        luring_register_buf(host, size);
+    }
+    return true;
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->io_uring_fixed) {
+        luring_unregister_buf(host, size);
+    }
+}
+#endif
+
 /**
  * Truncates the given regular file @fd to @offset and, when growing, fills the
  * new space according to @prealloc.
@@ -3556,6 +3661,17 @@ raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes,
         acb.aio_type |= QEMU_AIO_BLKDEV;
     }
 
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE_PUNCH_HOLE)
+    if (!blkdev && s->has_discard && raw_check_linux_io_uring(s)) {
+        ret = luring_co_fallocate(bs, s->fd, offset, bytes, QEMU_AIO_DISCARD);
+        if (ret != -ENOTSUP && ret != -EINVAL) {
+            raw_account_discard(s, bytes, ret);
+            return ret;
+        }
+        /* Let handle_aiocb_discard() find out what the file system supports */
+    }
+#endif
+
     ret = raw_thread_pool_submit(handle_aiocb_discard, &acb);
     raw_account_discard(s, bytes, ret);
     return ret;
@@ -3631,6 +3747,18 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
         handler = handle_aiocb_write_zeroes;
     }
 
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE_ZERO_RANGE)
+    if (!blkdev && handler == handle_aiocb_write_zeroes &&
+        s->has_write_zeroes && raw_check_linux_io_uring(s)) {
+        int ret = luring_co_fallocate(bs, s->fd, offset, bytes,
+                                      QEMU_AIO_WRITE_ZEROES);
+        /* Unsupported or unaligned ranges take the fallbacks below */
+        if (ret != -ENOTSUP && ret != -EINVAL) {
+            return ret;
+        }
+    }
+#endif
+
     return raw_thread_pool_submit(handler, &acb);
 }
 
@@ -3802,6 +3930,12 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+#ifdef CONFIG_LINUX_IO_URING
+        if (s->io_uring_fixed) {
+            luring_unregister_fd(s->fd);
+            luring_register_fd(s->perm_change_fd);
+        }
+#endif
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -3895,6 +4029,10 @@ BlockDriver bdrv_file = {
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
@@ -4264,6 +4402,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
     .bdrv_co_pdiscard       = hdev_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
@@ -34,6 +34,7 @@
 #include "block/write-threshold.h"
 #include "qemu/cutils.h"
 #include "qemu/memalign.h"
+#include "qemu/range.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
@@ -577,6 +578,27 @@ void bdrv_drain_all(void)
     bdrv_drain_all_end();
 }
 
+/*
+ * Interval tree key for [offset, offset + bytes).  Zero-length ranges are
+ * widened to one byte so that they can be stored; callers still check the
+ * exact overlap with tracked_request_overlaps().
+ */
+static void tracked_request_range(int64_t offset, int64_t bytes,
+                                  uint64_t *start, uint64_t *last)
+{
+    *start = offset;
+    *last = offset + MAX(bytes, 1) - 1;
+}
+
+/* Called with req->bs->reqs_lock held */
+static void tracked_request_tree_insert(BdrvTrackedRequest *req)
+{
+    tracked_request_range(req->overlap_offset, req->overlap_bytes,
+                          &req->overlap_node.start, &req->overlap_node.last);
+    interval_tree_insert(&req->overlap_node,
+                         &req->bs->tracked_requests_tree);
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -590,6 +612,7 @@ static void coroutine_fn tracked_request_end(BdrvTrackedRequest *req)
 
     qemu_mutex_lock(&req->bs->reqs_lock);
     QLIST_REMOVE(req, list);
+    interval_tree_remove(&req->overlap_node, &req->bs->tracked_requests_tree);
     qemu_mutex_unlock(&req->bs->reqs_lock);
 
     /*
@@ -626,6 +649,7 @@ static void coroutine_fn tracked_request_begin(BdrvTrackedRequest *req,
 
     qemu_mutex_lock(&bs->reqs_lock);
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    tracked_request_tree_insert(req);
     qemu_mutex_unlock(&bs->reqs_lock);
 }
 
@@ -650,8 +674,17 @@ static coroutine_fn BdrvTrackedRequest *
 bdrv_find_conflicting_request(BdrvTrackedRequest *self)
 {
     BdrvTrackedRequest *req;
+    IntervalTreeNode *node;
+    uint64_t start, last;
 
-    QLIST_FOREACH(req, &self->bs->tracked_requests, list) {
+    tracked_request_range(self->overlap_offset, self->overlap_bytes,
+                          &start, &last);
+
+    for (node = interval_tree_iter_first(&self->bs->tracked_requests_tree,
+                                         start, last);
+         node;
+         node = interval_tree_iter_next(node, start, last)) {
+        req = container_of(node, BdrvTrackedRequest, overlap_node);
         if (req == self || (!req->serialising && !self->serialising)) {
             continue;
         }
@@ -707,8 +740,17 @@ static void tracked_request_set_serialising(BdrvTrackedRequest *req,
         req->serialising = true;
     }
 
-    req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
-    req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    overlap_offset = MIN(req->overlap_offset, overlap_offset);
+    overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+
+    if (overlap_offset != req->overlap_offset ||
+        overlap_bytes != req->overlap_bytes) {
+        interval_tree_remove(&req->overlap_node,
+                             &req->bs->tracked_requests_tree);
+        req->overlap_offset = overlap_offset;
+        req->overlap_bytes = overlap_bytes;
+        tracked_request_tree_insert(req);
+    }
 }
 
 /**
@@ -1279,6 +1321,7 @@ bdrv_co_do_copy_on_readv(BdrvChild *child, int64_t offset, int64_t bytes,
                                           &local_qiov, 0,
                                           BDRV_REQ_WRITE_UNCHANGED);
             }
+            bdrv_csc_invalidate_range(bs, align_offset, pnum);
 
             if (ret < 0) {
                 /* It might be okay to ignore write errors for guest
@@ -2016,6 +2059,11 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, int64_t bytes,
     bdrv_check_request(offset, bytes, &error_abort);
 
     qatomic_inc(&bs->write_gen);
+    if (req->type == BDRV_TRACKED_TRUNCATE) {
+        bdrv_csc_invalidate_range(bs, 0, INT64_MAX);
+    } else {
+        bdrv_csc_invalidate_range(bs, offset, bytes);
+    }
 
     /*
      * Discard cannot extend the image, but in error handling cases, such as
@@ -2618,6 +2666,129 @@ early_out:
     return ret;
 }
 
+/*
+ * Chain status cache: for ranges that a deep backing chain has allocated
+ * below its top node, remember which layer owns them, so that block-status
+ * queries go straight to that layer instead of asking every layer on the
+ * way again.
+ */
+
+void bdrv_csc_invalidate_range(BlockDriverState *bs,
+                               int64_t offset, int64_t bytes)
+{
+    BdrvChild *c;
+    int i;
+
+    WITH_QEMU_LOCK_GUARD(&bs->csc_lock) {
+        bs->csc_gen++;
+        for (i = 0; i < BDRV_CHAIN_STATUS_CACHE_SIZE; i++) {
+            BdrvChainStatusEntry *e = &bs->csc_entries[i];
+
+            if (e->end && ranges_overlap(offset, bytes, e->start,
+                                         e->end - e->start)) {
+                e->end = 0;
+            }
+        }
+    }
+
+    /* Guest offsets are the same in all the layers of a chain */
+    QLIST_FOREACH(c, &bs->parents, next_parent) {
+        if (c->klass == &child_of_bds &&
+            (c->role & (BDRV_CHILD_COW | BDRV_CHILD_FILTERED))) {
+            bdrv_csc_invalidate_range(c->opaque, offset, bytes);
+        }
+    }
+}
+
+/*
+ * Look up the layer that owns @offset for this query.  On a hit, *bytes is
+ * reduced to what the layer is known to own.
+ */
+static bool bdrv_csc_lookup(BlockDriverState *bs, BlockDriverState *base,
+                            bool include_base, bool want_zero,
+                            int64_t offset, int64_t *bytes,
+                            BlockDriverState **owner, int *depth)
+{
+    int i;
+
+    QEMU_LOCK_GUARD(&bs->csc_lock);
+
+    for (i = 0; i < BDRV_CHAIN_STATUS_CACHE_SIZE; i++) {
+        BdrvChainStatusEntry *e = &bs->csc_entries[i];
+
+        if (e->end && offset >= e->start && offset < e->end &&
+            e->base == base && e->include_base == include_base &&
+            e->want_zero == want_zero) {
+            *bytes = MIN(*bytes, e->end - offset);
+            *owner = e->owner;
+            *depth = e->depth;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Remember the owner of a range, unless the cache was invalidated since @gen */
+static void bdrv_csc_fill(BlockDriverState *bs, unsigned int gen,
+                          BlockDriverState *base, bool include_base,
+                          bool want_zero, int64_t offset, int64_t bytes,
+                          BlockDriverState *owner, int depth)
+{
+    QEMU_LOCK_GUARD(&bs->csc_lock);
+
+    if (bs->csc_gen != gen) {
+        return;
+    }
+
+    bs->csc_entries[bs->csc_next] = (BdrvChainStatusEntry) {
+        .start = offset,
+        .end = offset + bytes,
+        .base = base,
+        .include_base = include_base,
+        .want_zero = want_zero,
+        .owner = owner,
+        .depth = depth,
+    };
+    bs->csc_next = (bs->csc_next + 1) % BDRV_CHAIN_STATUS_CACHE_SIZE;
+}
+
+/*
+ * Query the layer that the chain status cache says owns @offset.  Returns
+ * -ENOENT if the cache does not know it, or if the layer does not agree.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+bdrv_csc_block_status(BlockDriverState *bs, BlockDriverState *base,
+                      bool include_base, bool want_zero,
+                      int64_t offset, int64_t bytes, int64_t *pnum,
+                      int64_t *map, BlockDriverState **file, int *depth)
+{
+    BlockDriverState *owner;
+    int64_t total_size;
+    int owner_depth;
+    int ret;
+
+    if (!bdrv_csc_lookup(bs, base, include_base, want_zero, offset, &bytes,
+                         &owner, &owner_depth)) {
+        return -ENOENT;
+    }
+
+    ret = bdrv_co_do_block_status(owner, want_zero, offset, bytes, pnum,
+                                  map, file);
+    if (ret < 0 || *pnum == 0 || !(ret & BDRV_BLOCK_ALLOCATED)) {
+        return -ENOENT;
+    }
+
+    /* Like the walk through the chain, only report the EOF of @bs */
+    ret &= ~BDRV_BLOCK_EOF;
+    total_size = bdrv_co_getlength(bs);
+    if (total_size >= 0 && offset + *pnum == total_size) {
+        ret |= BDRV_BLOCK_EOF;
+    }
+
+    *depth = owner_depth;
+    return ret;
+}
+
 int coroutine_fn
 bdrv_co_common_block_status_above(BlockDriverState *bs,
                                   BlockDriverState *base,
@@ -2633,6 +2804,7 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
     int ret;
     BlockDriverState *p;
     int64_t eof = 0;
+    unsigned int gen;
     int dummy;
     IO_CODE();
 
@@ -2649,6 +2821,13 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
         return 0;
     }
 
+    ret = bdrv_csc_block_status(bs, base, include_base, want_zero, offset,
+                                bytes, pnum, map, file, depth);
+    if (ret != -ENOENT) {
+        return ret;
+    }
+    gen = qatomic_read(&bs->csc_gen);
+
     ret = bdrv_co_do_block_status(bs, want_zero, offset, bytes, pnum,
                                   map, file);
     ++*depth;
@@ -2699,6 +2878,8 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
              * below.
              */
             ret &= ~BDRV_BLOCK_EOF;
+            bdrv_csc_fill(bs, gen, base, include_base, want_zero, offset,
+                          *pnum, p, *depth);
             break;
         }
 
@@ -10,12 +10,16 @@
  */
 #include "qemu/osdep.h"
 #include <liburing.h>
+#include <linux/falloc.h>
 #include "block/aio.h"
 #include "qemu/queue.h"
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qemu/defer-call.h"
+#include "qemu/bitmap.h"
+#include "qemu/lockable.h"
+#include "qemu/rcu_queue.h"
 #include "qapi/error.h"
 #include "sysemu/block-backend.h"
 #include "trace.h"
@@ -32,6 +36,13 @@ typedef struct LuringAIOCB {
     ssize_t ret;
     QEMUIOVector *qiov;
     bool is_read;
+    int fd;
+    uint64_t offset;
+    int type;
+    /* Length of fallocate requests, which have no qiov */
+    uint64_t len;
+    /* sqeq uses a fixed buffer or file, see luring_prep_sqe() */
+    bool fixed;
     QSIMPLEQ_ENTRY(LuringAIOCB) next;
 
     /*
@@ -58,8 +69,412 @@ struct LuringState {
     LuringQueue io_q;
 
     QEMUBH *completion_bh;
+
+    /*
+     * The ring was set up with IORING_SETUP_IOPOLL and no SQ thread: nothing
+     * signals its completions, they are reaped by entering the kernel.
+     */
+    bool iopoll;
+
+    /* The kernel supports IORING_OP_FALLOCATE */
+    bool has_fallocate;
+
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+    /* The ring mirrors the buffers and files of luring_fixed */
+    bool fixed_bufs;
+    bool fixed_files;
+    QLIST_ENTRY(LuringState) next;
+#endif
 };
 
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+/* Registered buffers are at most 1GiB each */
+#define LURING_BUF_SIZE (1ULL << 30)
+
+/* Sizes of the sparse buffer and file tables of each ring */
+#define LURING_MAX_BUFS 1024
+#define LURING_MAX_FILES 256
+
+typedef struct LuringBuf {
+    void *host;
+    size_t size;
+    /* number of luring_register_buf() calls for @host */
+    unsigned int refs;
+    /* first slot of the buffer tables, one per LURING_BUF_SIZE chunk */
+    unsigned int slot;
+    unsigned int nr_slots;
+    struct rcu_head rcu;
+    QLIST_ENTRY(LuringBuf) next;
+} LuringBuf;
+
+typedef struct LuringFile {
+    int fd;
+    unsigned int slot;
+    struct rcu_head rcu;
+    QLIST_ENTRY(LuringFile) next;
+} LuringFile;
+
+/*
+ * Buffers and files registered by block drivers are installed in the tables
+ * of every ring, at the same slots, so that requests can use them whatever
+ * AioContext they are submitted from.  The lists are walked under RCU when
+ * preparing requests and modified under the lock.
+ */
+static struct {
+    QemuMutex lock;
+    QLIST_HEAD(, LuringBuf) bufs;
+    QLIST_HEAD(, LuringFile) files;
+    unsigned long *buf_slots;
+    unsigned long *file_slots;
+    QLIST_HEAD(, LuringState) states;
+} luring_fixed;
+
+static void __attribute__((__constructor__)) luring_fixed_init(void)
+{
+    qemu_mutex_init(&luring_fixed.lock);
+    luring_fixed.buf_slots = bitmap_new(LURING_MAX_BUFS);
+    luring_fixed.file_slots = bitmap_new(LURING_MAX_FILES);
+}
+
+/*
+ * Install or clear the slots of @b in the buffer table of @s.  A failure,
+ * most likely because pinning @b exceeds RLIMIT_MEMLOCK, drops the table and
+ * the ring goes back to plain reads and writes.
+ */
+static void luring_set_buf(LuringState *s, LuringBuf *b, bool add)
+{
+    g_autofree struct iovec *iovs = NULL;
+    unsigned int i;
+    int ret;
+
+    if (!s->fixed_bufs) {
+        return;
+    }
+
+    iovs = g_new0(struct iovec, b->nr_slots);
+    for (i = 0; add && i < b->nr_slots; i++) {
+        size_t off = i * LURING_BUF_SIZE;
+
+        iovs[i].iov_base = b->host + off;
+        iovs[i].iov_len = MIN(b->size - off, LURING_BUF_SIZE);
+    }
+
+    ret = io_uring_register_buffers_update_tag(&s->ring, b->slot, iovs, NULL,
+                                               b->nr_slots);
+    trace_luring_set_buf(s, b->host, b->size, add, ret);
+    if (ret != b->nr_slots) {
+        qatomic_set(&s->fixed_bufs, false);
+        io_uring_unregister_buffers(&s->ring);
+    }
+}
+
+/* Same as luring_set_buf() for the file table */
+static void luring_set_file(LuringState *s, LuringFile *f, bool add)
+{
+    int fd = add ? f->fd : -1;
+    int ret;
+
+    if (!s->fixed_files) {
+        return;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, f->slot, &fd, 1);
+    trace_luring_set_file(s, f->fd, add, ret);
+    if (ret != 1) {
+        qatomic_set(&s->fixed_files, false);
+        io_uring_unregister_files(&s->ring);
+    }
+}
+
+void luring_register_buf(void *host, size_t size)
+{
+    unsigned long nr = DIV_ROUND_UP(size, LURING_BUF_SIZE);
+    unsigned long slot;
+    LuringState *s;
+    LuringBuf *b;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    QLIST_FOREACH(b, &luring_fixed.bufs, next) {
+        if (b->host == host) {
+            b->refs++;
+            return;
+        }
+    }
+
+    slot = bitmap_find_next_zero_area(luring_fixed.buf_slots, LURING_MAX_BUFS,
+                                      0, nr, 0);
+    if (slot + nr > LURING_MAX_BUFS) {
+        trace_luring_set_buf(NULL, host, size, true, -ENOSPC);
+        return;
+    }
+    bitmap_set(luring_fixed.buf_slots, slot, nr);
+
+    b = g_new0(LuringBuf, 1);
+    b->host = host;
+    b->size = size;
+    b->refs = 1;
+    b->slot = slot;
+    b->nr_slots = nr;
+    QLIST_FOREACH(s, &luring_fixed.states, next) {
+        luring_set_buf(s, b, true);
+    }
+    QLIST_INSERT_HEAD_RCU(&luring_fixed.bufs, b, next);
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+    LuringState *s;
+    LuringBuf *b;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    QLIST_FOREACH(b, &luring_fixed.bufs, next) {
+        if (b->host == host) {
+            break;
+        }
+    }
+    if (!b || --b->refs) {
+        return;
+    }
+
+    QLIST_REMOVE_RCU(b, next);
+    QLIST_FOREACH(s, &luring_fixed.states, next) {
+        luring_set_buf(s, b, false);
+    }
+    bitmap_clear(luring_fixed.buf_slots, b->slot, b->nr_slots);
+    g_free_rcu(b, rcu);
+}
+
+void luring_register_fd(int fd)
+{
+    unsigned long slot;
+    LuringState *s;
+    LuringFile *f;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    slot = find_first_zero_bit(luring_fixed.file_slots, LURING_MAX_FILES);
+    if (slot >= LURING_MAX_FILES) {
+        trace_luring_set_file(NULL, fd, true, -ENOSPC);
+        return;
+    }
+    set_bit(slot, luring_fixed.file_slots);
+
+    f = g_new0(LuringFile, 1);
+    f->fd = fd;
+    f->slot = slot;
+    QLIST_FOREACH(s, &luring_fixed.states, next) {
+        luring_set_file(s, f, true);
+    }
+    QLIST_INSERT_HEAD_RCU(&luring_fixed.files, f, next);
+}
+
+void luring_unregister_fd(int fd)
+{
+    LuringState *s;
+    LuringFile *f;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    QLIST_FOREACH(f, &luring_fixed.files, next) {
+        if (f->fd == fd) {
+            break;
+        }
+    }
+    if (!f) {
+        return;
+    }
+
+    /* The rings drop their reference to the file once idle */
+    QLIST_REMOVE_RCU(f, next);
+    QLIST_FOREACH(s, &luring_fixed.states, next) {
+        luring_set_file(s, f, false);
+    }
+    clear_bit(f->slot, luring_fixed.file_slots);
+    g_free_rcu(f, rcu);
+}
+
+/* Returns the buffer slot that covers [@base, @base + @len), or -1 */
+static int luring_buf_slot(LuringState *s, void *base, size_t len)
+{
+    LuringBuf *b;
+
+    if (!len || !qatomic_read(&s->fixed_bufs)) {
+        return -1;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    QLIST_FOREACH_RCU(b, &luring_fixed.bufs, next) {
+        uintptr_t off = (uintptr_t)base - (uintptr_t)b->host;
+
+        if ((uintptr_t)base < (uintptr_t)b->host || off + len > b->size) {
+            continue;
+        }
+        /* A fixed request cannot span two registered buffers */
+        if (off / LURING_BUF_SIZE != (off + len - 1) / LURING_BUF_SIZE) {
+            return -1;
+        }
+        return b->slot + off / LURING_BUF_SIZE;
+    }
+    return -1;
+}
+
+static int luring_file_slot(LuringState *s, int fd)
+{
+    LuringFile *f;
+
+    if (!qatomic_read(&s->fixed_files)) {
+        return -1;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    QLIST_FOREACH_RCU(f, &luring_fixed.files, next) {
+        if (f->fd == fd) {
+            return f->slot;
+        }
+    }
+    return -1;
+}
+
+static void luring_fixed_add_state(LuringState *s)
+{
+    LuringBuf *b;
+    LuringFile *f;
+    int ret;
+
+    ret = io_uring_register_buffers_sparse(&s->ring, LURING_MAX_BUFS);
+    s->fixed_bufs = ret == 0;
+    ret = io_uring_register_files_sparse(&s->ring, LURING_MAX_FILES);
+    s->fixed_files = ret == 0;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    QLIST_FOREACH(b, &luring_fixed.bufs, next) {
+        luring_set_buf(s, b, true);
+    }
+    QLIST_FOREACH(f, &luring_fixed.files, next) {
+        luring_set_file(s, f, true);
+    }
+    QLIST_INSERT_HEAD(&luring_fixed.states, s, next);
+}
+
+static void luring_fixed_remove_state(LuringState *s)
+{
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+    QLIST_REMOVE(s, next);
+}
+#else
+void luring_register_buf(void *host, size_t size)
+{
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+}
+
+void luring_register_fd(int fd)
+{
+}
+
+void luring_unregister_fd(int fd)
+{
+}
+
+static int luring_buf_slot(LuringState *s, void *base, size_t len)
+{
+    return -1;
+}
+
+static int luring_file_slot(LuringState *s, int fd)
+{
+    return -1;
+}
+
+static void luring_fixed_add_state(LuringState *s)
+{
+}
+
+static void luring_fixed_remove_state(LuringState *s)
+{
+}
+#endif /* HAVE_IO_URING_REGISTER_SPARSE */
+
+/**
+ * luring_prep_sqe:
+ * @s: AIO state
+ * @luringcb: AIO control block
+ * @try_fixed: whether to look for a registered buffer and file
+ *
+ * Preps the sqe of a request, from luringcb->total_read on.  Reads and
+ * writes of a single iovec within a registered buffer use it rather than
+ * pinning the pages again, and registered files save the lookup of the fd.
+ */
+static void luring_prep_sqe(LuringState *s, LuringAIOCB *luringcb,
+                            bool try_fixed)
+{
+    struct io_uring_sqe *sqes = &luringcb->sqeq;
+    QEMUIOVector *qiov = luringcb->total_read ? &luringcb->resubmit_qiov :
+                                                luringcb->qiov;
+    uint64_t offset = luringcb->offset + luringcb->total_read;
+    int fd = luringcb->fd;
+    int buf = -1, file = -1;
+
+    if (try_fixed) {
+        file = luring_file_slot(s, fd);
+        if (qiov && qiov->niov == 1) {
+            buf = luring_buf_slot(s, qiov->iov[0].iov_base,
+                                  qiov->iov[0].iov_len);
+        }
+    }
+    if (file >= 0) {
+        fd = file;
+    }
+
+    switch (luringcb->type) {
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_ZONE_APPEND:
+        if (buf >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset, buf);
+        } else {
+            io_uring_prep_writev(sqes, fd, qiov->iov, qiov->niov, offset);
+        }
+        break;
+    case QEMU_AIO_READ:
+        if (buf >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset, buf);
+        } else {
+            io_uring_prep_readv(sqes, fd, qiov->iov, qiov->niov, offset);
+        }
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
+        break;
+#ifdef HAVE_IO_URING_PREP_FALLOCATE
+    case QEMU_AIO_WRITE_ZEROES:
+        io_uring_prep_fallocate(sqes, fd, FALLOC_FL_ZERO_RANGE, offset,
+                                luringcb->len);
+        break;
+    case QEMU_AIO_DISCARD:
+        io_uring_prep_fallocate(sqes, fd,
+                                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                offset, luringcb->len);
+        break;
+#endif
+    default:
+        fprintf(stderr, "%s: invalid AIO request type, aborting 0x%x.\n",
+                        __func__, luringcb->type);
+        abort();
+    }
+    if (file >= 0) {
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
+    luringcb->fixed = buf >= 0 || file >= 0;
+    io_uring_sqe_set_data(sqes, luringcb);
+}
+
 /**
  * luring_resubmit:
  *
@@ -101,9 +516,7 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
                       remaining);
 
     /* Update sqe */
-    luringcb->sqeq.off += nread;
-    luringcb->sqeq.addr = (uintptr_t)luringcb->resubmit_qiov.iov;
-    luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+    luring_prep_sqe(s, luringcb, true);
 
     luring_resubmit(s, luringcb);
 }
@@ -168,9 +581,10 @@ static void luring_process_completions(LuringState *s)
         if (ret < 0) {
             /*
              * Only writev/readv/fsync requests on regular files or host block
-             * devices are submitted. Therefore -EAGAIN is not expected but it's
-             * known to happen sometimes with Linux SCSI. Submit again and hope
-             * the request completes successfully.
+             * devices, and fallocate requests on regular files, are
+             * submitted. Therefore -EAGAIN is not expected but it's known to
+             * happen sometimes with Linux SCSI. Submit again and hope the
+             * request completes successfully.
              *
              * For more information, see:
              * https://lore.kernel.org/io-uring/20210727165811.284510-3-axboe@kernel.dk/T/#u
@@ -184,6 +598,17 @@ static void luring_process_completions(LuringState *s)
                 luring_resubmit(s, luringcb);
                 continue;
             }
+
+            /*
+             * A buffer or file may have been unregistered, e.g. because the
+             * ring could not pin more memory, after the request was prepped.
+             */
+            if (luringcb->fixed && (ret == -EFAULT || ret == -EBADF)) {
+                trace_luring_fixed_fallback(s, luringcb, ret);
+                luring_prep_sqe(s, luringcb, false);
+                luring_resubmit(s, luringcb);
+                continue;
+            }
         } else if (!luringcb->qiov) {
             goto end;
         } else if (total_bytes == luringcb->qiov->size) {
@@ -221,7 +646,13 @@ end:
         }
     }
 
-    qemu_bh_cancel(s->completion_bh);
+    /*
+     * Keep polling a polled ring while requests are in flight, the fd of the
+     * ring never becomes readable.
+     */
+    if (!s->iopoll || !s->io_q.in_flight) {
+        qemu_bh_cancel(s->completion_bh);
+    }
 
     defer_call_end();
 }
@@ -295,6 +726,12 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+    if (s->iopoll && s->io_q.in_flight) {
+        struct io_uring_cqe *cqe;
+
+        /* Peeking an IOPOLL ring polls the device for completions */
+        return io_uring_peek_cqe(&s->ring, &cqe) == 0;
+    }
     return io_uring_cq_ready(&s->ring);
 }
 
@@ -338,30 +775,11 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                             uint64_t offset, int type)
 {
     int ret;
-    struct io_uring_sqe *sqes = &luringcb->sqeq;
 
-    switch (type) {
-    case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
-        break;
-    case QEMU_AIO_ZONE_APPEND:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
-        break;
-    case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
-        break;
-    case QEMU_AIO_FLUSH:
-        io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
-        break;
-    default:
-        fprintf(stderr, "%s: invalid AIO request type, aborting 0x%x.\n",
-                        __func__, type);
-        abort();
-    }
-    io_uring_sqe_set_data(sqes, luringcb);
+    luringcb->fd = fd;
+    luringcb->offset = offset;
+    luringcb->type = type;
+    luring_prep_sqe(s, luringcb, true);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
@@ -379,12 +797,12 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
     return 0;
 }
 
-int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
-                                  QEMUIOVector *qiov, int type)
+static int coroutine_fn luring_co_submit_to(LuringState *s,
+                                           BlockDriverState *bs, int fd,
+                                           uint64_t offset, QEMUIOVector *qiov,
+                                           int type)
 {
     int ret;
-    AioContext *ctx = qemu_get_current_aio_context();
-    LuringState *s = aio_get_linux_io_uring(ctx);
     LuringAIOCB luringcb = {
         .co         = qemu_coroutine_self(),
         .ret        = -EINPROGRESS,
@@ -405,6 +823,56 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
     return luringcb.ret;
 }
 
+int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
+                                  QEMUIOVector *qiov, int type)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    return luring_co_submit_to(aio_get_linux_io_uring(ctx), bs, fd, offset,
+                               qiov, type);
+}
+
+int coroutine_fn luring_co_submit_poll(BlockDriverState *bs, int fd,
+                                       uint64_t offset, QEMUIOVector *qiov,
+                                       int type)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    /* Polled rings do not support fsync */
+    assert(type == QEMU_AIO_READ || type == QEMU_AIO_WRITE);
+    return luring_co_submit_to(aio_get_linux_io_uring_poll(ctx), bs, fd,
+                               offset, qiov, type);
+}
+
+int coroutine_fn luring_co_fallocate(BlockDriverState *bs, int fd,
+                                     uint64_t offset, uint64_t len, int type)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    LuringState *s = aio_get_linux_io_uring(ctx);
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .len        = len,
+    };
+    int ret;
+
+    assert(type == QEMU_AIO_WRITE_ZEROES || type == QEMU_AIO_DISCARD);
+    if (!s->has_fallocate) {
+        return -ENOTSUP;
+    }
+
+    trace_luring_co_submit(bs, s, &luringcb, fd, offset, len, type);
+    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
     aio_set_fd_handler(old_context, s->ring.ring_fd,
@@ -422,28 +890,52 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(bool iopoll, int sqpoll_cpu, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    struct io_uring_params params = {};
+#ifdef HAVE_IO_URING_PREP_FALLOCATE
+    struct io_uring_probe *probe;
+#endif
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (iopoll) {
+        params.flags |= IORING_SETUP_IOPOLL;
+    }
+    if (sqpoll_cpu >= 0) {
+        /* The SQ thread also reaps the completions of an IOPOLL ring */
+        params.flags |= IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF;
+        params.sq_thread_cpu = sqpoll_cpu;
+    }
+    s->iopoll = iopoll && sqpoll_cpu < 0;
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
     if (rc < 0) {
         error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
         return NULL;
     }
+    trace_luring_init_params(s, params.flags, sqpoll_cpu);
+
+#ifdef HAVE_IO_URING_PREP_FALLOCATE
+    probe = io_uring_get_probe_ring(ring);
+    s->has_fallocate = probe &&
+                       io_uring_opcode_supported(probe, IORING_OP_FALLOCATE);
+    io_uring_free_probe(probe);
+#endif
 
     ioq_init(&s->io_q);
+    luring_fixed_add_state(s);
     return s;
 
 }
 
 void luring_cleanup(LuringState *s)
 {
+    luring_fixed_remove_state(s);
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
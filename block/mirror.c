@@ -29,6 +29,15 @@
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/*
+ * In hybrid copy mode, guest writes are counted per region, and the counts
+ * are halved every MIRROR_HEAT_DECAY_NS.  Writes to regions with at least
+ * MIRROR_HOT_WRITES are copied to the target synchronously.
+ */
+#define MIRROR_HOT_REGION_SIZE (1 * MiB)
+#define MIRROR_HOT_WRITES 4
+#define MIRROR_HEAT_DECAY_NS NANOSECONDS_PER_SECOND
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -68,6 +77,10 @@ typedef struct MirrorBlockJob {
      * and the job is running in active mode.
      */
     bool actively_synced;
+    /* Recent guest writes per MIRROR_HOT_REGION_SIZE, accessed with atomics */
+    uint8_t *heat;
+    int64_t heat_regions;
+    int64_t last_heat_decay_ns;
     bool should_complete;
     int64_t granularity;
     size_t buf_size;
@@ -919,6 +932,22 @@ static int coroutine_fn mirror_flush(MirrorBlockJob *s)
     return ret;
 }
 
+/* Halve the write counts of hybrid copy mode once per MIRROR_HEAT_DECAY_NS */
+static void mirror_decay_heat(MirrorBlockJob *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t i;
+
+    if (now - s->last_heat_decay_ns < MIRROR_HEAT_DECAY_NS ||
+        qatomic_read(&s->copy_mode) != MIRROR_COPY_MODE_HYBRID) {
+        return;
+    }
+    s->last_heat_decay_ns = now;
+    for (i = 0; i < s->heat_regions; i++) {
+        qatomic_set(&s->heat[i], qatomic_read(&s->heat[i]) / 2);
+    }
+}
+
 static int coroutine_fn mirror_run(Job *job, Error **errp)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common.job);
@@ -985,6 +1014,8 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     length = DIV_ROUND_UP(s->bdev_length, s->granularity);
     s->in_flight_bitmap = bitmap_new(length);
+    s->heat_regions = DIV_ROUND_UP(s->bdev_length, MIRROR_HOT_REGION_SIZE);
+    s->heat = g_new0(uint8_t, s->heat_regions);
 
     /* If we have no backing file yet in the destination, we cannot let
      * the destination do COW.  Instead, we copy sectors around the
@@ -1046,6 +1077,8 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
             goto immediate_exit;
         }
 
+        mirror_decay_heat(s);
+
         cnt = bdrv_get_dirty_count(s->dirty_bitmap);
         /* cnt is the number of dirty bytes remaining and s->bytes_in_flight is
          * the number of bytes currently being processed; together those are
@@ -1089,7 +1122,8 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
                  */
                 job_transition_to_ready(&s->common.job);
             }
-            if (qatomic_read(&s->copy_mode) != MIRROR_COPY_MODE_BACKGROUND) {
+            if (qatomic_read(&s->copy_mode) ==
+                MIRROR_COPY_MODE_WRITE_BLOCKING) {
                 qatomic_set(&s->actively_synced, true);
             }
 
@@ -1159,6 +1193,7 @@ immediate_exit:
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
+    g_free(s->heat);
     bdrv_dirty_iter_free(s->dbi);
 
     if (need_drain) {
@@ -1267,23 +1302,24 @@ static void mirror_change(BlockJob *job, BlockJobChangeOptions *opts,
 
     GLOBAL_STATE_CODE();
 
-    if (qatomic_read(&s->copy_mode) == change_opts->copy_mode) {
+    current = qatomic_read(&s->copy_mode);
+    if (current == change_opts->copy_mode) {
         return;
     }
 
-    if (change_opts->copy_mode != MIRROR_COPY_MODE_WRITE_BLOCKING) {
+    /* Only switches to a mode that copies more writes synchronously */
+    if (change_opts->copy_mode == MIRROR_COPY_MODE_BACKGROUND) {
         error_setg(errp, "Change to copy mode '%s' is not implemented",
                    MirrorCopyMode_str(change_opts->copy_mode));
         return;
     }
-
-    current = qatomic_cmpxchg(&s->copy_mode, MIRROR_COPY_MODE_BACKGROUND,
-                              change_opts->copy_mode);
-    if (current != MIRROR_COPY_MODE_BACKGROUND) {
-        error_setg(errp, "Expected current copy mode '%s', got '%s'",
-                   MirrorCopyMode_str(MIRROR_COPY_MODE_BACKGROUND),
+    if (current == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        error_setg(errp, "Change from copy mode '%s' is not implemented",
                    MirrorCopyMode_str(current));
+        return;
     }
+
+    qatomic_set(&s->copy_mode, change_opts->copy_mode);
 }
 
 static void mirror_query(BlockJob *job, BlockJobInfo *info)
@@ -1515,11 +1551,47 @@ bdrv_mirror_top_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
     return bdrv_co_preadv(bs->backing, offset, bytes, qiov, flags);
 }
 
-static bool should_copy_to_target(MirrorBDSOpaque *s)
+/*
+ * Count a guest write in the regions it touches and return whether one of
+ * them is written often enough that copying it in the background would
+ * not converge.  The counts are updated without a lock because they are
+ * only a heuristic.
+ */
+static bool mirror_write_is_hot(MirrorBlockJob *s, uint64_t offset,
+                                uint64_t bytes)
+{
+    int64_t start = offset / MIRROR_HOT_REGION_SIZE;
+    int64_t end = MIN(DIV_ROUND_UP(offset + bytes, MIRROR_HOT_REGION_SIZE),
+                      s->heat_regions);
+    bool hot = false;
+    int64_t i;
+
+    for (i = start; i < end; i++) {
+        unsigned heat = qatomic_read(&s->heat[i]);
+
+        if (heat < UINT8_MAX) {
+            qatomic_set(&s->heat[i], ++heat);
+        }
+        hot |= heat >= MIRROR_HOT_WRITES;
+    }
+    return hot;
+}
+
+static bool should_copy_to_target(MirrorBDSOpaque *s, uint64_t offset,
+                                  uint64_t bytes)
 {
-    return s->job && s->job->ret >= 0 &&
-        !job_is_cancelled(&s->job->common.job) &&
-        qatomic_read(&s->job->copy_mode) == MIRROR_COPY_MODE_WRITE_BLOCKING;
+    if (!s->job || s->job->ret < 0 || job_is_cancelled(&s->job->common.job)) {
+        return false;
+    }
+
+    switch (qatomic_read(&s->job->copy_mode)) {
+    case MIRROR_COPY_MODE_WRITE_BLOCKING:
+        return true;
+    case MIRROR_COPY_MODE_HYBRID:
+        return mirror_write_is_hot(s->job, offset, bytes);
+    default:
+        return false;
+    }
 }
 
 static int coroutine_fn GRAPH_RDLOCK
@@ -1579,7 +1651,7 @@ bdrv_mirror_top_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
     QEMUIOVector bounce_qiov;
     void *bounce_buf;
     int ret = 0;
-    bool copy_to_target = should_copy_to_target(bs->opaque);
+    bool copy_to_target = should_copy_to_target(bs->opaque, offset, bytes);
 
     if (copy_to_target) {
         /* The guest might concurrently modify the data to write; but
@@ -1620,7 +1692,7 @@ static int coroutine_fn GRAPH_RDLOCK
 bdrv_mirror_top_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                               int64_t bytes, BdrvRequestFlags flags)
 {
-    bool copy_to_target = should_copy_to_target(bs->opaque);
+    bool copy_to_target = should_copy_to_target(bs->opaque, offset, bytes);
     return bdrv_mirror_top_do_write(bs, MIRROR_METHOD_ZERO, copy_to_target,
                                     offset, bytes, NULL, flags);
 }
@@ -1628,7 +1700,7 @@ bdrv_mirror_top_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
 static int coroutine_fn GRAPH_RDLOCK
 bdrv_mirror_top_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
 {
-    bool copy_to_target = should_copy_to_target(bs->opaque);
+    bool copy_to_target = should_copy_to_target(bs->opaque, offset, bytes);
     return bdrv_mirror_top_do_write(bs, MIRROR_METHOD_DISCARD, copy_to_target,
                                     offset, bytes, NULL, 0);
 }
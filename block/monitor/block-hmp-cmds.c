@@ -402,7 +402,7 @@ void hmp_nbd_server_start(Monitor *mon, const QDict *qdict)
         goto exit;
     }
 
-    nbd_server_start(addr, NULL, NULL, 0, &local_err);
+    nbd_server_start(addr, NULL, NULL, 0, false, &local_err);
     qapi_free_SocketAddress(addr);
     if (local_err != NULL) {
         goto exit;
@@ -499,7 +499,7 @@ void hmp_block_stream(Monitor *mon, const QDict *qdict)
     qmp_block_stream(device, device, base, NULL, NULL, false, false, NULL,
                      qdict_haskey(qdict, "speed"), speed,
                      true, BLOCKDEV_ON_ERROR_REPORT, NULL,
-                     false, false, false, false, &error);
+                     false, false, false, false, NULL, &error);
 
     hmp_handle_error(mon, error);
 }
@@ -0,0 +1,578 @@
+/*
+ * NVMe passthrough block driver based on io_uring
+ *
+ * Commands are submitted to the generic character device of a namespace
+ * (/dev/ngXnY) with IORING_OP_URING_CMD, so that reads and writes reach the
+ * NVMe driver without going through the host block layer.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include <linux/nvme_ioctl.h>
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#include "block/nvme.h"
+
+#define NVME_PASSTHRU_OPT_PATH "path"
+
+#define NVME_PASSTHRU_QUEUE_SIZE 128
+
+/* Transfer limit of controllers without MDTS, as for the host driver */
+#define NVME_PASSTHRU_MAX_TRANSFER (1 * MiB)
+
+typedef struct {
+    Coroutine *co;
+    AioContext *ctx;
+    AioCompletion completion;
+    int res;
+    int ret;
+} NVMePassthruRequest;
+
+typedef struct {
+    AioContext *aio_context;
+    char *path;
+    int fd;
+
+    uint32_t nsid;
+    uint64_t nsze; /* Namespace size reported by identify command */
+    int blkshift;
+    uint32_t max_transfer;
+    bool write_cache_supported;
+    bool supports_discard;
+    bool supports_write_zeroes;
+
+    QemuMutex lock;
+    /* Fields protected by @lock */
+    struct io_uring ring;
+    CoQueue free_sqe_queue;
+    unsigned int inflight;
+} BDRVNVMePassthruState;
+
+static QemuOptsList runtime_opts = {
+    .name = "nvme-passthru",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = NVME_PASSTHRU_OPT_PATH,
+            .type = QEMU_OPT_STRING,
+            .help = "Character device of the NVMe namespace, e.g. /dev/ng0n1",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int nvme_passthru_identify_cmd(int fd, uint32_t nsid, uint32_t cns,
+                                      void *buf, Error **errp)
+{
+    struct nvme_admin_cmd cmd = {
+        .opcode = NVME_ADM_CMD_IDENTIFY,
+        .nsid = nsid,
+        .addr = (uintptr_t)buf,
+        .data_len = NVME_IDENTIFY_DATA_SIZE,
+        .cdw10 = cns,
+    };
+    int ret;
+
+    ret = ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+    if (ret) {
+        if (ret < 0) {
+            error_setg_errno(errp, errno, "Failed to identify NVMe %s",
+                             cns == NVME_ID_CNS_CTRL ? "controller" :
+                                                       "namespace");
+        } else {
+            error_setg(errp, "Failed to identify NVMe %s: status 0x%x",
+                       cns == NVME_ID_CNS_CTRL ? "controller" : "namespace",
+                       ret);
+        }
+        return -EIO;
+    }
+    return 0;
+}
+
+static int nvme_passthru_identify(BlockDriverState *bs, Error **errp)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+    g_autofree NvmeIdCtrl *idctrl = g_new0(NvmeIdCtrl, 1);
+    g_autofree NvmeIdNs *idns = g_new0(NvmeIdNs, 1);
+    const NvmeLBAF *lbaf;
+    uint16_t oncs;
+    int ret;
+
+    ret = ioctl(s->fd, NVME_IOCTL_ID);
+    if (ret < 0) {
+        error_setg_errno(errp, errno, "Failed to get the NVMe namespace ID");
+        return -errno;
+    }
+    s->nsid = ret;
+
+    ret = nvme_passthru_identify_cmd(s->fd, 0, NVME_ID_CNS_CTRL, idctrl, errp);
+    if (ret) {
+        return ret;
+    }
+
+    s->max_transfer = NVME_PASSTHRU_MAX_TRANSFER;
+    if (idctrl->mdts) {
+        /* Assuming the smallest page size of 4KiB */
+        s->max_transfer = MIN(s->max_transfer,
+                              4 * KiB << MIN(idctrl->mdts, 20));
+    }
+    oncs = le16_to_cpu(idctrl->oncs);
+    s->supports_discard = !!(oncs & NVME_ONCS_DSM);
+    s->supports_write_zeroes = !!(oncs & NVME_ONCS_WRITE_ZEROES);
+    s->write_cache_supported = idctrl->vwc & 0x1;
+
+    ret = nvme_passthru_identify_cmd(s->fd, s->nsid, NVME_ID_CNS_NS, idns,
+                                     errp);
+    if (ret) {
+        return ret;
+    }
+
+    s->nsze = le64_to_cpu(idns->nsze);
+    lbaf = &idns->lbaf[NVME_ID_NS_FLBAS_INDEX(idns->flbas)];
+
+    if (lbaf->ms) {
+        error_setg(errp, "Namespaces with metadata are not yet supported");
+        return -EINVAL;
+    }
+
+    if (lbaf->ds < BDRV_SECTOR_BITS || lbaf->ds > 12 ||
+        (1 << lbaf->ds) > qemu_real_host_page_size()) {
+        error_setg(errp, "Namespace has unsupported block size (2^%d)",
+                   lbaf->ds);
+        return -EINVAL;
+    }
+
+    s->blkshift = lbaf->ds;
+    return 0;
+}
+
+static void nvme_passthru_free_sqe_cb(void *opaque)
+{
+    BDRVNVMePassthruState *s = opaque;
+
+    qemu_mutex_lock(&s->lock);
+    while (s->inflight < NVME_PASSTHRU_QUEUE_SIZE &&
+           qemu_co_enter_next(&s->free_sqe_queue, &s->lock)) {
+        /* Retry waiting requests */
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+/*
+ * The result of a passthrough command is 0, an NVMe status, or a negative
+ * errno if the command could not be submitted to the controller.
+ */
+static void nvme_passthru_complete_bh(void *opaque)
+{
+    NVMePassthruRequest *req = opaque;
+
+    req->ret = req->res > 0 ? -EIO : req->res;
+    aio_co_wake(req->co);
+}
+
+static void nvme_passthru_complete(NVMePassthruRequest *req, int res)
+{
+    req->res = res;
+
+    /*
+     * A request from another AioContext may not be waiting yet, complete
+     * it from its own AioContext.
+     */
+    if (req->ctx == qemu_get_current_aio_context()) {
+        nvme_passthru_complete_bh(req);
+    } else {
+        aio_complete_in(req->ctx, &req->completion,
+                        nvme_passthru_complete_bh, req);
+    }
+}
+
+static bool nvme_passthru_process_completions(BDRVNVMePassthruState *s)
+{
+    struct io_uring_cqe *cqe;
+    bool progress = false;
+
+    for (;;) {
+        NVMePassthruRequest *req;
+        int res;
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            if (io_uring_peek_cqe(&s->ring, &cqe) || !cqe) {
+                if (progress && !qemu_co_queue_empty(&s->free_sqe_queue)) {
+                    aio_bh_schedule_oneshot(s->aio_context,
+                                            nvme_passthru_free_sqe_cb, s);
+                }
+                return progress;
+            }
+            req = io_uring_cqe_get_data(cqe);
+            res = cqe->res;
+            io_uring_cqe_seen(&s->ring, cqe);
+            s->inflight--;
+        }
+
+        trace_nvme_passthru_complete(s, req, res);
+        nvme_passthru_complete(req, res);
+        progress = true;
+    }
+}
+
+static void nvme_passthru_handle_event(void *opaque)
+{
+    nvme_passthru_process_completions(opaque);
+}
+
+static bool nvme_passthru_poll_cb(void *opaque)
+{
+    BDRVNVMePassthruState *s = opaque;
+
+    return io_uring_cq_ready(&s->ring);
+}
+
+static void nvme_passthru_poll_ready(void *opaque)
+{
+    nvme_passthru_process_completions(opaque);
+}
+
+static int coroutine_fn nvme_passthru_co_cmd(BlockDriverState *bs,
+                                             struct nvme_uring_cmd *cmd,
+                                             uint32_t cmd_op)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+    NVMePassthruRequest req = {
+        .co = qemu_coroutine_self(),
+        .ctx = qemu_get_current_aio_context(),
+        .ret = -EINPROGRESS,
+    };
+    struct io_uring_sqe *sqe;
+    int ret;
+
+    cmd->nsid = s->nsid;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        while (s->inflight >= NVME_PASSTHRU_QUEUE_SIZE) {
+            qemu_co_queue_wait(&s->free_sqe_queue, &s->lock);
+        }
+
+        /* Commands are submitted right away, the SQ always has room */
+        sqe = io_uring_get_sqe(&s->ring);
+        assert(sqe);
+        io_uring_prep_rw(IORING_OP_URING_CMD, sqe, s->fd, NULL, 0, 0);
+        sqe->cmd_op = cmd_op;
+        memcpy(sqe->cmd, cmd, sizeof(*cmd));
+        io_uring_sqe_set_data(sqe, &req);
+
+        ret = io_uring_submit(&s->ring);
+        trace_nvme_passthru_submit(s, &req, cmd->opcode, ret);
+        if (ret < 0) {
+            return ret;
+        }
+        s->inflight++;
+    }
+
+    while (req.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return req.ret;
+}
+
+static int coroutine_fn nvme_passthru_co_prw(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, bool is_write,
+                                             BdrvRequestFlags flags)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+    uint64_t slba = offset >> s->blkshift;
+    struct nvme_uring_cmd cmd = {
+        .opcode = is_write ? NVME_CMD_WRITE : NVME_CMD_READ,
+        .cdw10 = slba & 0xffffffff,
+        .cdw11 = slba >> 32,
+        .cdw12 = ((bytes >> s->blkshift) - 1) |
+                 (flags & BDRV_REQ_FUA ? NVME_RW_FUA : 0),
+    };
+    uint32_t cmd_op;
+
+    assert(QEMU_IS_ALIGNED(offset | bytes, 1 << s->blkshift));
+    assert(bytes <= s->max_transfer);
+
+    if (qiov->niov == 1) {
+        cmd.addr = (uintptr_t)qiov->iov[0].iov_base;
+        cmd.data_len = qiov->iov[0].iov_len;
+        cmd_op = NVME_URING_CMD_IO;
+    } else {
+        cmd.addr = (uintptr_t)qiov->iov;
+        cmd.data_len = qiov->niov;
+        cmd_op = NVME_URING_CMD_IO_VEC;
+    }
+
+    return nvme_passthru_co_cmd(bs, &cmd, cmd_op);
+}
+
+static int coroutine_fn nvme_passthru_co_preadv(BlockDriverState *bs,
+                                                int64_t offset, int64_t bytes,
+                                                QEMUIOVector *qiov,
+                                                BdrvRequestFlags flags)
+{
+    return nvme_passthru_co_prw(bs, offset, bytes, qiov, false, flags);
+}
+
+static int coroutine_fn nvme_passthru_co_pwritev(BlockDriverState *bs,
+                                                 int64_t offset, int64_t bytes,
+                                                 QEMUIOVector *qiov,
+                                                 BdrvRequestFlags flags)
+{
+    return nvme_passthru_co_prw(bs, offset, bytes, qiov, true, flags);
+}
+
+static int coroutine_fn nvme_passthru_co_flush(BlockDriverState *bs)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+    struct nvme_uring_cmd cmd = {
+        .opcode = NVME_CMD_FLUSH,
+    };
+
+    if (!s->write_cache_supported) {
+        return 0;
+    }
+
+    return nvme_passthru_co_cmd(bs, &cmd, NVME_URING_CMD_IO);
+}
+
+static int coroutine_fn nvme_passthru_co_pwrite_zeroes(BlockDriverState *bs,
+                                                       int64_t offset,
+                                                       int64_t bytes,
+                                                       BdrvRequestFlags flags)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+    uint64_t slba = offset >> s->blkshift;
+    struct nvme_uring_cmd cmd = {
+        .opcode = NVME_CMD_WRITE_ZEROES,
+        .cdw10 = slba & 0xffffffff,
+        .cdw11 = slba >> 32,
+        .cdw12 = (bytes >> s->blkshift) - 1,
+    };
+
+    if (!s->supports_write_zeroes) {
+        return -ENOTSUP;
+    }
+
+    if (flags & BDRV_REQ_MAY_UNMAP) {
+        cmd.cdw12 |= 1 << 25; /* deallocate bit */
+    }
+    if (flags & BDRV_REQ_FUA) {
+        cmd.cdw12 |= NVME_RW_FUA;
+    }
+
+    assert(bytes >> s->blkshift <= 0x10000);
+    return nvme_passthru_co_cmd(bs, &cmd, NVME_URING_CMD_IO);
+}
+
+static int coroutine_fn nvme_passthru_co_pdiscard(BlockDriverState *bs,
+                                                  int64_t offset,
+                                                  int64_t bytes)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+    g_autofree NvmeDsmRange *range = NULL;
+    struct nvme_uring_cmd cmd = {
+        .opcode = NVME_CMD_DSM,
+        .cdw10 = 0, /* number of ranges - 1 */
+        .cdw11 = NVME_DSMGMT_AD,
+    };
+
+    if (!s->supports_discard) {
+        return -ENOTSUP;
+    }
+
+    range = g_new0(NvmeDsmRange, 1);
+    range->nlb = cpu_to_le32(bytes >> s->blkshift);
+    range->slba = cpu_to_le64(offset >> s->blkshift);
+    cmd.addr = (uintptr_t)range;
+    cmd.data_len = sizeof(*range);
+
+    return nvme_passthru_co_cmd(bs, &cmd, NVME_URING_CMD_IO);
+}
+
+static void nvme_passthru_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+
+    aio_set_fd_handler(s->aio_context, s->ring.ring_fd,
+                       NULL, NULL, NULL, NULL, NULL);
+    s->aio_context = NULL;
+}
+
+static void nvme_passthru_attach_aio_context(BlockDriverState *bs,
+                                             AioContext *new_context)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+
+    s->aio_context = new_context;
+    aio_set_fd_handler(new_context, s->ring.ring_fd,
+                       nvme_passthru_handle_event, NULL,
+                       nvme_passthru_poll_cb, nvme_passthru_poll_ready, s);
+}
+
+static void nvme_passthru_close(BlockDriverState *bs)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+
+    nvme_passthru_detach_aio_context(bs);
+    io_uring_queue_exit(&s->ring);
+    qemu_mutex_destroy(&s->lock);
+    qemu_close(s->fd);
+    g_free(s->path);
+}
+
+static int nvme_passthru_file_open(BlockDriverState *bs, QDict *options,
+                                   int flags, Error **errp)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+    QemuOpts *opts;
+    const char *path;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &error_abort);
+    path = qemu_opt_get(opts, NVME_PASSTHRU_OPT_PATH);
+    if (!path) {
+        error_setg(errp, "'" NVME_PASSTHRU_OPT_PATH "' option is required");
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    s->path = g_strdup(path);
+    qemu_opts_del(opts);
+
+    s->fd = qemu_open(s->path, flags & BDRV_O_RDWR ? O_RDWR : O_RDONLY, errp);
+    if (s->fd < 0) {
+        ret = -errno;
+        goto fail_path;
+    }
+
+    ret = nvme_passthru_identify(bs, errp);
+    if (ret) {
+        goto fail_fd;
+    }
+
+    /* NVMe passthrough commands need big SQEs and CQEs */
+    ret = io_uring_queue_init(NVME_PASSTHRU_QUEUE_SIZE, &s->ring,
+                              IORING_SETUP_SQE128 | IORING_SETUP_CQE32);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to set up io_uring passthrough");
+        goto fail_fd;
+    }
+
+    qemu_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->free_sqe_queue);
+    nvme_passthru_attach_aio_context(bs, bdrv_get_aio_context(bs));
+
+    bs->supported_write_flags = BDRV_REQ_FUA;
+    bs->supported_zero_flags = BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP |
+                               BDRV_REQ_NO_FALLBACK;
+    return 0;
+
+fail_fd:
+    qemu_close(s->fd);
+fail_path:
+    g_free(s->path);
+    return ret;
+}
+
+static int64_t coroutine_fn nvme_passthru_co_getlength(BlockDriverState *bs)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+    return s->nsze << s->blkshift;
+}
+
+static int nvme_passthru_probe_blocksizes(BlockDriverState *bs,
+                                          BlockSizes *bsz)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+
+    bsz->phys = UINT32_C(1) << s->blkshift;
+    bsz->log = UINT32_C(1) << s->blkshift;
+    return 0;
+}
+
+static int nvme_passthru_reopen_prepare(BDRVReopenState *reopen_state,
+                                        BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static void nvme_passthru_refresh_filename(BlockDriverState *bs)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+
+    pstrcpy(bs->exact_filename, sizeof(bs->exact_filename), s->path);
+}
+
+static void nvme_passthru_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVNVMePassthruState *s = bs->opaque;
+
+    /* The host driver bounces buffers that are not dword aligned */
+    bs->bl.min_mem_alignment = 4;
+    bs->bl.opt_mem_alignment = qemu_real_host_page_size();
+    bs->bl.request_alignment = 1 << s->blkshift;
+    bs->bl.max_transfer = s->max_transfer;
+
+    /* Write Zeroes and Dataset Management take 16 and 32 bit block counts */
+    bs->bl.max_pwrite_zeroes = 1ULL << (s->blkshift + 16);
+    bs->bl.pwrite_zeroes_alignment = 1 << s->blkshift;
+    bs->bl.max_pdiscard = (uint64_t)UINT32_MAX << s->blkshift;
+    bs->bl.pdiscard_alignment = 1 << s->blkshift;
+}
+
+static const char *const nvme_passthru_strong_runtime_opts[] = {
+    NVME_PASSTHRU_OPT_PATH,
+
+    NULL
+};
+
+static BlockDriver bdrv_nvme_passthru = {
+    .format_name              = "nvme-passthru",
+    .protocol_name            = "nvme-passthru",
+    .instance_size            = sizeof(BDRVNVMePassthruState),
+
+    .bdrv_co_create_opts      = bdrv_co_create_opts_simple,
+    .create_opts              = &bdrv_create_opts_simple,
+
+    .bdrv_file_open           = nvme_passthru_file_open,
+    .bdrv_close               = nvme_passthru_close,
+    .bdrv_co_getlength        = nvme_passthru_co_getlength,
+    .bdrv_probe_blocksizes    = nvme_passthru_probe_blocksizes,
+
+    .bdrv_co_preadv           = nvme_passthru_co_preadv,
+    .bdrv_co_pwritev          = nvme_passthru_co_pwritev,
+
+    .bdrv_co_pwrite_zeroes    = nvme_passthru_co_pwrite_zeroes,
+    .bdrv_co_pdiscard         = nvme_passthru_co_pdiscard,
+
+    .bdrv_co_flush_to_disk    = nvme_passthru_co_flush,
+    .bdrv_reopen_prepare      = nvme_passthru_reopen_prepare,
+
+    .bdrv_refresh_filename    = nvme_passthru_refresh_filename,
+    .bdrv_refresh_limits      = nvme_passthru_refresh_limits,
+    .strong_runtime_opts      = nvme_passthru_strong_runtime_opts,
+
+    .bdrv_detach_aio_context  = nvme_passthru_detach_aio_context,
+    .bdrv_attach_aio_context  = nvme_passthru_attach_aio_context,
+};
+
+static void bdrv_nvme_passthru_init(void)
+{
+    bdrv_register(&bdrv_nvme_passthru);
+}
+
+block_init(bdrv_nvme_passthru_init);
@@ -29,7 +29,10 @@
 #include "block/block-io.h"
 #include "block/dirty-bitmap.h"
 #include "qapi/error.h"
+#include "qemu/bitmap.h"
+#include "qemu/crc32c.h"
 #include "qemu/cutils.h"
+#include "qemu/error-report.h"
 
 #include "qcow2.h"
 
@@ -96,6 +99,87 @@ typedef struct Qcow2Bitmap {
 } Qcow2Bitmap;
 typedef QSIMPLEQ_HEAD(Qcow2BitmapList, Qcow2Bitmap) Qcow2BitmapList;
 
+/*
+ * Bitmap journal
+ *
+ * With bitmap-sync-interval, persistent bitmaps are kept up to date in the
+ * image while it is in use, without the IN_USE flag, so that they survive a
+ * crash and need not be written as a whole when the image is closed.
+ *
+ * The bitmap in the image always covers all guest writes that may have
+ * reached the image: before a write that sets bits that are not set yet,
+ * those bits are set in memory, and the bitmap clusters containing them are
+ * written and flushed.  Writes that need this at the same time share one
+ * flush.  Other changes, such as bits cleared by a backup or merged from
+ * another bitmap, are written every bitmap-sync-interval seconds, and only
+ * for the bitmap clusters whose contents changed.
+ */
+typedef struct Qcow2JournaledBitmap {
+    char *name;
+    uint8_t granularity_bits;
+    uint32_t flags;             /* as in the bitmap directory */
+    bool is_new;                /* not in the bitmap directory yet */
+
+    /* Computed by bitmap_journal_update() */
+    uint32_t new_flags;
+    bool gone;
+
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint64_t *table;            /* in CPU byte order */
+    uint32_t *crc;              /* of the clusters as last written */
+
+    /* Clusters that must be written before the next guest write */
+    unsigned long *pending;
+    unsigned long *writing;
+
+    QSIMPLEQ_ENTRY(Qcow2JournaledBitmap) entry;
+} Qcow2JournaledBitmap;
+
+struct Qcow2BitmapJournal {
+    /* Protects @bitmaps, the pending clusters and @pending_seq */
+    QemuMutex mutex;
+    QSIMPLEQ_HEAD(, Qcow2JournaledBitmap) bitmaps;
+    uint64_t pending_seq;
+
+    /*
+     * Serializes writing bitmaps to the image; taken before s->lock.  Only
+     * holders of both @lock and @mutex add or remove bitmaps.
+     */
+    CoMutex lock;
+    uint64_t written_seq;
+};
+
+static Qcow2JournaledBitmap *bitmap_journal_find(Qcow2BitmapJournal *j,
+                                                 const char *name)
+{
+    Qcow2JournaledBitmap *jb;
+
+    QSIMPLEQ_FOREACH(jb, &j->bitmaps, entry) {
+        if (!strcmp(jb->name, name)) {
+            return jb;
+        }
+    }
+
+    return NULL;
+}
+
+static bool is_journaled(BDRVQcow2State *s, const char *name)
+{
+    Qcow2BitmapJournal *j = s->bitmap_journal;
+    bool ret;
+
+    if (!j) {
+        return false;
+    }
+
+    qemu_mutex_lock(&j->mutex);
+    ret = bitmap_journal_find(j, name) != NULL;
+    qemu_mutex_unlock(&j->mutex);
+
+    return ret;
+}
+
 typedef enum BitmapType {
     BT_DIRTY_TRACKING_BITMAP = 1
 } BitmapType;
@@ -1158,6 +1242,11 @@ int qcow2_reopen_bitmaps_rw(BlockDriverState *bs, Error **errp)
             goto out;
         }
 
+        if (is_journaled(s, bm->name)) {
+            /* Kept up to date in the image without IN_USE */
+            continue;
+        }
+
         if (!(bm->flags & BME_FLAG_IN_USE)) {
             if (!bdrv_dirty_bitmap_readonly(bitmap)) {
                 error_setg(errp, "Corruption: bitmap '%s' is not marked IN_USE "
@@ -1454,12 +1543,608 @@ static Qcow2Bitmap *find_bitmap_by_name(Qcow2BitmapList *bm_list,
     return NULL;
 }
 
+/*
+ * Bitmap journal implementation
+ */
+
+/* Metadata updates outside of coroutines happen in drained sections */
+static void coroutine_mixed_fn bitmap_journal_lock_metadata(BDRVQcow2State *s)
+{
+    if (qemu_in_coroutine()) {
+        qemu_co_mutex_lock(&s->lock);
+    }
+}
+
+static void coroutine_mixed_fn
+bitmap_journal_unlock_metadata(BDRVQcow2State *s)
+{
+    if (qemu_in_coroutine()) {
+        qemu_co_mutex_unlock(&s->lock);
+    }
+}
+
+Qcow2BitmapJournal *qcow2_bitmap_journal_new(void)
+{
+    Qcow2BitmapJournal *j = g_new0(Qcow2BitmapJournal, 1);
+
+    qemu_mutex_init(&j->mutex);
+    QSIMPLEQ_INIT(&j->bitmaps);
+    qemu_co_mutex_init(&j->lock);
+
+    return j;
+}
+
+static void bitmap_journal_entry_free(Qcow2JournaledBitmap *jb)
+{
+    g_free(jb->name);
+    g_free(jb->table);
+    g_free(jb->crc);
+    g_free(jb->pending);
+    g_free(jb->writing);
+    g_free(jb);
+}
+
+/* Stop journaling all bitmaps, leaving them in the image as they are */
+static void bitmap_journal_clear(Qcow2BitmapJournal *j)
+{
+    Qcow2JournaledBitmap *jb, *next;
+
+    qemu_mutex_lock(&j->mutex);
+    QSIMPLEQ_FOREACH_SAFE(jb, &j->bitmaps, entry, next) {
+        bitmap_journal_entry_free(jb);
+    }
+    QSIMPLEQ_INIT(&j->bitmaps);
+    qemu_mutex_unlock(&j->mutex);
+}
+
+void qcow2_bitmap_journal_free(Qcow2BitmapJournal *j)
+{
+    if (!j) {
+        return;
+    }
+
+    bitmap_journal_clear(j);
+    qemu_mutex_destroy(&j->mutex);
+    g_free(j);
+}
+
+static void coroutine_mixed_fn GRAPH_RDLOCK
+bitmap_journal_entry_free_clusters(BlockDriverState *bs,
+                                   Qcow2JournaledBitmap *jb)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    bitmap_journal_lock_metadata(s);
+    clear_bitmap_table(bs, jb->table, jb->table_size);
+    qcow2_free_clusters(bs, jb->table_offset,
+                        jb->table_size * BME_TABLE_ENTRY_SIZE,
+                        QCOW2_DISCARD_OTHER);
+    bitmap_journal_unlock_metadata(s);
+}
+
+/*
+ * Allocate an empty bitmap table in the image for the bitmap @name.
+ * Returns NULL without setting @errp if the bitmap does not exist anymore
+ * or cannot be stored; the latter is reported when the image is closed.
+ */
+static Qcow2JournaledBitmap * coroutine_mixed_fn GRAPH_RDLOCK
+bitmap_journal_entry_new(BlockDriverState *bs, const char *name, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournaledBitmap *jb;
+    BdrvDirtyBitmap *bitmap;
+    uint32_t granularity = 0;
+    uint64_t tb_size = 0;
+    int64_t tb_offset;
+    uint64_t *tb;
+    int ret;
+
+    qemu_mutex_lock(&bs->dirty_bitmap_mutex);
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (bitmap) {
+        uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+
+        granularity = bdrv_dirty_bitmap_granularity(bitmap);
+        tb_size = size_to_clusters(s,
+            bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size));
+    }
+    qemu_mutex_unlock(&bs->dirty_bitmap_mutex);
+
+    if (!bitmap || tb_size == 0 || tb_size > BME_MAX_TABLE_SIZE ||
+        tb_size * s->cluster_size > BME_MAX_PHYS_SIZE ||
+        check_constraints_on_bitmap(bs, name, granularity, NULL) < 0)
+    {
+        return NULL;
+    }
+
+    tb = g_try_new0(uint64_t, tb_size);
+    if (tb == NULL) {
+        error_setg(errp, "No memory");
+        return NULL;
+    }
+
+    bitmap_journal_lock_metadata(s);
+    tb_offset = qcow2_alloc_clusters(bs, tb_size * BME_TABLE_ENTRY_SIZE);
+    ret = tb_offset < 0 ? tb_offset :
+        qcow2_pre_write_overlap_check(bs, 0, tb_offset,
+                                      tb_size * BME_TABLE_ENTRY_SIZE, false);
+    bitmap_journal_unlock_metadata(s);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* All entries are zero, so no byte swapping is needed */
+    ret = bdrv_pwrite(bs->file, tb_offset, tb_size * BME_TABLE_ENTRY_SIZE,
+                      tb, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    jb = g_new0(Qcow2JournaledBitmap, 1);
+    jb->name = g_strdup(name);
+    jb->flags = BME_FLAG_IN_USE;
+    jb->granularity_bits = ctz32(granularity);
+    jb->is_new = true;
+    jb->table_offset = tb_offset;
+    jb->table_size = tb_size;
+    jb->table = tb;
+    jb->crc = g_new0(uint32_t, tb_size);
+    jb->pending = bitmap_new(tb_size);
+    jb->writing = bitmap_new(tb_size);
+
+    return jb;
+
+fail:
+    error_setg_errno(errp, -ret, "Failed to allocate bitmap table for '%s'",
+                     name);
+    if (tb_offset > 0) {
+        bitmap_journal_lock_metadata(s);
+        qcow2_free_clusters(bs, tb_offset, tb_size * BME_TABLE_ENTRY_SIZE,
+                            QCOW2_DISCARD_OTHER);
+        bitmap_journal_unlock_metadata(s);
+    }
+    g_free(tb);
+    return NULL;
+}
+
+/*
+ * Write cluster @i of @jb if its contents changed since it was last
+ * written, or unconditionally if @force.  Clusters that only contain zeroes
+ * and were never written stay unallocated.  Returns 1 if the cluster was
+ * written, 0 if not, and -errno on failure.
+ */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+bitmap_journal_write_cluster(BlockDriverState *bs, Qcow2JournaledBitmap *jb,
+                             uint32_t i, uint8_t *buf, bool force)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    uint64_t offset, end, limit, size;
+    uint64_t entry;
+    int64_t off;
+    uint32_t crc;
+    bool alloc;
+    int ret;
+
+    qemu_mutex_lock(&bs->dirty_bitmap_mutex);
+    bitmap = bdrv_find_dirty_bitmap(bs, jb->name);
+    if (!bitmap) {
+        /* Removed, bitmap_journal_update() drops it */
+        qemu_mutex_unlock(&bs->dirty_bitmap_mutex);
+        return 0;
+    }
+    limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap);
+    offset = i * limit;
+    end = MIN(bdrv_dirty_bitmap_size(bitmap), offset + limit);
+    size = bdrv_dirty_bitmap_serialization_size(bitmap, offset, end - offset);
+    assert(size <= s->cluster_size);
+    bdrv_dirty_bitmap_serialize_part(bitmap, buf, offset, end - offset);
+    qemu_mutex_unlock(&bs->dirty_bitmap_mutex);
+
+    if (size < s->cluster_size) {
+        memset(buf + size, 0, s->cluster_size - size);
+    }
+
+    crc = crc32c(0xffffffff, buf, s->cluster_size);
+    off = jb->table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+    alloc = !off;
+    if (alloc ? buffer_is_zero(buf, s->cluster_size)
+              : !force && crc == jb->crc[i]) {
+        jb->crc[i] = crc;
+        return 0;
+    }
+
+    bitmap_journal_lock_metadata(s);
+    if (alloc) {
+        off = qcow2_alloc_clusters(bs, s->cluster_size);
+    }
+    ret = off < 0 ? off :
+        qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size, false);
+    bitmap_journal_unlock_metadata(s);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, off, s->cluster_size, buf, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (alloc) {
+        /* The table must not point to the cluster before it is allocated */
+        bitmap_journal_lock_metadata(s);
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        bitmap_journal_unlock_metadata(s);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        entry = cpu_to_be64(off);
+        ret = bdrv_pwrite(bs->file,
+                          jb->table_offset + i * BME_TABLE_ENTRY_SIZE,
+                          BME_TABLE_ENTRY_SIZE, &entry, 0);
+        if (ret < 0) {
+            /* The entry may have been written, so leak the cluster */
+            return ret;
+        }
+        jb->table[i] = off;
+    }
+
+    jb->crc[i] = crc;
+    return 1;
+
+fail:
+    if (alloc && off > 0) {
+        bitmap_journal_lock_metadata(s);
+        qcow2_free_clusters(bs, off, s->cluster_size, QCOW2_DISCARD_OTHER);
+        bitmap_journal_unlock_metadata(s);
+    }
+    return ret;
+}
+
+/*
+ * Write the pending clusters of all journaled bitmaps and, if @all, the
+ * other clusters that changed.  In coroutine context, the caller must hold
+ * j->lock.
+ */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+bitmap_journal_write(BlockDriverState *bs, Qcow2BitmapJournal *j, bool all)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree uint8_t *buf = g_malloc(s->cluster_size);
+    Qcow2JournaledBitmap *jb;
+    bool written = false;
+    uint64_t seq;
+    uint32_t i;
+    int ret = 0;
+
+    /* Writers that set bits from now on wait for the next round */
+    qemu_mutex_lock(&j->mutex);
+    seq = j->pending_seq;
+    QSIMPLEQ_FOREACH(jb, &j->bitmaps, entry) {
+        unsigned long *tmp = jb->writing;
+
+        jb->writing = jb->pending;
+        jb->pending = tmp;
+    }
+    qemu_mutex_unlock(&j->mutex);
+
+    QSIMPLEQ_FOREACH(jb, &j->bitmaps, entry) {
+        i = all ? 0 : find_first_bit(jb->writing, jb->table_size);
+        while (i < jb->table_size) {
+            ret = bitmap_journal_write_cluster(bs, jb, i, buf,
+                                               test_bit(i, jb->writing));
+            if (ret < 0) {
+                goto out;
+            }
+            written |= ret;
+            i = all ? i + 1 : find_next_bit(jb->writing, jb->table_size, i + 1);
+        }
+    }
+
+    if (written) {
+        ret = bdrv_flush(bs->file->bs);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    j->written_seq = seq;
+
+out:
+    qemu_mutex_lock(&j->mutex);
+    QSIMPLEQ_FOREACH(jb, &j->bitmaps, entry) {
+        if (ret < 0) {
+            bitmap_or(jb->pending, jb->pending, jb->writing, jb->table_size);
+        }
+        bitmap_zero(jb->writing, jb->table_size);
+    }
+    qemu_mutex_unlock(&j->mutex);
+
+    return ret;
+}
+
+/* Start journaling the persistent bitmaps that are not journaled yet */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+bitmap_journal_adopt(BlockDriverState *bs, Qcow2BitmapJournal *j,
+                     Error **errp)
+{
+    ERRP_GUARD();
+    BdrvDirtyBitmap *bitmap;
+    GSList *names = NULL, *l;
+    int ret = 0;
+
+    qemu_mutex_lock(&bs->dirty_bitmap_mutex);
+    FOR_EACH_DIRTY_BITMAP(bs, bitmap) {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+
+        if (bdrv_dirty_bitmap_get_persistence(bitmap) &&
+            !bdrv_dirty_bitmap_inconsistent(bitmap) &&
+            !bdrv_dirty_bitmap_readonly(bitmap) &&
+            !bitmap_journal_find(j, name))
+        {
+            names = g_slist_prepend(names, g_strdup(name));
+        }
+    }
+    qemu_mutex_unlock(&bs->dirty_bitmap_mutex);
+
+    for (l = names; l; l = l->next) {
+        Qcow2JournaledBitmap *jb = bitmap_journal_entry_new(bs, l->data, errp);
+
+        if (jb) {
+            qemu_mutex_lock(&j->mutex);
+            QSIMPLEQ_INSERT_TAIL(&j->bitmaps, jb, entry);
+            qemu_mutex_unlock(&j->mutex);
+        } else if (*errp) {
+            ret = -EIO;
+            break;
+        }
+    }
+
+    g_slist_free_full(names, g_free);
+    return ret;
+}
+
+/*
+ * Start journaling new persistent bitmaps if @adopt, write all changes of
+ * the journaled bitmaps and update the bitmap directory.  Bitmaps that were
+ * removed are deleted from the image, and bitmaps that must not be stored
+ * anymore are marked IN_USE; neither is journaled afterwards.  In coroutine
+ * context, the caller must hold j->lock.
+ */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+bitmap_journal_update(BlockDriverState *bs, Qcow2BitmapJournal *j, bool adopt,
+                      Error **errp)
+{
+    ERRP_GUARD();
+    BDRVQcow2State *s = bs->opaque;
+    QSIMPLEQ_HEAD(, Qcow2JournaledBitmap) dropped;
+    QSIMPLEQ_HEAD(, Qcow2BitmapTable) drop_tables;
+    Qcow2JournaledBitmap *jb, *jb_next;
+    Qcow2BitmapTable *tb, *tb_next;
+    Qcow2BitmapList *bm_list = NULL;
+    Qcow2Bitmap *bm;
+    bool update_dir = false;
+    int ret;
+
+    QSIMPLEQ_INIT(&dropped);
+    QSIMPLEQ_INIT(&drop_tables);
+
+    if (adopt) {
+        ret = bitmap_journal_adopt(bs, j, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    ret = bitmap_journal_write(bs, j, true);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write bitmaps");
+        goto fail;
+    }
+
+    qemu_mutex_lock(&bs->dirty_bitmap_mutex);
+    QSIMPLEQ_FOREACH(jb, &j->bitmaps, entry) {
+        BdrvDirtyBitmap *bitmap = bdrv_find_dirty_bitmap(bs, jb->name);
+
+        jb->gone = !bitmap;
+        if (bitmap && bdrv_dirty_bitmap_get_persistence(bitmap) &&
+            !bdrv_dirty_bitmap_inconsistent(bitmap))
+        {
+            /* A frozen bitmap is enabled again when its job ends */
+            jb->new_flags = bdrv_dirty_bitmap_enabled(bitmap) ||
+                bdrv_dirty_bitmap_has_successor(bitmap) ? BME_FLAG_AUTO : 0;
+        } else {
+            jb->new_flags = jb->flags | BME_FLAG_IN_USE;
+        }
+        update_dir |= jb->is_new || jb->gone || jb->new_flags != jb->flags;
+    }
+    qemu_mutex_unlock(&bs->dirty_bitmap_mutex);
+
+    if (!update_dir) {
+        return 0;
+    }
+
+    bitmap_journal_lock_metadata(s);
+
+    if (s->nb_bitmaps == 0) {
+        bm_list = bitmap_list_new();
+    } else {
+        bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                                   s->bitmap_directory_size, errp);
+        if (bm_list == NULL) {
+            bitmap_journal_unlock_metadata(s);
+            ret = -EIO;
+            goto fail;
+        }
+    }
+
+    QSIMPLEQ_FOREACH(jb, &j->bitmaps, entry) {
+        bm = find_bitmap_by_name(bm_list, jb->name);
+
+        if (jb->is_new && (jb->gone || (jb->new_flags & BME_FLAG_IN_USE))) {
+            /* Leave the image as if the bitmap had never been journaled */
+            continue;
+        }
+
+        if (jb->gone) {
+            if (bm) {
+                QSIMPLEQ_REMOVE(bm_list, bm, Qcow2Bitmap, entry);
+                bitmap_free(bm);
+            }
+            continue;
+        }
+
+        if (!bm) {
+            bm = g_new0(Qcow2Bitmap, 1);
+            bm->name = g_strdup(jb->name);
+            QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
+        } else if (bm->table.offset != jb->table_offset) {
+            /* Replaced by the journaled copy */
+            tb = g_memdup(&bm->table, sizeof(bm->table));
+            QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+        }
+        bm->table.offset = jb->table_offset;
+        bm->table.size = jb->table_size;
+        bm->flags = jb->new_flags;
+        bm->granularity_bits = jb->granularity_bits;
+    }
+
+    ret = update_ext_header_and_dir(bs, bm_list);
+    if (ret < 0) {
+        bitmap_journal_unlock_metadata(s);
+        error_setg_errno(errp, -ret, "Failed to update bitmap extension");
+        goto fail;
+    }
+
+    QSIMPLEQ_FOREACH_SAFE(tb, &drop_tables, entry, tb_next) {
+        free_bitmap_clusters(bs, tb);
+        g_free(tb);
+    }
+    bitmap_journal_unlock_metadata(s);
+    bitmap_list_free(bm_list);
+
+    qemu_mutex_lock(&j->mutex);
+    QSIMPLEQ_FOREACH_SAFE(jb, &j->bitmaps, entry, jb_next) {
+        if (jb->gone || (jb->new_flags & BME_FLAG_IN_USE)) {
+            QSIMPLEQ_REMOVE(&j->bitmaps, jb, Qcow2JournaledBitmap, entry);
+            QSIMPLEQ_INSERT_TAIL(&dropped, jb, entry);
+        } else {
+            jb->flags = jb->new_flags;
+            jb->is_new = false;
+        }
+    }
+    qemu_mutex_unlock(&j->mutex);
+
+    QSIMPLEQ_FOREACH_SAFE(jb, &dropped, entry, jb_next) {
+        /* The clusters of bitmaps marked IN_USE stay in the directory */
+        if (jb->is_new || jb->gone) {
+            bitmap_journal_entry_free_clusters(bs, jb);
+        }
+        bitmap_journal_entry_free(jb);
+    }
+
+    return 0;
+
+fail:
+    QSIMPLEQ_FOREACH_SAFE(tb, &drop_tables, entry, tb_next) {
+        g_free(tb);
+    }
+    bitmap_list_free(bm_list);
+
+    qemu_mutex_lock(&j->mutex);
+    QSIMPLEQ_FOREACH_SAFE(jb, &j->bitmaps, entry, jb_next) {
+        if (jb->is_new) {
+            QSIMPLEQ_REMOVE(&j->bitmaps, jb, Qcow2JournaledBitmap, entry);
+            QSIMPLEQ_INSERT_TAIL(&dropped, jb, entry);
+        }
+    }
+    qemu_mutex_unlock(&j->mutex);
+
+    QSIMPLEQ_FOREACH_SAFE(jb, &dropped, entry, jb_next) {
+        bitmap_journal_entry_free_clusters(bs, jb);
+        bitmap_journal_entry_free(jb);
+    }
+
+    return ret;
+}
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_bitmaps_pre_write(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *j = s->bitmap_journal;
+    Qcow2JournaledBitmap *jb;
+    uint64_t seq = 0;
+    int ret = 0;
+
+    if (!j || bytes == 0) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&j->mutex);
+    qemu_mutex_lock(&bs->dirty_bitmap_mutex);
+    QSIMPLEQ_FOREACH(jb, &j->bitmaps, entry) {
+        BdrvDirtyBitmap *bitmap = bdrv_find_dirty_bitmap(bs, jb->name);
+        uint64_t limit, first, last;
+
+        /* Only bitmaps that this write is going to set */
+        if (!bitmap ||
+            !(bdrv_dirty_bitmap_enabled(bitmap) ||
+              bdrv_dirty_bitmap_has_successor(bitmap)) ||
+            bdrv_dirty_bitmap_next_zero(bitmap, offset, bytes) < 0)
+        {
+            continue;
+        }
+
+        bdrv_set_dirty_bitmap_locked(bitmap, offset, bytes);
+        limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size,
+                                                         bitmap);
+        first = offset / limit;
+        last = (offset + bytes - 1) / limit;
+        bitmap_set(jb->pending, first, last - first + 1);
+        seq = ++j->pending_seq;
+    }
+    qemu_mutex_unlock(&bs->dirty_bitmap_mutex);
+    qemu_mutex_unlock(&j->mutex);
+
+    if (seq) {
+        qemu_co_mutex_lock(&j->lock);
+        if (j->written_seq < seq) {
+            ret = bitmap_journal_write(bs, j, false);
+        }
+        qemu_co_mutex_unlock(&j->lock);
+    }
+
+    return ret;
+}
+
+void coroutine_fn GRAPH_RDLOCK qcow2_co_sync_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *j = s->bitmap_journal;
+    Error *local_err = NULL;
+
+    if (!j || !can_write(bs) || !qcow2_supports_persistent_dirty_bitmap(bs)) {
+        return;
+    }
+
+    qemu_co_mutex_lock(&j->lock);
+    if (bitmap_journal_update(bs, j, true, &local_err) < 0) {
+        warn_reportf_err(local_err, "Failed to sync bitmaps of '%s': ",
+                         bdrv_get_device_or_node_name(bs));
+    }
+    qemu_co_mutex_unlock(&j->lock);
+}
+
 int coroutine_fn qcow2_co_remove_persistent_dirty_bitmap(BlockDriverState *bs,
                                                          const char *name,
                                                          Error **errp)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *j = s->bitmap_journal;
+    Qcow2JournaledBitmap *jb;
     Qcow2Bitmap *bm = NULL;
     Qcow2BitmapList *bm_list;
 
@@ -1471,6 +2156,9 @@ int coroutine_fn qcow2_co_remove_persistent_dirty_bitmap(BlockDriverState *bs,
         return 0;
     }
 
+    if (j) {
+        qemu_co_mutex_lock(&j->lock);
+    }
     qemu_co_mutex_lock(&s->lock);
 
     bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
@@ -1497,8 +2185,24 @@ int coroutine_fn qcow2_co_remove_persistent_dirty_bitmap(BlockDriverState *bs,
 
     free_bitmap_clusters(bs, &bm->table);
 
+    /* The clusters of a journaled bitmap were just freed */
+    if (j) {
+        qemu_mutex_lock(&j->mutex);
+        jb = bitmap_journal_find(j, name);
+        if (jb) {
+            QSIMPLEQ_REMOVE(&j->bitmaps, jb, Qcow2JournaledBitmap, entry);
+        }
+        qemu_mutex_unlock(&j->mutex);
+        if (jb) {
+            bitmap_journal_entry_free(jb);
+        }
+    }
+
 out:
     qemu_co_mutex_unlock(&s->lock);
+    if (j) {
+        qemu_co_mutex_unlock(&j->lock);
+    }
 
     bitmap_free(bm);
     bitmap_list_free(bm_list);
@@ -1547,6 +2251,13 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
 
     QSIMPLEQ_INIT(&drop_tables);
 
+    /* Journaled bitmaps only need their latest changes to be written */
+    if (s->bitmap_journal &&
+        bitmap_journal_update(bs, s->bitmap_journal, false, errp) < 0)
+    {
+        return false;
+    }
+
     if (s->nb_bitmaps == 0) {
         bm_list = bitmap_list_new();
     } else {
@@ -1567,7 +2278,7 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
             continue;
         }
 
-        if (bdrv_dirty_bitmap_readonly(bitmap)) {
+        if (bdrv_dirty_bitmap_readonly(bitmap) || is_journaled(s, name)) {
             /*
              * Store the bitmap in the associated Qcow2Bitmap so it
              * can be released later
@@ -1632,7 +2343,8 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
     QSIMPLEQ_FOREACH(bm, bm_list, entry) {
         bitmap = bm->dirty_bitmap;
 
-        if (bitmap == NULL || bdrv_dirty_bitmap_readonly(bitmap)) {
+        if (bitmap == NULL || bdrv_dirty_bitmap_readonly(bitmap) ||
+            is_journaled(s, bm->name)) {
             continue;
         }
 
@@ -1656,6 +2368,11 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
     }
 
 success:
+    /* All bitmaps are up to date in the image now */
+    if (s->bitmap_journal) {
+        bitmap_journal_clear(s->bitmap_journal);
+    }
+
     if (release_stored) {
         QSIMPLEQ_FOREACH(bm, bm_list, entry) {
             if (bm->dirty_bitmap == NULL) {
@@ -1672,7 +2389,8 @@ success:
 fail:
     QSIMPLEQ_FOREACH(bm, bm_list, entry) {
         if (bm->dirty_bitmap == NULL || bm->table.offset == 0 ||
-            bdrv_dirty_bitmap_readonly(bm->dirty_bitmap))
+            bdrv_dirty_bitmap_readonly(bm->dirty_bitmap) ||
+            is_journaled(s, bm->name))
         {
             continue;
         }
@@ -62,6 +62,7 @@ int coroutine_fn qcow2_shrink_l1_table(BlockDriverState *bs,
     }
 
     BLKDBG_CO_EVENT(bs->file, BLKDBG_L1_SHRINK_FREE_L2_CLUSTERS);
+    qcow2_read_cache_invalidate(&s->read_cache);
     for (i = s->l1_size - 1; i > new_l1_size - 1; i--) {
         if ((s->l1_table[i] & L1E_OFFSET_MASK) == 0) {
             continue;
@@ -742,6 +743,127 @@ fail:
     return ret;
 }
 
+void qcow2_read_cache_init(BDRVQcow2State *s)
+{
+    Qcow2ReadCache *rc = &s->read_cache;
+
+    seqlock_init(&rc->seqlock);
+    /* Zeroed entries belong to no generation */
+    rc->generation = 1;
+
+    /*
+     * Encrypted clusters need the crypto layer, and a cluster with
+     * subclusters is not necessarily allocated as a whole.
+     */
+    if (!s->crypt_method_header && !has_subclusters(s)) {
+        rc->entries = g_new0(Qcow2ReadCacheEntry, QCOW2_READ_CACHE_SIZE);
+    }
+}
+
+void qcow2_read_cache_destroy(BDRVQcow2State *s)
+{
+    g_free(s->read_cache.entries);
+    s->read_cache.entries = NULL;
+}
+
+/*
+ * Remember that the @bytes at guest @offset are stored contiguously from
+ * @host_offset, as returned by qcow2_get_host_offset() for a normal cluster.
+ * Called with s->lock held.
+ */
+void qcow2_read_cache_insert(BDRVQcow2State *s, uint64_t offset,
+                             unsigned int bytes, uint64_t host_offset)
+{
+    Qcow2ReadCache *rc = &s->read_cache;
+    uint64_t cluster = offset >> s->cluster_bits;
+    uint64_t in_cluster = offset_into_cluster(s, offset);
+    uint64_t n, nb_clusters;
+
+    if (!rc->entries) {
+        return;
+    }
+
+    nb_clusters = MIN(size_to_clusters(s, in_cluster + bytes),
+                      QCOW2_READ_CACHE_SIZE);
+    host_offset -= in_cluster;
+
+    seqlock_write_begin(&rc->seqlock);
+    for (n = 0; n < nb_clusters; n++) {
+        Qcow2ReadCacheEntry *e =
+            &rc->entries[(cluster + n) % QCOW2_READ_CACHE_SIZE];
+
+        e->cluster = cluster + n;
+        e->host_offset = host_offset + (n << s->cluster_bits);
+        e->generation = rc->generation;
+    }
+    seqlock_write_end(&rc->seqlock);
+}
+
+/*
+ * Look up guest @offset without s->lock.  On a hit, *host_offset is where
+ * it is stored and *bytes is reduced to what is contiguous from there; the
+ * range is then a normal cluster run, like qcow2_get_host_offset() returns.
+ */
+bool qcow2_read_cache_lookup(BDRVQcow2State *s, uint64_t offset,
+                             unsigned int *bytes, uint64_t *host_offset)
+{
+    Qcow2ReadCache *rc = &s->read_cache;
+    uint64_t cluster = offset >> s->cluster_bits;
+    uint64_t in_cluster = offset_into_cluster(s, offset);
+    uint64_t want = in_cluster + *bytes;
+    uint64_t host, len, n;
+    unsigned int seq;
+
+    if (!rc->entries) {
+        return false;
+    }
+
+    do {
+        uint64_t generation;
+
+        seq = seqlock_read_begin(&rc->seqlock);
+        generation = qatomic_read(&rc->generation);
+        host = 0;
+        len = 0;
+        for (n = 0; len < want && n < QCOW2_READ_CACHE_SIZE; n++) {
+            Qcow2ReadCacheEntry *e =
+                &rc->entries[(cluster + n) % QCOW2_READ_CACHE_SIZE];
+
+            if (e->generation != generation || e->cluster != cluster + n ||
+                (n && e->host_offset != host + len)) {
+                break;
+            }
+            if (!n) {
+                host = e->host_offset;
+            }
+            len += s->cluster_size;
+        }
+    } while (seqlock_read_retry(&rc->seqlock, seq));
+
+    if (!len) {
+        return false;
+    }
+
+    *bytes = MIN(len, want) - in_cluster;
+    *host_offset = host + in_cluster;
+    return true;
+}
+
+/*
+ * Drop all the entries.  Called with s->lock held whenever a mapping may
+ * change, before the change is made.
+ */
+void qcow2_read_cache_invalidate(Qcow2ReadCache *rc)
+{
+    if (!rc->entries) {
+        return;
+    }
+
+    seqlock_write_begin(&rc->seqlock);
+    qatomic_set(&rc->generation, rc->generation + 1);
+    seqlock_write_end(&rc->seqlock);
+}
+
 /*
  * get_cluster_table
  *
@@ -286,6 +286,72 @@ int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
     return 0;
 }
 
+/*
+ * Counts the clusters with a refcount of zero starting at @cluster_index,
+ * stopping after @max of them.  Unlike calling qcow2_get_refcount() for each
+ * cluster, every refcount block is looked up in the cache only once.
+ *
+ * Returns the length of the run, which is less than @max only if the cluster
+ * following it is in use, or -errno on failure.
+ */
+static int64_t GRAPH_RDLOCK
+count_free_clusters(BlockDriverState *bs, uint64_t cluster_index,
+                    uint64_t max)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t n = 0;
+
+    while (n < max) {
+        uint64_t index = cluster_index + n;
+        uint64_t refcount_table_index = index >> s->refcount_block_bits;
+        uint64_t block_index = index & (s->refcount_block_size - 1);
+        uint64_t in_block = MIN(max - n, s->refcount_block_size - block_index);
+        int64_t refcount_block_offset;
+        void *refcount_block;
+        uint64_t i;
+        int ret;
+
+        if (refcount_table_index >= s->refcount_table_size) {
+            return max;
+        }
+        refcount_block_offset =
+            s->refcount_table[refcount_table_index] & REFT_OFFSET_MASK;
+        if (!refcount_block_offset) {
+            n += in_block;
+            continue;
+        }
+
+        if (offset_into_cluster(s, refcount_block_offset)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#"
+                                    PRIx64 " unaligned (reftable index: %#"
+                                    PRIx64 ")", refcount_block_offset,
+                                    refcount_table_index);
+            return -EIO;
+        }
+
+        ret = qcow2_cache_get(bs, s->refcount_block_cache,
+                              refcount_block_offset, &refcount_block);
+        if (ret < 0) {
+            return ret;
+        }
+
+        for (i = 0; i < in_block; i++) {
+            if (s->get_refcount(refcount_block, block_index + i) != 0) {
+                break;
+            }
+        }
+
+        qcow2_cache_put(s->refcount_block_cache, &refcount_block);
+
+        n += i;
+        if (i < in_block) {
+            break;
+        }
+    }
+
+    return n;
+}
+
 /* Checks if two offsets are described by the same refcount block */
 static int in_same_refcount_block(BDRVQcow2State *s, uint64_t offset_a,
     uint64_t offset_b)
@@ -888,6 +954,8 @@ update_refcount(BlockDriverState *bs, int64_t offset, int64_t length,
         if (refcount == 0) {
             void *table;
 
+            qcow2_decompress_cache_invalidate(s);
+
             table = qcow2_cache_is_table_offset(s->refcount_block_cache,
                                                 offset);
             if (table != NULL) {
@@ -969,8 +1037,8 @@ static int64_t GRAPH_RDLOCK
 alloc_clusters_noref(BlockDriverState *bs, uint64_t size, uint64_t max)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t i, nb_clusters, refcount;
-    int ret;
+    uint64_t nb_clusters;
+    int64_t n;
 
     /* We can't allocate clusters if they may still be queued for discard. */
     if (s->cache_discards) {
@@ -978,16 +1046,17 @@ alloc_clusters_noref(BlockDriverState *bs, uint64_t size, uint64_t max)
     }
 
     nb_clusters = size_to_clusters(s, size);
-retry:
-    for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
-        ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
-
-        if (ret < 0) {
-            return ret;
-        } else if (refcount != 0) {
-            goto retry;
+    for (;;) {
+        n = count_free_clusters(bs, s->free_cluster_index, nb_clusters);
+        if (n < 0) {
+            return n;
+        }
+        s->free_cluster_index += n;
+        if (n == nb_clusters) {
+            break;
         }
+        /* Skip the cluster in use and look for a free run after it */
+        s->free_cluster_index++;
     }
 
     /* Make sure that all offsets in the "allocated" range are representable
@@ -1032,8 +1101,7 @@ int64_t coroutine_fn qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offs
                                              int64_t nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t cluster_index, refcount;
-    uint64_t i;
+    int64_t i;
     int ret;
 
     assert(nb_clusters >= 0);
@@ -1043,14 +1111,9 @@ int64_t coroutine_fn qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offs
 
     do {
         /* Check how many clusters there are free */
-        cluster_index = offset >> s->cluster_bits;
-        for(i = 0; i < nb_clusters; i++) {
-            ret = qcow2_get_refcount(bs, cluster_index++, &refcount);
-            if (ret < 0) {
-                return ret;
-            } else if (refcount != 0) {
-                break;
-            }
+        i = count_free_clusters(bs, offset >> s->cluster_bits, nb_clusters);
+        if (i < 0) {
+            return i;
         }
 
         /* And then allocate them */
@@ -34,6 +34,7 @@
 #endif
 
 #include "qcow2.h"
+#include "block/aio_task.h"
 #include "block/block-io.h"
 #include "block/thread-pool.h"
 #include "crypto.h"
@@ -453,6 +454,22 @@ static int qcow2_encdec_pool_func(void *opaque)
     return data->func(data->block, data->offset, data->buf, data->len, NULL);
 }
 
+/* Larger buffers are split, to encrypt or decrypt on several threads */
+#define QCOW2_ENCDEC_MIN_SPLIT (64 * KiB)
+
+typedef struct Qcow2EncDecTask {
+    AioTask task;
+    BlockDriverState *bs;
+    Qcow2EncDecData data;
+} Qcow2EncDecTask;
+
+static int coroutine_fn qcow2_encdec_task_entry(AioTask *task)
+{
+    Qcow2EncDecTask *t = container_of(task, Qcow2EncDecTask, task);
+
+    return qcow2_co_process(t->bs, qcow2_encdec_pool_func, &t->data);
+}
+
 static int coroutine_fn
 qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
                 uint64_t guest_offset, void *buf, size_t len,
@@ -467,6 +484,9 @@ qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
         .func = func,
     };
     uint64_t sector_size;
+    size_t chunk;
+    AioTaskPool *pool;
+    int ret;
 
     assert(s->crypto);
 
@@ -475,7 +495,40 @@ qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
     assert(QEMU_IS_ALIGNED(host_offset, sector_size));
     assert(QEMU_IS_ALIGNED(len, sector_size));
 
-    return len == 0 ? 0 : qcow2_co_process(bs, qcow2_encdec_pool_func, &arg);
+    if (len < 2 * QCOW2_ENCDEC_MIN_SPLIT) {
+        return len == 0 ? 0 :
+            qcow2_co_process(bs, qcow2_encdec_pool_func, &arg);
+    }
+
+    /*
+     * Sectors are independent, so split the buffer in one chunk per
+     * thread; qcow2_co_process() bounds the threads used by all requests.
+     */
+    chunk = MAX(DIV_ROUND_UP(len, QCOW2_MAX_THREADS), QCOW2_ENCDEC_MIN_SPLIT);
+    chunk = QEMU_ALIGN_UP(chunk, sector_size);
+
+    pool = aio_task_pool_new(QCOW2_MAX_THREADS);
+    while (arg.len > 0 && aio_task_pool_status(pool) == 0) {
+        Qcow2EncDecTask *t = g_new(Qcow2EncDecTask, 1);
+        size_t bytes = MIN(arg.len, chunk);
+
+        *t = (Qcow2EncDecTask) {
+            .task.func = qcow2_encdec_task_entry,
+            .bs = bs,
+            .data = arg,
+        };
+        t->data.len = bytes;
+        aio_task_pool_start_task(pool, &t->task);
+
+        arg.offset += bytes;
+        arg.buf += bytes;
+        arg.len -= bytes;
+    }
+    aio_task_pool_wait_all(pool);
+    ret = aio_task_pool_status(pool);
+    aio_task_pool_free(pool);
+
+    return ret;
 }
 
 /*
@@ -685,6 +685,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_DISCARD_SNAPSHOT,
     QCOW2_OPT_DISCARD_OTHER,
     QCOW2_OPT_DISCARD_NO_UNREF,
+    QCOW2_OPT_DETECT_ZERO_SUBCLUSTERS,
     QCOW2_OPT_OVERLAP,
     QCOW2_OPT_OVERLAP_TEMPLATE,
     QCOW2_OPT_OVERLAP_MAIN_HEADER,
@@ -701,6 +702,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_BITMAP_SYNC_INTERVAL,
     NULL
 };
 
@@ -734,6 +736,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Do not unreference discarded clusters",
         },
+        {
+            .name = QCOW2_OPT_DETECT_ZERO_SUBCLUSTERS,
+            .type = QEMU_OPT_BOOL,
+            .help = "Mark subclusters that are written with zeroes as zero "
+                    "instead of writing them",
+        },
         {
             .name = QCOW2_OPT_OVERLAP,
             .type = QEMU_OPT_STRING,
@@ -817,6 +825,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_BITMAP_SYNC_INTERVAL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Keep persistent bitmaps up to date in the image, "
+                    "writing their changes after this time (in seconds)",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -867,15 +881,65 @@ static void cache_clean_timer_del(BlockDriverState *bs)
     }
 }
 
+static void coroutine_fn bitmap_sync_timer_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    GRAPH_RDLOCK_GUARD();
+
+    qcow2_co_sync_bitmaps(bs);
+    bdrv_dec_in_flight(bs);
+}
+
+static void bitmap_sync_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+
+    /* Do not start I/O in a drained section, try again next time */
+    if (!qatomic_read(&bs->quiesce_counter)) {
+        Coroutine *co = qemu_coroutine_create(bitmap_sync_timer_entry, bs);
+
+        bdrv_inc_in_flight(bs);
+        qemu_coroutine_enter(co);
+    }
+
+    timer_mod(s->bitmap_sync_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+              (int64_t) s->bitmap_sync_interval * 1000);
+}
+
+static void bitmap_sync_timer_init(BlockDriverState *bs, AioContext *context)
+{
+    BDRVQcow2State *s = bs->opaque;
+    if (s->bitmap_sync_interval > 0) {
+        s->bitmap_sync_timer =
+            aio_timer_new_with_attrs(context, QEMU_CLOCK_VIRTUAL,
+                                     SCALE_MS, QEMU_TIMER_ATTR_EXTERNAL,
+                                     bitmap_sync_timer_cb, bs);
+        timer_mod(s->bitmap_sync_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                  (int64_t) s->bitmap_sync_interval * 1000);
+    }
+}
+
+static void bitmap_sync_timer_del(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    if (s->bitmap_sync_timer) {
+        timer_free(s->bitmap_sync_timer);
+        s->bitmap_sync_timer = NULL;
+    }
+}
+
 static void qcow2_detach_aio_context(BlockDriverState *bs)
 {
     cache_clean_timer_del(bs);
+    bitmap_sync_timer_del(bs);
 }
 
 static void qcow2_attach_aio_context(BlockDriverState *bs,
                                      AioContext *new_context)
 {
     cache_clean_timer_init(bs, new_context);
+    bitmap_sync_timer_init(bs, new_context);
 }
 
 static bool read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
@@ -978,7 +1042,9 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
+    bool detect_zero_subclusters;
     uint64_t cache_clean_interval;
+    uint64_t bitmap_sync_interval;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1079,6 +1145,15 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    /* New interval for writing persistent bitmaps */
+    r->bitmap_sync_interval =
+        qemu_opt_get_number(opts, QCOW2_OPT_BITMAP_SYNC_INTERVAL, 0);
+    if (r->bitmap_sync_interval > UINT_MAX) {
+        error_setg(errp, "Bitmap sync interval too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1157,6 +1232,15 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    r->detect_zero_subclusters =
+        qemu_opt_get_bool(opts, QCOW2_OPT_DETECT_ZERO_SUBCLUSTERS, false);
+    if (r->detect_zero_subclusters && s->qcow_version < 3) {
+        error_setg(errp, "detect-zero-subclusters is only supported since "
+                   "qcow2 version 3");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     switch (s->crypt_method_header) {
     case QCOW_CRYPT_NONE:
         if (encryptfmt) {
@@ -1228,6 +1312,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
+    qcow2_cache_set_read_cache(s->l2_table_cache, &s->read_cache);
     s->l2_slice_size = r->l2_slice_size;
 
     s->overlap_check = r->overlap_check;
@@ -1238,6 +1323,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
 
     s->discard_no_unref = r->discard_no_unref;
+    s->detect_zero_subclusters = r->detect_zero_subclusters;
 
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
@@ -1245,6 +1331,19 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    /*
+     * Bitmaps that are already journaled stay so until the image is closed,
+     * even if the interval is set to 0.
+     */
+    if (s->bitmap_sync_interval != r->bitmap_sync_interval) {
+        bitmap_sync_timer_del(bs);
+        s->bitmap_sync_interval = r->bitmap_sync_interval;
+        if (s->bitmap_sync_interval > 0 && !s->bitmap_journal) {
+            s->bitmap_journal = qcow2_bitmap_journal_new();
+        }
+        bitmap_sync_timer_init(bs, bdrv_get_aio_context(bs));
+    }
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1715,6 +1814,8 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    qcow2_read_cache_init(s);
+
     /* read the backing file name */
     if (header.backing_file_offset != 0) {
         len = header.backing_file_size;
@@ -1874,6 +1975,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    qcow2_decompress_cache_init(s);
 
     return ret;
 
@@ -1893,12 +1995,16 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
     cache_clean_timer_del(bs);
+    bitmap_sync_timer_del(bs);
+    qcow2_bitmap_journal_free(s->bitmap_journal);
+    s->bitmap_journal = NULL;
     if (s->l2_table_cache) {
         qcow2_cache_destroy(s->l2_table_cache);
     }
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    qcow2_read_cache_destroy(s);
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -2389,12 +2495,19 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
-        qemu_co_mutex_unlock(&s->lock);
-        if (ret < 0) {
-            goto out;
+        if (qcow2_read_cache_lookup(s, offset, &cur_bytes, &host_offset)) {
+            type = QCOW2_SUBCLUSTER_NORMAL;
+        } else {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+            if (ret == 0 && type == QCOW2_SUBCLUSTER_NORMAL) {
+                qcow2_read_cache_insert(s, offset, cur_bytes, host_offset);
+            }
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                goto out;
+            }
         }
 
         if (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
@@ -2659,6 +2772,71 @@ static coroutine_fn GRAPH_RDLOCK int qcow2_co_pwritev_task_entry(AioTask *task)
                                  t->l2meta);
 }
 
+/*
+ * Returns the length of the part of the request at @offset that is either
+ * made of whole subclusters that are written with zeroes (*zero is set to
+ * true), or that must be written as data because it ends before the next
+ * such subcluster (*zero is set to false).  A partial subcluster at the end
+ * of the image counts as a whole one.
+ */
+static uint64_t qcow2_scan_zero_subclusters(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov,
+                                            size_t qiov_offset, bool *zero)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t image_end = bs->total_sectors << BDRV_SECTOR_BITS;
+    uint64_t end = offset + bytes;
+    uint64_t pos = offset;
+
+    *zero = offset_into_subcluster(s, offset) == 0;
+    if (!*zero) {
+        pos = MIN(ROUND_UP(offset, s->subcluster_size), end);
+    }
+
+    while (pos < end) {
+        uint64_t len = MIN(s->subcluster_size, end - pos);
+        bool is_zero = (len == s->subcluster_size || pos + len == image_end) &&
+            qemu_iovec_is_zero(qiov, qiov_offset + pos - offset, len);
+
+        if (is_zero != *zero) {
+            if (pos == offset) {
+                /* The request starts with data */
+                *zero = false;
+                pos += len;
+                continue;
+            }
+            break;
+        }
+        pos += len;
+    }
+
+    return pos - offset;
+}
+
+/*
+ * Returns true if an allocating write to one of the clusters that hold
+ * [offset, offset + bytes) is in flight.  Linking its L2 entry may mark
+ * subclusters as allocated that we would have marked as zero since.
+ */
+static bool qcow2_alloc_in_flight(BDRVQcow2State *s, uint64_t offset,
+                                  uint64_t bytes)
+{
+    uint64_t start = start_of_cluster(s, offset);
+    uint64_t end = ROUND_UP(offset + bytes, s->cluster_size);
+    QCowL2Meta *m;
+
+    QLIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+        uint64_t m_end = m->offset + ((uint64_t)m->nb_clusters <<
+                                      s->cluster_bits);
+
+        if (m->offset < end && start < m_end) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                       QEMUIOVector *qiov, size_t qiov_offset,
@@ -2671,9 +2849,16 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
     uint64_t host_offset;
     QCowL2Meta *l2meta = NULL;
     AioTaskPool *aio = NULL;
+    /* With detect-zero-subclusters, data up to here is known to be data */
+    uint64_t data_end = 0;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
+    ret = qcow2_co_bitmaps_pre_write(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
 
         l2meta = NULL;
@@ -2681,6 +2866,36 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
         trace_qcow2_writev_start_part(qemu_coroutine_self());
         offset_in_cluster = offset_into_cluster(s, offset);
         cur_bytes = MIN(bytes, INT_MAX);
+
+        if (s->detect_zero_subclusters && !data_file_is_raw(bs)) {
+            if (offset >= data_end) {
+                bool zero;
+                uint64_t run = qcow2_scan_zero_subclusters(bs, offset,
+                                                           cur_bytes, qiov,
+                                                           qiov_offset, &zero);
+
+                if (zero) {
+                    qemu_co_mutex_lock(&s->lock);
+                    ret = -ENOTSUP;
+                    if (!qcow2_alloc_in_flight(s, offset, run)) {
+                        ret = qcow2_subcluster_zeroize(bs, offset, run, 0);
+                    }
+                    qemu_co_mutex_unlock(&s->lock);
+
+                    if (ret == 0) {
+                        bytes -= run;
+                        offset += run;
+                        qiov_offset += run;
+                        continue;
+                    } else if (ret != -ENOTSUP) {
+                        goto fail_nometa;
+                    }
+                    /* E.g. compressed clusters, write the zeroes as data */
+                }
+                data_end = offset + run;
+            }
+            cur_bytes = MIN(cur_bytes, data_end - offset);
+        }
         if (bs->encrypted) {
             cur_bytes = MIN(cur_bytes,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
@@ -2790,8 +3005,13 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     }
 
     cache_clean_timer_del(bs);
+    bitmap_sync_timer_del(bs);
+    qcow2_bitmap_journal_free(s->bitmap_journal);
+    s->bitmap_journal = NULL;
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_read_cache_destroy(s);
+    qcow2_decompress_cache_destroy(s);
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -4060,6 +4280,11 @@ qcow2_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
         tail = 0;
     }
 
+    ret = qcow2_co_bitmaps_pre_write(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
     if (head || tail) {
         uint64_t off;
         unsigned int nr;
@@ -4122,6 +4347,11 @@ qcow2_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
         }
     }
 
+    ret = qcow2_co_bitmaps_pre_write(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
     qemu_co_mutex_lock(&s->lock);
     ret = qcow2_cluster_discard(bs, offset, bytes, QCOW2_DISCARD_REQUEST,
                                 false);
@@ -4227,6 +4457,11 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
 
     assert(!bs->encrypted);
 
+    ret = qcow2_co_bitmaps_pre_write(bs, dst_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
     qemu_co_mutex_lock(&s->lock);
 
     while (bytes != 0) {
@@ -4776,6 +5011,11 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         return -EINVAL;
     }
 
+    ret = qcow2_co_bitmaps_pre_write(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
     while (bytes && aio_task_pool_status(aio) == 0) {
         uint64_t chunk_size = MIN(bytes, s->cluster_size);
 
@@ -4804,19 +5044,145 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * Sequential reads of compressed clusters decompress the following ones
+ * ahead of time, in parallel on the thread pool, into a small cache that
+ * also serves reads smaller than a cluster.
+ */
+#define QCOW2_DECOMPRESS_CACHE_BYTES (4 * MiB)
+#define QCOW2_DECOMPRESS_CACHE_MAX 16
+
+void qcow2_decompress_cache_init(BDRVQcow2State *s)
+{
+    Qcow2DecompressCache *dc = &s->decompress_cache;
+    int i;
+
+    qemu_mutex_init(&dc->lock);
+    dc->size = QCOW2_DECOMPRESS_CACHE_BYTES / s->cluster_size;
+    dc->size = MAX(2, MIN(dc->size, QCOW2_DECOMPRESS_CACHE_MAX));
+    dc->readahead = MAX(1, dc->size / 4);
+    /* Zeroed entries belong to no generation */
+    dc->generation = 1;
+    dc->entries = g_new0(Qcow2DecompressedCluster, dc->size);
+    for (i = 0; i < dc->size; i++) {
+        qemu_co_queue_init(&dc->entries[i].waiters);
+    }
+}
+
+void qcow2_decompress_cache_destroy(BDRVQcow2State *s)
+{
+    Qcow2DecompressCache *dc = &s->decompress_cache;
+    int i;
+
+    if (!dc->entries) {
+        return;
+    }
+
+    for (i = 0; i < dc->size; i++) {
+        assert(!dc->entries[i].pending);
+        qemu_vfree(dc->entries[i].data);
+    }
+    g_free(dc->entries);
+    dc->entries = NULL;
+    qemu_mutex_destroy(&dc->lock);
+}
+
+void qcow2_decompress_cache_invalidate(BDRVQcow2State *s)
+{
+    Qcow2DecompressCache *dc = &s->decompress_cache;
+
+    if (!dc->entries) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&dc->lock) {
+        dc->generation++;
+    }
+}
+
+/* Called with dc->lock held */
+static Qcow2DecompressedCluster *
+qcow2_decompress_cache_find(Qcow2DecompressCache *dc, uint64_t l2_entry)
+{
+    int i;
+
+    for (i = 0; i < dc->size; i++) {
+        Qcow2DecompressedCluster *e = &dc->entries[i];
+
+        if (e->l2_entry == l2_entry && e->generation == dc->generation) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Take the least recently used entry to decompress @l2_entry into.  Returns
+ * NULL if all the entries are pending.  Called with dc->lock held.
+ */
+static Qcow2DecompressedCluster *
+qcow2_decompress_cache_claim(BlockDriverState *bs, uint64_t l2_entry,
+                             bool readahead)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressCache *dc = &s->decompress_cache;
+    Qcow2DecompressedCluster *victim = NULL;
+    int i;
+
+    for (i = 0; i < dc->size; i++) {
+        Qcow2DecompressedCluster *e = &dc->entries[i];
+
+        if (e->pending) {
+            continue;
+        }
+        if (!e->l2_entry || e->generation != dc->generation) {
+            victim = e;
+            break;
+        }
+        if (!victim || e->lru_counter < victim->lru_counter) {
+            victim = e;
+        }
+    }
+
+    if (!victim) {
+        return NULL;
+    }
+    if (!victim->data) {
+        victim->data = qemu_try_blockalign(bs, s->cluster_size);
+        if (!victim->data) {
+            return NULL;
+        }
+    }
+
+    victim->l2_entry = l2_entry;
+    victim->generation = dc->generation;
+    victim->lru_counter = ++dc->lru_counter;
+    victim->pending = true;
+    victim->readahead = readahead;
+    return victim;
+}
+
+/* Make the pending entry @e available, or drop it if filling it failed */
+static void qcow2_decompress_cache_done(Qcow2DecompressCache *dc,
+                                        Qcow2DecompressedCluster *e, int ret)
+{
+    QEMU_LOCK_GUARD(&dc->lock);
+
+    e->pending = false;
+    if (ret < 0) {
+        e->l2_entry = 0;
+    }
+    qemu_co_queue_restart_all(&e->waiters);
+}
+
 static int coroutine_fn GRAPH_RDLOCK
-qcow2_co_preadv_compressed(BlockDriverState *bs,
-                           uint64_t l2_entry,
-                           uint64_t offset,
-                           uint64_t bytes,
-                           QEMUIOVector *qiov,
-                           size_t qiov_offset)
+qcow2_co_read_compressed(BlockDriverState *bs, uint64_t l2_entry,
+                         uint8_t *out_buf)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize;
+    int ret, csize;
     uint64_t coffset;
-    uint8_t *buf, *out_buf;
-    int offset_in_cluster = offset_into_cluster(s, offset);
+    uint8_t *buf;
 
     qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
 
@@ -4825,8 +5191,6 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
         return -ENOMEM;
     }
 
-    out_buf = qemu_blockalign(bs, s->cluster_size);
-
     BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
     ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
     if (ret < 0) {
@@ -4838,15 +5202,158 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
         goto fail;
     }
 
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
-
 fail:
-    qemu_vfree(out_buf);
     g_free(buf);
 
     return ret;
 }
 
+typedef struct Qcow2DecompressReadahead {
+    BlockDriverState *bs;
+    Qcow2DecompressedCluster *entry;
+} Qcow2DecompressReadahead;
+
+static void coroutine_fn qcow2_decompress_readahead_entry(void *opaque)
+{
+    Qcow2DecompressReadahead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    WITH_GRAPH_RDLOCK_GUARD() {
+        ret = qcow2_co_read_compressed(bs, ra->entry->l2_entry,
+                                       ra->entry->data);
+    }
+    qcow2_decompress_cache_done(&s->decompress_cache, ra->entry, ret);
+
+    g_free(ra);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Start decompressing the compressed clusters that follow guest @offset
+ * and are not in the cache yet.
+ */
+static void coroutine_fn GRAPH_RDLOCK
+qcow2_decompress_readahead(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressCache *dc = &s->decompress_cache;
+    uint64_t end = bs->total_sectors * BDRV_SECTOR_SIZE;
+    int i, ret;
+
+    offset = start_of_cluster(s, offset);
+    for (i = 0; i < dc->readahead; i++) {
+        unsigned int bytes = s->cluster_size;
+        QCow2SubclusterType type;
+        Qcow2DecompressReadahead *ra;
+        Qcow2DecompressedCluster *e;
+        uint64_t l2_entry;
+
+        offset += s->cluster_size;
+        if (offset >= end) {
+            break;
+        }
+
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_host_offset(bs, offset, &bytes, &l2_entry, &type);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0 || type != QCOW2_SUBCLUSTER_COMPRESSED) {
+            break;
+        }
+
+        WITH_QEMU_LOCK_GUARD(&dc->lock) {
+            e = qcow2_decompress_cache_find(dc, l2_entry);
+            e = e ? NULL : qcow2_decompress_cache_claim(bs, l2_entry, true);
+        }
+        if (!e) {
+            continue;
+        }
+
+        ra = g_new(Qcow2DecompressReadahead, 1);
+        *ra = (Qcow2DecompressReadahead) {
+            .bs = bs,
+            .entry = e,
+        };
+        bdrv_inc_in_flight(bs);
+        aio_co_enter(qemu_get_current_aio_context(),
+                     qemu_coroutine_create(qcow2_decompress_readahead_entry,
+                                           ra));
+    }
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_preadv_compressed(BlockDriverState *bs,
+                           uint64_t l2_entry,
+                           uint64_t offset,
+                           uint64_t bytes,
+                           QEMUIOVector *qiov,
+                           size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressCache *dc = &s->decompress_cache;
+    Qcow2DecompressedCluster *e;
+    uint64_t cluster = offset >> s->cluster_bits;
+    int offset_in_cluster = offset_into_cluster(s, offset);
+    bool readahead;
+    uint8_t *out_buf;
+    int ret;
+
+    qemu_mutex_lock(&dc->lock);
+    readahead = cluster == dc->last_cluster + 1;
+    dc->last_cluster = cluster;
+
+    while ((e = qcow2_decompress_cache_find(dc, l2_entry)) && e->pending) {
+        qemu_co_queue_wait(&e->waiters, &dc->lock);
+    }
+    if (e) {
+        /* Keep reading ahead as long as read-ahead is useful */
+        readahead = e->readahead;
+        e->readahead = false;
+        e->lru_counter = ++dc->lru_counter;
+        qemu_iovec_from_buf(qiov, qiov_offset, e->data + offset_in_cluster,
+                            bytes);
+        qemu_mutex_unlock(&dc->lock);
+
+        if (readahead) {
+            qcow2_decompress_readahead(bs, offset);
+        }
+        return 0;
+    }
+
+    e = qcow2_decompress_cache_claim(bs, l2_entry, false);
+    qemu_mutex_unlock(&dc->lock);
+
+    /* The clusters ahead are decompressed while this one is */
+    if (readahead) {
+        qcow2_decompress_readahead(bs, offset);
+    }
+
+    if (e) {
+        ret = qcow2_co_read_compressed(bs, l2_entry, e->data);
+        if (ret == 0) {
+            qemu_iovec_from_buf(qiov, qiov_offset,
+                                e->data + offset_in_cluster, bytes);
+        }
+        qcow2_decompress_cache_done(dc, e, ret);
+        return ret;
+    }
+
+    out_buf = qemu_try_blockalign(bs, s->cluster_size);
+    if (!out_buf) {
+        return -ENOMEM;
+    }
+
+    ret = qcow2_co_read_compressed(bs, l2_entry, out_buf);
+    if (ret == 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster,
+                            bytes);
+    }
+    qemu_vfree(out_buf);
+
+    return ret;
+}
+
 static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -27,6 +27,7 @@
 
 #include "crypto/block.h"
 #include "qemu/coroutine.h"
+#include "qemu/seqlock.h"
 #include "qemu/units.h"
 #include "block/block_int.h"
 
@@ -134,6 +135,7 @@
 #define QCOW2_OPT_DISCARD_SNAPSHOT "pass-discard-snapshot"
 #define QCOW2_OPT_DISCARD_OTHER "pass-discard-other"
 #define QCOW2_OPT_DISCARD_NO_UNREF "discard-no-unref"
+#define QCOW2_OPT_DETECT_ZERO_SUBCLUSTERS "detect-zero-subclusters"
 #define QCOW2_OPT_OVERLAP "overlap-check"
 #define QCOW2_OPT_OVERLAP_TEMPLATE "overlap-check.template"
 #define QCOW2_OPT_OVERLAP_MAIN_HEADER "overlap-check.main-header"
@@ -150,6 +152,7 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_BITMAP_SYNC_INTERVAL "bitmap-sync-interval"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -230,6 +233,52 @@ typedef struct QCowSnapshot {
 
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
+typedef struct Qcow2BitmapJournal Qcow2BitmapJournal;
+
+/* Number of guest clusters whose host offset is kept for lockless reads */
+#define QCOW2_READ_CACHE_SIZE 4096
+
+typedef struct Qcow2ReadCacheEntry {
+    uint64_t cluster;       /* guest cluster index */
+    uint64_t host_offset;   /* host offset of the cluster */
+    uint64_t generation;
+} Qcow2ReadCacheEntry;
+
+typedef struct Qcow2DecompressedCluster {
+    uint64_t l2_entry;      /* compressed L2 entry, 0 if unused */
+    uint64_t generation;
+    uint64_t lru_counter;
+    bool pending;           /* being read and decompressed */
+    bool readahead;         /* filled by read-ahead, not read since */
+    uint8_t *data;
+    CoQueue waiters;        /* wait for @pending to be cleared */
+} Qcow2DecompressedCluster;
+
+/*
+ * Recently decompressed clusters.  Entries are keyed by their L2 entry,
+ * which identifies the compressed data for as long as it is referenced;
+ * freeing clusters bumps @generation, which drops all of them.
+ */
+typedef struct Qcow2DecompressCache {
+    QemuMutex lock;
+    Qcow2DecompressedCluster *entries;
+    int size;
+    int readahead;          /* clusters to decompress ahead of reads */
+    uint64_t generation;
+    uint64_t lru_counter;
+    uint64_t last_cluster;  /* guest cluster of the last compressed read */
+} Qcow2DecompressCache;
+
+/*
+ * Host offsets of normal, already allocated clusters, for reads to find them
+ * without taking s->lock.  Updates are made under s->lock, inside a write
+ * section of @seqlock; bumping @generation drops all the entries at once.
+ */
+typedef struct Qcow2ReadCache {
+    QemuSeqLock seqlock;
+    uint64_t generation;
+    Qcow2ReadCacheEntry *entries;
+} Qcow2ReadCache;
 
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
@@ -348,6 +397,11 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    /* Persistent bitmaps kept up to date in the image, see qcow2-bitmap.c */
+    Qcow2BitmapJournal *bitmap_journal;
+    QEMUTimer *bitmap_sync_timer;
+    unsigned bitmap_sync_interval;
+
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -358,6 +412,7 @@ typedef struct BDRVQcow2State {
     uint64_t free_byte_offset;
 
     CoMutex lock;
+    Qcow2ReadCache read_cache;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
@@ -388,6 +443,9 @@ typedef struct BDRVQcow2State {
 
     bool discard_no_unref;
 
+    /* Mark zeroed subclusters as zero instead of writing them */
+    bool detect_zero_subclusters;
+
     int overlap_check; /* bitmask of Qcow2MetadataOverlap values */
     bool signaled_corruption;
 
@@ -410,6 +468,7 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    Qcow2DecompressCache decompress_cache;
 
     BdrvChild *data_file;
 
@@ -932,6 +991,14 @@ qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                       unsigned int *bytes, uint64_t *host_offset,
                       QCow2SubclusterType *subcluster_type);
 
+void qcow2_read_cache_init(BDRVQcow2State *s);
+void qcow2_read_cache_destroy(BDRVQcow2State *s);
+void qcow2_read_cache_insert(BDRVQcow2State *s, uint64_t offset,
+                             unsigned int bytes, uint64_t host_offset);
+bool qcow2_read_cache_lookup(BDRVQcow2State *s, uint64_t offset,
+                             unsigned int *bytes, uint64_t *host_offset);
+void qcow2_read_cache_invalidate(Qcow2ReadCache *rc);
+
 int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                         unsigned int *bytes, uint64_t *host_offset,
@@ -1021,6 +1088,7 @@ qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+void qcow2_cache_set_read_cache(Qcow2Cache *c, Qcow2ReadCache *rc);
 
 /* qcow2-bitmap.c functions */
 int coroutine_fn GRAPH_RDLOCK
@@ -1054,6 +1122,15 @@ int coroutine_fn GRAPH_RDLOCK
 qcow2_co_remove_persistent_dirty_bitmap(BlockDriverState *bs, const char *name,
                                         Error **errp);
 
+Qcow2BitmapJournal *qcow2_bitmap_journal_new(void);
+void qcow2_bitmap_journal_free(Qcow2BitmapJournal *j);
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_bitmaps_pre_write(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes);
+
+void coroutine_fn GRAPH_RDLOCK qcow2_co_sync_bitmaps(BlockDriverState *bs);
+
 bool qcow2_supports_persistent_dirty_bitmap(BlockDriverState *bs);
 uint64_t qcow2_get_persistent_dirty_bitmap_size(BlockDriverState *bs,
                                                 uint32_t cluster_size);
@@ -1064,6 +1141,9 @@ qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
 ssize_t coroutine_fn
 qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
                     const void *src, size_t src_size);
+void qcow2_decompress_cache_init(BDRVQcow2State *s);
+void qcow2_decompress_cache_destroy(BDRVQcow2State *s);
+void qcow2_decompress_cache_invalidate(BDRVQcow2State *s);
 int coroutine_fn
 qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
@@ -60,6 +60,8 @@
 
 #define RBD_MAX_SNAPS 100
 
+#define RBD_MAX_IMAGE_HANDLES 64
+
 #define RBD_ENCRYPTION_LUKS_HEADER_VERIFICATION_LEN 8
 
 static const char rbd_luks_header_verification[
@@ -99,11 +101,24 @@ typedef struct BDRVRBDState {
     char *namespace;
     uint64_t image_size;
     uint64_t object_size;
+
+    /*
+     * Handles for I/O requests, images[0] is @image.  Each AioContext that
+     * submits requests is given one of them in turn, so that requests from
+     * different iothreads go through different librbd image contexts.
+     */
+    rbd_image_t *images;
+    int nr_images;
+    QemuMutex images_lock;
+    GHashTable *ctx_images; /* AioContext -> index in @images */
+    int next_image;
 } BDRVRBDState;
 
 typedef struct RBDTask {
     BlockDriverState *bs;
+    AioContext *ctx;
     Coroutine *co;
+    AioCompletion completion;
     bool complete;
     int64_t ret;
 } RBDTask;
@@ -1061,6 +1076,150 @@ static int qemu_rbd_attempt_legacy_options(QDict *options,
     return r;
 }
 
+/* Open a handle for the image and load its encryption, if any */
+static int qemu_rbd_open_image(BDRVRBDState *s, BlockdevOptionsRbd *opts,
+                               rbd_image_t *image, Error **errp)
+{
+    int r;
+
+    /* rbd_open is always r/w */
+    r = rbd_open(s->io_ctx, s->image_name, image, s->snap);
+    if (r < 0) {
+        error_setg_errno(errp, -r, "error reading header from %s",
+                         s->image_name);
+        return r;
+    }
+
+    if (opts->encrypt) {
+#ifdef LIBRBD_SUPPORTS_ENCRYPTION
+        if (opts->encrypt->parent) {
+#ifdef LIBRBD_SUPPORTS_ENCRYPTION_LOAD2
+            r = qemu_rbd_encryption_load2(*image, opts->encrypt, errp);
+#else
+            r = -ENOTSUP;
+            error_setg(errp, "RBD library does not support layered encryption");
+#endif
+        } else {
+            r = qemu_rbd_encryption_load(*image, opts->encrypt, errp);
+        }
+        if (r < 0) {
+            rbd_close(*image);
+            return r;
+        }
+#else
+        error_setg(errp, "RBD library does not support image encryption");
+        rbd_close(*image);
+        return -ENOTSUP;
+#endif
+    }
+
+    return 0;
+}
+
+/*
+ * Writable handles would take the exclusive lock away from each other for
+ * every request.
+ */
+static int qemu_rbd_check_exclusive_lock(BDRVRBDState *s, Error **errp)
+{
+    uint64_t features;
+    int r;
+
+    r = rbd_get_features(s->image, &features);
+    if (r < 0) {
+        error_setg_errno(errp, -r, "error getting image features from %s",
+                         s->image_name);
+        return r;
+    }
+    if (features & RBD_FEATURE_EXCLUSIVE_LOCK) {
+        error_setg(errp, "image-handles > 1 requires the exclusive-lock "
+                   "feature to be disabled for writable images");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Open the handles after @image that requests are spread over */
+static int qemu_rbd_open_extra_images(BDRVRBDState *s,
+                                      BlockdevOptionsRbd *opts, int flags,
+                                      Error **errp)
+{
+    int nr = opts->has_image_handles ? opts->image_handles : 1;
+    int r;
+
+    if (nr < 1 || nr > RBD_MAX_IMAGE_HANDLES) {
+        error_setg(errp, "image-handles must be between 1 and %d",
+                   RBD_MAX_IMAGE_HANDLES);
+        return -EINVAL;
+    }
+    if (nr == 1) {
+        return 0;
+    }
+
+    /* Other handles would not see writes in the cache of one handle */
+    if (!(flags & BDRV_O_NOCACHE)) {
+        error_setg(errp, "image-handles > 1 requires cache.direct=on");
+        return -EINVAL;
+    }
+
+    if (!s->snap && (flags & BDRV_O_RDWR)) {
+        r = qemu_rbd_check_exclusive_lock(s, errp);
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    s->images = g_renew(rbd_image_t, s->images, nr);
+    while (s->nr_images < nr) {
+        r = qemu_rbd_open_image(s, opts, &s->images[s->nr_images], errp);
+        if (r < 0) {
+            return r;
+        }
+        s->nr_images++;
+    }
+    return 0;
+}
+
+/* Close all handles but @image and forget which AioContext uses which */
+static void qemu_rbd_close_extra_images(BDRVRBDState *s)
+{
+    int i;
+
+    for (i = 1; i < s->nr_images; i++) {
+        rbd_close(s->images[i]);
+    }
+    g_free(s->images);
+    s->images = NULL;
+    s->nr_images = 0;
+    g_hash_table_destroy(s->ctx_images);
+    qemu_mutex_destroy(&s->images_lock);
+}
+
+/* Returns the handle for requests from the current AioContext */
+static rbd_image_t qemu_rbd_get_image(BDRVRBDState *s)
+{
+    AioContext *ctx;
+    gpointer value;
+    int i;
+
+    if (s->nr_images == 1) {
+        return s->image;
+    }
+
+    ctx = qemu_get_current_aio_context();
+    qemu_mutex_lock(&s->images_lock);
+    if (g_hash_table_lookup_extended(s->ctx_images, ctx, NULL, &value)) {
+        i = GPOINTER_TO_INT(value);
+    } else {
+        i = s->next_image;
+        s->next_image = (i + 1) % s->nr_images;
+        g_hash_table_insert(s->ctx_images, ctx, GINT_TO_POINTER(i));
+    }
+    qemu_mutex_unlock(&s->images_lock);
+
+    return s->images[i];
+}
+
 static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
                          Error **errp)
 {
@@ -1126,34 +1285,20 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
     s->snap = g_strdup(opts->snapshot);
     s->image_name = g_strdup(opts->image);
 
-    /* rbd_open is always r/w */
-    r = rbd_open(s->io_ctx, s->image_name, &s->image, s->snap);
+    r = qemu_rbd_open_image(s, opts, &s->image, errp);
     if (r < 0) {
-        error_setg_errno(errp, -r, "error reading header from %s",
-                         s->image_name);
         goto failed_open;
     }
 
-    if (opts->encrypt) {
-#ifdef LIBRBD_SUPPORTS_ENCRYPTION
-        if (opts->encrypt->parent) {
-#ifdef LIBRBD_SUPPORTS_ENCRYPTION_LOAD2
-            r = qemu_rbd_encryption_load2(s->image, opts->encrypt, errp);
-#else
-            r = -ENOTSUP;
-            error_setg(errp, "RBD library does not support layered encryption");
-#endif
-        } else {
-            r = qemu_rbd_encryption_load(s->image, opts->encrypt, errp);
-        }
-        if (r < 0) {
-            goto failed_post_open;
-        }
-#else
-        r = -ENOTSUP;
-        error_setg(errp, "RBD library does not support image encryption");
+    qemu_mutex_init(&s->images_lock);
+    s->ctx_images = g_hash_table_new(NULL, NULL);
+    s->images = g_new(rbd_image_t, 1);
+    s->images[0] = s->image;
+    s->nr_images = 1;
+
+    r = qemu_rbd_open_extra_images(s, opts, flags, errp);
+    if (r < 0) {
         goto failed_post_open;
-#endif
     }
 
     r = rbd_stat(s->image, &info, sizeof(info));
@@ -1187,6 +1332,7 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
     goto out;
 
 failed_post_open:
+    qemu_rbd_close_extra_images(s);
     rbd_close(s->image);
 failed_open:
     rados_ioctx_destroy(s->io_ctx);
@@ -1217,6 +1363,9 @@ static int qemu_rbd_reopen_prepare(BDRVReopenState *state,
                    "Cannot change node '%s' to r/w when using RBD snapshot",
                    bdrv_get_device_or_node_name(state->bs));
         ret = -EINVAL;
+    } else if (s->nr_images > 1 && (state->flags & BDRV_O_RDWR) &&
+               !(state->bs->open_flags & BDRV_O_RDWR)) {
+        ret = qemu_rbd_check_exclusive_lock(s, errp);
     }
 
     return ret;
@@ -1226,6 +1375,7 @@ static void qemu_rbd_close(BlockDriverState *bs)
 {
     BDRVRBDState *s = bs->opaque;
 
+    qemu_rbd_close_extra_images(s);
     rbd_close(s->image);
     rados_ioctx_destroy(s->io_ctx);
     g_free(s->snap);
@@ -1262,18 +1412,18 @@ static void qemu_rbd_finish_bh(void *opaque)
  *
  * Note: this function is being called from a non qemu thread so
  * we need to be careful about what we do here. Generally we only
- * schedule a BH, and do the rest of the io completion handling
+ * queue the completion, and do the rest of the io completion handling
  * from qemu_rbd_finish_bh() which runs in a qemu context.
  */
 static void qemu_rbd_completion_cb(rbd_completion_t c, RBDTask *task)
 {
     task->ret = rbd_aio_get_return_value(c);
     rbd_aio_release(c);
-    aio_bh_schedule_oneshot(bdrv_get_aio_context(task->bs),
-                            qemu_rbd_finish_bh, task);
+    aio_complete_in(task->ctx, &task->completion, qemu_rbd_finish_bh, task);
 }
 
 static int coroutine_fn qemu_rbd_start_co(BlockDriverState *bs,
+                                          rbd_image_t image,
                                           uint64_t offset,
                                           uint64_t bytes,
                                           QEMUIOVector *qiov,
@@ -1281,7 +1431,11 @@ static int coroutine_fn qemu_rbd_start_co(BlockDriverState *bs,
                                           RBDAIOCmd cmd)
 {
     BDRVRBDState *s = bs->opaque;
-    RBDTask task = { .bs = bs, .co = qemu_coroutine_self() };
+    RBDTask task = {
+        .bs = bs,
+        .ctx = qemu_get_current_aio_context(),
+        .co = qemu_coroutine_self(),
+    };
     rbd_completion_t c;
     int r;
 
@@ -1309,16 +1463,16 @@ static int coroutine_fn qemu_rbd_start_co(BlockDriverState *bs,
 
     switch (cmd) {
     case RBD_AIO_READ:
-        r = rbd_aio_readv(s->image, qiov->iov, qiov->niov, offset, c);
+        r = rbd_aio_readv(image, qiov->iov, qiov->niov, offset, c);
         break;
     case RBD_AIO_WRITE:
-        r = rbd_aio_writev(s->image, qiov->iov, qiov->niov, offset, c);
+        r = rbd_aio_writev(image, qiov->iov, qiov->niov, offset, c);
         break;
     case RBD_AIO_DISCARD:
-        r = rbd_aio_discard(s->image, offset, bytes, c);
+        r = rbd_aio_discard(image, offset, bytes, c);
         break;
     case RBD_AIO_FLUSH:
-        r = rbd_aio_flush(s->image, c);
+        r = rbd_aio_flush(image, c);
         break;
 #ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
     case RBD_AIO_WRITE_ZEROES: {
@@ -1328,7 +1482,7 @@ static int coroutine_fn qemu_rbd_start_co(BlockDriverState *bs,
             zero_flags = RBD_WRITE_ZEROES_FLAG_THICK_PROVISION;
         }
 #endif
-        r = rbd_aio_write_zeroes(s->image, offset, bytes, c, zero_flags, 0);
+        r = rbd_aio_write_zeroes(image, offset, bytes, c, zero_flags, 0);
         break;
     }
 #endif
@@ -1368,7 +1522,8 @@ coroutine_fn qemu_rbd_co_preadv(BlockDriverState *bs, int64_t offset,
                                 int64_t bytes, QEMUIOVector *qiov,
                                 BdrvRequestFlags flags)
 {
-    return qemu_rbd_start_co(bs, offset, bytes, qiov, flags, RBD_AIO_READ);
+    return qemu_rbd_start_co(bs, qemu_rbd_get_image(bs->opaque), offset, bytes,
+                             qiov, flags, RBD_AIO_READ);
 }
 
 static int
@@ -1376,18 +1531,29 @@ coroutine_fn qemu_rbd_co_pwritev(BlockDriverState *bs, int64_t offset,
                                  int64_t bytes, QEMUIOVector *qiov,
                                  BdrvRequestFlags flags)
 {
-    return qemu_rbd_start_co(bs, offset, bytes, qiov, flags, RBD_AIO_WRITE);
+    return qemu_rbd_start_co(bs, qemu_rbd_get_image(bs->opaque), offset, bytes,
+                             qiov, flags, RBD_AIO_WRITE);
 }
 
 static int coroutine_fn qemu_rbd_co_flush(BlockDriverState *bs)
 {
-    return qemu_rbd_start_co(bs, 0, 0, NULL, 0, RBD_AIO_FLUSH);
+    BDRVRBDState *s = bs->opaque;
+    int i, r;
+
+    for (i = 0; i < s->nr_images; i++) {
+        r = qemu_rbd_start_co(bs, s->images[i], 0, 0, NULL, 0, RBD_AIO_FLUSH);
+        if (r < 0) {
+            return r;
+        }
+    }
+    return 0;
 }
 
 static int coroutine_fn qemu_rbd_co_pdiscard(BlockDriverState *bs,
                                              int64_t offset, int64_t bytes)
 {
-    return qemu_rbd_start_co(bs, offset, bytes, NULL, 0, RBD_AIO_DISCARD);
+    return qemu_rbd_start_co(bs, qemu_rbd_get_image(bs->opaque), offset, bytes,
+                             NULL, 0, RBD_AIO_DISCARD);
 }
 
 #ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
@@ -1395,8 +1561,8 @@ static int
 coroutine_fn qemu_rbd_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                        int64_t bytes, BdrvRequestFlags flags)
 {
-    return qemu_rbd_start_co(bs, offset, bytes, NULL, flags,
-                             RBD_AIO_WRITE_ZEROES);
+    return qemu_rbd_start_co(bs, qemu_rbd_get_image(bs->opaque), offset, bytes,
+                             NULL, flags, RBD_AIO_WRITE_ZEROES);
 }
 #endif
 
@@ -1754,9 +1920,14 @@ static void coroutine_fn qemu_rbd_co_invalidate_cache(BlockDriverState *bs,
                                                       Error **errp)
 {
     BDRVRBDState *s = bs->opaque;
-    int r = rbd_invalidate_cache(s->image);
-    if (r < 0) {
-        error_setg_errno(errp, -r, "Failed to invalidate the cache");
+    int i, r;
+
+    for (i = 0; i < s->nr_images; i++) {
+        r = rbd_invalidate_cache(s->images[i]);
+        if (r < 0) {
+            error_setg_errno(errp, -r, "Failed to invalidate the cache");
+            return;
+        }
     }
 }
 
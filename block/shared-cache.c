@@ -0,0 +1,535 @@
+/*
+ * Read cache filter driver shared between processes
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Nodes of this driver cache the clusters they read from their read-only
+ * child in a file that is mapped by all QEMU processes using it, typically on
+ * tmpfs or hugetlbfs. When many VMs boot from the same base image, the first
+ * one reads a cluster from the disk and the others copy it from memory.
+ *
+ * Clusters are identified by a hash of the node's image-id and their index,
+ * so nodes with the same image-id must have the same content. The child is
+ * not shared for writing, which stops other processes from writing to it
+ * through image locking, but nothing protects against changes made without
+ * QEMU.
+ *
+ * The file starts with a SharedCacheHeader, followed by the table of
+ * SharedCacheEntry and the cluster data. The table is set associative with
+ * SHARED_CACHE_WAYS entries per set. Entries are filled under a sequence
+ * counter that is odd while the entry changes: a writer moves it from even to
+ * odd with a compare-and-swap, which excludes other writers in any process,
+ * and readers copy the data and then check that the counter did not change.
+ * An entry whose writer died while filling it stays unused.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/file.h>
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "qemu/atomic.h"
+#include "qemu/cutils.h"
+#include "qemu/memalign.h"
+#include "qemu/mmap-alloc.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+
+#define SHARED_CACHE_OPT_PATH           "path"
+#define SHARED_CACHE_OPT_SIZE           "size"
+#define SHARED_CACHE_OPT_IMAGE_ID       "image-id"
+#define SHARED_CACHE_OPT_CLUSTER_SIZE   "cluster-size"
+
+#define SHARED_CACHE_MAGIC              0x514d5343 /* "QMSC" */
+
+enum {
+    SHARED_CACHE_VERSION = 1,
+    SHARED_CACHE_WAYS = 8,
+    SHARED_CACHE_HEADER_SIZE = 4096,
+    SHARED_CACHE_DEFAULT_SIZE = 1 * GiB,
+    SHARED_CACHE_DEFAULT_CLUSTER_SIZE = 64 * KiB,
+};
+
+typedef struct SharedCacheHeader {
+    uint32_t magic;             /* atomic, set once the file is formatted */
+    uint32_t version;
+    uint32_t cluster_size;
+    uint32_t clock;             /* atomic, advances with each fill */
+    uint64_t nb_entries;
+    uint64_t entries_offset;
+    uint64_t data_offset;
+} SharedCacheHeader;
+
+typedef struct SharedCacheEntry {
+    uint32_t seq;               /* atomic, odd while the entry changes */
+    uint32_t last_use;          /* atomic, header clock at the last use */
+    uint64_t image;             /* 0 if the entry is empty */
+    uint64_t cluster;
+    uint64_t padding;
+} SharedCacheEntry;
+
+QEMU_BUILD_BUG_ON(sizeof(SharedCacheHeader) > SHARED_CACHE_HEADER_SIZE);
+
+typedef struct BDRVSharedCacheState {
+    SharedCacheHeader *header;
+    SharedCacheEntry *entries;
+    uint8_t *data;
+    size_t map_size;
+    uint64_t nb_sets;
+    uint32_t cluster_size;
+    uint64_t image;             /* hash of image-id */
+} BDRVSharedCacheState;
+
+static QemuOptsList shared_cache_opts = {
+    .name = "shared-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(shared_cache_opts.head),
+    .desc = {
+        {
+            .name = SHARED_CACHE_OPT_PATH,
+            .type = QEMU_OPT_STRING,
+            .help = "Path of the file holding the cache",
+        },
+        {
+            .name = SHARED_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the file if it must be created (default: 1G)",
+        },
+        {
+            .name = SHARED_CACHE_OPT_IMAGE_ID,
+            .type = QEMU_OPT_STRING,
+            .help = "Identifier of the image content",
+        },
+        {
+            .name = SHARED_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cached clusters if the file must be "
+                    "created (default: 64k)",
+        },
+        { /* end of list */ }
+    },
+};
+
+/* 64-bit FNV-1a, never 0 so that empty entries don't match */
+static uint64_t shared_cache_hash_image_id(const char *image_id)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; *image_id; image_id++) {
+        hash ^= (uint8_t)*image_id;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash ?: 1;
+}
+
+/* Lay out an empty cache file of @size bytes */
+static bool shared_cache_format(SharedCacheHeader *header, uint64_t size,
+                                uint32_t cluster_size, Error **errp)
+{
+    uint64_t nb_entries, data_offset;
+
+    nb_entries = (size - SHARED_CACHE_HEADER_SIZE) /
+                 (cluster_size + sizeof(SharedCacheEntry));
+    nb_entries = QEMU_ALIGN_DOWN(nb_entries, SHARED_CACHE_WAYS);
+
+    /* The table is page aligned and may need a few entries' space more */
+    for (;;) {
+        if (nb_entries == 0) {
+            error_setg(errp, "The cache is too small for its cluster size");
+            return false;
+        }
+        data_offset = SHARED_CACHE_HEADER_SIZE +
+                      ROUND_UP(nb_entries * sizeof(SharedCacheEntry),
+                               qemu_real_host_page_size());
+        if (data_offset + nb_entries * cluster_size <= size) {
+            break;
+        }
+        nb_entries -= SHARED_CACHE_WAYS;
+    }
+
+    *header = (SharedCacheHeader) {
+        .version = SHARED_CACHE_VERSION,
+        .cluster_size = cluster_size,
+        .nb_entries = nb_entries,
+        .entries_offset = SHARED_CACHE_HEADER_SIZE,
+        .data_offset = data_offset,
+    };
+
+    /* Written last so that a half-formatted file is not used */
+    qatomic_store_release(&header->magic, SHARED_CACHE_MAGIC);
+    return true;
+}
+
+/*
+ * Open and map the cache file, creating and formatting it if it is empty.
+ * The file is locked while this happens so that concurrent processes wait
+ * for the first one to format it.
+ */
+static int shared_cache_map(BDRVSharedCacheState *s, const char *path,
+                            uint64_t size, uint32_t cluster_size,
+                            Error **errp)
+{
+    SharedCacheHeader *header;
+    struct stat st;
+    void *map;
+    int fd, ret;
+
+    fd = qemu_create(path, O_RDWR, 0600, errp);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (flock(fd, LOCK_EX) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not lock '%s'", path);
+        goto out;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not stat '%s'", path);
+        goto out;
+    }
+
+    if (st.st_size == 0) {
+        /* hugetlbfs only takes whole huge pages */
+        size = ROUND_UP(size, qemu_fd_getpagesize(fd));
+        if (ftruncate(fd, size) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Could not resize '%s'", path);
+            goto out;
+        }
+    } else {
+        size = st.st_size;
+    }
+
+    if (size < SHARED_CACHE_HEADER_SIZE) {
+        ret = -EINVAL;
+        error_setg(errp, "'%s' has an invalid size for a cache", path);
+        goto out;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not map '%s'", path);
+        goto out;
+    }
+    header = map;
+
+    if (qatomic_load_acquire(&header->magic) != SHARED_CACHE_MAGIC) {
+        if (st.st_size != 0) {
+            error_setg(errp, "'%s' is not a cache file", path);
+            ret = -EINVAL;
+            goto unmap;
+        }
+        if (!shared_cache_format(header, size, cluster_size, errp)) {
+            ret = -EINVAL;
+            goto unmap;
+        }
+    }
+
+    if (header->version != SHARED_CACHE_VERSION ||
+        !is_power_of_2(header->cluster_size) ||
+        header->cluster_size < BDRV_SECTOR_SIZE ||
+        header->nb_entries == 0 ||
+        header->nb_entries % SHARED_CACHE_WAYS ||
+        header->entries_offset < SHARED_CACHE_HEADER_SIZE ||
+        header->nb_entries > (size - header->entries_offset) /
+                             sizeof(SharedCacheEntry) ||
+        header->data_offset < header->entries_offset +
+                              header->nb_entries * sizeof(SharedCacheEntry) ||
+        header->data_offset > size ||
+        header->nb_entries > (size - header->data_offset) /
+                             header->cluster_size) {
+        error_setg(errp, "Unsupported or corrupt cache file '%s'", path);
+        ret = -EINVAL;
+        goto unmap;
+    }
+
+    s->header = header;
+    s->entries = map + header->entries_offset;
+    s->data = map + header->data_offset;
+    s->map_size = size;
+    s->nb_sets = header->nb_entries / SHARED_CACHE_WAYS;
+    s->cluster_size = header->cluster_size;
+    ret = 0;
+    goto out;
+
+unmap:
+    munmap(map, size);
+out:
+    qemu_close(fd); /* also drops the flock */
+    return ret;
+}
+
+static SharedCacheEntry *shared_cache_set(BDRVSharedCacheState *s,
+                                          uint64_t cluster)
+{
+    uint64_t hash = s->image ^ (cluster * 0x9e3779b97f4a7c15ULL);
+
+    hash ^= hash >> 29;
+    return &s->entries[(hash % s->nb_sets) * SHARED_CACHE_WAYS];
+}
+
+static uint8_t *shared_cache_entry_data(BDRVSharedCacheState *s,
+                                        SharedCacheEntry *entry)
+{
+    return s->data + (uint64_t)(entry - s->entries) * s->cluster_size;
+}
+
+/*
+ * Copy @bytes bytes at @offset_in_cluster of a cached cluster to @qiov at
+ * @qiov_offset. Return whether the cluster was in the cache.
+ */
+static bool shared_cache_lookup(BDRVSharedCacheState *s, uint64_t cluster,
+                                uint64_t offset_in_cluster, uint64_t bytes,
+                                QEMUIOVector *qiov, size_t qiov_offset)
+{
+    SharedCacheEntry *set = shared_cache_set(s, cluster);
+
+    for (int i = 0; i < SHARED_CACHE_WAYS; i++) {
+        SharedCacheEntry *entry = &set[i];
+        uint32_t seq = qatomic_load_acquire(&entry->seq);
+
+        if ((seq & 1) || entry->image != s->image ||
+            entry->cluster != cluster) {
+            continue;
+        }
+
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            shared_cache_entry_data(s, entry) +
+                            offset_in_cluster, bytes);
+
+        smp_rmb();
+        if (qatomic_read(&entry->seq) != seq) {
+            /* Replaced while we copied it */
+            return false;
+        }
+
+        qatomic_set(&entry->last_use, qatomic_read(&s->header->clock));
+        return true;
+    }
+
+    return false;
+}
+
+/* Add a cluster to the cache unless it is there already or the set is busy */
+static void shared_cache_insert(BDRVSharedCacheState *s, uint64_t cluster,
+                                const uint8_t *buf)
+{
+    SharedCacheEntry *set = shared_cache_set(s, cluster);
+    SharedCacheEntry *victim = NULL;
+    uint32_t victim_seq = 0;
+    uint32_t clock = qatomic_fetch_inc(&s->header->clock);
+
+    for (int i = 0; i < SHARED_CACHE_WAYS; i++) {
+        SharedCacheEntry *entry = &set[i];
+        uint32_t seq = qatomic_read(&entry->seq);
+
+        if (seq & 1) {
+            continue;
+        }
+        if (entry->image == s->image && entry->cluster == cluster) {
+            /* Another reader filled it in the meantime */
+            return;
+        }
+        if (!victim ||
+            (int32_t)(qatomic_read(&entry->last_use) -
+                      qatomic_read(&victim->last_use)) < 0) {
+            victim = entry;
+            victim_seq = seq;
+        }
+    }
+
+    if (!victim ||
+        qatomic_cmpxchg(&victim->seq, victim_seq, victim_seq + 1) !=
+        victim_seq) {
+        return;
+    }
+    smp_wmb();
+
+    victim->image = s->image;
+    victim->cluster = cluster;
+    memcpy(shared_cache_entry_data(s, victim), buf, s->cluster_size);
+    qatomic_set(&victim->last_use, clock);
+
+    qatomic_store_release(&victim->seq, victim_seq + 2);
+}
+
+static int shared_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                             Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    const char *path, *image_id;
+    uint64_t size, cluster_size;
+    int ret;
+
+    if (flags & BDRV_O_RDWR) {
+        error_setg(errp, "shared-cache nodes must be read-only");
+        return -EINVAL;
+    }
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    opts = qemu_opts_create(&shared_cache_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto fin;
+    }
+
+    path = qemu_opt_get(opts, SHARED_CACHE_OPT_PATH);
+    image_id = qemu_opt_get(opts, SHARED_CACHE_OPT_IMAGE_ID);
+    if (!path || !image_id) {
+        error_setg(errp, "shared-cache requires path and image-id");
+        ret = -EINVAL;
+        goto fin;
+    }
+
+    size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_SIZE,
+                             SHARED_CACHE_DEFAULT_SIZE);
+    cluster_size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_CLUSTER_SIZE,
+                                     SHARED_CACHE_DEFAULT_CLUSTER_SIZE);
+    if (!is_power_of_2(cluster_size) || cluster_size < BDRV_SECTOR_SIZE ||
+        cluster_size > 2 * MiB) {
+        error_setg(errp, "cluster-size must be a power of two between 512 "
+                   "and 2M");
+        ret = -EINVAL;
+        goto fin;
+    }
+
+    ret = shared_cache_map(s, path, size, cluster_size, errp);
+    if (ret < 0) {
+        goto fin;
+    }
+    s->image = shared_cache_hash_image_id(image_id);
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+    bs->supported_read_flags = bs->file->bs->supported_read_flags;
+
+fin:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void shared_cache_close(BlockDriverState *bs)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+
+    munmap(s->header, s->map_size);
+}
+
+static void
+shared_cache_child_perm(BlockDriverState *bs, BdrvChild *c, BdrvChildRole role,
+                        BlockReopenQueue *reopen_queue,
+                        uint64_t perm, uint64_t shared,
+                        uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared,
+                       nperm, nshared);
+
+    /* Cached clusters would become stale */
+    *nshared &= ~BLK_PERM_WRITE;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+shared_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+shared_cache_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                       QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    int64_t length = -1;
+    uint8_t *buf = NULL;
+    size_t qiov_offset = 0;
+    int ret = 0;
+
+    if (flags & BDRV_REQ_PREFETCH) {
+        return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    }
+
+    while (bytes > 0) {
+        uint64_t cluster = offset / s->cluster_size;
+        uint64_t cluster_offset = cluster * s->cluster_size;
+        uint64_t offset_in_cluster = offset - cluster_offset;
+        uint64_t cur_bytes = MIN(bytes, s->cluster_size - offset_in_cluster);
+
+        if (!shared_cache_lookup(s, cluster, offset_in_cluster, cur_bytes,
+                                 qiov, qiov_offset)) {
+            /* Read and cache the whole cluster, zeroed beyond the end */
+            if (!buf) {
+                buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+                if (!buf) {
+                    ret = -ENOMEM;
+                    break;
+                }
+                length = bdrv_co_getlength(bs->file->bs);
+                if (length < 0) {
+                    ret = length;
+                    break;
+                }
+            }
+
+            memset(buf, 0, s->cluster_size);
+            ret = bdrv_co_pread(bs->file, cluster_offset,
+                                MIN(s->cluster_size, length - cluster_offset),
+                                buf, flags);
+            if (ret < 0) {
+                break;
+            }
+
+            qemu_iovec_from_buf(qiov, qiov_offset, buf + offset_in_cluster,
+                                cur_bytes);
+            shared_cache_insert(s, cluster, buf);
+        }
+
+        offset += cur_bytes;
+        bytes -= cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+
+    qemu_vfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+shared_cache_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static BlockDriver bdrv_shared_cache = {
+    .format_name                        =   "shared-cache",
+    .instance_size                      =   sizeof(BDRVSharedCacheState),
+
+    .bdrv_open                          =   shared_cache_open,
+    .bdrv_close                         =   shared_cache_close,
+    .bdrv_co_flush                      =   shared_cache_co_flush,
+
+    .bdrv_child_perm                    =   shared_cache_child_perm,
+
+    .bdrv_co_getlength                  =   shared_cache_co_getlength,
+
+    .bdrv_co_preadv                     =   shared_cache_co_preadv,
+
+    .is_filter                          =   true,
+};
+
+static void bdrv_shared_cache_init(void)
+{
+    bdrv_register(&bdrv_shared_cache);
+}
+
+block_init(bdrv_shared_cache_init);
@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "trace.h"
+#include "block/aio_task.h"
 #include "block/block_int.h"
 #include "block/blockjob_int.h"
 #include "qapi/error.h"
@@ -30,6 +31,12 @@ enum {
     STREAM_CHUNK = 512 * 1024, /* in bytes */
 };
 
+typedef struct StreamRange {
+    int64_t offset;
+    int64_t bytes;
+    QSIMPLEQ_ENTRY(StreamRange) next;
+} StreamRange;
+
 typedef struct StreamBlockJob {
     BlockJob common;
     BlockBackend *blk;
@@ -41,8 +48,23 @@ typedef struct StreamBlockJob {
     char *backing_file_str;
     bool backing_mask_protocol;
     bool bs_read_only;
+
+    int max_workers;
+    int64_t chunk;
+    AioTaskPool *aio;
+    /* Areas to copy again once the job is resumed after an error */
+    QSIMPLEQ_HEAD(, StreamRange) retry;
+    int error;   /* First error that was ignored or reported */
+    bool failed; /* An error was reported, stop copying */
 } StreamBlockJob;
 
+typedef struct StreamTask {
+    AioTask task;
+    StreamBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+} StreamTask;
+
 static int coroutine_fn stream_populate(BlockBackend *blk,
                                         int64_t offset, uint64_t bytes)
 {
@@ -51,6 +73,74 @@ static int coroutine_fn stream_populate(BlockBackend *blk,
     return blk_co_preadv(blk, offset, bytes, NULL, BDRV_REQ_PREFETCH);
 }
 
+/* Returns true if the failed area must be copied again */
+static bool stream_error_action(StreamBlockJob *s, int ret)
+{
+    BlockErrorAction action =
+        block_job_error_action(&s->common, s->on_error, true, -ret);
+
+    if (action == BLOCK_ERROR_ACTION_STOP) {
+        return true;
+    }
+    if (s->error == 0) {
+        s->error = ret;
+    }
+    if (action == BLOCK_ERROR_ACTION_REPORT) {
+        s->failed = true;
+    }
+    return false;
+}
+
+static int coroutine_fn stream_task_entry(AioTask *task)
+{
+    StreamTask *t = container_of(task, StreamTask, task);
+    StreamBlockJob *s = t->s;
+    int ret;
+
+    ret = stream_populate(s->blk, t->offset, t->bytes);
+    if (ret < 0 && stream_error_action(s, ret)) {
+        StreamRange *r = g_new(StreamRange, 1);
+
+        r->offset = t->offset;
+        r->bytes = t->bytes;
+        QSIMPLEQ_INSERT_TAIL(&s->retry, r, next);
+        return 0;
+    }
+
+    /* Publish progress */
+    job_progress_update(&s->common.job, t->bytes);
+    return 0;
+}
+
+/*
+ * Copy the area in the background, after waiting for one of the requests
+ * in flight if there are already max_workers of them.
+ */
+static void coroutine_fn stream_copy(StreamBlockJob *s, int64_t offset,
+                                     int64_t bytes)
+{
+    StreamTask *t = g_new(StreamTask, 1);
+
+    *t = (StreamTask) {
+        .task.func = stream_task_entry,
+        .s = s,
+        .offset = offset,
+        .bytes = bytes,
+    };
+    aio_task_pool_start_task(s->aio, &t->task);
+    block_job_ratelimit_processed_bytes(&s->common, bytes);
+}
+
+/* Requests are not kept in flight while the job is paused */
+static void coroutine_fn stream_pause(Job *job)
+{
+    StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
+
+    if (s->aio) {
+        aio_task_pool_wait_all(s->aio);
+    }
+}
+
 static int stream_prepare(Job *job)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
@@ -156,9 +246,9 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
     BlockDriverState *unfiltered_bs;
+    StreamRange *r;
     int64_t len;
     int64_t offset = 0;
-    int error = 0;
     int64_t n = 0; /* bytes */
 
     WITH_GRAPH_RDLOCK_GUARD() {
@@ -175,22 +265,42 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
     }
     job_progress_set_remaining(&s->common.job, len);
 
-    for ( ; offset < len; offset += n) {
+    s->aio = aio_task_pool_new(s->max_workers);
+
+    for (;;) {
         bool copy;
         int ret;
 
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.  stream_pause() waits for
+         * the requests in flight before the job pauses.
          */
         block_job_ratelimit_sleep(&s->common);
-        if (job_is_cancelled(&s->common.job)) {
+        if (job_is_cancelled(&s->common.job) || s->failed) {
             break;
         }
 
+        r = QSIMPLEQ_FIRST(&s->retry);
+        if (r) {
+            QSIMPLEQ_REMOVE_HEAD(&s->retry, next);
+            stream_copy(s, r->offset, r->bytes);
+            g_free(r);
+            continue;
+        }
+
+        if (offset >= len) {
+            if (aio_task_pool_empty(s->aio)) {
+                break;
+            }
+            /* Failed requests may still have to be retried */
+            aio_task_pool_wait_one(s->aio);
+            continue;
+        }
+
         copy = false;
 
         WITH_GRAPH_RDLOCK_GUARD() {
-            ret = bdrv_co_is_allocated(unfiltered_bs, offset, STREAM_CHUNK, &n);
+            ret = bdrv_co_is_allocated(unfiltered_bs, offset, s->chunk, &n);
             if (ret == 1) {
                 /* Allocated in the top, no need to copy.  */
             } else if (ret >= 0) {
@@ -211,32 +321,32 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
         }
         trace_stream_one_iteration(s, offset, n, ret);
         if (copy) {
-            ret = stream_populate(s->blk, offset, n);
-        }
-        if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->on_error, true, -ret);
-            if (action == BLOCK_ERROR_ACTION_STOP) {
-                n = 0;
+            stream_copy(s, offset, n);
+        } else {
+            if (ret < 0 && stream_error_action(s, ret)) {
                 continue;
             }
-            if (error == 0) {
-                error = ret;
-            }
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
+            if (s->failed) {
                 break;
             }
-        }
 
-        /* Publish progress */
-        job_progress_update(&s->common.job, n);
-        if (copy) {
-            block_job_ratelimit_processed_bytes(&s->common, n);
+            /* Publish progress */
+            job_progress_update(&s->common.job, n);
         }
+        offset += n;
+    }
+
+    aio_task_pool_wait_all(s->aio);
+    aio_task_pool_free(s->aio);
+    s->aio = NULL;
+
+    while ((r = QSIMPLEQ_FIRST(&s->retry))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->retry, next);
+        g_free(r);
     }
 
     /* Do not remove the backing file if an error was there but ignored. */
-    return error;
+    return s->error;
 }
 
 static const BlockJobDriver stream_job_driver = {
@@ -248,6 +358,7 @@ static const BlockJobDriver stream_job_driver = {
         .prepare       = stream_prepare,
         .clean         = stream_clean,
         .user_resume   = block_job_user_resume,
+        .pause         = stream_pause,
     },
 };
 
@@ -258,6 +369,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
                   int creation_flags, int64_t speed,
                   BlockdevOnError on_error,
                   const char *filter_node_name,
+                  const BackingChainPerf *perf,
                   Error **errp)
 {
     StreamBlockJob *s = NULL;
@@ -275,6 +387,17 @@ void stream_start(const char *job_id, BlockDriverState *bs,
     assert(!(base && bottom));
     assert(!(backing_file_str && bottom));
 
+    if (perf->max_workers < 1 || perf->max_workers > INT_MAX) {
+        error_setg(errp, "max-workers must be between 1 and %d", INT_MAX);
+        return;
+    }
+
+    if (perf->max_chunk < 0 || perf->max_chunk > BDRV_REQUEST_MAX_BYTES) {
+        error_setg(errp, "max-chunk must be between 0 (which means the "
+                   "default) and %d", (int)BDRV_REQUEST_MAX_BYTES);
+        return;
+    }
+
     bdrv_graph_rdlock_main_loop();
 
     if (bottom) {
@@ -409,6 +532,9 @@ void stream_start(const char *job_id, BlockDriverState *bs,
     s->cor_filter_bs = cor_filter_bs;
     s->target_bs = bs;
     s->bs_read_only = bs_read_only;
+    s->max_workers = perf->max_workers;
+    s->chunk = perf->max_chunk ?: STREAM_CHUNK;
+    QSIMPLEQ_INIT(&s->retry);
 
     s->on_error = on_error;
     trace_stream_start(bs, base, s);
@@ -62,6 +62,12 @@ static void timer_cb(ThrottleGroupMember *tgm, ThrottleDirection direction);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * With high limits, requests would contend on the lock just to do the
+ * accounting. So while no request of the group is throttled, a member
+ * that is allowed to do I/O accounts in advance for what the limits allow
+ * during THROTTLE_GROUP_CREDIT_NS, and its following requests consume
+ * this credit with atomic operations instead of taking the lock.
  */
 struct ThrottleGroup {
     Object parent_obj;
@@ -70,11 +76,12 @@ struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following five fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
     ThrottleGroupMember *tokens[THROTTLE_MAX];
     bool any_timer_armed[THROTTLE_MAX];
+    unsigned pending_reqs[THROTTLE_MAX]; /* sum of the members' ones */
     QEMUClockType clock_type;
 
     /* This field is protected by the global QEMU mutex */
@@ -170,6 +177,14 @@ const char *throttle_group_get_name(ThrottleGroupMember *tgm)
     return tg->name;
 }
 
+enum {
+    /* Period of time whose I/O a member may account for in advance */
+    THROTTLE_GROUP_CREDIT_NS = 1000000,
+
+    /* Minimum number of requests that the credit must allow */
+    THROTTLE_GROUP_CREDIT_MIN_REQS = 4,
+};
+
 /* Return the next ThrottleGroupMember in the round-robin sequence, simulating
  * a circular list.
  *
@@ -350,6 +365,116 @@ static void coroutine_mixed_fn schedule_next_request(ThrottleGroupMember *tgm,
     }
 }
 
+/* Take @n from a credit counter if it holds that much.
+ *
+ * @credit: the counter, accessed with atomic operations
+ * @n:      the amount to take
+ * @ret:    whether @n was taken
+ */
+static bool throttle_group_credit_take(uint32_t *credit, uint32_t n)
+{
+    uint32_t old = qatomic_read(credit);
+    uint32_t prev;
+
+    while (old >= n) {
+        prev = qatomic_cmpxchg(credit, old, old - n);
+        if (prev == old) {
+            return true;
+        }
+        old = prev;
+    }
+
+    return false;
+}
+
+/* Use the credit of a ThrottleGroupMember for an I/O request. This does not
+ * take tg->lock.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @direction: the ThrottleDirection
+ * @ret:       whether the request was accounted and can be executed
+ */
+static bool throttle_group_use_credit(ThrottleGroupMember *tgm, int64_t bytes,
+                                      ThrottleDirection direction)
+{
+    /* Drained members and queued requests go through the round-robin */
+    if (bytes > UINT32_MAX || qatomic_read(&tgm->io_limits_disabled) ||
+        qatomic_read(&tgm->pending_reqs[direction])) {
+        return false;
+    }
+
+    if (!throttle_group_credit_take(&tgm->credit_ops[direction], 1)) {
+        return false;
+    }
+    if (!throttle_group_credit_take(&tgm->credit_bytes[direction], bytes)) {
+        qatomic_add(&tgm->credit_ops[direction], 1);
+        return false;
+    }
+
+    return true;
+}
+
+/* Set the credit of a ThrottleGroupMember to what the limits allow during
+ * THROTTLE_GROUP_CREDIT_NS and account for it, unless that is too little
+ * for requests of the given size or the group throttles requests.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @bytes:     the number of bytes of the current request
+ * @direction: the ThrottleDirection
+ */
+static void throttle_group_refill_credit(ThrottleGroupMember *tgm,
+                                         int64_t bytes,
+                                         ThrottleDirection direction)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    uint64_t units, size, added_units, added_size;
+    uint32_t old;
+
+    /* cfg.op_size makes requests count for several operations */
+    if (ts->cfg.op_size || qatomic_read(&tgm->io_limits_disabled) ||
+        tg->any_timer_armed[direction] || tg->pending_reqs[direction]) {
+        return;
+    }
+
+    throttle_compute_credit(ts, direction, THROTTLE_GROUP_CREDIT_NS,
+                            &units, &size);
+    if (units < THROTTLE_GROUP_CREDIT_MIN_REQS ||
+        size / THROTTLE_GROUP_CREDIT_MIN_REQS < bytes) {
+        return;
+    }
+
+    /* Unlimited credit does not need to be accounted */
+    old = qatomic_xchg(&tgm->credit_ops[direction], MIN(units, UINT32_MAX));
+    added_units = units == UINT64_MAX || old >= units ? 0 : units - old;
+
+    old = qatomic_xchg(&tgm->credit_bytes[direction], MIN(size, UINT32_MAX));
+    added_size = size == UINT64_MAX || old >= size ? 0 : size - old;
+
+    throttle_account_credit(ts, direction, added_units, added_size);
+}
+
+/* Drop the credit of all members of a group, e.g. because its configuration
+ * changed.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_reset_credit(ThrottleGroup *tg)
+{
+    ThrottleGroupMember *tgm;
+    ThrottleDirection dir;
+
+    QLIST_FOREACH(tgm, &tg->head, round_robin) {
+        for (dir = THROTTLE_READ; dir < THROTTLE_MAX; dir++) {
+            qatomic_set(&tgm->credit_ops[dir], 0);
+            qatomic_set(&tgm->credit_bytes[dir], 0);
+        }
+    }
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -369,6 +494,10 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     assert(bytes >= 0);
     assert(direction < THROTTLE_MAX);
 
+    if (throttle_group_use_credit(tgm, bytes, direction)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
     /* First we check if this I/O has to be throttled. */
@@ -378,6 +507,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[direction]) {
         tgm->pending_reqs[direction]++;
+        tg->pending_reqs[direction]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
         qemu_co_queue_wait(&tgm->throttled_reqs[direction],
@@ -385,10 +515,12 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[direction]--;
+        tg->pending_reqs[direction]--;
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(tgm->throttle_state, direction, bytes);
+    throttle_group_refill_credit(tgm, bytes, direction);
 
     /* Schedule the next request */
     schedule_next_request(tgm, direction);
@@ -478,6 +610,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
     throttle_config(ts, tg->clock_type, cfg);
+    throttle_group_reset_credit(tg);
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -559,6 +692,8 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
             tg->tokens[dir] = tgm;
         }
         qemu_co_queue_init(&tgm->throttled_reqs[dir]);
+        qatomic_set(&tgm->credit_ops[dir], 0);
+        qatomic_set(&tgm->credit_bytes[dir], 0);
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
@@ -903,6 +1038,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
         goto unlock;
     }
     throttle_config(&tg->ts, tg->clock_type, &cfg);
+    throttle_group_reset_credit(tg);
 
 unlock:
     qemu_mutex_unlock(&tg->lock);
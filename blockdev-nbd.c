@@ -27,6 +27,7 @@ typedef struct NBDServerData {
     char *tlsauthz;
     uint32_t max_connections;
     uint32_t connections;
+    bool zero_copy_send;
 } NBDServerData;
 
 static NBDServerData *nbd_server;
@@ -65,7 +66,7 @@ static void nbd_accept(QIONetListener *listener, QIOChannelSocket *cioc,
 
     qio_channel_set_name(QIO_CHANNEL(cioc), "nbd-server");
     nbd_client_new(cioc, nbd_server->tlscreds, nbd_server->tlsauthz,
-                   nbd_blockdev_client_closed);
+                   nbd_server->zero_copy_send, nbd_blockdev_client_closed);
 }
 
 static void nbd_update_server_watch(NBDServerData *s)
@@ -125,7 +126,7 @@ static QCryptoTLSCreds *nbd_get_tls_creds(const char *id, Error **errp)
 
 void nbd_server_start(SocketAddress *addr, const char *tls_creds,
                       const char *tls_authz, uint32_t max_connections,
-                      Error **errp)
+                      bool zero_copy_send, Error **errp)
 {
     if (nbd_server) {
         error_setg(errp, "NBD server already running");
@@ -134,6 +135,7 @@ void nbd_server_start(SocketAddress *addr, const char *tls_creds,
 
     nbd_server = g_new0(NBDServerData, 1);
     nbd_server->max_connections = max_connections;
+    nbd_server->zero_copy_send = zero_copy_send;
     nbd_server->listener = qio_net_listener_new();
 
     qio_net_listener_set_name(nbd_server->listener,
@@ -169,18 +171,20 @@ void nbd_server_start(SocketAddress *addr, const char *tls_creds,
 void nbd_server_start_options(NbdServerOptions *arg, Error **errp)
 {
     nbd_server_start(arg->addr, arg->tls_creds, arg->tls_authz,
-                     arg->max_connections, errp);
+                     arg->max_connections, arg->zero_copy_send, errp);
 }
 
 void qmp_nbd_server_start(SocketAddressLegacy *addr,
                           const char *tls_creds,
                           const char *tls_authz,
                           bool has_max_connections, uint32_t max_connections,
+                          bool has_zero_copy_send, bool zero_copy_send,
                           Error **errp)
 {
     SocketAddress *addr_flat = socket_address_flatten(addr);
 
-    nbd_server_start(addr_flat, tls_creds, tls_authz, max_connections, errp);
+    nbd_server_start(addr_flat, tls_creds, tls_authz, max_connections,
+                     zero_copy_send, errp);
     qapi_free_SocketAddress(addr_flat);
 }
 
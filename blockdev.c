@@ -2274,6 +2274,21 @@ void coroutine_fn qmp_block_resize(const char *device, const char *node_name,
     blk_co_unref(blk);
 }
 
+/* Fill in the defaults for the options that were not given */
+static void backing_chain_perf(BackingChainPerf *x_perf,
+                               BackingChainPerf *perf)
+{
+    *perf = (BackingChainPerf) { .max_workers = 1 };
+    if (x_perf) {
+        if (x_perf->has_max_workers) {
+            perf->max_workers = x_perf->max_workers;
+        }
+        if (x_perf->has_max_chunk) {
+            perf->max_chunk = x_perf->max_chunk;
+        }
+    }
+}
+
 void qmp_block_stream(const char *job_id, const char *device,
                       const char *base,
                       const char *base_node,
@@ -2286,6 +2301,7 @@ void qmp_block_stream(const char *job_id, const char *device,
                       const char *filter_node_name,
                       bool has_auto_finalize, bool auto_finalize,
                       bool has_auto_dismiss, bool auto_dismiss,
+                      BackingChainPerf *x_perf,
                       Error **errp)
 {
     BlockDriverState *bs, *iter, *iter_end;
@@ -2293,6 +2309,7 @@ void qmp_block_stream(const char *job_id, const char *device,
     BlockDriverState *bottom_bs = NULL;
     AioContext *aio_context;
     Error *local_err = NULL;
+    BackingChainPerf perf;
     int job_flags = JOB_DEFAULT;
 
     GLOBAL_STATE_CODE();
@@ -2405,10 +2422,11 @@ void qmp_block_stream(const char *job_id, const char *device,
         job_flags |= JOB_MANUAL_DISMISS;
     }
 
+    backing_chain_perf(x_perf, &perf);
     stream_start(job_id, bs, base_bs, backing_file,
                  backing_mask_protocol,
                  bottom_bs, job_flags, has_speed ? speed : 0, on_error,
-                 filter_node_name, &local_err);
+                 filter_node_name, &perf, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         return;
@@ -2434,6 +2452,7 @@ void qmp_block_commit(const char *job_id, const char *device,
                       const char *filter_node_name,
                       bool has_auto_finalize, bool auto_finalize,
                       bool has_auto_dismiss, bool auto_dismiss,
+                      BackingChainPerf *x_perf,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -2441,6 +2460,7 @@ void qmp_block_commit(const char *job_id, const char *device,
     BlockDriverState *base_bs, *top_bs;
     AioContext *aio_context;
     Error *local_err = NULL;
+    BackingChainPerf perf;
     int job_flags = JOB_DEFAULT;
     uint64_t top_perm, top_shared;
 
@@ -2601,10 +2621,11 @@ void qmp_block_commit(const char *job_id, const char *device,
         if (bdrv_op_is_blocked(overlay_bs, BLOCK_OP_TYPE_COMMIT_TARGET, errp)) {
             return;
         }
+        backing_chain_perf(x_perf, &perf);
         commit_start(job_id, bs, base_bs, top_bs, job_flags,
                      speed, on_error, backing_file,
                      backing_mask_protocol,
-                     filter_node_name, &local_err);
+                     filter_node_name, &perf, &local_err);
     }
     if (local_err != NULL) {
         error_propagate(errp, local_err);
@@ -2653,6 +2674,12 @@ static BlockJob *do_backup_common(BackupCommon *backup,
         if (backup->x_perf->has_max_chunk) {
             perf.max_chunk = backup->x_perf->max_chunk;
         }
+        if (backup->x_perf->has_adaptive) {
+            perf.adaptive = backup->x_perf->adaptive;
+        }
+        if (backup->x_perf->has_dedup) {
+            perf.dedup = backup->x_perf->dedup;
+        }
     }
 
     if ((backup->sync == MIRROR_SYNC_MODE_BITMAP) ||
@@ -138,6 +138,11 @@ bool cpu_exec_realizefn(CPUState *cpu, Error **errp)
         return false;
     }
 
+#ifndef CONFIG_USER_ONLY
+    /* Cached so that the CPU list can be queried without the BQL */
+    cpu->qom_path = object_get_canonical_path(OBJECT(cpu));
+#endif
+
     /* Wait until cpu initialization complete before exposing cpu. */
     cpu_list_add(cpu);
 
@@ -175,6 +180,9 @@ void cpu_exec_unrealizefn(CPUState *cpu)
      * accel_cpu_common_unrealize, which may free fields using call_rcu.
      */
     accel_cpu_common_unrealize(cpu);
+
+    g_free(cpu->qom_path);
+    cpu->qom_path = NULL;
 }
 
 /*
@@ -349,11 +349,16 @@ void qcrypto_block_free(QCryptoBlock *block)
 }
 
 
+/*
+ * Sectors processed per call to the cipher, whose IVs are computed at
+ * once with a single acquisition of the ivgen mutex.
+ */
+#define QCRYPTO_BLOCK_BATCH_SECTORS 64
+
 typedef int (*QCryptoCipherEncDecFunc)(QCryptoCipher *cipher,
-                                        const void *in,
-                                        void *out,
-                                        size_t len,
-                                        Error **errp);
+                                       const uint8_t *ivs, size_t niv,
+                                       uint8_t *buf, size_t sectorsize,
+                                       size_t nsectors, Error **errp);
 
 static int do_qcrypto_block_cipher_encdec(QCryptoCipher *cipher,
                                           size_t niv,
@@ -366,20 +371,28 @@ static int do_qcrypto_block_cipher_encdec(QCryptoCipher *cipher,
                                           QCryptoCipherEncDecFunc func,
                                           Error **errp)
 {
-    g_autofree uint8_t *iv = niv ? g_new0(uint8_t, niv) : NULL;
-    int ret = -1;
+    g_autofree uint8_t *ivs = NULL;
+    int ret = 0;
     uint64_t startsector = offset / sectorsize;
+    size_t i, nsectors;
 
     assert(QEMU_IS_ALIGNED(offset, sectorsize));
     assert(QEMU_IS_ALIGNED(len, sectorsize));
 
+    if (niv) {
+        ivs = g_new0(uint8_t, niv * QCRYPTO_BLOCK_BATCH_SECTORS);
+    }
+
     while (len > 0) {
-        size_t nbytes;
+        nsectors = MIN(len / sectorsize, QCRYPTO_BLOCK_BATCH_SECTORS);
         if (niv) {
             if (ivgen_mutex) {
                 qemu_mutex_lock(ivgen_mutex);
             }
-            ret = qcrypto_ivgen_calculate(ivgen, startsector, iv, niv, errp);
+            for (i = 0; i < nsectors && ret == 0; i++) {
+                ret = qcrypto_ivgen_calculate(ivgen, startsector + i,
+                                              ivs + i * niv, niv, errp);
+            }
             if (ivgen_mutex) {
                 qemu_mutex_unlock(ivgen_mutex);
             }
@@ -387,22 +400,15 @@ static int do_qcrypto_block_cipher_encdec(QCryptoCipher *cipher,
             if (ret < 0) {
                 return -1;
             }
-
-            if (qcrypto_cipher_setiv(cipher,
-                                     iv, niv,
-                                     errp) < 0) {
-                return -1;
-            }
         }
 
-        nbytes = len > sectorsize ? sectorsize : len;
-        if (func(cipher, buf, buf, nbytes, errp) < 0) {
+        if (func(cipher, ivs, niv, buf, sectorsize, nsectors, errp) < 0) {
             return -1;
         }
 
-        startsector++;
-        buf += nbytes;
-        len -= nbytes;
+        startsector += nsectors;
+        buf += nsectors * sectorsize;
+        len -= nsectors * sectorsize;
     }
 
     return 0;
@@ -420,7 +426,7 @@ int qcrypto_block_cipher_decrypt_helper(QCryptoCipher *cipher,
 {
     return do_qcrypto_block_cipher_encdec(cipher, niv, ivgen, NULL, sectorsize,
                                           offset, buf, len,
-                                          qcrypto_cipher_decrypt, errp);
+                                          qcrypto_cipher_decrypt_sectors, errp);
 }
 
 
@@ -435,7 +441,7 @@ int qcrypto_block_cipher_encrypt_helper(QCryptoCipher *cipher,
 {
     return do_qcrypto_block_cipher_encdec(cipher, niv, ivgen, NULL, sectorsize,
                                           offset, buf, len,
-                                          qcrypto_cipher_encrypt, errp);
+                                          qcrypto_cipher_encrypt_sectors, errp);
 }
 
 int qcrypto_block_decrypt_helper(QCryptoBlock *block,
@@ -450,7 +456,8 @@ int qcrypto_block_decrypt_helper(QCryptoBlock *block,
 
     ret = do_qcrypto_block_cipher_encdec(cipher, block->niv, block->ivgen,
                                          &block->mutex, sectorsize, offset, buf,
-                                         len, qcrypto_cipher_decrypt, errp);
+                                         len, qcrypto_cipher_decrypt_sectors,
+                                         errp);
 
     qcrypto_block_push_cipher(block, cipher);
 
@@ -469,7 +476,8 @@ int qcrypto_block_encrypt_helper(QCryptoBlock *block,
 
     ret = do_qcrypto_block_cipher_encdec(cipher, block->niv, block->ivgen,
                                          &block->mutex, sectorsize, offset, buf,
-                                         len, qcrypto_cipher_encrypt, errp);
+                                         len, qcrypto_cipher_encrypt_sectors,
+                                         errp);
 
     qcrypto_block_push_cipher(block, cipher);
 
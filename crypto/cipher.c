@@ -204,6 +204,54 @@ int qcrypto_cipher_setiv(QCryptoCipher *cipher,
 }
 
 
+static int qcrypto_cipher_encdec_sectors(QCryptoCipher *cipher,
+                                         const uint8_t *ivs, size_t niv,
+                                         uint8_t *buf, size_t sectorsize,
+                                         size_t nsectors, bool encrypt,
+                                         Error **errp)
+{
+    const QCryptoCipherDriver *drv = cipher->driver;
+    size_t i;
+    int ret;
+
+    for (i = 0; i < nsectors; i++) {
+        if (ivs && drv->cipher_setiv(cipher, ivs + i * niv, niv, errp) < 0) {
+            return -1;
+        }
+        if (encrypt) {
+            ret = drv->cipher_encrypt(cipher, buf, buf, sectorsize, errp);
+        } else {
+            ret = drv->cipher_decrypt(cipher, buf, buf, sectorsize, errp);
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        buf += sectorsize;
+    }
+    return 0;
+}
+
+
+int qcrypto_cipher_encrypt_sectors(QCryptoCipher *cipher,
+                                   const uint8_t *ivs, size_t niv,
+                                   uint8_t *buf, size_t sectorsize,
+                                   size_t nsectors, Error **errp)
+{
+    return qcrypto_cipher_encdec_sectors(cipher, ivs, niv, buf, sectorsize,
+                                         nsectors, true, errp);
+}
+
+
+int qcrypto_cipher_decrypt_sectors(QCryptoCipher *cipher,
+                                   const uint8_t *ivs, size_t niv,
+                                   uint8_t *buf, size_t sectorsize,
+                                   size_t nsectors, Error **errp)
+{
+    return qcrypto_cipher_encdec_sectors(cipher, ivs, niv, buf, sectorsize,
+                                         nsectors, false, errp);
+}
+
+
 void qcrypto_cipher_free(QCryptoCipher *cipher)
 {
     if (cipher) {
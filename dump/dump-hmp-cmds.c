@@ -78,7 +78,8 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     prot = g_strconcat("file:", file, NULL);
 
     qmp_dump_guest_memory(paging, prot, true, detach, has_begin, begin,
-                          has_length, length, true, dump_format, &err);
+                          has_length, length, true, dump_format, false, 0,
+                          &err);
     hmp_handle_error(mon, err);
     g_free(prot);
 }
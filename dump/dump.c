@@ -43,6 +43,7 @@
 #endif
 
 #define MAX_GUEST_NOTE_SIZE (1 << 20) /* 1MB should be enough */
+#define DUMP_MAX_COMPRESS_THREADS 256
 
 static Error *dump_migration_blocker;
 
@@ -526,16 +527,40 @@ static void write_data(DumpState *s, void *buf, int length, Error **errp)
     }
 }
 
+/*
+ * Skip a zero page of a sparse ELF dump, instead of writing it.  The last
+ * page of each chunk is always written, so that the file ends up with the
+ * right size.
+ */
+static bool skip_zero_page(DumpState *s, uint8_t *buf, bool last)
+{
+    if (!s->elf_sparse || last ||
+        !buffer_is_zero(buf, s->dump_info.page_size)) {
+        return false;
+    }
+    if (lseek(s->fd, s->dump_info.page_size, SEEK_CUR) == (off_t) -1) {
+        s->elf_sparse = false;
+        return false;
+    }
+    s->written_size += s->dump_info.page_size;
+    return true;
+}
+
 /* write the memory to vmcore. 1 page per I/O. */
 static void write_memory(DumpState *s, GuestPhysBlock *block, ram_addr_t start,
                          int64_t size, Error **errp)
 {
     ERRP_GUARD();
-    int64_t i;
+    int64_t i, n = size / s->dump_info.page_size;
+    uint8_t *buf;
 
-    for (i = 0; i < size / s->dump_info.page_size; i++) {
-        write_data(s, block->host_addr + start + i * s->dump_info.page_size,
-                   s->dump_info.page_size, errp);
+    for (i = 0; i < n; i++) {
+        buf = block->host_addr + start + i * s->dump_info.page_size;
+        if (skip_zero_page(s, buf,
+                           i == n - 1 && !(size % s->dump_info.page_size))) {
+            continue;
+        }
+        write_data(s, buf, s->dump_info.page_size, errp);
         if (*errp) {
             return;
         }
@@ -1466,21 +1491,301 @@ static size_t get_len_buf_out(size_t page_size, uint32_t flag_compress)
     return 0;
 }
 
+/* Pages that are compressed together, while the previous batch is written */
+#define DUMP_BATCH_PAGES 256
+
+typedef struct DumpPage {
+    uint8_t *data;              /* page contents */
+    uint8_t *out;               /* compressed page contents */
+    size_t size_out;            /* size of the page in the vmcore */
+    uint32_t flags;             /* DUMP_DH_COMPRESSED_*, or 0 for plain */
+    bool zero;
+} DumpPage;
+
+typedef struct DumpBatch {
+    DumpPage pages[DUMP_BATCH_PAGES];
+    uint8_t *copies;            /* pages that are not contiguous in RAM */
+    uint8_t *out;
+    int npages;
+    int next;                   /* next page to compress */
+} DumpBatch;
+
+/*
+ * With more than one compression thread, the dump thread only collects
+ * and writes pages, and the compression threads work on the batch that
+ * follows the one being written.  The output does not depend on the
+ * number of threads.
+ */
+typedef struct DumpCompress {
+    DumpState *s;
+    size_t len_buf_out;
+    void *wrkmem;               /* for compressing in the dump thread */
+    QemuThread *threads;
+    int nthreads;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    DumpBatch *batch;
+    unsigned generation;
+    int active;
+    bool quit;
+} DumpCompress;
+
+static void dump_compress_page(DumpCompress *dc, DumpPage *page, void *wrkmem)
+{
+    DumpState *s = dc->s;
+    size_t page_size = s->dump_info.page_size;
+    size_t size_out = dc->len_buf_out;
+
+    page->flags = 0;
+    page->size_out = page_size;
+    page->zero = buffer_is_zero(page->data, page_size);
+    if (page->zero) {
+        return;
+    }
+
+    /*
+     * only one compression format will be used here, for s->flag_compress
+     * is set.  But when compression fails to work, we fall back to save in
+     * plaintext.
+     */
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+        (compress2(page->out, (uLongf *)&size_out, page->data,
+                   page_size, Z_BEST_SPEED) == Z_OK) &&
+        (size_out < page_size)) {
+        page->flags = DUMP_DH_COMPRESSED_ZLIB;
+#ifdef CONFIG_LZO
+    } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+               (lzo1x_1_compress(page->data, page_size, page->out,
+                                 (lzo_uint *)&size_out,
+                                 wrkmem) == LZO_E_OK) &&
+               (size_out < page_size)) {
+        page->flags = DUMP_DH_COMPRESSED_LZO;
+#endif
+#ifdef CONFIG_SNAPPY
+    } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+               (snappy_compress((char *)page->data, page_size,
+                                (char *)page->out, &size_out) == SNAPPY_OK) &&
+               (size_out < page_size)) {
+        page->flags = DUMP_DH_COMPRESSED_SNAPPY;
+#endif
+    } else {
+        return;
+    }
+    page->size_out = size_out;
+}
+
+static void dump_compress_batch(DumpCompress *dc, DumpBatch *b, void *wrkmem)
+{
+    int i;
+
+    while ((i = qatomic_fetch_inc(&b->next)) < b->npages) {
+        dump_compress_page(dc, &b->pages[i], wrkmem);
+    }
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompress *dc = opaque;
+    unsigned generation = 0;
+    void *wrkmem = NULL;
+    DumpBatch *b;
+
+#ifdef CONFIG_LZO
+    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+
+    qemu_mutex_lock(&dc->lock);
+    for (;;) {
+        while (dc->generation == generation && !dc->quit) {
+            qemu_cond_wait(&dc->work_cond, &dc->lock);
+        }
+        if (dc->quit) {
+            break;
+        }
+        generation = dc->generation;
+        b = dc->batch;
+        qemu_mutex_unlock(&dc->lock);
+
+        dump_compress_batch(dc, b, wrkmem);
+
+        qemu_mutex_lock(&dc->lock);
+        if (--dc->active == 0) {
+            qemu_cond_signal(&dc->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&dc->lock);
+
+    g_free(wrkmem);
+    return NULL;
+}
+
+static void dump_compress_init(DumpCompress *dc, DumpState *s)
+{
+    int i;
+
+    dc->s = s;
+    dc->len_buf_out = get_len_buf_out(s->dump_info.page_size,
+                                      s->flag_compress);
+    assert(dc->len_buf_out != 0);
+#ifdef CONFIG_LZO
+    dc->wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+
+    dc->nthreads = s->compress_threads > 1 ? s->compress_threads : 0;
+    if (!dc->nthreads) {
+        return;
+    }
+    qemu_mutex_init(&dc->lock);
+    qemu_cond_init(&dc->work_cond);
+    qemu_cond_init(&dc->done_cond);
+    dc->threads = g_new0(QemuThread, dc->nthreads);
+    for (i = 0; i < dc->nthreads; i++) {
+        qemu_thread_create(&dc->threads[i], "dump_compress",
+                           dump_compress_thread, dc, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void dump_compress_cleanup(DumpCompress *dc)
+{
+    int i;
+
+    if (dc->nthreads) {
+        qemu_mutex_lock(&dc->lock);
+        dc->quit = true;
+        qemu_cond_broadcast(&dc->work_cond);
+        qemu_mutex_unlock(&dc->lock);
+        for (i = 0; i < dc->nthreads; i++) {
+            qemu_thread_join(&dc->threads[i]);
+        }
+        g_free(dc->threads);
+        qemu_cond_destroy(&dc->done_cond);
+        qemu_cond_destroy(&dc->work_cond);
+        qemu_mutex_destroy(&dc->lock);
+    }
+    g_free(dc->wrkmem);
+}
+
+/* Start compressing @b; without compression threads, compress it now */
+static void dump_compress_start(DumpCompress *dc, DumpBatch *b)
+{
+    b->next = 0;
+    if (!dc->nthreads) {
+        dump_compress_batch(dc, b, dc->wrkmem);
+        return;
+    }
+
+    qemu_mutex_lock(&dc->lock);
+    dc->batch = b;
+    dc->active = dc->nthreads;
+    dc->generation++;
+    qemu_cond_broadcast(&dc->work_cond);
+    qemu_mutex_unlock(&dc->lock);
+}
+
+static void dump_compress_wait(DumpCompress *dc)
+{
+    if (!dc->nthreads) {
+        return;
+    }
+
+    qemu_mutex_lock(&dc->lock);
+    while (dc->active) {
+        qemu_cond_wait(&dc->done_cond, &dc->lock);
+    }
+    dc->batch = NULL;
+    qemu_mutex_unlock(&dc->lock);
+}
+
+static void dump_batch_init(DumpCompress *dc, DumpBatch *b)
+{
+    size_t page_size = dc->s->dump_info.page_size;
+    int i;
+
+    b->copies = g_malloc(DUMP_BATCH_PAGES * page_size);
+    b->out = g_malloc(DUMP_BATCH_PAGES * dc->len_buf_out);
+    for (i = 0; i < DUMP_BATCH_PAGES; i++) {
+        b->pages[i].out = b->out + i * dc->len_buf_out;
+    }
+    b->npages = 0;
+}
+
+static void dump_batch_free(DumpBatch *b)
+{
+    g_free(b->copies);
+    g_free(b->out);
+}
+
+/* Collect the next pages into @b; return false after the last page */
+static bool dump_batch_fill(DumpState *s, DumpBatch *b,
+                            GuestPhysBlock **block_iter, uint64_t *pfn_iter)
+{
+    uint8_t *buf;
+
+    for (b->npages = 0; b->npages < DUMP_BATCH_PAGES; b->npages++) {
+        buf = b->copies + b->npages * s->dump_info.page_size;
+        if (!get_next_page(block_iter, pfn_iter, &buf, s)) {
+            return false;
+        }
+        b->pages[b->npages].data = buf;
+    }
+    return true;
+}
+
+static bool dump_batch_write(DumpState *s, DumpBatch *b,
+                             DataCache *page_desc, DataCache *page_data,
+                             PageDescriptor *pd_zero, off_t *offset_data,
+                             Error **errp)
+{
+    PageDescriptor pd;
+    DumpPage *page;
+    int i;
+
+    for (i = 0; i < b->npages; i++) {
+        page = &b->pages[i];
+
+        if (page->zero) {
+            if (write_cache(page_desc, pd_zero, sizeof(PageDescriptor),
+                            false) < 0) {
+                error_setg(errp, "dump: failed to write page desc");
+                return false;
+            }
+        } else {
+            if (write_cache(page_data, page->flags ? page->out : page->data,
+                            page->size_out, false) < 0) {
+                error_setg(errp, "dump: failed to write page data");
+                return false;
+            }
+
+            pd.flags = cpu_to_dump32(s, page->flags);
+            pd.size = cpu_to_dump32(s, page->size_out);
+            pd.page_flags = cpu_to_dump64(s, 0);
+            pd.offset = cpu_to_dump64(s, *offset_data);
+            *offset_data += page->size_out;
+
+            if (write_cache(page_desc, &pd, sizeof(PageDescriptor),
+                            false) < 0) {
+                error_setg(errp, "dump: failed to write page desc");
+                return false;
+            }
+        }
+        s->written_size += s->dump_info.page_size;
+    }
+    return true;
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    DumpCompress dc = {};
+    DumpBatch *batches, *cur, *prev = NULL;
     off_t offset_desc, offset_data;
-    PageDescriptor pd, pd_zero;
+    PageDescriptor pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
-    g_autofree uint8_t *page = NULL;
+    bool more, ok = true;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1489,15 +1794,11 @@ static void write_dump_pages(DumpState *s, Error **errp)
     prepare_data_cache(&page_desc, s, offset_desc);
     prepare_data_cache(&page_data, s, offset_data);
 
-    /* prepare buffer to store compressed data */
-    len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
-    assert(len_buf_out != 0);
-
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
-
-    buf_out = g_malloc(len_buf_out);
+    dump_compress_init(&dc, s);
+    batches = g_new0(DumpBatch, 2);
+    dump_batch_init(&dc, &batches[0]);
+    dump_batch_init(&dc, &batches[1]);
+    cur = &batches[0];
 
     /*
      * init zero page's page_desc and page_data, because every zero page
@@ -1516,103 +1817,30 @@ static void write_dump_pages(DumpState *s, Error **errp)
     }
 
     offset_data += s->dump_info.page_size;
-    page = g_malloc(s->dump_info.page_size);
 
     /*
      * dump memory to vmcore page by page. zero page will all be resided in the
-     * first page of page section
+     * first page of page section.  Each batch is compressed while the
+     * previous one is written.
      */
-    for (buf = page; get_next_page(&block_iter, &pfn_iter, &buf, s); buf = page) {
-        /* check zero page */
-        if (buffer_is_zero(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
-            }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-            }
-
-            /* get and write page desc here */
-            pd.page_flags = cpu_to_dump64(s, 0);
-            pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
-
-            ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
-            }
+    do {
+        more = dump_batch_fill(s, cur, &block_iter, &pfn_iter);
+        dump_compress_start(&dc, cur);
+        if (prev) {
+            ok = dump_batch_write(s, prev, &page_desc, &page_data, &pd_zero,
+                                  &offset_data, errp);
         }
-        s->written_size += s->dump_info.page_size;
+        dump_compress_wait(&dc);
+        if (!ok) {
+            goto out;
+        }
+        prev = cur;
+        cur = prev == &batches[0] ? &batches[1] : &batches[0];
+    } while (more);
+
+    if (!dump_batch_write(s, prev, &page_desc, &page_data, &pd_zero,
+                          &offset_data, errp)) {
+        goto out;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
@@ -1630,11 +1858,10 @@ out:
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
 
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
+    dump_compress_cleanup(&dc);
+    dump_batch_free(&batches[0]);
+    dump_batch_free(&batches[1]);
+    g_free(batches);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
@@ -1811,6 +2038,13 @@ static void dump_init(DumpState *s, int fd, bool has_format,
     }
 
     s->fd = fd;
+    if (!has_format || format == DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        struct stat st;
+
+        /* Holes read as zeroes only if the file had no data */
+        s->elf_sparse = !fstat(fd, &st) && S_ISREG(st.st_mode) &&
+                        st.st_size == 0 && lseek(fd, 0, SEEK_CUR) == 0;
+    }
     if (has_filter && !length) {
         error_setg(errp, "parameter 'length' expects a non-zero size");
         goto cleanup;
@@ -2062,6 +2296,7 @@ void qmp_dump_guest_memory(bool paging, const char *protocol,
                            bool has_begin, int64_t begin,
                            bool has_length, int64_t length,
                            bool has_format, DumpGuestMemoryFormat format,
+                           bool has_threads, int64_t threads,
                            Error **errp)
 {
     ERRP_GUARD();
@@ -2127,6 +2362,11 @@ void qmp_dump_guest_memory(bool paging, const char *protocol,
     if (has_detach) {
         detach_p = detach;
     }
+    if (has_threads && (threads < 1 || threads > DUMP_MAX_COMPRESS_THREADS)) {
+        error_setg(errp, "parameter 'threads' must be between 1 and %d",
+                   DUMP_MAX_COMPRESS_THREADS);
+        return;
+    }
 
     /* check whether lzo/snappy is supported */
 #ifndef CONFIG_LZO
@@ -2186,6 +2426,7 @@ void qmp_dump_guest_memory(bool paging, const char *protocol,
 
     s = &dump_state_global;
     dump_state_prepare(s);
+    s->compress_threads = has_threads ? threads : 1;
 
     dump_init(s, fd, has_format, format, paging, has_begin,
               begin, length, kdump_raw, errp);
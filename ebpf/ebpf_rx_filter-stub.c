@@ -0,0 +1,35 @@
+/*
+ * eBPF receive filter stub file
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "ebpf/ebpf_rx_filter.h"
+
+void ebpf_rx_filter_init(struct EBPFRxFilterContext *ctx)
+{
+
+}
+
+bool ebpf_rx_filter_is_loaded(struct EBPFRxFilterContext *ctx)
+{
+    return false;
+}
+
+bool ebpf_rx_filter_load(struct EBPFRxFilterContext *ctx)
+{
+    return false;
+}
+
+bool ebpf_rx_filter_set(struct EBPFRxFilterContext *ctx, uint32_t flags,
+                        const uint8_t *macs, unsigned int n_macs,
+                        const uint32_t *vlans)
+{
+    return false;
+}
+
+void ebpf_rx_filter_unload(struct EBPFRxFilterContext *ctx)
+{
+
+}
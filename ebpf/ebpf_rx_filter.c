@@ -0,0 +1,338 @@
+/*
+ * eBPF receive filter
+ *
+ * The program is assembled at load time rather than shipped as a compiled
+ * skeleton: it is small, and all of its policy lives in maps.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include <linux/bpf.h>
+
+#include "net/eth.h"
+#include "ebpf/ebpf_rx_filter.h"
+#include "trace.h"
+
+#define RXF_MAX_INSNS 80
+#define RXF_MAX_FIXUPS 24
+
+enum {
+    RXF_L_VLAN_IN_DATA,
+    RXF_L_VLAN_LOOKUP,
+    RXF_L_MAC,
+    RXF_L_MULTICAST,
+    RXF_L_UNICAST,
+    RXF_L_LOOKUP,
+    RXF_L_ACCEPT,
+    RXF_L_DROP,
+    RXF_L__MAX,
+};
+
+typedef struct RxFilterAsm {
+    struct bpf_insn insns[RXF_MAX_INSNS];
+    unsigned int len;
+    int labels[RXF_L__MAX];
+    struct {
+        unsigned int insn;
+        int label;
+    } fixups[RXF_MAX_FIXUPS];
+    unsigned int n_fixups;
+} RxFilterAsm;
+
+#define INSN(c, d, s, o, i) \
+    ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), \
+                         .off = (o), .imm = (i) })
+
+static void emit(RxFilterAsm *a, struct bpf_insn insn)
+{
+    assert(a->len < RXF_MAX_INSNS);
+    a->insns[a->len++] = insn;
+}
+
+/* Conditional jump to @label, or unconditional with op == BPF_JA */
+static void emit_jmp(RxFilterAsm *a, uint8_t op, uint8_t dst, uint8_t src,
+                     int32_t imm, int label)
+{
+    assert(a->n_fixups < RXF_MAX_FIXUPS);
+    a->fixups[a->n_fixups].insn = a->len;
+    a->fixups[a->n_fixups].label = label;
+    a->n_fixups++;
+    emit(a, INSN(BPF_JMP | op, dst, src, 0, imm));
+}
+
+static void emit_label(RxFilterAsm *a, int label)
+{
+    a->labels[label] = a->len;
+}
+
+static void emit_ld_map_fd(RxFilterAsm *a, uint8_t dst, int map_fd)
+{
+    emit(a, INSN(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0,
+                 map_fd));
+    emit(a, INSN(0, 0, 0, 0, 0));
+}
+
+/* r0 = bpf_map_lookup_elem(map_fd, r10 + off) */
+static void emit_lookup(RxFilterAsm *a, int map_fd, int16_t off)
+{
+    emit_ld_map_fd(a, BPF_REG_1, map_fd);
+    emit(a, INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0));
+    emit(a, INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, off));
+    emit(a, INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+}
+
+static void ebpf_rx_filter_assemble(RxFilterAsm *a,
+                                    struct EBPFRxFilterContext *ctx)
+{
+    unsigned int i;
+
+    /* r6 = skb, as required by BPF_LD_ABS */
+    emit(a, INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0));
+
+    /*
+     * r7 = VLAN id, from the skb metadata if the tag was stripped or else
+     * from an 802.1Q header in the frame
+     */
+    emit(a, INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_6,
+                 offsetof(struct __sk_buff, vlan_present), 0));
+    emit_jmp(a, BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, RXF_L_VLAN_IN_DATA);
+    emit(a, INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_6,
+                 offsetof(struct __sk_buff, vlan_tci), 0));
+    emit_jmp(a, BPF_JA, 0, 0, 0, RXF_L_VLAN_LOOKUP);
+
+    emit_label(a, RXF_L_VLAN_IN_DATA);
+    emit(a, INSN(BPF_LD | BPF_ABS | BPF_H, 0, 0, 0, 12));
+    emit_jmp(a, BPF_JNE | BPF_K, BPF_REG_0, 0, ETH_P_VLAN, RXF_L_MAC);
+    emit(a, INSN(BPF_LD | BPF_ABS | BPF_H, 0, 0, 0, 14));
+    emit(a, INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0));
+
+    /* Drop unless bit (vid & 31) of vlans[vid >> 5] is set */
+    emit_label(a, RXF_L_VLAN_LOOKUP);
+    emit(a, INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_7, 0, 0, 0xfff));
+    emit(a, INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_0, BPF_REG_7, 0, 0));
+    emit(a, INSN(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_0, 0, 0, 5));
+    emit(a, INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_0, -4, 0));
+    emit_lookup(a, ctx->map_vlans, -4);
+    emit_jmp(a, BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, RXF_L_DROP);
+    emit(a, INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_0, 0, 0));
+    emit(a, INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_7, 0, 0, 31));
+    emit(a, INSN(BPF_ALU64 | BPF_RSH | BPF_X, BPF_REG_0, BPF_REG_7, 0, 0));
+    emit(a, INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_0, 0, 0, 1));
+    emit_jmp(a, BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, RXF_L_DROP);
+
+    /* r7 = destination MAC as a 48-bit big endian number */
+    emit_label(a, RXF_L_MAC);
+    emit(a, INSN(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, 0));
+    emit(a, INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0));
+    emit(a, INSN(BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_7, 0, 0, 16));
+    emit(a, INSN(BPF_LD | BPF_ABS | BPF_H, 0, 0, 0, 4));
+    emit(a, INSN(BPF_ALU64 | BPF_OR | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0));
+
+    /* r8 = flags */
+    emit(a, INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, 0));
+    emit_lookup(a, ctx->map_config, -4);
+    emit_jmp(a, BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, RXF_L_ACCEPT);
+    emit(a, INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_8, BPF_REG_0, 0, 0));
+
+    /* The group bit is the lowest bit of the first octet */
+    emit(a, INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_0, BPF_REG_7, 0, 0));
+    emit(a, INSN(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_0, 0, 0, 40));
+    emit(a, INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_0, 0, 0, 1));
+    emit_jmp(a, BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, RXF_L_UNICAST);
+
+    emit(a, INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_0, 0, 0, 0xffffffff));
+    emit(a, INSN(0, 0, 0, 0, 0xffff));
+    emit_jmp(a, BPF_JNE | BPF_X, BPF_REG_7, BPF_REG_0, 0, RXF_L_MULTICAST);
+    emit_jmp(a, BPF_JSET | BPF_K, BPF_REG_8, 0, EBPF_RX_FILTER_F_NOBCAST,
+             RXF_L_DROP);
+    emit_jmp(a, BPF_JA, 0, 0, 0, RXF_L_ACCEPT);
+
+    emit_label(a, RXF_L_MULTICAST);
+    emit_jmp(a, BPF_JSET | BPF_K, BPF_REG_8, 0, EBPF_RX_FILTER_F_NOMULTI,
+             RXF_L_DROP);
+    emit_jmp(a, BPF_JSET | BPF_K, BPF_REG_8, 0, EBPF_RX_FILTER_F_ALLMULTI,
+             RXF_L_ACCEPT);
+    emit_jmp(a, BPF_JA, 0, 0, 0, RXF_L_LOOKUP);
+
+    emit_label(a, RXF_L_UNICAST);
+    emit_jmp(a, BPF_JSET | BPF_K, BPF_REG_8, 0, EBPF_RX_FILTER_F_NOUNI,
+             RXF_L_DROP);
+    emit_jmp(a, BPF_JSET | BPF_K, BPF_REG_8, 0, EBPF_RX_FILTER_F_ALLUNI,
+             RXF_L_ACCEPT);
+
+    emit_label(a, RXF_L_LOOKUP);
+    emit(a, INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_7, -16, 0));
+    emit_lookup(a, ctx->map_macs, -16);
+    emit_jmp(a, BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, RXF_L_DROP);
+
+    /* Keep the whole frame */
+    emit_label(a, RXF_L_ACCEPT);
+    emit(a, INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_6,
+                 offsetof(struct __sk_buff, len), 0));
+    emit(a, INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    emit_label(a, RXF_L_DROP);
+    emit(a, INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0));
+    emit(a, INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    for (i = 0; i < a->n_fixups; i++) {
+        unsigned int insn = a->fixups[i].insn;
+
+        a->insns[insn].off = a->labels[a->fixups[i].label] - insn - 1;
+    }
+}
+
+void ebpf_rx_filter_init(struct EBPFRxFilterContext *ctx)
+{
+    if (ctx != NULL) {
+        memset(ctx, 0, sizeof(*ctx));
+        ctx->program_fd = -1;
+        ctx->map_config = -1;
+        ctx->map_macs = -1;
+        ctx->map_vlans = -1;
+    }
+}
+
+bool ebpf_rx_filter_is_loaded(struct EBPFRxFilterContext *ctx)
+{
+    return ctx != NULL && ctx->program_fd != -1;
+}
+
+bool ebpf_rx_filter_load(struct EBPFRxFilterContext *ctx)
+{
+    g_autofree RxFilterAsm *a = g_new0(RxFilterAsm, 1);
+
+    if (ctx == NULL || ebpf_rx_filter_is_loaded(ctx)) {
+        return false;
+    }
+
+    ctx->map_config = bpf_map_create(BPF_MAP_TYPE_ARRAY, "qemu_rxf_config",
+                                     sizeof(uint32_t), sizeof(uint32_t),
+                                     1, NULL);
+    /* Old and new addresses coexist while ebpf_rx_filter_set() runs */
+    ctx->map_macs = bpf_map_create(BPF_MAP_TYPE_HASH, "qemu_rxf_macs",
+                                   sizeof(uint64_t), sizeof(uint8_t),
+                                   EBPF_RX_FILTER_MAX_MACS * 2, NULL);
+    ctx->map_vlans = bpf_map_create(BPF_MAP_TYPE_ARRAY, "qemu_rxf_vlans",
+                                    sizeof(uint32_t), sizeof(uint32_t),
+                                    ARRAY_SIZE(ctx->vlans), NULL);
+    if (ctx->map_config < 0 || ctx->map_macs < 0 || ctx->map_vlans < 0) {
+        trace_ebpf_rx_filter_error("bpf_map_create", errno);
+        goto error;
+    }
+
+    ebpf_rx_filter_assemble(a, ctx);
+    ctx->program_fd = bpf_prog_load(BPF_PROG_TYPE_SOCKET_FILTER,
+                                    "qemu_rx_filter", "GPL",
+                                    a->insns, a->len, NULL);
+    if (ctx->program_fd < 0) {
+        trace_ebpf_rx_filter_error("bpf_prog_load", errno);
+        ctx->program_fd = -1;
+        goto error;
+    }
+
+    /* Maps start zeroed: no flags, no addresses, no VLANs */
+    return true;
+
+error:
+    ebpf_rx_filter_unload(ctx);
+    return false;
+}
+
+static uint64_t ebpf_rx_filter_mac_key(const uint8_t *mac)
+{
+    return ldl_be_p(mac) * 0x10000ULL + lduw_be_p(mac + 4);
+}
+
+static bool ebpf_rx_filter_has_mac(const uint64_t *macs, unsigned int n,
+                                   uint64_t key)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        if (macs[i] == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Entries are added before stale ones are removed so that a frame that
+ * is accepted by both the old and the new state is never dropped.
+ */
+bool ebpf_rx_filter_set(struct EBPFRxFilterContext *ctx, uint32_t flags,
+                        const uint8_t *macs, unsigned int n_macs,
+                        const uint32_t *vlans)
+{
+    uint64_t keys[EBPF_RX_FILTER_MAX_MACS];
+    uint32_t zero = 0, i;
+    uint8_t one = 1;
+
+    if (!ebpf_rx_filter_is_loaded(ctx) || n_macs > ARRAY_SIZE(keys)) {
+        return false;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(ctx->vlans); i++) {
+        if (ctx->vlans[i] != vlans[i]) {
+            if (bpf_map_update_elem(ctx->map_vlans, &i, &vlans[i], 0) < 0) {
+                goto error;
+            }
+            ctx->vlans[i] = vlans[i];
+        }
+    }
+
+    for (i = 0; i < n_macs; i++) {
+        keys[i] = ebpf_rx_filter_mac_key(macs + i * ETH_ALEN);
+        if (!ebpf_rx_filter_has_mac(ctx->macs, ctx->n_macs, keys[i]) &&
+            bpf_map_update_elem(ctx->map_macs, &keys[i], &one, 0) < 0) {
+            goto error;
+        }
+    }
+
+    if (flags != ctx->flags) {
+        if (bpf_map_update_elem(ctx->map_config, &zero, &flags, 0) < 0) {
+            goto error;
+        }
+        ctx->flags = flags;
+    }
+
+    for (i = 0; i < ctx->n_macs; i++) {
+        if (!ebpf_rx_filter_has_mac(keys, n_macs, ctx->macs[i])) {
+            bpf_map_delete_elem(ctx->map_macs, &ctx->macs[i]);
+        }
+    }
+    memcpy(ctx->macs, keys, n_macs * sizeof(keys[0]));
+    ctx->n_macs = n_macs;
+
+    return true;
+
+error:
+    trace_ebpf_rx_filter_error("bpf_map_update_elem", errno);
+    return false;
+}
+
+void ebpf_rx_filter_unload(struct EBPFRxFilterContext *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+
+    if (ctx->program_fd != -1) {
+        close(ctx->program_fd);
+    }
+    if (ctx->map_config >= 0) {
+        close(ctx->map_config);
+    }
+    if (ctx->map_macs >= 0) {
+        close(ctx->map_macs);
+    }
+    if (ctx->map_vlans >= 0) {
+        close(ctx->map_vlans);
+    }
+    ebpf_rx_filter_init(ctx);
+}
@@ -0,0 +1,53 @@
+/*
+ * eBPF receive filter
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef QEMU_EBPF_RX_FILTER_H
+#define QEMU_EBPF_RX_FILTER_H
+
+/* Unicast and multicast addresses plus the device's own MAC address */
+#define EBPF_RX_FILTER_MAX_MACS 65
+
+#define EBPF_RX_FILTER_F_NOBCAST    (1u << 0)
+#define EBPF_RX_FILTER_F_NOMULTI    (1u << 1)
+#define EBPF_RX_FILTER_F_ALLMULTI   (1u << 2)
+#define EBPF_RX_FILTER_F_NOUNI      (1u << 3)
+#define EBPF_RX_FILTER_F_ALLUNI     (1u << 4)
+
+/*
+ * A socket filter program that drops frames the guest would discard
+ * anyway, so that they never leave the kernel.  Its policy lives in maps
+ * and is updated in place with ebpf_rx_filter_set().
+ */
+struct EBPFRxFilterContext {
+    int program_fd;
+    int map_config;
+    int map_macs;
+    int map_vlans;
+
+    /* Last state written to the maps */
+    uint32_t flags;
+    uint32_t vlans[4096 / 32];
+    uint64_t macs[EBPF_RX_FILTER_MAX_MACS];
+    unsigned int n_macs;
+};
+
+void ebpf_rx_filter_init(struct EBPFRxFilterContext *ctx);
+
+bool ebpf_rx_filter_is_loaded(struct EBPFRxFilterContext *ctx);
+
+bool ebpf_rx_filter_load(struct EBPFRxFilterContext *ctx);
+
+/*
+ * @macs holds @n_macs addresses of ETH_ALEN bytes each, @vlans is a
+ * 4096-bit bitmap of accepted VLAN ids.
+ */
+bool ebpf_rx_filter_set(struct EBPFRxFilterContext *ctx, uint32_t flags,
+                        const uint8_t *macs, unsigned int n_macs,
+                        const uint32_t *vlans);
+
+void ebpf_rx_filter_unload(struct EBPFRxFilterContext *ctx);
+
+#endif /* QEMU_EBPF_RX_FILTER_H */
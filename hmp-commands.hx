@@ -626,17 +626,21 @@ SRST
 ERST
     {
         .name       = "sync-profile",
-        .args_type  = "op:s?",
-        .params     = "[on|off|reset]",
+        .args_type  = "op:s?,period:i?",
+        .params     = "[on|off|reset] [period]",
         .help       = "enable, disable or reset synchronization profiling. "
-                      "With no arguments, prints whether profiling is on or off.",
+                      "With no arguments, prints whether profiling is on or off."
+                      " With 'on', profile one in 'period' events.",
         .cmd        = hmp_sync_profile,
     },
 
 SRST
-``sync-profile [on|off|reset]``
+``sync-profile [on|off|reset] [period]``
   Enable, disable or reset synchronization profiling. With no arguments, prints
-  whether profiling is on or off.
+  whether profiling is on or off. With ``on``, the optional *period* makes each
+  thread profile only one in *period* lock operations, which are then weighted
+  by *period*; the default is to profile all of them. The results are shown by
+  ``info sync-profile`` and by ``info stats locks``.
 ERST
 
     {
@@ -27,6 +27,7 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
+#include "block/aio-wait.h"
 #include "virtio-9p.h"
 #include "fsdev/qemu-fsdev.h"
 #include "9p-xattr.h"
@@ -406,7 +407,9 @@ static int coroutine_fn put_fid(V9fsPDU *pdu, V9fsFidState *fidp)
              * delete the migration blocker. Ideally, this
              * should be hooked to transport close notification
              */
-            migrate_del_blocker(&pdu->s->migration_blocker);
+            v9fs_co_run_in_main_loop({
+                migrate_del_blocker(&pdu->s->migration_blocker);
+            });
         }
         return free_fid(pdu, fidp);
     }
@@ -1011,6 +1014,7 @@ V9fsPDU *pdu_alloc(V9fsState *s)
         pdu = QLIST_FIRST(&s->free_list);
         QLIST_REMOVE(pdu, next);
         QLIST_INSERT_HEAD(&s->active_list, pdu, next);
+        qatomic_inc(&s->in_flight);
     }
     return pdu;
 }
@@ -1022,6 +1026,8 @@ void pdu_free(V9fsPDU *pdu)
     g_assert(!pdu->cancelled);
     QLIST_REMOVE(pdu, next);
     QLIST_INSERT_HEAD(&s->free_list, pdu, next);
+    qatomic_dec(&s->in_flight);
+    aio_wait_kick();
 }
 
 static void coroutine_fn pdu_complete(V9fsPDU *pdu, ssize_t len)
@@ -1501,7 +1507,9 @@ static void coroutine_fn v9fs_attach(void *opaque)
         error_setg(&s->migration_blocker,
                    "Migration is disabled when VirtFS export path '%s' is mounted in the guest using mount_tag '%s'",
                    s->ctx.fs_root ? s->ctx.fs_root : "NULL", s->tag);
-        err = migrate_add_blocker(&s->migration_blocker, NULL);
+        v9fs_co_run_in_main_loop({
+            err = migrate_add_blocker(&s->migration_blocker, NULL);
+        });
         if (err < 0) {
             clunk_fid(s, fid);
             goto out;
@@ -4194,6 +4202,9 @@ int v9fs_device_realize_common(V9fsState *s, const V9fsTransport *t,
 
     assert(!s->transport);
     s->transport = t;
+    if (!s->aio_context) {
+        s->aio_context = qemu_get_aio_context();
+    }
 
     /* initialize pdu allocator */
     QLIST_INIT(&s->free_list);
@@ -4330,9 +4341,7 @@ void v9fs_reset(V9fsState *s)
     VirtfsCoResetData data = { .pdu = { .s = s }, .done = false };
     Coroutine *co;
 
-    while (!QLIST_EMPTY(&s->active_list)) {
-        aio_poll(qemu_get_aio_context(), true);
-    }
+    AIO_WAIT_WHILE(s->aio_context, qatomic_read(&s->in_flight));
 
     co = qemu_coroutine_create(virtfs_co_reset, &data);
     qemu_coroutine_enter(co);
@@ -363,6 +363,8 @@ struct V9fsState {
     uint64_t qp_ndevices; /* Amount of entries in qpd_table. */
     uint16_t qp_affix_next;
     uint64_t qp_fullpath_next;
+    AioContext *aio_context; /* where requests are processed */
+    unsigned int in_flight;  /* PDUs in active_list, for v9fs_reset() */
 };
 
 /* 9p2000.L open flags */
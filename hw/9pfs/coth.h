@@ -17,6 +17,7 @@
 
 #include "qemu/thread.h"
 #include "qemu/coroutine-core.h"
+#include "qemu/main-loop.h"
 #include "9p.h"
 
 /*
@@ -41,16 +42,14 @@
  */
 #define v9fs_co_run_in_worker(code_block)                               \
     do {                                                                \
-        QEMUBH *co_bh;                                                  \
-        co_bh = qemu_bh_new(co_run_in_worker_bh,                        \
-                            qemu_coroutine_self());                     \
-        qemu_bh_schedule(co_bh);                                        \
+        aio_bh_schedule_oneshot(qemu_get_current_aio_context(),         \
+                                co_run_in_worker_bh,                    \
+                                qemu_coroutine_self());                 \
         /*                                                              \
          * yield in qemu thread and re-enter back                       \
          * in worker thread                                             \
          */                                                             \
         qemu_coroutine_yield();                                         \
-        qemu_bh_delete(co_bh);                                          \
         do {                                                            \
             code_block;                                                 \
         } while (0);                                                    \
@@ -58,6 +57,21 @@
         qemu_coroutine_yield();                                         \
     } while (0)
 
+/*
+ * Requests may be processed in an IOThread.  Operations that need the
+ * BQL, such as adding a migration blocker, hop to the main loop with
+ * this and then come back.
+ */
+#define v9fs_co_run_in_main_loop(code_block)                            \
+    do {                                                                \
+        AioContext *co_ctx = qemu_get_current_aio_context();            \
+        aio_co_reschedule_self(qemu_get_aio_context());                 \
+        do {                                                            \
+            code_block;                                                 \
+        } while (0);                                                    \
+        aio_co_reschedule_self(co_ctx);                                 \
+    } while (0)
+
 void co_run_in_worker_bh(void *);
 int coroutine_fn v9fs_co_readlink(V9fsPDU *, V9fsPath *, V9fsString *);
 int coroutine_fn v9fs_co_readdir(V9fsPDU *, V9fsFidState *, struct dirent **);
@@ -18,6 +18,11 @@
 
 #include "qemu/osdep.h"
 #include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-bus.h"
+#include "block/aio-wait.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "qemu/sockets.h"
 #include "virtio-9p.h"
 #include "fsdev/qemu-fsdev.h"
@@ -34,13 +39,96 @@ static void virtio_9p_push_and_notify(V9fsPDU *pdu)
     V9fsVirtioState *v = container_of(s, V9fsVirtioState, state);
     VirtQueueElement *elem = v->elems[pdu->idx];
 
-    /* push onto queue and notify */
+    /* push onto queue, and notify once all ready replies are pushed */
     virtqueue_push(v->vq, elem, pdu->size);
     g_free(elem);
     v->elems[pdu->idx] = NULL;
 
-    /* FIXME: we should batch these completions */
-    virtio_notify(VIRTIO_DEVICE(v), v->vq);
+    qemu_bh_schedule(v->notify_bh);
+}
+
+static void virtio_9p_notify_bh(void *opaque)
+{
+    V9fsVirtioState *v = opaque;
+
+    if (v->iothread) {
+        virtio_notify_irqfd(VIRTIO_DEVICE(v), v->vq);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(v), v->vq);
+    }
+}
+
+static int virtio_9p_start_ioeventfd(VirtIODevice *vdev)
+{
+    V9fsVirtioState *v = VIRTIO_9P(vdev);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int r;
+
+    if (!v->iothread) {
+        return virtio_device_start_ioeventfd_impl(vdev);
+    }
+    if (v->ioeventfd_started) {
+        return 0;
+    }
+
+    r = k->set_guest_notifiers(qbus->parent, 1, true);
+    if (r != 0) {
+        error_report("virtio-9p failed to set guest notifier (%d), "
+                     "ensure -accel kvm is set.", r);
+        return -ENOSYS;
+    }
+    r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), 0, true);
+    if (r != 0) {
+        error_report("virtio-9p failed to set host notifier (%d)", r);
+        k->set_guest_notifiers(qbus->parent, 1, false);
+        return -ENOSYS;
+    }
+
+    v->ioeventfd_started = true;
+    smp_wmb(); /* paired with aio_notify_accept() on the read side */
+
+    /* This also kicks the virtqueue, for requests that are already there */
+    virtio_queue_aio_attach_host_notifier(v->vq, v->state.aio_context);
+    return 0;
+}
+
+/* Context: BH in IOThread */
+static void virtio_9p_stop_ioeventfd_bh(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    virtio_queue_aio_detach_host_notifier(vq, qemu_get_current_aio_context());
+}
+
+static void virtio_9p_stop_ioeventfd(VirtIODevice *vdev)
+{
+    V9fsVirtioState *v = VIRTIO_9P(vdev);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+    if (!v->iothread) {
+        virtio_device_stop_ioeventfd_impl(vdev);
+        return;
+    }
+    if (!v->ioeventfd_started) {
+        return;
+    }
+
+    aio_wait_bh_oneshot(v->state.aio_context, virtio_9p_stop_ioeventfd_bh,
+                        v->vq);
+
+    memory_region_transaction_begin();
+    virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), 0, false);
+    memory_region_transaction_commit();
+    virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), 0);
+
+    /* Requests still in flight need the guest notifier for their reply */
+    AIO_WAIT_WHILE(v->state.aio_context, qatomic_read(&v->state.in_flight));
+    aio_wait_bh_oneshot(v->state.aio_context, virtio_9p_notify_bh, v);
+
+    k->set_guest_notifiers(qbus->parent, 1, false);
+    v->ioeventfd_started = false;
 }
 
 static void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
@@ -211,9 +299,31 @@ static void virtio_9p_device_realize(DeviceState *dev, Error **errp)
         fse->export_flags |= V9FS_NO_PERF_WARN;
     }
 
+    if (v->iothread) {
+        BusState *qbus = qdev_get_parent_bus(dev);
+        VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+        if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+            error_setg(errp, "device is incompatible with iothread "
+                       "(transport does not support notifiers)");
+            return;
+        }
+        if (!virtio_device_ioeventfd_enabled(vdev)) {
+            error_setg(errp, "ioeventfd is required for iothread");
+            return;
+        }
+        /* The throttling timers and queues belong to the main loop */
+        if (fse && throttle_enabled(&fse->fst.cfg)) {
+            error_setg(errp, "iothread cannot be used with fsdev throttling");
+            return;
+        }
+        s->aio_context = iothread_get_aio_context(v->iothread);
+    }
+
     if (v9fs_device_realize_common(s, &virtio_9p_transport, errp)) {
         return;
     }
+    v->notify_bh = aio_bh_new(s->aio_context, virtio_9p_notify_bh, v);
 
     v->config_size = sizeof(struct virtio_9p_config) + strlen(s->fsconf.tag);
     virtio_init(vdev, VIRTIO_ID_9P, v->config_size);
@@ -226,6 +336,7 @@ static void virtio_9p_device_unrealize(DeviceState *dev)
     V9fsVirtioState *v = VIRTIO_9P(dev);
     V9fsState *s = &v->state;
 
+    qemu_bh_delete(v->notify_bh);
     virtio_delete_queue(v->vq);
     virtio_cleanup(vdev);
     v9fs_device_unrealize_common(s);
@@ -246,6 +357,8 @@ static const VMStateDescription vmstate_virtio_9p = {
 static Property virtio_9p_properties[] = {
     DEFINE_PROP_STRING("mount_tag", V9fsVirtioState, state.fsconf.tag),
     DEFINE_PROP_STRING("fsdev", V9fsVirtioState, state.fsconf.fsdev_id),
+    DEFINE_PROP_LINK("iothread", V9fsVirtioState, iothread, TYPE_IOTHREAD,
+                     IOThread *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -262,6 +375,8 @@ static void virtio_9p_class_init(ObjectClass *klass, void *data)
     vdc->get_features = virtio_9p_get_features;
     vdc->get_config = virtio_9p_get_config;
     vdc->reset = virtio_9p_reset;
+    vdc->start_ioeventfd = virtio_9p_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_9p_stop_ioeventfd;
 }
 
 static const TypeInfo virtio_device_info = {
@@ -3,6 +3,7 @@
 
 #include "standard-headers/linux/virtio_9p.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 #include "9p.h"
 #include "qom/object.h"
 
@@ -12,6 +13,9 @@ struct V9fsVirtioState {
     size_t config_size;
     VirtQueueElement *elems[MAX_REQ];
     V9fsState state;
+    IOThread *iothread;
+    QEMUBH *notify_bh;      /* one notification for a batch of replies */
+    bool ioeventfd_started; /* with an IOThread */
 };
 
 #define TYPE_VIRTIO_9P "virtio-9p-device"
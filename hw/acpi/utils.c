@@ -25,6 +25,7 @@
 #include "hw/acpi/aml-build.h"
 #include "hw/acpi/utils.h"
 #include "hw/loader.h"
+#include "hw/pci/pci_device.h"
 
 MemoryRegion *acpi_add_rom_blob(FWCfgCallback update, void *opaque,
                                 GArray *blob, const char *name)
@@ -46,3 +47,70 @@ MemoryRegion *acpi_add_rom_blob(FWCfgCallback update, void *opaque,
     return rom_add_blob(name, blob->data, acpi_data_len(blob), max_size, -1,
                         name, update, opaque, NULL, true);
 }
+
+/* Bumped whenever a device is plugged or unplugged after machine init */
+static uint64_t acpi_build_generation;
+
+static void acpi_build_device_changed(DeviceListener *listener,
+                                      DeviceState *dev)
+{
+    if (phase_check(PHASE_MACHINE_READY)) {
+        acpi_build_generation++;
+    }
+}
+
+static DeviceListener acpi_build_device_listener = {
+    .realize = acpi_build_device_changed,
+    .unrealize = acpi_build_device_changed,
+};
+
+static int acpi_build_snapshot_pci(Object *obj, void *opaque)
+{
+    PCIDevice *pdev = (PCIDevice *)object_dynamic_cast(obj, TYPE_PCI_DEVICE);
+    GByteArray *snapshot = opaque;
+
+    if (pdev && DEVICE(pdev)->realized) {
+        uint32_t id = pci_dev_bus_num(pdev) << 8 | pdev->devfn;
+
+        /* Covers BARs, bridge windows and bus numbers, MCFG base on q35 */
+        g_byte_array_append(snapshot, (guint8 *)&id, sizeof(id));
+        g_byte_array_append(snapshot, pdev->config, PCI_CONFIG_SPACE_SIZE);
+    }
+    return 0;
+}
+
+bool acpi_build_snapshot_update(GByteArray **snapshot)
+{
+    static bool listening;
+    GByteArray *new = g_byte_array_new();
+    GByteArray *old = *snapshot;
+
+    if (!listening) {
+        device_listener_register(&acpi_build_device_listener);
+        listening = true;
+    }
+
+    g_byte_array_append(new, (guint8 *)&acpi_build_generation,
+                        sizeof(acpi_build_generation));
+    object_child_foreach_recursive(OBJECT(qdev_get_machine()),
+                                   acpi_build_snapshot_pci, new);
+
+    *snapshot = new;
+    if (old && old->len == new->len && !memcmp(old->data, new->data,
+                                               new->len)) {
+        g_byte_array_unref(old);
+        return false;
+    }
+    if (old) {
+        g_byte_array_unref(old);
+    }
+    return true;
+}
+
+void acpi_build_snapshot_clear(GByteArray **snapshot)
+{
+    if (*snapshot) {
+        g_byte_array_unref(*snapshot);
+        *snapshot = NULL;
+    }
+}
@@ -32,6 +32,147 @@
 #include "hw/arm/smmu-common.h"
 #include "smmu-internal.h"
 
+/* Page table walk cache */
+
+/*
+ * The nested devices of all the vSMMUs see the guest physical address space
+ * through a single address space. VFIO then maps guest RAM once per iommufd
+ * backend, into a single IOAS, however many devices and vSMMUs there are.
+ */
+static MemoryRegion smmu_nested_root;
+static MemoryRegion smmu_nested_sysmem;
+static AddressSpace smmu_nested_as;
+
+/* The nested vSMMUs, looked up when sharing stage-2 hwpts between them */
+static QLIST_HEAD(, SMMUState) smmu_nested_instances =
+    QLIST_HEAD_INITIALIZER(smmu_nested_instances);
+
+static guint smmu_ptw_cache_key_hash(gconstpointer v)
+{
+    SMMUPTWCacheKey *key = (SMMUPTWCacheKey *)v;
+    uint32_t a, b, c;
+
+    /* Jenkins hash */
+    a = b = c = JHASH_INITVAL + sizeof(*key);
+    a += key->asid + key->vmid + key->level + key->stage + key->granule_sz;
+    b += extract64(key->iova, 0, 32) ^ extract64(key->ttb, 0, 32);
+    c += extract64(key->iova, 32, 32) ^ extract64(key->ttb, 32, 32);
+
+    __jhash_mix(a, b, c);
+    __jhash_final(a, b, c);
+
+    return c;
+}
+
+static gboolean smmu_ptw_cache_key_equal(gconstpointer v1, gconstpointer v2)
+{
+    SMMUPTWCacheKey *k1 = (SMMUPTWCacheKey *)v1, *k2 = (SMMUPTWCacheKey *)v2;
+
+    return (k1->iova == k2->iova) && (k1->ttb == k2->ttb) &&
+           (k1->asid == k2->asid) && (k1->vmid == k2->vmid) &&
+           (k1->stage == k2->stage) && (k1->level == k2->level) &&
+           (k1->granule_sz == k2->granule_sz);
+}
+
+static SMMUPTWCacheKey smmu_get_ptw_cache_key(SMMUTransCfg *cfg, int stage,
+                                              uint64_t ttb, int granule_sz,
+                                              int level, dma_addr_t iova)
+{
+    SMMUPTWCacheKey key = {
+        .iova = iova & level_page_mask(level - 1, granule_sz),
+        .ttb = ttb, .asid = cfg->asid, .vmid = cfg->s2cfg.vmid,
+        .stage = stage, .level = level, .granule_sz = granule_sz};
+
+    return key;
+}
+
+/*
+ * Look for the deepest table translating @iova below @start_level. On a
+ * hit, the walk can resume at @level from the table at @baseaddr, with @ap
+ * (if non-NULL) holding the APTable restrictions of the skipped levels.
+ */
+static bool smmu_ptw_cache_lookup(SMMUState *bs, SMMUTransCfg *cfg, int stage,
+                                  uint64_t ttb, int granule_sz,
+                                  int start_level, dma_addr_t iova,
+                                  int *level, dma_addr_t *baseaddr,
+                                  uint8_t *ap)
+{
+    int l;
+
+    /* With CMDQV, TLBI commands will not be trapped so it cannot be used */
+    if (bs->has_cmdqv) {
+        return false;
+    }
+
+    for (l = VMSA_LEVELS - 1; l > start_level; l--) {
+        SMMUPTWCacheKey key = smmu_get_ptw_cache_key(cfg, stage, ttb,
+                                                     granule_sz, l, iova);
+        SMMUPTWCacheEntry *entry = g_hash_table_lookup(bs->ptw_cache, &key);
+
+        if (entry) {
+            trace_smmu_ptw_cache_hit(stage, iova, l, entry->table);
+            *level = l;
+            *baseaddr = entry->table;
+            if (ap) {
+                *ap = entry->ap;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static void smmu_ptw_cache_insert(SMMUState *bs, SMMUTransCfg *cfg, int stage,
+                                  uint64_t ttb, int granule_sz, int level,
+                                  dma_addr_t iova, dma_addr_t table, uint8_t ap)
+{
+    SMMUPTWCacheEntry *entry;
+
+    if (bs->has_cmdqv) {
+        return;
+    }
+    if (g_hash_table_size(bs->ptw_cache) >= SMMU_PTW_CACHE_MAX_SIZE) {
+        g_hash_table_remove_all(bs->ptw_cache);
+    }
+
+    entry = g_new0(SMMUPTWCacheEntry, 1);
+    entry->key = smmu_get_ptw_cache_key(cfg, stage, ttb, granule_sz,
+                                        level, iova);
+    entry->mask = ~level_page_mask(level - 1, granule_sz);
+    entry->table = table;
+    entry->ap = ap;
+    g_hash_table_replace(bs->ptw_cache, &entry->key, entry);
+}
+
+static gboolean smmu_ptw_cache_remove(gpointer key, gpointer value,
+                                      gpointer user_data)
+{
+    SMMUPTWCacheEntry *entry = (SMMUPTWCacheEntry *)value;
+    SMMUPTWCacheInvInfo *info = (SMMUPTWCacheInvInfo *)user_data;
+
+    if (info->asid >= 0 && info->asid != entry->key.asid) {
+        return false;
+    }
+    if (info->vmid >= 0 && info->vmid != entry->key.vmid) {
+        return false;
+    }
+    return entry->key.iova <= info->last &&
+           info->iova <= (entry->key.iova | entry->mask);
+}
+
+/*
+ * Table descriptors translate ranges much larger than the IOTLB entries, so
+ * that the walk cache is kept small and scanned as a whole on invalidation.
+ */
+static void smmu_ptw_cache_inv(SMMUState *s, int asid, int vmid,
+                               uint64_t iova, uint64_t last)
+{
+    SMMUPTWCacheInvInfo info = {.asid = asid, .vmid = vmid,
+                                .iova = iova, .last = last};
+
+    g_hash_table_foreach_remove(s->ptw_cache, smmu_ptw_cache_remove, &info);
+}
+
 /* IOTLB Management */
 
 static guint smmu_iotlb_key_hash(gconstpointer v)
@@ -69,6 +210,32 @@ SMMUIOTLBKey smmu_get_iotlb_key(uint16_t asid, uint16_t vmid, uint64_t iova,
     return key;
 }
 
+/*
+ * The IOTLB keeps each entry in three places: the iotlb hash table for
+ * lookups, the range index of the bucket of its (asid, vmid) for
+ * invalidations, and the LRU list used to evict entries once full.
+ */
+static void smmu_iotlb_remove(SMMUState *s, SMMUTLBEntry *entry)
+{
+    SMMUIOTLBBucket *bucket = entry->bucket;
+
+    interval_tree_remove(&entry->node, &bucket->ranges);
+    QTAILQ_REMOVE(&s->iotlb_lru, entry, lru);
+    if (!--bucket->nr_entries) {
+        g_hash_table_remove(s->iotlb_buckets,
+                            SMMU_IOTLB_BUCKET_KEY(bucket->asid, bucket->vmid));
+    }
+    g_hash_table_remove(s->iotlb, &entry->key);
+}
+
+static void smmu_iotlb_remove_all(SMMUState *s)
+{
+    g_hash_table_remove_all(s->ptw_cache);
+    g_hash_table_remove_all(s->iotlb_buckets);
+    QTAILQ_INIT(&s->iotlb_lru);
+    g_hash_table_remove_all(s->iotlb);
+}
+
 SMMUTLBEntry *smmu_iotlb_lookup(SMMUState *bs, SMMUTransCfg *cfg,
                                 SMMUTransTableInfo *tt, hwaddr iova)
 {
@@ -97,6 +264,8 @@ SMMUTLBEntry *smmu_iotlb_lookup(SMMUState *bs, SMMUTransCfg *cfg,
     }
 
     if (entry) {
+        QTAILQ_REMOVE(&bs->iotlb_lru, entry, lru);
+        QTAILQ_INSERT_TAIL(&bs->iotlb_lru, entry, lru);
         cfg->iotlb_hits++;
         trace_smmu_iotlb_lookup_hit(cfg->asid, cfg->s2cfg.vmid, iova,
                                     cfg->iotlb_hits, cfg->iotlb_misses,
@@ -114,64 +283,95 @@ SMMUTLBEntry *smmu_iotlb_lookup(SMMUState *bs, SMMUTransCfg *cfg,
 
 void smmu_iotlb_insert(SMMUState *bs, SMMUTransCfg *cfg, SMMUTLBEntry *new)
 {
-    SMMUIOTLBKey *key = g_new0(SMMUIOTLBKey, 1);
     uint8_t tg = (new->granule - 10) / 2;
+    SMMUIOTLBBucket *bucket;
+    SMMUTLBEntry *old;
+    gpointer bucket_key;
 
     /* With CMDQV, TLBI commands will not be trapped so it cannot use iotlb */
     if (bs->has_cmdqv) {
         return;
     }
-    if (g_hash_table_size(bs->iotlb) >= SMMU_IOTLB_MAX_SIZE) {
-        smmu_iotlb_inv_all(bs);
+
+    new->key = smmu_get_iotlb_key(cfg->asid, cfg->s2cfg.vmid, new->entry.iova,
+                                  tg, new->level);
+    old = g_hash_table_lookup(bs->iotlb, &new->key);
+    if (old) {
+        smmu_iotlb_remove(bs, old);
+    } else if (g_hash_table_size(bs->iotlb) >= SMMU_IOTLB_MAX_SIZE) {
+        smmu_iotlb_remove(bs, QTAILQ_FIRST(&bs->iotlb_lru));
+    }
+
+    bucket_key = SMMU_IOTLB_BUCKET_KEY(cfg->asid, cfg->s2cfg.vmid);
+    bucket = g_hash_table_lookup(bs->iotlb_buckets, bucket_key);
+    if (!bucket) {
+        bucket = g_new0(SMMUIOTLBBucket, 1);
+        bucket->asid = cfg->asid;
+        bucket->vmid = cfg->s2cfg.vmid;
+        g_hash_table_insert(bs->iotlb_buckets, bucket_key, bucket);
     }
 
-    *key = smmu_get_iotlb_key(cfg->asid, cfg->s2cfg.vmid, new->entry.iova,
-                              tg, new->level);
+    new->bucket = bucket;
+    new->node.start = new->entry.iova;
+    new->node.last = new->entry.iova | new->entry.addr_mask;
+    interval_tree_insert(&new->node, &bucket->ranges);
+    bucket->nr_entries++;
+    QTAILQ_INSERT_TAIL(&bs->iotlb_lru, new, lru);
+
     trace_smmu_iotlb_insert(cfg->asid, cfg->s2cfg.vmid, new->entry.iova,
                             tg, new->level);
-    g_hash_table_insert(bs->iotlb, key, new);
+    g_hash_table_insert(bs->iotlb, &new->key, new);
 }
 
 void smmu_iotlb_inv_all(SMMUState *s)
 {
     trace_smmu_iotlb_inv_all();
-    g_hash_table_remove_all(s->iotlb);
+    smmu_iotlb_remove_all(s);
 }
 
-static gboolean smmu_hash_remove_by_asid(gpointer key, gpointer value,
-                                         gpointer user_data)
+/* Remove the entries of @bucket overlapping [@start, @last] */
+static void smmu_iotlb_bucket_inv_range(SMMUState *s, SMMUIOTLBBucket *bucket,
+                                        uint64_t start, uint64_t last)
 {
-    uint16_t asid = *(uint16_t *)user_data;
-    SMMUIOTLBKey *iotlb_key = (SMMUIOTLBKey *)key;
+    IntervalTreeNode *node, *next;
 
-    return SMMU_IOTLB_ASID(*iotlb_key) == asid;
+    /* @bucket is freed along with its last entry */
+    for (node = interval_tree_iter_first(&bucket->ranges, start, last);
+         node; node = next) {
+        next = interval_tree_iter_next(node, start, last);
+        smmu_iotlb_remove(s, container_of(node, SMMUTLBEntry, node));
+    }
 }
 
-static gboolean smmu_hash_remove_by_vmid(gpointer key, gpointer value,
-                                         gpointer user_data)
+/*
+ * Return the buckets matching @asid and @vmid, -1 matching any. The list is
+ * built beforehand as emptying a bucket removes it from iotlb_buckets.
+ */
+static GSList *smmu_iotlb_find_buckets(SMMUState *s, int asid, int vmid)
 {
-    uint16_t vmid = *(uint16_t *)user_data;
-    SMMUIOTLBKey *iotlb_key = (SMMUIOTLBKey *)key;
+    SMMUIOTLBBucket *bucket;
+    GHashTableIter iter;
+    GSList *list = NULL;
 
-    return SMMU_IOTLB_VMID(*iotlb_key) == vmid;
+    g_hash_table_iter_init(&iter, s->iotlb_buckets);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&bucket)) {
+        if ((asid < 0 || bucket->asid == asid) &&
+            (vmid < 0 || bucket->vmid == vmid)) {
+            list = g_slist_prepend(list, bucket);
+        }
+    }
+    return list;
 }
 
-static gboolean smmu_hash_remove_by_asid_vmid_iova(gpointer key, gpointer value,
-                                              gpointer user_data)
+static void smmu_iotlb_inv_buckets(SMMUState *s, int asid, int vmid,
+                                   uint64_t start, uint64_t last)
 {
-    SMMUTLBEntry *iter = (SMMUTLBEntry *)value;
-    IOMMUTLBEntry *entry = &iter->entry;
-    SMMUIOTLBPageInvInfo *info = (SMMUIOTLBPageInvInfo *)user_data;
-    SMMUIOTLBKey iotlb_key = *(SMMUIOTLBKey *)key;
+    GSList *list = smmu_iotlb_find_buckets(s, asid, vmid), *elem;
 
-    if (info->asid >= 0 && info->asid != SMMU_IOTLB_ASID(iotlb_key)) {
-        return false;
+    for (elem = list; elem; elem = elem->next) {
+        smmu_iotlb_bucket_inv_range(s, elem->data, start, last);
     }
-    if (info->vmid >= 0 && info->vmid != SMMU_IOTLB_VMID(iotlb_key)) {
-        return false;
-    }
-    return ((info->iova & ~entry->addr_mask) == entry->iova) ||
-           ((entry->iova & ~info->mask) == info->iova);
+    g_slist_free(list);
 }
 
 void smmu_iotlb_inv_iova(SMMUState *s, int asid, int vmid, dma_addr_t iova,
@@ -179,11 +379,17 @@ void smmu_iotlb_inv_iova(SMMUState *s, int asid, int vmid, dma_addr_t iova,
 {
     /* if tg is not set we use 4KB range invalidation */
     uint8_t granule = tg ? tg * 2 + 10 : 12;
+    uint64_t last = iova + (num_pages << granule) - 1;
+    SMMUIOTLBBucket *bucket;
+
+    smmu_ptw_cache_inv(s, asid, vmid, iova, last);
 
     if (ttl && (num_pages == 1) && (asid >= 0)) {
         SMMUIOTLBKey key = smmu_get_iotlb_key(asid, vmid, iova, tg, ttl);
+        SMMUTLBEntry *entry = g_hash_table_lookup(s->iotlb, &key);
 
-        if (g_hash_table_remove(s->iotlb, &key)) {
+        if (entry) {
+            smmu_iotlb_remove(s, entry);
             return;
         }
         /*
@@ -192,26 +398,30 @@ void smmu_iotlb_inv_iova(SMMUState *s, int asid, int vmid, dma_addr_t iova,
          */
     }
 
-    SMMUIOTLBPageInvInfo info = {
-        .asid = asid, .iova = iova,
-        .vmid = vmid,
-        .mask = (num_pages * 1 << granule) - 1};
+    if (asid >= 0 && vmid >= 0) {
+        bucket = g_hash_table_lookup(s->iotlb_buckets,
+                                     SMMU_IOTLB_BUCKET_KEY(asid, vmid));
+        if (bucket) {
+            smmu_iotlb_bucket_inv_range(s, bucket, iova, last);
+        }
+        return;
+    }
 
-    g_hash_table_foreach_remove(s->iotlb,
-                                smmu_hash_remove_by_asid_vmid_iova,
-                                &info);
+    smmu_iotlb_inv_buckets(s, asid, vmid, iova, last);
 }
 
 void smmu_iotlb_inv_asid(SMMUState *s, uint16_t asid)
 {
     trace_smmu_iotlb_inv_asid(asid);
-    g_hash_table_foreach_remove(s->iotlb, smmu_hash_remove_by_asid, &asid);
+    smmu_ptw_cache_inv(s, asid, -1, 0, UINT64_MAX);
+    smmu_iotlb_inv_buckets(s, asid, -1, 0, UINT64_MAX);
 }
 
 void smmu_iotlb_inv_vmid(SMMUState *s, uint16_t vmid)
 {
     trace_smmu_iotlb_inv_vmid(vmid);
-    g_hash_table_foreach_remove(s->iotlb, smmu_hash_remove_by_vmid, &vmid);
+    smmu_ptw_cache_inv(s, -1, vmid, 0, UINT64_MAX);
+    smmu_iotlb_inv_buckets(s, -1, vmid, 0, UINT64_MAX);
 }
 
 /* VMSAv8-64 Translation */
@@ -310,14 +520,16 @@ SMMUTransTableInfo *select_tt(SMMUTransCfg *cfg, dma_addr_t iova)
  * Upon success, @tlbe is filled with translated_addr and entry
  * permission rights.
  */
-static int smmu_ptw_64_s1(SMMUTransCfg *cfg,
+static int smmu_ptw_64_s1(SMMUState *bs, SMMUTransCfg *cfg,
                           dma_addr_t iova, IOMMUAccessFlags perm,
                           SMMUTLBEntry *tlbe, SMMUPTWEventInfo *info)
 {
     dma_addr_t baseaddr, indexmask;
     int stage = cfg->stage;
     SMMUTransTableInfo *tt = select_tt(cfg, iova);
-    uint8_t level, granule_sz, inputsize, stride;
+    uint8_t granule_sz, inputsize, stride;
+    uint8_t aptable = 0;
+    int level;
 
     if (!tt || tt->disabled) {
         info->type = SMMU_PTW_ERR_TRANSLATION;
@@ -332,6 +544,13 @@ static int smmu_ptw_64_s1(SMMUTransCfg *cfg,
     baseaddr = extract64(tt->ttb, 0, 48);
     baseaddr &= ~indexmask;
 
+    if (smmu_ptw_cache_lookup(bs, cfg, 1, tt->ttb, granule_sz, level, iova,
+                              &level, &baseaddr, &aptable) &&
+        is_permission_fault(aptable, perm) && !tt->had) {
+        info->type = SMMU_PTW_ERR_PERMISSION;
+        goto error;
+    }
+
     while (level < VMSA_LEVELS) {
         uint64_t subpage_size = 1ULL << level_shift(level, granule_sz);
         uint64_t mask = subpage_size - 1;
@@ -353,14 +572,16 @@ static int smmu_ptw_64_s1(SMMUTransCfg *cfg,
         }
 
         if (is_table_pte(pte, level)) {
-            ap = PTE_APTABLE(pte);
+            aptable |= PTE_APTABLE(pte);
 
-            if (is_permission_fault(ap, perm) && !tt->had) {
+            if (is_permission_fault(aptable, perm) && !tt->had) {
                 info->type = SMMU_PTW_ERR_PERMISSION;
                 goto error;
             }
             baseaddr = get_table_pte_address(pte, granule_sz);
             level++;
+            smmu_ptw_cache_insert(bs, cfg, 1, tt->ttb, granule_sz, level,
+                                  iova, baseaddr, aptable);
             continue;
         } else if (is_page_pte(pte, level)) {
             gpa = get_page_pte_address(pte, granule_sz);
@@ -422,7 +643,7 @@ error:
  * Upon success, @tlbe is filled with translated_addr and entry
  * permission rights.
  */
-static int smmu_ptw_64_s2(SMMUTransCfg *cfg,
+static int smmu_ptw_64_s2(SMMUState *bs, SMMUTransCfg *cfg,
                           dma_addr_t ipa, IOMMUAccessFlags perm,
                           SMMUTLBEntry *tlbe, SMMUPTWEventInfo *info)
 {
@@ -452,6 +673,9 @@ static int smmu_ptw_64_s2(SMMUTransCfg *cfg,
         goto error;
     }
 
+    smmu_ptw_cache_lookup(bs, cfg, 2, cfg->s2cfg.vttb, granule_sz, level, ipa,
+                          &level, &baseaddr, NULL);
+
     while (level < VMSA_LEVELS) {
         uint64_t subpage_size = 1ULL << level_shift(level, granule_sz);
         uint64_t mask = subpage_size - 1;
@@ -474,6 +698,8 @@ static int smmu_ptw_64_s2(SMMUTransCfg *cfg,
         if (is_table_pte(pte, level)) {
             baseaddr = get_table_pte_address(pte, granule_sz);
             level++;
+            smmu_ptw_cache_insert(bs, cfg, 2, cfg->s2cfg.vttb, granule_sz,
+                                  level, ipa, baseaddr, 0);
             continue;
         } else if (is_page_pte(pte, level)) {
             gpa = get_page_pte_address(pte, granule_sz);
@@ -540,11 +766,11 @@ error:
  *
  * return 0 on success
  */
-int smmu_ptw(SMMUTransCfg *cfg, dma_addr_t iova, IOMMUAccessFlags perm,
-             SMMUTLBEntry *tlbe, SMMUPTWEventInfo *info)
+int smmu_ptw(SMMUState *bs, SMMUTransCfg *cfg, dma_addr_t iova,
+             IOMMUAccessFlags perm, SMMUTLBEntry *tlbe, SMMUPTWEventInfo *info)
 {
     if (cfg->stage == 1) {
-        return smmu_ptw_64_s1(cfg, iova, perm, tlbe, info);
+        return smmu_ptw_64_s1(bs, cfg, iova, perm, tlbe, info);
     } else if (cfg->stage == 2) {
         /*
          * If bypassing stage 1(or unimplemented), the input address is passed
@@ -559,7 +785,7 @@ int smmu_ptw(SMMUTransCfg *cfg, dma_addr_t iova, IOMMUAccessFlags perm,
             return -EINVAL;
         }
 
-        return smmu_ptw_64_s2(cfg, iova, perm, tlbe, info);
+        return smmu_ptw_64_s2(bs, cfg, iova, perm, tlbe, info);
     }
 
     g_assert_not_reached();
@@ -623,9 +849,6 @@ static SMMUDevice *smmu_get_sdev(SMMUState *s, SMMUPciBus *sbus,
         memory_region_init_iommu(&sdev->iommu, sizeof(sdev->iommu),
                                  s->mrtypename,
                                  OBJECT(s), name, UINT64_MAX);
-        if (s->nested) {
-            address_space_init(&sdev->as_sysmem, &s->root, name);
-        }
         address_space_init(&sdev->as,
                            MEMORY_REGION(&sdev->iommu), name);
         trace_smmu_add_mr(name);
@@ -654,7 +877,7 @@ static AddressSpace *smmu_find_add_as(PCIBus *bus, void *opaque, int devfn)
     SMMUDevice *sdev = smmu_get_sdev(s, sbus, bus, devfn);
 
     if (s->nested && smmu_dev_is_behind_nested_smmu(sdev)) {
-        return &sdev->as_sysmem;
+        return &smmu_nested_as;
     } else {
         return &sdev->as;
     }
@@ -669,23 +892,117 @@ static AddressSpace *smmu_find_msi_add_as(PCIBus *bus, void *opaque, int devfn)
     return &sdev->as;
 }
 
+/*
+ * The stage-2 hwpt holds the guest physical address space, so it is the one
+ * tracking dirty pages for migration. Publish it before attaching so that the
+ * host IOMMU device accounts for it.
+ */
+static int smmu_dev_attach_s2_hwpt_id(HIODIOMMUFD *idev, uint32_t hwpt_id,
+                                      bool dirty_tracking, Error **errp)
+{
+    uint32_t dirty_hwpt_id = idev->dirty_hwpt_id;
+    int ret;
+
+    idev->dirty_hwpt_id = dirty_tracking ? hwpt_id : 0;
+    ret = hiod_iommufd_attach_hwpt(idev, hwpt_id, errp);
+    if (ret) {
+        idev->dirty_hwpt_id = dirty_hwpt_id;
+    }
+
+    return ret;
+}
+
+/*
+ * With shared-s2-hwpt, try the stage-2 hwpts of the other vSMMUs on the same
+ * IOAS before allocating one, so that their host page tables are shared too.
+ * Each vSMMU keeps its own SMMUS2Hwpt for the devices it owns.
+ */
+static SMMUS2Hwpt *smmu_dev_share_s2_hwpt(SMMUState *s, HIODIOMMUFD *idev)
+{
+    SMMUS2Hwpt *peer_hwpt, *s2_hwpt;
+    SMMUState *peer;
+
+    if (!s->shared_s2_hwpt) {
+        return NULL;
+    }
+
+    QLIST_FOREACH(peer, &smmu_nested_instances, nested_next) {
+        if (peer == s || !peer->shared_s2_hwpt ||
+            peer->iommufd != s->iommufd) {
+            continue;
+        }
+        QLIST_FOREACH(peer_hwpt, &peer->s2_hwpt_list, next) {
+            if (peer_hwpt->ioas_id != idev->ioas_id ||
+                smmu_dev_attach_s2_hwpt_id(idev, peer_hwpt->hwpt_id,
+                                           peer_hwpt->dirty_tracking, NULL)) {
+                continue;
+            }
+
+            s2_hwpt = g_new0(SMMUS2Hwpt, 1);
+            s2_hwpt->smmu = s;
+            s2_hwpt->iommufd = s->iommufd;
+            s2_hwpt->hwpt_id = peer_hwpt->hwpt_id;
+            s2_hwpt->ioas_id = peer_hwpt->ioas_id;
+            s2_hwpt->dirty_tracking = peer_hwpt->dirty_tracking;
+            trace_smmu_share_s2_hwpt(s2_hwpt->hwpt_id, s2_hwpt->ioas_id);
+            return s2_hwpt;
+        }
+    }
+
+    return NULL;
+}
+
+/* Whether another vSMMU still uses the hwpt backing @s2_hwpt */
+static bool smmu_s2_hwpt_is_shared(SMMUS2Hwpt *s2_hwpt)
+{
+    SMMUS2Hwpt *peer_hwpt;
+    SMMUState *peer;
+
+    QLIST_FOREACH(peer, &smmu_nested_instances, nested_next) {
+        if (peer == s2_hwpt->smmu || peer->iommufd != s2_hwpt->iommufd) {
+            continue;
+        }
+        QLIST_FOREACH(peer_hwpt, &peer->s2_hwpt_list, next) {
+            if (peer_hwpt->hwpt_id == s2_hwpt->hwpt_id) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
 static SMMUS2Hwpt *smmu_dev_attach_s2_hwpt(SMMUDevice *sdev,
                                            HIODIOMMUFD *idev, Error **errp)
 {
     SMMUState *s = sdev->smmu;
+    uint32_t flags = IOMMU_HWPT_ALLOC_NEST_PARENT;
+    enum iommu_hw_info_type type;
     SMMUS2Hwpt *s2_hwpt;
     uint32_t s2_hwpt_id;
+    uint64_t caps = 0;
     int ret;
 
     QLIST_FOREACH(s2_hwpt, &s->s2_hwpt_list, next) {
-        if (!hiod_iommufd_attach_hwpt(idev, s2_hwpt->hwpt_id, NULL)) {
+        if (!smmu_dev_attach_s2_hwpt_id(idev, s2_hwpt->hwpt_id,
+                                        s2_hwpt->dirty_tracking, NULL)) {
             return s2_hwpt;
         }
     }
 
+    s2_hwpt = smmu_dev_share_s2_hwpt(s, idev);
+    if (s2_hwpt) {
+        goto new_s2_hwpt;
+    }
+
+    iommufd_backend_get_device_info(s->iommufd, idev->devid, &type,
+                                    NULL, 0, &caps, NULL);
+    if (caps & IOMMU_HW_CAP_DIRTY_TRACKING) {
+        flags |= IOMMU_HWPT_ALLOC_DIRTY_TRACKING;
+    }
+
     ret = iommufd_backend_alloc_hwpt(s->iommufd, idev->devid,
-                                     idev->ioas_id,
-                                     IOMMU_HWPT_ALLOC_NEST_PARENT,
+                                     idev->ioas_id, flags,
                                      IOMMU_HWPT_DATA_NONE, 0, NULL,
                                      &s2_hwpt_id);
     if (ret) {
@@ -693,7 +1010,9 @@ static SMMUS2Hwpt *smmu_dev_attach_s2_hwpt(SMMUDevice *sdev,
         return NULL;
     }
 
-    ret = hiod_iommufd_attach_hwpt(idev, s2_hwpt_id, errp);
+    ret = smmu_dev_attach_s2_hwpt_id(idev, s2_hwpt_id,
+                                     flags & IOMMU_HWPT_ALLOC_DIRTY_TRACKING,
+                                     errp);
     if (ret) {
         iommufd_backend_free_id(s->iommufd, s2_hwpt_id);
         error_setg(errp, "failed to attach stage-2 HW pagetable: %d", ret);
@@ -701,11 +1020,15 @@ static SMMUS2Hwpt *smmu_dev_attach_s2_hwpt(SMMUDevice *sdev,
     }
 
     s2_hwpt = g_new0(SMMUS2Hwpt, 1);
+    s2_hwpt->smmu = s;
     s2_hwpt->iommufd = s->iommufd;
     s2_hwpt->hwpt_id = s2_hwpt_id;
     s2_hwpt->ioas_id = idev->ioas_id;
+    s2_hwpt->dirty_tracking = flags & IOMMU_HWPT_ALLOC_DIRTY_TRACKING;
 
+new_s2_hwpt:
     QLIST_INSERT_HEAD(&s->s2_hwpt_list, s2_hwpt, next);
+    s2_hwpt_id = s2_hwpt->hwpt_id;
 
     if (s->has_cmdqv) {
         if (s->viommu) {
@@ -805,7 +1128,9 @@ static void smmu_dev_unset_iommu_device(PCIBus *bus, void *opaque, int devfn)
     trace_smmu_unset_iommu_device(devfn, smmu_get_sid(sdev));
 
     if (QLIST_EMPTY(&s2_hwpt->device_list)) {
-        iommufd_backend_free_id(s2_hwpt->iommufd, s2_hwpt->hwpt_id);
+        if (!smmu_s2_hwpt_is_shared(s2_hwpt)) {
+            iommufd_backend_free_id(s2_hwpt->iommufd, s2_hwpt->hwpt_id);
+        }
         QLIST_REMOVE(s2_hwpt, next);
         g_free(s2_hwpt);
     }
@@ -842,7 +1167,8 @@ int smmu_dev_get_info(SMMUDevice *sdev, uint32_t *data_type,
     }
 
     return iommufd_backend_get_device_info(s->iommufd, sdev->idev->devid,
-                                           data_type, data, data_len, NULL);
+                                           data_type, data, data_len, NULL,
+                                           NULL);
 }
 
 void smmu_dev_uninstall_nested_ste(SMMUDevice *sdev)
@@ -998,6 +1324,18 @@ void smmu_inv_notifiers_all(SMMUState *s)
     }
 }
 
+static void smmu_nested_as_init(void)
+{
+    MemoryRegion *sysmem = get_system_memory();
+
+    memory_region_init(&smmu_nested_root, NULL, "smmu-nested-root",
+                       UINT64_MAX);
+    memory_region_init_alias(&smmu_nested_sysmem, NULL, "smmu-sysmem",
+                             sysmem, 0, memory_region_size(sysmem));
+    memory_region_add_subregion(&smmu_nested_root, 0, &smmu_nested_sysmem);
+    address_space_init(&smmu_nested_as, &smmu_nested_root, "smmu-nested");
+}
+
 static void smmu_base_realize(DeviceState *dev, Error **errp)
 {
     SMMUState *s = ARM_SMMU(dev);
@@ -1011,7 +1349,12 @@ static void smmu_base_realize(DeviceState *dev, Error **errp)
     }
     s->configs = g_hash_table_new_full(NULL, NULL, NULL, g_free);
     s->iotlb = g_hash_table_new_full(smmu_iotlb_key_hash, smmu_iotlb_key_equal,
-                                     g_free, g_free);
+                                     NULL, g_free);
+    s->iotlb_buckets = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    s->ptw_cache = g_hash_table_new_full(smmu_ptw_cache_key_hash,
+                                         smmu_ptw_cache_key_equal,
+                                         NULL, g_free);
+    QTAILQ_INIT(&s->iotlb_lru);
     s->smmu_pcibus_by_busptr = g_hash_table_new(NULL, NULL);
 
     if (s->iommufd) {
@@ -1025,11 +1368,10 @@ static void smmu_base_realize(DeviceState *dev, Error **errp)
             }
         }
         if (s->nested) {
-            memory_region_init(&s->root, OBJECT(s), "root", UINT64_MAX);
-            memory_region_init_alias(&s->sysmem, OBJECT(s),
-                                     "smmu-sysmem", get_system_memory(), 0,
-                                     memory_region_size(get_system_memory()));
-            memory_region_add_subregion(&s->root, 0, &s->sysmem);
+            if (QLIST_EMPTY(&smmu_nested_instances)) {
+                smmu_nested_as_init();
+            }
+            QLIST_INSERT_HEAD(&smmu_nested_instances, s, nested_next);
         }
     }
 
@@ -1047,7 +1389,7 @@ static void smmu_base_reset_hold(Object *obj)
     memset(s->smmu_pcibus_by_bus_num, 0, sizeof(s->smmu_pcibus_by_bus_num));
 
     g_hash_table_remove_all(s->configs);
-    g_hash_table_remove_all(s->iotlb);
+    smmu_iotlb_remove_all(s);
 }
 
 static Property smmu_dev_properties[] = {
@@ -1058,6 +1400,7 @@ static Property smmu_dev_properties[] = {
                      TYPE_IOMMUFD_BACKEND, IOMMUFDBackend *),
     DEFINE_PROP_BOOL("nested", SMMUState, nested, false),
     DEFINE_PROP_BOOL("cmdqv", SMMUState, has_cmdqv, false),
+    DEFINE_PROP_BOOL("shared-s2-hwpt", SMMUState, shared_s2_hwpt, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
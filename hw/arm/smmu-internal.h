@@ -131,15 +131,47 @@ static inline int pgd_concat_idx(int start_level, int granule_sz,
     return ret;
 }
 
-#define SMMU_IOTLB_ASID(key) ((key).asid)
-#define SMMU_IOTLB_VMID(key) ((key).vmid)
+/*
+ * IOTLB entries of a given (asid, vmid), indexed by the IOVA range they
+ * translate, so that invalidations only visit the entries they affect
+ */
+struct SMMUIOTLBBucket {
+    uint16_t asid;
+    uint16_t vmid;
+    uint32_t nr_entries;
+    IntervalTreeRoot ranges;
+};
+
+#define SMMU_IOTLB_BUCKET_KEY(asid, vmid) \
+    GUINT_TO_POINTER((uint32_t)(asid) << 16 | (vmid))
 
-typedef struct SMMUIOTLBPageInvInfo {
+/*
+ * Page table walk cache: caches the table at @level translating @iova, as
+ * pointed to by a table descriptor of the walk starting from @ttb
+ */
+typedef struct SMMUPTWCacheKey {
+    uint64_t iova;
+    uint64_t ttb;
+    uint16_t asid;
+    uint16_t vmid;
+    uint8_t stage;
+    uint8_t level;
+    uint8_t granule_sz;
+} SMMUPTWCacheKey;
+
+typedef struct SMMUPTWCacheEntry {
+    SMMUPTWCacheKey key;
+    uint64_t mask;      /* range of IOVAs translated by the table */
+    dma_addr_t table;   /* base address of the table */
+    uint8_t ap;         /* APTable restrictions accumulated by the walk */
+} SMMUPTWCacheEntry;
+
+typedef struct SMMUPTWCacheInvInfo {
     int asid;
     int vmid;
     uint64_t iova;
-    uint64_t mask;
-} SMMUIOTLBPageInvInfo;
+    uint64_t last;
+} SMMUPTWCacheInvInfo;
 
 typedef struct SMMUSIDRange {
     SMMUState *state;
@@ -29,6 +29,7 @@
 #include "qemu/log.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
+#include "qemu/main-loop.h"
 
 #include "hw/arm/smmuv3.h"
 #include "smmuv3-internal.h"
@@ -1030,7 +1031,7 @@ static IOMMUTLBEntry smmuv3_translate(IOMMUMemoryRegion *mr, hwaddr addr,
 
     cached_entry = g_new0(SMMUTLBEntry, 1);
 
-    if (smmu_ptw(cfg, aligned_addr, flag, cached_entry, &ptw_info)) {
+    if (smmu_ptw(bs, cfg, aligned_addr, flag, cached_entry, &ptw_info)) {
         /* All faults from PTW has S2 field. */
         event.u.f_walk_eabt.s2 = (ptw_info.stage == 2);
         g_free(cached_entry);
@@ -1175,10 +1176,10 @@ static void smmuv3_notify_iova(IOMMUMemoryRegion *mr,
     event.type = IOMMU_NOTIFIER_UNMAP;
     event.entry.target_as = &address_space_memory;
     event.entry.iova = iova;
-    event.entry.addr_mask = num_pages * (1 << granule) - 1;
+    event.entry.addr_mask = (num_pages << granule) - 1;
     event.entry.perm = IOMMU_NONE;
 
-    memory_region_notify_iommu_one(n, &event);
+    memory_region_notify_iommu_range_one(n, &event);
 }
 
 /* invalidate an asid/vmid/iova range tuple in all mr's */
@@ -1203,7 +1204,7 @@ static void smmuv3_inv_notifiers_iova(SMMUState *s, int asid, int vmid,
 
 static void smmuv3_range_inval(SMMUState *s, Cmd *cmd)
 {
-    dma_addr_t end, addr = CMD_ADDR(cmd);
+    dma_addr_t addr = CMD_ADDR(cmd);
     uint8_t type = CMD_TYPE(cmd);
     int vmid = -1;
     uint8_t scale = CMD_SCALE(cmd);
@@ -1212,7 +1213,6 @@ static void smmuv3_range_inval(SMMUState *s, Cmd *cmd)
     bool leaf = CMD_LEAF(cmd);
     uint8_t tg = CMD_TG(cmd);
     uint64_t num_pages;
-    uint8_t granule;
     int asid = -1;
     SMMUv3State *smmuv3 = ARM_SMMUV3(s);
 
@@ -1235,20 +1235,14 @@ static void smmuv3_range_inval(SMMUState *s, Cmd *cmd)
     /* RIL in use */
 
     num_pages = (num + 1) * BIT_ULL(scale);
-    granule = tg * 2 + 10;
-
-    /* Split invalidations into ^2 range invalidations */
-    end = addr + (num_pages << granule) - 1;
 
-    while (addr != end + 1) {
-        uint64_t mask = dma_aligned_pow2_mask(addr, end, 64);
-
-        num_pages = (mask + 1) >> granule;
-        trace_smmuv3_range_inval(vmid, asid, addr, tg, num_pages, ttl, leaf);
-        smmuv3_inv_notifiers_iova(s, asid, vmid, addr, tg, num_pages);
-        smmu_iotlb_inv_iova(s, asid, vmid, addr, tg, num_pages, ttl);
-        addr += mask + 1;
-    }
+    /*
+     * Neither the notifiers, which split the range as they need, nor the
+     * range indexed IOTLB need power of two invalidations.
+     */
+    trace_smmuv3_range_inval(vmid, asid, addr, tg, num_pages, ttl, leaf);
+    smmuv3_inv_notifiers_iova(s, asid, vmid, addr, tg, num_pages);
+    smmu_iotlb_inv_iova(s, asid, vmid, addr, tg, num_pages, ttl);
 }
 
 static void smmuv3_install_nested_ste(SMMUDevice *sdev, int sid)
@@ -1330,30 +1324,36 @@ smmuv3_invalidate_ste(gpointer key, gpointer value, gpointer user_data)
     return true;
 }
 
+/**
+ * SMMUCommandOwner - target of a batched invalidation command
+ * @s2_hwpt: s2_hwpt the TLBI command applies to, NULL to broadcast across
+ * @sdev: device whose cache the command applies to, NULL for a TLBI command
+ */
+typedef struct SMMUCommandOwner {
+    SMMUS2Hwpt *s2_hwpt;
+    SMMUDevice *sdev;
+} SMMUCommandOwner;
+
 /**
  * SMMUCommandBatch - batch of commands to issue for nested SMMU invalidation
  * @cmds: Pointer to list of commands
  * @cons: Pointer to list of CONS corresponding to the commands
+ * @owners: Pointer to list of owners corresponding to the commands
+ * @scratch: Pointer to a list of commands being issued to a single owner
  * @ncmds: Total ncmds in the batch
- * @owner: Current onwer of the batch. NULL means broadcast across.
- * @dev_cache: Issue to a device cache
  */
 typedef struct SMMUCommandBatch {
     Cmd *cmds;
     uint32_t *cons;
+    SMMUCommandOwner *owners;
+    Cmd *scratch;
     uint32_t ncmds;
-    union {
-        SMMUS2Hwpt *s2_hwpt;
-        SMMUDevice *sdev;
-    } owner;
-    bool dev_cache;
 } SMMUCommandBatch;
 
-/* Update batch->ncmds to the number of execute cmds */
 static int smmuv3_hwpt_invalidate_cache(SMMUS2Hwpt *s2_hwpt,
-                                        SMMUCommandBatch *batch)
+                                        Cmd *cmds, uint32_t ncmds)
 {
-    uint32_t total = batch->ncmds;
+    uint32_t total = ncmds;
     SMMUDevice *sdev = NULL;
     int ret = 0;
 
@@ -1375,71 +1375,270 @@ static int smmuv3_hwpt_invalidate_cache(SMMUS2Hwpt *s2_hwpt,
     }
 
     ret = smmu_hwpt_invalidate_cache(sdev->s1_hwpt, IOMMU_HWPT_DATA_ARM_SMMUV3,
-                                     sizeof(Cmd), &batch->ncmds, batch->cmds);
-    if (total != batch->ncmds) {
+                                     sizeof(Cmd), &ncmds, cmds);
+    if (total != ncmds) {
         error_report("%s failed: ret=%d, total=%d, done=%d",
-                      __func__, ret, total, batch->ncmds);
+                      __func__, ret, total, ncmds);
     }
     return ret;
 }
 
-/* Broadcast to all physical SMMUs via s2_hwpts */
-static int smmuv3_hwpt_invalidate_cache_all(SMMUState *bs,
-                                            SMMUCommandBatch *batch)
+static int smmuv3_dev_invalidate_cache(SMMUDevice *sdev,
+                                       Cmd *cmds, uint32_t ncmds)
 {
-    SMMUS2Hwpt *s2_hwpt;
+    uint32_t total = ncmds;
     int ret = 0;
 
-    if (!bs->nested) {
-        return 0;
-    }
-
-    QLIST_FOREACH(s2_hwpt, &bs->s2_hwpt_list, next) {
-        ret = smmuv3_hwpt_invalidate_cache(s2_hwpt, batch);
-        if (ret) {
-            return ret;
-        }
+    ret = smmu_dev_invalidate_cache(sdev, IOMMU_DEV_INVALIDATE_DATA_ARM_SMMUV3,
+                                    sizeof(Cmd), &ncmds, cmds);
+    if (total != ncmds) {
+        error_report("%s failed: ret=%d, total=%d, done=%d",
+                      __func__, ret, total, ncmds);
     }
     return ret;
 }
 
-static int smmuv3_dev_invalidate_cache(SMMUDevice *sdev, SMMUCommandBatch *batch)
+/* Range of a TLBI_NH_VA(A) command with TG set, in granule sized pages */
+static void smmuv3_cmd_range(Cmd *cmd, uint64_t *first, uint64_t *last)
 {
-    uint32_t total = batch->ncmds;
-    int ret = 0;
+    uint8_t granule = CMD_TG(cmd) * 2 + 10;
 
-    ret = smmu_dev_invalidate_cache(sdev, IOMMU_DEV_INVALIDATE_DATA_ARM_SMMUV3,
-                                    sizeof(Cmd), &batch->ncmds, batch->cmds);
-    if (total != batch->ncmds) {
-        error_report("%s failed: ret=%d, total=%d, done=%d",
-                      __func__, ret, total, batch->ncmds);
+    *first = CMD_ADDR(cmd) >> granule;
+    *last = *first + (CMD_NUM(cmd) + 1) * BIT_ULL(CMD_SCALE(cmd)) - 1;
+}
+
+/*
+ * Merge the range invalidation @cmd into @dst when both apply to the same
+ * ASID/VMID with the same granule and the ranges overlap or are adjacent.
+ * The merged range is rounded up to what NUM and SCALE can encode, which
+ * only over-invalidates.
+ */
+static bool smmuv3_merge_range_cmd(Cmd *dst, Cmd *cmd)
+{
+    uint8_t tg = CMD_TG(dst), granule = tg * 2 + 10;
+    uint64_t first, last, cmd_first, cmd_last, pages, addr;
+    uint8_t scale;
+
+    if (CMD_TYPE(dst) != CMD_TYPE(cmd) || dst->word[1] != cmd->word[1] ||
+        !tg || tg != CMD_TG(cmd)) {
+        return false;
     }
-    return ret;
+
+    smmuv3_cmd_range(dst, &first, &last);
+    smmuv3_cmd_range(cmd, &cmd_first, &cmd_last);
+    if (cmd_first > last + 1 || first > cmd_last + 1) {
+        return false;
+    }
+
+    first = MIN(first, cmd_first);
+    last = MAX(last, cmd_last);
+    pages = last - first + 1;
+    for (scale = 0; DIV_ROUND_UP(pages, BIT_ULL(scale)) > 32; scale++) {
+        if (scale == 31) {
+            return false;
+        }
+    }
+
+    addr = first << granule;
+    dst->word[0] = deposit32(dst->word[0], 12, 5,
+                             DIV_ROUND_UP(pages, BIT_ULL(scale)) - 1);
+    dst->word[0] = deposit32(dst->word[0], 20, 5, scale);
+    dst->word[2] = deposit32(dst->word[2], 12, 20, addr >> 12);
+    dst->word[3] = addr >> 32;
+    if (CMD_TTL(dst) != CMD_TTL(cmd)) {
+        dst->word[2] = deposit32(dst->word[2], 8, 2, 0);
+    }
+    if (!CMD_LEAF(cmd)) {
+        dst->word[2] = deposit32(dst->word[2], 0, 1, 0);
+    }
+    return true;
 }
 
-static int _smmuv3_issue_cmd_batch(SMMUState *bs, SMMUCommandBatch *batch)
+#define SMMU_ASID_PENDING   GINT_TO_POINTER(1)
+#define SMMU_ASID_ISSUED    GINT_TO_POINTER(2)
+
+/*
+ * Coalesce the TLBI commands to issue to a single s2_hwpt, in place:
+ *  - a TLBI_NH_ALL or TLBI_NSNH_ALL supersedes every other command
+ *  - above the inv-coalesce-threshold, range invalidations are upgraded to
+ *    invalidations by ASID, or to a TLBI_NH_ALL if some don't match an ASID
+ *  - a TLBI_NH_VA is dropped if its ASID is invalidated by the batch
+ *  - duplicated TLBI_NH_ASID commands are dropped
+ *  - consecutive overlapping or adjacent range invalidations are merged
+ * Returns the number of commands left.
+ */
+static uint32_t smmuv3_coalesce_hwpt_cmds(SMMUv3State *s, Cmd *cmds,
+                                          uint32_t ncmds)
 {
-    if (batch->dev_cache) {
-        return smmuv3_dev_invalidate_cache(batch->owner.sdev, batch);
-    } else if (batch->owner.s2_hwpt) {
-        return smmuv3_hwpt_invalidate_cache(batch->owner.s2_hwpt, batch);
-    } else {
-        return smmuv3_hwpt_invalidate_cache_all(bs, batch);
+    g_autoptr(GHashTable) asids = NULL;
+    uint32_t i, n = 0, nranges = 0;
+    Cmd *last_range = NULL;
+    int all = -1;
+    bool vaa = false;
+
+    for (i = 0; i < ncmds; i++) {
+        switch (CMD_TYPE(&cmds[i])) {
+        case SMMU_CMD_TLBI_NSNH_ALL:
+            all = i;
+            break;
+        case SMMU_CMD_TLBI_NH_ALL:
+            if (all < 0) {
+                all = i;
+            }
+            break;
+        case SMMU_CMD_TLBI_NH_VAA:
+            vaa = true;
+            QEMU_FALLTHROUGH;
+        case SMMU_CMD_TLBI_NH_VA:
+            nranges++;
+            break;
+        case SMMU_CMD_TLBI_NH_ASID:
+            if (!asids) {
+                asids = g_hash_table_new(NULL, NULL);
+            }
+            g_hash_table_insert(asids, GUINT_TO_POINTER(CMD_ASID(&cmds[i])),
+                                SMMU_ASID_PENDING);
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (all < 0 && s->inv_coalesce_threshold &&
+        nranges > s->inv_coalesce_threshold) {
+        s->inv_stats.upgrades++;
+        if (vaa) {
+            memset(&cmds[0], 0, sizeof(Cmd));
+            cmds[0].word[0] = SMMU_CMD_TLBI_NH_ALL;
+            return 1;
+        }
+        for (i = 0; i < ncmds; i++) {
+            if (CMD_TYPE(&cmds[i]) == SMMU_CMD_TLBI_NH_VA) {
+                cmds[i].word[0] = SMMU_CMD_TLBI_NH_ASID;
+                cmds[i].word[2] = 0;
+                cmds[i].word[3] = 0;
+            }
+        }
+    }
+
+    if (all >= 0) {
+        cmds[0] = cmds[all];
+        return 1;
+    }
+
+    for (i = 0; i < ncmds; i++) {
+        Cmd *cmd = &cmds[i];
+        gpointer asid = GUINT_TO_POINTER(CMD_ASID(cmd));
+
+        switch (CMD_TYPE(cmd)) {
+        case SMMU_CMD_TLBI_NH_ASID:
+            if (!asids) {
+                asids = g_hash_table_new(NULL, NULL);
+            }
+            if (g_hash_table_lookup(asids, asid) == SMMU_ASID_ISSUED) {
+                continue;
+            }
+            g_hash_table_insert(asids, asid, SMMU_ASID_ISSUED);
+            break;
+        case SMMU_CMD_TLBI_NH_VA:
+            if (asids && g_hash_table_contains(asids, asid)) {
+                continue;
+            }
+            QEMU_FALLTHROUGH;
+        case SMMU_CMD_TLBI_NH_VAA:
+            if (last_range && smmuv3_merge_range_cmd(last_range, cmd)) {
+                continue;
+            }
+            last_range = &cmds[n];
+            break;
+        default:
+            break;
+        }
+        cmds[n++] = *cmd;
     }
+    return n;
 }
 
-static int smmuv3_issue_cmd_batch(SMMUState *bs, SMMUCommandBatch *batch)
+/*
+ * Issue the batched commands: one invalidation per s2_hwpt, i.e. per VMID
+ * of a physical SMMU, carrying its own commands with the broadcast ones,
+ * then one invalidation per device cache. SMMU commands only need to be
+ * complete at the next CMD_SYNC, so they needn't be issued in queue order.
+ *
+ * As invalidations are idempotent, CONS is rewound to the first command of
+ * the batch on failure.
+ */
+static int smmuv3_issue_cmd_batch(SMMUv3State *s, SMMUCommandBatch *batch,
+                                  uint32_t *cons)
 {
-    int ret;
+    SMMUState *bs = ARM_SMMU(s);
+    uint32_t nissued = 0, nioctls = 0;
+    SMMUS2Hwpt *s2_hwpt;
+    uint32_t i, j, n;
+    int ret = 0;
+
+    if (!batch->ncmds) {
+        return 0;
+    }
+
+    if (bs->nested) {
+        QLIST_FOREACH(s2_hwpt, &bs->s2_hwpt_list, next) {
+            for (i = 0, n = 0; i < batch->ncmds; i++) {
+                SMMUCommandOwner *owner = &batch->owners[i];
+
+                if (!owner->sdev &&
+                    (!owner->s2_hwpt || owner->s2_hwpt == s2_hwpt)) {
+                    batch->scratch[n++] = batch->cmds[i];
+                }
+            }
+            n = smmuv3_coalesce_hwpt_cmds(s, batch->scratch, n);
+            if (!n) {
+                continue;
+            }
+            nissued += n;
+            nioctls++;
+            ret = smmuv3_hwpt_invalidate_cache(s2_hwpt, batch->scratch, n);
+            if (ret) {
+                goto out;
+            }
+        }
+    }
+
+    for (i = 0; i < batch->ncmds; i++) {
+        SMMUDevice *sdev = batch->owners[i].sdev;
 
-    ret = _smmuv3_issue_cmd_batch(bs, batch);
+        if (!sdev) {
+            continue;
+        }
+        for (j = i, n = 0; j < batch->ncmds; j++) {
+            if (batch->owners[j].sdev != sdev) {
+                continue;
+            }
+            /* Mark as issued, skipping commands identical to the last one */
+            batch->owners[j].sdev = NULL;
+            if (n && !memcmp(&batch->scratch[n - 1], &batch->cmds[j],
+                             sizeof(Cmd))) {
+                continue;
+            }
+            batch->scratch[n++] = batch->cmds[j];
+        }
+        nissued += n;
+        nioctls++;
+        ret = smmuv3_dev_invalidate_cache(sdev, batch->scratch, n);
+        if (ret) {
+            goto out;
+        }
+    }
+
+out:
+    trace_smmuv3_issue_cmd_batch(batch->ncmds, nissued, nioctls, ret);
+    s->inv_stats.cmds += batch->ncmds;
+    s->inv_stats.issued += nissued;
+    s->inv_stats.ioctls += nioctls;
     if (ret) {
-        return ret;
+        *cons = batch->cons[0];
     }
     batch->ncmds = 0;
-    batch->dev_cache = false;
-    batch->owner.sdev = NULL;
-    batch->owner.s2_hwpt = NULL;
     return ret;
 }
 
@@ -1463,17 +1662,15 @@ static SMMUS1Hwpt *smmuv3_find_s1hwpt_by_asid(SMMUState *bs, uint16_t asid)
     return NULL;
 }
 
-/**
- * Add a new HWPT/TLBI command with the current CONS index to the batch
- *  - If the new cmd isn't compatible with the batch, consume the batch first
- *  - If the batch executing fails, rewind the CONS index
+/*
+ * Add a new HWPT/TLBI command with the current CONS index to the batch. It
+ * is issued, coalesced with the other commands to the same s2_hwpt, by the
+ * next smmuv3_issue_cmd_batch().
  */
-static int smmuv3_hwpt_batch_cmds(SMMUState *bs, SMMUCommandBatch *batch,
-                                  Cmd *cmd, uint32_t *cons)
+static void smmuv3_hwpt_batch_cmds(SMMUState *bs, SMMUCommandBatch *batch,
+                                   Cmd *cmd, uint32_t cons)
 {
-    SMMUS2Hwpt *s2_hwpt = NULL;
     SMMUS1Hwpt *s1_hwpt = NULL;
-    int ret;
 
     switch (CMD_TYPE(cmd)) {
     case SMMU_CMD_TLBI_NH_ASID:
@@ -1493,49 +1690,33 @@ static int smmuv3_hwpt_batch_cmds(SMMUState *bs, SMMUCommandBatch *batch,
         break;
     }
 
-    if (s1_hwpt) {
-        s2_hwpt = s1_hwpt->s2_hwpt;
-    }
-
-    if (batch->ncmds && (batch->dev_cache || s2_hwpt != batch->owner.s2_hwpt)) {
-        ret = smmuv3_issue_cmd_batch(bs, batch);
-        if (ret) {
-            *cons = batch->cons[batch->ncmds];
-            return ret;
-        }
-    }
-    batch->dev_cache = false;
-    batch->owner.s2_hwpt = s2_hwpt;
+    batch->owners[batch->ncmds].s2_hwpt = s1_hwpt ? s1_hwpt->s2_hwpt : NULL;
+    batch->owners[batch->ncmds].sdev = NULL;
     batch->cmds[batch->ncmds] = *cmd;
-    batch->cons[batch->ncmds++] = *cons;
-    return 0;
+    batch->cons[batch->ncmds++] = cons;
 }
 
-/**
- * Add a new device command with the current CONS index to the batch
- *  - If the new cmd isn't compatible with the batch, consume the batch first
- *  - If the batch executing fails, rewind the CONS index
- */
-static int smmuv3_batch_dev_cmds(SMMUDevice *sdev, SMMUCommandBatch *batch,
-                                 Cmd *cmd, uint32_t *cons)
+/* Add a new device command with the current CONS index to the batch */
+static void smmuv3_batch_dev_cmds(SMMUDevice *sdev, SMMUCommandBatch *batch,
+                                  Cmd *cmd, uint32_t cons)
 {
-    int ret;
-
-    if (batch->ncmds && (!batch->dev_cache || sdev != batch->owner.sdev)) {
-        ret = smmuv3_issue_cmd_batch(sdev->smmu, batch);
-        if (ret) {
-            *cons = batch->cons[batch->ncmds];
-            return ret;
-        }
-    }
-    batch->dev_cache = true;
-    batch->owner.sdev = sdev;
+    batch->owners[batch->ncmds].s2_hwpt = NULL;
+    batch->owners[batch->ncmds].sdev = sdev;
     batch->cmds[batch->ncmds] = *cmd;
-    batch->cons[batch->ncmds++] = *cons;
-    return 0;
+    batch->cons[batch->ncmds++] = cons;
 }
 
-static int smmuv3_cmdq_consume(SMMUv3State *s)
+/*
+ * Maximum number of commands consumed per run of the command queue bottom
+ * half, so that a TLBI storm doesn't hold the BQL for too long at once.
+ */
+#define SMMU_CMDQ_ASYNC_BUDGET 256
+
+/*
+ * Consume up to @budget commands, or all the pending ones if @budget is 0.
+ * Returns true if commands are left in the queue.
+ */
+static bool smmuv3_cmdq_consume(SMMUv3State *s, uint32_t budget)
 {
     SMMUState *bs = ARM_SMMU(s);
     SMMUCmdError cmd_error = SMMU_CERROR_NONE;
@@ -1543,14 +1724,20 @@ static int smmuv3_cmdq_consume(SMMUv3State *s)
     SMMUCommandType type = 0;
     SMMUCommandBatch batch = {};
     uint32_t ncmds = 0;
+    bool more;
 
     if (!smmuv3_cmdq_enabled(s)) {
-        return 0;
+        return false;
     }
 
     ncmds = smmuv3_q_ncmds(q);
+    if (budget && ncmds > budget) {
+        ncmds = budget;
+    }
     batch.cmds = g_new0(Cmd, ncmds);
     batch.cons = g_new0(uint32_t, ncmds);
+    batch.owners = g_new0(SMMUCommandOwner, ncmds);
+    batch.scratch = g_new0(Cmd, ncmds);
 
     /*
      * some commands depend on register values, typically CR0. In case those
@@ -1559,7 +1746,7 @@ static int smmuv3_cmdq_consume(SMMUv3State *s)
      * or old value.
      */
 
-    while (!smmuv3_q_empty(q)) {
+    while (!smmuv3_q_empty(q) && ncmds--) {
         uint32_t pending = s->gerror ^ s->gerrorn;
         Cmd cmd;
 
@@ -1582,6 +1769,15 @@ static int smmuv3_cmdq_consume(SMMUv3State *s)
         qemu_mutex_lock(&s->mutex);
         switch (type) {
         case SMMU_CMD_SYNC:
+            /*
+             * Complete the invalidations batched so far before the guest may
+             * observe the SYNC as consumed, which matters when the queue is
+             * consumed asynchronously to the CMDQ_PROD write.
+             */
+            if (smmuv3_issue_cmd_batch(s, &batch, &q->cons)) {
+                cmd_error = SMMU_CERROR_ILL;
+                break;
+            }
             if (CMD_SYNC_CS(&cmd) & CMD_SYNC_SIG_IRQ) {
                 smmuv3_trigger_irq(s, SMMU_IRQ_CMD_SYNC, 0);
             }
@@ -1603,6 +1799,12 @@ static int smmuv3_cmdq_consume(SMMUv3State *s)
                 break;
             }
 
+            /* The batch may refer to the hwpts that the STE update frees */
+            if (smmuv3_issue_cmd_batch(s, &batch, &q->cons)) {
+                cmd_error = SMMU_CERROR_ILL;
+                break;
+            }
+
             trace_smmuv3_cmdq_cfgi_ste(sid);
             smmuv3_flush_config(sdev);
             smmuv3_install_nested_ste(sdev, sid);
@@ -1625,6 +1827,11 @@ static int smmuv3_cmdq_consume(SMMUv3State *s)
             sid_range.start = sid & ~mask;
             sid_range.end = sid_range.start + mask;
 
+            if (smmuv3_issue_cmd_batch(s, &batch, &q->cons)) {
+                cmd_error = SMMU_CERROR_ILL;
+                break;
+            }
+
             trace_smmuv3_cmdq_cfgi_ste_range(sid_range.start, sid_range.end);
             g_hash_table_foreach_remove(bs->configs, smmuv3_invalidate_ste,
                                         &sid_range);
@@ -1649,10 +1856,7 @@ static int smmuv3_cmdq_consume(SMMUv3State *s)
             smmuv3_flush_config(sdev);
 
             if (sdev->s1_hwpt) {
-                if (smmuv3_batch_dev_cmds(sdev, &batch, &cmd, &q->cons)) {
-                    cmd_error = SMMU_CERROR_ILL;
-                    break;
-                }
+                smmuv3_batch_dev_cmds(sdev, &batch, &cmd, q->cons);
             }
             break;
         }
@@ -1669,10 +1873,7 @@ static int smmuv3_cmdq_consume(SMMUv3State *s)
             smmu_inv_notifiers_all(&s->smmu_state);
             smmu_iotlb_inv_asid(bs, asid);
 
-            if (smmuv3_hwpt_batch_cmds(bs, &batch, &cmd, &q->cons)) {
-                cmd_error = SMMU_CERROR_ILL;
-                break;
-            }
+            smmuv3_hwpt_batch_cmds(bs, &batch, &cmd, q->cons);
             break;
         }
         case SMMU_CMD_TLBI_NH_ALL:
@@ -1686,10 +1887,7 @@ static int smmuv3_cmdq_consume(SMMUv3State *s)
             smmu_inv_notifiers_all(&s->smmu_state);
             smmu_iotlb_inv_all(bs);
 
-            if (smmuv3_hwpt_batch_cmds(bs, &batch, &cmd, &q->cons)) {
-                cmd_error = SMMU_CERROR_ILL;
-                break;
-            }
+            smmuv3_hwpt_batch_cmds(bs, &batch, &cmd, q->cons);
             break;
         case SMMU_CMD_TLBI_NH_VAA:
         case SMMU_CMD_TLBI_NH_VA:
@@ -1699,20 +1897,14 @@ static int smmuv3_cmdq_consume(SMMUv3State *s)
             }
             smmuv3_range_inval(bs, &cmd);
 
-            if (smmuv3_hwpt_batch_cmds(bs, &batch, &cmd, &q->cons)) {
-                cmd_error = SMMU_CERROR_ILL;
-                break;
-            }
+            smmuv3_hwpt_batch_cmds(bs, &batch, &cmd, q->cons);
             break;
         case SMMU_CMD_ATC_INV:
         {
             SMMUDevice *sdev = smmu_find_sdev(bs, CMD_SID(&cmd));
 
             if (sdev->s1_hwpt) {
-                if (smmuv3_batch_dev_cmds(sdev, &batch, &cmd, &q->cons)) {
-                    cmd_error = SMMU_CERROR_ILL;
-                    break;
-                }
+                smmuv3_batch_dev_cmds(sdev, &batch, &cmd, q->cons);
             }
             break;
         }
@@ -1772,9 +1964,8 @@ static int smmuv3_cmdq_consume(SMMUv3State *s)
         queue_cons_incr(q);
     }
     qemu_mutex_lock(&s->mutex);
-    if (!cmd_error && batch.ncmds) {
-        if (smmuv3_issue_cmd_batch(bs, &batch)) {
-            q->cons = batch.cons[batch.ncmds];
+    if (!cmd_error) {
+        if (smmuv3_issue_cmd_batch(s, &batch, &q->cons)) {
             cmd_error = SMMU_CERROR_ILL;
         }
     }
@@ -1787,11 +1978,39 @@ static int smmuv3_cmdq_consume(SMMUv3State *s)
     }
     g_free(batch.cmds);
     g_free(batch.cons);
+    g_free(batch.owners);
+    g_free(batch.scratch);
+
+    more = !cmd_error && !smmuv3_q_empty(q);
 
     trace_smmuv3_cmdq_consume_out(Q_PROD(q), Q_CONS(q),
                                   Q_PROD_WRAP(q), Q_CONS_WRAP(q));
 
-    return 0;
+    return more;
+}
+
+static void smmuv3_cmdq_bh(void *opaque)
+{
+    SMMUv3State *s = opaque;
+
+    if (smmuv3_cmdq_consume(s, SMMU_CMDQ_ASYNC_BUDGET)) {
+        qemu_bh_schedule(s->cmdq_bh);
+    }
+}
+
+/*
+ * Called when the guest may have made new commands available. With
+ * x-async-cmdq, the queue is consumed from a bottom half so that the vCPU
+ * writing CMDQ_PROD returns right away; the guest learns about completion
+ * through CONS or the CMD_SYNC interrupt, as with real hardware.
+ */
+static void smmuv3_cmdq_kick(SMMUv3State *s)
+{
+    if (s->cmdq_bh) {
+        qemu_bh_schedule(s->cmdq_bh);
+    } else {
+        smmuv3_cmdq_consume(s, 0);
+    }
 }
 
 static MemTxResult smmu_writell(SMMUv3State *s, hwaddr offset,
@@ -1837,7 +2056,7 @@ static MemTxResult smmu_writel(SMMUv3State *s, hwaddr offset,
         s->cr[0] = data;
         s->cr0ack = data & ~SMMU_CR0_RESERVED;
         /* in case the command queue has been enabled */
-        smmuv3_cmdq_consume(s);
+        smmuv3_cmdq_kick(s);
         return MEMTX_OK;
     case A_CR1:
         s->cr[1] = data;
@@ -1854,7 +2073,7 @@ static MemTxResult smmu_writel(SMMUv3State *s, hwaddr offset,
          * By acknowledging the CMDQ_ERR, SW may notify cmds can
          * be processed again
          */
-        smmuv3_cmdq_consume(s);
+        smmuv3_cmdq_kick(s);
         return MEMTX_OK;
     case A_GERROR_IRQ_CFG0: /* 64b */
         s->gerror_irq_cfg0 = deposit64(s->gerror_irq_cfg0, 0, 32, data);
@@ -1903,7 +2122,7 @@ static MemTxResult smmu_writel(SMMUv3State *s, hwaddr offset,
         return MEMTX_OK;
     case A_CMDQ_PROD:
         s->cmdq.prod = data;
-        smmuv3_cmdq_consume(s);
+        smmuv3_cmdq_kick(s);
         return MEMTX_OK;
     case A_CMDQ_CONS:
         s->cmdq.cons = data;
@@ -2151,6 +2370,9 @@ static void smmu_reset_hold(Object *obj)
         c->parent_phases.hold(obj);
     }
 
+    if (s->cmdq_bh) {
+        qemu_bh_cancel(s->cmdq_bh);
+    }
     smmuv3_init_regs(s);
 }
 
@@ -2175,6 +2397,11 @@ static void smmu_realize(DeviceState *d, Error **errp)
 
     qemu_mutex_init(&s->mutex);
 
+    if (s->async_cmdq) {
+        s->cmdq_bh = qemu_bh_new_guarded(smmuv3_cmdq_bh, s,
+                                         &d->mem_reentrancy_guard);
+    }
+
     memory_region_init_io(&sys->iomem, OBJECT(s),
                           &smmu_mem_ops, sys, TYPE_ARM_SMMUV3, 0x20000);
 
@@ -2217,11 +2444,24 @@ static const VMStateDescription vmstate_gbpa = {
     }
 };
 
+static int smmuv3_post_load(void *opaque, int version_id)
+{
+    SMMUv3State *s = opaque;
+
+    /* Commands may have been pending when the source stopped */
+    if (s->cmdq_bh) {
+        qemu_bh_schedule(s->cmdq_bh);
+    }
+
+    return 0;
+}
+
 static const VMStateDescription vmstate_smmuv3 = {
     .name = "smmuv3",
     .version_id = 1,
     .minimum_version_id = 1,
     .priority = MIG_PRI_IOMMU,
+    .post_load = smmuv3_post_load,
     .fields = (const VMStateField[]) {
         VMSTATE_UINT32(features, SMMUv3State),
         VMSTATE_UINT8(sid_size, SMMUv3State),
@@ -2261,12 +2501,33 @@ static Property smmuv3_properties[] = {
      * Defaults to stage 1
      */
     DEFINE_PROP_STRING("stage", SMMUv3State, stage),
+    /*
+     * Consume the command queue asynchronously to the CMDQ_PROD writes,
+     * in bounded slices from a bottom half.
+     */
+    DEFINE_PROP_BOOL("x-async-cmdq", SMMUv3State, async_cmdq, false),
+    /*
+     * Number of range invalidations to a nested s2_hwpt above which they are
+     * upgraded to invalidations by ASID, or of the whole VMID. 0 disables it
+     */
+    DEFINE_PROP_UINT32("x-inv-coalesce-threshold", SMMUv3State,
+                       inv_coalesce_threshold, 64),
     DEFINE_PROP_END_OF_LIST()
 };
 
 static void smmuv3_instance_init(Object *obj)
 {
-    /* Nothing much to do here as of now */
+    SMMUv3State *s = ARM_SMMUV3(obj);
+
+    /* Nested invalidation statistics, to tune x-inv-coalesce-threshold */
+    object_property_add_uint64_ptr(obj, "x-inv-stats-cmds",
+                                   &s->inv_stats.cmds, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "x-inv-stats-issued",
+                                   &s->inv_stats.issued, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "x-inv-stats-ioctls",
+                                   &s->inv_stats.ioctls, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "x-inv-stats-upgrades",
+                                   &s->inv_stats.upgrades, OBJ_PROP_FLAG_READ);
 }
 
 static void smmuv3_class_init(ObjectClass *klass, void *data)
@@ -116,40 +116,60 @@ static uint64_t tegra241_cmdqv_read_vintf(Tegra241CMDQV *s, hwaddr offset)
     return 0;
 }
 
+/*
+ * Returns the VCMDQ page0 register backing @offset of queue @index, or NULL
+ * if the page is not mapped yet, in which case the register cache is used.
+ * Note that offset aligns down to 0x10000
+ */
+static uint32_t *tegra241_cmdqv_vcmdq_reg(Tegra241CMDQV *s, hwaddr offset,
+                                          int index)
+{
+    if (!s->vcmdq_page0) {
+        return NULL;
+    }
+    return (uint32_t *)(s->vcmdq_page0 + 0x80 * index + offset - 0x10000);
+}
+
 /* Note that offset aligns down to 0x10000 */
 static uint64_t tegra241_cmdqv_read_vcmdq(Tegra241CMDQV *s, hwaddr offset, int index)
 {
-    uint32_t *ptr;
+    uint32_t *ptr = tegra241_cmdqv_vcmdq_reg(s, offset, index);
 
     switch (offset) {
     case A_VCMDQ0_CONS_INDX:
-        ptr = (uint32_t *)(s->vcmdq_page0 + 0x80 * index + offset - 0x10000);
-        s->vcmdq_cons_indx[index] = *ptr;
+        if (ptr) {
+            s->vcmdq_cons_indx[index] = *ptr;
+        }
         return s->vcmdq_cons_indx[index];
 
     case A_VCMDQ0_PROD_INDX:
-        ptr = (uint32_t *)(s->vcmdq_page0 + 0x80 * index + offset - 0x10000);
-        s->vcmdq_prod_indx[index] = *ptr;
+        if (ptr) {
+            s->vcmdq_prod_indx[index] = *ptr;
+        }
         return s->vcmdq_prod_indx[index];
 
     case A_VCMDQ0_CONFIG:
-        ptr = (uint32_t *)(s->vcmdq_page0 + 0x80 * index + offset - 0x10000);
-        s->vcmdq_config[index] = *ptr;
+        if (ptr) {
+            s->vcmdq_config[index] = *ptr;
+        }
         return s->vcmdq_config[index];
 
     case A_VCMDQ0_STATUS:
-        ptr = (uint32_t *)(s->vcmdq_page0 + 0x80 * index + offset - 0x10000);
-        s->vcmdq_status[index] = *ptr;
+        if (ptr) {
+            s->vcmdq_status[index] = *ptr;
+        }
         return s->vcmdq_status[index];
 
     case A_VCMDQ0_GERROR:
-        ptr = (uint32_t *)(s->vcmdq_page0 + 0x80 * index + offset - 0x10000);
-        s->vcmdq_gerror[index] = *ptr;
+        if (ptr) {
+            s->vcmdq_gerror[index] = *ptr;
+        }
         return s->vcmdq_gerror[index];
 
     case A_VCMDQ0_GERRORN:
-        ptr = (uint32_t *)(s->vcmdq_page0 + 0x80 * index + offset - 0x10000);
-        s->vcmdq_gerrorn[index] = *ptr;
+        if (ptr) {
+            s->vcmdq_gerrorn[index] = *ptr;
+        }
         return s->vcmdq_gerrorn[index];
 
     case A_VCMDQ0_BASE_L:
@@ -170,17 +190,44 @@ static uint64_t tegra241_cmdqv_read_vcmdq(Tegra241CMDQV *s, hwaddr offset, int i
     return 0;
 }
 
+/*
+ * Maps the VCMDQ page0 of the host into the guest, so that the guest accesses
+ * the CONS/PROD, CONFIG, STATUS and GERROR registers of every VCMDQ directly,
+ * without exiting to QEMU. Only page1 (queue base setup) and the global
+ * config registers keep trapping. Requires the vIOMMU, which is allocated by
+ * the SMMU once the first device is attached.
+ */
 static int tegra241_cmdqv_init_vcmdq_page0(Tegra241CMDQV *s)
 {
+    SMMUState *bs = ARM_SMMU(s->smmu_dev);
     char *name;
+    int i;
 
-    s->vcmdq_page0 = smmu_iommu_get_shared_page(ARM_SMMU(s->smmu_dev),
-                                                VCMDQ_REG_PAGE_SIZE, false);
+    if (s->vcmdq_page0) {
+        return 0;
+    }
+    if (!bs->viommu) {
+        return -ENODEV;
+    }
+
+    s->vcmdq_page0 = smmu_iommu_get_shared_page(bs, VCMDQ_REG_PAGE_SIZE, false);
     if (!s->vcmdq_page0) {
-        error_report("failed to mmap VCMDQ PAGE0");
+        error_report_once("failed to mmap VCMDQ PAGE0");
         return -EIO;
     }
 
+    /* Replay what the guest wrote while the registers were only cached */
+    for (i = 0; i < 128; i++) {
+        if (!s->vqueue[i]) {
+            continue;
+        }
+        *tegra241_cmdqv_vcmdq_reg(s, A_VCMDQ0_CONS_INDX, i) =
+            s->vcmdq_cons_indx[i];
+        *tegra241_cmdqv_vcmdq_reg(s, A_VCMDQ0_PROD_INDX, i) =
+            s->vcmdq_prod_indx[i];
+        *tegra241_cmdqv_vcmdq_reg(s, A_VCMDQ0_CONFIG, i) = s->vcmdq_config[i];
+    }
+
     name = g_strdup_printf("%s vcmdq",
                            memory_region_name(&s->mmio_cmdqv));
     memory_region_init_ram_device_ptr(&s->mmio_vcmdq_page,
@@ -207,9 +254,7 @@ static uint64_t tegra241_cmdqv_read(void *opaque, hwaddr offset, unsigned size)
     Tegra241CMDQV *s = (Tegra241CMDQV *) opaque;
     int index;
 
-    if (!s->vcmdq_page0) {
-        tegra241_cmdqv_init_vcmdq_page0(s);
-    }
+    tegra241_cmdqv_init_vcmdq_page0(s);
 
     if (offset > 0x50000) {
         qemu_log_mask(LOG_UNIMP, "%s offset 0x%"PRIx64" off limit (0x50000)\n",
@@ -333,6 +378,9 @@ static int tegra241_cmdqv_setup_vcmdq(Tegra241CMDQV *s, int index)
     }
     s->vqueue[index] = vqueue;
 
+    /* Let the guest drive the queue directly from now on */
+    tegra241_cmdqv_init_vcmdq_page0(s);
+
     return 0;
 }
 
@@ -340,27 +388,35 @@ static int tegra241_cmdqv_setup_vcmdq(Tegra241CMDQV *s, int index)
 static void tegra241_cmdqv_write_vcmdq(Tegra241CMDQV *s, hwaddr offset,
                                        int index, uint64_t value, unsigned size)
 {
-    uint32_t *ptr;
+    uint32_t *ptr = tegra241_cmdqv_vcmdq_reg(s, offset, index);
 
     switch (offset) {
     case A_VCMDQ0_CONS_INDX:
-        ptr = (uint32_t *)(s->vcmdq_page0 + 0x80 * index + offset - 0x10000);
-        *ptr = s->vcmdq_cons_indx[index] = value;
+        s->vcmdq_cons_indx[index] = value;
+        if (ptr) {
+            *ptr = value;
+        }
         return;
 
     case A_VCMDQ0_PROD_INDX:
-        ptr = (uint32_t *)(s->vcmdq_page0 + 0x80 * index + offset - 0x10000);
-        *ptr = s->vcmdq_prod_indx[index] = value;
+        s->vcmdq_prod_indx[index] = value;
+        if (ptr) {
+            *ptr = value;
+        }
         return;
 
     case A_VCMDQ0_CONFIG:
-        ptr = (uint32_t *)(s->vcmdq_page0 + 0x80 * index + offset - 0x10000);
-        *ptr = s->vcmdq_config[index] = value;
+        s->vcmdq_config[index] = value;
+        if (ptr) {
+            *ptr = value;
+        }
         return;
 
     case A_VCMDQ0_GERRORN:
-        ptr = (uint32_t *)(s->vcmdq_page0 + 0x80 * index + offset - 0x10000);
-        *ptr = s->vcmdq_gerrorn[index] = value;
+        s->vcmdq_gerrorn[index] = value;
+        if (ptr) {
+            *ptr = value;
+        }
         return;
 
     case A_VCMDQ0_BASE_L:
@@ -406,9 +462,7 @@ static void tegra241_cmdqv_write(void *opaque, hwaddr offset,
     Tegra241CMDQV *s = (Tegra241CMDQV *) opaque;
     int index;
 
-    if (!s->vcmdq_page0) {
-        tegra241_cmdqv_init_vcmdq_page0(s);
-    }
+    tegra241_cmdqv_init_vcmdq_page0(s);
 
     if (offset > 0x50000) {
         qemu_log_mask(LOG_UNIMP, "%s offset 0x%"PRIx64" off limit (0x50000)\n",
@@ -525,8 +579,10 @@ static void cmdqv_unrealize(DeviceState *d)
 {
     Tegra241CMDQV *s = TEGRA241_CMDQV(d);
 
-    smmu_iommu_put_shared_page(ARM_SMMU(s->smmu_dev), s->vcmdq_page0,
-                               VCMDQ_REG_PAGE_SIZE);
+    if (s->vcmdq_page0) {
+        smmu_iommu_put_shared_page(ARM_SMMU(s->smmu_dev), s->vcmdq_page0,
+                                   VCMDQ_REG_PAGE_SIZE);
+    }
 }
 
 static Property cmdqv_properties[] = {
@@ -970,6 +970,8 @@ struct AcpiBuildState {
     MemoryRegion *linker_mr;
     /* Is table patched? */
     bool patched;
+    /* State the tables were last built from */
+    GByteArray *snapshot;
 } AcpiBuildState;
 
 static void acpi_align_size(GArray *blob, unsigned align)
@@ -1138,6 +1140,11 @@ static void virt_acpi_build_update(void *build_opaque)
     }
     build_state->patched = true;
 
+    /* Large topologies take long to build, skip it if nothing changed */
+    if (!acpi_build_snapshot_update(&build_state->snapshot)) {
+        return;
+    }
+
     acpi_build_tables_init(&tables);
 
     virt_acpi_build(VIRT_MACHINE(qdev_get_machine()), &tables);
@@ -1155,10 +1162,20 @@ static void virt_acpi_build_reset(void *build_opaque)
     build_state->patched = false;
 }
 
+static int virt_acpi_build_post_load(void *opaque, int version_id)
+{
+    AcpiBuildState *build_state = opaque;
+
+    /* The tables in RAM come from the source */
+    acpi_build_snapshot_clear(&build_state->snapshot);
+    return 0;
+}
+
 static const VMStateDescription vmstate_virt_acpi_build = {
     .name = "virt_acpi_build",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = virt_acpi_build_post_load,
     .fields = (const VMStateField[]) {
         VMSTATE_BOOL(patched, AcpiBuildState),
         VMSTATE_END_OF_LIST()
@@ -1211,6 +1228,7 @@ void virt_acpi_setup(VirtMachineState *vms)
                                              build_state, tables.rsdp,
                                              ACPI_BUILD_RSDP_FILE);
 
+    acpi_build_snapshot_update(&build_state->snapshot);
     qemu_register_reset(virt_acpi_build_reset, build_state);
     virt_acpi_build_reset(build_state);
     vmstate_register(NULL, 0, &vmstate_virt_acpi_build, build_state);
@@ -19,6 +19,7 @@
 #include "qapi/qmp/qobject.h"
 #include "qapi/qobject-input-visitor.h"
 #include "qapi/type-helpers.h"
+#include "qemu/lockable.h"
 #include "qemu/uuid.h"
 #include "qom/qom-qobject.h"
 #include "sysemu/hostmem.h"
@@ -40,11 +41,16 @@ CpuInfoFastList *qmp_query_cpus_fast(Error **errp)
                                           -1, &error_abort);
     CPUState *cpu;
 
+    /*
+     * This is a read-only command that can run without the BQL.  The CPU
+     * list lock keeps the CPUs from going away under our feet.
+     */
+    QEMU_LOCK_GUARD(&qemu_cpu_list_lock);
     CPU_FOREACH(cpu) {
         CpuInfoFast *value = g_malloc0(sizeof(*value));
 
         value->cpu_index = cpu->cpu_index;
-        value->qom_path = object_get_canonical_path(OBJECT(cpu));
+        value->qom_path = g_strdup(cpu->qom_path);
         value->thread_id = cpu->thread_id;
 
         if (mc->cpu_index_to_instance_props) {
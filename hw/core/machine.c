@@ -32,11 +32,13 @@
 #include "hw/virtio/virtio-net.h"
 #include "hw/virtio/virtio-iommu.h"
 #include "audio/audio.h"
+#include "qemu/thread-context.h"
 
 GlobalProperty hw_compat_8_2[] = {
     { "migration", "zero-page-detection", "legacy"},
     { TYPE_VIRTIO_IOMMU_PCI, "granule", "4k" },
     { TYPE_VIRTIO_IOMMU_PCI, "aw-bits", "64" },
+    { TYPE_VIRTIO_NET, "gro", "off" },
 };
 const size_t hw_compat_8_2_len = G_N_ELEMENTS(hw_compat_8_2);
 
@@ -373,6 +375,22 @@ static void machine_set_dumpdtb(Object *obj, const char *value, Error **errp)
     ms->dumpdtb = g_strdup(value);
 }
 
+static char *machine_get_emulator_thread_context(Object *obj, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    return g_strdup(ms->emulator_thread_context);
+}
+
+static void machine_set_emulator_thread_context(Object *obj, const char *value,
+                                                Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    g_free(ms->emulator_thread_context);
+    ms->emulator_thread_context = g_strdup(value);
+}
+
 static void machine_get_phandle_start(Object *obj, Visitor *v,
                                       const char *name, void *opaque,
                                       Error **errp)
@@ -1008,6 +1026,12 @@ static void machine_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "dumpdtb",
         "Dump current dtb to a file and quit");
 
+    object_class_property_add_str(oc, "emulator-thread-context",
+        machine_get_emulator_thread_context,
+        machine_set_emulator_thread_context);
+    object_class_property_set_description(oc, "emulator-thread-context",
+        "Thread context whose CPU affinity the main loop thread takes over");
+
     object_class_property_add(oc, "boot", "BootConfiguration",
         machine_get_boot, machine_set_boot,
         NULL, NULL);
@@ -1172,6 +1196,7 @@ static void machine_finalize(Object *obj)
     g_free(ms->dumpdtb);
     g_free(ms->dt_compatible);
     g_free(ms->firmware);
+    g_free(ms->emulator_thread_context);
     g_free(ms->device_memory);
     g_free(ms->nvdimms_state);
     g_free(ms->numa_state);
@@ -1478,6 +1503,27 @@ void machine_run_board_init(MachineState *machine, const char *mem_path, Error *
         }
     }
 
+    /*
+     * Threads created from now on, e.g. by devices, inherit the affinity
+     * unless placed explicitly.
+     */
+    if (machine->emulator_thread_context) {
+        Object *tc = object_resolve_path_type(machine->emulator_thread_context,
+                                              TYPE_THREAD_CONTEXT, NULL);
+        QemuThread self;
+
+        if (!tc) {
+            error_setg(errp, "emulator-thread-context=%s is not a thread "
+                       "context", machine->emulator_thread_context);
+            return;
+        }
+        qemu_thread_get_self(&self);
+        if (!thread_context_set_thread_affinity(THREAD_CONTEXT(tc), &self,
+                                                errp)) {
+            return;
+        }
+    }
+
     if (machine->memdev) {
         ram_addr_t backend_size = object_property_get_uint(OBJECT(machine->memdev),
                                                            "size",  &error_abort);
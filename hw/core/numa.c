@@ -40,6 +40,7 @@
 #include "qemu/option.h"
 #include "qemu/config-file.h"
 #include "qemu/cutils.h"
+#include "qemu/thread-context.h"
 
 QemuOptsList qemu_numa_opts = {
     .name = "numa",
@@ -163,6 +164,20 @@ static void parse_numa_node(MachineState *ms, NumaNodeOptions *node,
         numa_info[nodenr].node_memdev = MEMORY_BACKEND(o);
     }
 
+    if (node->thread_context) {
+        Object *o;
+        o = object_resolve_path_type(node->thread_context, TYPE_THREAD_CONTEXT,
+                                     NULL);
+        if (!o) {
+            error_setg(errp, "thread-context=%s is not a thread context",
+                       node->thread_context);
+            return;
+        }
+
+        object_ref(o);
+        numa_info[nodenr].thread_context = THREAD_CONTEXT(o);
+    }
+
     numa_info[nodenr].present = true;
     max_numa_nodeid = MAX(max_numa_nodeid, nodenr + 1);
     ms->numa_state->num_nodes++;
@@ -33,6 +33,7 @@
 #include "qapi/visitor.h"
 #include "qemu/error-report.h"
 #include "qemu/option.h"
+#include "qemu/timer.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/boards.h"
@@ -888,6 +889,7 @@ char *qdev_get_human_name(DeviceState *dev)
 }
 
 static MachineInitPhase machine_phase;
+static int64_t machine_phase_time_ns[PHASE_MACHINE_READY + 1];
 
 bool phase_check(MachineInitPhase phase)
 {
@@ -898,6 +900,27 @@ void phase_advance(MachineInitPhase phase)
 {
     assert(machine_phase == phase - 1);
     machine_phase = phase;
+    machine_phase_time_ns[phase] = get_clock();
+    trace_machine_phase_advance(phase, phase_get_time_ns(phase));
+}
+
+void phase_start_timeline(void)
+{
+    machine_phase_time_ns[PHASE_NO_MACHINE] = get_clock();
+}
+
+int64_t phase_get_time_ns(MachineInitPhase phase)
+{
+    if (!phase_check(phase) || !machine_phase_time_ns[PHASE_NO_MACHINE]) {
+        return -1;
+    }
+    return machine_phase_time_ns[phase] -
+           machine_phase_time_ns[PHASE_NO_MACHINE];
+}
+
+int64_t phase_get_elapsed_ns(void)
+{
+    return get_clock() - machine_phase_time_ns[PHASE_NO_MACHINE];
 }
 
 static const TypeInfo device_type_info = {
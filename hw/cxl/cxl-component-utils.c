@@ -116,6 +116,11 @@ static void dumb_hdm_handler(CXLComponentState *cxl_cstate, hwaddr offset,
         value = FIELD_DP32(value, CXL_HDM_DECODER0_CTRL, COMMITTED, 0);
     }
     stl_le_p((uint8_t *)cache_mem + offset, value);
+
+    /* Host bridge and switch decoders decide what may be mapped directly */
+    if (should_commit || should_uncommit) {
+        cxl_type3_unmap_direct_all();
+    }
 }
 
 static void cxl_cache_mem_write_reg(void *opaque, hwaddr offset, uint64_t value,
@@ -9,6 +9,7 @@
 #include "qemu/units.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
+#include "qemu/range.h"
 #include "qapi/error.h"
 #include "sysemu/qtest.h"
 #include "hw/boards.h"
@@ -98,8 +99,31 @@ void cxl_fmws_link_targets(CXLState *cxl_state, Error **errp)
     }
 }
 
+/*
+ * Narrow @linear to the HPA range of a decoder on the path to the device.
+ * Addresses only translate linearly if no decoder on the path interleaves.
+ */
+static void cxl_linear_range_narrow(Range *linear, uint64_t base,
+                                    uint64_t size, bool interleaved)
+{
+    uint64_t lob, upb;
+
+    if (interleaved || range_is_empty(linear) || !size) {
+        range_make_empty(linear);
+        return;
+    }
+
+    lob = MAX(range_lob(linear), base);
+    upb = MIN(range_upb(linear), base + size - 1);
+    if (lob > upb) {
+        range_make_empty(linear);
+    } else {
+        range_set_bounds(linear, lob, upb);
+    }
+}
+
 static bool cxl_hdm_find_target(uint32_t *cache_mem, hwaddr addr,
-                                uint8_t *target)
+                                uint8_t *target, Range *linear)
 {
     int hdm_inc = R_CXL_HDM_DECODER1_BASE_LO - R_CXL_HDM_DECODER0_BASE_LO;
     unsigned int hdm_count;
@@ -133,6 +157,7 @@ static bool cxl_hdm_find_target(uint32_t *cache_mem, hwaddr addr,
         found = true;
         ig_enc = FIELD_EX32(ctrl, CXL_HDM_DECODER0_CTRL, IG);
         iw_enc = FIELD_EX32(ctrl, CXL_HDM_DECODER0_CTRL, IW);
+        cxl_linear_range_narrow(linear, base, size, iw_enc != 0);
         target_idx = (addr / cxl_decode_ig(ig_enc)) % (1 << iw_enc);
 
         if (target_idx < 4) {
@@ -152,7 +177,13 @@ static bool cxl_hdm_find_target(uint32_t *cache_mem, hwaddr addr,
     return found;
 }
 
-static PCIDevice *cxl_cfmws_find_device(CXLFixedWindow *fw, hwaddr addr)
+/*
+ * Find the device that @addr in @fw decodes to.  @linear is narrowed to the
+ * HPA range around @addr that maps linearly onto that device, and is empty
+ * if the window or any decoder on the way interleaves.
+ */
+static PCIDevice *cxl_cfmws_find_device(CXLFixedWindow *fw, hwaddr addr,
+                                        Range *linear)
 {
     CXLComponentState *hb_cstate, *usp_cstate;
     PCIHostState *hb;
@@ -166,6 +197,11 @@ static PCIDevice *cxl_cfmws_find_device(CXLFixedWindow *fw, hwaddr addr)
     /* Address is relative to memory region. Convert to HPA */
     addr += fw->base;
 
+    range_init_nofail(linear, fw->base, fw->size);
+    if (fw->num_targets > 1) {
+        range_make_empty(linear);
+    }
+
     rb_index = (addr / cxl_decode_ig(fw->enc_int_gran)) % fw->num_targets;
     hb = PCI_HOST_BRIDGE(fw->target_hbs[rb_index]->cxl_host_bridge);
     if (!hb || !hb->bus || !pci_bus_is_cxl(hb->bus)) {
@@ -185,7 +221,8 @@ static PCIDevice *cxl_cfmws_find_device(CXLFixedWindow *fw, hwaddr addr)
 
         cache_mem = hb_cstate->crb.cache_mem_registers;
 
-        target_found = cxl_hdm_find_target(cache_mem, addr, &target);
+        target_found = cxl_hdm_find_target(cache_mem, addr, &target,
+                                           linear);
         if (!target_found) {
             return NULL;
         }
@@ -221,7 +258,7 @@ static PCIDevice *cxl_cfmws_find_device(CXLFixedWindow *fw, hwaddr addr)
 
     cache_mem = usp_cstate->crb.cache_mem_registers;
 
-    target_found = cxl_hdm_find_target(cache_mem, addr, &target);
+    target_found = cxl_hdm_find_target(cache_mem, addr, &target, linear);
     if (!target_found) {
         return NULL;
     }
@@ -248,14 +285,19 @@ static MemTxResult cxl_read_cfmws(void *opaque, hwaddr addr, uint64_t *data,
 {
     CXLFixedWindow *fw = opaque;
     PCIDevice *d;
+    Range linear;
 
-    d = cxl_cfmws_find_device(fw, addr);
+    d = cxl_cfmws_find_device(fw, addr, &linear);
     if (d == NULL) {
         *data = 0;
         /* Reads to invalid address return poison */
         return MEMTX_ERROR;
     }
 
+    if (!range_is_empty(&linear)) {
+        cxl_type3_map_direct(d, addr + fw->base, &linear, &fw->mr, fw->base);
+    }
+
     return cxl_type3_read(d, addr + fw->base, data, size, attrs);
 }
 
@@ -265,13 +307,18 @@ static MemTxResult cxl_write_cfmws(void *opaque, hwaddr addr,
 {
     CXLFixedWindow *fw = opaque;
     PCIDevice *d;
+    Range linear;
 
-    d = cxl_cfmws_find_device(fw, addr);
+    d = cxl_cfmws_find_device(fw, addr, &linear);
     if (d == NULL) {
         /* Writes to invalid address are silent */
         return MEMTX_OK;
     }
 
+    if (!range_is_empty(&linear)) {
+        cxl_type3_map_direct(d, addr + fw->base, &linear, &fw->mr, fw->base);
+    }
+
     return cxl_type3_write(d, addr + fw->base, data, size, attrs);
 }
 
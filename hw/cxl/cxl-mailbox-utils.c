@@ -1000,6 +1000,8 @@ static CXLRetCode cmd_sanitize_overwrite(const struct cxl_cmd *cmd,
     *len_out = 0;
 
     cxl_dev_disable_media(&ct3d->cxl_dstate);
+    /* Accesses must see the sanitize in progress */
+    cxl_type3_unmap_direct(ct3d);
 
     /* sanitize when done */
     return CXL_MBOX_BG_STARTED;
@@ -145,7 +145,8 @@ static int
 virtio_gpu_get_flags(void *opaque)
 {
     VirtIOGPUBase *g = opaque;
-    int flags = GRAPHIC_FLAGS_NONE;
+    /* The guest flushes the exact rectangles that it changed */
+    int flags = GRAPHIC_FLAGS_DAMAGE;
 
     if (virtio_gpu_virgl_enabled(g->conf)) {
         flags |= GRAPHIC_FLAGS_GL;
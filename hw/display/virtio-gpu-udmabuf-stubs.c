@@ -17,6 +17,14 @@ void virtio_gpu_fini_udmabuf(struct virtio_gpu_simple_resource *res)
     /* nothing (stub) */
 }
 
+pixman_image_t *virtio_gpu_udmabuf_image(struct virtio_gpu_simple_resource *res,
+                                         pixman_format_code_t format,
+                                         uint32_t stride)
+{
+    /* nothing (stub) */
+    return NULL;
+}
+
 int virtio_gpu_update_dmabuf(VirtIOGPU *g,
                              uint32_t scanout_id,
                              struct virtio_gpu_simple_resource *res,
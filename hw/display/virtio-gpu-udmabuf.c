@@ -167,6 +167,53 @@ static void virtio_gpu_free_dmabuf(VirtIOGPU *g, VGPUDMABuf *dmabuf)
     g_free(dmabuf);
 }
 
+static void virtio_gpu_unmap_udmabuf_image(pixman_image_t *image, void *data)
+{
+    munmap(pixman_image_get_data(image),
+           (size_t)pixman_image_get_stride(image) *
+           pixman_image_get_height(image));
+}
+
+/*
+ * Return an image of @res that maps its guest backing, laid out with
+ * @stride, or NULL if the backing cannot be mapped.  The mapping lives
+ * as long as the image, even if the backing is detached in the meantime.
+ */
+pixman_image_t *virtio_gpu_udmabuf_image(struct virtio_gpu_simple_resource *res,
+                                         pixman_format_code_t format,
+                                         uint32_t stride)
+{
+    size_t size = (size_t)stride * res->height;
+    pixman_image_t *image;
+    void *map;
+
+    if (!size || iov_size(res->iov, res->iov_cnt) < size) {
+        return NULL;
+    }
+
+    res->dmabuf_fd = -1;
+    virtio_gpu_create_udmabuf(res);
+    if (res->dmabuf_fd < 0) {
+        return NULL;
+    }
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, res->dmabuf_fd, 0);
+    close(res->dmabuf_fd);
+    res->dmabuf_fd = -1;
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    image = pixman_image_create_bits(format, res->width, res->height,
+                                     map, stride);
+    if (!image) {
+        munmap(map, size);
+        return NULL;
+    }
+    pixman_image_set_destroy_function(image, virtio_gpu_unmap_udmabuf_image,
+                                      NULL);
+    return image;
+}
+
 static VGPUDMABuf
 *virtio_gpu_create_dmabuf(VirtIOGPU *g,
                           uint32_t scanout_id,
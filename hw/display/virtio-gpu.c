@@ -485,6 +485,17 @@ static void virtio_gpu_transfer_to_host_2d(VirtIOGPU *g,
     stride = pixman_image_get_stride(res->image);
     img_data = pixman_image_get_data(res->image);
 
+    if (res->zerocopy) {
+        /* The image already is the guest backing */
+        if (t2d.offset != t2d.r.y * stride + t2d.r.x * bpp) {
+            qemu_log_mask(LOG_GUEST_ERROR, "%s: transfer offset %" PRIu64
+                          " does not match the layout of zero-copy"
+                          " resource %d\n", __func__, t2d.offset,
+                          t2d.resource_id);
+        }
+        return;
+    }
+
     if (t2d.r.x || t2d.r.width != pixman_image_get_width(res->image)) {
         for (h = 0; h < t2d.r.height; h++) {
             src_offset = t2d.offset + stride * h;
@@ -911,6 +922,68 @@ void virtio_gpu_cleanup_mapping(VirtIOGPU *g,
     }
 }
 
+/*
+ * Use the guest backing of a 2D resource as its image, so that transfers
+ * to the host are free and scanouts show the guest memory directly.
+ * This needs the backing to be laid out like the image, which is what
+ * the guest drivers do.
+ */
+static void virtio_gpu_share_2d(VirtIOGPU *g,
+                                struct virtio_gpu_simple_resource *res)
+{
+    pixman_image_t *image;
+
+    image = virtio_gpu_udmabuf_image(res, pixman_image_get_format(res->image),
+                                     pixman_image_get_stride(res->image));
+    if (!image) {
+        return;
+    }
+    trace_virtio_gpu_zerocopy_2d(res->resource_id, true);
+
+    qemu_pixman_image_unref(res->image);
+    res->image = image;
+    res->zerocopy = true;
+    g->hostmem -= res->hostmem;
+    res->hostmem = 0;
+}
+
+/* Give the resource its own copy of the image before the backing goes */
+static void virtio_gpu_unshare_2d(VirtIOGPU *g,
+                                  struct virtio_gpu_simple_resource *res)
+{
+    pixman_format_code_t format = pixman_image_get_format(res->image);
+    pixman_image_t *image;
+    int i;
+
+    trace_virtio_gpu_zerocopy_2d(res->resource_id, false);
+    res->hostmem = calc_image_hostmem(format, res->width, res->height);
+    image = pixman_image_create_bits(format, res->width, res->height,
+                                     NULL, res->hostmem / res->height);
+    pixman_image_composite(PIXMAN_OP_SRC, res->image, NULL, image,
+                           0, 0, 0, 0, 0, 0, res->width, res->height);
+    qemu_pixman_image_unref(res->image);
+    res->image = image;
+    res->zerocopy = false;
+    g->hostmem += res->hostmem;
+
+    /* Move the scanouts to the new image */
+    for (i = 0; i < g->parent_obj.conf.max_outputs; i++) {
+        struct virtio_gpu_scanout *scanout = &g->parent_obj.scanout[i];
+        struct virtio_gpu_framebuffer fb = scanout->fb;
+        struct virtio_gpu_rect r = {
+            .x = scanout->x,
+            .y = scanout->y,
+            .width = scanout->width,
+            .height = scanout->height,
+        };
+        uint32_t error = 0;
+
+        if (res->scanout_bitmask & (1 << i)) {
+            virtio_gpu_do_set_scanout(g, i, &fb, res, &r, &error);
+        }
+    }
+}
+
 static void
 virtio_gpu_resource_attach_backing(VirtIOGPU *g,
                                    struct virtio_gpu_ctrl_command *cmd)
@@ -942,6 +1015,11 @@ virtio_gpu_resource_attach_backing(VirtIOGPU *g,
         cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
         return;
     }
+
+    if (virtio_gpu_zerocopy_2d_enabled(g->parent_obj.conf) &&
+        res->image && !res->scanout_bitmask) {
+        virtio_gpu_share_2d(g, res);
+    }
 }
 
 static void
@@ -960,6 +1038,9 @@ virtio_gpu_resource_detach_backing(VirtIOGPU *g,
     if (!res) {
         return;
     }
+    if (res->zerocopy) {
+        virtio_gpu_unshare_2d(g, res);
+    }
     virtio_gpu_cleanup_mapping(g, res);
 }
 
@@ -1483,6 +1564,12 @@ void virtio_gpu_device_realize(DeviceState *qdev, Error **errp)
         }
     }
 
+    if (virtio_gpu_zerocopy_2d_enabled(g->parent_obj.conf) &&
+        !virtio_gpu_have_udmabuf()) {
+        error_setg(errp, "need udmabuf for zerocopy-2d");
+        return;
+    }
+
     if (!virtio_gpu_base_device_realize(qdev,
                                         virtio_gpu_handle_ctrl_cb,
                                         virtio_gpu_handle_cursor_cb,
@@ -1658,6 +1745,8 @@ static Property virtio_gpu_properties[] = {
                      256 * MiB),
     DEFINE_PROP_BIT("blob", VirtIOGPU, parent_obj.conf.flags,
                     VIRTIO_GPU_FLAG_BLOB_ENABLED, false),
+    DEFINE_PROP_BIT("zerocopy-2d", VirtIOGPU, parent_obj.conf.flags,
+                    VIRTIO_GPU_FLAG_ZEROCOPY_2D_ENABLED, false),
     DEFINE_PROP_SIZE("hostmem", VirtIOGPU, parent_obj.conf.hostmem, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -71,8 +71,13 @@ static int virtio_vga_base_get_flags(void *opaque)
 {
     VirtIOVGABase *vvga = opaque;
     VirtIOGPUBase *g = vvga->vgpu;
+    int flags = g->hw_ops->get_flags(g);
 
-    return g->hw_ops->get_flags(g);
+    /* VGA mode only knows about dirty pages */
+    if (!g->enable) {
+        flags &= ~GRAPHIC_FLAGS_DAMAGE;
+    }
+    return flags;
 }
 
 static const GraphicHwOps virtio_vga_base_ops = {
@@ -2462,6 +2462,8 @@ struct AcpiBuildState {
     void *rsdp;
     MemoryRegion *rsdp_mr;
     MemoryRegion *linker_mr;
+    /* State the tables were last built from */
+    GByteArray *snapshot;
 } AcpiBuildState;
 
 static bool acpi_get_mcfg(AcpiMcfgInfo *mcfg)
@@ -2768,6 +2770,11 @@ static void acpi_build_update(void *build_opaque)
     }
     build_state->patched = 1;
 
+    /* Large topologies take long to build, skip it if nothing changed */
+    if (!acpi_build_snapshot_update(&build_state->snapshot)) {
+        return;
+    }
+
     acpi_build_tables_init(&tables);
 
     acpi_build(&tables, MACHINE(qdev_get_machine()));
@@ -2790,10 +2797,20 @@ static void acpi_build_reset(void *build_opaque)
     build_state->patched = 0;
 }
 
+static int acpi_build_post_load(void *opaque, int version_id)
+{
+    AcpiBuildState *build_state = opaque;
+
+    /* The tables in RAM come from the source */
+    acpi_build_snapshot_clear(&build_state->snapshot);
+    return 0;
+}
+
 static const VMStateDescription vmstate_acpi_build = {
     .name = "acpi_build",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = acpi_build_post_load,
     .fields = (const VMStateField[]) {
         VMSTATE_UINT8(patched, AcpiBuildState),
         VMSTATE_END_OF_LIST()
@@ -2885,6 +2902,7 @@ void acpi_setup(void)
                                                  ACPI_BUILD_RSDP_FILE);
     }
 
+    acpi_build_snapshot_update(&build_state->snapshot);
     qemu_register_reset(acpi_build_reset, build_state);
     acpi_build_reset(build_state);
     vmstate_register(NULL, 0, &vmstate_acpi_build, build_state);
@@ -66,13 +66,6 @@ struct vtd_as_key {
     uint32_t pasid;
 };
 
-struct vtd_iotlb_key {
-    uint64_t gfn;
-    uint32_t pasid;
-    uint16_t sid;
-    uint8_t level;
-};
-
 static void vtd_address_space_refresh_all(IntelIOMMUState *s);
 static void vtd_address_space_unmap(VTDAddressSpace *as, IOMMUNotifier *n);
 static void vtd_refresh_pasid_bind(IntelIOMMUState *s);
@@ -353,10 +346,35 @@ static void vtd_reset_context_cache_locked(IntelIOMMUState *s)
     s->context_cache_gen = 1;
 }
 
+/*
+ * The IOTLB keeps each entry both in the iotlb hash table for lookups,
+ * and in the LRU list that is used to evict entries once full and to
+ * walk them for invalidations.  Must be called with IOMMU lock held.
+ */
+static void vtd_iotlb_remove(IntelIOMMUState *s, VTDIOTLBEntry *entry)
+{
+    QTAILQ_REMOVE(&s->iotlb_lru, entry, lru);
+    g_hash_table_remove(s->iotlb, &entry->key);
+}
+
+/* Remove the entries for which @match returns true */
+static void vtd_iotlb_remove_matching(IntelIOMMUState *s, GHRFunc match,
+                                      gpointer user_data)
+{
+    VTDIOTLBEntry *entry, *next;
+
+    QTAILQ_FOREACH_SAFE(entry, &s->iotlb_lru, lru, next) {
+        if (match(&entry->key, entry, user_data)) {
+            vtd_iotlb_remove(s, entry);
+        }
+    }
+}
+
 /* Must be called with IOMMU lock held. */
 static void vtd_reset_iotlb_locked(IntelIOMMUState *s)
 {
     assert(s->iotlb);
+    QTAILQ_INIT(&s->iotlb_lru);
     g_hash_table_remove_all(s->iotlb);
 }
 
@@ -396,6 +414,8 @@ static VTDIOTLBEntry *vtd_lookup_iotlb(IntelIOMMUState *s, uint16_t source_id,
         key.pasid = pasid;
         entry = g_hash_table_lookup(s->iotlb, &key);
         if (entry) {
+            QTAILQ_REMOVE(&s->iotlb_lru, entry, lru);
+            QTAILQ_INSERT_TAIL(&s->iotlb_lru, entry, lru);
             goto out;
         }
     }
@@ -411,14 +431,11 @@ static void vtd_update_iotlb(IntelIOMMUState *s, uint16_t source_id,
                              uint32_t pasid)
 {
     VTDIOTLBEntry *entry = g_malloc(sizeof(*entry));
-    struct vtd_iotlb_key *key = g_malloc(sizeof(*key));
+    struct vtd_iotlb_key *key = &entry->key;
     uint64_t gfn = vtd_get_iotlb_gfn(addr, level);
+    VTDIOTLBEntry *old;
 
     trace_vtd_iotlb_page_update(source_id, addr, pte, domain_id);
-    if (g_hash_table_size(s->iotlb) >= VTD_IOTLB_MAX_SIZE) {
-        trace_vtd_iotlb_reset("iotlb exceeds size limit");
-        vtd_reset_iotlb_locked(s);
-    }
 
     entry->gfn = gfn;
     entry->domain_id = domain_id;
@@ -434,7 +451,17 @@ static void vtd_update_iotlb(IntelIOMMUState *s, uint16_t source_id,
     key->level = level;
     key->pasid = pasid;
 
-    g_hash_table_replace(s->iotlb, key, entry);
+    /* Evict the least recently used entry instead of flushing them all */
+    old = g_hash_table_lookup(s->iotlb, key);
+    if (old) {
+        vtd_iotlb_remove(s, old);
+    } else if (g_hash_table_size(s->iotlb) >= VTD_IOTLB_MAX_SIZE) {
+        trace_vtd_iotlb_reset("iotlb exceeds size limit, evicting");
+        vtd_iotlb_remove(s, QTAILQ_FIRST(&s->iotlb_lru));
+    }
+
+    QTAILQ_INSERT_TAIL(&s->iotlb_lru, entry, lru);
+    g_hash_table_insert(s->iotlb, key, entry);
 }
 
 /* Given the reg addr of both the message data and address, generate an
@@ -2957,8 +2984,7 @@ static void vtd_iotlb_domain_invalidate(IntelIOMMUState *s, uint16_t domain_id)
     trace_vtd_inv_desc_iotlb_domain(domain_id);
 
     vtd_iommu_lock(s);
-    g_hash_table_foreach_remove(s->iotlb, vtd_hash_remove_by_domain,
-                                &domain_id);
+    vtd_iotlb_remove_matching(s, vtd_hash_remove_by_domain, &domain_id);
     vtd_iommu_unlock(s);
 
     QLIST_FOREACH(vtd_as, &s->vtd_as_with_notifiers, next) {
@@ -3027,7 +3053,7 @@ static void vtd_iotlb_page_invalidate(IntelIOMMUState *s, uint16_t domain_id,
     info.addr = addr;
     info.mask = ~((1 << am) - 1);
     vtd_iommu_lock(s);
-    g_hash_table_foreach_remove(s->iotlb, vtd_hash_remove_by_page, &info);
+    vtd_iotlb_remove_matching(s, vtd_hash_remove_by_page, &info);
     vtd_iommu_unlock(s);
     vtd_iotlb_page_invalidate_notify(s, domain_id, addr, am, PCI_NO_PASID);
 }
@@ -3451,8 +3477,7 @@ static void vtd_piotlb_pasid_invalidate_notify(IntelIOMMUState *s,
 static void vtd_piotlb_domain_invalidate(IntelIOMMUState *s, uint16_t domain_id)
 {
     vtd_iommu_lock(s);
-    g_hash_table_foreach_remove(s->iotlb, vtd_hash_remove_by_domain,
-                                &domain_id);
+    vtd_iotlb_remove_matching(s, vtd_hash_remove_by_domain, &domain_id);
     vtd_iommu_unlock(s);
     vtd_piotlb_pasid_invalidate_notify(s, false, domain_id, PCI_NO_PASID);
 }
@@ -3560,8 +3585,7 @@ static void vtd_piotlb_pasid_invalidate(IntelIOMMUState *s,
     g_hash_table_foreach(s->vtd_pasid_as,
                          vtd_flush_pasid_iotlb, &piotlb_info);
 
-    g_hash_table_foreach_remove(s->iotlb, vtd_hash_remove_by_pasid,
-                                &info);
+    vtd_iotlb_remove_matching(s, vtd_hash_remove_by_pasid, &info);
     vtd_iommu_unlock(s);
     vtd_piotlb_pasid_invalidate_notify(s, false, domain_id, pasid);
 }
@@ -3599,8 +3623,7 @@ static void vtd_piotlb_page_invalidate(IntelIOMMUState *s, uint16_t domain_id,
     g_hash_table_foreach(s->vtd_pasid_as,
                          vtd_flush_pasid_iotlb, &piotlb_info);
 
-    g_hash_table_foreach_remove(s->iotlb,
-                                vtd_hash_remove_by_page_piotlb, &info);
+    vtd_iotlb_remove_matching(s, vtd_hash_remove_by_page_piotlb, &info);
     vtd_iommu_unlock(s);
 
     QLIST_FOREACH(vtd_as, &(s->vtd_as_with_notifiers), next) {
@@ -6056,7 +6079,8 @@ static void vtd_realize(DeviceState *dev, Error **errp)
                                         &s->mr_ir, 1);
     /* No corresponding destroy */
     s->iotlb = g_hash_table_new_full(vtd_iotlb_hash, vtd_iotlb_equal,
-                                     g_free, g_free);
+                                     NULL, g_free);
+    QTAILQ_INIT(&s->iotlb_lru);
     s->vtd_address_spaces = g_hash_table_new_full(vtd_as_hash, vtd_as_equal,
                                       g_free, g_free);
     s->vtd_host_iommu_dev = g_hash_table_new_full(vtd_as_hash,
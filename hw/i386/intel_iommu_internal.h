@@ -117,7 +117,7 @@
 #define VTD_IOTLB_SID_SHIFT         26
 #define VTD_IOTLB_LVL_SHIFT         42
 #define VTD_IOTLB_PASID_SHIFT       44
-#define VTD_IOTLB_MAX_SIZE          1024    /* Max size of the hash table */
+#define VTD_IOTLB_MAX_SIZE          4096    /* Max size of the hash table */
 
 /* IOTLB_REG */
 #define VTD_TLB_GLOBAL_FLUSH        (1ULL << 60) /* Global invalidation */
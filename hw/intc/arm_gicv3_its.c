@@ -61,6 +61,26 @@ typedef struct ITEntry {
     uint32_t vpeid;
 } ITEntry;
 
+/*
+ * Cache of recent (DeviceID, EventID) translations, so that repeated
+ * interrupts from the same source skip the DTE and ITE reads from guest
+ * memory.  The tables belong to the ITS, and all our writes to them go
+ * through update_dte() and update_ite(), which flush the cache.
+ */
+#define ITS_TCACHE_SIZE 256
+
+typedef struct ITSTransCacheEntry {
+    bool valid;
+    uint32_t devid;
+    uint32_t eventid;
+    DTEntry dte;
+    ITEntry ite;
+} ITSTransCacheEntry;
+
+struct GICv3ITSTransCache {
+    ITSTransCacheEntry entries[ITS_TCACHE_SIZE];
+};
+
 typedef struct VTEntry {
     bool valid;
     unsigned vptsize;
@@ -105,6 +125,19 @@ static inline bool valid_doorbell(uint32_t id)
     return id == INTID_SPURIOUS || intid_in_lpi_range(id);
 }
 
+static ITSTransCacheEntry *its_tcache_entry(GICv3ITSState *s, uint32_t devid,
+                                            uint32_t eventid)
+{
+    uint32_t idx = (eventid ^ (devid * 0x9e3779b1)) % ITS_TCACHE_SIZE;
+
+    return &s->tcache->entries[idx];
+}
+
+static void its_tcache_flush(GICv3ITSState *s)
+{
+    memset(s->tcache, 0, sizeof(*s->tcache));
+}
+
 static uint64_t baser_base_addr(uint64_t value, uint32_t page_sz)
 {
     uint64_t result = 0;
@@ -219,6 +252,7 @@ static bool update_ite(GICv3ITSState *s, uint32_t eventid, const DTEntry *dte,
     uint64_t itel = 0;
     uint32_t iteh = 0;
 
+    its_tcache_flush(s);
     trace_gicv3_its_ite_write(dte->ittaddr, eventid, ite->valid,
                               ite->inttype, ite->intid, ite->icid,
                               ite->vpeid, ite->doorbell);
@@ -361,6 +395,7 @@ static ItsCmdResult lookup_ite(GICv3ITSState *s, const char *who,
                                uint32_t devid, uint32_t eventid, ITEntry *ite,
                                DTEntry *dte)
 {
+    ITSTransCacheEntry *tce;
     uint64_t num_eventids;
 
     if (devid >= s->dt.num_entries) {
@@ -370,6 +405,13 @@ static ItsCmdResult lookup_ite(GICv3ITSState *s, const char *who,
         return CMD_CONTINUE;
     }
 
+    tce = its_tcache_entry(s, devid, eventid);
+    if (tce->valid && tce->devid == devid && tce->eventid == eventid) {
+        *dte = tce->dte;
+        *ite = tce->ite;
+        return CMD_CONTINUE_OK;
+    }
+
     if (get_dte(s, devid, dte) != MEMTX_OK) {
         return CMD_STALL;
     }
@@ -398,6 +440,11 @@ static ItsCmdResult lookup_ite(GICv3ITSState *s, const char *who,
         return CMD_CONTINUE;
     }
 
+    tce->valid = true;
+    tce->devid = devid;
+    tce->eventid = eventid;
+    tce->dte = *dte;
+    tce->ite = *ite;
     return CMD_CONTINUE_OK;
 }
 
@@ -797,6 +844,7 @@ static bool update_dte(GICv3ITSState *s, uint32_t devid, const DTEntry *dte)
     uint64_t dteval = 0;
     MemTxResult res = MEMTX_OK;
 
+    its_tcache_flush(s);
     trace_gicv3_its_dte_write(devid, dte->valid, dte->size, dte->ittaddr);
 
     if (dte->valid) {
@@ -1418,6 +1466,8 @@ static void extract_table_params(GICv3ITSState *s)
     uint8_t  page_sz_type;
     uint8_t type;
     uint32_t page_sz = 0;
+
+    its_tcache_flush(s);
     uint64_t value;
 
     for (int i = 0; i < 8; i++) {
@@ -1933,6 +1983,7 @@ static void gicv3_arm_its_realize(DeviceState *dev, Error **errp)
 
     gicv3_add_its(s->gicv3, dev);
 
+    s->tcache = g_new0(struct GICv3ITSTransCache, 1);
     gicv3_its_init_mmio(s, &gicv3_its_control_ops, &gicv3_its_translation_ops);
 
     /* set the ITS default features supported */
@@ -1961,6 +2012,7 @@ static void gicv3_its_reset_hold(Object *obj)
 
     /* Quiescent bit reset to 1 */
     s->ctlr = FIELD_DP32(s->ctlr, GITS_CTLR, QUIESCENT, 1);
+    its_tcache_flush(s);
 
     /*
      * setting GITS_BASER0.Type = 0b001 (Device)
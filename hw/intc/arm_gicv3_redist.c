@@ -186,6 +186,16 @@ static bool set_pending_table_bit(GICv3CPUState *cs, uint64_t ptbase,
     return true;
 }
 
+static bool get_pending_table_bit(GICv3CPUState *cs, uint64_t ptbase,
+                                  int irq)
+{
+    uint8_t pend;
+
+    address_space_read(&cs->gic->dma_as, ptbase + irq / 8,
+                       MEMTXATTRS_UNSPECIFIED, &pend, 1);
+    return extract32(pend, irq % 8, 1);
+}
+
 static uint8_t gicr_read_ipriorityr(GICv3CPUState *cs, MemTxAttrs attrs,
                                     int irq)
 {
@@ -892,11 +902,29 @@ void gicv3_redist_inv_lpi(GICv3CPUState *cs, int irq)
 {
     /*
      * The only cached information for LPIs we have is the HPPLPI.
-     * We could be cleverer about identifying when we don't need
-     * to do a full rescan of the pending table, but until we find
-     * this is a performance issue, just always recalculate.
+     * Only a change to the HPPLPI itself can make it worse, which
+     * needs a full rescan of the pending table.  Any other LPI can
+     * only become the new HPPLPI, and only if it is pending.
      */
-    gicv3_redist_update_lpi(cs);
+    uint64_t lpipt_baddr, idbits;
+
+    if (irq == cs->hpplpi.irq || !(cs->gicr_ctlr & GICR_CTLR_ENABLE_LPIS)) {
+        gicv3_redist_update_lpi(cs);
+        return;
+    }
+
+    /* Out of range LPIs are never made pending */
+    idbits = MIN(FIELD_EX64(cs->gicr_propbaser, GICR_PROPBASER, IDBITS),
+                 GICD_TYPER_IDBITS);
+    if (irq > (1ULL << (idbits + 1)) - 1 || irq < GICV3_LPI_INTID_START) {
+        return;
+    }
+
+    lpipt_baddr = cs->gicr_pendbaser & R_GICR_PENDBASER_PHYADDR_MASK;
+    if (get_pending_table_bit(cs, lpipt_baddr, irq)) {
+        gicv3_redist_check_lpi_priority(cs, irq);
+        gicv3_redist_update(cs);
+    }
 }
 
 void gicv3_redist_mov_lpi(GICv3CPUState *src, GICv3CPUState *dest, int irq)
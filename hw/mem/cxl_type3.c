@@ -24,6 +24,8 @@
 #include "qemu/range.h"
 #include "qemu/rcu.h"
 #include "qemu/guest-random.h"
+#include "qemu/processor.h"
+#include "qemu/timer.h"
 #include "sysemu/hostmem.h"
 #include "sysemu/numa.h"
 #include "hw/cxl/cxl.h"
@@ -42,7 +44,25 @@ enum {
     CT3_CDAT_NUM_ENTRIES
 };
 
-static void ct3_build_cdat_entries_for_mr(CDATSubHeader **cdat_table,
+/* Replace the default value of a DSLBIS, given in units of @unit */
+static void ct3_dslbis_set(CDATDslbis *dslbis, uint64_t value, uint64_t unit)
+{
+    uint64_t scale = 1;
+
+    if (!value) {
+        return;
+    }
+
+    /* Entries are 16 bits and 0xffff is reserved */
+    while (value / scale >= UINT16_MAX) {
+        scale *= 10;
+    }
+    dslbis->entry_base_unit = unit * scale;
+    dslbis->entry[0] = value / scale;
+}
+
+static void ct3_build_cdat_entries_for_mr(CXLType3Dev *ct3d,
+                                          CDATSubHeader **cdat_table,
                                           int dsmad_handle, MemoryRegion *mr,
                                           bool is_pmem, uint64_t dpa_base)
 {
@@ -78,6 +98,8 @@ static void ct3_build_cdat_entries_for_mr(CDATSubHeader **cdat_table,
         .entry_base_unit = 10000, /* 10ns base */
         .entry[0] = 15, /* 150ns */
     };
+    /* Latencies are in ps */
+    ct3_dslbis_set(dslbis0, ct3d->perf.read_latency, 1000);
 
     dslbis1 = g_malloc(sizeof(*dslbis1));
     *dslbis1 = (CDATDslbis) {
@@ -91,6 +113,7 @@ static void ct3_build_cdat_entries_for_mr(CDATSubHeader **cdat_table,
         .entry_base_unit = 10000,
         .entry[0] = 25, /* 250ns */
     };
+    ct3_dslbis_set(dslbis1, ct3d->perf.write_latency, 1000);
 
     dslbis2 = g_malloc(sizeof(*dslbis2));
     *dslbis2 = (CDATDslbis) {
@@ -104,6 +127,8 @@ static void ct3_build_cdat_entries_for_mr(CDATSubHeader **cdat_table,
         .entry_base_unit = 1000, /* GB/s */
         .entry[0] = 16,
     };
+    /* Bandwidths are in MB/s */
+    ct3_dslbis_set(dslbis2, ct3d->perf.bandwidth / MiB, 1);
 
     dslbis3 = g_malloc(sizeof(*dslbis3));
     *dslbis3 = (CDATDslbis) {
@@ -117,6 +142,7 @@ static void ct3_build_cdat_entries_for_mr(CDATSubHeader **cdat_table,
         .entry_base_unit = 1000, /* GB/s */
         .entry[0] = 16,
     };
+    ct3_dslbis_set(dslbis3, ct3d->perf.bandwidth / MiB, 1);
 
     dsemts = g_malloc(sizeof(*dsemts));
     *dsemts = (CDATDsemts) {
@@ -176,15 +202,16 @@ static int ct3_build_cdat_table(CDATSubHeader ***cdat_table, void *priv)
 
     /* Now fill them in */
     if (volatile_mr) {
-        ct3_build_cdat_entries_for_mr(table, dsmad_handle++, volatile_mr,
-                                      false, 0);
+        ct3_build_cdat_entries_for_mr(ct3d, table, dsmad_handle++,
+                                      volatile_mr, false, 0);
         cur_ent = CT3_CDAT_NUM_ENTRIES;
     }
 
     if (nonvolatile_mr) {
         uint64_t base = volatile_mr ? memory_region_size(volatile_mr) : 0;
-        ct3_build_cdat_entries_for_mr(&(table[cur_ent]), dsmad_handle++,
-                                      nonvolatile_mr, true, base);
+        ct3_build_cdat_entries_for_mr(ct3d, &(table[cur_ent]),
+                                      dsmad_handle++, nonvolatile_mr, true,
+                                      base);
         cur_ent += CT3_CDAT_NUM_ENTRIES;
     }
     assert(len == cur_ent);
@@ -379,6 +406,8 @@ static void hdm_decoder_uncommit(CXLType3Dev *ct3d, int which)
     ctrl = FIELD_DP32(ctrl, CXL_HDM_DECODER0_CTRL, COMMITTED, 0);
 
     stl_le_p(cache_mem + R_CXL_HDM_DECODER0_CTRL + which * hdm_inc, ctrl);
+
+    cxl_type3_unmap_direct(ct3d);
 }
 
 static int ct3d_qmp_uncor_err_to_cxl(CxlUncorErrorType qmp_err)
@@ -740,6 +769,7 @@ static void ct3_exit(PCIDevice *pci_dev)
     CXLComponentState *cxl_cstate = &ct3d->cxl_cstate;
     ComponentRegisters *regs = &cxl_cstate->crb;
 
+    cxl_type3_unmap_direct(ct3d);
     pcie_aer_exit(pci_dev);
     cxl_doe_cdat_release(cxl_cstate);
     g_free(regs->special_ops);
@@ -856,6 +886,172 @@ static int cxl_type3_hpa_to_as_and_dpa(CXLType3Dev *ct3d,
     return 0;
 }
 
+static bool ct3_perf_enabled(CXLType3Dev *ct3d)
+{
+    return ct3d->perf.read_latency || ct3d->perf.write_latency ||
+           ct3d->perf.bandwidth;
+}
+
+/*
+ * Count an access and delay it as far memory would.  Accesses are served
+ * one after the other at the configured bandwidth, and each one completes
+ * a latency after its data was transferred.  The vCPU waits for that in
+ * the access itself.
+ */
+static void ct3_perf_access(CXLType3Dev *ct3d, unsigned size, bool is_write)
+{
+    uint64_t latency;
+    int64_t now, deadline;
+
+    if (is_write) {
+        ct3d->perf.writes++;
+        ct3d->perf.write_bytes += size;
+        latency = ct3d->perf.write_latency;
+    } else {
+        ct3d->perf.reads++;
+        ct3d->perf.read_bytes += size;
+        latency = ct3d->perf.read_latency;
+    }
+
+    if (!ct3_perf_enabled(ct3d)) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    deadline = now;
+    if (ct3d->perf.bandwidth) {
+        /* Single accesses take well below 1ns, carry over the remainder */
+        ct3d->perf.busy_rem += size * NANOSECONDS_PER_SECOND;
+        ct3d->perf.busy_until = MAX(now, ct3d->perf.busy_until) +
+                                ct3d->perf.busy_rem / ct3d->perf.bandwidth;
+        ct3d->perf.busy_rem %= ct3d->perf.bandwidth;
+        deadline = ct3d->perf.busy_until;
+    }
+    deadline += latency;
+    ct3d->perf.delay_ns += deadline - now;
+
+    while (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < deadline) {
+        cpu_relax();
+    }
+}
+
+static QLIST_HEAD(, CXLType3Dev) ct3d_direct_mapped =
+    QLIST_HEAD_INITIALIZER(ct3d_direct_mapped);
+
+void cxl_type3_map_direct(PCIDevice *d, hwaddr host_addr, Range *linear,
+                          MemoryRegion *window, hwaddr window_base)
+{
+    int hdm_inc = R_CXL_HDM_DECODER1_BASE_LO - R_CXL_HDM_DECODER0_BASE_LO;
+    CXLType3Dev *ct3d = CXL_TYPE3(d);
+    uint32_t *cache_mem = ct3d->cxl_cstate.crb.cache_mem_registers;
+    MemoryRegion *vmr = NULL, *pmr = NULL, *mr;
+    uint64_t base = 0, size = 0, lob, upb, dpa;
+    unsigned int hdm_count;
+    uint32_t cap, ctrl, low, high;
+    int i;
+
+    if (sanitize_running(&ct3d->cci) || ct3_perf_enabled(ct3d)) {
+        return;
+    }
+
+    cap = ldl_le_p(cache_mem + R_CXL_HDM_DECODER_CAPABILITY);
+    hdm_count = cxl_decoder_count_dec(FIELD_EX32(cap,
+                                                 CXL_HDM_DECODER_CAPABILITY,
+                                                 DECODER_COUNT));
+    for (i = 0; i < hdm_count; i++) {
+        low = ldl_le_p(cache_mem + R_CXL_HDM_DECODER0_BASE_LO + i * hdm_inc);
+        high = ldl_le_p(cache_mem + R_CXL_HDM_DECODER0_BASE_HI + i * hdm_inc);
+        base = ((uint64_t)high << 32) | (low & 0xf0000000);
+
+        low = ldl_le_p(cache_mem + R_CXL_HDM_DECODER0_SIZE_LO + i * hdm_inc);
+        high = ldl_le_p(cache_mem + R_CXL_HDM_DECODER0_SIZE_HI + i * hdm_inc);
+        size = ((uint64_t)high << 32) | (low & 0xf0000000);
+
+        if (host_addr >= base && host_addr - base < size) {
+            break;
+        }
+    }
+    if (i == hdm_count || ct3d->direct[i].window) {
+        return;
+    }
+
+    ctrl = ldl_le_p(cache_mem + R_CXL_HDM_DECODER0_CTRL + i * hdm_inc);
+    if (!FIELD_EX32(ctrl, CXL_HDM_DECODER0_CTRL, COMMITTED) ||
+        FIELD_EX32(ctrl, CXL_HDM_DECODER0_CTRL, IW)) {
+        return;
+    }
+
+    /* Both ranges contain @host_addr, so they overlap */
+    lob = MAX(range_lob(linear), base);
+    upb = MIN(range_upb(linear), base + size - 1);
+    if (!cxl_type3_dpa(ct3d, lob, &dpa)) {
+        return;
+    }
+
+    if (ct3d->hostvmem) {
+        vmr = host_memory_backend_get_memory(ct3d->hostvmem);
+    }
+    if (ct3d->hostpmem) {
+        pmr = host_memory_backend_get_memory(ct3d->hostpmem);
+    }
+    if (vmr && dpa < memory_region_size(vmr)) {
+        mr = vmr;
+    } else {
+        mr = pmr;
+        if (vmr) {
+            dpa -= memory_region_size(vmr);
+        }
+    }
+
+    /* The range must not straddle the volatile and persistent backends */
+    if (!mr || dpa + (upb - lob) >= memory_region_size(mr)) {
+        return;
+    }
+
+    memory_region_init_alias(&ct3d->direct[i].mr, OBJECT(ct3d),
+                             "cxl-type3-direct", mr, dpa, upb - lob + 1);
+    memory_region_add_subregion_overlap(window, lob - window_base,
+                                        &ct3d->direct[i].mr, 1);
+    ct3d->direct[i].window = window;
+
+    if (!ct3d->direct_mapped) {
+        QLIST_INSERT_HEAD(&ct3d_direct_mapped, ct3d, direct_node);
+        ct3d->direct_mapped = true;
+    }
+}
+
+void cxl_type3_unmap_direct(CXLType3Dev *ct3d)
+{
+    int i;
+
+    if (!ct3d->direct_mapped) {
+        return;
+    }
+
+    memory_region_transaction_begin();
+    for (i = 0; i < CXL_HDM_DECODER_COUNT; i++) {
+        if (ct3d->direct[i].window) {
+            memory_region_del_subregion(ct3d->direct[i].window,
+                                        &ct3d->direct[i].mr);
+            object_unparent(OBJECT(&ct3d->direct[i].mr));
+            ct3d->direct[i].window = NULL;
+        }
+    }
+    memory_region_transaction_commit();
+
+    QLIST_REMOVE(ct3d, direct_node);
+    ct3d->direct_mapped = false;
+}
+
+void cxl_type3_unmap_direct_all(void)
+{
+    CXLType3Dev *ct3d, *next;
+
+    QLIST_FOREACH_SAFE(ct3d, &ct3d_direct_mapped, direct_node, next) {
+        cxl_type3_unmap_direct(ct3d);
+    }
+}
+
 MemTxResult cxl_type3_read(PCIDevice *d, hwaddr host_addr, uint64_t *data,
                            unsigned size, MemTxAttrs attrs)
 {
@@ -875,6 +1071,8 @@ MemTxResult cxl_type3_read(PCIDevice *d, hwaddr host_addr, uint64_t *data,
         return MEMTX_OK;
     }
 
+    ct3_perf_access(ct3d, size, false);
+
     return address_space_read(as, dpa_offset, attrs, data, size);
 }
 
@@ -896,6 +1094,8 @@ MemTxResult cxl_type3_write(PCIDevice *d, hwaddr host_addr, uint64_t data,
         return MEMTX_OK;
     }
 
+    ct3_perf_access(ct3d, size, true);
+
     return address_space_write(as, dpa_offset, attrs, &data, size);
 }
 
@@ -905,6 +1105,9 @@ static void ct3d_reset(DeviceState *dev)
     uint32_t *reg_state = ct3d->cxl_cstate.crb.cache_mem_registers;
     uint32_t *write_msk = ct3d->cxl_cstate.crb.cache_mem_regs_write_mask;
 
+    cxl_type3_unmap_direct(ct3d);
+    ct3d->perf.busy_until = 0;
+    ct3d->perf.busy_rem = 0;
     cxl_component_register_init_common(reg_state, write_msk, CXL2_TYPE3_DEVICE);
     cxl_device_register_init_t3(ct3d);
 
@@ -931,6 +1134,9 @@ static Property ct3_props[] = {
                      HostMemoryBackend *),
     DEFINE_PROP_UINT64("sn", CXLType3Dev, sn, UI64_NULL),
     DEFINE_PROP_STRING("cdat", CXLType3Dev, cxl_cstate.cdat.filename),
+    DEFINE_PROP_UINT64("read-latency", CXLType3Dev, perf.read_latency, 0),
+    DEFINE_PROP_UINT64("write-latency", CXLType3Dev, perf.write_latency, 0),
+    DEFINE_PROP_SIZE("bandwidth", CXLType3Dev, perf.bandwidth, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1520,6 +1726,23 @@ void qmp_cxl_inject_memory_module_event(const char *path, CxlEventLog log,
     }
 }
 
+static void ct3_instance_init(Object *obj)
+{
+    CXLType3Dev *ct3d = CXL_TYPE3(obj);
+
+    object_property_add_uint64_ptr(obj, "read-count", &ct3d->perf.reads,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "write-count", &ct3d->perf.writes,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "read-bytes", &ct3d->perf.read_bytes,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "write-bytes",
+                                   &ct3d->perf.write_bytes,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "throttle-delay-ns",
+                                   &ct3d->perf.delay_ns, OBJ_PROP_FLAG_READ);
+}
+
 static void ct3_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
@@ -1553,6 +1776,7 @@ static const TypeInfo ct3d_info = {
     .class_size = sizeof(struct CXLType3Class),
     .class_init = ct3_class_init,
     .instance_size = sizeof(CXLType3Dev),
+    .instance_init = ct3_instance_init,
     .interfaces = (InterfaceInfo[]) {
         { INTERFACE_CXL_DEVICE },
         { INTERFACE_PCIE_DEVICE },
@@ -825,6 +825,21 @@ e1000e_ring_advance(E1000ECore *core, const E1000ERingInfo *r, uint32_t count)
     }
 }
 
+/*
+ * Number of descriptors from the head that are contiguous in memory, up
+ * to the tail or to the end of the ring, at least one
+ */
+static inline uint32_t
+e1000e_ring_contig_descr_num(E1000ECore *core, const E1000ERingInfo *r)
+{
+    uint32_t size = core->mac[r->dlen] / E1000_RING_DESC_LEN;
+
+    if (core->mac[r->dh] < core->mac[r->dt]) {
+        return core->mac[r->dt] - core->mac[r->dh];
+    }
+    return core->mac[r->dh] < size ? size - core->mac[r->dh] : 1;
+}
+
 static inline uint32_t
 e1000e_ring_free_descr_num(E1000ECore *core, const E1000ERingInfo *r)
 {
@@ -856,6 +871,9 @@ e1000e_ring_len(E1000ECore *core, const E1000ERingInfo *r)
     return core->mac[r->dlen];
 }
 
+/* Maximum number of TX descriptors fetched at once */
+#define E1000E_TX_DESC_BATCH 16
+
 typedef struct E1000E_TxRing_st {
     const E1000ERingInfo *i;
     struct e1000e_tx *tx;
@@ -902,7 +920,7 @@ static void
 e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
 {
     dma_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc descs[E1000E_TX_DESC_BATCH];
     bool ide = false;
     const E1000ERingInfo *txi = txr->i;
     uint32_t cause = E1000_ICS_TXQE;
@@ -913,17 +931,25 @@ e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
     }
 
     while (!e1000e_ring_empty(core, txi)) {
+        uint32_t i, n = MIN(e1000e_ring_contig_descr_num(core, txi),
+                            E1000E_TX_DESC_BATCH);
+
+        /* Fetch the descriptors up to the tail in a single DMA access */
         base = e1000e_ring_head_descr(core, txi);
+        pci_dma_read(core->owner, base, descs, n * sizeof(descs[0]));
 
-        pci_dma_read(core->owner, base, &desc, sizeof(desc));
+        for (i = 0; i < n; i++, base += sizeof(descs[0])) {
+            struct e1000_tx_desc *desc = &descs[i];
 
-        trace_e1000e_tx_descr((void *)(intptr_t)desc.buffer_addr,
-                              desc.lower.data, desc.upper.data);
+            trace_e1000e_tx_descr((void *)(intptr_t)desc->buffer_addr,
+                                  desc->lower.data, desc->upper.data);
 
-        e1000e_process_tx_desc(core, txr->tx, &desc, txi->idx);
-        cause |= e1000e_txdesc_writeback(core, base, &desc, &ide, txi->idx);
+            e1000e_process_tx_desc(core, txr->tx, desc, txi->idx);
+            cause |= e1000e_txdesc_writeback(core, base, desc, &ide,
+                                             txi->idx);
 
-        e1000e_ring_advance(core, txi, 1);
+            e1000e_ring_advance(core, txi, 1);
+        }
     }
 
     if (!ide || !e1000e_intrmgr_delay_tx_causes(core, &cause)) {
@@ -731,6 +731,21 @@ igb_ring_advance(IGBCore *core, const E1000ERingInfo *r, uint32_t count)
     }
 }
 
+/*
+ * Number of descriptors from the head that are contiguous in memory, up
+ * to the tail or to the end of the ring, at least one
+ */
+static inline uint32_t
+igb_ring_contig_descr_num(IGBCore *core, const E1000ERingInfo *r)
+{
+    uint32_t size = core->mac[r->dlen] / E1000_RING_DESC_LEN;
+
+    if (core->mac[r->dh] < core->mac[r->dt]) {
+        return core->mac[r->dt] - core->mac[r->dh];
+    }
+    return core->mac[r->dh] < size ? size - core->mac[r->dh] : 1;
+}
+
 static inline uint32_t
 igb_ring_free_descr_num(IGBCore *core, const E1000ERingInfo *r)
 {
@@ -756,6 +771,9 @@ igb_ring_enabled(IGBCore *core, const E1000ERingInfo *r)
     return core->mac[r->dlen] > 0;
 }
 
+/* Maximum number of TX descriptors fetched at once */
+#define IGB_TX_DESC_BATCH 16
+
 typedef struct IGB_TxRing_st {
     const E1000ERingInfo *i;
     struct igb_tx *tx;
@@ -878,7 +896,7 @@ igb_start_xmit(IGBCore *core, const IGB_TxRing *txr)
 {
     PCIDevice *d;
     dma_addr_t base;
-    union e1000_adv_tx_desc desc;
+    union e1000_adv_tx_desc descs[IGB_TX_DESC_BATCH];
     const E1000ERingInfo *txi = txr->i;
     uint32_t eic = 0;
 
@@ -893,16 +911,23 @@ igb_start_xmit(IGBCore *core, const IGB_TxRing *txr)
     }
 
     while (!igb_ring_empty(core, txi)) {
+        uint32_t i, n = MIN(igb_ring_contig_descr_num(core, txi),
+                            IGB_TX_DESC_BATCH);
+
+        /* Fetch the descriptors up to the tail in a single DMA access */
         base = igb_ring_head_descr(core, txi);
+        pci_dma_read(d, base, descs, n * sizeof(descs[0]));
 
-        pci_dma_read(d, base, &desc, sizeof(desc));
+        for (i = 0; i < n; i++, base += sizeof(descs[0])) {
+            union e1000_adv_tx_desc *desc = &descs[i];
 
-        trace_e1000e_tx_descr((void *)(intptr_t)desc.read.buffer_addr,
-                              desc.read.cmd_type_len, desc.wb.status);
+            trace_e1000e_tx_descr((void *)(intptr_t)desc->read.buffer_addr,
+                                  desc->read.cmd_type_len, desc->wb.status);
 
-        igb_process_tx_desc(core, d, txr->tx, &desc, txi->idx);
-        igb_ring_advance(core, txi, 1);
-        eic |= igb_txdesc_writeback(core, base, &desc, txi);
+            igb_process_tx_desc(core, d, txr->tx, desc, txi->idx);
+            igb_ring_advance(core, txi, 1);
+            eic |= igb_txdesc_writeback(core, base, desc, txi);
+        }
     }
 
     if (eic) {
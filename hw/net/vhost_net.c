@@ -156,6 +156,56 @@ void vhost_net_save_acked_features(NetClientState *nc)
 #endif
 }
 
+void vhost_net_reset_inflight(NetClientState *nc)
+{
+#ifdef CONFIG_VHOST_NET_USER
+    if (nc->info->type == NET_CLIENT_DRIVER_VHOST_USER) {
+        vhost_dev_free_inflight(vhost_user_get_inflight(nc));
+    }
+#endif
+}
+
+/*
+ * vhost-user backends that support inflight I/O tracking get one inflight
+ * region for all queues of the device, set up through the first queue
+ * pair.  The region is kept while the backend reconnects, so that the new
+ * backend can resume the rings; @resumed tells whether that is the case.
+ */
+static int vhost_net_set_inflight(struct vhost_net *net, VirtIODevice *dev,
+                                  bool *resumed)
+{
+#ifdef CONFIG_VHOST_NET_USER
+    VirtIONet *n = VIRTIO_NET(dev);
+    struct vhost_inflight *inflight;
+    int r;
+
+    if (net->nc->info->type != NET_CLIENT_DRIVER_VHOST_USER) {
+        return 0;
+    }
+    inflight = vhost_user_get_inflight(net->nc);
+
+    r = vhost_dev_prepare_inflight(&net->dev, dev);
+    if (r < 0) {
+        return r;
+    }
+
+    *resumed = inflight->addr != NULL;
+    if (!inflight->addr) {
+        r = vhost_dev_get_inflight(&net->dev,
+                                   MAX(n->net_conf.rx_queue_size,
+                                       n->net_conf.tx_queue_size),
+                                   inflight);
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    return vhost_dev_set_inflight(&net->dev, inflight);
+#else
+    return 0;
+#endif
+}
+
 static int vhost_net_get_fd(NetClientState *backend)
 {
     switch (backend->info->type) {
@@ -360,6 +410,7 @@ int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
     struct vhost_net *net;
     int r, e, i, index_end = data_queue_pairs * 2;
     NetClientState *peer;
+    bool resumed = false;
 
     if (cvq) {
         index_end += 1;
@@ -396,6 +447,13 @@ int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
         goto err;
     }
 
+    r = vhost_net_set_inflight(get_vhost_net(qemu_get_peer(ncs, 0)), dev,
+                               &resumed);
+    if (r < 0) {
+        error_report("Error setting inflight: %d", -r);
+        goto err_inflight;
+    }
+
     for (i = 0; i < nvhosts; i++) {
         if (i < data_queue_pairs) {
             peer = qemu_get_peer(ncs, i);
@@ -418,6 +476,16 @@ int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
         }
     }
 
+    if (resumed) {
+        /* Let the new backend look at buffers queued while it was away */
+        for (i = 0; i < index_end; i++) {
+            if (virtio_queue_get_desc_addr(dev, i)) {
+                event_notifier_set(
+                    virtio_queue_get_host_notifier(virtio_get_queue(dev, i)));
+            }
+        }
+    }
+
     return 0;
 
 err_start:
@@ -426,6 +494,7 @@ err_start:
                                   i : n->max_queue_pairs);
         vhost_net_stop_one(get_vhost_net(peer), dev);
     }
+err_inflight:
     e = k->set_guest_notifiers(qbus->parent, total_notifiers, false);
     if (e < 0) {
         fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", e);
@@ -456,6 +525,12 @@ void vhost_net_stop(VirtIODevice *dev, NetClientState *ncs,
         vhost_net_stop_one(get_vhost_net(peer), dev);
     }
 
+    /* Only a backend that went away may resume the rings later */
+    peer = qemu_get_peer(ncs, 0);
+    if (!peer->link_down) {
+        vhost_net_reset_inflight(peer);
+    }
+
     r = k->set_guest_notifiers(qbus->parent, total_notifiers, false);
     if (r < 0) {
         fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", r);
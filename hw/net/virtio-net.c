@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/atomic.h"
+#include "block/aio-wait.h"
 #include "qemu/iov.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
@@ -34,6 +35,7 @@
 #include "qapi/error.h"
 #include "qapi/qapi-events-net.h"
 #include "hw/qdev-properties.h"
+#include "hw/qdev-properties-system.h"
 #include "qapi/qapi-types-migration.h"
 #include "qapi/qapi-events-migration.h"
 #include "hw/virtio/virtio-access.h"
@@ -58,6 +60,11 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/* Number of TX elements popped from the ring at once */
+#define VIRTIO_NET_TX_BATCH 32
+/* Room for the iovecs of one batch handed to qemu_sendv_packet_batch() */
+#define VIRTIO_NET_TX_BATCH_IOV 256
+
 #define VIRTIO_NET_IP4_ADDR_SIZE   8        /* ipv4 saddr + daddr */
 
 #define VIRTIO_NET_TCP_FLAG         0x3F
@@ -188,6 +195,82 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     }
 }
 
+static bool virtio_net_attach_ebpf_rx_filter(VirtIONet *n, int prog_fd)
+{
+    NetClientState *nc = qemu_get_peer(qemu_get_queue(n->nic), 0);
+
+    if (nc == NULL || nc->info->set_filter_ebpf == NULL) {
+        return false;
+    }
+
+    return nc->info->set_filter_ebpf(nc, prog_fd);
+}
+
+static void virtio_net_load_ebpf_rx_filter(VirtIONet *n)
+{
+    /* Loading needs privileges; without them QEMU keeps filtering alone */
+    if (n->ebpf_rx_filter_enabled &&
+        virtio_net_attach_ebpf_rx_filter(n, -1)) {
+        ebpf_rx_filter_load(&n->ebpf_rx_filter);
+    }
+}
+
+static void virtio_net_unload_ebpf_rx_filter(VirtIONet *n)
+{
+    if (ebpf_rx_filter_is_loaded(&n->ebpf_rx_filter)) {
+        virtio_net_attach_ebpf_rx_filter(n, -1);
+        ebpf_rx_filter_unload(&n->ebpf_rx_filter);
+    }
+}
+
+/*
+ * Mirror the receive filter state into the backend so that frames which
+ * receive_filter() would drop are dropped before they are read from it.
+ * receive_filter() keeps running, so this is purely an optimization.
+ */
+static void virtio_net_update_ebpf_rx_filter(VirtIONet *n)
+{
+    uint8_t macs[EBPF_RX_FILTER_MAX_MACS * ETH_ALEN];
+    uint32_t flags = 0;
+
+    if (!ebpf_rx_filter_is_loaded(&n->ebpf_rx_filter)) {
+        return;
+    }
+
+    if (n->promisc) {
+        virtio_net_attach_ebpf_rx_filter(n, -1);
+        return;
+    }
+
+    if (n->nobcast) {
+        flags |= EBPF_RX_FILTER_F_NOBCAST;
+    }
+    if (n->nomulti) {
+        flags |= EBPF_RX_FILTER_F_NOMULTI;
+    }
+    if (n->allmulti || n->mac_table.multi_overflow) {
+        flags |= EBPF_RX_FILTER_F_ALLMULTI;
+    }
+    if (n->nouni) {
+        flags |= EBPF_RX_FILTER_F_NOUNI;
+    }
+    if (n->alluni || n->mac_table.uni_overflow) {
+        flags |= EBPF_RX_FILTER_F_ALLUNI;
+    }
+
+    QEMU_BUILD_BUG_ON(MAC_TABLE_ENTRIES + 1 > EBPF_RX_FILTER_MAX_MACS);
+    memcpy(macs, n->mac, ETH_ALEN);
+    memcpy(macs + ETH_ALEN, n->mac_table.macs,
+           n->mac_table.in_use * ETH_ALEN);
+
+    if (!ebpf_rx_filter_set(&n->ebpf_rx_filter, flags, macs,
+                            n->mac_table.in_use + 1, n->vlans) ||
+        !virtio_net_attach_ebpf_rx_filter(n,
+                                          n->ebpf_rx_filter.program_fd)) {
+        virtio_net_unload_ebpf_rx_filter(n);
+    }
+}
+
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -201,6 +284,7 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
         memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
         qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
+        virtio_net_update_ebpf_rx_filter(n);
     }
 
     /*
@@ -372,14 +456,27 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/* Queue pairs bound to an IOThread signal the guest through irqfd */
+static void virtio_net_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (qemu_in_iothread()) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(vdev, vq);
     }
 }
 
+static void virtio_net_dataplane_pause(VirtIONet *n);
+static void virtio_net_dataplane_resume(VirtIONet *n);
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -387,6 +484,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     int i;
     uint8_t queue_status;
 
+    virtio_net_dataplane_pause(n);
+
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
@@ -435,6 +534,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+
+    virtio_net_dataplane_resume(n);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -602,6 +703,7 @@ static void virtio_net_queue_enable(VirtIODevice *vdev, uint32_t queue_index)
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    NetClientState *nc = qemu_get_queue(n->nic);
     int i;
 
     /* Reset back to compatibility mode */
@@ -626,10 +728,18 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+    virtio_net_update_ebpf_rx_filter(n);
 
-    /* Flush any async TX */
+    /* Flush any async TX, drop partially coalesced RX */
     for (i = 0;  i < n->max_queue_pairs; i++) {
         flush_or_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+        net_gro_free(n->vqs[i].gro);
+        n->vqs[i].gro = NULL;
+    }
+
+    /* A reconnecting backend must not resume the rings of before reset */
+    if (nc->peer) {
+        vhost_net_reset_inflight(nc->peer);
     }
 }
 
@@ -786,6 +896,7 @@ static void virtio_net_set_queue_pairs(VirtIONet *n)
 }
 
 static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue);
+static void virtio_net_update_gro(VirtIONet *n);
 
 static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
                                         Error **errp)
@@ -804,9 +915,14 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
 
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        if (n->gro) {
+            /* Large frames come from the GRO stage; RSC needs a vnet hdr */
+            virtio_clear_feature(&features, VIRTIO_NET_F_RSC_EXT);
+        } else {
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        }
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
 
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_USO);
@@ -877,6 +993,11 @@ static uint64_t virtio_net_bad_features(VirtIODevice *vdev)
 
 static void virtio_net_apply_guest_offloads(VirtIONet *n)
 {
+    if (!n->has_vnet_hdr) {
+        virtio_net_update_gro(n);
+        return;
+    }
+
     qemu_set_offload(qemu_get_queue(n->nic)->peer,
             !!(n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_CSUM)),
             !!(n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO4)),
@@ -1012,7 +1133,7 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
         virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO6);
     n->rss_data.redirect = virtio_has_feature(features, VIRTIO_NET_F_RSS);
 
-    if (n->has_vnet_hdr) {
+    if (n->has_vnet_hdr || n->gro) {
         n->curr_guest_offloads =
             virtio_net_guest_offloads_by_features(features);
         virtio_net_apply_guest_offloads(n);
@@ -1036,6 +1157,7 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
     if (!virtio_has_feature(features, VIRTIO_NET_F_CTRL_VLAN)) {
         memset(n->vlans, 0xff, MAX_VLAN >> 3);
     }
+    virtio_net_update_ebpf_rx_filter(n);
 
     if (virtio_has_feature(features, VIRTIO_NET_F_STANDBY)) {
         qapi_event_send_failover_negotiated(n->netclient_name);
@@ -1105,7 +1227,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
 
         offloads = virtio_ldq_p(vdev, &offloads);
 
-        if (!n->has_vnet_hdr) {
+        if (!n->has_vnet_hdr && !n->gro) {
             return VIRTIO_NET_ERR;
         }
 
@@ -1602,10 +1724,13 @@ size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
         status = VIRTIO_NET_ERR;
     } else if (ctrl.class == VIRTIO_NET_CTRL_RX) {
         status = virtio_net_handle_rx_mode(n, ctrl.cmd, iov, out_num);
+        virtio_net_update_ebpf_rx_filter(n);
     } else if (ctrl.class == VIRTIO_NET_CTRL_MAC) {
         status = virtio_net_handle_mac(n, ctrl.cmd, iov, out_num);
+        virtio_net_update_ebpf_rx_filter(n);
     } else if (ctrl.class == VIRTIO_NET_CTRL_VLAN) {
         status = virtio_net_handle_vlan_table(n, ctrl.cmd, iov, out_num);
+        virtio_net_update_ebpf_rx_filter(n);
     } else if (ctrl.class == VIRTIO_NET_CTRL_ANNOUNCE) {
         status = virtio_net_handle_announce(n, ctrl.cmd, iov, out_num);
     } else if (ctrl.class == VIRTIO_NET_CTRL_MQ) {
@@ -1623,8 +1748,12 @@ size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
 
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
+    VirtIONet *n = VIRTIO_NET(vdev);
     VirtQueueElement *elem;
 
+    /* Filters and queue pairs must not change under the IOThreads' feet */
+    virtio_net_dataplane_pause(n);
+
     for (;;) {
         size_t written;
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
@@ -1644,6 +1773,8 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             break;
         }
     }
+
+    virtio_net_dataplane_resume(n);
 }
 
 /* RX */
@@ -1652,7 +1783,12 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    VirtIONetQueue *q = &n->vqs[queue_index];
 
+    /* Coalesced frames go first, they are older than anything queued */
+    if (q->gro && !net_gro_flush(q->gro)) {
+        return;
+    }
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
 
@@ -1737,7 +1873,8 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
 }
 
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
-                           const void *buf, size_t size)
+                           const void *buf, size_t size,
+                           const struct virtio_net_hdr *gro_hdr)
 {
     if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
@@ -1754,6 +1891,11 @@ static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
             .flags = 0,
             .gso_type = VIRTIO_NET_HDR_GSO_NONE
         };
+
+        if (gro_hdr) {
+            hdr = *gro_hdr;
+            virtio_net_hdr_swap(VIRTIO_DEVICE(n), &hdr);
+        }
         iov_from_buf(iov, iov_cnt, 0, &hdr, sizeof hdr);
     }
 }
@@ -1928,8 +2070,10 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
     return (index == new_index) ? -1 : new_index;
 }
 
+/* @gro_hdr describes frames coalesced by the GRO stage */
 static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size, bool no_rss)
+                                      size_t size, bool no_rss,
+                                      const struct virtio_net_hdr *gro_hdr)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1950,7 +2094,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
         int index = virtio_net_process_rss(nc, buf, size);
         if (index >= 0) {
             NetClientState *nc2 = qemu_get_subqueue(n->nic, index);
-            return virtio_net_receive_rcu(nc2, buf, size, true);
+            return virtio_net_receive_rcu(nc2, buf, size, true, gro_hdr);
         }
     }
 
@@ -2011,7 +2155,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem->in_num, buf, size);
+            receive_header(n, sg, elem->in_num, buf, size, gro_hdr);
             if (n->rss_data.populate_hash) {
                 offset = sizeof(mhdr);
                 iov_from_buf(sg, elem->in_num, offset,
@@ -2058,7 +2202,12 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (q->rx_burst) {
+        /* Signalled once by virtio_net_receive_burst() */
+        q->rx_notify_pending = true;
+    } else {
+        virtio_net_notify(vdev, q->rx_vq);
+    }
 
     return size;
 
@@ -2076,7 +2225,47 @@ static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
 {
     RCU_READ_LOCK_GUARD();
 
-    return virtio_net_receive_rcu(nc, buf, size, false);
+    return virtio_net_receive_rcu(nc, buf, size, false, NULL);
+}
+
+static ssize_t virtio_net_gro_deliver(void *opaque,
+                                      const struct virtio_net_hdr *hdr,
+                                      const uint8_t *buf, size_t size)
+{
+    VirtIONetQueue *q = opaque;
+    NetClientState *nc = qemu_get_subqueue(q->n->nic, q - q->n->vqs);
+
+    RCU_READ_LOCK_GUARD();
+
+    return virtio_net_receive_rcu(nc, buf, size, false, hdr);
+}
+
+/*
+ * Backends without a vnet header only pass MTU sized frames.  Coalesce
+ * them into large ones when the guest accepts those, unless the queues
+ * run in IOThreads.
+ */
+static void virtio_net_update_gro(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    uint64_t offloads = n->curr_guest_offloads;
+    bool csum = offloads & (1ULL << VIRTIO_NET_F_GUEST_CSUM);
+    bool tcp4 = csum && (offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO4));
+    bool tcp6 = csum && (offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO6));
+    int i, queue_pairs = n->multiqueue ? n->max_queue_pairs : 1;
+
+    for (i = 0; i < queue_pairs; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        /* Frames still being coalesced are dropped */
+        net_gro_free(q->gro);
+        q->gro = NULL;
+        if (n->gro && !n->has_vnet_hdr && !n->vq_aio_context &&
+            (tcp4 || tcp6)) {
+            q->gro = net_gro_new(tcp4, tcp6, virtio_net_gro_deliver, q,
+                                 &DEVICE(vdev)->mem_reentrancy_guard);
+        }
+    }
 }
 
 static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
@@ -2676,8 +2865,12 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
     if ((n->rsc4_enabled || n->rsc6_enabled)) {
         return virtio_net_rsc_receive(nc, buf, size);
+    } else if (q->gro) {
+        return net_gro_receive(q->gro, buf, size);
     } else {
         return virtio_net_do_receive(nc, buf, size);
     }
@@ -2693,9 +2886,9 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     int ret;
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(vdev, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_element_free(q->tx_vq, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -2717,14 +2910,94 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     }
 }
 
+/* Give back popped elements that were not processed, newest first */
+static void virtio_net_tx_unpop(VirtQueue *vq, VirtQueueElement **elems,
+                                unsigned int num)
+{
+    while (num--) {
+        virtqueue_unpop(vq, elems[num], 0);
+        virtqueue_element_free(vq, elems[num]);
+    }
+}
+
+/*
+ * Hand a prefix of @elems to the peer with a single
+ * qemu_sendv_packet_batch() call and complete the sent ones with one used
+ * ring update.  Returns the number of elements consumed; the caller sends
+ * the others one by one, which also takes care of malformed descriptors.
+ */
+static unsigned int virtio_net_tx_batch(VirtIONetQueue *q, NetClientState *nc,
+                                        VirtQueueElement **elems,
+                                        unsigned int num)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct iovec iov[VIRTIO_NET_TX_BATCH_IOV];
+    int iovcnt[VIRTIO_NET_TX_BATCH];
+    unsigned int i, niov = 0;
+    int sent;
+
+    /* Byte swapping the header needs a bounce buffer per packet */
+    if (n->needs_vnet_hdr_swap) {
+        return 0;
+    }
+
+    assert(num <= ARRAY_SIZE(iovcnt));
+    for (i = 0; i < num; i++) {
+        VirtQueueElement *elem = elems[i];
+        unsigned int cnt;
+
+        if (elem->out_num < 1 || elem->out_num + 1 > ARRAY_SIZE(iov) - niov ||
+            iov_size(elem->out_sg, elem->out_num) < n->guest_hdr_len) {
+            break;
+        }
+
+        if (n->host_hdr_len == n->guest_hdr_len) {
+            cnt = iov_copy(&iov[niov], ARRAY_SIZE(iov) - niov,
+                           elem->out_sg, elem->out_num, 0, -1);
+        } else {
+            cnt = iov_copy(&iov[niov], ARRAY_SIZE(iov) - niov,
+                           elem->out_sg, elem->out_num, 0, n->host_hdr_len);
+            cnt += iov_copy(&iov[niov + cnt], ARRAY_SIZE(iov) - niov - cnt,
+                            elem->out_sg, elem->out_num,
+                            n->guest_hdr_len, -1);
+        }
+        iovcnt[i] = cnt;
+        niov += cnt;
+    }
+
+    if (!i) {
+        return 0;
+    }
+
+    sent = qemu_sendv_packet_batch(nc, iov, iovcnt, i);
+    if (!sent) {
+        return 0;
+    }
+
+    for (i = 0; i < sent; i++) {
+        virtqueue_fill(q->tx_vq, elems[i], 0, i);
+    }
+    virtqueue_flush(q->tx_vq, sent);
+    virtio_net_notify(vdev, q->tx_vq);
+
+    for (i = 0; i < sent; i++) {
+        virtqueue_element_free(q->tx_vq, elems[i]);
+    }
+    return sent;
+}
+
 /* TX */
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
     VirtQueueElement *elem;
+    unsigned int i = 0, num_elems = 0;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = qemu_get_subqueue(n->nic, queue_index);
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -2738,33 +3011,52 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         ssize_t ret;
         unsigned int out_num;
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_v1_hash vhdr;
+        /* Must outlive the call if the packet is queued by reference */
+        struct virtio_net_hdr_v1_hash *vhdr = &q->async_tx.vhdr;
+
+        if (i == num_elems) {
+            /* Never pop more than the rest of the burst */
+            num_elems = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                            (void **)elems,
+                                            MIN(ARRAY_SIZE(elems),
+                                                n->tx_burst - num_packets));
+            if (!num_elems) {
+                break;
+            }
 
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
-            break;
+            i = virtio_net_tx_batch(q, nc, elems, num_elems);
+            num_packets += i;
+            if (i == num_elems) {
+                if (num_packets >= n->tx_burst) {
+                    break;
+                }
+                continue;
+            }
         }
+        elem = elems[i++];
 
         out_num = elem->out_num;
         out_sg = elem->out_sg;
         if (out_num < 1) {
             virtio_error(vdev, "virtio-net header not in first element");
             virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_element_free(q->tx_vq, elem);
+            virtio_net_tx_unpop(q->tx_vq, elems + i, num_elems - i);
             return -EINVAL;
         }
 
         if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &vhdr, n->guest_hdr_len) <
+            if (iov_to_buf(out_sg, out_num, 0, vhdr, n->guest_hdr_len) <
                 n->guest_hdr_len) {
                 virtio_error(vdev, "virtio-net header incorrect");
                 virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
+                virtqueue_element_free(q->tx_vq, elem);
+                virtio_net_tx_unpop(q->tx_vq, elems + i, num_elems - i);
                 return -EINVAL;
             }
             if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &vhdr);
-                sg2[0].iov_base = &vhdr;
+                virtio_net_hdr_swap(vdev, (void *) vhdr);
+                sg2[0].iov_base = vhdr;
                 sg2[0].iov_len = n->guest_hdr_len;
                 out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
                                    out_sg, out_num,
@@ -2793,18 +3085,24 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             out_sg = sg;
         }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
+        /*
+         * The element is only completed by virtio_net_tx_complete() if
+         * the backend cannot take the packet now, so the guest buffers
+         * need not be copied in that case.
+         */
+        ret = qemu_sendv_packet_zerocopy(nc, out_sg, out_num,
+                                         virtio_net_tx_complete);
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
+            virtio_net_tx_unpop(q->tx_vq, elems + i, num_elems - i);
             return -EBUSY;
         }
 
 drop:
         virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        virtio_net_notify(vdev, q->tx_vq);
+        virtqueue_element_free(q->tx_vq, elem);
 
         if (++num_packets >= n->tx_burst) {
             break;
@@ -2815,11 +3113,27 @@ drop:
 
 static void virtio_net_tx_timer(void *opaque);
 
+/*
+ * A vhost backend that went away without taking the link down resumes
+ * the rings when it comes back; leave the buffers for it.
+ */
+static bool virtio_net_vhost_reconnecting(VirtIONet *n)
+{
+    NetClientState *nc = qemu_get_queue(n->nic);
+
+    return !nc->link_down && nc->peer && nc->peer->link_down &&
+           get_vhost_net(nc->peer);
+}
+
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
+    if (unlikely(virtio_net_vhost_reconnecting(n))) {
+        return;
+    }
+
     if (unlikely((n->status & VIRTIO_NET_S_LINK_UP) == 0)) {
         virtio_net_drop_tx_queue_data(vdev, vq);
         return;
@@ -2849,7 +3163,7 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
-    if (unlikely(n->vhost_started)) {
+    if (unlikely(n->vhost_started || virtio_net_vhost_reconnecting(n))) {
         return;
     }
 
@@ -3013,6 +3327,294 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     }
     q->tx_waiting = 0;
     virtio_del_queue(vdev, index * 2 + 1);
+
+    net_gro_free(q->gro);
+    q->gro = NULL;
+}
+
+/*
+ * Rebind the tx bottom half or timer of @q to @ctx.  Nothing must be running
+ * in the old AioContext on behalf of @q.
+ *
+ * Context: BQL held
+ */
+static void virtio_net_tx_set_aio_context(VirtIONetQueue *q, AioContext *ctx)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+
+    if (q->tx_timer) {
+        timer_free(q->tx_timer);
+        q->tx_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                    virtio_net_tx_timer, q);
+    } else {
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = aio_bh_new_guarded(ctx, virtio_net_tx_bh, q,
+                                      &DEVICE(vdev)->mem_reentrancy_guard);
+    }
+}
+
+static void virtio_net_tx_resched(VirtIONetQueue *q)
+{
+    if (!q->tx_waiting) {
+        return;
+    }
+    if (q->tx_timer) {
+        timer_mod(q->tx_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + q->n->tx_timeout);
+    } else {
+        qemu_bh_schedule(q->tx_bh);
+    }
+}
+
+static NetClientState *virtio_net_queue_peer(VirtIONetQueue *q)
+{
+    return qemu_get_subqueue(q->n->nic, q - q->n->vqs)->peer;
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_dataplane_attach_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    qemu_set_aio_context(virtio_net_queue_peer(q), ctx);
+    virtio_queue_aio_attach_host_notifier_no_poll(q->rx_vq, ctx);
+    virtio_queue_aio_attach_host_notifier(q->tx_vq, ctx);
+    virtio_net_tx_resched(q);
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_dataplane_detach_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    virtio_queue_aio_detach_host_notifier(q->rx_vq, ctx);
+    virtio_queue_aio_detach_host_notifier(q->tx_vq, ctx);
+
+    /*
+     * Test and clear notifiers after disabling events, in case the poll
+     * callback didn't have time to run.
+     */
+    virtio_queue_host_notifier_read(virtio_queue_get_host_notifier(q->rx_vq));
+    virtio_queue_host_notifier_read(virtio_queue_get_host_notifier(q->tx_vq));
+
+    /* tx_waiting is kept, the main loop reschedules the flush */
+    if (q->tx_timer) {
+        timer_del(q->tx_timer);
+    } else {
+        qemu_bh_cancel(q->tx_bh);
+    }
+
+    qemu_set_aio_context(virtio_net_queue_peer(q), qemu_get_aio_context());
+}
+
+/* Queue pairs that currently have virtqueues */
+static int virtio_net_dataplane_queue_pairs(VirtIONet *n)
+{
+    return n->multiqueue ? n->max_queue_pairs : 1;
+}
+
+/* Context: BQL held */
+static void virtio_net_dataplane_attach(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < virtio_net_dataplane_queue_pairs(n); i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        virtio_net_tx_set_aio_context(q, n->vq_aio_context[i]);
+        aio_wait_bh_oneshot(n->vq_aio_context[i],
+                            virtio_net_dataplane_attach_bh, q);
+    }
+}
+
+/* Context: BQL held */
+static void virtio_net_dataplane_detach(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < virtio_net_dataplane_queue_pairs(n); i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        aio_wait_bh_oneshot(n->vq_aio_context[i],
+                            virtio_net_dataplane_detach_bh, q);
+        virtio_net_tx_set_aio_context(q, qemu_get_aio_context());
+        virtio_net_tx_resched(q);
+    }
+}
+
+/*
+ * Move the queue pairs back to the main loop so that the control plane
+ * can change filters, offloads and queue state without racing with the
+ * IOThreads.  Calls nest and must be balanced by
+ * virtio_net_dataplane_resume().
+ *
+ * Context: BQL held
+ */
+static void virtio_net_dataplane_pause(VirtIONet *n)
+{
+    if (n->dataplane_pause_depth++ || !n->ioeventfd_started) {
+        return;
+    }
+    virtio_net_dataplane_detach(n);
+}
+
+/* Context: BQL held */
+static void virtio_net_dataplane_resume(VirtIONet *n)
+{
+    assert(n->dataplane_pause_depth > 0);
+    if (--n->dataplane_pause_depth || !n->ioeventfd_started) {
+        return;
+    }
+    virtio_net_dataplane_attach(n);
+}
+
+/* Context: BQL held */
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = virtio_get_num_queues(vdev);
+    int i, r;
+
+    if (!n->vq_aio_context) {
+        return virtio_device_start_ioeventfd_impl(vdev);
+    }
+    if (n->ioeventfd_started) {
+        return 0;
+    }
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -accel kvm is set.", r);
+        return -ENOSYS;
+    }
+
+    r = virtio_device_start_ioeventfd_impl(vdev);
+    if (r < 0) {
+        k->set_guest_notifiers(qbus->parent, nvqs, false);
+        return r;
+    }
+
+    /* The control virtqueue stays in the main loop */
+    for (i = 0; i < virtio_net_dataplane_queue_pairs(n); i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->rx_vq),
+                                   NULL);
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->tx_vq),
+                                   NULL);
+    }
+
+    n->ioeventfd_started = true;
+    if (!n->dataplane_pause_depth) {
+        virtio_net_dataplane_attach(n);
+    }
+    return 0;
+}
+
+/* Context: BQL held */
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+    if (!n->vq_aio_context) {
+        virtio_device_stop_ioeventfd_impl(vdev);
+        return;
+    }
+    if (!n->ioeventfd_started) {
+        return;
+    }
+
+    if (!n->dataplane_pause_depth) {
+        virtio_net_dataplane_detach(n);
+    }
+    n->ioeventfd_started = false;
+
+    virtio_device_stop_ioeventfd_impl(vdev);
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, virtio_get_num_queues(vdev), false);
+}
+
+/* Context: BQL held */
+static bool virtio_net_vq_aio_context_init(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThreadVirtQueueMappingList *list = n->net_conf.iothread_vq_mapping_list;
+    int i;
+
+    if (!list) {
+        return true;
+    }
+
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp,
+                   "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return false;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for iothread");
+        return false;
+    }
+
+    /*
+     * Software RSS, hash reporting and RSC share per-device receive state
+     * and may deliver a packet to a queue pair owned by another IOThread.
+     */
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS) ||
+        virtio_has_feature(n->host_features, VIRTIO_NET_F_HASH_REPORT) ||
+        virtio_has_feature(n->host_features, VIRTIO_NET_F_RSC_EXT)) {
+        error_setg(errp, "iothread-vq-mapping is incompatible with rss, "
+                   "hash and guest_rsc_ext");
+        return false;
+    }
+
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (peer && get_vhost_net(peer)) {
+            error_setg(errp, "iothread-vq-mapping is incompatible with vhost");
+            return false;
+        }
+        if (!qemu_can_set_aio_context(peer)) {
+            error_setg(errp, "iothread-vq-mapping requires a netdev that "
+                       "can run in an IOThread (tap or af-xdp)");
+            return false;
+        }
+    }
+
+    /* The mapping is indexed by queue pair, not by virtqueue */
+    n->vq_aio_context = g_new(AioContext *, n->max_queue_pairs);
+    if (!iothread_vq_mapping_apply(list, n->vq_aio_context,
+                                   n->max_queue_pairs, errp)) {
+        g_free(n->vq_aio_context);
+        n->vq_aio_context = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* Context: BQL held */
+static void virtio_net_vq_aio_context_cleanup(VirtIONet *n)
+{
+    if (!n->vq_aio_context) {
+        return;
+    }
+
+    assert(!n->ioeventfd_started);
+    iothread_vq_mapping_cleanup(n->net_conf.iothread_vq_mapping_list);
+    g_free(n->vq_aio_context);
+    n->vq_aio_context = NULL;
 }
 
 static void virtio_net_change_num_queue_pairs(VirtIONet *n, int new_max_queue_pairs)
@@ -3099,6 +3701,7 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
         }
     }
     n->mac_table.first_multi = i;
+    virtio_net_update_ebpf_rx_filter(n);
 
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in n->status */
@@ -3152,7 +3755,7 @@ static int virtio_net_post_load_virtio(VirtIODevice *vdev)
      * Restore it back and apply the desired offloads.
      */
     n->curr_guest_offloads = n->saved_guest_offloads;
-    if (peer_has_vnet_hdr(n)) {
+    if (peer_has_vnet_hdr(n) || n->gro) {
         virtio_net_apply_guest_offloads(n);
     }
 
@@ -3399,11 +4002,28 @@ static const VMStateDescription vmstate_virtio_net_device = {
     }
 };
 
+static void virtio_net_receive_burst(NetClientState *nc, bool begin)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (!begin && q->gro) {
+        net_gro_flush(q->gro);
+    }
+
+    q->rx_burst = begin;
+    if (!begin && q->rx_notify_pending) {
+        q->rx_notify_pending = false;
+        virtio_net_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    }
+}
+
 static NetClientInfo net_virtio_info = {
     .type = NET_CLIENT_DRIVER_NIC,
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_burst = virtio_net_receive_burst,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
@@ -3731,6 +4351,12 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+
+    if (!virtio_net_vq_aio_context_init(n, errp)) {
+        virtio_cleanup(vdev);
+        return;
+    }
+
     n->vqs = g_new0(VirtIONetQueue, n->max_queue_pairs);
     n->curr_queue_pairs = 1;
     n->tx_timeout = n->net_conf.txtimer;
@@ -3814,6 +4440,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS)) {
         virtio_net_load_ebpf(n, errp);
     }
+    virtio_net_load_ebpf_rx_filter(n);
 }
 
 static void virtio_net_device_unrealize(DeviceState *dev)
@@ -3825,6 +4452,7 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS)) {
         virtio_net_unload_ebpf(n);
     }
+    virtio_net_unload_ebpf_rx_filter(n);
 
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
@@ -3857,6 +4485,7 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     virtio_net_rsc_cleanup(n);
     g_free(n->rss_data.indirections_table);
     net_rx_pkt_uninit(n->rx_pkt);
+    virtio_net_vq_aio_context_cleanup(n);
     virtio_cleanup(vdev);
 }
 
@@ -3874,6 +4503,7 @@ static void virtio_net_instance_init(Object *obj)
                                   DEVICE(n));
 
     ebpf_rss_init(&n->ebpf_rss);
+    ebpf_rx_filter_init(&n->ebpf_rx_filter);
 }
 
 static int virtio_net_pre_save(void *opaque)
@@ -3927,6 +4557,7 @@ static const VMStateDescription vmstate_virtio_net = {
     },
     .pre_save = virtio_net_pre_save,
     .dev_unplug_pending = dev_unplug_pending,
+    .parallel_save = true,
 };
 
 static Property virtio_net_properties[] = {
@@ -3985,6 +4616,8 @@ static Property virtio_net_properties[] = {
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-vq-mapping", VirtIONet,
+                                         net_conf.iothread_vq_mapping_list),
     DEFINE_PROP_UINT16("rx_queue_size", VirtIONet, net_conf.rx_queue_size,
                        VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE),
     DEFINE_PROP_UINT16("tx_queue_size", VirtIONet, net_conf.tx_queue_size,
@@ -3995,6 +4628,9 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_INT32("speed", VirtIONet, net_conf.speed, SPEED_UNKNOWN),
     DEFINE_PROP_STRING("duplex", VirtIONet, net_conf.duplex_str),
     DEFINE_PROP_BOOL("failover", VirtIONet, failover, false),
+    DEFINE_PROP_BOOL("ebpf-rx-filter", VirtIONet, ebpf_rx_filter_enabled,
+                     true),
+    DEFINE_PROP_BOOL("gro", VirtIONet, gro, true),
     DEFINE_PROP_BIT64("guest_uso4", VirtIONet, host_features,
                       VIRTIO_NET_F_GUEST_USO4, true),
     DEFINE_PROP_BIT64("guest_uso6", VirtIONet, host_features,
@@ -4023,6 +4659,8 @@ static void virtio_net_class_init(ObjectClass *klass, void *data)
     vdc->queue_reset = virtio_net_queue_reset;
     vdc->queue_enable = virtio_net_queue_enable;
     vdc->set_status = virtio_net_set_status;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
     vdc->guest_notifier_mask = virtio_net_guest_notifier_mask;
     vdc->guest_notifier_pending = virtio_net_guest_notifier_pending;
     vdc->legacy_features |= (0x1 << VIRTIO_NET_F_GSO);
@@ -40,6 +40,7 @@
  *              sriov_vi_flexible=<N[optional]> \
  *              sriov_max_vi_per_vf=<N[optional]> \
  *              sriov_max_vq_per_vf=<N[optional]> \
+ *              iothread=<iothread_id[optional]> \
  *              subsys=<subsys_id>
  *      -device nvme-ns,drive=<drive_id>,bus=<bus_name>,nsid=<nsid>,\
  *              zoned=<true|false[optional]>, \
@@ -147,6 +148,18 @@
  *   a secondary controller. The default 0 resolves to
  *   `(sriov_vq_flexible / sriov_max_vfs)`.
  *
+ * - `iothread`
+ *   Process the I/O queues in the given IOThread instead of the main loop.
+ *   The admin queue always stays in the main loop.
+ *
+ * - `iothread-vq-mapping`
+ *   Like `iothread`, but spreads the I/O queues over several IOThreads. The
+ *   `vqs` lists contain 0-based I/O queue pair indices, i.e. queue id - 1.
+ *   A submission queue runs in the IOThread of its completion queue.
+ *   Zoned and FDP namespaces cannot be attached to such controllers.
+ *   With `ioeventfd` and shadow doorbells, polling IOThreads busy wait for
+ *   shadow submission queue tail updates instead of doorbell writes.
+ *
  * nvme namespace device parameters
  * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
  * - `shared`
@@ -201,8 +214,10 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/block-backend.h"
 #include "sysemu/hostmem.h"
+#include "block/aio-wait.h"
 #include "hw/pci/msix.h"
 #include "hw/pci/pcie_sriov.h"
+#include "hw/qdev-properties-system.h"
 #include "migration/vmstate.h"
 
 #include "nvme.h"
@@ -311,6 +326,7 @@ static const uint32_t nvme_cse_iocs_zoned[256] = {
 };
 
 static void nvme_process_sq(void *opaque);
+static void nvme_update_sq_eventidx(const NvmeSQueue *sq);
 static void nvme_ctrl_reset(NvmeCtrl *n, NvmeResetType rst);
 static inline uint64_t nvme_get_timestamp(const NvmeCtrl *n);
 
@@ -634,14 +650,43 @@ static void nvme_inc_sq_head(NvmeSQueue *sq)
     sq->head = (sq->head + 1) % sq->size;
 }
 
+/*
+ * The doorbell registers of queues in IOThreads are written by vCPU threads,
+ * hence the atomic accesses to sq->tail and cq->head.
+ */
 static uint8_t nvme_cq_full(NvmeCQueue *cq)
 {
-    return (cq->tail + 1) % cq->size == cq->head;
+    return (cq->tail + 1) % cq->size == qatomic_read(&cq->head);
 }
 
 static uint8_t nvme_sq_empty(NvmeSQueue *sq)
 {
-    return sq->head == sq->tail;
+    return sq->head == qatomic_read(&sq->tail);
+}
+
+static bool nvme_ctx_is_iothread(AioContext *ctx)
+{
+    return ctx != qemu_get_aio_context();
+}
+
+/* Run @fn in @ctx and wait for it; BQL held */
+static void nvme_run_in_ctx(AioContext *ctx, QEMUBHFunc *fn, void *opaque)
+{
+    if (nvme_ctx_is_iothread(ctx)) {
+        aio_wait_bh_oneshot(ctx, fn, opaque);
+    } else {
+        fn(opaque);
+    }
+}
+
+static void nvme_set_notifier_handler(AioContext *ctx, EventNotifier *e,
+                                      EventNotifierHandler *handler)
+{
+    if (nvme_ctx_is_iothread(ctx)) {
+        aio_set_event_notifier(ctx, e, handler, NULL, NULL);
+    } else {
+        event_notifier_set_handler(e, handler);
+    }
 }
 
 static void nvme_irq_check(NvmeCtrl *n)
@@ -693,6 +738,44 @@ static void nvme_irq_deassert(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+/*
+ * Update the interrupt state of a completion queue that runs in an
+ * IOThread.  The IOThread can only move cq->tail forward and vCPUs can only
+ * move cq->head, so whatever is seen here is eventually corrected by the
+ * next notification.
+ *
+ * Context: BQL held
+ */
+static void nvme_cq_update_irq(NvmeCtrl *n, NvmeCQueue *cq, bool assert)
+{
+    if (qatomic_read(&cq->tail) != qatomic_read(&cq->head)) {
+        if (cq->irq_enabled && !cq->irq_pending) {
+            cq->irq_pending = true;
+            n->cq_pending++;
+        }
+        if (assert) {
+            nvme_irq_assert(n, cq);
+        }
+    } else {
+        if (cq->irq_enabled && cq->irq_pending) {
+            cq->irq_pending = false;
+            n->cq_pending--;
+        }
+        nvme_irq_deassert(n, cq);
+    }
+}
+
+static void nvme_cq_irq_notifier(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, irq_notifier);
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    nvme_cq_update_irq(cq->ctrl, cq, true);
+}
+
 static void nvme_req_clear(NvmeRequest *req)
 {
     req->ns = NULL;
@@ -854,6 +937,20 @@ static uint16_t nvme_map_addr(NvmeCtrl *n, NvmeSg *sg, hwaddr addr, size_t len)
         return NVME_INVALID_USE_OF_CMB | NVME_DNR;
     }
 
+    /*
+     * Guests commonly hand out physically contiguous buffers page by page;
+     * extend the previous entry so that such a run becomes a single iovec.
+     */
+    if (sg->qsg.nsg) {
+        ScatterGatherEntry *last = &sg->qsg.sg[sg->qsg.nsg - 1];
+
+        if (last->base + last->len == addr) {
+            last->len += len;
+            sg->qsg.size += len;
+            return NVME_SUCCESS;
+        }
+    }
+
     if (sg->qsg.nsg + 1 > IOV_MAX) {
         goto max_mappings_exceeded;
     }
@@ -1440,13 +1537,97 @@ uint16_t nvme_bounce_mdata(NvmeCtrl *n, void *ptr, uint32_t len,
     return nvme_tx(n, &req->sg, ptr, len, dir);
 }
 
+typedef struct NvmeMappedIO {
+    NvmeRequest *req;
+    BlockCompletionFunc *cb;
+    AddressSpace *as;
+    DMADirection dir;
+    QEMUIOVector iov;
+} NvmeMappedIO;
+
+static void nvme_mapped_io_unmap(NvmeMappedIO *mio, bool done)
+{
+    int i;
+
+    for (i = 0; i < mio->iov.niov; i++) {
+        struct iovec *v = &mio->iov.iov[i];
+
+        dma_memory_unmap(mio->as, v->iov_base, v->iov_len, mio->dir,
+                         done ? v->iov_len : 0);
+    }
+    qemu_iovec_destroy(&mio->iov);
+}
+
+static void nvme_mapped_io_cb(void *opaque, int ret)
+{
+    NvmeMappedIO *mio = opaque;
+    NvmeRequest *req = mio->req;
+    BlockCompletionFunc *cb = mio->cb;
+
+    nvme_mapped_io_unmap(mio, true);
+    g_free(mio);
+
+    cb(req, ret);
+}
+
+/*
+ * Map the whole scatter/gather list into guest RAM up front and submit it
+ * with a single blk_aio_preadv()/blk_aio_pwritev(), skipping the
+ * dma-helpers state machine.  Returns NULL if any part of the list is not
+ * directly accessible RAM, in which case the caller falls back to
+ * dma_blk_io().
+ */
+static NvmeMappedIO *nvme_mapped_io_new(NvmeRequest *req, DMADirection dir,
+                                        BlockCompletionFunc *cb)
+{
+    QEMUSGList *qsg = &req->sg.qsg;
+    NvmeMappedIO *mio = g_new(NvmeMappedIO, 1);
+    int i;
+
+    mio->req = req;
+    mio->cb = cb;
+    mio->as = qsg->as;
+    mio->dir = dir;
+    qemu_iovec_init(&mio->iov, qsg->nsg);
+
+    for (i = 0; i < qsg->nsg; i++) {
+        dma_addr_t len = qsg->sg[i].len;
+        void *mem;
+
+        mem = dma_memory_map(qsg->as, qsg->sg[i].base, &len, dir,
+                             MEMTXATTRS_UNSPECIFIED);
+        if (!mem) {
+            goto fail;
+        }
+        qemu_iovec_add(&mio->iov, mem, len);
+        if (len < qsg->sg[i].len) {
+            goto fail;
+        }
+    }
+
+    return mio;
+
+fail:
+    nvme_mapped_io_unmap(mio, false);
+    g_free(mio);
+    return NULL;
+}
+
 static inline void nvme_blk_read(BlockBackend *blk, int64_t offset,
                                  uint32_t align, BlockCompletionFunc *cb,
                                  NvmeRequest *req)
 {
+    NvmeMappedIO *mio;
+
     assert(req->sg.flags & NVME_SG_ALLOC);
 
     if (req->sg.flags & NVME_SG_DMA) {
+        mio = nvme_mapped_io_new(req, DMA_DIRECTION_FROM_DEVICE, cb);
+        if (mio) {
+            req->aiocb = blk_aio_preadv(blk, offset, &mio->iov, 0,
+                                        nvme_mapped_io_cb, mio);
+            return;
+        }
         req->aiocb = dma_blk_read(blk, &req->sg.qsg, offset, align, cb, req);
     } else {
         req->aiocb = blk_aio_preadv(blk, offset, &req->sg.iov, 0, cb, req);
@@ -1457,9 +1638,17 @@ static inline void nvme_blk_write(BlockBackend *blk, int64_t offset,
                                   uint32_t align, BlockCompletionFunc *cb,
                                   NvmeRequest *req)
 {
+    NvmeMappedIO *mio;
+
     assert(req->sg.flags & NVME_SG_ALLOC);
 
     if (req->sg.flags & NVME_SG_DMA) {
+        mio = nvme_mapped_io_new(req, DMA_DIRECTION_TO_DEVICE, cb);
+        if (mio) {
+            req->aiocb = blk_aio_pwritev(blk, offset, &mio->iov, 0,
+                                         nvme_mapped_io_cb, mio);
+            return;
+        }
         req->aiocb = dma_blk_write(blk, &req->sg.qsg, offset, align, cb, req);
     } else {
         req->aiocb = blk_aio_pwritev(blk, offset, &req->sg.iov, 0, cb, req);
@@ -1494,7 +1683,7 @@ static void nvme_post_cqes(void *opaque)
         NvmeSQueue *sq;
         hwaddr addr;
 
-        if (n->dbbuf_enabled) {
+        if (qatomic_load_acquire(&n->dbbuf_enabled)) {
             nvme_update_cq_eventidx(cq);
             nvme_update_cq_head(cq);
         }
@@ -1521,6 +1710,13 @@ static void nvme_post_cqes(void *opaque)
         nvme_sg_unmap(&req->sg);
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
+    if (nvme_ctx_is_iothread(cq->ctx)) {
+        /* pci_dma_write() above orders the entries before the interrupt */
+        if (cq->tail != qatomic_read(&cq->head)) {
+            event_notifier_set(&cq->irq_notifier);
+        }
+        return;
+    }
     if (cq->tail != cq->head) {
         if (cq->irq_enabled && !pending) {
             n->cq_pending++;
@@ -4497,7 +4693,11 @@ static void nvme_cq_notifier(EventNotifier *e)
 
     nvme_update_cq_head(cq);
 
-    if (cq->tail == cq->head) {
+    if (nvme_ctx_is_iothread(cq->ctx)) {
+        if (cq->tail == cq->head) {
+            event_notifier_set(&cq->irq_notifier);
+        }
+    } else if (cq->tail == cq->head) {
         if (cq->irq_enabled) {
             n->cq_pending--;
         }
@@ -4519,7 +4719,7 @@ static int nvme_init_cq_ioeventfd(NvmeCQueue *cq)
         return ret;
     }
 
-    event_notifier_set_handler(&cq->notifier, nvme_cq_notifier);
+    nvme_set_notifier_handler(cq->ctx, &cq->notifier, nvme_cq_notifier);
     memory_region_add_eventfd(&n->iomem,
                               0x1000 + offset, 4, false, 0, &cq->notifier);
 
@@ -4537,6 +4737,72 @@ static void nvme_sq_notifier(EventNotifier *e)
     nvme_process_sq(sq);
 }
 
+/*
+ * With shadow doorbells, an IOThread can busy wait for the guest to move
+ * the tail of a submission queue instead of waiting for an ioeventfd kick.
+ */
+static bool nvme_sq_poll(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+    uint32_t tail;
+
+    if (!qatomic_load_acquire(&sq->ctrl->dbbuf_enabled) ||
+        QTAILQ_EMPTY(&sq->req_list)) {
+        return false;
+    }
+
+    ldl_le_pci_dma(PCI_DEVICE(sq->ctrl), sq->db_addr, &tail,
+                   MEMTXATTRS_UNSPECIFIED);
+
+    return tail != sq->head;
+}
+
+static void nvme_sq_poll_ready(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    nvme_process_sq(sq);
+}
+
+/*
+ * Point the event index just behind the tail, so that the guest does not
+ * ring the MMIO doorbell for new submissions while we are polling.
+ */
+static void nvme_sq_poll_begin(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    sq->polling = true;
+    if (qatomic_load_acquire(&sq->ctrl->dbbuf_enabled)) {
+        stl_le_pci_dma(PCI_DEVICE(sq->ctrl), sq->ei_addr,
+                       (qatomic_read(&sq->tail) + sq->size - 1) % sq->size,
+                       MEMTXATTRS_UNSPECIFIED);
+    }
+}
+
+/* The caller polls once more, catching submissions that raced with us */
+static void nvme_sq_poll_end(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    sq->polling = false;
+    if (qatomic_load_acquire(&sq->ctrl->dbbuf_enabled)) {
+        nvme_update_sq_eventidx(sq);
+    }
+}
+
+/* Runs in the IOThread, aio_set_event_notifier_poll() is not thread-safe */
+static void nvme_attach_sq_notifier(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+
+    aio_set_event_notifier(sq->ctx, &sq->notifier, nvme_sq_notifier,
+                           nvme_sq_poll, nvme_sq_poll_ready);
+    aio_set_event_notifier_poll(sq->ctx, &sq->notifier, nvme_sq_poll_begin,
+                                nvme_sq_poll_end);
+}
+
 static int nvme_init_sq_ioeventfd(NvmeSQueue *sq)
 {
     NvmeCtrl *n = sq->ctrl;
@@ -4548,23 +4814,40 @@ static int nvme_init_sq_ioeventfd(NvmeSQueue *sq)
         return ret;
     }
 
-    event_notifier_set_handler(&sq->notifier, nvme_sq_notifier);
+    if (nvme_ctx_is_iothread(sq->ctx)) {
+        nvme_run_in_ctx(sq->ctx, nvme_attach_sq_notifier, sq);
+    } else {
+        event_notifier_set_handler(&sq->notifier, nvme_sq_notifier);
+    }
     memory_region_add_eventfd(&n->iomem,
                               0x1000 + offset, 4, false, 0, &sq->notifier);
 
     return 0;
 }
 
+/* Stop fetching commands from @sq; runs in its AioContext */
+static void nvme_stop_sq(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+
+    qemu_bh_delete(sq->bh);
+    sq->bh = NULL;
+    if (sq->ioeventfd_enabled) {
+        nvme_set_notifier_handler(sq->ctx, &sq->notifier, NULL);
+    }
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     uint16_t offset = sq->sqid << 3;
 
     n->sq[sq->sqid] = NULL;
-    qemu_bh_delete(sq->bh);
+    if (sq->bh) {
+        nvme_run_in_ctx(sq->ctx, nvme_stop_sq, sq);
+    }
     if (sq->ioeventfd_enabled) {
         memory_region_del_eventfd(&n->iomem,
                                   0x1000 + offset, 4, false, 0, &sq->notifier);
-        event_notifier_set_handler(&sq->notifier, NULL);
         event_notifier_cleanup(&sq->notifier);
     }
     g_free(sq->io_req);
@@ -4573,10 +4856,43 @@ static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
     }
 }
 
+/* Return the completions of @sq to it; runs in the AioContext of its CQ */
+static void nvme_detach_sq(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+    NvmeCQueue *cq = sq->ctrl->cq[sq->cqid];
+    NvmeRequest *r, *next;
+
+    QTAILQ_REMOVE(&cq->sq_list, sq, entry);
+
+    nvme_post_cqes(cq);
+    QTAILQ_FOREACH_SAFE(r, &cq->req_list, entry, next) {
+        if (r->sq == sq) {
+            QTAILQ_REMOVE(&cq->req_list, r, entry);
+            QTAILQ_INSERT_TAIL(&sq->req_list, r, entry);
+        }
+    }
+}
+
+static void nvme_ctrl_drain(NvmeCtrl *n)
+{
+    NvmeNamespace *ns;
+    int i;
+
+    for (i = 1; i <= NVME_MAX_NAMESPACES; i++) {
+        ns = nvme_ns(n, i);
+        if (!ns) {
+            continue;
+        }
+
+        nvme_ns_drain(ns);
+    }
+}
+
 static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
 {
     NvmeDeleteQ *c = (NvmeDeleteQ *)&req->cmd;
-    NvmeRequest *r, *next;
+    NvmeRequest *r;
     NvmeSQueue *sq;
     NvmeCQueue *cq;
     uint16_t qid = le16_to_cpu(c->qid);
@@ -4589,6 +4905,14 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
     trace_pci_nvme_del_sq(qid);
 
     sq = n->sq[qid];
+    if (nvme_ctx_is_iothread(sq->ctx)) {
+        /*
+         * Requests cannot be cancelled from outside the IOThread that
+         * submitted them; stop the queue and let them complete instead.
+         */
+        nvme_run_in_ctx(sq->ctx, nvme_stop_sq, sq);
+        nvme_ctrl_drain(n);
+    }
     while (!QTAILQ_EMPTY(&sq->out_req_list)) {
         r = QTAILQ_FIRST(&sq->out_req_list);
         assert(r->aiocb);
@@ -4599,15 +4923,7 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
 
     if (!nvme_check_cqid(n, sq->cqid)) {
         cq = n->cq[sq->cqid];
-        QTAILQ_REMOVE(&cq->sq_list, sq, entry);
-
-        nvme_post_cqes(cq);
-        QTAILQ_FOREACH_SAFE(r, &cq->req_list, entry, next) {
-            if (r->sq == sq) {
-                QTAILQ_REMOVE(&cq->req_list, r, entry);
-                QTAILQ_INSERT_TAIL(&sq->req_list, r, entry);
-            }
-        }
+        nvme_run_in_ctx(cq->ctx, nvme_detach_sq, sq);
     }
 
     nvme_free_sq(sq, n);
@@ -4620,7 +4936,11 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     int i;
     NvmeCQueue *cq;
 
+    assert(n->cq[cqid]);
+    cq = n->cq[cqid];
+
     sq->ctrl = n;
+    sq->ctx = cq->ctx;
     sq->dma_addr = dma_addr;
     sq->sqid = sqid;
     sq->size = size;
@@ -4635,8 +4955,8 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
 
-    sq->bh = qemu_bh_new_guarded(nvme_process_sq, sq,
-                                 &DEVICE(sq->ctrl)->mem_reentrancy_guard);
+    sq->bh = aio_bh_new_guarded(sq->ctx, nvme_process_sq, sq,
+                                &DEVICE(sq->ctrl)->mem_reentrancy_guard);
 
     if (n->dbbuf_enabled) {
         sq->db_addr = n->dbbuf_dbs + (sqid << 3);
@@ -4649,8 +4969,6 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         }
     }
 
-    assert(n->cq[cqid]);
-    cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
 }
@@ -5209,19 +5527,36 @@ static uint16_t nvme_get_log(NvmeCtrl *n, NvmeRequest *req)
     }
 }
 
+/* Stop posting completions to @cq; runs in its AioContext */
+static void nvme_stop_cq(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    qemu_bh_delete(cq->bh);
+    cq->bh = NULL;
+    if (cq->ioeventfd_enabled) {
+        nvme_set_notifier_handler(cq->ctx, &cq->notifier, NULL);
+    }
+}
+
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     PCIDevice *pci = PCI_DEVICE(n);
     uint16_t offset = (cq->cqid << 3) + (1 << 2);
 
     n->cq[cq->cqid] = NULL;
-    qemu_bh_delete(cq->bh);
+    if (cq->bh) {
+        nvme_run_in_ctx(cq->ctx, nvme_stop_cq, cq);
+    }
     if (cq->ioeventfd_enabled) {
         memory_region_del_eventfd(&n->iomem,
                                   0x1000 + offset, 4, false, 0, &cq->notifier);
-        event_notifier_set_handler(&cq->notifier, NULL);
         event_notifier_cleanup(&cq->notifier);
     }
+    if (nvme_ctx_is_iothread(cq->ctx)) {
+        event_notifier_set_handler(&cq->irq_notifier, NULL);
+        event_notifier_cleanup(&cq->irq_notifier);
+    }
     if (msix_enabled(pci)) {
         msix_vector_unuse(pci, cq->vector);
     }
@@ -5247,7 +5582,11 @@ static uint16_t nvme_del_cq(NvmeCtrl *n, NvmeRequest *req)
         return NVME_INVALID_QUEUE_DEL;
     }
 
-    if (cq->irq_enabled && cq->tail != cq->head) {
+    if (nvme_ctx_is_iothread(cq->ctx)) {
+        if (cq->irq_pending) {
+            n->cq_pending--;
+        }
+    } else if (cq->irq_enabled && cq->tail != cq->head) {
         n->cq_pending--;
     }
 
@@ -5267,6 +5606,10 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
         msix_vector_use(pci, vector);
     }
     cq->ctrl = n;
+    cq->ctx = qemu_get_aio_context();
+    if (cqid && nvme_ctrl_has_iothreads(n)) {
+        cq->ctx = n->ioq_aio_context[cqid - 1];
+    }
     cq->cqid = cqid;
     cq->size = size;
     cq->dma_addr = dma_addr;
@@ -5274,8 +5617,13 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->irq_pending = false;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
+    if (nvme_ctx_is_iothread(cq->ctx)) {
+        event_notifier_init(&cq->irq_notifier, 0);
+        event_notifier_set_handler(&cq->irq_notifier, nvme_cq_irq_notifier);
+    }
     if (n->dbbuf_enabled) {
         cq->db_addr = n->dbbuf_dbs + (cqid << 3) + (1 << 2);
         cq->ei_addr = n->dbbuf_eis + (cqid << 3) + (1 << 2);
@@ -5287,8 +5635,8 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
         }
     }
     n->cq[cqid] = cq;
-    cq->bh = qemu_bh_new_guarded(nvme_post_cqes, cq,
-                                 &DEVICE(cq->ctrl)->mem_reentrancy_guard);
+    cq->bh = aio_bh_new_guarded(cq->ctx, nvme_post_cqes, cq,
+                                &DEVICE(cq->ctrl)->mem_reentrancy_guard);
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeRequest *req)
@@ -6417,6 +6765,10 @@ static uint16_t nvme_ns_attachment(NvmeCtrl *n, NvmeRequest *req)
                 return NVME_NS_PRIVATE | NVME_DNR;
             }
 
+            if (!nvme_ctrl_can_attach(ctrl, ns)) {
+                return NVME_NS_CTRL_LIST_INVALID | NVME_DNR;
+            }
+
             nvme_attach_ns(ctrl, ns);
             nvme_select_iocs_ns(ctrl, ns);
 
@@ -6831,7 +7183,6 @@ static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeRequest *req)
     /* Save shadow buffer base addr for use during queue creation */
     n->dbbuf_dbs = dbs_addr;
     n->dbbuf_eis = eis_addr;
-    n->dbbuf_enabled = true;
 
     for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
         NvmeSQueue *sq = n->sq[i];
@@ -6868,6 +7219,9 @@ static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeRequest *req)
         }
     }
 
+    /* Queues in IOThreads must see the addresses when they see the flag */
+    qatomic_store_release(&n->dbbuf_enabled, true);
+
     trace_pci_nvme_dbbuf_config(dbs_addr, eis_addr);
 
     return NVME_SUCCESS;
@@ -7013,8 +7367,9 @@ static void nvme_process_sq(void *opaque)
     hwaddr addr;
     NvmeCmd cmd;
     NvmeRequest *req;
+    bool dbbuf_enabled = qatomic_load_acquire(&n->dbbuf_enabled);
 
-    if (n->dbbuf_enabled) {
+    if (dbbuf_enabled) {
         nvme_update_sq_tail(sq);
     }
 
@@ -7042,8 +7397,10 @@ static void nvme_process_sq(void *opaque)
             nvme_enqueue_req_completion(cq, req);
         }
 
-        if (n->dbbuf_enabled) {
-            nvme_update_sq_eventidx(sq);
+        if (dbbuf_enabled) {
+            if (!sq->polling) {
+                nvme_update_sq_eventidx(sq);
+            }
             nvme_update_sq_tail(sq);
         }
     }
@@ -7091,16 +7448,26 @@ static void nvme_ctrl_reset(NvmeCtrl *n, NvmeResetType rst)
 {
     PCIDevice *pci_dev = PCI_DEVICE(n);
     NvmeSecCtrlEntry *sctrl;
-    NvmeNamespace *ns;
     int i;
 
-    for (i = 1; i <= NVME_MAX_NAMESPACES; i++) {
-        ns = nvme_ns(n, i);
-        if (!ns) {
-            continue;
+    /* Requests in flight must not be joined by new ones from IOThreads */
+    for (i = 1; i < n->params.max_ioqpairs + 1; i++) {
+        NvmeSQueue *sq = n->sq[i];
+
+        if (sq && sq->bh && nvme_ctx_is_iothread(sq->ctx)) {
+            nvme_run_in_ctx(sq->ctx, nvme_stop_sq, sq);
         }
+    }
 
-        nvme_ns_drain(ns);
+    nvme_ctrl_drain(n);
+
+    /* Completions refer to the submission queues that are freed first */
+    for (i = 1; i < n->params.max_ioqpairs + 1; i++) {
+        NvmeCQueue *cq = n->cq[i];
+
+        if (cq && cq->bh && nvme_ctx_is_iothread(cq->ctx)) {
+            nvme_run_in_ctx(cq->ctx, nvme_stop_cq, cq);
+        }
     }
 
     for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
@@ -7633,6 +8000,19 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
         trace_pci_nvme_mmio_doorbell_cq(cq->cqid, new_head);
 
+        if (nvme_ctx_is_iothread(cq->ctx)) {
+            NvmeSQueue *sq;
+
+            /* Whether the queue was full is only known to the IOThread */
+            qatomic_set(&cq->head, new_head);
+            QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+                qemu_bh_schedule(sq->bh);
+            }
+            qemu_bh_schedule(cq->bh);
+            nvme_cq_update_irq(n, cq, false);
+            return;
+        }
+
         start_sqs = nvme_cq_full(cq) ? 1 : 0;
         cq->head = new_head;
         if (!qid && n->dbbuf_enabled) {
@@ -7694,7 +8074,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
         trace_pci_nvme_mmio_doorbell_sq(sq->sqid, new_tail);
 
-        sq->tail = new_tail;
+        qatomic_set(&sq->tail, new_tail);
         if (!qid && n->dbbuf_enabled) {
             /*
              * The spec states "the host shall also update the controller's
@@ -8330,6 +8710,57 @@ void nvme_attach_ns(NvmeCtrl *n, NvmeNamespace *ns)
                             BDRV_REQUEST_MAX_BYTES / nvme_l2b(ns, 1));
 }
 
+static bool nvme_init_ioq_aio_context(NvmeCtrl *n, Error **errp)
+{
+    uint32_t nr = n->params.max_ioqpairs;
+    uint32_t i;
+
+    if (n->iothread && n->iothread_vq_mapping_list) {
+        error_setg(errp, "iothread and iothread-vq-mapping properties cannot "
+                   "be set at the same time");
+        return false;
+    }
+    if (!n->iothread && !n->iothread_vq_mapping_list) {
+        return true;
+    }
+
+    n->ioq_aio_context = g_new(AioContext *, nr);
+    if (n->iothread_vq_mapping_list) {
+        if (!iothread_vq_mapping_apply(n->iothread_vq_mapping_list,
+                                       n->ioq_aio_context, nr, errp)) {
+            g_free(n->ioq_aio_context);
+            n->ioq_aio_context = NULL;
+            return false;
+        }
+    } else {
+        for (i = 0; i < nr; i++) {
+            n->ioq_aio_context[i] = iothread_get_aio_context(n->iothread);
+        }
+
+        /* Released in nvme_cleanup_ioq_aio_context() */
+        object_ref(OBJECT(n->iothread));
+    }
+
+    return true;
+}
+
+static void nvme_cleanup_ioq_aio_context(NvmeCtrl *n)
+{
+    if (!n->ioq_aio_context) {
+        return;
+    }
+
+    if (n->iothread_vq_mapping_list) {
+        iothread_vq_mapping_cleanup(n->iothread_vq_mapping_list);
+    }
+    if (n->iothread) {
+        object_unref(OBJECT(n->iothread));
+    }
+
+    g_free(n->ioq_aio_context);
+    n->ioq_aio_context = NULL;
+}
+
 static void nvme_realize(PCIDevice *pci_dev, Error **errp)
 {
     NvmeCtrl *n = NVME(pci_dev);
@@ -8356,9 +8787,14 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
         return;
     }
 
+    if (!nvme_init_ioq_aio_context(n, errp)) {
+        return;
+    }
+
     qbus_init(&n->bus, sizeof(NvmeBus), TYPE_NVME_BUS, dev, dev->id);
 
     if (nvme_init_subsys(n, errp)) {
+        nvme_cleanup_ioq_aio_context(n);
         return;
     }
     nvme_init_state(n);
@@ -8376,6 +8812,12 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
             return;
         }
 
+        if (!nvme_ctrl_can_attach(n, ns)) {
+            error_setg(errp, "zoned and FDP namespaces are not supported "
+                       "with iothread");
+            return;
+        }
+
         nvme_attach_ns(n, ns);
     }
 }
@@ -8417,6 +8859,8 @@ static void nvme_exit(PCIDevice *pci_dev)
 
     msix_uninit(pci_dev, &n->bar0, &n->bar0);
     memory_region_del_subregion(&n->bar0, &n->iomem);
+
+    nvme_cleanup_ioq_aio_context(n);
 }
 
 static Property nvme_props[] = {
@@ -8437,6 +8881,10 @@ static Property nvme_props[] = {
     DEFINE_PROP_BOOL("use-intel-id", NvmeCtrl, params.use_intel_id, false),
     DEFINE_PROP_BOOL("legacy-cmb", NvmeCtrl, params.legacy_cmb, false),
     DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, params.ioeventfd, false),
+    DEFINE_PROP_LINK("iothread", NvmeCtrl, iothread, TYPE_IOTHREAD,
+                     IOThread *),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-vq-mapping", NvmeCtrl,
+                                         iothread_vq_mapping_list),
     DEFINE_PROP_UINT8("zoned.zasl", NvmeCtrl, params.zasl, 0),
     DEFINE_PROP_BOOL("zoned.auto_transition", NvmeCtrl,
                      params.auto_transition_zones, true),
@@ -712,6 +712,33 @@ static void nvme_ns_unrealize(DeviceState *dev)
     nvme_ns_cleanup(ns);
 }
 
+/* Check the controllers that @ns is attached to when it is realized */
+static bool nvme_ns_check_attach(NvmeNamespace *ns, NvmeCtrl *n,
+                                 Error **errp)
+{
+    NvmeSubsystem *subsys = ns->subsys;
+    int i;
+
+    for (i = 0; subsys && ns->params.shared &&
+                i < ARRAY_SIZE(subsys->ctrls); i++) {
+        NvmeCtrl *ctrl = subsys->ctrls[i];
+
+        if (ctrl && ctrl != SUBSYS_SLOT_RSVD &&
+            !nvme_ctrl_can_attach(ctrl, ns)) {
+            n = ctrl;
+            break;
+        }
+    }
+
+    if (!nvme_ctrl_can_attach(n, ns)) {
+        error_setg(errp, "zoned and FDP namespaces cannot be attached to "
+                   "controllers with iothread");
+        return false;
+    }
+
+    return true;
+}
+
 static void nvme_ns_realize(DeviceState *dev, Error **errp)
 {
     NvmeNamespace *ns = NVME_NS(dev);
@@ -766,6 +793,10 @@ static void nvme_ns_realize(DeviceState *dev, Error **errp)
         }
     }
 
+    if (!ns->params.detached && !nvme_ns_check_attach(ns, n, errp)) {
+        return;
+    }
+
     if (subsys) {
         subsys->namespaces[nsid] = ns;
 
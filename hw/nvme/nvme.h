@@ -21,6 +21,7 @@
 #include "qemu/uuid.h"
 #include "hw/pci/pci_device.h"
 #include "hw/block/block.h"
+#include "sysemu/iothread.h"
 
 #include "block/nvme.h"
 
@@ -484,9 +485,11 @@ typedef struct NvmeSQueue {
     uint64_t    dma_addr;
     uint64_t    db_addr;
     uint64_t    ei_addr;
+    AioContext  *ctx;       /* that of the completion queue */
     QEMUBH      *bh;
     EventNotifier notifier;
     bool        ioeventfd_enabled;
+    bool        polling;    /* shadow doorbell polled, no event index */
     NvmeRequest *io_req;
     QTAILQ_HEAD(, NvmeRequest) req_list;
     QTAILQ_HEAD(, NvmeRequest) out_req_list;
@@ -505,9 +508,17 @@ typedef struct NvmeCQueue {
     uint64_t    dma_addr;
     uint64_t    db_addr;
     uint64_t    ei_addr;
+    AioContext  *ctx;
     QEMUBH      *bh;
     EventNotifier notifier;
     bool        ioeventfd_enabled;
+    /*
+     * Queues that run in an IOThread ask the main loop to update the
+     * interrupt state through @irq_notifier.  @irq_pending tells whether
+     * the queue is accounted for in NvmeCtrl::cq_pending.
+     */
+    EventNotifier irq_notifier;
+    bool        irq_pending;
     QTAILQ_HEAD(, NvmeSQueue) sq_list;
     QTAILQ_HEAD(, NvmeRequest) req_list;
 } NvmeCQueue;
@@ -547,6 +558,11 @@ typedef struct NvmeCtrl {
     NvmeParams   params;
     NvmeBus      bus;
 
+    IOThread     *iothread;
+    IOThreadVirtQueueMappingList *iothread_vq_mapping_list;
+    /* AioContext of each I/O queue pair, indexed by queue id - 1 */
+    AioContext   **ioq_aio_context;
+
     uint16_t    cntlid;
     bool        qs_created;
     uint32_t    page_size;
@@ -633,6 +649,24 @@ static inline NvmeNamespace *nvme_ns(NvmeCtrl *n, uint32_t nsid)
     return n->namespaces[nsid];
 }
 
+static inline bool nvme_ctrl_has_iothreads(NvmeCtrl *n)
+{
+    return n->ioq_aio_context != NULL;
+}
+
+/*
+ * Zoned and FDP namespaces keep state that is shared by all queues and
+ * updated without locking, so they cannot be used by I/O queues in
+ * IOThreads.
+ */
+static inline bool nvme_ctrl_can_attach(NvmeCtrl *n, NvmeNamespace *ns)
+{
+    if (!nvme_ctrl_has_iothreads(n)) {
+        return true;
+    }
+    return !ns->params.zoned && !(ns->endgrp && ns->endgrp->fdp.enabled);
+}
+
 static inline NvmeCQueue *nvme_cq(NvmeRequest *req)
 {
     NvmeSQueue *sq = req->sq;
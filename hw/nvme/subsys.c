@@ -58,6 +58,16 @@ int nvme_subsys_register_ctrl(NvmeCtrl *n, Error **errp)
     NvmeSecCtrlEntry *sctrl = nvme_sctrl(n);
     int cntlid, nsid, num_rsvd, num_vfs = n->params.sriov_max_vfs;
 
+    for (nsid = 1; nsid < ARRAY_SIZE(subsys->namespaces); nsid++) {
+        NvmeNamespace *ns = subsys->namespaces[nsid];
+        if (ns && ns->params.shared && !ns->params.detached &&
+            !nvme_ctrl_can_attach(n, ns)) {
+            error_setg(errp, "zoned and FDP namespaces cannot be attached to "
+                       "controllers with iothread");
+            return -1;
+        }
+    }
+
     if (pci_is_vf(&n->parent_obj)) {
         cntlid = le16_to_cpu(sctrl->scid);
     } else {
@@ -85,6 +85,8 @@ static Property pci_props[] = {
                     QEMU_PCIE_ERR_UNC_MASK_BITNR, true),
     DEFINE_PROP_BIT("x-pcie-ari-nextfn-1", PCIDevice, cap_present,
                     QEMU_PCIE_ARI_NEXTFN_1_BITNR, false),
+    DEFINE_PROP_BIT("sriov-lazy-vfs", PCIDevice, cap_present,
+                    QEMU_PCIE_SRIOV_LAZY_VFS_BITNR, false),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -1112,7 +1114,7 @@ uint16_t pci_requester_id(PCIDevice *dev)
 
 static bool pci_bus_devfn_available(PCIBus *bus, int devfn)
 {
-    return !(bus->devices[devfn]);
+    return !(bus->devices[devfn]) && !bus->lazy_vf_pf[devfn];
 }
 
 static bool pci_bus_devfn_reserved(PCIBus *bus, int devfn)
@@ -2023,6 +2025,10 @@ PCIDevice *pci_find_device(PCIBus *bus, int bus_num, uint8_t devfn)
     if (!bus)
         return NULL;
 
+    if (!bus->devices[devfn] && bus->lazy_vf_pf[devfn]) {
+        pcie_sriov_realize_lazy_vf(bus, devfn);
+    }
+
     return bus->devices[devfn];
 }
 
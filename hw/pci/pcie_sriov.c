@@ -163,16 +163,23 @@ static PCIDevice *register_vf(PCIDevice *pf, int devfn, const char *name,
     return dev;
 }
 
-static void register_vfs(PCIDevice *dev)
+static int32_t vf_devfn(PCIDevice *dev, uint16_t vf_num)
 {
-    uint16_t num_vfs;
-    uint16_t i;
     uint16_t sriov_cap = dev->exp.sriov_cap;
     uint16_t vf_offset =
         pci_get_word(dev->config + sriov_cap + PCI_SRIOV_VF_OFFSET);
     uint16_t vf_stride =
         pci_get_word(dev->config + sriov_cap + PCI_SRIOV_VF_STRIDE);
-    int32_t devfn = dev->devfn + vf_offset;
+
+    return dev->devfn + vf_offset + vf_num * vf_stride;
+}
+
+static void register_vfs(PCIDevice *dev)
+{
+    PCIBus *bus = pci_get_bus(dev);
+    uint16_t num_vfs;
+    uint16_t i;
+    uint16_t sriov_cap = dev->exp.sriov_cap;
 
     assert(sriov_cap > 0);
     num_vfs = pci_get_word(dev->config + sriov_cap + PCI_SRIOV_NUM_VF);
@@ -180,24 +187,69 @@ static void register_vfs(PCIDevice *dev)
         return;
     }
 
-    dev->exp.sriov_pf.vf = g_new(PCIDevice *, num_vfs);
+    dev->exp.sriov_pf.vf = g_new0(PCIDevice *, num_vfs);
 
     trace_sriov_register_vfs(dev->name, PCI_SLOT(dev->devfn),
                              PCI_FUNC(dev->devfn), num_vfs);
     for (i = 0; i < num_vfs; i++) {
+        int32_t devfn = vf_devfn(dev, i);
+
+        /*
+         * Realizing many VFs takes long and uses a lot of memory, so defer
+         * it to the first config space access or use by the PF.
+         */
+        if ((dev->cap_present & QEMU_PCIE_SRIOV_LAZY_VFS) &&
+            devfn < ARRAY_SIZE(bus->lazy_vf_pf) &&
+            !bus->devices[devfn] && !bus->lazy_vf_pf[devfn]) {
+            bus->lazy_vf_pf[devfn] = dev;
+            continue;
+        }
+
         dev->exp.sriov_pf.vf[i] = register_vf(dev, devfn,
                                               dev->exp.sriov_pf.vfname, i);
         if (!dev->exp.sriov_pf.vf[i]) {
             num_vfs = i;
             break;
         }
-        devfn += vf_stride;
     }
     dev->exp.sriov_pf.num_vfs = num_vfs;
 }
 
+static PCIDevice *realize_lazy_vf(PCIDevice *dev, uint16_t vf_num)
+{
+    PCIBus *bus = pci_get_bus(dev);
+    int32_t devfn = vf_devfn(dev, vf_num);
+
+    if (dev->exp.sriov_pf.vf[vf_num] || bus->lazy_vf_pf[devfn] != dev) {
+        return dev->exp.sriov_pf.vf[vf_num];
+    }
+
+    trace_sriov_realize_lazy_vf(dev->name, PCI_SLOT(dev->devfn),
+                                PCI_FUNC(dev->devfn), vf_num);
+    /* Also if realizing fails, so that it is not tried on every access */
+    bus->lazy_vf_pf[devfn] = NULL;
+    dev->exp.sriov_pf.vf[vf_num] = register_vf(dev, devfn,
+                                               dev->exp.sriov_pf.vfname,
+                                               vf_num);
+    return dev->exp.sriov_pf.vf[vf_num];
+}
+
+void pcie_sriov_realize_lazy_vf(PCIBus *bus, uint8_t devfn)
+{
+    PCIDevice *dev = bus->lazy_vf_pf[devfn];
+    uint16_t i;
+
+    for (i = 0; i < dev->exp.sriov_pf.num_vfs; i++) {
+        if (vf_devfn(dev, i) == devfn) {
+            realize_lazy_vf(dev, i);
+            return;
+        }
+    }
+}
+
 static void unregister_vfs(PCIDevice *dev)
 {
+    PCIBus *bus = pci_get_bus(dev);
     uint16_t num_vfs = dev->exp.sriov_pf.num_vfs;
     uint16_t i;
 
@@ -206,6 +258,15 @@ static void unregister_vfs(PCIDevice *dev)
     for (i = 0; i < num_vfs; i++) {
         Error *err = NULL;
         PCIDevice *vf = dev->exp.sriov_pf.vf[i];
+        int32_t devfn = vf_devfn(dev, i);
+
+        if (!vf) {
+            if (devfn < ARRAY_SIZE(bus->lazy_vf_pf) &&
+                bus->lazy_vf_pf[devfn] == dev) {
+                bus->lazy_vf_pf[devfn] = NULL;
+            }
+            continue;
+        }
         if (!object_property_set_bool(OBJECT(vf), "realized", false, &err)) {
             error_reportf_err(err, "Failed to unplug: ");
         }
@@ -307,7 +368,7 @@ PCIDevice *pcie_sriov_get_vf_at_index(PCIDevice *dev, int n)
 {
     assert(!pci_is_vf(dev));
     if (n < dev->exp.sriov_pf.num_vfs) {
-        return dev->exp.sriov_pf.vf[n];
+        return realize_lazy_vf(dev, n);
     }
     return NULL;
 }
@@ -1,6 +1,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/hw-version.h"
@@ -100,8 +101,11 @@ static void scsi_device_for_each_req_sync(SCSIDevice *s,
     assert(!runstate_is_running());
     assert(qemu_in_main_thread());
 
-    QTAILQ_FOREACH_SAFE(req, &s->requests, next, next_req) {
-        fn(req, opaque);
+    /* Nothing runs while the guest is stopped, the lock is for consistency */
+    WITH_QEMU_LOCK_GUARD(&s->requests_lock) {
+        QTAILQ_FOREACH_SAFE(req, &s->requests, next, next_req) {
+            fn(req, opaque);
+        }
     }
 }
 
@@ -115,21 +119,25 @@ static void scsi_device_for_each_req_async_bh(void *opaque)
 {
     g_autofree SCSIDeviceForEachReqAsyncData *data = opaque;
     SCSIDevice *s = data->s;
-    AioContext *ctx;
+    AioContext *ctx = qemu_get_current_aio_context();
+    g_autoptr(GSList) reqs = NULL;
     SCSIRequest *req;
-    SCSIRequest *next;
-
-    /*
-     * The BB cannot have changed contexts between this BH being scheduled and
-     * now: BBs' AioContexts, when they have a node attached, can only be
-     * changed via bdrv_try_change_aio_context(), in a drained section.  While
-     * we have the in-flight counter incremented, that drain must block.
-     */
-    ctx = blk_get_aio_context(s->conf.blk);
-    assert(ctx == qemu_get_current_aio_context());
+    GSList *l;
+
+    /* @fn() may dequeue requests, so call it outside requests_lock */
+    WITH_QEMU_LOCK_GUARD(&s->requests_lock) {
+        QTAILQ_FOREACH(req, &s->requests, next) {
+            if (req->ctx == ctx) {
+                scsi_req_ref(req);
+                reqs = g_slist_prepend(reqs, req);
+            }
+        }
+    }
+    reqs = g_slist_reverse(reqs);
 
-    QTAILQ_FOREACH_SAFE(req, &s->requests, next, next) {
-        data->fn(req, data->fn_opaque);
+    for (l = reqs; l; l = l->next) {
+        data->fn(l->data, data->fn_opaque);
+        scsi_req_unref(l->data);
     }
 
     /* Drop the reference taken by scsi_device_for_each_req_async() */
@@ -141,7 +149,8 @@ static void scsi_device_for_each_req_async_bh(void *opaque)
 
 /*
  * Schedule @fn() to be invoked for each enqueued request in device @s. @fn()
- * runs in the AioContext that is executing the request.
+ * runs in the AioContext that is executing the request, with one BH for each
+ * AioContext that has requests.
  * Keeps the BlockBackend's in-flight counter incremented until everything is
  * done, so draining it will settle all scheduled @fn() calls.
  */
@@ -149,26 +158,41 @@ static void scsi_device_for_each_req_async(SCSIDevice *s,
                                            void (*fn)(SCSIRequest *, void *),
                                            void *opaque)
 {
+    g_autoptr(GHashTable) contexts = g_hash_table_new(NULL, NULL);
+    GHashTableIter iter;
+    SCSIRequest *req;
+    gpointer ctx;
+
     assert(qemu_in_main_thread());
 
-    SCSIDeviceForEachReqAsyncData *data =
-        g_new(SCSIDeviceForEachReqAsyncData, 1);
+    WITH_QEMU_LOCK_GUARD(&s->requests_lock) {
+        QTAILQ_FOREACH(req, &s->requests, next) {
+            g_hash_table_add(contexts, req->ctx);
+        }
+    }
 
-    data->s = s;
-    data->fn = fn;
-    data->fn_opaque = opaque;
+    g_hash_table_iter_init(&iter, contexts);
+    while (g_hash_table_iter_next(&iter, &ctx, NULL)) {
+        SCSIDeviceForEachReqAsyncData *data =
+            g_new(SCSIDeviceForEachReqAsyncData, 1);
 
-    /*
-     * Hold a reference to the SCSIDevice until
-     * scsi_device_for_each_req_async_bh() finishes.
-     */
-    object_ref(OBJECT(s));
+        data->s = s;
+        data->fn = fn;
+        data->fn_opaque = opaque;
+
+        /*
+         * Hold a reference to the SCSIDevice until
+         * scsi_device_for_each_req_async_bh() finishes.
+         */
+        object_ref(OBJECT(s));
 
-    /* Paired with blk_dec_in_flight() in scsi_device_for_each_req_async_bh() */
-    blk_inc_in_flight(s->conf.blk);
-    aio_bh_schedule_oneshot(blk_get_aio_context(s->conf.blk),
-                            scsi_device_for_each_req_async_bh,
-                            data);
+        /*
+         * Paired with blk_dec_in_flight() in
+         * scsi_device_for_each_req_async_bh()
+         */
+        blk_inc_in_flight(s->conf.blk);
+        aio_bh_schedule_oneshot(ctx, scsi_device_for_each_req_async_bh, data);
+    }
 }
 
 static void scsi_device_realize(SCSIDevice *s, Error **errp)
@@ -349,10 +373,12 @@ static void scsi_qdev_realize(DeviceState *qdev, Error **errp)
         dev->lun = lun;
     }
 
+    qemu_mutex_init(&dev->requests_lock);
     QTAILQ_INIT(&dev->requests);
     scsi_device_realize(dev, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
+        qemu_mutex_destroy(&dev->requests_lock);
         return;
     }
     dev->vmsentry = qdev_add_vm_change_state_handler(DEVICE(dev),
@@ -370,6 +396,7 @@ static void scsi_qdev_unrealize(DeviceState *qdev)
     scsi_device_purge_requests(dev, SENSE_CODE(NO_SENSE));
 
     scsi_device_unrealize(dev);
+    qemu_mutex_destroy(&dev->requests_lock);
 
     blockdev_mark_auto_del(dev->conf.blk);
 }
@@ -783,6 +810,7 @@ SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
     req->status = -1;
     req->host_status = -1;
     req->ops = reqops;
+    req->ctx = qemu_get_current_aio_context();
     object_ref(OBJECT(d));
     object_ref(OBJECT(qbus->parent));
     notifier_list_init(&req->cancel_notifiers);
@@ -955,7 +983,9 @@ static void scsi_req_enqueue_internal(SCSIRequest *req)
         req->sg = NULL;
     }
     req->enqueued = true;
-    QTAILQ_INSERT_TAIL(&req->dev->requests, req, next);
+    WITH_QEMU_LOCK_GUARD(&req->dev->requests_lock) {
+        QTAILQ_INSERT_TAIL(&req->dev->requests, req, next);
+    }
 }
 
 int32_t scsi_req_enqueue(SCSIRequest *req)
@@ -975,7 +1005,9 @@ static void scsi_req_dequeue(SCSIRequest *req)
     trace_scsi_req_dequeue(req->dev->id, req->lun, req->tag);
     req->retry = false;
     if (req->enqueued) {
-        QTAILQ_REMOVE(&req->dev->requests, req, next);
+        WITH_QEMU_LOCK_GUARD(&req->dev->requests_lock) {
+            QTAILQ_REMOVE(&req->dev->requests, req, next);
+        }
         req->enqueued = false;
         scsi_req_unref(req);
     }
@@ -22,6 +22,7 @@
 #include "qemu/osdep.h"
 #include "qemu/units.h"
 #include "qapi/error.h"
+#include "qemu/defer-call.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
@@ -94,6 +95,7 @@ struct SCSIDiskState {
     uint16_t port_index;
     uint64_t max_unmap_size;
     uint64_t max_io_size;
+    bool request_merging;
     uint32_t quirks;
     QEMUBH *bh;
     char *version;
@@ -273,9 +275,8 @@ static void scsi_aio_complete(void *opaque, int ret)
     SCSIDiskReq *r = (SCSIDiskReq *)opaque;
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
 
-    /* The request must only run in the BlockBackend's AioContext */
-    assert(blk_get_aio_context(s->qdev.conf.blk) ==
-           qemu_get_current_aio_context());
+    /* The request must only run in the AioContext that submitted it */
+    assert(r->req.ctx == qemu_get_current_aio_context());
 
     assert(r->req.aiocb != NULL);
     r->req.aiocb = NULL;
@@ -371,14 +372,186 @@ static void scsi_dma_complete(void *opaque, int ret)
     scsi_dma_complete_noio(r, ret);
 }
 
+/*
+ * DMA reads and writes issued within a defer_call section are collected
+ * per thread and submitted when the section ends.  Like virtio-blk's
+ * MultiReqBuffer, requests to adjacent sectors of the same device are
+ * merged into a single block layer request.
+ */
+#define SCSI_DISK_BATCH_MAX 32
+
+typedef struct SCSIDiskBatch {
+    unsigned int nr_reqs;
+    SCSIDiskReq *reqs[SCSI_DISK_BATCH_MAX];
+} SCSIDiskBatch;
+
+static __thread SCSIDiskBatch scsi_disk_batch;
+
+typedef struct SCSIDiskMergedIO {
+    QEMUSGList sg;
+    unsigned int nr_reqs;
+    SCSIDiskReq *reqs[];
+} SCSIDiskMergedIO;
+
+/*
+ * Batched requests get an AIOCB of their own, so that cancelling one of
+ * them waits for the merged I/O instead of failing it for the others.
+ */
+static const AIOCBInfo scsi_disk_batch_aiocb_info = {
+    .aiocb_size = sizeof(BlockAIOCB),
+};
+
+static void scsi_disk_merged_complete(void *opaque, int ret)
+{
+    SCSIDiskMergedIO *m = opaque;
+    unsigned int i;
+
+    for (i = 0; i < m->nr_reqs; i++) {
+        BlockAIOCB *acb = m->reqs[i]->req.aiocb;
+
+        acb->cb(acb->opaque, ret);
+        qemu_aio_unref(acb);
+    }
+    qemu_sglist_destroy(&m->sg);
+    g_free(m);
+}
+
+static void scsi_disk_dma_submit(SCSIDiskReq **reqs, unsigned int nr_reqs)
+{
+    SCSIDiskReq *r = reqs[0];
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+    SCSIDiskClass *sdc = (SCSIDiskClass *) object_get_class(OBJECT(s));
+    bool write = r->req.cmd.mode == SCSI_XFER_TO_DEV;
+    DMADirection dir = write ? DMA_DIRECTION_TO_DEVICE :
+                               DMA_DIRECTION_FROM_DEVICE;
+    DMAIOFunc *io_func = write ? sdc->dma_writev : sdc->dma_readv;
+    SCSIDiskMergedIO *m;
+    unsigned int i;
+    int j;
+
+    if (nr_reqs == 1) {
+        /* Nothing can have run since the request was batched */
+        if (r->req.aiocb) {
+            qemu_aio_unref(r->req.aiocb);
+        }
+        r->req.aiocb = dma_blk_io(qemu_get_current_aio_context(),
+                                  r->req.sg, r->sector << BDRV_SECTOR_BITS,
+                                  BDRV_SECTOR_SIZE, io_func, r,
+                                  scsi_dma_complete, r, dir);
+        return;
+    }
+
+    trace_scsi_disk_dma_merge(nr_reqs, r->sector, write);
+
+    m = g_malloc(sizeof(*m) + nr_reqs * sizeof(m->reqs[0]));
+    m->nr_reqs = nr_reqs;
+    qemu_sglist_init(&m->sg, DEVICE(s), 0, r->req.sg->as);
+    for (i = 0; i < nr_reqs; i++) {
+        QEMUSGList *sg = reqs[i]->req.sg;
+
+        m->reqs[i] = reqs[i];
+        for (j = 0; j < sg->nsg; j++) {
+            qemu_sglist_add(&m->sg, sg->sg[j].base, sg->sg[j].len);
+        }
+    }
+
+    dma_blk_io(qemu_get_current_aio_context(), &m->sg,
+               r->sector << BDRV_SECTOR_BITS, BDRV_SECTOR_SIZE, io_func, r,
+               scsi_disk_merged_complete, m, dir);
+}
+
+static int scsi_disk_req_cmp(const void *a, const void *b)
+{
+    const SCSIDiskReq *r1 = *(SCSIDiskReq * const *)a;
+    const SCSIDiskReq *r2 = *(SCSIDiskReq * const *)b;
+
+    if (r1->req.dev != r2->req.dev) {
+        return (uintptr_t)r1->req.dev < (uintptr_t)r2->req.dev ? -1 : 1;
+    }
+    if (r1->req.cmd.mode != r2->req.cmd.mode) {
+        return r1->req.cmd.mode < r2->req.cmd.mode ? -1 : 1;
+    }
+    if (r1->sector != r2->sector) {
+        return r1->sector < r2->sector ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Can @r be appended to a merged request of @size bytes ending with @prev? */
+static bool scsi_disk_can_merge(SCSIDiskReq *prev, SCSIDiskReq *r,
+                                uint64_t size, int nsg)
+{
+    BlockBackend *blk = r->req.dev->conf.blk;
+
+    return prev->req.dev == r->req.dev &&
+           prev->req.cmd.mode == r->req.cmd.mode &&
+           QEMU_IS_ALIGNED(prev->req.sg->size, BDRV_SECTOR_SIZE) &&
+           (prev->sector << BDRV_SECTOR_BITS) + prev->req.sg->size ==
+               r->sector << BDRV_SECTOR_BITS &&
+           size + r->req.sg->size <= blk_get_max_transfer(blk) &&
+           nsg + r->req.sg->nsg <= blk_get_max_iov(blk);
+}
+
+static void scsi_disk_batch_flush(void *opaque)
+{
+    SCSIDiskBatch *batch = &scsi_disk_batch;
+    SCSIDiskReq *reqs[SCSI_DISK_BATCH_MAX];
+    unsigned int nr_reqs = batch->nr_reqs;
+    unsigned int i, start = 0;
+    uint64_t size = 0;
+    int nsg = 0;
+
+    if (!nr_reqs) {
+        return;
+    }
+
+    /* Completion callbacks may batch new requests */
+    memcpy(reqs, batch->reqs, nr_reqs * sizeof(reqs[0]));
+    batch->nr_reqs = 0;
+
+    qsort(reqs, nr_reqs, sizeof(reqs[0]), scsi_disk_req_cmp);
+
+    for (i = 0; i < nr_reqs; i++) {
+        if (i > start &&
+            !scsi_disk_can_merge(reqs[i - 1], reqs[i], size, nsg)) {
+            scsi_disk_dma_submit(&reqs[start], i - start);
+            start = i;
+            size = 0;
+            nsg = 0;
+        }
+        size += reqs[i]->req.sg->size;
+        nsg += reqs[i]->req.sg->nsg;
+    }
+    scsi_disk_dma_submit(&reqs[start], nr_reqs - start);
+}
+
+/* Start a read or write from/to r->req.sg at r->sector */
+static void scsi_disk_dma_start(SCSIDiskReq *r)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+    SCSIDiskBatch *batch = &scsi_disk_batch;
+
+    if (!s->request_merging) {
+        scsi_disk_dma_submit(&r, 1);
+        return;
+    }
+
+    if (batch->nr_reqs == SCSI_DISK_BATCH_MAX) {
+        scsi_disk_batch_flush(NULL);
+    }
+    r->req.aiocb = qemu_aio_get(&scsi_disk_batch_aiocb_info, NULL,
+                                scsi_dma_complete, r);
+    batch->reqs[batch->nr_reqs++] = r;
+    defer_call(scsi_disk_batch_flush, NULL);
+}
+
 static void scsi_read_complete_noio(SCSIDiskReq *r, int ret)
 {
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
     uint32_t n;
 
-    /* The request must only run in the BlockBackend's AioContext */
-    assert(blk_get_aio_context(s->qdev.conf.blk) ==
-           qemu_get_current_aio_context());
+    /* The request must only run in the AioContext that submitted it */
+    assert(r->req.ctx == qemu_get_current_aio_context());
 
     assert(r->req.aiocb == NULL);
     if (scsi_disk_req_check_error(r, ret, false)) {
@@ -428,11 +601,7 @@ static void scsi_do_read(SCSIDiskReq *r, int ret)
     if (r->req.sg) {
         dma_acct_start(s->qdev.conf.blk, &r->acct, r->req.sg, BLOCK_ACCT_READ);
         r->req.residual -= r->req.sg->size;
-        r->req.aiocb = dma_blk_io(blk_get_aio_context(s->qdev.conf.blk),
-                                  r->req.sg, r->sector << BDRV_SECTOR_BITS,
-                                  BDRV_SECTOR_SIZE,
-                                  sdc->dma_readv, r, scsi_dma_complete, r,
-                                  DMA_DIRECTION_FROM_DEVICE);
+        scsi_disk_dma_start(r);
     } else {
         scsi_init_iovec(r, SCSI_DMA_BUF_SIZE);
         block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct,
@@ -507,9 +676,8 @@ static void scsi_write_complete_noio(SCSIDiskReq *r, int ret)
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
     uint32_t n;
 
-    /* The request must only run in the BlockBackend's AioContext */
-    assert(blk_get_aio_context(s->qdev.conf.blk) ==
-           qemu_get_current_aio_context());
+    /* The request must only run in the AioContext that submitted it */
+    assert(r->req.ctx == qemu_get_current_aio_context());
 
     assert (r->req.aiocb == NULL);
     if (scsi_disk_req_check_error(r, ret, false)) {
@@ -589,11 +757,7 @@ static void scsi_write_data(SCSIRequest *req)
     if (r->req.sg) {
         dma_acct_start(s->qdev.conf.blk, &r->acct, r->req.sg, BLOCK_ACCT_WRITE);
         r->req.residual -= r->req.sg->size;
-        r->req.aiocb = dma_blk_io(blk_get_aio_context(s->qdev.conf.blk),
-                                  r->req.sg, r->sector << BDRV_SECTOR_BITS,
-                                  BDRV_SECTOR_SIZE,
-                                  sdc->dma_writev, r, scsi_dma_complete, r,
-                                  DMA_DIRECTION_TO_DEVICE);
+        scsi_disk_dma_start(r);
     } else {
         block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct,
                          r->qiov.size, BLOCK_ACCT_WRITE);
@@ -3123,6 +3287,7 @@ static Property scsi_hd_properties[] = {
                        DEFAULT_MAX_UNMAP_SIZE),
     DEFINE_PROP_UINT64("max_io_size", SCSIDiskState, max_io_size,
                        DEFAULT_MAX_IO_SIZE),
+    DEFINE_PROP_BOOL("request-merging", SCSIDiskState, request_merging, true),
     DEFINE_PROP_UINT16("rotation_rate", SCSIDiskState, rotation_rate, 0),
     DEFINE_PROP_INT32("scsi_version", SCSIDiskState, qdev.default_scsi_version,
                       5),
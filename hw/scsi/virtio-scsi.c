@@ -25,6 +25,7 @@
 #include "sysemu/block-backend.h"
 #include "sysemu/dma.h"
 #include "hw/qdev-properties.h"
+#include "hw/qdev-properties-system.h"
 #include "hw/scsi/scsi.h"
 #include "scsi/constants.h"
 #include "hw/virtio/virtio-bus.h"
@@ -99,21 +100,24 @@ static void virtio_scsi_free_req(VirtIOSCSIReq *req)
 {
     qemu_iovec_destroy(&req->resp_iov);
     qemu_sglist_destroy(&req->qsgl);
-    g_free(req);
+    virtqueue_element_free(req->vq, req);
 }
 
-static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
+/* @vq_lock is &s->ctrl_lock for the ctrl virtqueue and NULL otherwise */
+static void virtio_scsi_complete_req(VirtIOSCSIReq *req, QemuMutex *vq_lock)
 {
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
     qemu_iovec_from_buf(&req->resp_iov, 0, &req->resp, req->resp_size);
-    virtqueue_push(vq, &req->elem, req->qsgl.size + req->resp_iov.size);
-    if (s->dataplane_started && !s->dataplane_fenced) {
-        virtio_notify_irqfd(vdev, vq);
-    } else {
-        virtio_notify(vdev, vq);
+    WITH_QEMU_LOCK_GUARD(vq_lock) {
+        virtqueue_push(vq, &req->elem, req->qsgl.size + req->resp_iov.size);
+        if (s->dataplane_started && !s->dataplane_fenced) {
+            virtio_notify_irqfd(vdev, vq);
+        } else {
+            virtio_notify(vdev, vq);
+        }
     }
 
     if (req->sreq) {
@@ -123,34 +127,12 @@ static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
     virtio_scsi_free_req(req);
 }
 
-static void virtio_scsi_complete_req_bh(void *opaque)
-{
-    VirtIOSCSIReq *req = opaque;
-
-    virtio_scsi_complete_req(req);
-}
-
-/*
- * Called from virtio_scsi_do_one_tmf_bh() in main loop thread. The main loop
- * thread cannot touch the virtqueue since that could race with an IOThread.
- */
-static void virtio_scsi_complete_req_from_main_loop(VirtIOSCSIReq *req)
-{
-    VirtIOSCSI *s = req->dev;
-
-    if (!s->ctx || s->ctx == qemu_get_aio_context()) {
-        /* No need to schedule a BH when there is no IOThread */
-        virtio_scsi_complete_req(req);
-    } else {
-        /* Run request completion in the IOThread */
-        aio_wait_bh_oneshot(s->ctx, virtio_scsi_complete_req_bh, req);
-    }
-}
-
-static void virtio_scsi_bad_req(VirtIOSCSIReq *req)
+static void virtio_scsi_bad_req(VirtIOSCSIReq *req, QemuMutex *vq_lock)
 {
     virtio_error(VIRTIO_DEVICE(req->dev), "wrong size for virtio-scsi headers");
-    virtqueue_detach_element(req->vq, &req->elem, 0);
+    WITH_QEMU_LOCK_GUARD(vq_lock) {
+        virtqueue_detach_element(req->vq, &req->elem, 0);
+    }
     virtio_scsi_free_req(req);
 }
 
@@ -235,12 +217,15 @@ static int virtio_scsi_parse_req(VirtIOSCSIReq *req,
     return 0;
 }
 
-static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
+static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq,
+                                          QemuMutex *vq_lock)
 {
     VirtIOSCSICommon *vs = (VirtIOSCSICommon *)s;
     VirtIOSCSIReq *req;
 
-    req = virtqueue_pop(vq, sizeof(VirtIOSCSIReq) + vs->cdb_size);
+    WITH_QEMU_LOCK_GUARD(vq_lock) {
+        req = virtqueue_pop(vq, sizeof(VirtIOSCSIReq) + vs->cdb_size);
+    }
     if (!req) {
         return NULL;
     }
@@ -281,6 +266,11 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
         exit(1);
     }
 
+    /* Resume the request in the AioContext of its virtqueue */
+    if (s->vq_aio_context) {
+        sreq->ctx = s->vq_aio_context[VIRTIO_SCSI_VQ_NUM_FIXED + n];
+    }
+
     scsi_req_ref(sreq);
     req->sreq = sreq;
     if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
@@ -294,29 +284,141 @@ typedef struct {
     VirtIOSCSIReq  *tmf_req;
 } VirtIOSCSICancelNotifier;
 
+/* Called from any thread, completes the TMF when nothing else is pending */
+static void virtio_scsi_tmf_dec_remaining(VirtIOSCSIReq *req)
+{
+    if (qatomic_fetch_dec(&req->remaining) == 1) {
+        trace_virtio_scsi_tmf_resp(virtio_scsi_get_lun(req->req.tmf.lun),
+                                   req->req.tmf.tag, req->resp.tmf.response);
+        virtio_scsi_complete_req(req, &req->dev->ctrl_lock);
+    }
+}
+
 static void virtio_scsi_cancel_notify(Notifier *notifier, void *data)
 {
     VirtIOSCSICancelNotifier *n = container_of(notifier,
                                                VirtIOSCSICancelNotifier,
                                                notifier);
 
-    if (--n->tmf_req->remaining == 0) {
-        VirtIOSCSIReq *req = n->tmf_req;
+    virtio_scsi_tmf_dec_remaining(n->tmf_req);
+    g_free(n);
+}
 
-        trace_virtio_scsi_tmf_resp(virtio_scsi_get_lun(req->req.tmf.lun),
-                                   req->req.tmf.tag, req->resp.tmf.response);
-        virtio_scsi_complete_req(req);
+/* Does the TMF in @req apply to the command request @r? */
+static bool virtio_scsi_tmf_matches(VirtIOSCSIReq *req, SCSIRequest *r)
+{
+    VirtIOSCSIReq *cmd_req = r->hba_private;
+
+    if (!cmd_req) {
+        return false;
+    }
+    switch (req->req.tmf.subtype) {
+    case VIRTIO_SCSI_T_TMF_ABORT_TASK:
+    case VIRTIO_SCSI_T_TMF_QUERY_TASK:
+        return cmd_req->req.cmd.tag == req->req.tmf.tag;
+    default:
+        return true;
     }
-    g_free(n);
 }
 
-static inline void virtio_scsi_ctx_check(VirtIOSCSI *s, SCSIDevice *d)
+typedef struct {
+    VirtIOSCSIReq *tmf_req;
+    SCSIDevice *d;
+} VirtIOSCSITMFCancel;
+
+/*
+ * Requests can only be cancelled from the AioContext that runs them, so a
+ * TMF that aborts requests sends this BH to each AioContext involved.
+ */
+static void virtio_scsi_tmf_cancel_bh(void *opaque)
 {
-    if (s->dataplane_started && d && blk_is_available(d->conf.blk)) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
+    g_autofree VirtIOSCSITMFCancel *data = opaque;
+    VirtIOSCSIReq *req = data->tmf_req;
+    SCSIDevice *d = data->d;
+    AioContext *ctx = qemu_get_current_aio_context();
+    g_autoptr(GSList) reqs = NULL;
+    SCSIRequest *r;
+    GSList *l;
+
+    /* Cancelling dequeues requests, so do it outside requests_lock */
+    WITH_QEMU_LOCK_GUARD(&d->requests_lock) {
+        QTAILQ_FOREACH(r, &d->requests, next) {
+            if (r->ctx == ctx && virtio_scsi_tmf_matches(req, r)) {
+                scsi_req_ref(r);
+                reqs = g_slist_prepend(reqs, r);
+            }
+        }
+    }
+
+    for (l = reqs; l; l = l->next) {
+        r = l->data;
+        if (r->hba_private) {
+            VirtIOSCSICancelNotifier *notifier;
+
+            qatomic_inc(&req->remaining);
+            notifier = g_new(VirtIOSCSICancelNotifier, 1);
+            notifier->notifier.notify = virtio_scsi_cancel_notify;
+            notifier->tmf_req = req;
+            scsi_req_cancel_async(r, &notifier->notifier);
+        }
+        scsi_req_unref(r);
+    }
+
+    virtio_scsi_tmf_dec_remaining(req);
+
+    /* Paired with virtio_scsi_tmf_cancel() */
+    blk_dec_in_flight(d->conf.blk);
+    object_unref(OBJECT(d));
+}
+
+/*
+ * Cancel the requests of @d that the TMF in @req applies to.  The caller
+ * holds one count in req->remaining so that the TMF cannot complete before
+ * this function returns.  The BlockBackend's in-flight counter makes
+ * draining @d wait for the cancellation.
+ */
+static void virtio_scsi_tmf_cancel(VirtIOSCSIReq *req, SCSIDevice *d)
+{
+    g_autoptr(GHashTable) contexts = g_hash_table_new(NULL, NULL);
+    GHashTableIter iter;
+    SCSIRequest *r;
+    gpointer ctx;
+
+    WITH_QEMU_LOCK_GUARD(&d->requests_lock) {
+        QTAILQ_FOREACH(r, &d->requests, next) {
+            if (virtio_scsi_tmf_matches(req, r)) {
+                g_hash_table_add(contexts, r->ctx);
+            }
+        }
+    }
+
+    g_hash_table_iter_init(&iter, contexts);
+    while (g_hash_table_iter_next(&iter, &ctx, NULL)) {
+        VirtIOSCSITMFCancel *data = g_new(VirtIOSCSITMFCancel, 1);
+
+        data->tmf_req = req;
+        data->d = d;
+        object_ref(OBJECT(d));
+        blk_inc_in_flight(d->conf.blk);
+        qatomic_inc(&req->remaining);
+        aio_bh_schedule_oneshot(ctx, virtio_scsi_tmf_cancel_bh, data);
     }
 }
 
+/* Is any request of @d subject to the TMF in @req? */
+static bool virtio_scsi_tmf_query(VirtIOSCSIReq *req, SCSIDevice *d)
+{
+    SCSIRequest *r;
+
+    QEMU_LOCK_GUARD(&d->requests_lock);
+    QTAILQ_FOREACH(r, &d->requests, next) {
+        if (virtio_scsi_tmf_matches(req, r)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static void virtio_scsi_do_one_tmf_bh(VirtIOSCSIReq *req)
 {
     VirtIOSCSI *s = req->dev;
@@ -362,10 +464,13 @@ static void virtio_scsi_do_one_tmf_bh(VirtIOSCSIReq *req)
 
 out:
     object_unref(OBJECT(d));
-    virtio_scsi_complete_req_from_main_loop(req);
+    virtio_scsi_complete_req(req, &s->ctrl_lock);
 }
 
-/* Some TMFs must be processed from the main loop thread */
+/*
+ * Resets drain the devices, so run them from a BH rather than from within
+ * whatever aio_poll() dispatched the ctrl virtqueue.
+ */
 static void virtio_scsi_do_tmf_bh(void *opaque)
 {
     VirtIOSCSI *s = opaque;
@@ -409,7 +514,7 @@ static void virtio_scsi_reset_tmf_bh(VirtIOSCSI *s)
 
         /* SAM-6 6.3.2 Hard reset */
         req->resp.tmf.response = VIRTIO_SCSI_S_TARGET_FAILURE;
-        virtio_scsi_complete_req(req);
+        virtio_scsi_complete_req(req, &s->ctrl_lock);
     }
 }
 
@@ -433,10 +538,8 @@ static void virtio_scsi_defer_tmf_to_bh(VirtIOSCSIReq *req)
 static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
     SCSIDevice *d = virtio_scsi_device_get(s, req->req.tmf.lun);
-    SCSIRequest *r, *next;
     int ret = 0;
 
-    virtio_scsi_ctx_check(s, d);
     /* Here VIRTIO_SCSI_S_OK means "FUNCTION COMPLETE".  */
     req->resp.tmf.response = VIRTIO_SCSI_S_OK;
 
@@ -459,31 +562,17 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
         if (d->lun != virtio_scsi_get_lun(req->req.tmf.lun)) {
             goto incorrect_lun;
         }
-        QTAILQ_FOREACH_SAFE(r, &d->requests, next, next) {
-            VirtIOSCSIReq *cmd_req = r->hba_private;
-            if (cmd_req && cmd_req->req.cmd.tag == req->req.tmf.tag) {
-                break;
-            }
-        }
-        if (r) {
-            /*
-             * Assert that the request has not been completed yet, we
-             * check for it in the loop above.
+        if (req->req.tmf.subtype == VIRTIO_SCSI_T_TMF_QUERY_TASK) {
+            /* "If the specified command is present in the task set, then
+             * return a service response set to FUNCTION SUCCEEDED".
              */
-            assert(r->hba_private);
-            if (req->req.tmf.subtype == VIRTIO_SCSI_T_TMF_QUERY_TASK) {
-                /* "If the specified command is present in the task set, then
-                 * return a service response set to FUNCTION SUCCEEDED".
-                 */
+            if (virtio_scsi_tmf_query(req, d)) {
                 req->resp.tmf.response = VIRTIO_SCSI_S_FUNCTION_SUCCEEDED;
-            } else {
-                VirtIOSCSICancelNotifier *notifier;
-
-                req->remaining = 1;
-                notifier = g_new(VirtIOSCSICancelNotifier, 1);
-                notifier->tmf_req = req;
-                notifier->notifier.notify = virtio_scsi_cancel_notify;
-                scsi_req_cancel_async(r, &notifier->notifier);
+            }
+        } else {
+            req->remaining = 1;
+            virtio_scsi_tmf_cancel(req, d);
+            if (qatomic_fetch_dec(&req->remaining) != 1) {
                 ret = -EINPROGRESS;
             }
         }
@@ -505,32 +594,24 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
             goto incorrect_lun;
         }
 
+        if (req->req.tmf.subtype == VIRTIO_SCSI_T_TMF_QUERY_TASK_SET) {
+            /* "If there is any command present in the task set, then
+             * return a service response set to FUNCTION SUCCEEDED".
+             */
+            if (virtio_scsi_tmf_query(req, d)) {
+                req->resp.tmf.response = VIRTIO_SCSI_S_FUNCTION_SUCCEEDED;
+            }
+            break;
+        }
+
         /* Add 1 to "remaining" until virtio_scsi_do_tmf returns.
-         * This way, if the bus starts calling back to the notifiers
-         * even before we finish the loop, virtio_scsi_cancel_notify
+         * This way, if the requests' AioContexts start calling back to
+         * the notifiers even before we are done, virtio_scsi_cancel_notify
          * will not complete the TMF too early.
          */
         req->remaining = 1;
-        QTAILQ_FOREACH_SAFE(r, &d->requests, next, next) {
-            if (r->hba_private) {
-                if (req->req.tmf.subtype == VIRTIO_SCSI_T_TMF_QUERY_TASK_SET) {
-                    /* "If there is any command present in the task set, then
-                     * return a service response set to FUNCTION SUCCEEDED".
-                     */
-                    req->resp.tmf.response = VIRTIO_SCSI_S_FUNCTION_SUCCEEDED;
-                    break;
-                } else {
-                    VirtIOSCSICancelNotifier *notifier;
-
-                    req->remaining++;
-                    notifier = g_new(VirtIOSCSICancelNotifier, 1);
-                    notifier->notifier.notify = virtio_scsi_cancel_notify;
-                    notifier->tmf_req = req;
-                    scsi_req_cancel_async(r, &notifier->notifier);
-                }
-            }
-        }
-        if (--req->remaining > 0) {
+        virtio_scsi_tmf_cancel(req, d);
+        if (qatomic_fetch_dec(&req->remaining) != 1) {
             ret = -EINPROGRESS;
         }
         break;
@@ -563,7 +644,7 @@ static void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
 
     if (iov_to_buf(req->elem.out_sg, req->elem.out_num, 0,
                 &type, sizeof(type)) < sizeof(type)) {
-        virtio_scsi_bad_req(req);
+        virtio_scsi_bad_req(req, &s->ctrl_lock);
         return;
     }
 
@@ -571,7 +652,7 @@ static void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
     if (type == VIRTIO_SCSI_T_TMF) {
         if (virtio_scsi_parse_req(req, sizeof(VirtIOSCSICtrlTMFReq),
                     sizeof(VirtIOSCSICtrlTMFResp)) < 0) {
-            virtio_scsi_bad_req(req);
+            virtio_scsi_bad_req(req, &s->ctrl_lock);
             return;
         } else {
             r = virtio_scsi_do_tmf(s, req);
@@ -581,7 +662,7 @@ static void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
                type == VIRTIO_SCSI_T_AN_SUBSCRIBE) {
         if (virtio_scsi_parse_req(req, sizeof(VirtIOSCSICtrlANReq),
                     sizeof(VirtIOSCSICtrlANResp)) < 0) {
-            virtio_scsi_bad_req(req);
+            virtio_scsi_bad_req(req, &s->ctrl_lock);
             return;
         } else {
             req->req.an.event_requested =
@@ -601,7 +682,7 @@ static void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
                  type == VIRTIO_SCSI_T_AN_SUBSCRIBE)
             trace_virtio_scsi_an_resp(virtio_scsi_get_lun(req->req.an.lun),
                                       req->resp.an.response);
-        virtio_scsi_complete_req(req);
+        virtio_scsi_complete_req(req, &s->ctrl_lock);
     } else {
         assert(r == -EINPROGRESS);
     }
@@ -611,7 +692,7 @@ static void virtio_scsi_handle_ctrl_vq(VirtIOSCSI *s, VirtQueue *vq)
 {
     VirtIOSCSIReq *req;
 
-    while ((req = virtio_scsi_pop_req(s, vq))) {
+    while ((req = virtio_scsi_pop_req(s, vq, &s->ctrl_lock))) {
         virtio_scsi_handle_ctrl_req(s, req);
     }
 }
@@ -626,7 +707,7 @@ static void virtio_scsi_handle_ctrl_vq(VirtIOSCSI *s, VirtQueue *vq)
  */
 static bool virtio_scsi_defer_to_dataplane(VirtIOSCSI *s)
 {
-    if (!s->ctx || s->dataplane_started) {
+    if (!s->vq_aio_context || s->dataplane_started) {
         return false;
     }
 
@@ -655,7 +736,7 @@ static void virtio_scsi_complete_cmd_req(VirtIOSCSIReq *req)
      * in virtio_scsi_command_complete.
      */
     req->resp_size = sizeof(VirtIOSCSICmdResp);
-    virtio_scsi_complete_req(req);
+    virtio_scsi_complete_req(req, NULL);
 }
 
 static void virtio_scsi_command_failed(SCSIRequest *r)
@@ -789,7 +870,7 @@ static int virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
             virtio_scsi_fail_cmd_req(req);
             return -ENOTSUP;
         } else {
-            virtio_scsi_bad_req(req);
+            virtio_scsi_bad_req(req, NULL);
             return -EINVAL;
         }
     }
@@ -802,7 +883,6 @@ static int virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
         virtio_scsi_complete_cmd_req(req);
         return -ENOENT;
     }
-    virtio_scsi_ctx_check(s, d);
     req->sreq = scsi_req_new(d, req->req.cmd.tag,
                              virtio_scsi_get_lun(req->req.cmd.lun),
                              req->req.cmd.cdb, vs->cdb_size, req);
@@ -844,7 +924,7 @@ static void virtio_scsi_handle_cmd_vq(VirtIOSCSI *s, VirtQueue *vq)
             virtio_queue_set_notification(vq, 0);
         }
 
-        while ((req = virtio_scsi_pop_req(s, vq))) {
+        while ((req = virtio_scsi_pop_req(s, vq, NULL))) {
             ret = virtio_scsi_handle_cmd_req_prepare(s, req);
             if (!ret) {
                 QTAILQ_INSERT_TAIL(&reqs, req, next);
@@ -974,7 +1054,7 @@ static void virtio_scsi_push_event(VirtIOSCSI *s,
         return;
     }
 
-    req = virtio_scsi_pop_req(s, vs->event_vq);
+    req = virtio_scsi_pop_req(s, vs->event_vq, NULL);
     if (!req) {
         s->events_dropped = true;
         return;
@@ -986,7 +1066,7 @@ static void virtio_scsi_push_event(VirtIOSCSI *s,
     }
 
     if (virtio_scsi_parse_req(req, 0, sizeof(VirtIOSCSIEvent))) {
-        virtio_scsi_bad_req(req);
+        virtio_scsi_bad_req(req, NULL);
         return;
     }
 
@@ -1006,7 +1086,7 @@ static void virtio_scsi_push_event(VirtIOSCSI *s,
     }
     trace_virtio_scsi_event(virtio_scsi_get_lun(evt->lun), event, reason);
 
-    virtio_scsi_complete_req(req);
+    virtio_scsi_complete_req(req, NULL);
 }
 
 static void virtio_scsi_handle_event_vq(VirtIOSCSI *s, VirtQueue *vq)
@@ -1065,11 +1145,18 @@ static void virtio_scsi_hotplug(HotplugHandler *hotplug_dev, DeviceState *dev,
     SCSIDevice *sd = SCSI_DEVICE(dev);
     int ret;
 
-    if (s->ctx && !s->dataplane_fenced) {
+    /*
+     * With several IOThreads, requests run in the thread of the virtqueue
+     * that submitted them.  The BlockBackend follows the first one, which
+     * is also where it was before iothread-vq-mapping existed.
+     */
+    if (s->vq_aio_context && !s->dataplane_fenced) {
+        AioContext *ctx = s->vq_aio_context[VIRTIO_SCSI_VQ_NUM_FIXED];
+
         if (blk_op_is_blocked(sd->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             return;
         }
-        ret = blk_set_aio_context(sd->conf.blk, s->ctx, errp);
+        ret = blk_set_aio_context(sd->conf.blk, ctx, errp);
         if (ret < 0) {
             return;
         }
@@ -1107,7 +1194,7 @@ static void virtio_scsi_hotunplug(HotplugHandler *hotplug_dev, DeviceState *dev,
 
     qdev_simple_device_unplug_cb(hotplug_dev, dev, errp);
 
-    if (s->ctx) {
+    if (s->vq_aio_context) {
         /* If other users keep the BlockBackend in the iothread, that's ok */
         blk_set_aio_context(sd->conf.blk, qemu_get_aio_context(), NULL);
     }
@@ -1141,7 +1228,7 @@ static void virtio_scsi_drained_begin(SCSIBus *bus)
 
     for (uint32_t i = 0; i < total_queues; i++) {
         VirtQueue *vq = virtio_get_queue(vdev, i);
-        virtio_queue_aio_detach_host_notifier(vq, s->ctx);
+        virtio_queue_aio_detach_host_notifier(vq, s->vq_aio_context[i]);
     }
 }
 
@@ -1168,9 +1255,10 @@ static void virtio_scsi_drained_end(SCSIBus *bus)
     for (uint32_t i = 0; i < total_queues; i++) {
         VirtQueue *vq = virtio_get_queue(vdev, i);
         if (vq == vs->event_vq) {
-            virtio_queue_aio_attach_host_notifier_no_poll(vq, s->ctx);
+            virtio_queue_aio_attach_host_notifier_no_poll(vq,
+                                                          s->vq_aio_context[i]);
         } else {
-            virtio_queue_aio_attach_host_notifier(vq, s->ctx);
+            virtio_queue_aio_attach_host_notifier(vq, s->vq_aio_context[i]);
         }
     }
 }
@@ -1241,6 +1329,7 @@ static void virtio_scsi_device_realize(DeviceState *dev, Error **errp)
 
     QTAILQ_INIT(&s->tmf_bh_list);
     qemu_mutex_init(&s->tmf_bh_lock);
+    qemu_mutex_init(&s->ctrl_lock);
 
     virtio_scsi_common_realize(dev,
                                virtio_scsi_handle_ctrl,
@@ -1280,9 +1369,11 @@ static void virtio_scsi_device_unrealize(DeviceState *dev)
     VirtIOSCSI *s = VIRTIO_SCSI(dev);
 
     virtio_scsi_reset_tmf_bh(s);
+    virtio_scsi_dataplane_cleanup(s);
 
     qbus_set_hotplug_handler(BUS(&s->bus), NULL);
     virtio_scsi_common_unrealize(dev);
+    qemu_mutex_destroy(&s->ctrl_lock);
     qemu_mutex_destroy(&s->tmf_bh_lock);
 }
 
@@ -1303,6 +1394,8 @@ static Property virtio_scsi_properties[] = {
                                                 VIRTIO_SCSI_F_CHANGE, true),
     DEFINE_PROP_LINK("iothread", VirtIOSCSI, parent_obj.conf.iothread,
                      TYPE_IOTHREAD, IOThread *),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-vq-mapping", VirtIOSCSI,
+            parent_obj.conf.iothread_vq_mapping_list),
     DEFINE_PROP_END_OF_LIST(),
 };
 
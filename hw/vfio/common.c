@@ -31,7 +31,9 @@
 #include "exec/memory.h"
 #include "exec/ram_addr.h"
 #include "hw/hw.h"
+#include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "qemu/interval-tree.h"
 #include "qemu/main-loop.h"
 #include "qemu/range.h"
 #include "sysemu/kvm.h"
@@ -199,7 +201,11 @@ bool vfio_devices_all_device_dirty_tracking(const VFIOContainerBase *bcontainer)
     VFIODevice *vbasedev;
 
     QLIST_FOREACH(vbasedev, &bcontainer->device_list, container_next) {
-        if (!vbasedev->dirty_pages_supported) {
+        /*
+         * Behind a vIOMMU the device logs guest IOVAs, not the addresses
+         * mapped in the container.
+         */
+        if (!vbasedev->dirty_pages_supported || vfio_viommu_preset(vbasedev)) {
             return false;
         }
     }
@@ -558,11 +564,13 @@ static bool vfio_get_section_iova_range(VFIOContainerBase *bcontainer,
     return true;
 }
 
-static void vfio_listener_region_add(MemoryListener *listener,
-                                     MemoryRegionSection *section)
+/*
+ * With @cpr_remap, only give back their vaddr to the RAM mappings of
+ * @section, which is already accounted for in @bcontainer.
+ */
+void vfio_container_region_add(VFIOContainerBase *bcontainer,
+                               MemoryRegionSection *section, bool cpr_remap)
 {
-    VFIOContainerBase *bcontainer = container_of(listener, VFIOContainerBase,
-                                                 listener);
     hwaddr iova, end;
     Int128 llend, llsize;
     void *vaddr;
@@ -585,10 +593,21 @@ static void vfio_listener_region_add(MemoryListener *listener,
         return;
     }
 
+    if (cpr_remap) {
+        /* cpr-exec refuses to start with a vIOMMU or a RamDiscardManager */
+        if (memory_region_is_iommu(section->mr) ||
+            memory_region_has_ram_discard_manager(section->mr)) {
+            return;
+        }
+        goto map;
+    }
+
     if (vfio_container_add_section_window(bcontainer, section, &err)) {
         goto fail;
     }
 
+    vfio_dirty_tracking_check(bcontainer, iova, end);
+
     memory_region_ref(section->mr);
 
     if (memory_region_is_iommu(section->mr)) {
@@ -618,6 +637,8 @@ static void vfio_listener_region_add(MemoryListener *listener,
                             section->offset_within_region,
                             int128_get64(llend),
                             iommu_idx);
+        /* DMA (un)map any contiguous range at once */
+        giommu->n.coalesce = true;
 
         ret = memory_region_iommu_set_page_size_mask(giommu->iommu_mr,
                                                      bcontainer->pgsizes,
@@ -661,6 +682,7 @@ static void vfio_listener_region_add(MemoryListener *listener,
         return;
     }
 
+map:
     vaddr = memory_region_get_ram_ptr(section->mr) +
             section->offset_within_region +
             (iova - section->offset_within_address_space);
@@ -682,8 +704,21 @@ static void vfio_listener_region_add(MemoryListener *listener,
         }
     }
 
-    ret = vfio_container_dma_map(bcontainer, iova, int128_get64(llsize),
-                                 vaddr, section->readonly);
+    if (cpr_remap) {
+        ret = vfio_cpr_update_vaddr(container_of(bcontainer, VFIOContainer,
+                                                 bcontainer),
+                                    iova, int128_get64(llsize), vaddr);
+    } else if (vfio_container_dma_unmap_cancel(bcontainer, iova,
+                                               int128_get64(llsize),
+                                               vaddr, section->readonly)) {
+        return;
+    } else if (bcontainer->cpr_reused) {
+        ret = vfio_cpr_dma_map(bcontainer, section->mr, iova,
+                               int128_get64(llsize), vaddr, section->readonly);
+    } else {
+        ret = vfio_container_dma_map(bcontainer, iova, int128_get64(llsize),
+                                     vaddr, section->readonly);
+    }
     if (ret) {
         error_setg(&err, "vfio_container_dma_map(%p, 0x%"HWADDR_PRIx", "
                    "0x%"HWADDR_PRIx", %p) = %d (%s)",
@@ -723,6 +758,15 @@ fail:
     }
 }
 
+static void vfio_listener_region_add(MemoryListener *listener,
+                                     MemoryRegionSection *section)
+{
+    VFIOContainerBase *bcontainer = container_of(listener, VFIOContainerBase,
+                                                 listener);
+
+    vfio_container_region_add(bcontainer, section, false);
+}
+
 static void vfio_listener_region_del(MemoryListener *listener,
                                      MemoryRegionSection *section)
 {
@@ -780,6 +824,19 @@ static void vfio_listener_region_del(MemoryListener *listener,
         try_unmap = false;
     }
 
+    if (try_unmap && memory_region_is_ram(section->mr) &&
+        !memory_region_is_ram_device(section->mr) &&
+        !int128_eq(llsize, int128_2_64())) {
+        void *vaddr = memory_region_get_ram_ptr(section->mr) +
+                      section->offset_within_region +
+                      (iova - section->offset_within_address_space);
+
+        /* The deferred unmap holds its own reference on the region */
+        try_unmap = !vfio_container_dma_unmap_defer(bcontainer, section->mr,
+                                                    iova, int128_get64(llsize),
+                                                    vaddr, section->readonly);
+    }
+
     if (try_unmap) {
         if (int128_eq(llsize, int128_2_64())) {
             /* The unmap ioctl doesn't accept a full 64-bit span. */
@@ -809,41 +866,121 @@ static void vfio_listener_region_del(MemoryListener *listener,
     vfio_container_del_section_window(bcontainer, section);
 }
 
-typedef struct VFIODirtyRanges {
-    hwaddr min32;
-    hwaddr max32;
-    hwaddr min64;
-    hwaddr max64;
-    hwaddr minpci64;
-    hwaddr maxpci64;
-} VFIODirtyRanges;
-
 typedef struct VFIODirtyRangesListener {
     VFIOContainerBase *bcontainer;
-    VFIODirtyRanges ranges;
+    IntervalTreeRoot ranges;
+    unsigned int nr_ranges;
     MemoryListener listener;
 } VFIODirtyRangesListener;
 
-static bool vfio_section_is_vfio_pci(MemoryRegionSection *section,
-                                     VFIOContainerBase *bcontainer)
+/*
+ * Add [start, last] to the tracked ranges, absorbing every range it
+ * overlaps or touches so that the tree only ever holds disjoint,
+ * non-adjacent ranges.
+ */
+static IntervalTreeNode *vfio_dirty_ranges_add(IntervalTreeRoot *root,
+                                               unsigned int *nr_ranges,
+                                               hwaddr start, hwaddr last)
 {
-    VFIOPCIDevice *pcidev;
-    VFIODevice *vbasedev;
-    Object *owner;
+    IntervalTreeNode *node;
 
-    owner = memory_region_owner(section->mr);
+    while ((node = interval_tree_iter_first(root, start ? start - 1 : 0,
+                                            last == UINT64_MAX ? last :
+                                                                 last + 1))) {
+        start = MIN(start, node->start);
+        last = MAX(last, node->last);
+        interval_tree_remove(node, root);
+        g_free(node);
+        (*nr_ranges)--;
+    }
 
-    QLIST_FOREACH(vbasedev, &bcontainer->device_list, container_next) {
-        if (vbasedev->type != VFIO_DEVICE_TYPE_PCI) {
-            continue;
-        }
-        pcidev = container_of(vbasedev, VFIOPCIDevice, vbasedev);
-        if (OBJECT(pcidev) == owner) {
-            return true;
-        }
+    node = g_new0(IntervalTreeNode, 1);
+    node->start = start;
+    node->last = last;
+    interval_tree_insert(node, root);
+    (*nr_ranges)++;
+
+    return node;
+}
+
+static void vfio_dirty_ranges_free(IntervalTreeRoot *root)
+{
+    IntervalTreeNode *node;
+
+    while ((node = interval_tree_iter_first(root, 0, UINT64_MAX))) {
+        interval_tree_remove(node, root);
+        g_free(node);
     }
+}
 
-    return false;
+typedef struct VFIODirtyRangeGap {
+    hwaddr size;
+    unsigned int idx;
+} VFIODirtyRangeGap;
+
+static int vfio_dirty_range_gap_cmp(const void *a, const void *b)
+{
+    const VFIODirtyRangeGap *ga = a, *gb = b;
+
+    if (ga->size != gb->size) {
+        return ga->size < gb->size ? -1 : 1;
+    }
+    return ga->idx < gb->idx ? -1 : ga->idx > gb->idx;
+}
+
+/*
+ * Devices only have to accept as many ranges as fit into a host page. When
+ * the guest layout has more, close the smallest holes first, so that big
+ * ones like the x86 AMD 1T hole or a relocated pci-hole64 remain untracked.
+ */
+static void vfio_dirty_ranges_reduce(IntervalTreeRoot *root,
+                                     unsigned int *nr_ranges,
+                                     unsigned int max_ranges)
+{
+    unsigned int i, n = *nr_ranges;
+    g_autofree IntervalTreeNode **nodes = NULL;
+    g_autofree VFIODirtyRangeGap *gaps = NULL;
+    g_autofree bool *merge = NULL;
+    IntervalTreeNode *node;
+    hwaddr start;
+
+    if (n <= max_ranges) {
+        return;
+    }
+
+    nodes = g_new(IntervalTreeNode *, n);
+    gaps = g_new(VFIODirtyRangeGap, n - 1);
+    merge = g_new0(bool, n);
+
+    node = interval_tree_iter_first(root, 0, UINT64_MAX);
+    for (i = 0; i < n; i++) {
+        nodes[i] = node;
+        node = interval_tree_iter_next(node, 0, UINT64_MAX);
+    }
+    for (i = 0; i < n - 1; i++) {
+        gaps[i].size = nodes[i + 1]->start - nodes[i]->last;
+        gaps[i].idx = i;
+    }
+    qsort(gaps, n - 1, sizeof(*gaps), vfio_dirty_range_gap_cmp);
+    for (i = 0; i < n - max_ranges; i++) {
+        merge[gaps[i].idx] = true;
+    }
+
+    /* Rebuild the tree, joining each range with its successor if marked */
+    for (i = 0; i < n; i++) {
+        interval_tree_remove(nodes[i], root);
+    }
+    *nr_ranges = 0;
+    start = nodes[0]->start;
+    for (i = 0; i < n; i++) {
+        if (!merge[i]) {
+            vfio_dirty_ranges_add(root, nr_ranges, start, nodes[i]->last);
+            if (i + 1 < n) {
+                start = nodes[i + 1]->start;
+            }
+        }
+        g_free(nodes[i]);
+    }
 }
 
 static void vfio_dirty_tracking_update(MemoryListener *listener,
@@ -852,8 +989,8 @@ static void vfio_dirty_tracking_update(MemoryListener *listener,
     VFIODirtyRangesListener *dirty = container_of(listener,
                                                   VFIODirtyRangesListener,
                                                   listener);
-    VFIODirtyRanges *range = &dirty->ranges;
-    hwaddr iova, end, *min, *max;
+    IntervalTreeNode *node;
+    hwaddr iova, end;
 
     if (!vfio_listener_valid_section(section, "tracking_update") ||
         !vfio_get_section_iova_range(dirty->bcontainer, section,
@@ -862,41 +999,15 @@ static void vfio_dirty_tracking_update(MemoryListener *listener,
     }
 
     /*
-     * The address space passed to the dirty tracker is reduced to three ranges:
-     * one for 32-bit DMA ranges, one for 64-bit DMA ranges and one for the
-     * PCI 64-bit hole.
-     *
-     * The underlying reports of dirty will query a sub-interval of each of
-     * these ranges.
-     *
-     * The purpose of the three range handling is to handle known cases of big
-     * holes in the address space, like the x86 AMD 1T hole, and firmware (like
-     * OVMF) which may relocate the pci-hole64 to the end of the address space.
-     * The latter would otherwise generate large ranges for tracking, stressing
-     * the limits of supported hardware. The pci-hole32 will always be below 4G
-     * (overlapping or not) so it doesn't need special handling and is part of
-     * the 32-bit range.
-     *
-     * The alternative would be an IOVATree but that has a much bigger runtime
-     * overhead and unnecessary complexity.
+     * Every section becomes its own range, merged only with its immediate
+     * neighbours, so holes in the address space are not tracked unless the
+     * uAPI range limit forces it, see vfio_dirty_ranges_reduce().
      */
-    if (vfio_section_is_vfio_pci(section, dirty->bcontainer) &&
-        iova >= UINT32_MAX) {
-        min = &range->minpci64;
-        max = &range->maxpci64;
-    } else {
-        min = (end <= UINT32_MAX) ? &range->min32 : &range->min64;
-        max = (end <= UINT32_MAX) ? &range->max32 : &range->max64;
-    }
-    if (*min > iova) {
-        *min = iova;
-    }
-    if (*max < end) {
-        *max = end;
-    }
+    node = vfio_dirty_ranges_add(&dirty->ranges, &dirty->nr_ranges,
+                                 iova, end);
 
-    trace_vfio_device_dirty_tracking_update(iova, end, *min, *max);
-    return;
+    trace_vfio_device_dirty_tracking_update(iova, end, node->start,
+                                            node->last);
 }
 
 static const MemoryListener vfio_dirty_tracking_listener = {
@@ -904,29 +1015,62 @@ static const MemoryListener vfio_dirty_tracking_listener = {
     .region_add = vfio_dirty_tracking_update,
 };
 
-static void vfio_dirty_tracking_init(VFIOContainerBase *bcontainer,
-                                     VFIODirtyRanges *ranges)
+static void vfio_dirty_tracking_init(VFIOContainerBase *bcontainer)
 {
     VFIODirtyRangesListener dirty;
+    unsigned int max_ranges;
 
     memset(&dirty, 0, sizeof(dirty));
-    dirty.ranges.min32 = UINT32_MAX;
-    dirty.ranges.min64 = UINT64_MAX;
-    dirty.ranges.minpci64 = UINT64_MAX;
     dirty.listener = vfio_dirty_tracking_listener;
     dirty.bcontainer = bcontainer;
 
     memory_listener_register(&dirty.listener,
                              bcontainer->space->as);
 
-    *ranges = dirty.ranges;
-
     /*
      * The memory listener is synchronous, and used to calculate the range
-     * to dirty tracking. Unregister it after we are done as we are not
-     * interested in any follow-up updates.
+     * to dirty tracking. Unregister it after we are done, follow-up updates
+     * are checked against the result by vfio_dirty_tracking_check().
      */
     memory_listener_unregister(&dirty.listener);
+
+    /*
+     * DMA logging uAPI guarantees to support at least a number of ranges that
+     * fits into a single host kernel base page.
+     */
+    max_ranges = qemu_real_host_page_size() /
+                 sizeof(struct vfio_device_feature_dma_logging_range);
+    vfio_dirty_ranges_reduce(&dirty.ranges, &dirty.nr_ranges, max_ranges);
+
+    vfio_dirty_ranges_free(&bcontainer->dirty_tracking_ranges);
+    bcontainer->dirty_tracking_ranges = dirty.ranges;
+    bcontainer->nr_dirty_tracking_ranges = dirty.nr_ranges;
+}
+
+/*
+ * The DMA logging uAPI has no way to add ranges to a running session, so a
+ * section showing up outside the tracked ranges while logging (e.g. memory
+ * hotplugged mid-migration) cannot have its DMA writes reported. Fail the
+ * migration rather than silently missing dirty pages.
+ */
+static void vfio_dirty_tracking_check(VFIOContainerBase *bcontainer,
+                                      hwaddr iova, hwaddr end)
+{
+    IntervalTreeNode *node;
+
+    if (interval_tree_is_empty(&bcontainer->dirty_tracking_ranges)) {
+        return;
+    }
+
+    node = interval_tree_iter_first(&bcontainer->dirty_tracking_ranges,
+                                    iova, end);
+    if (node && node->start <= iova && node->last >= end) {
+        return;
+    }
+
+    error_report("vfio: DMA to [0x%"HWADDR_PRIx" - 0x%"HWADDR_PRIx"] is not "
+                 "covered by device dirty tracking", iova, end);
+    vfio_set_migration_error(-ERANGE);
 }
 
 static void vfio_devices_dma_logging_stop(VFIOContainerBase *bcontainer)
@@ -951,16 +1095,19 @@ static void vfio_devices_dma_logging_stop(VFIOContainerBase *bcontainer)
         }
         vbasedev->dirty_tracking = false;
     }
+
+    vfio_dirty_ranges_free(&bcontainer->dirty_tracking_ranges);
+    bcontainer->nr_dirty_tracking_ranges = 0;
 }
 
 static struct vfio_device_feature *
-vfio_device_feature_dma_logging_start_create(VFIOContainerBase *bcontainer,
-                                             VFIODirtyRanges *tracking)
+vfio_device_feature_dma_logging_start_create(VFIOContainerBase *bcontainer)
 {
     struct vfio_device_feature *feature;
     size_t feature_size;
     struct vfio_device_feature_dma_logging_control *control;
     struct vfio_device_feature_dma_logging_range *ranges;
+    IntervalTreeNode *node;
 
     feature_size = sizeof(struct vfio_device_feature) +
                    sizeof(struct vfio_device_feature_dma_logging_control);
@@ -975,13 +1122,7 @@ vfio_device_feature_dma_logging_start_create(VFIOContainerBase *bcontainer,
 
     control = (struct vfio_device_feature_dma_logging_control *)feature->data;
     control->page_size = qemu_real_host_page_size();
-
-    /*
-     * DMA logging uAPI guarantees to support at least a number of ranges that
-     * fits into a single host kernel base page.
-     */
-    control->num_ranges = !!tracking->max32 + !!tracking->max64 +
-        !!tracking->maxpci64;
+    control->num_ranges = bcontainer->nr_dirty_tracking_ranges;
     ranges = g_try_new0(struct vfio_device_feature_dma_logging_range,
                         control->num_ranges);
     if (!ranges) {
@@ -992,25 +1133,16 @@ vfio_device_feature_dma_logging_start_create(VFIOContainerBase *bcontainer,
     }
 
     control->ranges = (uintptr_t)ranges;
-    if (tracking->max32) {
-        ranges->iova = tracking->min32;
-        ranges->length = (tracking->max32 - tracking->min32) + 1;
-        ranges++;
-    }
-    if (tracking->max64) {
-        ranges->iova = tracking->min64;
-        ranges->length = (tracking->max64 - tracking->min64) + 1;
+    for (node = interval_tree_iter_first(&bcontainer->dirty_tracking_ranges,
+                                         0, UINT64_MAX);
+         node; node = interval_tree_iter_next(node, 0, UINT64_MAX)) {
+        ranges->iova = node->start;
+        ranges->length = (node->last - node->start) + 1;
+        trace_vfio_device_dirty_tracking_range(node->start, node->last);
         ranges++;
     }
-    if (tracking->maxpci64) {
-        ranges->iova = tracking->minpci64;
-        ranges->length = (tracking->maxpci64 - tracking->minpci64) + 1;
-    }
 
-    trace_vfio_device_dirty_tracking_start(control->num_ranges,
-                                           tracking->min32, tracking->max32,
-                                           tracking->min64, tracking->max64,
-                                           tracking->minpci64, tracking->maxpci64);
+    trace_vfio_device_dirty_tracking_start(control->num_ranges);
 
     return feature;
 }
@@ -1030,15 +1162,16 @@ static void vfio_device_feature_dma_logging_start_destroy(
 static int vfio_devices_dma_logging_start(VFIOContainerBase *bcontainer)
 {
     struct vfio_device_feature *feature;
-    VFIODirtyRanges ranges;
     VFIODevice *vbasedev;
     int ret = 0;
 
-    vfio_dirty_tracking_init(bcontainer, &ranges);
-    feature = vfio_device_feature_dma_logging_start_create(bcontainer,
-                                                           &ranges);
+    vfio_dirty_tracking_init(bcontainer);
+    feature = vfio_device_feature_dma_logging_start_create(bcontainer);
     if (!feature) {
-        return -errno;
+        ret = -errno;
+        vfio_dirty_ranges_free(&bcontainer->dirty_tracking_ranges);
+        bcontainer->nr_dirty_tracking_ranges = 0;
+        return ret;
     }
 
     QLIST_FOREACH(vbasedev, &bcontainer->device_list, container_next) {
@@ -1153,6 +1286,64 @@ int vfio_devices_query_dirty_bitmap(const VFIOContainerBase *bcontainer,
     return 0;
 }
 
+/*
+ * Device dirty page reports are requested one window at a time, so the
+ * scratch bitmap stays small regardless of the guest size and a window in
+ * which no device wrote anything costs a single zero check instead of a
+ * walk of the QEMU dirty bitmaps. Only windows found dirty are cleared
+ * again before the next report.
+ */
+#define VFIO_DIRTY_SYNC_WINDOW_PAGES (1ULL << 21)
+
+static int vfio_devices_get_dirty_bitmap(const VFIOContainerBase *bcontainer,
+                                         hwaddr iova, hwaddr size,
+                                         ram_addr_t ram_addr,
+                                         uint64_t *dirty_pages)
+{
+    hwaddr window = VFIO_DIRTY_SYNC_WINDOW_PAGES * qemu_real_host_page_size();
+    uint64_t clean_windows = 0;
+    VFIOBitmap vbmap;
+    hwaddr offset;
+    int ret;
+
+    ret = vfio_bitmap_alloc(&vbmap, MIN(size, window));
+    if (ret) {
+        return ret;
+    }
+
+    *dirty_pages = 0;
+    for (offset = 0; offset < size; offset += window) {
+        hwaddr len = MIN(size - offset, window);
+        uint64_t pages = REAL_HOST_PAGE_ALIGN(len) /
+                         qemu_real_host_page_size();
+        uint64_t bytes = ROUND_UP(pages, sizeof(__u64) * BITS_PER_BYTE) /
+                         BITS_PER_BYTE;
+
+        ret = vfio_devices_query_dirty_bitmap(bcontainer, &vbmap,
+                                              iova + offset, len);
+        if (ret) {
+            break;
+        }
+
+        if (buffer_is_zero(vbmap.bitmap, bytes)) {
+            clean_windows++;
+            continue;
+        }
+
+        *dirty_pages +=
+            cpu_physical_memory_set_dirty_lebitmap(vbmap.bitmap,
+                                                   ram_addr + offset, pages);
+        memset(vbmap.bitmap, 0, bytes);
+    }
+
+    trace_vfio_devices_get_dirty_bitmap(iova, size, ram_addr,
+                                        DIV_ROUND_UP(size, window),
+                                        clean_windows, *dirty_pages);
+    g_free(vbmap.bitmap);
+
+    return ret;
+}
+
 int vfio_get_dirty_bitmap(const VFIOContainerBase *bcontainer, uint64_t iova,
                           uint64_t size, ram_addr_t ram_addr)
 {
@@ -1169,17 +1360,21 @@ int vfio_get_dirty_bitmap(const VFIOContainerBase *bcontainer, uint64_t iova,
         return 0;
     }
 
+    if (all_device_dirty_tracking) {
+        return vfio_devices_get_dirty_bitmap(bcontainer, iova, size, ram_addr,
+                                             &dirty_pages);
+    }
+
+    /*
+     * The container interfaces are queried in one go: the legacy type1
+     * backend rejects ranges that only partially cover a DMA mapping.
+     */
     ret = vfio_bitmap_alloc(&vbmap, size);
     if (ret) {
         return ret;
     }
 
-    if (all_device_dirty_tracking) {
-        ret = vfio_devices_query_dirty_bitmap(bcontainer, &vbmap, iova, size);
-    } else {
-        ret = vfio_container_query_dirty_bitmap(bcontainer, &vbmap, iova, size);
-    }
-
+    ret = vfio_container_query_dirty_bitmap(bcontainer, &vbmap, iova, size);
     if (ret) {
         goto out;
     }
@@ -1344,8 +1539,26 @@ static void vfio_listener_log_sync(MemoryListener *listener,
     }
 }
 
+static void vfio_listener_begin(MemoryListener *listener)
+{
+    VFIOContainerBase *bcontainer = container_of(listener, VFIOContainerBase,
+                                                 listener);
+
+    vfio_container_dma_batch_begin(bcontainer);
+}
+
+static void vfio_listener_commit(MemoryListener *listener)
+{
+    VFIOContainerBase *bcontainer = container_of(listener, VFIOContainerBase,
+                                                 listener);
+
+    vfio_container_dma_batch_commit(bcontainer);
+}
+
 const MemoryListener vfio_memory_listener = {
     .name = "vfio",
+    .begin = vfio_listener_begin,
+    .commit = vfio_listener_commit,
     .region_add = vfio_listener_region_add,
     .region_del = vfio_listener_region_del,
     .log_global_start = vfio_listener_log_global_start,
@@ -14,12 +14,72 @@
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "hw/vfio/vfio-container-base.h"
+#include "trace.h"
+
+static gint vfio_dma_range_cmp(gconstpointer a, gconstpointer b)
+{
+    const VFIODMARange *ra = a, *rb = b;
+
+    return ra->iova < rb->iova ? -1 : ra->iova > rb->iova;
+}
+
+/*
+ * Issues the unmaps deferred during the current memory transaction,
+ * coalescing adjacent ranges into a single unmap call each.  Unmapping
+ * several whole mappings at once is supported by all the IOMMU backends,
+ * unlike unmapping part of a mapping, which is why maps are not merged.
+ */
+static void vfio_container_dma_flush(VFIOContainerBase *bcontainer)
+{
+    GArray *pending = bcontainer->pending_unmaps;
+    unsigned int i, calls = 0;
+
+    if (!pending || !pending->len) {
+        return;
+    }
+
+    g_array_sort(pending, vfio_dma_range_cmp);
+
+    for (i = 0; i < pending->len;) {
+        VFIODMARange *first = &g_array_index(pending, VFIODMARange, i);
+        hwaddr iova = first->iova;
+        ram_addr_t size = first->size;
+        int ret;
+
+        for (i++; i < pending->len; i++) {
+            VFIODMARange *next = &g_array_index(pending, VFIODMARange, i);
+
+            /* The unmap ioctl doesn't accept a full 64-bit span. */
+            if (iova + size != next->iova || size + next->size < size) {
+                break;
+            }
+            size += next->size;
+        }
+
+        ret = bcontainer->ops->dma_unmap(bcontainer, iova, size, NULL);
+        if (ret) {
+            error_report("vfio_container_dma_unmap(%p, 0x%"HWADDR_PRIx", "
+                         "0x%"HWADDR_PRIx") = %d (%s)",
+                         bcontainer, iova, size, ret, strerror(-ret));
+        }
+        calls++;
+    }
+
+    trace_vfio_container_dma_flush(pending->len, calls);
+
+    /* RAM can only go away once it's no longer mapped */
+    for (i = 0; i < pending->len; i++) {
+        memory_region_unref(g_array_index(pending, VFIODMARange, i).mr);
+    }
+    g_array_set_size(pending, 0);
+}
 
 int vfio_container_dma_map(VFIOContainerBase *bcontainer,
                            hwaddr iova, ram_addr_t size,
                            void *vaddr, bool readonly)
 {
     g_assert(bcontainer->ops->dma_map);
+    vfio_container_dma_flush(bcontainer);
     return bcontainer->ops->dma_map(bcontainer, iova, size, vaddr, readonly);
 }
 
@@ -28,9 +88,98 @@ int vfio_container_dma_unmap(VFIOContainerBase *bcontainer,
                              IOMMUTLBEntry *iotlb)
 {
     g_assert(bcontainer->ops->dma_unmap);
+    vfio_container_dma_flush(bcontainer);
     return bcontainer->ops->dma_unmap(bcontainer, iova, size, iotlb);
 }
 
+/*
+ * Between vfio_container_dma_batch_begin() and
+ * vfio_container_dma_batch_commit(), which bracket a memory transaction,
+ * RAM unmaps can be deferred with vfio_container_dma_unmap_defer().  Any
+ * other map or unmap of the container flushes them first, so ordering is
+ * preserved.
+ */
+void vfio_container_dma_batch_begin(VFIOContainerBase *bcontainer)
+{
+    bcontainer->dma_batching = true;
+}
+
+void vfio_container_dma_batch_commit(VFIOContainerBase *bcontainer)
+{
+    bcontainer->dma_batching = false;
+    vfio_container_dma_flush(bcontainer);
+}
+
+/*
+ * Defers the unmap of a RAM mapping of @mr until the end of the memory
+ * transaction, taking a reference on @mr until then.
+ *
+ * Returns false if the unmap can't be deferred, in which case the caller
+ * has to unmap right away.
+ */
+bool vfio_container_dma_unmap_defer(VFIOContainerBase *bcontainer,
+                                    MemoryRegion *mr, hwaddr iova,
+                                    ram_addr_t size, void *vaddr,
+                                    bool readonly)
+{
+    VFIODMARange range = {
+        .mr = mr,
+        .iova = iova,
+        .size = size,
+        .vaddr = vaddr,
+        .readonly = readonly,
+    };
+
+    /* DMA windows are removed right after unmapping, so can't wait */
+    if (!bcontainer->dma_batching || bcontainer->ops->del_window) {
+        return false;
+    }
+
+    if (!bcontainer->pending_unmaps) {
+        bcontainer->pending_unmaps = g_array_new(FALSE, FALSE,
+                                                 sizeof(VFIODMARange));
+    }
+
+    memory_region_ref(mr);
+    g_array_append_val(bcontainer->pending_unmaps, range);
+
+    return true;
+}
+
+/*
+ * A transaction that deletes and adds back an identical mapping doesn't
+ * need to touch the IOMMU at all.  Drops the matching deferred unmap, if
+ * any.
+ *
+ * Returns true if the mapping is still in place and doesn't need to be
+ * established again.
+ */
+bool vfio_container_dma_unmap_cancel(VFIOContainerBase *bcontainer,
+                                     hwaddr iova, ram_addr_t size,
+                                     void *vaddr, bool readonly)
+{
+    GArray *pending = bcontainer->pending_unmaps;
+    unsigned int i;
+
+    if (!pending) {
+        return false;
+    }
+
+    for (i = 0; i < pending->len; i++) {
+        VFIODMARange *range = &g_array_index(pending, VFIODMARange, i);
+
+        if (range->iova == iova && range->size == size &&
+            range->vaddr == vaddr && range->readonly == readonly) {
+            memory_region_unref(range->mr);
+            g_array_remove_index_fast(pending, i);
+            trace_vfio_container_dma_unmap_cancel(iova, size);
+            return true;
+        }
+    }
+
+    return false;
+}
+
 int vfio_container_add_section_window(VFIOContainerBase *bcontainer,
                                       MemoryRegionSection *section,
                                       Error **errp)
@@ -98,6 +247,12 @@ void vfio_container_destroy(VFIOContainerBase *bcontainer)
     }
 
     g_list_free_full(bcontainer->iova_ranges, g_free);
+
+    vfio_container_dma_flush(bcontainer);
+    if (bcontainer->pending_unmaps) {
+        g_array_free(bcontainer->pending_unmaps, TRUE);
+        bcontainer->pending_unmaps = NULL;
+    }
 }
 
 static const TypeInfo types[] = {
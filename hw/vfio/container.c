@@ -27,16 +27,41 @@
 #include "exec/memory.h"
 #include "exec/ram_addr.h"
 #include "hw/hw.h"
+#include "qemu/async-teardown.h"
 #include "qemu/error-report.h"
 #include "qemu/range.h"
 #include "sysemu/reset.h"
+#include "sysemu/sysemu.h"
 #include "trace.h"
 #include "qapi/error.h"
+#include "migration/cpr.h"
 #include "pci.h"
 
 VFIOGroupList vfio_group_list =
     QLIST_HEAD_INITIALIZER(vfio_group_list);
 
+/*
+ * The kernel unmaps and unpins all the DMA mappings of a container when its
+ * last group is released, which can take minutes for large guests.  If
+ * asynchronous teardown is enabled, let the teardown process hold on to the
+ * groups and containers so that this happens after QEMU has exited.
+ */
+static void vfio_group_exit_notify(Notifier *n, void *data)
+{
+    VFIOGroup *group;
+
+    QLIST_FOREACH(group, &vfio_group_list, next) {
+        if (!async_teardown_hand_over_fd(group->container->fd) ||
+            !async_teardown_hand_over_fd(group->fd)) {
+            return;
+        }
+    }
+}
+
+static Notifier vfio_group_exit_notifier = {
+    .notify = vfio_group_exit_notify,
+};
+
 static int vfio_ram_block_discard_disable(VFIOContainer *container, bool state)
 {
     switch (container->iommu_type) {
@@ -402,6 +427,11 @@ static int vfio_set_iommu(VFIOContainer *container, int group_fd,
         return iommu_type;
     }
 
+    /* An inherited container is already set up */
+    if (container->bcontainer.cpr_reused) {
+        goto set_type;
+    }
+
     ret = ioctl(group_fd, VFIO_GROUP_SET_CONTAINER, &container->fd);
     if (ret) {
         error_setg_errno(errp, errno, "Failed to set group container");
@@ -423,6 +453,7 @@ static int vfio_set_iommu(VFIOContainer *container, int group_fd,
         return -errno;
     }
 
+set_type:
     container->iommu_type = iommu_type;
 
     vioc = vfio_get_iommu_class(iommu_type, errp);
@@ -539,10 +570,11 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as,
 {
     VFIOContainer *container;
     VFIOContainerBase *bcontainer;
-    int ret, fd;
+    int ret, fd, cpr_fd;
     VFIOAddressSpace *space;
 
     space = vfio_get_address_space(as);
+    cpr_fd = cpr_find_fd("vfio_container", group->groupid);
 
     /*
      * VFIO is currently incompatible with discarding of RAM insofar as the
@@ -577,7 +609,8 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as,
 
     QLIST_FOREACH(bcontainer, &space->containers, next) {
         container = container_of(bcontainer, VFIOContainer, bcontainer);
-        if (!ioctl(group->fd, VFIO_GROUP_SET_CONTAINER, &container->fd)) {
+        if (cpr_fd >= 0 ? container->fd == cpr_fd :
+            !ioctl(group->fd, VFIO_GROUP_SET_CONTAINER, &container->fd)) {
             ret = vfio_ram_block_discard_disable(container, true);
             if (ret) {
                 error_setg_errno(errp, -ret,
@@ -592,15 +625,20 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as,
             group->container = container;
             QLIST_INSERT_HEAD(&container->group_list, group, container_next);
             vfio_kvm_device_add_group(group);
+            cpr_save_fd("vfio_container", group->groupid, container->fd);
             return 0;
         }
     }
 
-    fd = qemu_open_old("/dev/vfio/vfio", O_RDWR);
-    if (fd < 0) {
-        error_setg_errno(errp, errno, "failed to open /dev/vfio/vfio");
-        ret = -errno;
-        goto put_space_exit;
+    if (cpr_fd >= 0) {
+        fd = cpr_fd;
+    } else {
+        fd = qemu_open_old("/dev/vfio/vfio", O_RDWR);
+        if (fd < 0) {
+            error_setg_errno(errp, errno, "failed to open /dev/vfio/vfio");
+            ret = -errno;
+            goto put_space_exit;
+        }
     }
 
     ret = ioctl(fd, VFIO_GET_API_VERSION);
@@ -614,6 +652,7 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as,
     container = g_malloc0(sizeof(*container));
     container->fd = fd;
     bcontainer = &container->bcontainer;
+    bcontainer->cpr_reused = cpr_fd >= 0;
 
     ret = vfio_set_iommu(container, group->fd, space, errp);
     if (ret) {
@@ -657,6 +696,7 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as,
     }
 
     bcontainer->initialized = true;
+    cpr_save_fd("vfio_container", group->groupid, container->fd);
 
     return 0;
 listener_release_exit:
@@ -693,6 +733,7 @@ static void vfio_disconnect_container(VFIOGroup *group)
 
     QLIST_REMOVE(group, container_next);
     group->container = NULL;
+    cpr_delete_fd("vfio_container", group->groupid);
 
     /*
      * Explicitly release the listener first before unset container,
@@ -748,7 +789,10 @@ static VFIOGroup *vfio_get_group(int groupid, AddressSpace *as, Error **errp)
     group = g_malloc0(sizeof(*group));
 
     snprintf(path, sizeof(path), "/dev/vfio/%d", groupid);
-    group->fd = qemu_open_old(path, O_RDWR);
+    group->fd = cpr_find_fd("vfio_group", groupid);
+    if (group->fd < 0) {
+        group->fd = qemu_open_old(path, O_RDWR);
+    }
     if (group->fd < 0) {
         error_setg_errno(errp, errno, "failed to open %s", path);
         goto free_group_exit;
@@ -776,7 +820,11 @@ static VFIOGroup *vfio_get_group(int groupid, AddressSpace *as, Error **errp)
         goto close_fd_exit;
     }
 
+    if (QLIST_EMPTY(&vfio_group_list)) {
+        qemu_add_exit_notifier(&vfio_group_exit_notifier);
+    }
     QLIST_INSERT_HEAD(&vfio_group_list, group, next);
+    cpr_save_fd("vfio_group", groupid, group->fd);
 
     return group;
 
@@ -801,6 +849,10 @@ static void vfio_put_group(VFIOGroup *group)
     vfio_kvm_device_del_group(group);
     vfio_disconnect_container(group);
     QLIST_REMOVE(group, next);
+    if (QLIST_EMPTY(&vfio_group_list)) {
+        qemu_remove_exit_notifier(&vfio_group_exit_notifier);
+    }
+    cpr_delete_fd("vfio_group", group->groupid);
     trace_vfio_put_group(group->fd);
     close(group->fd);
     g_free(group);
@@ -812,7 +864,11 @@ static int vfio_get_device(VFIOGroup *group, const char *name,
     g_autofree struct vfio_device_info *info = NULL;
     int fd;
 
-    fd = ioctl(group->fd, VFIO_GROUP_GET_DEVICE_FD, name);
+    fd = cpr_find_fd(name, 0);
+    vbasedev->cpr_reused = fd >= 0;
+    if (fd < 0) {
+        fd = ioctl(group->fd, VFIO_GROUP_GET_DEVICE_FD, name);
+    }
     if (fd < 0) {
         error_setg_errno(errp, errno, "error getting device from group %d",
                          group->groupid);
@@ -853,6 +909,7 @@ static int vfio_get_device(VFIOGroup *group, const char *name,
     vbasedev->fd = fd;
     vbasedev->group = group;
     QLIST_INSERT_HEAD(&group->device_list, vbasedev, next);
+    cpr_save_fd(name, 0, fd);
 
     vbasedev->num_irqs = info->num_irqs;
     vbasedev->num_regions = info->num_regions;
@@ -872,6 +929,7 @@ static void vfio_put_base_device(VFIODevice *vbasedev)
     }
     QLIST_REMOVE(vbasedev, next);
     vbasedev->group = NULL;
+    cpr_delete_fd(vbasedev->name, 0);
     trace_vfio_put_base_device(vbasedev->fd);
     close(vbasedev->fd);
 }
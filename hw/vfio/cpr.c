@@ -6,10 +6,14 @@
  */
 
 #include "qemu/osdep.h"
+#include <sys/ioctl.h>
+#include <linux/vfio.h>
 #include "hw/vfio/vfio-common.h"
+#include "migration/blocker.h"
 #include "migration/misc.h"
 #include "qapi/error.h"
 #include "sysemu/runstate.h"
+#include "trace.h"
 
 static int vfio_cpr_reboot_notifier(NotifierWithReturn *notifier,
                                     MigrationEvent *e, Error **errp)
@@ -25,15 +29,199 @@ static int vfio_cpr_reboot_notifier(NotifierWithReturn *notifier,
     return 0;
 }
 
+/*
+ * cpr-exec hands the container, group and device descriptors over to the
+ * new QEMU.  The IOMMU keeps the guest RAM pinned and mapped meanwhile, so
+ * devices can go on with DMA: the old QEMU only invalidates the vaddr of
+ * the mappings, and the new QEMU provides its own with VFIO_UPDATE_VADDR.
+ * RAM that is not handed over, such as ROMs, is copied by the migration
+ * and mapped again.
+ */
+
+static bool vfio_cpr_exec_supported(VFIOContainerBase *bcontainer)
+{
+    ObjectClass *klass = object_class_by_name(TYPE_VFIO_IOMMU_LEGACY);
+
+    return bcontainer->ops == VFIO_IOMMU_CLASS(klass);
+}
+
+static bool vfio_cpr_exec_check(VFIOContainer *container, Error **errp)
+{
+    VFIOContainerBase *bcontainer = &container->bcontainer;
+
+    if (!ioctl(container->fd, VFIO_CHECK_EXTENSION, VFIO_UPDATE_VADDR) ||
+        !ioctl(container->fd, VFIO_CHECK_EXTENSION, VFIO_UNMAP_ALL)) {
+        error_setg(errp, "VFIO container does not support updating the "
+                   "vaddr of DMA mappings, which cpr-exec requires");
+        return false;
+    }
+    if (!QLIST_EMPTY(&bcontainer->giommu_list)) {
+        error_setg(errp, "cpr-exec does not support VFIO devices behind "
+                   "a vIOMMU");
+        return false;
+    }
+    if (!QLIST_EMPTY(&bcontainer->vrdl_list)) {
+        error_setg(errp, "cpr-exec does not support VFIO devices with "
+                   "discardable RAM");
+        return false;
+    }
+    return true;
+}
+
+static int vfio_cpr_unmap_vaddr(VFIOContainer *container, Error **errp)
+{
+    struct vfio_iommu_type1_dma_unmap unmap = {
+        .argsz = sizeof(unmap),
+        .flags = VFIO_DMA_UNMAP_FLAG_VADDR | VFIO_DMA_UNMAP_FLAG_ALL,
+        .iova = 0,
+        .size = 0,
+    };
+
+    if (ioctl(container->fd, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
+        error_setg_errno(errp, errno, "VFIO_UNMAP_DMA with VADDR failed");
+        return -errno;
+    }
+    container->cpr_vaddr_unmapped = true;
+    trace_vfio_cpr_unmap_vaddr(container->fd);
+    return 0;
+}
+
+int vfio_cpr_update_vaddr(VFIOContainer *container, hwaddr iova,
+                          ram_addr_t size, void *vaddr)
+{
+    struct vfio_iommu_type1_dma_map map = {
+        .argsz = sizeof(map),
+        .flags = VFIO_DMA_MAP_FLAG_VADDR,
+        .vaddr = (__u64)(uintptr_t)vaddr,
+        .iova = iova,
+        .size = size,
+    };
+
+    if (ioctl(container->fd, VFIO_IOMMU_MAP_DMA, &map)) {
+        return -errno;
+    }
+    trace_vfio_cpr_update_vaddr(iova, size, vaddr);
+    return 0;
+}
+
+/*
+ * Map a section in a container inherited from the previous QEMU.  RAM
+ * that was handed over is still mapped and only needs its new vaddr;
+ * anything else was copied to new pages, or was not mapped before.
+ */
+int vfio_cpr_dma_map(VFIOContainerBase *bcontainer, MemoryRegion *mr,
+                     hwaddr iova, ram_addr_t size, void *vaddr,
+                     bool readonly)
+{
+    VFIOContainer *container = container_of(bcontainer, VFIOContainer,
+                                            bcontainer);
+
+    if (mr->ram_block && migrate_ram_is_ignored(mr->ram_block) &&
+        !vfio_cpr_update_vaddr(container, iova, size, vaddr)) {
+        return 0;
+    }
+    vfio_container_dma_unmap(bcontainer, iova, size, NULL);
+    return vfio_container_dma_map(bcontainer, iova, size, vaddr, readonly);
+}
+
+static void vfio_cpr_remap_region_add(MemoryListener *listener,
+                                      MemoryRegionSection *section)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer,
+                                            cpr_remap_listener);
+
+    vfio_container_region_add(&container->bcontainer, section, true);
+}
+
+/* The exec failed: give the vaddr of all mappings back to the IOMMU */
+static void vfio_cpr_remap(VFIOContainer *container)
+{
+    VFIOContainerBase *bcontainer = &container->bcontainer;
+
+    container->cpr_remap_listener = (MemoryListener) {
+        .name = "vfio-cpr-remap",
+        .region_add = vfio_cpr_remap_region_add,
+    };
+    memory_listener_register(&container->cpr_remap_listener,
+                             bcontainer->space->as);
+    memory_listener_unregister(&container->cpr_remap_listener);
+    container->cpr_vaddr_unmapped = false;
+}
+
+static int vfio_cpr_exec_notifier(NotifierWithReturn *notifier,
+                                  MigrationEvent *e, Error **errp)
+{
+    VFIOContainerBase *bcontainer = container_of(notifier, VFIOContainerBase,
+                                                 cpr_exec_notifier);
+    VFIOContainer *container = container_of(bcontainer, VFIOContainer,
+                                            bcontainer);
+
+    switch (e->type) {
+    case MIG_EVENT_PRECOPY_SETUP:
+        return vfio_cpr_exec_check(container, errp) ? 0 : -1;
+    case MIG_EVENT_PRECOPY_DONE:
+        return vfio_cpr_unmap_vaddr(container, errp);
+    case MIG_EVENT_PRECOPY_FAILED:
+        if (container->cpr_vaddr_unmapped) {
+            vfio_cpr_remap(container);
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+/* Once the VM runs, inherited containers and devices are ours */
+static VMChangeStateEntry *vfio_cpr_vm_state;
+
+static void vfio_cpr_vm_state_change(void *opaque, bool running,
+                                     RunState state)
+{
+    VFIODevice *vbasedev;
+
+    if (!running) {
+        return;
+    }
+
+    QLIST_FOREACH(vbasedev, &vfio_device_list, global_next) {
+        vbasedev->cpr_reused = false;
+        if (vbasedev->bcontainer) {
+            vbasedev->bcontainer->cpr_reused = false;
+        }
+    }
+    qemu_del_vm_change_state_handler(vfio_cpr_vm_state);
+    vfio_cpr_vm_state = NULL;
+}
+
 int vfio_cpr_register_container(VFIOContainerBase *bcontainer, Error **errp)
 {
     migration_add_notifier_mode(&bcontainer->cpr_reboot_notifier,
                                 vfio_cpr_reboot_notifier,
                                 MIG_MODE_CPR_REBOOT);
+
+    if (!vfio_cpr_exec_supported(bcontainer)) {
+        if (bcontainer->cpr_exec_blocker) {
+            return 0;
+        }
+        error_setg(&bcontainer->cpr_exec_blocker,
+                   "cpr-exec only supports the legacy VFIO container");
+        return migrate_add_blocker_modes(&bcontainer->cpr_exec_blocker, errp,
+                                         MIG_MODE_CPR_EXEC, -1);
+    }
+
+    migration_add_notifier_mode(&bcontainer->cpr_exec_notifier,
+                                vfio_cpr_exec_notifier,
+                                MIG_MODE_CPR_EXEC);
+    if (bcontainer->cpr_reused && !vfio_cpr_vm_state) {
+        vfio_cpr_vm_state =
+            qemu_add_vm_change_state_handler(vfio_cpr_vm_state_change, NULL);
+    }
     return 0;
 }
 
 void vfio_cpr_unregister_container(VFIOContainerBase *bcontainer)
 {
     migration_remove_notifier(&bcontainer->cpr_reboot_notifier);
+    migration_remove_notifier(&bcontainer->cpr_exec_notifier);
+    migrate_del_blocker(&bcontainer->cpr_exec_blocker);
 }
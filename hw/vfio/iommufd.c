@@ -24,14 +24,53 @@
 #include "sysemu/reset.h"
 #include "qemu/cutils.h"
 #include "qemu/chardev_open.h"
+#include "exec/address-spaces.h"
 #include "pci.h"
 
+/*
+ * Without a vIOMMU, every container of the address space maps the same
+ * guest RAM at the same IOVAs.  When a device cannot attach to the
+ * existing container, ranges that another container of the same iommufd
+ * has already pinned are copied from its IOAS instead of pinning all of
+ * guest RAM again.
+ */
+static int iommufd_cdev_copy(const VFIOIOMMUFDContainer *container,
+                             hwaddr iova, ram_addr_t size, bool readonly)
+{
+    const VFIOContainerBase *self = &container->bcontainer;
+    VFIOContainerBase *bcontainer;
+
+    if (self->space->as != &address_space_memory) {
+        return -ENOENT;
+    }
+
+    QLIST_FOREACH(bcontainer, &self->space->containers, next) {
+        const VFIOIOMMUFDContainer *src =
+            container_of(bcontainer, VFIOIOMMUFDContainer, bcontainer);
+
+        if (bcontainer == self || bcontainer->ops != self->ops ||
+            src->be != container->be) {
+            continue;
+        }
+        if (!iommufd_backend_copy_dma(container->be, src->ioas_id,
+                                      container->ioas_id, iova, size,
+                                      readonly)) {
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
 static int iommufd_cdev_map(const VFIOContainerBase *bcontainer, hwaddr iova,
                             ram_addr_t size, void *vaddr, bool readonly)
 {
     const VFIOIOMMUFDContainer *container =
         container_of(bcontainer, VFIOIOMMUFDContainer, bcontainer);
 
+    if (!iommufd_cdev_copy(container, iova, size, readonly)) {
+        return 0;
+    }
+
     return iommufd_backend_map_dma(container->be,
                                    container->ioas_id,
                                    iova, size, vaddr, readonly);
@@ -216,10 +255,101 @@ static int iommufd_cdev_detach_ioas_hwpt(VFIODevice *vbasedev, Error **errp)
     return ret;
 }
 
+static bool iommufd_cdev_dirty_tracking_capable(VFIODevice *vbasedev)
+{
+    enum iommu_hw_info_type type;
+    uint64_t caps;
+
+    if (iommufd_backend_get_device_info(vbasedev->iommufd, vbasedev->devid,
+                                        &type, NULL, 0, &caps, NULL)) {
+        return false;
+    }
+
+    return caps & IOMMU_HW_CAP_DIRTY_TRACKING;
+}
+
+/*
+ * Devices whose IOMMU can track dirty IOVAs are attached to a hwpt allocated
+ * on the container IOAS with dirty tracking, rather than to the IOAS itself.
+ * Mappings of the IOAS are mirrored in all of its hwpts, so nothing else
+ * changes for the container.
+ */
+static int iommufd_cdev_attach_dirty_hwpt(VFIODevice *vbasedev,
+                                          VFIOIOMMUFDContainer *container,
+                                          Error **errp)
+{
+    VFIOIOASHwpt *hwpt;
+    uint32_t hwpt_id;
+    int ret;
+
+    QLIST_FOREACH(hwpt, &container->hwpt_list, next) {
+        if (!iommufd_cdev_attach_ioas_hwpt(vbasedev, hwpt->hwpt_id, NULL)) {
+            goto found_hwpt;
+        }
+    }
+
+    ret = iommufd_backend_alloc_hwpt(container->be, vbasedev->devid,
+                                     container->ioas_id,
+                                     IOMMU_HWPT_ALLOC_DIRTY_TRACKING,
+                                     IOMMU_HWPT_DATA_NONE, 0, NULL, &hwpt_id);
+    if (ret) {
+        error_setg_errno(errp, -ret, "cannot allocate dirty tracking hwpt");
+        return ret;
+    }
+
+    ret = iommufd_cdev_attach_ioas_hwpt(vbasedev, hwpt_id, errp);
+    if (ret) {
+        iommufd_backend_free_id(container->be, hwpt_id);
+        return ret;
+    }
+
+    trace_iommufd_cdev_alloc_dirty_hwpt(container->be->fd, vbasedev->name,
+                                        hwpt_id, container->ioas_id);
+
+    hwpt = g_new0(VFIOIOASHwpt, 1);
+    hwpt->hwpt_id = hwpt_id;
+    QLIST_INIT(&hwpt->device_list);
+    QLIST_INSERT_HEAD(&container->hwpt_list, hwpt, next);
+
+found_hwpt:
+    vbasedev->hwpt = hwpt;
+    QLIST_INSERT_HEAD(&hwpt->device_list, vbasedev, hwpt_next);
+    return 0;
+}
+
+static void iommufd_cdev_put_dirty_hwpt(VFIODevice *vbasedev,
+                                        VFIOIOMMUFDContainer *container)
+{
+    VFIOIOASHwpt *hwpt = vbasedev->hwpt;
+
+    if (!hwpt) {
+        return;
+    }
+
+    QLIST_REMOVE(vbasedev, hwpt_next);
+    vbasedev->hwpt = NULL;
+
+    if (QLIST_EMPTY(&hwpt->device_list)) {
+        QLIST_REMOVE(hwpt, next);
+        iommufd_backend_free_id(container->be, hwpt->hwpt_id);
+        g_free(hwpt);
+    }
+}
+
 static int iommufd_cdev_attach_container(VFIODevice *vbasedev,
                                          VFIOIOMMUFDContainer *container,
                                          Error **errp)
 {
+    Error *err = NULL;
+
+    if (iommufd_cdev_dirty_tracking_capable(vbasedev)) {
+        if (!iommufd_cdev_attach_dirty_hwpt(vbasedev, container, &err)) {
+            return 0;
+        }
+        /* Fall back to the IOAS, without IOMMU dirty tracking */
+        warn_report_err(err);
+    }
+
     return iommufd_cdev_attach_ioas_hwpt(vbasedev, container->ioas_id, errp);
 }
 
@@ -231,6 +361,106 @@ static void iommufd_cdev_detach_container(VFIODevice *vbasedev,
     if (iommufd_cdev_detach_ioas_hwpt(vbasedev, &err)) {
         error_report_err(err);
     }
+    iommufd_cdev_put_dirty_hwpt(vbasedev, container);
+}
+
+/*
+ * The container can rely on IOMMU dirty tracking only when every device sits
+ * on a hwpt tracking dirty IOVAs, be it one of the container's own or the
+ * stage-2 hwpt a nesting vIOMMU attached the device to.
+ */
+static void iommufd_cdev_update_dirty_tracking(VFIOContainerBase *bcontainer)
+{
+    bool supported = !QLIST_EMPTY(&bcontainer->device_list);
+    VFIODevice *vbasedev;
+
+    QLIST_FOREACH(vbasedev, &bcontainer->device_list, container_next) {
+        HIODIOMMUFD *idev = vbasedev->hiod ? HIOD_IOMMUFD(vbasedev->hiod) :
+                                             NULL;
+
+        vbasedev->iommu_dirty_tracking = idev && idev->dirty_hwpt_id;
+        supported &= vbasedev->iommu_dirty_tracking;
+    }
+
+    bcontainer->dirty_pages_supported = supported;
+}
+
+/* Gather the distinct dirty tracking hwpts of the container's devices */
+static GArray *iommufd_cdev_dirty_hwpts(const VFIOContainerBase *bcontainer)
+{
+    GArray *hwpts = g_array_new(false, false, sizeof(uint32_t));
+    VFIODevice *vbasedev;
+    uint32_t hwpt_id;
+    int i;
+
+    QLIST_FOREACH(vbasedev, &bcontainer->device_list, container_next) {
+        hwpt_id = HIOD_IOMMUFD(vbasedev->hiod)->dirty_hwpt_id;
+
+        for (i = 0; i < hwpts->len; i++) {
+            if (g_array_index(hwpts, uint32_t, i) == hwpt_id) {
+                break;
+            }
+        }
+        if (i == hwpts->len) {
+            g_array_append_val(hwpts, hwpt_id);
+        }
+    }
+
+    return hwpts;
+}
+
+static int iommufd_cdev_set_dirty_page_tracking(
+                                     const VFIOContainerBase *bcontainer,
+                                     bool start)
+{
+    const VFIOIOMMUFDContainer *container =
+        container_of(bcontainer, VFIOIOMMUFDContainer, bcontainer);
+    g_autoptr(GArray) hwpts = iommufd_cdev_dirty_hwpts(bcontainer);
+    int i, ret = 0;
+
+    for (i = 0; i < hwpts->len; i++) {
+        ret = iommufd_backend_set_dirty_tracking(container->be,
+                                                 g_array_index(hwpts,
+                                                               uint32_t, i),
+                                                 start);
+        if (ret) {
+            goto err;
+        }
+    }
+
+    return 0;
+
+err:
+    while (--i >= 0) {
+        iommufd_backend_set_dirty_tracking(container->be,
+                                           g_array_index(hwpts, uint32_t, i),
+                                           !start);
+    }
+    return ret;
+}
+
+static int iommufd_cdev_query_dirty_bitmap(const VFIOContainerBase *bcontainer,
+                                           VFIOBitmap *vbmap,
+                                           hwaddr iova, hwaddr size)
+{
+    const VFIOIOMMUFDContainer *container =
+        container_of(bcontainer, VFIOIOMMUFDContainer, bcontainer);
+    g_autoptr(GArray) hwpts = iommufd_cdev_dirty_hwpts(bcontainer);
+    uint64_t page_size = qemu_real_host_page_size();
+    int i, ret;
+
+    for (i = 0; i < hwpts->len; i++) {
+        ret = iommufd_backend_get_dirty_bitmap(container->be,
+                                               g_array_index(hwpts,
+                                                             uint32_t, i),
+                                               iova, size, page_size,
+                                               vbmap->bitmap);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return 0;
 }
 
 static void iommufd_cdev_container_destroy(VFIOIOMMUFDContainer *container)
@@ -367,6 +597,7 @@ static int iommufd_cdev_attach(const char *name, VFIODevice *vbasedev,
     container = g_malloc0(sizeof(*container));
     container->be = vbasedev->iommufd;
     container->ioas_id = ioas_id;
+    QLIST_INIT(&container->hwpt_list);
 
     bcontainer = &container->bcontainer;
     vfio_container_init(bcontainer, space, iommufd_vioc);
@@ -435,8 +666,12 @@ found_container:
     hiod_vfio = HIOD_IOMMUFD_VFIO(object_new(TYPE_HIOD_IOMMUFD_VFIO));
     hiod_iommufd_init(HIOD_IOMMUFD(hiod_vfio), vbasedev->iommufd,
                       vbasedev->devid, container->ioas_id);
+    if (vbasedev->hwpt) {
+        HIOD_IOMMUFD(hiod_vfio)->dirty_hwpt_id = vbasedev->hwpt->hwpt_id;
+    }
     hiod_vfio->vdev = vbasedev;
     vbasedev->hiod = HOST_IOMMU_DEVICE(hiod_vfio);
+    iommufd_cdev_update_dirty_tracking(bcontainer);
 
     trace_iommufd_cdev_device_info(vbasedev->name, devfd, vbasedev->num_irqs,
                                    vbasedev->num_regions, vbasedev->flags);
@@ -466,6 +701,7 @@ static void iommufd_cdev_detach(VFIODevice *vbasedev)
     QLIST_REMOVE(vbasedev, global_next);
     QLIST_REMOVE(vbasedev, container_next);
     vbasedev->bcontainer = NULL;
+    iommufd_cdev_update_dirty_tracking(bcontainer);
 
     if (!vbasedev->ram_block_discard_allowed) {
         iommufd_cdev_ram_block_discard_disable(false);
@@ -640,21 +876,54 @@ static void vfio_iommu_iommufd_class_init(ObjectClass *klass, void *data)
     vioc->attach_device = iommufd_cdev_attach;
     vioc->detach_device = iommufd_cdev_detach;
     vioc->pci_hot_reset = iommufd_cdev_pci_hot_reset;
+    vioc->set_dirty_page_tracking = iommufd_cdev_set_dirty_page_tracking;
+    vioc->query_dirty_bitmap = iommufd_cdev_query_dirty_bitmap;
 };
 
 static int hiod_iommufd_vfio_attach_hwpt(HIODIOMMUFD *idev, uint32_t hwpt_id,
                                          Error **errp)
 {
     VFIODevice *vbasedev = HIOD_IOMMUFD_VFIO(idev)->vdev;
+    VFIOIOASHwpt *hwpt = vbasedev->hwpt;
+    int ret;
+
+    /* Going back to the IOAS means going back to the device's own hwpt */
+    if (hwpt_id == idev->ioas_id && hwpt) {
+        hwpt_id = hwpt->hwpt_id;
+    }
+
+    ret = iommufd_cdev_attach_ioas_hwpt(vbasedev, hwpt_id, errp);
+    if (ret) {
+        return ret;
+    }
+
+    /*
+     * A vIOMMU attaching the device to its stage-2 hwpt sets dirty_hwpt_id
+     * beforehand, and keeps it while stage-1 hwpts nest on top of it. Any
+     * other hwpt of the vIOMMU leaves the device without dirty tracking.
+     */
+    if (hwpt_id == idev->ioas_id || (hwpt && hwpt_id == hwpt->hwpt_id)) {
+        idev->dirty_hwpt_id = hwpt ? hwpt->hwpt_id : 0;
+    } else if (hwpt && idev->dirty_hwpt_id == hwpt->hwpt_id) {
+        idev->dirty_hwpt_id = 0;
+    }
+    iommufd_cdev_update_dirty_tracking(vbasedev->bcontainer);
 
-    return iommufd_cdev_attach_ioas_hwpt(vbasedev, hwpt_id, errp);
+    return 0;
 }
 
 static int hiod_iommufd_vfio_detach_hwpt(HIODIOMMUFD *idev, Error **errp)
 {
     VFIODevice *vbasedev = HIOD_IOMMUFD_VFIO(idev)->vdev;
+    int ret;
 
-    return iommufd_cdev_detach_ioas_hwpt(vbasedev, errp);
+    ret = iommufd_cdev_detach_ioas_hwpt(vbasedev, errp);
+    if (!ret) {
+        idev->dirty_hwpt_id = 0;
+        iommufd_cdev_update_dirty_tracking(vbasedev->bcontainer);
+    }
+
+    return ret;
 }
 
 static void hiod_iommufd_vfio_class_init(ObjectClass *oc, void *data)
@@ -0,0 +1,33 @@
+/*
+ * Compression of VFIO device migration data
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_VFIO_MIGRATION_COMPRESS_H
+#define HW_VFIO_MIGRATION_COMPRESS_H
+
+#include "qapi/qapi-types-migration.h"
+
+typedef struct VFIOMigrationCompressOps {
+    /* Worst case compressed size of @len bytes of data */
+    size_t (*compress_bound)(size_t len);
+    /*
+     * Compress @in_len bytes from @in into @out, which can hold @out_len
+     * bytes. Returns the compressed size, or 0 on failure.
+     */
+    size_t (*compress)(const uint8_t *in, size_t in_len, uint8_t *out,
+                       size_t out_len);
+    /*
+     * Decompress @in_len bytes from @in into @out, which must be filled with
+     * exactly @out_len bytes. Returns 0 on success, -1 on failure.
+     */
+    int (*decompress)(const uint8_t *in, size_t in_len, uint8_t *out,
+                      size_t out_len, Error **errp);
+} VFIOMigrationCompressOps;
+
+void vfio_migration_register_compress_ops(MultiFDCompression method,
+                                          const VFIOMigrationCompressOps *ops);
+
+#endif /* HW_VFIO_MIGRATION_COMPRESS_H */
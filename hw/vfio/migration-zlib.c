@@ -0,0 +1,63 @@
+/*
+ * zlib compression of VFIO device migration data
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#include "qemu/module.h"
+#include "qapi/error.h"
+#include "migration-compress.h"
+
+static size_t vfio_zlib_compress_bound(size_t len)
+{
+    return compressBound(len);
+}
+
+static size_t vfio_zlib_compress(const uint8_t *in, size_t in_len,
+                                 uint8_t *out, size_t out_len)
+{
+    uLongf len = out_len;
+
+    if (compress2(out, &len, in, in_len, Z_BEST_SPEED) != Z_OK) {
+        return 0;
+    }
+
+    return len;
+}
+
+static int vfio_zlib_decompress(const uint8_t *in, size_t in_len,
+                                uint8_t *out, size_t out_len, Error **errp)
+{
+    uLongf len = out_len;
+    int ret;
+
+    ret = uncompress(out, &len, in, in_len);
+    if (ret != Z_OK) {
+        error_setg(errp, "zlib uncompress failed with error %d", ret);
+        return -1;
+    }
+    if (len != out_len) {
+        error_setg(errp, "zlib uncompressed %lu bytes, expected %zu",
+                   len, out_len);
+        return -1;
+    }
+
+    return 0;
+}
+
+static const VFIOMigrationCompressOps vfio_zlib_ops = {
+    .compress_bound = vfio_zlib_compress_bound,
+    .compress = vfio_zlib_compress,
+    .decompress = vfio_zlib_decompress,
+};
+
+static void vfio_zlib_register(void)
+{
+    vfio_migration_register_compress_ops(MULTIFD_COMPRESSION_ZLIB,
+                                         &vfio_zlib_ops);
+}
+
+migration_init(vfio_zlib_register);
@@ -0,0 +1,66 @@
+/*
+ * zstd compression of VFIO device migration data
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zstd.h>
+#include "qemu/module.h"
+#include "qapi/error.h"
+#include "migration-compress.h"
+
+#define VFIO_ZSTD_LEVEL 1
+
+static size_t vfio_zstd_compress_bound(size_t len)
+{
+    return ZSTD_compressBound(len);
+}
+
+static size_t vfio_zstd_compress(const uint8_t *in, size_t in_len,
+                                 uint8_t *out, size_t out_len)
+{
+    size_t ret;
+
+    ret = ZSTD_compress(out, out_len, in, in_len, VFIO_ZSTD_LEVEL);
+    if (ZSTD_isError(ret)) {
+        return 0;
+    }
+
+    return ret;
+}
+
+static int vfio_zstd_decompress(const uint8_t *in, size_t in_len,
+                                uint8_t *out, size_t out_len, Error **errp)
+{
+    size_t ret;
+
+    ret = ZSTD_decompress(out, out_len, in, in_len);
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "zstd decompress failed with error %s",
+                   ZSTD_getErrorName(ret));
+        return -1;
+    }
+    if (ret != out_len) {
+        error_setg(errp, "zstd decompressed %zu bytes, expected %zu",
+                   ret, out_len);
+        return -1;
+    }
+
+    return 0;
+}
+
+static const VFIOMigrationCompressOps vfio_zstd_ops = {
+    .compress_bound = vfio_zstd_compress_bound,
+    .compress = vfio_zstd_compress,
+    .decompress = vfio_zstd_decompress,
+};
+
+static void vfio_zstd_register(void)
+{
+    vfio_migration_register_compress_ops(MULTIFD_COMPRESSION_ZSTD,
+                                         &vfio_zstd_ops);
+}
+
+migration_init(vfio_zstd_register);
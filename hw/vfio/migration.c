@@ -12,11 +12,15 @@
 #include "qemu/cutils.h"
 #include "qemu/units.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
+#include "qemu/stats64.h"
+#include "qemu/thread.h"
 #include <linux/vfio.h>
 #include <sys/ioctl.h>
 
 #include "sysemu/runstate.h"
 #include "hw/vfio/vfio-common.h"
+#include "migration/cpr.h"
 #include "migration/misc.h"
 #include "migration/savevm.h"
 #include "migration/vmstate.h"
@@ -27,6 +31,7 @@
 #include "exec/ramlist.h"
 #include "exec/ram_addr.h"
 #include "pci.h"
+#include "migration-compress.h"
 #include "trace.h"
 #include "hw/hw.h"
 
@@ -46,6 +51,9 @@
 #define VFIO_MIG_FLAG_DEV_SETUP_STATE   (0xffffffffef100003ULL)
 #define VFIO_MIG_FLAG_DEV_DATA_STATE    (0xffffffffef100004ULL)
 #define VFIO_MIG_FLAG_DEV_INIT_DATA_SENT (0xffffffffef100005ULL)
+#define VFIO_MIG_FLAG_DEV_DATA_STATE_MULTIFD (0xffffffffef100006ULL)
+#define VFIO_MIG_FLAG_DEV_DATA_STATE_ZERO (0xffffffffef100007ULL)
+#define VFIO_MIG_FLAG_DEV_DATA_STATE_COMPRESSED (0xffffffffef100008ULL)
 
 /*
  * This is an arbitrary size based on migration of mlx5 devices, where typically
@@ -54,7 +62,103 @@
  */
 #define VFIO_MIG_DEFAULT_DATA_BUFFER_SIZE (1 * MiB)
 
-static int64_t bytes_transferred;
+/*
+ * With zero elision, device data is scanned in blocks of this size and runs
+ * of zeroed blocks are sent as a _DEV_DATA_STATE_ZERO record carrying only
+ * their length.
+ */
+#define VFIO_MIG_ZERO_BLOCK_SIZE (64 * KiB)
+
+/*
+ * Stop-copy device state transferred over multifd channels is split into
+ * numbered buffers, as buffers sent over different channels can arrive out
+ * of order on the destination. The last buffer is empty and flagged with
+ * VFIO_DEVICE_STATE_PACKET_FLAG_END.
+ */
+#define VFIO_DEVICE_STATE_PACKET_VERSION 0
+#define VFIO_DEVICE_STATE_PACKET_FLAG_END (1 << 0)
+
+typedef struct VFIODeviceStatePacket {
+    uint32_t version;
+    uint32_t idx;
+    uint32_t flags;
+    uint8_t data[];
+} QEMU_PACKED VFIODeviceStatePacket;
+
+typedef struct VFIOStateBuffer {
+    bool is_present;
+    bool is_end;
+    char *data;
+    size_t len;
+} VFIOStateBuffer;
+
+struct VFIOMultifd {
+    QemuThread load_thread;
+    /* Protects all the fields below */
+    QemuMutex load_bufs_mutex;
+    /* Signalled when a new buffer arrives or the load thread should exit */
+    QemuCond load_bufs_cond;
+    /* Signalled when the load thread is done */
+    QemuCond load_done_cond;
+    GArray *load_bufs;
+    uint32_t load_buf_idx;
+    /* All main stream data was loaded, multifd buffers may be written */
+    bool main_stream_done;
+    bool load_exiting;
+    bool load_done;
+    int load_ret;
+};
+
+/*
+ * How long the precopy reader waits before polling the device again once
+ * it runs out of precopy data.
+ */
+#define VFIO_PRECOPY_BUFFER_POLL_MS 100
+
+typedef struct VFIOPrecopyChunk {
+    char *data;
+    size_t len;
+    /* Number of bytes of @data that are part of the initial precopy data */
+    size_t init_len;
+} VFIOPrecopyChunk;
+
+/*
+ * Bounded queue of precopy data chunks decoupling the data_fd access from
+ * the migration thread. On the source a reader thread fills it from the
+ * device while RAM is being iterated, on the destination a writer thread
+ * drains it into the device while RAM is being loaded.
+ */
+struct VFIOPrecopyBuffer {
+    QemuThread thread;
+    bool thread_running;
+    /* Protects all the fields below */
+    QemuMutex mutex;
+    /* Signalled whenever chunks are queued or dequeued */
+    QemuCond cond;
+    GQueue chunks;
+    size_t bytes;
+    size_t capacity;
+    /* Destination: the writer thread is writing a dequeued chunk */
+    bool busy;
+    bool exiting;
+    int ret;
+    /* Source: precopy sizes left in the device after the last read */
+    uint64_t device_init_size;
+    uint64_t device_dirty_size;
+    /* Source: initial precopy bytes among the queued ones */
+    uint64_t queued_init_size;
+};
+
+static Stat64 bytes_transferred;
+
+static const VFIOMigrationCompressOps *compress_ops[MULTIFD_COMPRESSION__MAX];
+
+void vfio_migration_register_compress_ops(MultiFDCompression method,
+                                          const VFIOMigrationCompressOps *ops)
+{
+    assert(0 < method && method < MULTIFD_COMPRESSION__MAX);
+    compress_ops[method] = ops;
+}
 
 static const char *mig_state_to_str(enum vfio_device_mig_state state)
 {
@@ -261,12 +365,21 @@ static int vfio_query_stop_copy_size(VFIODevice *vbasedev,
     return 0;
 }
 
+static void vfio_precopy_buffer_get_sizes(VFIOMigration *migration);
+
 static int vfio_query_precopy_size(VFIOMigration *migration)
 {
     struct vfio_precopy_info precopy = {
         .argsz = sizeof(precopy),
     };
 
+    if (migration->precopy_buffer &&
+        migration->precopy_buffer->thread_running) {
+        /* data_fd belongs to the precopy reader thread */
+        vfio_precopy_buffer_get_sizes(migration);
+        return 0;
+    }
+
     migration->precopy_init_size = 0;
     migration->precopy_dirty_size = 0;
 
@@ -280,6 +393,71 @@ static int vfio_query_precopy_size(VFIOMigration *migration)
     return 0;
 }
 
+/* Sends a run of device data, compressed if that makes it smaller */
+static void vfio_put_data_block(QEMUFile *f, VFIOMigration *migration,
+                                const uint8_t *buf, size_t len)
+{
+    const VFIOMigrationCompressOps *ops = compress_ops[migration->compression];
+    size_t compressed_len = 0;
+
+    if (ops) {
+        compressed_len = ops->compress(buf, len, migration->compress_buffer,
+                                       migration->compress_buffer_size);
+    }
+
+    if (compressed_len && compressed_len < len) {
+        qemu_put_be64(f, VFIO_MIG_FLAG_DEV_DATA_STATE_COMPRESSED);
+        qemu_put_be32(f, migration->compression);
+        qemu_put_be64(f, len);
+        qemu_put_be64(f, compressed_len);
+        qemu_put_buffer(f, migration->compress_buffer, compressed_len);
+        stat64_add(&bytes_transferred, compressed_len);
+        trace_vfio_save_block_compressed(migration->vbasedev->name, len,
+                                         compressed_len);
+        return;
+    }
+
+    qemu_put_be64(f, VFIO_MIG_FLAG_DEV_DATA_STATE);
+    qemu_put_be64(f, len);
+    qemu_put_buffer(f, buf, len);
+    stat64_add(&bytes_transferred, len);
+}
+
+/* Sends device data, eliding runs of zeroes if enabled */
+static void vfio_put_data(QEMUFile *f, VFIOMigration *migration,
+                          const uint8_t *buf, size_t len)
+{
+    size_t offset = 0;
+
+    if (!migration->vbasedev->migration_zero_elision) {
+        vfio_put_data_block(f, migration, buf, len);
+        return;
+    }
+
+    while (offset < len) {
+        size_t run = MIN(VFIO_MIG_ZERO_BLOCK_SIZE, len - offset);
+        bool zero = buffer_is_zero(buf + offset, run);
+
+        while (offset + run < len) {
+            size_t next = MIN(VFIO_MIG_ZERO_BLOCK_SIZE, len - offset - run);
+
+            if (buffer_is_zero(buf + offset + run, next) != zero) {
+                break;
+            }
+            run += next;
+        }
+
+        if (zero) {
+            qemu_put_be64(f, VFIO_MIG_FLAG_DEV_DATA_STATE_ZERO);
+            qemu_put_be64(f, run);
+            trace_vfio_save_block_zero(migration->vbasedev->name, run);
+        } else {
+            vfio_put_data_block(f, migration, buf + offset, run);
+        }
+        offset += run;
+    }
+}
+
 /* Returns the size of saved data on success and -errno on error */
 static ssize_t vfio_save_block(QEMUFile *f, VFIOMigration *migration)
 {
@@ -302,10 +480,7 @@ static ssize_t vfio_save_block(QEMUFile *f, VFIOMigration *migration)
         return 0;
     }
 
-    qemu_put_be64(f, VFIO_MIG_FLAG_DEV_DATA_STATE);
-    qemu_put_be64(f, data_size);
-    qemu_put_buffer(f, migration->data_buffer, data_size);
-    bytes_transferred += data_size;
+    vfio_put_data(f, migration, migration->data_buffer, data_size);
 
     trace_vfio_save_block(migration->vbasedev->name, data_size);
 
@@ -344,6 +519,522 @@ static bool vfio_precopy_supported(VFIODevice *vbasedev)
     return migration->mig_flags & VFIO_MIGRATION_PRE_COPY;
 }
 
+static void vfio_state_buffer_clear(gpointer data)
+{
+    VFIOStateBuffer *lb = data;
+
+    g_clear_pointer(&lb->data, g_free);
+    lb->is_present = false;
+}
+
+static int vfio_write_state_buffer(VFIODevice *vbasedev, char *buf,
+                                   size_t len)
+{
+    VFIOMigration *migration = vbasedev->migration;
+
+    while (len) {
+        ssize_t wr = write(migration->data_fd, buf, len);
+
+        if (wr < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -errno;
+        }
+
+        buf += wr;
+        len -= wr;
+    }
+
+    return 0;
+}
+
+static bool vfio_load_thread_can_write(VFIOMultifd *multifd)
+{
+    return multifd->main_stream_done &&
+           multifd->load_buf_idx < multifd->load_bufs->len &&
+           g_array_index(multifd->load_bufs, VFIOStateBuffer,
+                         multifd->load_buf_idx).is_present;
+}
+
+/*
+ * Writes the multifd state buffers to the device in order, as they
+ * arrive from the multifd receive threads.
+ */
+static void *vfio_load_thread(void *opaque)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOMultifd *multifd = vbasedev->migration->multifd;
+    int ret = 0;
+
+    qemu_mutex_lock(&multifd->load_bufs_mutex);
+    while (true) {
+        VFIOStateBuffer *lb;
+        uint32_t idx;
+        char *buf;
+        size_t len;
+        bool is_end;
+
+        while (!multifd->load_exiting && !vfio_load_thread_can_write(multifd)) {
+            qemu_cond_wait(&multifd->load_bufs_cond,
+                           &multifd->load_bufs_mutex);
+        }
+
+        if (multifd->load_exiting) {
+            ret = -ECANCELED;
+            break;
+        }
+
+        idx = multifd->load_buf_idx++;
+        lb = &g_array_index(multifd->load_bufs, VFIOStateBuffer, idx);
+        buf = g_steal_pointer(&lb->data);
+        len = lb->len;
+        is_end = lb->is_end;
+        lb->is_present = false;
+        qemu_mutex_unlock(&multifd->load_bufs_mutex);
+
+        ret = vfio_write_state_buffer(vbasedev, buf, len);
+        trace_vfio_load_state_device_buffer(vbasedev->name, idx, len, ret);
+        g_free(buf);
+
+        qemu_mutex_lock(&multifd->load_bufs_mutex);
+        if (ret) {
+            error_report("%s: Failed writing state buffer %u, err: %s",
+                         vbasedev->name, idx, strerror(-ret));
+            break;
+        }
+
+        if (is_end) {
+            break;
+        }
+    }
+
+    multifd->load_ret = ret;
+    multifd->load_done = true;
+    qemu_cond_broadcast(&multifd->load_done_cond);
+    qemu_mutex_unlock(&multifd->load_bufs_mutex);
+
+    return NULL;
+}
+
+static int vfio_multifd_load_setup(VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    VFIOMultifd *multifd;
+
+    if (!multifd_device_state_supported()) {
+        error_report("%s: Multifd device transfer requires multifd "
+                     "migration without mapped-ram", vbasedev->name);
+        return -EINVAL;
+    }
+
+    multifd = g_new0(VFIOMultifd, 1);
+    multifd->load_bufs = g_array_new(FALSE, TRUE, sizeof(VFIOStateBuffer));
+    g_array_set_clear_func(multifd->load_bufs, vfio_state_buffer_clear);
+    qemu_mutex_init(&multifd->load_bufs_mutex);
+    qemu_cond_init(&multifd->load_bufs_cond);
+    qemu_cond_init(&multifd->load_done_cond);
+    migration->multifd = multifd;
+
+    qemu_thread_create(&multifd->load_thread, "vfio-load", vfio_load_thread,
+                       vbasedev, QEMU_THREAD_JOINABLE);
+
+    return 0;
+}
+
+static void vfio_multifd_load_cleanup(VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    VFIOMultifd *multifd = migration->multifd;
+
+    if (!multifd) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&multifd->load_bufs_mutex) {
+        multifd->load_exiting = true;
+        qemu_cond_signal(&multifd->load_bufs_cond);
+    }
+    qemu_thread_join(&multifd->load_thread);
+
+    g_array_unref(multifd->load_bufs);
+    qemu_cond_destroy(&multifd->load_done_cond);
+    qemu_cond_destroy(&multifd->load_bufs_cond);
+    qemu_mutex_destroy(&multifd->load_bufs_mutex);
+    g_free(multifd);
+    migration->multifd = NULL;
+}
+
+static void vfio_multifd_main_stream_done(VFIODevice *vbasedev)
+{
+    VFIOMultifd *multifd = vbasedev->migration->multifd;
+
+    QEMU_LOCK_GUARD(&multifd->load_bufs_mutex);
+    multifd->main_stream_done = true;
+    qemu_cond_signal(&multifd->load_bufs_cond);
+}
+
+/*
+ * Waits until all the multifd state buffers were written to the device.
+ * Returns immediately if the source didn't use multifd transfer.
+ */
+static int vfio_multifd_load_wait(VFIODevice *vbasedev)
+{
+    VFIOMultifd *multifd = vbasedev->migration->multifd;
+
+    QEMU_LOCK_GUARD(&multifd->load_bufs_mutex);
+    if (!multifd->main_stream_done) {
+        return 0;
+    }
+
+    while (!multifd->load_done) {
+        qemu_cond_wait(&multifd->load_done_cond, &multifd->load_bufs_mutex);
+    }
+
+    return multifd->load_ret;
+}
+
+static void vfio_precopy_chunk_free(gpointer data)
+{
+    VFIOPrecopyChunk *chunk = data;
+
+    g_free(chunk->data);
+    g_free(chunk);
+}
+
+static VFIOPrecopyBuffer *vfio_precopy_buffer_new(size_t capacity)
+{
+    VFIOPrecopyBuffer *pb = g_new0(VFIOPrecopyBuffer, 1);
+
+    qemu_mutex_init(&pb->mutex);
+    qemu_cond_init(&pb->cond);
+    g_queue_init(&pb->chunks);
+    pb->capacity = capacity;
+
+    return pb;
+}
+
+static void vfio_precopy_buffer_stop(VFIODevice *vbasedev)
+{
+    VFIOPrecopyBuffer *pb = vbasedev->migration->precopy_buffer;
+
+    if (!pb || !pb->thread_running) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&pb->mutex) {
+        pb->exiting = true;
+        qemu_cond_broadcast(&pb->cond);
+    }
+    qemu_thread_join(&pb->thread);
+    pb->thread_running = false;
+
+    trace_vfio_precopy_buffer_stop(vbasedev->name, pb->bytes, pb->ret);
+}
+
+static void vfio_precopy_buffer_free(VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    VFIOPrecopyBuffer *pb = migration->precopy_buffer;
+
+    if (!pb) {
+        return;
+    }
+
+    vfio_precopy_buffer_stop(vbasedev);
+    g_queue_clear_full(&pb->chunks, vfio_precopy_chunk_free);
+    qemu_cond_destroy(&pb->cond);
+    qemu_mutex_destroy(&pb->mutex);
+    g_free(pb);
+    migration->precopy_buffer = NULL;
+}
+
+/*
+ * Keeps reading precopy data from the device into the precopy buffer until
+ * the buffer is full, so that the migration thread only has to copy data
+ * that was already read to the migration stream.
+ */
+static void *vfio_precopy_read_thread(void *opaque)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
+    VFIOPrecopyBuffer *pb = migration->precopy_buffer;
+    int ret = 0;
+
+    qemu_mutex_lock(&pb->mutex);
+    while (!pb->exiting) {
+        struct vfio_precopy_info precopy = {
+            .argsz = sizeof(precopy),
+        };
+        VFIOPrecopyChunk *chunk;
+        ssize_t len = 0;
+        char *buf = NULL;
+
+        if (pb->bytes + migration->data_buffer_size > pb->capacity) {
+            qemu_cond_wait(&pb->cond, &pb->mutex);
+            continue;
+        }
+        qemu_mutex_unlock(&pb->mutex);
+
+        if (ioctl(migration->data_fd, VFIO_MIG_GET_PRECOPY_INFO, &precopy)) {
+            ret = -errno;
+            qemu_mutex_lock(&pb->mutex);
+            break;
+        }
+
+        if (precopy.initial_bytes || precopy.dirty_bytes) {
+            buf = g_malloc(migration->data_buffer_size);
+            len = read(migration->data_fd, buf, migration->data_buffer_size);
+            if (len < 0) {
+                /* ENOMSG: pre-copy emptied all the device state for now */
+                if (errno != ENOMSG) {
+                    ret = -errno;
+                    g_free(buf);
+                    qemu_mutex_lock(&pb->mutex);
+                    break;
+                }
+                precopy.initial_bytes = 0;
+                precopy.dirty_bytes = 0;
+                len = 0;
+            }
+        }
+
+        qemu_mutex_lock(&pb->mutex);
+        if (!len) {
+            g_free(buf);
+            pb->device_init_size = precopy.initial_bytes;
+            pb->device_dirty_size = precopy.dirty_bytes;
+            qemu_cond_timedwait(&pb->cond, &pb->mutex,
+                                VFIO_PRECOPY_BUFFER_POLL_MS);
+            continue;
+        }
+
+        chunk = g_new(VFIOPrecopyChunk, 1);
+        chunk->data = buf;
+        chunk->len = len;
+        chunk->init_len = MIN(precopy.initial_bytes, len);
+        g_queue_push_tail(&pb->chunks, chunk);
+        pb->bytes += len;
+        pb->queued_init_size += chunk->init_len;
+        pb->device_init_size = precopy.initial_bytes - chunk->init_len;
+        pb->device_dirty_size = precopy.dirty_bytes -
+                                MIN(precopy.dirty_bytes, len - chunk->init_len);
+        qemu_cond_broadcast(&pb->cond);
+
+        trace_vfio_precopy_buffer_read(vbasedev->name, len, pb->bytes);
+    }
+
+    if (ret) {
+        error_report("%s: Failed to read precopy data, err: %s",
+                     vbasedev->name, strerror(-ret));
+        pb->ret = ret;
+    }
+    qemu_mutex_unlock(&pb->mutex);
+
+    return NULL;
+}
+
+static void vfio_precopy_buffer_get_sizes(VFIOMigration *migration)
+{
+    VFIOPrecopyBuffer *pb = migration->precopy_buffer;
+
+    QEMU_LOCK_GUARD(&pb->mutex);
+    migration->precopy_init_size = pb->device_init_size +
+                                   pb->queued_init_size;
+    migration->precopy_dirty_size = pb->device_dirty_size + pb->bytes -
+                                    pb->queued_init_size;
+}
+
+static int vfio_precopy_buffer_save_setup(VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    VFIOPrecopyBuffer *pb;
+
+    pb = vfio_precopy_buffer_new(MAX(vbasedev->migration_precopy_buffer_size,
+                                     migration->data_buffer_size));
+    pb->device_init_size = migration->precopy_init_size;
+    pb->device_dirty_size = migration->precopy_dirty_size;
+    migration->precopy_buffer = pb;
+
+    qemu_thread_create(&pb->thread, "vfio-precopy", vfio_precopy_read_thread,
+                       vbasedev, QEMU_THREAD_JOINABLE);
+    pb->thread_running = true;
+
+    trace_vfio_precopy_buffer_setup(vbasedev->name, pb->capacity);
+
+    return 0;
+}
+
+/*
+ * Sends one chunk read ahead by the precopy reader thread. Returns the size
+ * of the sent data, 0 if there was none queued and -errno on error.
+ */
+static ssize_t vfio_precopy_buffer_save_block(QEMUFile *f,
+                                              VFIOMigration *migration)
+{
+    VFIOPrecopyBuffer *pb = migration->precopy_buffer;
+    VFIOPrecopyChunk *chunk;
+    ssize_t data_size;
+
+    WITH_QEMU_LOCK_GUARD(&pb->mutex) {
+        if (pb->ret) {
+            return pb->ret;
+        }
+
+        chunk = g_queue_pop_head(&pb->chunks);
+        if (chunk) {
+            pb->bytes -= chunk->len;
+            pb->queued_init_size -= chunk->init_len;
+            qemu_cond_broadcast(&pb->cond);
+        }
+    }
+    vfio_precopy_buffer_get_sizes(migration);
+
+    if (!chunk) {
+        return 0;
+    }
+
+    vfio_put_data(f, migration, (uint8_t *)chunk->data, chunk->len);
+    data_size = chunk->len;
+    vfio_precopy_chunk_free(chunk);
+
+    trace_vfio_save_block(migration->vbasedev->name, data_size);
+
+    return qemu_file_get_error(f) ?: data_size;
+}
+
+/* Writes the queued precopy chunks to the device in order */
+static void *vfio_precopy_write_thread(void *opaque)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOPrecopyBuffer *pb = vbasedev->migration->precopy_buffer;
+
+    qemu_mutex_lock(&pb->mutex);
+    while (true) {
+        VFIOPrecopyChunk *chunk;
+        int ret;
+
+        while (!pb->exiting && g_queue_is_empty(&pb->chunks)) {
+            qemu_cond_wait(&pb->cond, &pb->mutex);
+        }
+        if (pb->exiting) {
+            break;
+        }
+
+        chunk = g_queue_pop_head(&pb->chunks);
+        pb->busy = true;
+        qemu_mutex_unlock(&pb->mutex);
+
+        ret = vfio_write_state_buffer(vbasedev, chunk->data, chunk->len);
+        trace_vfio_load_state_device_data(vbasedev->name, chunk->len, ret);
+
+        qemu_mutex_lock(&pb->mutex);
+        pb->busy = false;
+        pb->bytes -= chunk->len;
+        vfio_precopy_chunk_free(chunk);
+        qemu_cond_broadcast(&pb->cond);
+
+        if (ret) {
+            error_report("%s: Failed writing precopy data, err: %s",
+                         vbasedev->name, strerror(-ret));
+            pb->ret = ret;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&pb->mutex);
+
+    return NULL;
+}
+
+static void vfio_precopy_buffer_load_setup(VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    VFIOPrecopyBuffer *pb;
+
+    pb = vfio_precopy_buffer_new(vbasedev->migration_precopy_buffer_size);
+    migration->precopy_buffer = pb;
+
+    qemu_thread_create(&pb->thread, "vfio-precopy", vfio_precopy_write_thread,
+                       vbasedev, QEMU_THREAD_JOINABLE);
+    pb->thread_running = true;
+
+    trace_vfio_precopy_buffer_setup(vbasedev->name, pb->capacity);
+}
+
+/*
+ * Queues a chunk of device data for the writer thread, so loading of the
+ * rest of the migration stream can go on while the device consumes it.
+ * Blocks while the buffer is full. Takes ownership of @data.
+ */
+static int vfio_precopy_buffer_queue(VFIODevice *vbasedev, char *data,
+                                     size_t data_size)
+{
+    VFIOPrecopyBuffer *pb = vbasedev->migration->precopy_buffer;
+    VFIOPrecopyChunk *chunk;
+
+    QEMU_LOCK_GUARD(&pb->mutex);
+    while (!pb->ret && pb->bytes && pb->bytes + data_size > pb->capacity) {
+        qemu_cond_wait(&pb->cond, &pb->mutex);
+    }
+    if (pb->ret) {
+        g_free(data);
+        return pb->ret;
+    }
+
+    chunk = g_new(VFIOPrecopyChunk, 1);
+    chunk->data = data;
+    chunk->len = data_size;
+    chunk->init_len = 0;
+    g_queue_push_tail(&pb->chunks, chunk);
+    pb->bytes += data_size;
+    qemu_cond_broadcast(&pb->cond);
+
+    return 0;
+}
+
+static int vfio_precopy_buffer_load(QEMUFile *f, VFIODevice *vbasedev,
+                                    uint64_t data_size)
+{
+    char *data;
+    int ret;
+
+    data = g_try_malloc(data_size);
+    if (!data) {
+        return -ENOMEM;
+    }
+
+    qemu_get_buffer(f, (uint8_t *)data, data_size);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        g_free(data);
+        return ret;
+    }
+
+    return vfio_precopy_buffer_queue(vbasedev, data, data_size);
+}
+
+/*
+ * Waits until all the queued chunks were written to the device. Needed
+ * before anything else that depends on the device having consumed the
+ * precopy data.
+ */
+static int vfio_precopy_buffer_drain(VFIODevice *vbasedev)
+{
+    VFIOPrecopyBuffer *pb = vbasedev->migration->precopy_buffer;
+
+    if (!pb) {
+        return 0;
+    }
+
+    QEMU_LOCK_GUARD(&pb->mutex);
+    while (!pb->ret && (pb->busy || !g_queue_is_empty(&pb->chunks))) {
+        qemu_cond_wait(&pb->cond, &pb->mutex);
+    }
+
+    return pb->ret;
+}
+
 /* ---------------------------------------------------------------------- */
 
 static int vfio_save_prepare(void *opaque, Error **errp)
@@ -382,6 +1073,15 @@ static int vfio_save_setup(QEMUFile *f, void *opaque)
     VFIOMigration *migration = vbasedev->migration;
     uint64_t stop_copy_size = VFIO_MIG_DEFAULT_DATA_BUFFER_SIZE;
 
+    /* Snapshots don't use multifd, fall back to the main stream for them */
+    migration->multifd_transfer = vbasedev->migration_multifd_transfer &&
+                                  !runstate_check(RUN_STATE_SAVE_VM);
+    if (migration->multifd_transfer && !multifd_device_state_supported()) {
+        error_report("%s: Multifd device transfer requires multifd "
+                     "migration without mapped-ram", vbasedev->name);
+        return -EINVAL;
+    }
+
     qemu_put_be64(f, VFIO_MIG_FLAG_DEV_SETUP_STATE);
 
     vfio_query_stop_copy_size(vbasedev, &stop_copy_size);
@@ -394,6 +1094,29 @@ static int vfio_save_setup(QEMUFile *f, void *opaque)
         return -ENOMEM;
     }
 
+    migration->compression = vbasedev->migration_compression;
+    if (migration->compression != MULTIFD_COMPRESSION_NONE) {
+        const VFIOMigrationCompressOps *ops =
+            compress_ops[migration->compression];
+
+        if (!ops) {
+            error_report("%s: Device data compression method %s is not "
+                         "supported", vbasedev->name,
+                         MultiFDCompression_str(migration->compression));
+            return -EINVAL;
+        }
+
+        migration->compress_buffer_size =
+            ops->compress_bound(migration->data_buffer_size);
+        migration->compress_buffer =
+            g_try_malloc(migration->compress_buffer_size);
+        if (!migration->compress_buffer) {
+            error_report("%s: Failed to allocate compression buffer",
+                         vbasedev->name);
+            return -ENOMEM;
+        }
+    }
+
     if (vfio_precopy_supported(vbasedev)) {
         int ret;
 
@@ -407,6 +1130,10 @@ static int vfio_save_setup(QEMUFile *f, void *opaque)
 
             vfio_query_precopy_size(migration);
 
+            if (vbasedev->migration_precopy_buffer_size) {
+                vfio_precopy_buffer_save_setup(vbasedev);
+            }
+
             break;
         case VFIO_DEVICE_STATE_STOP:
             /* vfio_save_complete_precopy() will go to STOP_COPY */
@@ -436,8 +1163,12 @@ static void vfio_save_cleanup(void *opaque)
         vfio_migration_set_state_or_reset(vbasedev, VFIO_DEVICE_STATE_STOP);
     }
 
+    vfio_precopy_buffer_free(vbasedev);
     g_free(migration->data_buffer);
     migration->data_buffer = NULL;
+    g_free(migration->compress_buffer);
+    migration->compress_buffer = NULL;
+    migration->compression = MULTIFD_COMPRESSION_NONE;
     migration->precopy_init_size = 0;
     migration->precopy_dirty_size = 0;
     migration->initial_data_sent = false;
@@ -496,6 +1227,12 @@ static void vfio_state_pending_exact(void *opaque, uint64_t *must_precopy,
                                    migration->precopy_dirty_size);
 }
 
+/* cpr-exec hands the running device over to the new QEMU as is */
+static bool vfio_is_active(void *opaque)
+{
+    return !cpr_is_exec();
+}
+
 static bool vfio_is_active_iterate(void *opaque)
 {
     VFIODevice *vbasedev = opaque;
@@ -515,12 +1252,20 @@ static int vfio_save_iterate(QEMUFile *f, void *opaque)
     VFIOMigration *migration = vbasedev->migration;
     ssize_t data_size;
 
-    data_size = vfio_save_block(f, migration);
-    if (data_size < 0) {
-        return data_size;
-    }
+    if (migration->precopy_buffer) {
+        /* Also refreshes the estimated pending data */
+        data_size = vfio_precopy_buffer_save_block(f, migration);
+        if (data_size < 0) {
+            return data_size;
+        }
+    } else {
+        data_size = vfio_save_block(f, migration);
+        if (data_size < 0) {
+            return data_size;
+        }
 
-    vfio_update_estimated_pending_data(migration, data_size);
+        vfio_update_estimated_pending_data(migration, data_size);
+    }
 
     if (migrate_switchover_ack() && !migration->precopy_init_size &&
         !migration->initial_data_sent) {
@@ -542,6 +1287,30 @@ static int vfio_save_complete_precopy(QEMUFile *f, void *opaque)
     ssize_t data_size;
     int ret;
 
+    /* Precopy data that was read ahead must precede the stop-copy data */
+    if (vbasedev->migration->precopy_buffer) {
+        vfio_precopy_buffer_stop(vbasedev);
+        do {
+            data_size = vfio_precopy_buffer_save_block(f,
+                                                       vbasedev->migration);
+            if (data_size < 0) {
+                return data_size;
+            }
+        } while (data_size);
+    }
+
+    if (vbasedev->migration->multifd_transfer) {
+        /*
+         * The data is sent by vfio_save_complete_precopy_thread(), only
+         * mark the end of the main stream data for the destination.
+         */
+        qemu_put_be64(f, VFIO_MIG_FLAG_DEV_DATA_STATE_MULTIFD);
+        qemu_put_be64(f, VFIO_MIG_FLAG_END_OF_STATE);
+        trace_vfio_save_complete_precopy(vbasedev->name, 0);
+
+        return qemu_file_get_error(f);
+    }
+
     /* We reach here with device state STOP or STOP_COPY only */
     ret = vfio_migration_set_state(vbasedev, VFIO_DEVICE_STATE_STOP_COPY,
                                    VFIO_DEVICE_STATE_STOP);
@@ -567,6 +1336,69 @@ static int vfio_save_complete_precopy(QEMUFile *f, void *opaque)
     return ret;
 }
 
+static int vfio_save_complete_precopy_thread(char *idstr,
+                                             uint32_t instance_id,
+                                             void *opaque, Error **errp)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
+    g_autofree VFIODeviceStatePacket *packet = NULL;
+    uint32_t idx;
+    int ret;
+
+    if (!migration->multifd_transfer) {
+        return 0;
+    }
+
+    /* We reach here with device state STOP or STOP_COPY only */
+    ret = vfio_migration_set_state(vbasedev, VFIO_DEVICE_STATE_STOP_COPY,
+                                   VFIO_DEVICE_STATE_STOP);
+    if (ret) {
+        error_setg_errno(errp, -ret, "%s: Failed to set STOP_COPY state",
+                         vbasedev->name);
+        return ret;
+    }
+
+    packet = g_malloc0(sizeof(*packet) + migration->data_buffer_size);
+    packet->version = cpu_to_be32(VFIO_DEVICE_STATE_PACKET_VERSION);
+
+    for (idx = 0; ; idx++) {
+        ssize_t data_size;
+
+        data_size = read(migration->data_fd, packet->data,
+                         migration->data_buffer_size);
+        if (data_size < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "%s: Failed reading state buffer %u",
+                             vbasedev->name, idx);
+            return ret;
+        }
+
+        packet->idx = cpu_to_be32(idx);
+        packet->flags = cpu_to_be32(data_size ? 0 :
+                                    VFIO_DEVICE_STATE_PACKET_FLAG_END);
+
+        if (!multifd_queue_device_state(idstr, instance_id, (char *)packet,
+                                        sizeof(*packet) + data_size)) {
+            error_setg(errp, "%s: Failed queuing state buffer %u",
+                       vbasedev->name, idx);
+            return -EIO;
+        }
+
+        stat64_add(&bytes_transferred, data_size);
+        trace_vfio_save_complete_precopy_thread_buffer(vbasedev->name, idx,
+                                                       data_size);
+
+        if (!data_size) {
+            break;
+        }
+    }
+
+    trace_vfio_save_complete_precopy_thread(vbasedev->name, idx);
+
+    return 0;
+}
+
 static void vfio_save_state(QEMUFile *f, void *opaque)
 {
     VFIODevice *vbasedev = opaque;
@@ -583,21 +1415,111 @@ static void vfio_save_state(QEMUFile *f, void *opaque)
 static int vfio_load_setup(QEMUFile *f, void *opaque)
 {
     VFIODevice *vbasedev = opaque;
+    int ret;
 
-    return vfio_migration_set_state(vbasedev, VFIO_DEVICE_STATE_RESUMING,
+    ret = vfio_migration_set_state(vbasedev, VFIO_DEVICE_STATE_RESUMING,
                                    vbasedev->migration->device_state);
+    if (ret) {
+        return ret;
+    }
+
+    if (vbasedev->migration_precopy_buffer_size) {
+        vfio_precopy_buffer_load_setup(vbasedev);
+    }
+
+    if (vbasedev->migration_multifd_transfer) {
+        return vfio_multifd_load_setup(vbasedev);
+    }
+
+    return 0;
 }
 
 static int vfio_load_cleanup(void *opaque)
 {
     VFIODevice *vbasedev = opaque;
 
+    vfio_precopy_buffer_free(vbasedev);
+    vfio_multifd_load_cleanup(vbasedev);
     vfio_migration_cleanup(vbasedev);
     trace_vfio_load_cleanup(vbasedev->name);
 
     return 0;
 }
 
+/* Hands decoded device data to the device. Takes ownership of @data. */
+static int vfio_load_data(VFIODevice *vbasedev, char *data, size_t data_size)
+{
+    int ret;
+
+    if (vbasedev->migration->precopy_buffer) {
+        return vfio_precopy_buffer_queue(vbasedev, data, data_size);
+    }
+
+    ret = vfio_write_state_buffer(vbasedev, data, data_size);
+    trace_vfio_load_state_device_data(vbasedev->name, data_size, ret);
+    g_free(data);
+
+    return ret;
+}
+
+static int vfio_load_zero_data(VFIODevice *vbasedev, uint64_t data_size)
+{
+    char *data = g_try_malloc0(data_size);
+
+    if (!data) {
+        return -ENOMEM;
+    }
+
+    return vfio_load_data(vbasedev, data, data_size);
+}
+
+static int vfio_load_compressed_data(QEMUFile *f, VFIODevice *vbasedev)
+{
+    uint32_t method = qemu_get_be32(f);
+    uint64_t data_size = qemu_get_be64(f);
+    uint64_t compressed_size = qemu_get_be64(f);
+    g_autofree uint8_t *compressed = NULL;
+    const VFIOMigrationCompressOps *ops;
+    Error *local_err = NULL;
+    char *data;
+    int ret;
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    ops = method < MULTIFD_COMPRESSION__MAX ? compress_ops[method] : NULL;
+    if (!ops) {
+        error_report("%s: Unsupported device data compression method %u",
+                     vbasedev->name, method);
+        return -EINVAL;
+    }
+
+    compressed = g_try_malloc(compressed_size);
+    data = g_try_malloc(data_size);
+    if (!compressed || !data) {
+        g_free(data);
+        return -ENOMEM;
+    }
+
+    qemu_get_buffer(f, compressed, compressed_size);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        g_free(data);
+        return ret;
+    }
+
+    if (ops->decompress(compressed, compressed_size, (uint8_t *)data,
+                        data_size, &local_err)) {
+        error_report_err(local_err);
+        g_free(data);
+        return -EINVAL;
+    }
+
+    return vfio_load_data(vbasedev, data, data_size);
+}
+
 static int vfio_load_state(QEMUFile *f, void *opaque, int version_id)
 {
     VFIODevice *vbasedev = opaque;
@@ -612,6 +1534,18 @@ static int vfio_load_state(QEMUFile *f, void *opaque, int version_id)
         switch (data) {
         case VFIO_MIG_FLAG_DEV_CONFIG_STATE:
         {
+            ret = vfio_precopy_buffer_drain(vbasedev);
+            if (ret) {
+                return ret;
+            }
+
+            if (vbasedev->migration->multifd) {
+                ret = vfio_multifd_load_wait(vbasedev);
+                if (ret) {
+                    return ret;
+                }
+            }
+
             return vfio_load_device_config_state(f, opaque);
         }
         case VFIO_MIG_FLAG_DEV_SETUP_STATE:
@@ -631,13 +1565,53 @@ static int vfio_load_state(QEMUFile *f, void *opaque, int version_id)
             uint64_t data_size = qemu_get_be64(f);
 
             if (data_size) {
-                ret = vfio_load_buffer(f, vbasedev, data_size);
+                if (vbasedev->migration->precopy_buffer) {
+                    ret = vfio_precopy_buffer_load(f, vbasedev, data_size);
+                } else {
+                    ret = vfio_load_buffer(f, vbasedev, data_size);
+                }
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            break;
+        }
+        case VFIO_MIG_FLAG_DEV_DATA_STATE_ZERO:
+        {
+            uint64_t data_size = qemu_get_be64(f);
+
+            if (data_size) {
+                ret = vfio_load_zero_data(vbasedev, data_size);
                 if (ret < 0) {
                     return ret;
                 }
             }
             break;
         }
+        case VFIO_MIG_FLAG_DEV_DATA_STATE_COMPRESSED:
+        {
+            ret = vfio_load_compressed_data(f, vbasedev);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+        }
+        case VFIO_MIG_FLAG_DEV_DATA_STATE_MULTIFD:
+        {
+            if (!vbasedev->migration->multifd) {
+                error_report("%s: Received multifd data marker but multifd "
+                             "transfer is disabled", vbasedev->name);
+                return -EINVAL;
+            }
+
+            ret = vfio_precopy_buffer_drain(vbasedev);
+            if (ret) {
+                return ret;
+            }
+
+            vfio_multifd_main_stream_done(vbasedev);
+            break;
+        }
         case VFIO_MIG_FLAG_DEV_INIT_DATA_SENT:
         {
             if (!vfio_precopy_supported(vbasedev) ||
@@ -647,6 +1621,12 @@ static int vfio_load_state(QEMUFile *f, void *opaque, int version_id)
                 return -EINVAL;
             }
 
+            /* Only ack once the device consumed all the initial data */
+            ret = vfio_precopy_buffer_drain(vbasedev);
+            if (ret) {
+                return ret;
+            }
+
             ret = qemu_loadvm_approve_switchover();
             if (ret) {
                 error_report(
@@ -670,6 +1650,65 @@ static int vfio_load_state(QEMUFile *f, void *opaque, int version_id)
     return ret;
 }
 
+static int vfio_load_state_buffer(void *opaque, char *data, size_t data_size,
+                                  Error **errp)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOMultifd *multifd = vbasedev->migration->multifd;
+    VFIODeviceStatePacket *packet = (VFIODeviceStatePacket *)data;
+    VFIOStateBuffer *lb;
+    uint32_t idx;
+
+    if (!multifd) {
+        error_setg(errp, "%s: Received state buffer but multifd transfer is "
+                   "disabled", vbasedev->name);
+        return -EINVAL;
+    }
+
+    if (data_size < sizeof(*packet)) {
+        error_setg(errp, "%s: State buffer too short (%zu bytes)",
+                   vbasedev->name, data_size);
+        return -EINVAL;
+    }
+
+    if (be32_to_cpu(packet->version) != VFIO_DEVICE_STATE_PACKET_VERSION) {
+        error_setg(errp, "%s: Unsupported state buffer version %u",
+                   vbasedev->name, be32_to_cpu(packet->version));
+        return -EINVAL;
+    }
+
+    idx = be32_to_cpu(packet->idx);
+
+    QEMU_LOCK_GUARD(&multifd->load_bufs_mutex);
+
+    if (idx < multifd->load_buf_idx) {
+        error_setg(errp, "%s: State buffer %u was already loaded",
+                   vbasedev->name, idx);
+        return -EINVAL;
+    }
+
+    if (idx >= multifd->load_bufs->len) {
+        g_array_set_size(multifd->load_bufs, idx + 1);
+    }
+
+    lb = &g_array_index(multifd->load_bufs, VFIOStateBuffer, idx);
+    if (lb->is_present) {
+        error_setg(errp, "%s: State buffer %u received twice",
+                   vbasedev->name, idx);
+        return -EINVAL;
+    }
+
+    lb->len = data_size - sizeof(*packet);
+    lb->data = g_memdup2(packet->data, lb->len);
+    lb->is_end = be32_to_cpu(packet->flags) & VFIO_DEVICE_STATE_PACKET_FLAG_END;
+    lb->is_present = true;
+    qemu_cond_signal(&multifd->load_bufs_cond);
+
+    trace_vfio_load_state_buffer(vbasedev->name, idx, lb->len);
+
+    return 0;
+}
+
 static bool vfio_switchover_ack_needed(void *opaque)
 {
     VFIODevice *vbasedev = opaque;
@@ -683,18 +1722,28 @@ static const SaveVMHandlers savevm_vfio_handlers = {
     .save_cleanup = vfio_save_cleanup,
     .state_pending_estimate = vfio_state_pending_estimate,
     .state_pending_exact = vfio_state_pending_exact,
+    .is_active = vfio_is_active,
     .is_active_iterate = vfio_is_active_iterate,
     .save_live_iterate = vfio_save_iterate,
     .save_live_complete_precopy = vfio_save_complete_precopy,
+    .save_live_complete_precopy_thread = vfio_save_complete_precopy_thread,
     .save_state = vfio_save_state,
     .load_setup = vfio_load_setup,
     .load_cleanup = vfio_load_cleanup,
     .load_state = vfio_load_state,
+    .load_state_buffer = vfio_load_state_buffer,
     .switchover_ack_needed = vfio_switchover_ack_needed,
 };
 
 /* ---------------------------------------------------------------------- */
 
+/* cpr-exec keeps the device running while the new QEMU takes it over */
+static bool vfio_cpr_exec_stop(bool running, RunState state)
+{
+    return !running && state == RUN_STATE_FINISH_MIGRATE &&
+           migrate_mode() == MIG_MODE_CPR_EXEC;
+}
+
 static void vfio_vmstate_change_prepare(void *opaque, bool running,
                                         RunState state)
 {
@@ -703,6 +1752,12 @@ static void vfio_vmstate_change_prepare(void *opaque, bool running,
     enum vfio_device_mig_state new_state;
     int ret;
 
+    if (vfio_cpr_exec_stop(running, state)) {
+        return;
+    }
+
+    vfio_precopy_buffer_stop(vbasedev);
+
     new_state = migration->device_state == VFIO_DEVICE_STATE_PRE_COPY ?
                     VFIO_DEVICE_STATE_PRE_COPY_P2P :
                     VFIO_DEVICE_STATE_RUNNING_P2P;
@@ -727,6 +1782,12 @@ static void vfio_vmstate_change(void *opaque, bool running, RunState state)
     enum vfio_device_mig_state new_state;
     int ret;
 
+    if (vfio_cpr_exec_stop(running, state)) {
+        return;
+    }
+
+    vfio_precopy_buffer_stop(vbasedev);
+
     if (running) {
         new_state = VFIO_DEVICE_STATE_RUNNING;
     } else {
@@ -760,6 +1821,7 @@ static int vfio_migration_state_notifier(NotifierWithReturn *notifier,
     trace_vfio_migration_state_notifier(vbasedev->name, e->type);
 
     if (e->type == MIG_EVENT_PRECOPY_FAILED) {
+        vfio_precopy_buffer_stop(vbasedev);
         vfio_migration_set_state_or_reset(vbasedev, VFIO_DEVICE_STATE_RUNNING);
     }
     return 0;
@@ -892,12 +1954,12 @@ static int vfio_block_migration(VFIODevice *vbasedev, Error *err, Error **errp)
 
 int64_t vfio_mig_bytes_transferred(void)
 {
-    return bytes_transferred;
+    return stat64_get(&bytes_transferred);
 }
 
 void vfio_reset_bytes_transferred(void)
 {
-    bytes_transferred = 0;
+    stat64_set(&bytes_transferred, 0);
 }
 
 /*
@@ -931,7 +1993,7 @@ bool vfio_migration_realize(VFIODevice *vbasedev, Error **errp)
         return !vfio_block_migration(vbasedev, err, errp);
     }
 
-    if (!vbasedev->dirty_pages_supported) {
+    if (!vbasedev->dirty_pages_supported && !vbasedev->iommu_dirty_tracking) {
         if (vbasedev->enable_migration == ON_OFF_AUTO_AUTO) {
             error_setg(&err,
                        "%s: VFIO device doesn't support device dirty tracking",
@@ -948,7 +2010,13 @@ bool vfio_migration_realize(VFIODevice *vbasedev, Error **errp)
         goto out_deinit;
     }
 
-    if (vfio_viommu_preset(vbasedev)) {
+    /*
+     * A nesting vIOMMU leaves the guest physical address space mapped in the
+     * container, which is what the host IOMMU then tracks dirty pages of.
+     */
+    if (vfio_viommu_preset(vbasedev) &&
+        !(vbasedev->iommu_dirty_tracking &&
+          QLIST_EMPTY(&vbasedev->bcontainer->giommu_list))) {
         error_setg(&err, "%s: Migration is currently not supported "
                    "with vIOMMU enabled", vbasedev->name);
         goto add_blocker;
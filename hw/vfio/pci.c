@@ -42,6 +42,7 @@
 #include "trace.h"
 #include "qapi/error.h"
 #include "migration/blocker.h"
+#include "migration/misc.h"
 #include "migration/qemu-file.h"
 #include "sysemu/iommufd.h"
 
@@ -442,6 +443,7 @@ static int vfio_enable_vectors(VFIOPCIDevice *vdev, bool msix)
          */
         if (vdev->msi_vectors[i].use) {
             if (vdev->msi_vectors[i].virq < 0 ||
+                vdev->msi_vectors[i].virq_pending ||
                 (msix && msix_is_masked(&vdev->pdev, i))) {
                 fd = event_notifier_get_fd(&vdev->msi_vectors[i].interrupt);
             } else {
@@ -496,6 +498,13 @@ fail_notifier:
 
 static void vfio_remove_kvm_msi_virq(VFIOMSIVector *vector)
 {
+    if (vector->virq_pending) {
+        vector->virq_pending = false;
+        kvm_irqchip_release_virq(kvm_state, vector->virq);
+        vector->virq = -1;
+        return;
+    }
+
     kvm_irqchip_remove_irqfd_notifier_gsi(kvm_state, &vector->kvm_interrupt,
                                           vector->virq);
     kvm_irqchip_release_virq(kvm_state, vector->virq);
@@ -547,13 +556,19 @@ static int vfio_msix_vector_do_use(PCIDevice *pdev, unsigned int nr,
         }
     } else {
         if (msg) {
-            if (vdev->defer_kvm_irq_routing) {
-                vfio_add_kvm_msi_virq(vdev, vector, nr, true);
-            } else {
+            if (!vdev->defer_kvm_irq_routing) {
                 vfio_route_change = kvm_irqchip_begin_route_changes(kvm_state);
-                vfio_add_kvm_msi_virq(vdev, vector, nr, true);
-                kvm_irqchip_commit_route_changes(&vfio_route_change);
-                vfio_connect_kvm_msi_virq(vector);
+            }
+            vfio_add_kvm_msi_virq(vdev, vector, nr, true);
+            /*
+             * Guest drivers unmask their vectors one at a time.  Rather than
+             * pushing the routing table to KVM for each of them, deliver
+             * through QEMU until a bottom half commits the routes of all
+             * vectors unmasked meanwhile and switches them to their irqfd.
+             */
+            if (!vdev->defer_kvm_irq_routing && vector->virq >= 0) {
+                vector->virq_pending = true;
+                qemu_bh_schedule(vdev->msix->route_bh);
             }
         }
     }
@@ -584,7 +599,7 @@ static int vfio_msix_vector_do_use(PCIDevice *pdev, unsigned int nr,
             Error *err = NULL;
             int32_t fd;
 
-            if (vector->virq >= 0) {
+            if (vector->virq >= 0 && !vector->virq_pending) {
                 fd = event_notifier_get_fd(&vector->kvm_interrupt);
             } else {
                 fd = event_notifier_get_fd(&vector->interrupt);
@@ -641,6 +656,41 @@ static void vfio_msix_vector_release(PCIDevice *pdev, unsigned int nr)
     }
 }
 
+static void vfio_msix_route_bh(void *opaque)
+{
+    VFIOPCIDevice *vdev = opaque;
+    int i;
+
+    if (vdev->interrupt != VFIO_INT_MSIX) {
+        return;
+    }
+
+    kvm_irqchip_commit_routes(kvm_state);
+
+    for (i = 0; i < vdev->nr_vectors; i++) {
+        VFIOMSIVector *vector = &vdev->msi_vectors[i];
+        Error *err = NULL;
+        int32_t fd;
+
+        if (!vector->virq_pending) {
+            continue;
+        }
+        vector->virq_pending = false;
+        vfio_connect_kvm_msi_virq(vector);
+
+        /* Masked vectors keep going through QEMU, see vector_release. */
+        if (vector->virq < 0 || msix_is_masked(&vdev->pdev, i)) {
+            continue;
+        }
+        fd = event_notifier_get_fd(&vector->kvm_interrupt);
+        if (vfio_set_irq_signaling(&vdev->vbasedev, VFIO_PCI_MSIX_IRQ_INDEX, i,
+                                   VFIO_IRQ_SET_ACTION_TRIGGER, fd, &err)) {
+            error_reportf_err(err, VFIO_MSG_PREFIX, vdev->vbasedev.name);
+        }
+    }
+    trace_vfio_msix_route_commit(vdev->vbasedev.name);
+}
+
 static void vfio_prepare_kvm_msi_virq_batch(VFIOPCIDevice *vdev)
 {
     assert(!vdev->defer_kvm_irq_routing);
@@ -958,6 +1008,39 @@ static void vfio_pci_load_rom(VFIOPCIDevice *vdev)
     }
 }
 
+static void *vfio_pci_rom_prefetch_thread(void *opaque)
+{
+    vfio_pci_load_rom(opaque);
+    return NULL;
+}
+
+/*
+ * Reading the ROM of a physical device is slow, and firmware reads the
+ * ROMs of all devices one after the other.  Start reading it during
+ * realize so that the ROMs of all devices are read at the same time.
+ */
+static void vfio_pci_rom_prefetch(VFIOPCIDevice *vdev)
+{
+    g_autofree char *name = NULL;
+
+    if (!vdev->rom_prefetch) {
+        return;
+    }
+
+    name = g_strdup_printf("vfio-rom %s", vdev->vbasedev.name);
+    qemu_thread_create(&vdev->rom_thread, name, vfio_pci_rom_prefetch_thread,
+                       vdev, QEMU_THREAD_JOINABLE);
+    vdev->rom_thread_running = true;
+}
+
+static void vfio_pci_rom_prefetch_wait(VFIOPCIDevice *vdev)
+{
+    if (vdev->rom_thread_running) {
+        qemu_thread_join(&vdev->rom_thread);
+        vdev->rom_thread_running = false;
+    }
+}
+
 static uint64_t vfio_rom_read(void *opaque, hwaddr addr, unsigned size)
 {
     VFIOPCIDevice *vdev = opaque;
@@ -969,6 +1052,8 @@ static uint64_t vfio_rom_read(void *opaque, hwaddr addr, unsigned size)
     } val;
     uint64_t data = 0;
 
+    vfio_pci_rom_prefetch_wait(vdev);
+
     /* Load the ROM lazily when the guest tries to read it */
     if (unlikely(!vdev->rom && !vdev->rom_read_failed)) {
         vfio_pci_load_rom(vdev);
@@ -1073,6 +1158,7 @@ static void vfio_pci_size_rom(VFIOPCIDevice *vdev)
                      PCI_BASE_ADDRESS_SPACE_MEMORY, &vdev->pdev.rom);
 
     vdev->rom_read_failed = false;
+    vfio_pci_rom_prefetch(vdev);
 }
 
 void vfio_vga_write(void *opaque, hwaddr addr,
@@ -1209,6 +1295,50 @@ static void vfio_sub_page_bar_update_mapping(PCIDevice *pdev, int bar)
     memory_region_transaction_commit();
 }
 
+static void vfio_bar_mmap(VFIOPCIDevice *vdev, int nr)
+{
+    VFIOBAR *bar = &vdev->bars[nr];
+
+    bar->mmap_pending = false;
+    if (vfio_region_mmap(&bar->region)) {
+        error_report("Failed to mmap %s BAR %d. Performance may be slow",
+                     vdev->vbasedev.name, nr);
+    }
+}
+
+/*
+ * With x-lazy-bar-mmap, BARs are only mmapped once the guest enables
+ * the decoding for them.  Firmware usually sizes and moves BARs with
+ * decoding disabled, so this saves the mmaps of BARs that are never
+ * used, and the memory listener (including P2P DMA mapping) sees all
+ * BARs of the device in a single transaction.
+ */
+static void vfio_bars_mmap_pending(VFIOPCIDevice *vdev)
+{
+    PCIDevice *pdev = &vdev->pdev;
+    uint16_t cmd = pci_get_word(pdev->config + PCI_COMMAND);
+    int nr;
+
+    memory_region_transaction_begin();
+    for (nr = 0; nr < PCI_ROM_SLOT; nr++) {
+        VFIOBAR *bar = &vdev->bars[nr];
+
+        if (!bar->mmap_pending ||
+            !(cmd & (bar->ioport ? PCI_COMMAND_IO : PCI_COMMAND_MEMORY))) {
+            continue;
+        }
+        vfio_bar_mmap(vdev, nr);
+        if (bar->region.size < qemu_real_host_page_size()) {
+            vfio_sub_page_bar_update_mapping(pdev, nr);
+        }
+        /* INTx may have disabled the fast path for now */
+        if (vdev->intx.pending) {
+            vfio_region_mmaps_set_enabled(&bar->region, false);
+        }
+    }
+    memory_region_transaction_commit();
+}
+
 /*
  * PCI config space
  */
@@ -1303,6 +1433,10 @@ void vfio_pci_write_config(PCIDevice *pdev,
 
         pci_default_write_config(pdev, addr, val, len);
 
+        if (range_covers_byte(addr, len, PCI_COMMAND)) {
+            vfio_bars_mmap_pending(vdev);
+        }
+
         for (bar = 0; bar < PCI_ROM_SLOT; bar++) {
             if (old_addr[bar] != pdev->io_regions[bar].addr &&
                 vdev->bars[bar].region.size > 0 &&
@@ -1682,6 +1816,8 @@ static int vfio_msix_setup(VFIOPCIDevice *vdev, int pos, Error **errp)
      */
     memory_region_set_enabled(&vdev->pdev.msix_pba_mmio, false);
 
+    vdev->msix->route_bh = qemu_bh_new(vfio_msix_route_bh, vdev);
+
     /*
      * The emulated machine may provide a paravirt interface for MSIX setup
      * so it is not strictly necessary to emulate MSIX here. This becomes
@@ -1707,6 +1843,10 @@ static void vfio_teardown_msi(VFIOPCIDevice *vdev)
                     vdev->bars[vdev->msix->table_bar].mr,
                     vdev->bars[vdev->msix->pba_bar].mr);
         g_free(vdev->msix->pending);
+        if (vdev->msix->route_bh) {
+            qemu_bh_delete(vdev->msix->route_bh);
+            vdev->msix->route_bh = NULL;
+        }
     }
 }
 
@@ -1776,9 +1916,10 @@ static void vfio_bar_register(VFIOPCIDevice *vdev, int nr)
     if (bar->region.size) {
         memory_region_add_subregion(bar->mr, 0, bar->region.mem);
 
-        if (vfio_region_mmap(&bar->region)) {
-            error_report("Failed to mmap %s BAR %d. Performance may be slow",
-                         vdev->vbasedev.name, nr);
+        if (vdev->lazy_bar_mmap) {
+            bar->mmap_pending = true;
+        } else {
+            vfio_bar_mmap(vdev, nr);
         }
     }
 
@@ -2384,6 +2525,8 @@ void vfio_pci_pre_reset(VFIOPCIDevice *vdev)
     PCIDevice *pdev = &vdev->pdev;
     uint16_t cmd;
 
+    /* Do not reset the device under the ROM read */
+    vfio_pci_rom_prefetch_wait(vdev);
     vfio_disable_interrupts(vdev);
 
     /* Make sure the device is in D0 */
@@ -2593,21 +2736,15 @@ static void vfio_pci_save_config(VFIODevice *vbasedev, QEMUFile *f)
     vmstate_save_state(f, &vmstate_vfio_pci_config, vdev, NULL);
 }
 
-static int vfio_pci_load_config(VFIODevice *vbasedev, QEMUFile *f)
+/*
+ * Apply the config space loaded by migration to the device.  @old_addr
+ * holds the BAR addresses from before the load, NULL if all BARs are new.
+ */
+static void vfio_pci_config_loaded(VFIOPCIDevice *vdev,
+                                   const pcibus_t *old_addr)
 {
-    VFIOPCIDevice *vdev = container_of(vbasedev, VFIOPCIDevice, vbasedev);
     PCIDevice *pdev = &vdev->pdev;
-    pcibus_t old_addr[PCI_NUM_REGIONS - 1];
-    int bar, ret;
-
-    for (bar = 0; bar < PCI_ROM_SLOT; bar++) {
-        old_addr[bar] = pdev->io_regions[bar].addr;
-    }
-
-    ret = vmstate_load_state(f, &vmstate_vfio_pci_config, vdev, 1);
-    if (ret) {
-        return ret;
-    }
+    int bar;
 
     vfio_pci_write_config(pdev, PCI_COMMAND,
                           pci_get_word(pdev->config + PCI_COMMAND), 2);
@@ -2617,7 +2754,7 @@ static int vfio_pci_load_config(VFIODevice *vbasedev, QEMUFile *f)
          * The address may not be changed in some scenarios
          * (e.g. the VF driver isn't loaded in VM).
          */
-        if (old_addr[bar] != pdev->io_regions[bar].addr &&
+        if ((!old_addr || old_addr[bar] != pdev->io_regions[bar].addr) &&
             vdev->bars[bar].region.size > 0 &&
             vdev->bars[bar].region.size < qemu_real_host_page_size()) {
             vfio_sub_page_bar_update_mapping(pdev, bar);
@@ -2629,10 +2766,82 @@ static int vfio_pci_load_config(VFIODevice *vbasedev, QEMUFile *f)
     } else if (msix_enabled(pdev)) {
         vfio_msix_enable(vdev);
     }
+}
+
+static int vfio_pci_load_config(VFIODevice *vbasedev, QEMUFile *f)
+{
+    VFIOPCIDevice *vdev = container_of(vbasedev, VFIOPCIDevice, vbasedev);
+    PCIDevice *pdev = &vdev->pdev;
+    pcibus_t old_addr[PCI_NUM_REGIONS - 1];
+    int bar, ret;
+
+    for (bar = 0; bar < PCI_ROM_SLOT; bar++) {
+        old_addr[bar] = pdev->io_regions[bar].addr;
+    }
+
+    ret = vmstate_load_state(f, &vmstate_vfio_pci_config, vdev, 1);
+    if (ret) {
+        return ret;
+    }
+
+    vfio_pci_config_loaded(vdev, old_addr);
 
     return ret;
 }
 
+/*
+ * cpr-exec: the device kept running, but the interrupts it raised while
+ * no QEMU was listening are lost.  Re-arm the interrupts of the loaded
+ * config, and raise the enabled vectors once; spurious MSIs are harmless.
+ */
+static bool vfio_pci_cpr_needed(void *opaque)
+{
+    return migrate_mode() == MIG_MODE_CPR_EXEC;
+}
+
+static int vfio_pci_cpr_post_load(void *opaque, int version_id)
+{
+    VFIOPCIDevice *vdev = opaque;
+    PCIDevice *pdev = &vdev->pdev;
+    Error *err = NULL;
+    int nr;
+
+    vfio_pci_config_loaded(vdev, NULL);
+
+    if (msix_enabled(pdev)) {
+        for (nr = 0; nr < vdev->nr_vectors; nr++) {
+            if (vdev->msi_vectors[nr].use && !msix_is_masked(pdev, nr)) {
+                msix_notify(pdev, nr);
+            }
+        }
+    } else if (msi_enabled(pdev)) {
+        for (nr = 0; nr < vdev->nr_vectors; nr++) {
+            if (!msi_is_masked(pdev, nr)) {
+                msi_notify(pdev, nr);
+            }
+        }
+    } else if (vfio_pci_read_config(pdev, PCI_INTERRUPT_PIN, 1) &&
+               vfio_intx_enable(vdev, &err)) {
+        error_report_err(err);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_vfio_pci_cpr = {
+    .name = "vfio-pci-cpr",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = vfio_pci_cpr_needed,
+    .post_load = vfio_pci_cpr_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_PCI_DEVICE(pdev, VFIOPCIDevice),
+        VMSTATE_MSIX_TEST(pdev, VFIOPCIDevice, vfio_msix_present),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static VFIODeviceOps vfio_pci_ops = {
     .vfio_compute_needs_reset = vfio_pci_compute_needs_reset,
     .vfio_hot_reset_multi = vfio_pci_hot_reset_multi,
@@ -3175,7 +3384,8 @@ static void vfio_realize(PCIDevice *pdev, Error **errp)
                                              vfio_intx_routing_notifier);
         vdev->irqchip_change_notifier.notify = vfio_irqchip_change;
         kvm_irqchip_add_change_notifier(&vdev->irqchip_change_notifier);
-        ret = vfio_intx_enable(vdev, errp);
+        /* The interrupts of an inherited device are set up on load */
+        ret = vdev->vbasedev.cpr_reused ? 0 : vfio_intx_enable(vdev, errp);
         if (ret) {
             goto out_deregister;
         }
@@ -3252,6 +3462,7 @@ static void vfio_instance_finalize(Object *obj)
 {
     VFIOPCIDevice *vdev = VFIO_PCI(obj);
 
+    vfio_pci_rom_prefetch_wait(vdev);
     vfio_display_finalize(vdev);
     vfio_bars_finalize(vdev);
     g_free(vdev->emulated_config_bits);
@@ -3271,6 +3482,7 @@ static void vfio_exitfn(PCIDevice *pdev)
     VFIOPCIDevice *vdev = VFIO_PCI(pdev);
     VFIODevice *vbasedev = &vdev->vbasedev;
 
+    vfio_pci_rom_prefetch_wait(vdev);
     vfio_unregister_req_notifier(vdev);
     vfio_unregister_err_notifier(vdev);
     pci_device_set_intx_routing_notifier(&vdev->pdev, NULL);
@@ -3294,6 +3506,11 @@ static void vfio_pci_reset(DeviceState *dev)
 
     trace_vfio_pci_reset(vdev->vbasedev.name);
 
+    /* Don't disturb a device that cpr-exec handed over while it runs */
+    if (vdev->vbasedev.cpr_reused) {
+        return;
+    }
+
     vfio_pci_pre_reset(vdev);
 
     if (vdev->display != ON_OFF_AUTO_OFF) {
@@ -3372,7 +3589,18 @@ static Property vfio_pci_dev_properties[] = {
                     VFIO_FEATURE_ENABLE_IGD_OPREGION_BIT, false),
     DEFINE_PROP_ON_OFF_AUTO("enable-migration", VFIOPCIDevice,
                             vbasedev.enable_migration, ON_OFF_AUTO_AUTO),
+    DEFINE_PROP_BOOL("x-migration-multifd-transfer", VFIOPCIDevice,
+                     vbasedev.migration_multifd_transfer, false),
+    DEFINE_PROP_SIZE("x-migration-precopy-buffer-size", VFIOPCIDevice,
+                     vbasedev.migration_precopy_buffer_size, 0),
+    DEFINE_PROP_MULTIFD_COMPRESSION("x-migration-compression", VFIOPCIDevice,
+                                    vbasedev.migration_compression,
+                                    MULTIFD_COMPRESSION_NONE),
+    DEFINE_PROP_BOOL("x-migration-zero-elision", VFIOPCIDevice,
+                     vbasedev.migration_zero_elision, false),
     DEFINE_PROP_BOOL("x-no-mmap", VFIOPCIDevice, vbasedev.no_mmap, false),
+    DEFINE_PROP_BOOL("x-rom-prefetch", VFIOPCIDevice, rom_prefetch, true),
+    DEFINE_PROP_BOOL("x-lazy-bar-mmap", VFIOPCIDevice, lazy_bar_mmap, true),
     DEFINE_PROP_BOOL("x-balloon-allowed", VFIOPCIDevice,
                      vbasedev.ram_block_discard_allowed, false),
     DEFINE_PROP_BOOL("x-no-kvm-intx", VFIOPCIDevice, no_kvm_intx, false),
@@ -3416,6 +3644,7 @@ static void vfio_pci_dev_class_init(ObjectClass *klass, void *data)
     PCIDeviceClass *pdc = PCI_DEVICE_CLASS(klass);
 
     dc->reset = vfio_pci_reset;
+    dc->vmsd = &vmstate_vfio_pci_cpr;
     device_class_set_props(dc, vfio_pci_dev_properties);
 #ifdef CONFIG_IOMMUFD
     object_class_property_add_str(klass, "fd", NULL, vfio_pci_set_fd);
@@ -17,6 +17,7 @@
 #include "hw/vfio/vfio-common.h"
 #include "qemu/event_notifier.h"
 #include "qemu/queue.h"
+#include "qemu/thread.h"
 #include "qemu/timer.h"
 #include "qom/object.h"
 #include "sysemu/kvm.h"
@@ -54,6 +55,7 @@ typedef struct VFIOBAR {
     uint8_t type;
     bool ioport;
     bool mem64;
+    bool mmap_pending; /* mmap deferred until the guest enables decoding */
     QLIST_HEAD(, VFIOQuirk) quirks;
 } VFIOBAR;
 
@@ -89,13 +91,15 @@ typedef struct VFIOMSIVector {
      * bits.  The KVM path bypasses QEMU and is therefore higher performance,
      * but requires masking at the device.  virq is used to track the MSI route
      * through KVM, thus kvm_interrupt is only available when virq is set to a
-     * valid (>= 0) value.
+     * valid (>= 0) value and the route is not pending.
      */
     EventNotifier interrupt;
     EventNotifier kvm_interrupt;
     struct VFIOPCIDevice *vdev; /* back pointer to device */
     int virq;
     bool use;
+    /* virq route added, but not committed to KVM nor connected yet */
+    bool virq_pending;
 } VFIOMSIVector;
 
 enum {
@@ -114,6 +118,7 @@ typedef struct VFIOMSIXInfo {
     uint32_t pba_offset;
     unsigned long *pending;
     bool noresize;
+    QEMUBH *route_bh; /* commits routes of vectors unmasked one by one */
 } VFIOMSIXInfo;
 
 #define TYPE_VFIO_PCI "vfio-pci"
@@ -167,6 +172,11 @@ struct VFIOPCIDevice {
     bool has_flr;
     bool has_pm_reset;
     bool rom_read_failed;
+    bool rom_prefetch;
+    bool lazy_bar_mmap;
+    /* Reads the ROM in the background from realize on */
+    QemuThread rom_thread;
+    bool rom_thread_running;
     bool no_kvm_intx;
     bool no_kvm_msi;
     bool no_kvm_msix;
@@ -28,6 +28,9 @@ struct VhostIOVATree {
 
     /* IOVA address to qemu memory maps. */
     IOVATree *iova_taddr_map;
+
+    /* Bumped every time a mapping is removed */
+    uint64_t generation;
 };
 
 /**
@@ -37,7 +40,7 @@ struct VhostIOVATree {
  */
 VhostIOVATree *vhost_iova_tree_new(hwaddr iova_first, hwaddr iova_last)
 {
-    VhostIOVATree *tree = g_new(VhostIOVATree, 1);
+    VhostIOVATree *tree = g_new0(VhostIOVATree, 1);
 
     /* Some devices do not like 0 addresses */
     tree->iova_first = MAX(iova_first, iova_min_addr);
@@ -107,4 +110,18 @@ int vhost_iova_tree_map_alloc(VhostIOVATree *tree, DMAMap *map)
 void vhost_iova_tree_remove(VhostIOVATree *iova_tree, DMAMap map)
 {
     iova_tree_remove(iova_tree->iova_taddr_map, map);
+    iova_tree->generation++;
+}
+
+/**
+ * Get the tree generation
+ *
+ * @iova_tree: The vhost iova tree
+ *
+ * Mappings found with vhost_iova_tree_find_iova() stay valid for as long as
+ * the generation does not change.
+ */
+uint64_t vhost_iova_tree_generation(const VhostIOVATree *iova_tree)
+{
+    return iova_tree->generation;
 }
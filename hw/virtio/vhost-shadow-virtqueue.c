@@ -34,6 +34,8 @@ bool vhost_svq_valid_features(uint64_t features, Error **errp)
         switch (b) {
         case VIRTIO_F_ANY_LAYOUT:
         case VIRTIO_RING_F_EVENT_IDX:
+        case VIRTIO_F_IN_ORDER:
+        case VIRTIO_F_RING_PACKED:
             continue;
 
         case VIRTIO_F_ACCESS_PLATFORM:
@@ -54,6 +56,13 @@ bool vhost_svq_valid_features(uint64_t features, Error **errp)
         }
     }
 
+    /* In order batches of used descriptors are only handled for split */
+    if ((svq_features & BIT_ULL(VIRTIO_F_RING_PACKED)) &&
+        (svq_features & BIT_ULL(VIRTIO_F_IN_ORDER))) {
+        svq_features &= ~BIT_ULL(VIRTIO_F_IN_ORDER);
+        ok = false;
+    }
+
     if (!ok) {
         error_setg(errp, "SVQ Invalid device feature flags, offer: 0x%"PRIx64
                          ", ok: 0x%"PRIx64, features, svq_features);
@@ -71,6 +80,35 @@ uint16_t vhost_svq_available_slots(const VhostShadowVirtqueue *svq)
     return svq->num_free;
 }
 
+/**
+ * Find the IOVA mapping of a buffer, trying the last hit mapping first since
+ * guest buffers usually sit in the same few memory regions.
+ *
+ * @svq: Shadow VirtQueue
+ * @needle: The buffer in qemu's VA
+ */
+static const DMAMap *vhost_svq_find_iova(VhostShadowVirtqueue *svq,
+                                         const DMAMap *needle)
+{
+    uint64_t generation = vhost_iova_tree_generation(svq->iova_tree);
+    const DMAMap *map;
+
+    if (svq->last_map_valid && svq->last_map_generation == generation &&
+        needle->translated_addr >= svq->last_map.translated_addr &&
+        needle->translated_addr - svq->last_map.translated_addr <=
+        svq->last_map.size) {
+        return &svq->last_map;
+    }
+
+    map = vhost_iova_tree_find_iova(svq->iova_tree, needle);
+    if (map) {
+        svq->last_map = *map;
+        svq->last_map_generation = generation;
+        svq->last_map_valid = true;
+    }
+    return map;
+}
+
 /**
  * Translate addresses between the qemu's virtual address and the SVQ IOVA
  *
@@ -79,7 +117,7 @@ uint16_t vhost_svq_available_slots(const VhostShadowVirtqueue *svq)
  * @iovec: Source qemu's VA addresses
  * @num: Length of iovec and minimum length of vaddr
  */
-static bool vhost_svq_translate_addr(const VhostShadowVirtqueue *svq,
+static bool vhost_svq_translate_addr(VhostShadowVirtqueue *svq,
                                      hwaddr *addrs, const struct iovec *iovec,
                                      size_t num)
 {
@@ -95,7 +133,7 @@ static bool vhost_svq_translate_addr(const VhostShadowVirtqueue *svq,
         Int128 needle_last, map_last;
         size_t off;
 
-        const DMAMap *map = vhost_iova_tree_find_iova(svq->iova_tree, &needle);
+        const DMAMap *map = vhost_svq_find_iova(svq, &needle);
         /*
          * Map cannot be NULL since iova map contains all guest space and
          * qemu already has a physical address mapped
@@ -210,14 +248,122 @@ static bool vhost_svq_add_split(VhostShadowVirtqueue *svq,
     avail->ring[avail_idx] = cpu_to_le16(*head);
     svq->shadow_avail_idx++;
 
-    /* Update the avail index after write the descriptor */
+    return true;
+}
+
+/**
+ * Write descriptors to the SVQ packed vring.  All the descriptors but the
+ * first are made available as they are written, the first one is made
+ * available last so the device sees the whole chain at once.
+ *
+ * @svq: The shadow virtqueue
+ * @out_sg: The out iovec from the guest
+ * @out_num: The out iovec length
+ * @in_sg: The in iovec from the guest
+ * @in_num: The in iovec length
+ * @id: Buffer id used for the chain
+ *
+ * Return true if success, false otherwise and print error.
+ */
+static bool vhost_svq_add_packed(VhostShadowVirtqueue *svq,
+                                 const struct iovec *out_sg, size_t out_num,
+                                 const struct iovec *in_sg, size_t in_num,
+                                 unsigned *id)
+{
+    struct vring_packed_desc *descs = svq->vring_packed.desc;
+    size_t total = out_num + in_num;
+    g_autofree hwaddr *sgs = g_new(hwaddr, total);
+    uint16_t head = svq->shadow_avail_idx, i = head;
+    uint16_t head_flags = 0;
+    bool ok;
+
+    /* We need some descriptors here */
+    if (unlikely(!total)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "Guest provided element with no descriptors");
+        return false;
+    }
+
+    ok = vhost_svq_translate_addr(svq, sgs, out_sg, out_num) &&
+         vhost_svq_translate_addr(svq, sgs + out_num, in_sg, in_num);
+    if (unlikely(!ok)) {
+        return false;
+    }
+
+    *id = svq->free_head;
+    for (size_t n = 0; n < total; n++) {
+        const struct iovec *iov = n < out_num ? &out_sg[n]
+                                              : &in_sg[n - out_num];
+        uint16_t flags = svq->avail_used_flags;
+
+        if (n >= out_num) {
+            flags |= VRING_DESC_F_WRITE;
+        }
+        if (n + 1 < total) {
+            flags |= VRING_DESC_F_NEXT;
+        }
+
+        descs[i].addr = cpu_to_le64(sgs[n]);
+        descs[i].len = cpu_to_le32(iov->iov_len);
+        descs[i].id = cpu_to_le16(*id);
+        if (n == 0) {
+            head_flags = flags;
+        } else {
+            descs[i].flags = cpu_to_le16(flags);
+        }
+
+        if (++i >= svq->vring.num) {
+            i = 0;
+            svq->avail_wrap_counter = !svq->avail_wrap_counter;
+            svq->avail_used_flags ^= 1 << VRING_PACKED_DESC_F_AVAIL |
+                                     1 << VRING_PACKED_DESC_F_USED;
+        }
+    }
+
+    svq->shadow_avail_idx = i;
+    svq->num_added += total;
+    svq->free_head = le16_to_cpu(svq->desc_next[*id]);
+
+    /* Expose the rest of the chain before its head */
     smp_wmb();
-    avail->idx = cpu_to_le16(svq->shadow_avail_idx);
+    descs[head].flags = cpu_to_le16(head_flags);
 
     return true;
 }
 
-static void vhost_svq_kick(VhostShadowVirtqueue *svq)
+static void vhost_svq_kick_packed(VhostShadowVirtqueue *svq)
+{
+    const struct vring_packed_desc_event *event = svq->vring_packed.device;
+    uint16_t new = svq->shadow_avail_idx;
+    uint16_t old = new - svq->num_added;
+    uint16_t off_wrap, flags;
+    bool needs_kick;
+
+    svq->num_added = 0;
+
+    /* Expose the descriptors before checking the device event suppression */
+    smp_mb();
+
+    off_wrap = le16_to_cpu(event->off_wrap);
+    flags = le16_to_cpu(event->flags);
+    if (flags == VRING_PACKED_EVENT_FLAG_DESC) {
+        uint16_t event_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+        if ((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) !=
+            svq->avail_wrap_counter) {
+            event_idx -= svq->vring.num;
+        }
+        needs_kick = vring_need_event(event_idx, new, old);
+    } else {
+        needs_kick = flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+    }
+
+    if (needs_kick) {
+        event_notifier_set(&svq->hdev_kick);
+    }
+}
+
+static void vhost_svq_kick(VhostShadowVirtqueue *svq, uint16_t old)
 {
     bool needs_kick;
 
@@ -229,7 +375,7 @@ static void vhost_svq_kick(VhostShadowVirtqueue *svq)
 
     if (virtio_vdev_has_feature(svq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         uint16_t avail_event = *(uint16_t *)(&svq->vring.used->ring[svq->vring.num]);
-        needs_kick = vring_need_event(avail_event, svq->shadow_avail_idx, svq->shadow_avail_idx - 1);
+        needs_kick = vring_need_event(avail_event, svq->shadow_avail_idx, old);
     } else {
         needs_kick = !(svq->vring.used->flags & VRING_USED_F_NO_NOTIFY);
     }
@@ -241,6 +387,35 @@ static void vhost_svq_kick(VhostShadowVirtqueue *svq)
     event_notifier_set(&svq->hdev_kick);
 }
 
+/**
+ * Expose the avail ring entries added since the last call to the device, and
+ * kick it if needed.
+ *
+ * @svq: The svq
+ */
+static void vhost_svq_publish_avail(VhostShadowVirtqueue *svq)
+{
+    uint16_t old = svq->published_avail_idx;
+
+    if (svq->packed) {
+        /* Descriptors are already available, only the kick is deferred */
+        if (svq->num_added) {
+            vhost_svq_kick_packed(svq);
+        }
+        return;
+    }
+
+    if (old == svq->shadow_avail_idx) {
+        return;
+    }
+
+    /* Update the avail index after write the descriptor */
+    smp_wmb();
+    svq->vring.avail->idx = cpu_to_le16(svq->shadow_avail_idx);
+    svq->published_avail_idx = svq->shadow_avail_idx;
+    vhost_svq_kick(svq, old);
+}
+
 /**
  * Add an element to a SVQ.
  *
@@ -258,7 +433,13 @@ int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
         return -ENOSPC;
     }
 
-    ok = vhost_svq_add_split(svq, out_sg, out_num, in_sg, in_num, &qemu_head);
+    if (svq->packed) {
+        ok = vhost_svq_add_packed(svq, out_sg, out_num, in_sg, in_num,
+                                  &qemu_head);
+    } else {
+        ok = vhost_svq_add_split(svq, out_sg, out_num, in_sg, in_num,
+                                 &qemu_head);
+    }
     if (unlikely(!ok)) {
         return -EINVAL;
     }
@@ -266,7 +447,9 @@ int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
     svq->num_free -= ndescs;
     svq->desc_state[qemu_head].elem = elem;
     svq->desc_state[qemu_head].ndescs = ndescs;
-    vhost_svq_kick(svq);
+    if (!svq->avail_batch) {
+        vhost_svq_publish_avail(svq);
+    }
     return 0;
 }
 
@@ -296,6 +479,13 @@ static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
     /* Clear event notifier */
     event_notifier_test_and_clear(&svq->svq_kick);
 
+    /*
+     * Expose all the buffers forwarded below with a single avail idx update
+     * and kick.  Callers with their own avail handler may wait for the device
+     * to use each buffer, so they are not batched.
+     */
+    svq->avail_batch = !svq->ops;
+
     /* Forward to the device as many available buffers as possible */
     do {
         virtio_queue_set_notification(svq->vq, false);
@@ -336,14 +526,19 @@ static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
                 }
 
                 /* VQ is full or broken, just return and ignore kicks */
-                return;
+                goto out;
             }
             /* elem belongs to SVQ or external caller now */
             elem = NULL;
         }
 
+        vhost_svq_publish_avail(svq);
         virtio_queue_set_notification(svq->vq, true);
     } while (!virtio_queue_empty(svq->vq));
+
+out:
+    svq->avail_batch = false;
+    vhost_svq_publish_avail(svq);
 }
 
 /**
@@ -358,10 +553,27 @@ static void vhost_handle_guest_kick_notifier(EventNotifier *n)
     vhost_handle_guest_kick(svq);
 }
 
+static bool vhost_svq_more_used_packed(VhostShadowVirtqueue *svq)
+{
+    const struct vring_packed_desc *desc =
+        &svq->vring_packed.desc[svq->last_used_idx];
+    uint16_t flags = le16_to_cpu(qatomic_read(&desc->flags));
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+    return avail == used && used == svq->used_wrap_counter;
+}
+
 static bool vhost_svq_more_used(VhostShadowVirtqueue *svq)
 {
     uint16_t *used_idx = &svq->vring.used->idx;
-    if (svq->last_used_idx != svq->shadow_used_idx) {
+
+    if (svq->packed) {
+        return vhost_svq_more_used_packed(svq);
+    }
+
+    if (svq->in_order_used_pending ||
+        svq->last_used_idx != svq->shadow_used_idx) {
         return true;
     }
 
@@ -381,7 +593,19 @@ static bool vhost_svq_more_used(VhostShadowVirtqueue *svq)
  */
 static bool vhost_svq_enable_notification(VhostShadowVirtqueue *svq)
 {
-    if (virtio_vdev_has_feature(svq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (svq->packed) {
+        struct vring_packed_desc_event *event = svq->vring_packed.driver;
+
+        if (virtio_vdev_has_feature(svq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+            event->off_wrap = cpu_to_le16(svq->last_used_idx |
+                svq->used_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR);
+            /* The offset must be visible before the flags enable it */
+            smp_wmb();
+            event->flags = cpu_to_le16(VRING_PACKED_EVENT_FLAG_DESC);
+        } else {
+            event->flags = cpu_to_le16(VRING_PACKED_EVENT_FLAG_ENABLE);
+        }
+    } else if (virtio_vdev_has_feature(svq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         uint16_t *used_event = (uint16_t *)&svq->vring.avail->ring[svq->vring.num];
         *used_event = svq->shadow_used_idx;
     } else {
@@ -395,6 +619,12 @@ static bool vhost_svq_enable_notification(VhostShadowVirtqueue *svq)
 
 static void vhost_svq_disable_notification(VhostShadowVirtqueue *svq)
 {
+    if (svq->packed) {
+        svq->vring_packed.driver->flags =
+            cpu_to_le16(VRING_PACKED_EVENT_FLAG_DISABLE);
+        return;
+    }
+
     /*
      * No need to disable notification in the event idx case, since used event
      * index is already an index too far away.
@@ -414,6 +644,101 @@ static uint16_t vhost_svq_last_desc_of_chain(const VhostShadowVirtqueue *svq,
     return i;
 }
 
+/*
+ * With VIRTIO_F_IN_ORDER, descriptors are handed out in ring order and never
+ * relinked, so the chains are used in the order they were made available and
+ * the chain following @head starts right after its last descriptor.  The
+ * device may write a single used entry for a batch of chains: all chains up
+ * to the one it names are used, and only the last one has a length.
+ */
+static VirtQueueElement *vhost_svq_get_buf_in_order(VhostShadowVirtqueue *svq,
+                                                    uint32_t *len)
+{
+    const vring_used_t *used = svq->vring.used;
+    uint16_t last_used, head, num;
+
+    if (!svq->in_order_used_pending) {
+        uint32_t id;
+
+        if (!vhost_svq_more_used(svq)) {
+            return NULL;
+        }
+
+        /* Only get used array entries after they have been exposed by dev */
+        smp_rmb();
+        last_used = svq->last_used_idx & (svq->vring.num - 1);
+        id = le32_to_cpu(used->ring[last_used].id);
+        svq->last_used_idx++;
+        if (unlikely(id >= svq->vring.num || !svq->desc_state[id].ndescs)) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                "Device %s says index %u is used, but it was not available",
+                svq->vdev->name, id);
+            return NULL;
+        }
+
+        svq->in_order_used_id = id;
+        svq->in_order_used_len = le32_to_cpu(used->ring[last_used].len);
+        svq->in_order_used_pending = true;
+    }
+
+    head = svq->in_order_head;
+    num = svq->desc_state[head].ndescs;
+    if (unlikely(!num)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "Device %s used buffers out of order", svq->vdev->name);
+        svq->in_order_used_pending = false;
+        return NULL;
+    }
+
+    svq->desc_state[head].ndescs = 0;
+    svq->in_order_head = (head + num) % svq->vring.num;
+    svq->num_free += num;
+
+    if (head == svq->in_order_used_id) {
+        *len = svq->in_order_used_len;
+        svq->in_order_used_pending = false;
+    } else {
+        *len = 0;
+    }
+    return g_steal_pointer(&svq->desc_state[head].elem);
+}
+
+static VirtQueueElement *vhost_svq_get_buf_packed(VhostShadowVirtqueue *svq,
+                                                  uint32_t *len)
+{
+    const struct vring_packed_desc *desc;
+    uint16_t id, num;
+
+    if (!vhost_svq_more_used(svq)) {
+        return NULL;
+    }
+
+    /* Only get used descriptor fields after they have been exposed by dev */
+    smp_rmb();
+    desc = &svq->vring_packed.desc[svq->last_used_idx];
+    id = le16_to_cpu(desc->id);
+    if (unlikely(id >= svq->vring.num || !svq->desc_state[id].ndescs)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+            "Device %s says buffer id %u is used, but it was not available",
+            svq->vdev->name, id);
+        return NULL;
+    }
+
+    num = svq->desc_state[id].ndescs;
+    svq->desc_state[id].ndescs = 0;
+    svq->last_used_idx += num;
+    if (svq->last_used_idx >= svq->vring.num) {
+        svq->last_used_idx -= svq->vring.num;
+        svq->used_wrap_counter = !svq->used_wrap_counter;
+    }
+    svq->desc_next[id] = cpu_to_le16(svq->free_head);
+    svq->free_head = id;
+    svq->num_free += num;
+
+    *len = le32_to_cpu(desc->len);
+    return g_steal_pointer(&svq->desc_state[id].elem);
+}
+
 static VirtQueueElement *vhost_svq_get_buf(VhostShadowVirtqueue *svq,
                                            uint32_t *len)
 {
@@ -421,6 +746,14 @@ static VirtQueueElement *vhost_svq_get_buf(VhostShadowVirtqueue *svq,
     vring_used_elem_t used_elem;
     uint16_t last_used, last_used_chain, num;
 
+    if (svq->packed) {
+        return vhost_svq_get_buf_packed(svq, len);
+    }
+
+    if (svq->in_order) {
+        return vhost_svq_get_buf_in_order(svq, len);
+    }
+
     if (!vhost_svq_more_used(svq)) {
         return NULL;
     }
@@ -602,17 +935,32 @@ void vhost_svq_get_vring_addr(const VhostShadowVirtqueue *svq,
 
 size_t vhost_svq_driver_area_size(const VhostShadowVirtqueue *svq)
 {
-    size_t desc_size = sizeof(vring_desc_t) * svq->vring.num;
-    size_t avail_size = offsetof(vring_avail_t, ring[svq->vring.num]) +
-                                                              sizeof(uint16_t);
+    size_t desc_size, avail_size;
+
+    if (svq->packed) {
+        desc_size = sizeof(struct vring_packed_desc) * svq->vring.num;
+        return ROUND_UP(desc_size + sizeof(struct vring_packed_desc_event),
+                        qemu_real_host_page_size());
+    }
+
+    desc_size = sizeof(vring_desc_t) * svq->vring.num;
+    avail_size = offsetof(vring_avail_t, ring[svq->vring.num]) +
+                                                         sizeof(uint16_t);
 
     return ROUND_UP(desc_size + avail_size, qemu_real_host_page_size());
 }
 
 size_t vhost_svq_device_area_size(const VhostShadowVirtqueue *svq)
 {
-    size_t used_size = offsetof(vring_used_t, ring[svq->vring.num]) +
-                                                              sizeof(uint16_t);
+    size_t used_size;
+
+    if (svq->packed) {
+        return ROUND_UP(sizeof(struct vring_packed_desc_event),
+                        qemu_real_host_page_size());
+    }
+
+    used_size = offsetof(vring_used_t, ring[svq->vring.num]) +
+                                                    sizeof(uint16_t);
     return ROUND_UP(used_size, qemu_real_host_page_size());
 }
 
@@ -662,22 +1010,41 @@ void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
     event_notifier_set_handler(&svq->hdev_call, vhost_svq_handle_call);
     svq->next_guest_avail_elem = NULL;
     svq->shadow_avail_idx = 0;
+    svq->published_avail_idx = 0;
+    svq->avail_batch = false;
     svq->shadow_used_idx = 0;
     svq->last_used_idx = 0;
     svq->vdev = vdev;
     svq->vq = vq;
     svq->iova_tree = iova_tree;
+    svq->last_map_valid = false;
+    svq->packed = virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+    svq->in_order = virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER);
+    svq->free_head = 0;
+    svq->in_order_head = 0;
+    svq->in_order_used_pending = false;
+    svq->avail_wrap_counter = true;
+    svq->used_wrap_counter = true;
+    svq->avail_used_flags = 1 << VRING_PACKED_DESC_F_AVAIL;
+    svq->num_added = 0;
 
     svq->vring.num = virtio_queue_get_num(vdev, virtio_get_queue_index(vq));
     svq->num_free = svq->vring.num;
     svq->vring.desc = mmap(NULL, vhost_svq_driver_area_size(svq),
                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
                            -1, 0);
-    desc_size = sizeof(vring_desc_t) * svq->vring.num;
+    if (svq->packed) {
+        desc_size = sizeof(struct vring_packed_desc) * svq->vring.num;
+    } else {
+        desc_size = sizeof(vring_desc_t) * svq->vring.num;
+    }
     svq->vring.avail = (void *)((char *)svq->vring.desc + desc_size);
     svq->vring.used = mmap(NULL, vhost_svq_device_area_size(svq),
                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
                            -1, 0);
+    svq->vring_packed.desc = (void *)svq->vring.desc;
+    svq->vring_packed.driver = (void *)svq->vring.avail;
+    svq->vring_packed.device = (void *)svq->vring.used;
     svq->desc_state = g_new0(SVQDescState, svq->vring.num);
     svq->desc_next = g_new0(uint16_t, svq->vring.num);
     for (unsigned i = 0; i < svq->vring.num - 1; i++) {
@@ -48,9 +48,22 @@ typedef struct VhostShadowVirtqueueOps {
 
 /* Shadow virtqueue to relay notifications */
 typedef struct VhostShadowVirtqueue {
-    /* Shadow vring */
+    /*
+     * Shadow vring.  With a packed layout, desc, avail and used point to the
+     * descriptor ring, driver event area and device event area respectively.
+     */
     struct vring vring;
 
+    /* Packed layout views of the shadow vring areas */
+    struct {
+        struct vring_packed_desc *desc;
+        struct vring_packed_desc_event *driver;
+        struct vring_packed_desc_event *device;
+    } vring_packed;
+
+    /* Device and guest negotiated VIRTIO_F_RING_PACKED */
+    bool packed;
+
     /* Shadow kick notifier, sent to vhost */
     EventNotifier hdev_kick;
     /* Shadow call notifier, sent to vhost */
@@ -96,16 +109,52 @@ typedef struct VhostShadowVirtqueue {
     /* Caller callbacks opaque */
     void *ops_opaque;
 
-    /* Next head to expose to the device */
+    /*
+     * Next head to expose to the device.  For packed rings, the position of
+     * the next descriptor in the ring.
+     */
     uint16_t shadow_avail_idx;
 
-    /* Next free descriptor */
+    /* Packed: wrap counters and the avail/used flags of new descriptors */
+    bool avail_wrap_counter;
+    bool used_wrap_counter;
+    uint16_t avail_used_flags;
+
+    /* Packed: descriptors made available since the last kick check */
+    uint16_t num_added;
+
+    /* Avail idx last written to the device's avail ring */
+    uint16_t published_avail_idx;
+
+    /* Defer avail idx updates and kicks until the guest kick is handled */
+    bool avail_batch;
+
+    /* Device and guest negotiated VIRTIO_F_IN_ORDER */
+    bool in_order;
+
+    /* In order: head of the oldest chain not yet used by the device */
+    uint16_t in_order_head;
+
+    /* In order: a used entry that may cover several chains is pending */
+    bool in_order_used_pending;
+    uint16_t in_order_used_id;
+    uint32_t in_order_used_len;
+
+    /* Last IOVA mapping hit and the tree generation it is valid for */
+    DMAMap last_map;
+    uint64_t last_map_generation;
+    bool last_map_valid;
+
+    /* Next free descriptor, or next free buffer id for packed rings */
     uint16_t free_head;
 
     /* Last seen used idx */
     uint16_t shadow_used_idx;
 
-    /* Next head to consume from the device */
+    /*
+     * Next head to consume from the device.  For packed rings, the position
+     * of the next used descriptor in the ring.
+     */
     uint16_t last_used_idx;
 
     /* Size of SVQ vring free descriptors */
@@ -15,6 +15,8 @@
 #include "hw/qdev-properties.h"
 #include "hw/virtio/vhost-user-fs.h"
 #include "hw/virtio/virtio-pci.h"
+#include "qapi/error.h"
+#include "standard-headers/linux/virtio_fs.h"
 #include "qom/object.h"
 
 struct VHostUserFSPCI {
@@ -26,6 +28,9 @@ typedef struct VHostUserFSPCI VHostUserFSPCI;
 
 #define TYPE_VHOST_USER_FS_PCI "vhost-user-fs-pci-base"
 
+/* Replaces the modern io bar, which must then stay disabled */
+#define VIRTIO_FS_PCI_CACHE_BAR 2
+
 DECLARE_INSTANCE_CHECKER(VHostUserFSPCI, VHOST_USER_FS_PCI,
                          TYPE_VHOST_USER_FS_PCI)
 
@@ -40,12 +45,32 @@ static void vhost_user_fs_pci_realize(VirtIOPCIProxy *vpci_dev, Error **errp)
     VHostUserFSPCI *dev = VHOST_USER_FS_PCI(vpci_dev);
     DeviceState *vdev = DEVICE(&dev->vdev);
 
+    uint64_t cache_size = dev->vdev.conf.cache_size;
+
     if (vpci_dev->nvectors == DEV_NVECTORS_UNSPECIFIED) {
         /* Also reserve config change and hiprio queue vectors */
         vpci_dev->nvectors = dev->vdev.conf.num_request_queues + 2;
     }
 
-    qdev_realize(vdev, BUS(&vpci_dev->bus), errp);
+    if (cache_size &&
+        (vpci_dev->flags & VIRTIO_PCI_FLAG_MODERN_PIO_NOTIFY)) {
+        error_setg(errp, "cache-size cannot be used with modern-pio-notify");
+        return;
+    }
+
+    if (!qdev_realize(vdev, BUS(&vpci_dev->bus), errp)) {
+        return;
+    }
+
+    if (cache_size) {
+        pci_register_bar(&vpci_dev->pci_dev, VIRTIO_FS_PCI_CACHE_BAR,
+                         PCI_BASE_ADDRESS_SPACE_MEMORY |
+                         PCI_BASE_ADDRESS_MEM_PREFETCH |
+                         PCI_BASE_ADDRESS_MEM_TYPE_64,
+                         &dev->vdev.cache);
+        virtio_pci_add_shm_cap(vpci_dev, VIRTIO_FS_PCI_CACHE_BAR, 0,
+                               cache_size, VIRTIO_FS_SHMCAP_ID_CACHE);
+    }
 }
 
 static void vhost_user_fs_pci_class_init(ObjectClass *klass, void *data)
@@ -22,8 +22,10 @@
 #include "qemu/error-report.h"
 #include "hw/virtio/vhost.h"
 #include "hw/virtio/vhost-user-fs.h"
+#include "migration/blocker.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
+#include "trace.h"
 
 static const int user_feature_bits[] = {
     VIRTIO_F_VERSION_1,
@@ -37,6 +39,156 @@ static const int user_feature_bits[] = {
     VHOST_INVALID_FEATURE_BIT
 };
 
+static bool vuf_cache_range_valid(VHostUserFS *fs, uint64_t offset,
+                                  uint64_t len)
+{
+    return len <= fs->conf.cache_size &&
+           offset <= fs->conf.cache_size - len &&
+           QEMU_IS_ALIGNED(offset, qemu_real_host_page_size());
+}
+
+/* Replace a range of the DAX window with inaccessible anonymous memory */
+static int vuf_cache_unmap(VHostUserFS *fs, uint64_t offset, uint64_t len)
+{
+    void *ptr = memory_region_get_ram_ptr(&fs->cache) + offset;
+
+    if (mmap(ptr, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+             -1, 0) != ptr) {
+        return -errno;
+    }
+    return 0;
+}
+
+static VHostUserFS *vuf_from_vhost_dev(struct vhost_dev *dev)
+{
+    VHostUserFS *fs;
+
+    if (!dev->vdev) {
+        return NULL;
+    }
+    fs = (VHostUserFS *)object_dynamic_cast(OBJECT(dev->vdev),
+                                            TYPE_VHOST_USER_FS);
+    if (!fs || !fs->conf.cache_size) {
+        return NULL;
+    }
+    return fs;
+}
+
+int vhost_user_fs_backend_map(struct vhost_dev *dev, int message_size,
+                              VhostUserFSBackendMsg *sm, int fd)
+{
+    VHostUserFS *fs = vuf_from_vhost_dev(dev);
+    void *cache_host;
+    int ret = 0;
+    int i, j;
+
+    if (!fs) {
+        error_report("vhost-user-fs: map request without a DAX window");
+        return -EINVAL;
+    }
+    if (message_size != sizeof(*sm)) {
+        error_report("vhost-user-fs: bad map request size %d", message_size);
+        return -EINVAL;
+    }
+    if (fd < 0) {
+        error_report("vhost-user-fs: map request without a file descriptor");
+        return -EBADF;
+    }
+
+    cache_host = memory_region_get_ram_ptr(&fs->cache);
+    for (i = 0; i < VHOST_USER_FS_BACKEND_ENTRIES; i++) {
+        int prot = 0;
+        void *ptr;
+
+        if (!sm->len[i]) {
+            continue;
+        }
+        if (!vuf_cache_range_valid(fs, sm->c_offset[i], sm->len[i])) {
+            error_report("vhost-user-fs: bad map range 0x%" PRIx64
+                         "+0x%" PRIx64, sm->c_offset[i], sm->len[i]);
+            ret = -EINVAL;
+            break;
+        }
+
+        if (sm->flags[i] & VHOST_USER_FS_FLAG_MAP_R) {
+            prot |= PROT_READ;
+        }
+        if (sm->flags[i] & VHOST_USER_FS_FLAG_MAP_W) {
+            prot |= PROT_WRITE;
+        }
+        ptr = mmap(cache_host + sm->c_offset[i], sm->len[i], prot,
+                   MAP_SHARED | MAP_FIXED, fd, sm->fd_offset[i]);
+        if (ptr != cache_host + sm->c_offset[i]) {
+            ret = -errno;
+            error_report("vhost-user-fs: map of 0x%" PRIx64 "+0x%" PRIx64
+                         " failed: %s", sm->c_offset[i], sm->len[i],
+                         strerror(errno));
+            break;
+        }
+        trace_vhost_user_fs_backend_map(sm->c_offset[i], sm->len[i],
+                                        sm->fd_offset[i], sm->flags[i]);
+    }
+
+    if (ret < 0) {
+        /* Don't leave a partially applied request behind */
+        for (j = 0; j < i; j++) {
+            if (sm->len[j]) {
+                vuf_cache_unmap(fs, sm->c_offset[j], sm->len[j]);
+            }
+        }
+    }
+    return ret;
+}
+
+int vhost_user_fs_backend_unmap(struct vhost_dev *dev, int message_size,
+                                VhostUserFSBackendMsg *sm)
+{
+    VHostUserFS *fs = vuf_from_vhost_dev(dev);
+    int ret = 0;
+    int i;
+
+    if (!fs) {
+        error_report("vhost-user-fs: unmap request without a DAX window");
+        return -EINVAL;
+    }
+    if (message_size != sizeof(*sm)) {
+        error_report("vhost-user-fs: bad unmap request size %d", message_size);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < VHOST_USER_FS_BACKEND_ENTRIES; i++) {
+        uint64_t offset = sm->c_offset[i];
+        uint64_t len = sm->len[i];
+        int r;
+
+        if (!len) {
+            continue;
+        }
+        /* A length of all ones stands for the whole window */
+        if (len == ~(uint64_t)0) {
+            offset = 0;
+            len = fs->conf.cache_size;
+        }
+        if (!vuf_cache_range_valid(fs, offset, len)) {
+            error_report("vhost-user-fs: bad unmap range 0x%" PRIx64
+                         "+0x%" PRIx64, offset, len);
+            ret = -EINVAL;
+            continue;
+        }
+
+        /* Carry on with the other entries even if one fails */
+        r = vuf_cache_unmap(fs, offset, len);
+        if (r < 0) {
+            error_report("vhost-user-fs: unmap of 0x%" PRIx64 "+0x%" PRIx64
+                         " failed: %s", offset, len, strerror(-r));
+            ret = r;
+            continue;
+        }
+        trace_vhost_user_fs_backend_unmap(offset, len);
+    }
+    return ret;
+}
+
 static void vuf_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VHostUserFS *fs = VHOST_USER_FS(vdev);
@@ -112,6 +264,14 @@ static void vuf_stop(VirtIODevice *vdev)
 
     vhost_dev_stop(&fs->vhost_dev, vdev, true);
 
+    /* The next driver must not find the previous mappings in the window */
+    if (fs->conf.cache_size) {
+        ret = vuf_cache_unmap(fs, 0, fs->conf.cache_size);
+        if (ret < 0) {
+            error_report("Error clearing the DAX window: %s", strerror(-ret));
+        }
+    }
+
     ret = k->set_guest_notifiers(qbus->parent, fs->vhost_dev.nvqs, false);
     if (ret < 0) {
         error_report("vhost guest notifier cleanup failed: %d", ret);
@@ -187,6 +347,16 @@ static bool vuf_guest_notifier_pending(VirtIODevice *vdev, int idx)
     return vhost_virtqueue_pending(&fs->vhost_dev, idx);
 }
 
+static void vuf_cache_cleanup(VHostUserFS *fs)
+{
+    if (!fs->conf.cache_size) {
+        return;
+    }
+    munmap(memory_region_get_ram_ptr(&fs->cache), fs->conf.cache_size);
+    object_unparent(OBJECT(&fs->cache));
+    migrate_del_blocker(&fs->migration_blocker);
+}
+
 static void vuf_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -231,8 +401,42 @@ static void vuf_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (fs->conf.cache_size) {
+        void *cache_ptr;
+
+        if (!is_power_of_2(fs->conf.cache_size) ||
+            fs->conf.cache_size < qemu_real_host_page_size()) {
+            error_setg(errp, "cache-size property must be a power of 2 "
+                       "no smaller than the page size");
+            return;
+        }
+
+        /*
+         * The mappings set up by the back-end live in QEMU's address space
+         * and are neither migrated nor re-created on the destination.
+         */
+        error_setg(&fs->migration_blocker,
+                   "vhost-user-fs with a DAX window does not support "
+                   "migration");
+        if (migrate_add_blocker(&fs->migration_blocker, errp) < 0) {
+            return;
+        }
+
+        /* Reserve the address space; the back-end maps files into it */
+        cache_ptr = mmap(NULL, fs->conf.cache_size, PROT_NONE,
+                         MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (cache_ptr == MAP_FAILED) {
+            error_setg_errno(errp, errno, "Unable to reserve the DAX window");
+            migrate_del_blocker(&fs->migration_blocker);
+            return;
+        }
+        memory_region_init_ram_device_ptr(&fs->cache, OBJECT(vdev),
+                                          "virtio-fs-cache",
+                                          fs->conf.cache_size, cache_ptr);
+    }
+
     if (!vhost_user_init(&fs->vhost_user, &fs->conf.chardev, errp)) {
-        return;
+        goto err_cache;
     }
 
     virtio_init(vdev, VIRTIO_ID_FS, sizeof(struct virtio_fs_config));
@@ -266,6 +470,8 @@ err_virtio:
     g_free(fs->req_vqs);
     virtio_cleanup(vdev);
     g_free(fs->vhost_dev.vqs);
+err_cache:
+    vuf_cache_cleanup(fs);
     return;
 }
 
@@ -290,6 +496,7 @@ static void vuf_device_unrealize(DeviceState *dev)
     g_free(fs->req_vqs);
     virtio_cleanup(vdev);
     g_free(vhost_vqs);
+    vuf_cache_cleanup(fs);
 }
 
 static struct vhost_dev *vuf_get_vhost(VirtIODevice *vdev)
@@ -408,6 +615,7 @@ static Property vuf_properties[] = {
     DEFINE_PROP_UINT16("num-request-queues", VHostUserFS,
                        conf.num_request_queues, 1),
     DEFINE_PROP_UINT16("queue-size", VHostUserFS, conf.queue_size, 128),
+    DEFINE_PROP_SIZE("cache-size", VHostUserFS, conf.cache_size, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
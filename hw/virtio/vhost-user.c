@@ -17,6 +17,7 @@
 #include "hw/virtio/vhost-backend.h"
 #include "hw/virtio/virtio.h"
 #include "hw/virtio/virtio-net.h"
+#include "hw/virtio/vhost-user-fs.h"
 #include "chardev/char-fe.h"
 #include "io/channel-socket.h"
 #include "sysemu/kvm.h"
@@ -35,6 +36,7 @@
 #include <sys/un.h>
 
 #include "standard-headers/linux/vhost_types.h"
+#include CONFIG_DEVICES
 
 #ifdef CONFIG_LINUX
 #include <linux/userfaultfd.h>
@@ -115,6 +117,8 @@ typedef enum VhostUserBackendRequest {
     VHOST_USER_BACKEND_SHARED_OBJECT_ADD = 6,
     VHOST_USER_BACKEND_SHARED_OBJECT_REMOVE = 7,
     VHOST_USER_BACKEND_SHARED_OBJECT_LOOKUP = 8,
+    VHOST_USER_BACKEND_FS_MAP = 9,
+    VHOST_USER_BACKEND_FS_UNMAP = 10,
     VHOST_USER_BACKEND_MAX
 }  VhostUserBackendRequest;
 
@@ -224,6 +228,7 @@ typedef union {
         VhostUserInflight inflight;
         VhostUserShared object;
         VhostUserTransferDeviceState transfer_state;
+        VhostUserFSBackendMsg fs;
 } VhostUserPayload;
 
 typedef struct VhostUserMsg {
@@ -657,6 +662,12 @@ static void scrub_shadow_regions(struct vhost_dev *dev,
     return;
 }
 
+/*
+ * All VHOST_USER_REM_MEM_REG messages are sent before the first reply is
+ * read, so that a memory unplug costs one round trip instead of one per
+ * region.  Replies come back in order; a region stays in the shadow table
+ * unless the backend acknowledged its removal.
+ */
 static int send_remove_regions(struct vhost_dev *dev,
                                struct scrub_regions *remove_reg,
                                int nr_rem_reg, VhostUserMsg *msg,
@@ -664,10 +675,13 @@ static int send_remove_regions(struct vhost_dev *dev,
 {
     struct vhost_user *u = dev->opaque;
     struct vhost_memory_region *shadow_reg;
-    int i, fd, shadow_reg_idx, ret;
+    bool sent[VHOST_USER_MAX_RAM_SLOTS] = {};
+    int i, fd, shadow_reg_idx, ret, err = 0;
     ram_addr_t offset;
     VhostUserMemoryRegion region_buffer;
 
+    msg->hdr.request = VHOST_USER_REM_MEM_REG;
+
     /*
      * The regions in remove_reg appear in the same order they do in the
      * shadow table. Therefore we can minimize memory copies by iterating
@@ -675,12 +689,10 @@ static int send_remove_regions(struct vhost_dev *dev,
      */
     for (i = nr_rem_reg - 1; i >= 0; i--) {
         shadow_reg = remove_reg[i].region;
-        shadow_reg_idx = remove_reg[i].reg_idx;
 
         vhost_user_get_mr_data(shadow_reg->userspace_addr, &offset, &fd);
 
         if (fd > 0) {
-            msg->hdr.request = VHOST_USER_REM_MEM_REG;
             vhost_user_fill_msg_region(&region_buffer, shadow_reg, 0);
             msg->payload.mem_reg.region = region_buffer;
 
@@ -688,12 +700,18 @@ static int send_remove_regions(struct vhost_dev *dev,
             if (ret < 0) {
                 return ret;
             }
+            sent[i] = true;
+        }
+    }
 
-            if (reply_supported) {
-                ret = process_message_reply(dev, msg);
-                if (ret) {
-                    return ret;
-                }
+    for (i = nr_rem_reg - 1; i >= 0; i--) {
+        shadow_reg_idx = remove_reg[i].reg_idx;
+
+        if (sent[i] && reply_supported) {
+            ret = process_message_reply(dev, msg);
+            if (ret) {
+                err = err ?: ret;
+                continue;
             }
         }
 
@@ -708,7 +726,19 @@ static int send_remove_regions(struct vhost_dev *dev,
         u->num_shadow_regions--;
     }
 
-    return 0;
+    return err;
+}
+
+static void vhost_user_shadow_add(struct vhost_user *u,
+                                  struct vhost_memory_region *reg)
+{
+    u->shadow_regions[u->num_shadow_regions].guest_phys_addr =
+        reg->guest_phys_addr;
+    u->shadow_regions[u->num_shadow_regions].userspace_addr =
+        reg->userspace_addr;
+    u->shadow_regions[u->num_shadow_regions].memory_size =
+        reg->memory_size;
+    u->num_shadow_regions++;
 }
 
 static int send_add_regions(struct vhost_dev *dev,
@@ -717,7 +747,8 @@ static int send_add_regions(struct vhost_dev *dev,
                             bool reply_supported, bool track_ramblocks)
 {
     struct vhost_user *u = dev->opaque;
-    int i, fd, ret, reg_idx, reg_fd_idx;
+    bool pending[VHOST_USER_MAX_RAM_SLOTS] = {};
+    int i, fd, ret, reg_idx, reg_fd_idx, err = 0;
     struct vhost_memory_region *reg;
     MemoryRegion *mr;
     ram_addr_t offset;
@@ -795,10 +826,9 @@ static int send_add_regions(struct vhost_dev *dev,
                     return -EPROTO;
                 }
             } else if (reply_supported) {
-                ret = process_message_reply(dev, msg);
-                if (ret) {
-                    return ret;
-                }
+                /* Collected below, once all regions have been sent */
+                pending[i] = true;
+                continue;
             }
         } else if (track_ramblocks) {
             u->region_rb_offset[reg_idx] = 0;
@@ -811,16 +841,23 @@ static int send_add_regions(struct vhost_dev *dev,
          *
          * The region should now be added to the shadow table.
          */
-        u->shadow_regions[u->num_shadow_regions].guest_phys_addr =
-            reg->guest_phys_addr;
-        u->shadow_regions[u->num_shadow_regions].userspace_addr =
-            reg->userspace_addr;
-        u->shadow_regions[u->num_shadow_regions].memory_size =
-            reg->memory_size;
-        u->num_shadow_regions++;
+        vhost_user_shadow_add(u, reg);
     }
 
-    return 0;
+    for (i = 0; i < nr_add_reg; i++) {
+        if (!pending[i]) {
+            continue;
+        }
+
+        ret = process_message_reply(dev, msg);
+        if (ret) {
+            err = err ?: ret;
+            continue;
+        }
+        vhost_user_shadow_add(u, add_reg[i].region);
+    }
+
+    return err;
 }
 
 static int vhost_user_add_remove_regions(struct vhost_dev *dev,
@@ -1215,18 +1252,27 @@ static int vhost_user_set_vring_base(struct vhost_dev *dev,
 
 static int vhost_user_set_vring_enable(struct vhost_dev *dev, int enable)
 {
-    int i;
+    bool reply_supported = virtio_has_feature(dev->protocol_features,
+                                              VHOST_USER_PROTOCOL_F_REPLY_ACK);
+    VhostUserMsg msg = {
+        .hdr.request = VHOST_USER_SET_VRING_ENABLE,
+        .hdr.flags = VHOST_USER_VERSION,
+        .hdr.size = sizeof(msg.payload.state),
+    };
+    uint64_t dummy;
+    int i, ret, err = 0;
 
     if (!virtio_has_feature(dev->features, VHOST_USER_F_PROTOCOL_FEATURES)) {
         return -EINVAL;
     }
 
+    if (reply_supported) {
+        msg.hdr.flags |= VHOST_USER_NEED_REPLY_MASK;
+    }
+
     for (i = 0; i < dev->nvqs; ++i) {
-        int ret;
-        struct vhost_vring_state state = {
-            .index = dev->vq_index + i,
-            .num   = enable,
-        };
+        msg.payload.state.index = dev->vq_index + i;
+        msg.payload.state.num = enable;
 
         /*
          * SET_VRING_ENABLE travels from guest to QEMU to vhost-user backend /
@@ -1239,10 +1285,11 @@ static int vhost_user_set_vring_enable(struct vhost_dev *dev, int enable)
          * data plane thread to discard the virtio request (it arrived on a
          * seemingly disabled queue). To prevent this out-of-order delivery,
          * don't let the guest proceed to pushing the virtio request until the
-         * backend control plane acknowledges enabling the queue -- IOW, pass
-         * wait_for_reply=true below.
+         * backend control plane acknowledges enabling the queue -- IOW,
+         * wait for the replies below.  All queues are sent first so that
+         * starting a device costs one round trip instead of one per queue.
          */
-        ret = vhost_set_vring(dev, VHOST_USER_SET_VRING_ENABLE, &state, true);
+        ret = vhost_user_write(dev, &msg, NULL, 0);
         if (ret < 0) {
             /*
              * Restoring the previous state is likely infeasible, as well as
@@ -1253,7 +1300,18 @@ static int vhost_user_set_vring_enable(struct vhost_dev *dev, int enable)
         }
     }
 
-    return 0;
+    if (!reply_supported) {
+        /* Backends reply to VHOST_USER_GET_FEATURES in any case */
+        return vhost_user_get_features(dev, &dummy);
+    }
+
+    /* Keep reading after an error so that no reply is left behind */
+    for (i = 0; i < dev->nvqs; ++i) {
+        ret = process_message_reply(dev, &msg);
+        err = err ?: ret;
+    }
+
+    return err;
 }
 
 static VhostUserHostNotifier *fetch_notifier(VhostUserState *u,
@@ -1816,6 +1874,15 @@ static gboolean backend_read(QIOChannel *ioc, GIOCondition condition,
         ret = vhost_user_backend_handle_shared_object_lookup(dev->opaque, ioc,
                                                              &hdr, &payload);
         break;
+#ifdef CONFIG_VHOST_USER_FS
+    case VHOST_USER_BACKEND_FS_MAP:
+        ret = vhost_user_fs_backend_map(dev, hdr.size, &payload.fs,
+                                        fd ? fd[0] : -1);
+        break;
+    case VHOST_USER_BACKEND_FS_UNMAP:
+        ret = vhost_user_fs_backend_unmap(dev, hdr.size, &payload.fs);
+        break;
+#endif
     default:
         error_report("Received unexpected msg type: %d.", hdr.request);
         ret = -EINVAL;
@@ -2639,6 +2706,15 @@ static bool vhost_user_no_private_memslots(struct vhost_dev *dev)
     return true;
 }
 
+/*
+ * Devices made of several vhost_devs, like vhost-user-net with one per
+ * queue pair, share a single inflight region covering all their queues.
+ */
+static uint16_t vhost_user_inflight_num_queues(struct vhost_dev *dev)
+{
+    return MAX(dev->nvqs, dev->vq_index_end - dev->vq_index);
+}
+
 static int vhost_user_get_inflight_fd(struct vhost_dev *dev,
                                       uint16_t queue_size,
                                       struct vhost_inflight *inflight)
@@ -2651,7 +2727,7 @@ static int vhost_user_get_inflight_fd(struct vhost_dev *dev,
     VhostUserMsg msg = {
         .hdr.request = VHOST_USER_GET_INFLIGHT_FD,
         .hdr.flags = VHOST_USER_VERSION,
-        .payload.inflight.num_queues = dev->nvqs,
+        .payload.inflight.num_queues = vhost_user_inflight_num_queues(dev),
         .payload.inflight.queue_size = queue_size,
         .hdr.size = sizeof(msg.payload.inflight),
     };
@@ -2719,7 +2795,7 @@ static int vhost_user_set_inflight_fd(struct vhost_dev *dev,
         .hdr.flags = VHOST_USER_VERSION,
         .payload.inflight.mmap_size = inflight->size,
         .payload.inflight.mmap_offset = inflight->offset,
-        .payload.inflight.num_queues = dev->nvqs,
+        .payload.inflight.num_queues = vhost_user_inflight_num_queues(dev),
         .payload.inflight.queue_size = inflight->queue_size,
         .hdr.size = sizeof(msg.payload.inflight),
     };
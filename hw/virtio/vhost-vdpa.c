@@ -173,9 +173,8 @@ static void vhost_vdpa_iotlb_batch_begin_once(VhostVDPAShared *s)
     s->iotlb_batch_begin_sent = true;
 }
 
-static void vhost_vdpa_listener_commit(MemoryListener *listener)
+static void vhost_vdpa_iotlb_batch_end_once(VhostVDPAShared *s)
 {
-    VhostVDPAShared *s = container_of(listener, VhostVDPAShared, listener);
     struct vhost_msg_v2 msg = {};
     int fd = s->device_fd;
 
@@ -199,6 +198,13 @@ static void vhost_vdpa_listener_commit(MemoryListener *listener)
     s->iotlb_batch_begin_sent = false;
 }
 
+static void vhost_vdpa_listener_commit(MemoryListener *listener)
+{
+    VhostVDPAShared *s = container_of(listener, VhostVDPAShared, listener);
+
+    vhost_vdpa_iotlb_batch_end_once(s);
+}
+
 static void vhost_vdpa_iommu_map_notify(IOMMUNotifier *n, IOMMUTLBEntry *iotlb)
 {
     struct vdpa_iommu *iommu = container_of(n, struct vdpa_iommu, n);
@@ -760,6 +766,7 @@ static int vhost_vdpa_cleanup(struct vhost_dev *dev)
     if (vhost_vdpa_first_dev(dev)) {
         ram_block_discard_disable(false);
         memory_listener_unregister(&v->shared->listener);
+        v->shared->listener_registered = false;
     }
 
     vhost_vdpa_host_notifiers_uninit(dev, dev->nvqs);
@@ -845,7 +852,8 @@ static int vhost_vdpa_set_backend_cap(struct vhost_dev *dev)
     uint64_t f = 0x1ULL << VHOST_BACKEND_F_IOTLB_MSG_V2 |
         0x1ULL << VHOST_BACKEND_F_IOTLB_BATCH |
         0x1ULL << VHOST_BACKEND_F_IOTLB_ASID |
-        0x1ULL << VHOST_BACKEND_F_SUSPEND;
+        0x1ULL << VHOST_BACKEND_F_SUSPEND |
+        0x1ULL << VHOST_BACKEND_F_IOTLB_PERSIST;
     int r;
 
     if (vhost_vdpa_call(dev, VHOST_GET_BACKEND_FEATURES, &features)) {
@@ -1225,6 +1233,11 @@ static bool vhost_vdpa_svq_setup(struct vhost_dev *dev,
     };
     int r;
 
+    if (virtio_vdev_has_feature(dev->vdev, VIRTIO_F_RING_PACKED)) {
+        /* Both wrap counters start set, as on a freshly reset packed ring */
+        s.num = 1 << 15 | 1U << 31;
+    }
+
     r = vhost_vdpa_set_dev_vring_base(dev, &s);
     if (unlikely(r)) {
         error_setg_errno(errp, -r, "Cannot set vring base");
@@ -1245,6 +1258,8 @@ static bool vhost_vdpa_svqs_start(struct vhost_dev *dev)
         return true;
     }
 
+    /* Map all the rings in one IOTLB batch */
+    vhost_vdpa_iotlb_batch_begin_once(v->shared);
     for (i = 0; i < v->shadow_vqs->len; ++i) {
         VirtQueue *vq = virtio_get_queue(dev->vdev, dev->vq_index + i);
         VhostShadowVirtqueue *svq = g_ptr_array_index(v->shadow_vqs, i);
@@ -1270,6 +1285,7 @@ static bool vhost_vdpa_svqs_start(struct vhost_dev *dev)
             goto err_set_addr;
         }
     }
+    vhost_vdpa_iotlb_batch_end_once(v->shared);
 
     return true;
 
@@ -1286,6 +1302,7 @@ err:
         vhost_vdpa_svq_unmap_rings(dev, svq);
         vhost_svq_stop(svq);
     }
+    vhost_vdpa_iotlb_batch_end_once(v->shared);
 
     return false;
 }
@@ -1298,6 +1315,7 @@ static void vhost_vdpa_svqs_stop(struct vhost_dev *dev)
         return;
     }
 
+    vhost_vdpa_iotlb_batch_begin_once(v->shared);
     for (unsigned i = 0; i < v->shadow_vqs->len; ++i) {
         VhostShadowVirtqueue *svq = g_ptr_array_index(v->shadow_vqs, i);
 
@@ -1307,6 +1325,7 @@ static void vhost_vdpa_svqs_stop(struct vhost_dev *dev)
         event_notifier_cleanup(&svq->hdev_kick);
         event_notifier_cleanup(&svq->hdev_call);
     }
+    vhost_vdpa_iotlb_batch_end_once(v->shared);
 }
 
 static void vhost_vdpa_suspend(struct vhost_dev *dev)
@@ -1360,7 +1379,21 @@ static int vhost_vdpa_dev_start(struct vhost_dev *dev, bool started)
                          "IOMMU and try again");
             return -1;
         }
-        memory_listener_register(&v->shared->listener, dev->vdev->dma_as);
+        if (v->shared->listener_registered && v->shared->shadow_data) {
+            /*
+             * Only guest physical mappings are kept across reset, drop
+             * them in the mode they were created in before switching to
+             * shadow virtqueue addresses.
+             */
+            v->shared->shadow_data = false;
+            memory_listener_unregister(&v->shared->listener);
+            v->shared->shadow_data = true;
+            v->shared->listener_registered = false;
+        }
+        if (!v->shared->listener_registered) {
+            memory_listener_register(&v->shared->listener, dev->vdev->dma_as);
+            v->shared->listener_registered = true;
+        }
 
         return vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_DRIVER_OK);
     }
@@ -1379,7 +1412,19 @@ static void vhost_vdpa_reset_status(struct vhost_dev *dev)
     vhost_vdpa_reset_device(dev);
     vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_ACKNOWLEDGE |
                                VIRTIO_CONFIG_S_DRIVER);
+
+    /*
+     * Keep the guest mappings if the device preserves them, so that the
+     * next start does not have to map the whole guest again.  Shadow
+     * virtqueue mappings depend on the IOVA tree, which is freed on stop.
+     */
+    if ((v->shared->backend_cap & BIT_ULL(VHOST_BACKEND_F_IOTLB_PERSIST)) &&
+        !v->shared->shadow_data) {
+        trace_vhost_vdpa_reset_status_keep_maps(dev);
+        return;
+    }
     memory_listener_unregister(&v->shared->listener);
+    v->shared->listener_registered = false;
 }
 
 static int vhost_vdpa_set_log_base(struct vhost_dev *dev, uint64_t base,
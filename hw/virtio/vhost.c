@@ -554,6 +554,7 @@ static void vhost_begin(MemoryListener *listener)
                                          memory_listener);
     dev->tmp_sections = NULL;
     dev->n_tmp_sections = 0;
+    dev->n_tmp_sections_alloc = 0;
 }
 
 static void vhost_commit(MemoryListener *listener)
@@ -565,7 +566,8 @@ static void vhost_commit(MemoryListener *listener)
     uint64_t log_size;
     size_t regions_size;
     int r;
-    int i;
+    int i, j;
+    int n_kept = 0;
     bool changed = false;
 
     /* Note we can be called before the device is started, but then
@@ -608,7 +610,13 @@ static void vhost_commit(MemoryListener *listener)
         used_memslots = dev->mem->nregions;
     }
 
-    for (i = 0; i < dev->n_mem_sections; i++) {
+    /*
+     * Both lists are sorted by guest physical address, so walk them side
+     * by side to find the sections that are new in this transaction.
+     * Sections that were already mapped have had their ring mappings
+     * verified before and are left alone.
+     */
+    for (i = 0, j = 0; i < dev->n_mem_sections; i++) {
         struct vhost_memory_region *cur_vmr = dev->mem->regions + i;
         struct MemoryRegionSection *mrs = dev->mem_sections + i;
 
@@ -618,21 +626,36 @@ static void vhost_commit(MemoryListener *listener)
             (uintptr_t)memory_region_get_ram_ptr(mrs->mr) +
             mrs->offset_within_region;
         cur_vmr->flags_padding   = 0;
-    }
 
-    if (!dev->started) {
-        goto out;
-    }
+        while (j < n_old_sections &&
+               old_sections[j].offset_within_address_space <
+               mrs->offset_within_address_space) {
+            j++;
+        }
+        if (j < n_old_sections &&
+            MemoryRegionSection_eq(&old_sections[j], mrs)) {
+            n_kept++;
+            j++;
+            continue;
+        }
 
-    for (i = 0; i < dev->mem->nregions; i++) {
-        if (vhost_verify_ring_mappings(dev,
-                       (void *)(uintptr_t)dev->mem->regions[i].userspace_addr,
-                       dev->mem->regions[i].guest_phys_addr,
-                       dev->mem->regions[i].memory_size)) {
+        trace_vhost_commit_add_region(cur_vmr->guest_phys_addr,
+                                      cur_vmr->memory_size,
+                                      cur_vmr->userspace_addr);
+        if (dev->started &&
+            vhost_verify_ring_mappings(dev,
+                           (void *)(uintptr_t)cur_vmr->userspace_addr,
+                           cur_vmr->guest_phys_addr, cur_vmr->memory_size)) {
             error_report("Verify ring failure on region %d", i);
             abort();
         }
     }
+    trace_vhost_commit_diff(dev->n_mem_sections - n_kept,
+                            n_old_sections - n_kept);
+
+    if (!dev->started) {
+        goto out;
+    }
 
     if (!dev->log_enabled) {
         r = dev->vhost_ops->vhost_set_mem_table(dev, dev->mem);
@@ -770,8 +793,14 @@ static void vhost_region_add_section(struct vhost_dev *dev,
 
     if (need_add) {
         ++dev->n_tmp_sections;
-        dev->tmp_sections = g_renew(MemoryRegionSection, dev->tmp_sections,
-                                    dev->n_tmp_sections);
+        if (dev->n_tmp_sections > dev->n_tmp_sections_alloc) {
+            /* Grow geometrically, a transaction can add many sections */
+            dev->n_tmp_sections_alloc = MAX(dev->n_tmp_sections_alloc * 2,
+                                            16);
+            dev->tmp_sections = g_renew(MemoryRegionSection,
+                                        dev->tmp_sections,
+                                        dev->n_tmp_sections_alloc);
+        }
         dev->tmp_sections[dev->n_tmp_sections - 1] = *section;
         /* The flatview isn't stable and we don't use it, making it NULL
          * means we can memcmp the list.
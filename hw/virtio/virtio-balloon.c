@@ -323,12 +323,58 @@ static void balloon_stats_set_poll_interval(Object *obj, Visitor *v,
     balloon_stats_change_timer(s, 0);
 }
 
+typedef struct ReportedRange {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    size_t size;
+} ReportedRange;
+
+static gint reported_range_compare(gconstpointer a, gconstpointer b)
+{
+    const ReportedRange *ra = a, *rb = b;
+
+    if (ra->rb != rb->rb) {
+        return (uintptr_t)ra->rb < (uintptr_t)rb->rb ? -1 : 1;
+    }
+    if (ra->offset != rb->offset) {
+        return ra->offset < rb->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Discard all host pages that are completely covered by @range.  Reported
+ * pages are usually smaller than huge host pages, so this only frees memory
+ * once adjacent reports have been merged into @range.
+ */
+static void virtio_balloon_discard_reported(VirtIOBalloon *dev,
+                                            const ReportedRange *range)
+{
+    const size_t page_size = qemu_ram_pagesize(range->rb);
+    ram_addr_t start = QEMU_ALIGN_UP(range->offset, page_size);
+    ram_addr_t end = MIN(range->offset + range->size,
+                         qemu_ram_get_used_length(range->rb));
+
+    end = QEMU_ALIGN_DOWN(end, page_size);
+    trace_virtio_balloon_discard_reported(qemu_ram_get_idstr(range->rb),
+                                          range->offset, range->size,
+                                          start < end ? end - start : 0);
+    if (start >= end) {
+        return;
+    }
+    if (!ram_block_discard_range(range->rb, start, end - start)) {
+        dev->reporting_discarded_bytes += end - start;
+    }
+}
+
 static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
     VirtQueueElement *elem;
 
     while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        g_autoptr(GArray) ranges = NULL;
+        ReportedRange *merged = NULL;
         unsigned int i;
 
         /*
@@ -364,17 +410,40 @@ static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
                 trace_virtio_balloon_bad_addr(elem->in_addr[i]);
                 continue;
             }
+            dev->reporting_reported_bytes += size;
 
-            /*
-             * For now we will simply ignore unaligned memory regions, or
-             * regions that overrun the end of the RAMBlock.
-             */
-            if (!QEMU_IS_ALIGNED(ram_offset | size, qemu_ram_pagesize(rb)) ||
-                (ram_offset + size) > qemu_ram_get_used_length(rb)) {
-                continue;
+            if (!ranges) {
+                ranges = g_array_sized_new(false, false, sizeof(ReportedRange),
+                                           elem->in_num);
             }
+            g_array_append_val(ranges, ((ReportedRange) {
+                .rb = rb, .offset = ram_offset, .size = size,
+            }));
+        }
 
-            ram_block_discard_range(rb, ram_offset, size);
+        /*
+         * The guest may reuse reported pages as soon as the element is
+         * completed, so only the ranges of this element can be combined.
+         * Merge adjacent ranges and discard the host pages they cover in
+         * full: with huge pages, single reports are usually too small.
+         */
+        if (ranges) {
+            g_array_sort(ranges, reported_range_compare);
+            for (i = 0; i < ranges->len; i++) {
+                ReportedRange *r = &g_array_index(ranges, ReportedRange, i);
+
+                if (merged && merged->rb == r->rb &&
+                    merged->offset + merged->size >= r->offset) {
+                    merged->size = MAX(merged->offset + merged->size,
+                                       r->offset + r->size) - merged->offset;
+                    continue;
+                }
+                if (merged) {
+                    virtio_balloon_discard_reported(dev, merged);
+                }
+                merged = r;
+            }
+            virtio_balloon_discard_reported(dev, merged);
         }
 
 skip_element:
@@ -989,6 +1058,13 @@ static void virtio_balloon_instance_init(Object *obj)
                         balloon_stats_get_poll_interval,
                         balloon_stats_set_poll_interval,
                         NULL, NULL);
+
+    object_property_add_uint64_ptr(obj, "free-page-reporting-reported",
+                                   &s->reporting_reported_bytes,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "free-page-reporting-discarded",
+                                   &s->reporting_discarded_bytes,
+                                   OBJ_PROP_FLAG_READ);
 }
 
 static const VMStateDescription vmstate_virtio_balloon = {
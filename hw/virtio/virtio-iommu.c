@@ -67,8 +67,31 @@ typedef struct VirtIOIOMMUInterval {
 typedef struct VirtIOIOMMUMapping {
     uint64_t phys_addr;
     uint32_t flags;
+    /*
+     * Contiguous mappings created by one batch of requests are notified
+     * as a single MAP, which covers [run_low, run_high].  VFIO cannot split
+     * a DMA mapping, so UNMAP notifications must cover the run whole.
+     */
+    uint64_t run_low;
+    uint64_t run_high;
 } VirtIOIOMMUMapping;
 
+/*
+ * The requests popped from the request queue in one go are processed as
+ * a batch.  MAP notifications for mappings of a domain that are contiguous
+ * in both virtual and physical address, with the same flags, are merged,
+ * and completions are only made visible once they have all been notified.
+ */
+typedef struct VirtIOIOMMUBatch {
+    VirtIOIOMMUDomain *domain;
+    hwaddr low;
+    hwaddr high;
+    hwaddr phys_addr;
+    uint32_t flags;
+    /* The mappings covered by the pending MAP notification */
+    GPtrArray *mappings;
+} VirtIOIOMMUBatch;
+
 static inline uint16_t virtio_iommu_get_bdf(IOMMUDevice *dev)
 {
     return PCI_BUILD_BDF(pci_bus_num(dev->bus), dev->devfn);
@@ -206,26 +229,10 @@ static void virtio_iommu_notify_map_unmap(IOMMUMemoryRegion *mr,
                                           IOMMUTLBEvent *event,
                                           hwaddr virt_start, hwaddr virt_end)
 {
-    uint64_t delta = virt_end - virt_start;
-
     event->entry.iova = virt_start;
-    event->entry.addr_mask = delta;
-
-    if (delta == UINT64_MAX) {
-        memory_region_notify_iommu(mr, 0, *event);
-    }
-
-    while (virt_start != virt_end + 1) {
-        uint64_t mask = dma_aligned_pow2_mask(virt_start, virt_end, 64);
+    event->entry.addr_mask = virt_end - virt_start;
 
-        event->entry.addr_mask = mask;
-        event->entry.iova = virt_start;
-        memory_region_notify_iommu(mr, 0, *event);
-        virt_start += mask + 1;
-        if (event->entry.perm != IOMMU_NONE) {
-            event->entry.translated_addr += mask + 1;
-        }
-    }
+    memory_region_notify_iommu_range(mr, 0, event);
 }
 
 static void virtio_iommu_notify_map(IOMMUMemoryRegion *mr, hwaddr virt_start,
@@ -274,14 +281,22 @@ static void virtio_iommu_notify_unmap(IOMMUMemoryRegion *mr, hwaddr virt_start,
 static gboolean virtio_iommu_notify_unmap_cb(gpointer key, gpointer value,
                                              gpointer data)
 {
+    VirtIOIOMMUMapping *mapping = (VirtIOIOMMUMapping *) value;
     VirtIOIOMMUInterval *interval = (VirtIOIOMMUInterval *) key;
     IOMMUMemoryRegion *mr = (IOMMUMemoryRegion *) data;
 
-    virtio_iommu_notify_unmap(mr, interval->low, interval->high);
+    /* Each run is unmapped once, when its first mapping is visited */
+    if (interval->low == mapping->run_low) {
+        virtio_iommu_notify_unmap(mr, mapping->run_low, mapping->run_high);
+    }
 
     return false;
 }
 
+/*
+ * Replaying a domain notifies each run of mappings as a single MAP, the
+ * same way as it was notified to the endpoints already attached
+ */
 static gboolean virtio_iommu_notify_map_cb(gpointer key, gpointer value,
                                            gpointer data)
 {
@@ -289,12 +304,161 @@ static gboolean virtio_iommu_notify_map_cb(gpointer key, gpointer value,
     VirtIOIOMMUInterval *interval = (VirtIOIOMMUInterval *) key;
     IOMMUMemoryRegion *mr = (IOMMUMemoryRegion *) data;
 
-    virtio_iommu_notify_map(mr, interval->low, interval->high,
-                            mapping->phys_addr, mapping->flags);
+    if (interval->low == mapping->run_low) {
+        virtio_iommu_notify_map(mr, mapping->run_low, mapping->run_high,
+                                mapping->phys_addr, mapping->flags);
+    }
 
     return false;
 }
 
+static void virtio_iommu_batch_flush(VirtIOIOMMUBatch *batch)
+{
+    VirtIOIOMMUEndpoint *ep;
+    guint i;
+
+    if (!batch->mappings->len) {
+        return;
+    }
+
+    for (i = 0; i < batch->mappings->len; i++) {
+        VirtIOIOMMUMapping *mapping = g_ptr_array_index(batch->mappings, i);
+
+        mapping->run_low = batch->low;
+        mapping->run_high = batch->high;
+    }
+    QLIST_FOREACH(ep, &batch->domain->endpoint_list, next) {
+        virtio_iommu_notify_map(ep->iommu_mr, batch->low, batch->high,
+                                batch->phys_addr, batch->flags);
+    }
+    g_ptr_array_set_size(batch->mappings, 0);
+}
+
+static void virtio_iommu_batch_add(VirtIOIOMMUBatch *batch,
+                                   VirtIOIOMMUDomain *domain,
+                                   VirtIOIOMMUInterval *interval,
+                                   VirtIOIOMMUMapping *mapping)
+{
+    if (batch->mappings->len && batch->domain == domain &&
+        batch->high + 1 == interval->low &&
+        batch->flags == mapping->flags &&
+        batch->phys_addr + (interval->low - batch->low) ==
+        mapping->phys_addr) {
+        batch->high = interval->high;
+    } else {
+        virtio_iommu_batch_flush(batch);
+        batch->domain = domain;
+        batch->low = interval->low;
+        batch->high = interval->high;
+        batch->phys_addr = mapping->phys_addr;
+        batch->flags = mapping->flags;
+    }
+    g_ptr_array_add(batch->mappings, mapping);
+}
+
+typedef struct VirtIOIOMMURemapRun {
+    VirtIOIOMMUDomain *domain;
+    VirtIOIOMMUInterval range;
+} VirtIOIOMMURemapRun;
+
+static gboolean virtio_iommu_remap_run_cb(gpointer key, gpointer value,
+                                          gpointer data)
+{
+    VirtIOIOMMUMapping *mapping = (VirtIOIOMMUMapping *) value;
+    VirtIOIOMMUInterval *interval = (VirtIOIOMMUInterval *) key;
+    VirtIOIOMMURemapRun *remap = (VirtIOIOMMURemapRun *) data;
+    VirtIOIOMMUEndpoint *ep;
+
+    if (interval->low > remap->range.high) {
+        return true;
+    }
+    if (interval->high < remap->range.low) {
+        return false;
+    }
+
+    mapping->run_low = interval->low;
+    mapping->run_high = interval->high;
+    QLIST_FOREACH(ep, &remap->domain->endpoint_list, next) {
+        virtio_iommu_notify_map(ep->iommu_mr, interval->low, interval->high,
+                                mapping->phys_addr, mapping->flags);
+    }
+    return false;
+}
+
+static gint virtio_iommu_run_cmp(gconstpointer a, gconstpointer b)
+{
+    const VirtIOIOMMUInterval *ra = a, *rb = b;
+
+    return (ra->low > rb->low) - (ra->low < rb->low);
+}
+
+static bool virtio_iommu_runs_exceed(GArray *runs,
+                                     VirtIOIOMMUInterval *range)
+{
+    guint i;
+
+    for (i = 0; i < runs->len; i++) {
+        VirtIOIOMMUInterval *run = &g_array_index(runs, VirtIOIOMMUInterval,
+                                                  i);
+
+        if (run->low < range->low || run->high > range->high) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Notify UNMAP for the runs of the mappings removed from @domain, merging
+ * adjacent ones.  If @partial, some of the removed runs may also contain
+ * mappings that are still in place; those are mapped again, each on its
+ * own.
+ */
+static void virtio_iommu_unmap_runs(VirtIOIOMMUDomain *domain, GArray *runs,
+                                    bool partial)
+{
+    VirtIOIOMMUEndpoint *ep;
+    VirtIOIOMMURemapRun remap = { .domain = domain };
+    guint i;
+
+    g_array_sort(runs, virtio_iommu_run_cmp);
+    for (i = 0; i < runs->len; i++) {
+        VirtIOIOMMUInterval *run = &g_array_index(runs, VirtIOIOMMUInterval,
+                                                  i);
+
+        if (i + 1 < runs->len) {
+            VirtIOIOMMUInterval *next = run + 1;
+
+            /* Runs of a single UNMAP request often come back to back */
+            if (next->low <= run->high + 1) {
+                next->low = run->low;
+                next->high = MAX(next->high, run->high);
+                continue;
+            }
+        }
+
+        QLIST_FOREACH(ep, &domain->endpoint_list, next) {
+            virtio_iommu_notify_unmap(ep->iommu_mr, run->low, run->high);
+        }
+        if (partial) {
+            remap.range = *run;
+            g_tree_foreach(domain->mappings, virtio_iommu_remap_run_cb,
+                           &remap);
+        }
+    }
+}
+
+static gboolean virtio_iommu_reset_run_cb(gpointer key, gpointer value,
+                                          gpointer data)
+{
+    VirtIOIOMMUMapping *mapping = (VirtIOIOMMUMapping *) value;
+    VirtIOIOMMUInterval *interval = (VirtIOIOMMUInterval *) key;
+
+    mapping->run_low = interval->low;
+    mapping->run_high = interval->high;
+    return false;
+}
+
 static void virtio_iommu_detach_endpoint_from_domain(VirtIOIOMMUEndpoint *ep)
 {
     VirtIOIOMMUDomain *domain = ep->domain;
@@ -558,7 +722,6 @@ static int virtio_iommu_map(VirtIOIOMMU *s,
     VirtIOIOMMUDomain *domain;
     VirtIOIOMMUInterval *interval;
     VirtIOIOMMUMapping *mapping;
-    VirtIOIOMMUEndpoint *ep;
 
     if (flags & ~VIRTIO_IOMMU_MAP_F_MASK) {
         return VIRTIO_IOMMU_S_INVAL;
@@ -592,10 +755,8 @@ static int virtio_iommu_map(VirtIOIOMMU *s,
 
     g_tree_insert(domain->mappings, interval, mapping);
 
-    QLIST_FOREACH(ep, &domain->endpoint_list, next) {
-        virtio_iommu_notify_map(ep->iommu_mr, virt_start, virt_end, phys_start,
-                                flags);
-    }
+    /* Notified when the batch is flushed, possibly along with others */
+    virtio_iommu_batch_add(s->batch, domain, interval, mapping);
 
     return VIRTIO_IOMMU_S_OK;
 }
@@ -609,7 +770,7 @@ static int virtio_iommu_unmap(VirtIOIOMMU *s,
     VirtIOIOMMUMapping *iter_val;
     VirtIOIOMMUInterval interval, *iter_key;
     VirtIOIOMMUDomain *domain;
-    VirtIOIOMMUEndpoint *ep;
+    g_autoptr(GArray) runs = NULL;
     int ret = VIRTIO_IOMMU_S_OK;
 
     trace_virtio_iommu_unmap(domain_id, virt_start, virt_end);
@@ -625,6 +786,7 @@ static int virtio_iommu_unmap(VirtIOIOMMU *s,
 
     interval.low = virt_start;
     interval.high = virt_end;
+    runs = g_array_new(FALSE, FALSE, sizeof(VirtIOIOMMUInterval));
 
     while (g_tree_lookup_extended(domain->mappings, &interval,
                                   (void **)&iter_key, (void**)&iter_val)) {
@@ -632,10 +794,12 @@ static int virtio_iommu_unmap(VirtIOIOMMU *s,
         uint64_t current_high = iter_key->high;
 
         if (interval.low <= current_low && interval.high >= current_high) {
-            QLIST_FOREACH(ep, &domain->endpoint_list, next) {
-                virtio_iommu_notify_unmap(ep->iommu_mr, current_low,
-                                          current_high);
-            }
+            VirtIOIOMMUInterval run = {
+                .low = iter_val->run_low,
+                .high = iter_val->run_high,
+            };
+
+            g_array_append_val(runs, run);
             g_tree_remove(domain->mappings, iter_key);
             trace_virtio_iommu_unmap_done(domain_id, current_low, current_high);
         } else {
@@ -643,6 +807,15 @@ static int virtio_iommu_unmap(VirtIOIOMMU *s,
             break;
         }
     }
+
+    /*
+     * A run can only outlive this request if it extends past the request,
+     * or if the request failed half way.
+     */
+    virtio_iommu_unmap_runs(domain, runs,
+                            ret != VIRTIO_IOMMU_S_OK ||
+                            (runs->len &&
+                             virtio_iommu_runs_exceed(runs, &interval)));
     return ret;
 }
 
@@ -756,18 +929,24 @@ static void virtio_iommu_handle_command(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOIOMMU *s = VIRTIO_IOMMU(vdev);
     struct virtio_iommu_req_head head;
     struct virtio_iommu_req_tail tail = {};
+    VirtIOIOMMUBatch batch = {};
     VirtQueueElement *elem;
     unsigned int iov_cnt;
+    unsigned int done = 0;
     struct iovec *iov;
     void *buf = NULL;
     size_t sz;
 
+    batch.mappings = g_ptr_array_new();
+    qemu_rec_mutex_lock(&s->mutex);
+    s->batch = &batch;
+
     for (;;) {
         size_t output_size = sizeof(tail);
 
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
-            return;
+            break;
         }
 
         if (iov_size(elem->in_sg, elem->in_num) < sizeof(tail) ||
@@ -785,7 +964,12 @@ static void virtio_iommu_handle_command(VirtIODevice *vdev, VirtQueue *vq)
             tail.status = VIRTIO_IOMMU_S_DEVERR;
             goto out;
         }
-        qemu_rec_mutex_lock(&s->mutex);
+
+        /* Only MAP requests can be merged; keep the others in order */
+        if (head.type != VIRTIO_IOMMU_T_MAP) {
+            virtio_iommu_batch_flush(&batch);
+        }
+
         switch (head.type) {
         case VIRTIO_IOMMU_T_ATTACH:
             tail.status = virtio_iommu_handle_attach(s, iov, iov_cnt);
@@ -813,19 +997,29 @@ static void virtio_iommu_handle_command(VirtIODevice *vdev, VirtQueue *vq)
         default:
             tail.status = VIRTIO_IOMMU_S_UNSUPP;
         }
-        qemu_rec_mutex_unlock(&s->mutex);
 
 out:
         sz = iov_from_buf(elem->in_sg, elem->in_num, 0,
                           buf ? buf : &tail, output_size);
         assert(sz == output_size);
 
-        virtqueue_push(vq, elem, sz);
-        virtio_notify(vdev, vq);
+        /* Not visible to the guest until the batch is flushed below */
+        virtqueue_fill(vq, elem, sz, done++);
         g_free(elem);
         g_free(buf);
         buf = NULL;
     }
+
+    /* Mappings must be in place before the guest sees them completed */
+    virtio_iommu_batch_flush(&batch);
+    s->batch = NULL;
+    qemu_rec_mutex_unlock(&s->mutex);
+    g_ptr_array_free(batch.mappings, TRUE);
+
+    if (done) {
+        virtqueue_flush(vq, done);
+        virtio_notify(vdev, vq);
+    }
 }
 
 static void virtio_iommu_report_fault(VirtIOIOMMU *viommu, uint8_t reason,
@@ -1064,11 +1258,9 @@ static gboolean virtio_iommu_remap(gpointer key, gpointer value, gpointer data)
     VirtIOIOMMUInterval *interval = (VirtIOIOMMUInterval *) key;
     IOMMUMemoryRegion *mr = (IOMMUMemoryRegion *) data;
 
-    trace_virtio_iommu_remap(mr->parent_obj.name, interval->low, interval->high,
-                             mapping->phys_addr);
-    virtio_iommu_notify_map(mr, interval->low, interval->high,
-                            mapping->phys_addr, mapping->flags);
-    return false;
+    trace_virtio_iommu_remap(mr->parent_obj.name, interval->low,
+                             interval->high, mapping->phys_addr);
+    return virtio_iommu_notify_map_cb(key, value, data);
 }
 
 static void virtio_iommu_replay(IOMMUMemoryRegion *mr, IOMMUNotifier *n)
@@ -1492,6 +1684,9 @@ static gboolean reconstruct_endpoints(gpointer key, gpointer value,
     VirtIOIOMMUEndpoint *iter;
     IOMMUMemoryRegion *mr;
 
+    /* Runs are not migrated; the destination starts over with one each */
+    g_tree_foreach(d->mappings, virtio_iommu_reset_run_cb, NULL);
+
     QLIST_FOREACH(iter, &d->endpoint_list, next) {
         mr = virtio_iommu_mr(s, iter->id);
         assert(mr);
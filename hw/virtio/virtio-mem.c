@@ -576,6 +576,21 @@ static void virtio_mem_deactivate_unplugged_memslots(VirtIOMEM *vmem,
     memory_region_transaction_commit();
 }
 
+/*
+ * Populate a range with the threads and thread context configured for the
+ * memory backend; small ranges are still handled by a single thread.
+ */
+static bool virtio_mem_prealloc_range(VirtIOMEM *vmem, uint64_t offset,
+                                      uint64_t size, Error **errp)
+{
+    void *area = memory_region_get_ram_ptr(&vmem->memdev->mr) + offset;
+    int fd = memory_region_get_fd(&vmem->memdev->mr);
+
+    return qemu_prealloc_mem(fd, area, size,
+                             MAX(vmem->memdev->prealloc_threads, 1),
+                             vmem->memdev->prealloc_context, false, errp);
+}
+
 static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
                                       uint64_t size, bool plug)
 {
@@ -601,11 +616,9 @@ static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
     }
 
     if (vmem->prealloc) {
-        void *area = memory_region_get_ram_ptr(&vmem->memdev->mr) + offset;
-        int fd = memory_region_get_fd(&vmem->memdev->mr);
         Error *local_err = NULL;
 
-        if (!qemu_prealloc_mem(fd, area, size, 1, NULL, false, &local_err)) {
+        if (!virtio_mem_prealloc_range(vmem, offset, size, &local_err)) {
             static bool warned;
 
             /*
@@ -650,17 +663,60 @@ static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
     return 0;
 }
 
-static int virtio_mem_state_change_request(VirtIOMEM *vmem, uint64_t gpa,
-                                           uint16_t nb_blocks, bool plug)
+/*
+ * Plug or unplug requests for adjacent ranges that are queued together are
+ * merged, so that the memory backend, the memslots and all RamDiscardListeners
+ * see a single range instead of one per request.
+ */
+#define VIRTIO_MEM_BATCH_MAX 64
+
+typedef struct VirtIOMEMBatch {
+    bool plug;
+    uint64_t gpa;
+    uint64_t size;
+    unsigned int nb_elems;
+    VirtQueueElement *elems[VIRTIO_MEM_BATCH_MAX];
+} VirtIOMEMBatch;
+
+static void virtio_mem_batch_flush(VirtIOMEM *vmem, VirtIOMEMBatch *batch)
 {
-    const uint64_t size = nb_blocks * vmem->block_size;
-    int ret;
+    uint16_t type = VIRTIO_MEM_RESP_ACK;
+    unsigned int i;
+
+    if (!batch->nb_elems) {
+        return;
+    }
+
+    trace_virtio_mem_batch_flush(batch->gpa, batch->size, batch->nb_elems,
+                                 batch->plug);
+    if (virtio_mem_set_block_state(vmem, batch->gpa, batch->size,
+                                   batch->plug)) {
+        type = VIRTIO_MEM_RESP_BUSY;
+    } else {
+        if (batch->plug) {
+            vmem->size += batch->size;
+        } else {
+            vmem->size -= batch->size;
+        }
+        notifier_list_notify(&vmem->size_change_notifiers, &vmem->size);
+    }
 
+    for (i = 0; i < batch->nb_elems; i++) {
+        virtio_mem_send_response_simple(vmem, batch->elems[i], type);
+        g_free(batch->elems[i]);
+    }
+    batch->nb_elems = 0;
+}
+
+static uint16_t virtio_mem_check_state_change(VirtIOMEM *vmem, uint64_t gpa,
+                                              uint64_t size, bool plug,
+                                              uint64_t pending_size)
+{
     if (!virtio_mem_valid_range(vmem, gpa, size)) {
         return VIRTIO_MEM_RESP_ERROR;
     }
 
-    if (plug && (vmem->size + size > vmem->requested_size)) {
+    if (plug && (vmem->size + pending_size + size > vmem->requested_size)) {
         return VIRTIO_MEM_RESP_NACK;
     }
 
@@ -669,42 +725,68 @@ static int virtio_mem_state_change_request(VirtIOMEM *vmem, uint64_t gpa,
         (!plug && !virtio_mem_is_range_plugged(vmem, gpa, size))) {
         return VIRTIO_MEM_RESP_ERROR;
     }
+    return VIRTIO_MEM_RESP_ACK;
+}
 
-    ret = virtio_mem_set_block_state(vmem, gpa, size, plug);
-    if (ret) {
-        return VIRTIO_MEM_RESP_BUSY;
+/* Takes ownership of @elem, which is answered once its batch is flushed. */
+static void virtio_mem_state_change_request(VirtIOMEM *vmem,
+                                            VirtIOMEMBatch *batch,
+                                            VirtQueueElement *elem,
+                                            uint64_t gpa, uint16_t nb_blocks,
+                                            bool plug)
+{
+    const uint64_t size = nb_blocks * vmem->block_size;
+    uint16_t type;
+
+    /*
+     * Only a range that directly follows the batch can join it; the state
+     * bitmap does not reflect the batch yet, but stays accurate for that one.
+     */
+    if (batch->nb_elems &&
+        (batch->plug != plug || batch->gpa + batch->size != gpa ||
+         batch->nb_elems == VIRTIO_MEM_BATCH_MAX)) {
+        virtio_mem_batch_flush(vmem, batch);
+    }
+
+    type = virtio_mem_check_state_change(vmem, gpa, size, plug,
+                                         batch->nb_elems ? batch->size : 0);
+    if (type != VIRTIO_MEM_RESP_ACK) {
+        /* Answer in order. */
+        virtio_mem_batch_flush(vmem, batch);
+        virtio_mem_send_response_simple(vmem, elem, type);
+        g_free(elem);
+        return;
     }
-    if (plug) {
-        vmem->size += size;
-    } else {
-        vmem->size -= size;
+
+    if (!batch->nb_elems) {
+        batch->plug = plug;
+        batch->gpa = gpa;
+        batch->size = 0;
     }
-    notifier_list_notify(&vmem->size_change_notifiers, &vmem->size);
-    return VIRTIO_MEM_RESP_ACK;
+    batch->size += size;
+    batch->elems[batch->nb_elems++] = elem;
 }
 
-static void virtio_mem_plug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
+static void virtio_mem_plug_request(VirtIOMEM *vmem, VirtIOMEMBatch *batch,
+                                    VirtQueueElement *elem,
                                     struct virtio_mem_req *req)
 {
     const uint64_t gpa = le64_to_cpu(req->u.plug.addr);
     const uint16_t nb_blocks = le16_to_cpu(req->u.plug.nb_blocks);
-    uint16_t type;
 
     trace_virtio_mem_plug_request(gpa, nb_blocks);
-    type = virtio_mem_state_change_request(vmem, gpa, nb_blocks, true);
-    virtio_mem_send_response_simple(vmem, elem, type);
+    virtio_mem_state_change_request(vmem, batch, elem, gpa, nb_blocks, true);
 }
 
-static void virtio_mem_unplug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
+static void virtio_mem_unplug_request(VirtIOMEM *vmem, VirtIOMEMBatch *batch,
+                                      VirtQueueElement *elem,
                                       struct virtio_mem_req *req)
 {
     const uint64_t gpa = le64_to_cpu(req->u.unplug.addr);
     const uint16_t nb_blocks = le16_to_cpu(req->u.unplug.nb_blocks);
-    uint16_t type;
 
     trace_virtio_mem_unplug_request(gpa, nb_blocks);
-    type = virtio_mem_state_change_request(vmem, gpa, nb_blocks, false);
-    virtio_mem_send_response_simple(vmem, elem, type);
+    virtio_mem_state_change_request(vmem, batch, elem, gpa, nb_blocks, false);
 }
 
 static void virtio_mem_resize_usable_region(VirtIOMEM *vmem,
@@ -800,6 +882,7 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
 {
     const int len = sizeof(struct virtio_mem_req);
     VirtIOMEM *vmem = VIRTIO_MEM(vdev);
+    VirtIOMEMBatch batch = {};
     VirtQueueElement *elem;
     struct virtio_mem_req req;
     uint16_t type;
@@ -807,7 +890,7 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
     while (true) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
-            return;
+            break;
         }
 
         if (iov_to_buf(elem->out_sg, elem->out_num, 0, &req, len) < len) {
@@ -815,7 +898,7 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
                          " size: %d", len);
             virtqueue_detach_element(vq, elem, 0);
             g_free(elem);
-            return;
+            break;
         }
 
         if (iov_size(elem->in_sg, elem->in_num) <
@@ -825,17 +908,20 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
                          iov_size(elem->in_sg, elem->in_num));
             virtqueue_detach_element(vq, elem, 0);
             g_free(elem);
-            return;
+            break;
         }
 
         type = le16_to_cpu(req.type);
+        if (type == VIRTIO_MEM_REQ_PLUG) {
+            virtio_mem_plug_request(vmem, &batch, elem, &req);
+            continue;
+        } else if (type == VIRTIO_MEM_REQ_UNPLUG) {
+            virtio_mem_unplug_request(vmem, &batch, elem, &req);
+            continue;
+        }
+
+        virtio_mem_batch_flush(vmem, &batch);
         switch (type) {
-        case VIRTIO_MEM_REQ_PLUG:
-            virtio_mem_plug_request(vmem, elem, &req);
-            break;
-        case VIRTIO_MEM_REQ_UNPLUG:
-            virtio_mem_unplug_request(vmem, elem, &req);
-            break;
         case VIRTIO_MEM_REQ_UNPLUG_ALL:
             virtio_mem_unplug_all_request(vmem, elem);
             break;
@@ -852,6 +938,8 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
 
         g_free(elem);
     }
+
+    virtio_mem_batch_flush(vmem, &batch);
 }
 
 static void virtio_mem_get_config(VirtIODevice *vdev, uint8_t *config_data)
@@ -1244,11 +1332,9 @@ static int virtio_mem_post_load(void *opaque, int version_id)
 static int virtio_mem_prealloc_range_cb(VirtIOMEM *vmem, void *arg,
                                         uint64_t offset, uint64_t size)
 {
-    void *area = memory_region_get_ram_ptr(&vmem->memdev->mr) + offset;
-    int fd = memory_region_get_fd(&vmem->memdev->mr);
     Error *local_err = NULL;
 
-    if (!qemu_prealloc_mem(fd, area, size, 1, NULL, false, &local_err)) {
+    if (!virtio_mem_prealloc_range(vmem, offset, size, &local_err)) {
         error_report_err(local_err);
         return -ENOMEM;
     }
@@ -28,66 +28,116 @@
 
 typedef struct VirtIODeviceRequest {
     VirtQueueElement elem;
-    int fd;
     VirtIOPMEM *pmem;
     VirtIODevice *vdev;
     struct virtio_pmem_req req;
     struct virtio_pmem_resp resp;
+    QTAILQ_ENTRY(VirtIODeviceRequest) next;
 } VirtIODeviceRequest;
 
+/* One fsync of the backing file, completing every request in @reqs */
+typedef struct VirtIOPMEMFlush {
+    VirtIOPMEM *pmem;
+    int fd;
+    int err;
+    unsigned int count;
+    QTAILQ_HEAD(, VirtIODeviceRequest) reqs;
+} VirtIOPMEMFlush;
+
+static void virtio_pmem_submit_flush(VirtIOPMEM *pmem);
+
 static int worker_cb(void *opaque)
 {
-    VirtIODeviceRequest *req_data = opaque;
+    VirtIOPMEMFlush *flush = opaque;
     int err = 0;
 
     /* flush raw backing image */
-    err = fsync(req_data->fd);
+    err = fsync(flush->fd);
     trace_virtio_pmem_flush_done(err);
     if (err != 0) {
         err = 1;
     }
 
-    virtio_stl_p(req_data->vdev, &req_data->resp.ret, err);
+    flush->err = err;
 
     return 0;
 }
 
 static void done_cb(void *opaque, int ret)
 {
-    VirtIODeviceRequest *req_data = opaque;
-    int len = iov_from_buf(req_data->elem.in_sg, req_data->elem.in_num, 0,
-                              &req_data->resp, sizeof(struct virtio_pmem_resp));
+    VirtIOPMEMFlush *flush = opaque;
+    VirtIOPMEM *pmem = flush->pmem;
+    VirtIODeviceRequest *req_data, *next;
+    unsigned int i = 0;
 
     /* Callbacks are serialized, so no need to use atomic ops. */
-    virtqueue_push(req_data->pmem->rq_vq, &req_data->elem, len);
-    virtio_notify((VirtIODevice *)req_data->pmem, req_data->pmem->rq_vq);
-    trace_virtio_pmem_response();
-    g_free(req_data);
+    QTAILQ_FOREACH_SAFE(req_data, &flush->reqs, next, next) {
+        int len;
+
+        virtio_stl_p(req_data->vdev, &req_data->resp.ret, flush->err);
+        len = iov_from_buf(req_data->elem.in_sg, req_data->elem.in_num, 0,
+                           &req_data->resp, sizeof(struct virtio_pmem_resp));
+        virtqueue_fill(pmem->rq_vq, &req_data->elem, len, i++);
+        trace_virtio_pmem_response();
+        g_free(req_data);
+    }
+    virtqueue_flush(pmem->rq_vq, i);
+    virtio_notify(VIRTIO_DEVICE(pmem), pmem->rq_vq);
+    g_free(flush);
+
+    pmem->flush_in_flight = false;
+    if (!QTAILQ_EMPTY(&pmem->flush_pending)) {
+        virtio_pmem_submit_flush(pmem);
+    }
+}
+
+/*
+ * Start one fsync for all pending requests.  Requests that arrive while it
+ * runs must not be completed by it, since it may not cover their writes, so
+ * they wait for the next one.
+ */
+static void virtio_pmem_submit_flush(VirtIOPMEM *pmem)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(pmem->memdev);
+    VirtIOPMEMFlush *flush = g_new0(VirtIOPMEMFlush, 1);
+    VirtIODeviceRequest *req_data;
+
+    flush->pmem = pmem;
+    flush->fd = memory_region_get_fd(&backend->mr);
+    QTAILQ_INIT(&flush->reqs);
+    while ((req_data = QTAILQ_FIRST(&pmem->flush_pending))) {
+        QTAILQ_REMOVE(&pmem->flush_pending, req_data, next);
+        QTAILQ_INSERT_TAIL(&flush->reqs, req_data, next);
+        flush->count++;
+    }
+
+    trace_virtio_pmem_flush_batch(flush->count);
+    pmem->flush_in_flight = true;
+    thread_pool_submit_aio(worker_cb, flush, done_cb, flush);
 }
 
 static void virtio_pmem_flush(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIODeviceRequest *req_data;
     VirtIOPMEM *pmem = VIRTIO_PMEM(vdev);
-    HostMemoryBackend *backend = MEMORY_BACKEND(pmem->memdev);
 
-    trace_virtio_pmem_flush_request();
-    req_data = virtqueue_pop(vq, sizeof(VirtIODeviceRequest));
-    if (!req_data) {
-        virtio_error(vdev, "virtio-pmem missing request data");
-        return;
+    while ((req_data = virtqueue_pop(vq, sizeof(VirtIODeviceRequest)))) {
+        trace_virtio_pmem_flush_request();
+
+        if (req_data->elem.out_num < 1 || req_data->elem.in_num < 1) {
+            virtio_error(vdev, "virtio-pmem request not proper");
+            virtqueue_detach_element(vq, (VirtQueueElement *)req_data, 0);
+            g_free(req_data);
+            break;
+        }
+        req_data->pmem = pmem;
+        req_data->vdev = vdev;
+        QTAILQ_INSERT_TAIL(&pmem->flush_pending, req_data, next);
     }
 
-    if (req_data->elem.out_num < 1 || req_data->elem.in_num < 1) {
-        virtio_error(vdev, "virtio-pmem request not proper");
-        virtqueue_detach_element(vq, (VirtQueueElement *)req_data, 0);
-        g_free(req_data);
-        return;
+    if (!pmem->flush_in_flight && !QTAILQ_EMPTY(&pmem->flush_pending)) {
+        virtio_pmem_submit_flush(pmem);
     }
-    req_data->fd   = memory_region_get_fd(&backend->mr);
-    req_data->pmem = pmem;
-    req_data->vdev = vdev;
-    thread_pool_submit_aio(worker_cb, req_data, done_cb, req_data);
 }
 
 static void virtio_pmem_get_config(VirtIODevice *vdev, uint8_t *config)
@@ -122,6 +172,7 @@ static void virtio_pmem_realize(DeviceState *dev, Error **errp)
     }
 
     host_memory_backend_set_mapped(pmem->memdev, true);
+    QTAILQ_INIT(&pmem->flush_pending);
     virtio_init(vdev, VIRTIO_ID_PMEM, sizeof(struct virtio_pmem_config));
     pmem->rq_vq = virtio_add_queue(vdev, 128, virtio_pmem_flush);
 }
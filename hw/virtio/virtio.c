@@ -17,9 +17,12 @@
 #include "trace.h"
 #include "qemu/defer-call.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
 #include "qom/object_interfaces.h"
 #include "hw/core/cpu.h"
 #include "hw/virtio/virtio.h"
@@ -31,6 +34,8 @@
 #include "hw/virtio/virtio-access.h"
 #include "sysemu/dma.h"
 #include "sysemu/runstate.h"
+#include "sysemu/stats.h"
+#include "sysemu/xen.h"
 #include "virtio-qmp.h"
 
 #include "standard-headers/linux/virtio_ids.h"
@@ -93,11 +98,28 @@ typedef struct VRingUsed
     VRingUsedElem ring[];
 } VRingUsed;
 
+/*
+ * Guest RAM ranges recently hit by descriptor buffers.  Entries live as
+ * long as the VRingMemoryRegionCaches they belong to, which is replaced on
+ * every memory topology change, and hold a reference to their region.
+ */
+#define VRING_MAP_CACHE_SIZE 4
+
+typedef struct VRingMapCacheEntry {
+    MemoryRegion *mr;
+    hwaddr addr;
+    hwaddr len;
+    void *host;
+} VRingMapCacheEntry;
+
 typedef struct VRingMemoryRegionCaches {
     struct rcu_head rcu;
     MemoryRegionCache desc;
     MemoryRegionCache avail;
     MemoryRegionCache used;
+    /* Only accessed by the thread popping from the virtqueue */
+    VRingMapCacheEntry map[VRING_MAP_CACHE_SIZE];
+    unsigned int map_next;
 } VRingMemoryRegionCaches;
 
 typedef struct VRing
@@ -116,10 +138,39 @@ typedef struct VRingPackedDescEvent {
     uint16_t flags;
 } VRingPackedDescEvent ;
 
+/*
+ * Popped elements are allocated in power-of-two size classes starting at
+ * VIRTQUEUE_ELEM_POOL_MIN_SIZE, and up to VIRTQUEUE_ELEM_POOL_DEPTH freed
+ * blocks per class are kept around for reuse by the next pop.
+ */
+#define VIRTQUEUE_ELEM_POOL_MIN_SIZE 512
+#define VIRTQUEUE_ELEM_POOL_CLASSES 5
+#define VIRTQUEUE_ELEM_POOL_DEPTH 16
+
+typedef struct VirtQueueElemPool {
+    /* Taken on pop and on free, which may run in different threads */
+    QemuSpin lock;
+    unsigned int count[VIRTQUEUE_ELEM_POOL_CLASSES];
+    void *free[VIRTQUEUE_ELEM_POOL_CLASSES][VIRTQUEUE_ELEM_POOL_DEPTH];
+} VirtQueueElemPool;
+
+/* Log2 buckets of the virtqueue latency histograms, in nanoseconds */
+#define VIRTQUEUE_LATENCY_BUCKETS 32
+
+typedef struct VirtQueueLatency {
+    /* First kick that was not followed by a pop yet, or 0 */
+    aligned_uint64_t kick_ns;
+    /* From a kick to the next pop */
+    aligned_uint64_t kick_hist[VIRTQUEUE_LATENCY_BUCKETS];
+    /* From popping an element to filling it in the used ring */
+    aligned_uint64_t request_hist[VIRTQUEUE_LATENCY_BUCKETS];
+} VirtQueueLatency;
+
 struct VirtQueue
 {
     VRing vring;
     VirtQueueElement *used_elems;
+    VirtQueueElemPool elem_pool;
 
     /* Next head to pop */
     uint16_t last_avail_idx;
@@ -151,6 +202,18 @@ struct VirtQueue
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
     bool host_notifier_enabled;
+
+    /* Interrupt coalescing state, only used from the irqfd path */
+    QEMUTimer *coalesce_timer;
+    AioContext *coalesce_ctx;
+    unsigned int coalesce_pending;
+    unsigned int coalesce_threshold;
+    unsigned int coalesce_window_count;
+    int64_t coalesce_window_end;
+
+    /* Only allocated with x-latency-stats=on */
+    VirtQueueLatency *latency;
+
     QLIST_ENTRY(VirtQueue) node;
 };
 
@@ -207,10 +270,17 @@ static const char *virtio_id_to_name(uint16_t device_id)
 /* Called within call_rcu().  */
 static void virtio_free_region_cache(VRingMemoryRegionCaches *caches)
 {
+    int i;
+
     assert(caches != NULL);
     address_space_cache_destroy(&caches->desc);
     address_space_cache_destroy(&caches->avail);
     address_space_cache_destroy(&caches->used);
+    for (i = 0; i < VRING_MAP_CACHE_SIZE; i++) {
+        if (caches->map[i].mr) {
+            memory_region_unref(caches->map[i].mr);
+        }
+    }
     g_free(caches);
 }
 
@@ -910,12 +980,51 @@ static void virtqueue_packed_fill_desc(VirtQueue *vq,
     vring_packed_desc_write(vq->vdev, &desc, &caches->desc, head, strict_order);
 }
 
+static void virtqueue_latency_account(aligned_uint64_t *hist, int64_t ns)
+{
+    unsigned int bucket = 0;
+
+    if (ns > 1) {
+        bucket = MIN(63 - clz64(ns), VIRTQUEUE_LATENCY_BUCKETS - 1);
+    }
+    /* Racing updates from several threads may lose a count, that's fine */
+    qatomic_set_u64(&hist[bucket], qatomic_read_u64(&hist[bucket]) + 1);
+}
+
+static void virtqueue_latency_kick(VirtQueue *vq)
+{
+    if (unlikely(vq->latency) && !qatomic_read_u64(&vq->latency->kick_ns)) {
+        qatomic_set_u64(&vq->latency->kick_ns, get_clock());
+    }
+}
+
+static void virtqueue_latency_popped(VirtQueue *vq, void **elems,
+                                     unsigned int n)
+{
+    int64_t now = get_clock();
+    uint64_t kick_ns = qatomic_read_u64(&vq->latency->kick_ns);
+    unsigned int i;
+
+    if (n && kick_ns) {
+        virtqueue_latency_account(vq->latency->kick_hist, now - kick_ns);
+        qatomic_set_u64(&vq->latency->kick_ns, 0);
+    }
+    for (i = 0; i < n; i++) {
+        ((VirtQueueElement *)elems[i])->pop_ns = now;
+    }
+}
+
 /* Called within rcu_read_lock().  */
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx)
 {
     trace_virtqueue_fill(vq, elem, len, idx);
 
+    if (unlikely(vq->latency) && elem->pop_ns) {
+        virtqueue_latency_account(vq->latency->request_hist,
+                                  get_clock() - elem->pop_ns);
+    }
+
     virtqueue_unmap_sg(vq, elem, len);
 
     if (virtio_device_disabled(vq->vdev)) {
@@ -1385,7 +1494,62 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
     return in_bytes <= in_total && out_bytes <= out_total;
 }
 
-static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
+/*
+ * Map guest RAM at @pa through the descriptor map cache, falling back to
+ * a FlatView lookup that then fills an entry.  Like dma_memory_map(), a
+ * successful map takes a reference to the region that is dropped by
+ * dma_memory_unmap().  Returns NULL if @pa cannot be mapped directly, the
+ * caller must then use dma_memory_map().
+ *
+ * Called within rcu_read_lock().
+ */
+static void *virtqueue_map_cached(VirtIODevice *vdev,
+                                  VRingMemoryRegionCaches *caches,
+                                  hwaddr pa, hwaddr *plen)
+{
+    VRingMapCacheEntry *e;
+    MemoryRegion *mr;
+    hwaddr xlat, len;
+    int i;
+
+    for (i = 0; i < VRING_MAP_CACHE_SIZE; i++) {
+        e = &caches->map[i];
+        if (e->mr && pa >= e->addr && pa - e->addr < e->len) {
+            goto hit;
+        }
+    }
+
+    /* With an IOMMU translations can change without a topology change */
+    if (vdev->dma_as != &address_space_memory || xen_enabled()) {
+        return NULL;
+    }
+
+    len = HWADDR_MAX - pa;
+    mr = address_space_translate(&address_space_memory, pa, &xlat, &len,
+                                 true, MEMTXATTRS_UNSPECIFIED);
+    if (!len || !memory_access_is_direct(mr, true)) {
+        return NULL;
+    }
+
+    e = &caches->map[caches->map_next++ % VRING_MAP_CACHE_SIZE];
+    if (e->mr) {
+        memory_region_unref(e->mr);
+    }
+    memory_region_ref(mr);
+    e->mr = mr;
+    e->addr = pa;
+    e->len = len;
+    e->host = memory_region_get_ram_ptr(mr) + xlat;
+
+hit:
+    *plen = MIN(*plen, e->len - (pa - e->addr));
+    memory_region_ref(e->mr);
+    return e->host + (pa - e->addr);
+}
+
+static bool virtqueue_map_desc(VirtIODevice *vdev,
+                               VRingMemoryRegionCaches *caches,
+                               unsigned int *p_num_sg,
                                hwaddr *addr, struct iovec *iov,
                                unsigned int max_num_sg, bool is_write,
                                hwaddr pa, size_t sz)
@@ -1408,11 +1572,14 @@ static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
             goto out;
         }
 
-        iov[num_sg].iov_base = dma_memory_map(vdev->dma_as, pa, &len,
-                                              is_write ?
-                                              DMA_DIRECTION_FROM_DEVICE :
-                                              DMA_DIRECTION_TO_DEVICE,
-                                              MEMTXATTRS_UNSPECIFIED);
+        iov[num_sg].iov_base = virtqueue_map_cached(vdev, caches, pa, &len);
+        if (!iov[num_sg].iov_base) {
+            iov[num_sg].iov_base = dma_memory_map(vdev->dma_as, pa, &len,
+                                                  is_write ?
+                                                  DMA_DIRECTION_FROM_DEVICE :
+                                                  DMA_DIRECTION_TO_DEVICE,
+                                                  MEMTXATTRS_UNSPECIFIED);
+        }
         if (!iov[num_sg].iov_base) {
             virtio_error(vdev, "virtio: bogus descriptor or out of resources");
             goto out;
@@ -1481,9 +1648,72 @@ void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem)
                                                                         false);
 }
 
-static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+static void *virtqueue_elem_pool_get(VirtQueue *vq, size_t size,
+                                     unsigned int *pool_class)
+{
+    VirtQueueElemPool *pool = &vq->elem_pool;
+    void *block = NULL;
+    unsigned int i;
+
+    for (i = 0; i < VIRTQUEUE_ELEM_POOL_CLASSES; i++) {
+        if (size <= VIRTQUEUE_ELEM_POOL_MIN_SIZE << i) {
+            break;
+        }
+    }
+    if (i == VIRTQUEUE_ELEM_POOL_CLASSES) {
+        *pool_class = 0;
+        return g_malloc(size);
+    }
+
+    qemu_spin_lock(&pool->lock);
+    if (pool->count[i]) {
+        block = pool->free[i][--pool->count[i]];
+    }
+    qemu_spin_unlock(&pool->lock);
+
+    *pool_class = i + 1;
+    return block ?: g_malloc(VIRTQUEUE_ELEM_POOL_MIN_SIZE << i);
+}
+
+static void virtqueue_elem_pool_drain(VirtQueue *vq)
+{
+    VirtQueueElemPool *pool = &vq->elem_pool;
+    unsigned int i;
+
+    qemu_spin_lock(&pool->lock);
+    for (i = 0; i < VIRTQUEUE_ELEM_POOL_CLASSES; i++) {
+        while (pool->count[i]) {
+            g_free(pool->free[i][--pool->count[i]]);
+        }
+    }
+    qemu_spin_unlock(&pool->lock);
+}
+
+void virtqueue_element_free(VirtQueue *vq, void *elem)
+{
+    VirtQueueElemPool *pool = &vq->elem_pool;
+    unsigned int pool_class = ((VirtQueueElement *)elem)->pool_class;
+
+    if (pool_class == 0 || vq->vring.num == 0) {
+        g_free(elem);
+        return;
+    }
+
+    qemu_spin_lock(&pool->lock);
+    if (pool->count[pool_class - 1] < VIRTQUEUE_ELEM_POOL_DEPTH) {
+        pool->free[pool_class - 1][pool->count[pool_class - 1]++] = elem;
+        elem = NULL;
+    }
+    qemu_spin_unlock(&pool->lock);
+    g_free(elem);
+}
+
+/* @vq may be NULL, the element is then not taken from any pool */
+static void *virtqueue_alloc_element(VirtQueue *vq, size_t sz,
+                                     unsigned out_num, unsigned in_num)
 {
     VirtQueueElement *elem;
+    unsigned int pool_class = 0;
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
     size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
     size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
@@ -1492,8 +1722,14 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
 
     assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
+    if (vq) {
+        elem = virtqueue_elem_pool_get(vq, out_sg_end, &pool_class);
+    } else {
+        elem = g_malloc(out_sg_end);
+    }
     trace_virtqueue_alloc_element(elem, sz, in_num, out_num);
+    elem->pool_class = pool_class;
+    elem->pop_ns = 0;
     elem->out_num = out_num;
     elem->in_num = in_num;
     elem->in_addr = (void *)elem + in_addr_ofs;
@@ -1503,10 +1739,16 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+/*
+ * Map the descriptor chain starting at @head into a new element.
+ * Called within rcu_read_lock(), with @caches already validated to cover
+ * the whole descriptor ring.
+ */
+static VirtQueueElement *
+virtqueue_split_map_head(VirtQueue *vq, size_t sz,
+                         VRingMemoryRegionCaches *caches, unsigned int head)
 {
-    unsigned int i, head, max;
-    VRingMemoryRegionCaches *caches;
+    unsigned int i, max;
     MemoryRegionCache indirect_desc_cache;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1520,45 +1762,12 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
 
     address_space_cache_init_empty(&indirect_desc_cache);
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_empty_rcu(vq)) {
-        goto done;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
     max = vq->vring.num;
-
-    if (vq->inuse >= vq->vring.num) {
-        virtio_error(vdev, "Virtqueue size exceeded");
-        goto done;
-    }
-
-    if (!virtqueue_get_head(vq, vq->last_avail_idx++, &head)) {
-        goto done;
-    }
-
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_split_desc_read(vdev, &desc, desc_cache, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
@@ -1586,7 +1795,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         bool map_ok;
 
         if (desc.flags & VRING_DESC_F_WRITE) {
-            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+            map_ok = virtqueue_map_desc(vdev, caches, &in_num, addr + out_num,
                                         iov + out_num,
                                         VIRTQUEUE_MAX_SIZE - out_num, true,
                                         desc.addr, desc.len);
@@ -1595,7 +1804,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
                 virtio_error(vdev, "Incorrect order for descriptors");
                 goto err_undo_map;
             }
-            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+            map_ok = virtqueue_map_desc(vdev, caches, &out_num, addr, iov,
                                         VIRTQUEUE_MAX_SIZE, false,
                                         desc.addr, desc.len);
         }
@@ -1617,7 +1826,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     }
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     elem->index = head;
     elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
@@ -1642,6 +1851,113 @@ err_undo_map:
     goto done;
 }
 
+/* Called within rcu_read_lock().  */
+static VRingMemoryRegionCaches *virtqueue_split_get_caches(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches;
+
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        virtio_error(vq->vdev, "Region caches not initialized");
+        return NULL;
+    }
+
+    if (caches->desc.len < vq->vring.num * sizeof(VRingDesc)) {
+        virtio_error(vq->vdev, "Cannot map descriptor ring");
+        return NULL;
+    }
+
+    return caches;
+}
+
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    unsigned int head;
+    VRingMemoryRegionCaches *caches;
+    VirtIODevice *vdev = vq->vdev;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    if (vq->inuse >= vq->vring.num) {
+        virtio_error(vdev, "Virtqueue size exceeded");
+        return NULL;
+    }
+
+    if (!virtqueue_get_head(vq, vq->last_avail_idx++, &head)) {
+        return NULL;
+    }
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    caches = virtqueue_split_get_caches(vq);
+    if (!caches) {
+        return NULL;
+    }
+
+    return virtqueue_split_map_head(vq, sz, caches, head);
+}
+
+/*
+ * Pop up to @max elements with a single avail index read, RCU critical
+ * section and region cache lookup.  The avail event is only published
+ * once, after the last head has been consumed.
+ */
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
+{
+    VRingMemoryRegionCaches *caches;
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int head, n = 0;
+    int num_heads;
+
+    RCU_READ_LOCK_GUARD();
+    if (unlikely(!vq->vring.avail)) {
+        return 0;
+    }
+
+    num_heads = virtqueue_num_heads(vq, vq->last_avail_idx);
+    if (num_heads <= 0) {
+        return 0;
+    }
+
+    caches = virtqueue_split_get_caches(vq);
+    if (!caches) {
+        return 0;
+    }
+
+    max = MIN(max, num_heads);
+    while (n < max) {
+        if (vq->inuse >= vq->vring.num) {
+            virtio_error(vdev, "Virtqueue size exceeded");
+            break;
+        }
+
+        if (!virtqueue_get_head(vq, vq->last_avail_idx++, &head)) {
+            break;
+        }
+
+        elems[n] = virtqueue_split_map_head(vq, sz, caches, head);
+        if (!elems[n]) {
+            break;
+        }
+        n++;
+    }
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    return n;
+}
+
 static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, max;
@@ -1716,7 +2032,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
         bool map_ok;
 
         if (desc.flags & VRING_DESC_F_WRITE) {
-            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+            map_ok = virtqueue_map_desc(vdev, caches, &in_num, addr + out_num,
                                         iov + out_num,
                                         VIRTQUEUE_MAX_SIZE - out_num, true,
                                         desc.addr, desc.len);
@@ -1725,7 +2041,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
                 virtio_error(vdev, "Incorrect order for descriptors");
                 goto err_undo_map;
             }
-            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+            map_ok = virtqueue_map_desc(vdev, caches, &out_num, addr, iov,
                                         VIRTQUEUE_MAX_SIZE, false,
                                         desc.addr, desc.len);
         }
@@ -1745,7 +2061,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     } while (rc == VIRTQUEUE_READ_DESC_MORE);
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -1781,15 +2097,50 @@ err_undo_map:
 
 void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
+    void *elem;
+
     if (virtio_device_disabled(vq->vdev)) {
         return NULL;
     }
 
     if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
-        return virtqueue_packed_pop(vq, sz);
+        elem = virtqueue_packed_pop(vq, sz);
     } else {
-        return virtqueue_split_pop(vq, sz);
+        elem = virtqueue_split_pop(vq, sz);
+    }
+
+    if (unlikely(vq->latency) && elem) {
+        virtqueue_latency_popped(vq, &elem, 1);
+    }
+    return elem;
+}
+
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int n = 0;
+
+    if (virtio_device_disabled(vq->vdev)) {
+        return 0;
+    }
+
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        n = virtqueue_split_pop_batch(vq, sz, elems, max);
+    } else {
+        /* Packed rings have no avail index to amortize, pop one at a time */
+        while (n < max) {
+            elems[n] = virtqueue_packed_pop(vq, sz);
+            if (!elems[n]) {
+                break;
+            }
+            n++;
+        }
+    }
+
+    if (unlikely(vq->latency)) {
+        virtqueue_latency_popped(vq, elems, n);
     }
+    return n;
 }
 
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
@@ -1927,7 +2278,7 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
     assert(ARRAY_SIZE(data.in_addr) >= data.in_num);
     assert(ARRAY_SIZE(data.out_addr) >= data.out_num);
 
-    elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
+    elem = virtqueue_alloc_element(NULL, sz, data.out_num, data.in_num);
     elem->index = data.index;
 
     for (i = 0; i < elem->in_num; i++) {
@@ -2273,6 +2624,7 @@ static void virtio_queue_notify_vq(VirtQueue *vq)
         }
 
         trace_virtio_queue_notify(vdev, vq - vdev->vq, vq);
+        virtqueue_latency_kick(vq);
         vq->handle_output(vdev, vq);
 
         if (unlikely(vdev->start_on_kick)) {
@@ -2290,6 +2642,8 @@ void virtio_queue_notify(VirtIODevice *vdev, int n)
     }
 
     trace_virtio_queue_notify(vdev, vq - vdev->vq, vq);
+    /* Also counts the time until the host notifier is handled */
+    virtqueue_latency_kick(vq);
     if (vq->host_notifier_enabled) {
         event_notifier_set(&vq->host_notifier);
     } else if (vq->handle_output) {
@@ -2342,6 +2696,10 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
     vdev->vq[i].used_elems = g_new0(VirtQueueElement, queue_size);
+    qemu_spin_init(&vdev->vq[i].elem_pool.lock);
+    if (vdev->latency_stats) {
+        vdev->vq[i].latency = g_new0(VirtQueueLatency, 1);
+    }
 
     return &vdev->vq[i];
 }
@@ -2353,6 +2711,10 @@ void virtio_delete_queue(VirtQueue *vq)
     vq->handle_output = NULL;
     g_free(vq->used_elems);
     vq->used_elems = NULL;
+    g_free(vq->latency);
+    vq->latency = NULL;
+    virtqueue_elem_pool_drain(vq);
+    virtio_notify_coalesce_flush(vq);
     virtio_virtqueue_reset_region_cache(vq);
 }
 
@@ -2464,6 +2826,89 @@ static void virtio_notify_irqfd_deferred_fn(void *opaque)
     event_notifier_set(notifier);
 }
 
+static void virtio_notify_coalesce_timer_cb(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    trace_virtio_notify_coalesce_timer(vq->vdev, vq, vq->coalesce_pending);
+    vq->coalesce_pending = 0;
+    event_notifier_set(&vq->guest_notifier);
+}
+
+/*
+ * Fire a held back interrupt now and drop the timer.  Must be called from
+ * the AioContext that the notifications were coalesced in.
+ */
+static void virtio_notify_coalesce_flush(VirtQueue *vq)
+{
+    if (!vq->coalesce_timer) {
+        return;
+    }
+
+    timer_free(vq->coalesce_timer);
+    vq->coalesce_timer = NULL;
+    vq->coalesce_ctx = NULL;
+
+    if (vq->coalesce_pending) {
+        vq->coalesce_pending = 0;
+        event_notifier_set(&vq->guest_notifier);
+    }
+}
+
+/*
+ * Decide whether an interrupt may be held back.  The number of completions
+ * one interrupt covers is re-evaluated once per coalescing period: it
+ * doubles while completions keep arriving faster than the threshold, and
+ * halves down to 1 (no coalescing, no added latency) when they slow down.
+ *
+ * Returns true if the interrupt was held back.
+ */
+static bool virtio_notify_coalesce(VirtIODevice *vdev, VirtQueue *vq)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    int64_t period = (int64_t)vdev->notify_coalesce_us * SCALE_US;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (vq->coalesce_ctx != ctx) {
+        virtio_notify_coalesce_flush(vq);
+        vq->coalesce_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                                           virtio_notify_coalesce_timer_cb,
+                                           vq);
+        vq->coalesce_ctx = ctx;
+        vq->coalesce_threshold = 1;
+        vq->coalesce_window_count = 0;
+        vq->coalesce_window_end = now + period;
+    }
+
+    vq->coalesce_window_count++;
+    if (now >= vq->coalesce_window_end) {
+        unsigned int threshold = vq->coalesce_threshold;
+
+        if (vq->coalesce_window_count >= 2 * threshold) {
+            threshold = MIN(threshold * 2, MAX(vdev->notify_coalesce_max, 1));
+        } else if (vq->coalesce_window_count < threshold) {
+            threshold = MAX(threshold / 2, 1);
+        }
+        if (threshold != vq->coalesce_threshold) {
+            trace_virtio_notify_coalesce_threshold(vdev, vq, threshold);
+            vq->coalesce_threshold = threshold;
+        }
+        vq->coalesce_window_count = 0;
+        vq->coalesce_window_end = now + period;
+    }
+
+    if (++vq->coalesce_pending >= vq->coalesce_threshold) {
+        vq->coalesce_pending = 0;
+        timer_del(vq->coalesce_timer);
+        return false;
+    }
+
+    if (vq->coalesce_pending == 1) {
+        timer_mod(vq->coalesce_timer, now + period);
+    }
+    return true;
+}
+
 void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
 {
     WITH_RCU_READ_LOCK_GUARD() {
@@ -2490,6 +2935,10 @@ void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
      * to an atomic operation.
      */
     virtio_set_isr(vq->vdev, 0x1);
+
+    if (vdev->notify_coalesce_us && virtio_notify_coalesce(vdev, vq)) {
+        return;
+    }
     defer_call(virtio_notify_irqfd_deferred_fn, &vq->guest_notifier);
 }
 
@@ -3621,6 +4070,9 @@ void virtio_queue_aio_detach_host_notifier(VirtQueue *vq, AioContext *ctx)
 {
     aio_set_event_notifier(ctx, &vq->host_notifier, NULL, NULL, NULL);
 
+    /* Do not leave a coalesced interrupt behind in the old AioContext */
+    virtio_notify_coalesce_flush(vq);
+
     /*
      * aio_set_event_notifier_poll() does not guarantee whether io_poll_end()
      * will run after io_poll_begin(), so by removing the notifier, we do not
@@ -3760,6 +4212,8 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
         if (vdev->vq[i].vring.num == 0) {
             break;
         }
+        virtqueue_elem_pool_drain(&vdev->vq[i]);
+        virtio_notify_coalesce_flush(&vdev->vq[i]);
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
     g_free(vdev->vq);
@@ -3781,10 +4235,15 @@ static Property virtio_properties[] = {
     DEFINE_PROP_BOOL("use-disabled-flag", VirtIODevice, use_disabled_flag, true),
     DEFINE_PROP_BOOL("x-disable-legacy-check", VirtIODevice,
                      disable_legacy_check, false),
+    DEFINE_PROP_UINT32("notify-coalesce-us", VirtIODevice,
+                       notify_coalesce_us, 0),
+    DEFINE_PROP_UINT32("notify-coalesce-max", VirtIODevice,
+                       notify_coalesce_max, 32),
+    DEFINE_PROP_BOOL("x-latency-stats", VirtIODevice, latency_stats, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
-static int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int i, n, r, err;
@@ -3854,7 +4313,7 @@ int virtio_device_start_ioeventfd(VirtIODevice *vdev)
     return virtio_bus_start_ioeventfd(vbus);
 }
 
-static void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int n, r;
@@ -4139,9 +4598,110 @@ static const TypeInfo virtio_device_info = {
     .class_size = sizeof(VirtioDeviceClass),
 };
 
+static Stats *virtio_latency_stat(const char *name,
+                                  const aligned_uint64_t *hist)
+{
+    Stats *stats = g_new0(Stats, 1);
+    int i;
+
+    stats->name = g_strdup(name);
+    stats->value = g_new0(StatsValue, 1);
+    stats->value->type = QTYPE_QLIST;
+    for (i = VIRTQUEUE_LATENCY_BUCKETS - 1; i >= 0; i--) {
+        QAPI_LIST_PREPEND(stats->value->u.list, qatomic_read_u64(&hist[i]));
+    }
+    return stats;
+}
+
+typedef struct VirtioStatsQuery {
+    StatsResultList **result;
+    strList *names;
+} VirtioStatsQuery;
+
+static int virtio_query_stats_device(Object *obj, void *opaque)
+{
+    VirtioStatsQuery *q = opaque;
+    VirtIODevice *vdev;
+    g_autofree char *path = NULL;
+    int i;
+
+    vdev = (VirtIODevice *)object_dynamic_cast(obj, TYPE_VIRTIO_DEVICE);
+    if (!vdev || !vdev->latency_stats) {
+        return 0;
+    }
+
+    path = object_get_canonical_path(obj);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+        StatsList *list = NULL;
+
+        if (!vq->latency || !vq->vring.num) {
+            continue;
+        }
+
+        /* Prepend in reverse order of the schema */
+        if (apply_str_list_filter("request-latency", q->names)) {
+            QAPI_LIST_PREPEND(list,
+                              virtio_latency_stat("request-latency",
+                                                  vq->latency->request_hist));
+        }
+        if (apply_str_list_filter("kick-latency", q->names)) {
+            QAPI_LIST_PREPEND(list,
+                              virtio_latency_stat("kick-latency",
+                                                  vq->latency->kick_hist));
+        }
+        if (!list) {
+            continue;
+        }
+        add_stats_entry(q->result, STATS_PROVIDER_VIRTIO, path, list);
+        (*q->result)->value->has_queue = true;
+        (*q->result)->value->queue = i;
+    }
+    return 0;
+}
+
+static void virtio_query_stats_cb(StatsResultList **result,
+                                  StatsTarget target, strList *names,
+                                  strList *targets, Error **errp)
+{
+    VirtioStatsQuery q = { .result = result, .names = names };
+
+    if (target == STATS_TARGET_VIRTQUEUE) {
+        object_child_foreach_recursive(object_get_root(),
+                                       virtio_query_stats_device, &q);
+    }
+}
+
+static StatsSchemaValue *virtio_latency_schema_value(const char *name)
+{
+    StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+    value->name = g_strdup(name);
+    value->type = STATS_TYPE_LOG2_HISTOGRAM;
+    value->has_unit = true;
+    value->unit = STATS_UNIT_SECONDS;
+    value->has_base = true;
+    value->base = 10;
+    value->exponent = -9;
+    return value;
+}
+
+static void virtio_query_stats_schemas_cb(StatsSchemaList **result,
+                                          Error **errp)
+{
+    StatsSchemaValueList *list = NULL;
+
+    QAPI_LIST_PREPEND(list, virtio_latency_schema_value("request-latency"));
+    QAPI_LIST_PREPEND(list, virtio_latency_schema_value("kick-latency"));
+    add_stats_schema(result, STATS_PROVIDER_VIRTIO, STATS_TARGET_VIRTQUEUE,
+                     list);
+}
+
 static void virtio_register_types(void)
 {
     type_register_static(&virtio_device_info);
+    add_stats_callbacks(STATS_PROVIDER_VIRTIO, virtio_query_stats_cb,
+                        virtio_query_stats_schemas_cb);
 }
 
 type_init(virtio_register_types)
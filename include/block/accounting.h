@@ -79,6 +79,9 @@ typedef struct BlockLatencyHistogram {
     uint64_t *bins;
 } BlockLatencyHistogram;
 
+/* Log2 buckets of the latency histograms that are always kept, in ns */
+#define BLOCK_LATENCY_LOG2_BUCKETS 32
+
 struct BlockAcctStats {
     QemuMutex lock;
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
@@ -92,6 +95,7 @@ struct BlockAcctStats {
     bool account_invalid;
     bool account_failed;
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
+    uint64_t latency_log2[BLOCK_MAX_IOTYPE][BLOCK_LATENCY_LOG2_BUCKETS];
 };
 
 typedef struct BlockAcctCookie {
@@ -120,5 +124,7 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
+void block_acct_get_latency_log2(BlockAcctStats *stats,
+                                 enum BlockAcctType type, uint64_t *hist);
 
 #endif
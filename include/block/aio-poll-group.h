@@ -0,0 +1,61 @@
+/*
+ * Threads that busy wait for events on behalf of several AioContexts
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef QEMU_AIO_POLL_GROUP_H
+#define QEMU_AIO_POLL_GROUP_H
+
+#include "block/aio.h"
+#include "qemu/thread.h"
+#include "qom/object.h"
+
+#define TYPE_AIO_POLL_GROUP "poll-group"
+OBJECT_DECLARE_SIMPLE_TYPE(AioPollGroup, AIO_POLL_GROUP)
+
+typedef struct AioPollGroupContexts AioPollGroupContexts;
+typedef struct AioPollGroupWorker AioPollGroupWorker;
+
+/*
+ * An AioContext that belongs to a poll group does not busy wait in
+ * aio_poll().  It enables polling mode and sleeps for the time it would
+ * have polled, while one of the group's threads polls its handlers and
+ * wakes it up when one of them is ready.  The group's threads share the
+ * contexts that are waiting between them, so that a few threads can poll
+ * for many AioContexts.
+ */
+struct AioPollGroup {
+    Object parent_obj;
+
+    uint32_t nr_threads;
+    AioPollGroupWorker *workers;
+    bool stopping;
+
+    /* Set when a context starts waiting for the group */
+    QemuEvent wakeup;
+
+    /* Serializes updates to @contexts, which is read under RCU */
+    QemuMutex lock;
+    AioPollGroupContexts *contexts;
+};
+
+/*
+ * Add @ctx to @group.  Must be called before any thread runs aio_poll()
+ * on @ctx.
+ */
+void aio_poll_group_add(AioPollGroup *group, AioContext *ctx);
+
+/*
+ * Remove @ctx from its group, if any.  Must be called once no thread runs
+ * aio_poll() on @ctx anymore.
+ */
+void aio_poll_group_remove(AioContext *ctx);
+
+/* Wake up the group after a context started waiting for it */
+static inline void aio_poll_group_kick(AioPollGroup *group)
+{
+    qemu_event_set(&group->wakeup);
+}
+
+#endif /* QEMU_AIO_POLL_GROUP_H */
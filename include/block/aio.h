@@ -56,6 +56,14 @@ typedef void IOHandler(void *opaque);
 struct ThreadPool;
 struct LinuxAioState;
 typedef struct LuringState LuringState;
+typedef struct AioPollGroup AioPollGroup;
+
+/* Storage for aio_complete_in(), usually embedded in a request */
+typedef struct AioCompletion {
+    QSLIST_ENTRY(AioCompletion) next;
+    QEMUBHFunc *cb;
+    void *opaque;
+} AioCompletion;
 
 /* Is polling disabled? */
 bool aio_poll_disabled(AioContext *ctx);
@@ -191,6 +199,10 @@ struct AioContext {
      * positives are possible, i.e. "notified" could be set even though the
      * EventNotifier is clear.
      *
+     * aio_notify skips event_notifier_set if "notified" was already set,
+     * so that a batch of notifications costs a single wakeup.  This relies
+     * on the event loop checking "notified" before it blocks.
+     *
      * Note that event_notifier_set *cannot* be optimized the same way.  For
      * more information on the problem that would result, see "#ifdef BUG2"
      * in the docs/aio_notify_accept.promela formal model.
@@ -201,6 +213,10 @@ struct AioContext {
     QSLIST_HEAD(, Coroutine) scheduled_coroutines;
     QEMUBH *co_schedule_bh;
 
+    /* Queued by aio_complete_in() from any thread, run by completion_bh */
+    QSLIST_HEAD(, AioCompletion) completions;
+    QEMUBH *completion_bh;
+
     int thread_pool_min;
     int thread_pool_max;
     /* Thread pool for performing work and receiving completion callbacks.
@@ -213,6 +229,8 @@ struct AioContext {
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     LuringState *linux_io_uring;
+    /* Ring for O_DIRECT reads and writes that poll for completions */
+    LuringState *linux_io_uring_poll;
 
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
@@ -247,6 +265,16 @@ struct AioContext {
     /* Are we in polling mode or monitoring file descriptors? */
     bool poll_started;
 
+    /*
+     * Poll group that busy waits for this context, see
+     * block/aio-poll-group.h.  While @poll_group_waiting, aio_poll() sleeps
+     * in polling mode and a group thread that sets @poll_group_claimed may
+     * walk poll_aio_handlers.
+     */
+    AioPollGroup *poll_group;
+    bool poll_group_waiting;
+    bool poll_group_claimed;
+
     /* epoll(7) state used when built with CONFIG_EPOLL */
     int epollfd;
 
@@ -513,6 +541,17 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
 
 /* Return the LuringState bound to this AioContext */
 LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+/*
+ * Setup the polled LuringState bound to this AioContext, with an SQ thread
+ * bound to @sqpoll_cpu unless it is negative.  Only the first call creates
+ * the ring.
+ */
+LuringState *aio_setup_linux_io_uring_poll(AioContext *ctx, int sqpoll_cpu,
+                                           Error **errp);
+
+/* Return the polled LuringState bound to this AioContext */
+LuringState *aio_get_linux_io_uring_poll(AioContext *ctx);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -609,6 +648,21 @@ static inline void aio_timer_init(AioContext *ctx,
  */
 int64_t aio_compute_timeout(AioContext *ctx);
 
+/**
+ * aio_complete_in:
+ * @ctx: the aio context
+ * @c: storage for the completion, valid until @cb has run
+ * @cb: the function to run in @ctx
+ * @opaque: the argument of @cb
+ *
+ * Run @cb in @ctx, typically to complete a request owned by @ctx from
+ * another thread.  Unlike aio_bh_schedule_oneshot(), this does not
+ * allocate a bottom half: completions queued from any thread are run in
+ * order by one bottom half, and a batch of them wakes up @ctx only once.
+ */
+void aio_complete_in(AioContext *ctx, AioCompletion *c, QEMUBHFunc *cb,
+                     void *opaque);
+
 /**
  * aio_co_schedule:
  * @ctx: the aio context
@@ -698,6 +752,18 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_poll_for_group:
+ * @ctx: the aio context
+ *
+ * Called by the threads of @ctx's poll group.  If @ctx is waiting for
+ * the group, check its poll handlers once and wake it up if one of them
+ * is ready.
+ *
+ * Returns: true if @ctx was waiting for the group
+ */
+bool aio_context_poll_for_group(AioContext *ctx);
+
 /**
  * aio_context_set_aio_params:
  * @ctx: the aio context
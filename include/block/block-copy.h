@@ -32,6 +32,15 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
 void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
                               bool compress);
 void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm);
+void block_copy_set_adaptive(BlockCopyState *s, bool adaptive);
+void block_copy_set_dedup(BlockCopyState *s, bool dedup);
+
+/*
+ * Current size of buffered copy requests, number of workers in flight per
+ * call and throughput of data copies in bytes per second.
+ */
+void block_copy_get_stats(BlockCopyState *s, int64_t *chunk_size,
+                          int *workers, uint64_t *throughput);
 
 void block_copy_state_free(BlockCopyState *s);
 
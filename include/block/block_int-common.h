@@ -28,6 +28,7 @@
 #include "block/block-common.h"
 #include "block/block-global-state.h"
 #include "block/snapshot.h"
+#include "qemu/interval-tree.h"
 #include "qemu/iov.h"
 #include "qemu/rcu.h"
 #include "qemu/stats64.h"
@@ -84,6 +85,8 @@ typedef struct BdrvTrackedRequest {
     int64_t overlap_bytes;
 
     QLIST_ENTRY(BdrvTrackedRequest) list;
+    /* Keyed on the overlap range, for conflict lookups */
+    IntervalTreeNode overlap_node;
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 
@@ -1069,6 +1072,23 @@ typedef struct BdrvBlockStatusCache {
     int64_t data_end;
 } BdrvBlockStatusCache;
 
+#define BDRV_CHAIN_STATUS_CACHE_SIZE 16
+
+/*
+ * A range that bdrv_co_common_block_status_above() found allocated in
+ * @owner, @depth layers below the node it was queried on, for the given
+ * @base, @include_base and @want_zero.  Unused if @end is 0.
+ */
+typedef struct BdrvChainStatusEntry {
+    int64_t start;
+    int64_t end;
+    BlockDriverState *base;
+    bool include_base;
+    bool want_zero;
+    BlockDriverState *owner;
+    int depth;
+} BdrvChainStatusEntry;
+
 struct BlockDriverState {
     /*
      * Protected by big QEMU lock or read-only after opening.  No special
@@ -1241,6 +1261,7 @@ struct BlockDriverState {
     /* Protected by reqs_lock.  */
     QemuMutex reqs_lock;
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    IntervalTreeRoot tracked_requests_tree;
     CoQueue flush_queue;                  /* Serializing flush queue */
     bool active_flush_req;                /* Flush request in flight? */
 
@@ -1255,6 +1276,16 @@ struct BlockDriverState {
     /* Always non-NULL, but must only be dereferenced under an RCU read guard */
     BdrvBlockStatusCache *block_status_cache;
 
+    /*
+     * Ranges allocated below this node in its backing chain, so that deep
+     * chains are not walked again for them.  @csc_gen is bumped whenever
+     * the allocation of this node or of a node below might change.
+     */
+    QemuMutex csc_lock;
+    unsigned int csc_gen;
+    int csc_next;
+    BdrvChainStatusEntry csc_entries[BDRV_CHAIN_STATUS_CACHE_SIZE];
+
     /* array of write pointers' location of each zone in the zoned device. */
     BlockZoneWps *wps;
 };
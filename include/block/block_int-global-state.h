@@ -55,6 +55,7 @@
  * @filter_node_name: The node name that should be assigned to the filter
  *                    driver that the stream job inserts into the graph above
  *                    @bs. NULL means that a node name should be autogenerated.
+ * @perf: Number and size of the requests that copy data in parallel.
  * @errp: Error object.
  *
  * Start a streaming operation on @bs.  Clusters that are unallocated
@@ -71,6 +72,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
                   int creation_flags, int64_t speed,
                   BlockdevOnError on_error,
                   const char *filter_node_name,
+                  const BackingChainPerf *perf,
                   Error **errp);
 
 /**
@@ -90,6 +92,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
  * @filter_node_name: The node name that should be assigned to the filter
  * driver that the commit job inserts into the graph above @top. NULL means
  * that a node name should be autogenerated.
+ * @perf: Number and size of the requests that copy data in parallel.
  * @errp: Error object.
  *
  */
@@ -98,7 +101,8 @@ void commit_start(const char *job_id, BlockDriverState *bs,
                   int creation_flags, int64_t speed,
                   BlockdevOnError on_error, const char *backing_file_str,
                   bool backing_mask_protocol,
-                  const char *filter_node_name, Error **errp);
+                  const char *filter_node_name,
+                  const BackingChainPerf *perf, Error **errp);
 /**
  * commit_active_start:
  * @job_id: The id of the newly-created job, or %NULL to use the
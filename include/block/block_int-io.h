@@ -191,4 +191,12 @@ void bdrv_bsc_invalidate_range(BlockDriverState *bs,
  */
 void bdrv_bsc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes);
 
+/**
+ * Drop what the chain status cache of @bs and of the nodes above it knows
+ * about [offset, offset + bytes), because the allocation of the range in
+ * @bs may have changed.
+ */
+void bdrv_csc_invalidate_range(BlockDriverState *bs,
+                               int64_t offset, int64_t bytes);
+
 #endif /* BLOCK_INT_IO_H */
@@ -0,0 +1,40 @@
+/*
+ * Table of cluster contents already written to a target
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef BLOCK_DEDUP_H
+#define BLOCK_DEDUP_H
+
+#define BLOCK_DEDUP_HASH_SIZE 32
+
+/* Clusters remembered at most, about 64 MiB of memory */
+#define BLOCK_DEDUP_MAX_ENTRIES (1 << 20)
+
+typedef struct BlockDedup BlockDedup;
+
+typedef struct BlockDedupHash {
+    uint8_t data[BLOCK_DEDUP_HASH_SIZE];
+} BlockDedupHash;
+
+/*
+ * Copy jobs write each cluster of the target once.  When a cluster has
+ * the same content as one that was written earlier, they can copy the
+ * earlier cluster within the target instead, which protocols that
+ * support copy offloading turn into a reference to the same host
+ * storage.  The table is thread-safe.
+ */
+BlockDedup *block_dedup_new(void);
+void block_dedup_free(BlockDedup *d);
+
+void block_dedup_hash(const void *buf, size_t len, BlockDedupHash *hash);
+
+/* Offset of a cluster with content @hash, or -1 if there is none */
+int64_t block_dedup_find(BlockDedup *d, const BlockDedupHash *hash);
+
+/* Call once the cluster at @offset has been written successfully */
+void block_dedup_insert(BlockDedup *d, const BlockDedupHash *hash,
+                        int64_t offset);
+
+#endif /* BLOCK_DEDUP_H */
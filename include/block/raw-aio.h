@@ -65,14 +65,40 @@ void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context);
 #endif
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
-LuringState *luring_init(Error **errp);
+/*
+ * luring_init: set up a ring, polling the device for completions if @iopoll,
+ * with an SQ thread bound to @sqpoll_cpu unless it is negative.
+ */
+LuringState *luring_init(bool iopoll, int sqpoll_cpu, Error **errp);
 void luring_cleanup(LuringState *s);
 
 /* luring_co_submit: submit I/O requests in the thread's current AioContext. */
 int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
                                   QEMUIOVector *qiov, int type);
+/* luring_co_submit_poll: same, to the polled ring of the AioContext. */
+int coroutine_fn luring_co_submit_poll(BlockDriverState *bs, int fd,
+                                       uint64_t offset, QEMUIOVector *qiov,
+                                       int type);
+/*
+ * luring_co_fallocate: zero (QEMU_AIO_WRITE_ZEROES) or punch a hole in
+ * (QEMU_AIO_DISCARD) a range of a regular file without blocking a worker
+ * thread.  Returns -ENOTSUP if the kernel cannot do it asynchronously.
+ */
+int coroutine_fn luring_co_fallocate(BlockDriverState *bs, int fd,
+                                     uint64_t offset, uint64_t len, int type);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
+
+/*
+ * Register guest RAM and image files with all the rings, so that requests
+ * use fixed buffers and files.  Registration is best effort: requests that
+ * cannot use them are submitted as usual.  An fd must be unregistered
+ * before it is closed, as the rings hold a reference to the file.
+ */
+void luring_register_buf(void *host, size_t size);
+void luring_unregister_buf(void *host, size_t size);
+void luring_register_fd(int fd);
+void luring_unregister_fd(int fd);
 #endif
 
 #ifdef _WIN32
@@ -235,4 +235,44 @@ int qcrypto_cipher_setiv(QCryptoCipher *cipher,
                          const uint8_t *iv, size_t niv,
                          Error **errp);
 
+/**
+ * qcrypto_cipher_encrypt_sectors:
+ * @cipher: the cipher object
+ * @ivs: @nsectors initialization vectors of @niv bytes each, or NULL
+ * @niv: the length of each initialization vector
+ * @buf: buffer holding @nsectors sectors, encrypted in place
+ * @sectorsize: the size of each sector
+ * @nsectors: the number of sectors in @buf
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Encrypts a batch of sectors, each with its own initialization
+ * vector, as used by disk encryption.  @ivs must be NULL if the
+ * cipher mode does not use initialization vectors.
+ *
+ * Returns: 0 on success, or -1 on error
+ */
+int qcrypto_cipher_encrypt_sectors(QCryptoCipher *cipher,
+                                   const uint8_t *ivs, size_t niv,
+                                   uint8_t *buf, size_t sectorsize,
+                                   size_t nsectors, Error **errp);
+
+/**
+ * qcrypto_cipher_decrypt_sectors:
+ * @cipher: the cipher object
+ * @ivs: @nsectors initialization vectors of @niv bytes each, or NULL
+ * @niv: the length of each initialization vector
+ * @buf: buffer holding @nsectors sectors, decrypted in place
+ * @sectorsize: the size of each sector
+ * @nsectors: the number of sectors in @buf
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Decrypts a batch of sectors, like qcrypto_cipher_encrypt_sectors().
+ *
+ * Returns: 0 on success, or -1 on error
+ */
+int qcrypto_cipher_decrypt_sectors(QCryptoCipher *cipher,
+                                   const uint8_t *ivs, size_t niv,
+                                   uint8_t *buf, size_t sectorsize,
+                                   size_t nsectors, Error **errp);
+
 #endif /* QCRYPTO_CIPHER_H */
@@ -184,6 +184,11 @@ struct IOMMUNotifier {
     hwaddr start;
     hwaddr end;
     int iommu_idx;
+    /*
+     * Accept entries of any size, merged by memory_region_notify_iommu_range()
+     * rather than split into naturally aligned power of two entries
+     */
+    bool coalesce;
     QLIST_ENTRY(IOMMUNotifier) node;
 };
 typedef struct IOMMUNotifier IOMMUNotifier;
@@ -253,6 +258,7 @@ static inline void iommu_notifier_init(IOMMUNotifier *n, IOMMUNotify fn,
     n->start = start;
     n->end = end;
     n->iommu_idx = iommu_idx;
+    n->coalesce = false;
 }
 
 /*
@@ -1139,6 +1145,9 @@ struct FlatView {
     unsigned nr_allocated;
     struct AddressSpaceDispatch *dispatch;
     MemoryRegion *root;
+    /* Top-level regions of the trees that were rendered into the view */
+    MemoryRegion **trees;
+    unsigned nr_trees;
 };
 
 static inline FlatView *address_space_to_flatview(AddressSpace *as)
@@ -1799,6 +1808,39 @@ void memory_region_notify_iommu(IOMMUMemoryRegion *iommu_mr,
 void memory_region_notify_iommu_one(IOMMUNotifier *notifier,
                                     IOMMUTLBEvent *event);
 
+/**
+ * memory_region_notify_iommu_range: notify a change in the IOMMU translation
+ *                                   of an arbitrary range
+ *
+ * This works like memory_region_notify_iommu(), but the entry of @event
+ * may cover a range whose size isn't a power of two, contiguous in both
+ * I/O virtual address and, for a MAP event, translated address. The range
+ * is cropped to each notifier. Notifiers that set @coalesce get it in as
+ * few entries as the target address space allows, the others get it split
+ * into naturally aligned power of two entries.
+ *
+ * @iommu_mr: the memory region that was changed
+ * @iommu_idx: the IOMMU index for the translation table which has changed
+ * @event: TLB event with the new entry in the IOMMU translation table.
+ */
+void memory_region_notify_iommu_range(IOMMUMemoryRegion *iommu_mr,
+                                      int iommu_idx,
+                                      IOMMUTLBEvent *event);
+
+/**
+ * memory_region_notify_iommu_range_one: notify a change in the IOMMU
+ *                                       translation of an arbitrary range
+ *                                       to a single notifier
+ *
+ * This works just like memory_region_notify_iommu_range(), but it only
+ * notifies a specific notifier, not all of them.
+ *
+ * @notifier: the notifier to be notified
+ * @event: TLB event with the new entry in the IOMMU translation table.
+ */
+void memory_region_notify_iommu_range_one(IOMMUNotifier *notifier,
+                                          IOMMUTLBEvent *event);
+
 /**
  * memory_region_unmap_iommu_notifier_range: notify a unmap for an IOMMU
  *                                           translation that covers the
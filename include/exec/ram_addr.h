@@ -44,7 +44,8 @@ static inline long clear_bmap_size(uint64_t pages, uint8_t shift)
 
 /**
  * clear_bmap_set: set clear bitmap for the page range.  Must be with
- * bitmap_mutex held.
+ * bitmap_mutex held, but several threads can set ranges at once while
+ * the dirty bitmap sync is split across them.
  *
  * @rb: the ramblock to operate on
  * @start: the start page number
@@ -57,7 +58,8 @@ static inline void clear_bmap_set(RAMBlock *rb, uint64_t start,
 {
     uint8_t shift = rb->clear_bmap_shift;
 
-    bitmap_set(rb->clear_bmap, start >> shift, clear_bmap_size(npages, shift));
+    bitmap_set_atomic(rb->clear_bmap, start >> shift,
+                      clear_bmap_size(npages, shift));
 }
 
 /**
@@ -365,44 +367,37 @@ uint64_t cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
         long k;
         long nr = BITS_TO_LONGS(pages);
 
-        idx = (start >> TARGET_PAGE_BITS) / DIRTY_MEMORY_BLOCK_SIZE;
-        offset = BIT_WORD((start >> TARGET_PAGE_BITS) %
-                          DIRTY_MEMORY_BLOCK_SIZE);
-
         WITH_RCU_READ_LOCK_GUARD() {
             for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
                 blocks[i] =
                     qatomic_rcu_read(&ram_list.dirty_memory[i])->blocks;
             }
 
-            for (k = 0; k < nr; k++) {
-                if (bitmap[k]) {
-                    unsigned long temp = leul_to_cpu(bitmap[k]);
-
-                    nbits = ctpopl(temp);
-                    qatomic_or(&blocks[DIRTY_MEMORY_VGA][idx][offset], temp);
-
-                    if (global_dirty_tracking) {
-                        qatomic_or(
-                                &blocks[DIRTY_MEMORY_MIGRATION][idx][offset],
-                                temp);
-                        if (unlikely(
-                            global_dirty_tracking & GLOBAL_DIRTY_DIRTY_RATE)) {
-                            total_dirty_pages += nbits;
-                        }
-                    }
+            /* Clear words of a mostly clean bitmap are skipped in bulk */
+            for (k = bitmap_find_next_nonzero_word(bitmap, 0, nr); k < nr;
+                 k = bitmap_find_next_nonzero_word(bitmap, k + 1, nr)) {
+                unsigned long temp = leul_to_cpu(bitmap[k]);
+
+                idx = (page + k) / BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE);
+                offset = (page + k) % BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE);
 
-                    num_dirty += nbits;
+                nbits = ctpopl(temp);
+                qatomic_or(&blocks[DIRTY_MEMORY_VGA][idx][offset], temp);
 
-                    if (tcg_enabled()) {
-                        qatomic_or(&blocks[DIRTY_MEMORY_CODE][idx][offset],
-                                   temp);
+                if (global_dirty_tracking) {
+                    qatomic_or(&blocks[DIRTY_MEMORY_MIGRATION][idx][offset],
+                               temp);
+                    if (unlikely(
+                        global_dirty_tracking & GLOBAL_DIRTY_DIRTY_RATE)) {
+                        total_dirty_pages += nbits;
                     }
                 }
 
-                if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
-                    offset = 0;
-                    idx++;
+                num_dirty += nbits;
+
+                if (tcg_enabled()) {
+                    qatomic_or(&blocks[DIRTY_MEMORY_CODE][idx][offset],
+                               temp);
                 }
             }
         }
@@ -487,7 +482,7 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
     if (((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
          (start + rb->offset) &&
         !(length & ((BITS_PER_LONG << TARGET_PAGE_BITS) - 1))) {
-        int k;
+        int k, n;
         int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
         unsigned long * const *src;
         unsigned long idx = (word * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
@@ -498,20 +493,15 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
         src = qatomic_rcu_read(
                 &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
 
-        for (k = page; k < page + nr; k++) {
-            if (src[idx][offset]) {
-                unsigned long bits = qatomic_xchg(&src[idx][offset], 0);
-                unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
-                new_dirty &= bits;
-                num_dirty += ctpopl(new_dirty);
-            }
-
-            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
-                offset = 0;
-                idx++;
-            }
+        /* One dirty memory block at a time */
+        for (k = page; k < page + nr; k += n) {
+            n = MIN(page + nr - k,
+                    BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE) - offset);
+            num_dirty += bitmap_or_and_clear_atomic(dest + k,
+                                                    src[idx] + offset,
+                                                    n * BITS_PER_LONG);
+            offset = 0;
+            idx++;
         }
         if (num_dirty) {
             cpu_physical_memory_dirty_bits_cleared(start, length);
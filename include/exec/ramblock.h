@@ -79,6 +79,13 @@ struct RAMBlock {
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
 
+    /*
+     * bitmap of the pages found to be zero ahead of the first round of
+     * migration, only used on the source side while they are known not
+     * to have been written since
+     */
+    unsigned long *zero_bmap;
+
     /*
      * RAM block length that corresponds to the used_length on the migration
      * source (after RAM block sizes were synchronized). Especially, after
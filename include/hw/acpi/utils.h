@@ -5,4 +5,16 @@
 
 MemoryRegion *acpi_add_rom_blob(FWCfgCallback update, void *opaque,
                                 GArray *blob, const char *name);
+
+/*
+ * Tables are rebuilt on the first fw_cfg read after each reset, because
+ * firmware programs PCI BARs, bridge windows and bus numbers before and
+ * devices may have been hot-plugged since.  Take a snapshot of that state
+ * into *@snapshot and return whether it changed since the last call.  If
+ * it did not, the tables built last time are still current.
+ */
+bool acpi_build_snapshot_update(GByteArray **snapshot);
+
+/* Forget *@snapshot, e.g. when the tables came in with migration */
+void acpi_build_snapshot_clear(GByteArray **snapshot);
 #endif
@@ -22,6 +22,7 @@
 #include "hw/sysbus.h"
 #include "hw/pci/pci.h"
 #include "qom/object.h"
+#include "qemu/interval-tree.h"
 #include "sysemu/iommufd.h"
 
 #define SMMU_PCI_BUS_MAX                    256
@@ -64,10 +65,25 @@ typedef struct SMMUTransTableInfo {
     bool had;                  /* hierarchical attribute disable */
 } SMMUTransTableInfo;
 
+typedef struct SMMUIOTLBKey {
+    uint64_t iova;
+    uint16_t asid;
+    uint16_t vmid;
+    uint8_t tg;
+    uint8_t level;
+} SMMUIOTLBKey;
+
+typedef struct SMMUIOTLBBucket SMMUIOTLBBucket;
+
 typedef struct SMMUTLBEntry {
     IOMMUTLBEntry entry;
     uint8_t level;
     uint8_t granule;
+    /* IOTLB bookkeeping, owned by smmu-common.c */
+    SMMUIOTLBKey key;
+    SMMUIOTLBBucket *bucket;
+    IntervalTreeNode node;
+    QTAILQ_ENTRY(SMMUTLBEntry) lru;
 } SMMUTLBEntry;
 
 /* Stage-2 configuration. */
@@ -113,6 +129,7 @@ typedef struct SMMUS2Hwpt {
     IOMMUFDBackend *iommufd;
     uint32_t hwpt_id;
     uint32_t ioas_id;
+    bool dirty_tracking;
     QLIST_HEAD(, SMMUDevice) device_list;
     QLIST_ENTRY(SMMUS2Hwpt) next;
 } SMMUS2Hwpt;
@@ -136,7 +153,6 @@ typedef struct SMMUDevice {
     SMMUS2Hwpt         *s2_hwpt;
     SMMUS1Hwpt         *s1_hwpt;
     AddressSpace       as;
-    AddressSpace       as_sysmem;
     uint32_t           cfg_cache_hits;
     uint32_t           cfg_cache_misses;
     struct iommu_hw_info_arm_smmuv3 info;
@@ -149,30 +165,25 @@ typedef struct SMMUPciBus {
     SMMUDevice   *pbdev[]; /* Parent array is sparse, so dynamically alloc */
 } SMMUPciBus;
 
-typedef struct SMMUIOTLBKey {
-    uint64_t iova;
-    uint16_t asid;
-    uint16_t vmid;
-    uint8_t tg;
-    uint8_t level;
-} SMMUIOTLBKey;
-
 struct SMMUState {
     /* <private> */
     SysBusDevice  dev;
     const char *mrtypename;
-    MemoryRegion root;
     MemoryRegion iomem;
-    MemoryRegion sysmem;
     /* /dev/iommu interface */
     IOMMUFDBackend *iommufd;
     IOMMUFDViommu *viommu;
     bool nested;
     bool has_cmdqv;
+    bool shared_s2_hwpt; /* share stage-2 hwpts with the other vSMMUs */
+    QLIST_ENTRY(SMMUState) nested_next;
 
     GHashTable *smmu_pcibus_by_busptr;
     GHashTable *configs; /* cache for configuration data */
     GHashTable *iotlb;
+    GHashTable *iotlb_buckets; /* SMMUIOTLBBucket by (asid, vmid) */
+    QTAILQ_HEAD(, SMMUTLBEntry) iotlb_lru; /* least recently used first */
+    GHashTable *ptw_cache; /* cache of the page table walks */
     SMMUPciBus *smmu_pcibus_by_bus_num[SMMU_PCI_BUS_MAX];
     PCIBus *pci_bus;
     QLIST_HEAD(, SMMUDevice) devices_with_notifiers;
@@ -207,8 +218,8 @@ static inline uint16_t smmu_get_sid(SMMUDevice *sdev)
  * smmu_ptw - Perform the page table walk for a given iova / access flags
  * pair, according to @cfg translation config
  */
-int smmu_ptw(SMMUTransCfg *cfg, dma_addr_t iova, IOMMUAccessFlags perm,
-             SMMUTLBEntry *tlbe, SMMUPTWEventInfo *info);
+int smmu_ptw(SMMUState *bs, SMMUTransCfg *cfg, dma_addr_t iova,
+             IOMMUAccessFlags perm, SMMUTLBEntry *tlbe, SMMUPTWEventInfo *info);
 
 /**
  * select_tt - compute which translation table shall be used according to
@@ -220,6 +231,7 @@ SMMUTransTableInfo *select_tt(SMMUTransCfg *cfg, dma_addr_t iova);
 SMMUDevice *smmu_find_sdev(SMMUState *s, uint32_t sid);
 
 #define SMMU_IOTLB_MAX_SIZE 256
+#define SMMU_PTW_CACHE_MAX_SIZE 64
 
 SMMUTLBEntry *smmu_iotlb_lookup(SMMUState *bs, SMMUTransCfg *cfg,
                                 SMMUTransTableInfo *tt, hwaddr iova);
@@ -63,6 +63,15 @@ struct SMMUv3State {
     qemu_irq     irq[4];
     QemuMutex mutex;
     char *stage;
+    bool async_cmdq;
+    QEMUBH *cmdq_bh;
+    uint32_t inv_coalesce_threshold;
+    struct {
+        uint64_t cmds;      /* invalidation commands batched */
+        uint64_t issued;    /* commands issued after coalescing */
+        uint64_t ioctls;    /* invalidation requests to the host */
+        uint64_t upgrades;  /* range invalidations upgraded */
+    } inv_stats;
 };
 
 typedef enum {
@@ -373,6 +373,7 @@ struct MachineState {
     bool usb;
     bool usb_disabled;
     char *firmware;
+    char *emulator_thread_context;
     bool iommu;
     bool suppress_vmdesc;
     bool enable_graphics;
@@ -198,6 +198,9 @@ struct CPUClass {
 /* Use a fully associative victim tlb of 8 entries. */
 #define CPU_VTLB_SIZE 8
 
+/* Remember up to 8 large pages per mmu_idx. */
+#define CPU_LTLB_SIZE 8
+
 /*
  * The full TLB entry, which is not accessed by generated TCG code,
  * so the layout is not as critical as that of CPUTLBEntry. This is
@@ -265,11 +268,25 @@ typedef struct CPUTLBEntryFull {
  * Data elements that are per MMU mode, minus the bits accessed by
  * the TCG fast path.
  */
+/*
+ * A large page that the tlb can refill from without calling tlb_fill.
+ * The table entries created for its pages are removed all together when
+ * any of them is flushed.
+ */
+typedef struct CPUTLBLargePage {
+    /* First address and mask of the large page; addr is -1 if unused */
+    vaddr addr;
+    vaddr mask;
+    /* As passed to tlb_set_page_full() for the first page */
+    CPUTLBEntryFull full;
+} CPUTLBLargePage;
+
 typedef struct CPUTLBDesc {
     /*
-     * Describe a region covering all of the large pages allocated
-     * into the tlb.  When any page within this region is flushed,
-     * we must flush the entire tlb.  The region is matched if
+     * Describe a region covering all of the large pages that were
+     * evicted from ltable while table entries for them may remain.
+     * When any page within this region is flushed, we must flush
+     * the entire tlb.  The region is matched if
      * (addr & large_page_mask) == large_page_addr.
      */
     vaddr large_page_addr;
@@ -285,6 +302,9 @@ typedef struct CPUTLBDesc {
     CPUTLBEntry vtable[CPU_VTLB_SIZE];
     CPUTLBEntryFull vfulltlb[CPU_VTLB_SIZE];
     CPUTLBEntryFull *fulltlb;
+    /* The next index to use in the large page table.  */
+    size_t lindex;
+    CPUTLBLargePage ltable[CPU_LTLB_SIZE];
 } CPUTLBDesc;
 
 /*
@@ -299,6 +319,11 @@ typedef struct CPUTLBCommon {
      * Protected by tlb_c.lock.
      */
     uint16_t dirty;
+    /*
+     * Flushes requested by other vCPUs, merged until this vCPU gets to
+     * process them.  Protected by tlb_c.lock.
+     */
+    struct CPUTLBPendingFlush *pending;
     /*
      * Statistics.  These are not lock protected, but are read and
      * written atomically.  This allows the monitor to print a snapshot
@@ -307,6 +332,12 @@ typedef struct CPUTLBCommon {
     size_t full_flush_count;
     size_t part_flush_count;
     size_t elide_flush_count;
+    /*
+     * Lookups that missed the main table, and those of them that also
+     * missed the victim and large page tables and went to tlb_fill.
+     */
+    size_t miss_count;
+    size_t fill_count;
 } CPUTLBCommon;
 
 /*
@@ -395,9 +426,24 @@ struct qemu_work_item;
 
 #define CPU_UNSET_NUMA_NODE_ID -1
 
+#define CPU_SECTION_CACHE_SIZE 4
+
+/*
+ * MMIO sections recently hit by a CPU thread, valid for one
+ * AddressSpaceDispatch generation.
+ */
+typedef struct CPUSectionCache {
+    struct AddressSpaceDispatch *dispatch;
+    uint64_t generation;
+    unsigned next;
+    MemoryRegionSection *sections[CPU_SECTION_CACHE_SIZE];
+} CPUSectionCache;
+
 /**
  * CPUState:
  * @cpu_index: CPU index (informative).
+ * @qom_path: Canonical QOM path, valid under cpu_list_lock while the CPU
+ *   is in the CPU list.
  * @cluster_index: Identifies which cluster this CPU is in.
  *   For boards which don't define clusters or for "loose" CPUs not assigned
  *   to a cluster this will be UNASSIGNED_CLUSTER_INDEX; otherwise it will
@@ -426,6 +472,7 @@ struct qemu_work_item;
  * @num_ases: number of CPUAddressSpaces in @cpu_ases
  * @as: Pointer to the first AddressSpace, for the convenience of targets which
  *      only have a single AddressSpace
+ * @section_cache: MMIO sections recently looked up by this CPU's thread.
  * @gdb_regs: Additional GDB registers.
  * @gdb_num_regs: Number of total registers accessible to GDB.
  * @gdb_num_g_regs: Number of registers in GDB 'g' packets.
@@ -496,8 +543,10 @@ struct CPUState {
     int num_ases;
     AddressSpace *as;
     MemoryRegion *memory;
+    CPUSectionCache section_cache;
 
     CPUJumpCache *tb_jmp_cache;
+    CPUTCGStats *tcg_stats;
 
     GArray *gdb_regs;
     int gdb_num_regs;
@@ -540,6 +589,7 @@ struct CPUState {
 
     /* TODO Move common fields from CPUArchState here. */
     int cpu_index;
+    char *qom_path;
     int cluster_index;
     uint32_t tcg_cflags;
     uint32_t halted;
@@ -452,6 +452,33 @@ struct CXLType3Dev {
     unsigned int poison_list_cnt;
     bool poison_list_overflowed;
     uint64_t poison_list_overflow_ts;
+
+    /*
+     * Optional model of far memory performance, applied to accesses that
+     * go through cxl_type3_read()/cxl_type3_write()
+     */
+    struct {
+        uint64_t read_latency;  /* ns */
+        uint64_t write_latency; /* ns */
+        uint64_t bandwidth;     /* bytes/s */
+        int64_t busy_until;     /* QEMU_CLOCK_REALTIME */
+        uint64_t busy_rem;      /* bytes * ns, below 1ns of transfer */
+
+        /* Counters, readable as QOM properties */
+        uint64_t reads;
+        uint64_t writes;
+        uint64_t read_bytes;
+        uint64_t write_bytes;
+        uint64_t delay_ns;
+    } perf;
+
+    /* HDM decoders mapped directly into a fixed memory window */
+    struct {
+        MemoryRegion mr;
+        MemoryRegion *window;
+    } direct[CXL_HDM_DECODER_COUNT];
+    QLIST_ENTRY(CXLType3Dev) direct_node;
+    bool direct_mapped;
 };
 
 #define TYPE_CXL_TYPE3 "cxl-type3"
@@ -488,6 +515,19 @@ MemTxResult cxl_type3_read(PCIDevice *d, hwaddr host_addr, uint64_t *data,
 MemTxResult cxl_type3_write(PCIDevice *d, hwaddr host_addr, uint64_t data,
                             unsigned size, MemTxAttrs attrs);
 
+/*
+ * Map the HPA range @linear around @host_addr, which no decoder above @d
+ * interleaves, straight onto the device's memory backend as a subregion of
+ * the fixed memory window @window based at @window_base.  Accesses to the
+ * range then no longer go through cxl_type3_read()/cxl_type3_write().
+ * Nothing is mapped if @d interleaves the range itself or is sanitizing.
+ */
+void cxl_type3_map_direct(PCIDevice *d, hwaddr host_addr, Range *linear,
+                          MemoryRegion *window, hwaddr window_base);
+void cxl_type3_unmap_direct(CXLType3Dev *ct3d);
+/* Drop all direct mappings, for when decoders above the devices change */
+void cxl_type3_unmap_direct_all(void);
+
 uint64_t cxl_device_get_timestamp(CXLDeviceState *cxlds);
 
 void cxl_event_init(CXLDeviceState *cxlds, int start_msg_num);
@@ -149,7 +149,16 @@ struct VTDAddressSpace {
     IOVATree *iova_tree;
 };
 
+struct vtd_iotlb_key {
+    uint64_t gfn;
+    uint32_t pasid;
+    uint16_t sid;
+    uint8_t level;
+};
+
 struct VTDIOTLBEntry {
+    struct vtd_iotlb_key key;
+    QTAILQ_ENTRY(VTDIOTLBEntry) lru;
     uint64_t gfn;
     uint16_t domain_id;
     uint32_t pasid;
@@ -290,6 +299,7 @@ struct IntelIOMMUState {
 
     uint32_t context_cache_gen;     /* Should be in [1,MAX] */
     GHashTable *iotlb;              /* IOTLB */
+    QTAILQ_HEAD(, VTDIOTLBEntry) iotlb_lru; /* least recently used first */
 
     GHashTable *vtd_address_spaces;             /* VTD address spaces */
     VTDAddressSpace *vtd_as_cache[VTD_PCI_BUS_MAX]; /* VTD address space cache */
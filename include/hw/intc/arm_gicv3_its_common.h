@@ -81,6 +81,9 @@ struct GICv3ITSState {
     TableDesc  vpet;
     CmdQDesc   cq;
 
+    /* Recent DTE/ITE lookups of the emulated ITS */
+    struct GICv3ITSTransCache *tcache;
+
     Error *migration_blocker;
 };
 
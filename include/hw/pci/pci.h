@@ -213,6 +213,8 @@ enum {
     QEMU_PCIE_ERR_UNC_MASK = (1 << QEMU_PCIE_ERR_UNC_MASK_BITNR),
 #define QEMU_PCIE_ARI_NEXTFN_1_BITNR 12
     QEMU_PCIE_ARI_NEXTFN_1 = (1 << QEMU_PCIE_ARI_NEXTFN_1_BITNR),
+#define QEMU_PCIE_SRIOV_LAZY_VFS_BITNR 13
+    QEMU_PCIE_SRIOV_LAZY_VFS = (1 << QEMU_PCIE_SRIOV_LAZY_VFS_BITNR),
 };
 
 typedef struct PCIINTxRoute {
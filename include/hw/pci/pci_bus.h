@@ -42,6 +42,8 @@ struct PCIBus {
     pci_route_irq_fn route_intx_to_irq;
     void *irq_opaque;
     PCIDevice *devices[PCI_SLOT_MAX * PCI_FUNC_MAX];
+    /* PFs whose VF at this devfn is realized on first access */
+    PCIDevice *lazy_vf_pf[PCI_SLOT_MAX * PCI_FUNC_MAX];
     PCIDevice *parent_dev;
     MemoryRegion *address_space_mem;
     MemoryRegion *address_space_io;
@@ -19,7 +19,7 @@ struct PCIESriovPF {
     uint16_t num_vfs;   /* Number of virtual functions created */
     uint8_t vf_bar_type[PCI_NUM_REGIONS];   /* Store type for each VF bar */
     const char *vfname; /* Reference to the device type used for the VFs */
-    PCIDevice **vf;     /* Pointer to an array of num_vfs VF devices */
+    PCIDevice **vf;     /* Array of num_vfs VF devices, NULL while lazy */
 };
 
 struct PCIESriovVF {
@@ -61,6 +61,12 @@ void pcie_sriov_config_write(PCIDevice *dev, uint32_t address,
 /* Reset SR/IOV */
 void pcie_sriov_pf_reset(PCIDevice *dev);
 
+/*
+ * Realize the VF at @devfn on @bus, whose realization was deferred because
+ * its PF has the "sriov-lazy-vfs" property set.
+ */
+void pcie_sriov_realize_lazy_vf(PCIBus *bus, uint8_t devfn);
+
 /* Get logical VF number of a VF - only valid for VFs */
 uint16_t pcie_sriov_vf_number(PCIDevice *dev);
 
@@ -72,6 +78,7 @@ PCIDevice *pcie_sriov_get_pf(PCIDevice *dev);
 
 /*
  * Get the n-th VF of this physical function - only valid for PF.
+ * Realizes the VF if it is lazy.
  * Returns NULL if index is invalid
  */
 PCIDevice *pcie_sriov_get_vf_at_index(PCIDevice *dev, int n);
@@ -1106,4 +1106,14 @@ typedef enum MachineInitPhase {
 bool phase_check(MachineInitPhase phase);
 void phase_advance(MachineInitPhase phase);
 
+/*
+ * Record the start of QEMU initialization.  phase_get_time_ns()
+ * returns the time from this point to the moment @phase was reached,
+ * in nanoseconds, or -1 if @phase has not been reached yet.
+ * phase_get_elapsed_ns() returns the time from this point to now.
+ */
+void phase_start_timeline(void);
+int64_t phase_get_time_ns(MachineInitPhase phase);
+int64_t phase_get_elapsed_ns(void);
+
 #endif
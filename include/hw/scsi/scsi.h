@@ -34,6 +34,9 @@ struct SCSIRequest {
     SCSICommand       cmd;
     NotifierList      cancel_notifiers;
 
+    /* The AioContext that submitted and executes the request */
+    AioContext        *ctx;
+
     /* Note:
      * - fields before sense are initialized by scsi_req_alloc;
      * - sense[] is uninitialized;
@@ -77,9 +80,12 @@ struct SCSIDevice
     uint32_t sense_len;
 
     /*
-     * The requests list is only accessed from the AioContext that executes
-     * requests or from the main loop when IOThread processing is stopped.
+     * Requests of one device can run in several AioContexts, for example
+     * when an HBA has one IOThread per queue.  Each request is only
+     * processed in its own AioContext; the list itself is protected by
+     * requests_lock.
      */
+    QemuMutex requests_lock;
     QTAILQ_HEAD(, SCSIRequest) requests;
 
     uint32_t channel;
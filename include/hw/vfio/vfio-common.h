@@ -33,6 +33,7 @@
 #include "hw/vfio/vfio-container-base.h"
 #include "sysemu/host_iommu_device.h"
 #include "sysemu/iommufd.h"
+#include "qapi/qapi-types-migration.h"
 
 #define VFIO_MSG_PREFIX "vfio %s: "
 
@@ -61,6 +62,9 @@ typedef struct VFIORegion {
     uint8_t nr; /* cache the region number for debug */
 } VFIORegion;
 
+typedef struct VFIOMultifd VFIOMultifd;
+typedef struct VFIOPrecopyBuffer VFIOPrecopyBuffer;
+
 typedef struct VFIOMigration {
     struct VFIODevice *vbasedev;
     VMChangeStateEntry *vm_state;
@@ -73,6 +77,14 @@ typedef struct VFIOMigration {
     uint64_t precopy_init_size;
     uint64_t precopy_dirty_size;
     bool initial_data_sent;
+    /* Stop-copy device state is transferred over multifd channels */
+    bool multifd_transfer;
+    VFIOMultifd *multifd;
+    /* Precopy data is read from / written to the device by a thread */
+    VFIOPrecopyBuffer *precopy_buffer;
+    MultiFDCompression compression;
+    uint8_t *compress_buffer;
+    size_t compress_buffer_size;
 } VFIOMigration;
 
 struct VFIOGroup;
@@ -82,6 +94,9 @@ typedef struct VFIOContainer {
     int fd; /* /dev/vfio/vfio, empowered by the attached groups */
     unsigned iommu_type;
     QLIST_HEAD(, VFIOGroup) group_list;
+    /* The vaddr of all DMA mappings was invalidated for cpr-exec */
+    bool cpr_vaddr_unmapped;
+    MemoryListener cpr_remap_listener;
 } VFIOContainer;
 
 typedef struct VFIOHostDMAWindow {
@@ -93,10 +108,21 @@ typedef struct VFIOHostDMAWindow {
 
 typedef struct IOMMUFDBackend IOMMUFDBackend;
 
+/*
+ * A hwpt allocated on the container IOAS with dirty tracking enabled, shared
+ * by the devices whose IOMMU supports it.
+ */
+typedef struct VFIOIOASHwpt {
+    uint32_t hwpt_id;
+    QLIST_HEAD(, VFIODevice) device_list;
+    QLIST_ENTRY(VFIOIOASHwpt) next;
+} VFIOIOASHwpt;
+
 typedef struct VFIOIOMMUFDContainer {
     VFIOContainerBase bcontainer;
     IOMMUFDBackend *be;
     uint32_t ioas_id;
+    QLIST_HEAD(, VFIOIOASHwpt) hwpt_list;
 } VFIOIOMMUFDContainer;
 
 typedef struct VFIODeviceOps VFIODeviceOps;
@@ -115,8 +141,14 @@ typedef struct VFIODevice {
     bool reset_works;
     bool needs_reset;
     bool no_mmap;
+    /* Inherited from the QEMU that cpr-exec'ed us, until the VM runs */
+    bool cpr_reused;
     bool ram_block_discard_allowed;
     OnOffAuto enable_migration;
+    bool migration_multifd_transfer;
+    uint64_t migration_precopy_buffer_size;
+    MultiFDCompression migration_compression;
+    bool migration_zero_elision;
     VFIODeviceOps *ops;
     unsigned int num_irqs;
     unsigned int num_regions;
@@ -126,9 +158,12 @@ typedef struct VFIODevice {
     OnOffAuto pre_copy_dirty_page_tracking;
     bool dirty_pages_supported;
     bool dirty_tracking;
+    bool iommu_dirty_tracking;
     HostIOMMUDevice *hiod;
     int devid;
     IOMMUFDBackend *iommufd;
+    VFIOIOASHwpt *hwpt;
+    QLIST_ENTRY(VFIODevice) hwpt_next;
 } VFIODevice;
 
 struct VFIODeviceOps {
@@ -230,6 +265,13 @@ int vfio_kvm_device_del_fd(int fd, Error **errp);
 
 int vfio_cpr_register_container(VFIOContainerBase *bcontainer, Error **errp);
 void vfio_cpr_unregister_container(VFIOContainerBase *bcontainer);
+int vfio_cpr_dma_map(VFIOContainerBase *bcontainer, MemoryRegion *mr,
+                     hwaddr iova, ram_addr_t size, void *vaddr,
+                     bool readonly);
+int vfio_cpr_update_vaddr(VFIOContainer *container, hwaddr iova,
+                          ram_addr_t size, void *vaddr);
+void vfio_container_region_add(VFIOContainerBase *bcontainer,
+                               MemoryRegionSection *section, bool cpr_remap);
 
 extern const MemoryRegionOps vfio_region_ops;
 typedef QLIST_HEAD(VFIOGroupList, VFIOGroup) VFIOGroupList;
@@ -14,6 +14,7 @@
 #define HW_VFIO_VFIO_CONTAINER_BASE_H
 
 #include "exec/memory.h"
+#include "qemu/interval-tree.h"
 
 typedef struct VFIODevice VFIODevice;
 typedef struct VFIOIOMMUClass VFIOIOMMUClass;
@@ -24,6 +25,15 @@ typedef struct {
     hwaddr pages;
 } VFIOBitmap;
 
+/* A DMA unmap deferred until the end of a memory transaction */
+typedef struct VFIODMARange {
+    MemoryRegion *mr;
+    hwaddr iova;
+    ram_addr_t size;
+    void *vaddr;
+    bool readonly;
+} VFIODMARange;
+
 typedef struct VFIOAddressSpace {
     AddressSpace *as;
     QLIST_HEAD(, VFIOContainerBase) containers;
@@ -50,6 +60,16 @@ typedef struct VFIOContainerBase {
     QLIST_HEAD(, VFIODevice) device_list;
     GList *iova_ranges;
     NotifierWithReturn cpr_reboot_notifier;
+    NotifierWithReturn cpr_exec_notifier;
+    Error *cpr_exec_blocker;
+    /* Inherited from the QEMU that cpr-exec'ed us, until the VM runs */
+    bool cpr_reused;
+    /* Memory transaction in progress, see vfio_container_dma_batch_begin() */
+    bool dma_batching;
+    GArray *pending_unmaps;
+    /* IOVA ranges handed to device DMA logging while it is running */
+    IntervalTreeRoot dirty_tracking_ranges;
+    unsigned int nr_dirty_tracking_ranges;
 } VFIOContainerBase;
 
 typedef struct VFIOGuestIOMMU {
@@ -76,6 +96,15 @@ int vfio_container_dma_map(VFIOContainerBase *bcontainer,
 int vfio_container_dma_unmap(VFIOContainerBase *bcontainer,
                              hwaddr iova, ram_addr_t size,
                              IOMMUTLBEntry *iotlb);
+void vfio_container_dma_batch_begin(VFIOContainerBase *bcontainer);
+void vfio_container_dma_batch_commit(VFIOContainerBase *bcontainer);
+bool vfio_container_dma_unmap_defer(VFIOContainerBase *bcontainer,
+                                    MemoryRegion *mr, hwaddr iova,
+                                    ram_addr_t size, void *vaddr,
+                                    bool readonly);
+bool vfio_container_dma_unmap_cancel(VFIOContainerBase *bcontainer,
+                                     hwaddr iova, ram_addr_t size,
+                                     void *vaddr, bool readonly);
 int vfio_container_add_section_window(VFIOContainerBase *bcontainer,
                                       MemoryRegionSection *section,
                                       Error **errp);
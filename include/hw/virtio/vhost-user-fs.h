@@ -23,11 +23,30 @@
 #define TYPE_VHOST_USER_FS "vhost-user-fs-device"
 OBJECT_DECLARE_SIMPLE_TYPE(VHostUserFS, VHOST_USER_FS)
 
+/* Structures carried over the backend channel back to QEMU */
+#define VHOST_USER_FS_BACKEND_ENTRIES 8
+
+/* For the flags field of VhostUserFSBackendMsg */
+#define VHOST_USER_FS_FLAG_MAP_R (1ULL << 0)
+#define VHOST_USER_FS_FLAG_MAP_W (1ULL << 1)
+
+typedef struct {
+    /* Offsets within the file being mapped */
+    uint64_t fd_offset[VHOST_USER_FS_BACKEND_ENTRIES];
+    /* Offsets within the cache */
+    uint64_t c_offset[VHOST_USER_FS_BACKEND_ENTRIES];
+    /* Lengths of sections */
+    uint64_t len[VHOST_USER_FS_BACKEND_ENTRIES];
+    /* Flags, from VHOST_USER_FS_FLAG_* */
+    uint64_t flags[VHOST_USER_FS_BACKEND_ENTRIES];
+} VhostUserFSBackendMsg;
+
 typedef struct {
     CharBackend chardev;
     char *tag;
     uint16_t num_request_queues;
     uint16_t queue_size;
+    uint64_t cache_size;
 } VHostUserFSConf;
 
 struct VHostUserFS {
@@ -40,8 +59,17 @@ struct VHostUserFS {
     VirtQueue **req_vqs;
     VirtQueue *hiprio_vq;
     int32_t bootindex;
+    /* DAX window the back-end maps file ranges into, if cache-size is set */
+    MemoryRegion cache;
+    Error *migration_blocker;
 
     /*< public >*/
 };
 
+/* Back-end requests to map and unmap file ranges in the DAX window */
+int vhost_user_fs_backend_map(struct vhost_dev *dev, int message_size,
+                              VhostUserFSBackendMsg *sm, int fd);
+int vhost_user_fs_backend_unmap(struct vhost_dev *dev, int message_size,
+                                VhostUserFSBackendMsg *sm);
+
 #endif /* QEMU_VHOST_USER_FS_H */
@@ -51,6 +51,13 @@ typedef struct vhost_vdpa_shared {
 
     bool iotlb_batch_begin_sent;
 
+    /*
+     * The memory listener is registered and its guest mappings are in the
+     * device.  With VHOST_BACKEND_F_IOTLB_PERSIST they stay there across
+     * device resets, as long as they are guest physical addresses.
+     */
+    bool listener_registered;
+
     /* Vdpa must send shadow addresses as IOTLB key for data queues, not GPA */
     bool shadow_data;
 
@@ -68,6 +68,9 @@ struct VirtIOBalloon {
     int64_t stats_last_update;
     int64_t stats_poll_interval;
     uint32_t host_features;
+    /* Bytes reported free by the guest, and bytes actually discarded */
+    uint64_t reporting_reported_bytes;
+    uint64_t reporting_discarded_bytes;
 
     bool qemu_4_0_config_size;
     uint32_t poison_val;
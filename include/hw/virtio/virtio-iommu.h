@@ -69,6 +69,8 @@ struct VirtIOIOMMU {
     bool granule_frozen;
     GranuleMode granule_mode;
     uint8_t aw_bits;
+    /* Requests being processed by the request queue handler, if any */
+    struct VirtIOIOMMUBatch *batch;
 };
 
 #endif
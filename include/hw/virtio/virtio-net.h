@@ -20,8 +20,11 @@
 #include "net/announce.h"
 #include "qemu/option_int.h"
 #include "qom/object.h"
+#include "sysemu/iothread.h"
 
 #include "ebpf/ebpf_rss.h"
+#include "ebpf/ebpf_rx_filter.h"
+#include "net/gro.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 OBJECT_DECLARE_SIMPLE_TYPE(VirtIONet, VIRTIO_NET)
@@ -56,6 +59,7 @@ typedef struct virtio_net_conf
     char *duplex_str;
     uint8_t duplex;
     char *primary_id_str;
+    IOThreadVirtQueueMappingList *iothread_vq_mapping_list;
 } virtio_net_conf;
 
 /* Coalesced packets type & status */
@@ -159,7 +163,14 @@ typedef struct VirtIONetQueue {
     uint32_t tx_waiting;
     struct {
         VirtQueueElement *elem;
+        /* Byte swapped header of elem */
+        struct virtio_net_hdr_v1_hash vhdr;
     } async_tx;
+    /* The peer is sending a burst, notify the guest at its end */
+    bool rx_burst;
+    bool rx_notify_pending;
+    /* Coalesces frames from backends without a vnet header */
+    NetGro *gro;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -227,6 +238,13 @@ struct VirtIONet {
     struct EBPFRSSContext ebpf_rss;
     uint32_t nr_ebpf_rss_fds;
     char **ebpf_rss_fds;
+    struct EBPFRxFilterContext ebpf_rx_filter;
+    bool ebpf_rx_filter_enabled;
+    bool gro;
+    /* Per queue pair AioContext, NULL without iothread-vq-mapping */
+    AioContext **vq_aio_context;
+    bool ioeventfd_started;
+    unsigned int dataplane_pause_depth;
 };
 
 size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
@@ -32,6 +32,13 @@ struct VirtIOPMEM {
     VirtQueue *rq_vq;
     uint64_t start;
     HostMemoryBackend *memdev;
+
+    /*
+     * Flush requests that arrived while an fsync was in flight; they are
+     * all completed by the next one.
+     */
+    bool flush_in_flight;
+    QTAILQ_HEAD(, VirtIODeviceRequest) flush_pending;
 };
 
 struct VirtIOPMEMClass {
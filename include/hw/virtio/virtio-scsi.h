@@ -60,6 +60,7 @@ struct VirtIOSCSIConf {
     CharBackend chardev;
     uint32_t boot_tpgt;
     IOThread *iothread;
+    IOThreadVirtQueueMappingList *iothread_vq_mapping_list;
 };
 
 struct VirtIOSCSI;
@@ -92,8 +93,19 @@ struct VirtIOSCSI {
     QEMUBH *tmf_bh;
     QTAILQ_HEAD(, VirtIOSCSIReq) tmf_bh_list;
 
+    /*
+     * Serializes the ctrl virtqueue, which is processed in the main loop
+     * but where TMFs that cancel requests can complete from any IOThread.
+     */
+    QemuMutex ctrl_lock;
+
     /* Fields for dataplane below */
-    AioContext *ctx; /* one iothread per virtio-scsi-pci for now */
+
+    /*
+     * AioContext of each virtqueue, or NULL without ioeventfd.  The ctrl and
+     * event virtqueues always run in the main loop.
+     */
+    AioContext **vq_aio_context;
 
     bool dataplane_started;
     bool dataplane_starting;
@@ -111,6 +123,7 @@ void virtio_scsi_common_realize(DeviceState *dev,
 void virtio_scsi_common_unrealize(DeviceState *dev);
 
 void virtio_scsi_dataplane_setup(VirtIOSCSI *s, Error **errp);
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s);
 int virtio_scsi_dataplane_start(VirtIODevice *s);
 void virtio_scsi_dataplane_stop(VirtIODevice *s);
 
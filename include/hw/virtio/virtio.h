@@ -69,6 +69,10 @@ typedef struct VirtQueueElement
     unsigned int ndescs;
     unsigned int out_num;
     unsigned int in_num;
+    /* Size class in the virtqueue element pool, or 0 if not pooled */
+    unsigned int pool_class;
+    /* When the element was popped, or 0 without x-latency-stats */
+    int64_t pop_ns;
     hwaddr *in_addr;
     hwaddr *out_addr;
     struct iovec *in_sg;
@@ -147,6 +151,16 @@ struct VirtIODevice
     bool started;
     bool start_on_kick; /* when virtio 1.0 feature has not been negotiated */
     bool disable_legacy_check;
+    /*
+     * @notify_coalesce_us: if non-zero, virtio_notify_irqfd() may hold back
+     * an interrupt for up to this long so that it covers several
+     * completions.  How many completions it waits for adapts to the
+     * completion rate, up to @notify_coalesce_max.
+     */
+    uint32_t notify_coalesce_us;
+    uint32_t notify_coalesce_max;
+    /* @latency_stats: keep latency histograms of the virtqueues */
+    bool latency_stats;
     bool vhost_started;
     VMChangeStateEntry *vmstate;
     char *bus_name;
@@ -265,7 +279,32 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
 void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem);
 void *virtqueue_pop(VirtQueue *vq, size_t sz);
+/**
+ * virtqueue_pop_batch:
+ * @vq: a VirtQueue
+ * @sz: size of each element, as for virtqueue_pop()
+ * @elems: array receiving the popped elements
+ * @max: capacity of @elems
+ *
+ * Pop up to @max available elements.  On split rings the avail index and
+ * the descriptor region caches are only looked up once for the whole batch.
+ *
+ * Returns: the number of elements stored in @elems.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max);
 unsigned int virtqueue_drop_all(VirtQueue *vq);
+/**
+ * virtqueue_element_free:
+ * @vq: the VirtQueue the element was popped from
+ * @elem: the element, or the device request embedding it at offset 0
+ *
+ * Release an element returned by virtqueue_pop().  The memory is kept for
+ * reuse by later pops from @vq instead of going back to the allocator.
+ * Calling g_free() on a popped element is still allowed, it just bypasses
+ * the pool.
+ */
+void virtqueue_element_free(VirtQueue *vq, void *elem);
 void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz);
 void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
                                 VirtQueueElement *elem);
@@ -391,6 +430,8 @@ EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq);
 void virtio_queue_set_guest_notifier_fd_handler(VirtQueue *vq, bool assign,
                                                 bool with_irqfd);
 int virtio_device_start_ioeventfd(VirtIODevice *vdev);
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev);
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev);
 int virtio_device_grab_ioeventfd(VirtIODevice *vdev);
 void virtio_device_release_ioeventfd(VirtIODevice *vdev);
 bool virtio_device_ioeventfd_enabled(VirtIODevice *vdev);
@@ -261,5 +261,18 @@ QIOChannelSocket *
 qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
+/**
+ * qio_channel_socket_enable_zero_copy:
+ * @ioc: the socket channel object
+ *
+ * Enable MSG_ZEROCOPY on the socket, if the host supports it, so
+ * that QIO_CHANNEL_WRITE_FLAG_ZERO_COPY can be used for writes.
+ * This is done by qio_channel_socket_connect_sync(), other
+ * connections such as accepted clients have to ask for it.
+ *
+ * Returns: true if zero copy writes are available
+ */
+bool qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc);
+
 
 #endif /* QIO_CHANNEL_SOCKET_H */
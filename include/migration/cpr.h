@@ -0,0 +1,46 @@
+/*
+ * CheckPoint and Restart (CPR)
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef MIGRATION_CPR_H
+#define MIGRATION_CPR_H
+
+#include "qapi/qapi-types-migration.h"
+
+/*
+ * File descriptors that a new QEMU inherits in cpr-exec mode.  Each
+ * descriptor is identified by a @name and an @id, which the old and
+ * the new QEMU must compute in the same way for the same object.
+ *
+ * cpr_save_fd() records a descriptor that the new QEMU should reuse,
+ * and cpr_delete_fd() forgets it when the object goes away.
+ * cpr_find_fd() returns the inherited descriptor, or -1 if there is
+ * none.  Inherited descriptors stay recorded, so that they are passed
+ * on again by the next cpr-exec.
+ */
+void cpr_save_fd(const char *name, int id, int fd);
+void cpr_delete_fd(const char *name, int id);
+int cpr_find_fd(const char *name, int id);
+
+/*
+ * The mode of the migration that started this QEMU, or MIG_MODE_NORMAL
+ * if it was not started by cpr-exec.
+ */
+MigMode cpr_get_incoming_mode(void);
+void cpr_set_incoming_mode(MigMode mode);
+
+/* True if the current outgoing or incoming migration is a cpr-exec */
+bool cpr_is_exec(void);
+
+/* Load the state passed by the QEMU that started this one, if any */
+int cpr_state_load(Error **errp);
+
+/*
+ * Execute the cpr-exec-command migration parameter, passing the recorded
+ * descriptors.  Return only on failure.
+ */
+void cpr_exec(Error **errp);
+
+#endif
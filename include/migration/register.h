@@ -102,6 +102,28 @@ typedef struct SaveVMHandlers {
      */
     int (*save_live_complete_precopy)(QEMUFile *f, void *opaque);
 
+    /* This runs outside the BQL, in a dedicated thread per device.  */
+
+    /**
+     * @save_live_complete_precopy_thread
+     *
+     * Called at the end of a precopy phase from a separate thread,
+     * concurrently with @save_live_complete_precopy of all the devices.
+     * Intended for devices that transfer their final state over multifd
+     * channels using multifd_queue_device_state(), so that the state of
+     * multiple devices is saved in parallel.
+     *
+     * @idstr: this device's section idstr
+     * @instance_id: this device's section instance_id
+     * @opaque: data pointer passed to register_savevm_live()
+     * @errp: pointer to Error*, to store an error if it happens.
+     *
+     * Returns zero to indicate success and negative for error
+     */
+    int (*save_live_complete_precopy_thread)(char *idstr,
+                                             uint32_t instance_id,
+                                             void *opaque, Error **errp);
+
     /* This runs both outside and inside the BQL.  */
 
     /**
@@ -226,6 +248,23 @@ typedef struct SaveVMHandlers {
      */
     int (*load_state)(QEMUFile *f, void *opaque, int version_id);
 
+    /**
+     * @load_state_buffer
+     *
+     * Load device state buffer sent by the source with
+     * multifd_queue_device_state().  Called from a multifd receive
+     * thread, outside the BQL.
+     *
+     * @opaque: data pointer passed to register_savevm_live()
+     * @buf: the data buffer to load
+     * @len: the data length in buffer
+     * @errp: pointer to Error*, to store an error if it happens.
+     *
+     * Returns zero to indicate success and negative for error
+     */
+    int (*load_state_buffer)(void *opaque, char *buf, size_t len,
+                             Error **errp);
+
     /**
      * @load_setup
      *
@@ -198,6 +198,13 @@ struct VMStateDescription {
      * a QEMU_VM_SECTION_START section.
      */
     bool early_setup;
+    /*
+     * The state of this VMSD can be saved by a thread other than the
+     * migration thread, which holds the BQL meanwhile, concurrently with
+     * other VMSDs that set this.  The save must only read the state of
+     * the device, and its pre_save() must not need to own the BQL.
+     */
+    bool parallel_save;
     int version_id;
     int minimum_version_id;
     MigrationPriority priority;
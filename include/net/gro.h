@@ -0,0 +1,43 @@
+/*
+ * Generic receive offload
+ *
+ * Coalesces TCP segments received from backends that have no vnet header
+ * into large frames described by a struct virtio_net_hdr, for NIC models
+ * that can hand such frames to the guest.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef QEMU_NET_GRO_H
+#define QEMU_NET_GRO_H
+
+#include "hw/qdev-core.h"
+#include "standard-headers/linux/virtio_net.h"
+
+typedef struct NetGro NetGro;
+
+/*
+ * Called for every frame leaving the GRO stage.  @hdr is NULL for frames
+ * that are passed through unmodified; for coalesced frames its fields are
+ * in host byte order.  Returns like NetReceive, with 0 meaning that the
+ * frame cannot be taken now and must be offered again later.
+ */
+typedef ssize_t (NetGroDeliver)(void *opaque, const struct virtio_net_hdr *hdr,
+                                const uint8_t *buf, size_t size);
+
+/*
+ * Coalesce TCP over IPv4 if @tcp4 and over IPv6 if @tcp6.  The GRO stage
+ * flushes itself from a main loop bottom half, and when net_gro_flush()
+ * is called at the end of a burst of packets.
+ */
+NetGro *net_gro_new(bool tcp4, bool tcp6, NetGroDeliver *deliver,
+                    void *opaque, MemReentrancyGuard *reentrancy_guard);
+void net_gro_free(NetGro *gro);
+
+/* Like NetReceive, returns 0 while earlier frames are still undelivered */
+ssize_t net_gro_receive(NetGro *gro, const uint8_t *buf, size_t size);
+
+/* Returns false if some frames could not be delivered yet */
+bool net_gro_flush(NetGro *gro);
+
+#endif /* QEMU_NET_GRO_H */
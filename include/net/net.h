@@ -68,7 +68,12 @@ typedef struct SocketReadState SocketReadState;
 typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 typedef void (NetAnnounce)(NetClientState *);
 typedef bool (SetSteeringEBPF)(NetClientState *, int);
+typedef bool (SetFilterEBPF)(NetClientState *, int);
 typedef bool (NetCheckPeerType)(NetClientState *, ObjectClass *, Error **);
+typedef void (NetSetAioContext)(NetClientState *, AioContext *);
+typedef int (NetReceiveBatch)(NetClientState *, const struct iovec *,
+                              const int *, int);
+typedef void (NetReceiveBurst)(NetClientState *, bool);
 
 typedef struct NetClientInfo {
     NetClientDriver type;
@@ -97,7 +102,21 @@ typedef struct NetClientInfo {
     SetVnetBE *set_vnet_be;
     NetAnnounce *announce;
     SetSteeringEBPF *set_steering_ebpf;
+    SetFilterEBPF *set_filter_ebpf;
     NetCheckPeerType *check_peer_type;
+    NetSetAioContext *set_aio_context;
+    /*
+     * Receive several packets at once.  The iovec array holds the packets
+     * back to back, packet i using iovcnt[i] entries.  Returns how many
+     * packets were consumed; fewer than requested means the backend would
+     * block and flushes its queue once it can write again.
+     */
+    NetReceiveBatch *receive_batch;
+    /*
+     * Called with true before and false after the peer sends a burst of
+     * packets, so that completion work can be done once per burst.
+     */
+    NetReceiveBurst *receive_burst;
 } NetClientInfo;
 
 struct NetClientState {
@@ -176,6 +195,12 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
+ssize_t qemu_sendv_packet_zerocopy(NetClientState *nc, const struct iovec *iov,
+                                   int iovcnt, NetPacketSent *sent_cb);
+int qemu_sendv_packet_batch(NetClientState *nc, const struct iovec *iov,
+                            const int *iovcnt, int count);
+void qemu_send_burst_begin(NetClientState *nc);
+void qemu_send_burst_end(NetClientState *nc);
 ssize_t qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_receive_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_receive_packet_iov(NetClientState *nc,
@@ -202,6 +227,8 @@ int qemu_get_vnet_hdr_len(NetClientState *nc);
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len);
 int qemu_set_vnet_le(NetClientState *nc, bool is_le);
 int qemu_set_vnet_be(NetClientState *nc, bool is_be);
+bool qemu_can_set_aio_context(NetClientState *nc);
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
 /**
  * qemu_find_nic_info: Obtain NIC configuration information
@@ -32,6 +32,11 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+/*
+ * The sender keeps the packet's buffers alive until its sent callback
+ * runs, so a packet that has to be queued is referenced, not copied.
+ */
+#define QEMU_NET_PACKET_FLAG_ZEROCOPY  (1<<1)
 
 /* Returns:
  *   >0 - success
@@ -79,5 +84,6 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
 
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
+bool qemu_net_queue_idle(NetQueue *queue);
 
 #endif /* QEMU_NET_QUEUE_H */
@@ -53,4 +53,5 @@ int vhost_net_virtqueue_restart(VirtIODevice *vdev, NetClientState *nc,
                                 int vq_index);
 
 void vhost_net_save_acked_features(NetClientState *nc);
+void vhost_net_reset_inflight(NetClientState *nc);
 #endif
@@ -0,0 +1,32 @@
+/*
+ * JSON Input Visitor
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef JSON_INPUT_VISITOR_H
+#define JSON_INPUT_VISITOR_H
+
+#include "qapi/visitor.h"
+
+typedef struct JSONInputVisitor JSONInputVisitor;
+
+/*
+ * Create a JSON input visitor for the JSON text @json
+ *
+ * A JSON input visitor builds a QAPI object straight from JSON text,
+ * without building a QObject first.  It matches types exactly like
+ * the visitor returned by qobject_input_visitor_new() does for the
+ * QObject that qobject_from_json() would return for @json, and it
+ * reports the same errors.  Only visit_type_any() creates QObjects.
+ *
+ * @json is parsed and checked completely before this returns.  The
+ * JSON dialect is the one accepted by qobject_from_json(), without
+ * interpolation.  On parse error, return NULL and set @errp.
+ *
+ * The caller must keep @json alive and unchanged until the visitor is
+ * freed.
+ */
+Visitor *json_input_visitor_new(const char *json, Error **errp);
+
+#endif
@@ -15,6 +15,7 @@
 
 #ifdef CONFIG_LINUX
 void init_async_teardown(void);
+bool async_teardown_hand_over_fd(int fd);
 #endif
 
 #endif
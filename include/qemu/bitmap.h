@@ -256,6 +256,22 @@ bool bitmap_test_and_clear_atomic(unsigned long *map, long start, long nr);
 bool bitmap_test_and_clear(unsigned long *map, long start, long nr);
 void bitmap_copy_and_clear_atomic(unsigned long *dst, unsigned long *src,
                                   long nr);
+
+/*
+ * Atomically fetch and clear the first @nr bits of @src, and OR them
+ * into @dst.  Returns the number of bits that were set in @src but not
+ * in @dst.
+ */
+long bitmap_or_and_clear_atomic(unsigned long *dst, unsigned long *src,
+                                long nr);
+
+/*
+ * Returns the index of the first nonzero word of @map between @start and
+ * @nwords, or @nwords if there is none.  Long clear ranges are skipped
+ * with vector instructions.
+ */
+long bitmap_find_next_nonzero_word(const unsigned long *map, long start,
+                                   long nwords);
 unsigned long bitmap_find_next_zero_area(unsigned long *map,
                                          unsigned long size,
                                          unsigned long start,
@@ -281,6 +281,21 @@ void qemu_coroutine_inc_pool_size(unsigned int additional_pool_size);
  */
 void qemu_coroutine_dec_pool_size(unsigned int additional_pool_size);
 
+typedef struct CoroutineStats {
+    /* Coroutines recycled from the pool, and created from scratch */
+    uint64_t pool_hits;
+    uint64_t pool_misses;
+    /* Stacks in use, and address space set aside for stacks */
+    uint64_t stacks;
+    uint64_t stack_bytes_reserved;
+} CoroutineStats;
+
+/**
+ * Get coroutine pool and stack statistics.  Pool hits are counted per
+ * thread and may lag behind by a few coroutines.
+ */
+void qemu_coroutine_get_stats(CoroutineStats *stats);
+
 #include "qemu/lockable.h"
 
 /**
@@ -69,6 +69,17 @@ struct Coroutine {
     QSLIST_ENTRY(Coroutine) co_scheduled_next;
 };
 
+#ifndef _WIN32
+/*
+ * Allocate and free coroutine stacks like qemu_alloc_stack() and
+ * qemu_free_stack(), but recycle stacks of COROUTINE_STACK_SIZE bytes
+ * through an arena instead of mapping each of them separately.
+ */
+void *qemu_coroutine_stack_alloc(size_t *sz);
+void qemu_coroutine_stack_free(void *stack, size_t sz);
+void qemu_coroutine_stack_stats(CoroutineStats *stats);
+#endif
+
 Coroutine *qemu_coroutine_new(void);
 void qemu_coroutine_delete(Coroutine *co);
 CoroutineAction qemu_coroutine_switch(Coroutine *from, Coroutine *to,
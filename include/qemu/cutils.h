@@ -188,6 +188,8 @@ char *freq_to_str(uint64_t freq_hz);
 #define STR_OR_NULL(str) ((str) ? (str) : "null")
 
 bool buffer_is_zero(const void *buf, size_t len);
+size_t buffer_is_zero_batch(const void * const *bufs, size_t n, size_t len,
+                            unsigned long *zero);
 bool test_buffer_is_zero_next_accel(void);
 
 /*
@@ -696,20 +696,46 @@ typedef struct ThreadContext ThreadContext;
  * each page in the area was faulted in writable at least once, for example,
  * after allocating file blocks for mapped files.
  *
- * When setting @async, allocation might be performed asynchronously.
- * qemu_finish_async_prealloc_mem() must be called to finish any asynchronous
- * preallocation.
+ * When setting @async, allocation might be performed asynchronously: the
+ * area is then populated in the background after this function returns,
+ * and qemu_finish_async_prealloc_mem() must be called to finish any
+ * asynchronous preallocation.  Callers must not rely on the memory being
+ * populated before that.
  *
  * Return: true on success, else false setting @errp with error.
  */
 bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
                        ThreadContext *tc, bool async, Error **errp);
 
+/**
+ * qemu_prealloc_mem_nodes:
+ * @fd: the fd mapped into the area, -1 for anonymous memory
+ * @area: start address of the are to preallocate
+ * @sz: the size of the area to preallocate
+ * @max_threads: maximum number of threads to use per context
+ * @tcs: prealloc context threads pointers, NULL if not in use
+ * @n_tcs: number of entries in @tcs
+ * @async: request asynchronous preallocation, requires @tcs
+ * @errp: returns an error if this function fails
+ *
+ * Like qemu_prealloc_mem(), but split the area into @n_tcs consecutive
+ * parts of about the same size, each preallocated by threads created in
+ * the matching context of @tcs.  With contexts bound to the host NUMA nodes
+ * of a memory policy, every node gets its share of the area faulted in by
+ * local CPUs.
+ *
+ * Return: true on success, else false setting @errp with error.
+ */
+bool qemu_prealloc_mem_nodes(int fd, char *area, size_t sz, int max_threads,
+                             ThreadContext **tcs, int n_tcs, bool async,
+                             Error **errp);
+
 /**
  * qemu_finish_async_prealloc_mem:
  * @errp: returns an error if this function fails
  *
- * Finish all outstanding asynchronous memory preallocation.
+ * Wait for all outstanding asynchronous memory preallocation to complete
+ * and report the first failure.
  *
  * Return: true on success, else false setting @errp with error.
  */
@@ -75,6 +75,12 @@ enum plugin_dyn_cb_subtype {
     PLUGIN_CB_REGULAR,
     PLUGIN_CB_REGULAR_R,
     PLUGIN_CB_INLINE,
+    /*
+     * Emitted after the inline ops; these need control flow and are
+     * generated directly rather than copied from an empty callback.
+     */
+    PLUGIN_CB_COND,
+    PLUGIN_CB_MEM_RECORD,
     PLUGIN_N_CB_SUBTYPES,
 };
 
@@ -96,6 +102,17 @@ struct qemu_plugin_dyn_cb {
             enum qemu_plugin_op op;
             uint64_t imm;
         } inline_insn;
+        struct {
+            qemu_plugin_u64 entry;
+            enum qemu_plugin_cond cond;
+            uint64_t imm;
+            /* call the helper that syncs registers for the callback */
+            bool read_regs;
+        } cond;
+        struct {
+            qemu_plugin_u64 entry;
+            size_t size;
+        } record;
     };
 };
 
@@ -172,6 +172,30 @@ bool qht_reset_size(struct qht *ht, size_t n_elems);
  */
 bool qht_resize(struct qht *ht, size_t n_elems);
 
+/**
+ * qht_resize_start - start resizing a QHT incrementally
+ * @ht: QHT to be resized
+ * @n_elems: number of entries the resized hash table should be optimized for
+ *
+ * Unlike qht_resize(), only a few buckets are moved to the resized table
+ * before returning.  The others are moved by later insertions and removals,
+ * or by qht_resize_step(), while lookups keep finding all entries.
+ * Automatic resizes are always done this way.
+ *
+ * Returns true if the resize was started.
+ * Returns false if it was not necessary, or if another resize is in progress.
+ */
+bool qht_resize_start(struct qht *ht, size_t n_elems);
+
+/**
+ * qht_resize_step - make progress on an incremental resize
+ * @ht: QHT being resized
+ *
+ * Returns true if the resize is still in progress after moving a few buckets.
+ * Returns false if it is complete, or if no resize was in progress.
+ */
+bool qht_resize_step(struct qht *ht);
+
 /**
  * qht_iter - Iterate over a QHT
  * @ht: QHT to be iterated over
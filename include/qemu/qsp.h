@@ -16,12 +16,39 @@ enum QSPSortBy {
     QSP_SORT_BY_AVG_WAIT_TIME,
 };
 
+/* Log2 buckets of the BQL hold time histogram, in nanoseconds */
+#define QSP_HOLD_TIME_BUCKETS 32
+
+typedef struct QSPCallSiteStats {
+    const char *type;
+    const char *call_site;
+    uint64_t n_acqs;
+    uint64_t wait_ns;
+    /* The BQL is also profiled from its acquisition to its release */
+    bool has_hold_time;
+    uint64_t hold_ns;
+    uint64_t hold_hist[QSP_HOLD_TIME_BUCKETS];
+} QSPCallSiteStats;
+
+typedef void QSPCallSiteFunc(const QSPCallSiteStats *stats, void *opaque);
+
 void qsp_report(size_t max, enum QSPSortBy sort_by,
                 bool callsite_coalesce);
 
+/* Call @fn for each call site, coalescing the objects it operated on */
+void qsp_foreach_call_site(QSPCallSiteFunc *fn, void *opaque);
+
 bool qsp_is_enabled(void);
 void qsp_enable(void);
 void qsp_disable(void);
 void qsp_reset(void);
 
+/*
+ * Profile only one in @period acquisitions and waits of each thread.
+ * Sampled events are weighted so that counts and times remain estimates
+ * of the totals.
+ */
+void qsp_set_sample_period(unsigned int period);
+unsigned int qsp_get_sample_period(void);
+
 #endif /* QEMU_QSP_H */
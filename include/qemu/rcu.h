@@ -143,6 +143,16 @@ struct rcu_head {
 void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
 void drain_call_rcu(void);
 
+typedef struct RCUStats {
+    /* Callbacks passed to call_rcu1() that have not run yet */
+    uint64_t pending_callbacks;
+    /* Grace periods waited for, and how many were expedited */
+    uint64_t grace_periods;
+    uint64_t expedited_grace_periods;
+} RCUStats;
+
+void rcu_get_stats(RCUStats *stats);
+
 /* The operands of the minus operator must have the same type,
  * which must be the one that we specify in the cast.
  */
@@ -54,4 +54,11 @@ void thread_context_create_thread(ThreadContext *tc, QemuThread *thread,
                                   void *(*start_routine)(void *), void *arg,
                                   int mode);
 
+/*
+ * Apply the current CPU affinity of the context to an existing thread, for
+ * threads that cannot be created within the context.
+ */
+bool thread_context_set_thread_affinity(ThreadContext *tc, QemuThread *thread,
+                                        Error **errp);
+
 #endif /* SYSEMU_THREAD_CONTEXT_H */
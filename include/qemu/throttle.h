@@ -158,6 +158,12 @@ bool throttle_schedule_timer(ThrottleState *ts,
 
 void throttle_account(ThrottleState *ts, ThrottleDirection direction,
                       uint64_t size);
+
+void throttle_compute_credit(ThrottleState *ts, ThrottleDirection direction,
+                             uint32_t ns, uint64_t *units, uint64_t *size);
+void throttle_account_credit(ThrottleState *ts, ThrottleDirection direction,
+                             uint64_t units, uint64_t size);
+
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
 void throttle_config_to_limits(ThrottleConfig *cfg, ThrottleLimits *var);
@@ -4,6 +4,7 @@
 #include "qemu/bitops.h"
 #include "qemu/notify.h"
 #include "qemu/host-utils.h"
+#include "qemu/queue.h"
 
 #define NANOSECONDS_PER_SECOND 1000000000LL
 
@@ -86,7 +87,7 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    QTAILQ_ENTRY(QEMUTimer) node;
     int attributes;
     int scale;
 };
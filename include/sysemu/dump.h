@@ -212,6 +212,8 @@ typedef struct DumpState {
                                   * finished. */
     uint8_t *guest_note;         /* ELF note content */
     size_t guest_note_size;
+    int compress_threads;        /* threads compressing kdump pages */
+    bool elf_sparse;             /* skip zero pages of an ELF dump */
 } DumpState;
 
 uint16_t cpu_to_dump16(DumpState *s, uint16_t val);
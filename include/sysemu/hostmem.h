@@ -78,6 +78,10 @@ struct HostMemoryBackend {
     ThreadContext *prealloc_context;
     DECLARE_BITMAP(host_nodes, MAX_NODES + 1);
     HostMemPolicy policy;
+    char *near_device;
+    ThreadContext *near_context; /* prealloc on the near-device node */
+    ThreadContext **node_contexts; /* prealloc on each of host-nodes */
+    int n_node_contexts;
 
     MemoryRegion mr;
 };
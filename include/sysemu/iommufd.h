@@ -2,12 +2,20 @@
 #define SYSEMU_IOMMUFD_H
 
 #include "qom/object.h"
+#include "qemu/notify.h"
 #include "exec/hwaddr.h"
 #include "exec/cpu-common.h"
 #include <linux/iommufd.h>
 #include "sysemu/host_iommu_device.h"
 
 #define TYPE_IOMMUFD_BACKEND "iommufd"
+
+/*
+ * Mappings of at least two chunks are pinned by up to dma-map-threads
+ * threads in parallel, one chunk at a time.
+ */
+#define IOMMUFD_DMA_MAP_CHUNK       (1ULL << 30)
+#define IOMMUFD_DMA_MAP_MAX_THREADS 64
 OBJECT_DECLARE_TYPE(IOMMUFDBackend, IOMMUFDBackendClass, IOMMUFD_BACKEND)
 
 struct IOMMUFDBackendClass {
@@ -21,6 +29,8 @@ struct IOMMUFDBackend {
     int fd;            /* /dev/iommu file descriptor */
     bool owned;        /* is the /dev/iommu opened internally */
     uint32_t users;
+    uint32_t dma_map_threads; /* workers used to pin large mappings */
+    Notifier exit_notifier;
 
     /*< public >*/
 };
@@ -44,11 +54,15 @@ int iommufd_backend_alloc_ioas(IOMMUFDBackend *be, uint32_t *ioas_id,
 void iommufd_backend_free_id(IOMMUFDBackend *be, uint32_t id);
 int iommufd_backend_map_dma(IOMMUFDBackend *be, uint32_t ioas_id, hwaddr iova,
                             ram_addr_t size, void *vaddr, bool readonly);
+int iommufd_backend_copy_dma(IOMMUFDBackend *be, uint32_t src_ioas_id,
+                             uint32_t dst_ioas_id, hwaddr iova,
+                             ram_addr_t size, bool readonly);
 int iommufd_backend_unmap_dma(IOMMUFDBackend *be, uint32_t ioas_id,
                               hwaddr iova, ram_addr_t size);
 int iommufd_backend_get_device_info(IOMMUFDBackend *be, uint32_t devid,
                                     enum iommu_hw_info_type *type,
-                                    void *data, uint32_t len, Error **errp);
+                                    void *data, uint32_t len,
+                                    uint64_t *caps, Error **errp);
 int iommufd_backend_alloc_hwpt(IOMMUFDBackend *be, uint32_t dev_id,
                                uint32_t pt_id, uint32_t flags,
                                uint32_t data_type, uint32_t data_len,
@@ -59,6 +73,11 @@ int iommufd_backend_invalidate_cache(IOMMUFDBackend *be, uint32_t hwpt_id,
 int iommufd_backend_invalidate_dev_cache(IOMMUFDBackend *be, uint32_t dev_id,
                                          uint32_t data_type, uint32_t entry_len,
                                          uint32_t *entry_num, void *data_ptr);
+int iommufd_backend_set_dirty_tracking(IOMMUFDBackend *be, uint32_t hwpt_id,
+                                       bool start);
+int iommufd_backend_get_dirty_bitmap(IOMMUFDBackend *be, uint32_t hwpt_id,
+                                     uint64_t iova, uint64_t size,
+                                     uint64_t page_size, uint64_t *data);
 struct IOMMUFDViommu *iommufd_backend_alloc_viommu(IOMMUFDBackend *be,
                                                    uint32_t dev_id,
                                                    uint32_t viommu_type,
@@ -75,6 +94,7 @@ void iommufd_viommu_put_shared_page(IOMMUFDViommu *viommu,
 
 typedef struct HIOD_IOMMUFD_INFO {
     enum iommu_hw_info_type type;
+    uint64_t caps; /* enum iommufd_hw_capabilities */
     union {
         struct iommu_hw_info_vtd vtd;
     } data;
@@ -91,6 +111,12 @@ struct HIODIOMMUFD {
     IOMMUFDBackend *iommufd;
     uint32_t devid;
     uint32_t ioas_id;
+    /*
+     * hwpt tracking the dirty IOVAs of ioas_id on behalf of the device, or 0
+     * if there is none. A vIOMMU nesting the device on top of its own stage-2
+     * hwpt points it at that nesting parent.
+     */
+    uint32_t dirty_hwpt_id;
 };
 
 struct HIODIOMMUFDClass {
@@ -17,6 +17,7 @@
 #include "block/aio.h"
 #include "qemu/thread.h"
 #include "qom/object.h"
+#include "qapi/qapi-types-common.h"
 #include "sysemu/event-loop-base.h"
 
 #define TYPE_IOTHREAD "iothread"
@@ -33,6 +34,8 @@ struct IOThread {
     bool stopping;              /* has iothread_stop() been called? */
     bool running;               /* should iothread_run() continue? */
     int thread_id;
+    struct ThreadContext *thread_context; /* to create the thread in */
+    struct AioPollGroup *poll_group; /* polls in our place, if set */
 
     /* AioContext poll parameters */
     int64_t poll_max_ns;
@@ -64,4 +67,31 @@ void iothread_destroy(IOThread *iothread);
  */
 bool qemu_in_iothread(void);
 
+/**
+ * iothread_vq_mapping_apply:
+ * @iothread_vq_mapping_list: The mapping of virtqueues to IOThreads.
+ * @vq_aio_context: The array of AioContext pointers to fill in.
+ * @num_queues: The length of @vq_aio_context.
+ * @errp: If an error occurs, a pointer to the area to store the error.
+ *
+ * Fill in the AioContext for each virtqueue in the @vq_aio_context array given
+ * the iothread-vq-mapping parameter in @iothread_vq_mapping_list. The
+ * IOThreads are referenced until iothread_vq_mapping_cleanup() is called.
+ *
+ * Returns: %true on success, %false on failure.
+ **/
+bool iothread_vq_mapping_apply(
+        IOThreadVirtQueueMappingList *iothread_vq_mapping_list,
+        AioContext **vq_aio_context,
+        uint16_t num_queues,
+        Error **errp);
+
+/**
+ * iothread_vq_mapping_cleanup:
+ * @list: The mapping of virtqueues to IOThreads.
+ *
+ * Release the IOThread references taken by iothread_vq_mapping_apply().
+ **/
+void iothread_vq_mapping_cleanup(IOThreadVirtQueueMappingList *list);
+
 #endif /* IOTHREAD_H */
@@ -35,6 +35,8 @@ typedef struct KVMSlot
 typedef struct KVMMemoryUpdate {
     QSIMPLEQ_ENTRY(KVMMemoryUpdate) next;
     MemoryRegionSection section;
+    /* Removal and re-add of the same RAM, applied by updating the flags */
+    bool in_place;
 } KVMMemoryUpdate;
 
 typedef struct KVMMemoryListener {
@@ -97,6 +99,8 @@ struct KVMState
 #ifdef KVM_CAP_IRQ_ROUTING
     struct kvm_irq_routing *irq_routes;
     int nr_allocated_irq_routes;
+    /* irq_routes differs from the table last passed to KVM */
+    bool irq_routes_dirty;
     unsigned long *used_gsi_bitmap;
     unsigned int gsi_count;
 #endif
@@ -39,6 +39,7 @@ enum {
 struct NodeInfo {
     uint64_t node_mem;
     struct HostMemoryBackend *node_memdev;
+    struct ThreadContext *thread_context; /* affinity of the node's vCPUs */
     bool present;
     bool has_cpu;
     bool has_gi;
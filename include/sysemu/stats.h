@@ -42,4 +42,13 @@ void add_stats_schema(StatsSchemaList **, StatsProvider, StatsTarget,
  */
 bool apply_str_list_filter(const char *string, strList *list);
 
+/* Register the statistics of the coroutine pool, of RCU and of locks */
+void util_stats_init(void);
+
+/* Register the latency histograms of the block backends of devices */
+void block_stats_init(void);
+
+/* Register the timeline of QEMU startup */
+void startup_stats_init(void);
+
 #endif /* STATS_H */
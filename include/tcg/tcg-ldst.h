@@ -60,4 +60,21 @@ void helper_stq_mmu(CPUArchState *env, uint64_t addr, uint64_t val,
 void helper_st16_mmu(CPUArchState *env, uint64_t addr, Int128 val,
                      MemOpIdx oi, uintptr_t retaddr);
 
+/*
+ * Slow paths of the inline compare-and-swap, for host-endian data.
+ * The old value is zero-extended.
+ */
+uint32_t helper_cmpxchgb_mmu(CPUArchState *env, uint64_t addr,
+                             uint32_t cmpv, uint32_t newv,
+                             MemOpIdx oi, uintptr_t retaddr);
+uint32_t helper_cmpxchgw_mmu(CPUArchState *env, uint64_t addr,
+                             uint32_t cmpv, uint32_t newv,
+                             MemOpIdx oi, uintptr_t retaddr);
+uint32_t helper_cmpxchgl_mmu(CPUArchState *env, uint64_t addr,
+                             uint32_t cmpv, uint32_t newv,
+                             MemOpIdx oi, uintptr_t retaddr);
+uint64_t helper_cmpxchgq_mmu(CPUArchState *env, uint64_t addr,
+                             uint64_t cmpv, uint64_t newv,
+                             MemOpIdx oi, uintptr_t retaddr);
+
 #endif /* TCG_LDST_H */
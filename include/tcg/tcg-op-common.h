@@ -74,7 +74,8 @@ void tcg_gen_goto_tb(unsigned idx);
  */
 void tcg_gen_lookup_and_goto_ptr(void);
 
-void tcg_gen_plugin_cb_start(unsigned from, unsigned type, unsigned wr);
+void tcg_gen_plugin_cb_start(unsigned from, unsigned type, unsigned wr,
+                             TCGv_i64 addr);
 void tcg_gen_plugin_cb_end(void);
 
 /* 32 bit ops */
@@ -164,20 +164,28 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
+    qio_channel_socket_enable_zero_copy(ioc);
+
+    qio_channel_set_feature(QIO_CHANNEL(ioc),
+                            QIO_CHANNEL_FEATURE_READ_MSG_PEEK);
+
+    return 0;
+}
+
+
+bool qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc)
+{
 #ifdef QEMU_MSG_ZEROCOPY
-    int ret, v = 1;
-    ret = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
-    if (ret == 0) {
+    int v = 1;
+
+    if (setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) == 0) {
         /* Zero copy available on host */
         qio_channel_set_feature(QIO_CHANNEL(ioc),
                                 QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+        return true;
     }
 #endif
-
-    qio_channel_set_feature(QIO_CHANNEL(ioc),
-                            QIO_CHANNEL_FEATURE_READ_MSG_PEEK);
-
-    return 0;
+    return false;
 }
 
 
@@ -70,6 +70,7 @@ char *exec_path;
 char real_exec_path[PATH_MAX];
 
 static bool opt_one_insn_per_tb;
+static const char *opt_tb_cache;
 static const char *argv0;
 static const char *gdbstub;
 static envlist_t *envlist;
@@ -416,6 +417,11 @@ static void handle_arg_one_insn_per_tb(const char *arg)
     opt_one_insn_per_tb = true;
 }
 
+static void handle_arg_tb_cache(const char *arg)
+{
+    opt_tb_cache = arg;
+}
+
 static void handle_arg_strace(const char *arg)
 {
     enable_strace = true;
@@ -505,6 +511,8 @@ static const struct qemu_argument arg_table[] = {
     {"one-insn-per-tb",
                    "QEMU_ONE_INSN_PER_TB",  false, handle_arg_one_insn_per_tb,
      "",           "run with one guest instruction per emulated TB"},
+    {"tb-cache",   "QEMU_TB_CACHE",    true,  handle_arg_tb_cache,
+     "file",       "remember translated blocks across runs in 'file'"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
     {"seed",       "QEMU_RAND_SEED",   true,  handle_arg_seed,
@@ -795,6 +803,10 @@ int main(int argc, char **argv, char **envp)
         accel_init_interfaces(ac);
         object_property_set_bool(OBJECT(accel), "one-insn-per-tb",
                                  opt_one_insn_per_tb, &error_abort);
+        if (opt_tb_cache) {
+            object_property_set_str(OBJECT(accel), "tb-cache",
+                                    opt_tb_cache, &error_abort);
+        }
         ac->init_machine(NULL);
     }
 
@@ -280,6 +280,8 @@ static type name (type1 arg1,type2 arg2,type3 arg3,type4 arg4,type5 arg5,	\
 # define __NR_sys_futex_time64 __NR_futex_time64
 #endif
 #define __NR_sys_statx __NR_statx
+#define __NR_sys_io_uring_setup __NR_io_uring_setup
+#define __NR_sys_io_uring_register __NR_io_uring_register
 
 #if defined(__alpha__) || defined(__x86_64__) || defined(__s390x__)
 #define __NR__llseek __NR_lseek
@@ -421,6 +423,12 @@ _syscall5(int, sys_statx, int, dirfd, const char *, pathname, int, flags,
 #if defined(TARGET_NR_membarrier) && defined(__NR_membarrier)
 _syscall2(int, membarrier, int, cmd, int, flags)
 #endif
+#if defined(TARGET_NR_io_uring_setup) && defined(__NR_io_uring_setup)
+_syscall2(int, sys_io_uring_setup, unsigned int, entries,
+          struct target_io_uring_params *, params)
+_syscall4(int, sys_io_uring_register, unsigned int, fd, unsigned int, opcode,
+          void *, arg, unsigned int, nr_args)
+#endif
 
 static const bitmask_transtbl fcntl_flags_tbl[] = {
   { TARGET_O_ACCMODE,   TARGET_O_WRONLY,    O_ACCMODE,   O_WRONLY,    },
@@ -747,6 +755,11 @@ safe_syscall5(int, mq_timedsend, int, mqdes, const char *, msg_ptr,
 safe_syscall5(int, mq_timedreceive, int, mqdes, char *, msg_ptr,
               size_t, len, unsigned *, prio, const struct timespec *, timeout)
 #endif
+#if defined(TARGET_NR_io_uring_setup) && defined(__NR_io_uring_setup)
+safe_syscall6(int, io_uring_enter, unsigned int, fd, unsigned int, to_submit,
+              unsigned int, min_complete, unsigned int, flags,
+              const void *, arg, size_t, argsz)
+#endif
 #if defined(TARGET_NR_copy_file_range) && defined(__NR_copy_file_range)
 safe_syscall6(ssize_t, copy_file_range, int, infd, loff_t *, pinoff,
               int, outfd, loff_t *, poutoff, size_t, length,
@@ -9076,6 +9089,79 @@ _syscall5(int, sys_move_mount, int, __from_dfd, const char *, __from_pathname,
            int, __to_dfd, const char *, __to_pathname, unsigned int, flag)
 #endif
 
+#if defined(TARGET_NR_io_uring_setup) && defined(__NR_io_uring_setup)
+/*
+ * The guest's io_uring rings are mapped from the host kernel, which then
+ * reads submissions and the buffers, iovecs, paths, etc. they point to
+ * straight from guest memory.  This requires guest addresses to be host
+ * addresses, and the structures to have the same layout; there is no
+ * translation of the rings.  Structures with an architecture-specific
+ * layout, such as x86's packed struct epoll_event, are not converted.
+ * Otherwise io_uring is reported as not implemented, and guests fall back
+ * to regular system calls.
+ */
+static bool io_uring_passthrough(void)
+{
+    return HOST_BIG_ENDIAN == TARGET_BIG_ENDIAN &&
+           TARGET_ABI_BITS == HOST_LONG_BITS &&
+           guest_base == 0 &&
+           TARGET_PAGE_SIZE == qemu_real_host_page_size();
+}
+
+static abi_long do_io_uring_enter(abi_long fd, abi_long to_submit,
+                                  abi_long min_complete, abi_long flags,
+                                  abi_ulong arg, abi_ulong argsz)
+{
+    struct target_io_uring_getevents_arg ext, *target_ext;
+    sigset_t *set = NULL;
+    abi_ulong sigmask = 0, sigsize = 0;
+    const void *host_arg = NULL;
+    abi_long ret;
+
+    if (flags & TARGET_IORING_ENTER_EXT_ARG) {
+        if (arg) {
+            if (argsz != sizeof(ext)) {
+                return -TARGET_EINVAL;
+            }
+            if (!lock_user_struct(VERIFY_READ, target_ext, arg, 1)) {
+                return -TARGET_EFAULT;
+            }
+            ext = *target_ext;
+            unlock_user_struct(target_ext, arg, 0);
+            sigmask = ext.sigmask;
+            sigsize = ext.sigmask_sz;
+            host_arg = &ext;
+        }
+    } else {
+        sigmask = arg;
+        sigsize = argsz;
+    }
+
+    /* The signal mask is the guest's, and needs the sigsuspend treatment */
+    if (sigmask) {
+        ret = process_sigsuspend_mask(&set, sigmask, sigsize);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    if (flags & TARGET_IORING_ENTER_EXT_ARG) {
+        ext.sigmask = (uintptr_t)set;
+        ext.sigmask_sz = set ? SIGSET_T_SIZE : 0;
+        argsz = host_arg ? sizeof(ext) : 0;
+    } else {
+        host_arg = set;
+        argsz = set ? SIGSET_T_SIZE : 0;
+    }
+
+    ret = get_errno(safe_io_uring_enter(fd, to_submit, min_complete, flags,
+                                        host_arg, argsz));
+    if (set) {
+        finish_sigsuspend_mask(ret);
+    }
+    return ret;
+}
+#endif
+
 /* This is an internal helper for do_syscall so that it is easier
  * to have a single return point, so that actions, such as logging
  * of syscall results, can be performed.
@@ -13688,6 +13774,29 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         return get_errno(membarrier(arg1, arg2));
 #endif
 
+#if defined(TARGET_NR_io_uring_setup) && defined(__NR_io_uring_setup)
+    case TARGET_NR_io_uring_setup:
+        {
+            struct target_io_uring_params *params;
+
+            if (!io_uring_passthrough()) {
+                return -TARGET_ENOSYS;
+            }
+            if (!lock_user_struct(VERIFY_WRITE, params, arg2, 1)) {
+                return -TARGET_EFAULT;
+            }
+            ret = get_errno(sys_io_uring_setup(arg1, params));
+            unlock_user_struct(params, arg2, 1);
+        }
+        return ret;
+    case TARGET_NR_io_uring_enter:
+        return do_io_uring_enter(arg1, arg2, arg3, arg4, arg5, arg6);
+    case TARGET_NR_io_uring_register:
+        /* Only reachable with a ring, i.e. in passthrough mode */
+        return get_errno(sys_io_uring_register(arg1, arg2,
+                                               arg3 ? g2h(cpu, arg3) : NULL,
+                                               arg4));
+#endif
 #if defined(TARGET_NR_copy_file_range) && defined(__NR_copy_file_range)
     case TARGET_NR_copy_file_range:
         {
@@ -2621,6 +2621,36 @@ struct target_epoll_event {
 
 #endif
 
+/* io_uring structures only use fixed-size types */
+struct target_io_sqring_offsets {
+    uint32_t head, tail, ring_mask, ring_entries, flags, dropped, array;
+    uint32_t resv1;
+    uint64_t user_addr;
+};
+
+struct target_io_cqring_offsets {
+    uint32_t head, tail, ring_mask, ring_entries, overflow, cqes, flags;
+    uint32_t resv1;
+    uint64_t user_addr;
+};
+
+struct target_io_uring_params {
+    uint32_t sq_entries, cq_entries, flags, sq_thread_cpu, sq_thread_idle;
+    uint32_t features, wq_fd;
+    uint32_t resv[3];
+    struct target_io_sqring_offsets sq_off;
+    struct target_io_cqring_offsets cq_off;
+};
+
+struct target_io_uring_getevents_arg {
+    uint64_t sigmask;
+    uint32_t sigmask_sz;
+    uint32_t pad;
+    uint64_t ts;
+};
+
+#define TARGET_IORING_ENTER_EXT_ARG (1U << 3)
+
 struct target_ucred {
     abi_uint pid;
     abi_uint uid;
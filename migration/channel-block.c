@@ -22,6 +22,9 @@
 #include "migration/channel-block.h"
 #include "qapi/error.h"
 #include "block/block.h"
+#include "block/graph-lock.h"
+#include "qemu/coroutine.h"
+#include "qemu/thread.h"
 #include "trace.h"
 
 QIOChannelBlock *
@@ -33,6 +36,18 @@ qio_channel_block_new(BlockDriverState *bs)
 
     bdrv_ref(bs);
     ioc->bs = bs;
+    qio_channel_set_feature(QIO_CHANNEL(ioc), QIO_CHANNEL_FEATURE_SEEKABLE);
+
+    return ioc;
+}
+
+
+QIOChannelBlock *
+qio_channel_block_new_in_context(BlockDriverState *bs, AioContext *ctx)
+{
+    QIOChannelBlock *ioc = qio_channel_block_new(bs);
+
+    ioc->ctx = ctx;
 
     return ioc;
 }
@@ -47,6 +62,60 @@ qio_channel_block_finalize(Object *obj)
 }
 
 
+typedef struct QIOChannelBlockRequest {
+    BlockDriverState *bs;
+    QEMUIOVector *qiov;
+    off_t offset;
+    bool is_write;
+    int ret;
+    QemuSemaphore done;
+} QIOChannelBlockRequest;
+
+
+static void coroutine_fn
+qio_channel_block_co_rw(void *opaque)
+{
+    QIOChannelBlockRequest *req = opaque;
+
+    WITH_GRAPH_RDLOCK_GUARD() {
+        if (req->is_write) {
+            req->ret = bdrv_writev_vmstate(req->bs, req->qiov, req->offset);
+        } else {
+            req->ret = bdrv_readv_vmstate(req->bs, req->qiov, req->offset);
+        }
+    }
+    qemu_sem_post(&req->done);
+}
+
+
+static int
+qio_channel_block_rw(QIOChannelBlock *bioc,
+                     QEMUIOVector *qiov,
+                     off_t offset,
+                     bool is_write)
+{
+    QIOChannelBlockRequest req = {
+        .bs = bioc->bs,
+        .qiov = qiov,
+        .offset = offset,
+        .is_write = is_write,
+    };
+
+    if (!bioc->ctx) {
+        return is_write ? bdrv_writev_vmstate(bioc->bs, qiov, offset) :
+                          bdrv_readv_vmstate(bioc->bs, qiov, offset);
+    }
+
+    qemu_sem_init(&req.done, 0);
+    aio_co_enter(bioc->ctx, qemu_coroutine_create(qio_channel_block_co_rw,
+                                                  &req));
+    qemu_sem_wait(&req.done);
+    qemu_sem_destroy(&req.done);
+
+    return req.ret;
+}
+
+
 static ssize_t
 qio_channel_block_readv(QIOChannel *ioc,
                         const struct iovec *iov,
@@ -61,7 +130,7 @@ qio_channel_block_readv(QIOChannel *ioc,
     int ret;
 
     qemu_iovec_init_external(&qiov, (struct iovec *)iov, niov);
-    ret = bdrv_readv_vmstate(bioc->bs, &qiov, bioc->offset);
+    ret = qio_channel_block_rw(bioc, &qiov, bioc->offset, false);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "bdrv_readv_vmstate failed");
         return -1;
@@ -86,7 +155,7 @@ qio_channel_block_writev(QIOChannel *ioc,
     int ret;
 
     qemu_iovec_init_external(&qiov, (struct iovec *)iov, niov);
-    ret = bdrv_writev_vmstate(bioc->bs, &qiov, bioc->offset);
+    ret = qio_channel_block_rw(bioc, &qiov, bioc->offset, true);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "bdrv_writev_vmstate failed");
         return -1;
@@ -97,6 +166,50 @@ qio_channel_block_writev(QIOChannel *ioc,
 }
 
 
+static ssize_t
+qio_channel_block_preadv(QIOChannel *ioc,
+                         const struct iovec *iov,
+                         size_t niov,
+                         off_t offset,
+                         Error **errp)
+{
+    QIOChannelBlock *bioc = QIO_CHANNEL_BLOCK(ioc);
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init_external(&qiov, (struct iovec *)iov, niov);
+    ret = qio_channel_block_rw(bioc, &qiov, offset, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "bdrv_readv_vmstate failed");
+        return -1;
+    }
+
+    return qiov.size;
+}
+
+
+static ssize_t
+qio_channel_block_pwritev(QIOChannel *ioc,
+                          const struct iovec *iov,
+                          size_t niov,
+                          off_t offset,
+                          Error **errp)
+{
+    QIOChannelBlock *bioc = QIO_CHANNEL_BLOCK(ioc);
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init_external(&qiov, (struct iovec *)iov, niov);
+    ret = qio_channel_block_rw(bioc, &qiov, offset, true);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "bdrv_writev_vmstate failed");
+        return -1;
+    }
+
+    return qiov.size;
+}
+
+
 static int
 qio_channel_block_set_blocking(QIOChannel *ioc,
                                bool enabled,
@@ -123,7 +236,7 @@ qio_channel_block_seek(QIOChannel *ioc,
         bioc->offset = offset;
         break;
     case SEEK_CUR:
-        bioc->offset += whence;
+        bioc->offset += offset;
         break;
     case SEEK_END:
         error_setg(errp, "Size of VMstate region is unknown");
@@ -141,7 +254,7 @@ qio_channel_block_close(QIOChannel *ioc,
                         Error **errp)
 {
     QIOChannelBlock *bioc = QIO_CHANNEL_BLOCK(ioc);
-    int rv = bdrv_flush(bioc->bs);
+    int rv = bioc->ctx ? 0 : bdrv_flush(bioc->bs);
 
     if (rv < 0) {
         error_setg_errno(errp, -rv,
@@ -176,6 +289,8 @@ qio_channel_block_class_init(ObjectClass *klass,
 
     ioc_klass->io_writev = qio_channel_block_writev;
     ioc_klass->io_readv = qio_channel_block_readv;
+    ioc_klass->io_pwritev = qio_channel_block_pwritev;
+    ioc_klass->io_preadv = qio_channel_block_preadv;
     ioc_klass->io_set_blocking = qio_channel_block_set_blocking;
     ioc_klass->io_seek = qio_channel_block_seek;
     ioc_klass->io_close = qio_channel_block_close;
@@ -40,6 +40,8 @@ struct QIOChannelBlock {
     QIOChannel parent;
     BlockDriverState *bs;
     off_t offset;
+    /* If set, I/O is submitted from coroutines in this context */
+    AioContext *ctx;
 };
 
 
@@ -56,4 +58,23 @@ struct QIOChannelBlock {
 QIOChannelBlock *
 qio_channel_block_new(BlockDriverState *bs);
 
+/**
+ * qio_channel_block_new_in_context:
+ * @bs: the block driver state
+ * @ctx: the AioContext to submit I/O from
+ *
+ * Create a new IO channel object that can perform I/O on the
+ * VMState region of a BlockDriverState object from any thread,
+ * without holding the BQL.  The I/O is submitted from coroutines
+ * in @ctx, which must be run by an IOThread for the lifetime of
+ * the channel, and the caller waits for their completion.
+ *
+ * Unlike with qio_channel_block_new(), closing the channel does
+ * not flush @bs.
+ *
+ * Returns: the new channel object
+ */
+QIOChannelBlock *
+qio_channel_block_new_in_context(BlockDriverState *bs, AioContext *ctx);
+
 #endif /* QIO_CHANNEL_BLOCK_H */
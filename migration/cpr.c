@@ -0,0 +1,270 @@
+/*
+ * CheckPoint and Restart (CPR) state passed across exec
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/memfd.h"
+#include "qapi/error.h"
+#include "qapi/type-helpers.h"
+#include "io/channel-file.h"
+#include "migration/cpr.h"
+#include "migration/qemu-file-types.h"
+#include "migration/vmstate.h"
+#include "options.h"
+#include "qemu-file.h"
+#include "trace.h"
+
+#define CPR_STATE_ENV "QEMU_CPR_STATE"
+#define CPR_STATE_MAGIC 0x51435052      /* "QCPR" */
+#define CPR_STATE_VERSION 1
+
+typedef struct CprFd {
+    char *name;
+    uint32_t namelen;
+    int32_t id;
+    int32_t fd;
+    QLIST_ENTRY(CprFd) next;
+} CprFd;
+
+typedef struct CprState {
+    uint32_t mode;
+    QLIST_HEAD(, CprFd) fds;
+} CprState;
+
+static CprState cpr_state;
+static MigMode cpr_incoming_mode = MIG_MODE_NORMAL;
+
+static const VMStateDescription vmstate_cpr_fd = {
+    .name = "cpr fd",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(namelen, CprFd),
+        VMSTATE_VBUFFER_ALLOC_UINT32(name, CprFd, 0, NULL, namelen),
+        VMSTATE_INT32(id, CprFd),
+        VMSTATE_INT32(fd, CprFd),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_cpr_state = {
+    .name = "cpr state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(mode, CprState),
+        VMSTATE_QLIST_V(fds, CprState, 1, vmstate_cpr_fd, CprFd, next),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static CprFd *cpr_lookup_fd(const char *name, int id)
+{
+    CprFd *elem;
+
+    QLIST_FOREACH(elem, &cpr_state.fds, next) {
+        if (!strcmp(elem->name, name) && elem->id == id) {
+            return elem;
+        }
+    }
+    return NULL;
+}
+
+void cpr_save_fd(const char *name, int id, int fd)
+{
+    CprFd *elem = cpr_lookup_fd(name, id);
+
+    trace_cpr_save_fd(name, id, fd);
+    if (elem) {
+        elem->fd = fd;
+        return;
+    }
+    elem = g_new0(CprFd, 1);
+    elem->name = g_strdup(name);
+    elem->namelen = strlen(name) + 1;
+    elem->id = id;
+    elem->fd = fd;
+    QLIST_INSERT_HEAD(&cpr_state.fds, elem, next);
+}
+
+void cpr_delete_fd(const char *name, int id)
+{
+    CprFd *elem = cpr_lookup_fd(name, id);
+
+    if (elem) {
+        QLIST_REMOVE(elem, next);
+        g_free(elem->name);
+        g_free(elem);
+    }
+    trace_cpr_delete_fd(name, id);
+}
+
+int cpr_find_fd(const char *name, int id)
+{
+    CprFd *elem = cpr_lookup_fd(name, id);
+    int fd = elem ? elem->fd : -1;
+
+    trace_cpr_find_fd(name, id, fd);
+    return fd;
+}
+
+MigMode cpr_get_incoming_mode(void)
+{
+    return cpr_incoming_mode;
+}
+
+void cpr_set_incoming_mode(MigMode mode)
+{
+    cpr_incoming_mode = mode;
+}
+
+bool cpr_is_exec(void)
+{
+    return migrate_mode() == MIG_MODE_CPR_EXEC ||
+           cpr_incoming_mode == MIG_MODE_CPR_EXEC;
+}
+
+#ifndef _WIN32
+
+static void cpr_set_fd_cloexec(int fd, bool cloexec)
+{
+    int flags = fcntl(fd, F_GETFD);
+
+    if (flags >= 0) {
+        flags = cloexec ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC;
+        fcntl(fd, F_SETFD, flags);
+    }
+}
+
+static void cpr_set_cloexec(bool cloexec)
+{
+    CprFd *elem;
+
+    QLIST_FOREACH(elem, &cpr_state.fds, next) {
+        cpr_set_fd_cloexec(elem->fd, cloexec);
+    }
+}
+
+/* Return a memfd holding the CPR state, inheritable across exec */
+static int cpr_state_save(Error **errp)
+{
+    QIOChannelFile *fioc;
+    QEMUFile *f;
+    int fd, ret;
+
+    fd = qemu_memfd_create("cpr-state", 0, false, 0, 0, errp);
+    if (fd < 0) {
+        return -1;
+    }
+
+    fioc = qio_channel_file_new_fd(dup(fd));
+    f = qemu_file_new_output(QIO_CHANNEL(fioc));
+    object_unref(OBJECT(fioc));
+
+    cpr_state.mode = migrate_mode();
+    qemu_put_be32(f, CPR_STATE_MAGIC);
+    qemu_put_be32(f, CPR_STATE_VERSION);
+    ret = vmstate_save_state(f, &vmstate_cpr_state, &cpr_state, NULL);
+    if (qemu_fclose(f) < 0 && !ret) {
+        ret = -EIO;
+    }
+    if (ret) {
+        error_setg_errno(errp, -ret, "failed to save CPR state");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int cpr_state_load(Error **errp)
+{
+    const char *env = g_getenv(CPR_STATE_ENV);
+    QIOChannelFile *fioc;
+    QEMUFile *f;
+    int fd, ret;
+
+    if (!env) {
+        return 0;
+    }
+    if (qemu_strtoi(env, NULL, 10, &fd) < 0 || fd < 0) {
+        error_setg(errp, "invalid %s=%s", CPR_STATE_ENV, env);
+        return -1;
+    }
+    g_unsetenv(CPR_STATE_ENV);
+
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        error_setg_errno(errp, errno, "cannot read CPR state");
+        close(fd);
+        return -1;
+    }
+    fioc = qio_channel_file_new_fd(fd);
+    f = qemu_file_new_input(QIO_CHANNEL(fioc));
+    object_unref(OBJECT(fioc));
+
+    if (qemu_get_be32(f) != CPR_STATE_MAGIC) {
+        error_setg(errp, "bad CPR state magic");
+        qemu_fclose(f);
+        return -1;
+    }
+    if (qemu_get_be32(f) != CPR_STATE_VERSION) {
+        error_setg(errp, "unsupported CPR state version");
+        qemu_fclose(f);
+        return -1;
+    }
+    ret = vmstate_load_state(f, &vmstate_cpr_state, &cpr_state, 1);
+    qemu_fclose(f);
+    if (ret) {
+        error_setg_errno(errp, -ret, "failed to load CPR state");
+        return -1;
+    }
+
+    /* Do not leak the inherited descriptors into helper processes */
+    cpr_set_cloexec(true);
+    cpr_incoming_mode = cpr_state.mode;
+    trace_cpr_state_load(MigMode_str(cpr_incoming_mode));
+    return 0;
+}
+
+void cpr_exec(Error **errp)
+{
+    const strList *command = migrate_cpr_exec_command();
+    g_auto(GStrv) argv = strv_from_str_list(command);
+    g_autofree char *fdstr = NULL;
+    int fd, saved_errno;
+
+    fd = cpr_state_save(errp);
+    if (fd < 0) {
+        return;
+    }
+    fdstr = g_strdup_printf("%d", fd);
+    g_setenv(CPR_STATE_ENV, fdstr, true);
+    cpr_set_fd_cloexec(fd, false);
+    cpr_set_cloexec(false);
+
+    trace_cpr_exec(argv[0]);
+    execvp(argv[0], argv);
+    saved_errno = errno;
+
+    cpr_set_cloexec(true);
+    g_unsetenv(CPR_STATE_ENV);
+    close(fd);
+    error_setg_errno(errp, saved_errno, "cannot exec %s", argv[0]);
+}
+
+#else
+
+int cpr_state_load(Error **errp)
+{
+    return 0;
+}
+
+void cpr_exec(Error **errp)
+{
+    error_setg(errp, "cpr-exec is not supported on this host");
+}
+
+#endif
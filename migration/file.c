@@ -9,6 +9,7 @@
 #include "exec/ramblock.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "exec/target_page.h"
 #include "qapi/error.h"
 #include "channel.h"
 #include "file.h"
@@ -50,10 +51,29 @@ void file_cleanup_outgoing_migration(void)
     outgoing_args.fname = NULL;
 }
 
+/*
+ * The multifd channels only transfer guest pages, which are page
+ * aligned both in memory and in the file, so they can bypass the page
+ * cache.  Returns the extra flags to open their file with.
+ */
+static int file_multifd_open_flags(void)
+{
+#ifdef O_DIRECT
+    if (migrate_mapped_ram_direct_io()) {
+        if (qemu_target_page_size() >= 4096) {
+            return O_DIRECT;
+        }
+        warn_report_once("x-mapped-ram-direct-io needs target pages of at "
+                         "least 4KiB, using buffered I/O");
+    }
+#endif
+    return 0;
+}
+
 bool file_send_channel_create(gpointer opaque, Error **errp)
 {
     QIOChannelFile *ioc;
-    int flags = O_WRONLY;
+    int flags = O_WRONLY | file_multifd_open_flags();
     bool ret = true;
 
     ioc = qio_channel_file_new_path(outgoing_args.fname, flags, 0, errp);
@@ -109,9 +129,15 @@ static gboolean file_accept_incoming_migration(QIOChannel *ioc,
     return G_SOURCE_REMOVE;
 }
 
-void file_create_incoming_channels(QIOChannel *ioc, Error **errp)
+/*
+ * The multifd channels share the file description of @ioc, unless
+ * @filename is given and they need other flags: they open it again then.
+ */
+void file_create_incoming_channels(QIOChannel *ioc, const char *filename,
+                                   Error **errp)
 {
     int i, fd, channels = 1;
+    int flags = file_multifd_open_flags();
     g_autofree QIOChannel **iocs = NULL;
 
     if (migrate_multifd()) {
@@ -123,7 +149,14 @@ void file_create_incoming_channels(QIOChannel *ioc, Error **errp)
     iocs[0] = ioc;
 
     for (i = 1; i < channels; i++) {
-        QIOChannelFile *fioc = qio_channel_file_new_dupfd(fd, errp);
+        QIOChannelFile *fioc;
+
+        if (filename && flags) {
+            fioc = qio_channel_file_new_path(filename, O_RDONLY | flags, 0,
+                                             errp);
+        } else {
+            fioc = qio_channel_file_new_dupfd(fd, errp);
+        }
 
         if (!fioc) {
             while (i) {
@@ -163,7 +196,7 @@ void file_start_incoming_migration(FileMigrationArgs *file_args, Error **errp)
         return;
     }
 
-    file_create_incoming_channels(QIO_CHANNEL(fioc), errp);
+    file_create_incoming_channels(QIO_CHANNEL(fioc), filename, errp);
 }
 
 int file_write_ramblock_iov(QIOChannel *ioc, const struct iovec *iov,
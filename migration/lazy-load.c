@@ -0,0 +1,379 @@
+/*
+ * Lazy loading of guest RAM from a mapped-ram migration file
+ *
+ * Instead of reading all the pages of a snapshot before the guest can
+ * run, guest RAM is registered with userfaultfd and each page is read
+ * from its fixed offset in the file the first time it is touched, while
+ * a background thread prefetches all the others.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "qemu/rcu.h"
+#include "qemu/userfaultfd.h"
+#include "qapi/error.h"
+#include "exec/target_page.h"
+#include "exec/ramblock.h"
+#include "io/channel-file.h"
+#include "qemu-file.h"
+#include "lazy-load.h"
+#include "trace.h"
+
+typedef struct {
+    RAMBlock *block;
+    /* pages present in the file, from the mapped-ram header of the block */
+    unsigned long *bitmap;
+    /* offset of the pages of the block in the file */
+    uint64_t pages_offset;
+    /* host pages already placed */
+    unsigned long *placed;
+    unsigned long nr_host_pages;
+} LazyLoadBlock;
+
+typedef struct {
+    int uffd;
+    /* our own descriptor of the migration file, which outlives the load */
+    int fd;
+    /* tells the fault thread to quit */
+    int quit_fd;
+    QemuThread fault_thread;
+    QemuThread prefetch_thread;
+    /* protects the blocks array while it grows */
+    QemuMutex lock;
+    GPtrArray *blocks;
+    uint64_t fault_pages;
+    uint64_t prefetch_pages;
+} LazyLoadState;
+
+static LazyLoadState *lazy_load;
+
+static LazyLoadBlock *lazy_load_find_block(LazyLoadState *s, RAMBlock *rb)
+{
+    QEMU_LOCK_GUARD(&s->lock);
+
+    for (int i = 0; i < s->blocks->len; i++) {
+        LazyLoadBlock *lb = g_ptr_array_index(s->blocks, i);
+
+        if (lb->block == rb) {
+            return lb;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Fills @buf with host page @hp of @lb: the target pages present in the
+ * file are read from it, the others are zero.
+ */
+static void lazy_load_read_page(LazyLoadState *s, LazyLoadBlock *lb,
+                                unsigned long hp, uint8_t *buf)
+{
+    size_t page_size = lb->block->page_size;
+    size_t tps = qemu_target_page_size();
+    unsigned long first = hp * (page_size / tps);
+    unsigned long n = page_size / tps;
+    ram_addr_t offset = (ram_addr_t)hp * page_size;
+    ssize_t len = 0;
+
+    if (find_next_bit(lb->bitmap, first + n, first) < first + n) {
+        do {
+            len = pread(s->fd, buf, page_size,
+                        lb->pages_offset + offset);
+        } while (len < 0 && errno == EINTR);
+
+        if (len < 0) {
+            /* The guest cannot make progress without this page */
+            error_report("lazy load: cannot read page " RAM_ADDR_FMT
+                         " of %s: %s", offset, lb->block->idstr,
+                         strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* The end of the file may be a hole */
+    memset(buf + len, 0, page_size - len);
+
+    for (unsigned long i = 0; i < n; i++) {
+        if (!test_bit(first + i, lb->bitmap)) {
+            memset(buf + i * tps, 0, tps);
+        }
+    }
+}
+
+/*
+ * Places host page @hp of @lb, unless it already was.  Both the fault
+ * and the prefetch threads may race to place the same page, the loser
+ * only wakes up the threads waiting on it.
+ */
+static bool lazy_load_place_page(LazyLoadState *s, LazyLoadBlock *lb,
+                                 unsigned long hp, uint8_t *buf)
+{
+    size_t page_size = lb->block->page_size;
+    void *host = lb->block->host + (ram_addr_t)hp * page_size;
+    struct uffdio_copy copy;
+
+    if (test_bit(hp, lb->placed)) {
+        return false;
+    }
+
+    lazy_load_read_page(s, lb, hp, buf);
+
+    copy.dst = (uintptr_t)host;
+    copy.src = (uintptr_t)buf;
+    copy.len = page_size;
+    copy.mode = 0;
+    if (ioctl(s->uffd, UFFDIO_COPY, &copy)) {
+        if (errno != EEXIST) {
+            error_report("lazy load: cannot place page at %p of %s: %s",
+                         host, lb->block->idstr, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        uffd_wakeup(s->uffd, host, page_size);
+    }
+
+    set_bit_atomic(hp, lb->placed);
+    return true;
+}
+
+static uint8_t *lazy_load_buf(uint8_t *buf, size_t *size, size_t page_size)
+{
+    if (*size < page_size) {
+        qemu_vfree(buf);
+        buf = qemu_memalign(page_size, page_size);
+        *size = page_size;
+    }
+    return buf;
+}
+
+static void lazy_load_handle_fault(LazyLoadState *s, void *addr,
+                                   uint8_t **buf, size_t *buf_size)
+{
+    ram_addr_t offset;
+    RAMBlock *rb = qemu_ram_block_from_host(addr, false, &offset);
+    LazyLoadBlock *lb = rb ? lazy_load_find_block(s, rb) : NULL;
+    unsigned long hp;
+
+    if (!lb) {
+        error_report("lazy load: fault at %p outside of guest RAM", addr);
+        exit(EXIT_FAILURE);
+    }
+
+    hp = offset / rb->page_size;
+    *buf = lazy_load_buf(*buf, buf_size, rb->page_size);
+    trace_lazy_load_fault(rb->idstr, offset);
+    if (lazy_load_place_page(s, lb, hp, *buf)) {
+        qatomic_inc(&s->fault_pages);
+    } else {
+        /* Placed since the fault was raised */
+        uffd_wakeup(s->uffd, rb->host + (ram_addr_t)hp * rb->page_size,
+                    rb->page_size);
+    }
+}
+
+static void *lazy_load_fault_thread(void *opaque)
+{
+    LazyLoadState *s = opaque;
+    struct pollfd pfd[2] = {
+        { .fd = s->uffd, .events = POLLIN },
+        { .fd = s->quit_fd, .events = POLLIN },
+    };
+    struct uffd_msg msgs[16];
+    uint8_t *buf = NULL;
+    size_t buf_size = 0;
+
+    rcu_register_thread();
+    while (true) {
+        int n;
+
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("lazy load: poll failed: %s", strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        n = uffd_read_events(s->uffd, msgs, ARRAY_SIZE(msgs));
+        for (int i = 0; i < n; i++) {
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+                continue;
+            }
+            lazy_load_handle_fault(s,
+                (void *)(uintptr_t)msgs[i].arg.pagefault.address,
+                &buf, &buf_size);
+        }
+    }
+    qemu_vfree(buf);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void lazy_load_free(LazyLoadState *s)
+{
+    for (int i = 0; i < s->blocks->len; i++) {
+        LazyLoadBlock *lb = g_ptr_array_index(s->blocks, i);
+
+        uffd_unregister_memory(s->uffd, lb->block->host,
+                               lb->nr_host_pages * lb->block->page_size);
+        g_free(lb->bitmap);
+        g_free(lb->placed);
+        g_free(lb);
+    }
+    g_ptr_array_free(s->blocks, true);
+    uffd_close_fd(s->uffd);
+    close(s->quit_fd);
+    close(s->fd);
+    qemu_mutex_destroy(&s->lock);
+    g_free(s);
+}
+
+/*
+ * Places all the pages not faulted in yet, one block after the other,
+ * then stops the fault thread and drops userfaultfd since nothing is
+ * missing anymore.
+ */
+static void *lazy_load_prefetch_thread(void *opaque)
+{
+    LazyLoadState *s = opaque;
+    uint8_t *buf = NULL;
+    size_t buf_size = 0;
+    uint64_t one = 1;
+    int i;
+
+    rcu_register_thread();
+    for (i = 0; i < s->blocks->len; i++) {
+        LazyLoadBlock *lb = g_ptr_array_index(s->blocks, i);
+
+        buf = lazy_load_buf(buf, &buf_size, lb->block->page_size);
+        for (unsigned long hp = 0; hp < lb->nr_host_pages; hp++) {
+            if (lazy_load_place_page(s, lb, hp, buf)) {
+                s->prefetch_pages++;
+            }
+        }
+    }
+    qemu_vfree(buf);
+
+    if (write(s->quit_fd, &one, sizeof(one)) != sizeof(one)) {
+        error_report("lazy load: cannot stop the fault thread: %s",
+                     strerror(errno));
+    }
+    qemu_thread_join(&s->fault_thread);
+    trace_lazy_load_done(qatomic_read(&s->fault_pages), s->prefetch_pages);
+
+    lazy_load_free(s);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static LazyLoadState *lazy_load_new(QEMUFile *f, Error **errp)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    LazyLoadState *s;
+    int uffd, fd, quit_fd;
+
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        error_setg(errp, "lazy load needs a migration file");
+        return NULL;
+    }
+
+    uffd = uffd_create_fd(0, true);
+    if (uffd < 0) {
+        error_setg(errp, "lazy load needs userfaultfd");
+        return NULL;
+    }
+
+    fd = dup(QIO_CHANNEL_FILE(ioc)->fd);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot duplicate the migration file");
+        uffd_close_fd(uffd);
+        return NULL;
+    }
+
+    quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (quit_fd < 0) {
+        error_setg_errno(errp, errno, "cannot create an eventfd");
+        close(fd);
+        uffd_close_fd(uffd);
+        return NULL;
+    }
+
+    s = g_new0(LazyLoadState, 1);
+    s->uffd = uffd;
+    s->fd = fd;
+    s->quit_fd = quit_fd;
+    s->blocks = g_ptr_array_new();
+    qemu_mutex_init(&s->lock);
+    qemu_thread_create(&s->fault_thread, "mig/dst/lazyfault",
+                       lazy_load_fault_thread, s, QEMU_THREAD_JOINABLE);
+    return s;
+}
+
+bool lazy_load_add_block(QEMUFile *f, RAMBlock *block, unsigned long *bitmap,
+                         uint64_t pages_offset, Error **errp)
+{
+    LazyLoadBlock *lb;
+    uint64_t ioctls;
+    size_t len;
+
+    if (!lazy_load) {
+        lazy_load = lazy_load_new(f, errp);
+        if (!lazy_load) {
+            return false;
+        }
+    }
+
+    if (block->page_size < qemu_target_page_size()) {
+        error_setg(errp, "RAM block %s has pages smaller than target pages",
+                   block->idstr);
+        return false;
+    }
+
+    /* Drop any content, e.g. ROMs loaded at startup, to fault it in */
+    len = ROUND_UP(block->used_length, block->page_size);
+    if (ram_block_discard_range(block, 0, len)) {
+        error_setg(errp, "cannot discard RAM block %s", block->idstr);
+        return false;
+    }
+    if (uffd_register_memory(lazy_load->uffd, block->host, len,
+                             UFFDIO_REGISTER_MODE_MISSING, &ioctls) ||
+        !(ioctls & (1ULL << _UFFDIO_COPY))) {
+        error_setg(errp, "cannot register RAM block %s with userfaultfd",
+                   block->idstr);
+        return false;
+    }
+
+    lb = g_new0(LazyLoadBlock, 1);
+    lb->block = block;
+    lb->bitmap = bitmap;
+    lb->pages_offset = pages_offset;
+    lb->nr_host_pages = len / block->page_size;
+    lb->placed = bitmap_new(lb->nr_host_pages);
+
+    WITH_QEMU_LOCK_GUARD(&lazy_load->lock) {
+        g_ptr_array_add(lazy_load->blocks, lb);
+    }
+    trace_lazy_load_add_block(block->idstr, lb->nr_host_pages);
+    return true;
+}
+
+void lazy_load_start_prefetch(void)
+{
+    LazyLoadState *s = lazy_load;
+
+    if (!s) {
+        return;
+    }
+
+    /* The prefetch thread owns the state from now on */
+    lazy_load = NULL;
+    qemu_thread_create(&s->prefetch_thread, "mig/dst/lazyload",
+                       lazy_load_prefetch_thread, s, QEMU_THREAD_DETACHED);
+}
@@ -0,0 +1,38 @@
+/*
+ * Lazy loading of guest RAM from a mapped-ram migration file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_LAZY_LOAD_H
+#define QEMU_MIGRATION_LAZY_LOAD_H
+
+#include "qapi/error.h"
+#include "qemu-file.h"
+
+#ifdef CONFIG_LINUX
+/*
+ * Registers @block to be loaded from the file of @f on demand.  @bitmap
+ * holds the pages present in the file at @pages_offset, and is owned by
+ * the lazy loader from now on.
+ */
+bool lazy_load_add_block(QEMUFile *f, RAMBlock *block, unsigned long *bitmap,
+                         uint64_t pages_offset, Error **errp);
+/* Starts loading the pages of all the blocks added in the background */
+void lazy_load_start_prefetch(void);
+#else
+static inline bool lazy_load_add_block(QEMUFile *f, RAMBlock *block,
+                                       unsigned long *bitmap,
+                                       uint64_t pages_offset, Error **errp)
+{
+    error_setg(errp, "lazy load needs userfaultfd");
+    return false;
+}
+
+static inline void lazy_load_start_prefetch(void)
+{
+}
+#endif
+
+#endif
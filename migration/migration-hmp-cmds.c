@@ -117,6 +117,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->page_size >> 10);
         monitor_printf(mon, "multifd bytes: %" PRIu64 " kbytes\n",
                        info->ram->multifd_bytes >> 10);
+        if (info->ram->multifd_zero_pages) {
+            monitor_printf(mon, "multifd zero pages: %" PRIu64 " pages\n",
+                           info->ram->multifd_zero_pages);
+        }
         monitor_printf(mon, "pages-per-second: %" PRIu64 "\n",
                        info->ram->pages_per_second);
 
@@ -397,6 +401,17 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %s\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MODE),
             qapi_enum_lookup(&MigMode_lookup, params->mode));
+
+        if (params->has_cpr_exec_command) {
+            const strList *arg;
+
+            monitor_printf(mon, "%s:",
+                MigrationParameter_str(MIGRATION_PARAMETER_CPR_EXEC_COMMAND));
+            for (arg = params->cpr_exec_command; arg; arg = arg->next) {
+                monitor_printf(mon, " %s", arg->value);
+            }
+            monitor_printf(mon, "\n");
+        }
     }
 
     qapi_free_MigrationParameters(params);
@@ -690,6 +705,22 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_mode = true;
         visit_type_MigMode(v, param, &p->mode, &err);
         break;
+    case MIGRATION_PARAMETER_CPR_EXEC_COMMAND: {
+        g_auto(GStrv) argv = NULL;
+        GError *gerr = NULL;
+        int argc;
+
+        if (!g_shell_parse_argv(valuestr, &argc, &argv, &gerr)) {
+            error_setg(&err, "%s", gerr->message);
+            g_error_free(gerr);
+            break;
+        }
+        p->has_cpr_exec_command = true;
+        while (argc--) {
+            QAPI_LIST_PREPEND(p->cpr_exec_command, g_strdup(argv[argc]));
+        }
+        break;
+    }
     default:
         assert(0);
     }
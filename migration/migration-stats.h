@@ -64,6 +64,10 @@ typedef struct {
      * Number of bytes sent through multifd channels.
      */
     Stat64 multifd_bytes;
+    /*
+     * Number of zero pages found by the multifd channels.
+     */
+    Stat64 multifd_zero_pages;
     /*
      * Number of pages transferred that were not full of zeros.
      */
@@ -18,6 +18,7 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "migration/blocker.h"
+#include "migration/cpr.h"
 #include "exec.h"
 #include "fd.h"
 #include "file.h"
@@ -75,6 +76,7 @@
 static NotifierWithReturnList migration_state_notifiers[] = {
     NOTIFIER_ELEM_INIT(migration_state_notifiers, MIG_MODE_NORMAL),
     NOTIFIER_ELEM_INIT(migration_state_notifiers, MIG_MODE_CPR_REBOOT),
+    NOTIFIER_ELEM_INIT(migration_state_notifiers, MIG_MODE_CPR_EXEC),
 };
 
 /* Messages sent on the return path from destination to source */
@@ -225,6 +227,7 @@ void migration_object_init(void)
     qemu_mutex_init(&current_incoming->rp_mutex);
     qemu_mutex_init(&current_incoming->postcopy_prio_thread_mutex);
     qemu_event_init(&current_incoming->main_thread_load_event, false);
+    qemu_event_init(&current_incoming->postcopy_listen_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fast_load, 0);
@@ -368,6 +371,7 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    mis->loading_snapshot = false;
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -375,6 +379,7 @@ void migration_incoming_state_destroy(void)
 
     migration_incoming_transport_cleanup(mis);
     qemu_event_reset(&mis->main_thread_load_event);
+    qemu_event_reset(&mis->postcopy_listen_event);
 
     if (mis->page_requested) {
         g_tree_destroy(mis->page_requested);
@@ -730,6 +735,8 @@ static void process_incoming_migration_bh(void *opaque)
     migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
                       MIGRATION_STATUS_COMPLETED);
     migration_incoming_state_destroy();
+    /* Later migrations from this QEMU are not cpr-exec unless asked to */
+    cpr_set_incoming_mode(MIG_MODE_NORMAL);
 }
 
 static void coroutine_fn
@@ -1162,6 +1169,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         stat64_get(&mig_stats.postcopy_requests);
     info->ram->page_size = page_size;
     info->ram->multifd_bytes = stat64_get(&mig_stats.multifd_bytes);
+    info->ram->multifd_zero_pages =
+        stat64_get(&mig_stats.multifd_zero_pages);
     info->ram->pages_per_second = s->pages_per_second;
     info->ram->precopy_bytes = stat64_get(&mig_stats.precopy_bytes);
     info->ram->downtime_bytes = stat64_get(&mig_stats.downtime_bytes);
@@ -1411,6 +1420,16 @@ static void migrate_fd_cleanup(MigrationState *s)
     migration_call_notifiers(s, type, NULL);
     block_cleanup_parameters();
     yank_unregister_instance(MIGRATION_YANK_INSTANCE);
+
+    if (type == MIG_EVENT_PRECOPY_DONE &&
+        s->parameters.mode == MIG_MODE_CPR_EXEC) {
+        Error *local_err = NULL;
+
+        /* Only returns on failure; let the devices take back their state */
+        cpr_exec(&local_err);
+        migration_call_notifiers(s, MIG_EVENT_PRECOPY_FAILED, NULL);
+        error_report_err(local_err);
+    }
 }
 
 static void migrate_fd_cleanup_bh(void *opaque)
@@ -1640,7 +1659,8 @@ bool migration_thread_is_self(void)
 
 bool migrate_mode_is_cpr(MigrationState *s)
 {
-    return s->parameters.mode == MIG_MODE_CPR_REBOOT;
+    return s->parameters.mode == MIG_MODE_CPR_REBOOT ||
+           s->parameters.mode == MIG_MODE_CPR_EXEC;
 }
 
 int migrate_init(MigrationState *s, Error **errp)
@@ -2008,6 +2028,12 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
             error_setg(errp, "Cannot use %s with CPR", conflict);
             return false;
         }
+
+        if (s->parameters.mode == MIG_MODE_CPR_EXEC &&
+            !migrate_cpr_exec_command()) {
+            error_setg(errp, "cpr-exec mode requires cpr-exec-command");
+            return false;
+        }
     }
 
     if (blk || blk_inc) {
@@ -3138,6 +3164,9 @@ static void migration_update_counters(MigrationState *s,
     /* Expected bandwidth when switching over to destination QEMU */
     double expected_bw_per_ms;
     double bandwidth;
+    /* Expected time the devices take to save their state, in ms */
+    uint64_t device_time = 0;
+    uint64_t downtime_limit = migrate_downtime_limit();
 
     if (current_time < s->iteration_start_time + BUFFER_DELAY) {
         return;
@@ -3160,7 +3189,14 @@ static void migration_update_counters(MigrationState *s,
         expected_bw_per_ms = bandwidth;
     }
 
-    s->threshold_size = expected_bw_per_ms * migrate_downtime_limit();
+    if (migrate_switchover_device_time()) {
+        device_time = qemu_savevm_state_complete_estimate(expected_bw_per_ms);
+        trace_migration_switchover_device_time(device_time, downtime_limit);
+    }
+
+    /* Only the time left once the devices are saved can send RAM */
+    s->threshold_size = expected_bw_per_ms *
+        (downtime_limit > device_time ? downtime_limit - device_time : 0);
 
     s->mbps = (((double) transferred * 8.0) /
                ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
@@ -3177,7 +3213,8 @@ static void migration_update_counters(MigrationState *s,
     if (stat64_get(&mig_stats.dirty_pages_rate) &&
         transferred > 10000) {
         s->expected_downtime =
-            stat64_get(&mig_stats.dirty_bytes_last_sync) / expected_bw_per_ms;
+            stat64_get(&mig_stats.dirty_bytes_last_sync) / expected_bw_per_ms +
+            device_time;
     }
 
     migration_rate_reset();
@@ -76,6 +76,11 @@ typedef enum {
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
+    /*
+     * Loading an internal snapshot: the state comes from from_src_file
+     * only, and RAM is not known to be zero beforehand.
+     */
+    bool loading_snapshot;
     /* Previously received RAM's RAMBlock pointer */
     RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
     /* A hook to allow cleanup at the end of incoming migration */
@@ -157,6 +162,8 @@ struct MigrationIncomingState {
     PostcopyTmpPage *postcopy_tmp_pages;
     /* This is shared for all postcopy channels */
     void     *postcopy_tmp_zero_page;
+    /* Set once guest RAM is registered with userfaultfd */
+    QemuEvent postcopy_listen_event;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
@@ -440,6 +447,58 @@ struct MigrationState {
      * Default value is false. (since 8.1)
      */
     bool multifd_flush_after_each_section;
+    /*
+     * Read the pages received by multifd channels with io_uring, optionally
+     * into guest RAM registered as fixed buffers. Only used on plain socket
+     * channels, and only when QEMU is built with liburing.
+     */
+    bool multifd_recv_io_uring;
+    bool multifd_recv_io_uring_fixed;
+    /*
+     * Number of threads syncing the dirty bitmap of the RAMBlocks along
+     * with the migration thread, which does it alone when zero.  They are
+     * started at the first sync of a migration.
+     */
+    uint8_t dirty_sync_threads;
+    /*
+     * Have each multifd channel look for the dirty pages of the ranges of
+     * RAM handed to it, instead of the migration thread finding them all.
+     * Only applies to precopy without legacy zero page detection.
+     */
+    bool multifd_channel_scan;
+    /*
+     * With the dirty-limit capability, only limit the vCPUs dirtying
+     * memory faster than their share of what the migration can send,
+     * instead of limiting all of them to vcpu-dirty-limit.
+     */
+    bool dirty_limit_adaptive;
+    /*
+     * Number of threads looking for the zero pages of guest RAM once the
+     * dirty log is started, so that the first round of migration sends
+     * them without reading them, none when zero.
+     */
+    uint8_t zero_scan_threads;
+    /*
+     * Open the file of the multifd channels of a mapped-ram migration
+     * with O_DIRECT, so that the guest pages bypass the page cache.
+     */
+    bool mapped_ram_direct_io;
+    /*
+     * Load the RAM of a mapped-ram migration on demand with userfaultfd,
+     * so that the guest starts before all its pages are read.
+     */
+    bool mapped_ram_lazy_load;
+    /*
+     * Leave out of the downtime limit the time the devices took to save
+     * their state the last time, when deciding to switch over.
+     */
+    bool switchover_device_time;
+    /*
+     * Number of threads saving the state of the devices whose VMSD sets
+     * parallel_save once the VM is stopped, 0 to save it in the
+     * migration thread.
+     */
+    uint8_t device_save_threads;
     /*
      * This decides the size of guest memory chunk that will be used
      * to track dirty bitmap clearing.  The size of memory chunk will
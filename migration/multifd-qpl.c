@@ -0,0 +1,439 @@
+/*
+ * Multifd QPL compression implementation
+ *
+ * Pages are compressed one by one with the Intel Query Processing Library.
+ * The jobs of all the pages of a packet are submitted at once to the
+ * In-Memory Analytics Accelerator, and the pages it cannot process are
+ * compressed again with the software implementation of the library.
+ * Pages that do not shrink are sent as they are.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <qpl/qpl.h>
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "exec/ramblock.h"
+#include "migration.h"
+#include "trace.h"
+#include "multifd.h"
+
+typedef struct {
+    /* input and output of the job of the page */
+    uint8_t *in;
+    uint32_t in_len;
+    uint8_t *out;
+    /* whether the job is in flight on the accelerator */
+    bool hw;
+    /* outcome of the job */
+    qpl_status status;
+    uint32_t total_out;
+} QplPage;
+
+typedef struct {
+    /* one hardware job per page of a packet, NULL without accelerator */
+    qpl_job **hw_jobs;
+    /* software job for the pages the accelerator cannot process */
+    qpl_job *sw_job;
+    /* jobs of the pages being processed */
+    QplPage *pages;
+    /* one page sized buffer per page of a packet for compressed data */
+    uint8_t *zbuf;
+    /* length of each page on the wire, in big endian */
+    uint32_t *zlen;
+    /* number of pages in a full packet */
+    uint32_t page_count;
+} QplData;
+
+static qpl_job *multifd_qpl_init_job(qpl_path_t path)
+{
+    qpl_job *job;
+    uint32_t size;
+
+    if (qpl_get_job_size(path, &size) != QPL_STS_OK) {
+        return NULL;
+    }
+    job = g_malloc0(size);
+    if (qpl_init_job(path, job) != QPL_STS_OK) {
+        g_free(job);
+        return NULL;
+    }
+    return job;
+}
+
+static void multifd_qpl_fini_job(qpl_job *job)
+{
+    if (job) {
+        qpl_fini_job(job);
+        g_free(job);
+    }
+}
+
+static void multifd_qpl_free(QplData *qpl)
+{
+    uint32_t i;
+
+    if (qpl->hw_jobs) {
+        for (i = 0; i < qpl->page_count; i++) {
+            multifd_qpl_fini_job(qpl->hw_jobs[i]);
+        }
+        g_free(qpl->hw_jobs);
+    }
+    multifd_qpl_fini_job(qpl->sw_job);
+    g_free(qpl->pages);
+    g_free(qpl->zbuf);
+    g_free(qpl->zlen);
+    g_free(qpl);
+}
+
+/**
+ * multifd_qpl_init: allocate the jobs and buffers of a channel
+ *
+ * Without an accelerator, all the pages are compressed in software.
+ *
+ * Returns the QPL data of the channel, or NULL for error
+ *
+ * @page_count: number of pages in a full packet
+ * @page_size: guest page size
+ * @id: channel number
+ * @errp: pointer to an error
+ */
+static QplData *multifd_qpl_init(uint32_t page_count, uint32_t page_size,
+                                 uint8_t id, Error **errp)
+{
+    QplData *qpl = g_new0(QplData, 1);
+    uint32_t i;
+
+    qpl->page_count = page_count;
+    qpl->sw_job = multifd_qpl_init_job(qpl_path_software);
+    if (!qpl->sw_job) {
+        error_setg(errp, "multifd %u: cannot initialize QPL software job", id);
+        multifd_qpl_free(qpl);
+        return NULL;
+    }
+
+    qpl->hw_jobs = g_new0(qpl_job *, page_count);
+    for (i = 0; i < page_count; i++) {
+        qpl->hw_jobs[i] = multifd_qpl_init_job(qpl_path_hardware);
+        if (!qpl->hw_jobs[i]) {
+            warn_report_once("multifd: no accelerator available to QPL, "
+                             "compressing pages in software");
+            while (i--) {
+                multifd_qpl_fini_job(qpl->hw_jobs[i]);
+            }
+            g_free(qpl->hw_jobs);
+            qpl->hw_jobs = NULL;
+            break;
+        }
+    }
+
+    qpl->pages = g_new0(QplPage, page_count);
+    qpl->zlen = g_new0(uint32_t, page_count);
+    qpl->zbuf = g_try_malloc((size_t)page_count * page_size);
+    if (!qpl->zbuf) {
+        error_setg(errp, "multifd %u: out of memory for zbuf", id);
+        multifd_qpl_free(qpl);
+        return NULL;
+    }
+    return qpl;
+}
+
+static void multifd_qpl_prepare_job(qpl_job *job, qpl_opcode op,
+                                    QplPage *page, uint32_t page_size)
+{
+    job->op = op;
+    job->level = qpl_default_level;
+    job->flags = QPL_FLAG_FIRST | QPL_FLAG_LAST | QPL_FLAG_OMIT_VERIFY;
+    job->next_in_ptr = page->in;
+    job->available_in = page->in_len;
+    job->next_out_ptr = page->out;
+    job->available_out = page_size;
+}
+
+/*
+ * A page that does not fit in its output buffer will not fit in software
+ * either: only other failures, e.g. a busy queue or a fault on a guest
+ * page not yet populated, are retried in software.
+ */
+static bool multifd_qpl_hw_done(qpl_opcode op, qpl_status status)
+{
+    return status == QPL_STS_OK ||
+           (op == qpl_op_compress && status == QPL_STS_MORE_OUTPUT_NEEDED);
+}
+
+/**
+ * multifd_qpl_run: run the jobs of the first @num pages
+ *
+ * All the jobs are in flight at once on the accelerator, then those it
+ * could not process run one after the other in software.
+ *
+ * @qpl: QPL data of the channel
+ * @op: qpl_op_compress or qpl_op_decompress
+ * @num: number of pages
+ * @page_size: guest page size
+ * @id: channel number
+ */
+static void multifd_qpl_run(QplData *qpl, qpl_opcode op, uint32_t num,
+                            uint32_t page_size, uint8_t id)
+{
+    uint32_t i, sw_num = 0;
+
+    for (i = 0; i < num; i++) {
+        QplPage *page = &qpl->pages[i];
+
+        page->hw = false;
+        if (qpl->hw_jobs) {
+            multifd_qpl_prepare_job(qpl->hw_jobs[i], op, page, page_size);
+            page->hw = qpl_submit_job(qpl->hw_jobs[i]) == QPL_STS_OK;
+        }
+    }
+
+    for (i = 0; i < num; i++) {
+        QplPage *page = &qpl->pages[i];
+        qpl_job *job;
+
+        if (page->hw) {
+            job = qpl->hw_jobs[i];
+            page->status = qpl_wait_job(job);
+            if (multifd_qpl_hw_done(op, page->status)) {
+                page->total_out = job->total_out;
+                continue;
+            }
+        }
+
+        job = qpl->sw_job;
+        multifd_qpl_prepare_job(job, op, page, page_size);
+        page->status = qpl_execute_job(job);
+        page->total_out = job->total_out;
+        sw_num++;
+    }
+
+    trace_multifd_qpl_run(id, op == qpl_op_compress, num, sw_num);
+}
+
+/**
+ * multifd_qpl_send_setup: setup send side
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_qpl_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    p->compress_data = multifd_qpl_init(p->page_count, p->page_size,
+                                        p->id, errp);
+    return p->compress_data ? 0 : -1;
+}
+
+/**
+ * multifd_qpl_send_cleanup: cleanup send side
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void multifd_qpl_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    multifd_qpl_free(p->compress_data);
+    p->compress_data = NULL;
+}
+
+/**
+ * multifd_qpl_send_prepare: prepare data to be able to send
+ *
+ * Compress each page on its own. The packet carries the length of each
+ * page, followed by the pages, compressed or not when they do not shrink.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_qpl_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    QplData *qpl = p->compress_data;
+    uint32_t size, i;
+
+    if (!multifd_send_prepare_common(p)) {
+        goto out;
+    }
+
+    for (i = 0; i < pages->normal_num; i++) {
+        QplPage *page = &qpl->pages[i];
+
+        page->in = pages->block->host + pages->offset[i];
+        page->in_len = p->page_size;
+        page->out = qpl->zbuf + (size_t)i * p->page_size;
+    }
+
+    multifd_qpl_run(qpl, qpl_op_compress, pages->normal_num, p->page_size,
+                    p->id);
+
+    size = pages->normal_num * sizeof(uint32_t);
+    p->iov[p->iovs_num].iov_base = qpl->zlen;
+    p->iov[p->iovs_num].iov_len = size;
+    p->iovs_num++;
+
+    for (i = 0; i < pages->normal_num; i++) {
+        QplPage *page = &qpl->pages[i];
+        uint32_t len = p->page_size;
+        uint8_t *buf = page->in;
+
+        if (page->status == QPL_STS_OK && page->total_out < p->page_size) {
+            len = page->total_out;
+            buf = page->out;
+        }
+        qpl->zlen[i] = cpu_to_be32(len);
+        p->iov[p->iovs_num].iov_base = buf;
+        p->iov[p->iovs_num].iov_len = len;
+        p->iovs_num++;
+        size += len;
+    }
+    p->next_packet_size = size;
+
+out:
+    p->flags |= MULTIFD_FLAG_QPL;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+/**
+ * multifd_qpl_recv_setup: setup receive side
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_qpl_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    p->compress_data = multifd_qpl_init(p->page_count, p->page_size,
+                                        p->id, errp);
+    return p->compress_data ? 0 : -1;
+}
+
+/**
+ * multifd_qpl_recv_cleanup: cleanup receive side
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_qpl_recv_cleanup(MultiFDRecvParams *p)
+{
+    multifd_qpl_free(p->compress_data);
+    p->compress_data = NULL;
+}
+
+/**
+ * multifd_qpl_recv: read the data from the channel into actual pages
+ *
+ * Read the uncompressed pages straight into guest memory, and the
+ * compressed ones into the buffer they are decompressed from.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_qpl_recv(MultiFDRecvParams *p, Error **errp)
+{
+    QplData *qpl = p->compress_data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t hdr_len = p->normal_num * sizeof(uint32_t);
+    uint32_t data_len = 0, num = 0;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_QPL) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_QPL);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    if (in_size < hdr_len) {
+        error_setg(errp, "multifd %u: packet size received %u smaller than "
+                   "page lengths %u", p->id, in_size, hdr_len);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)qpl->zlen, hdr_len, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint32_t len = be32_to_cpu(qpl->zlen[i]);
+        uint8_t *host = p->host + p->normal[i];
+
+        if (!len || len > p->page_size) {
+            error_setg(errp, "multifd %u: invalid page length %u",
+                       p->id, len);
+            return -1;
+        }
+
+        if (len == p->page_size) {
+            p->iov[i].iov_base = host;
+        } else {
+            QplPage *page = &qpl->pages[num++];
+
+            page->in = qpl->zbuf + (size_t)i * p->page_size;
+            page->in_len = len;
+            page->out = host;
+            p->iov[i].iov_base = page->in;
+        }
+        p->iov[i].iov_len = len;
+        data_len += len;
+    }
+
+    if (hdr_len + data_len != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u size expected %u",
+                   p->id, in_size, hdr_len + data_len);
+        return -1;
+    }
+
+    ret = qio_channel_readv_all(p->c, p->iov, p->normal_num, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    multifd_qpl_run(qpl, qpl_op_decompress, num, p->page_size, p->id);
+
+    for (i = 0; i < num; i++) {
+        QplPage *page = &qpl->pages[i];
+
+        if (page->status != QPL_STS_OK || page->total_out != p->page_size) {
+            error_setg(errp, "multifd %u: decompression failed with status "
+                       "%d, %u bytes out of %u", p->id, page->status,
+                       page->total_out, p->page_size);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_qpl_ops = {
+    .send_setup = multifd_qpl_send_setup,
+    .send_cleanup = multifd_qpl_send_cleanup,
+    .send_prepare = multifd_qpl_send_prepare,
+    .recv_setup = multifd_qpl_recv_setup,
+    .recv_cleanup = multifd_qpl_recv_cleanup,
+    .recv = multifd_qpl_recv
+};
+
+static void multifd_qpl_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_QPL, &multifd_qpl_ops);
+}
+
+migration_init(multifd_qpl_register);
@@ -0,0 +1,239 @@
+/*
+ * Multifd io_uring receive engine
+ *
+ * Pages of a packet are read from the channel socket straight into guest
+ * RAM with one chain of linked reads per packet: a single io_uring_enter()
+ * posts them all and reaps their completions.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "qemu/rcu.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "exec/ramblock.h"
+#include "io/channel-socket.h"
+#include "migration.h"
+#include "multifd.h"
+#include "options.h"
+#include "ram.h"
+#include "trace.h"
+
+/* Registered buffers are at most 1GiB each */
+#define MULTIFD_URING_BUF_SIZE (1ULL << 30)
+
+struct MultiFDURing {
+    struct io_uring ring;
+    int fd;
+    /* RAMBlock -> index of its first registered buffer, plus one */
+    GHashTable *bufs;
+    /* result of each read of the chain in flight */
+    int *res;
+};
+
+/*
+ * Register the host memory of all the migrated RAMBlocks as fixed buffers,
+ * so that reads do not need to pin and map guest pages one at a time.
+ * Registration pins the whole guest RAM, so it is optional and failures
+ * only fall back to plain reads.
+ */
+static void multifd_uring_register_bufs(MultiFDURing *ur, uint8_t id)
+{
+    g_autoptr(GArray) iovs = g_array_new(false, false, sizeof(struct iovec));
+    RAMBlock *block;
+    int ret;
+
+    ur->bufs = g_hash_table_new(NULL, NULL);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            uint8_t *host = qemu_ram_get_host_addr(block);
+            ram_addr_t len = block->max_length;
+            ram_addr_t off;
+
+            g_hash_table_insert(ur->bufs, block,
+                                GUINT_TO_POINTER(iovs->len + 1));
+            for (off = 0; off < len; off += MULTIFD_URING_BUF_SIZE) {
+                struct iovec iov = {
+                    .iov_base = host + off,
+                    .iov_len = MIN(len - off, MULTIFD_URING_BUF_SIZE),
+                };
+
+                g_array_append_val(iovs, iov);
+            }
+        }
+    }
+
+    ret = io_uring_register_buffers(&ur->ring, (struct iovec *)iovs->data,
+                                    iovs->len);
+    trace_multifd_uring_register_bufs(id, iovs->len, ret);
+    if (ret) {
+        warn_report("multifd %u: cannot register guest RAM with io_uring: %s",
+                    id, strerror(-ret));
+        g_hash_table_remove_all(ur->bufs);
+    }
+}
+
+static int multifd_uring_buf_index(MultiFDURing *ur, RAMBlock *block,
+                                   ram_addr_t offset)
+{
+    unsigned int index = GPOINTER_TO_UINT(g_hash_table_lookup(ur->bufs,
+                                                              block));
+
+    if (!index) {
+        return -1;
+    }
+    return index - 1 + offset / MULTIFD_URING_BUF_SIZE;
+}
+
+void multifd_uring_recv_setup(MultiFDRecvParams *p)
+{
+    MultiFDURing *ur;
+    int ret;
+
+    if (!migrate_multifd_recv_io_uring()) {
+        return;
+    }
+
+    /* TLS and other channels do not expose a socket to read from */
+    if (!object_dynamic_cast(OBJECT(p->c), TYPE_QIO_CHANNEL_SOCKET)) {
+        warn_report("multifd %u: io_uring needs a plain socket channel", p->id);
+        return;
+    }
+
+    ur = g_new0(MultiFDURing, 1);
+    ret = io_uring_queue_init(p->page_count, &ur->ring, 0);
+    if (ret) {
+        warn_report("multifd %u: cannot set up io_uring: %s", p->id,
+                    strerror(-ret));
+        g_free(ur);
+        return;
+    }
+
+    ur->fd = QIO_CHANNEL_SOCKET(p->c)->fd;
+    ur->res = g_new0(int, p->page_count);
+    if (migrate_multifd_recv_io_uring_fixed()) {
+        multifd_uring_register_bufs(ur, p->id);
+    } else {
+        ur->bufs = g_hash_table_new(NULL, NULL);
+    }
+
+    p->uring = ur;
+}
+
+void multifd_uring_recv_cleanup(MultiFDRecvParams *p)
+{
+    MultiFDURing *ur = p->uring;
+
+    if (!ur) {
+        return;
+    }
+
+    io_uring_queue_exit(&ur->ring);
+    g_hash_table_destroy(ur->bufs);
+    g_free(ur->res);
+    g_free(ur);
+    p->uring = NULL;
+}
+
+/*
+ * Queue one linked read per page, from page @first on, the first one
+ * resuming after the @partial bytes already read. Returns the number of
+ * reads queued.
+ */
+static uint32_t multifd_uring_queue_reads(MultiFDRecvParams *p,
+                                          uint32_t first, size_t partial)
+{
+    MultiFDURing *ur = p->uring;
+    uint32_t i;
+
+    for (i = first; i < p->normal_num; i++) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ur->ring);
+        size_t skip = i == first ? partial : 0;
+        uint8_t *buf = p->host + p->normal[i] + skip;
+        int index = multifd_uring_buf_index(ur, p->block, p->normal[i]);
+
+        /* The ring has one entry per page of a packet */
+        assert(sqe);
+        if (index >= 0) {
+            io_uring_prep_read_fixed(sqe, ur->fd, buf, p->page_size - skip,
+                                     0, index);
+        } else {
+            io_uring_prep_read(sqe, ur->fd, buf, p->page_size - skip, 0);
+        }
+        io_uring_sqe_set_data(sqe, (void *)(uintptr_t)(i - first));
+        if (i + 1 < p->normal_num) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+    }
+
+    return i - first;
+}
+
+int multifd_uring_recv_pages(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDURing *ur = p->uring;
+    struct io_uring_cqe *cqe;
+    uint32_t done = 0, submits = 0;
+    size_t partial = 0;
+    uint32_t i, n;
+    int ret;
+
+    while (done < p->normal_num) {
+        n = multifd_uring_queue_reads(p, done, partial);
+        ret = io_uring_submit_and_wait(&ur->ring, n);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "multifd %u: io_uring submit failed",
+                             p->id);
+            return -1;
+        }
+        submits++;
+
+        /* All the reads of the chain complete, be it only as cancelled */
+        for (i = 0; i < n; i++) {
+            ret = io_uring_wait_cqe(&ur->ring, &cqe);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "multifd %u: io_uring wait failed",
+                                 p->id);
+                return -1;
+            }
+            ur->res[(uintptr_t)io_uring_cqe_get_data(cqe)] = cqe->res;
+            io_uring_cqe_seen(&ur->ring, cqe);
+        }
+
+        /*
+         * A short read breaks the chain and cancels the following reads:
+         * resume from where it stopped.
+         */
+        for (i = 0; i < n; i++) {
+            size_t len = p->page_size - (i ? 0 : partial);
+            int res = ur->res[i];
+
+            if (res == len) {
+                partial = 0;
+                continue;
+            }
+            if (res == -ECANCELED || res == -EINTR) {
+                break;
+            }
+            if (res == -EAGAIN) {
+                qio_channel_wait(p->c, G_IO_IN);
+                break;
+            }
+            if (res <= 0) {
+                error_setg_errno(errp, res ? -res : EPIPE,
+                                 "multifd %u: failed to read page", p->id);
+                return -1;
+            }
+            partial = (i ? 0 : partial) + res;
+            break;
+        }
+        done += i;
+    }
+
+    trace_multifd_uring_recv_pages(p->id, p->normal_num, submits);
+    return 0;
+}
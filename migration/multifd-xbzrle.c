@@ -0,0 +1,345 @@
+/*
+ * Multifd XBZRLE encoding
+ *
+ * Once the first round is over, the sender threads encode each page of
+ * their packets as its difference from the copy of the page kept in the
+ * XBZRLE cache, which mirrors what the destination has in guest RAM.
+ * The cache is split in shards, as many as there are channels, each with
+ * its own lock, so that the channels rarely wait for each other.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "multifd.h"
+#include "options.h"
+#include "page_cache.h"
+#include "ram.h"
+#include "xbzrle.h"
+#include "trace.h"
+
+/* Length of a page sent as is rather than encoded */
+#define MULTIFD_XBZRLE_RAW UINT32_MAX
+
+typedef struct {
+    /* copy of the page being encoded */
+    uint8_t *current_buf;
+    /* length of each page of the packet, in network order */
+    uint32_t *lens;
+    /* data of the pages of the packet */
+    uint8_t *buf;
+} MultiFDXbzrleData;
+
+static struct {
+    /*
+     * A page goes to the shard given by the low bits of its page number,
+     * under the lock of the shard.  The caches of the shards are indexed
+     * by the remaining bits.
+     */
+    PageCache **shards;
+    QemuMutex *locks;
+    unsigned int shard_bits;
+    /* set once the first round is over */
+    bool started;
+    uint8_t *zero_page;
+    /* protects xbzrle_counters */
+    QemuMutex stats_lock;
+} multifd_xbzrle;
+
+static PageCache *multifd_xbzrle_shard(ram_addr_t addr, uint64_t *key,
+                                       QemuMutex **lock)
+{
+    unsigned int page_bits = qemu_target_page_bits();
+    uint64_t page = addr >> page_bits;
+    unsigned int i = page & ((1U << multifd_xbzrle.shard_bits) - 1);
+
+    *key = (page >> multifd_xbzrle.shard_bits) << page_bits;
+    *lock = &multifd_xbzrle.locks[i];
+    return multifd_xbzrle.shards[i];
+}
+
+int multifd_xbzrle_setup(Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    uint64_t cache_size = migrate_xbzrle_cache_size();
+    unsigned int bits = ctz32(pow2floor(migrate_multifd_channels()));
+    int i;
+
+    /* Each shard needs at least one page */
+    bits = MIN(bits, ctz64(cache_size / page_size));
+
+    multifd_xbzrle.shard_bits = bits;
+    multifd_xbzrle.shards = g_new0(PageCache *, 1U << bits);
+    multifd_xbzrle.locks = g_new0(QemuMutex, 1U << bits);
+    for (i = 0; i < 1U << bits; i++) {
+        multifd_xbzrle.shards[i] = cache_init(cache_size >> bits, page_size,
+                                              errp);
+        if (!multifd_xbzrle.shards[i]) {
+            multifd_xbzrle_cleanup();
+            return -1;
+        }
+        qemu_mutex_init(&multifd_xbzrle.locks[i]);
+    }
+    multifd_xbzrle.zero_page = g_malloc0(page_size);
+    qemu_mutex_init(&multifd_xbzrle.stats_lock);
+    multifd_xbzrle.started = false;
+    return 0;
+}
+
+void multifd_xbzrle_cleanup(void)
+{
+    int i;
+
+    if (!multifd_xbzrle.shards) {
+        return;
+    }
+
+    for (i = 0; i < 1U << multifd_xbzrle.shard_bits; i++) {
+        if (!multifd_xbzrle.shards[i]) {
+            break;
+        }
+        cache_fini(multifd_xbzrle.shards[i]);
+        qemu_mutex_destroy(&multifd_xbzrle.locks[i]);
+    }
+    if (multifd_xbzrle.zero_page) {
+        qemu_mutex_destroy(&multifd_xbzrle.stats_lock);
+    }
+    g_free(multifd_xbzrle.shards);
+    g_free(multifd_xbzrle.locks);
+    g_free(multifd_xbzrle.zero_page);
+    multifd_xbzrle.shards = NULL;
+    multifd_xbzrle.locks = NULL;
+    multifd_xbzrle.zero_page = NULL;
+}
+
+void multifd_xbzrle_start(void)
+{
+    qatomic_set(&multifd_xbzrle.started, true);
+}
+
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr)
+{
+    QemuMutex *lock;
+    uint64_t key;
+    PageCache *cache = multifd_xbzrle_shard(addr, &key, &lock);
+
+    /* Like xbzrle_cache_zero_page(), only a stale page must be replaced */
+    WITH_QEMU_LOCK_GUARD(lock) {
+        cache_insert(cache, key, multifd_xbzrle.zero_page,
+                     stat64_get(&mig_stats.dirty_sync_count));
+    }
+}
+
+int multifd_xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDXbzrleData *x = g_new0(MultiFDXbzrleData, 1);
+
+    x->current_buf = g_try_malloc(p->page_size);
+    x->lens = g_try_new(uint32_t, p->page_count);
+    x->buf = g_try_malloc((size_t)p->page_count * p->page_size);
+    if (!x->current_buf || !x->lens || !x->buf) {
+        error_setg(errp, "multifd %u: out of memory for xbzrle", p->id);
+        p->compress_data = x;
+        multifd_xbzrle_send_cleanup(p);
+        return -1;
+    }
+
+    p->compress_data = x;
+    return 0;
+}
+
+void multifd_xbzrle_send_cleanup(MultiFDSendParams *p)
+{
+    MultiFDXbzrleData *x = p->compress_data;
+
+    if (!x) {
+        return;
+    }
+
+    g_free(x->current_buf);
+    g_free(x->lens);
+    g_free(x->buf);
+    g_free(x);
+    p->compress_data = NULL;
+}
+
+/*
+ * Encodes the page at @host into @out, and keeps the cache in sync with
+ * what is sent: a page that is not cached is inserted and sent as is,
+ * from the cache so that both match even if the guest writes to it.
+ *
+ * Returns the length written to @out, MULTIFD_XBZRLE_RAW when it is the
+ * whole page, or 0 when the page did not change.
+ */
+static uint32_t multifd_xbzrle_encode_page(MultiFDSendParams *p,
+                                           ram_addr_t addr, uint8_t *host,
+                                           uint8_t *out, XBZRLECacheStats *st)
+{
+    MultiFDXbzrleData *x = p->compress_data;
+    uint64_t generation = stat64_get(&mig_stats.dirty_sync_count);
+    QemuMutex *lock;
+    uint64_t key;
+    PageCache *cache = multifd_xbzrle_shard(addr, &key, &lock);
+    uint8_t *prev;
+    int len;
+
+    QEMU_LOCK_GUARD(lock);
+
+    if (!cache_is_cached(cache, key, generation)) {
+        st->cache_miss++;
+        if (cache_insert(cache, key, host, generation) == 0) {
+            host = get_cached_data(cache, key);
+        }
+        memcpy(out, host, p->page_size);
+        return MULTIFD_XBZRLE_RAW;
+    }
+
+    st->pages++;
+    prev = get_cached_data(cache, key);
+    memcpy(x->current_buf, host, p->page_size);
+    len = xbzrle_encode_buffer(prev, x->current_buf, p->page_size, out,
+                               p->page_size);
+    if (len == 0) {
+        return 0;
+    }
+
+    memcpy(prev, x->current_buf, p->page_size);
+    if (len < 0) {
+        st->overflow++;
+        st->bytes += p->page_size;
+        memcpy(out, x->current_buf, p->page_size);
+        return MULTIFD_XBZRLE_RAW;
+    }
+
+    st->bytes += len + sizeof(uint32_t);
+    return len;
+}
+
+bool multifd_xbzrle_send_prepare(MultiFDSendParams *p)
+{
+    MultiFDXbzrleData *x = p->compress_data;
+    MultiFDPages_t *pages = p->pages;
+    XBZRLECacheStats st = {};
+    uint32_t size = 0;
+    uint32_t i;
+
+    /* Postcopy does not use XBZRLE */
+    if (!x || !qatomic_read(&multifd_xbzrle.started) ||
+        (p->flags & MULTIFD_FLAG_POSTCOPY)) {
+        return false;
+    }
+
+    for (i = pages->normal_num; i < pages->num; i++) {
+        multifd_xbzrle_cache_zero_page(pages->block->offset +
+                                       pages->offset[i]);
+    }
+
+    multifd_send_prepare_header(p);
+    for (i = 0; i < pages->normal_num; i++) {
+        ram_addr_t offset = pages->offset[i];
+        uint32_t len;
+
+        len = multifd_xbzrle_encode_page(p, pages->block->offset + offset,
+                                         pages->block->host + offset,
+                                         x->buf + size, &st);
+        x->lens[i] = cpu_to_be32(len);
+        size += len == MULTIFD_XBZRLE_RAW ? p->page_size : len;
+    }
+
+    if (pages->normal_num) {
+        p->iov[p->iovs_num].iov_base = x->lens;
+        p->iov[p->iovs_num].iov_len = pages->normal_num * sizeof(uint32_t);
+        p->iovs_num++;
+    }
+    if (size) {
+        p->iov[p->iovs_num].iov_base = x->buf;
+        p->iov[p->iovs_num].iov_len = size;
+        p->iovs_num++;
+    }
+    p->next_packet_size = pages->normal_num * sizeof(uint32_t) + size;
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+
+    WITH_QEMU_LOCK_GUARD(&multifd_xbzrle.stats_lock) {
+        xbzrle_counters.pages += st.pages;
+        xbzrle_counters.cache_miss += st.cache_miss;
+        xbzrle_counters.overflow += st.overflow;
+        xbzrle_counters.bytes += st.bytes;
+    }
+    trace_multifd_xbzrle_send(p->id, pages->normal_num, size);
+    return true;
+}
+
+int multifd_xbzrle_recv_pages(MultiFDRecvParams *p, Error **errp)
+{
+    size_t lens_size = p->normal_num * sizeof(uint32_t);
+    uint32_t in_size = p->next_packet_size;
+    uint32_t *lens;
+    uint8_t *data;
+    uint32_t used = 0;
+    int ret;
+
+    if (in_size < lens_size ||
+        in_size - lens_size > (size_t)p->normal_num * p->page_size) {
+        error_setg(errp, "multifd %u: xbzrle packet of %u bytes for %u pages",
+                   p->id, in_size, p->normal_num);
+        return -1;
+    }
+
+    if (!p->compress_data) {
+        p->compress_data = g_malloc((size_t)p->page_count *
+                                    (sizeof(uint32_t) + p->page_size));
+    }
+    lens = p->compress_data;
+    data = (uint8_t *)(lens + p->normal_num);
+
+    ret = qio_channel_read_all(p->c, p->compress_data, in_size, errp);
+    if (ret) {
+        return ret;
+    }
+    in_size -= lens_size;
+
+    for (uint32_t i = 0; i < p->normal_num; i++) {
+        uint8_t *host = p->host + p->normal[i];
+        uint32_t len = be32_to_cpu(lens[i]);
+
+        bool raw = len == MULTIFD_XBZRLE_RAW;
+
+        if (raw) {
+            len = p->page_size;
+        }
+        if (len > in_size - used) {
+            error_setg(errp, "multifd %u: xbzrle packet too short", p->id);
+            return -1;
+        }
+        if (raw) {
+            memcpy(host, data + used, len);
+        } else if (len && xbzrle_decode_buffer(data + used, len, host,
+                                               p->page_size) < 0) {
+            error_setg(errp, "multifd %u: failed to decode xbzrle page",
+                       p->id);
+            return -1;
+        }
+        used += len;
+    }
+
+    if (used != in_size) {
+        error_setg(errp, "multifd %u: xbzrle packet size received %u size "
+                   "used %u", p->id, in_size, used);
+        return -1;
+    }
+    return 0;
+}
+
+void multifd_xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+}
@@ -12,8 +12,10 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/bitmap.h"
 #include "exec/ramblock.h"
 #include "migration.h"
+#include "migration-stats.h"
 #include "multifd.h"
 #include "options.h"
 #include "ram.h"
@@ -23,19 +25,6 @@ static bool multifd_zero_page_enabled(void)
     return migrate_zero_page_detection() == ZERO_PAGE_DETECTION_MULTIFD;
 }
 
-static void swap_page_offset(ram_addr_t *pages_offset, int a, int b)
-{
-    ram_addr_t temp;
-
-    if (a == b) {
-        return;
-    }
-
-    temp = pages_offset[a];
-    pages_offset[a] = pages_offset[b];
-    pages_offset[b] = temp;
-}
-
 /**
  * multifd_send_zero_page_detect: Perform zero page detection on all pages.
  *
@@ -48,32 +37,44 @@ void multifd_send_zero_page_detect(MultiFDSendParams *p)
 {
     MultiFDPages_t *pages = p->pages;
     RAMBlock *rb = pages->block;
-    int i = 0;
-    int j = pages->num - 1;
+    uint32_t normal_num = 0;
+    uint32_t i, j;
 
     if (!multifd_zero_page_enabled()) {
         pages->normal_num = pages->num;
         return;
     }
 
+    for (i = 0; i < pages->num; i++) {
+        p->zero_bufs[i] = rb->host + pages->offset[i];
+    }
+    if (!buffer_is_zero_batch(p->zero_bufs, pages->num, p->page_size,
+                              p->zero_bitmap)) {
+        pages->normal_num = pages->num;
+        return;
+    }
+
     /*
-     * Sort the page offset array by moving all normal pages to
-     * the left and all zero pages to the right of the array.
+     * Move all normal pages to the left and all zero pages to the right
+     * of the page offset array, recovering the offsets of the zero pages
+     * from their host address.
      */
-    while (i <= j) {
-        uint64_t offset = pages->offset[i];
-
-        if (!buffer_is_zero(rb->host + offset, p->page_size)) {
-            i++;
-            continue;
+    for (i = 0; i < pages->num; i++) {
+        if (!test_bit(i, p->zero_bitmap)) {
+            pages->offset[normal_num++] = pages->offset[i];
         }
+    }
+    for (i = 0, j = normal_num; i < pages->num; i++) {
+        if (test_bit(i, p->zero_bitmap)) {
+            ram_addr_t offset = (const uint8_t *)p->zero_bufs[i] - rb->host;
 
-        swap_page_offset(pages->offset, i, j);
-        ram_release_page(rb->idstr, offset);
-        j--;
+            pages->offset[j++] = offset;
+            ram_release_page(rb->idstr, offset);
+        }
     }
 
-    pages->normal_num = i;
+    pages->normal_num = normal_num;
+    stat64_add(&mig_stats.multifd_zero_pages, pages->num - normal_num);
 }
 
 void multifd_recv_zero_page_process(MultiFDRecvParams *p)
@@ -12,7 +12,9 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/bitmap.h"
 #include "qemu/rcu.h"
+#include "qemu/lockable.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -20,14 +22,19 @@
 #include "qapi/error.h"
 #include "file.h"
 #include "migration.h"
+#include "migration/misc.h"
+#include "migration/colo.h"
 #include "migration-stats.h"
+#include "postcopy-ram.h"
 #include "socket.h"
 #include "tls.h"
 #include "qemu-file.h"
+#include "savevm.h"
 #include "trace.h"
 #include "multifd.h"
 #include "threadinfo.h"
 #include "options.h"
+#include "ram.h"
 #include "qemu/yank.h"
 #include "io/channel-file.h"
 #include "io/channel-socket.h"
@@ -71,12 +78,20 @@ struct {
     QemuSemaphore channels_created;
     /* send channels ready */
     QemuSemaphore channels_ready;
+    /*
+     * Serializes handing out jobs to the channels, since besides the
+     * migration thread, device state saving threads can queue jobs
+     * concurrently via multifd_queue_device_state().
+     */
+    QemuMutex send_mutex;
     /*
      * Have we already run terminate threads.  There is a race when it
      * happens that we got one error while we are exiting.
      * We will use atomic operations.  Only valid values are 0 and 1.
      */
     int exiting;
+    /* Pages are now sent during postcopy */
+    bool postcopy;
     /* multifd ops */
     MultiFDMethods *ops;
 } *multifd_send_state;
@@ -137,30 +152,56 @@ static int nocomp_send_setup(MultiFDSendParams *p, Error **errp)
         p->write_flags |= QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
     }
 
+    if (migrate_xbzrle()) {
+        return multifd_xbzrle_send_setup(p, errp);
+    }
+
     return 0;
 }
 
 /**
  * nocomp_send_cleanup: cleanup send side
  *
- * For no compression this function does nothing.
+ * For no compression this function only frees the XBZRLE buffers.
  *
  * @p: Params for the channel that we are using
  * @errp: pointer to an error
  */
 static void nocomp_send_cleanup(MultiFDSendParams *p, Error **errp)
 {
-    return;
+    multifd_xbzrle_send_cleanup(p);
+}
+
+/*
+ * Adds the @len bytes at @base to the @num iovs of @iov, extending the
+ * last one instead when they follow it, as the pages of a huge page do.
+ * The iovs before @first are left alone.
+ *
+ * Returns the new number of iovs.
+ */
+static uint32_t multifd_iov_add(struct iovec *iov, uint32_t first,
+                                uint32_t num, uint8_t *base, size_t len)
+{
+    if (num > first &&
+        (uint8_t *)iov[num - 1].iov_base + iov[num - 1].iov_len == base) {
+        iov[num - 1].iov_len += len;
+        return num;
+    }
+
+    iov[num].iov_base = base;
+    iov[num].iov_len = len;
+    return num + 1;
 }
 
 static void multifd_send_prepare_iovs(MultiFDSendParams *p)
 {
     MultiFDPages_t *pages = p->pages;
+    uint32_t first = p->iovs_num;
 
     for (int i = 0; i < pages->normal_num; i++) {
-        p->iov[p->iovs_num].iov_base = pages->block->host + pages->offset[i];
-        p->iov[p->iovs_num].iov_len = p->page_size;
-        p->iovs_num++;
+        p->iovs_num = multifd_iov_add(p->iov, first, p->iovs_num,
+                                      pages->block->host + pages->offset[i],
+                                      p->page_size);
     }
 
     p->next_packet_size = pages->normal_num * p->page_size;
@@ -191,6 +232,12 @@ static int nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
         return 0;
     }
 
+    /* XBZRLE is not compatible with zero copy */
+    if (multifd_xbzrle_send_prepare(p)) {
+        multifd_send_fill_packet(p);
+        return 0;
+    }
+
     if (!use_zero_copy_send) {
         /*
          * Only !zerocopy needs the header in IOV; zerocopy will
@@ -234,12 +281,64 @@ static int nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
 /**
  * nocomp_recv_cleanup: setup receive side
  *
- * For no compression this function does nothing.
+ * For no compression this function only frees the XBZRLE buffer.
  *
  * @p: Params for the channel that we are using
  */
 static void nocomp_recv_cleanup(MultiFDRecvParams *p)
 {
+    multifd_xbzrle_recv_cleanup(p);
+}
+
+/*
+ * During postcopy the vCPUs may be faulting on the pages, which must be
+ * placed atomically through userfaultfd instead of written in place.
+ */
+static int multifd_recv_postcopy_pages(MultiFDRecvParams *p, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int ret;
+
+    /* Pages can arrive before the main thread registered guest RAM */
+    qemu_event_wait(&mis->postcopy_listen_event);
+    if (qatomic_read(&multifd_recv_state->exiting)) {
+        error_setg(errp, "multifd %u: exiting before postcopy listen", p->id);
+        return -1;
+    }
+
+    for (int i = 0; i < p->zero_num; i++) {
+        ret = postcopy_place_page_zero(mis, p->host + p->zero[i], p->block);
+        if (ret) {
+            error_setg_errno(errp, -ret, "multifd %u: failed to place zero "
+                             "page", p->id);
+            return -1;
+        }
+    }
+
+    if (!p->normal_num) {
+        return 0;
+    }
+
+    if (!p->postcopy_buf) {
+        p->postcopy_buf = g_malloc((size_t)p->page_count * p->page_size);
+    }
+    ret = qio_channel_read_all(p->c, (char *)p->postcopy_buf,
+                               (size_t)p->normal_num * p->page_size, errp);
+    if (ret) {
+        return ret;
+    }
+
+    for (int i = 0; i < p->normal_num; i++) {
+        ret = postcopy_place_page(mis, p->host + p->normal[i],
+                                  p->postcopy_buf + (size_t)i * p->page_size,
+                                  p->block);
+        if (ret) {
+            error_setg_errno(errp, -ret, "multifd %u: failed to place page",
+                             p->id);
+            return -1;
+        }
+    }
+    return 0;
 }
 
 /**
@@ -254,7 +353,7 @@ static void nocomp_recv_cleanup(MultiFDRecvParams *p)
  */
 static int nocomp_recv(MultiFDRecvParams *p, Error **errp)
 {
-    uint32_t flags;
+    uint32_t flags, num = 0;
 
     if (!multifd_use_packets()) {
         return multifd_file_recv_data(p, errp);
@@ -262,23 +361,37 @@ static int nocomp_recv(MultiFDRecvParams *p, Error **errp)
 
     flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
 
-    if (flags != MULTIFD_FLAG_NOCOMP) {
+    if (flags != MULTIFD_FLAG_NOCOMP && flags != MULTIFD_FLAG_XBZRLE) {
         error_setg(errp, "multifd %u: flags received %x flags expected %x",
                    p->id, flags, MULTIFD_FLAG_NOCOMP);
         return -1;
     }
 
+    if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+        return multifd_recv_postcopy_pages(p, errp);
+    }
+
     multifd_recv_zero_page_process(p);
 
+    if (flags == MULTIFD_FLAG_XBZRLE) {
+        return multifd_xbzrle_recv_pages(p, errp);
+    }
+
     if (!p->normal_num) {
         return 0;
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (p->uring) {
+        return multifd_uring_recv_pages(p, errp);
+    }
+#endif
+
     for (int i = 0; i < p->normal_num; i++) {
-        p->iov[i].iov_base = p->host + p->normal[i];
-        p->iov[i].iov_len = p->page_size;
+        num = multifd_iov_add(p->iov, 0, num, p->host + p->normal[i],
+                              p->page_size);
     }
-    return qio_channel_readv_all(p->c, p->iov, p->normal_num, errp);
+    return qio_channel_readv_all(p->c, p->iov, num, errp);
 }
 
 static MultiFDMethods multifd_nocomp_ops = {
@@ -431,28 +544,48 @@ void multifd_send_fill_packet(MultiFDSendParams *p)
                        p->flags, p->next_packet_size);
 }
 
-static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
+static int multifd_recv_unfill_packet_header(MultiFDRecvParams *p,
+                                             MultiFDPacketHdr_t *hdr,
+                                             Error **errp)
 {
-    MultiFDPacket_t *packet = p->packet;
-    int i;
+    uint32_t magic = be32_to_cpu(hdr->magic);
+    uint32_t version = be32_to_cpu(hdr->version);
 
-    packet->magic = be32_to_cpu(packet->magic);
-    if (packet->magic != MULTIFD_MAGIC) {
+    if (magic != MULTIFD_MAGIC) {
         error_setg(errp, "multifd: received packet "
                    "magic %x and expected magic %x",
-                   packet->magic, MULTIFD_MAGIC);
+                   magic, MULTIFD_MAGIC);
         return -1;
     }
 
-    packet->version = be32_to_cpu(packet->version);
-    if (packet->version != MULTIFD_VERSION) {
+    if (version != MULTIFD_VERSION) {
         error_setg(errp, "multifd: received packet "
                    "version %u and expected version %u",
-                   packet->version, MULTIFD_VERSION);
+                   version, MULTIFD_VERSION);
         return -1;
     }
 
-    p->flags = be32_to_cpu(packet->flags);
+    p->flags = be32_to_cpu(hdr->flags);
+
+    return 0;
+}
+
+static int multifd_recv_unfill_packet_device_state(MultiFDRecvParams *p,
+                                                   Error **errp)
+{
+    MultiFDPacketDeviceState_t *packet = p->packet_device_state;
+
+    packet->instance_id = be32_to_cpu(packet->instance_id);
+    p->next_packet_size = be32_to_cpu(packet->next_packet_size);
+    p->packets_recved++;
+
+    return 0;
+}
+
+static int multifd_recv_unfill_packet_ram(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPacket_t *packet = p->packet;
+    int i;
 
     packet->pages_alloc = be32_to_cpu(packet->pages_alloc);
     /*
@@ -505,6 +638,17 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     p->host = p->block->host;
+    if (migration_incoming_colo_enabled() &&
+        migration_incoming_in_colo_state()) {
+        if (!p->block->colo_cache) {
+            error_setg(errp, "multifd: colo_cache is NULL in block %s",
+                       p->block->idstr);
+            return -1;
+        }
+        /* In COLO stage, put all pages into cache temporarily */
+        p->host = p->block->colo_cache;
+    }
+
     for (i = 0; i < p->normal_num; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
 
@@ -529,9 +673,43 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->zero[i] = offset;
     }
 
+    /*
+     * During a COLO checkpoint, remember which pages were sent so that
+     * only those are flushed from the cache into the SVM's memory.
+     */
+    if (p->host == p->block->colo_cache) {
+        colo_record_bitmap(p->block, p->normal, p->normal_num);
+        colo_record_bitmap(p->block, p->zero, p->zero_num);
+    }
+
     return 0;
 }
 
+/*
+ * In migration stage but before COLO stage, pages land in the SVM's
+ * memory and must be copied into the COLO cache as well, like
+ * ram_load_precopy() does for the main channel.
+ */
+static void multifd_recv_colo_backup(MultiFDRecvParams *p)
+{
+    RAMBlock *block = p->block;
+    int i;
+
+    if (!migration_incoming_colo_enabled() ||
+        migration_incoming_in_colo_state() || !block->colo_cache) {
+        return;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        memcpy(block->colo_cache + p->normal[i], block->host + p->normal[i],
+               p->page_size);
+    }
+    for (i = 0; i < p->zero_num; i++) {
+        memcpy(block->colo_cache + p->zero[i], block->host + p->zero[i],
+               p->page_size);
+    }
+}
+
 static bool multifd_send_should_exit(void)
 {
     return qatomic_read(&multifd_send_state->exiting);
@@ -555,33 +733,19 @@ static void multifd_send_kick_main(MultiFDSendParams *p)
 }
 
 /*
- * How we use multifd_send_state->pages and channel->pages?
+ * Picks the next idle channel, waiting for one if needed.  Must be
+ * called with multifd_send_state->send_mutex held.
  *
- * We create a pages for each channel, and a main one.  Each time that
- * we need to send a batch of pages we interchange the ones between
- * multifd_send_state and the channel that is sending it.  There are
- * two reasons for that:
- *    - to not have to do so many mallocs during migration
- *    - to make easier to know what to free at the end of migration
- *
- * This way we always know who is the owner of each "pages" struct,
- * and we don't need any locking.  It belongs to the migration thread
- * or to the channel thread.  Switching is safe because the migration
- * thread is using the channel mutex when changing it, and the channel
- * have to had finish with its own, otherwise pending_job can't be
- * false.
- *
- * Returns true if succeed, false otherwise.
+ * Returns the channel, or NULL if multifd is exiting.
  */
-static bool multifd_send_pages(void)
+static MultiFDSendParams *multifd_send_pick_channel(void)
 {
-    int i;
     static int next_channel;
-    MultiFDSendParams *p = NULL; /* make happy gcc */
-    MultiFDPages_t *pages = multifd_send_state->pages;
+    MultiFDSendParams *p;
+    int i;
 
     if (multifd_send_should_exit()) {
-        return false;
+        return NULL;
     }
 
     /* We wait here, until at least one channel is ready */
@@ -595,7 +759,7 @@ static bool multifd_send_pages(void)
     next_channel %= migrate_multifd_channels();
     for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
         if (multifd_send_should_exit()) {
-            return false;
+            return NULL;
         }
         p = &multifd_send_state->params[i];
         /*
@@ -613,6 +777,41 @@ static bool multifd_send_pages(void)
      * qatomic_store_release() in multifd_send_thread().
      */
     smp_mb_acquire();
+
+    return p;
+}
+
+/*
+ * How we use multifd_send_state->pages and channel->pages?
+ *
+ * We create a pages for each channel, and a main one.  Each time that
+ * we need to send a batch of pages we interchange the ones between
+ * multifd_send_state and the channel that is sending it.  There are
+ * two reasons for that:
+ *    - to not have to do so many mallocs during migration
+ *    - to make easier to know what to free at the end of migration
+ *
+ * This way we always know who is the owner of each "pages" struct,
+ * and we don't need any locking.  It belongs to the migration thread
+ * or to the channel thread.  Switching is safe because the migration
+ * thread is using the channel mutex when changing it, and the channel
+ * have to had finish with its own, otherwise pending_job can't be
+ * false.
+ *
+ * Returns true if succeed, false otherwise.
+ */
+static bool multifd_send_pages(void)
+{
+    MultiFDSendParams *p;
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    QEMU_LOCK_GUARD(&multifd_send_state->send_mutex);
+
+    p = multifd_send_pick_channel();
+    if (!p) {
+        return false;
+    }
+
     assert(!p->pages->num);
     multifd_send_state->pages = p->pages;
     p->pages = pages;
@@ -626,6 +825,54 @@ static bool multifd_send_pages(void)
     return true;
 }
 
+bool multifd_device_state_supported(void)
+{
+    return migrate_multifd() && multifd_use_packets();
+}
+
+/*
+ * Queues a device state buffer to be sent over one of the multifd
+ * channels.  The data is copied, so the caller can reuse @data right
+ * away.  Can be called concurrently from multiple threads.
+ *
+ * On the destination the buffer is handed over to the load_state_buffer
+ * handler of the SaveStateEntry matching @idstr and @instance_id.
+ *
+ * Returns true if queuing was successful, false otherwise.
+ */
+bool multifd_queue_device_state(char *idstr, uint32_t instance_id,
+                                char *data, size_t len)
+{
+    MultiFDSendParams *p;
+    MultiFDDeviceState_t *device_state;
+
+    assert(multifd_device_state_supported());
+
+    QEMU_LOCK_GUARD(&multifd_send_state->send_mutex);
+
+    p = multifd_send_pick_channel();
+    if (!p) {
+        return false;
+    }
+
+    device_state = p->device_state;
+    assert(!device_state->buf);
+    device_state->idstr = g_strdup(idstr);
+    device_state->instance_id = instance_id;
+    device_state->buf = g_memdup2(data, len);
+    device_state->buf_len = len;
+
+    /*
+     * Making sure p->device_state is setup before marking
+     * pending_job=true. Pairs with the qatomic_load_acquire() in
+     * multifd_send_thread().
+     */
+    qatomic_store_release(&p->pending_job, true);
+    qemu_sem_post(&p->sem);
+
+    return true;
+}
+
 static inline bool multifd_queue_empty(MultiFDPages_t *pages)
 {
     return pages->num == 0;
@@ -676,6 +923,93 @@ retry:
     return true;
 }
 
+/*
+ * Hands the pages queued so far to a channel, without waiting for the
+ * queue to be full.
+ *
+ * Returns true if successful, false otherwise.
+ */
+bool multifd_queue_flush(void)
+{
+    if (multifd_queue_empty(multifd_send_state->pages)) {
+        return true;
+    }
+    return multifd_send_pages();
+}
+
+/*
+ * Hands the pages from @start up to @end of @block to a channel, which
+ * looks for the dirty ones and sends them by itself.  The range must
+ * not share a word of the dirty bitmap with any other range handed out
+ * before the next multifd_scan_wait().
+ *
+ * Returns true if successful, false otherwise.
+ */
+bool multifd_queue_scan(RAMBlock *block, unsigned long start,
+                        unsigned long end)
+{
+    MultiFDSendParams *p;
+
+    /* The queue must not hold pages that a scan could find again */
+    if (!multifd_queue_flush()) {
+        return false;
+    }
+
+    QEMU_LOCK_GUARD(&multifd_send_state->send_mutex);
+
+    p = multifd_send_pick_channel();
+    if (!p) {
+        return false;
+    }
+
+    assert(!p->scan.block);
+    p->scan.block = block;
+    p->scan.start = start;
+    p->scan.end = end;
+    /*
+     * Making sure p->scan is setup before marking pending_job=true. Pairs
+     * with the qatomic_load_acquire() in multifd_send_thread().
+     */
+    qatomic_store_release(&p->pending_job, true);
+    qemu_sem_post(&p->sem);
+
+    return true;
+}
+
+/*
+ * Waits for the channels to be done with the ranges handed to them.
+ *
+ * Returns the number of dirty pages they found and sent, -1 on error.
+ */
+int64_t multifd_scan_wait(void)
+{
+    int64_t pages = 0;
+    int i;
+
+    if (multifd_send_sync_main(MULTIFD_SYNC_LOCAL) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        pages += p->scan_pages;
+        p->scan_pages = 0;
+    }
+
+    return pages;
+}
+
+/*
+ * Flags all the packets sent from now on as postcopy ones, for the
+ * destination to place their pages through userfaultfd.  The channels
+ * must have been synced, so that none of the precopy pages is left.
+ */
+void multifd_send_postcopy_start(void)
+{
+    qatomic_set(&multifd_send_state->postcopy, true);
+}
+
 /* Multifd send side hit an error; remember it and prepare to quit */
 static void multifd_send_set_error(Error *err)
 {
@@ -779,9 +1113,17 @@ static bool multifd_send_cleanup_channel(MultiFDSendParams *p, Error **errp)
     p->name = NULL;
     multifd_pages_clear(p->pages);
     p->pages = NULL;
+    g_free(p->device_state);
+    p->device_state = NULL;
     p->packet_len = 0;
     g_free(p->packet);
     p->packet = NULL;
+    g_free(p->packet_device_state);
+    p->packet_device_state = NULL;
+    g_free(p->zero_bufs);
+    p->zero_bufs = NULL;
+    g_free(p->zero_bitmap);
+    p->zero_bitmap = NULL;
     g_free(p->iov);
     p->iov = NULL;
     multifd_send_state->ops->send_cleanup(p, errp);
@@ -795,6 +1137,7 @@ static void multifd_send_cleanup_state(void)
     socket_cleanup_outgoing_migration();
     qemu_sem_destroy(&multifd_send_state->channels_created);
     qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_mutex_destroy(&multifd_send_state->send_mutex);
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
     multifd_pages_clear(multifd_send_state->pages);
@@ -823,6 +1166,7 @@ void multifd_send_shutdown(void)
         }
     }
 
+    multifd_xbzrle_cleanup();
     multifd_send_cleanup_state();
 }
 
@@ -843,11 +1187,13 @@ static int multifd_zero_copy_flush(QIOChannel *c)
     return ret;
 }
 
-int multifd_send_sync_main(void)
+int multifd_send_sync_main(MultiFDSyncReq req)
 {
     int i;
     bool flush_zero_copy;
 
+    assert(req != MULTIFD_SYNC_NONE);
+
     if (!migrate_multifd()) {
         return 0;
     }
@@ -873,8 +1219,8 @@ int multifd_send_sync_main(void)
          * We should be the only user so far, so not possible to be set by
          * others concurrently.
          */
-        assert(qatomic_read(&p->pending_sync) == false);
-        qatomic_set(&p->pending_sync, true);
+        assert(qatomic_read(&p->pending_sync) == MULTIFD_SYNC_NONE);
+        qatomic_set(&p->pending_sync, req);
         qemu_sem_post(&p->sem);
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -897,6 +1243,114 @@ int multifd_send_sync_main(void)
     return 0;
 }
 
+static int multifd_send_device_state(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDDeviceState_t *device_state = p->device_state;
+    MultiFDPacketDeviceState_t *packet = p->packet_device_state;
+    struct iovec iov[2];
+    int ret;
+
+    packet->hdr.flags = cpu_to_be32(MULTIFD_FLAG_DEVICE_STATE);
+    memset(packet->idstr, 0, sizeof(packet->idstr));
+    pstrcpy(packet->idstr, sizeof(packet->idstr), device_state->idstr);
+    packet->instance_id = cpu_to_be32(device_state->instance_id);
+    packet->next_packet_size = cpu_to_be32(device_state->buf_len);
+
+    iov[0].iov_base = packet;
+    iov[0].iov_len = sizeof(*packet);
+    iov[1].iov_base = device_state->buf;
+    iov[1].iov_len = device_state->buf_len;
+
+    ret = qio_channel_writev_all(p->c, iov, ARRAY_SIZE(iov), errp);
+    if (ret == 0) {
+        stat64_add(&mig_stats.multifd_bytes,
+                   sizeof(*packet) + device_state->buf_len);
+        p->packets_sent++;
+        trace_multifd_send_device_state(p->id, device_state->idstr,
+                                        device_state->instance_id,
+                                        device_state->buf_len);
+    }
+
+    g_clear_pointer(&device_state->idstr, g_free);
+    g_clear_pointer(&device_state->buf, g_free);
+    device_state->buf_len = 0;
+
+    return ret;
+}
+
+/* Sends the pages of p->pages as one packet, then resets them */
+static int multifd_send_pages_packet(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    int ret;
+
+    p->iovs_num = 0;
+    p->flags = qatomic_read(&multifd_send_state->postcopy) ?
+               MULTIFD_FLAG_POSTCOPY : 0;
+    ret = multifd_send_state->ops->send_prepare(p, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (migrate_mapped_ram()) {
+        ret = file_write_ramblock_iov(p->c, p->iov, p->iovs_num,
+                                      pages->block, errp);
+    } else {
+        ret = qio_channel_writev_full_all(p->c, p->iov, p->iovs_num,
+                                          NULL, 0, p->write_flags, errp);
+    }
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    stat64_add(&mig_stats.multifd_bytes, p->next_packet_size + p->packet_len);
+    stat64_add(&mig_stats.normal_pages, pages->normal_num);
+    stat64_add(&mig_stats.zero_pages, pages->num - pages->normal_num);
+
+    multifd_pages_reset(pages);
+    p->next_packet_size = 0;
+
+    return 0;
+}
+
+/*
+ * Looks for the dirty pages of the range in p->scan, clearing them from
+ * the dirty bitmap, and sends them a packet at a time.
+ */
+static int multifd_send_scan(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDScan_t *scan = &p->scan;
+    MultiFDPages_t *pages = p->pages;
+    unsigned long page = scan->start;
+    uint64_t found = 0;
+    int ret = 0;
+
+    assert(!pages->num);
+
+    while (page < scan->end) {
+        pages->num = ram_multifd_scan_range(scan->block, &page, scan->end,
+                                            pages->offset, pages->allocated);
+        if (!pages->num) {
+            break;
+        }
+        pages->block = scan->block;
+        found += pages->num;
+
+        ret = multifd_send_pages_packet(p, errp);
+        if (ret != 0) {
+            break;
+        }
+    }
+
+    trace_multifd_send_scan(p->id, scan->block->idstr, scan->start,
+                            scan->end, found);
+    p->scan_pages += found;
+    scan->block = NULL;
+
+    return ret;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -929,37 +1383,37 @@ static void *multifd_send_thread(void *opaque)
          * Read pending_job flag before p->pages.  Pairs with the
          * qatomic_store_release() in multifd_send_pages().
          */
-        if (qatomic_load_acquire(&p->pending_job)) {
-            MultiFDPages_t *pages = p->pages;
-
-            p->iovs_num = 0;
-            assert(pages->num);
-
-            ret = multifd_send_state->ops->send_prepare(p, &local_err);
+        if (qatomic_load_acquire(&p->pending_job) && p->device_state->buf) {
+            ret = multifd_send_device_state(p, &local_err);
             if (ret != 0) {
                 break;
             }
 
-            if (migrate_mapped_ram()) {
-                ret = file_write_ramblock_iov(p->c, p->iov, p->iovs_num,
-                                              p->pages->block, &local_err);
-            } else {
-                ret = qio_channel_writev_full_all(p->c, p->iov, p->iovs_num,
-                                                  NULL, 0, p->write_flags,
-                                                  &local_err);
-            }
-
+            /*
+             * Making sure p->device_state is released before saying
+             * "we're free".  Pairs with the smp_mb_acquire() in
+             * multifd_send_pick_channel().
+             */
+            qatomic_store_release(&p->pending_job, false);
+        } else if (qatomic_load_acquire(&p->pending_job) && p->scan.block) {
+            ret = multifd_send_scan(p, &local_err);
             if (ret != 0) {
                 break;
             }
 
-            stat64_add(&mig_stats.multifd_bytes,
-                       p->next_packet_size + p->packet_len);
-            stat64_add(&mig_stats.normal_pages, pages->normal_num);
-            stat64_add(&mig_stats.zero_pages, pages->num - pages->normal_num);
+            /*
+             * Making sure p->scan is released before saying "we're
+             * free".  Pairs with the smp_mb_acquire() in
+             * multifd_send_pick_channel().
+             */
+            qatomic_store_release(&p->pending_job, false);
+        } else if (qatomic_load_acquire(&p->pending_job)) {
+            assert(p->pages->num);
 
-            multifd_pages_reset(p->pages);
-            p->next_packet_size = 0;
+            ret = multifd_send_pages_packet(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
 
             /*
              * Making sure p->pages is published before saying "we're
@@ -973,9 +1427,11 @@ static void *multifd_send_thread(void *opaque)
              * pending_sync is a standalone flag (unlike pending_job), so
              * it doesn't require explicit memory barriers.
              */
-            assert(qatomic_read(&p->pending_sync));
+            int req = qatomic_read(&p->pending_sync);
+
+            assert(req != MULTIFD_SYNC_NONE);
 
-            if (use_packets) {
+            if (use_packets && req == MULTIFD_SYNC_ALL) {
                 p->flags = MULTIFD_FLAG_SYNC;
                 multifd_send_fill_packet(p);
                 ret = qio_channel_write_all(p->c, (void *)p->packet,
@@ -988,7 +1444,7 @@ static void *multifd_send_thread(void *opaque)
                 p->flags = 0;
             }
 
-            qatomic_set(&p->pending_sync, false);
+            qatomic_set(&p->pending_sync, MULTIFD_SYNC_NONE);
             qemu_sem_post(&p->sem_sync);
         }
     }
@@ -1135,6 +1591,9 @@ out:
 static bool multifd_new_send_channel_create(gpointer opaque, Error **errp)
 {
     if (!multifd_use_packets()) {
+        if (savevm_snapshot_in_progress()) {
+            return savevm_send_channel_create(opaque, errp);
+        }
         return file_send_channel_create(opaque, errp);
     }
 
@@ -1161,6 +1620,7 @@ bool multifd_send_setup(void)
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->channels_created, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_mutex_init(&multifd_send_state->send_mutex);
     qatomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
 
@@ -1171,6 +1631,9 @@ bool multifd_send_setup(void)
         qemu_sem_init(&p->sem_sync, 0);
         p->id = i;
         p->pages = multifd_pages_init(page_count);
+        p->device_state = g_new0(MultiFDDeviceState_t, 1);
+        p->zero_bufs = g_new0(const void *, page_count);
+        p->zero_bitmap = bitmap_new(page_count);
 
         if (use_packets) {
             p->packet_len = sizeof(MultiFDPacket_t)
@@ -1178,9 +1641,15 @@ bool multifd_send_setup(void)
             p->packet = g_malloc0(p->packet_len);
             p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
             p->packet->version = cpu_to_be32(MULTIFD_VERSION);
+            p->packet_device_state = g_new0(MultiFDPacketDeviceState_t, 1);
+            p->packet_device_state->hdr.magic = cpu_to_be32(MULTIFD_MAGIC);
+            p->packet_device_state->hdr.version = cpu_to_be32(MULTIFD_VERSION);
 
-            /* We need one extra place for the packet header */
-            p->iov = g_new0(struct iovec, page_count + 1);
+            /*
+             * We need one extra place for the packet header, and one for
+             * the page lengths of methods that compress pages one by one
+             */
+            p->iov = g_new0(struct iovec, page_count + 2);
         } else {
             p->iov = g_new0(struct iovec, page_count);
         }
@@ -1212,6 +1681,10 @@ bool multifd_send_setup(void)
         }
     }
 
+    if (!ret && migrate_xbzrle()) {
+        ret = multifd_xbzrle_setup(&local_err);
+    }
+
     if (ret) {
         migrate_set_error(s, local_err);
         error_report_err(local_err);
@@ -1294,6 +1767,9 @@ static void multifd_recv_terminate_threads(Error *err)
         }
     }
 
+    /* Release the channels waiting to place postcopy pages */
+    qemu_event_set(&migration_incoming_get_current()->postcopy_listen_event);
+
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
@@ -1352,6 +1828,10 @@ static void multifd_recv_cleanup_channel(MultiFDRecvParams *p)
     p->packet_len = 0;
     g_free(p->packet);
     p->packet = NULL;
+    g_free(p->postcopy_buf);
+    p->postcopy_buf = NULL;
+    g_free(p->packet_device_state);
+    p->packet_device_state = NULL;
     g_free(p->iov);
     p->iov = NULL;
     g_free(p->normal);
@@ -1376,7 +1856,8 @@ void multifd_recv_cleanup(void)
 {
     int i;
 
-    if (!migrate_multifd()) {
+    /* Not set up when loading a snapshot */
+    if (!migrate_multifd() || !multifd_recv_state) {
         return;
     }
     multifd_recv_terminate_threads(NULL);
@@ -1399,7 +1880,7 @@ void multifd_recv_sync_main(void)
     bool file_based = !multifd_use_packets();
     int i;
 
-    if (!migrate_multifd()) {
+    if (!migrate_multifd() || !multifd_recv_state) {
         return;
     }
 
@@ -1455,6 +1936,30 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+static int multifd_device_state_recv(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPacketDeviceState_t *packet = p->packet_device_state;
+    g_autofree char *dev_state_buf = NULL;
+    int ret;
+
+    dev_state_buf = g_malloc(p->next_packet_size);
+
+    ret = qio_channel_read_all(p->c, dev_state_buf, p->next_packet_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    /* make sure that idstr is 0 terminated */
+    packet->idstr[sizeof(packet->idstr) - 1] = 0;
+
+    trace_multifd_recv_device_state(p->id, packet->idstr,
+                                    packet->instance_id, p->next_packet_size);
+
+    return qemu_loadvm_load_state_buffer(packet->idstr, packet->instance_id,
+                                         dev_state_buf, p->next_packet_size,
+                                         errp);
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1465,24 +1970,62 @@ static void *multifd_recv_thread(void *opaque)
     trace_multifd_recv_thread_start(p->id);
     rcu_register_thread();
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* The ring is only ever used from this thread */
+    if (use_packets) {
+        multifd_uring_recv_setup(p);
+    }
+#endif
+
     while (true) {
         uint32_t flags = 0;
         bool has_data = false;
+        bool is_device_state = false;
         p->normal_num = 0;
 
         if (use_packets) {
+            MultiFDPacketHdr_t hdr;
+            void *pkt_buf;
+            size_t pkt_len;
+
             if (multifd_recv_should_exit()) {
                 break;
             }
 
-            ret = qio_channel_read_all_eof(p->c, (void *)p->packet,
-                                           p->packet_len, &local_err);
+            ret = qio_channel_read_all_eof(p->c, (void *)&hdr,
+                                           sizeof(hdr), &local_err);
             if (ret == 0 || ret == -1) {   /* 0: EOF  -1: Error */
                 break;
             }
 
             qemu_mutex_lock(&p->mutex);
-            ret = multifd_recv_unfill_packet(p, &local_err);
+            ret = multifd_recv_unfill_packet_header(p, &hdr, &local_err);
+            is_device_state = p->flags & MULTIFD_FLAG_DEVICE_STATE;
+            qemu_mutex_unlock(&p->mutex);
+            if (ret) {
+                break;
+            }
+
+            /* The header was already read, fetch the rest of the packet */
+            if (is_device_state) {
+                pkt_buf = (char *)p->packet_device_state + sizeof(hdr);
+                pkt_len = sizeof(*p->packet_device_state) - sizeof(hdr);
+            } else {
+                pkt_buf = (char *)p->packet + sizeof(hdr);
+                pkt_len = p->packet_len - sizeof(hdr);
+            }
+
+            ret = qio_channel_read_all(p->c, pkt_buf, pkt_len, &local_err);
+            if (ret != 0) {
+                break;
+            }
+
+            qemu_mutex_lock(&p->mutex);
+            if (is_device_state) {
+                ret = multifd_recv_unfill_packet_device_state(p, &local_err);
+            } else {
+                ret = multifd_recv_unfill_packet_ram(p, &local_err);
+            }
             if (ret) {
                 qemu_mutex_unlock(&p->mutex);
                 break;
@@ -1491,7 +2034,7 @@ static void *multifd_recv_thread(void *opaque)
             flags = p->flags;
             /* recv methods don't know how to handle the SYNC flag */
             p->flags &= ~MULTIFD_FLAG_SYNC;
-            has_data = p->normal_num || p->zero_num;
+            has_data = is_device_state || p->normal_num || p->zero_num;
             qemu_mutex_unlock(&p->mutex);
         } else {
             /*
@@ -1520,7 +2063,15 @@ static void *multifd_recv_thread(void *opaque)
         }
 
         if (has_data) {
-            ret = multifd_recv_state->ops->recv(p, &local_err);
+            if (is_device_state) {
+                assert(use_packets);
+                ret = multifd_device_state_recv(p, &local_err);
+            } else {
+                ret = multifd_recv_state->ops->recv(p, &local_err);
+                if (ret == 0 && use_packets) {
+                    multifd_recv_colo_backup(p);
+                }
+            }
             if (ret != 0) {
                 break;
             }
@@ -1548,6 +2099,9 @@ static void *multifd_recv_thread(void *opaque)
         error_free(local_err);
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    multifd_uring_recv_cleanup(p);
+#endif
     rcu_unregister_thread();
     trace_multifd_recv_thread_end(p->id, p->packets_recved,
                                   p->total_normal_pages,
@@ -1599,6 +2153,7 @@ int multifd_recv_setup(Error **errp)
             p->packet_len = sizeof(MultiFDPacket_t)
                 + sizeof(uint64_t) * page_count;
             p->packet = g_malloc0(p->packet_len);
+            p->packet_device_state = g_new0(MultiFDPacketDeviceState_t, 1);
         }
         p->name = g_strdup_printf("multifdrecv_%d", i);
         p->iov = g_new0(struct iovec, page_count);
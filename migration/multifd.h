@@ -17,6 +17,15 @@
 
 typedef struct MultiFDRecvData MultiFDRecvData;
 
+typedef enum {
+    /* No sync request */
+    MULTIFD_SYNC_NONE = 0,
+    /* Sync locally on the sender side only, no SYNC packet is sent */
+    MULTIFD_SYNC_LOCAL,
+    /* Sync on both sides by sending a SYNC packet on every channel */
+    MULTIFD_SYNC_ALL,
+} MultiFDSyncReq;
+
 bool multifd_send_setup(void);
 void multifd_send_shutdown(void);
 void multifd_send_channel_created(void);
@@ -26,8 +35,13 @@ void multifd_recv_shutdown(void);
 bool multifd_recv_all_channels_created(void);
 void multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
-int multifd_send_sync_main(void);
+int multifd_send_sync_main(MultiFDSyncReq req);
 bool multifd_queue_page(RAMBlock *block, ram_addr_t offset);
+bool multifd_queue_flush(void);
+bool multifd_queue_scan(RAMBlock *block, unsigned long start,
+                        unsigned long end);
+int64_t multifd_scan_wait(void);
+void multifd_send_postcopy_start(void);
 bool multifd_recv(void);
 MultiFDRecvData *multifd_get_recv_data(void);
 
@@ -40,10 +54,26 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_QPL (4 << 1)
+/* Pages encoded with XBZRLE, on top of no compression */
+#define MULTIFD_FLAG_XBZRLE (3 << 1)
+
+/* This packet carries device state instead of RAM pages */
+#define MULTIFD_FLAG_DEVICE_STATE (1 << 4)
+
+/* The pages of this packet were sent during postcopy */
+#define MULTIFD_FLAG_POSTCOPY (1 << 5)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
+/* Common header of all the packet types, it must match their first fields */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+} __attribute__((packed)) MultiFDPacketHdr_t;
+
 typedef struct {
     uint32_t magic;
     uint32_t version;
@@ -68,6 +98,14 @@ typedef struct {
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
 
+typedef struct {
+    MultiFDPacketHdr_t hdr;
+    char idstr[256];
+    uint32_t instance_id;
+    /* size of the data that follows this header */
+    uint32_t next_packet_size;
+} __attribute__((packed)) MultiFDPacketDeviceState_t;
+
 typedef struct {
     /* number of used pages */
     uint32_t num;
@@ -80,6 +118,22 @@ typedef struct {
     RAMBlock *block;
 } MultiFDPages_t;
 
+typedef struct {
+    char *idstr;
+    uint32_t instance_id;
+    char *buf;
+    size_t buf_len;
+} MultiFDDeviceState_t;
+
+typedef struct {
+    /* RAMBlock to scan, NULL when there is no range to scan */
+    RAMBlock *block;
+    /* first page of the range */
+    unsigned long start;
+    /* page the range ends before */
+    unsigned long end;
+} MultiFDScan_t;
+
 struct MultiFDRecvData {
     void *opaque;
     size_t size;
@@ -122,24 +176,39 @@ typedef struct {
      * The sender thread has work to do if either of below boolean is set.
      *
      * @pending_job:  a job is pending
-     * @pending_sync: a sync request is pending
+     * @pending_sync: a sync request (MultiFDSyncReq) is pending
      *
      * For both of these fields, they're only set by the requesters, and
      * cleared by the multifd sender threads.
      */
     bool pending_job;
-    bool pending_sync;
+    int pending_sync;
     /* array of pages to sent.
      * The owner of 'pages' depends of 'pending_job' value:
      * pending_job == 0 -> migration_thread can use it.
      * pending_job != 0 -> multifd_channel can use it.
      */
     MultiFDPages_t *pages;
+    /*
+     * Device state to send, instead of pages, when device_state->buf is
+     * set.  Ownership follows the same rules as 'pages' above.
+     */
+    MultiFDDeviceState_t *device_state;
+    /*
+     * Range of the dirty bitmap to scan and send the dirty pages of,
+     * instead of pages, when scan.block is set.  Ownership follows the
+     * same rules as 'pages' above.
+     */
+    MultiFDScan_t scan;
+    /* dirty pages sent by the scans since the last multifd_scan_wait() */
+    uint64_t scan_pages;
 
     /* thread local variables. No locking required */
 
     /* pointer to the packet */
     MultiFDPacket_t *packet;
+    /* pointer to the device state packet */
+    MultiFDPacketDeviceState_t *packet_device_state;
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     /* packets sent through this channel */
@@ -148,6 +217,10 @@ typedef struct {
     uint64_t total_normal_pages;
     /* zero pages sent through this channel */
     uint64_t total_zero_pages;
+    /* host address of each page, for zero page detection */
+    const void **zero_bufs;
+    /* zero pages found by zero page detection */
+    unsigned long *zero_bitmap;
     /* buffers to send */
     struct iovec *iov;
     /* number of iovs used */
@@ -156,6 +229,8 @@ typedef struct {
     void *compress_data;
 }  MultiFDSendParams;
 
+typedef struct MultiFDURing MultiFDURing;
+
 typedef struct {
     /* Fields are only written at creating/deletion time */
     /* No lock required for them, they are read only */
@@ -196,6 +271,8 @@ typedef struct {
 
     /* pointer to the packet */
     MultiFDPacket_t *packet;
+    /* pointer to the device state packet */
+    MultiFDPacketDeviceState_t *packet_device_state;
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     /* packets received through this channel */
@@ -220,6 +297,10 @@ typedef struct {
     uint32_t zero_num;
     /* used for de-compression methods */
     void *compress_data;
+    /* io_uring receive engine, if in use */
+    MultiFDURing *uring;
+    /* buffer the pages of postcopy packets are placed from */
+    uint8_t *postcopy_buf;
 } MultiFDRecvParams;
 
 typedef struct {
@@ -243,6 +324,22 @@ bool multifd_send_prepare_common(MultiFDSendParams *p);
 void multifd_send_zero_page_detect(MultiFDSendParams *p);
 void multifd_recv_zero_page_process(MultiFDRecvParams *p);
 
+int multifd_xbzrle_setup(Error **errp);
+void multifd_xbzrle_cleanup(void);
+void multifd_xbzrle_start(void);
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr);
+int multifd_xbzrle_send_setup(MultiFDSendParams *p, Error **errp);
+void multifd_xbzrle_send_cleanup(MultiFDSendParams *p);
+bool multifd_xbzrle_send_prepare(MultiFDSendParams *p);
+int multifd_xbzrle_recv_pages(MultiFDRecvParams *p, Error **errp);
+void multifd_xbzrle_recv_cleanup(MultiFDRecvParams *p);
+
+#ifdef CONFIG_LINUX_IO_URING
+void multifd_uring_recv_setup(MultiFDRecvParams *p);
+void multifd_uring_recv_cleanup(MultiFDRecvParams *p);
+int multifd_uring_recv_pages(MultiFDRecvParams *p, Error **errp);
+#endif
+
 static inline void multifd_send_prepare_header(MultiFDSendParams *p)
 {
     p->iov[0].iov_len = p->packet_len;
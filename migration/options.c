@@ -100,6 +100,26 @@ Property migration_properties[] = {
                       clear_bitmap_shift, CLEAR_BITMAP_SHIFT_DEFAULT),
     DEFINE_PROP_BOOL("x-preempt-pre-7-2", MigrationState,
                      preempt_pre_7_2, false),
+    DEFINE_PROP_BOOL("x-multifd-recv-io-uring", MigrationState,
+                     multifd_recv_io_uring, false),
+    DEFINE_PROP_BOOL("x-multifd-recv-io-uring-fixed", MigrationState,
+                     multifd_recv_io_uring_fixed, false),
+    DEFINE_PROP_UINT8("x-dirty-sync-threads", MigrationState,
+                      dirty_sync_threads, 0),
+    DEFINE_PROP_BOOL("x-multifd-channel-scan", MigrationState,
+                     multifd_channel_scan, false),
+    DEFINE_PROP_BOOL("x-dirty-limit-adaptive", MigrationState,
+                     dirty_limit_adaptive, false),
+    DEFINE_PROP_UINT8("x-zero-scan-threads", MigrationState,
+                      zero_scan_threads, 0),
+    DEFINE_PROP_BOOL("x-mapped-ram-direct-io", MigrationState,
+                     mapped_ram_direct_io, false),
+    DEFINE_PROP_BOOL("x-mapped-ram-lazy-load", MigrationState,
+                     mapped_ram_lazy_load, false),
+    DEFINE_PROP_BOOL("x-switchover-device-time", MigrationState,
+                     switchover_device_time, false),
+    DEFINE_PROP_UINT8("x-device-save-threads", MigrationState,
+                      device_save_threads, 0),
 
     /* Migration parameters */
     DEFINE_PROP_UINT8("x-compress-level", MigrationState,
@@ -208,6 +228,8 @@ Property migration_properties[] = {
                         MIGRATION_CAPABILITY_SWITCHOVER_ACK),
     DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
     DEFINE_PROP_MIG_CAP("mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-clone-template",
+                        MIGRATION_CAPABILITY_X_CLONE_TEMPLATE),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -232,6 +254,13 @@ bool migrate_block(void)
     return s->capabilities[MIGRATION_CAPABILITY_BLOCK];
 }
 
+bool migrate_clone_template(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_X_CLONE_TEMPLATE];
+}
+
 bool migrate_colo(void)
 {
     MigrationState *s = migrate_get_current();
@@ -381,6 +410,62 @@ bool migrate_zero_copy_send(void)
 
 /* pseudo capabilities */
 
+bool migrate_dirty_limit_adaptive(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->dirty_limit_adaptive;
+}
+
+uint8_t migrate_dirty_sync_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->dirty_sync_threads;
+}
+
+bool migrate_multifd_channel_scan(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->multifd_channel_scan;
+}
+
+uint8_t migrate_zero_scan_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->zero_scan_threads;
+}
+
+bool migrate_mapped_ram_direct_io(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->mapped_ram_direct_io;
+}
+
+bool migrate_mapped_ram_lazy_load(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->mapped_ram_lazy_load;
+}
+
+bool migrate_switchover_device_time(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->switchover_device_time;
+}
+
+uint8_t migrate_device_save_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->device_save_threads;
+}
+
 bool migrate_multifd_flush_after_each_section(void)
 {
     MigrationState *s = migrate_get_current();
@@ -388,6 +473,20 @@ bool migrate_multifd_flush_after_each_section(void)
     return s->multifd_flush_after_each_section;
 }
 
+bool migrate_multifd_recv_io_uring(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->multifd_recv_io_uring;
+}
+
+bool migrate_multifd_recv_io_uring_fixed(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->multifd_recv_io_uring_fixed;
+}
+
 bool migrate_postcopy(void)
 {
     return migrate_postcopy_ram() || migrate_dirty_bitmaps();
@@ -527,11 +626,6 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
             error_setg(errp, "Postcopy is not compatible with ignore-shared");
             return false;
         }
-
-        if (new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
-            error_setg(errp, "Postcopy is not yet compatible with multifd");
-            return false;
-        }
     }
 
     if (new_caps[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
@@ -569,13 +663,24 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
 
 #ifdef CONFIG_LINUX
     if (new_caps[MIGRATION_CAPABILITY_ZERO_COPY_SEND] &&
-        (!new_caps[MIGRATION_CAPABILITY_MULTIFD] ||
-         new_caps[MIGRATION_CAPABILITY_COMPRESS] ||
+        (new_caps[MIGRATION_CAPABILITY_COMPRESS] ||
          new_caps[MIGRATION_CAPABILITY_XBZRLE] ||
          migrate_multifd_compression() ||
          migrate_tls())) {
         error_setg(errp,
-                   "Zero copy only available for non-compressed non-TLS multifd migration");
+                   "Zero copy only available for non-compressed non-TLS migration");
+        return false;
+    }
+
+    /*
+     * Without multifd, pages are sent without copy on the main channel,
+     * and COLO resumes the VM while those of a checkpoint may be in flight.
+     */
+    if (new_caps[MIGRATION_CAPABILITY_ZERO_COPY_SEND] &&
+        !new_caps[MIGRATION_CAPABILITY_MULTIFD] &&
+        new_caps[MIGRATION_CAPABILITY_X_COLO]) {
+        error_setg(errp,
+                   "Zero copy without multifd is not compatible with COLO");
         return false;
     }
 #else
@@ -643,8 +748,10 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
     }
 
     if (new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
-        if (new_caps[MIGRATION_CAPABILITY_XBZRLE]) {
-            error_setg(errp, "Multifd is not compatible with xbzrle");
+        if (new_caps[MIGRATION_CAPABILITY_XBZRLE] &&
+            migrate_multifd_compression()) {
+            error_setg(errp,
+                       "Multifd compression is not compatible with xbzrle");
             return false;
         }
     }
@@ -676,6 +783,25 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_X_CLONE_TEMPLATE]) {
+        if (!new_caps[MIGRATION_CAPABILITY_X_IGNORE_SHARED]) {
+            error_setg(errp, "Capability 'x-clone-template' requires "
+                       "capability 'x-ignore-shared'");
+            return false;
+        }
+
+        /*
+         * On the source, privately mapped RAM differs from its file and
+         * must be migrated.
+         */
+        if (!old_caps[MIGRATION_CAPABILITY_X_CLONE_TEMPLATE] &&
+            !runstate_check(RUN_STATE_INMIGRATE)) {
+            error_setg(errp, "Capability 'x-clone-template' can only be "
+                       "enabled on the destination");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -756,6 +882,13 @@ const BitmapMigrationNodeAliasList *migrate_block_bitmap_mapping(void)
     return s->parameters.block_bitmap_mapping;
 }
 
+const strList *migrate_cpr_exec_command(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.cpr_exec_command;
+}
+
 bool migrate_has_block_bitmap_mapping(void)
 {
     MigrationState *s = migrate_get_current();
@@ -1061,6 +1194,12 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->has_zero_page_detection = true;
     params->zero_page_detection = s->parameters.zero_page_detection;
 
+    if (s->parameters.has_cpr_exec_command) {
+        params->has_cpr_exec_command = true;
+        params->cpr_exec_command = QAPI_CLONE(strList,
+                                              s->parameters.cpr_exec_command);
+    }
+
     return params;
 }
 
@@ -1263,11 +1402,18 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
         ((params->has_multifd_compression && params->multifd_compression) ||
          (params->tls_creds && *params->tls_creds))) {
         error_setg(errp,
-                   "Zero copy only available for non-compressed non-TLS multifd migration");
+                   "Zero copy only available for non-compressed non-TLS migration");
         return false;
     }
 #endif
 
+    if (migrate_multifd() && migrate_xbzrle() &&
+        params->has_multifd_compression && params->multifd_compression) {
+        error_setg(errp,
+                   "Multifd compression is not compatible with xbzrle");
+        return false;
+    }
+
     if (migrate_mapped_ram() &&
         (migrate_multifd_compression() || migrate_tls())) {
         error_setg(errp,
@@ -1417,6 +1563,11 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_zero_page_detection) {
         dest->zero_page_detection = params->zero_page_detection;
     }
+
+    if (params->has_cpr_exec_command) {
+        dest->has_cpr_exec_command = true;
+        dest->cpr_exec_command = params->cpr_exec_command;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -1571,6 +1722,13 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_zero_page_detection) {
         s->parameters.zero_page_detection = params->zero_page_detection;
     }
+
+    if (params->has_cpr_exec_command) {
+        qapi_free_strList(s->parameters.cpr_exec_command);
+        s->parameters.has_cpr_exec_command = true;
+        s->parameters.cpr_exec_command = QAPI_CLONE(strList,
+                                                    params->cpr_exec_command);
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -26,6 +26,7 @@ extern Property migration_properties[];
 
 bool migrate_auto_converge(void);
 bool migrate_block(void);
+bool migrate_clone_template(void);
 bool migrate_colo(void);
 bool migrate_compress(void);
 bool migrate_dirty_bitmaps(void);
@@ -52,7 +53,17 @@ bool migrate_zero_copy_send(void);
  * check, but they are not a capability.
  */
 
+bool migrate_dirty_limit_adaptive(void);
+uint8_t migrate_dirty_sync_threads(void);
+bool migrate_multifd_channel_scan(void);
+bool migrate_mapped_ram_direct_io(void);
+bool migrate_mapped_ram_lazy_load(void);
+bool migrate_switchover_device_time(void);
+uint8_t migrate_device_save_threads(void);
 bool migrate_multifd_flush_after_each_section(void);
+uint8_t migrate_zero_scan_threads(void);
+bool migrate_multifd_recv_io_uring(void);
+bool migrate_multifd_recv_io_uring_fixed(void);
 bool migrate_postcopy(void);
 bool migrate_rdma(void);
 bool migrate_tls(void);
@@ -66,6 +77,7 @@ bool migrate_cap_set(int cap, bool value, Error **errp);
 
 const BitmapMigrationNodeAliasList *migrate_block_bitmap_mapping(void);
 bool migrate_has_block_bitmap_mapping(void);
+const strList *migrate_cpr_exec_command(void);
 
 bool migrate_block_incremental(void);
 uint32_t migrate_checkpoint_delay(void);
@@ -24,6 +24,7 @@
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "ram.h"
+#include "multifd.h"
 #include "qapi/error.h"
 #include "qemu/notify.h"
 #include "qemu/rcu.h"
@@ -698,6 +699,12 @@ static int nhp_range(RAMBlock *rb, void *opaque)
  */
 int postcopy_ram_prepare_discard(MigrationIncomingState *mis)
 {
+    /*
+     * The multifd channels write precopy pages in place: let them drain
+     * before the pages dirtied since then are discarded.
+     */
+    multifd_recv_sync_main();
+
     if (foreach_not_ignored_block(nhp_range, mis)) {
         return -1;
     }
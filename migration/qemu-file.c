@@ -26,6 +26,7 @@
 #include "qemu/madvise.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
+#include "qemu/units.h"
 #include "migration.h"
 #include "migration-stats.h"
 #include "qemu-file.h"
@@ -35,18 +36,27 @@
 #include "rdma.h"
 #include "io/channel-file.h"
 
-#define IO_BUF_SIZE 32768
-#define MAX_IOV_SIZE MIN_CONST(IOV_MAX, 64)
+/*
+ * Large enough that device state and streams of page headers and pages
+ * go out in few system calls.
+ */
+#define IO_BUF_SIZE (128 * KiB)
+#define MAX_IOV_SIZE MIN_CONST(IOV_MAX, 256)
 
 struct QEMUFile {
     QIOChannel *ioc;
     bool is_writable;
+    /* Guest pages put with qemu_put_buffer_async() are sent without copy */
+    bool zero_copy_send;
+    /* Zero-copy writes were made since the last qemu_file_flush_zero_copy() */
+    bool zero_copy_pending;
 
     int buf_index;
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
     DECLARE_BITMAP(may_free, MAX_IOV_SIZE);
+    DECLARE_BITMAP(zero_copy, MAX_IOV_SIZE);
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
 
@@ -110,6 +120,8 @@ static QEMUFile *qemu_file_new_impl(QIOChannel *ioc, bool is_writable)
     object_ref(ioc);
     f->ioc = ioc;
     f->is_writable = is_writable;
+    f->zero_copy_send = is_writable && migrate_zero_copy_send() &&
+        qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
 
     return f;
 }
@@ -264,6 +276,37 @@ bool qemu_file_is_seekable(QEMUFile *f)
     return qio_channel_has_feature(f->ioc, QIO_CHANNEL_FEATURE_SEEKABLE);
 }
 
+/*
+ * Writes the iovecs, each run of iovecs to be sent without copy with a
+ * single zero-copy write, and the others with plain writes in between.
+ */
+static int qemu_file_writev(QEMUFile *f, Error **errp)
+{
+    unsigned int start = 0, end;
+
+    while (start < f->iovcnt) {
+        bool zero_copy = test_bit(start, f->zero_copy);
+
+        if (zero_copy) {
+            end = find_next_zero_bit(f->zero_copy, f->iovcnt, start + 1);
+            f->zero_copy_pending = true;
+        } else {
+            end = find_next_bit(f->zero_copy, f->iovcnt, start + 1);
+        }
+
+        if (qio_channel_writev_full_all(f->ioc, &f->iov[start], end - start,
+                                        NULL, 0,
+                                        zero_copy ?
+                                        QIO_CHANNEL_WRITE_FLAG_ZERO_COPY : 0,
+                                        errp) < 0) {
+            return -1;
+        }
+        start = end;
+    }
+
+    return 0;
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -281,9 +324,7 @@ int qemu_fflush(QEMUFile *f)
     }
     if (f->iovcnt > 0) {
         Error *local_error = NULL;
-        if (qio_channel_writev_all(f->ioc,
-                                   f->iov, f->iovcnt,
-                                   &local_error) < 0) {
+        if (qemu_file_writev(f, &local_error) < 0) {
             qemu_file_set_error_obj(f, -EIO, local_error);
         } else {
             uint64_t size = iov_size(f->iov, f->iovcnt);
@@ -291,6 +332,7 @@ int qemu_fflush(QEMUFile *f)
         }
 
         qemu_iovec_release_ram(f);
+        bitmap_zero(f->zero_copy, MAX_IOV_SIZE);
     }
 
     f->buf_index = 0;
@@ -298,6 +340,28 @@ int qemu_fflush(QEMUFile *f)
     return f->last_error;
 }
 
+int qemu_file_flush_zero_copy(QEMUFile *f)
+{
+    Error *local_error = NULL;
+    int ret;
+
+    if (qemu_fflush(f) < 0 || !f->zero_copy_pending) {
+        return f->last_error;
+    }
+
+    f->zero_copy_pending = false;
+    ret = qio_channel_flush(f->ioc, &local_error);
+    if (ret < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+        return f->last_error;
+    }
+    if (ret == 1) {
+        stat64_add(&mig_stats.dirty_sync_missed_zero_copy, 1);
+    }
+
+    return 0;
+}
+
 /*
  * Attempt to fill the buffer from the underlying file
  * Returns the number of bytes read, or negative value for an error.
@@ -362,7 +426,7 @@ static ssize_t coroutine_mixed_fn qemu_fill_buffer(QEMUFile *f)
  */
 int qemu_fclose(QEMUFile *f)
 {
-    int ret = qemu_fflush(f);
+    int ret = qemu_file_flush_zero_copy(f);
     int ret2 = qio_channel_close(f->ioc, NULL);
     if (ret >= 0) {
         ret = ret2;
@@ -383,12 +447,13 @@ int qemu_fclose(QEMUFile *f)
  *
  */
 static int add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size,
-                        bool may_free)
+                        bool may_free, bool zero_copy)
 {
     /* check for adjacent buffer and coalesce them */
     if (f->iovcnt > 0 && buf == f->iov[f->iovcnt - 1].iov_base +
         f->iov[f->iovcnt - 1].iov_len &&
-        may_free == test_bit(f->iovcnt - 1, f->may_free))
+        may_free == test_bit(f->iovcnt - 1, f->may_free) &&
+        zero_copy == test_bit(f->iovcnt - 1, f->zero_copy))
     {
         f->iov[f->iovcnt - 1].iov_len += size;
     } else {
@@ -400,6 +465,9 @@ static int add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size,
         if (may_free) {
             set_bit(f->iovcnt, f->may_free);
         }
+        if (zero_copy) {
+            set_bit(f->iovcnt, f->zero_copy);
+        }
         f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
         f->iov[f->iovcnt++].iov_len = size;
     }
@@ -414,7 +482,7 @@ static int add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size,
 
 static void add_buf_to_iovec(QEMUFile *f, size_t len)
 {
-    if (!add_to_iovec(f, f->buf + f->buf_index, len, false)) {
+    if (!add_to_iovec(f, f->buf + f->buf_index, len, false, false)) {
         f->buf_index += len;
         if (f->buf_index == IO_BUF_SIZE) {
             qemu_fflush(f);
@@ -429,7 +497,11 @@ void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size,
         return;
     }
 
-    add_to_iovec(f, buf, size, may_free);
+    /*
+     * Memory released right after the write must not be referenced by the
+     * kernel any more.
+     */
+    add_to_iovec(f, buf, size, may_free, f->zero_copy_send && !may_free);
 }
 
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, size_t size)
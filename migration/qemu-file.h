@@ -46,6 +46,11 @@ uint64_t qemu_file_transferred(QEMUFile *f);
 /*
  * put_buffer without copying the buffer.
  * The buffer should be available till it is sent asynchronously.
+ *
+ * With the zero-copy-send capability, and unless @may_free, the buffer
+ * is passed to the kernel without copying it, on channels that support
+ * that: a guest page changed before qemu_file_flush_zero_copy() may go
+ * out with either content, so it must be sent again.
  */
 void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size,
                            bool may_free);
@@ -73,6 +78,11 @@ void qemu_file_set_error(QEMUFile *f, int ret);
 int qemu_file_shutdown(QEMUFile *f);
 QEMUFile *qemu_file_get_return_path(QEMUFile *f);
 int qemu_fflush(QEMUFile *f);
+/*
+ * Flushes @f, then waits until the buffers sent without copying them
+ * have left the host.  Returns 0, or a negative error.
+ */
+int qemu_file_flush_zero_copy(QEMUFile *f);
 void qemu_file_set_blocking(QEMUFile *f, bool block);
 int qemu_file_get_to_fd(QEMUFile *f, int fd, size_t size);
 void qemu_set_offset(QEMUFile *f, off_t off, int whence);
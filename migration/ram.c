@@ -32,6 +32,7 @@
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 #include "xbzrle.h"
 #include "ram-compress.h"
 #include "ram.h"
@@ -39,8 +40,10 @@
 #include "migration-stats.h"
 #include "migration/register.h"
 #include "migration/misc.h"
+#include "migration/cpr.h"
 #include "qemu-file.h"
 #include "postcopy-ram.h"
+#include "lazy-load.h"
 #include "page_cache.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
@@ -126,6 +129,8 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* Whether the page was requested by the destination */
+    bool          urgent;
     /* Whether we're sending a host page */
     bool          host_page_sending;
     /* The start/end of current host page.  Invalid if host_page_sending==false */
@@ -218,9 +223,22 @@ static bool postcopy_preempt_active(void)
 
 bool migrate_ram_is_ignored(RAMBlock *block)
 {
-    return !qemu_ram_is_migratable(block) ||
-           (migrate_ignore_shared() && qemu_ram_is_shared(block)
-                                    && qemu_ram_is_named_file(block));
+    if (!qemu_ram_is_migratable(block)) {
+        return true;
+    }
+    /* cpr-exec hands shared, fd-backed RAM to the new QEMU as is */
+    if (cpr_is_exec() && qemu_ram_is_shared(block) &&
+        qemu_ram_get_fd(block) >= 0) {
+        return true;
+    }
+    if (!migrate_ignore_shared() || !qemu_ram_is_named_file(block)) {
+        return false;
+    }
+    /*
+     * A clone maps the RAM file of the template privately; the contents
+     * of the file are the RAM of the template.
+     */
+    return qemu_ram_is_shared(block) || migrate_clone_template();
 }
 
 #undef RAMBLOCK_FOREACH
@@ -350,6 +368,14 @@ struct RAMSrcPageRequest {
 };
 
 /* State of RAM for migration */
+typedef struct DirtySyncPool DirtySyncPool;
+typedef struct ZeroScanPool ZeroScanPool;
+
+/* Write faults fetched from the UFFD descriptor with a single read() */
+#define UFFD_FAULT_BATCH        64
+/* Most target pages kept write-protected after they have been saved */
+#define WP_RELEASE_MAX_PAGES    256
+
 struct RAMState {
     /*
      * PageSearchStatus structures for the channels when send pages.
@@ -358,6 +384,19 @@ struct RAMState {
     PageSearchStatus pss[RAM_CHANNEL_MAX];
     /* UFFD file descriptor, used in 'write-tracking' migration */
     int uffdio_fd;
+#if defined(__linux__)
+    /* Write faults read from uffdio_fd but not handled yet */
+    struct uffd_msg uffd_msgs[UFFD_FAULT_BATCH];
+    int uffd_msgs_next;
+    int uffd_msgs_count;
+    /*
+     * Range of saved pages whose write protection is still to be released,
+     * relative to wp_release_block
+     */
+    RAMBlock *wp_release_block;
+    unsigned long wp_release_start;
+    unsigned long wp_release_end;
+#endif
     /* total ram size in bytes */
     uint64_t ram_bytes_total;
     /* Last block that we have visited searching for dirty pages */
@@ -399,6 +438,10 @@ struct RAMState {
      * - pss structures
      */
     QemuMutex bitmap_mutex;
+    /* Threads the dirty bitmap sync is split across, if any */
+    DirtySyncPool *sync_pool;
+    /* Threads looking for zero pages ahead of the first round, if any */
+    ZeroScanPool *zero_scan;
     /* The RAMBlock used in the last src_page_requests */
     RAMBlock *last_req_rb;
     /* Queue of outstanding page requests from the destination */
@@ -587,6 +630,11 @@ void mig_throttle_counter_reset(void)
  */
 static void xbzrle_cache_zero_page(ram_addr_t current_addr)
 {
+    if (migrate_multifd()) {
+        multifd_xbzrle_cache_zero_page(current_addr);
+        return;
+    }
+
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
     cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
@@ -921,6 +969,310 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/* Size of the pieces the dirty bitmap sync is split in across threads */
+#define DIRTY_SYNC_CHUNK_SIZE (1ULL << 30)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} DirtySyncChunk;
+
+typedef struct {
+    QemuThread thread;
+    DirtySyncPool *pool;
+    /* new dirty pages found by the thread in the current sync */
+    uint64_t num_dirty;
+} DirtySyncThread;
+
+struct DirtySyncPool {
+    DirtySyncThread *threads;
+    int nr_threads;
+    /* posted once per thread to start a sync or to quit */
+    QemuSemaphore start_sem;
+    /* posted by each thread once done with a sync */
+    QemuSemaphore done_sem;
+    bool quit;
+    /* chunks of the current sync, and the next one to be picked */
+    GArray *chunks;
+    unsigned int next;
+};
+
+/*
+ * Chunks never share a word of the dirty bitmap of their RAMBlock, and
+ * the other bitmaps are updated atomically, so that any number of
+ * threads can sync them at the same time.
+ */
+static uint64_t dirty_sync_run_chunks(DirtySyncPool *pool)
+{
+    uint64_t num_dirty = 0;
+    unsigned int i;
+
+    while ((i = qatomic_fetch_inc(&pool->next)) < pool->chunks->len) {
+        DirtySyncChunk *c = &g_array_index(pool->chunks, DirtySyncChunk, i);
+
+        num_dirty += cpu_physical_memory_sync_dirty_bitmap(c->block, c->start,
+                                                           c->length);
+    }
+    return num_dirty;
+}
+
+static void *dirty_sync_thread(void *opaque)
+{
+    DirtySyncThread *t = opaque;
+    DirtySyncPool *pool = t->pool;
+
+    rcu_register_thread();
+    while (true) {
+        qemu_sem_wait(&pool->start_sem);
+        if (qatomic_read(&pool->quit)) {
+            break;
+        }
+        WITH_RCU_READ_LOCK_GUARD() {
+            t->num_dirty = dirty_sync_run_chunks(pool);
+        }
+        qemu_sem_post(&pool->done_sem);
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static DirtySyncPool *dirty_sync_pool_new(int nr_threads)
+{
+    DirtySyncPool *pool = g_new0(DirtySyncPool, 1);
+    int i;
+
+    qemu_sem_init(&pool->start_sem, 0);
+    qemu_sem_init(&pool->done_sem, 0);
+    pool->chunks = g_array_new(false, false, sizeof(DirtySyncChunk));
+    pool->threads = g_new0(DirtySyncThread, nr_threads);
+    pool->nr_threads = nr_threads;
+    for (i = 0; i < nr_threads; i++) {
+        pool->threads[i].pool = pool;
+        qemu_thread_create(&pool->threads[i].thread, "mig/src/dirtysync",
+                           dirty_sync_thread, &pool->threads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    return pool;
+}
+
+static void dirty_sync_pool_free(DirtySyncPool *pool)
+{
+    int i;
+
+    qatomic_set(&pool->quit, true);
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_sem_post(&pool->start_sem);
+    }
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_thread_join(&pool->threads[i].thread);
+    }
+    qemu_sem_destroy(&pool->start_sem);
+    qemu_sem_destroy(&pool->done_sem);
+    g_array_free(pool->chunks, true);
+    g_free(pool->threads);
+    g_free(pool);
+}
+
+/*
+ * Sync the dirty bitmap of all the RAMBlocks, split in chunks that the
+ * pool threads and the caller pick one after the other.
+ *
+ * Called with the bitmap_mutex held and within an RCU critical section.
+ */
+static void ramblock_sync_dirty_bitmap_parallel(RAMState *rs)
+{
+    DirtySyncPool *pool = rs->sync_pool;
+    uint64_t new_dirty_pages;
+    RAMBlock *block;
+    ram_addr_t start;
+    int i;
+
+    g_array_set_size(pool->chunks, 0);
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        for (start = 0; start < block->used_length;
+             start += DIRTY_SYNC_CHUNK_SIZE) {
+            DirtySyncChunk c = {
+                .block = block,
+                .start = start,
+                .length = MIN(DIRTY_SYNC_CHUNK_SIZE,
+                              block->used_length - start),
+            };
+
+            g_array_append_val(pool->chunks, c);
+        }
+    }
+
+    pool->next = 0;
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_sem_post(&pool->start_sem);
+    }
+    new_dirty_pages = dirty_sync_run_chunks(pool);
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_sem_wait(&pool->done_sem);
+    }
+    for (i = 0; i < pool->nr_threads; i++) {
+        new_dirty_pages += pool->threads[i].num_dirty;
+    }
+
+    trace_ramblock_sync_dirty_bitmap_parallel(pool->chunks->len,
+                                              pool->nr_threads);
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+}
+
+typedef struct {
+    RAMBlock *block;
+    unsigned long start;
+    unsigned long npages;
+} ZeroScanChunk;
+
+struct ZeroScanPool {
+    QemuThread *threads;
+    int nr_threads;
+    /*
+     * Set once the zero pages found may have been written since, when the
+     * dirty bitmap is synced again; the threads then stop
+     */
+    bool quit;
+    /* chunks of RAM to scan, and the next one to be picked */
+    GArray *chunks;
+    unsigned int next;
+};
+
+/*
+ * Looks for the zero pages among the dirty ones of a chunk, marking them
+ * in the zero_bmap of their RAMBlock.  The remote dirty bitmap of the
+ * chunk is cleared first, as the migration thread does before reading a
+ * page, so that any write after the page was found to be zero is caught
+ * by the next dirty bitmap sync.
+ */
+static uint64_t zero_scan_chunk(RAMState *rs, ZeroScanChunk *c)
+{
+    RAMBlock *rb = c->block;
+    unsigned long end = c->start + c->npages;
+    unsigned long page = c->start;
+    uint64_t zero_pages = 0;
+
+    WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
+        if (qatomic_read(&rs->zero_scan->quit)) {
+            return 0;
+        }
+        migration_clear_memory_region_dirty_bitmap_range(rb, c->start,
+                                                         c->npages);
+    }
+
+    /* The dirty bitmap is only read as a hint of the pages still to send */
+    while ((page = find_next_bit(rb->bmap, end, page)) < end) {
+        if (buffer_is_zero(rb->host + ((ram_addr_t)page << TARGET_PAGE_BITS),
+                           TARGET_PAGE_SIZE)) {
+            set_bit_atomic(page, rb->zero_bmap);
+            zero_pages++;
+        }
+        page++;
+    }
+    return zero_pages;
+}
+
+static void *zero_scan_thread(void *opaque)
+{
+    RAMState *rs = opaque;
+    ZeroScanPool *pool = rs->zero_scan;
+    uint64_t zero_pages = 0;
+    unsigned int i, chunks = 0;
+
+    rcu_register_thread();
+    while (!qatomic_read(&pool->quit) &&
+           (i = qatomic_fetch_inc(&pool->next)) < pool->chunks->len) {
+        WITH_RCU_READ_LOCK_GUARD() {
+            zero_pages += zero_scan_chunk(rs, &g_array_index(pool->chunks,
+                                                             ZeroScanChunk,
+                                                             i));
+        }
+        chunks++;
+    }
+    trace_ram_zero_scan_thread_end(chunks, zero_pages);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Starts the threads looking for the zero pages of guest RAM, so that the
+ * migration thread sends them during the first round without reading
+ * them.  Must be called after the first dirty bitmap sync.
+ */
+static void zero_scan_start(RAMState *rs, int nr_threads)
+{
+    ZeroScanPool *pool = g_new0(ZeroScanPool, 1);
+    RAMBlock *block;
+    int i;
+
+    pool->chunks = g_array_new(false, false, sizeof(ZeroScanChunk));
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+            unsigned long chunk = 1UL << block->clear_bmap_shift;
+            unsigned long start;
+
+            block->zero_bmap = bitmap_new(block->max_length >>
+                                          TARGET_PAGE_BITS);
+            for (start = 0; start < pages; start += chunk) {
+                ZeroScanChunk c = {
+                    .block = block,
+                    .start = start,
+                    .npages = MIN(chunk, pages - start),
+                };
+
+                g_array_append_val(pool->chunks, c);
+            }
+        }
+    }
+
+    rs->zero_scan = pool;
+    pool->threads = g_new0(QemuThread, nr_threads);
+    pool->nr_threads = nr_threads;
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_create(&pool->threads[i], "mig/src/zeroscan",
+                           zero_scan_thread, rs, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void zero_scan_free(RAMState *rs)
+{
+    ZeroScanPool *pool = rs->zero_scan;
+    RAMBlock *block;
+    int i;
+
+    if (!pool) {
+        return;
+    }
+
+    qatomic_set(&pool->quit, true);
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        g_free(block->zero_bmap);
+        block->zero_bmap = NULL;
+    }
+    g_array_free(pool->chunks, true);
+    g_free(pool->threads);
+    g_free(pool);
+    rs->zero_scan = NULL;
+}
+
+/*
+ * Whether @page of @rb was found to be zero since the last dirty bitmap
+ * sync.  Only the migration thread may rely on it, as it is the one
+ * syncing the dirty bitmap.
+ */
+static bool zero_scan_page_is_zero(RAMState *rs, RAMBlock *rb,
+                                   unsigned long page)
+{
+    return rs->zero_scan && !qatomic_read(&rs->zero_scan->quit) &&
+           rb->zero_bmap && test_bit(page, rb->zero_bmap);
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1013,6 +1365,22 @@ static void migration_dirty_limit_guest(void)
     trace_migration_dirty_limit_guest(quota_dirtyrate);
 }
 
+/*
+ * Limit only the vCPUs dirtying memory faster than their share of the
+ * @bytes_dirty_threshold bytes the guest may dirty in the last period
+ */
+static void migration_dirty_limit_guest_adaptive(RAMState *rs,
+                                                 uint64_t bytes_dirty_threshold)
+{
+    MigrationState *s = migrate_get_current();
+    int64_t period = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                     rs->time_last_bitmap_sync;
+    uint64_t budget = bytes_dirty_threshold * 1000 / MAX(period, 1) / MiB;
+
+    dirtylimit_set_share(budget, s->parameters.vcpu_dirty_limit);
+    trace_migration_dirty_limit_guest_adaptive(budget);
+}
+
 static void migration_trigger_throttle(RAMState *rs)
 {
     uint64_t threshold = migrate_throttle_trigger_threshold();
@@ -1028,6 +1396,16 @@ static void migration_trigger_throttle(RAMState *rs)
         return;
     }
 
+    /*
+     * Once started, the adaptive dirty limit follows the vCPU dirty rates
+     * at every period, letting the vCPUs that calmed down run freely.
+     */
+    if (migrate_dirty_limit() && migrate_dirty_limit_adaptive() &&
+        dirtylimit_in_service()) {
+        migration_dirty_limit_guest_adaptive(rs, bytes_dirty_threshold);
+        return;
+    }
+
     /*
      * The following detection logic can be refined later. For now:
      * Check to see if the ratio between dirtied bytes and the approx.
@@ -1042,6 +1420,8 @@ static void migration_trigger_throttle(RAMState *rs)
             trace_migration_throttle();
             mig_throttle_guest_down(bytes_dirty_period,
                                     bytes_dirty_threshold);
+        } else if (migrate_dirty_limit() && migrate_dirty_limit_adaptive()) {
+            migration_dirty_limit_guest_adaptive(rs, bytes_dirty_threshold);
         } else if (migrate_dirty_limit()) {
             migration_dirty_limit_guest();
         }
@@ -1055,6 +1435,11 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
     stat64_add(&mig_stats.dirty_sync_count, 1);
 
+    /* The zero pages found so far may have been written since */
+    if (rs->zero_scan) {
+        qatomic_set(&rs->zero_scan->quit, true);
+    }
+
     if (!rs->time_last_bitmap_sync) {
         rs->time_last_bitmap_sync = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     }
@@ -1062,10 +1447,18 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
     trace_migration_bitmap_sync_start();
     memory_global_dirty_log_sync(last_stage);
 
+    if (!rs->sync_pool && migrate_dirty_sync_threads()) {
+        rs->sync_pool = dirty_sync_pool_new(migrate_dirty_sync_threads());
+    }
+
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
+        if (rs->sync_pool) {
+            ramblock_sync_dirty_bitmap_parallel(rs);
+        } else {
+            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                ramblock_sync_dirty_bitmap(rs, block);
+            }
         }
         stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
     }
@@ -1108,6 +1501,14 @@ static void migration_bitmap_sync_precopy(RAMState *rs, bool last_stage)
         local_err = NULL;
     }
 
+    /*
+     * As the multifd channels do, wait for the pages sent without copy
+     * once per round.  Errors are caught with the file error later.
+     */
+    if (rs->pss[RAM_CHANNEL_PRECOPY].pss_channel) {
+        qemu_file_flush_zero_copy(rs->pss[RAM_CHANNEL_PRECOPY].pss_channel);
+    }
+
     migration_bitmap_sync(rs, last_stage);
 
     if (precopy_notify(PRECOPY_NOTIFY_AFTER_BITMAP_SYNC, &local_err)) {
@@ -1144,7 +1545,8 @@ static int save_zero_page(RAMState *rs, PageSearchStatus *pss,
         return 0;
     }
 
-    if (!buffer_is_zero(p, TARGET_PAGE_SIZE)) {
+    if (!zero_scan_page_is_zero(rs, pss->block, offset >> TARGET_PAGE_BITS) &&
+        !buffer_is_zero(p, TARGET_PAGE_SIZE)) {
         return 0;
     }
 
@@ -1328,6 +1730,31 @@ int compress_send_queued_data(CompressParam *param)
     return len;
 }
 
+/*
+ * Syncs the multifd channels once the whole of RAM was looked at, so
+ * that a page sent again in the next round cannot be overwritten on the
+ * destination by its older copy still in flight on another channel.
+ */
+static int multifd_ram_flush_round(RAMState *rs)
+{
+    if (migrate_multifd() &&
+        (!migrate_multifd_flush_after_each_section() ||
+         migrate_mapped_ram())) {
+        QEMUFile *f = rs->pss[RAM_CHANNEL_PRECOPY].pss_channel;
+        int ret = multifd_send_sync_main(MULTIFD_SYNC_ALL);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (!migrate_mapped_ram()) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_FLUSH);
+            qemu_fflush(f);
+        }
+    }
+
+    return 0;
+}
+
 #define PAGE_ALL_CLEAN 0
 #define PAGE_TRY_AGAIN 1
 #define PAGE_DIRTY_FOUND 2
@@ -1364,19 +1791,10 @@ static int find_dirty_block(RAMState *rs, PageSearchStatus *pss)
         pss->page = 0;
         pss->block = QLIST_NEXT_RCU(pss->block, next);
         if (!pss->block) {
-            if (migrate_multifd() &&
-                (!migrate_multifd_flush_after_each_section() ||
-                 migrate_mapped_ram())) {
-                QEMUFile *f = rs->pss[RAM_CHANNEL_PRECOPY].pss_channel;
-                int ret = multifd_send_sync_main();
-                if (ret < 0) {
-                    return ret;
-                }
+            int ret = multifd_ram_flush_round(rs);
 
-                if (!migrate_mapped_ram()) {
-                    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_FLUSH);
-                    qemu_fflush(f);
-                }
+            if (ret < 0) {
+                return ret;
             }
             /*
              * If memory migration starts over, we will meet a dirtied page
@@ -1396,6 +1814,9 @@ static int find_dirty_block(RAMState *rs, PageSearchStatus *pss)
             /* After the first round, enable XBZRLE. */
             if (migrate_xbzrle()) {
                 rs->xbzrle_started = true;
+                if (migrate_multifd()) {
+                    multifd_xbzrle_start();
+                }
             }
         }
         /* Didn't find anything this time, but try again on the new block */
@@ -1463,7 +1884,7 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
  */
 static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
 {
-    struct uffd_msg uffd_msg;
+    struct uffd_msg *uffd_msg;
     void *page_address;
     RAMBlock *block;
     int res;
@@ -1472,21 +1893,66 @@ static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
         return NULL;
     }
 
-    res = uffd_read_events(rs->uffdio_fd, &uffd_msg, 1);
-    if (res <= 0) {
-        return NULL;
+    /*
+     * Faulting vCPUs tend to come in bursts, so fetch as many events as
+     * are pending and hand them out one by one on the following calls.
+     */
+    if (rs->uffd_msgs_next == rs->uffd_msgs_count) {
+        res = uffd_read_events(rs->uffdio_fd, rs->uffd_msgs, UFFD_FAULT_BATCH);
+        if (res <= 0) {
+            return NULL;
+        }
+        rs->uffd_msgs_next = 0;
+        rs->uffd_msgs_count = res;
     }
 
-    page_address = (void *)(uintptr_t) uffd_msg.arg.pagefault.address;
+    uffd_msg = &rs->uffd_msgs[rs->uffd_msgs_next++];
+    page_address = (void *)(uintptr_t) uffd_msg->arg.pagefault.address;
     block = qemu_ram_block_from_host(page_address, false, offset);
     assert(block && (block->flags & RAM_UF_WRITEPROTECT) != 0);
     return block;
 }
 
+/**
+ * ram_release_pending_protection: release UFFD write protection on the
+ *   saved pages accumulated by ram_save_release_protection()
+ *
+ * @rs: current RAM state
+ * @f: channel the pages have been written to
+ *
+ * Returns 0 on success, negative value in case of an error
+ */
+static int ram_release_pending_protection(RAMState *rs, QEMUFile *f)
+{
+    RAMBlock *block = rs->wp_release_block;
+    unsigned long start = rs->wp_release_start;
+    void *page_address;
+    uint64_t run_length;
+
+    if (!block) {
+        return 0;
+    }
+    rs->wp_release_block = NULL;
+
+    page_address = block->host + (start << TARGET_PAGE_BITS);
+    run_length = (rs->wp_release_end - start) << TARGET_PAGE_BITS;
+
+    /* Flush async buffers before un-protect. */
+    qemu_fflush(f);
+    /* Un-protect memory range. */
+    return uffd_change_protection(rs->uffdio_fd, page_address, run_length,
+                                  false, false);
+}
+
 /**
  * ram_save_release_protection: release UFFD write protection after
  *   a range of pages has been saved
  *
+ * Ranges saved by the linear scan are merged with the previous ones as
+ * long as they are contiguous, so that the channel flush and the ioctl
+ * are paid once for up to WP_RELEASE_MAX_PAGES pages.  Pages saved
+ * because a vCPU faulted on them are released right away.
+ *
  * @rs: current RAM state
  * @pss: page-search-status structure
  * @start_page: index of the first page in the range relative to pss->block
@@ -1496,21 +1962,33 @@ static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
 static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
         unsigned long start_page)
 {
-    int res = 0;
+    int res;
 
     /* Check if page is from UFFD-managed region. */
-    if (pss->block->flags & RAM_UF_WRITEPROTECT) {
-        void *page_address = pss->block->host + (start_page << TARGET_PAGE_BITS);
-        uint64_t run_length = (pss->page - start_page) << TARGET_PAGE_BITS;
+    if (!(pss->block->flags & RAM_UF_WRITEPROTECT)) {
+        return 0;
+    }
 
-        /* Flush async buffers before un-protect. */
-        qemu_fflush(pss->pss_channel);
-        /* Un-protect memory range. */
-        res = uffd_change_protection(rs->uffdio_fd, page_address, run_length,
-                false, false);
+    if (rs->wp_release_block == pss->block &&
+        rs->wp_release_end == start_page &&
+        pss->page - rs->wp_release_start <= WP_RELEASE_MAX_PAGES) {
+        rs->wp_release_end = pss->page;
+    } else {
+        res = ram_release_pending_protection(rs, pss->pss_channel);
+        if (res < 0) {
+            return res;
+        }
+        rs->wp_release_block = pss->block;
+        rs->wp_release_start = start_page;
+        rs->wp_release_end = pss->page;
+    }
+
+    if (pss->urgent || rs->wp_release_end - rs->wp_release_start >=
+                       WP_RELEASE_MAX_PAGES) {
+        return ram_release_pending_protection(rs, pss->pss_channel);
     }
 
-    return res;
+    return 0;
 }
 
 /* ram_write_tracking_available: check if kernel supports required UFFD features
@@ -1787,6 +2265,8 @@ void ram_write_tracking_stop(void)
     /* Finally close UFFD file descriptor */
     uffd_close_fd(rs->uffdio_fd);
     rs->uffdio_fd = -1;
+    rs->uffd_msgs_next = rs->uffd_msgs_count = 0;
+    rs->wp_release_block = NULL;
 }
 
 #else
@@ -1810,6 +2290,14 @@ static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
     return 0;
 }
 
+static int ram_release_pending_protection(RAMState *rs, QEMUFile *f)
+{
+    (void) rs;
+    (void) f;
+
+    return 0;
+}
+
 bool ram_write_tracking_available(void)
 {
     return false;
@@ -2110,6 +2598,18 @@ static int ram_save_target_page_multifd(RAMState *rs, PageSearchStatus *pss)
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
 
+    /*
+     * During postcopy, multifd only carries the background pages.  The
+     * requested ones keep going through the main or preempt channel, and
+     * so do host pages bigger than a target page, since the destination
+     * must place them as a whole.
+     */
+    if (migration_in_postcopy() &&
+        (pss->urgent || qemu_ram_pagesize(block) != TARGET_PAGE_SIZE ||
+         migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE)) {
+        return ram_save_target_page_legacy(rs, pss);
+    }
+
     /*
      * While using multifd live migration, we still need to handle zero
      * page checking on the migration main thread.
@@ -2191,6 +2691,7 @@ static int ram_save_host_page_urgent(PageSearchStatus *pss)
     int ret = 0;
 
     trace_postcopy_preempt_send_host_page(pss->block->idstr, pss->page);
+    pss->urgent = true;
     pss_host_page_prepare(pss);
 
     /*
@@ -2348,11 +2849,14 @@ static int ram_find_and_save_block(RAMState *rs)
     pss_init(pss, rs->last_seen_block, rs->last_page);
 
     while (true){
-        if (!get_queued_page(rs, pss)) {
+        pss->urgent = get_queued_page(rs, pss);
+        if (!pss->urgent) {
             /* priority queue empty, so just search for something dirty */
             int res = find_dirty_block(rs, pss);
             if (res != PAGE_DIRTY_FOUND) {
                 if (res == PAGE_ALL_CLEAN) {
+                    pages = ram_release_pending_protection(rs,
+                                                           pss->pss_channel);
                     break;
                 } else if (res == PAGE_TRY_AGAIN) {
                     continue;
@@ -2374,6 +2878,140 @@ static int ram_find_and_save_block(RAMState *rs)
     return pages;
 }
 
+/* Most pages of RAM handed to a multifd channel at a time */
+#define MULTIFD_SCAN_RANGE_PAGES (1UL << 14)
+
+/**
+ * ram_multifd_scan_range: find and clear the dirty pages of a range
+ *
+ * Called by the multifd channels on the ranges handed out by
+ * ram_save_multifd_scan(), while the migration thread holds bitmap_mutex
+ * and waits for them.  The ranges cover whole words of the dirty bitmap
+ * and the remote dirty bitmap of their chunks is already cleared, so no
+ * other thread touches the bits cleared here.
+ *
+ * Returns the number of dirty pages found, whose offsets are stored in
+ * @offset.
+ *
+ * @rb: RAMBlock being scanned
+ * @page: first page to look at, updated to the page to resume from
+ * @end: page the range ends before
+ * @offset: where to store the offsets of the dirty pages
+ * @max: most dirty pages to return
+ */
+uint32_t ram_multifd_scan_range(RAMBlock *rb, unsigned long *page,
+                                unsigned long end, ram_addr_t *offset,
+                                uint32_t max)
+{
+    unsigned long i = *page;
+    uint32_t n = 0;
+
+    while (n < max) {
+        i = find_next_bit(rb->bmap, end, i);
+        if (i >= end) {
+            break;
+        }
+        clear_bit(i, rb->bmap);
+        offset[n++] = (ram_addr_t)i << TARGET_PAGE_BITS;
+        i++;
+    }
+
+    *page = i;
+    return n;
+}
+
+static bool ram_multifd_scan_active(void)
+{
+    return migrate_multifd() && migrate_multifd_channel_scan() &&
+           migrate_zero_page_detection() != ZERO_PAGE_DETECTION_LEGACY &&
+           !migrate_mapped_ram() && !migration_in_postcopy();
+}
+
+/**
+ * ram_save_multifd_scan: have the multifd channels send the dirty pages
+ *
+ * Hands ranges of RAM starting at the next dirty pages to the multifd
+ * channels, about one range each, then waits for them.  The channels
+ * clear the dirty pages they find there and send them on their own, so
+ * that only skipping over the clean parts of the dirty bitmap is left to
+ * the migration thread.
+ *
+ * Called within an RCU critical section, with bitmap_mutex held.
+ *
+ * Returns the number of pages written where zero means no dirty pages,
+ * or negative on error
+ *
+ * @rs: current RAM state
+ */
+static int ram_save_multifd_scan(RAMState *rs)
+{
+    uint64_t total = rs->ram_bytes_total >> TARGET_PAGE_BITS;
+    uint64_t scanned = 0;
+    int64_t pages = 0;
+    RAMBlock *block;
+    unsigned long page;
+    int i, ret;
+
+    if (!rs->last_seen_block) {
+        rs->last_seen_block = QLIST_FIRST_RCU(&ram_list.blocks);
+        rs->last_page = 0;
+    }
+    block = rs->last_seen_block;
+    page = rs->last_page;
+
+    while (!pages && rs->migration_dirty_pages && scanned < total) {
+        for (i = 0; i < migrate_multifd_channels(); i++) {
+            unsigned long size = block->used_length >> TARGET_PAGE_BITS;
+            unsigned long next = size;
+
+            if (!migrate_ram_is_ignored(block)) {
+                next = find_next_bit(block->bmap, size, page);
+            }
+
+            if (next < size) {
+                unsigned long start = QEMU_ALIGN_DOWN(next, BITS_PER_LONG);
+                unsigned long end = MIN(start + MULTIFD_SCAN_RANGE_PAGES,
+                                        size);
+
+                /*
+                 * The channels must not clear the remote dirty bitmap
+                 * concurrently, do it here for them.
+                 */
+                migration_clear_memory_region_dirty_bitmap_range(block, start,
+                                                                 end - start);
+                if (!multifd_queue_scan(block, start, end)) {
+                    return -1;
+                }
+                scanned += end - page;
+                page = end;
+                continue;
+            }
+
+            scanned += size - MIN(page, size);
+            page = 0;
+            block = QLIST_NEXT_RCU(block, next);
+            if (!block) {
+                ret = multifd_ram_flush_round(rs);
+                if (ret < 0) {
+                    return ret;
+                }
+                block = QLIST_FIRST_RCU(&ram_list.blocks);
+            }
+        }
+
+        pages = multifd_scan_wait();
+        if (pages < 0) {
+            return pages;
+        }
+        rs->migration_dirty_pages -= pages;
+    }
+
+    rs->last_seen_block = block;
+    rs->last_page = page;
+
+    return pages;
+}
+
 static uint64_t ram_bytes_total_with_ignored(void)
 {
     RAMBlock *block;
@@ -2414,6 +3052,9 @@ static void xbzrle_load_cleanup(void)
 static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
+        if ((*rsp)->sync_pool) {
+            dirty_sync_pool_free((*rsp)->sync_pool);
+        }
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
@@ -2458,6 +3099,10 @@ static void ram_save_cleanup(void *opaque)
         }
     }
 
+    if (*rsp) {
+        zero_scan_free(*rsp);
+    }
+
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->clear_bmap);
         block->clear_bmap = NULL;
@@ -2668,6 +3313,18 @@ void ram_postcopy_send_discard_bitmap(MigrationState *ms)
 
     RCU_READ_LOCK_GUARD();
 
+    /*
+     * Precopy pages still in flight on the multifd channels must land
+     * before the destination discards the pages dirtied since then.
+     */
+    if (migrate_multifd()) {
+        if (multifd_send_sync_main(MULTIFD_SYNC_ALL) < 0) {
+            qemu_file_set_error(ms->to_dst_file, -EIO);
+            return;
+        }
+        multifd_send_postcopy_start();
+    }
+
     /* This should be our last sync, the src is now paused */
     migration_bitmap_sync(rs, false);
 
@@ -2727,6 +3384,11 @@ static int xbzrle_init(void)
         return 0;
     }
 
+    /* The multifd channels encode the pages, with their own cache */
+    if (migrate_multifd()) {
+        return 0;
+    }
+
     XBZRLE_cache_lock();
 
     XBZRLE.zero_target_page = g_try_malloc0(TARGET_PAGE_SIZE);
@@ -2871,6 +3533,10 @@ static void ram_init_bitmaps(RAMState *rs)
      * containing all 1s to exclude any discarded pages from migration.
      */
     migration_bitmap_clear_discarded_pages(rs);
+
+    if (migrate_zero_scan_threads() && !migrate_background_snapshot()) {
+        zero_scan_start(rs, migrate_zero_scan_threads());
+    }
 }
 
 static int ram_init_all(RAMState **rsp)
@@ -3135,7 +3801,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     }
 
     bql_unlock();
-    ret = multifd_send_sync_main();
+    ret = multifd_send_sync_main(MULTIFD_SYNC_ALL);
     bql_lock();
     if (ret < 0) {
         return ret;
@@ -3237,7 +3903,11 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
                     break;
                 }
 
-                pages = ram_find_and_save_block(rs);
+                if (ram_multifd_scan_active()) {
+                    pages = ram_save_multifd_scan(rs);
+                } else {
+                    pages = ram_find_and_save_block(rs);
+                }
                 /* no more pages to sent */
                 if (pages == 0) {
                     done = 1;
@@ -3278,6 +3948,15 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
     }
 
+    /*
+     * Do not leave postcopy pages waiting for a batch to fill up, a vCPU
+     * of the destination may be waiting for one of them.
+     */
+    if (migrate_multifd() && migration_in_postcopy() &&
+        !multifd_queue_flush()) {
+        qemu_file_set_error(f, -EIO);
+    }
+
     /*
      * Must occur before EOS (or any QEMUFile operation)
      * because of RDMA protocol.
@@ -3292,7 +3971,7 @@ out:
         && migration_is_setup_or_active()) {
         if (migrate_multifd() && migrate_multifd_flush_after_each_section() &&
             !migrate_mapped_ram()) {
-            ret = multifd_send_sync_main();
+            ret = multifd_send_sync_main(MULTIFD_SYNC_ALL);
             if (ret < 0) {
                 return ret;
             }
@@ -3345,7 +4024,11 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         while (true) {
             int pages;
 
-            pages = ram_find_and_save_block(rs);
+            if (ram_multifd_scan_active()) {
+                pages = ram_save_multifd_scan(rs);
+            } else {
+                pages = ram_find_and_save_block(rs);
+            }
             /* no more blocks to sent */
             if (pages == 0) {
                 break;
@@ -3366,7 +4049,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
     }
 
-    ret = multifd_send_sync_main();
+    ret = multifd_send_sync_main(MULTIFD_SYNC_ALL);
     if (ret < 0) {
         return ret;
     }
@@ -4029,7 +4712,8 @@ static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
 
             size = MIN(unread, MAPPED_RAM_LOAD_BUF_SIZE);
 
-            if (migrate_multifd()) {
+            if (migrate_multifd() &&
+                !migration_incoming_get_current()->loading_snapshot) {
                 read = ram_load_multifd_pages(host, size,
                                               block->pages_offset + offset);
             } else {
@@ -4055,6 +4739,27 @@ err:
     return false;
 }
 
+/*
+ * Pages that were zero when saved are not in the file.  Clear them, for
+ * the RAM of a VM that loads a snapshot can hold anything.
+ */
+static void mapped_ram_zero_missing(RAMBlock *block, long num_pages,
+                                    unsigned long *bitmap)
+{
+    unsigned long set_bit_idx, clear_bit_idx;
+
+    for (clear_bit_idx = find_first_zero_bit(bitmap, num_pages);
+         clear_bit_idx < num_pages;
+         clear_bit_idx = find_next_zero_bit(bitmap, num_pages,
+                                            set_bit_idx + 1)) {
+
+        set_bit_idx = find_next_bit(bitmap, num_pages, clear_bit_idx + 1);
+
+        ram_handle_zero(block->host + (clear_bit_idx << TARGET_PAGE_BITS),
+                        (set_bit_idx - clear_bit_idx) << TARGET_PAGE_BITS);
+    }
+}
+
 static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
                                       ram_addr_t length, Error **errp)
 {
@@ -4092,10 +4797,20 @@ static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
         return;
     }
 
-    if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
+    if (migrate_mapped_ram_lazy_load()) {
+        /* The pages are read when first touched, or by the prefetch */
+        if (!lazy_load_add_block(f, block, g_steal_pointer(&bitmap),
+                                 block->pages_offset, errp)) {
+            return;
+        }
+    } else if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
         return;
     }
 
+    if (migration_incoming_get_current()->loading_snapshot) {
+        mapped_ram_zero_missing(block, num_pages, bitmap);
+    }
+
     /* Skip pages array */
     qemu_set_offset(f, block->pages_offset + length, SEEK_SET);
 
@@ -4195,6 +4910,10 @@ static int parse_ramblocks(QEMUFile *f, ram_addr_t total_ram_bytes)
         total_ram_bytes -= length;
     }
 
+    if (!ret && migrate_mapped_ram() && migrate_mapped_ram_lazy_load()) {
+        lazy_load_start_prefetch();
+    }
+
     return ret;
 }
 
@@ -64,6 +64,9 @@ void ram_handle_zero(void *host, uint64_t size);
 
 void ram_transferred_add(uint64_t bytes);
 void ram_release_page(const char *rbname, uint64_t offset);
+uint32_t ram_multifd_scan_range(RAMBlock *rb, unsigned long *page,
+                                unsigned long end, ram_addr_t *offset,
+                                uint32_t max);
 
 int ramblock_recv_bitmap_test(RAMBlock *rb, void *host_addr);
 bool ramblock_recv_bitmap_test_byte_offset(RAMBlock *rb, uint64_t byte_offset);
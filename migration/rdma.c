@@ -46,6 +46,13 @@
 #define RDMA_MERGE_MAX (2 * 1024 * 1024)
 #define RDMA_SIGNALED_SEND_MAX (RDMA_MERGE_MAX / 4096)
 
+/*
+ * Only every Nth RDMA WRITE asks for a completion.  On a reliable
+ * connection, the completion of a signaled write implies that all the
+ * writes posted before it on the same QP have completed too.
+ */
+#define RDMA_WRITE_SIGNAL_INTERVAL 16
+
 #define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB */
 
 /*
@@ -308,6 +315,20 @@ typedef struct RDMAContext {
     /* number of outstanding writes */
     int nb_sent;
 
+    /*
+     * Outstanding writes in posting order, retired in bulk when a
+     * signaled write completes; see RDMA_WRITE_SIGNAL_INTERVAL.
+     */
+    uint64_t unacked_wrids[RDMA_SIGNALED_SEND_MAX];
+    int unacked_head;
+    int nb_unacked;
+    /* writes posted since the last signaled one */
+    int nb_unsignaled;
+    /* target of the last posted write, reused by qemu_rdma_signal_writes() */
+    uint64_t last_write_wrid;
+    uint64_t last_write_raddr;
+    uint32_t last_write_rkey;
+
     /* store info about current buffer so that we can
        merge it with future sends */
     uint64_t current_addr;
@@ -1438,6 +1459,33 @@ static uint64_t qemu_rdma_make_wrid(uint64_t wr_id, uint64_t index,
     return result;
 }
 
+/*
+ * A signaled RDMA WRITE completed: everything posted up to and including
+ * @wr_id has been delivered as well.
+ */
+static void qemu_rdma_complete_writes(RDMAContext *rdma, uint64_t wr_id)
+{
+    while (rdma->nb_unacked) {
+        uint64_t done = rdma->unacked_wrids[rdma->unacked_head];
+        uint64_t chunk =
+            (done & RDMA_WRID_CHUNK_MASK) >> RDMA_WRID_CHUNK_SHIFT;
+        uint64_t index =
+            (done & RDMA_WRID_BLOCK_MASK) >> RDMA_WRID_BLOCK_SHIFT;
+
+        clear_bit(chunk, rdma->local_ram_blocks.block[index].transit_bitmap);
+        rdma->unacked_head = (rdma->unacked_head + 1) % RDMA_SIGNALED_SEND_MAX;
+        rdma->nb_unacked--;
+
+        if (rdma->nb_sent > 0) {
+            rdma->nb_sent--;
+        }
+
+        if (done == wr_id) {
+            break;
+        }
+    }
+}
+
 /*
  * Consult the connection manager to see a work request
  * (of any kind) has completed.
@@ -1485,11 +1533,7 @@ static int qemu_rdma_poll(RDMAContext *rdma, struct ibv_cq *cq,
                                    index, chunk, block->local_host_addr,
                                    (void *)(uintptr_t)block->remote_host_addr);
 
-        clear_bit(chunk, block->transit_bitmap);
-
-        if (rdma->nb_sent > 0) {
-            rdma->nb_sent--;
-        }
+        qemu_rdma_complete_writes(rdma, wc.wr_id);
     } else {
         trace_qemu_rdma_poll_other(wr_id, rdma->nb_sent);
     }
@@ -1991,6 +2035,59 @@ static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
  * If we're using dynamic registration on the dest-side, we have to
  * send a registration command first.
  */
+/*
+ * Make sure that a completion will eventually be generated for all the
+ * writes posted so far, by queueing a zero-length signaled RDMA WRITE
+ * behind them if the last one was not signaled.
+ */
+static int qemu_rdma_signal_writes(RDMAContext *rdma, Error **errp)
+{
+    struct ibv_send_wr send_wr = { 0 };
+    struct ibv_send_wr *bad_wr;
+    int ret;
+
+    if (!rdma->nb_unsignaled) {
+        return 0;
+    }
+
+    /*
+     * Reuse the wrid of the last write so that its completion retires
+     * everything up to that write.
+     */
+    send_wr.wr_id = rdma->last_write_wrid;
+    send_wr.opcode = IBV_WR_RDMA_WRITE;
+    send_wr.send_flags = IBV_SEND_SIGNALED;
+    send_wr.num_sge = 0;
+    send_wr.wr.rdma.remote_addr = rdma->last_write_raddr;
+    send_wr.wr.rdma.rkey = rdma->last_write_rkey;
+
+    for (;;) {
+        ret = ibv_post_send(rdma->qp, &send_wr, &bad_wr);
+        if (ret != ENOMEM) {
+            break;
+        }
+        trace_qemu_rdma_write_one_queue_full();
+        if (qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL) < 0) {
+            error_setg(errp, "rdma migration: failed to make "
+                       "room in full send queue!");
+            return -1;
+        }
+        if (!rdma->nb_unacked) {
+            /* The queue drained by itself, nothing left to signal */
+            rdma->nb_unsignaled = 0;
+            return 0;
+        }
+    }
+
+    if (ret > 0) {
+        error_setg_errno(errp, ret, "rdma migration: post rdma write failed");
+        return -1;
+    }
+
+    rdma->nb_unsignaled = 0;
+    return 0;
+}
+
 static int qemu_rdma_write_one(RDMAContext *rdma,
                                int current_index, uint64_t current_addr,
                                uint64_t length, Error **errp)
@@ -2045,6 +2142,10 @@ retry:
         trace_qemu_rdma_write_one_block(count++, current_index, chunk,
                 sge.addr, length, rdma->nb_sent, block->nb_chunks);
 
+        if (qemu_rdma_signal_writes(rdma, errp) < 0) {
+            return -1;
+        }
+
         ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
 
         if (ret < 0) {
@@ -2172,7 +2273,9 @@ retry:
                                         current_index, chunk);
 
     send_wr.opcode = IBV_WR_RDMA_WRITE;
-    send_wr.send_flags = IBV_SEND_SIGNALED;
+    if (rdma->nb_unsignaled + 1 >= RDMA_WRITE_SIGNAL_INTERVAL) {
+        send_wr.send_flags = IBV_SEND_SIGNALED;
+    }
     send_wr.sg_list = &sge;
     send_wr.num_sge = 1;
     send_wr.wr.rdma.remote_addr = block->remote_host_addr +
@@ -2205,6 +2308,20 @@ retry:
     }
 
     set_bit(chunk, block->transit_bitmap);
+
+    assert(rdma->nb_unacked < RDMA_SIGNALED_SEND_MAX);
+    rdma->unacked_wrids[(rdma->unacked_head + rdma->nb_unacked) %
+                        RDMA_SIGNALED_SEND_MAX] = send_wr.wr_id;
+    rdma->nb_unacked++;
+    if (send_wr.send_flags & IBV_SEND_SIGNALED) {
+        rdma->nb_unsignaled = 0;
+    } else {
+        rdma->nb_unsignaled++;
+    }
+    rdma->last_write_wrid = send_wr.wr_id;
+    rdma->last_write_raddr = send_wr.wr.rdma.remote_addr;
+    rdma->last_write_rkey = send_wr.wr.rdma.rkey;
+
     stat64_add(&mig_stats.normal_pages, sge.length / qemu_target_page_size());
     /*
      * We are adding to transferred the amount of data written, but no
@@ -2602,6 +2719,9 @@ static int qemu_rdma_connect(RDMAContext *rdma, bool return_path,
 
     rdma->control_ready_expected = 1;
     rdma->nb_sent = 0;
+    rdma->unacked_head = 0;
+    rdma->nb_unacked = 0;
+    rdma->nb_unsignaled = 0;
     return 0;
 
 err_rdma_source_connect:
@@ -2925,6 +3045,11 @@ static int qemu_rdma_drain_cq(RDMAContext *rdma)
         return -1;
     }
 
+    if (qemu_rdma_signal_writes(rdma, &err) < 0) {
+        error_report_err(err);
+        return -1;
+    }
+
     while (rdma->nb_sent) {
         if (qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL) < 0) {
             error_report("rdma migration: complete polling error!");
@@ -38,6 +38,7 @@
 #include "migration/global_state.h"
 #include "migration/channel-block.h"
 #include "ram.h"
+#include "multifd.h"
 #include "qemu-file.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
@@ -62,6 +63,7 @@
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/xen.h"
+#include "sysemu/iothread.h"
 #include "migration/colo.h"
 #include "qemu/bitmap.h"
 #include "net/announce.h"
@@ -142,6 +144,68 @@ static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
     }
 }
 
+/*
+ * With mapped-ram, the multifd channels of a snapshot write the pages
+ * of RAM to the vmstate region of @bs in parallel.  The multifd threads
+ * don't hold the BQL, so they submit their I/O from @iothread.
+ */
+static struct SnapshotOutgoingArgs {
+    BlockDriverState *bs;
+    IOThread *iothread;
+} snapshot_outgoing_args;
+
+bool savevm_snapshot_in_progress(void)
+{
+    return snapshot_outgoing_args.bs;
+}
+
+bool savevm_send_channel_create(gpointer opaque, Error **errp)
+{
+    AioContext *ctx = iothread_get_aio_context(snapshot_outgoing_args.iothread);
+    QIOChannelBlock *bioc;
+
+    bioc = qio_channel_block_new_in_context(snapshot_outgoing_args.bs, ctx);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-snapshot-outgoing");
+    multifd_channel_connect(opaque, QIO_CHANNEL(bioc));
+
+    /* Channel creation is synchronous, as for file channels */
+    multifd_send_channel_created();
+
+    return true;
+}
+
+static bool savevm_snapshot_channels_setup(BlockDriverState *bs,
+                                           Error **errp)
+{
+    if (!migrate_multifd()) {
+        return true;
+    }
+
+    snapshot_outgoing_args.iothread = iothread_create("savevm-multifd",
+                                                      errp);
+    if (!snapshot_outgoing_args.iothread) {
+        return false;
+    }
+    snapshot_outgoing_args.bs = bs;
+
+    if (!multifd_send_setup()) {
+        error_setg(errp, "Failed to set up the multifd channels");
+        return false;
+    }
+    return true;
+}
+
+static void savevm_snapshot_channels_cleanup(void)
+{
+    if (snapshot_outgoing_args.bs) {
+        /* Waits for the multifd threads, which use the IOThread */
+        multifd_send_shutdown();
+    }
+
+    g_clear_pointer(&snapshot_outgoing_args.iothread, iothread_destroy);
+    snapshot_outgoing_args.bs = NULL;
+}
+
 
 /* QEMUFile timer support.
  * Not in qemu-file.c to not add qemu-timer.c as dependency to qemu-file.c
@@ -217,6 +281,13 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /*
+     * Time spent and bytes sent completing the entry the last time the
+     * state was saved, during completion @complete_gen.
+     */
+    unsigned int complete_gen;
+    int64_t complete_time_us;
+    uint64_t complete_bytes;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -229,6 +300,8 @@ typedef struct SaveState {
     uint32_t caps_count;
     MigrationCapability *capabilities;
     QemuUUID uuid;
+    /* number of precopy completions so far */
+    unsigned int complete_gen;
 } SaveState;
 
 static SaveState savevm_state = {
@@ -1490,13 +1563,137 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
+typedef struct SaveCompletePrecopyThread {
+    SaveStateEntry *se;
+    QemuThread thread;
+    Error *err;
+    int ret;
+} SaveCompletePrecopyThread;
+
+static void *qemu_savevm_state_complete_precopy_thread(void *opaque)
+{
+    SaveCompletePrecopyThread *t = opaque;
+    SaveStateEntry *se = t->se;
+
+    rcu_register_thread();
+    t->ret = se->ops->save_live_complete_precopy_thread(se->idstr,
+                                                        se->instance_id,
+                                                        se->opaque, &t->err);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/*
+ * Starts a thread for every device that implements
+ * save_live_complete_precopy_thread.  Returns the array of started
+ * threads, terminated by an entry with a NULL se.
+ */
+static SaveCompletePrecopyThread *
+qemu_savevm_state_complete_precopy_threads_start(bool in_postcopy)
+{
+    SaveCompletePrecopyThread *threads;
+    SaveStateEntry *se;
+    int n = 0;
+
+    threads = g_new0(SaveCompletePrecopyThread, 1);
+
+    /* Snapshots don't set up multifd channels */
+    if (!multifd_device_state_supported() ||
+        runstate_check(RUN_STATE_SAVE_VM)) {
+        return threads;
+    }
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        SaveCompletePrecopyThread *t;
+
+        if (!se->ops ||
+            (in_postcopy && se->ops->has_postcopy &&
+             se->ops->has_postcopy(se->opaque)) ||
+            !se->ops->save_live_complete_precopy_thread) {
+            continue;
+        }
+
+        if (se->ops->is_active) {
+            if (!se->ops->is_active(se->opaque)) {
+                continue;
+            }
+        }
+
+        threads = g_renew(SaveCompletePrecopyThread, threads, n + 2);
+        memset(&threads[n + 1], 0, sizeof(threads[n + 1]));
+        t = &threads[n++];
+        memset(t, 0, sizeof(*t));
+        t->se = se;
+    }
+
+    for (int i = 0; i < n; i++) {
+        qemu_thread_create(&threads[i].thread, "mig/src/save",
+                           qemu_savevm_state_complete_precopy_thread,
+                           &threads[i], QEMU_THREAD_JOINABLE);
+    }
+
+    return threads;
+}
+
+static int qemu_savevm_state_complete_precopy_threads_join(
+    SaveCompletePrecopyThread *threads)
+{
+    MigrationState *ms = migrate_get_current();
+    bool started = threads[0].se;
+    int ret = 0;
+
+    for (SaveCompletePrecopyThread *t = threads; t->se; t++) {
+        qemu_thread_join(&t->thread);
+        if (t->ret && !ret) {
+            ret = t->ret;
+            error_prepend(&t->err, "%s: ", t->se->idstr);
+            migrate_set_error(ms, t->err);
+            error_report_err(t->err);
+            t->err = NULL;
+        }
+        error_free(t->err);
+    }
+    g_free(threads);
+
+    /*
+     * Make sure that all the device state queued by the threads actually
+     * hit the wire before the main stream is allowed to complete.
+     */
+    if (started && !ret) {
+        ret = multifd_send_sync_main(MULTIFD_SYNC_LOCAL);
+    }
+
+    return ret;
+}
+
+/*
+ * Accounts for the time spent and the bytes sent completing @se, which
+ * may be done in more than one step.
+ */
+static void savevm_complete_account(SaveStateEntry *se, int64_t time_us,
+                                    uint64_t bytes)
+{
+    if (se->complete_gen != savevm_state.complete_gen) {
+        se->complete_gen = savevm_state.complete_gen;
+        se->complete_time_us = 0;
+        se->complete_bytes = 0;
+    }
+    se->complete_time_us += time_us;
+    se->complete_bytes += bytes;
+}
+
 static
 int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
     int64_t start_ts_each, end_ts_each;
+    uint64_t start_bytes_each;
+    SaveCompletePrecopyThread *threads;
     SaveStateEntry *se;
     int ret;
 
+    threads = qemu_savevm_state_complete_precopy_threads_start(in_postcopy);
+
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops ||
             (in_postcopy && se->ops->has_postcopy &&
@@ -1512,6 +1709,7 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
         }
 
         start_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        start_bytes_each = migration_transferred_bytes();
         trace_savevm_section_start(se->idstr, se->section_id);
 
         save_section_header(f, se, QEMU_VM_SECTION_END);
@@ -1521,11 +1719,21 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
         save_section_footer(f, se);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
+            qemu_savevm_state_complete_precopy_threads_join(threads);
             return -1;
         }
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         trace_vmstate_downtime_save("iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
+        savevm_complete_account(se, end_ts_each - start_ts_each,
+                                migration_transferred_bytes() -
+                                start_bytes_each);
+    }
+
+    ret = qemu_savevm_state_complete_precopy_threads_join(threads);
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        return -1;
     }
 
     trace_vmstate_downtime_checkpoint("src-iterable-saved");
@@ -1533,35 +1741,193 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
     return 0;
 }
 
+typedef struct SaveParallelJob {
+    SaveStateEntry *se;
+    /* the section of @se, once saved */
+    QIOChannelBuffer *bioc;
+    int64_t time_us;
+    int ret;
+    QemuEvent done;
+} SaveParallelJob;
+
+typedef struct SaveParallelState {
+    /* the entries that can be saved in parallel, in the stream order */
+    SaveParallelJob *jobs;
+    int nr_jobs;
+    /* next job for the threads to pick, and next one to write out */
+    int next;
+    int written;
+    QemuThread *threads;
+    int nr_threads;
+} SaveParallelState;
+
+static bool qemu_savevm_se_parallel(SaveStateEntry *se)
+{
+    return se->vmsd && se->vmsd->parallel_save && !se->vmsd->early_setup;
+}
+
+static void *qemu_savevm_parallel_save_thread(void *opaque)
+{
+    SaveParallelState *ps = opaque;
+    int i;
+
+    rcu_register_thread();
+    while ((i = qatomic_fetch_inc(&ps->next)) < ps->nr_jobs) {
+        SaveParallelJob *job = &ps->jobs[i];
+        int64_t start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        QEMUFile *f;
+
+        job->bioc = qio_channel_buffer_new(4096);
+        f = qemu_file_new_output(QIO_CHANNEL(job->bioc));
+        /* The description of the stream is not built in parallel */
+        job->ret = vmstate_save(f, job->se, NULL);
+        if (!job->ret) {
+            job->ret = qemu_fflush(f);
+        }
+        qemu_fclose(f);
+        job->time_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_ts;
+        qemu_event_set(&job->done);
+    }
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/*
+ * Starts saving the state of the entries marked parallel_save into
+ * buffers, with up to x-device-save-threads threads.  Returns NULL when
+ * there is nothing to save in parallel.
+ */
+static SaveParallelState *qemu_savevm_parallel_save_start(void)
+{
+    int nr_threads = migrate_device_save_threads();
+    SaveParallelState *ps;
+    SaveStateEntry *se;
+    int n = 0;
+
+    if (!nr_threads) {
+        return NULL;
+    }
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        n += qemu_savevm_se_parallel(se);
+    }
+    if (!n) {
+        return NULL;
+    }
+
+    ps = g_new0(SaveParallelState, 1);
+    ps->jobs = g_new0(SaveParallelJob, n);
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (qemu_savevm_se_parallel(se)) {
+            SaveParallelJob *job = &ps->jobs[ps->nr_jobs++];
+
+            job->se = se;
+            qemu_event_init(&job->done, false);
+        }
+    }
+
+    ps->nr_threads = MIN(nr_threads, n);
+    ps->threads = g_new0(QemuThread, ps->nr_threads);
+    for (int i = 0; i < ps->nr_threads; i++) {
+        qemu_thread_create(&ps->threads[i], "mig/src/vmstate",
+                           qemu_savevm_parallel_save_thread, ps,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    return ps;
+}
+
+/* Writes out the section of @se to @f once its thread saved it */
+static int qemu_savevm_parallel_save_put(SaveParallelState *ps,
+                                         SaveStateEntry *se, QEMUFile *f)
+{
+    SaveParallelJob *job = &ps->jobs[ps->written++];
+
+    assert(job->se == se);
+    qemu_event_wait(&job->done);
+    if (job->ret) {
+        return job->ret;
+    }
+
+    qemu_put_buffer(f, job->bioc->data, job->bioc->usage);
+    trace_vmstate_downtime_save("non-iterable", se->idstr, se->instance_id,
+                                job->time_us);
+    savevm_complete_account(se, job->time_us, job->bioc->usage);
+    return 0;
+}
+
+static void qemu_savevm_parallel_save_finish(SaveParallelState *ps)
+{
+    if (!ps) {
+        return;
+    }
+
+    for (int i = 0; i < ps->nr_threads; i++) {
+        qemu_thread_join(&ps->threads[i]);
+    }
+    for (int i = 0; i < ps->nr_jobs; i++) {
+        if (ps->jobs[i].bioc) {
+            object_unref(OBJECT(ps->jobs[i].bioc));
+        }
+        qemu_event_destroy(&ps->jobs[i].done);
+    }
+    g_free(ps->threads);
+    g_free(ps->jobs);
+    g_free(ps);
+}
+
 int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy,
                                                     bool inactivate_disks)
 {
     MigrationState *ms = migrate_get_current();
     int64_t start_ts_each, end_ts_each;
+    uint64_t start_bytes_each;
     JSONWriter *vmdesc = ms->vmdesc;
+    SaveParallelState *ps;
+    bool parallel;
     int vmdesc_len;
     SaveStateEntry *se;
     int ret;
 
+    ps = qemu_savevm_parallel_save_start();
+    parallel = ps != NULL;
+
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (se->vmsd && se->vmsd->early_setup) {
             /* Already saved during qemu_savevm_state_setup(). */
             continue;
         }
 
+        if (ps && qemu_savevm_se_parallel(se)) {
+            ret = qemu_savevm_parallel_save_put(ps, se, f);
+            if (ret) {
+                qemu_file_set_error(f, ret);
+                qemu_savevm_parallel_save_finish(ps);
+                return ret;
+            }
+            continue;
+        }
+
         start_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        start_bytes_each = migration_transferred_bytes();
 
         ret = vmstate_save(f, se, vmdesc);
         if (ret) {
             qemu_file_set_error(f, ret);
+            qemu_savevm_parallel_save_finish(ps);
             return ret;
         }
 
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         trace_vmstate_downtime_save("non-iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
+        savevm_complete_account(se, end_ts_each - start_ts_each,
+                                migration_transferred_bytes() -
+                                start_bytes_each);
     }
+    qemu_savevm_parallel_save_finish(ps);
 
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
@@ -1586,7 +1952,8 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     json_writer_end_object(vmdesc);
     vmdesc_len = strlen(json_writer_get(vmdesc));
 
-    if (should_send_vmdesc()) {
+    /* The description would miss the entries saved in parallel */
+    if (should_send_vmdesc() && !parallel) {
         qemu_put_byte(f, QEMU_VM_VMDESCRIPTION);
         qemu_put_be32(f, vmdesc_len);
         qemu_put_buffer(f, (uint8_t *)json_writer_get(vmdesc), vmdesc_len);
@@ -1615,6 +1982,7 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     trace_savevm_state_complete_precopy();
 
     cpu_synchronize_all_states();
+    savevm_state.complete_gen++;
 
     if (!in_postcopy || iterable_only) {
         ret = qemu_savevm_state_complete_precopy_iterable(f, in_postcopy);
@@ -1637,6 +2005,32 @@ flush:
     return qemu_fflush(f);
 }
 
+/*
+ * Returns the time in ms the entries are expected to take to save their
+ * state once the VM is stopped, from their last completion, on top of
+ * sending it at @bw_per_ms bytes per ms, which pending sizes account for.
+ */
+uint64_t qemu_savevm_state_complete_estimate(double bw_per_ms)
+{
+    SaveStateEntry *se;
+    int64_t total_us = 0;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        int64_t send_us;
+
+        if (!se->complete_gen) {
+            continue;
+        }
+
+        send_us = bw_per_ms ? se->complete_bytes * 1000 / bw_per_ms : 0;
+        if (se->complete_time_us > send_us) {
+            total_us += se->complete_time_us - send_us;
+        }
+    }
+
+    return total_us / 1000;
+}
+
 /* Give an estimate of the amount left to be transferred,
  * the result is split into the amount for units that can and
  * for units that can't do postcopy.
@@ -1700,7 +2094,7 @@ void qemu_savevm_state_cleanup(void)
     }
 }
 
-static int qemu_savevm_state(QEMUFile *f, Error **errp)
+static int qemu_savevm_state(QEMUFile *f, BlockDriverState *bs, Error **errp)
 {
     int ret;
     MigrationState *ms = migrate_get_current();
@@ -1716,12 +2110,25 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
         return -EINVAL;
     }
 
+    if (migrate_multifd() && !migrate_mapped_ram()) {
+        error_setg(errp, "Snapshots only support multifd with mapped-ram");
+        return -EINVAL;
+    }
+
     ret = migrate_init(ms, errp);
     if (ret) {
         return ret;
     }
     ms->to_dst_file = f;
 
+    if (!savevm_snapshot_channels_setup(bs, errp)) {
+        savevm_snapshot_channels_cleanup();
+        migrate_set_state(&ms->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        ms->to_dst_file = NULL;
+        return -EINVAL;
+    }
+
     qemu_savevm_state_header(f);
     qemu_savevm_state_setup(f);
 
@@ -1736,6 +2143,7 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
         qemu_savevm_state_complete_precopy(f, false, false);
         ret = qemu_file_get_error(f);
     }
+    savevm_snapshot_channels_cleanup();
     qemu_savevm_state_cleanup();
     if (ret != 0) {
         error_setg_errno(errp, -ret, "Error while writing VM state");
@@ -2120,6 +2528,7 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
     }
 
     trace_loadvm_postcopy_handle_listen("after uffd");
+    qemu_event_set(&mis->postcopy_listen_event);
 
     if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_LISTEN, &local_err)) {
         error_report_err(local_err);
@@ -3059,6 +3468,27 @@ int qemu_loadvm_approve_switchover(void)
     return migrate_send_rp_switchover_ack(mis);
 }
 
+int qemu_loadvm_load_state_buffer(const char *idstr, uint32_t instance_id,
+                                  char *buf, size_t len, Error **errp)
+{
+    SaveStateEntry *se;
+
+    se = find_se(idstr, instance_id);
+    if (!se) {
+        error_setg(errp, "Unknown idstr %s or instance id %u for load "
+                   "state buffer", idstr, instance_id);
+        return -1;
+    }
+
+    if (!se->ops || !se->ops->load_state_buffer) {
+        error_setg(errp, "idstr %s / instance %u has no load state buffer "
+                   "operation", idstr, instance_id);
+        return -1;
+    }
+
+    return se->ops->load_state_buffer(se->opaque, buf, len, errp);
+}
+
 bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
                   bool has_devices, strList *devices, Error **errp)
 {
@@ -3142,8 +3572,10 @@ bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
         error_setg(errp, "Could not open VM state file");
         goto the_end;
     }
-    ret = qemu_savevm_state(f, errp);
-    vm_state_size = qemu_file_transferred(f);
+    ret = qemu_savevm_state(f, bs, errp);
+    /* With mapped-ram, pages are written at offsets, not in the stream */
+    vm_state_size = migrate_mapped_ram() ? qemu_get_offset(f) :
+                                           qemu_file_transferred(f);
     ret2 = qemu_fclose(f);
     if (ret < 0) {
         goto the_end;
@@ -3278,6 +3710,11 @@ bool load_snapshot(const char *name, const char *vmstate,
         return false;
     }
 
+    if (migrate_mapped_ram_lazy_load()) {
+        error_setg(errp, "Snapshots cannot be loaded lazily");
+        return false;
+    }
+
     /* Don't even try to load empty VM states */
     ret = bdrv_snapshot_find(bs_vm_state, &sn, name);
     if (ret < 0) {
@@ -3311,6 +3748,7 @@ bool load_snapshot(const char *name, const char *vmstate,
 
     qemu_system_reset(SHUTDOWN_CAUSE_SNAPSHOT_LOAD);
     mis->from_src_file = f;
+    mis->loading_snapshot = true;
 
     if (!yank_register_instance(MIGRATION_YANK_INSTANCE, errp)) {
         ret = -EINVAL;
@@ -125,10 +125,25 @@ void hmp_sync_profile(Monitor *mon, const QDict *qdict)
     if (op == NULL) {
         bool on = qsp_is_enabled();
 
-        monitor_printf(mon, "sync-profile is %s\n", on ? "on" : "off");
+        monitor_printf(mon, "sync-profile is %s", on ? "on" : "off");
+        if (on && qsp_get_sample_period() > 1) {
+            monitor_printf(mon, ", sampling 1 in %u events",
+                           qsp_get_sample_period());
+        }
+        monitor_printf(mon, "\n");
         return;
     }
     if (!strcmp(op, "on")) {
+        int64_t period = qdict_get_try_int(qdict, "period", 1);
+
+        if (period < 1 || period > UINT_MAX) {
+            Error *err = NULL;
+
+            error_setg(&err, "invalid sampling period %" PRId64, period);
+            hmp_handle_error(mon, err);
+            return;
+        }
+        qsp_set_sample_period(period);
         qsp_enable();
     } else if (!strcmp(op, "off")) {
         qsp_disable();
@@ -151,6 +151,8 @@ typedef struct {
     QemuMutex qmp_queue_lock;
     /* Input queue that holds all the parsed QMP requests */
     GQueue *qmp_requests;
+    /* An in-band request was dequeued and has not been responded to yet */
+    bool qmp_request_in_flight;
 } MonitorQMP;
 
 /**
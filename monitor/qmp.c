@@ -31,6 +31,7 @@
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qjson.h"
 #include "qapi/qmp/qlist.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 
 /*
@@ -157,8 +158,9 @@ static void monitor_qmp_respond(MonitorQMP *mon, QDict *rsp)
 }
 
 /*
- * Runs outside of coroutine context for OOB commands, but in
- * coroutine context for everything else.
+ * Runs outside of coroutine context for OOB commands and for read-only
+ * commands executed in the I/O thread, but in coroutine context for
+ * everything else.
  */
 static void monitor_qmp_dispatch(MonitorQMP *mon, QObject *req)
 {
@@ -300,6 +302,7 @@ void coroutine_fn monitor_qmp_dispatcher_co(void *data)
          * qmp_qmp_capabilities() can change it.
          */
         oob_enabled = qmp_oob_enabled(mon);
+        mon->qmp_request_in_flight = true;
         if (oob_enabled
             && mon->qmp_requests->length == QMP_REQ_QUEUE_LEN_MAX - 1) {
             monitor_resume(&mon->common);
@@ -342,6 +345,10 @@ void coroutine_fn monitor_qmp_dispatcher_co(void *data)
             qobject_unref(rsp);
         }
 
+        WITH_QEMU_LOCK_GUARD(&mon->qmp_queue_lock) {
+            mon->qmp_request_in_flight = false;
+        }
+
         if (!oob_enabled) {
             monitor_resume(&mon->common);
         }
@@ -361,11 +368,31 @@ void qmp_dispatcher_co_wake(void)
     }
 }
 
+/*
+ * Can @qdict be executed right away in the monitor I/O thread?
+ * Read-only commands can, unless in-band requests that came before
+ * are still pending, because responses must come in order.
+ * Caller must hold mon->qmp_queue_lock.
+ */
+static bool qmp_can_run_read_only_locked(MonitorQMP *mon, QDict *qdict)
+{
+    const char *command = qdict_get_try_str(qdict, "execute");
+    const QmpCommand *cmd;
+
+    if (!mon->common.use_io_thread || !command ||
+        mon->qmp_request_in_flight || !g_queue_is_empty(mon->qmp_requests)) {
+        return false;
+    }
+    cmd = qmp_find_command(mon->commands, command);
+    return cmd && (cmd->options & QCO_READ_ONLY);
+}
+
 static void handle_qmp_command(void *opaque, QObject *req, Error *err)
 {
     MonitorQMP *mon = opaque;
     QDict *qdict = qobject_to(QDict, req);
     QMPRequest *req_obj;
+    bool read_only = false;
 
     assert(!req != !err);
 
@@ -390,6 +417,32 @@ static void handle_qmp_command(void *opaque, QObject *req, Error *err)
         return;
     }
 
+    /*
+     * Read-only commands are executed right away, without the BQL.
+     * Further requests from this monitor are only parsed once we're
+     * done, so they can't overtake it.
+     */
+    if (qdict) {
+        WITH_QEMU_LOCK_GUARD(&mon->qmp_queue_lock) {
+            read_only = qmp_can_run_read_only_locked(mon, qdict);
+        }
+    }
+    if (read_only) {
+        if (trace_event_get_state(TRACE_MONITOR_QMP_CMD_READ_ONLY)) {
+            QObject *id = qdict_get(qdict, "id");
+            GString *id_json;
+
+            id_json = id ? qobject_to_json(id) : g_string_new(NULL);
+            trace_monitor_qmp_cmd_read_only(id_json->str);
+            g_string_free(id_json, true);
+        }
+        WITH_RCU_READ_LOCK_GUARD() {
+            monitor_qmp_dispatch(mon, req);
+        }
+        qobject_unref(req);
+        return;
+    }
+
     req_obj = g_new0(QMPRequest, 1);
     req_obj->mon = mon;
     req_obj->req = req;
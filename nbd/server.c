@@ -82,9 +82,16 @@ typedef struct NBDRequestData NBDRequestData;
 struct NBDRequestData {
     NBDClient *client;
     uint8_t *data;
+    size_t read_size; /* size of @data when it holds a read payload */
     bool complete;
 };
 
+/* Read payloads smaller than this are copied even with zero copy enabled */
+#define NBD_ZERO_COPY_MIN (16 * KiB)
+
+/* Amount of payload buffers that may wait for the kernel to send them */
+#define NBD_ZERO_COPY_MAX_PENDING (32 * MiB)
+
 struct NBDExport {
     BlockExport common;
 
@@ -138,6 +145,15 @@ struct NBDClient {
     CoMutex send_lock;
     Coroutine *send_coroutine;
 
+    /*
+     * With zero copy, the kernel goes on reading the payload of read
+     * replies after the write returns: their buffers are kept in
+     * zero_copy_bufs until the next flush of the channel.
+     */
+    bool zero_copy;
+    GSList *zero_copy_bufs; /* protected by lock */
+    size_t zero_copy_pending; /* protected by lock */
+
     bool read_yielding; /* protected by lock */
     bool quiescing; /* protected by lock */
 
@@ -1537,6 +1553,7 @@ void nbd_client_put(NBDClient *client)
             blk_exp_unref(&client->exp->common);
         }
         g_free(client->contexts.bitmaps);
+        g_slist_free_full(client->zero_copy_bufs, qemu_vfree);
         qemu_mutex_destroy(&client->lock);
         g_free(client);
     }
@@ -1609,7 +1626,11 @@ static void nbd_request_put(NBDRequestData *req)
 {
     NBDClient *client = req->client;
 
-    if (req->data) {
+    if (req->read_size && client->zero_copy) {
+        client->zero_copy_bufs = g_slist_prepend(client->zero_copy_bufs,
+                                                 req->data);
+        client->zero_copy_pending += req->read_size;
+    } else if (req->data) {
         qemu_vfree(req->data);
     }
     g_free(req);
@@ -1987,8 +2008,46 @@ const BlockExportDriver blk_exp_nbd = {
     .request_shutdown   = nbd_export_request_shutdown,
 };
 
-static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
-                                        unsigned niov, Error **errp)
+/*
+ * Wait for the kernel to be done with the payloads sent so far, and free
+ * the buffers of the requests that are over.  Called with send_lock held,
+ * so that all the buffers in zero_copy_bufs have been written before.
+ */
+static int coroutine_fn nbd_co_zero_copy_flush(NBDClient *client,
+                                               Error **errp)
+{
+    GSList *bufs;
+    size_t pending;
+
+    WITH_QEMU_LOCK_GUARD(&client->lock) {
+        if (client->zero_copy_pending < NBD_ZERO_COPY_MAX_PENDING) {
+            return 0;
+        }
+    }
+
+    if (qio_channel_flush(client->ioc, errp) < 0) {
+        return -EIO;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&client->lock) {
+        bufs = client->zero_copy_bufs;
+        pending = client->zero_copy_pending;
+        client->zero_copy_bufs = NULL;
+        client->zero_copy_pending = 0;
+    }
+
+    trace_nbd_co_zero_copy_flush(client, pending);
+    g_slist_free_full(bufs, qemu_vfree);
+    return 0;
+}
+
+/*
+ * If @payload is true, the last element of @iov is the payload of a read
+ * reply.  With zero copy, it is written separately with MSG_ZEROCOPY.
+ */
+static int coroutine_fn nbd_co_send_iov_full(NBDClient *client,
+                                             struct iovec *iov, unsigned niov,
+                                             bool payload, Error **errp)
 {
     int ret;
 
@@ -1996,7 +2055,23 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
 
-    ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
+    if (client->zero_copy && payload &&
+        iov[niov - 1].iov_len >= NBD_ZERO_COPY_MIN) {
+        ret = qio_channel_writev_all(client->ioc, iov, niov - 1, errp);
+        if (ret == 0) {
+            ret = qio_channel_writev_full_all(client->ioc, &iov[niov - 1], 1,
+                                              NULL, 0,
+                                              QIO_CHANNEL_WRITE_FLAG_ZERO_COPY,
+                                              errp);
+        }
+    } else {
+        ret = qio_channel_writev_all(client->ioc, iov, niov, errp);
+    }
+    ret = ret < 0 ? -EIO : 0;
+
+    if (ret == 0 && client->zero_copy) {
+        ret = nbd_co_zero_copy_flush(client, errp);
+    }
 
     client->send_coroutine = NULL;
     qemu_co_mutex_unlock(&client->send_lock);
@@ -2004,6 +2079,12 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
+                                        unsigned niov, Error **errp)
+{
+    return nbd_co_send_iov_full(client, iov, niov, false, errp);
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t cookie)
 {
@@ -2035,7 +2116,7 @@ static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
                                    nbd_err_lookup(nbd_err), len);
     set_be_simple_reply(&reply, nbd_err, request->cookie);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_iov_full(client, iov, 2, len > 0, errp);
 }
 
 /*
@@ -2116,7 +2197,7 @@ static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
                  NBD_REPLY_TYPE_OFFSET_DATA, request);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 3, errp);
+    return nbd_co_send_iov_full(client, iov, 3, true, errp);
 }
 
 static int coroutine_fn nbd_co_send_chunk_error(NBDClient *client,
@@ -2722,6 +2803,9 @@ static int coroutine_fn nbd_co_receive_request(NBDRequestData *req,
             error_setg(errp, "No memory");
             return -ENOMEM;
         }
+        if (request->type == NBD_CMD_READ) {
+            req->read_size = request->len;
+        }
     }
     if (payload_len) {
         if (payload_okay) {
@@ -3174,10 +3258,13 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
  * Create a new client listener using the given channel @sioc.
  * Begin servicing it in a coroutine.  When the connection closes, call
  * @close_fn with an indication of whether the client completed negotiation.
+ * If @zero_copy is true, replies to reads are sent with MSG_ZEROCOPY when
+ * the host supports it and the connection does not use TLS.
  */
 void nbd_client_new(QIOChannelSocket *sioc,
                     QCryptoTLSCreds *tlscreds,
                     const char *tlsauthz,
+                    bool zero_copy,
                     void (*close_fn)(NBDClient *, bool))
 {
     NBDClient *client;
@@ -3197,6 +3284,10 @@ void nbd_client_new(QIOChannelSocket *sioc,
     client->ioc = QIO_CHANNEL(sioc);
     object_ref(OBJECT(client->ioc));
     client->close_fn = close_fn;
+    if (zero_copy && !tlscreds) {
+        client->zero_copy = qio_channel_socket_enable_zero_copy(sioc);
+    }
+    trace_nbd_client_new(client, client->zero_copy);
 
     co = qemu_coroutine_create(nbd_co_client_start, client);
     qemu_coroutine_enter(co);
@@ -52,20 +52,62 @@ typedef struct AFXDPState {
     uint32_t             n_queues;
     uint32_t             xdp_flags;
     bool                 inhibit;
+
+    /* NULL when polled by the main loop */
+    AioContext           *ctx;
+
+    uint32_t             busy_poll_budget;
 } AFXDPState;
 
 #define AF_XDP_BATCH_SIZE 64
 
+/* How long a blocking syscall may busy poll the device queue. */
+#define AF_XDP_BUSY_POLL_USECS 20
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
 static void af_xdp_send(void *opaque);
 static void af_xdp_writable(void *opaque);
 
+/*
+ * Let the kernel process the Rx side.  Needed when the fill ring ran dry
+ * with need_wakeup set, and on every poll with preferred busy polling,
+ * where the syscall is what runs the driver's NAPI loop.
+ */
+static void af_xdp_kick_rx(AFXDPState *s)
+{
+    if (s->busy_poll_budget || xsk_ring_prod__needs_wakeup(&s->fq)) {
+        recvfrom(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+/* AioContext polling: check for received packets without a syscall. */
+static bool af_xdp_io_poll(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    af_xdp_kick_rx(s);
+
+    return xsk_cons_nb_avail(&s->rx, 1) > 0;
+}
+
 /* Set the event-loop handlers for the af-xdp backend. */
 static void af_xdp_update_fd_handler(AFXDPState *s)
 {
-    qemu_set_fd_handler(xsk_socket__fd(s->xsk),
-                        s->read_poll ? af_xdp_send : NULL,
-                        s->write_poll ? af_xdp_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll ? af_xdp_send : NULL;
+    IOHandler *fd_write = s->write_poll ? af_xdp_writable : NULL;
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, xsk_socket__fd(s->xsk), fd_read, fd_write,
+                           s->read_poll ? af_xdp_io_poll : NULL, fd_read, s);
+    } else {
+        qemu_set_fd_handler(xsk_socket__fd(s->xsk), fd_read, fd_write, s);
+    }
 }
 
 /* Update the read handler. */
@@ -103,6 +145,10 @@ static void af_xdp_complete_tx(AFXDPState *s)
     uint32_t done, i;
     uint64_t *addr;
 
+    if (!s->outstanding_tx) {
+        return;
+    }
+
     done = xsk_ring_cons__peek(&s->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx);
 
     for (i = 0; i < done; i++) {
@@ -116,6 +162,22 @@ static void af_xdp_complete_tx(AFXDPState *s)
     }
 }
 
+/*
+ * Tell the kernel about new Tx descriptors.  Only fall back to polling for
+ * POLLOUT if the kick could not be delivered right now.
+ */
+static void af_xdp_kick_tx(AFXDPState *s)
+{
+    if (!xsk_ring_prod__needs_wakeup(&s->tx)) {
+        return;
+    }
+
+    if (sendto(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+        (errno == EAGAIN || errno == EBUSY || errno == ENOBUFS)) {
+        af_xdp_write_poll(s, true);
+    }
+}
+
 /*
  * The fd_write() callback, invoked if the fd is marked as writable
  * after a poll.
@@ -174,13 +236,53 @@ static ssize_t af_xdp_receive(NetClientState *nc,
     xsk_ring_prod__submit(&s->tx, 1);
     s->outstanding_tx++;
 
-    if (xsk_ring_prod__needs_wakeup(&s->tx)) {
-        af_xdp_write_poll(s, true);
-    }
+    af_xdp_kick_tx(s);
 
     return size;
 }
 
+/* Fill several Tx descriptors and submit them with a single ring update. */
+static int af_xdp_receive_batch(NetClientState *nc, const struct iovec *iov,
+                                const int *iovcnt, int count)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    const struct iovec *p = iov;
+    struct xdp_desc *desc;
+    uint32_t idx, i, n;
+
+    /* Try to recover buffers that are already sent. */
+    af_xdp_complete_tx(s);
+
+    /* Oversized packets are left to af_xdp_receive(), which drops them. */
+    for (n = 0; n < count && n < s->n_pool; p += iovcnt[n], n++) {
+        if (iov_size(p, iovcnt[n]) > XSK_UMEM__DEFAULT_FRAME_SIZE) {
+            break;
+        }
+    }
+    n = MIN(n, xsk_prod_nb_free(&s->tx, n));
+
+    if (!n || !xsk_ring_prod__reserve(&s->tx, n, &idx)) {
+        /* Fall back to af_xdp_receive(), which polls until we can write. */
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        desc = xsk_ring_prod__tx_desc(&s->tx, idx++);
+        desc->addr = s->pool[--s->n_pool];
+        desc->len = iov_to_buf(iov, iovcnt[i], 0,
+                               xsk_umem__get_data(s->buffer, desc->addr),
+                               XSK_UMEM__DEFAULT_FRAME_SIZE);
+        iov += iovcnt[i];
+    }
+
+    xsk_ring_prod__submit(&s->tx, n);
+    s->outstanding_tx += n;
+
+    af_xdp_kick_tx(s);
+
+    return n;
+}
+
 /*
  * Complete a previous send (backend --> guest) and enable the
  * fd_read callback.
@@ -223,9 +325,12 @@ static void af_xdp_send(void *opaque)
 
     n_rx = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH_SIZE, &idx);
     if (!n_rx) {
+        af_xdp_kick_rx(s);
         return;
     }
 
+    qemu_send_burst_begin(&s->nc);
+
     for (i = 0; i < n_rx; i++) {
         const struct xdp_desc *desc;
         struct iovec iov;
@@ -252,6 +357,8 @@ static void af_xdp_send(void *opaque)
         }
     }
 
+    qemu_send_burst_end(&s->nc);
+
     /* Release actually sent descriptors and try to re-fill. */
     xsk_ring_cons__release(&s->rx, n_rx);
     af_xdp_fq_refill(s, AF_XDP_BATCH_SIZE);
@@ -393,16 +500,53 @@ static int af_xdp_socket_create(AFXDPState *s,
 
     s->xdp_flags = cfg.xdp_flags;
 
+    if (s->busy_poll_budget) {
+        int fd = xsk_socket__fd(s->xsk);
+        int prefer = 1, usecs = AF_XDP_BUSY_POLL_USECS;
+        int budget = s->busy_poll_budget;
+
+        if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                       &prefer, sizeof(prefer)) ||
+            setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+                       &usecs, sizeof(usecs)) ||
+            setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+                       &budget, sizeof(budget))) {
+            error_setg_errno(errp, errno,
+                             "failed to enable busy polling for %s "
+                             "queue_id: %d", s->ifname, queue_id);
+            return -1;
+        }
+    }
+
     return 0;
 }
 
 /* NetClientInfo methods. */
+/* Move the socket handlers to another event loop. */
+static void af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    bool read_poll = s->read_poll;
+    bool write_poll = s->write_poll;
+
+    s->read_poll = false;
+    s->write_poll = false;
+    af_xdp_update_fd_handler(s);
+
+    s->ctx = ctx == qemu_get_aio_context() ? NULL : ctx;
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    af_xdp_update_fd_handler(s);
+}
+
 static NetClientInfo net_af_xdp_info = {
     .type = NET_CLIENT_DRIVER_AF_XDP,
     .size = sizeof(AFXDPState),
     .receive = af_xdp_receive,
+    .receive_batch = af_xdp_receive_batch,
     .poll = af_xdp_poll,
     .cleanup = af_xdp_cleanup,
+    .set_aio_context = af_xdp_set_aio_context,
 };
 
 static int *parse_socket_fds(const char *sock_fds_str,
@@ -491,6 +635,8 @@ int net_init_af_xdp(const Netdev *netdev,
         pstrcpy(s->ifname, sizeof(s->ifname), opts->ifname);
         s->ifindex = ifindex;
         s->n_queues = queues;
+        s->busy_poll_budget = opts->has_busy_poll_budget
+                              ? opts->busy_poll_budget : 0;
 
         if (af_xdp_umem_create(s, sock_fds ? sock_fds[i] : -1, errp)
             || af_xdp_socket_create(s, opts, errp)) {
@@ -0,0 +1,352 @@
+/*
+ * Generic receive offload
+ *
+ * Only in-order TCP segments of the same flow carrying nothing but ACK,
+ * and PSH on the last one, are coalesced, with the same restrictions as
+ * Linux GRO: identical headers apart from the sequence number, IP id and
+ * window, and no IP options or IPv6 extension headers.  Segments with a
+ * bad checksum are passed through untouched, which lets the coalesced
+ * frame be handed over with a partial checksum.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/main-loop.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "net/gro.h"
+
+#define NET_GRO_MAX_FLOWS   8
+#define NET_GRO_MAX_SIZE    (ETH_HLEN + ETH_MAX_IP_DGRAM_LEN)
+
+#define NET_GRO_IP6_HLEN    40
+#define NET_GRO_TCP_HLEN    20
+
+typedef struct NetGroPkt {
+    bool ipv6;
+    size_t l4_off;      /* offset of the TCP header */
+    size_t hdr_len;     /* Ethernet, IP and TCP headers */
+    size_t size;        /* without Ethernet padding */
+    uint32_t seq;
+    uint8_t flags;
+} NetGroPkt;
+
+typedef struct NetGroFlow {
+    uint8_t *buf;
+    NetGroPkt head;     /* head.size grows as segments are appended */
+    uint32_t next_seq;
+    uint16_t mss;
+    unsigned int segs;
+    bool closed;
+} NetGroFlow;
+
+struct NetGro {
+    NetGroDeliver *deliver;
+    void *opaque;
+    QEMUBH *bh;
+    bool tcp4;
+    bool tcp6;
+    /* Oldest first; buffers of unused slots are kept for reuse */
+    NetGroFlow flows[NET_GRO_MAX_FLOWS];
+    unsigned int n_flows;
+};
+
+static bool net_gro_parse(NetGro *gro, const uint8_t *buf, size_t size,
+                          NetGroPkt *pkt)
+{
+    size_t ip_end;
+
+    if (size < ETH_HLEN) {
+        return false;
+    }
+
+    switch (lduw_be_p(buf + 12)) {
+    case ETH_P_IP:
+        if (!gro->tcp4 ||
+            size < ETH_HLEN + sizeof(struct ip_header) ||
+            buf[ETH_HLEN] != 0x45 ||
+            (lduw_be_p(buf + ETH_HLEN + 6) & ~IP_DF) != 0 ||
+            buf[ETH_HLEN + 9] != IP_PROTO_TCP) {
+            return false;
+        }
+        pkt->ipv6 = false;
+        pkt->l4_off = ETH_HLEN + sizeof(struct ip_header);
+        ip_end = ETH_HLEN + lduw_be_p(buf + ETH_HLEN + 2);
+        break;
+    case ETH_P_IPV6:
+        if (!gro->tcp6 ||
+            size < ETH_HLEN + NET_GRO_IP6_HLEN ||
+            (buf[ETH_HLEN] >> 4) != 6 ||
+            buf[ETH_HLEN + 6] != IP_PROTO_TCP) {
+            return false;
+        }
+        pkt->ipv6 = true;
+        pkt->l4_off = ETH_HLEN + NET_GRO_IP6_HLEN;
+        ip_end = pkt->l4_off + lduw_be_p(buf + ETH_HLEN + 4);
+        break;
+    default:
+        return false;
+    }
+
+    if (ip_end > size || ip_end < pkt->l4_off + NET_GRO_TCP_HLEN) {
+        return false;
+    }
+
+    pkt->hdr_len = pkt->l4_off + (buf[pkt->l4_off + 12] >> 4) * 4;
+    if (pkt->hdr_len < pkt->l4_off + NET_GRO_TCP_HLEN ||
+        pkt->hdr_len > ip_end) {
+        return false;
+    }
+
+    pkt->size = ip_end;
+    pkt->seq = ldl_be_p(buf + pkt->l4_off + 4);
+    pkt->flags = buf[pkt->l4_off + 13];
+    return true;
+}
+
+static uint32_t net_gro_pseudo_sum(const uint8_t *buf, const NetGroPkt *pkt,
+                                   size_t l4_len)
+{
+    if (pkt->ipv6) {
+        return net_checksum_add(32, (uint8_t *)buf + ETH_HLEN + 8) +
+               IP_PROTO_TCP + l4_len;
+    } else {
+        return net_checksum_add(8, (uint8_t *)buf + ETH_HLEN + 12) +
+               IP_PROTO_TCP + l4_len;
+    }
+}
+
+static bool net_gro_csum_ok(const uint8_t *buf, const NetGroPkt *pkt)
+{
+    size_t l4_len = pkt->size - pkt->l4_off;
+    uint32_t sum;
+
+    if (!pkt->ipv6 &&
+        net_raw_checksum((uint8_t *)buf + ETH_HLEN,
+                         sizeof(struct ip_header)) != 0) {
+        return false;
+    }
+
+    sum = net_gro_pseudo_sum(buf, pkt, l4_len) +
+          net_checksum_add(l4_len, (uint8_t *)buf + pkt->l4_off);
+    return net_checksum_finish(sum) == 0;
+}
+
+static bool net_gro_same_flow(const NetGroFlow *flow, const uint8_t *buf,
+                              const NetGroPkt *pkt)
+{
+    const uint8_t *h = flow->buf;
+
+    if (pkt->ipv6 != flow->head.ipv6 || memcmp(h, buf, ETH_HLEN)) {
+        return false;
+    }
+
+    if (pkt->ipv6) {
+        /* Traffic class, flow label, hop limit and addresses */
+        if (memcmp(h + ETH_HLEN, buf + ETH_HLEN, 4) ||
+            memcmp(h + ETH_HLEN + 6, buf + ETH_HLEN + 6, 34)) {
+            return false;
+        }
+    } else {
+        /* TOS, DF, TTL and addresses */
+        if (h[ETH_HLEN + 1] != buf[ETH_HLEN + 1] ||
+            memcmp(h + ETH_HLEN + 6, buf + ETH_HLEN + 6, 4) ||
+            memcmp(h + ETH_HLEN + 12, buf + ETH_HLEN + 12, 8)) {
+            return false;
+        }
+    }
+
+    /* Ports */
+    return !memcmp(h + pkt->l4_off, buf + pkt->l4_off, 4);
+}
+
+static bool net_gro_can_start(const uint8_t *buf, const NetGroPkt *pkt)
+{
+    return pkt->flags == TH_ACK &&
+           pkt->size > pkt->hdr_len &&
+           pkt->size <= NET_GRO_MAX_SIZE &&
+           net_gro_csum_ok(buf, pkt);
+}
+
+static bool net_gro_can_merge(const NetGroFlow *flow, const uint8_t *buf,
+                              const NetGroPkt *pkt)
+{
+    const NetGroPkt *head = &flow->head;
+    size_t payload = pkt->size - pkt->hdr_len;
+    size_t th = pkt->l4_off;
+
+    return !flow->closed &&
+           (pkt->flags & ~TH_PUSH) == TH_ACK &&
+           pkt->seq == flow->next_seq &&
+           payload > 0 && payload <= flow->mss &&
+           head->size + payload <= NET_GRO_MAX_SIZE &&
+           pkt->hdr_len == head->hdr_len &&
+           /* Acknowledgment number and options */
+           ldl_be_p(buf + th + 8) == ldl_be_p(flow->buf + th + 8) &&
+           !memcmp(buf + th + NET_GRO_TCP_HLEN,
+                   flow->buf + th + NET_GRO_TCP_HLEN,
+                   pkt->hdr_len - th - NET_GRO_TCP_HLEN) &&
+           net_gro_csum_ok(buf, pkt);
+}
+
+static void net_gro_start(NetGro *gro, const uint8_t *buf,
+                          const NetGroPkt *pkt)
+{
+    NetGroFlow *flow = &gro->flows[gro->n_flows++];
+
+    if (!flow->buf) {
+        flow->buf = g_malloc(NET_GRO_MAX_SIZE);
+    }
+    memcpy(flow->buf, buf, pkt->size);
+    flow->head = *pkt;
+    flow->mss = pkt->size - pkt->hdr_len;
+    flow->next_seq = pkt->seq + flow->mss;
+    flow->segs = 1;
+    flow->closed = false;
+
+    qemu_bh_schedule(gro->bh);
+}
+
+static void net_gro_append(NetGroFlow *flow, const uint8_t *buf,
+                           const NetGroPkt *pkt)
+{
+    size_t payload = pkt->size - pkt->hdr_len;
+    uint8_t *th = flow->buf + flow->head.l4_off;
+
+    memcpy(flow->buf + flow->head.size, buf + pkt->hdr_len, payload);
+    flow->head.size += payload;
+    flow->next_seq += payload;
+    flow->segs++;
+
+    /* The window advertised by the last segment is the current one */
+    memcpy(th + 14, buf + pkt->l4_off + 14, 2);
+    if ((pkt->flags & TH_PUSH) || payload < flow->mss) {
+        th[13] |= pkt->flags & TH_PUSH;
+        flow->closed = true;
+    }
+}
+
+/* Returns false, keeping the flow, if it cannot be delivered now */
+static bool net_gro_flush_flow(NetGro *gro, unsigned int i)
+{
+    NetGroFlow *flow = &gro->flows[i];
+    const NetGroPkt *head = &flow->head;
+    struct virtio_net_hdr hdr = {};
+    uint8_t *buf = flow->buf;
+
+    if (flow->segs > 1) {
+        size_t l4_len = head->size - head->l4_off;
+
+        if (head->ipv6) {
+            stw_be_p(buf + ETH_HLEN + 4, l4_len);
+        } else {
+            stw_be_p(buf + ETH_HLEN + 2, head->size - ETH_HLEN);
+            stw_be_p(buf + ETH_HLEN + 10, 0);
+            stw_be_p(buf + ETH_HLEN + 10,
+                     net_raw_checksum(buf + ETH_HLEN,
+                                      sizeof(struct ip_header)));
+        }
+
+        /* The receiver completes the checksum from the pseudo header */
+        stw_be_p(buf + head->l4_off + 16,
+                 ~net_checksum_finish(net_gro_pseudo_sum(buf, head, l4_len)));
+
+        hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.gso_type = head->ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6 :
+                                    VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr.hdr_len = head->hdr_len;
+        hdr.gso_size = flow->mss;
+        hdr.csum_start = head->l4_off;
+        hdr.csum_offset = 16;
+    }
+
+    if (gro->deliver(gro->opaque, flow->segs > 1 ? &hdr : NULL,
+                     buf, head->size) == 0) {
+        return false;
+    }
+
+    memmove(flow, flow + 1, (gro->n_flows - i - 1) * sizeof(*flow));
+    gro->n_flows--;
+    gro->flows[gro->n_flows].buf = buf;
+    return true;
+}
+
+bool net_gro_flush(NetGro *gro)
+{
+    while (gro->n_flows) {
+        if (!net_gro_flush_flow(gro, 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void net_gro_bh(void *opaque)
+{
+    net_gro_flush(opaque);
+}
+
+ssize_t net_gro_receive(NetGro *gro, const uint8_t *buf, size_t size)
+{
+    NetGroPkt pkt;
+    unsigned int i;
+
+    if (!net_gro_parse(gro, buf, size, &pkt)) {
+        return gro->deliver(gro->opaque, NULL, buf, size);
+    }
+
+    for (i = 0; i < gro->n_flows; i++) {
+        if (net_gro_same_flow(&gro->flows[i], buf, &pkt)) {
+            if (net_gro_can_merge(&gro->flows[i], buf, &pkt)) {
+                net_gro_append(&gro->flows[i], buf, &pkt);
+                return size;
+            }
+
+            /* Whatever comes next must not overtake the flow */
+            if (!net_gro_flush_flow(gro, i)) {
+                return 0;
+            }
+            break;
+        }
+    }
+
+    if (!net_gro_can_start(buf, &pkt)) {
+        return gro->deliver(gro->opaque, NULL, buf, size);
+    }
+
+    if (gro->n_flows == NET_GRO_MAX_FLOWS && !net_gro_flush_flow(gro, 0)) {
+        return 0;
+    }
+
+    net_gro_start(gro, buf, &pkt);
+    return size;
+}
+
+NetGro *net_gro_new(bool tcp4, bool tcp6, NetGroDeliver *deliver,
+                    void *opaque, MemReentrancyGuard *reentrancy_guard)
+{
+    NetGro *gro = g_new0(NetGro, 1);
+
+    gro->tcp4 = tcp4;
+    gro->tcp6 = tcp6;
+    gro->deliver = deliver;
+    gro->opaque = opaque;
+    gro->bh = qemu_bh_new_guarded(net_gro_bh, gro, reentrancy_guard);
+    return gro;
+}
+
+void net_gro_free(NetGro *gro)
+{
+    unsigned int i;
+
+    if (!gro) {
+        return;
+    }
+
+    qemu_bh_delete(gro->bh);
+    for (i = 0; i < NET_GRO_MAX_FLOWS; i++) {
+        g_free(gro->flows[i].buf);
+    }
+    g_free(gro);
+}
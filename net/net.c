@@ -602,6 +602,23 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+bool qemu_can_set_aio_context(NetClientState *nc)
+{
+    return nc && nc->info->set_aio_context;
+}
+
+/*
+ * Move the backend's event handlers to @ctx, or back to the main loop if
+ * @ctx is the main AioContext.  The caller must make sure that the peer only
+ * sends and receives packets from @ctx afterwards.
+ */
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (qemu_can_set_aio_context(nc)) {
+        nc->info->set_aio_context(nc, ctx);
+    }
+}
+
 int qemu_can_receive_packet(NetClientState *nc)
 {
     if (nc->receive_disabled) {
@@ -858,9 +875,11 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+static ssize_t qemu_sendv_packet_async_with_flags(NetClientState *sender,
+                                                  unsigned flags,
+                                                  const struct iovec *iov,
+                                                  int iovcnt,
+                                                  NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     size_t size = iov_size(iov, iovcnt);
@@ -876,30 +895,108 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
 
     /* Let filters handle the packet first */
     ret = filter_receive_iov(sender, NET_FILTER_DIRECTION_TX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags, iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     ret = filter_receive_iov(sender->peer, NET_FILTER_DIRECTION_RX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags, iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     queue = sender->peer->incoming_queue;
 
-    return qemu_net_queue_send_iov(queue, sender,
-                                   QEMU_NET_PACKET_FLAG_NONE,
+    return qemu_net_queue_send_iov(queue, sender, flags,
                                    iov, iovcnt, sent_cb);
 }
 
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_NONE,
+                                              iov, iovcnt, sent_cb);
+}
+
+/*
+ * Like qemu_sendv_packet_async(), but the buffers that @iov points to stay
+ * valid until @sent_cb runs.  If the packet cannot be delivered right away
+ * it is queued by reference, so that it is not copied in QEMU at all.
+ */
+ssize_t qemu_sendv_packet_zerocopy(NetClientState *sender,
+                                   const struct iovec *iov, int iovcnt,
+                                   NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_ZEROCOPY,
+                                              iov, iovcnt, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+/*
+ * Hand the first packets of @iov straight to the peer's receive_batch
+ * callback.  This is only possible while nothing could intercept or reorder
+ * them: no filters, no hub and an empty peer queue.  Returns the number of
+ * packets consumed, possibly 0; the caller sends the remaining ones with
+ * qemu_sendv_packet_async().
+ */
+int qemu_sendv_packet_batch(NetClientState *sender, const struct iovec *iov,
+                            const int *iovcnt, int count)
+{
+    NetClientState *peer = sender->peer;
+    int i, n;
+
+    if (sender->link_down || !peer) {
+        return count;
+    }
+
+    if (!peer->info->receive_batch || peer->link_down ||
+        peer->receive_disabled ||
+        !QTAILQ_EMPTY(&sender->filters) || !QTAILQ_EMPTY(&peer->filters) ||
+        !qemu_net_queue_idle(peer->incoming_queue) ||
+        !qemu_can_send_packet(sender)) {
+        return 0;
+    }
+
+    /* Oversized packets are dropped by qemu_sendv_packet_async() */
+    for (i = 0, n = 0; n < count; i += iovcnt[n], n++) {
+        if (iov_size(&iov[i], iovcnt[n]) > NET_BUFSIZE) {
+            break;
+        }
+    }
+    if (!n) {
+        return 0;
+    }
+
+    return peer->info->receive_batch(peer, iov, iovcnt, n);
+}
+
+void qemu_send_burst_begin(NetClientState *sender)
+{
+    NetClientState *peer = sender->peer;
+
+    if (peer && peer->info->receive_burst) {
+        peer->info->receive_burst(peer, true);
+    }
+}
+
+void qemu_send_burst_end(NetClientState *sender)
+{
+    NetClientState *peer = sender->peer;
+
+    if (peer && peer->info->receive_burst) {
+        peer->info->receive_burst(peer, false);
+    }
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
@@ -23,6 +23,7 @@
 
 #include "qemu/osdep.h"
 #include "net/queue.h"
+#include "qemu/iov.h"
 #include "qemu/queue.h"
 #include "net/net.h"
 
@@ -38,6 +39,9 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * Packets are copied when they are queued, except for those sent with
+ * QEMU_NET_PACKET_FLAG_ZEROCOPY and a sent callback.
  */
 
 struct NetPacket {
@@ -46,6 +50,9 @@ struct NetPacket {
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    /* The sender's buffers for zero-copy packets, data is empty then */
+    struct iovec *iov;
+    int iovcnt;
     uint8_t data[];
 };
 
@@ -84,12 +91,18 @@ void qemu_del_net_queue(NetQueue *queue)
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+        qemu_net_packet_free(packet);
     }
 
     g_free(queue);
 }
 
+static void qemu_net_packet_free(NetPacket *packet)
+{
+    g_free(packet->iov);
+    g_free(packet);
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -107,6 +120,8 @@ static void qemu_net_queue_append(NetQueue *queue,
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
+    packet->iov = NULL;
+    packet->iovcnt = 0;
     memcpy(packet->data, buf, size);
 
     queue->nq_count++;
@@ -127,6 +142,21 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
+
+    if ((flags & QEMU_NET_PACKET_FLAG_ZEROCOPY) && sent_cb) {
+        packet = g_new(NetPacket, 1);
+        packet->sender = sender;
+        packet->sent_cb = sent_cb;
+        packet->flags = flags;
+        packet->size = iov_size(iov, iovcnt);
+        packet->iov = g_memdup2(iov, iovcnt * sizeof(*iov));
+        packet->iovcnt = iovcnt;
+
+        queue->nq_count++;
+        QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+        return;
+    }
+
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
@@ -136,6 +166,8 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     packet->sent_cb = sent_cb;
     packet->flags = flags;
     packet->size = 0;
+    packet->iov = NULL;
+    packet->iovcnt = 0;
 
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
@@ -265,7 +297,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_packet_free(packet);
         }
     }
 }
@@ -283,11 +315,19 @@ bool qemu_net_queue_flush(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iov) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             packet->iov,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
@@ -298,7 +338,13 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_packet_free(packet);
     }
     return true;
 }
+
+/* True if a packet handed to the receiver now cannot overtake queued ones */
+bool qemu_net_queue_idle(NetQueue *queue)
+{
+    return !queue->delivering && QTAILQ_EMPTY(&queue->packets);
+}
@@ -350,3 +350,15 @@ int tap_fd_set_steering_ebpf(int fd, int prog_fd)
 
     return 0;
 }
+
+int tap_fd_set_filter_ebpf(int fd, int prog_fd)
+{
+    if (ioctl(fd, TUNSETFILTEREBPF, (void *) &prog_fd) != 0) {
+        error_report("Issue while setting TUNSETFILTEREBPF:"
+                     " %s with fd: %d, prog_fd: %d",
+                     strerror(errno), fd, prog_fd);
+        return -1;
+    }
+
+    return 0;
+}
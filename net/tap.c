@@ -62,6 +62,7 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    AioContext *ctx; /* NULL when polled by the main loop */
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -72,10 +73,14 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *fd_write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, fd_read, fd_write, NULL, NULL, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -133,6 +138,23 @@ static ssize_t tap_receive_iov(NetClientState *nc, const struct iovec *iov,
     return tap_write_packet(s, iovp, iovcnt);
 }
 
+/* One writev() per packet: tap has no multi-packet write */
+static int tap_receive_batch(NetClientState *nc, const struct iovec *iov,
+                             const int *iovcnt, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (tap_receive_iov(nc, iov, iovcnt[i]) == 0) {
+            /* tap_writable() flushes once the fd drains */
+            break;
+        }
+        iov += iovcnt[i];
+    }
+
+    return i;
+}
+
 static ssize_t tap_receive_raw(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -187,6 +209,8 @@ static void tap_send(void *opaque)
     int size;
     int packets = 0;
 
+    qemu_send_burst_begin(&s->nc);
+
     while (true) {
         uint8_t *buf = s->buf;
         uint8_t min_pkt[ETH_ZLEN];
@@ -228,6 +252,8 @@ static void tap_send(void *opaque)
             break;
         }
     }
+
+    qemu_send_burst_end(&s->nc);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -377,6 +403,14 @@ static bool tap_set_steering_ebpf(NetClientState *nc, int prog_fd)
     return tap_fd_set_steering_ebpf(s->fd, prog_fd) == 0;
 }
 
+static bool tap_set_filter_ebpf(NetClientState *nc, int prog_fd)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_DRIVER_TAP);
+
+    return tap_fd_set_filter_ebpf(s->fd, prog_fd) == 0;
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -386,12 +420,30 @@ int tap_get_fd(NetClientState *nc)
 
 /* fd support */
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    bool read_poll = s->read_poll;
+    bool write_poll = s->write_poll;
+
+    /* Remove the handlers from the old event loop */
+    s->read_poll = false;
+    s->write_poll = false;
+    tap_update_fd_handler(s);
+
+    s->ctx = ctx == qemu_get_aio_context() ? NULL : ctx;
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    tap_update_fd_handler(s);
+}
+
 static NetClientInfo net_tap_info = {
     .type = NET_CLIENT_DRIVER_TAP,
     .size = sizeof(TAPState),
     .receive = tap_receive,
     .receive_raw = tap_receive_raw,
     .receive_iov = tap_receive_iov,
+    .receive_batch = tap_receive_batch,
     .poll = tap_poll,
     .cleanup = tap_cleanup,
     .has_ufo = tap_has_ufo,
@@ -406,6 +458,8 @@ static NetClientInfo net_tap_info = {
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
     .set_steering_ebpf = tap_set_steering_ebpf,
+    .set_filter_ebpf = tap_set_filter_ebpf,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -12,6 +12,7 @@
 #include "clients.h"
 #include "net/vhost_net.h"
 #include "net/vhost-user.h"
+#include "hw/virtio/vhost.h"
 #include "hw/virtio/vhost-user.h"
 #include "chardev/char-fe.h"
 #include "qapi/error.h"
@@ -24,6 +25,7 @@
 typedef struct NetVhostUserState {
     NetClientState nc;
     CharBackend chr; /* only queue index 0 */
+    struct vhost_inflight *inflight; /* only queue index 0 */
     VhostUserState *vhost_user;
     VHostNetState *vhost_net;
     guint watch;
@@ -45,6 +47,13 @@ uint64_t vhost_user_get_acked_features(NetClientState *nc)
     return s->acked_features;
 }
 
+struct vhost_inflight *vhost_user_get_inflight(NetClientState *nc)
+{
+    NetVhostUserState *s = DO_UPCAST(NetVhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_DRIVER_VHOST_USER);
+    return s->inflight;
+}
+
 void vhost_user_save_acked_features(NetClientState *nc)
 {
     NetVhostUserState *s;
@@ -172,6 +181,9 @@ static void net_vhost_user_cleanup(NetClientState *nc)
             s->watch = 0;
         }
         qemu_chr_fe_deinit(&s->chr, true);
+        vhost_dev_free_inflight(s->inflight);
+        g_free(s->inflight);
+        s->inflight = NULL;
         if (s->vhost_user) {
             vhost_user_cleanup(s->vhost_user);
             g_free(s->vhost_user);
@@ -251,6 +263,7 @@ static void chr_closed_bh(void *opaque)
     NetVhostUserState *s;
     Error *err = NULL;
     int queues, i;
+    bool resume;
 
     queues = qemu_find_net_clients_except(name, ncs,
                                           NET_CLIENT_DRIVER_NIC,
@@ -263,7 +276,23 @@ static void chr_closed_bh(void *opaque)
         vhost_user_save_acked_features(ncs[i]);
     }
 
-    qmp_set_link(name, false, &err);
+    /*
+     * If the backend tracks inflight descriptors, a restarted backend
+     * picks up the rings where this one stopped.  Only stop vhost then,
+     * without taking the guest's link down.
+     */
+    resume = s->inflight->addr != NULL;
+    trace_vhost_user_closed(queues, resume);
+    if (resume) {
+        for (i = 0; i < queues; i++) {
+            ncs[i]->link_down = true;
+        }
+        if (ncs[0]->peer && ncs[0]->peer->info->link_status_changed) {
+            ncs[0]->peer->info->link_status_changed(ncs[0]->peer);
+        }
+    } else {
+        qmp_set_link(name, false, &err);
+    }
 
     qemu_chr_fe_set_handlers(&s->chr, NULL, NULL, net_vhost_user_event,
                              NULL, opaque, NULL, true);
@@ -351,6 +380,7 @@ static int net_vhost_user_init(NetClientState *peer, const char *device,
         if (!nc0) {
             nc0 = nc;
             s = DO_UPCAST(NetVhostUserState, nc, nc);
+            s->inflight = g_new0(struct vhost_inflight, 1);
             if (!qemu_chr_fe_init(&s->chr, chr, &err) ||
                 !vhost_user_init(user, &s->chr, &err)) {
                 error_report_err(err);
@@ -346,6 +346,43 @@ void plugin_register_dyn_cb__udata(GArray **arr,
     dyn_cb->type = PLUGIN_CB_REGULAR;
 }
 
+void plugin_register_dyn_cond_cb__udata(GArray **arr,
+                                        qemu_plugin_vcpu_udata_cb_t cb,
+                                        enum qemu_plugin_cb_flags flags,
+                                        enum qemu_plugin_cond cond,
+                                        qemu_plugin_u64 entry,
+                                        uint64_t imm,
+                                        void *udata)
+{
+    struct qemu_plugin_dyn_cb *dyn_cb = plugin_get_dyn_cb(arr);
+
+    dyn_cb->userp = udata;
+    dyn_cb->f.vcpu_udata = cb;
+    dyn_cb->type = PLUGIN_CB_COND;
+    dyn_cb->cond.entry = entry;
+    dyn_cb->cond.cond = cond;
+    dyn_cb->cond.imm = imm;
+    dyn_cb->cond.read_regs = flags == QEMU_PLUGIN_CB_R_REGS ||
+                             flags == QEMU_PLUGIN_CB_RW_REGS;
+}
+
+void plugin_register_vcpu_mem_record(GArray **arr,
+                                     enum qemu_plugin_mem_rw rw,
+                                     qemu_plugin_u64 entry,
+                                     size_t size,
+                                     qemu_plugin_vcpu_udata_cb_t cb,
+                                     void *udata)
+{
+    struct qemu_plugin_dyn_cb *dyn_cb = plugin_get_dyn_cb(arr);
+
+    dyn_cb->userp = udata;
+    dyn_cb->f.vcpu_udata = cb;
+    dyn_cb->type = PLUGIN_CB_MEM_RECORD;
+    dyn_cb->rw = rw;
+    dyn_cb->record.entry = entry;
+    dyn_cb->record.size = size;
+}
+
 void plugin_register_vcpu_mem_cb(GArray **arr,
                                  void *cb,
                                  enum qemu_plugin_cb_flags flags,
@@ -476,23 +513,43 @@ void qemu_plugin_flush_cb(void)
     plugin_cb__simple(QEMU_PLUGIN_EV_FLUSH);
 }
 
+static uint64_t *plugin_u64_address(qemu_plugin_u64 entry, int cpu_index)
+{
+    char *ptr = entry.score->data->data;
+    size_t elem_size = g_array_get_element_size(entry.score->data);
+
+    return (uint64_t *)(ptr + entry.offset + cpu_index * elem_size);
+}
+
 void exec_inline_op(struct qemu_plugin_dyn_cb *cb, int cpu_index)
 {
-    char *ptr = cb->inline_insn.entry.score->data->data;
-    size_t elem_size = g_array_get_element_size(
-        cb->inline_insn.entry.score->data);
-    size_t offset = cb->inline_insn.entry.offset;
-    uint64_t *val = (uint64_t *)(ptr + offset + cpu_index * elem_size);
+    uint64_t *val = plugin_u64_address(cb->inline_insn.entry, cpu_index);
 
     switch (cb->inline_insn.op) {
     case QEMU_PLUGIN_INLINE_ADD_U64:
         *val += cb->inline_insn.imm;
         break;
+    case QEMU_PLUGIN_INLINE_STORE_U64:
+        *val = cb->inline_insn.imm;
+        break;
     default:
         g_assert_not_reached();
     }
 }
 
+/* Same as the code generated for accesses that are not done by helpers */
+QEMU_DISABLE_CFI
+static void exec_mem_record(struct qemu_plugin_dyn_cb *cb, int cpu_index,
+                            uint64_t vaddr)
+{
+    uint64_t *count = plugin_u64_address(cb->record.entry, cpu_index);
+
+    count[1 + *count] = vaddr;
+    if (++*count == cb->record.size) {
+        cb->f.vcpu_udata(cpu_index, cb->userp);
+    }
+}
+
 void qemu_plugin_vcpu_mem_cb(CPUState *cpu, uint64_t vaddr,
                              MemOpIdx oi, enum qemu_plugin_mem_rw rw)
 {
@@ -507,7 +564,7 @@ void qemu_plugin_vcpu_mem_cb(CPUState *cpu, uint64_t vaddr,
             &g_array_index(arr, struct qemu_plugin_dyn_cb, i);
 
         if (!(rw & cb->rw)) {
-                break;
+            continue;
         }
         switch (cb->type) {
         case PLUGIN_CB_REGULAR:
@@ -517,6 +574,9 @@ void qemu_plugin_vcpu_mem_cb(CPUState *cpu, uint64_t vaddr,
         case PLUGIN_CB_INLINE:
             exec_inline_op(cb, cpu->cpu_index);
             break;
+        case PLUGIN_CB_MEM_RECORD:
+            exec_mem_record(cb, cpu->cpu_index, vaddr);
+            break;
         default:
             g_assert_not_reached();
         }
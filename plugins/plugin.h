@@ -93,6 +93,15 @@ plugin_register_dyn_cb__udata(GArray **arr,
                               qemu_plugin_vcpu_udata_cb_t cb,
                               enum qemu_plugin_cb_flags flags, void *udata);
 
+void
+plugin_register_dyn_cond_cb__udata(GArray **arr,
+                                   qemu_plugin_vcpu_udata_cb_t cb,
+                                   enum qemu_plugin_cb_flags flags,
+                                   enum qemu_plugin_cond cond,
+                                   qemu_plugin_u64 entry,
+                                   uint64_t imm,
+                                   void *udata);
+
 
 void plugin_register_vcpu_mem_cb(GArray **arr,
                                  void *cb,
@@ -100,6 +109,13 @@ void plugin_register_vcpu_mem_cb(GArray **arr,
                                  enum qemu_plugin_mem_rw rw,
                                  void *udata);
 
+void plugin_register_vcpu_mem_record(GArray **arr,
+                                     enum qemu_plugin_mem_rw rw,
+                                     qemu_plugin_u64 entry,
+                                     size_t size,
+                                     qemu_plugin_vcpu_udata_cb_t cb,
+                                     void *udata);
+
 void exec_inline_op(struct qemu_plugin_dyn_cb *cb, int cpu_index);
 
 int plugin_num_vcpus(void);
@@ -0,0 +1,1063 @@
+/*
+ * JSON Input Visitor
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/compat-policy.h"
+#include "qapi/error.h"
+#include "qapi/json-input-visitor.h"
+#include "qapi/visitor-impl.h"
+#include "qapi/qmp/qbool.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qerror.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnull.h"
+#include "qapi/qmp/qnum.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/ctype.h"
+#include "qemu/cutils.h"
+#include "qemu/unicode.h"
+
+/* Same limit as the JSON message parser */
+#define JSON_INPUT_MAX_NESTING 1024
+
+/*
+ * The JSON text is parsed into an array of nodes in document order.
+ * An object is followed by its members, each a string node for the key
+ * and the nodes for the value; an array is followed by the nodes for
+ * its elements.  @end skips over a value including all its contents.
+ */
+typedef struct JSONNode {
+    QType type;
+    bool visited;               /* Key of an object member: member visited */
+    unsigned end;               /* Index of the node after this value */
+    union {
+        bool b;
+        struct {
+            QNumKind kind;
+            union {
+                int64_t i64;
+                uint64_t u64;
+                double dbl;
+            } u;
+        } num;
+        struct {
+            const char *str;    /* Not NUL-terminated */
+            size_t len;
+            bool owned;         /* Unescaped copy rather than the input */
+        } str;
+    } u;
+} JSONNode;
+
+typedef struct StackObject {
+    const char *name;           /* Name of @node in its parent, if any */
+    unsigned node;              /* Object or array being visited */
+    void *qapi;                 /* sanity check that caller uses same pointer */
+
+    unsigned next;              /* If array: next unvisited element */
+    unsigned index;             /* If array: list index of the last visit */
+} StackObject;
+
+struct JSONInputVisitor {
+    Visitor visitor;
+
+    GArray *nodes;              /* JSONNode, root first */
+    GArray *stack;              /* StackObject, top last */
+
+    GString *errname;           /* Accumulator for full_name() */
+};
+
+static JSONInputVisitor *to_jiv(Visitor *v)
+{
+    return container_of(v, JSONInputVisitor, visitor);
+}
+
+static JSONNode *json_node(JSONInputVisitor *jiv, unsigned i)
+{
+    return &g_array_index(jiv->nodes, JSONNode, i);
+}
+
+static StackObject *json_input_tos(JSONInputVisitor *jiv)
+{
+    assert(jiv->stack->len);
+    return &g_array_index(jiv->stack, StackObject, jiv->stack->len - 1);
+}
+
+/*
+ * Parsing
+ */
+
+static const char *json_input_skip_ws(const char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+        p++;
+    }
+    return p;
+}
+
+static void json_input_parse_error(const char *p, const char *msg,
+                                   Error **errp)
+{
+    if (!*p) {
+        msg = "premature EOI";
+    }
+    error_setg(errp, "JSON parse error, %s", msg);
+}
+
+/* Append @node, which ends right after itself unless it has contents */
+static unsigned json_input_add_node(JSONInputVisitor *jiv, JSONNode *node)
+{
+    unsigned i = jiv->nodes->len;
+
+    node->end = i + 1;
+    g_array_append_vals(jiv->nodes, node, 1);
+    return i;
+}
+
+static int json_input_cvt4hex(const char *s)
+{
+    int cp = 0, i;
+
+    for (i = 0; i < 4; i++) {
+        if (!qemu_isxdigit(s[i])) {
+            return -1;
+        }
+        cp = (cp << 4) | g_ascii_xdigit_value(s[i]);
+    }
+    return cp;
+}
+
+/*
+ * Parse the string starting at the quote @p, like the JSON lexer and
+ * parser do.  Only strings with escape sequences are copied.
+ */
+static const char *json_input_parse_string(JSONInputVisitor *jiv,
+                                           const char *p, Error **errp)
+{
+    JSONNode node = { .type = QTYPE_QSTRING };
+    char quote = *p++;
+    const char *beg = p, *esc;
+    g_autoptr(GString) str = NULL;
+    char utf8_buf[5];
+    char *end;
+    int cp, trailing;
+
+    assert(quote == '"' || quote == '\'');
+
+    while (*p != quote) {
+        if (!*p || (unsigned char)*p < 0x20) {
+            json_input_parse_error(p, "invalid character in string", errp);
+            return NULL;
+        }
+
+        if (*p == '\\') {
+            if (!str) {
+                str = g_string_new_len(beg, p - beg);
+            }
+            esc = p++;
+            switch (*p++) {
+            case '"':
+            case '\'':
+            case '\\':
+            case '/':
+                g_string_append_c(str, p[-1]);
+                break;
+            case 'b':
+                g_string_append_c(str, '\b');
+                break;
+            case 'f':
+                g_string_append_c(str, '\f');
+                break;
+            case 'n':
+                g_string_append_c(str, '\n');
+                break;
+            case 'r':
+                g_string_append_c(str, '\r');
+                break;
+            case 't':
+                g_string_append_c(str, '\t');
+                break;
+            case 'u':
+                cp = json_input_cvt4hex(p);
+                if (cp < 0) {
+                    json_input_parse_error(p,
+                                           "invalid escape sequence in string",
+                                           errp);
+                    return NULL;
+                }
+                p += 4;
+
+                /* handle surrogate pairs */
+                if (cp >= 0xD800 && cp <= 0xDBFF
+                    && p[0] == '\\' && p[1] == 'u') {
+                    /* leading surrogate followed by \u */
+                    cp = 0x10000 + ((cp & 0x3FF) << 10);
+                    trailing = json_input_cvt4hex(p + 2);
+                    if (trailing >= 0xDC00 && trailing <= 0xDFFF) {
+                        /* followed by trailing surrogate */
+                        cp |= trailing & 0x3FF;
+                        p += 6;
+                    } else {
+                        cp = -1; /* invalid */
+                    }
+                }
+
+                if (mod_utf8_encode(utf8_buf, sizeof(utf8_buf), cp) < 0) {
+                    error_setg(errp, "JSON parse error, "
+                               "%.*s is not a valid Unicode character",
+                               (int)(p - esc), esc);
+                    return NULL;
+                }
+                g_string_append(str, utf8_buf);
+                break;
+            default:
+                json_input_parse_error(p - 1,
+                                       "invalid escape sequence in string",
+                                       errp);
+                return NULL;
+            }
+            continue;
+        }
+
+        if ((unsigned char)*p >= 0x80) {
+            cp = mod_utf8_codepoint(p, 6, &end);
+            if (cp < 0) {
+                json_input_parse_error(p, "invalid UTF-8 sequence in string",
+                                       errp);
+                return NULL;
+            }
+        } else {
+            end = (char *)p + 1;
+        }
+        if (str) {
+            g_string_append_len(str, p, end - p);
+        }
+        p = end;
+    }
+
+    if (str) {
+        node.u.str.len = str->len;
+        node.u.str.str = g_string_free(g_steal_pointer(&str), false);
+        node.u.str.owned = true;
+    } else {
+        node.u.str.str = beg;
+        node.u.str.len = p - beg;
+    }
+    json_input_add_node(jiv, &node);
+    return p + 1;
+}
+
+static const char *json_input_parse_number(JSONInputVisitor *jiv,
+                                           const char *p, Error **errp)
+{
+    JSONNode node = { .type = QTYPE_QNUM };
+    const char *beg = p, *end;
+    bool is_float = false;
+    int ret;
+
+    if (*p == '-') {
+        p++;
+    }
+    if (!qemu_isdigit(*p)) {
+        json_input_parse_error(p, "invalid number", errp);
+        return NULL;
+    }
+    if (*p == '0') {
+        p++;
+    } else {
+        while (qemu_isdigit(*p)) {
+            p++;
+        }
+    }
+    if (*p == '.') {
+        p++;
+        is_float = true;
+        if (!qemu_isdigit(*p)) {
+            json_input_parse_error(p, "invalid number", errp);
+            return NULL;
+        }
+        while (qemu_isdigit(*p)) {
+            p++;
+        }
+    }
+    if (*p == 'e' || *p == 'E') {
+        p++;
+        is_float = true;
+        if (*p == '+' || *p == '-') {
+            p++;
+        }
+        if (!qemu_isdigit(*p)) {
+            json_input_parse_error(p, "invalid number", errp);
+            return NULL;
+        }
+        while (qemu_isdigit(*p)) {
+            p++;
+        }
+    }
+
+    /* Pick the same QNumKind as the JSON parser */
+    node.u.num.kind = QNUM_DOUBLE;
+    if (!is_float) {
+        ret = qemu_strtoi64(beg, &end, 10, &node.u.num.u.i64);
+        if (!ret) {
+            node.u.num.kind = QNUM_I64;
+        } else if (*beg != '-') {
+            ret = qemu_strtou64(beg, &end, 10, &node.u.num.u.u64);
+            if (!ret) {
+                node.u.num.kind = QNUM_U64;
+            }
+        }
+    }
+    if (node.u.num.kind == QNUM_DOUBLE) {
+        /* FIXME dependent on locale, like the JSON parser */
+        node.u.num.u.dbl = strtod(beg, NULL);
+    }
+
+    json_input_add_node(jiv, &node);
+    return p;
+}
+
+static const char *json_input_parse_keyword(JSONInputVisitor *jiv,
+                                            const char *p, Error **errp)
+{
+    JSONNode node = { 0 };
+    const char *beg = p;
+    size_t len;
+
+    while (*p >= 'a' && *p <= 'z') {
+        p++;
+    }
+    len = p - beg;
+
+    if (len == 4 && !memcmp(beg, "true", 4)) {
+        node.type = QTYPE_QBOOL;
+        node.u.b = true;
+    } else if (len == 5 && !memcmp(beg, "false", 5)) {
+        node.type = QTYPE_QBOOL;
+        node.u.b = false;
+    } else if (len == 4 && !memcmp(beg, "null", 4)) {
+        node.type = QTYPE_QNULL;
+    } else {
+        error_setg(errp, "JSON parse error, invalid keyword '%.*s'",
+                   (int)len, beg);
+        return NULL;
+    }
+
+    json_input_add_node(jiv, &node);
+    return p;
+}
+
+static bool json_input_node_str_equal(JSONNode *a, JSONNode *b)
+{
+    return a->u.str.len == b->u.str.len &&
+        !memcmp(a->u.str.str, b->u.str.str, a->u.str.len);
+}
+
+static const char *json_input_parse_value(JSONInputVisitor *jiv,
+                                          const char *p, unsigned depth,
+                                          Error **errp);
+
+static const char *json_input_parse_object(JSONInputVisitor *jiv,
+                                           const char *p, unsigned depth,
+                                           Error **errp)
+{
+    JSONNode node = { .type = QTYPE_QDICT };
+    unsigned obj, key, i;
+
+    assert(*p == '{');
+    obj = json_input_add_node(jiv, &node);
+    p = json_input_skip_ws(p + 1);
+
+    if (*p != '}') {
+        for (;;) {
+            p = json_input_skip_ws(p);
+            if (*p != '"' && *p != '\'') {
+                json_input_parse_error(p, "key is not a string in object",
+                                       errp);
+                return NULL;
+            }
+            key = jiv->nodes->len;
+            p = json_input_parse_string(jiv, p, errp);
+            if (!p) {
+                return NULL;
+            }
+            for (i = obj + 1; i < key; i = json_node(jiv, i + 1)->end) {
+                if (json_input_node_str_equal(json_node(jiv, i),
+                                              json_node(jiv, key))) {
+                    error_setg(errp, "JSON parse error, duplicate key");
+                    return NULL;
+                }
+            }
+
+            p = json_input_skip_ws(p);
+            if (*p != ':') {
+                json_input_parse_error(p, "missing : in object pair", errp);
+                return NULL;
+            }
+            p = json_input_parse_value(jiv, p + 1, depth, errp);
+            if (!p) {
+                return NULL;
+            }
+
+            p = json_input_skip_ws(p);
+            if (*p == '}') {
+                break;
+            }
+            if (*p != ',') {
+                json_input_parse_error(p, "expected separator in dict", errp);
+                return NULL;
+            }
+            p++;
+        }
+    }
+
+    json_node(jiv, obj)->end = jiv->nodes->len;
+    return p + 1;
+}
+
+static const char *json_input_parse_array(JSONInputVisitor *jiv,
+                                          const char *p, unsigned depth,
+                                          Error **errp)
+{
+    JSONNode node = { .type = QTYPE_QLIST };
+    unsigned list;
+
+    assert(*p == '[');
+    list = json_input_add_node(jiv, &node);
+    p = json_input_skip_ws(p + 1);
+
+    if (*p != ']') {
+        for (;;) {
+            p = json_input_parse_value(jiv, p, depth, errp);
+            if (!p) {
+                return NULL;
+            }
+
+            p = json_input_skip_ws(p);
+            if (*p == ']') {
+                break;
+            }
+            if (*p != ',') {
+                json_input_parse_error(p, "expected separator in list", errp);
+                return NULL;
+            }
+            p++;
+        }
+    }
+
+    json_node(jiv, list)->end = jiv->nodes->len;
+    return p + 1;
+}
+
+static const char *json_input_parse_value(JSONInputVisitor *jiv,
+                                          const char *p, unsigned depth,
+                                          Error **errp)
+{
+    p = json_input_skip_ws(p);
+
+    switch (*p) {
+    case '{':
+    case '[':
+        if (depth >= JSON_INPUT_MAX_NESTING) {
+            error_setg(errp, "JSON nesting depth limit exceeded");
+            return NULL;
+        }
+        return *p == '{'
+            ? json_input_parse_object(jiv, p, depth + 1, errp)
+            : json_input_parse_array(jiv, p, depth + 1, errp);
+    case '"':
+    case '\'':
+        return json_input_parse_string(jiv, p, errp);
+    case '-':
+    case '0' ... '9':
+        return json_input_parse_number(jiv, p, errp);
+    case 'a' ... 'z':
+        return json_input_parse_keyword(jiv, p, errp);
+    default:
+        json_input_parse_error(p, "expecting value", errp);
+        return NULL;
+    }
+}
+
+/*
+ * Visiting
+ */
+
+/*
+ * Find the full name of something @jiv is currently visiting.
+ * @jiv is visiting something named @name in the stack of containers
+ * @jiv->stack.
+ * If @n is zero, return its full name.
+ * If @n is positive, return the full name of the @n-th container
+ * counting from the top.  The stack of containers must have at least
+ * @n elements.
+ * The returned string is valid until the next full_name_nth(@v) or
+ * destruction of @v.
+ */
+static const char *full_name_nth(JSONInputVisitor *jiv, const char *name,
+                                 int n)
+{
+    StackObject *so;
+    char buf[32];
+    int i;
+
+    if (jiv->errname) {
+        g_string_truncate(jiv->errname, 0);
+    } else {
+        jiv->errname = g_string_new("");
+    }
+
+    for (i = (int)jiv->stack->len - 1; i >= 0; i--) {
+        so = &g_array_index(jiv->stack, StackObject, i);
+        if (n) {
+            n--;
+        } else if (json_node(jiv, so->node)->type == QTYPE_QDICT) {
+            g_string_prepend(jiv->errname, name ?: "<anonymous>");
+            g_string_prepend_c(jiv->errname, '.');
+        } else {
+            snprintf(buf, sizeof(buf), "[%u]", so->index);
+            g_string_prepend(jiv->errname, buf);
+        }
+        name = so->name;
+    }
+    assert(!n);
+
+    if (name) {
+        g_string_prepend(jiv->errname, name);
+    } else if (jiv->errname->str[0] == '.') {
+        g_string_erase(jiv->errname, 0, 1);
+    } else if (!jiv->errname->str[0]) {
+        return "<anonymous>";
+    }
+
+    return jiv->errname->str;
+}
+
+static const char *full_name(JSONInputVisitor *jiv, const char *name)
+{
+    return full_name_nth(jiv, name, 0);
+}
+
+/* Return the node of the next value to visit, or NULL if there is none */
+static JSONNode *json_input_try_get_node(JSONInputVisitor *jiv,
+                                         const char *name, bool consume)
+{
+    StackObject *tos;
+    JSONNode *container, *key;
+    unsigned i;
+
+    if (!jiv->stack->len) {
+        /* Starting at root, name is ignored. */
+        return json_node(jiv, 0);
+    }
+
+    /* We are in a container; find the next element. */
+    tos = json_input_tos(jiv);
+    container = json_node(jiv, tos->node);
+
+    if (container->type == QTYPE_QDICT) {
+        assert(name);
+        for (i = tos->node + 1; i < container->end;
+             i = json_node(jiv, i + 1)->end) {
+            key = json_node(jiv, i);
+            if (key->u.str.len == strlen(name) &&
+                !memcmp(key->u.str.str, name, key->u.str.len)) {
+                if (consume) {
+                    assert(!key->visited);
+                    key->visited = true;
+                }
+                return json_node(jiv, i + 1);
+            }
+        }
+        return NULL;
+    }
+
+    assert(container->type == QTYPE_QLIST);
+    assert(!name);
+    i = tos->next;
+    if (consume) {
+        if (i < container->end) {
+            tos->next = json_node(jiv, i)->end;
+        }
+        tos->index++;
+    }
+    return i < container->end ? json_node(jiv, i) : NULL;
+}
+
+static JSONNode *json_input_get_node(JSONInputVisitor *jiv, const char *name,
+                                     bool consume, Error **errp)
+{
+    JSONNode *node = json_input_try_get_node(jiv, name, consume);
+
+    if (!node) {
+        error_setg(errp, QERR_MISSING_PARAMETER, full_name(jiv, name));
+    }
+    return node;
+}
+
+static void json_input_push(JSONInputVisitor *jiv, const char *name,
+                            JSONNode *node, void *qapi)
+{
+    unsigned i = node - json_node(jiv, 0);
+    StackObject so = {
+        .name = name,
+        .node = i,
+        .qapi = qapi,
+        .next = i + 1,
+        .index = -1,
+    };
+
+    g_array_append_val(jiv->stack, so);
+}
+
+static void json_input_pop(Visitor *v, void **obj)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+
+    assert(json_input_tos(jiv)->qapi == obj);
+    g_array_set_size(jiv->stack, jiv->stack->len - 1);
+}
+
+static bool json_input_start_struct(Visitor *v, const char *name, void **obj,
+                                    size_t size, Error **errp)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    JSONNode *node = json_input_get_node(jiv, name, true, errp);
+
+    if (obj) {
+        *obj = NULL;
+    }
+    if (!node) {
+        return false;
+    }
+    if (node->type != QTYPE_QDICT) {
+        error_setg(errp, QERR_INVALID_PARAMETER_TYPE,
+                   full_name(jiv, name), "object");
+        return false;
+    }
+
+    json_input_push(jiv, name, node, obj);
+
+    if (obj) {
+        *obj = g_malloc0(size);
+    }
+    return true;
+}
+
+static bool json_input_check_struct(Visitor *v, Error **errp)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    StackObject *tos = json_input_tos(jiv);
+    JSONNode *container = json_node(jiv, tos->node);
+    JSONNode *key;
+    unsigned i;
+
+    assert(container->type == QTYPE_QDICT);
+
+    for (i = tos->node + 1; i < container->end;
+         i = json_node(jiv, i + 1)->end) {
+        key = json_node(jiv, i);
+        if (!key->visited) {
+            g_autofree char *name = g_strndup(key->u.str.str,
+                                              key->u.str.len);
+
+            error_setg(errp, "Parameter '%s' is unexpected",
+                       full_name(jiv, name));
+            return false;
+        }
+    }
+    return true;
+}
+
+static void json_input_end_struct(Visitor *v, void **obj)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+
+    assert(json_node(jiv, json_input_tos(jiv)->node)->type == QTYPE_QDICT);
+    json_input_pop(v, obj);
+}
+
+static bool json_input_start_list(Visitor *v, const char *name,
+                                  GenericList **list, size_t size,
+                                  Error **errp)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    JSONNode *node = json_input_get_node(jiv, name, true, errp);
+
+    if (list) {
+        *list = NULL;
+    }
+    if (!node) {
+        return false;
+    }
+    if (node->type != QTYPE_QLIST) {
+        error_setg(errp, QERR_INVALID_PARAMETER_TYPE,
+                   full_name(jiv, name), "array");
+        return false;
+    }
+
+    json_input_push(jiv, name, node, list);
+    if (node->end > json_input_tos(jiv)->next && list) {
+        *list = g_malloc0(size);
+    }
+    return true;
+}
+
+static GenericList *json_input_next_list(Visitor *v, GenericList *tail,
+                                         size_t size)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    StackObject *tos = json_input_tos(jiv);
+    JSONNode *container = json_node(jiv, tos->node);
+
+    assert(container->type == QTYPE_QLIST);
+
+    if (tos->next >= container->end) {
+        return NULL;
+    }
+    tail->next = g_malloc0(size);
+    return tail->next;
+}
+
+static bool json_input_check_list(Visitor *v, Error **errp)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    StackObject *tos = json_input_tos(jiv);
+    JSONNode *container = json_node(jiv, tos->node);
+
+    assert(container->type == QTYPE_QLIST);
+
+    if (tos->next < container->end) {
+        error_setg(errp, "Only %u list elements expected in %s",
+                   tos->index + 1, full_name_nth(jiv, NULL, 1));
+        return false;
+    }
+    return true;
+}
+
+static void json_input_end_list(Visitor *v, void **obj)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+
+    assert(json_node(jiv, json_input_tos(jiv)->node)->type == QTYPE_QLIST);
+    json_input_pop(v, obj);
+}
+
+static bool json_input_start_alternate(Visitor *v, const char *name,
+                                       GenericAlternate **obj, size_t size,
+                                       Error **errp)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    JSONNode *node = json_input_get_node(jiv, name, false, errp);
+
+    if (!node) {
+        *obj = NULL;
+        return false;
+    }
+    *obj = g_malloc0(size);
+    (*obj)->type = node->type;
+    return true;
+}
+
+static bool json_input_node_get_try_int(JSONNode *node, int64_t *val)
+{
+    switch (node->u.num.kind) {
+    case QNUM_I64:
+        *val = node->u.num.u.i64;
+        return true;
+    case QNUM_U64:
+        if (node->u.num.u.u64 > INT64_MAX) {
+            return false;
+        }
+        *val = node->u.num.u.u64;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool json_input_type_int64(Visitor *v, const char *name, int64_t *obj,
+                                  Error **errp)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    JSONNode *node = json_input_get_node(jiv, name, true, errp);
+
+    if (!node) {
+        return false;
+    }
+    if (node->type != QTYPE_QNUM || !json_input_node_get_try_int(node, obj)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_TYPE,
+                   full_name(jiv, name), "integer");
+        return false;
+    }
+    return true;
+}
+
+static bool json_input_type_uint64(Visitor *v, const char *name,
+                                   uint64_t *obj, Error **errp)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    JSONNode *node = json_input_get_node(jiv, name, true, errp);
+
+    if (!node) {
+        return false;
+    }
+    if (node->type != QTYPE_QNUM) {
+        goto err;
+    }
+
+    switch (node->u.num.kind) {
+    case QNUM_U64:
+        *obj = node->u.num.u.u64;
+        return true;
+    case QNUM_I64:
+        /* Need to accept negative values for backward compatibility */
+        *obj = node->u.num.u.i64;
+        return true;
+    default:
+        break;
+    }
+
+err:
+    error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+               full_name(jiv, name), "uint64");
+    return false;
+}
+
+static bool json_input_type_bool(Visitor *v, const char *name, bool *obj,
+                                 Error **errp)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    JSONNode *node = json_input_get_node(jiv, name, true, errp);
+
+    if (!node) {
+        return false;
+    }
+    if (node->type != QTYPE_QBOOL) {
+        error_setg(errp, QERR_INVALID_PARAMETER_TYPE,
+                   full_name(jiv, name), "boolean");
+        return false;
+    }
+
+    *obj = node->u.b;
+    return true;
+}
+
+static bool json_input_type_str(Visitor *v, const char *name, char **obj,
+                                Error **errp)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    JSONNode *node = json_input_get_node(jiv, name, true, errp);
+
+    *obj = NULL;
+    if (!node) {
+        return false;
+    }
+    if (node->type != QTYPE_QSTRING) {
+        error_setg(errp, QERR_INVALID_PARAMETER_TYPE,
+                   full_name(jiv, name), "string");
+        return false;
+    }
+
+    *obj = g_strndup(node->u.str.str, node->u.str.len);
+    return true;
+}
+
+static bool json_input_type_number(Visitor *v, const char *name, double *obj,
+                                   Error **errp)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    JSONNode *node = json_input_get_node(jiv, name, true, errp);
+
+    if (!node) {
+        return false;
+    }
+    if (node->type != QTYPE_QNUM) {
+        error_setg(errp, QERR_INVALID_PARAMETER_TYPE,
+                   full_name(jiv, name), "number");
+        return false;
+    }
+
+    switch (node->u.num.kind) {
+    case QNUM_I64:
+        *obj = node->u.num.u.i64;
+        break;
+    case QNUM_U64:
+        *obj = node->u.num.u.u64;
+        break;
+    case QNUM_DOUBLE:
+        *obj = node->u.num.u.dbl;
+        break;
+    default:
+        abort();
+    }
+    return true;
+}
+
+static QObject *json_input_node_to_qobject(JSONInputVisitor *jiv,
+                                           unsigned i)
+{
+    JSONNode *node = json_node(jiv, i);
+    JSONNode *key;
+    QDict *dict;
+    QList *list;
+    unsigned j;
+
+    switch (node->type) {
+    case QTYPE_QNULL:
+        return QOBJECT(qnull());
+    case QTYPE_QBOOL:
+        return QOBJECT(qbool_from_bool(node->u.b));
+    case QTYPE_QNUM:
+        switch (node->u.num.kind) {
+        case QNUM_I64:
+            return QOBJECT(qnum_from_int(node->u.num.u.i64));
+        case QNUM_U64:
+            return QOBJECT(qnum_from_uint(node->u.num.u.u64));
+        case QNUM_DOUBLE:
+            return QOBJECT(qnum_from_double(node->u.num.u.dbl));
+        default:
+            abort();
+        }
+    case QTYPE_QSTRING:
+        return QOBJECT(qstring_from_substr(node->u.str.str, 0,
+                                           node->u.str.len));
+    case QTYPE_QDICT:
+        dict = qdict_new();
+        for (j = i + 1; j < node->end; j = json_node(jiv, j + 1)->end) {
+            g_autofree char *name = NULL;
+
+            key = json_node(jiv, j);
+            name = g_strndup(key->u.str.str, key->u.str.len);
+            qdict_put_obj(dict, name, json_input_node_to_qobject(jiv, j + 1));
+        }
+        return QOBJECT(dict);
+    case QTYPE_QLIST:
+        list = qlist_new();
+        for (j = i + 1; j < node->end; j = json_node(jiv, j)->end) {
+            qlist_append_obj(list, json_input_node_to_qobject(jiv, j));
+        }
+        return QOBJECT(list);
+    default:
+        abort();
+    }
+}
+
+static bool json_input_type_any(Visitor *v, const char *name, QObject **obj,
+                                Error **errp)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    JSONNode *node = json_input_get_node(jiv, name, true, errp);
+
+    *obj = NULL;
+    if (!node) {
+        return false;
+    }
+
+    *obj = json_input_node_to_qobject(jiv, node - json_node(jiv, 0));
+    return true;
+}
+
+static bool json_input_type_null(Visitor *v, const char *name,
+                                 QNull **obj, Error **errp)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    JSONNode *node = json_input_get_node(jiv, name, true, errp);
+
+    *obj = NULL;
+    if (!node) {
+        return false;
+    }
+
+    if (node->type != QTYPE_QNULL) {
+        error_setg(errp, QERR_INVALID_PARAMETER_TYPE,
+                   full_name(jiv, name), "null");
+        return false;
+    }
+    *obj = qnull();
+    return true;
+}
+
+static void json_input_optional(Visitor *v, const char *name, bool *present)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+
+    *present = !!json_input_try_get_node(jiv, name, false);
+}
+
+static bool json_input_policy_reject(Visitor *v, const char *name,
+                                     unsigned special_features,
+                                     Error **errp)
+{
+    return !compat_policy_input_ok(special_features, &v->compat_policy,
+                                   ERROR_CLASS_GENERIC_ERROR,
+                                   "parameter", name, errp);
+}
+
+static void json_input_free(Visitor *v)
+{
+    JSONInputVisitor *jiv = to_jiv(v);
+    JSONNode *node;
+    unsigned i;
+
+    for (i = 0; i < jiv->nodes->len; i++) {
+        node = json_node(jiv, i);
+        if (node->type == QTYPE_QSTRING && node->u.str.owned) {
+            g_free((char *)node->u.str.str);
+        }
+    }
+    g_array_free(jiv->nodes, true);
+    g_array_free(jiv->stack, true);
+    if (jiv->errname) {
+        g_string_free(jiv->errname, TRUE);
+    }
+    g_free(jiv);
+}
+
+Visitor *json_input_visitor_new(const char *json, Error **errp)
+{
+    JSONInputVisitor *v = g_malloc0(sizeof(*v));
+    const char *p;
+
+    v->visitor.type = VISITOR_INPUT;
+    v->visitor.start_struct = json_input_start_struct;
+    v->visitor.check_struct = json_input_check_struct;
+    v->visitor.end_struct = json_input_end_struct;
+    v->visitor.start_list = json_input_start_list;
+    v->visitor.next_list = json_input_next_list;
+    v->visitor.check_list = json_input_check_list;
+    v->visitor.end_list = json_input_end_list;
+    v->visitor.start_alternate = json_input_start_alternate;
+    v->visitor.type_int64 = json_input_type_int64;
+    v->visitor.type_uint64 = json_input_type_uint64;
+    v->visitor.type_bool = json_input_type_bool;
+    v->visitor.type_str = json_input_type_str;
+    v->visitor.type_number = json_input_type_number;
+    v->visitor.type_any = json_input_type_any;
+    v->visitor.type_null = json_input_type_null;
+    v->visitor.optional = json_input_optional;
+    v->visitor.policy_reject = json_input_policy_reject;
+    v->visitor.free = json_input_free;
+
+    /* Most JSON text has fewer values than one per 8 bytes */
+    v->nodes = g_array_sized_new(false, false, sizeof(JSONNode),
+                                 strlen(json) / 8 + 1);
+    v->stack = g_array_new(false, false, sizeof(StackObject));
+
+    p = json_input_parse_value(v, json, 0, errp);
+    if (p) {
+        p = json_input_skip_ws(p);
+        if (*p) {
+            error_setg(errp, "Expecting at most one JSON value");
+            p = NULL;
+        }
+    }
+    if (!p) {
+        json_input_free(&v->visitor);
+        return NULL;
+    }
+
+    return &v->visitor;
+}
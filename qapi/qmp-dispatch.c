@@ -131,8 +131,9 @@ static void do_qmp_dispatch_bh(void *opaque)
 }
 
 /*
- * Runs outside of coroutine context for OOB commands, but in coroutine
- * context for everything else.
+ * Runs outside of coroutine context for OOB commands and for read-only
+ * commands executed in the monitor I/O thread, but in coroutine context
+ * for everything else.
  */
 QDict *coroutine_mixed_fn qmp_dispatch(const QmpCommandList *cmds, QObject *request,
                                        bool allow_oob, Monitor *cur_mon)
@@ -16,6 +16,7 @@
 #include <math.h>
 #include "qapi/compat-policy.h"
 #include "qapi/error.h"
+#include "qapi/json-input-visitor.h"
 #include "qapi/qobject-input-visitor.h"
 #include "qapi/visitor-impl.h"
 #include "qemu/queue.h"
@@ -751,25 +752,19 @@ Visitor *qobject_input_visitor_new_str(const char *str,
                                        Error **errp)
 {
     bool is_json = str[0] == '{';
-    QObject *obj;
     QDict *args;
     Visitor *v;
 
     if (is_json) {
-        obj = qobject_from_json(str, errp);
-        if (!obj) {
-            return NULL;
-        }
-        args = qobject_to(QDict, obj);
-        assert(args);
-        v = qobject_input_visitor_new(QOBJECT(args));
-    } else {
-        args = keyval_parse(str, implied_key, NULL, errp);
-        if (!args) {
-            return NULL;
-        }
-        v = qobject_input_visitor_new_keyval(QOBJECT(args));
+        /* Visit the JSON text directly, without building a QDict first */
+        return json_input_visitor_new(str, errp);
+    }
+
+    args = keyval_parse(str, implied_key, NULL, errp);
+    if (!args) {
+        return NULL;
     }
+    v = qobject_input_visitor_new_keyval(QOBJECT(args));
     qobject_unref(args);
 
     return v;
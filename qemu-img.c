@@ -44,10 +44,14 @@
 #include "qemu/sockets.h"
 #include "qemu/units.h"
 #include "qemu/memalign.h"
+#include "qemu/rcu.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
+#include "block/dedup.h"
 #include "block/dirty-bitmap.h"
 #include "block/qapi.h"
 #include "crypto/init.h"
@@ -86,6 +90,11 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_PARALLEL = 278,
+    OPTION_JOBS = 279,
+    OPTION_RANDOM = 280,
+    OPTION_RW_MIX = 281,
+    OPTION_DEDUP = 282,
 };
 
 typedef enum OutputFormat {
@@ -207,6 +216,10 @@ void help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--parallel' specifies how many threads copy separate ranges of the\n"
+           "       image, each with its own coroutines (requires -W)\n"
+           "  '--dedup' copies clusters whose content was already written within\n"
+           "       the target instead of writing them again\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1348,6 +1361,274 @@ static int check_empty_sectors(BlockBackend *blk, int64_t offset,
     return 0;
 }
 
+#define MAX_COMPARE_THREADS 64
+#define COMPARE_CHUNK_SIZE (64 * MiB)
+
+typedef struct ImgCompareState {
+    BlockBackend *blk1, *blk2;
+    const char *filename1, *filename2;
+    int64_t total_size;
+    uint64_t progress_base;
+    bool strict;
+    int running_threads;
+
+    /* Protects everything below and the progress output */
+    QemuMutex lock;
+    int64_t next_chunk;
+    /* Lowest offset where the images differ or an error occurred */
+    int64_t fail_offset;
+    int ret;
+    bool status_mismatch;
+} ImgCompareState;
+
+typedef struct ImgCompareThread {
+    ImgCompareState *s;
+    AioContext *ctx;
+    QemuThread thread;
+    uint8_t *buf1, *buf2;
+    bool done;
+} ImgCompareThread;
+
+typedef struct ImgCompareRead {
+    BlockBackend *blk;
+    int64_t offset;
+    int64_t bytes;
+    uint8_t *buf;
+    int ret;
+    bool done;
+    Coroutine *waiter;
+} ImgCompareRead;
+
+/*
+ * Record a difference or an error at @offset.  Only the one at the
+ * lowest offset is reported, like a sequential compare would.
+ */
+static void compare_fail(ImgCompareState *s, int64_t offset, int ret,
+                         bool status_mismatch)
+{
+    QEMU_LOCK_GUARD(&s->lock);
+    if (offset < s->fail_offset) {
+        s->fail_offset = offset;
+        s->ret = ret;
+        s->status_mismatch = status_mismatch;
+    }
+}
+
+static int64_t compare_fail_offset(ImgCompareState *s)
+{
+    QEMU_LOCK_GUARD(&s->lock);
+    return s->fail_offset;
+}
+
+/* Returns the start of the next chunk to compare, or -1 */
+static int64_t compare_claim_chunk(ImgCompareState *s)
+{
+    int64_t start = -1;
+
+    QEMU_LOCK_GUARD(&s->lock);
+    if (s->next_chunk < MIN(s->total_size, s->fail_offset)) {
+        start = s->next_chunk;
+        s->next_chunk += COMPARE_CHUNK_SIZE;
+    }
+    return start;
+}
+
+static void coroutine_fn compare_co_read_entry(void *opaque)
+{
+    ImgCompareRead *r = opaque;
+
+    r->ret = blk_co_pread(r->blk, r->offset, r->bytes, r->buf, 0);
+    r->done = true;
+    if (r->waiter) {
+        aio_co_wake(r->waiter);
+    }
+}
+
+/* Read the same range of both images at the same time */
+static int coroutine_fn compare_co_read_both(ImgCompareState *s,
+                                             ImgCompareThread *t,
+                                             int64_t offset, int64_t bytes)
+{
+    ImgCompareRead r1 = {
+        .blk = s->blk1, .offset = offset, .bytes = bytes, .buf = t->buf1,
+    };
+    int ret;
+
+    qemu_coroutine_enter(qemu_coroutine_create(compare_co_read_entry, &r1));
+    ret = blk_co_pread(s->blk2, offset, bytes, t->buf2, 0);
+    if (!r1.done) {
+        r1.waiter = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+
+    if (r1.ret < 0) {
+        error_report("Error while reading offset %" PRId64 " of %s: %s",
+                     offset, s->filename1, strerror(-r1.ret));
+        return r1.ret;
+    }
+    if (ret < 0) {
+        error_report("Error while reading offset %" PRId64 " of %s: %s",
+                     offset, s->filename2, strerror(-ret));
+    }
+    return ret;
+}
+
+/* Same checks as the sequential loop in img_compare() */
+static void coroutine_fn compare_co_chunk(ImgCompareState *s,
+                                          ImgCompareThread *t,
+                                          int64_t offset, int64_t end)
+{
+    BlockDriverState *bs1 = blk_bs(s->blk1), *bs2 = blk_bs(s->blk2);
+    int64_t pnum1, pnum2, chunk, idx;
+    int status1, status2, ret;
+
+    while (offset < end && offset < compare_fail_offset(s)) {
+        WITH_GRAPH_RDLOCK_GUARD() {
+            status1 = bdrv_block_status_above(bs1, NULL, offset,
+                                              end - offset, &pnum1, NULL,
+                                              NULL);
+            status2 = status1 < 0 ? 0 :
+                      bdrv_block_status_above(bs2, NULL, offset,
+                                              end - offset, &pnum2, NULL,
+                                              NULL);
+        }
+        if (status1 < 0 || status2 < 0) {
+            error_report("Sector allocation test failed for %s",
+                         status1 < 0 ? s->filename1 : s->filename2);
+            compare_fail(s, offset, 3, false);
+            return;
+        }
+
+        assert(pnum1 && pnum2);
+        chunk = MIN(pnum1, pnum2);
+
+        if (s->strict && status1 != status2) {
+            compare_fail(s, offset, 1, true);
+            return;
+        }
+        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
+            /* nothing to do */
+        } else if ((status1 & BDRV_BLOCK_ALLOCATED) ==
+                   (status2 & BDRV_BLOCK_ALLOCATED)) {
+            if (status1 & BDRV_BLOCK_ALLOCATED) {
+                chunk = MIN(chunk, IO_BUF_SIZE);
+                if (compare_co_read_both(s, t, offset, chunk) < 0) {
+                    compare_fail(s, offset, 4, false);
+                    return;
+                }
+                ret = compare_buffers(t->buf1, t->buf2, chunk, 0, &idx);
+                if (ret || idx != chunk) {
+                    compare_fail(s, offset + (ret ? 0 : idx), 1, false);
+                    return;
+                }
+            }
+        } else {
+            bool first = status1 & BDRV_BLOCK_ALLOCATED;
+
+            chunk = MIN(chunk, IO_BUF_SIZE);
+            ret = blk_co_pread(first ? s->blk1 : s->blk2, offset, chunk,
+                               t->buf1, 0);
+            if (ret < 0) {
+                error_report("Error while reading offset %" PRId64
+                             " of %s: %s", offset,
+                             first ? s->filename1 : s->filename2,
+                             strerror(-ret));
+                compare_fail(s, offset, 4, false);
+                return;
+            }
+            idx = find_nonzero(t->buf1, chunk);
+            if (idx >= 0) {
+                compare_fail(s, offset + idx, 1, false);
+                return;
+            }
+        }
+        offset += chunk;
+    }
+}
+
+static void coroutine_fn compare_co_thread(void *opaque)
+{
+    ImgCompareThread *t = opaque;
+    ImgCompareState *s = t->s;
+    int64_t start, end;
+
+    while ((start = compare_claim_chunk(s)) >= 0) {
+        end = MIN(start + COMPARE_CHUNK_SIZE, s->total_size);
+        compare_co_chunk(s, t, start, end);
+
+        qemu_mutex_lock(&s->lock);
+        qemu_progress_print(((float) (end - start) / s->progress_base) * 100,
+                            100);
+        qemu_mutex_unlock(&s->lock);
+    }
+    t->done = true;
+}
+
+static void *compare_thread(void *opaque)
+{
+    ImgCompareThread *t = opaque;
+
+    rcu_register_thread();
+    qemu_set_current_aio_context(t->ctx);
+
+    qemu_coroutine_enter(qemu_coroutine_create(compare_co_thread, t));
+    while (!t->done) {
+        aio_poll(t->ctx, true);
+    }
+
+    qatomic_dec(&t->s->running_threads);
+    aio_notify(qemu_get_aio_context());
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Compare the first @s->total_size bytes of both images with
+ * @nr_threads threads, each taking chunks of the images in turn.  The
+ * main loop keeps running, as some drivers complete requests there.
+ */
+static int compare_parallel(ImgCompareState *s, int nr_threads, bool quiet)
+{
+    ImgCompareThread *threads = g_new0(ImgCompareThread, nr_threads);
+    int i;
+
+    qemu_mutex_init(&s->lock);
+    s->fail_offset = INT64_MAX;
+    s->running_threads = nr_threads;
+    for (i = 0; i < nr_threads; i++) {
+        ImgCompareThread *t = &threads[i];
+
+        t->s = s;
+        t->ctx = aio_context_new(&error_abort);
+        t->buf1 = blk_blockalign(s->blk1, IO_BUF_SIZE);
+        t->buf2 = blk_blockalign(s->blk2, IO_BUF_SIZE);
+        qemu_thread_create(&t->thread, "qemu-img-compare", compare_thread, t,
+                           QEMU_THREAD_JOINABLE);
+    }
+    while (qatomic_read(&s->running_threads)) {
+        main_loop_wait(false);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_join(&threads[i].thread);
+        aio_context_unref(threads[i].ctx);
+        qemu_vfree(threads[i].buf1);
+        qemu_vfree(threads[i].buf2);
+    }
+    g_free(threads);
+    qemu_mutex_destroy(&s->lock);
+
+    if (s->ret == 1) {
+        if (s->status_mismatch) {
+            qprintf(quiet, "Strict mode: Offset %" PRId64
+                    " block status mismatch!\n", s->fail_offset);
+        } else {
+            qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                    s->fail_offset);
+        }
+    }
+    return s->ret;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -1375,6 +1656,7 @@ static int img_compare(int argc, char **argv)
     uint64_t progress_base;
     bool image_opts = false;
     bool force_share = false;
+    long nr_threads = 0;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1383,6 +1665,7 @@ static int img_compare(int argc, char **argv)
             {"object", required_argument, 0, OPTION_OBJECT},
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"force-share", no_argument, 0, 'U'},
+            {"parallel", required_argument, 0, OPTION_PARALLEL},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:F:T:pqsU",
@@ -1439,6 +1722,15 @@ static int img_compare(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_PARALLEL:
+            if (qemu_strtol(optarg, NULL, 0, &nr_threads) ||
+                nr_threads < 1 || nr_threads > MAX_COMPARE_THREADS) {
+                error_report("Invalid number of threads. Allowed number of"
+                             " threads is between 1 and %d",
+                             MAX_COMPARE_THREADS);
+                return 2;
+            }
+            break;
         }
     }
 
@@ -1508,6 +1800,24 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
+    if (nr_threads) {
+        ImgCompareState s = {
+            .blk1 = blk1,
+            .blk2 = blk2,
+            .filename1 = filename1,
+            .filename2 = filename2,
+            .total_size = total_size,
+            .progress_base = progress_base,
+            .strict = strict,
+        };
+
+        ret = compare_parallel(&s, nr_threads, quiet);
+        if (ret) {
+            goto out;
+        }
+        offset = total_size;
+    }
+
     while (offset < total_size) {
         int status1, status2;
 
@@ -1665,9 +1975,35 @@ enum ImgConvertBlockStatus {
 };
 
 #define MAX_COROUTINES 16
+#define MAX_CONVERT_THREADS 64
+#define CONVERT_CHUNK_SECTORS (1 * GiB / BDRV_SECTOR_SIZE)
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
-typedef struct ImgConvertState {
+typedef struct ImgConvertState ImgConvertState;
+
+/*
+ * The coroutines of one thread.  They claim chunks of the image in turn
+ * and share the block status of the chunk they are working on.
+ */
+typedef struct ImgConvertWorker {
+    ImgConvertState *s;
+    AioContext *ctx;
+    QemuThread thread;
+    CoroutineEntry *entry;
+    int nb_coroutines;
+    int64_t sector_num;
+    int64_t end;
+    int64_t wr_offs;
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+    int64_t allocated_sectors;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+} ImgConvertWorker;
+
+struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
     int *src_alignment;
@@ -1675,10 +2011,6 @@ typedef struct ImgConvertState {
     int64_t total_sectors;
     int64_t allocated_sectors;
     int64_t allocated_done;
-    int64_t sector_num;
-    int64_t wr_offs;
-    enum ImgConvertBlockStatus status;
-    int64_t sector_next_status;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
@@ -1694,12 +2026,29 @@ typedef struct ImgConvertState {
     size_t cluster_sectors;
     size_t buf_sectors;
     long num_coroutines;
-    int running_coroutines;
-    Coroutine *co[MAX_COROUTINES];
-    int64_t wait_sector_num[MAX_COROUTINES];
-    CoMutex lock;
+    /* 0 to copy from the main loop */
+    long num_threads;
+    ImgConvertWorker *workers;
+    int running_workers;
+    int64_t chunk_sectors;
+    /* Protects next_chunk, allocated_done and the progress output */
+    QemuMutex lock;
+    int64_t next_chunk;
     int ret;
-} ImgConvertState;
+
+    /* Reported at the end of a parallel conversion */
+    bool stats;
+    int64_t probe_ns;
+    int64_t copy_ns;
+    Stat64 bytes_read;
+    Stat64 bytes_written;
+    Stat64 bytes_zeroed;
+    Stat64 bytes_dedup;
+
+    /* Clusters already written to the target, if deduplicating */
+    BlockDedup *dedup;
+    int64_t dedup_sectors;
+};
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
                                 int *src_cur, int64_t *src_cur_offset)
@@ -1713,8 +2062,26 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
+static bool convert_claim_chunk(ImgConvertWorker *w)
+{
+    ImgConvertState *s = w->s;
+    bool ret = false;
+
+    qemu_mutex_lock(&s->lock);
+    if (s->next_chunk < s->total_sectors) {
+        w->sector_num = s->next_chunk;
+        w->end = MIN(w->sector_num + s->chunk_sectors, s->total_sectors);
+        w->sector_next_status = w->sector_num;
+        s->next_chunk = w->end;
+        ret = true;
+    }
+    qemu_mutex_unlock(&s->lock);
+    return ret;
+}
+
 static int coroutine_mixed_fn GRAPH_RDLOCK
-convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+convert_iteration_sectors(ImgConvertState *s, ImgConvertWorker *w,
+                          int64_t sector_num)
 {
     int64_t src_cur_offset;
     int ret, n, src_cur;
@@ -1722,8 +2089,8 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 
     convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
 
-    assert(s->total_sectors > sector_num);
-    n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
+    assert(w->end > sector_num);
+    n = MIN(w->end - sector_num, BDRV_REQUEST_MAX_SECTORS);
 
     if (s->target_backing_sectors >= 0) {
         if (sector_num >= s->target_backing_sectors) {
@@ -1735,7 +2102,7 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
     }
 
-    if (s->sector_next_status <= sector_num) {
+    if (w->sector_next_status <= sector_num) {
         uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
         int64_t count;
         int tail;
@@ -1780,7 +2147,7 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         n = DIV_ROUND_UP(count, BDRV_SECTOR_SIZE);
 
         /*
-         * Avoid that s->sector_next_status becomes unaligned to the source
+         * Avoid that w->sector_next_status becomes unaligned to the source
          * request alignment and/or cluster size to avoid unnecessary read
          * cycles.
          */
@@ -1790,18 +2157,18 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
 
         if (ret & BDRV_BLOCK_ZERO) {
-            s->status = post_backing_zero ? BLK_BACKING_FILE : BLK_ZERO;
+            w->status = post_backing_zero ? BLK_BACKING_FILE : BLK_ZERO;
         } else if (ret & BDRV_BLOCK_DATA) {
-            s->status = BLK_DATA;
+            w->status = BLK_DATA;
         } else {
-            s->status = s->target_has_backing ? BLK_BACKING_FILE : BLK_DATA;
+            w->status = s->target_has_backing ? BLK_BACKING_FILE : BLK_DATA;
         }
 
-        s->sector_next_status = sector_num + n;
+        w->sector_next_status = sector_num + n;
     }
 
-    n = MIN(n, s->sector_next_status - sector_num);
-    if (s->status == BLK_DATA) {
+    n = MIN(n, w->sector_next_status - sector_num);
+    if (w->status == BLK_DATA) {
         n = MIN(n, s->buf_sectors);
     }
 
@@ -1810,8 +2177,8 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
      * cluster allocated. */
     if (s->compressed) {
         if (n < s->cluster_sectors) {
-            n = MIN(s->cluster_sectors, s->total_sectors - sector_num);
-            s->status = BLK_DATA;
+            n = MIN(s->cluster_sectors, w->end - sector_num);
+            w->status = BLK_DATA;
         } else {
             n = QEMU_ALIGN_DOWN(n, s->cluster_sectors);
         }
@@ -1863,6 +2230,8 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
             } else {
                 return ret;
             }
+        } else {
+            stat64_add(&s->bytes_read, n << BDRV_SECTOR_BITS);
         }
 
         sector_num += n;
@@ -1874,6 +2243,80 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
+/*
+ * Write @buf, copying whole clusters within the target instead where an
+ * earlier cluster has the same content.
+ */
+static int coroutine_fn convert_co_write_dedup(ImgConvertState *s,
+                                               int64_t sector_num,
+                                               int nb_sectors, uint8_t *buf,
+                                               BdrvRequestFlags flags)
+{
+    int64_t unit = s->dedup_sectors;
+    int64_t first = QEMU_ALIGN_UP(sector_num, unit);
+    int64_t end = sector_num + nb_sectors;
+    int64_t nr = MAX(QEMU_ALIGN_DOWN(end, unit) - first, 0) / unit;
+    g_autofree BlockDedupHash *hashes = g_new(BlockDedupHash, nr);
+    g_autofree bool *insert = g_new0(bool, nr);
+    int64_t run = sector_num, i;
+    int ret;
+
+    for (i = 0; i < nr; i++) {
+        int64_t cur = first + i * unit;
+        int64_t src;
+
+        block_dedup_hash(buf + (cur - sector_num) * BDRV_SECTOR_SIZE,
+                         unit * BDRV_SECTOR_SIZE, &hashes[i]);
+        src = block_dedup_find(s->dedup, &hashes[i]);
+        if (src < 0) {
+            insert[i] = true;
+            continue;
+        }
+
+        if (cur > run) {
+            ret = blk_co_pwrite(s->target, run << BDRV_SECTOR_BITS,
+                                (cur - run) << BDRV_SECTOR_BITS,
+                                buf + (run - sector_num) * BDRV_SECTOR_SIZE,
+                                flags);
+            if (ret < 0) {
+                return ret;
+            }
+            stat64_add(&s->bytes_written, (cur - run) << BDRV_SECTOR_BITS);
+            run = cur;
+        }
+        ret = blk_co_copy_range(s->target, src, s->target,
+                                cur << BDRV_SECTOR_BITS,
+                                unit << BDRV_SECTOR_BITS, 0, flags);
+        if (ret < 0) {
+            /* Write the data instead */
+            insert[i] = true;
+            continue;
+        }
+        stat64_add(&s->bytes_dedup, unit << BDRV_SECTOR_BITS);
+        run = cur + unit;
+    }
+
+    if (end > run) {
+        ret = blk_co_pwrite(s->target, run << BDRV_SECTOR_BITS,
+                            (end - run) << BDRV_SECTOR_BITS,
+                            buf + (run - sector_num) * BDRV_SECTOR_SIZE,
+                            flags);
+        if (ret < 0) {
+            return ret;
+        }
+        stat64_add(&s->bytes_written, (end - run) << BDRV_SECTOR_BITS);
+    }
+
+    /* Only now can other requests copy from these clusters */
+    for (i = 0; i < nr; i++) {
+        if (insert[i]) {
+            block_dedup_insert(s->dedup, &hashes[i],
+                               (first + i * unit) << BDRV_SECTOR_BITS);
+        }
+    }
+    return 0;
+}
+
 static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
                                          enum ImgConvertBlockStatus status)
@@ -1906,11 +2349,19 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                 (s->compressed &&
                  !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
             {
+                if (s->dedup) {
+                    ret = convert_co_write_dedup(s, sector_num, n, buf, flags);
+                    if (ret < 0) {
+                        return ret;
+                    }
+                    break;
+                }
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
                 if (ret < 0) {
                     return ret;
                 }
+                stat64_add(&s->bytes_written, n << BDRV_SECTOR_BITS);
                 break;
             }
             /* fall-through */
@@ -1927,6 +2378,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
             if (ret < 0) {
                 return ret;
             }
+            stat64_add(&s->bytes_zeroed, n << BDRV_SECTOR_BITS);
             break;
         }
 
@@ -1962,6 +2414,7 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
         if (ret < 0) {
             return ret;
         }
+        stat64_add(&s->bytes_written, n << BDRV_SECTOR_BITS);
 
         sector_num += n;
         nb_sectors -= n;
@@ -1971,20 +2424,21 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
 
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
-    ImgConvertState *s = opaque;
+    ImgConvertWorker *w = opaque;
+    ImgConvertState *s = w->s;
     uint8_t *buf = NULL;
     int ret, i;
     int index = -1;
 
-    for (i = 0; i < s->num_coroutines; i++) {
-        if (s->co[i] == qemu_coroutine_self()) {
+    for (i = 0; i < w->nb_coroutines; i++) {
+        if (w->co[i] == qemu_coroutine_self()) {
             index = i;
             break;
         }
     }
     assert(index >= 0);
 
-    s->running_coroutines++;
+    w->running_coroutines++;
     buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     while (1) {
@@ -1993,44 +2447,47 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         enum ImgConvertBlockStatus status;
         bool copy_range;
 
-        qemu_co_mutex_lock(&s->lock);
-        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
-            qemu_co_mutex_unlock(&s->lock);
+        qemu_co_mutex_lock(&w->lock);
+        if (qatomic_read(&s->ret) != -EINPROGRESS ||
+            (w->sector_num >= w->end && !convert_claim_chunk(w))) {
+            qemu_co_mutex_unlock(&w->lock);
             break;
         }
         WITH_GRAPH_RDLOCK_GUARD() {
-            n = convert_iteration_sectors(s, s->sector_num);
+            n = convert_iteration_sectors(s, w, w->sector_num);
         }
         if (n < 0) {
-            qemu_co_mutex_unlock(&s->lock);
-            s->ret = n;
+            qemu_co_mutex_unlock(&w->lock);
+            qatomic_set(&s->ret, n);
             break;
         }
         /* save current sector and allocation status to local variables */
-        sector_num = s->sector_num;
-        status = s->status;
-        if (!s->min_sparse && s->status == BLK_ZERO) {
+        sector_num = w->sector_num;
+        status = w->status;
+        if (!s->min_sparse && w->status == BLK_ZERO) {
             n = MIN(n, s->buf_sectors);
         }
-        /* increment global sector counter so that other coroutines can
+        /* increment the sector counter so that other coroutines can
          * already continue reading beyond this request */
-        s->sector_num += n;
-        qemu_co_mutex_unlock(&s->lock);
+        w->sector_num += n;
+        qemu_co_mutex_unlock(&w->lock);
 
         if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
+            qemu_mutex_lock(&s->lock);
             s->allocated_done += n;
             qemu_progress_print(100.0 * s->allocated_done /
                                         s->allocated_sectors, 0);
+            qemu_mutex_unlock(&s->lock);
         }
 
 retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
+        copy_range = s->copy_range && w->status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
                 error_report("error while reading at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
-                s->ret = ret;
+                qatomic_set(&s->ret, ret);
             }
         } else if (!s->min_sparse && status == BLK_ZERO) {
             status = BLK_DATA;
@@ -2039,14 +2496,15 @@ retry:
 
         if (s->wr_in_order) {
             /* keep writes in order */
-            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
-                s->wait_sector_num[index] = sector_num;
+            while (w->wr_offs != sector_num &&
+                   qatomic_read(&s->ret) == -EINPROGRESS) {
+                w->wait_sector_num[index] = sector_num;
                 qemu_coroutine_yield();
             }
-            s->wait_sector_num[index] = -1;
+            w->wait_sector_num[index] = -1;
         }
 
-        if (s->ret == -EINPROGRESS) {
+        if (qatomic_read(&s->ret) == -EINPROGRESS) {
             if (copy_range) {
                 WITH_GRAPH_RDLOCK_GUARD() {
                     ret = convert_co_copy_range(s, sector_num, n);
@@ -2061,22 +2519,22 @@ retry:
             if (ret < 0) {
                 error_report("error while writing at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
-                s->ret = ret;
+                qatomic_set(&s->ret, ret);
             }
         }
 
         if (s->wr_in_order) {
             /* reenter the coroutine that might have waited
              * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            w->wr_offs = sector_num + n;
+            for (i = 0; i < w->nb_coroutines; i++) {
+                if (w->co[i] && w->wait_sector_num[i] == w->wr_offs) {
                     /*
                      * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+                     * w->wait_sector_num[i] == -1 during A -> B.  Therefore
                      * B will never enter A during this time window.
                      */
-                    qemu_coroutine_enter(s->co[i]);
+                    qemu_coroutine_enter(w->co[i]);
                     break;
                 }
             }
@@ -2084,18 +2542,113 @@ retry:
     }
 
     qemu_vfree(buf);
-    s->co[index] = NULL;
-    s->running_coroutines--;
-    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
-        /* the convert job finished successfully */
-        s->ret = 0;
+    w->co[index] = NULL;
+    w->running_coroutines--;
+}
+
+/* Count the sectors that will be copied, for the progress output */
+static void coroutine_fn convert_co_probe(void *opaque)
+{
+    ImgConvertWorker *w = opaque;
+    ImgConvertState *s = w->s;
+    int n;
+
+    w->running_coroutines++;
+    while (qatomic_read(&s->ret) == -EINPROGRESS &&
+           (w->sector_num < w->end || convert_claim_chunk(w))) {
+        WITH_GRAPH_RDLOCK_GUARD() {
+            n = convert_iteration_sectors(s, w, w->sector_num);
+        }
+        if (n < 0) {
+            qatomic_set(&s->ret, n);
+            break;
+        }
+        if (w->status == BLK_DATA ||
+            (!s->min_sparse && w->status == BLK_ZERO)) {
+            w->allocated_sectors += n;
+        }
+        w->sector_num += n;
+    }
+    w->co[0] = NULL;
+    w->running_coroutines--;
+}
+
+static void convert_worker_start(ImgConvertWorker *w)
+{
+    int i;
+
+    for (i = 0; i < w->nb_coroutines; i++) {
+        w->co[i] = qemu_coroutine_create(w->entry, w);
+        w->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(w->co[i]);
+    }
+}
+
+static void *convert_worker_thread(void *opaque)
+{
+    ImgConvertWorker *w = opaque;
+    ImgConvertState *s = w->s;
+
+    rcu_register_thread();
+    qemu_set_current_aio_context(w->ctx);
+
+    convert_worker_start(w);
+    while (w->running_coroutines) {
+        aio_poll(w->ctx, true);
+    }
+
+    qatomic_dec(&s->running_workers);
+    aio_notify(qemu_get_aio_context());
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Run @nb_coroutines instances of @entry in every worker until the whole
+ * image has been processed.  The main loop keeps running meanwhile, as
+ * some drivers complete requests from there.
+ */
+static void convert_run_workers(ImgConvertState *s, CoroutineEntry *entry,
+                                int nb_coroutines)
+{
+    int i, nr_workers = MAX(s->num_threads, 1);
+
+    s->next_chunk = 0;
+    for (i = 0; i < nr_workers; i++) {
+        ImgConvertWorker *w = &s->workers[i];
+
+        w->entry = entry;
+        w->nb_coroutines = nb_coroutines;
+        w->sector_num = w->end = w->wr_offs = 0;
+    }
+
+    if (!s->num_threads) {
+        convert_worker_start(&s->workers[0]);
+        while (s->workers[0].running_coroutines) {
+            main_loop_wait(false);
+        }
+        return;
+    }
+
+    s->running_workers = nr_workers;
+    for (i = 0; i < nr_workers; i++) {
+        qemu_thread_create(&s->workers[i].thread, "qemu-img-convert",
+                           convert_worker_thread, &s->workers[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    while (qatomic_read(&s->running_workers)) {
+        main_loop_wait(false);
+    }
+    for (i = 0; i < nr_workers; i++) {
+        qemu_thread_join(&s->workers[i].thread);
     }
 }
 
 static int convert_do_copy(ImgConvertState *s)
 {
-    int ret, i, n;
-    int64_t sector_num = 0;
+    int ret, i;
+    int nr_workers = MAX(s->num_threads, 1);
+    int64_t start;
 
     /* Check whether we have zero initialisation or can get it efficiently */
     if (!s->has_zero_init && s->target_is_new && s->min_sparse &&
@@ -2115,44 +2668,84 @@ static int convert_do_copy(ImgConvertState *s)
         s->buf_sectors = s->cluster_sectors;
     }
 
-    while (sector_num < s->total_sectors) {
-        bdrv_graph_rdlock_main_loop();
-        n = convert_iteration_sectors(s, sector_num);
-        bdrv_graph_rdunlock_main_loop();
-        if (n < 0) {
-            return n;
-        }
-        if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
-        {
-            s->allocated_sectors += n;
-        }
-        sector_num += n;
+    /*
+     * Without threads, the main loop copies the whole image in one chunk.
+     * Otherwise, the threads take turns in claiming the next chunk.
+     */
+    s->chunk_sectors = s->num_threads ? CONVERT_CHUNK_SECTORS
+                                      : s->total_sectors;
+    qemu_mutex_init(&s->lock);
+    s->workers = g_new0(ImgConvertWorker, nr_workers);
+    for (i = 0; i < nr_workers; i++) {
+        ImgConvertWorker *w = &s->workers[i];
+
+        w->s = s;
+        w->ctx = s->num_threads ? aio_context_new(&error_abort)
+                                : qemu_get_aio_context();
+        qemu_co_mutex_init(&w->lock);
     }
 
-    /* Do the copy */
-    s->sector_next_status = 0;
+    /* Probe block status ahead of the copy, for the progress output */
     s->ret = -EINPROGRESS;
-
-    qemu_co_mutex_init(&s->lock);
-    for (i = 0; i < s->num_coroutines; i++) {
-        s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
-        s->wait_sector_num[i] = -1;
-        qemu_coroutine_enter(s->co[i]);
+    start = get_clock();
+    convert_run_workers(s, convert_co_probe, 1);
+    s->probe_ns = get_clock() - start;
+    if (s->ret != -EINPROGRESS) {
+        ret = s->ret;
+        goto out;
+    }
+    for (i = 0; i < nr_workers; i++) {
+        s->allocated_sectors += s->workers[i].allocated_sectors;
     }
 
-    while (s->running_coroutines) {
-        main_loop_wait(false);
+    /* Do the copy */
+    start = get_clock();
+    convert_run_workers(s, convert_co_do_copy, s->num_coroutines);
+    s->copy_ns = get_clock() - start;
+    if (s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
     }
 
     if (s->compressed && !s->ret) {
         /* signal EOF to align */
         ret = blk_pwrite_compressed(s->target, 0, 0, NULL);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
     }
+    ret = s->ret;
 
-    return s->ret;
+out:
+    for (i = 0; s->num_threads && i < nr_workers; i++) {
+        aio_context_unref(s->workers[i].ctx);
+    }
+    g_free(s->workers);
+    qemu_mutex_destroy(&s->lock);
+    return ret;
+}
+
+static void convert_print_phase(const char *name, uint64_t bytes,
+                                int64_t ns)
+{
+    double secs = MAX(ns, 1) / (double)NANOSECONDS_PER_SECOND;
+
+    printf("%-13s %" PRIu64 " bytes in %.2f s (%.2f MiB/s)\n", name, bytes,
+           secs, bytes / secs / MiB);
+}
+
+static void convert_print_stats(ImgConvertState *s)
+{
+    convert_print_phase("block status:", s->total_sectors * BDRV_SECTOR_SIZE,
+                        s->probe_ns);
+    convert_print_phase("read:", stat64_get(&s->bytes_read), s->copy_ns);
+    convert_print_phase("write:", stat64_get(&s->bytes_written), s->copy_ns);
+    convert_print_phase("write zeroes:", stat64_get(&s->bytes_zeroed),
+                        s->copy_ns);
+    if (s->dedup) {
+        convert_print_phase("deduplicated:", stat64_get(&s->bytes_dedup),
+                            s->copy_ns);
+    }
 }
 
 /* Check that bitmaps can be copied, or output an error */
@@ -2253,6 +2846,7 @@ static int img_convert(int argc, char **argv)
     bool explict_min_sparse = false;
     bool bitmaps = false;
     bool skip_broken = false;
+    bool dedup = false;
     int64_t rate_limit = 0;
 
     ImgConvertState s = (ImgConvertState) {
@@ -2275,6 +2869,8 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"parallel", required_argument, 0, OPTION_PARALLEL},
+            {"dedup", no_argument, 0, OPTION_DEDUP},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:WUr:",
@@ -2409,6 +3005,18 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_PARALLEL:
+            if (qemu_strtol(optarg, NULL, 0, &s.num_threads) ||
+                s.num_threads < 1 || s.num_threads > MAX_CONVERT_THREADS) {
+                error_report("Invalid number of threads. Allowed number of"
+                             " threads is between 1 and %d",
+                             MAX_CONVERT_THREADS);
+                goto fail_getopt;
+            }
+            break;
+        case OPTION_DEDUP:
+            dedup = true;
+            break;
         }
     }
 
@@ -2436,6 +3044,21 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (s.num_threads && s.wr_in_order) {
+        error_report("--parallel requires -W");
+        goto fail_getopt;
+    }
+
+    if (dedup && s.copy_range) {
+        error_report("Cannot use --dedup with copy offloading");
+        goto fail_getopt;
+    }
+
+    if (s.num_threads && rate_limit) {
+        error_report("Cannot use -r with --parallel");
+        goto fail_getopt;
+    }
+
     if (tgt_image_opts && !skip_create) {
         error_report("--target-image-opts requires use of -n flag");
         goto fail_getopt;
@@ -2480,6 +3103,7 @@ static int img_convert(int argc, char **argv)
     if (s.quiet) {
         progress = false;
     }
+    s.stats = progress && s.num_threads;
     qemu_progress_init(progress, 1.0);
     qemu_progress_print(0, 100);
 
@@ -2779,6 +3403,17 @@ static int img_convert(int argc, char **argv)
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    if (dedup) {
+        if (s.compressed) {
+            error_report("Cannot use --dedup with compression");
+            ret = -1;
+            goto out;
+        }
+        /* Formats without clusters are deduplicated in 64k units */
+        s.dedup_sectors = s.cluster_sectors ?: 64 * KiB / BDRV_SECTOR_SIZE;
+        s.dedup = block_dedup_new();
+    }
+
     if (rate_limit) {
         set_rate_limit(s.target, rate_limit);
     }
@@ -2795,6 +3430,10 @@ out:
         qemu_progress_print(100, 0);
     }
     qemu_progress_end();
+    if (!ret && s.stats) {
+        convert_print_stats(&s);
+    }
+    block_dedup_free(s.dedup);
     qemu_opts_del(opts);
     qemu_opts_free(create_opts);
     qobject_unref(open_opts);
@@ -4410,10 +5049,27 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+#define MAX_BENCH_JOBS 64
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    bool write;
+    int64_t start_ns;
+    QSLIST_ENTRY(BenchRequest) next;
+} BenchRequest;
+
+/* One job, which runs either in the main loop or in a thread of its own */
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
     bool write;
+    /* Percentage of reads in a write test */
+    int read_percent;
+    bool random;
+    GRand *rand;
     int bufsize;
     int step;
     int nrreq;
@@ -4421,12 +5077,19 @@ typedef struct BenchData {
     int flush_interval;
     bool drain_on_flush;
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    BenchRequest *reqs;
+    QSLIST_HEAD(, BenchRequest) free_reqs;
+
+    AioContext *ctx;
+    QemuThread thread;
+    int *running_jobs;
+    /* Completion latencies in ns, indexed by BenchRequest.write */
+    GArray *latency[2];
 
     int in_flight;
     bool in_flush;
     uint64_t offset;
-} BenchData;
+};
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -4436,6 +5099,33 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset = b->offset;
+
+    if (b->random) {
+        offset = (uint64_t)g_rand_int(b->rand) << 32 | g_rand_int(b->rand);
+        return offset % (b->image_size / b->bufsize) * b->bufsize;
+    }
+
+    b->offset += b->step;
+    b->offset %= b->image_size;
+    return offset;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_request_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+    int64_t latency = get_clock() - req->start_ns;
+
+    g_array_append_val(b->latency[req->write], latency);
+    QSLIST_INSERT_HEAD(&b->free_reqs, req, next);
+    bench_cb(b, ret);
+}
+
 static void bench_cb(void *opaque, int ret)
 {
     BenchData *b = opaque;
@@ -4481,18 +5171,24 @@ static void bench_cb(void *opaque, int ret)
     }
 
     while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        int64_t offset = b->offset;
+        BenchRequest *req = QSLIST_FIRST(&b->free_reqs);
+        int64_t offset = bench_next_offset(b);
+
         /* blk_aio_* might look for completed I/Os and kick bench_cb
          * again, so make sure this operation is counted by in_flight
          * and b->offset is ready for the next submission.
          */
+        QSLIST_REMOVE_HEAD(&b->free_reqs, next);
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
+        req->write = b->write &&
+                     g_rand_int_range(b->rand, 0, 100) >= b->read_percent;
+        req->start_ns = get_clock();
+        if (req->write) {
+            acb = blk_aio_pwritev(b->blk, offset, &req->qiov, 0,
+                                  bench_request_cb, req);
         } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
+            acb = blk_aio_preadv(b->blk, offset, &req->qiov, 0,
+                                 bench_request_cb, req);
         }
         if (!acb) {
             error_report("Failed to issue request");
@@ -4501,6 +5197,104 @@ static void bench_cb(void *opaque, int ret)
     }
 }
 
+static void *bench_thread(void *opaque)
+{
+    BenchData *b = opaque;
+
+    rcu_register_thread();
+    qemu_set_current_aio_context(b->ctx);
+
+    bench_cb(b, 0);
+    while (b->n > 0) {
+        aio_poll(b->ctx, true);
+    }
+
+    qatomic_dec(b->running_jobs);
+    aio_notify(qemu_get_aio_context());
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void bench_job_init(BenchData *b, int pattern, unsigned int seed)
+{
+    size_t buf_size = b->nrreq * b->bufsize;
+    int i;
+
+    b->rand = g_rand_new_with_seed(seed);
+    b->latency[0] = g_array_new(false, false, sizeof(int64_t));
+    b->latency[1] = g_array_new(false, false, sizeof(int64_t));
+
+    b->buf = blk_blockalign(b->blk, buf_size);
+    memset(b->buf, pattern, buf_size);
+    blk_register_buf(b->blk, b->buf, buf_size, &error_fatal);
+
+    b->reqs = g_new0(BenchRequest, b->nrreq);
+    for (i = 0; i < b->nrreq; i++) {
+        BenchRequest *req = &b->reqs[i];
+
+        req->b = b;
+        qemu_iovec_init(&req->qiov, 1);
+        qemu_iovec_add(&req->qiov, b->buf + i * b->bufsize, b->bufsize);
+        QSLIST_INSERT_HEAD(&b->free_reqs, req, next);
+    }
+}
+
+static void bench_job_cleanup(BenchData *b)
+{
+    int i;
+
+    if (!b->buf) {
+        return;
+    }
+    for (i = 0; i < b->nrreq; i++) {
+        qemu_iovec_destroy(&b->reqs[i].qiov);
+    }
+    g_free(b->reqs);
+    blk_unregister_buf(b->blk, b->buf, b->nrreq * b->bufsize);
+    qemu_vfree(b->buf);
+    g_array_free(b->latency[0], true);
+    g_array_free(b->latency[1], true);
+    g_rand_free(b->rand);
+}
+
+static int bench_compare_latency(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* In microseconds, @v is sorted */
+static double bench_percentile(const int64_t *v, unsigned int n, double p)
+{
+    return v[MIN(n - 1, (unsigned int)(n * p))] / 1000.0;
+}
+
+static void bench_print_latency(const char *name, GArray *latency,
+                                double secs, int bufsize)
+{
+    int64_t *v = &g_array_index(latency, int64_t, 0);
+    unsigned int n = latency->len;
+    double sum = 0;
+    unsigned int i;
+
+    if (!n) {
+        return;
+    }
+
+    qsort(v, n, sizeof(*v), bench_compare_latency);
+    for (i = 0; i < n; i++) {
+        sum += v[i];
+    }
+
+    printf("%s: %u requests, %.0f IOPS, %.2f MiB/s\n", name, n, n / secs,
+           (double)n * bufsize / secs / MiB);
+    printf("  latency (us): min %.1f, avg %.1f, p50 %.1f, p99 %.1f, "
+           "p99.9 %.1f, max %.1f\n", v[0] / 1000.0, sum / n / 1000.0,
+           bench_percentile(v, n, 0.5), bench_percentile(v, n, 0.99),
+           bench_percentile(v, n, 0.999), v[n - 1] / 1000.0);
+}
+
 static int img_bench(int argc, char **argv)
 {
     int c, ret = 0;
@@ -4519,12 +5313,17 @@ static int img_bench(int argc, char **argv)
     int64_t image_size;
     BlockBackend *blk = NULL;
     BenchData data = {};
+    BenchData *jobs = NULL;
+    int nr_jobs = 1, running_jobs = 0;
+    int read_percent = 0;
+    bool random = false;
+    GArray *latency[2] = { NULL, NULL };
     int flags = 0;
     bool writethrough = false;
     struct timeval t1, t2;
+    double secs;
     int i;
     bool force_share = false;
-    size_t buf_size = 0;
 
     for (;;) {
         static const struct option long_options[] = {
@@ -4534,6 +5333,9 @@ static int img_bench(int argc, char **argv)
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
             {"force-share", no_argument, 0, 'U'},
+            {"jobs", required_argument, 0, OPTION_JOBS},
+            {"random", no_argument, 0, OPTION_RANDOM},
+            {"rw-mix", required_argument, 0, OPTION_RW_MIX},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hc:d:f:ni:o:qs:S:t:wU", long_options,
@@ -4667,6 +5469,33 @@ static int img_bench(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_JOBS:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || !res ||
+                res > MAX_BENCH_JOBS) {
+                error_report("Invalid number of jobs. Allowed number of"
+                             " jobs is between 1 and %d", MAX_BENCH_JOBS);
+                return 1;
+            }
+            nr_jobs = res;
+            break;
+        }
+        case OPTION_RANDOM:
+            random = true;
+            break;
+        case OPTION_RW_MIX:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 100) {
+                error_report("Invalid read percentage specified");
+                return 1;
+            }
+            read_percent = res;
+            break;
+        }
         }
     }
 
@@ -4675,6 +5504,12 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
+    if (!is_write && read_percent) {
+        error_report("--rw-mix is only available in write tests");
+        ret = -1;
+        goto out;
+    }
+
     if (!is_write && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
@@ -4698,6 +5533,11 @@ static int img_bench(int argc, char **argv)
         ret = image_size;
         goto out;
     }
+    if (random && image_size < bufsize) {
+        error_report("Image is smaller than the buffer size");
+        ret = -1;
+        goto out;
+    }
 
     data = (BenchData) {
         .blk            = blk,
@@ -4708,47 +5548,94 @@ static int img_bench(int argc, char **argv)
         .n              = count,
         .offset         = offset,
         .write          = is_write,
+        .read_percent   = read_percent,
+        .random         = random,
         .flush_interval = flush_interval,
         .drain_on_flush = drain_on_flush,
     };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
+    if (random) {
+        printf("Sending %d %s requests, %d bytes each, %d in parallel "
+               "(random offsets)\n",
+               data.n, !data.write ? "read" : read_percent ? "mixed" : "write",
+               data.bufsize, data.nrreq);
+    } else {
+        printf("Sending %d %s requests, %d bytes each, %d in parallel "
+               "(starting at offset %" PRId64 ", step size %d)\n",
+               data.n, !data.write ? "read" : read_percent ? "mixed" : "write",
+               data.bufsize, data.nrreq, data.offset, data.step);
+    }
+    if (read_percent) {
+        printf("%d%% of the requests are reads\n", read_percent);
+    }
     if (flush_interval) {
         printf("Sending flush every %d requests\n", flush_interval);
     }
+    if (nr_jobs > 1) {
+        printf("Running %d jobs, each in its own thread\n", nr_jobs);
+    }
 
-    buf_size = data.nrreq * data.bufsize;
-    data.buf = blk_blockalign(blk, buf_size);
-    memset(data.buf, pattern, data.nrreq * data.bufsize);
-
-    blk_register_buf(blk, data.buf, buf_size, &error_fatal);
-
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
-    for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
-                       data.buf + i * data.bufsize, data.bufsize);
+    /* Sequential jobs start at evenly spaced offsets */
+    jobs = g_new0(BenchData, nr_jobs);
+    for (i = 0; i < nr_jobs; i++) {
+        jobs[i] = data;
+        jobs[i].offset = (data.offset + i * (image_size / nr_jobs)) %
+                         image_size;
+        jobs[i].ctx = nr_jobs > 1 ? aio_context_new(&error_abort)
+                                  : qemu_get_aio_context();
+        jobs[i].running_jobs = &running_jobs;
+        bench_job_init(&jobs[i], pattern, i);
     }
 
     gettimeofday(&t1, NULL);
-    bench_cb(&data, 0);
-
-    while (data.n > 0) {
-        main_loop_wait(false);
+    if (nr_jobs == 1) {
+        bench_cb(&jobs[0], 0);
+        while (jobs[0].n > 0) {
+            main_loop_wait(false);
+        }
+    } else {
+        /* Some drivers complete requests in the main loop */
+        running_jobs = nr_jobs;
+        for (i = 0; i < nr_jobs; i++) {
+            qemu_thread_create(&jobs[i].thread, "qemu-img-bench",
+                               bench_thread, &jobs[i], QEMU_THREAD_JOINABLE);
+        }
+        while (qatomic_read(&running_jobs)) {
+            main_loop_wait(false);
+        }
+        for (i = 0; i < nr_jobs; i++) {
+            qemu_thread_join(&jobs[i].thread);
+        }
     }
     gettimeofday(&t2, NULL);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    secs = (t2.tv_sec - t1.tv_sec)
+           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000);
+    printf("Run completed in %3.3f seconds.\n", secs);
+
+    latency[0] = g_array_new(false, false, sizeof(int64_t));
+    latency[1] = g_array_new(false, false, sizeof(int64_t));
+    for (i = 0; i < nr_jobs; i++) {
+        g_array_append_vals(latency[0], jobs[i].latency[0]->data,
+                            jobs[i].latency[0]->len);
+        g_array_append_vals(latency[1], jobs[i].latency[1]->data,
+                            jobs[i].latency[1]->len);
+    }
+    bench_print_latency("read", latency[0], secs, bufsize);
+    bench_print_latency("write", latency[1], secs, bufsize);
 
 out:
-    if (data.buf) {
-        blk_unregister_buf(blk, data.buf, buf_size);
+    for (i = 0; jobs && i < nr_jobs; i++) {
+        bench_job_cleanup(&jobs[i]);
+        if (nr_jobs > 1) {
+            aio_context_unref(jobs[i].ctx);
+        }
+    }
+    g_free(jobs);
+    for (i = 0; i < 2; i++) {
+        if (latency[i]) {
+            g_array_free(latency[i], true);
+        }
     }
-    qemu_vfree(data.buf);
     blk_unref(blk);
 
     if (ret) {
@@ -39,6 +39,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                memory-encryption=@var{} memory encryption object to use (default=none)\n"
     "                hmat=on|off controls ACPI HMAT support (default=off)\n"
     "                memory-backend='backend-id' specifies explicitly provided backend for main RAM (default=none)\n"
+    "                emulator-thread-context='id' applies the CPU affinity of a thread context to the main loop thread (default=none)\n"
     "                cxl-fmw.0.targets.0=firsttarget,cxl-fmw.0.targets.1=secondtarget,cxl-fmw.0.size=size[,cxl-fmw.0.interleave-granularity=granularity]\n",
     QEMU_ARCH_ALL)
 SRST
@@ -128,6 +129,11 @@ SRST
             -machine memory-backend=pc.ram
             -m 512M
 
+    ``emulator-thread-context='id'``
+        Place the main loop thread onto the host CPUs of the given
+        ``thread-context`` object before the board is created. Threads
+        created later by devices inherit this affinity.
+
     ``cxl-fmw.0.targets.0=firsttarget,cxl-fmw.0.targets.1=secondtarget,cxl-fmw.0.size=size[,cxl-fmw.0.interleave-granularity=granularity]``
         Define a CXL Fixed Memory Window (CFMW).
 
@@ -187,6 +193,10 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                one-insn-per-tb=on|off (one guest instruction per TCG translation block)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
+    "                tb-cache=file (remember TCG translation blocks across runs)\n"
+    "                tier-threshold=n (optimize TCG translation blocks after n entries, default 0)\n"
+    "                smc-batch=on|off (batch invalidation of code written by the guest, default off)\n"
+    "                profile-interval=n (sample executing TCG translation blocks every n ms, default 0)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
@@ -230,6 +240,40 @@ SRST
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
+    ``tb-cache=file``
+        Records which translation blocks were needed in ``file`` at
+        exit, and reads it back at startup. When the guest first runs
+        code on a page, the blocks remembered for that page are
+        translated at once, provided that their guest code is unchanged.
+        The file is only used if it was written by the same QEMU version
+        and target.
+
+    ``tier-threshold=n``
+        When non-zero, TCG first translates code without running the
+        TCG optimizer. Translation blocks that are entered ``n`` times
+        are then translated again with full optimization. This speeds up
+        start-up of workloads that run most of their code only a few
+        times. The default, 0, always optimizes.
+
+    ``smc-batch=on|off``
+        When enabled, guest writes to memory that holds translated code
+        do not immediately invalidate the translations. Instead, each
+        translation block checks on entry whether its page was written
+        to, and the stale translations of all written pages are dropped
+        together the next time a vCPU returns to the main loop. This
+        speeds up guests with just-in-time compilers, which often write
+        to pages that also hold code they run. It only applies to system
+        emulation, and is ignored with ``-icount``. The default is off.
+
+    ``profile-interval=n``
+        Every n milliseconds of guest time, note which translation block
+        each running vCPU is executing. The translation blocks sampled
+        most often are reported as ``hot-tb-pcs`` and ``hot-tb-samples``
+        by the ``query-stats`` command for the ``tcg`` provider, next to
+        per-vCPU TLB miss and exit counters that are always available.
+        It only applies to system emulation. The default, 0, disables
+        sampling.
+
     ``thread=single|multi``
         Controls number of TCG threads. When the TCG is multi-threaded
         there will be one thread per vCPU therefore taking advantage of
@@ -382,17 +426,17 @@ SRST
 ERST
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=firstcpu[-lastcpu]][,nodeid=node][,initiator=node]\n"
-    "-numa node[,memdev=id][,cpus=firstcpu[-lastcpu]][,nodeid=node][,initiator=node]\n"
+    "-numa node[,mem=size][,cpus=firstcpu[-lastcpu]][,nodeid=node][,initiator=node][,thread-context=id]\n"
+    "-numa node[,memdev=id][,cpus=firstcpu[-lastcpu]][,nodeid=node][,initiator=node][,thread-context=id]\n"
     "-numa dist,src=source,dst=destination,val=distance\n"
     "-numa cpu,node-id=node[,socket-id=x][,core-id=y][,thread-id=z]\n"
     "-numa hmat-lb,initiator=node,target=node,hierarchy=memory|first-level|second-level|third-level,data-type=access-latency|read-latency|write-latency[,latency=lat][,bandwidth=bw]\n"
     "-numa hmat-cache,node-id=node,size=size,level=level[,associativity=none|direct|complex][,policy=none|write-back|write-through][,line=size]\n",
     QEMU_ARCH_ALL)
 SRST
-``-numa node[,mem=size][,cpus=firstcpu[-lastcpu]][,nodeid=node][,initiator=initiator]``
+``-numa node[,mem=size][,cpus=firstcpu[-lastcpu]][,nodeid=node][,initiator=initiator][,thread-context=id]``
   \ 
-``-numa node[,memdev=id][,cpus=firstcpu[-lastcpu]][,nodeid=node][,initiator=initiator]``
+``-numa node[,memdev=id][,cpus=firstcpu[-lastcpu]][,nodeid=node][,initiator=initiator][,thread-context=id]``
   \
 ``-numa dist,src=source,dst=destination,val=distance``
   \ 
@@ -455,6 +499,17 @@ SRST
     (or legacy '\ ``mem``\ ' if available). In QEMU 5.2, the support
     for '\ ``-numa node``\ ' without memory specified was removed.
 
+    '\ ``thread-context``\ ' applies the CPU affinity of a
+    '\ ``thread-context``\ ' object to the threads of all VCPUs of the
+    node before they run, for example to keep them on the host NUMA node
+    that backs the node's memory:
+
+    ::
+
+        -object thread-context,id=tc0,node-affinity=0 \
+        -object memory-backend-ram,id=m0,size=4G,host-nodes=0,policy=bind \
+        -numa node,nodeid=0,memdev=m0,cpus=0-3,thread-context=tc0
+
     '\ ``initiator``\ ' is an additional option that points to an
     initiator NUMA node that has best performance (the lowest latency or
     largest bandwidth) to this NUMA node. Note that this option can be
@@ -1882,6 +1937,11 @@ SRST
     ``mount_tag=mount_tag``
         Specifies the tag name to be used by the guest to mount this
         export point.
+
+    ``iothread=id``
+        Process requests in the given IOThread instead of the main loop.
+        This needs ioeventfd and irqfd support (e.g. KVM), and cannot be
+        combined with fsdev throttling.
 ERST
 
 DEF("virtfs", HAS_ARG, QEMU_OPTION_virtfs,
@@ -2277,6 +2337,7 @@ DEF("spice", HAS_ARG, QEMU_OPTION_spice,
     "       [,jpeg-wan-compression=[auto|never|always]]\n"
     "       [,zlib-glz-wan-compression=[auto|never|always]]\n"
     "       [,streaming-video=[off|all|filter]][,disable-copy-paste=on|off]\n"
+    "       [,video-codec=<encoder>:<codec>[;<encoder>:<codec>...]]\n"
     "       [,disable-agent-file-xfer=on|off][,agent-mouse=[on|off]]\n"
     "       [,playback-compression=[on|off]][,seamless-migration=[on|off]]\n"
     "       [,gl=[on|off]][,rendernode=<file>]\n"
@@ -2357,6 +2418,12 @@ SRST
     ``streaming-video=[off|all|filter]``
         Configure video stream detection. Default is off.
 
+    ``video-codec=<encoder>:<codec>[;<encoder>:<codec>...]``
+        Preferred video encoders and codecs for video streams, in order,
+        for example ``gstreamer:h264;spice:mjpeg``. The GStreamer
+        encoders may use the hardware encoders of the host GPU. Default
+        is the spice server's choice.
+
     ``agent-mouse=[on|off]``
         Enable/disable passing mouse events via vdagent. Default is on.
 
@@ -2368,7 +2435,11 @@ SRST
         Enable/disable spice seamless migration. Default is off.
 
     ``gl=[on|off]``
-        Enable/disable OpenGL context. Default is off.
+        Enable/disable OpenGL context. Default is off. With spice
+        server 0.15.3 or newer, ``gl=on`` can be combined with ``port``
+        or ``tls-port``: the spice server then encodes the guest
+        scanouts as a video stream for remote clients, according to
+        ``video-codec``.
 
     ``rendernode=<file>``
         DRM render node for OpenGL rendering. If not specified, it will
@@ -2609,6 +2680,12 @@ SRST
         bandwidth when playing videos. Disabling adaptive encodings
         restores the original static behavior of encodings like Tight.
 
+    ``encoder-threads=n``
+        Encode framebuffer updates with up to n threads (default 1).
+        Large updates are split into slices that are compressed in
+        parallel, at the cost of a slightly worse compression ratio.
+        The zlib encoding is always compressed by a single thread.
+
     ``share=[allow-exclusive|force-shared|ignore]``
         Set display sharing policy. 'allow-exclusive' allows clients to
         ask for exclusive access. As suggested by the rfb spec this is
@@ -2919,6 +2996,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #ifdef CONFIG_AF_XDP
     "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
     "         [,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]\n"
+    "         [,busy-poll-budget=n]\n"
     "                attach to the existing network interface 'name' with AF_XDP socket\n"
     "                use 'mode=MODE' to specify an XDP program attach mode\n"
     "                use 'force-copy=on|off' to force XDP copy mode even if device supports zero-copy (default: off)\n"
@@ -2928,6 +3006,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                  added to a socket map in XDP program.  One socket per queue.\n"
     "                use 'queues=n' to specify how many queues of a multiqueue interface should be used\n"
     "                use 'start-queue=m' to specify the first queue that should be used\n"
+    "                use 'busy-poll-budget=n' to busy poll the sockets with a NAPI budget of n\n"
 #endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
@@ -3431,7 +3510,7 @@ SRST
         # launch QEMU instance
         |qemu_system| linux.img -nic vde,sock=/tmp/myswitch
 
-``-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off][,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]``
+``-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off][,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z][,busy-poll-budget=n]``
     Configure AF_XDP backend to connect to a network interface 'name'
     using AF_XDP socket.  A specific program attach mode for a default
     XDP program can be forced with 'mode', defaults to best-effort,
@@ -3480,6 +3559,21 @@ SRST
         |qemu_system| linux.img -device virtio-net-pci,netdev=n1 \\
             -netdev af-xdp,id=n1,ifname=eth0,queues=3,inhibit=on,sock-fds=15:16:17
 
+    'busy-poll-budget' enables preferred busy polling on the sockets: the
+    device queues are then processed when the backend polls them rather
+    than from device interrupts.  This works best with each queue pair
+    bound to its own IOThread through the virtio-net 'iothread-vq-mapping'
+    property, so that AioContext polling drives the sockets.  The kernel
+    also needs ``napi_defer_hard_irqs`` and ``gro_flush_timeout`` set on
+    the interface.
+
+    .. parsed-literal::
+
+        |qemu_system| linux.img \\
+            -object iothread,id=io0 -object iothread,id=io1 \\
+            -device '{"driver":"virtio-net-pci","netdev":"n1","mq":true,"vectors":6,"iothread-vq-mapping":[{"iothread":"io0"},{"iothread":"io1"}]}' \\
+            -netdev af-xdp,id=n1,ifname=eth0,queues=2,busy-poll-budget=64
+
 ``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n]``
     Establish a vhost-user netdev, backed by a chardev id. The chardev
     should be a unix domain socket backed one. The vhost-user uses a
@@ -5140,6 +5234,15 @@ SRST
         The ``host-nodes`` option binds the memory range to a list of
         NUMA host nodes.
 
+        The ``near-device`` option binds the memory range to the NUMA
+        host node of a device, given as a host PCI address such as
+        ``0000:09:00.0`` or as a sysfs device path. It is meant for the
+        memory of guest NUMA nodes exposed next to an assigned GPU, e.g.
+        with ``acpi-generic-initiator``. The policy defaults to ``bind``
+        and, unless ``prealloc-context`` is set, preallocation threads
+        run on the CPUs of that node. It cannot be combined with
+        ``host-nodes``.
+
         The ``policy`` option sets the NUMA policy to one of the
         following values:
 
@@ -5230,7 +5333,7 @@ SRST
 
         The ``share`` boolean option is on by default with memfd.
 
-    ``-object iommufd,id=id[,fd=fd]``
+    ``-object iommufd,id=id[,fd=fd][,dma-map-threads=n]``
         Creates an iommufd backend which allows control of DMA mapping
         through the ``/dev/iommu`` device.
 
@@ -5242,6 +5345,13 @@ SRST
         across all subsystems, bringing the benefit of centralized
         reference counting.
 
+        The ``dma-map-threads`` parameter sets the number of threads used
+        to pin and map guest RAM regions of 2 GiB or more. Such regions
+        are mapped in 1 GiB pieces concurrently, which reduces the time
+        needed to attach a device to a guest with a large amount of
+        memory. The default is 1, i.e. regions are mapped by a single
+        ioctl.
+
     ``-object rng-builtin,id=id``
         Creates a random number generator backend which obtains entropy
         from QEMU builtin functions. The ``id`` parameter is a unique ID
@@ -5814,7 +5924,7 @@ SRST
 
             CN=laptop.example.com,O=Example Home,L=London,ST=London,C=GB
 
-    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,aio-max-batch=aio-max-batch``
+    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,aio-max-batch=aio-max-batch[,thread-context=id][,poll-group=id]``
         Creates a dedicated event loop thread that devices can be
         assigned to. This is known as an IOThread. By default device
         emulation happens in vCPU threads or the main event loop thread.
@@ -5854,6 +5964,15 @@ SRST
         in a batch for the AIO engine, 0 means that the engine will use
         its default.
 
+        The ``thread-context`` parameter creates the IOThread within the
+        given ``thread-context`` object, so that it inherits the CPU
+        affinity of the context.
+
+        The ``poll-group`` parameter lets the threads of the given
+        ``poll-group`` object busy wait for events in place of the
+        IOThread, which sleeps while they poll. It cannot be changed at
+        run-time.
+
         The IOThread parameters can be modified at run-time using the
         ``qom-set`` command (where ``iothread1`` is the IOThread's
         ``id``):
@@ -5861,6 +5980,22 @@ SRST
         ::
 
             (qemu) qom-set /objects/iothread1 poll-max-ns 100000
+
+    ``-object poll-group,id=id[,threads=n]``
+        Creates n threads (default 1) that poll for events on behalf of
+        the IOThreads that name this object in their ``poll-group``
+        parameter. Each IOThread keeps its adaptive polling algorithm,
+        but sleeps for the time it would have spent busy waiting, while
+        one of the group's threads polls its virtqueues and completion
+        rings and wakes it up when work is ready. With many IOThreads,
+        this bounds the host CPUs spent busy waiting to the number of
+        threads in the group:
+
+        ::
+
+            -object poll-group,id=pg0,threads=2 \
+            -object iothread,id=iothread0,poll-group=pg0 \
+            -object iothread,id=iothread1,poll-group=pg0
 ERST
 
 
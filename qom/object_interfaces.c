@@ -7,6 +7,7 @@
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/json-input-visitor.h"
 #include "qapi/qobject-input-visitor.h"
 #include "qapi/qobject-output-visitor.h"
 #include "qom/object_interfaces.h"
@@ -262,17 +263,16 @@ static void user_creatable_print_help_from_qdict(QDict *args)
 ObjectOptions *user_creatable_parse_str(const char *str, Error **errp)
 {
     ERRP_GUARD();
-    QObject *obj;
+    QObject *obj = NULL;
     bool help;
     Visitor *v;
     ObjectOptions *options;
 
     if (str[0] == '{') {
-        obj = qobject_from_json(str, errp);
-        if (!obj) {
+        v = json_input_visitor_new(str, errp);
+        if (!v) {
             return NULL;
         }
-        v = qobject_input_visitor_new(obj);
     } else {
         QDict *args = keyval_parse(str, "qom-type", &help, errp);
         if (*errp) {
@@ -15,6 +15,8 @@
 #include "replay-internal.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
 
 /* Mutex to protect reading and writing events to the log.
    data_kind and has_unread_data are also protected
@@ -30,6 +32,30 @@ static unsigned long mutex_head, mutex_tail;
 static bool write_error;
 FILE *replay_file;
 
+/*
+ * In record mode the log is written by a separate thread, so that the
+ * vCPU and I/O threads do not stall on the file.  Events are appended
+ * to @buf under the replay mutex, and full buffers are handed over to
+ * the thread as @pending.  Two buffers are enough: the producer only
+ * waits when it fills one while the other is still being written.
+ */
+#define REPLAY_WRITE_BUF_SIZE (1 * MiB)
+
+static struct {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* Protected by the replay mutex */
+    uint8_t *buf;
+    size_t len;
+    /* Protected by @mutex */
+    uint8_t *spare;
+    uint8_t *pending;
+    size_t pending_len;
+    bool error;
+    bool exiting;
+} writer;
+
 static void replay_write_error(void)
 {
     if (!write_error) {
@@ -38,6 +64,121 @@ static void replay_write_error(void)
     }
 }
 
+static void *replay_writer_thread(void *opaque)
+{
+    qemu_mutex_lock(&writer.mutex);
+    while (true) {
+        uint8_t *buf;
+        size_t len;
+        bool ok;
+
+        while (!writer.pending && !writer.exiting) {
+            qemu_cond_wait(&writer.cond, &writer.mutex);
+        }
+        if (!writer.pending) {
+            break;
+        }
+        buf = writer.pending;
+        len = writer.pending_len;
+        qemu_mutex_unlock(&writer.mutex);
+
+        ok = fwrite(buf, 1, len, replay_file) == len;
+
+        qemu_mutex_lock(&writer.mutex);
+        writer.error |= !ok;
+        writer.spare = buf;
+        writer.pending = NULL;
+        qemu_cond_broadcast(&writer.cond);
+    }
+    qemu_mutex_unlock(&writer.mutex);
+    return NULL;
+}
+
+/* Wait until the thread has written out the previous buffer */
+static void replay_writer_wait_locked(void)
+{
+    while (writer.pending) {
+        qemu_cond_wait(&writer.cond, &writer.mutex);
+    }
+    if (writer.error) {
+        replay_write_error();
+    }
+}
+
+static void replay_writer_submit(void)
+{
+    qemu_mutex_lock(&writer.mutex);
+    replay_writer_wait_locked();
+    writer.pending = writer.buf;
+    writer.pending_len = writer.len;
+    writer.buf = writer.spare;
+    writer.spare = NULL;
+    writer.len = 0;
+    qemu_cond_broadcast(&writer.cond);
+    qemu_mutex_unlock(&writer.mutex);
+}
+
+void replay_writer_start(void)
+{
+    assert(!writer.buf);
+    qemu_mutex_init(&writer.mutex);
+    qemu_cond_init(&writer.cond);
+    writer.buf = g_malloc(REPLAY_WRITE_BUF_SIZE);
+    writer.spare = g_malloc(REPLAY_WRITE_BUF_SIZE);
+    writer.len = 0;
+    writer.exiting = false;
+    qemu_thread_create(&writer.thread, "replay-writer", replay_writer_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+}
+
+void replay_writer_flush(void)
+{
+    if (!writer.buf) {
+        return;
+    }
+    if (writer.len) {
+        replay_writer_submit();
+    }
+    qemu_mutex_lock(&writer.mutex);
+    replay_writer_wait_locked();
+    qemu_mutex_unlock(&writer.mutex);
+}
+
+void replay_writer_stop(void)
+{
+    if (!writer.buf) {
+        return;
+    }
+    replay_writer_flush();
+
+    qemu_mutex_lock(&writer.mutex);
+    writer.exiting = true;
+    qemu_cond_broadcast(&writer.cond);
+    qemu_mutex_unlock(&writer.mutex);
+    qemu_thread_join(&writer.thread);
+
+    g_free(writer.buf);
+    g_free(writer.spare);
+    writer.buf = writer.spare = NULL;
+    qemu_cond_destroy(&writer.cond);
+    qemu_mutex_destroy(&writer.mutex);
+}
+
+static void replay_write_bytes(const uint8_t *buf, size_t size)
+{
+    while (size) {
+        size_t chunk = MIN(size, REPLAY_WRITE_BUF_SIZE - writer.len);
+
+        memcpy(writer.buf + writer.len, buf, chunk);
+        writer.len += chunk;
+        buf += chunk;
+        size -= chunk;
+        if (writer.len == REPLAY_WRITE_BUF_SIZE) {
+            replay_writer_submit();
+        }
+    }
+}
+
 static void replay_read_error(void)
 {
     error_report("error reading the replay data");
@@ -47,7 +188,12 @@ static void replay_read_error(void)
 void replay_put_byte(uint8_t byte)
 {
     if (replay_file) {
-        if (putc(byte, replay_file) == EOF) {
+        if (writer.buf) {
+            writer.buf[writer.len++] = byte;
+            if (writer.len == REPLAY_WRITE_BUF_SIZE) {
+                replay_writer_submit();
+            }
+        } else if (putc(byte, replay_file) == EOF) {
             replay_write_error();
         }
     }
@@ -82,7 +228,9 @@ void replay_put_array(const uint8_t *buf, size_t size)
 {
     if (replay_file) {
         replay_put_dword(size);
-        if (fwrite(buf, 1, size, replay_file) != size) {
+        if (writer.buf) {
+            replay_write_bytes(buf, size);
+        } else if (fwrite(buf, 1, size, replay_file) != size) {
             replay_write_error();
         }
     }
@@ -113,6 +113,13 @@ void replay_put_dword(uint32_t dword);
 void replay_put_qword(int64_t qword);
 void replay_put_array(const uint8_t *buf, size_t size);
 
+/*! Starts the thread that writes the log in record mode. */
+void replay_writer_start(void);
+/*! Waits until all the data put so far is in the log file. */
+void replay_writer_flush(void);
+/*! Flushes the log and stops the writer thread. */
+void replay_writer_stop(void);
+
 uint8_t replay_get_byte(void);
 uint16_t replay_get_word(void);
 uint32_t replay_get_dword(void);
@@ -22,6 +22,8 @@
 static int replay_pre_save(void *opaque)
 {
     ReplayState *state = opaque;
+
+    replay_writer_flush();
     state->file_offset = ftell(replay_file);
 
     return 0;
@@ -280,7 +280,8 @@ def gen_register_command(name: str,
                          success_response: bool,
                          allow_oob: bool,
                          allow_preconfig: bool,
-                         coroutine: bool) -> str:
+                         coroutine: bool,
+                         read_only: bool) -> str:
     options = []
 
     if not success_response:
@@ -291,6 +292,8 @@ def gen_register_command(name: str,
         options += ['QCO_ALLOW_PRECONFIG']
     if coroutine:
         options += ['QCO_COROUTINE']
+    if read_only:
+        options += ['QCO_READ_ONLY']
 
     ret = mcgen('''
     qmp_register_command(cmds, "%(name)s",
@@ -382,7 +385,8 @@ def visit_command(self,
                       boxed: bool,
                       allow_oob: bool,
                       allow_preconfig: bool,
-                      coroutine: bool) -> None:
+                      coroutine: bool,
+                      read_only: bool) -> None:
         if not gen:
             return
         # FIXME: If T is a user-defined type, the user is responsible
@@ -407,7 +411,7 @@ def visit_command(self,
             with ifcontext(ifcond, self._genh, self._genc):
                 self._genc.add(gen_register_command(
                     name, features, success_response, allow_oob,
-                    allow_preconfig, coroutine))
+                    allow_preconfig, coroutine, read_only))
 
 
 def gen_commands(schema: QAPISchema,
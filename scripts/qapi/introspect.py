@@ -358,7 +358,8 @@ def visit_command(self, name: str, info: Optional[QAPISourceInfo],
                       arg_type: Optional[QAPISchemaObjectType],
                       ret_type: Optional[QAPISchemaType], gen: bool,
                       success_response: bool, boxed: bool, allow_oob: bool,
-                      allow_preconfig: bool, coroutine: bool) -> None:
+                      allow_preconfig: bool, coroutine: bool,
+                      read_only: bool) -> None:
         assert self._schema is not None
 
         arg_type = arg_type or self._schema.the_empty_object_type
@@ -159,7 +159,7 @@ def visit_alternate_type(self, name, info, ifcond, features, variants):
 
     def visit_command(self, name, info, ifcond, features,
                       arg_type, ret_type, gen, success_response, boxed,
-                      allow_oob, allow_preconfig, coroutine):
+                      allow_oob, allow_preconfig, coroutine, read_only):
         pass
 
     def visit_event(self, name, info, ifcond, features, arg_type, boxed):
@@ -798,7 +798,7 @@ class QAPISchemaCommand(QAPISchemaEntity):
     def __init__(self, name, info, doc, ifcond, features,
                  arg_type, ret_type,
                  gen, success_response, boxed, allow_oob, allow_preconfig,
-                 coroutine):
+                 coroutine, read_only):
         super().__init__(name, info, doc, ifcond, features)
         assert not arg_type or isinstance(arg_type, str)
         assert not ret_type or isinstance(ret_type, str)
@@ -812,6 +812,7 @@ def __init__(self, name, info, doc, ifcond, features,
         self.allow_oob = allow_oob
         self.allow_preconfig = allow_preconfig
         self.coroutine = coroutine
+        self.read_only = read_only
 
     def check(self, schema):
         super().check(schema)
@@ -860,7 +861,7 @@ def visit(self, visitor):
             self.name, self.info, self.ifcond, self.features,
             self.arg_type, self.ret_type, self.gen, self.success_response,
             self.boxed, self.allow_oob, self.allow_preconfig,
-            self.coroutine)
+            self.coroutine, self.read_only)
 
 
 class QAPISchemaEvent(QAPISchemaEntity):
@@ -1166,6 +1167,7 @@ def _def_command(self, expr: QAPIExpression):
         allow_oob = expr.get('allow-oob', False)
         allow_preconfig = expr.get('allow-preconfig', False)
         coroutine = expr.get('coroutine', False)
+        read_only = expr.get('read-only', False)
         ifcond = QAPISchemaIfCond(expr.get('if'))
         info = expr.info
         features = self._make_features(expr.get('features'), info)
@@ -1180,7 +1182,7 @@ def _def_command(self, expr: QAPIExpression):
                                            features, data, rets,
                                            gen, success_response,
                                            boxed, allow_oob, allow_preconfig,
-                                           coroutine))
+                                           coroutine, read_only))
 
     def _def_event(self, expr: QAPIExpression):
         name = expr['event']
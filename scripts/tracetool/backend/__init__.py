@@ -19,11 +19,17 @@
 Backend attributes
 ------------------
 
-========= ====================================================================
-Attribute Description
-========= ====================================================================
-PUBLIC    If exists and is set to 'True', the backend is considered "public".
-========= ====================================================================
+=========================== ==================================================
+Attribute                   Description
+=========================== ==================================================
+PUBLIC                      If exists and is set to 'True', the backend is
+                            considered "public".
+CHECK_TRACE_EVENT_GET_STATE If exists and is set to 'True', the backend only
+                            traces events that are enabled in the QEMU dynamic
+                            state.  When all backends set it, the generated
+                            trace_<event>() checks that state before calling
+                            into any backend.
+=========================== ==================================================
 
 
 Backend functions
@@ -104,6 +110,12 @@ def __init__(self, backends, format):
         for backend in self._backends:
             assert exists(backend)
         assert tracetool.format.exists(self._format)
+        # Whether all backends only trace events enabled in the QEMU dstate
+        self.check_trace_event_get_state = len(self._backends) > 0
+        for backend in self._backends:
+            module = tracetool.try_import("tracetool.backend." + backend)[1]
+            if not getattr(module, "CHECK_TRACE_EVENT_GET_STATE", False):
+                self.check_trace_event_get_state = False
 
     def _run_function(self, name, *args, **kwargs):
         for backend in self._backends:
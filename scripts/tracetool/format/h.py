@@ -71,7 +71,12 @@ def generate(events, backend, group):
 
         out('}')
 
-        cond = "true"
+        # Check the dynamic state before marshalling any argument, so
+        # that a disabled event costs a single well-predicted branch
+        if backend.check_trace_event_get_state:
+            cond = "trace_event_get_state(%s)" % ("TRACE_" + e.name.upper())
+        else:
+            cond = "true"
 
         out('',
             'static inline void %(api)s(%(args)s)',
@@ -0,0 +1,95 @@
+/*
+ * Latency histograms of the block backends of guest devices
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "block/accounting.h"
+#include "hw/qdev-core.h"
+#include "sysemu/block-backend.h"
+#include "sysemu/stats.h"
+
+static const char *const block_latency_stats[BLOCK_MAX_IOTYPE] = {
+    [BLOCK_ACCT_READ] = "read-latency",
+    [BLOCK_ACCT_WRITE] = "write-latency",
+    [BLOCK_ACCT_FLUSH] = "flush-latency",
+    [BLOCK_ACCT_ZONE_APPEND] = "zone-append-latency",
+    [BLOCK_ACCT_UNMAP] = "unmap-latency",
+};
+
+static void block_query_stats_cb(StatsResultList **result, StatsTarget target,
+                                 strList *names, strList *targets,
+                                 Error **errp)
+{
+    BlockBackend *blk = NULL;
+
+    if (target != STATS_TARGET_BLOCK_BACKEND) {
+        return;
+    }
+
+    while ((blk = blk_all_next(blk)) != NULL) {
+        DeviceState *dev = blk_get_attached_dev(blk);
+        uint64_t hist[BLOCK_LATENCY_LOG2_BUCKETS];
+        g_autofree char *path = NULL;
+        StatsList *list = NULL;
+        int type, i;
+
+        if (!dev) {
+            continue;
+        }
+
+        /* Prepend in reverse order of the schema */
+        for (type = BLOCK_MAX_IOTYPE - 1; type > BLOCK_ACCT_NONE; type--) {
+            Stats *stats;
+
+            if (!apply_str_list_filter(block_latency_stats[type], names)) {
+                continue;
+            }
+            block_acct_get_latency_log2(blk_get_stats(blk), type, hist);
+
+            stats = g_new0(Stats, 1);
+            stats->name = g_strdup(block_latency_stats[type]);
+            stats->value = g_new0(StatsValue, 1);
+            stats->value->type = QTYPE_QLIST;
+            for (i = BLOCK_LATENCY_LOG2_BUCKETS - 1; i >= 0; i--) {
+                QAPI_LIST_PREPEND(stats->value->u.list, hist[i]);
+            }
+            QAPI_LIST_PREPEND(list, stats);
+        }
+        if (!list) {
+            continue;
+        }
+
+        path = object_get_canonical_path(OBJECT(dev));
+        add_stats_entry(result, STATS_PROVIDER_BLOCK, path, list);
+    }
+}
+
+static void block_query_stats_schemas_cb(StatsSchemaList **result,
+                                         Error **errp)
+{
+    StatsSchemaValueList *list = NULL;
+    int type;
+
+    for (type = BLOCK_MAX_IOTYPE - 1; type > BLOCK_ACCT_NONE; type--) {
+        StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+        value->name = g_strdup(block_latency_stats[type]);
+        value->type = STATS_TYPE_LOG2_HISTOGRAM;
+        value->has_unit = true;
+        value->unit = STATS_UNIT_SECONDS;
+        value->has_base = true;
+        value->base = 10;
+        value->exponent = -9;
+        QAPI_LIST_PREPEND(list, value);
+    }
+    add_stats_schema(result, STATS_PROVIDER_BLOCK,
+                     STATS_TARGET_BLOCK_BACKEND, list);
+}
+
+void block_stats_init(void)
+{
+    add_stats_callbacks(STATS_PROVIDER_BLOCK, block_query_stats_cb,
+                        block_query_stats_schemas_cb);
+}
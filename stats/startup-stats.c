@@ -0,0 +1,98 @@
+/*
+ * Timeline of QEMU startup
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "hw/qdev-core.h"
+#include "sysemu/runstate.h"
+#include "sysemu/stats.h"
+
+/* Phases of machine initialization, in order; -1 for the first VM start */
+static const struct {
+    const char *name;
+    int phase;
+} startup_stats_desc[] = {
+    { "machine-created", PHASE_MACHINE_CREATED },
+    { "accel-created", PHASE_ACCEL_CREATED },
+    { "late-backends-created", PHASE_LATE_BACKENDS_CREATED },
+    { "machine-initialized", PHASE_MACHINE_INITIALIZED },
+    { "machine-ready", PHASE_MACHINE_READY },
+    { "vm-started", -1 },
+};
+
+static int64_t vm_start_ns = -1;
+static VMChangeStateEntry *vm_start_entry;
+
+static void startup_vm_state_change(void *opaque, bool running,
+                                    RunState state)
+{
+    if (running) {
+        vm_start_ns = phase_get_elapsed_ns();
+        qemu_del_vm_change_state_handler(vm_start_entry);
+        vm_start_entry = NULL;
+    }
+}
+
+static void startup_query_stats_cb(StatsResultList **result,
+                                   StatsTarget target, strList *names,
+                                   strList *targets, Error **errp)
+{
+    StatsList *list = NULL;
+    int i;
+
+    if (target != STATS_TARGET_VM) {
+        return;
+    }
+
+    for (i = ARRAY_SIZE(startup_stats_desc) - 1; i >= 0; i--) {
+        int phase = startup_stats_desc[i].phase;
+        int64_t ns = phase < 0 ? vm_start_ns : phase_get_time_ns(phase);
+        Stats *stats;
+
+        if (ns < 0 || !apply_str_list_filter(startup_stats_desc[i].name,
+                                             names)) {
+            continue;
+        }
+        stats = g_new0(Stats, 1);
+        stats->name = g_strdup(startup_stats_desc[i].name);
+        stats->value = g_new0(StatsValue, 1);
+        stats->value->type = QTYPE_QNUM;
+        stats->value->u.scalar = ns;
+        QAPI_LIST_PREPEND(list, stats);
+    }
+    if (!list) {
+        return;
+    }
+    add_stats_entry(result, STATS_PROVIDER_STARTUP, NULL, list);
+}
+
+static void startup_query_stats_schemas_cb(StatsSchemaList **result,
+                                           Error **errp)
+{
+    StatsSchemaValueList *list = NULL;
+    int i;
+
+    for (i = ARRAY_SIZE(startup_stats_desc) - 1; i >= 0; i--) {
+        StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+        value->name = g_strdup(startup_stats_desc[i].name);
+        value->type = STATS_TYPE_INSTANT;
+        value->has_unit = true;
+        value->unit = STATS_UNIT_SECONDS;
+        value->has_base = true;
+        value->base = 10;
+        value->exponent = -9;
+        QAPI_LIST_PREPEND(list, value);
+    }
+    add_stats_schema(result, STATS_PROVIDER_STARTUP, STATS_TARGET_VM, list);
+}
+
+void startup_stats_init(void)
+{
+    vm_start_entry = qemu_add_vm_change_state_handler(startup_vm_state_change,
+                                                      NULL);
+    add_stats_callbacks(STATS_PROVIDER_STARTUP, startup_query_stats_cb,
+                        startup_query_stats_schemas_cb);
+}
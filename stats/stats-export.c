@@ -0,0 +1,455 @@
+/*
+ * Export of runtime statistics through a shared memory file
+ *
+ * A monitoring agent that polls query-stats over QMP pays for the JSON
+ * serialization and for the QMP dispatcher on both sides.  A stats-export
+ * object instead writes all statistics and their schema to a file, which
+ * the agent maps and reads lock-free.  The format is described in
+ * docs/interop/stats-export.rst.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include "qapi/error.h"
+#include "qapi/qapi-commands-stats.h"
+#include "qapi/visitor.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "qom/object_interfaces.h"
+#include "sysemu/stats.h"
+
+#define TYPE_STATS_EXPORT "stats-export"
+OBJECT_DECLARE_SIMPLE_TYPE(StatsExport, STATS_EXPORT)
+
+#define STATS_EXPORT_MAGIC          "QEMUSTAT"
+#define STATS_EXPORT_VERSION        1
+
+/* The statistics did not fit in the file and were left out */
+#define STATS_EXPORT_F_TRUNCATED    (1u << 0)
+
+#define STATS_EXPORT_TYPE_UNKNOWN   0xff
+
+typedef struct StatsExportHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t seq;
+    uint32_t flags;
+    uint64_t generation;
+    uint64_t timestamp_ns;
+    uint32_t nr_entries;
+    uint32_t entries_offset;
+    uint32_t entries_size;
+    uint32_t values_offset;
+    uint32_t values_size;
+    uint32_t reserved;
+} StatsExportHeader;
+
+QEMU_BUILD_BUG_ON(sizeof(StatsExportHeader) != 64);
+
+/* Followed by the provider, target, object and name strings */
+typedef struct StatsExportEntry {
+    uint32_t size;
+    uint8_t type;
+    uint8_t unit;
+    int8_t base;
+    uint8_t reserved;
+    int16_t exponent;
+    uint16_t provider_len;
+    uint16_t target_len;
+    uint16_t object_len;
+    uint16_t name_len;
+    uint16_t reserved2;
+    uint32_t bucket_size;
+    uint32_t nr_values;
+    uint32_t value_index;
+} StatsExportEntry;
+
+QEMU_BUILD_BUG_ON(sizeof(StatsExportEntry) != 32);
+
+struct StatsExport {
+    Object parent_obj;
+
+    char *path;
+    uint64_t size;
+    uint32_t interval_ms;
+
+    int fd;
+    StatsExportHeader *header;
+    QEMUTimer *timer;
+
+    /* Entries of the last update, to detect schema changes */
+    GByteArray *entries;
+};
+
+static StatsSchemaValue *stats_export_find_schema(StatsSchemaList *schemas,
+                                                  StatsProvider provider,
+                                                  StatsTarget target,
+                                                  const char *name)
+{
+    StatsSchemaValueList *value;
+
+    for (; schemas; schemas = schemas->next) {
+        if (schemas->value->provider != provider ||
+            schemas->value->target != target) {
+            continue;
+        }
+        for (value = schemas->value->stats; value; value = value->next) {
+            if (g_str_equal(value->value->name, name)) {
+                return value->value;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void stats_export_add_string(GByteArray *entries, const char *s,
+                                    uint16_t *len)
+{
+    *len = MIN(strlen(s), UINT16_MAX);
+    g_byte_array_append(entries, (const guint8 *)s, *len);
+}
+
+static void stats_export_add_entry(GByteArray *entries, GArray *values,
+                                   StatsTarget target, StatsResult *result,
+                                   Stats *stats, StatsSchemaValue *schema)
+{
+    static const uint8_t padding[8];
+    StatsExportEntry e = {
+        .type = STATS_EXPORT_TYPE_UNKNOWN,
+        .value_index = values->len,
+    };
+    guint start = entries->len;
+    uint64List *l;
+    uint64_t v;
+
+    if (schema) {
+        e.type = schema->type;
+        e.unit = schema->has_unit ? schema->unit + 1 : 0;
+        e.base = schema->has_base ? schema->base : 0;
+        e.exponent = schema->exponent;
+        e.bucket_size = schema->has_bucket_size ? schema->bucket_size : 0;
+    }
+
+    switch (stats->value->type) {
+    case QTYPE_QNUM:
+        g_array_append_val(values, stats->value->u.scalar);
+        break;
+    case QTYPE_QBOOL:
+        v = stats->value->u.boolean;
+        g_array_append_val(values, v);
+        break;
+    case QTYPE_QLIST:
+        for (l = stats->value->u.list; l; l = l->next) {
+            g_array_append_val(values, l->value);
+        }
+        break;
+    default:
+        abort();
+    }
+    e.nr_values = values->len - e.value_index;
+
+    /* The header is filled in last, once the string lengths are known */
+    g_byte_array_set_size(entries, start + sizeof(e));
+    stats_export_add_string(entries, StatsProvider_str(result->provider),
+                            &e.provider_len);
+    stats_export_add_string(entries, StatsTarget_str(target), &e.target_len);
+    stats_export_add_string(entries,
+                            result->qom_path ?: result->call_site ?: "",
+                            &e.object_len);
+    stats_export_add_string(entries, stats->name, &e.name_len);
+    g_byte_array_append(entries, padding,
+                        ROUND_UP(entries->len, 8) - entries->len);
+
+    e.size = entries->len - start;
+    memcpy(entries->data + start, &e, sizeof(e));
+}
+
+/* Collect the statistics of all providers and targets */
+static uint32_t stats_export_collect(GByteArray *entries, GArray *values)
+{
+    Error *local_err = NULL;
+    StatsSchemaList *schemas;
+    uint32_t nr_entries = 0;
+    int target;
+
+    schemas = qmp_query_stats_schemas(false, 0, &local_err);
+    if (local_err) {
+        error_report_once("stats-export: %s", error_get_pretty(local_err));
+        error_free(local_err);
+        return 0;
+    }
+
+    for (target = 0; target < STATS_TARGET__MAX; target++) {
+        StatsFilter filter = { .target = target };
+        StatsResultList *results, *r;
+        StatsList *s;
+
+        results = qmp_query_stats(&filter, &local_err);
+        if (local_err) {
+            error_report_once("stats-export: %s",
+                              error_get_pretty(local_err));
+            error_free(local_err);
+            local_err = NULL;
+            continue;
+        }
+
+        for (r = results; r; r = r->next) {
+            for (s = r->value->stats; s; s = s->next) {
+                StatsSchemaValue *schema =
+                    stats_export_find_schema(schemas, r->value->provider,
+                                             target, s->value->name);
+
+                stats_export_add_entry(entries, values, target, r->value,
+                                       s->value, schema);
+                nr_entries++;
+            }
+        }
+        qapi_free_StatsResultList(results);
+    }
+
+    qapi_free_StatsSchemaList(schemas);
+    return nr_entries;
+}
+
+static void stats_export_update(void *opaque)
+{
+    StatsExport *se = opaque;
+    StatsExportHeader *h = se->header;
+    g_autoptr(GByteArray) entries = g_byte_array_new();
+    g_autoptr(GArray) values = g_array_new(false, false, sizeof(uint64_t));
+    uint32_t nr_entries, flags = 0;
+    uint64_t values_size;
+    bool changed;
+
+    nr_entries = stats_export_collect(entries, values);
+    values_size = (uint64_t)values->len * sizeof(uint64_t);
+
+    if (sizeof(*h) + values_size + entries->len > se->size) {
+        warn_report_once("stats-export: '%s' is too small for all "
+                         "statistics", se->path);
+        flags |= STATS_EXPORT_F_TRUNCATED;
+        nr_entries = 0;
+        values_size = 0;
+        g_byte_array_set_size(entries, 0);
+    }
+
+    changed = !se->entries || se->entries->len != entries->len ||
+              memcmp(se->entries->data, entries->data, entries->len);
+
+    /* Readers retry if @seq is odd or changed while they read */
+    qatomic_set(&h->seq, h->seq + 1);
+    smp_wmb();
+
+    h->flags = flags;
+    if (changed) {
+        h->generation++;
+    }
+    h->timestamp_ns = qemu_clock_get_ns(QEMU_CLOCK_HOST);
+    h->nr_entries = nr_entries;
+    h->values_offset = sizeof(*h);
+    h->values_size = values_size;
+    h->entries_offset = h->values_offset + values_size;
+    h->entries_size = entries->len;
+    memcpy((char *)h + h->values_offset, values->data, values_size);
+    memcpy((char *)h + h->entries_offset, entries->data, entries->len);
+
+    smp_wmb();
+    qatomic_set(&h->seq, h->seq + 1);
+
+    if (changed) {
+        if (se->entries) {
+            g_byte_array_unref(se->entries);
+        }
+        se->entries = g_steal_pointer(&entries);
+    }
+
+    timer_mod(se->timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                         qatomic_read(&se->interval_ms));
+}
+
+static char *stats_export_get_path(Object *obj, Error **errp)
+{
+    return g_strdup(STATS_EXPORT(obj)->path);
+}
+
+static void stats_export_set_path(Object *obj, const char *value,
+                                  Error **errp)
+{
+    StatsExport *se = STATS_EXPORT(obj);
+
+    if (se->header) {
+        error_setg(errp, "Property 'path' cannot be changed after creation");
+        return;
+    }
+    g_free(se->path);
+    se->path = g_strdup(value);
+}
+
+static void stats_export_get_size(Object *obj, Visitor *v, const char *name,
+                                  void *opaque, Error **errp)
+{
+    visit_type_size(v, name, &STATS_EXPORT(obj)->size, errp);
+}
+
+static void stats_export_set_size(Object *obj, Visitor *v, const char *name,
+                                  void *opaque, Error **errp)
+{
+    StatsExport *se = STATS_EXPORT(obj);
+    uint64_t value;
+
+    if (se->header) {
+        error_setg(errp, "Property '%s' cannot be changed after creation",
+                   name);
+        return;
+    }
+    if (!visit_type_size(v, name, &value, errp)) {
+        return;
+    }
+    if (value < sizeof(StatsExportHeader) || value > UINT32_MAX) {
+        error_setg(errp, "Property '%s' must be between %zu and %u",
+                   name, sizeof(StatsExportHeader), UINT32_MAX);
+        return;
+    }
+    se->size = value;
+}
+
+static void stats_export_get_interval(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    visit_type_uint32(v, name, &STATS_EXPORT(obj)->interval_ms, errp);
+}
+
+static void stats_export_set_interval(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    StatsExport *se = STATS_EXPORT(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value) {
+        error_setg(errp, "Property '%s' must be at least 1", name);
+        return;
+    }
+    /* Takes effect after the next update */
+    qatomic_set(&se->interval_ms, value);
+}
+
+static void stats_export_complete(UserCreatable *uc, Error **errp)
+{
+    StatsExport *se = STATS_EXPORT(uc);
+    StatsExportHeader *h;
+    void *map;
+
+    if (!se->path) {
+        error_setg(errp, "Property 'path' is required");
+        return;
+    }
+
+    se->fd = qemu_create(se->path, O_RDWR | O_TRUNC, 0600, errp);
+    if (se->fd < 0) {
+        return;
+    }
+    if (ftruncate(se->fd, se->size) < 0) {
+        error_setg_errno(errp, errno, "Could not resize '%s'", se->path);
+        goto fail;
+    }
+    map = mmap(NULL, se->size, PROT_READ | PROT_WRITE, MAP_SHARED, se->fd, 0);
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Could not map '%s'", se->path);
+        goto fail;
+    }
+
+    h = map;
+    memcpy(h->magic, STATS_EXPORT_MAGIC, sizeof(h->magic));
+    h->version = STATS_EXPORT_VERSION;
+    h->header_size = sizeof(*h);
+    se->header = h;
+
+    se->timer = timer_new_ms(QEMU_CLOCK_REALTIME, stats_export_update, se);
+    stats_export_update(se);
+    return;
+
+fail:
+    close(se->fd);
+    se->fd = -1;
+}
+
+static void stats_export_instance_init(Object *obj)
+{
+    StatsExport *se = STATS_EXPORT(obj);
+
+    se->fd = -1;
+    se->size = 1 * MiB;
+    se->interval_ms = 1000;
+}
+
+static void stats_export_instance_finalize(Object *obj)
+{
+    StatsExport *se = STATS_EXPORT(obj);
+
+    if (se->timer) {
+        timer_free(se->timer);
+    }
+    if (se->header) {
+        munmap(se->header, se->size);
+    }
+    if (se->fd >= 0) {
+        close(se->fd);
+    }
+    if (se->entries) {
+        g_byte_array_unref(se->entries);
+    }
+    g_free(se->path);
+}
+
+static void stats_export_class_init(ObjectClass *oc, void *data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
+
+    ucc->complete = stats_export_complete;
+
+    object_class_property_add_str(oc, "path", stats_export_get_path,
+                                  stats_export_set_path);
+    object_class_property_set_description(oc, "path",
+        "File to write the statistics to");
+    object_class_property_add(oc, "size", "size",
+                              stats_export_get_size,
+                              stats_export_set_size, NULL, NULL);
+    object_class_property_set_description(oc, "size",
+        "Size of the file in bytes");
+    object_class_property_add(oc, "interval", "uint32",
+                              stats_export_get_interval,
+                              stats_export_set_interval, NULL, NULL);
+    object_class_property_set_description(oc, "interval",
+        "Update interval in milliseconds");
+}
+
+static const TypeInfo stats_export_info = {
+    .name = TYPE_STATS_EXPORT,
+    .parent = TYPE_OBJECT,
+    .class_init = stats_export_class_init,
+    .instance_size = sizeof(StatsExport),
+    .instance_init = stats_export_instance_init,
+    .instance_finalize = stats_export_instance_finalize,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_USER_CREATABLE },
+        { }
+    }
+};
+
+static void stats_export_register_types(void)
+{
+    type_register_static(&stats_export_info);
+}
+
+type_init(stats_export_register_types);
@@ -91,6 +91,16 @@ static void print_stats_results(Monitor *mon, StatsTarget target,
         monitor_printf(mon, "provider: %s\n",
                        StatsProvider_str(result->provider));
     }
+    if (result->call_site) {
+        monitor_printf(mon, "call site: %s\n", result->call_site);
+    }
+    if (target == STATS_TARGET_BLOCK_BACKEND ||
+        target == STATS_TARGET_VIRTQUEUE) {
+        monitor_printf(mon, "device: %s\n", result->qom_path);
+    }
+    if (result->has_queue) {
+        monitor_printf(mon, "queue: %u\n", result->queue);
+    }
 
     for (stats_list = result->stats; stats_list;
              stats_list = stats_list->next,
@@ -156,6 +166,9 @@ static StatsFilter *stats_filter(StatsTarget target, const char *names,
         break;
     }
     case STATS_TARGET_CRYPTODEV:
+    case STATS_TARGET_LOCKS:
+    case STATS_TARGET_BLOCK_BACKEND:
+    case STATS_TARGET_VIRTQUEUE:
         break;
     default:
         break;
@@ -229,6 +242,9 @@ void hmp_info_stats(Monitor *mon, const QDict *qdict)
         filter = stats_filter(target, names, cpu_index, provider);
         break;
     case STATS_TARGET_CRYPTODEV:
+    case STATS_TARGET_LOCKS:
+    case STATS_TARGET_BLOCK_BACKEND:
+    case STATS_TARGET_VIRTQUEUE:
         filter = stats_filter(target, names, -1, provider);
         break;
     default:
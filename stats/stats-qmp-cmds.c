@@ -65,6 +65,9 @@ static bool invoke_stats_cb(StatsCallbacks *entry,
         }
         break;
     case STATS_TARGET_CRYPTODEV:
+    case STATS_TARGET_LOCKS:
+    case STATS_TARGET_BLOCK_BACKEND:
+    case STATS_TARGET_VIRTQUEUE:
         break;
     default:
         abort();
@@ -0,0 +1,238 @@
+/*
+ * Statistics of the coroutine pool, of RCU and of lock profiling
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/coroutine.h"
+#include "qemu/qsp.h"
+#include "qemu/rcu.h"
+#include "sysemu/stats.h"
+
+typedef struct UtilStatsDesc {
+    const char *name;
+    size_t offset;
+    StatsType type;
+    bool bytes;
+} UtilStatsDesc;
+
+static const UtilStatsDesc coroutine_stats_desc[] = {
+    { "pool-hits", offsetof(CoroutineStats, pool_hits),
+      STATS_TYPE_CUMULATIVE },
+    { "pool-misses", offsetof(CoroutineStats, pool_misses),
+      STATS_TYPE_CUMULATIVE },
+    { "stacks", offsetof(CoroutineStats, stacks), STATS_TYPE_INSTANT },
+    { "stack-bytes-reserved", offsetof(CoroutineStats, stack_bytes_reserved),
+      STATS_TYPE_INSTANT, true },
+};
+
+static const UtilStatsDesc rcu_stats_desc[] = {
+    { "pending-callbacks", offsetof(RCUStats, pending_callbacks),
+      STATS_TYPE_INSTANT },
+    { "grace-periods", offsetof(RCUStats, grace_periods),
+      STATS_TYPE_CUMULATIVE },
+    { "expedited-grace-periods", offsetof(RCUStats, expedited_grace_periods),
+      STATS_TYPE_CUMULATIVE },
+};
+
+/* @values points to a structure of uint64_t fields described by @desc */
+static void util_stats_add(StatsResultList **result, StatsProvider provider,
+                           const UtilStatsDesc *desc, int n,
+                           const void *values, strList *names)
+{
+    StatsList *list = NULL;
+    Stats *stats;
+
+    while (n--) {
+        if (!apply_str_list_filter(desc[n].name, names)) {
+            continue;
+        }
+        stats = g_new0(Stats, 1);
+        stats->name = g_strdup(desc[n].name);
+        stats->value = g_new0(StatsValue, 1);
+        stats->value->type = QTYPE_QNUM;
+        stats->value->u.scalar =
+            *(const uint64_t *)((const char *)values + desc[n].offset);
+        QAPI_LIST_PREPEND(list, stats);
+    }
+    add_stats_entry(result, provider, NULL, list);
+}
+
+static void util_stats_add_schema(StatsSchemaList **result,
+                                  StatsProvider provider,
+                                  const UtilStatsDesc *desc, int n)
+{
+    StatsSchemaValueList *list = NULL;
+    StatsSchemaValue *value;
+
+    while (n--) {
+        value = g_new0(StatsSchemaValue, 1);
+        value->name = g_strdup(desc[n].name);
+        value->type = desc[n].type;
+        if (desc[n].bytes) {
+            value->has_unit = true;
+            value->unit = STATS_UNIT_BYTES;
+        }
+        QAPI_LIST_PREPEND(list, value);
+    }
+    add_stats_schema(result, provider, STATS_TARGET_VM, list);
+}
+
+static void coroutine_query_stats_cb(StatsResultList **result,
+                                     StatsTarget target, strList *names,
+                                     strList *targets, Error **errp)
+{
+    CoroutineStats cs;
+
+    if (target == STATS_TARGET_VM) {
+        qemu_coroutine_get_stats(&cs);
+        util_stats_add(result, STATS_PROVIDER_COROUTINE, coroutine_stats_desc,
+                       ARRAY_SIZE(coroutine_stats_desc), &cs, names);
+    }
+}
+
+static void coroutine_query_stats_schemas_cb(StatsSchemaList **result,
+                                             Error **errp)
+{
+    util_stats_add_schema(result, STATS_PROVIDER_COROUTINE,
+                          coroutine_stats_desc,
+                          ARRAY_SIZE(coroutine_stats_desc));
+}
+
+static void rcu_query_stats_cb(StatsResultList **result, StatsTarget target,
+                               strList *names, strList *targets,
+                               Error **errp)
+{
+    RCUStats rs;
+
+    if (target == STATS_TARGET_VM) {
+        rcu_get_stats(&rs);
+        util_stats_add(result, STATS_PROVIDER_RCU, rcu_stats_desc,
+                       ARRAY_SIZE(rcu_stats_desc), &rs, names);
+    }
+}
+
+static void rcu_query_stats_schemas_cb(StatsSchemaList **result,
+                                       Error **errp)
+{
+    util_stats_add_schema(result, STATS_PROVIDER_RCU, rcu_stats_desc,
+                          ARRAY_SIZE(rcu_stats_desc));
+}
+
+static Stats *sync_profile_stat(const char *name, uint64_t value)
+{
+    Stats *stats = g_new0(Stats, 1);
+
+    stats->name = g_strdup(name);
+    stats->value = g_new0(StatsValue, 1);
+    stats->value->type = QTYPE_QNUM;
+    stats->value->u.scalar = value;
+    return stats;
+}
+
+typedef struct SyncProfileQuery {
+    StatsResultList **result;
+    strList *names;
+} SyncProfileQuery;
+
+static void sync_profile_add_call_site(const QSPCallSiteStats *cs,
+                                       void *opaque)
+{
+    SyncProfileQuery *q = opaque;
+    StatsList *list = NULL;
+    Stats *stats;
+    int i;
+
+    /* Prepend in reverse order of the schema */
+    if (cs->has_hold_time) {
+        if (apply_str_list_filter("hold-time-histogram", q->names)) {
+            stats = g_new0(Stats, 1);
+            stats->name = g_strdup("hold-time-histogram");
+            stats->value = g_new0(StatsValue, 1);
+            stats->value->type = QTYPE_QLIST;
+            for (i = QSP_HOLD_TIME_BUCKETS - 1; i >= 0; i--) {
+                QAPI_LIST_PREPEND(stats->value->u.list, cs->hold_hist[i]);
+            }
+            QAPI_LIST_PREPEND(list, stats);
+        }
+        if (apply_str_list_filter("hold-time", q->names)) {
+            QAPI_LIST_PREPEND(list, sync_profile_stat("hold-time",
+                                                      cs->hold_ns));
+        }
+    }
+    if (apply_str_list_filter("wait-time", q->names)) {
+        QAPI_LIST_PREPEND(list, sync_profile_stat("wait-time", cs->wait_ns));
+    }
+    if (apply_str_list_filter("acquisitions", q->names)) {
+        QAPI_LIST_PREPEND(list, sync_profile_stat("acquisitions",
+                                                  cs->n_acqs));
+    }
+    if (!list) {
+        return;
+    }
+    add_stats_entry(q->result, STATS_PROVIDER_SYNC_PROFILE, NULL, list);
+    (*q->result)->value->call_site = g_strdup_printf("%s %s", cs->type,
+                                                     cs->call_site);
+}
+
+static void sync_profile_query_stats_cb(StatsResultList **result,
+                                        StatsTarget target, strList *names,
+                                        strList *targets, Error **errp)
+{
+    SyncProfileQuery q = { .result = result, .names = names };
+
+    if (target == STATS_TARGET_LOCKS) {
+        qsp_foreach_call_site(sync_profile_add_call_site, &q);
+    }
+}
+
+static StatsSchemaValue *sync_profile_schema_value(const char *name,
+                                                   StatsType type, bool ns)
+{
+    StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+    value->name = g_strdup(name);
+    value->type = type;
+    if (ns) {
+        value->has_unit = true;
+        value->unit = STATS_UNIT_SECONDS;
+        value->has_base = true;
+        value->base = 10;
+        value->exponent = -9;
+    }
+    return value;
+}
+
+static void sync_profile_query_stats_schemas_cb(StatsSchemaList **result,
+                                                Error **errp)
+{
+    StatsSchemaValueList *list = NULL;
+
+    QAPI_LIST_PREPEND(list,
+                      sync_profile_schema_value("hold-time-histogram",
+                                                STATS_TYPE_LOG2_HISTOGRAM,
+                                                false));
+    QAPI_LIST_PREPEND(list,
+                      sync_profile_schema_value("hold-time",
+                                                STATS_TYPE_CUMULATIVE, true));
+    QAPI_LIST_PREPEND(list,
+                      sync_profile_schema_value("wait-time",
+                                                STATS_TYPE_CUMULATIVE, true));
+    QAPI_LIST_PREPEND(list,
+                      sync_profile_schema_value("acquisitions",
+                                                STATS_TYPE_CUMULATIVE, false));
+    add_stats_schema(result, STATS_PROVIDER_SYNC_PROFILE, STATS_TARGET_LOCKS,
+                     list);
+}
+
+void util_stats_init(void)
+{
+    add_stats_callbacks(STATS_PROVIDER_COROUTINE, coroutine_query_stats_cb,
+                        coroutine_query_stats_schemas_cb);
+    add_stats_callbacks(STATS_PROVIDER_RCU, rcu_query_stats_cb,
+                        rcu_query_stats_schemas_cb);
+    add_stats_callbacks(STATS_PROVIDER_SYNC_PROFILE,
+                        sync_profile_query_stats_cb,
+                        sync_profile_query_stats_schemas_cb);
+}
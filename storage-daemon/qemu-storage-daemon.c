@@ -114,11 +114,15 @@ static void help(void)
 "  --export [type=]vhost-user-blk,id=<id>,node-name=<node-name>,\n"
 "           addr.type=unix,addr.path=<socket-path>[,writable=on|off]\n"
 "           [,logical-block-size=<block-size>][,num-queues=<num-queues>]\n"
+"           [,iothread-vq-mapping.<N>.iothread=<iothread-id>\n"
+"           [,iothread-vq-mapping.<N>.vqs.<M>=<vq>]]\n"
 "                         export the specified block node as a\n"
 "                         vhost-user-blk device over UNIX domain socket\n"
 "  --export [type=]vhost-user-blk,id=<id>,node-name=<node-name>,\n"
 "           addr.type=fd,addr.str=<fd>[,writable=on|off]\n"
 "           [,logical-block-size=<block-size>][,num-queues=<num-queues>]\n"
+"           [,iothread-vq-mapping.<N>.iothread=<iothread-id>\n"
+"           [,iothread-vq-mapping.<N>.vqs.<M>=<vq>]]\n"
 "                         export the specified block node as a\n"
 "                         vhost-user-blk device over file descriptor\n"
 "\n"
@@ -15,6 +15,7 @@
 #include <dirent.h>
 #include <sys/prctl.h>
 #include <sched.h>
+#include <sys/socket.h>
 
 #include "qemu/async-teardown.h"
 
@@ -26,17 +27,23 @@
 
 static pid_t the_ppid;
 
+/* Main process end of the socket used to hand file descriptors over */
+static int handover_sock = -1;
+
 /*
- * Close all open file descriptors.
+ * Close all open file descriptors except @keep_fd.
  */
-static void close_all_open_fd(void)
+static void close_all_open_fd(int keep_fd)
 {
     struct dirent *de;
     int fd, dfd;
     DIR *dir;
 
 #ifdef CONFIG_CLOSE_RANGE
-    int r = close_range(0, ~0U, 0);
+    int r = close_range(keep_fd + 1, ~0U, 0);
+    if (!r && keep_fd > 0) {
+        r = close_range(0, keep_fd - 1, 0);
+    }
     if (!r) {
         /* Success, no need to try other ways. */
         return;
@@ -53,7 +60,7 @@ static void close_all_open_fd(void)
 
     for (de = readdir(dir); de; de = readdir(dir)) {
         fd = atoi(de->d_name);
-        if (fd != dfd) {
+        if (fd != dfd && fd != keep_fd) {
             close(fd);
         }
     }
@@ -72,9 +79,35 @@ static void hup_handler(int signal)
     _exit(0);
 }
 
+/*
+ * Receives one file descriptor sent by async_teardown_hand_over_fd() and
+ * keeps it open until this process exits.  Returns false once the main
+ * process has closed its end of the socket.
+ */
+static bool receive_fd(int sock)
+{
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t ret;
+
+    ret = recvmsg(sock, &msg, 0);
+    return ret > 0 || (ret < 0 && errno == EINTR);
+}
+
 static int async_teardown_fn(void *arg)
 {
     struct sigaction sa = { .sa_handler = hup_handler };
+    int sock = (intptr_t)arg;
     sigset_t hup_signal;
     char name[16];
 
@@ -86,8 +119,9 @@ static int async_teardown_fn(void *arg)
      * Close all file descriptors that might have been inherited from the
      * main qemu process when doing clone, needed to make libvirt happy.
      * Not using close_range for increased compatibility with older kernels.
+     * Only the socket used to hand file descriptors over is kept.
      */
-    close_all_open_fd();
+    close_all_open_fd(sock);
 
     /* Set up a handler for SIGHUP and unblock SIGHUP. */
     sigaction(SIGHUP, &sa, NULL);
@@ -102,9 +136,15 @@ static int async_teardown_fn(void *arg)
      * Sleep forever, unless the parent process has already terminated. The
      * only interruption can come from the SIGHUP signal, which in normal
      * operation is received when the parent process dies.
+     *
+     * Meanwhile, collect the file descriptors that the parent hands over on
+     * its way out.  The parent closes its end of the socket when it exits.
      */
-    if (the_ppid == getppid()) {
-        pause();
+    while (the_ppid == getppid() && receive_fd(sock)) {
+        /* nothing */
+    }
+    while (the_ppid == getppid()) {
+        sleep(1);
     }
 
     /* At this point the parent process has terminated completely. */
@@ -133,11 +173,58 @@ static void *new_stack_for_clone(void)
 void init_async_teardown(void)
 {
     sigset_t all_signals, old_signals;
+    int sv[2] = { -1, -1 };
 
     the_ppid = getpid();
 
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        sv[0] = sv[1] = -1;
+    }
+
     sigfillset(&all_signals);
     sigprocmask(SIG_BLOCK, &all_signals, &old_signals);
-    clone(async_teardown_fn, new_stack_for_clone(), CLONE_VM, NULL);
+    clone(async_teardown_fn, new_stack_for_clone(), CLONE_VM,
+          (void *)(intptr_t)sv[1]);
     sigprocmask(SIG_SETMASK, &old_signals, NULL);
+
+    if (sv[1] >= 0) {
+        close(sv[1]);
+    }
+    handover_sock = sv[0];
+}
+
+/*
+ * Passes a duplicate of @fd to the teardown process, which keeps it open
+ * until QEMU has exited.  This is useful for descriptors whose release is
+ * expensive, for example those that hold pinned memory.
+ *
+ * Returns false if asynchronous teardown is not enabled or the descriptor
+ * could not be sent.
+ */
+bool async_teardown_hand_over_fd(int fd)
+{
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control = { };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    if (handover_sock < 0) {
+        return false;
+    }
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return RETRY_ON_EINTR(sendmsg(handover_sock, &msg, 0)) == 1;
 }
@@ -45,6 +45,8 @@
 #include "sysemu/whpx.h"
 #include "hw/boards.h"
 #include "hw/hw.h"
+#include "qemu/thread-context.h"
+#include "qemu/error-report.h"
 #include "trace.h"
 
 #ifdef CONFIG_LINUX
@@ -528,9 +530,11 @@ void bql_lock_impl(const char *file, int line)
 
 void bql_unlock(void)
 {
+    QemuMutexUnlockFunc bql_unlock_fn = qatomic_read(&bql_mutex_unlock_func);
+
     g_assert(bql_locked());
     set_bql_locked(false);
-    qemu_mutex_unlock(&bql);
+    bql_unlock_fn(&bql, __FILE__, __LINE__);
 }
 
 void qemu_cond_wait_bql(QemuCond *cond)
@@ -647,6 +651,44 @@ const AccelOpsClass *cpus_get_accel(void)
     return cpus_accel;
 }
 
+/*
+ * Place the vCPU thread onto the host CPUs of the thread context configured
+ * for its NUMA node, before the vCPU runs for the first time.
+ */
+static void qemu_vcpu_set_thread_context(MachineState *ms, CPUState *cpu)
+{
+    MachineClass *mc = MACHINE_GET_CLASS(ms);
+    CpuInstanceProperties props;
+    ThreadContext *tc;
+    Error *err = NULL;
+    CPUState *other;
+
+    if (!ms->numa_state || !ms->numa_state->num_nodes ||
+        !mc->cpu_index_to_instance_props) {
+        return;
+    }
+
+    props = mc->cpu_index_to_instance_props(ms, cpu->cpu_index);
+    if (!props.has_node_id || props.node_id >= MAX_NODES) {
+        return;
+    }
+    tc = ms->numa_state->nodes[props.node_id].thread_context;
+    if (!tc) {
+        return;
+    }
+
+    /* Single-threaded TCG runs all vCPUs in one thread, keep its affinity. */
+    CPU_FOREACH(other) {
+        if (other != cpu && other->thread == cpu->thread) {
+            return;
+        }
+    }
+
+    if (!thread_context_set_thread_affinity(tc, cpu->thread, &err)) {
+        warn_report_err(err);
+    }
+}
+
 void qemu_init_vcpu(CPUState *cpu)
 {
     MachineState *ms = MACHINE(qdev_get_machine());
@@ -671,6 +713,8 @@ void qemu_init_vcpu(CPUState *cpu)
     while (!cpu->created) {
         qemu_cond_wait(&qemu_cpu_cond, &bql);
     }
+
+    qemu_vcpu_set_thread_context(ms, cpu);
 }
 
 void cpu_stop_current(void)
@@ -441,6 +441,68 @@ static void dirtylimit_cleanup(void)
     dirtylimit_state_finalize();
 }
 
+static int dirtylimit_demand_cmp(const void *a, const void *b)
+{
+    uint64_t da = *(const uint64_t *)a, db = *(const uint64_t *)b;
+
+    return da < db ? -1 : da > db;
+}
+
+/*
+ * Shares a dirty page rate of @budget MB/s among the vCPUs.  The ones
+ * dirtying less than an even share run freely and leave what they do
+ * not use to the others, which split what is left evenly, but are never
+ * limited below @min_quota.  A limited vCPU cannot show how much more it
+ * would dirty, so it keeps its limit until it no longer uses it.
+ */
+void dirtylimit_set_share(uint64_t budget, uint64_t min_quota)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    g_autofree uint64_t *rates = g_new0(uint64_t, ms->smp.max_cpus);
+    g_autofree uint64_t *demands = g_new0(uint64_t, ms->smp.max_cpus);
+    uint64_t left = budget, quota = UINT64_MAX;
+    CPUState *cpu;
+    int n = 0, i;
+
+    dirtylimit_state_lock();
+
+    if (!dirtylimit_in_service()) {
+        dirtylimit_init();
+    }
+
+    CPU_FOREACH(cpu) {
+        int index = cpu->cpu_index;
+
+        rates[index] = MAX(vcpu_dirty_rate_get(index), 0);
+        demands[n++] = dirtylimit_vcpu_get_state(index)->enabled ?
+                       UINT64_MAX : rates[index];
+    }
+    qsort(demands, n, sizeof(*demands), dirtylimit_demand_cmp);
+
+    for (i = 0; i < n; i++) {
+        if (demands[i] > left / (n - i)) {
+            quota = MAX(left / (n - i), min_quota);
+            break;
+        }
+        left -= demands[i];
+    }
+
+    CPU_FOREACH(cpu) {
+        int index = cpu->cpu_index;
+        bool limited = dirtylimit_vcpu_get_state(index)->enabled;
+
+        if (rates[index] > quota ||
+            (limited && rates[index] + DIRTYLIMIT_TOLERANCE_RANGE >= quota)) {
+            dirtylimit_set_vcpu(index, quota, true);
+        } else if (limited) {
+            dirtylimit_set_vcpu(index, 0, false);
+        }
+    }
+
+    trace_dirtylimit_set_share(budget, quota);
+    dirtylimit_state_unlock();
+}
+
 /*
  * dirty page rate limit is not allowed to set if migration
  * is running with dirty-limit capability enabled.
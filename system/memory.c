@@ -34,6 +34,7 @@
 #include "hw/boards.h"
 #include "migration/vmstate.h"
 #include "exec/address-spaces.h"
+#include "sysemu/dma.h"
 
 //#define DEBUG_UNASSIGNED
 
@@ -50,6 +51,14 @@ static QTAILQ_HEAD(, AddressSpace) address_spaces
 
 static GHashTable *flat_views;
 
+/*
+ * Top-level regions of the trees changed since FlatViews were last
+ * regenerated.  Only views rendered from one of these trees need to be
+ * rendered again.
+ */
+static GHashTable *flat_views_dirty_trees;
+static bool flat_views_all_dirty;
+
 typedef struct AddrRange AddrRange;
 
 /*
@@ -269,6 +278,62 @@ static FlatView *flatview_new(MemoryRegion *mr_root)
     return view;
 }
 
+static MemoryRegion *memory_region_get_tree(MemoryRegion *mr)
+{
+    while (mr->container) {
+        mr = mr->container;
+    }
+    return mr;
+}
+
+static void flatview_add_tree(FlatView *view, MemoryRegion *mr)
+{
+    MemoryRegion *tree = memory_region_get_tree(mr);
+    unsigned i;
+
+    for (i = 0; i < view->nr_trees; i++) {
+        if (view->trees[i] == tree) {
+            return;
+        }
+    }
+    view->trees = g_renew(MemoryRegion *, view->trees, view->nr_trees + 1);
+    view->trees[view->nr_trees++] = tree;
+}
+
+static bool flatview_is_dirty(FlatView *view)
+{
+    unsigned i;
+
+    if (flat_views_all_dirty || !view->root) {
+        return true;
+    }
+    if (!flat_views_dirty_trees) {
+        return false;
+    }
+    for (i = 0; i < view->nr_trees; i++) {
+        if (g_hash_table_contains(flat_views_dirty_trees, view->trees[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void flat_views_mark_tree_dirty(MemoryRegion *tree)
+{
+    if (!flat_views_dirty_trees) {
+        flat_views_dirty_trees = g_hash_table_new(g_direct_hash,
+                                                  g_direct_equal);
+    }
+    g_hash_table_add(flat_views_dirty_trees, tree);
+}
+
+/* Schedule a FlatView update for the views that @mr is rendered into */
+static void memory_region_update_pending_mark(MemoryRegion *mr)
+{
+    memory_region_update_pending = true;
+    flat_views_mark_tree_dirty(memory_region_get_tree(mr));
+}
+
 /* Insert a range into a given position.  Caller is responsible for maintaining
  * sorting order.
  */
@@ -298,6 +363,7 @@ static void flatview_destroy(FlatView *view)
         memory_region_unref(view->ranges[i].mr);
     }
     g_free(view->ranges);
+    g_free(view->trees);
     memory_region_unref(view->root);
     g_free(view);
 }
@@ -632,6 +698,7 @@ static void render_memory_region(FlatView *view,
     clip = addrrange_intersection(tmp, clip);
 
     if (mr->alias) {
+        flatview_add_tree(view, mr->alias);
         int128_subfrom(&base, int128_make64(mr->alias->addr));
         int128_subfrom(&base, int128_make64(mr->alias_offset));
         render_memory_region(view, mr->alias, base, clip,
@@ -758,6 +825,7 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     view = flatview_new(mr);
 
     if (mr) {
+        flatview_add_tree(view, mr);
         render_memory_region(view, mr, int128_zero(),
                              addrrange_make(int128_zero(), int128_2_64()),
                              false, false, false);
@@ -1032,24 +1100,38 @@ static void flatviews_init(void)
 
 static void flatviews_reset(void)
 {
+    GHashTable *old_views = flat_views;
     AddressSpace *as;
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
-    }
+    flat_views = NULL;
     flatviews_init();
 
-    /* Render unique FVs */
+    /* Render unique FVs, keeping those whose trees did not change */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *view;
 
         if (g_hash_table_lookup(flat_views, physmr)) {
             continue;
         }
 
+        view = old_views ? g_hash_table_lookup(old_views, physmr) : NULL;
+        if (view && !flatview_is_dirty(view)) {
+            flatview_ref(view);
+            g_hash_table_replace(flat_views, physmr, view);
+            continue;
+        }
+
         generate_memory_topology(physmr);
     }
+
+    if (old_views) {
+        g_hash_table_unref(old_views);
+    }
+    if (flat_views_dirty_trees) {
+        g_hash_table_remove_all(flat_views_dirty_trees);
+    }
+    flat_views_all_dirty = false;
 }
 
 static void address_space_set_flatview(AddressSpace *as)
@@ -1129,8 +1211,13 @@ void memory_region_transaction_commit(void)
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                FlatView *old_view = address_space_to_flatview(as);
+
                 address_space_set_flatview(as);
-                address_space_update_ioeventfds(as);
+                if (ioeventfd_update_pending ||
+                    address_space_to_flatview(as) != old_view) {
+                    address_space_update_ioeventfds(as);
+                }
             }
             memory_region_update_pending = false;
             ioeventfd_update_pending = false;
@@ -2060,6 +2147,72 @@ void memory_region_notify_iommu(IOMMUMemoryRegion *iommu_mr,
     }
 }
 
+void memory_region_notify_iommu_range_one(IOMMUNotifier *notifier,
+                                          IOMMUTLBEvent *event)
+{
+    IOMMUTLBEvent tmp = *event;
+    hwaddr start = MAX(event->entry.iova, notifier->start);
+    hwaddr end = MIN(event->entry.iova + event->entry.addr_mask,
+                     notifier->end);
+    bool map = event->entry.perm != IOMMU_NONE;
+
+    if (start > end) {
+        return;
+    }
+    if (map) {
+        tmp.entry.translated_addr += start - event->entry.iova;
+    }
+
+    while (true) {
+        hwaddr mask;
+
+        if (!notifier->coalesce) {
+            mask = dma_aligned_pow2_mask(start, end, 64);
+        } else if (map) {
+            hwaddr xlat, len = end - start + 1;
+
+            /*
+             * A MAP entry must not straddle memory regions of the target
+             * address space, which contiguous guest ranges can do.
+             */
+            RCU_READ_LOCK_GUARD();
+            address_space_translate(tmp.entry.target_as,
+                                    tmp.entry.translated_addr, &xlat, &len,
+                                    tmp.entry.perm & IOMMU_WO,
+                                    MEMTXATTRS_UNSPECIFIED);
+            mask = len && len <= end - start ? len - 1 : end - start;
+        } else {
+            mask = end - start;
+        }
+
+        tmp.entry.iova = start;
+        tmp.entry.addr_mask = mask;
+        memory_region_notify_iommu_one(notifier, &tmp);
+        if (end - start == mask) {
+            break;
+        }
+        start += mask + 1;
+        if (map) {
+            tmp.entry.translated_addr += mask + 1;
+        }
+    }
+}
+
+void memory_region_notify_iommu_range(IOMMUMemoryRegion *iommu_mr,
+                                      int iommu_idx,
+                                      IOMMUTLBEvent *event)
+{
+    IOMMUNotifier *iommu_notifier;
+
+    assert(memory_region_is_iommu(MEMORY_REGION(iommu_mr)));
+
+    IOMMU_NOTIFIER_FOREACH(iommu_notifier, iommu_mr) {
+        if (iommu_notifier->iommu_idx == iommu_idx) {
+            memory_region_notify_iommu_range_one(iommu_notifier, event);
+        }
+    }
+}
+
 int memory_region_iommu_get_attr(IOMMUMemoryRegion *iommu_mr,
                                  enum IOMMUMemoryRegionAttr attr,
                                  void *data)
@@ -2219,10 +2372,10 @@ bool memory_get_xlat_addr(IOMMUTLBEntry *iotlb, void **vaddr,
     }
 
     /*
-     * Translation truncates length to the IOMMU page size,
-     * check that it did not truncate too much.
+     * Translation truncates length to the IOMMU page size, or to the end of
+     * the memory region, check that it did not truncate the entry.
      */
-    if (len & iotlb->addr_mask) {
+    if (len <= iotlb->addr_mask) {
         error_report("iommu has granularity incompatible with target AS");
         return false;
     }
@@ -2256,7 +2409,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_pending_mark(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2386,7 +2541,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_pending_mark(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2396,7 +2553,9 @@ void memory_region_set_nonvolatile(MemoryRegion *mr, bool nonvolatile)
     if (mr->nonvolatile != nonvolatile) {
         memory_region_transaction_begin();
         mr->nonvolatile = nonvolatile;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_pending_mark(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2406,7 +2565,9 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_pending_mark(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2642,7 +2803,11 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    /* Views rendered through aliases into @subregion now depend on @mr */
+    flat_views_mark_tree_dirty(subregion);
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_pending_mark(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2692,7 +2857,11 @@ void memory_region_del_subregion(MemoryRegion *mr,
     }
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    /* Views rendered through aliases into @subregion have to learn its tree */
+    flat_views_mark_tree_dirty(memory_region_get_tree(mr));
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_pending = true;
+    }
     memory_region_transaction_commit();
 }
 
@@ -2703,7 +2872,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_update_pending_mark(mr);
     memory_region_transaction_commit();
 }
 
@@ -2719,7 +2888,7 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
     }
     memory_region_transaction_begin();
     mr->size = s;
-    memory_region_update_pending = true;
+    memory_region_update_pending_mark(mr);
     memory_region_transaction_commit();
 }
 
@@ -2755,7 +2924,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_pending_mark(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2767,7 +2938,9 @@ void memory_region_set_unmergeable(MemoryRegion *mr, bool unmergeable)
 
     memory_region_transaction_begin();
     mr->unmergeable = unmergeable;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_pending_mark(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2939,6 +3112,7 @@ void memory_global_dirty_log_start(unsigned int flags)
         MEMORY_LISTENER_CALL_GLOBAL(log_global_start, Forward);
         memory_region_transaction_begin();
         memory_region_update_pending = true;
+        flat_views_all_dirty = true;
         memory_region_transaction_commit();
     }
 }
@@ -2954,6 +3128,7 @@ static void memory_global_dirty_log_do_stop(unsigned int flags)
     if (!global_dirty_tracking) {
         memory_region_transaction_begin();
         memory_region_update_pending = true;
+        flat_views_all_dirty = true;
         memory_region_transaction_commit();
         MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
     }
@@ -129,6 +129,8 @@ typedef struct PhysPageMap {
 
 struct AddressSpaceDispatch {
     MemoryRegionSection *mru_section;
+    /* Tags CPUSectionCache entries, unique across all dispatches */
+    uint64_t generation;
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
@@ -332,18 +334,70 @@ static MemoryRegionSection *phys_page_find(AddressSpaceDispatch *d, hwaddr addr)
     }
 }
 
+/*
+ * vCPUs exiting to userspace for MMIO tend to hit the same few registers
+ * (doorbells, interrupt controllers) over and over, so each vCPU keeps the
+ * last MMIO sections it found.  Unlike mru_section this is not shared, and
+ * it does not thrash when vCPUs alternate between devices.
+ */
+static MemoryRegionSection *cpu_section_cache_find(CPUState *cpu,
+                                                   AddressSpaceDispatch *d,
+                                                   hwaddr addr)
+{
+    CPUSectionCache *c = &cpu->section_cache;
+    int i;
+
+    if (c->dispatch != d || c->generation != d->generation) {
+        return NULL;
+    }
+    for (i = 0; i < CPU_SECTION_CACHE_SIZE; i++) {
+        if (c->sections[i] && section_covers_addr(c->sections[i], addr)) {
+            return c->sections[i];
+        }
+    }
+    return NULL;
+}
+
+static void cpu_section_cache_add(CPUState *cpu, AddressSpaceDispatch *d,
+                                  MemoryRegionSection *section)
+{
+    CPUSectionCache *c = &cpu->section_cache;
+
+    if (section == &d->map.sections[PHYS_SECTION_UNASSIGNED] ||
+        memory_region_is_ram(section->mr)) {
+        return;
+    }
+    if (c->dispatch != d || c->generation != d->generation) {
+        memset(c, 0, sizeof(*c));
+        c->dispatch = d;
+        c->generation = d->generation;
+    }
+    c->sections[c->next++ % CPU_SECTION_CACHE_SIZE] = section;
+}
+
 /* Called from RCU critical section */
 static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
                                                         bool resolve_subpage)
 {
-    MemoryRegionSection *section = qatomic_read(&d->mru_section);
+    CPUState *cpu = current_cpu;
+    MemoryRegionSection *section = NULL;
     subpage_t *subpage;
 
-    if (!section || section == &d->map.sections[PHYS_SECTION_UNASSIGNED] ||
-        !section_covers_addr(section, addr)) {
-        section = phys_page_find(d, addr);
-        qatomic_set(&d->mru_section, section);
+    if (cpu) {
+        section = cpu_section_cache_find(cpu, d, addr);
+    }
+    if (!section) {
+        section = qatomic_read(&d->mru_section);
+        if (!section ||
+            section == &d->map.sections[PHYS_SECTION_UNASSIGNED] ||
+            !section_covers_addr(section, addr)) {
+            section = phys_page_find(d, addr);
+            qatomic_set(&d->mru_section, section);
+        }
+        if (cpu) {
+            cpu_section_cache_add(cpu, d, section);
+        }
     }
     if (resolve_subpage && section->mr->subpage) {
         subpage = container_of(section->mr, subpage_t, iomem);
@@ -2459,9 +2513,13 @@ static void io_mem_init(void)
 
 AddressSpaceDispatch *address_space_dispatch_new(FlatView *fv)
 {
+    static uint64_t generation;
     AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
     uint16_t n;
 
+    /* Called with the BQL held */
+    d->generation = ++generation;
+
     n = dummy_section(&d->map, fv, &io_mem_unassigned);
     assert(n == PHYS_SECTION_UNASSIGNED);
 
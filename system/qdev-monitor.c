@@ -42,6 +42,7 @@
 #include "hw/qdev-properties.h"
 #include "hw/clock.h"
 #include "hw/boards.h"
+#include "exec/memory.h"
 
 /*
  * Aliases were a bad idea from the start.  Let's keep them
@@ -846,21 +847,35 @@ void hmp_info_qdm(Monitor *mon, const QDict *qdict)
     qdev_print_devinfos(true);
 }
 
-void qmp_device_add(QDict *qdict, QObject **ret_data, Error **errp)
+/*
+ * Add a device from device_add arguments.  On failure, the caller
+ * should drain pending RCU callbacks with drain_call_rcu().
+ */
+static bool qdev_device_add_qmp(QDict *qdict, Error **errp)
 {
     QemuOpts *opts;
     DeviceState *dev;
 
     opts = qemu_opts_from_qdict(qemu_find_opts("device"), qdict, errp);
     if (!opts) {
-        return;
+        return false;
     }
     if (!monitor_cur_is_qmp() && qdev_device_help(opts)) {
         qemu_opts_del(opts);
-        return;
+        return true;
     }
     dev = qdev_device_add(opts, errp);
     if (!dev) {
+        qemu_opts_del(opts);
+        return false;
+    }
+    object_unref(OBJECT(dev));
+    return true;
+}
+
+void qmp_device_add(QDict *qdict, QObject **ret_data, Error **errp)
+{
+    if (!qdev_device_add_qmp(qdict, errp)) {
         /*
          * Drain all pending RCU callbacks. This is done because
          * some bus related operations can delay a device removal
@@ -871,11 +886,40 @@ void qmp_device_add(QDict *qdict, QObject **ret_data, Error **errp)
          * to the user
          */
         drain_call_rcu();
+    }
+}
 
-        qemu_opts_del(opts);
-        return;
+void qmp_device_add_batch(anyList *devices, Error **errp)
+{
+    ERRP_GUARD();
+    anyList *l;
+    unsigned i = 0;
+
+    /*
+     * Realizing a device usually changes the memory map.  Commit all
+     * the changes at once instead of rebuilding the flat views for
+     * each device.
+     */
+    memory_region_transaction_begin();
+    for (l = devices; l; l = l->next, i++) {
+        QDict *qdict = qobject_to(QDict, l->value);
+
+        if (!qdict) {
+            error_setg(errp, "Invalid parameter type for 'devices[%u]',"
+                       " expected: object", i);
+            break;
+        }
+        if (!qdev_device_add_qmp(qdict, errp)) {
+            error_prepend(errp, "devices[%u]: ", i);
+            break;
+        }
+    }
+    memory_region_transaction_commit();
+
+    if (*errp) {
+        /* See qmp_device_add() */
+        drain_call_rcu();
     }
-    object_unref(OBJECT(dev));
 }
 
 static DeviceState *find_device_state(const char *id, Error **errp)
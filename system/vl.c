@@ -76,6 +76,7 @@
 #include "hw/block/block.h"
 #include "hw/i386/x86.h"
 #include "hw/i386/pc.h"
+#include "migration/cpr.h"
 #include "migration/misc.h"
 #include "migration/snapshot.h"
 #include "sysemu/tpm.h"
@@ -2012,14 +2013,6 @@ static void qemu_create_late_backends(void)
 
     object_option_foreach_add(object_create_late);
 
-    /*
-     * Wait for any outstanding memory prealloc from created memory
-     * backends to complete.
-     */
-    if (!qemu_finish_async_prealloc_mem(&error_fatal)) {
-        exit(1);
-    }
-
     if (tpm_init() < 0) {
         exit(1);
     }
@@ -2708,6 +2701,16 @@ void qmp_x_exit_preconfig(Error **errp)
         return;
     }
 
+    /*
+     * Memory backends created from the command line preallocate in the
+     * background while the board and devices are set up.  Wait for that
+     * to complete before any vCPU, snapshot or incoming migration touches
+     * guest RAM for real.
+     */
+    if (!qemu_finish_async_prealloc_mem(&error_fatal)) {
+        exit(1);
+    }
+
     if (loadvm) {
         RunState state = autostart ? RUN_STATE_RUNNING : runstate_get();
         load_snapshot(loadvm, NULL, false, NULL, &error_fatal);
@@ -2742,6 +2745,8 @@ void qemu_init(int argc, char **argv)
     bool userconfig = true;
     FILE *vmstate_dump_file = NULL;
 
+    phase_start_timeline();
+
     qemu_add_opts(&qemu_drive_opts);
     qemu_add_drive_opts(&qemu_legacy_drive_opts);
     qemu_add_drive_opts(&qemu_common_drive_opts);
@@ -2785,6 +2790,9 @@ void qemu_init(int argc, char **argv)
 
     qemu_init_subsystems();
 
+    /* Pick up the state of the QEMU that exec'ed this one for cpr-exec */
+    cpr_state_load(&error_fatal);
+
     /* first pass of option parsing */
     optind = 1;
     while (optind < argc) {
@@ -31,6 +31,7 @@ C_O1_I2(w, w, w)
 C_O1_I2(w, w, wN)
 C_O1_I2(w, w, wO)
 C_O1_I2(w, w, wZ)
+C_O1_I3(r, r, 0, r)
 C_O1_I3(w, w, w, w)
 C_O1_I4(r, r, rC, rZ, rZ)
 C_O2_I1(r, r, r)
@@ -64,6 +64,7 @@ typedef enum {
 
 #define have_lse    (cpuinfo & CPUINFO_LSE)
 #define have_lse2   (cpuinfo & CPUINFO_LSE2)
+#define have_sve2   (cpuinfo & CPUINFO_SVE2)
 
 /* optional instructions */
 #define TCG_TARGET_HAS_div_i32          1
@@ -142,6 +143,9 @@ typedef enum {
 #define TCG_TARGET_HAS_qemu_ldst_i128   1
 #endif
 
+/* Inline compare-and-swap uses CASAL. */
+#define TCG_TARGET_HAS_qemu_cmpxchg     have_lse
+
 #define TCG_TARGET_HAS_tst              1
 
 #define TCG_TARGET_HAS_v64              1
@@ -150,9 +154,9 @@ typedef enum {
 
 #define TCG_TARGET_HAS_andc_vec         1
 #define TCG_TARGET_HAS_orc_vec          1
-#define TCG_TARGET_HAS_nand_vec         0
-#define TCG_TARGET_HAS_nor_vec          0
-#define TCG_TARGET_HAS_eqv_vec          0
+#define TCG_TARGET_HAS_nand_vec         have_sve2
+#define TCG_TARGET_HAS_nor_vec          have_sve2
+#define TCG_TARGET_HAS_eqv_vec          have_sve2
 #define TCG_TARGET_HAS_not_vec          1
 #define TCG_TARGET_HAS_neg_vec          1
 #define TCG_TARGET_HAS_abs_vec          1
@@ -170,6 +174,7 @@ typedef enum {
 
 #define TCG_TARGET_DEFAULT_MO (0)
 #define TCG_TARGET_NEED_LDST_LABELS
+#define TCG_TARGET_NEED_CMPXCHG_LABELS
 #define TCG_TARGET_NEED_POOL_LABELS
 
 #endif /* AARCH64_TCG_TARGET_H */
@@ -124,6 +124,7 @@ extern bool use_neon_instructions;
 #define TCG_TARGET_HAS_qemu_st8_i32     0
 
 #define TCG_TARGET_HAS_qemu_ldst_i128   0
+#define TCG_TARGET_HAS_qemu_cmpxchg     0
 
 #define TCG_TARGET_HAS_tst              1
 
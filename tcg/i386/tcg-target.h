@@ -197,6 +197,7 @@ typedef enum {
 
 #define TCG_TARGET_HAS_qemu_ldst_i128 \
     (TCG_TARGET_REG_BITS == 64 && (cpuinfo & CPUINFO_ATOMIC_VMOVDQA))
+#define TCG_TARGET_HAS_qemu_cmpxchg   (TCG_TARGET_REG_BITS == 64)
 
 #define TCG_TARGET_HAS_tst              1
 
@@ -247,6 +248,7 @@ typedef enum {
 
 #define TCG_TARGET_DEFAULT_MO (TCG_MO_ALL & ~TCG_MO_ST_LD)
 #define TCG_TARGET_NEED_LDST_LABELS
+#define TCG_TARGET_NEED_CMPXCHG_LABELS
 #define TCG_TARGET_NEED_POOL_LABELS
 
 #endif
@@ -168,6 +168,7 @@ typedef enum {
 #define TCG_TARGET_HAS_mulsh_i64        1
 
 #define TCG_TARGET_HAS_qemu_ldst_i128   (cpuinfo & CPUINFO_LSX)
+#define TCG_TARGET_HAS_qemu_cmpxchg     0
 
 #define TCG_TARGET_HAS_tst              0
 
@@ -193,6 +193,7 @@ extern bool use_mips32r2_instructions;
 #endif
 
 #define TCG_TARGET_HAS_qemu_ldst_i128   0
+#define TCG_TARGET_HAS_qemu_cmpxchg     0
 
 #define TCG_TARGET_HAS_tst              0
 
@@ -2781,6 +2781,8 @@ void tcg_optimize(TCGContext *s)
         case INDEX_op_qemu_ld_a64_i64:
         case INDEX_op_qemu_ld_a32_i128:
         case INDEX_op_qemu_ld_a64_i128:
+        case INDEX_op_qemu_cmpxchg_i32:
+        case INDEX_op_qemu_cmpxchg_i64:
             done = fold_qemu_ld(&ctx, op);
             break;
         case INDEX_op_qemu_st8_a32_i32:
@@ -137,6 +137,7 @@ extern uint64_t s390_facilities[3];
 #define TCG_TARGET_HAS_mulsh_i64      0
 
 #define TCG_TARGET_HAS_qemu_ldst_i128 1
+#define TCG_TARGET_HAS_qemu_cmpxchg   0
 
 #define TCG_TARGET_HAS_tst            1
 
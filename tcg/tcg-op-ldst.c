@@ -854,6 +854,23 @@ void tcg_gen_nonatomic_cmpxchg_i32_chk(TCGv_i32 retv, TCGTemp *addr,
     tcg_gen_nonatomic_cmpxchg_i32_int(retv, addr, cmpv, newv, idx, memop);
 }
 
+/*
+ * The backend can inline compare-and-swap of host-endian data.  The
+ * helper is still needed when plugins want the memory callbacks.
+ */
+static bool tcg_can_inline_cmpxchg(MemOp memop)
+{
+    if (!TCG_TARGET_HAS_qemu_cmpxchg || (memop & MO_BSWAP)) {
+        return false;
+    }
+#ifdef CONFIG_PLUGIN
+    if (tcg_ctx->plugin_insn != NULL) {
+        return false;
+    }
+#endif
+    return true;
+}
+
 static void tcg_gen_atomic_cmpxchg_i32_int(TCGv_i32 retv, TCGTemp *addr,
                                            TCGv_i32 cmpv, TCGv_i32 newv,
                                            TCGArg idx, MemOp memop)
@@ -868,13 +885,20 @@ static void tcg_gen_atomic_cmpxchg_i32_int(TCGv_i32 retv, TCGTemp *addr,
     }
 
     memop = tcg_canonicalize_memop(memop, 0, 0);
-    gen = table_cmpxchg[memop & (MO_SIZE | MO_BSWAP)];
-    tcg_debug_assert(gen != NULL);
-
     oi = make_memop_idx(memop & ~MO_SIGN, idx);
-    a64 = maybe_extend_addr64(addr);
-    gen(retv, tcg_env, a64, cmpv, newv, tcg_constant_i32(oi));
-    maybe_free_addr64(a64);
+
+    if (tcg_can_inline_cmpxchg(memop)) {
+        tcg_gen_op5(INDEX_op_qemu_cmpxchg_i32, tcgv_i32_arg(retv),
+                    temp_arg(addr), tcgv_i32_arg(cmpv),
+                    tcgv_i32_arg(newv), oi);
+    } else {
+        gen = table_cmpxchg[memop & (MO_SIZE | MO_BSWAP)];
+        tcg_debug_assert(gen != NULL);
+
+        a64 = maybe_extend_addr64(addr);
+        gen(retv, tcg_env, a64, cmpv, newv, tcg_constant_i32(oi));
+        maybe_free_addr64(a64);
+    }
 
     if (memop & MO_SIGN) {
         tcg_gen_ext_i32(retv, retv, memop);
@@ -949,6 +973,13 @@ static void tcg_gen_atomic_cmpxchg_i64_int(TCGv_i64 retv, TCGTemp *addr,
         gen_atomic_cx_i64 gen;
 
         memop = tcg_canonicalize_memop(memop, 1, 0);
+        if (tcg_can_inline_cmpxchg(memop)) {
+            tcg_gen_op5(INDEX_op_qemu_cmpxchg_i64, tcgv_i64_arg(retv),
+                        temp_arg(addr), tcgv_i64_arg(cmpv),
+                        tcgv_i64_arg(newv), make_memop_idx(memop, idx));
+            return;
+        }
+
         gen = table_cmpxchg[memop & (MO_SIZE | MO_BSWAP)];
         if (gen) {
             MemOpIdx oi = make_memop_idx(memop, idx);
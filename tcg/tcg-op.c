@@ -312,9 +312,11 @@ void tcg_gen_mb(TCGBar mb_type)
     }
 }
 
-void tcg_gen_plugin_cb_start(unsigned from, unsigned type, unsigned wr)
+void tcg_gen_plugin_cb_start(unsigned from, unsigned type, unsigned wr,
+                             TCGv_i64 addr)
 {
-    tcg_gen_op3(INDEX_op_plugin_cb_start, from, type, wr);
+    tcg_gen_op4(INDEX_op_plugin_cb_start, from, type, wr,
+                addr ? tcgv_i64_arg(addr) : 0);
 }
 
 void tcg_gen_plugin_cb_end(void)
@@ -98,6 +98,8 @@ typedef struct TCGLabelQemuLdst {
     TCGReg addrhi_reg;      /* reg index for high word of guest virtual addr */
     TCGReg datalo_reg;      /* reg index for low word to be loaded or stored */
     TCGReg datahi_reg;      /* reg index for high word to be loaded or stored */
+    bool is_cmpxchg;        /* qemu_cmpxchg: datalo_reg holds cmpv */
+    TCGReg newv_reg;        /* reg index for the new value of qemu_cmpxchg */
     const tcg_insn_unit *raddr;   /* addr of the next IR of qemu_ld/st IR */
     tcg_insn_unit *label_ptr[2]; /* label pointers to be updated */
     QSIMPLEQ_ENTRY(TCGLabelQemuLdst) next;
@@ -198,6 +200,13 @@ static void tcg_out_ld_helper_ret(TCGContext *s, const TCGLabelQemuLdst *l,
 static void tcg_out_st_helper_args(TCGContext *s, const TCGLabelQemuLdst *l,
                                    const TCGLdstHelperParam *p)
     __attribute__((unused));
+static void tcg_out_cmpxchg_helper_args(TCGContext *s,
+                                        const TCGLabelQemuLdst *l,
+                                        const TCGLdstHelperParam *p)
+    __attribute__((unused));
+static void tcg_out_cmpxchg_helper_ret(TCGContext *s,
+                                       const TCGLabelQemuLdst *l)
+    __attribute__((unused));
 
 static void * const qemu_ld_helpers[MO_SSIZE + 1] __attribute__((unused)) = {
     [MO_UB] = helper_ldub_mmu,
@@ -222,6 +231,15 @@ static void * const qemu_st_helpers[MO_SIZE + 1] __attribute__((unused)) = {
 #endif
 };
 
+static void * const qemu_cmpxchg_helpers[MO_64 + 1] __attribute__((unused)) = {
+    [MO_8]  = helper_cmpxchgb_mmu,
+    [MO_16] = helper_cmpxchgw_mmu,
+    [MO_32] = helper_cmpxchgl_mmu,
+#ifdef CONFIG_ATOMIC64
+    [MO_64] = helper_cmpxchgq_mmu,
+#endif
+};
+
 typedef struct {
     MemOp atom;   /* lg2 bits of atomicity required */
     MemOp align;  /* lg2 bits of alignment to use */
@@ -947,6 +965,28 @@ static TCGHelperInfo info_helper_st128_mmu = {
               | dh_typemask(ptr, 5)  /* uintptr_t ra */
 };
 
+static TCGHelperInfo info_helper_cmpxchg32_mmu = {
+    .flags = TCG_CALL_NO_WG,
+    .typemask = dh_typemask(i32, 0)  /* return uint32_t */
+              | dh_typemask(env, 1)
+              | dh_typemask(i64, 2)  /* uint64_t addr */
+              | dh_typemask(i32, 3)  /* uint32_t cmpv */
+              | dh_typemask(i32, 4)  /* uint32_t newv */
+              | dh_typemask(i32, 5)  /* unsigned oi */
+              | dh_typemask(ptr, 6)  /* uintptr_t ra */
+};
+
+static TCGHelperInfo info_helper_cmpxchg64_mmu = {
+    .flags = TCG_CALL_NO_WG,
+    .typemask = dh_typemask(i64, 0)  /* return uint64_t */
+              | dh_typemask(env, 1)
+              | dh_typemask(i64, 2)  /* uint64_t addr */
+              | dh_typemask(i64, 3)  /* uint64_t cmpv */
+              | dh_typemask(i64, 4)  /* uint64_t newv */
+              | dh_typemask(i32, 5)  /* unsigned oi */
+              | dh_typemask(ptr, 6)  /* uintptr_t ra */
+};
+
 #ifdef CONFIG_TCG_INTERPRETER
 static ffi_type *typecode_to_ffi(int argmask)
 {
@@ -1342,6 +1382,8 @@ static void tcg_context_init(unsigned max_cpus)
     init_call_layout(&info_helper_st32_mmu);
     init_call_layout(&info_helper_st64_mmu);
     init_call_layout(&info_helper_st128_mmu);
+    init_call_layout(&info_helper_cmpxchg32_mmu);
+    init_call_layout(&info_helper_cmpxchg64_mmu);
 
     tcg_target_init(s);
     process_op_defs(s);
@@ -1981,6 +2023,10 @@ bool tcg_op_supported(TCGOpcode op)
     case INDEX_op_qemu_st_a64_i128:
         return TCG_TARGET_HAS_qemu_ldst_i128;
 
+    case INDEX_op_qemu_cmpxchg_i32:
+    case INDEX_op_qemu_cmpxchg_i64:
+        return TCG_TARGET_HAS_qemu_cmpxchg;
+
     case INDEX_op_mov_i32:
     case INDEX_op_setcond_i32:
     case INDEX_op_brcond_i32:
@@ -2671,6 +2717,8 @@ static void tcg_dump_ops(TCGContext *s, FILE *f, bool have_prefs)
             case INDEX_op_qemu_ld_a64_i128:
             case INDEX_op_qemu_st_a32_i128:
             case INDEX_op_qemu_st_a64_i128:
+            case INDEX_op_qemu_cmpxchg_i32:
+            case INDEX_op_qemu_cmpxchg_i64:
                 {
                     const char *s_al, *s_op, *s_at;
                     MemOpIdx oi = op->args[k++];
@@ -6072,6 +6120,47 @@ static void tcg_out_st_helper_args(TCGContext *s, const TCGLabelQemuLdst *ldst,
     tcg_out_helper_load_common_args(s, ldst, parm, info, next_arg);
 }
 
+/*
+ * qemu_cmpxchg is only for 64-bit hosts, where each of addr, cmpv
+ * and newv occupies a single argument slot.
+ */
+static void tcg_out_cmpxchg_helper_args(TCGContext *s,
+                                        const TCGLabelQemuLdst *ldst,
+                                        const TCGLdstHelperParam *parm)
+{
+    const TCGHelperInfo *info;
+    TCGMovExtend mov[3];
+
+    tcg_debug_assert(TCG_TARGET_REG_BITS == 64);
+    info = (ldst->type == TCG_TYPE_I32
+            ? &info_helper_cmpxchg32_mmu : &info_helper_cmpxchg64_mmu);
+
+    /* Defer env argument. */
+    tcg_out_helper_add_mov(mov, &info->in[1], TCG_TYPE_I64, s->addr_type,
+                           ldst->addrlo_reg, -1);
+    tcg_out_helper_add_mov(mov + 1, &info->in[2], ldst->type, ldst->type,
+                           ldst->datalo_reg, -1);
+    tcg_out_helper_add_mov(mov + 2, &info->in[3], ldst->type, ldst->type,
+                           ldst->newv_reg, -1);
+    tcg_out_helper_load_slots(s, 3, mov, parm);
+
+    tcg_out_helper_load_common_args(s, ldst, parm, info, 4);
+}
+
+static void tcg_out_cmpxchg_helper_ret(TCGContext *s,
+                                       const TCGLabelQemuLdst *ldst)
+{
+    TCGMovExtend mov = {
+        .dst = ldst->datalo_reg,
+        .dst_type = ldst->type,
+        .src = tcg_target_call_oarg_reg(TCG_CALL_RET_NORMAL, 0),
+        .src_type = TCG_TYPE_REG,
+        .src_ext = ldst->type == TCG_TYPE_I32 ? MO_32 : MO_64,
+    };
+
+    tcg_out_movext1(s, &mov);
+}
+
 int tcg_gen_code(TCGContext *s, TranslationBlock *tb, uint64_t pc_start)
 {
     int i, start_words, num_insns;
@@ -6105,7 +6194,10 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb, uint64_t pc_start)
     }
 #endif
 
-    tcg_optimize(s);
+    /* The first tier trades code quality for translation speed */
+    if (!(tb_cflags(tb) & CF_TIER0)) {
+        tcg_optimize(s);
+    }
 
     reachable_code_pass(s);
     liveness_pass_0(s);
@@ -0,0 +1,257 @@
+/*
+ * Block layer I/O submission path benchmark
+ *
+ * Drives blk_co_preadv()/blk_co_pwritev() through a few common node
+ * graphs, either from the main loop or from an IOThread, and reports
+ * the CPU time spent per request together with the request latency
+ * distribution.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "qemu/osdep.h"
+#include <sys/resource.h>
+#include "qemu/units.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "qemu/module.h"
+#include "qemu/main-loop.h"
+#include "qemu/coroutine.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qom/object.h"
+#include "block/block.h"
+#include "block/throttle-groups.h"
+#include "sysemu/block-backend.h"
+#include "../unit/iothread.h"
+
+#define BENCH_DEV_SIZE      (1 * GiB)
+#define BENCH_REQUESTS      200000
+#define BENCH_HIST_BUCKETS  40
+
+typedef struct BlockBenchOpts {
+    const char *driver;
+    bool iothread;
+    bool write;
+    size_t bufsize;
+    int queue_depth;
+} BlockBenchOpts;
+
+typedef struct BlockBenchState {
+    const BlockBenchOpts *opts;
+    BlockBackend *blk;
+    QEMUIOVector qiov;
+    uint64_t remaining;
+    uint64_t next;
+    unsigned running;
+
+    /* Latency histogram, bucket i counts requests taking < 2^i ns */
+    uint64_t hist[BENCH_HIST_BUCKETS];
+    uint64_t lat_total;
+    uint64_t lat_max;
+} BlockBenchState;
+
+static IOThread *bench_iothread;
+static char *bench_image;
+
+static QDict *bench_node_options(const char *driver)
+{
+    QDict *qdict = qdict_new();
+
+    if (!strcmp(driver, "null-co")) {
+        qdict_put_str(qdict, "driver", "null-co");
+        qdict_put_int(qdict, "size", BENCH_DEV_SIZE);
+    } else if (!strcmp(driver, "raw")) {
+        qdict_put_str(qdict, "driver", "raw");
+        qdict_put_str(qdict, "file.driver", "null-co");
+        qdict_put_int(qdict, "file.size", BENCH_DEV_SIZE);
+    } else if (!strcmp(driver, "qcow2")) {
+        qdict_put_str(qdict, "driver", "qcow2");
+        qdict_put_str(qdict, "file.driver", "file");
+        qdict_put_str(qdict, "file.filename", bench_image);
+    } else if (!strcmp(driver, "throttle")) {
+        qdict_put_str(qdict, "driver", "throttle");
+        qdict_put_str(qdict, "throttle-group", "bench-tg");
+        qdict_put_str(qdict, "file.driver", "null-co");
+        qdict_put_int(qdict, "file.size", BENCH_DEV_SIZE);
+    } else {
+        g_assert_not_reached();
+    }
+
+    return qdict;
+}
+
+static void bench_record(BlockBenchState *s, uint64_t ns)
+{
+    int bucket = MIN(64 - clz64(ns | 1), BENCH_HIST_BUCKETS - 1);
+
+    s->hist[bucket]++;
+    s->lat_total += ns;
+    s->lat_max = MAX(s->lat_max, ns);
+}
+
+static uint64_t bench_percentile(BlockBenchState *s, uint64_t count,
+                                 unsigned permille)
+{
+    uint64_t want = count * permille / 1000;
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+        seen += s->hist[i];
+        if (seen > want) {
+            break;
+        }
+    }
+    return 1ULL << MIN(i, BENCH_HIST_BUCKETS - 1);
+}
+
+static void coroutine_fn bench_worker(void *opaque)
+{
+    BlockBenchState *s = opaque;
+    const BlockBenchOpts *opts = s->opts;
+    int64_t offset, start;
+    int ret;
+
+    /* All workers run in the same AioContext, no locking needed */
+    while (s->remaining) {
+        s->remaining--;
+        offset = (s->next++ * opts->bufsize) % BENCH_DEV_SIZE;
+
+        start = get_clock();
+        if (opts->write) {
+            ret = blk_co_pwritev(s->blk, offset, opts->bufsize, &s->qiov, 0);
+        } else {
+            ret = blk_co_preadv(s->blk, offset, opts->bufsize, &s->qiov, 0);
+        }
+        g_assert(ret == 0);
+        bench_record(s, get_clock() - start);
+    }
+
+    qatomic_dec(&s->running);
+    aio_wait_kick();
+}
+
+static int64_t bench_cpu_ns(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * NANOSECONDS_PER_SECOND +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+}
+
+static void test_block_speed(const void *opaque)
+{
+    const BlockBenchOpts *opts = opaque;
+    BlockBenchState s = {
+        .opts = opts,
+        .remaining = BENCH_REQUESTS,
+    };
+    AioContext *ctx = opts->iothread ?
+        iothread_get_aio_context(bench_iothread) : qemu_get_aio_context();
+    void *buf;
+    int64_t cpu;
+    int i;
+
+    s.blk = blk_new_open(NULL, NULL, bench_node_options(opts->driver),
+                         BDRV_O_RDWR, &error_abort);
+    blk_set_aio_context(s.blk, ctx, &error_abort);
+
+    buf = qemu_blockalign(blk_bs(s.blk), opts->bufsize);
+    memset(buf, 0xa5, opts->bufsize);
+    qemu_iovec_init_buf(&s.qiov, buf, opts->bufsize);
+
+    s.running = opts->queue_depth;
+
+    cpu = bench_cpu_ns();
+    g_test_timer_start();
+    for (i = 0; i < opts->queue_depth; i++) {
+        aio_co_enter(ctx, qemu_coroutine_create(bench_worker, &s));
+    }
+    AIO_WAIT_WHILE_UNLOCKED(ctx, qatomic_read(&s.running) > 0);
+    g_test_timer_elapsed();
+    cpu = bench_cpu_ns() - cpu;
+
+    g_test_message("%s(%s, %s): bufsize %zu qd %d: %.0f IOPS, "
+                   "%" PRId64 " ns CPU/req, latency avg %" PRIu64
+                   " ns p50 <%" PRIu64 " ns p99 <%" PRIu64
+                   " ns p99.9 <%" PRIu64 " ns max %" PRIu64 " ns",
+                   opts->write ? "write" : "read", opts->driver,
+                   opts->iothread ? "iothread" : "main-loop",
+                   opts->bufsize, opts->queue_depth,
+                   BENCH_REQUESTS / g_test_timer_last(),
+                   cpu / BENCH_REQUESTS,
+                   s.lat_total / BENCH_REQUESTS,
+                   bench_percentile(&s, BENCH_REQUESTS, 500),
+                   bench_percentile(&s, BENCH_REQUESTS, 990),
+                   bench_percentile(&s, BENCH_REQUESTS, 999),
+                   s.lat_max);
+
+    blk_set_aio_context(s.blk, qemu_get_aio_context(), &error_abort);
+    qemu_vfree(buf);
+    blk_unref(s.blk);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *drivers[] = { "null-co", "raw", "qcow2", "throttle" };
+    static const int depths[] = { 1, 32 };
+    char img_opts[] = "preallocation=metadata";
+    Object *tg;
+    int fd, ret, d, q, t, w;
+
+    module_call_init(MODULE_INIT_QOM);
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    fd = g_file_open_tmp("qemu-bench-block-XXXXXX.qcow2", &bench_image, NULL);
+    g_assert(fd >= 0);
+    close(fd);
+    bdrv_img_create(bench_image, "qcow2", NULL, NULL,
+                    img_opts, BENCH_DEV_SIZE,
+                    BDRV_O_RDWR, true, &error_abort);
+
+    /* Limits high enough that requests are accounted but never queued */
+    tg = object_new_with_props(TYPE_THROTTLE_GROUP, object_get_objects_root(),
+                               "bench-tg", &error_abort,
+                               "x-iops-total", "100000000",
+                               NULL);
+
+    bench_iothread = iothread_new();
+
+    for (d = 0; d < ARRAY_SIZE(drivers); d++) {
+        for (t = 0; t < 2; t++) {
+            for (w = 0; w < 2; w++) {
+                for (q = 0; q < ARRAY_SIZE(depths); q++) {
+                    BlockBenchOpts *opts = g_new0(BlockBenchOpts, 1);
+                    g_autofree char *name = NULL;
+
+                    opts->driver = drivers[d];
+                    opts->iothread = t;
+                    opts->write = w;
+                    opts->bufsize = 4 * KiB;
+                    opts->queue_depth = depths[q];
+
+                    name = g_strdup_printf("/block/benchmark/%s/%s/%s/qd-%d",
+                                           opts->driver,
+                                           t ? "iothread" : "main-loop",
+                                           w ? "write" : "read",
+                                           opts->queue_depth);
+                    g_test_add_data_func_full(name, opts, test_block_speed,
+                                              g_free);
+                }
+            }
+        }
+    }
+
+    ret = g_test_run();
+
+    iothread_join(bench_iothread);
+    object_unparent(tg);
+    unlink(bench_image);
+    g_free(bench_image);
+
+    return ret;
+}
@@ -99,6 +99,80 @@ static void test_cipher_speed(size_t chunk_size,
     g_free(key);
 }
 
+/* Disk encryption: 512 byte sectors, each with its own IV */
+static void test_cipher_sectors_speed(size_t chunk_size,
+                                      QCryptoCipherMode mode,
+                                      QCryptoCipherAlgorithm alg)
+{
+    QCryptoCipher *cipher;
+    Error *err = NULL;
+    uint8_t *key = NULL, *ivs = NULL, *buf = NULL;
+    const size_t sector_size = 512;
+    size_t nsectors = chunk_size / sector_size;
+    size_t nkey;
+    size_t niv;
+    const size_t total = 2 * GiB;
+    size_t remain;
+
+    if (!qcrypto_cipher_supports(alg, mode)) {
+        return;
+    }
+
+    nkey = qcrypto_cipher_get_key_len(alg);
+    niv = qcrypto_cipher_get_iv_len(alg, mode);
+    if (mode == QCRYPTO_CIPHER_MODE_XTS) {
+        nkey *= 2;
+    }
+
+    key = g_new0(uint8_t, nkey);
+    memset(key, g_test_rand_int(), nkey);
+
+    ivs = g_new0(uint8_t, niv * nsectors);
+    memset(ivs, g_test_rand_int(), niv * nsectors);
+
+    buf = g_new0(uint8_t, chunk_size);
+    memset(buf, g_test_rand_int(), chunk_size);
+
+    cipher = qcrypto_cipher_new(alg, mode,
+                                key, nkey, &err);
+    g_assert(cipher != NULL);
+
+    g_test_timer_start();
+    remain = total;
+    while (remain) {
+        g_assert(qcrypto_cipher_encrypt_sectors(cipher, ivs, niv, buf,
+                                                sector_size, nsectors,
+                                                &err) == 0);
+        remain -= chunk_size;
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("enc(%s-%s) sectors, chunk %zu bytes %.2f MB/sec ",
+                   QCryptoCipherAlgorithm_str(alg),
+                   QCryptoCipherMode_str(mode),
+                   chunk_size, (double)total / MiB / g_test_timer_last());
+
+    g_test_timer_start();
+    remain = total;
+    while (remain) {
+        g_assert(qcrypto_cipher_decrypt_sectors(cipher, ivs, niv, buf,
+                                                sector_size, nsectors,
+                                                &err) == 0);
+        remain -= chunk_size;
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("dec(%s-%s) sectors, chunk %zu bytes %.2f MB/sec ",
+                   QCryptoCipherAlgorithm_str(alg),
+                   QCryptoCipherMode_str(mode),
+                   chunk_size, (double)total / MiB / g_test_timer_last());
+
+    qcrypto_cipher_free(cipher);
+    g_free(buf);
+    g_free(ivs);
+    g_free(key);
+}
+
 
 static void test_cipher_speed_ecb_aes_128(const void *opaque)
 {
@@ -164,6 +238,22 @@ static void test_cipher_speed_xts_aes_256(const void *opaque)
                       QCRYPTO_CIPHER_ALG_AES_256);
 }
 
+static void test_cipher_speed_xts_sectors_aes_128(const void *opaque)
+{
+    size_t chunk_size = (size_t)opaque;
+    test_cipher_sectors_speed(chunk_size,
+                              QCRYPTO_CIPHER_MODE_XTS,
+                              QCRYPTO_CIPHER_ALG_AES_128);
+}
+
+static void test_cipher_speed_xts_sectors_aes_256(const void *opaque)
+{
+    size_t chunk_size = (size_t)opaque;
+    test_cipher_sectors_speed(chunk_size,
+                              QCRYPTO_CIPHER_MODE_XTS,
+                              QCRYPTO_CIPHER_ALG_AES_256);
+}
+
 
 int main(int argc, char **argv)
 {
@@ -197,6 +287,8 @@ int main(int argc, char **argv)
         ADD_TEST(ctr, aes, 256, chunk);         \
         ADD_TEST(xts, aes, 128, chunk);         \
         ADD_TEST(xts, aes, 256, chunk);         \
+        ADD_TEST(xts_sectors, aes, 128, chunk); \
+        ADD_TEST(xts_sectors, aes, 256, chunk); \
     } while (0)
 
     ADD_TESTS(512);
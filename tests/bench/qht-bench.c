@@ -60,6 +60,7 @@ static unsigned long resize_delay = 1000;
 static double resize_rate; /* 0.0 to 1.0 */
 static unsigned int n_rz_threads = 1;
 static QemuThread *rz_threads;
+static bool resize_incremental;
 static bool precompute_hash;
 
 static double update_rate; /* 0.0 to 1.0 */
@@ -93,7 +94,8 @@ static const char commands_string[] =
     " -R = enable auto-resize\n"
     " -S = resize rate (0.0 to 100.0)\n"
     " -D = delay (in us) between potential resizes\n"
-    " -N = number of resize threads";
+    " -N = number of resize threads\n"
+    " -I = resize incrementally, while the other threads run";
 
 static void usage_complete(int argc, char *argv[])
 {
@@ -144,7 +146,15 @@ static void do_rz(struct thread_info *info)
         size_t size = info->resize_down ? resize_min : resize_max;
         bool resized;
 
-        resized = qht_resize(&ht, size);
+        if (resize_incremental) {
+            resized = qht_resize_start(&ht, size);
+            while (qht_resize_step(&ht)) {
+                /* leave most of the copying to the writers */
+                g_usleep(resize_delay / 10);
+            }
+        } else {
+            resized = qht_resize(&ht, size);
+        }
         info->resize_down = !info->resize_down;
 
         if (resized) {
@@ -280,6 +290,7 @@ static void pr_params(void)
         printf(" resize_rate:       %f%%\n", resize_rate * 100.0);
         printf(" resize range:      %zu-%zu\n", resize_min, resize_max);
         printf(" # resize threads   %u\n", n_rz_threads);
+        printf(" incremental:       %s\n", resize_incremental ? "on" : "off");
     }
     printf(" update rate:       %f%%\n", update_rate * 100.0);
     printf(" offset:            %ld\n", populate_offset);
@@ -445,7 +456,7 @@ static void parse_args(int argc, char *argv[])
     int c;
 
     for (;;) {
-        c = getopt(argc, argv, "d:D:g:k:K:l:hn:N:o:pr:Rs:S:u:");
+        c = getopt(argc, argv, "d:D:g:Ik:K:l:hn:N:o:pr:Rs:S:u:");
         if (c < 0) {
             break;
         }
@@ -463,6 +474,9 @@ static void parse_args(int argc, char *argv[])
             qht_n_elems = atol(optarg);
             init_size = atol(optarg);
             break;
+        case 'I':
+            resize_incremental = true;
+            break;
         case 'h':
             usage_complete(argc, argv);
             exit(0);
@@ -136,6 +136,30 @@ def __init__(self, name, scenarios):
                  multifd=True, multifd_channels=64),
     ]),
 
+    # Looking at effect of multifd compression methods
+    # with a fixed number of channels
+    Comparison("compr-multifd-compression", scenarios = [
+        Scenario("compr-multifd-compression-none",
+                 multifd=True, multifd_channels=8,
+                 multifd_compression="none"),
+        Scenario("compr-multifd-compression-zlib",
+                 multifd=True, multifd_channels=8,
+                 multifd_compression="zlib"),
+        Scenario("compr-multifd-compression-zstd",
+                 multifd=True, multifd_channels=8,
+                 multifd_compression="zstd"),
+    ]),
+
+    # Looking at effect of the dedicated post-copy
+    # preempt channel on page fault latency
+    Comparison("post-copy-preempt", scenarios = [
+        Scenario("post-copy-preempt-off",
+                 post_copy=True, post_copy_iters=1),
+        Scenario("post-copy-preempt-on",
+                 post_copy=True, post_copy_iters=1,
+                 post_copy_preempt=True),
+    ]),
+
     # Looking at effect of dirty-limit with
     # varying x_vcpu_dirty_limit_period
     Comparison("compr-dirty-limit-period", scenarios = [
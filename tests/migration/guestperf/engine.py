@@ -150,6 +150,22 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
                                  "state": True }
                            ])
 
+        if scenario._post_copy_preempt:
+            if not scenario._post_copy:
+                raise Exception("post-copy must be enabled when "
+                                "testing post-copy preempt migration")
+
+            resp = src.cmd("migrate-set-capabilities",
+                           capabilities = [
+                               { "capability": "postcopy-preempt",
+                                 "state": True }
+                           ])
+            resp = dst.cmd("migrate-set-capabilities",
+                           capabilities = [
+                               { "capability": "postcopy-preempt",
+                                 "state": True }
+                           ])
+
         resp = src.cmd("migrate-set-parameters",
                        max_bandwidth=scenario._bandwidth * 1024 * 1024)
 
@@ -204,6 +220,10 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
                            ])
             resp = dst.cmd("migrate-set-parameters",
                            multifd_channels=scenario._multifd_channels)
+            resp = src.cmd("migrate-set-parameters",
+                           multifd_compression=scenario._multifd_compression)
+            resp = dst.cmd("migrate-set-parameters",
+                           multifd_compression=scenario._multifd_compression)
 
         if scenario._dirty_limit:
             if not hardware._dirty_ring_size:
@@ -53,6 +53,39 @@ def __init__(self,
         self._transport = transport
         self._sleep = sleep
 
+    def summary(self):
+        # Headline numbers for comparing runs without having to
+        # post-process the full progress history
+        if len(self._progress_history) == 0:
+            return {}
+
+        last = self._progress_history[-1]
+        transferred_gb = last._ram._transferred_bytes / (1024 * 1024 * 1024)
+
+        throughput_mbps = 0
+        if last._duration:
+            throughput_mbps = (last._ram._transferred_bytes * 8 /
+                              (1000 * 1000) / (last._duration / 1000))
+
+        qemu_cpu_ms = 0
+        records = self._qemu_timings._records
+        if len(records) >= 2:
+            qemu_cpu_ms = records[-1]._value - records[0]._value
+
+        qemu_cpu_ms_per_gb = 0
+        if transferred_gb:
+            qemu_cpu_ms_per_gb = qemu_cpu_ms / transferred_gb
+
+        return {
+            "status": last._status,
+            "duration_ms": last._duration,
+            "downtime_ms": last._downtime,
+            "transferred_bytes": last._ram._transferred_bytes,
+            "throughput_mbps": throughput_mbps,
+            "qemu_cpu_ms": qemu_cpu_ms,
+            "qemu_cpu_ms_per_gb": qemu_cpu_ms_per_gb,
+        }
+
     def serialize(self):
         return {
             "hardware": self._hardware.serialize(),
@@ -67,6 +100,7 @@ def serialize(self):
             "initrd": self._initrd,
             "transport": self._transport,
             "sleep": self._sleep,
+            "summary": self.summary(),
         }
 
     @classmethod
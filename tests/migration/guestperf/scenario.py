@@ -31,6 +31,8 @@ def __init__(self, name,
                  compression_mt=False, compression_mt_threads=1,
                  compression_xbzrle=False, compression_xbzrle_cache=10,
                  multifd=False, multifd_channels=2,
+                 multifd_compression="none",
+                 post_copy_preempt=False,
                  dirty_limit=False, x_vcpu_dirty_limit_period=500,
                  vcpu_dirty_limit=1):
 
@@ -61,6 +63,9 @@ def __init__(self, name,
 
         self._multifd = multifd
         self._multifd_channels = multifd_channels
+        self._multifd_compression = multifd_compression
+
+        self._post_copy_preempt = post_copy_preempt
 
         self._dirty_limit = dirty_limit
         self._x_vcpu_dirty_limit_period = x_vcpu_dirty_limit_period
@@ -85,6 +90,8 @@ def serialize(self):
             "compression_xbzrle_cache": self._compression_xbzrle_cache,
             "multifd": self._multifd,
             "multifd_channels": self._multifd_channels,
+            "multifd_compression": self._multifd_compression,
+            "post_copy_preempt": self._post_copy_preempt,
             "dirty_limit": self._dirty_limit,
             "x_vcpu_dirty_limit_period": self._x_vcpu_dirty_limit_period,
             "vcpu_dirty_limit": self._vcpu_dirty_limit,
@@ -109,4 +116,9 @@ def deserialize(cls, data):
             data["compression_xbzrle"],
             data["compression_xbzrle_cache"],
             data["multifd"],
-            data["multifd_channels"])
+            data["multifd_channels"],
+            data.get("multifd_compression", "none"),
+            data.get("post_copy_preempt", False),
+            data.get("dirty_limit", False),
+            data.get("x_vcpu_dirty_limit_period", 500),
+            data.get("vcpu_dirty_limit", 1))
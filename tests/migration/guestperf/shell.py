@@ -130,6 +130,12 @@ def __init__(self):
                             action="store_true")
         parser.add_argument("--multifd-channels", dest="multifd_channels",
                             default=2, type=int)
+        parser.add_argument("--multifd-compression",
+                            dest="multifd_compression", default="none",
+                            choices=["none", "zlib", "zstd"])
+
+        parser.add_argument("--post-copy-preempt", dest="post_copy_preempt",
+                            default=False, action="store_true")
 
         parser.add_argument("--dirty-limit", dest="dirty_limit", default=False,
                             action="store_true")
@@ -166,6 +172,9 @@ def get_scenario(self, args):
 
                         multifd=args.multifd,
                         multifd_channels=args.multifd_channels,
+                        multifd_compression=args.multifd_compression,
+
+                        post_copy_preempt=args.post_copy_preempt,
 
                         dirty_limit=args.dirty_limit,
                         x_vcpu_dirty_limit_period=\
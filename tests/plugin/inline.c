@@ -13,6 +13,9 @@
 
 #include <qemu-plugin.h>
 
+#define COND_THRESHOLD 1000
+#define RECORD_SIZE 64
+
 typedef struct {
     uint64_t count_tb;
     uint64_t count_tb_inline;
@@ -20,6 +23,14 @@ typedef struct {
     uint64_t count_insn_inline;
     uint64_t count_mem;
     uint64_t count_mem_inline;
+    uint64_t tb_cond_track;
+    uint64_t tb_cond_sum;
+    uint64_t insn_cond_track;
+    uint64_t insn_cond_sum;
+    uint64_t insn_store;
+    uint64_t mem_record_sum;
+    uint64_t mem_record_count;
+    uint64_t mem_record[RECORD_SIZE];
 } CPUCount;
 
 static struct qemu_plugin_scoreboard *counts;
@@ -29,6 +40,13 @@ static qemu_plugin_u64 count_insn;
 static qemu_plugin_u64 count_insn_inline;
 static qemu_plugin_u64 count_mem;
 static qemu_plugin_u64 count_mem_inline;
+static qemu_plugin_u64 tb_cond_track;
+static qemu_plugin_u64 tb_cond_sum;
+static qemu_plugin_u64 insn_cond_track;
+static qemu_plugin_u64 insn_cond_sum;
+static qemu_plugin_u64 insn_store;
+static qemu_plugin_u64 mem_record_sum;
+static qemu_plugin_u64 mem_record_count;
 
 static uint64_t global_count_tb;
 static uint64_t global_count_insn;
@@ -52,6 +70,8 @@ static void stats_insn(void)
     g_assert(expected > 0);
     g_assert(per_vcpu == expected);
     g_assert(inl_per_vcpu == expected);
+    g_assert(qemu_plugin_u64_sum(insn_cond_sum) +
+             qemu_plugin_u64_sum(insn_cond_track) == expected);
 }
 
 static void stats_tb(void)
@@ -66,6 +86,8 @@ static void stats_tb(void)
     g_assert(expected > 0);
     g_assert(per_vcpu == expected);
     g_assert(inl_per_vcpu == expected);
+    g_assert(qemu_plugin_u64_sum(tb_cond_sum) +
+             qemu_plugin_u64_sum(tb_cond_track) == expected);
 }
 
 static void stats_mem(void)
@@ -80,6 +102,8 @@ static void stats_mem(void)
     g_assert(expected > 0);
     g_assert(per_vcpu == expected);
     g_assert(inl_per_vcpu == expected);
+    g_assert(qemu_plugin_u64_sum(mem_record_sum) +
+             qemu_plugin_u64_sum(mem_record_count) == expected);
 }
 
 static void plugin_exit(qemu_plugin_id_t id, void *udata)
@@ -102,6 +126,7 @@ static void plugin_exit(qemu_plugin_id_t id, void *udata)
         g_assert(tb == tb_inline);
         g_assert(insn == insn_inline);
         g_assert(mem == mem_inline);
+        g_assert(insn == 0 || qemu_plugin_u64_get(insn_store, i) == 1);
     }
 
     stats_tb();
@@ -139,12 +164,42 @@ static void vcpu_mem_access(unsigned int cpu_index,
     g_mutex_unlock(&mem_lock);
 }
 
+static void vcpu_tb_cond_exec(unsigned int cpu_index, void *udata)
+{
+    g_assert(qemu_plugin_u64_get(tb_cond_track, cpu_index) ==
+             COND_THRESHOLD);
+    qemu_plugin_u64_add(tb_cond_sum, cpu_index, COND_THRESHOLD);
+    qemu_plugin_u64_set(tb_cond_track, cpu_index, 0);
+}
+
+static void vcpu_insn_cond_exec(unsigned int cpu_index, void *udata)
+{
+    g_assert(qemu_plugin_u64_get(insn_cond_track, cpu_index) ==
+             COND_THRESHOLD);
+    qemu_plugin_u64_add(insn_cond_sum, cpu_index, COND_THRESHOLD);
+    qemu_plugin_u64_set(insn_cond_track, cpu_index, 0);
+}
+
+static void vcpu_mem_record_flush(unsigned int cpu_index, void *udata)
+{
+    uint64_t n = qemu_plugin_u64_get(mem_record_count, cpu_index);
+
+    g_assert(n <= RECORD_SIZE);
+    qemu_plugin_u64_add(mem_record_sum, cpu_index, n);
+    qemu_plugin_u64_set(mem_record_count, cpu_index, 0);
+}
+
 static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
 {
     qemu_plugin_register_vcpu_tb_exec_cb(
         tb, vcpu_tb_exec, QEMU_PLUGIN_CB_NO_REGS, 0);
     qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
         tb, QEMU_PLUGIN_INLINE_ADD_U64, count_tb_inline, 1);
+    qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
+        tb, QEMU_PLUGIN_INLINE_ADD_U64, tb_cond_track, 1);
+    qemu_plugin_register_vcpu_tb_exec_cond_cb(
+        tb, vcpu_tb_cond_exec, QEMU_PLUGIN_CB_NO_REGS,
+        QEMU_PLUGIN_COND_EQ, tb_cond_track, COND_THRESHOLD, 0);
 
     for (int idx = 0; idx < qemu_plugin_tb_n_insns(tb); ++idx) {
         struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, idx);
@@ -152,6 +207,13 @@ static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
             insn, vcpu_insn_exec, QEMU_PLUGIN_CB_NO_REGS, 0);
         qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
             insn, QEMU_PLUGIN_INLINE_ADD_U64, count_insn_inline, 1);
+        qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+            insn, QEMU_PLUGIN_INLINE_STORE_U64, insn_store, 1);
+        qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+            insn, QEMU_PLUGIN_INLINE_ADD_U64, insn_cond_track, 1);
+        qemu_plugin_register_vcpu_insn_exec_cond_cb(
+            insn, vcpu_insn_cond_exec, QEMU_PLUGIN_CB_NO_REGS,
+            QEMU_PLUGIN_COND_GE, insn_cond_track, COND_THRESHOLD, 0);
         qemu_plugin_register_vcpu_mem_cb(insn, &vcpu_mem_access,
                                          QEMU_PLUGIN_CB_NO_REGS,
                                          QEMU_PLUGIN_MEM_RW, 0);
@@ -159,6 +221,9 @@ static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
             insn, QEMU_PLUGIN_MEM_RW,
             QEMU_PLUGIN_INLINE_ADD_U64,
             count_mem_inline, 1);
+        qemu_plugin_register_vcpu_mem_record_per_vcpu(
+            insn, QEMU_PLUGIN_MEM_RW, mem_record_count, RECORD_SIZE,
+            vcpu_mem_record_flush, 0);
     }
 }
 
@@ -179,6 +244,20 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
         counts, CPUCount, count_insn_inline);
     count_mem_inline = qemu_plugin_scoreboard_u64_in_struct(
         counts, CPUCount, count_mem_inline);
+    tb_cond_track = qemu_plugin_scoreboard_u64_in_struct(
+        counts, CPUCount, tb_cond_track);
+    tb_cond_sum = qemu_plugin_scoreboard_u64_in_struct(
+        counts, CPUCount, tb_cond_sum);
+    insn_cond_track = qemu_plugin_scoreboard_u64_in_struct(
+        counts, CPUCount, insn_cond_track);
+    insn_cond_sum = qemu_plugin_scoreboard_u64_in_struct(
+        counts, CPUCount, insn_cond_sum);
+    insn_store = qemu_plugin_scoreboard_u64_in_struct(
+        counts, CPUCount, insn_store);
+    mem_record_sum = qemu_plugin_scoreboard_u64_in_struct(
+        counts, CPUCount, mem_record_sum);
+    mem_record_count = qemu_plugin_scoreboard_u64_in_struct(
+        counts, CPUCount, mem_record_count);
     qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
     qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
 
@@ -85,6 +85,47 @@ static void test_pci_unplug_request(void)
     qtest_quit(qtest);
 }
 
+static void test_pci_batch_add(void)
+{
+    QTestState *qtest;
+    const char *arch = qtest_get_arch();
+    const char *machine_addition = "";
+    QDict *resp;
+
+    if (!qtest_has_device("virtio-mouse-pci")) {
+        g_test_skip("Device virtio-mouse-pci not available");
+        return;
+    }
+
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        machine_addition = "-machine pc";
+    }
+
+    qtest = qtest_initf("%s", machine_addition);
+
+    resp = qtest_qmp(qtest, "{'execute': 'device-add-batch', 'arguments': {"
+                     " 'devices': ["
+                     "  {'driver': 'virtio-mouse-pci', 'id': 'dev0'},"
+                     "  {'driver': 'virtio-mouse-pci', 'id': 'dev1'} ] } }");
+    g_assert(qdict_haskey(resp, "return"));
+    qobject_unref(resp);
+
+    /* The devices before the failing one are kept */
+    resp = qtest_qmp(qtest, "{'execute': 'device-add-batch', 'arguments': {"
+                     " 'devices': ["
+                     "  {'driver': 'virtio-mouse-pci', 'id': 'dev2'},"
+                     "  {'driver': 'virtio-mouse-pci', 'id': 'dev0'},"
+                     "  {'driver': 'virtio-mouse-pci', 'id': 'dev3'} ] } }");
+    g_assert(qdict_haskey(resp, "error"));
+    qobject_unref(resp);
+
+    process_device_remove(qtest, "dev0");
+    process_device_remove(qtest, "dev1");
+    process_device_remove(qtest, "dev2");
+
+    qtest_quit(qtest);
+}
+
 static void test_q35_pci_unplug_request(void)
 {
     QTestState *qtest;
@@ -225,6 +266,8 @@ int main(int argc, char **argv)
                    test_pci_unplug_request);
     qtest_add_func("/device-plug/pci-unplug-json-request",
                    test_pci_unplug_json_request);
+    qtest_add_func("/device-plug/pci-batch-add",
+                   test_pci_batch_add);
 
     if (!strcmp(arch, "s390x")) {
         qtest_add_func("/device-plug/ccw-unplug",
@@ -405,6 +405,29 @@ void qvirtqueue_kick(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
     }
 }
 
+/*
+ * qvirtqueue_make_avail:
+ * Publish @n descriptor chains in the available ring without notifying the
+ * device, so that the caller can hand over a full ring with a single kick.
+ */
+void qvirtqueue_make_avail(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
+                           const uint32_t *free_heads, unsigned n)
+{
+    /* vq->avail->idx */
+    uint16_t idx = qvirtio_readw(d, qts, vq->avail + 2);
+    unsigned i;
+
+    g_assert_cmpint(n, <=, vq->size);
+
+    for (i = 0; i < n; i++) {
+        /* vq->avail->ring[(idx + i) % vq->size] */
+        qvirtio_writew(d, qts, vq->avail + 4 + (2 * ((idx + i) % vq->size)),
+                       free_heads[i]);
+    }
+    /* vq->avail->idx */
+    qvirtio_writew(d, qts, vq->avail + 2, idx + n);
+}
+
 /*
  * qvirtqueue_get_buf:
  * @desc_idx: A pointer that is filled with the vq->desc[] index, may be NULL
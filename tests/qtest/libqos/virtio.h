@@ -145,6 +145,8 @@ uint32_t qvirtqueue_add_indirect(QTestState *qts, QVirtQueue *vq,
                                  QVRingIndirectDesc *indirect);
 void qvirtqueue_kick(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
                      uint32_t free_head);
+void qvirtqueue_make_avail(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
+                           const uint32_t *free_heads, unsigned n);
 bool qvirtqueue_get_buf(QTestState *qts, QVirtQueue *vq, uint32_t *desc_idx,
                         uint32_t *len);
 
@@ -654,6 +654,8 @@ typedef struct {
      */
     bool hide_stderr;
     bool use_shmem;
+    /* the target maps the shmem file privately, like a template clone */
+    bool use_shmem_clone;
     /* only launch the target process */
     bool only_target;
     /* Use dirty ring if true; dirty logging otherwise */
@@ -767,6 +769,7 @@ static int test_migrate_start(QTestState **from, QTestState **to,
     g_autofree gchar *cmd_target = NULL;
     const gchar *ignore_stderr;
     g_autofree char *shmem_opts = NULL;
+    g_autofree char *shmem_opts_target = NULL;
     g_autofree char *shmem_path = NULL;
     const char *kvm_opts = NULL;
     const char *arch = qtest_get_arch();
@@ -848,6 +851,13 @@ static int test_migrate_start(QTestState **from, QTestState **to,
             "-object memory-backend-file,id=mem0,size=%s"
             ",mem-path=%s,share=on -numa node,memdev=mem0",
             memory_size, shmem_path);
+        if (args->use_shmem_clone) {
+            shmem_opts_target = g_strdup_printf(
+                "-object memory-backend-file,id=mem0,size=%s"
+                ",mem-path=%s,share=off,readonly=on,rom=off"
+                " -numa node,memdev=mem0",
+                memory_size, shmem_path);
+        }
     }
 
     if (args->use_dirty_ring) {
@@ -892,6 +902,7 @@ static int test_migrate_start(QTestState **from, QTestState **to,
                                  memory_size, tmpfs, uri,
                                  arch_opts ? arch_opts : "",
                                  arch_target ? arch_target : "",
+                                 shmem_opts_target ? shmem_opts_target :
                                  shmem_opts ? shmem_opts : "",
                                  args->opts_target ? args->opts_target : "",
                                  ignore_stderr);
@@ -1430,6 +1441,37 @@ static void test_postcopy_preempt(void)
     test_postcopy_common(&args);
 }
 
+static void *
+test_migrate_postcopy_multifd_start(QTestState *from, QTestState *to)
+{
+    migrate_set_parameter_int(from, "multifd-channels", 4);
+    migrate_set_parameter_int(to, "multifd-channels", 4);
+
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+
+    return NULL;
+}
+
+static void test_postcopy_multifd(void)
+{
+    MigrateCommon args = {
+        .start_hook = test_migrate_postcopy_multifd_start,
+    };
+
+    test_postcopy_common(&args);
+}
+
+static void test_postcopy_preempt_multifd(void)
+{
+    MigrateCommon args = {
+        .postcopy_preempt = true,
+        .start_hook = test_migrate_postcopy_multifd_start,
+    };
+
+    test_postcopy_common(&args);
+}
+
 #ifdef CONFIG_GNUTLS
 static void test_postcopy_tls_psk(void)
 {
@@ -2200,6 +2242,30 @@ static void *test_mode_reboot_start(QTestState *from, QTestState *to)
     return NULL;
 }
 
+static void *test_clone_template_start(QTestState *from, QTestState *to)
+{
+    migrate_set_capability(from, "x-ignore-shared", true);
+    migrate_set_capability(to, "x-ignore-shared", true);
+    migrate_set_capability(to, "x-clone-template", true);
+
+    return NULL;
+}
+
+static void test_clone_template(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .start.use_shmem = true,
+        .start.use_shmem_clone = true,
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = test_clone_template_start,
+    };
+
+    test_file_common(&args, true);
+}
+
 static void *migrate_mapped_ram_start(QTestState *from, QTestState *to)
 {
     migrate_set_capability(from, "mapped-ram", true);
@@ -2778,6 +2844,15 @@ test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
 }
 #endif /* CONFIG_ZSTD */
 
+#ifdef CONFIG_QPL
+static void *
+test_migrate_precopy_tcp_multifd_qpl_start(QTestState *from,
+                                           QTestState *to)
+{
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "qpl");
+}
+#endif /* CONFIG_QPL */
+
 static void test_multifd_tcp_none(void)
 {
     MigrateCommon args = {
@@ -2793,6 +2868,40 @@ static void test_multifd_tcp_none(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_channel_scan(void)
+{
+    MigrateCommon args = {
+        .start = {
+            .opts_source = "-global migration.x-multifd-channel-scan=on",
+        },
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_start,
+        /* The channels look for the pages the guest keeps dirtying */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
+static void *
+test_migrate_precopy_tcp_multifd_xbzrle_start(QTestState *from,
+                                              QTestState *to)
+{
+    test_migrate_xbzrle_start(from, to);
+    return test_migrate_precopy_tcp_multifd_start(from, to);
+}
+
+static void test_multifd_tcp_xbzrle(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_xbzrle_start,
+        .iterations = 2,
+        /* The pages need to change after the first round to be encoded */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_zero_page_legacy(void)
 {
     MigrateCommon args = {
@@ -2843,6 +2952,17 @@ static void test_multifd_tcp_zstd(void)
 }
 #endif
 
+#ifdef CONFIG_QPL
+static void test_multifd_tcp_qpl(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_qpl_start,
+    };
+    test_precopy_common(&args);
+}
+#endif
+
 #ifdef CONFIG_GNUTLS
 static void *
 test_migrate_multifd_tcp_tls_psk_start_match(QTestState *from,
@@ -3589,6 +3709,10 @@ int main(int argc, char **argv)
                            test_postcopy_preempt);
         migration_test_add("/migration/postcopy/preempt/recovery/plain",
                            test_postcopy_preempt_recovery);
+        migration_test_add("/migration/postcopy/multifd/plain",
+                           test_postcopy_multifd);
+        migration_test_add("/migration/postcopy/preempt/multifd/plain",
+                           test_postcopy_preempt_multifd);
         if (getenv("QEMU_TEST_FLAKY_TESTS")) {
             migration_test_add("/migration/postcopy/compress/plain",
                                test_postcopy_compress);
@@ -3639,6 +3763,7 @@ int main(int argc, char **argv)
      */
     if (getenv("QEMU_TEST_FLAKY_TESTS")) {
         migration_test_add("/migration/mode/reboot", test_mode_reboot);
+        migration_test_add("/migration/clone-template", test_clone_template);
     }
 
     migration_test_add("/migration/precopy/file/mapped-ram",
@@ -3734,6 +3859,10 @@ int main(int argc, char **argv)
     }
     migration_test_add("/migration/multifd/tcp/plain/none",
                        test_multifd_tcp_none);
+    migration_test_add("/migration/multifd/tcp/plain/channel-scan",
+                       test_multifd_tcp_channel_scan);
+    migration_test_add("/migration/multifd/tcp/plain/xbzrle",
+                       test_multifd_tcp_xbzrle);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/legacy",
                        test_multifd_tcp_zero_page_legacy);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/none",
@@ -3746,6 +3875,10 @@ int main(int argc, char **argv)
     migration_test_add("/migration/multifd/tcp/plain/zstd",
                        test_multifd_tcp_zstd);
 #endif
+#ifdef CONFIG_QPL
+    migration_test_add("/migration/multifd/tcp/plain/qpl",
+                       test_multifd_tcp_qpl);
+#endif
 #ifdef CONFIG_GNUTLS
     migration_test_add("/migration/multifd/tcp/tls/psk/match",
                        test_multifd_tcp_tls_psk_match);
@@ -19,6 +19,7 @@
 
 #define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
 #define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
+#define QVIRTIO_BLK_BENCH_ROUNDS 2000
 #define PCI_SLOT_HP             0x06
 
 typedef struct QVirtioBlkReq {
@@ -345,6 +346,94 @@ static void basic(void *obj, void *data, QGuestAllocator *t_alloc)
 
 }
 
+/*
+ * Fill the whole split ring with 3-descriptor read chains, kick once and
+ * time how long the device takes to pop, map and push all of them.  The
+ * descriptor table is written only once; each round only republishes the
+ * chains in the available ring, so the timed part only covers the kick
+ * and draining the used ring.
+ */
+static void bench(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QTestState *qts = global_qtest;
+    QVirtioBlkReq req;
+    QVirtQueue *vq;
+    uint64_t features;
+    uint64_t *req_addr;
+    uint32_t *free_head;
+    gint64 start, elapsed = 0;
+    unsigned i, n, done, round;
+
+    if (!g_test_perf()) {
+        g_test_skip("benchmark, run with -m perf");
+        return;
+    }
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+
+    qvirtio_set_driver_ok(dev);
+
+    n = vq->size / 3;
+    req_addr = g_new(uint64_t, n);
+    free_head = g_new(uint32_t, n);
+
+    for (i = 0; i < n; i++) {
+        req.type = VIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+
+        req_addr[i] = virtio_blk_request(t_alloc, dev, &req, 512);
+
+        g_free(req.data);
+
+        free_head[i] = qvirtqueue_add(qts, vq, req_addr[i], 16, false, true);
+        qvirtqueue_add(qts, vq, req_addr[i] + 16, 512, true, true);
+        qvirtqueue_add(qts, vq, req_addr[i] + 528, 1, true, false);
+    }
+
+    for (round = 0; round < QVIRTIO_BLK_BENCH_ROUNDS; round++) {
+        qvirtqueue_make_avail(qts, dev, vq, free_head, n);
+
+        start = g_get_monotonic_time();
+        dev->bus->virtqueue_kick(dev, vq);
+        for (done = 0; done < n;) {
+            if (qvirtqueue_get_buf(qts, vq, NULL, NULL)) {
+                done++;
+            } else {
+                g_assert_cmpint(g_get_monotonic_time() - start, <,
+                                QVIRTIO_BLK_TIMEOUT_US);
+            }
+        }
+        elapsed += g_get_monotonic_time() - start;
+    }
+
+    for (i = 0; i < n; i++) {
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+        guest_free(t_alloc, req_addr[i]);
+    }
+
+    g_test_message("virtio-blk: %u chains/kick, %u rounds: %.0f requests/sec, "
+                   "%.2f us/kick",
+                   n, QVIRTIO_BLK_BENCH_ROUNDS,
+                   (double)n * QVIRTIO_BLK_BENCH_ROUNDS * G_USEC_PER_SEC /
+                   elapsed,
+                   (double)elapsed / QVIRTIO_BLK_BENCH_ROUNDS);
+
+    g_free(free_head);
+    g_free(req_addr);
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
 static void indirect(void *obj, void *u_data, QGuestAllocator *t_alloc)
 {
     QVirtQueue *vq;
@@ -795,6 +884,7 @@ static void register_virtio_blk_test(void)
     qos_add_test("config", "virtio-blk", config, &opts);
     qos_add_test("basic", "virtio-blk", basic, &opts);
     qos_add_test("resize", "virtio-blk", resize, &opts);
+    qos_add_test("bench", "virtio-blk", bench, &opts);
 
     /* tests just for virtio-blk-pci */
     qos_add_test("msix", "virtio-blk-pci", msix, &opts);
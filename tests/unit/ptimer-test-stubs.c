@@ -50,37 +50,26 @@ void timer_init_full(QEMUTimer *ts,
     ts->expire_time = -1;
 }
 
-void timer_mod(QEMUTimer *ts, int64_t expire_time)
+void timer_del(QEMUTimer *ts)
 {
     QEMUTimerList *timer_list = ts->timer_list;
-    QEMUTimer *t = &timer_list->active_timers;
+    QEMUTimer *t;
 
-    while (t->next != NULL) {
-        if (t->next == ts) {
-            break;
+    QTAILQ_FOREACH(t, &timer_list->active_timers, node) {
+        if (t == ts) {
+            QTAILQ_REMOVE(&timer_list->active_timers, ts, node);
+            return;
         }
-
-        t = t->next;
     }
-
-    ts->expire_time = MAX(expire_time * ts->scale, 0);
-    ts->next = NULL;
-    t->next = ts;
 }
 
-void timer_del(QEMUTimer *ts)
+void timer_mod(QEMUTimer *ts, int64_t expire_time)
 {
     QEMUTimerList *timer_list = ts->timer_list;
-    QEMUTimer *t = &timer_list->active_timers;
-
-    while (t->next != NULL) {
-        if (t->next == ts) {
-            t->next = ts->next;
-            return;
-        }
 
-        t = t->next;
-    }
+    timer_del(ts);
+    ts->expire_time = MAX(expire_time * ts->scale, 0);
+    QTAILQ_INSERT_TAIL(&timer_list->active_timers, ts, node);
 }
 
 int64_t qemu_clock_get_ns(QEMUClockType type)
@@ -91,17 +80,15 @@ int64_t qemu_clock_get_ns(QEMUClockType type)
 int64_t qemu_clock_deadline_ns_all(QEMUClockType type, int attr_mask)
 {
     QEMUTimerList *timer_list = main_loop_tlg.tl[QEMU_CLOCK_VIRTUAL];
-    QEMUTimer *t = timer_list->active_timers.next;
+    QEMUTimer *t;
     int64_t deadline = -1;
 
-    while (t != NULL) {
+    QTAILQ_FOREACH(t, &timer_list->active_timers, node) {
         if (deadline == -1) {
             deadline = t->expire_time;
         } else {
             deadline = MIN(deadline, t->expire_time);
         }
-
-        t = t->next;
     }
 
     return deadline;
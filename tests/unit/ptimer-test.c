@@ -27,9 +27,9 @@ static void ptimer_test_expire_qemu_timers(int64_t expire_time,
                                            QEMUClockType type)
 {
     QEMUTimerList *timer_list = main_loop_tlg.tl[type];
-    QEMUTimer *t = timer_list->active_timers.next;
+    QEMUTimer *t, *next;
 
-    while (t != NULL) {
+    QTAILQ_FOREACH_SAFE(t, &timer_list->active_timers, node, next) {
         if (t->expire_time == expire_time) {
             timer_del(t);
 
@@ -37,8 +37,6 @@ static void ptimer_test_expire_qemu_timers(int64_t expire_time,
                 t->cb(t->opaque);
             }
         }
-
-        t = t->next;
     }
 }
 
@@ -882,6 +880,7 @@ int main(int argc, char **argv)
 
     for (i = 0; i < QEMU_CLOCK_MAX; i++) {
         main_loop_tlg.tl[i] = g_new0(QEMUTimerList, 1);
+        QTAILQ_INIT(&main_loop_tlg.tl[i]->active_timers);
     }
 
     add_all_ptimer_policies_comb_tests();
@@ -16,7 +16,7 @@ extern bool qtest_allowed;
 extern int64_t ptimer_test_time_ns;
 
 struct QEMUTimerList {
-    QEMUTimer active_timers;
+    QTAILQ_HEAD(, QEMUTimer) active_timers;
 };
 
 #endif
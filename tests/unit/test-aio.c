@@ -255,6 +255,41 @@ static void test_bh_flush(void)
     qemu_bh_delete(data.bh);
 }
 
+typedef struct {
+    AioCompletion completion;
+    int *order;
+    int index;
+} CompletionTestData;
+
+static void completion_test_cb(void *opaque)
+{
+    CompletionTestData *data = opaque;
+
+    g_assert_cmpint(*data->order, ==, data->index);
+    (*data->order)++;
+}
+
+static void test_complete_in(void)
+{
+    CompletionTestData data[3];
+    int order = 0;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        data[i].order = &order;
+        data[i].index = i;
+        aio_complete_in(ctx, &data[i].completion, completion_test_cb,
+                        &data[i]);
+    }
+    g_assert_cmpint(order, ==, 0);
+
+    /* One wakeup runs the whole batch, in order */
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(order, ==, 3);
+
+    g_assert(!aio_poll(ctx, false));
+}
+
 static void test_set_event_notifier(void)
 {
     EventNotifierTestData data = { .n = 0, .active = 0 };
@@ -424,6 +459,89 @@ static void test_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+#define ORDER_TIMERS 200
+
+static int order_n;
+static int order_seen[ORDER_TIMERS];
+
+static void order_timer_cb(void *opaque)
+{
+    order_seen[order_n++] = GPOINTER_TO_INT(opaque);
+}
+
+static void order_notify_cb(void *opaque, QEMUClockType type)
+{
+}
+
+/* Offsets that reach every level of the timer wheel, with some repeats */
+static int64_t order_offset(int i)
+{
+    return (int64_t)((i * 7919) % 50) << ((i % 6) * 6);
+}
+
+static void test_timer_order(void)
+{
+    QEMUTimerListGroup tlg;
+    QEMUTimerList *tl;
+    QEMUTimer timers[ORDER_TIMERS];
+    int64_t expire[ORDER_TIMERS];
+    int64_t now, before, after, deadline, first;
+    int i, j;
+
+    timerlistgroup_init(&tlg, order_notify_cb, NULL);
+    tl = tlg.tl[QEMU_CLOCK_REALTIME];
+    for (i = 0; i < ORDER_TIMERS; i++) {
+        timer_init_full(&timers[i], &tlg, QEMU_CLOCK_REALTIME, SCALE_NS, 0,
+                        order_timer_cb, GINT_TO_POINTER(i));
+    }
+
+    /* Expired timers run by expiry time, then in the order they were set */
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    for (i = 0; i < ORDER_TIMERS; i++) {
+        expire[i] = MAX(now - order_offset(i), 0);
+        timer_mod_ns(&timers[i], expire[i]);
+    }
+    order_n = 0;
+    g_assert(timerlist_run_timers(tl));
+    g_assert_cmpint(order_n, ==, ORDER_TIMERS);
+    g_assert(!timerlist_has_timers(tl));
+    for (i = 1; i < ORDER_TIMERS; i++) {
+        int a = order_seen[i - 1], b = order_seen[i];
+
+        g_assert_cmpint(expire[a], <=, expire[b]);
+        if (expire[a] == expire[b]) {
+            g_assert_cmpint(a, <, b);
+        }
+    }
+
+    /* The deadline follows the first timer as timers are removed */
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    for (i = 0; i < ORDER_TIMERS; i++) {
+        expire[i] = now + 100 * SCALE_S + order_offset(i);
+        timer_mod_ns(&timers[i], expire[i]);
+    }
+    for (i = 0; i < ORDER_TIMERS; i++) {
+        first = -1;
+        for (j = 0; j < ORDER_TIMERS; j++) {
+            if (timer_pending(&timers[j]) &&
+                (first == -1 || expire[j] < expire[first])) {
+                first = j;
+            }
+        }
+
+        before = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        deadline = timerlist_deadline_ns(tl);
+        after = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        g_assert_cmpint(deadline, >=, expire[first] - after);
+        g_assert_cmpint(deadline, <=, expire[first] - before);
+        timer_del(&timers[first]);
+    }
+    g_assert(!timerlist_has_timers(tl));
+    g_assert_cmpint(timerlist_deadline_ns(tl), ==, -1);
+
+    timerlistgroup_deinit(&tlg);
+}
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -842,11 +960,13 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/bh/callback-delete/one",  test_bh_delete_from_cb);
     g_test_add_func("/aio/bh/callback-delete/many", test_bh_delete_from_cb_many);
     g_test_add_func("/aio/bh/flush",                test_bh_flush);
+    g_test_add_func("/aio/complete-in",             test_complete_in);
     g_test_add_func("/aio/event/add-remove",        test_set_event_notifier);
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/timer/order",             test_timer_order);
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
     g_test_add_func("/aio/coroutine/worker-thread-co-enter", test_worker_thread_co_enter);
@@ -123,6 +123,41 @@ static void check_bitmap_set(void)
     bitmap_set_case(bitmap_set_atomic);
 }
 
+static void check_bitmap_or_and_clear_atomic(void)
+{
+    /* Large enough for clear words to be skipped in chunks */
+    const long nbits = 300 * BITS_PER_LONG;
+    unsigned long *src = bitmap_new(nbits);
+    unsigned long *dst = bitmap_new(nbits);
+    unsigned long *copy = bitmap_new(nbits);
+
+    set_bit(3, src);
+    set_bit(70 * BITS_PER_LONG + 1, src);
+    bitmap_set(src, 200 * BITS_PER_LONG, 3 * BITS_PER_LONG);
+    set_bit(nbits - 1, src);
+    g_assert_cmpint(bitmap_count_one(src, nbits), ==,
+                    3 + 3 * BITS_PER_LONG);
+    g_assert_cmpint(bitmap_find_next_nonzero_word(src, 1, 300), ==, 70);
+    g_assert_cmpint(bitmap_find_next_nonzero_word(src, 71, 300), ==, 200);
+    g_assert_cmpint(bitmap_find_next_nonzero_word(src, 203, 299), ==, 299);
+
+    bitmap_copy(copy, src, nbits);
+    set_bit(3, dst);
+    set_bit(200 * BITS_PER_LONG, dst);
+    g_assert_cmpint(bitmap_or_and_clear_atomic(dst, src, nbits), ==,
+                    1 + 3 * BITS_PER_LONG);
+    g_assert_true(bitmap_empty(src, nbits));
+    g_assert_true(bitmap_equal(dst, copy, nbits));
+
+    bitmap_copy_and_clear_atomic(src, dst, nbits);
+    g_assert_true(bitmap_empty(dst, nbits));
+    g_assert_true(bitmap_equal(src, copy, nbits));
+
+    g_free(src);
+    g_free(dst);
+    g_free(copy);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -131,6 +166,8 @@ int main(int argc, char **argv)
                     check_bitmap_copy_with_offset);
     g_test_add_func("/bitmap/bitmap_set",
                     check_bitmap_set);
+    g_test_add_func("/bitmap/bitmap_or_and_clear_atomic",
+                    check_bitmap_or_and_clear_atomic);
 
     g_test_run();
 
@@ -20,6 +20,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/bitmap.h"
 
 static char buffer[8 * 1024 * 1024];
 
@@ -58,13 +59,45 @@ static void test_1(void)
     }
 }
 
+static void test_batch(void)
+{
+    enum { N = 67, PAGE = 4096 };
+    const void *bufs[N];
+    DECLARE_BITMAP(zero, N);
+    size_t i;
+
+    for (i = 0; i < N; i++) {
+        bufs[i] = buffer + (N - 1 - i) * PAGE;
+    }
+
+    /* All zero, on top of a bitmap with stale bits set and cleared.  */
+    bitmap_zero(zero, N);
+    g_assert_cmpint(buffer_is_zero_batch(bufs, N, PAGE, zero), ==, N);
+    g_assert(find_first_zero_bit(zero, N) == N);
+
+    /* Every third buffer has a marker, at a varying offset.  */
+    for (i = 0; i < N; i += 3) {
+        buffer[(N - 1 - i) * PAGE + (i * 61) % PAGE] = 1;
+    }
+    g_assert_cmpint(buffer_is_zero_batch(bufs, N, PAGE, zero), ==,
+                    N - DIV_ROUND_UP(N, 3));
+    for (i = 0; i < N; i++) {
+        g_assert(test_bit(i, zero) == !!(i % 3));
+        buffer[(N - 1 - i) * PAGE + (i * 61) % PAGE] = 0;
+    }
+
+    g_assert_cmpint(buffer_is_zero_batch(bufs, 0, PAGE, zero), ==, 0);
+}
+
 static void test_2(void)
 {
     if (g_test_perf()) {
         test_1();
+        test_batch();
     } else {
         do {
             test_1();
+            test_batch();
         } while (test_buffer_is_zero_next_accel());
     }
 }
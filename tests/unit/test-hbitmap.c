@@ -378,6 +378,39 @@ static void test_hbitmap_reset(TestHBitmapData *data,
     hbitmap_test_set(data, L3 / 2, L3);
 }
 
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    static const struct {
+        uint64_t first, count;
+    } ranges[] = {
+        { 0, 1 }, { L2 - 1, 2 }, { L3 - L1, L2 }, { L3 * 3 / 2, 1 },
+    };
+    HBitmap *hb;
+    int i;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    hb = hbitmap_alloc(L3 * 2, 0);
+
+    hbitmap_test_set(data, L2, L3);
+    for (i = 0; i < ARRAY_SIZE(ranges); i++) {
+        hbitmap_set(hb, ranges[i].first, ranges[i].count);
+        bitmap_set(data->bits, ranges[i].first, ranges[i].count);
+    }
+    hbitmap_merge(data->hb, hb, data->hb);
+    hbitmap_test_check(data, 0);
+
+    /* Clear whole chunks and make sure they can be written again */
+    hbitmap_test_reset(data, 0, L3 * 2);
+    hbitmap_test_set(data, L3, 1);
+    hbitmap_merge(hb, data->hb, data->hb);
+    hbitmap_free(hb);
+    for (i = 0; i < ARRAY_SIZE(ranges); i++) {
+        bitmap_set(data->bits, ranges[i].first, ranges[i].count);
+    }
+    hbitmap_test_check(data, 0);
+}
+
 static void test_hbitmap_reset_all(TestHBitmapData *data,
                                    const void *unused)
 {
@@ -1062,6 +1095,7 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
     hbitmap_test_add("/hbitmap/truncate/grow/negligible",
@@ -0,0 +1,266 @@
+/*
+ * JSON Input Visitor unit-tests.
+ *
+ * The JSON input visitor must behave exactly like the QObject input
+ * visitor on the result of qobject_from_json(), so most tests visit the
+ * same text with both and compare.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qapi/json-input-visitor.h"
+#include "qapi/qobject-input-visitor.h"
+#include "qapi/qobject-output-visitor.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qnum.h"
+#include "test-qapi-visit.h"
+
+/*
+ * Visit @json as @type with both input visitors, and check that they
+ * build the same object or fail with the same error.
+ */
+#define check_same(type, json) do {                                     \
+        type *a = NULL, *b = NULL;                                      \
+        Error *err_a = NULL, *err_b = NULL;                             \
+        QObject *obj, *qa = NULL, *qb = NULL;                           \
+        Visitor *v;                                                     \
+                                                                        \
+        v = json_input_visitor_new(json, &error_abort);                 \
+        visit_type_##type(v, NULL, &a, &err_a);                         \
+        visit_free(v);                                                  \
+                                                                        \
+        obj = qobject_from_json(json, &error_abort);                    \
+        v = qobject_input_visitor_new(obj);                             \
+        visit_type_##type(v, NULL, &b, &err_b);                         \
+        visit_free(v);                                                  \
+        qobject_unref(obj);                                             \
+                                                                        \
+        if (err_b) {                                                    \
+            g_assert(err_a);                                            \
+            g_assert_cmpstr(error_get_pretty(err_a), ==,                \
+                            error_get_pretty(err_b));                   \
+            g_assert(!a && !b);                                         \
+            error_free(err_a);                                          \
+            error_free(err_b);                                          \
+        } else {                                                        \
+            g_assert(!err_a);                                           \
+            v = qobject_output_visitor_new(&qa);                        \
+            visit_type_##type(v, NULL, &a, &error_abort);               \
+            visit_complete(v, &qa);                                     \
+            visit_free(v);                                              \
+            v = qobject_output_visitor_new(&qb);                        \
+            visit_type_##type(v, NULL, &b, &error_abort);               \
+            visit_complete(v, &qb);                                     \
+            visit_free(v);                                              \
+            g_assert(qobject_is_equal(qa, qb));                         \
+            qobject_unref(qa);                                          \
+            qobject_unref(qb);                                          \
+            qapi_free_##type(a);                                        \
+            qapi_free_##type(b);                                        \
+        }                                                               \
+    } while (0)
+
+static void test_visitor_in_struct(void)
+{
+    check_same(TestStruct,
+               "{ 'integer': -42, 'boolean': true, 'string': 'foo' }");
+    check_same(TestStruct,
+               "{\"string\":\"foo\",\"boolean\":false,\"integer\":0}");
+    check_same(UserDefTwo,
+               "{ 'string0': 'string0', "
+               "'dict1': { 'string1': 'string1', "
+               "'dict2': { 'userdef': { 'integer': 42, "
+               "'string': 'string' }, 'string': 'string2'}}}");
+}
+
+static void test_visitor_in_numbers(void)
+{
+    check_same(AltEnumNum, "-42");
+    check_same(AltEnumNum, "42.5e-1");
+    check_same(uint64List, "[ 0, 18446744073709551615, -1 ]");
+    check_same(intList, "[ -9223372036854775808, 9223372036854775807 ]");
+    check_same(intList, "[ 9223372036854775808 ]");
+    check_same(numberList, "[ 1, 1.5, -2E3, 18446744073709551616 ]");
+}
+
+static void test_visitor_in_strings(void)
+{
+    check_same(strList, "[ 'single', \"double\", '\"', \"'\" ]");
+    check_same(strList, "[ 'a\\\\b\\/c\\n\\t\\'\\\"', '\\u00e9\\u20ac' ]");
+    check_same(strList, "[ '\\ud83d\\ude00', '\xc3\xa9', '' ]");
+    check_same(strList, "[ '\\u0000' ]");
+}
+
+static void test_visitor_in_list(void)
+{
+    check_same(UserDefOneList,
+               "[ { 'string': 'string0', 'integer': 42 }, "
+               "{ 'string': 'string1', 'integer': 43 } ]");
+    check_same(UserDefOneList, "[ ]");
+    check_same(intList, "[ 1, [ 2 ] ]");
+}
+
+static void test_visitor_in_any(void)
+{
+    QObject *res = NULL, *expected;
+    QDict *qdict;
+    Visitor *v;
+    int64_t val;
+
+    v = json_input_visitor_new("{ 'integer': -42, 'boolean': true, "
+                               "'list': [ 'foo', null, 1.5 ], "
+                               "'dict': { 'u': 18446744073709551615 } }",
+                               &error_abort);
+    visit_type_any(v, NULL, &res, &error_abort);
+    visit_free(v);
+
+    expected = qobject_from_json("{ 'integer': -42, 'boolean': true, "
+                                 "'list': [ 'foo', null, 1.5 ], "
+                                 "'dict': { 'u': 18446744073709551615 } }",
+                                 &error_abort);
+    g_assert(qobject_is_equal(res, expected));
+    qobject_unref(expected);
+    qdict = qobject_to(QDict, res);
+    g_assert(qnum_get_try_int(qobject_to(QNum, qdict_get(qdict, "integer")),
+                              &val));
+    g_assert_cmpint(val, ==, -42);
+    qobject_unref(res);
+}
+
+static void test_visitor_in_union_alternate(void)
+{
+    check_same(UserDefFlatUnion,
+               "{ 'enum1': 'value1', 'integer': 41, 'string': 'str', "
+               "'boolean': true }");
+    check_same(UserDefAlternate, "42");
+    check_same(UserDefAlternate, "'value1'");
+    check_same(UserDefAlternate, "null");
+    check_same(UserDefAlternate,
+               "{'integer':1, 'string':'str', 'enum1':'value1', "
+               "'boolean':true}");
+    check_same(WrapAlternate, "{ 'alt': 'value1' }");
+}
+
+static void test_visitor_in_fail(void)
+{
+    /* wrong types */
+    check_same(TestStruct, "{ 'integer': false, 'boolean': 'foo', "
+               "'string': -42 }");
+    check_same(TestStruct, "{ 'integer': 1.5, 'boolean': true, "
+               "'string': 'foo' }");
+    check_same(TestStruct, "[ 1 ]");
+    check_same(strList, "[ '1', '2', false, '3' ]");
+    check_same(UserDefOneList, "{ }");
+    check_same(uint64List, "[ 1.5 ]");
+
+    /* missing and unexpected members */
+    check_same(TestStruct, "{ 'integer': -42, 'string': 'foo' }");
+    check_same(TestStruct, "{ 'integer': -42, 'boolean': true, "
+               "'string': 'foo', 'extra': 42 }");
+    check_same(UserDefTwo, "{ 'string0': 'string0', "
+               "'dict1': { 'string1': 'string1', "
+               "'dict2': { 'userdef': { 'integer': 42, 'string': 'string', "
+               "'extra': [ 42, 23, { 'foo': 'bar' } ] }, "
+               "'string': 'string2' } } }");
+    check_same(UserDefOneList,
+               "[ { 'string': 'string0', 'integer': 42 }, "
+               "{ 'string': 'string2', 'integer': 44, 'extra': 'ggg' } ]");
+    check_same(UserDefFlatUnion, "{ 'enum1': 'value2', 'string': 'c', "
+               "'integer': 41, 'boolean': true }");
+    check_same(UserDefFlatUnion, "{ 'integer': 42 }");
+    check_same(WrapAlternate, "{ 'alt': [ 1 ] }");
+    check_same(WrapAlternate, "{ }");
+}
+
+static void test_visitor_in_parse_errors(void)
+{
+    static const char *const bad[] = {
+        "",
+        "{",
+        "{ 'a' }",
+        "{ 'a': 1, }",
+        "{ 1: 1 }",
+        "{ 'a': 1 'b': 2 }",
+        "[ 1, ]",
+        "[ 1 2 ]",
+        "{ 'a': 01 }",
+        "{ 'a': - }",
+        "{ 'a': 1. }",
+        "{ 'a': 1e }",
+        "{ 'a': tru }",
+        "{ 'a': 'b }",
+        "{ 'a': '\\x' }",
+        "{ 'a': '\\u12' }",
+        "{ 'a': '\\ud800' }",
+        "{ 'a': '\xff' }",
+        "{ 'a': '\x01' }",
+        "{ 'a': %d }",
+    };
+    Error *err = NULL;
+    char *deep;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(bad); i++) {
+        g_assert(!json_input_visitor_new(bad[i], &err));
+        error_free_or_abort(&err);
+    }
+
+    g_assert(!json_input_visitor_new("{ 'a': 1, 'a': 2 }", &err));
+    g_assert_cmpstr(error_get_pretty(err), ==,
+                    "JSON parse error, duplicate key");
+    error_free_or_abort(&err);
+
+    g_assert(!json_input_visitor_new("{ } { }", &err));
+    g_assert_cmpstr(error_get_pretty(err), ==,
+                    "Expecting at most one JSON value");
+    error_free_or_abort(&err);
+
+    deep = g_strnfill(2000, '[');
+    g_assert(!json_input_visitor_new(deep, &err));
+    g_assert_cmpstr(error_get_pretty(err), ==,
+                    "JSON nesting depth limit exceeded");
+    error_free_or_abort(&err);
+    g_free(deep);
+}
+
+static void test_visitor_in_new_str(void)
+{
+    TestStruct *p = NULL;
+    Visitor *v;
+
+    /* qobject_input_visitor_new_str() uses the JSON input visitor */
+    v = qobject_input_visitor_new_str("{ 'integer': -42, 'boolean': true, "
+                                      "'string': 'foo' }", NULL,
+                                      &error_abort);
+    visit_type_TestStruct(v, NULL, &p, &error_abort);
+    visit_free(v);
+    g_assert_cmpint(p->integer, ==, -42);
+    g_assert(p->boolean == true);
+    g_assert_cmpstr(p->string, ==, "foo");
+    qapi_free_TestStruct(p);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/visitor/json-input/struct", test_visitor_in_struct);
+    g_test_add_func("/visitor/json-input/numbers", test_visitor_in_numbers);
+    g_test_add_func("/visitor/json-input/strings", test_visitor_in_strings);
+    g_test_add_func("/visitor/json-input/list", test_visitor_in_list);
+    g_test_add_func("/visitor/json-input/any", test_visitor_in_any);
+    g_test_add_func("/visitor/json-input/union-alternate",
+                    test_visitor_in_union_alternate);
+    g_test_add_func("/visitor/json-input/fail", test_visitor_in_fail);
+    g_test_add_func("/visitor/json-input/parse-errors",
+                    test_visitor_in_parse_errors);
+    g_test_add_func("/visitor/json-input/new-str", test_visitor_in_new_str);
+
+    g_test_run();
+
+    return 0;
+}
@@ -251,10 +251,42 @@ static void test_resize(void)
     qht_test(QHT_MODE_AUTO_RESIZE);
 }
 
+static void test_incremental_resize(void)
+{
+    qht_init(&ht, is_equal, 0, 0);
+    insert(0, N);
+    g_assert_true(qht_resize_start(&ht, N * 4));
+    g_assert_false(qht_resize_start(&ht, N * 8));
+
+    /* updates while some of the buckets have moved */
+    check(0, N, true);
+    check_n(N);
+    rm(0, N / 2);
+    insert(N, N + N / 2);
+    check(0, N / 2, false);
+    check(N / 2, N + N / 2, true);
+    check_n(N);
+
+    while (qht_resize_step(&ht)) {
+        check_n(N);
+    }
+    check(N / 2, N + N / 2, true);
+    iter_check(N);
+
+    /* iterators complete the resize */
+    g_assert_true(qht_resize_start(&ht, N));
+    iter_rm_mod(2);
+    g_assert_false(qht_resize_step(&ht));
+    check_n(N / 2);
+
+    qht_destroy(&ht);
+}
+
 int main(int argc, char *argv[])
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/qht/mode/default", test_default);
     g_test_add_func("/qht/mode/resize", test_resize);
+    g_test_add_func("/qht/resize/incremental", test_incremental_resize);
     return g_test_run();
 }
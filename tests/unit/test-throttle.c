@@ -734,6 +734,36 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_credit(void)
+{
+    uint64_t units, size;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1000 * 1000;
+    cfg.buckets[THROTTLE_BPS_READ].avg = 500 * 1000;
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = 2000;
+
+    throttle_init(&ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+
+    /* the smallest of the total and read limits applies, for 10 ms */
+    throttle_compute_credit(&ts, THROTTLE_READ, 10 * SCALE_MS, &units, &size);
+    g_assert_cmpuint(units, ==, UINT64_MAX);
+    g_assert_cmpuint(size, ==, 5000);
+
+    throttle_compute_credit(&ts, THROTTLE_WRITE, 10 * SCALE_MS, &units, &size);
+    g_assert_cmpuint(units, ==, 20);
+    g_assert_cmpuint(size, ==, 10000);
+
+    /* credit is accounted as is, without cfg.op_size */
+    ts.cfg.op_size = 512;
+    throttle_account_credit(&ts, THROTTLE_WRITE, 20, 10000);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_WRITE].level, 20));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 20));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 10000));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_READ].level, 0));
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -829,6 +859,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/credit",             test_credit);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
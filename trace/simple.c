@@ -12,6 +12,7 @@
 #ifndef _WIN32
 #include <pthread.h>
 #endif
+#include "qemu/queue.h"
 #include "qemu/timer.h"
 #include "trace/control.h"
 #include "trace/simple.h"
@@ -45,13 +46,33 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 16,
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
+/*
+ * Each thread that traces has its own ring buffer, so that threads do not
+ * contend on a shared write index.  The index is still updated atomically
+ * because signal handlers may trace in the middle of a record.  The writeout
+ * thread merges the records of all buffers in timestamp order.
+ */
+typedef struct TraceBuffer {
+    uint8_t data[TRACE_BUF_LEN];
+    volatile gint idx;
+    volatile gint writeout_idx;
+    /* Set when the thread exits, the writeout thread frees the buffer */
+    volatile gint exited;
+    QSLIST_ENTRY(TraceBuffer) next;
+} TraceBuffer;
+
+static void trace_buffer_exit(gpointer data);
+
+static GPrivate trace_buffer_key = G_PRIVATE_INIT(trace_buffer_exit);
+/* Buffers of new threads, taken over by the writeout thread */
+static QSLIST_HEAD(, TraceBuffer) new_trace_buffers;
+/* Only accessed by the writeout thread */
+static QSLIST_HEAD(, TraceBuffer) trace_buffers;
+
 static volatile gint dropped_events;
 static uint32_t trace_pid;
 static FILE *trace_fp;
@@ -76,53 +97,99 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void read_from_buffer(TraceBuffer *buf, unsigned int idx,
+                             void *dataptr, size_t size);
+static unsigned int write_to_buffer(TraceBuffer *buf, unsigned int idx,
+                                    void *dataptr, size_t size);
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+static void clear_buffer_range(TraceBuffer *buf, unsigned int idx, size_t len)
 {
     uint32_t num = 0;
     while (num < len) {
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        trace_buf[idx++] = 0;
+        buf->data[idx++] = 0;
         num++;
     }
 }
+
+static void trace_buffer_exit(gpointer data)
+{
+    TraceBuffer *buf = data;
+
+    g_atomic_int_set(&buf->exited, 1);
+}
+
+/**
+ * Return the trace buffer of the current thread, allocating it on first use
+ */
+static TraceBuffer *get_trace_buffer(void)
+{
+    TraceBuffer *buf = g_private_get(&trace_buffer_key);
+
+    if (!buf) {
+        /* don't use g_malloc, can deadlock when traced */
+        buf = calloc(1, sizeof(*buf));
+        if (!buf) {
+            return NULL;
+        }
+        g_private_set(&trace_buffer_key, buf);
+        QSLIST_INSERT_HEAD_ATOMIC(&new_trace_buffers, buf, next);
+    }
+    return buf;
+}
+
 /**
- * Read a trace record from the trace buffer
+ * Look at the next trace record of a buffer without consuming it
  *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * @buf         Trace buffer
+ * @timestamp   Filled with the timestamp of the record
  *
- * Returns false if the record is not valid.
+ * Returns false if there is no valid record.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static bool peek_trace_record(TraceBuffer *buf, uint64_t *timestamp)
 {
-    uint64_t event_flag = 0;
+    unsigned int idx = g_atomic_int_get(&buf->writeout_idx) % TRACE_BUF_LEN;
     TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
 
+    /* read the event flag to see if its a valid record */
+    read_from_buffer(buf, idx, &record, sizeof(record.event));
     if (!(record.event & TRACE_RECORD_VALID)) {
         return false;
     }
 
     smp_rmb(); /* read memory barrier before accessing record */
+    read_from_buffer(buf, idx, &record, sizeof(TraceRecord));
+    *timestamp = record.timestamp_ns;
+    return true;
+}
+
+/**
+ * Read a trace record from a trace buffer
+ *
+ * @buf         Trace buffer, positioned on a valid record
+ * @record      Trace record to fill
+ */
+static void get_trace_record(TraceBuffer *buf, TraceRecord **recordptr)
+{
+    unsigned int idx = g_atomic_int_get(&buf->writeout_idx) % TRACE_BUF_LEN;
+    TraceRecord record;
+
     /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
+    read_from_buffer(buf, idx, &record, sizeof(TraceRecord));
     *recordptr = malloc(record.length); /* don't use g_malloc, can deadlock when traced */
     /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
+    read_from_buffer(buf, idx, *recordptr, record.length);
     smp_rmb(); /* memory barrier before clearing valid flag */
     (*recordptr)->event &= ~TRACE_RECORD_VALID;
     /* clear the trace buffer range for consumed record otherwise any byte
      * with its MSB set may be considered as a valid event id when the writer
      * thread crosses this range of buffer again.
      */
-    clear_buffer_range(idx, record.length);
-    return true;
+    clear_buffer_range(buf, idx, record.length);
+    smp_wmb(); /* clear the range before the producer can reuse it */
+    g_atomic_int_add(&buf->writeout_idx, record.length);
 }
 
 /**
@@ -154,14 +221,63 @@ static void wait_for_trace_records_available(void)
     g_mutex_unlock(&trace_lock);
 }
 
-static gpointer writeout_thread(gpointer opaque)
+/**
+ * Write out the records of all trace buffers, oldest first
+ */
+static void write_trace_records(void)
 {
+    QSLIST_HEAD(, TraceBuffer) added = QSLIST_HEAD_INITIALIZER(added);
+    TraceBuffer *buf, *next_buf;
     TraceRecord *recordptr;
+    size_t unused __attribute__ ((unused));
+    uint64_t type = TRACE_RECORD_TYPE_EVENT;
+
+    QSLIST_MOVE_ATOMIC(&added, &new_trace_buffers);
+    while ((buf = QSLIST_FIRST(&added))) {
+        QSLIST_REMOVE_HEAD(&added, next);
+        QSLIST_INSERT_HEAD(&trace_buffers, buf, next);
+    }
+
+    for (;;) {
+        TraceBuffer *oldest = NULL;
+        uint64_t oldest_ns = 0;
+
+        QSLIST_FOREACH(buf, &trace_buffers, next) {
+            uint64_t timestamp_ns;
+
+            if (peek_trace_record(buf, &timestamp_ns) &&
+                (!oldest || timestamp_ns < oldest_ns)) {
+                oldest = buf;
+                oldest_ns = timestamp_ns;
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+
+        get_trace_record(oldest, &recordptr);
+        unused = fwrite(&type, sizeof(type), 1, trace_fp);
+        unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
+        free(recordptr); /* don't use g_free, can deadlock when traced */
+    }
+
+    /* Free the buffers of threads that exited once they are empty */
+    QSLIST_FOREACH_SAFE(buf, &trace_buffers, next, next_buf) {
+        if (g_atomic_int_get(&buf->exited) &&
+            g_atomic_int_get(&buf->idx) ==
+            g_atomic_int_get(&buf->writeout_idx)) {
+            QSLIST_REMOVE(&trace_buffers, buf, TraceBuffer, next);
+            free(buf); /* don't use g_free, can deadlock when traced */
+        }
+    }
+}
+
+static gpointer writeout_thread(gpointer opaque)
+{
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
     int dropped_count;
     size_t unused __attribute__ ((unused));
     uint64_t type = TRACE_RECORD_TYPE_EVENT;
@@ -183,13 +299,7 @@ static gpointer writeout_thread(gpointer opaque)
             unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(&type, sizeof(type), 1, trace_fp);
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* don't use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
-        }
+        write_trace_records();
 
         fflush(trace_fp);
     }
@@ -198,50 +308,62 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, (void*)s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, uint32_t event, size_t datasize)
 {
+    TraceBuffer *buf = get_trace_buffer();
     unsigned int idx, rec_off, old_idx, new_idx;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
     uint64_t event_u64 = event;
     uint64_t timestamp_ns = get_clock();
 
+    if (!buf) {
+        g_atomic_int_inc(&dropped_events);
+        return -ENOMEM;
+    }
+
     do {
-        old_idx = g_atomic_int_get(&trace_idx);
+        old_idx = g_atomic_int_get(&buf->idx);
         smp_rmb();
         new_idx = old_idx + rec_len;
 
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
+        if (new_idx - (unsigned int)g_atomic_int_get(&buf->writeout_idx) >
+            TRACE_BUF_LEN) {
             /* Trace Buffer Full, Event dropped ! */
             g_atomic_int_inc(&dropped_events);
             return -ENOSPC;
         }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
+    } while (!g_atomic_int_compare_and_exchange(&buf->idx, old_idx, new_idx));
 
     idx = old_idx % TRACE_BUF_LEN;
 
     rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
+    rec_off = write_to_buffer(buf, rec_off, &event_u64, sizeof(event_u64));
+    rec_off = write_to_buffer(buf, rec_off, &timestamp_ns,
+                              sizeof(timestamp_ns));
+    rec_off = write_to_buffer(buf, rec_off, &rec_len, sizeof(rec_len));
+    rec_off = write_to_buffer(buf, rec_off, &trace_pid, sizeof(trace_pid));
 
+    rec->tbuf = buf;
     rec->tbuf_idx = idx;
     rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
+static void read_from_buffer(TraceBuffer *buf, unsigned int idx,
+                             void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
@@ -249,11 +371,12 @@ static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        data_ptr[x++] = trace_buf[idx++];
+        data_ptr[x++] = buf->data[idx++];
     }
 }
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
+static unsigned int write_to_buffer(TraceBuffer *buf, unsigned int idx,
+                                    void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
@@ -261,20 +384,22 @@ static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size
         if (idx >= TRACE_BUF_LEN) {
             idx = idx % TRACE_BUF_LEN;
         }
-        trace_buf[idx++] = data_ptr[x++];
+        buf->data[idx++] = data_ptr[x++];
     }
     return idx; /* most callers wants to know where to write next */
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
+    TraceBuffer *buf = rec->tbuf;
     TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    read_from_buffer(buf, rec->tbuf_idx, &record, sizeof(TraceRecord));
     smp_wmb(); /* write barrier before marking as valid */
     record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    write_to_buffer(buf, rec->tbuf_idx, &record, sizeof(TraceRecord));
 
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
+    if (((unsigned int)g_atomic_int_get(&buf->idx) -
+         (unsigned int)g_atomic_int_get(&buf->writeout_idx))
         > TRACE_BUF_FLUSH_THRESHOLD) {
         flush_trace_file(false);
     }
@@ -1381,6 +1381,17 @@ bool qemu_console_is_gl_blocked(QemuConsole *con)
     return con->gl_block;
 }
 
+bool qemu_console_has_exact_damage(QemuConsole *con)
+{
+    int flags;
+
+    if (!con || !con->hw_ops || !con->hw_ops->get_flags) {
+        return false;
+    }
+    flags = con->hw_ops->get_flags(con->hw);
+    return flags & GRAPHIC_FLAGS_DAMAGE;
+}
+
 static bool qemu_graphic_console_is_multihead(QemuGraphicConsole *c)
 {
     QemuConsole *con;
@@ -29,6 +29,7 @@
 #include "ui/spice-display.h"
 
 bool spice_opengl;
+bool spice_remote_client;
 
 int qemu_spice_rect_is_empty(const QXLRect* r)
 {
@@ -814,6 +815,30 @@ static void qemu_spice_gl_monitor_config(SimpleSpiceDisplay *ssd,
                                     (uintptr_t)cookie);
 }
 
+/*
+ * Pass a scanout to the server, which takes ownership of @fd.  Remote
+ * clients get the scanout encoded as a video stream, so tell the server
+ * about the buffer layout: a hardware encoder can then import the
+ * dmabuf directly instead of going through system memory.
+ */
+static void qemu_spice_gl_scanout_fd(SimpleSpiceDisplay *ssd, int fd,
+                                     uint32_t width, uint32_t height,
+                                     uint32_t stride, uint32_t fourcc,
+                                     uint64_t modifier, bool y_0_top)
+{
+#if SPICE_SERVER_VERSION >= 0x000f03 /* release 0.15.3 */
+    if (spice_remote_client) {
+        uint32_t offset = 0;
+
+        spice_qxl_gl_scanout2(&ssd->qxl, &fd, width, height, &offset,
+                              &stride, 1, fourcc, modifier, y_0_top);
+        return;
+    }
+#endif
+    spice_qxl_gl_scanout(&ssd->qxl, fd, width, height, stride, fourcc,
+                         y_0_top);
+}
+
 static void qemu_spice_gl_block(SimpleSpiceDisplay *ssd, bool block)
 {
     uint64_t timeout;
@@ -875,6 +900,7 @@ static void spice_gl_switch(DisplayChangeListener *dcl,
                             struct DisplaySurface *new_surface)
 {
     SimpleSpiceDisplay *ssd = container_of(dcl, SimpleSpiceDisplay, dcl);
+    EGLuint64KHR modifier = 0;
     EGLint stride, fourcc;
     int fd;
 
@@ -886,7 +912,7 @@ static void spice_gl_switch(DisplayChangeListener *dcl,
         surface_gl_create_texture(ssd->gls, ssd->ds);
         fd = egl_get_fd_for_texture(ssd->ds->texture,
                                     &stride, &fourcc,
-                                    NULL);
+                                    &modifier);
         if (fd < 0) {
             surface_gl_destroy_texture(ssd->gls, ssd->ds);
             return;
@@ -898,10 +924,10 @@ static void spice_gl_switch(DisplayChangeListener *dcl,
                                     fourcc);
 
         /* note: spice server will close the fd */
-        spice_qxl_gl_scanout(&ssd->qxl, fd,
-                             surface_width(ssd->ds),
-                             surface_height(ssd->ds),
-                             stride, fourcc, false);
+        qemu_spice_gl_scanout_fd(ssd, fd,
+                                 surface_width(ssd->ds),
+                                 surface_height(ssd->ds),
+                                 stride, fourcc, modifier, false);
         ssd->have_surface = true;
         ssd->have_scanout = false;
 
@@ -940,11 +966,12 @@ static void qemu_spice_gl_scanout_texture(DisplayChangeListener *dcl,
                                           void *d3d_tex2d)
 {
     SimpleSpiceDisplay *ssd = container_of(dcl, SimpleSpiceDisplay, dcl);
+    EGLuint64KHR modifier = 0;
     EGLint stride = 0, fourcc = 0;
     int fd = -1;
 
     assert(tex_id);
-    fd = egl_get_fd_for_texture(tex_id, &stride, &fourcc, NULL);
+    fd = egl_get_fd_for_texture(tex_id, &stride, &fourcc, &modifier);
     if (fd < 0) {
         fprintf(stderr, "%s: failed to get fd for texture\n", __func__);
         return;
@@ -952,8 +979,8 @@ static void qemu_spice_gl_scanout_texture(DisplayChangeListener *dcl,
     trace_qemu_spice_gl_scanout_texture(ssd->qxl.id, w, h, fourcc);
 
     /* note: spice server will close the fd */
-    spice_qxl_gl_scanout(&ssd->qxl, fd, backing_width, backing_height,
-                         stride, fourcc, y_0_top);
+    qemu_spice_gl_scanout_fd(ssd, fd, backing_width, backing_height,
+                             stride, fourcc, modifier, y_0_top);
     qemu_spice_gl_monitor_config(ssd, x, y, w, h);
     ssd->have_surface = false;
     ssd->have_scanout = true;
@@ -1021,6 +1048,7 @@ static void qemu_spice_gl_update(DisplayChangeListener *dcl,
                                  uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
     SimpleSpiceDisplay *ssd = container_of(dcl, SimpleSpiceDisplay, dcl);
+    EGLuint64KHR modifier = 0;
     EGLint stride = 0, fourcc = 0;
     bool render_cursor = false;
     bool y_0_top = false; /* FIXME */
@@ -1062,19 +1090,19 @@ static void qemu_spice_gl_update(DisplayChangeListener *dcl,
                 egl_fb_setup_new_tex(&ssd->blit_fb,
                                      dmabuf->width, dmabuf->height);
                 fd = egl_get_fd_for_texture(ssd->blit_fb.texture,
-                                            &stride, &fourcc, NULL);
-                spice_qxl_gl_scanout(&ssd->qxl, fd,
-                                     dmabuf->width, dmabuf->height,
-                                     stride, fourcc, false);
+                                            &stride, &fourcc, &modifier);
+                qemu_spice_gl_scanout_fd(ssd, fd,
+                                         dmabuf->width, dmabuf->height,
+                                         stride, fourcc, modifier, false);
             }
         } else {
             trace_qemu_spice_gl_forward_dmabuf(ssd->qxl.id,
                                                dmabuf->width, dmabuf->height);
             /* note: spice server will close the fd, so hand over a dup */
-            spice_qxl_gl_scanout(&ssd->qxl, dup(dmabuf->fd),
-                                 dmabuf->width, dmabuf->height,
-                                 dmabuf->stride, dmabuf->fourcc,
-                                 dmabuf->y0_top);
+            qemu_spice_gl_scanout_fd(ssd, dup(dmabuf->fd),
+                                     dmabuf->width, dmabuf->height,
+                                     dmabuf->stride, dmabuf->fourcc,
+                                     dmabuf->modifier, dmabuf->y0_top);
         }
         qemu_spice_gl_monitor_config(ssd, 0, 0, dmabuf->width, dmabuf->height);
         ssd->guest_dmabuf_refresh = false;
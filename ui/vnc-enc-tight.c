@@ -816,6 +816,25 @@ static int tight_init_stream(VncState *vs, int stream_id,
     return 0;
 }
 
+/*
+ * The low four bits of every compression control byte ask the client to
+ * reset the corresponding zlib streams.  Reset ours at the same time, so
+ * that both ends start the stream afresh.
+ */
+static void tight_write_control(VncState *vs, uint8_t control)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(vs->tight->stream); i++) {
+        if ((vs->tight->reset_streams & (1 << i)) &&
+            vs->tight->stream[i].opaque) {
+            deflateReset(&vs->tight->stream[i]);
+        }
+    }
+    vnc_write_u8(vs, control | vs->tight->reset_streams);
+    vs->tight->reset_streams = 0;
+}
+
 static void tight_send_compact_size(VncState *vs, size_t len)
 {
     int lpc = 0;
@@ -925,7 +944,7 @@ static int send_full_color_rect(VncState *vs, int x, int y, int w, int h)
     }
 #endif
 
-    vnc_write_u8(vs, stream << 4); /* no flushing, no filter */
+    tight_write_control(vs, stream << 4); /* no filter */
 
     if (vs->tight->pixel24) {
         tight_pack24(vs, vs->tight->tight.buffer, w * h,
@@ -946,7 +965,7 @@ static int send_solid_rect(VncState *vs)
 {
     size_t bytes;
 
-    vnc_write_u8(vs, VNC_TIGHT_FILL << 4); /* no flushing, no filter */
+    tight_write_control(vs, VNC_TIGHT_FILL << 4); /* no filter */
 
     if (vs->tight->pixel24) {
         tight_pack24(vs, vs->tight->tight.buffer, 1, &vs->tight->tight.offset);
@@ -982,7 +1001,7 @@ static int send_mono_rect(VncState *vs, int x, int y,
 
     bytes = DIV_ROUND_UP(w, 8) * h;
 
-    vnc_write_u8(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
+    tight_write_control(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
     vnc_write_u8(vs, VNC_TIGHT_FILTER_PALETTE);
     vnc_write_u8(vs, 1);
 
@@ -1048,7 +1067,7 @@ static bool send_gradient_rect(VncState *vs, int x, int y, int w, int h)
         return send_full_color_rect(vs, x, y, w, h);
     }
 
-    vnc_write_u8(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
+    tight_write_control(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
     vnc_write_u8(vs, VNC_TIGHT_FILTER_GRADIENT);
 
     buffer_reserve(&vs->tight->gradient, w * 3 * sizeof(int));
@@ -1090,7 +1109,7 @@ static int send_palette_rect(VncState *vs, int x, int y,
 
     colors = palette_size(palette);
 
-    vnc_write_u8(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
+    tight_write_control(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
     vnc_write_u8(vs, VNC_TIGHT_FILTER_PALETTE);
     vnc_write_u8(vs, colors - 1);
 
@@ -1221,7 +1240,7 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
     jpeg_finish_compress(&cinfo);
     jpeg_destroy_compress(&cinfo);
 
-    vnc_write_u8(vs, VNC_TIGHT_JPEG << 4);
+    tight_write_control(vs, VNC_TIGHT_JPEG << 4);
 
     tight_send_compact_size(vs, vs->tight->jpeg.offset);
     vnc_write(vs, vs->tight->jpeg.buffer, vs->tight->jpeg.offset);
@@ -1373,7 +1392,7 @@ static int send_png_rect(VncState *vs, int x, int y, int w, int h,
 
     png_destroy_write_struct(&png_ptr, &info_ptr);
 
-    vnc_write_u8(vs, VNC_TIGHT_PNG << 4);
+    tight_write_control(vs, VNC_TIGHT_PNG << 4);
 
     tight_send_compact_size(vs, vs->tight->png.offset);
     vnc_write(vs, vs->tight->png.buffer, vs->tight->png.offset);
@@ -1711,3 +1730,39 @@ void vnc_tight_clear(VncState *vs)
     buffer_free(&vs->tight->png);
 #endif
 }
+
+/*
+ * Set up @slice to encode part of an update for @vs in parallel with the
+ * other slices.  The slice has its own zlib streams; its first control
+ * byte resets all the client's streams, so that the client decompresses
+ * the slice with fresh streams too.
+ */
+void vnc_tight_init_slice(VncState *slice, VncState *vs)
+{
+    slice->tight = g_new0(VncTight, 1);
+    slice->tight->quality = vs->tight->quality;
+    slice->tight->compression = vs->tight->compression;
+    slice->tight->pixel24 = vs->tight->pixel24;
+    slice->tight->reset_streams = 0xf;
+
+    buffer_init(&slice->tight->tight,    "vnc-tight-slice");
+    buffer_init(&slice->tight->zlib,     "vnc-tight-slice-zlib");
+    buffer_init(&slice->tight->gradient, "vnc-tight-slice-gradient");
+#ifdef CONFIG_VNC_JPEG
+    buffer_init(&slice->tight->jpeg,     "vnc-tight-slice-jpeg");
+#endif
+#ifdef CONFIG_PNG
+    buffer_init(&slice->tight->png,      "vnc-tight-slice-png");
+#endif
+}
+
+void vnc_tight_fini_slice(VncState *slice, VncState *vs)
+{
+    /* The client reset its streams if the slice sent a control byte */
+    if (!slice->tight->reset_streams) {
+        vs->tight->reset_streams = 0xf;
+    }
+    vnc_tight_clear(slice);
+    g_free(slice->tight);
+    slice->tight = NULL;
+}
@@ -75,13 +75,19 @@ static int zrle_compress_data(VncState *vs, int level)
 
     buffer_reset(&vs->zrle->zlib);
 
-    if (zstream->opaque != vs) {
+    /*
+     * The connection uses a single zlib stream, but it is built by hand
+     * from a zlib header and raw deflate data ending in a sync flush.
+     * This way the stream can be restarted at any rectangle boundary
+     * and slices encoded in parallel can simply be concatenated.
+     */
+    if (zstream->opaque == NULL) {
         int err;
 
         zstream->zalloc = vnc_zlib_zalloc;
         zstream->zfree = vnc_zlib_zfree;
 
-        err = deflateInit2(zstream, level, Z_DEFLATED, MAX_WBITS,
+        err = deflateInit2(zstream, level, Z_DEFLATED, -MAX_WBITS,
                            MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
 
         if (err != Z_OK) {
@@ -95,11 +101,19 @@ static int zrle_compress_data(VncState *vs, int level)
     /* reserve memory in output buffer */
     buffer_reserve(&vs->zrle->zlib, vs->zrle->zrle.offset + 64);
 
+    if (!vs->zrle->header_sent) {
+        /* deflate, 32K window, no preset dictionary */
+        vs->zrle->zlib.buffer[0] = 0x78;
+        vs->zrle->zlib.buffer[1] = 0x01;
+        vs->zrle->zlib.offset = 2;
+        vs->zrle->header_sent = true;
+    }
+
     /* set pointers */
     zstream->next_in = vs->zrle->zrle.buffer;
     zstream->avail_in = vs->zrle->zrle.offset;
-    zstream->next_out = vs->zrle->zlib.buffer;
-    zstream->avail_out = vs->zrle->zlib.capacity;
+    zstream->next_out = vs->zrle->zlib.buffer + vs->zrle->zlib.offset;
+    zstream->avail_out = vs->zrle->zlib.capacity - vs->zrle->zlib.offset;
     zstream->data_type = Z_BINARY;
 
     /* start encoding */
@@ -364,3 +378,35 @@ void vnc_zrle_clear(VncState *vs)
     buffer_free(&vs->zrle->fb);
     buffer_free(&vs->zrle->zlib);
 }
+
+/*
+ * Set up @slice to encode part of an update for @vs in parallel with the
+ * other slices.  Each slice starts a new raw deflate stream; only the
+ * @first one may have to send the zlib header.
+ */
+void vnc_zrle_init_slice(VncState *slice, VncState *vs, bool first)
+{
+    slice->zrle = g_new0(VncZrle, 1);
+    slice->zrle->header_sent = !first || vs->zrle->header_sent;
+
+    buffer_init(&slice->zrle->zrle, "vnc-zrle-slice");
+    buffer_init(&slice->zrle->fb,   "vnc-zrle-slice-fb");
+    buffer_init(&slice->zrle->zlib, "vnc-zrle-slice-zlib");
+}
+
+void vnc_zrle_fini_slice(VncState *slice, VncState *vs)
+{
+    if (slice->zrle->stream.opaque) {
+        /*
+         * The client has seen data from another stream since the last
+         * output of ours, so ours must not refer back to it.
+         */
+        if (vs->zrle->stream.opaque) {
+            deflateReset(&vs->zrle->stream);
+        }
+        vs->zrle->header_sent = true;
+    }
+    vnc_zrle_clear(slice);
+    g_free(slice->zrle);
+    slice->zrle = NULL;
+}
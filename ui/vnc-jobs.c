@@ -51,6 +51,14 @@
  * its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * With encoder-threads=N, the worker thread can split a job into up to N
+ * slices of about the same area, which it encodes together with a pool of
+ * helper threads while it holds the VncDisplay lock.  Each slice has its
+ * own copy of the client state and its own output buffer, and the outputs
+ * are sent in order.  The tight and ZRLE encoders keep their zlib streams
+ * in sync with the client across slices, see vnc_tight_init_slice() and
+ * vnc_zrle_init_slice().
  */
 
 struct VncJobQueue {
@@ -69,6 +77,29 @@ typedef struct VncJobQueue VncJobQueue;
  */
 static VncJobQueue *queue;
 
+/* Slices are not split below this height, unless the rectangle is smaller */
+#define VNC_SLICE_MIN_HEIGHT 16
+
+typedef struct VncSlice {
+    VncState vs;
+    VncRect *rects;
+    int nrects;
+    int n_rectangles;
+} VncSlice;
+
+typedef struct VncEncoderPool {
+    QemuMutex mutex;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    int nthreads;
+    VncSlice *slices;
+    int nslices;
+    int next;
+    int pending;
+} VncEncoderPool;
+
+static VncEncoderPool *pool;
+
 static void vnc_lock_queue(VncJobQueue *queue)
 {
     qemu_mutex_lock(&queue->mutex);
@@ -207,6 +238,74 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->lossy_rect = local->lossy_rect;
 }
 
+static void vnc_slice_encode(VncSlice *slice)
+{
+    int i, n;
+
+    for (i = 0; i < slice->nrects; i++) {
+        VncRect *rect = &slice->rects[i];
+
+        n = vnc_send_framebuffer_update(&slice->vs, rect->x, rect->y,
+                                        rect->w, rect->h);
+        if (n >= 0) {
+            slice->n_rectangles += n;
+        }
+    }
+}
+
+static void *vnc_encoder_thread(void *arg)
+{
+    VncEncoderPool *pool = arg;
+    VncSlice *slice;
+
+    qemu_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->next >= pool->nslices) {
+            qemu_cond_wait(&pool->work_cond, &pool->mutex);
+        }
+        slice = &pool->slices[pool->next++];
+        qemu_mutex_unlock(&pool->mutex);
+
+        vnc_slice_encode(slice);
+
+        qemu_mutex_lock(&pool->mutex);
+        if (--pool->pending == 0) {
+            qemu_cond_signal(&pool->done_cond);
+        }
+    }
+    return NULL;
+}
+
+/* Encode @slices with the pool, taking a share of the work */
+static void vnc_pool_encode(VncSlice *slices, int nslices)
+{
+    VncSlice *slice;
+
+    qemu_mutex_lock(&pool->mutex);
+    pool->slices = slices;
+    pool->nslices = nslices;
+    pool->next = 0;
+    pool->pending = nslices;
+    qemu_cond_broadcast(&pool->work_cond);
+
+    while (pool->next < pool->nslices) {
+        slice = &pool->slices[pool->next++];
+        qemu_mutex_unlock(&pool->mutex);
+
+        vnc_slice_encode(slice);
+
+        qemu_mutex_lock(&pool->mutex);
+        pool->pending--;
+    }
+    while (pool->pending) {
+        qemu_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    pool->slices = NULL;
+    pool->nslices = 0;
+    pool->next = 0;
+    qemu_mutex_unlock(&pool->mutex);
+}
+
 static bool vnc_worker_clamp_rect(VncState *vs, VncJob *job, VncRect *rect)
 {
     trace_vnc_job_clamp_rect(vs, job, rect->x, rect->y, rect->w, rect->h);
@@ -235,12 +334,116 @@ static bool vnc_worker_clamp_rect(VncState *vs, VncJob *job, VncRect *rect)
     return false;
 }
 
+static int vnc_worker_nslices(VncState *vs)
+{
+    if (!pool) {
+        return 1;
+    }
+    switch (vs->vnc_encoding) {
+    case VNC_ENCODING_ZLIB:
+        /* A single stream that cannot be restarted */
+        return 1;
+    default:
+        return vs->vd->encoder_threads;
+    }
+}
+
+/*
+ * Encode all the rectangles of @job into @vs with up to @nslices threads.
+ * Rectangles that are larger than a slice are cut into horizontal bands.
+ * Return the number of rectangles that were sent.
+ */
+static int vnc_worker_encode_slices(VncJob *job, VncState *vs, int nslices)
+{
+    g_autoptr(GArray) rects = g_array_new(false, false, sizeof(VncRect));
+    g_autofree VncSlice *slices = NULL;
+    VncRectEntry *entry, *tmp;
+    uint64_t area = 0, target, done = 0;
+    int i, n, used, n_rectangles = 0;
+
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        VncRect *rect = &entry->rect;
+
+        if (vnc_worker_clamp_rect(vs, job, rect)) {
+            area += (uint64_t)rect->w * rect->h;
+            g_array_append_val(rects, *rect);
+        }
+        QLIST_REMOVE(entry, next);
+        g_free(entry);
+    }
+    if (!rects->len) {
+        return 0;
+    }
+
+    target = DIV_ROUND_UP(area, nslices);
+    n = rects->len;
+    for (i = 0; i < n; i++) {
+        VncRect rect = g_array_index(rects, VncRect, i);
+        int band_h;
+
+        if ((uint64_t)rect.w * rect.h <= target) {
+            continue;
+        }
+        band_h = MAX(VNC_SLICE_MIN_HEIGHT, DIV_ROUND_UP(target, rect.w));
+        while (rect.h > band_h) {
+            VncRect band = rect;
+
+            band.h = band_h;
+            g_array_append_val(rects, band);
+            rect.y += band_h;
+            rect.h -= band_h;
+        }
+        g_array_index(rects, VncRect, i) = rect;
+    }
+
+    slices = g_new0(VncSlice, nslices);
+    used = 0;
+    for (i = 0; i < rects->len; i++) {
+        VncRect *rect = &g_array_index(rects, VncRect, i);
+
+        if (!slices[used].nrects) {
+            slices[used].rects = rect;
+        }
+        slices[used].nrects++;
+        done += (uint64_t)rect->w * rect->h;
+        if (done >= target * (used + 1) && used < nslices - 1) {
+            used++;
+        }
+    }
+    if (slices[used].nrects) {
+        used++;
+    }
+
+    for (i = 0; i < used; i++) {
+        VncState *local = &slices[i].vs;
+
+        vnc_async_encoding_start(vs, local);
+        local->magic = VNC_MAGIC;
+        vnc_tight_init_slice(local, vs);
+        vnc_zrle_init_slice(local, vs, i == 0);
+    }
+
+    vnc_pool_encode(slices, used);
+
+    for (i = 0; i < used; i++) {
+        VncState *local = &slices[i].vs;
+
+        vnc_write(vs, local->output.buffer, local->output.offset);
+        n_rectangles += slices[i].n_rectangles;
+        vnc_tight_fini_slice(local, vs);
+        vnc_zrle_fini_slice(local, vs);
+        buffer_free(&local->output);
+        local->magic = 0;
+    }
+    return n_rectangles;
+}
+
 static int vnc_worker_thread_loop(VncJobQueue *queue)
 {
     VncJob *job;
     VncRectEntry *entry, *tmp;
     VncState vs = {};
-    int n_rectangles;
+    int n_rectangles, nslices;
     int saved_offset;
 
     vnc_lock_queue(queue);
@@ -284,6 +487,10 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     vnc_write_u16(&vs, 0);
 
     vnc_lock_display(job->vs->vd);
+    nslices = vnc_worker_nslices(&vs);
+    if (nslices > 1 && job->vs->ioc != NULL) {
+        n_rectangles = vnc_worker_encode_slices(job, &vs, nslices);
+    }
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
@@ -369,6 +576,23 @@ static bool vnc_worker_thread_running(void)
     return queue; /* Check global queue */
 }
 
+/* Make sure that there are at least @n encoder helper threads */
+void vnc_start_encoder_threads(int n)
+{
+    QemuThread thread;
+
+    if (!pool) {
+        pool = g_new0(VncEncoderPool, 1);
+        qemu_mutex_init(&pool->mutex);
+        qemu_cond_init(&pool->work_cond);
+        qemu_cond_init(&pool->done_cond);
+    }
+    for (; pool->nthreads < n; pool->nthreads++) {
+        qemu_thread_create(&thread, "vnc_encoder", vnc_encoder_thread, pool,
+                           QEMU_THREAD_DETACHED);
+    }
+}
+
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
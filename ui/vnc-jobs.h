@@ -38,6 +38,7 @@ void vnc_jobs_join(VncState *vs);
 
 void vnc_jobs_consume_buffer(VncState *vs);
 void vnc_start_worker_thread(void);
+void vnc_start_encoder_threads(int n);
 
 /* Locks */
 static inline int vnc_trylock_display(VncDisplay *vd)
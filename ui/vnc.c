@@ -3111,6 +3111,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     unsigned long offset;
     int x;
     uint8_t *guest_ptr, *server_ptr;
+    bool exact_damage = qemu_console_has_exact_damage(vd->dcl.con);
 
     struct timeval tv = { 0, 0 };
 
@@ -3173,7 +3174,8 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
                 _cmp_bytes = line_bytes - x * cmp_bytes;
             }
             assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+            if (!exact_damage &&
+                memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
                 continue;
             }
             memcpy(server_ptr, guest_ptr, _cmp_bytes);
@@ -3589,6 +3591,9 @@ static QemuOptsList qemu_vnc_opts = {
         },{
             .name = "non-adaptive",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "encoder-threads",
+            .type = QEMU_OPT_NUMBER,
         },{
             .name = "audiodev",
             .type = QEMU_OPT_STRING,
@@ -4153,6 +4158,15 @@ void vnc_display_open(const char *id, Error **errp)
 
     vd->power_control = qemu_opt_get_bool(opts, "power-control", false);
 
+    vd->encoder_threads = qemu_opt_get_number(opts, "encoder-threads", 1);
+    if (vd->encoder_threads < 1 ||
+        vd->encoder_threads > VNC_MAX_ENCODER_THREADS) {
+        error_setg(errp, "vnc encoder-threads must be between 1 and %d",
+                   VNC_MAX_ENCODER_THREADS);
+        goto fail;
+    }
+    vnc_start_encoder_threads(vd->encoder_threads - 1);
+
     if (tlsauthz) {
         vd->tlsauthzid = g_strdup(tlsauthz);
     }
@@ -95,6 +95,9 @@ typedef void VncSendHextileTile(VncState *vs,
 #define VNC_STAT_COLS (VNC_MAX_WIDTH / VNC_STAT_RECT)
 #define VNC_STAT_ROWS (VNC_MAX_HEIGHT / VNC_STAT_RECT)
 
+/* Upper limit of the encoder-threads option */
+#define VNC_MAX_ENCODER_THREADS 64
+
 #define VNC_AUTH_CHALLENGE_SIZE 16
 
 typedef struct VncDisplay VncDisplay;
@@ -178,6 +181,7 @@ struct VncDisplay
     bool lossy;
     bool non_adaptive;
     bool power_control;
+    int encoder_threads;
     QCryptoTLSCreds *tlscreds;
     QAuthZ *tlsauthz;
     char *tlsauthzid;
@@ -205,6 +209,8 @@ typedef struct VncTight {
 #endif
     int levels[4];
     z_stream stream[4];
+    /* Streams to reset with the next compression control byte */
+    uint8_t reset_streams;
 } VncTight;
 
 typedef struct VncHextile {
@@ -225,6 +231,7 @@ typedef struct VncZrle {
     Buffer tmp;
     Buffer zlib;
     z_stream stream;
+    bool header_sent;
     VncPalette palette;
 } VncZrle;
 
@@ -621,10 +628,14 @@ int vnc_tight_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 int vnc_tight_png_send_framebuffer_update(VncState *vs, int x, int y,
                                           int w, int h);
 void vnc_tight_clear(VncState *vs);
+void vnc_tight_init_slice(VncState *slice, VncState *vs);
+void vnc_tight_fini_slice(VncState *slice, VncState *vs);
 
 int vnc_zrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 int vnc_zywrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 void vnc_zrle_clear(VncState *vs);
+void vnc_zrle_init_slice(VncState *slice, VncState *vs, bool first);
+void vnc_zrle_fini_slice(VncState *slice, VncState *vs);
 
 /* vnc-clipboard.c */
 void vnc_server_cut_text_caps(VncState *vs);
@@ -0,0 +1,227 @@
+/*
+ * Threads that busy wait for events on behalf of several AioContexts
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "block/aio-poll-group.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/module.h"
+#include "qemu/rcu.h"
+#include "qom/object_interfaces.h"
+
+struct AioPollGroupContexts {
+    struct rcu_head rcu;
+    unsigned int nr;
+    AioContext *ctx[];
+};
+
+struct AioPollGroupWorker {
+    QemuThread thread;
+    AioPollGroup *group;
+    unsigned int index;
+};
+
+static void *aio_poll_group_run(void *opaque)
+{
+    AioPollGroupWorker *w = opaque;
+    AioPollGroup *group = w->group;
+
+    rcu_register_thread();
+
+    while (!qatomic_read(&group->stopping)) {
+        AioPollGroupContexts *c;
+        bool busy = false;
+        unsigned int i;
+
+        qemu_event_reset(&group->wakeup);
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            c = qatomic_rcu_read(&group->contexts);
+
+            /* Start at a different context in each worker */
+            for (i = 0; c && i < c->nr; i++) {
+                AioContext *ctx = c->ctx[(i + w->index) % c->nr];
+
+                busy |= aio_context_poll_for_group(ctx);
+            }
+        }
+
+        /*
+         * Nobody waits for us, or other workers poll for all contexts
+         * that do.  A context that starts waiting sets the event.
+         */
+        if (!busy) {
+            qemu_event_wait(&group->wakeup);
+        }
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void aio_poll_group_update(AioPollGroup *group, AioContext *add,
+                                  AioContext *remove)
+{
+    AioPollGroupContexts *old, *new;
+    unsigned int i, nr = 0;
+
+    qemu_mutex_lock(&group->lock);
+    old = group->contexts;
+    new = g_malloc(sizeof(*new) +
+                   sizeof(AioContext *) * ((old ? old->nr : 0) + 1));
+    for (i = 0; old && i < old->nr; i++) {
+        if (old->ctx[i] != remove) {
+            new->ctx[nr++] = old->ctx[i];
+        }
+    }
+    if (add) {
+        new->ctx[nr++] = add;
+    }
+    new->nr = nr;
+    qatomic_rcu_set(&group->contexts, new);
+    qemu_mutex_unlock(&group->lock);
+
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+}
+
+void aio_poll_group_add(AioPollGroup *group, AioContext *ctx)
+{
+    assert(!ctx->poll_group);
+    ctx->poll_group = group;
+    aio_poll_group_update(group, ctx, NULL);
+}
+
+void aio_poll_group_remove(AioContext *ctx)
+{
+    AioPollGroup *group = ctx->poll_group;
+
+    if (!group) {
+        return;
+    }
+    aio_poll_group_update(group, NULL, ctx);
+
+    /* Workers may still be looking at the old list */
+    synchronize_rcu();
+    ctx->poll_group = NULL;
+}
+
+static void aio_poll_group_get_threads(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    AioPollGroup *group = AIO_POLL_GROUP(obj);
+
+    visit_type_uint32(v, name, &group->nr_threads, errp);
+}
+
+static void aio_poll_group_set_threads(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    AioPollGroup *group = AIO_POLL_GROUP(obj);
+    uint32_t value;
+
+    if (group->workers) {
+        error_setg(errp, "Property '%s' cannot be changed after creation",
+                   name);
+        return;
+    }
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value) {
+        error_setg(errp, "Property '%s' must be at least 1", name);
+        return;
+    }
+    group->nr_threads = value;
+}
+
+static void aio_poll_group_complete(UserCreatable *uc, Error **errp)
+{
+    AioPollGroup *group = AIO_POLL_GROUP(uc);
+    const char *id = object_get_canonical_path_component(OBJECT(uc));
+    uint32_t i;
+
+    group->workers = g_new0(AioPollGroupWorker, group->nr_threads);
+    for (i = 0; i < group->nr_threads; i++) {
+        AioPollGroupWorker *w = &group->workers[i];
+        g_autofree char *name = g_strdup_printf("PG %s/%u", id, i);
+
+        w->group = group;
+        w->index = i;
+        qemu_thread_create(&w->thread, name, aio_poll_group_run, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static bool aio_poll_group_can_be_deleted(UserCreatable *uc)
+{
+    AioPollGroupContexts *c = AIO_POLL_GROUP(uc)->contexts;
+
+    return !c || !c->nr;
+}
+
+static void aio_poll_group_instance_init(Object *obj)
+{
+    AioPollGroup *group = AIO_POLL_GROUP(obj);
+
+    group->nr_threads = 1;
+    qemu_event_init(&group->wakeup, false);
+    qemu_mutex_init(&group->lock);
+}
+
+static void aio_poll_group_instance_finalize(Object *obj)
+{
+    AioPollGroup *group = AIO_POLL_GROUP(obj);
+    uint32_t i;
+
+    if (group->workers) {
+        qatomic_set(&group->stopping, true);
+        qemu_event_set(&group->wakeup);
+        for (i = 0; i < group->nr_threads; i++) {
+            qemu_thread_join(&group->workers[i].thread);
+        }
+        g_free(group->workers);
+    }
+    g_free(group->contexts);
+    qemu_event_destroy(&group->wakeup);
+    qemu_mutex_destroy(&group->lock);
+}
+
+static void aio_poll_group_class_init(ObjectClass *oc, void *data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
+
+    ucc->complete = aio_poll_group_complete;
+    ucc->can_be_deleted = aio_poll_group_can_be_deleted;
+    object_class_property_add(oc, "threads", "uint32",
+                              aio_poll_group_get_threads,
+                              aio_poll_group_set_threads, NULL, NULL);
+    object_class_property_set_description(oc, "threads",
+        "Number of threads that poll for the group's event loops");
+}
+
+static const TypeInfo aio_poll_group_info = {
+    .name = TYPE_AIO_POLL_GROUP,
+    .parent = TYPE_OBJECT,
+    .class_init = aio_poll_group_class_init,
+    .instance_size = sizeof(AioPollGroup),
+    .instance_init = aio_poll_group_instance_init,
+    .instance_finalize = aio_poll_group_instance_finalize,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_USER_CREATABLE },
+        { }
+    }
+};
+
+static void aio_poll_group_register_types(void)
+{
+    type_register_static(&aio_poll_group_info);
+}
+
+type_init(aio_poll_group_register_types);
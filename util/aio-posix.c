@@ -15,6 +15,7 @@
 
 #include "qemu/osdep.h"
 #include "block/block.h"
+#include "block/aio-poll-group.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 #include "qemu/rcu.h"
@@ -565,21 +566,94 @@ static bool run_poll_handlers(AioContext *ctx, AioHandlerList *ready_list,
     return progress;
 }
 
+bool aio_context_poll_for_group(AioContext *ctx)
+{
+    AioHandler *node;
+    bool waiting;
+
+    /* Another thread of the group is polling for @ctx */
+    if (qatomic_xchg(&ctx->poll_group_claimed, true)) {
+        return false;
+    }
+
+    /* Pairs with smp_mb() in poll_group_wait() */
+    waiting = qatomic_read(&ctx->poll_group_waiting);
+    if (waiting) {
+        QLIST_FOREACH(node, &ctx->poll_aio_handlers, node_poll) {
+            if (node->opaque != &ctx->notifier &&
+                node->io_poll(node->opaque)) {
+                aio_notify(ctx);
+                break;
+            }
+        }
+    }
+
+    qatomic_store_release(&ctx->poll_group_claimed, false);
+    return waiting;
+}
+
+/* poll_group_wait:
+ * @ctx: the AioContext
+ * @ready_list: list to add handlers that need to be run
+ * @max_ns: how long to poll for
+ * @timeout: timeout for blocking wait, reduced by the time spent here if
+ *    nothing is ready
+ *
+ * Sleep in polling mode for up to @max_ns while ctx->poll_group polls our
+ * handlers in our place, instead of busy waiting in run_poll_handlers().
+ *
+ * Returns: true if a handler became ready
+ */
+static bool poll_group_wait(AioContext *ctx, AioHandlerList *ready_list,
+                            int64_t max_ns, int64_t *timeout)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t now, unused;
+
+    qatomic_set(&ctx->poll_group_waiting, true);
+    /* Pairs with qatomic_xchg() in aio_context_poll_for_group() */
+    smp_mb();
+    aio_poll_group_kick(ctx->poll_group);
+
+    ctx->fdmon_ops->wait(ctx, ready_list,
+                         qemu_soonest_timeout(*timeout, max_ns));
+
+    /* Don't let the group walk poll_aio_handlers once we return */
+    qatomic_set(&ctx->poll_group_waiting, false);
+    smp_mb();
+    while (qatomic_read(&ctx->poll_group_claimed)) {
+        cpu_relax();
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    run_poll_handlers_once(ctx, ready_list, now, &unused);
+    if (!QLIST_EMPTY(ready_list)) {
+        return true;
+    }
+
+    if (*timeout != -1) {
+        *timeout -= MIN(*timeout, now - start);
+    }
+    return false;
+}
+
 /* try_poll_mode:
  * @ctx: the AioContext
  * @ready_list: list to add handlers that need to be run
  * @timeout: timeout for blocking wait, computed by the caller and updated if
  *    polling succeeds.
+ * @group_ns: set to how long ctx->poll_group should poll for us, if at all
  *
  * Note that the caller must have incremented ctx->list_lock.
  *
  * Returns: true if progress was made, false otherwise
  */
 static bool try_poll_mode(AioContext *ctx, AioHandlerList *ready_list,
-                          int64_t *timeout)
+                          int64_t *timeout, int64_t *group_ns)
 {
     int64_t max_ns;
 
+    *group_ns = 0;
     if (QLIST_EMPTY_RCU(&ctx->poll_aio_handlers)) {
         return false;
     }
@@ -592,6 +666,19 @@ static bool try_poll_mode(AioContext *ctx, AioHandlerList *ready_list,
          */
         poll_set_started(ctx, ready_list, true);
 
+        if (ctx->poll_group) {
+            int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+            /* Check once, then leave the busy waiting to the group */
+            if (run_poll_handlers_once(ctx, ready_list, now, timeout) ||
+                remove_idle_poll_handlers(ctx, ready_list, now)) {
+                *timeout = 0;
+                return true;
+            }
+            *group_ns = max_ns;
+            return false;
+        }
+
         if (run_poll_handlers(ctx, ready_list, max_ns, timeout)) {
             return true;
         }
@@ -605,6 +692,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     bool progress;
     bool use_notify_me;
     int64_t timeout;
+    int64_t group_ns;
     int64_t start = 0;
 
     /*
@@ -626,7 +714,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     }
 
     timeout = blocking ? aio_compute_timeout(ctx) : 0;
-    progress = try_poll_mode(ctx, &ready_list, &timeout);
+    progress = try_poll_mode(ctx, &ready_list, &timeout, &group_ns);
     assert(!(timeout && progress));
 
     /*
@@ -655,7 +743,11 @@ bool aio_poll(AioContext *ctx, bool blocking)
     /* If polling is allowed, non-blocking aio_poll does not need the
      * system call---a single round of run_poll_handlers_once suffices.
      */
-    if (timeout || ctx->fdmon_ops->need_wait(ctx)) {
+    if (timeout && group_ns &&
+        poll_group_wait(ctx, &ready_list, group_ns, &timeout)) {
+        /* The group found an event while we slept in poll mode */
+        timeout = 0;
+    } else if (timeout || ctx->fdmon_ops->need_wait(ctx)) {
         /*
          * Disable poll mode. poll mode should be disabled before the call
          * of ctx->fdmon_ops->wait() so that guest's notification can wake
@@ -382,7 +382,9 @@ bool aio_poll(AioContext *ctx, bool blocking)
         HANDLE event;
         int ret;
 
-        timeout = blocking && !have_select_revents
+        /* aio_notify() may not set the notifier if ctx->notified is set */
+        timeout = blocking && !have_select_revents &&
+                  !qatomic_read(&ctx->notified)
             ? qemu_timeout_ns_to_ms(aio_compute_timeout(ctx)) : 0;
         ret = WaitForMultipleObjects(count, events, FALSE, timeout);
         if (blocking) {
@@ -441,3 +443,9 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch)
 {
 }
+
+bool aio_context_poll_for_group(AioContext *ctx)
+{
+    /* Without polling mode, nothing ever waits for the group */
+    return false;
+}
@@ -319,6 +319,12 @@ aio_ctx_prepare(GSource *source, gint    *timeout)
         *timeout = 0;
     }
 
+    /* Don't block if aio_notify() was called, it may not set the notifier */
+    if (qatomic_read(&ctx->notified)) {
+        aio_notify_accept(ctx);
+        *timeout = 0;
+    }
+
     return *timeout == 0;
 }
 
@@ -384,10 +390,17 @@ aio_ctx_finalize(GSource     *source)
         luring_cleanup(ctx->linux_io_uring);
         ctx->linux_io_uring = NULL;
     }
+    if (ctx->linux_io_uring_poll) {
+        luring_detach_aio_context(ctx->linux_io_uring_poll, ctx);
+        luring_cleanup(ctx->linux_io_uring_poll);
+        ctx->linux_io_uring_poll = NULL;
+    }
 #endif
 
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
     qemu_bh_delete(ctx->co_schedule_bh);
+    assert(QSLIST_EMPTY(&ctx->completions));
+    qemu_bh_delete(ctx->completion_bh);
 
     /* There must be no aio_bh_poll() calls going on */
     assert(QSIMPLEQ_EMPTY(&ctx->bh_slice_list));
@@ -468,7 +481,7 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    ctx->linux_io_uring = luring_init(false, -1, errp);
     if (!ctx->linux_io_uring) {
         return NULL;
     }
@@ -482,6 +495,28 @@ LuringState *aio_get_linux_io_uring(AioContext *ctx)
     assert(ctx->linux_io_uring);
     return ctx->linux_io_uring;
 }
+
+LuringState *aio_setup_linux_io_uring_poll(AioContext *ctx, int sqpoll_cpu,
+                                           Error **errp)
+{
+    if (ctx->linux_io_uring_poll) {
+        return ctx->linux_io_uring_poll;
+    }
+
+    ctx->linux_io_uring_poll = luring_init(true, sqpoll_cpu, errp);
+    if (!ctx->linux_io_uring_poll) {
+        return NULL;
+    }
+
+    luring_attach_aio_context(ctx->linux_io_uring_poll, ctx);
+    return ctx->linux_io_uring_poll;
+}
+
+LuringState *aio_get_linux_io_uring_poll(AioContext *ctx)
+{
+    assert(ctx->linux_io_uring_poll);
+    return ctx->linux_io_uring_poll;
+}
 #endif
 
 void aio_notify(AioContext *ctx)
@@ -491,13 +526,21 @@ void aio_notify(AioContext *ctx)
      * smp_mb() in aio_notify_accept().
      */
     smp_wmb();
-    qatomic_set(&ctx->notified, true);
+    if (qatomic_xchg(&ctx->notified, true)) {
+        /*
+         * Whoever set ctx->notified also set the notifier if the event
+         * loop was about to block, and the event loop checks
+         * ctx->notified before blocking otherwise.  Our writes are
+         * processed after the aio_notify_accept() that clears it.
+         */
+        return;
+    }
 
     /*
      * Write ctx->notified (and also ctx->bh_list) before reading ctx->notify_me.
      * Pairs with smp_mb() in aio_ctx_prepare or aio_poll.
      */
-    smp_mb();
+    smp_mb__after_rmw();
     if (qatomic_read(&ctx->notify_me)) {
         event_notifier_set(&ctx->notifier);
     }
@@ -571,6 +614,29 @@ static void co_schedule_bh_cb(void *opaque)
     }
 }
 
+static void aio_completion_bh_cb(void *opaque)
+{
+    AioContext *ctx = opaque;
+    QSLIST_HEAD(, AioCompletion) straight, reversed;
+
+    QSLIST_MOVE_ATOMIC(&reversed, &ctx->completions);
+    QSLIST_INIT(&straight);
+
+    while (!QSLIST_EMPTY(&reversed)) {
+        AioCompletion *c = QSLIST_FIRST(&reversed);
+        QSLIST_REMOVE_HEAD(&reversed, next);
+        QSLIST_INSERT_HEAD(&straight, c, next);
+    }
+
+    while (!QSLIST_EMPTY(&straight)) {
+        AioCompletion *c = QSLIST_FIRST(&straight);
+        QSLIST_REMOVE_HEAD(&straight, next);
+
+        /* @c may be freed by its callback */
+        c->cb(c->opaque);
+    }
+}
+
 AioContext *aio_context_new(Error **errp)
 {
     int ret;
@@ -591,6 +657,8 @@ AioContext *aio_context_new(Error **errp)
 
     ctx->co_schedule_bh = aio_bh_new(ctx, co_schedule_bh_cb, ctx);
     QSLIST_INIT(&ctx->scheduled_coroutines);
+    ctx->completion_bh = aio_bh_new(ctx, aio_completion_bh_cb, ctx);
+    QSLIST_INIT(&ctx->completions);
 
     aio_set_event_notifier(ctx, &ctx->notifier,
                            aio_context_notifier_cb,
@@ -602,6 +670,7 @@ AioContext *aio_context_new(Error **errp)
 
 #ifdef CONFIG_LINUX_IO_URING
     ctx->linux_io_uring = NULL;
+    ctx->linux_io_uring_poll = NULL;
 #endif
 
     ctx->thread_pool = NULL;
@@ -626,6 +695,20 @@ fail:
     return NULL;
 }
 
+void aio_complete_in(AioContext *ctx, AioCompletion *c, QEMUBHFunc *cb,
+                     void *opaque)
+{
+    c->cb = cb;
+    c->opaque = opaque;
+
+    /*
+     * Until the event loop picks up the batch, the bottom half is pending
+     * and aio_notify() returns early, so this costs two atomic operations.
+     */
+    QSLIST_INSERT_HEAD_ATOMIC(&ctx->completions, c, next);
+    qemu_bh_schedule(ctx->completion_bh);
+}
+
 void aio_co_schedule(AioContext *ctx, Coroutine *co)
 {
     trace_aio_co_schedule(ctx, co);
@@ -13,6 +13,7 @@
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/atomic.h"
+#include "qemu/cutils.h"
 
 /*
  * bitmaps provide an array of bits, implemented using an
@@ -332,15 +333,71 @@ bool bitmap_test_and_clear_atomic(unsigned long *map, long start, long nr)
     return dirty != 0;
 }
 
+/*
+ * Words checked at once with buffer_is_zero(), which uses the widest
+ * vector instructions that the host supports.
+ */
+#define BITMAP_ZERO_CHUNK   64
+
+long bitmap_find_next_nonzero_word(const unsigned long *map, long start,
+                                   long nwords)
+{
+    long k = start;
+
+    /* Go word by word up to the next chunk boundary... */
+    while (k < nwords && k % BITMAP_ZERO_CHUNK) {
+        if (map[k]) {
+            return k;
+        }
+        k++;
+    }
+
+    /* ... skip whole chunks that are clear... */
+    while (k + BITMAP_ZERO_CHUNK <= nwords &&
+           buffer_is_zero(map + k, BITMAP_ZERO_CHUNK * sizeof(*map))) {
+        k += BITMAP_ZERO_CHUNK;
+    }
+
+    /* ... and find the word within the chunk that is not. */
+    for (; k < nwords; k++) {
+        if (map[k]) {
+            return k;
+        }
+    }
+    return nwords;
+}
+
 void bitmap_copy_and_clear_atomic(unsigned long *dst, unsigned long *src,
                                   long nr)
 {
-    while (nr > 0) {
-        *dst = qatomic_xchg(src, 0);
-        dst++;
-        src++;
-        nr -= BITS_PER_LONG;
+    long nwords = BITS_TO_LONGS(nr);
+    long k = 0, next;
+
+    while (k < nwords) {
+        /* Clear words need not be exchanged */
+        next = bitmap_find_next_nonzero_word(src, k, nwords);
+        memset(dst + k, 0, (next - k) * sizeof(*dst));
+        if (next < nwords) {
+            dst[next] = qatomic_xchg(&src[next], 0);
+        }
+        k = next + 1;
+    }
+}
+
+long bitmap_or_and_clear_atomic(unsigned long *dst, unsigned long *src,
+                                long nr)
+{
+    long nwords = BITS_TO_LONGS(nr);
+    long k, new_bits = 0;
+
+    for (k = bitmap_find_next_nonzero_word(src, 0, nwords); k < nwords;
+         k = bitmap_find_next_nonzero_word(src, k + 1, nwords)) {
+        unsigned long bits = qatomic_xchg(&src[k], 0);
+
+        new_bits += ctpopl(bits & ~dst[k]);
+        dst[k] |= bits;
     }
+    return new_bits;
 }
 
 #define ALIGN_MASK(x,mask)      (((x)+(mask))&~(mask))
@@ -405,9 +462,11 @@ long slow_bitmap_count_one(const unsigned long *bitmap, long nbits)
 {
     long k, lim = nbits / BITS_PER_LONG, result = 0;
 
-    for (k = 0; k < lim; k++) {
+    for (k = bitmap_find_next_nonzero_word(bitmap, 0, lim); k < lim;
+         k = bitmap_find_next_nonzero_word(bitmap, k + 1, lim)) {
         result += ctpopl(bitmap[k]);
     }
+    k = lim;
 
     if (nbits % BITS_PER_LONG) {
         result += ctpopl(bitmap[k] & BITMAP_LAST_WORD_MASK(nbits));
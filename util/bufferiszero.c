@@ -24,8 +24,11 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "qemu/bswap.h"
+#include "qemu/bitmap.h"
 #include "host/cpuinfo.h"
 
+typedef bool (*biz_accel_fn)(const void *, size_t);
+
 static bool
 buffer_zero_int(const void *buf, size_t len)
 {
@@ -64,7 +67,83 @@ buffer_zero_int(const void *buf, size_t len)
     }
 }
 
-#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT) || \
+    defined(__SSE2__) || defined(__aarch64__)
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+
+/* Note that the AdvSIMD function requires len >= 64.  */
+
+static bool buffer_zero_neon(const void *buf, size_t len)
+{
+    uint64x2_t t = vld1q_u64(buf);
+    const uint64x2_t *p = (uint64x2_t *)(((uintptr_t)buf + 5 * 16) & -16);
+    const uint64x2_t *e = (uint64x2_t *)(((uintptr_t)buf + len) & -16);
+
+    /* Loop over 16-byte aligned blocks of 64.  */
+    while (likely(p <= e)) {
+        __builtin_prefetch(p);
+        if (unlikely(vmaxvq_u32(vreinterpretq_u32_u64(t)))) {
+            return false;
+        }
+        t = vorrq_u64(vorrq_u64(p[-4], p[-3]), vorrq_u64(p[-2], p[-1]));
+        p += 4;
+    }
+
+    /* Finish the aligned tail.  */
+    t = vorrq_u64(t, e[-3]);
+    t = vorrq_u64(t, e[-2]);
+    t = vorrq_u64(t, e[-1]);
+
+    /* Finish the unaligned tail.  */
+    t = vorrq_u64(t, vld1q_u64(buf + len - 16));
+
+    return vmaxvq_u32(vreinterpretq_u32_u64(t)) == 0;
+}
+
+#ifdef CONFIG_ARM_SVE_OPT
+#pragma GCC push_options
+#pragma GCC target("+sve")
+#include <arm_sve.h>
+
+/*
+ * The vector length is only known at run time; predicated loads let
+ * the loop handle the unaligned tail as well, whatever its size.
+ */
+static bool buffer_zero_sve(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    const uint64_t vl = svcntb();
+    const svbool_t all = svptrue_b8();
+    uint64_t i = 0;
+
+    for (; i + 4 * vl <= len; i += 4 * vl) {
+        svuint8_t t0 = svld1(all, p + i);
+        svuint8_t t1 = svld1(all, p + i + vl);
+        svuint8_t t2 = svld1(all, p + i + 2 * vl);
+        svuint8_t t3 = svld1(all, p + i + 3 * vl);
+
+        __builtin_prefetch(p + i + 4 * vl);
+        t0 = svorr_x(all, svorr_x(all, t0, t1), svorr_x(all, t2, t3));
+        if (unlikely(svptest_any(all, svcmpne(all, t0, 0)))) {
+            return false;
+        }
+    }
+    for (; i < len; i += vl) {
+        svbool_t pg = svwhilelt_b8(i, (uint64_t)len);
+
+        if (svptest_any(pg, svcmpne(pg, svld1(pg, p + i), 0))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#pragma GCC pop_options
+#endif /* CONFIG_ARM_SVE_OPT */
+
+#else
 #include <immintrin.h>
 
 /* Note that each of these vectorized functions require len >= 64.  */
@@ -184,16 +263,22 @@ buffer_zero_avx512(const void *buf, size_t len)
 
 }
 #endif /* CONFIG_AVX512F_OPT */
+#endif /* __aarch64__ */
 
 /*
  * Make sure that these variables are appropriately initialized when
  * SSE2 is enabled on the compiler command-line, but the compiler is
  * too old to support CONFIG_AVX2_OPT.
  */
-#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT) || \
+    defined(CONFIG_ARM_SVE_OPT)
 # define INIT_USED     0
 # define INIT_LENGTH   0
 # define INIT_ACCEL    buffer_zero_int
+#elif defined(__aarch64__)
+# define INIT_USED     CPUINFO_ADVSIMD
+# define INIT_LENGTH   64
+# define INIT_ACCEL    buffer_zero_neon
 #else
 # ifndef __SSE2__
 #  error "ISA selection confusion"
@@ -205,7 +290,7 @@ buffer_zero_avx512(const void *buf, size_t len)
 
 static unsigned used_accel = INIT_USED;
 static unsigned length_to_accel = INIT_LENGTH;
-static bool (*buffer_accel)(const void *, size_t) = INIT_ACCEL;
+static biz_accel_fn buffer_accel = INIT_ACCEL;
 
 static unsigned __attribute__((noinline))
 select_accel_cpuinfo(unsigned info)
@@ -214,8 +299,14 @@ select_accel_cpuinfo(unsigned info)
     static const struct {
         unsigned bit;
         unsigned len;
-        bool (*fn)(const void *, size_t);
+        biz_accel_fn fn;
     } all[] = {
+#if defined(__aarch64__)
+#ifdef CONFIG_ARM_SVE_OPT
+        { CPUINFO_SVE,      64, buffer_zero_sve },
+#endif
+        { CPUINFO_ADVSIMD,  64, buffer_zero_neon },
+#else
 #ifdef CONFIG_AVX512F_OPT
         { CPUINFO_AVX512F, 256, buffer_zero_avx512 },
 #endif
@@ -224,6 +315,7 @@ select_accel_cpuinfo(unsigned info)
         { CPUINFO_SSE4,     64, buffer_zero_sse4 },
 #endif
         { CPUINFO_SSE2,     64, buffer_zero_sse2 },
+#endif
         { CPUINFO_ALWAYS,    0, buffer_zero_int },
     };
 
@@ -237,12 +329,13 @@ select_accel_cpuinfo(unsigned info)
     return 0;
 }
 
-#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT) || \
+    defined(CONFIG_ARM_SVE_OPT)
 static void __attribute__((constructor)) init_accel(void)
 {
     used_accel = select_accel_cpuinfo(cpuinfo_init());
 }
-#endif /* CONFIG_AVX2_OPT */
+#endif
 
 bool test_buffer_is_zero_next_accel(void)
 {
@@ -256,15 +349,21 @@ bool test_buffer_is_zero_next_accel(void)
     return used;
 }
 
-static bool select_accel_fn(const void *buf, size_t len)
+static biz_accel_fn select_accel_len(size_t len)
 {
     if (likely(len >= length_to_accel)) {
-        return buffer_accel(buf, len);
+        return buffer_accel;
     }
-    return buffer_zero_int(buf, len);
+    return buffer_zero_int;
+}
+
+static bool select_accel_fn(const void *buf, size_t len)
+{
+    return select_accel_len(len)(buf, len);
 }
 
 #else
+#define select_accel_len(len)  buffer_zero_int
 #define select_accel_fn  buffer_zero_int
 bool test_buffer_is_zero_next_accel(void)
 {
@@ -288,3 +387,37 @@ bool buffer_is_zero(const void *buf, size_t len)
        includes a check for an unrolled loop over 64-bit integers.  */
     return select_accel_fn(buf, len);
 }
+
+/*
+ * Checks which of @n buffers of @len bytes are all zeroes, setting their
+ * bit in @zero and clearing the others.  The accelerator is selected once
+ * for all of them, and each buffer is fetched while the previous one is
+ * checked.  Returns the number of buffers that are all zeroes.
+ */
+size_t buffer_is_zero_batch(const void * const *bufs, size_t n, size_t len,
+                            unsigned long *zero)
+{
+    biz_accel_fn fn = select_accel_len(len);
+    size_t count = 0;
+
+    if (unlikely(len == 0)) {
+        bitmap_set(zero, 0, n);
+        return n;
+    }
+
+    if (n) {
+        __builtin_prefetch(bufs[0]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (i + 1 < n) {
+            __builtin_prefetch(bufs[i + 1]);
+        }
+        if (fn(bufs[i], len)) {
+            set_bit(i, zero);
+            count++;
+        } else {
+            clear_bit(i, zero);
+        }
+    }
+    return count;
+}
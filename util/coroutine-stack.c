@@ -0,0 +1,127 @@
+/*
+ * Coroutine stack arena
+ *
+ * Coroutine stacks are carved out of large mappings rather than mapped one
+ * by one, so that bursts of coroutine creation do not turn into bursts of
+ * mmap()/munmap() calls.  Stacks that are freed go back to the arena after
+ * their memory is released with madvise(); mapping and guard pages are
+ * kept, and the memory is only committed again when the next user of the
+ * stack touches it.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/coroutine_int.h"
+#include "qemu/madvise.h"
+#include "qemu/thread.h"
+
+/* Stacks per mapping; each one has its own guard page */
+#define STACKS_PER_CHUNK 32
+
+static QemuMutex stack_lock;
+static GPtrArray *free_stacks;
+static size_t stack_slot_size;
+static uint64_t stacks_in_use;
+static uint64_t stack_bytes_reserved;
+
+static void stack_arena_grow(void)
+{
+    size_t pagesz = qemu_real_host_page_size();
+    size_t len = stack_slot_size * STACKS_PER_CHUNK;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *ptr;
+    int i;
+
+#if defined(MAP_STACK) && defined(__OpenBSD__)
+    /* See qemu_alloc_stack() */
+    flags |= MAP_STACK;
+#endif
+
+    ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("failed to allocate memory for coroutine stacks");
+        abort();
+    }
+
+    /* Stacks grow down -- guard page at the bottom of each one */
+    for (i = STACKS_PER_CHUNK - 1; i >= 0; i--) {
+        void *stack = ptr + i * stack_slot_size;
+
+        if (mprotect(stack, pagesz, PROT_NONE) != 0) {
+            perror("failed to set up stack guard page");
+            abort();
+        }
+        g_ptr_array_add(free_stacks, stack);
+    }
+    stack_bytes_reserved += len;
+}
+
+void *qemu_coroutine_stack_alloc(size_t *sz)
+{
+    void *stack;
+
+    /*
+     * Stack usage is measured by qemu_free_stack(), and odd sizes cannot
+     * be recycled.
+     */
+    if (IS_ENABLED(CONFIG_DEBUG_STACK_USAGE) ||
+        *sz != COROUTINE_STACK_SIZE) {
+        return qemu_alloc_stack(sz);
+    }
+
+    qemu_mutex_lock(&stack_lock);
+    if (!free_stacks->len) {
+        stack_arena_grow();
+    }
+    stack = g_ptr_array_remove_index_fast(free_stacks, free_stacks->len - 1);
+    stacks_in_use++;
+    qemu_mutex_unlock(&stack_lock);
+
+    *sz = stack_slot_size;
+    return stack;
+}
+
+void qemu_coroutine_stack_free(void *stack, size_t sz)
+{
+    size_t pagesz = qemu_real_host_page_size();
+    void *usable = stack + pagesz;
+
+    if (IS_ENABLED(CONFIG_DEBUG_STACK_USAGE) || sz != stack_slot_size) {
+        qemu_free_stack(stack, sz);
+        return;
+    }
+
+    /*
+     * MADV_FREE lets the kernel reclaim the pages lazily, so the next user
+     * of the stack usually finds them still there.
+     */
+#ifdef MADV_FREE
+    if (madvise(usable, sz - pagesz, MADV_FREE) != 0)
+#endif
+    {
+        qemu_madvise(usable, sz - pagesz, QEMU_MADV_DONTNEED);
+    }
+
+    qemu_mutex_lock(&stack_lock);
+    g_ptr_array_add(free_stacks, stack);
+    stacks_in_use--;
+    qemu_mutex_unlock(&stack_lock);
+}
+
+void qemu_coroutine_stack_stats(CoroutineStats *stats)
+{
+    qemu_mutex_lock(&stack_lock);
+    stats->stacks = stacks_in_use;
+    stats->stack_bytes_reserved = stack_bytes_reserved;
+    qemu_mutex_unlock(&stack_lock);
+}
+
+static void __attribute__((constructor)) qemu_coroutine_stack_init(void)
+{
+    size_t pagesz = qemu_real_host_page_size();
+
+    qemu_mutex_init(&stack_lock);
+    free_stacks = g_ptr_array_new();
+    stack_slot_size = ROUND_UP(COROUTINE_STACK_SIZE, pagesz) + pagesz;
+}
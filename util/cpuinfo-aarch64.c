@@ -16,6 +16,12 @@
 # ifndef HWCAP2_BTI
 #  define HWCAP2_BTI 0  /* added in glibc 2.32 */
 # endif
+# ifndef HWCAP_SVE
+#  define HWCAP_SVE 0  /* added in glibc 2.27 */
+# endif
+# ifndef HWCAP2_SVE2
+#  define HWCAP2_SVE2 0  /* added in glibc 2.31 */
+# endif
 #endif
 #ifdef CONFIG_DARWIN
 # include <sys/sysctl.h>
@@ -53,7 +59,8 @@ unsigned __attribute__((constructor)) cpuinfo_init(void)
         return info;
     }
 
-    info = CPUINFO_ALWAYS;
+    /* AdvSIMD is part of the base ABI for all of our aarch64 hosts. */
+    info = CPUINFO_ALWAYS | CPUINFO_ADVSIMD;
 
 #ifdef CONFIG_LINUX
     unsigned long hwcap = qemu_getauxval(AT_HWCAP);
@@ -61,9 +68,11 @@ unsigned __attribute__((constructor)) cpuinfo_init(void)
     info |= (hwcap & HWCAP_USCAT ? CPUINFO_LSE2 : 0);
     info |= (hwcap & HWCAP_AES ? CPUINFO_AES : 0);
     info |= (hwcap & HWCAP_PMULL ? CPUINFO_PMULL : 0);
+    info |= (hwcap & HWCAP_SVE ? CPUINFO_SVE : 0);
 
     unsigned long hwcap2 = qemu_getauxval(AT_HWCAP2);
     info |= (hwcap2 & HWCAP2_BTI ? CPUINFO_BTI : 0);
+    info |= (hwcap2 & HWCAP2_SVE2 ? CPUINFO_SVE2 : 0);
 #endif
 #ifdef CONFIG_DARWIN
     info |= sysctl_for_bool("hw.optional.arm.FEAT_LSE") * CPUINFO_LSE;
@@ -50,8 +50,25 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * The last level makes up almost all of the memory, so it is split in
+ * chunks of HB_CHUNK_WORDS words that are only allocated once a bit in
+ * them is set.  Chunks that were never written all point to a single
+ * read-only chunk of zeroes, so that lookups need no extra test.  For large
+ * disks that are mostly clean, memory usage and the cost of merging are
+ * then proportional to the dirty data, plus one pointer per chunk and the
+ * (BITS_PER_LONG times smaller) upper levels.
  */
 
+/* Words in a chunk of the last level, i.e. 4 KiB on 64-bit hosts */
+#define HB_CHUNK_SHIFT  9
+#define HB_CHUNK_WORDS  (1UL << HB_CHUNK_SHIFT)
+#define HB_CHUNK_MASK   (HB_CHUNK_WORDS - 1)
+/* Bits in a chunk of the last level */
+#define HB_CHUNK_BITS   (HB_CHUNK_WORDS << BITS_PER_LEVEL)
+
+static const unsigned long hb_zero_chunk[HB_CHUNK_WORDS];
+
 struct HBitmap {
     /*
      * Size of the bitmap, as requested in hbitmap_alloc or in hbitmap_truncate.
@@ -93,14 +110,97 @@ struct HBitmap {
      * actual bitmap.
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
-     * bitmap will still allocate HBITMAP_LEVELS arrays.
+     * bitmap will still allocate HBITMAP_LEVELS arrays.  The last level
+     * is kept in @leaves rather than here.
      */
     unsigned long *levels[HBITMAP_LEVELS];
 
-    /* The length of each levels[] array. */
+    /* The chunks of the last level; unused ones point to hb_zero_chunk. */
+    unsigned long **leaves;
+
+    /* The length of each level, in words. */
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+static inline uint64_t hb_chunks(uint64_t words)
+{
+    return DIV_ROUND_UP(words, HB_CHUNK_WORDS);
+}
+
+static inline unsigned long hb_leaf(const HBitmap *hb, uint64_t pos)
+{
+    return hb->leaves[pos >> HB_CHUNK_SHIFT][pos & HB_CHUNK_MASK];
+}
+
+static inline unsigned long hb_word(const HBitmap *hb, int level, uint64_t pos)
+{
+    if (level == HBITMAP_LEVELS - 1) {
+        return hb_leaf(hb, pos);
+    }
+    return hb->levels[level][pos];
+}
+
+/* Return a pointer to word @pos of @level, so that it can be modified.
+ * A chunk of the last level that has never been written is allocated if
+ * @alloc is true; otherwise NULL is returned, as all of its bits are clear.
+ */
+static unsigned long *hb_word_ptr(HBitmap *hb, int level, uint64_t pos,
+                                  bool alloc)
+{
+    unsigned long **chunk;
+
+    if (level < HBITMAP_LEVELS - 1) {
+        return &hb->levels[level][pos];
+    }
+
+    chunk = &hb->leaves[pos >> HB_CHUNK_SHIFT];
+    if (*chunk == hb_zero_chunk) {
+        if (!alloc) {
+            return NULL;
+        }
+        *chunk = g_new0(unsigned long, HB_CHUNK_WORDS);
+    }
+    return &(*chunk)[pos & HB_CHUNK_MASK];
+}
+
+/* Initialize chunks [@first, @end) of the last level as unused. */
+static void hb_init_chunks(HBitmap *hb, uint64_t first, uint64_t end)
+{
+    uint64_t c;
+
+    for (c = first; c < end; c++) {
+        hb->leaves[c] = (unsigned long *)hb_zero_chunk;
+    }
+}
+
+/* Free chunks [@first, @end) of the last level, whose bits must be clear. */
+static void hb_free_chunks(HBitmap *hb, uint64_t first, uint64_t end)
+{
+    uint64_t c;
+
+    for (c = first; c < end; c++) {
+        if (hb->leaves[c] != hb_zero_chunk) {
+            g_free(hb->leaves[c]);
+            hb->leaves[c] = (unsigned long *)hb_zero_chunk;
+        }
+    }
+}
+
+/* Fill @count words of the last level starting at @pos with byte @c. */
+static void hb_fill_leaves(HBitmap *hb, uint64_t pos, uint64_t count, int c)
+{
+    while (count) {
+        uint64_t n = MIN(count, HB_CHUNK_WORDS - (pos & HB_CHUNK_MASK));
+        unsigned long *elem = hb_word_ptr(hb, HBITMAP_LEVELS - 1, pos, c != 0);
+
+        if (elem) {
+            memset(elem, c, n * sizeof(unsigned long));
+        }
+        pos += n;
+        count -= n;
+    }
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -136,7 +236,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -149,7 +249,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_leaf(hbi->hb, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -182,7 +282,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -220,8 +320,7 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -240,20 +339,43 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     /* There may be some zero bits in @cur before @start. We are not interested
      * in them, let's set them.
      */
+    cur = hb_leaf(hb, pos);
     start_bit_offset = (start >> hb->granularity) & (BITS_PER_LONG - 1);
     cur |= (1UL << start_bit_offset) - 1;
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+        pos++;
+
+        while (pos < sz) {
+            const unsigned long *chunk = hb->leaves[pos >> HB_CHUNK_SHIFT];
+            size_t base = pos & ~HB_CHUNK_MASK;
+            size_t end = MIN(sz, base + HB_CHUNK_WORDS);
+
+            /*
+             * Long runs of dirty words are common in a mostly dirty bitmap;
+             * check four words at a time, which the compiler can turn into
+             * a single vector comparison.
+             */
+            while (pos + 4 <= end &&
+                   (chunk[pos - base] & chunk[pos - base + 1] &
+                    chunk[pos - base + 2] & chunk[pos - base + 3]) ==
+                   (unsigned long)-1) {
+                pos += 4;
+            }
+            while (pos < end && chunk[pos - base] == (unsigned long)-1) {
+                pos++;
+            }
+            if (pos < end) {
+                break;
+            }
+        }
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_leaf(hb, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -434,23 +556,26 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     size_t pos = start >> BITS_PER_LEVEL;
     size_t lastpos = last >> BITS_PER_LEVEL;
     bool changed = false;
+    unsigned long *elem;
     size_t i;
 
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
+        changed |= hb_set_elem(hb_word_ptr(hb, level, i, true),
+                               start, next - 1);
         for (;;) {
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+            elem = hb_word_ptr(hb, level, i, true);
+            changed |= (*elem == 0);
+            *elem = ~0UL;
         }
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_elem(hb_word_ptr(hb, level, i, true), start, last);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -512,6 +637,7 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
     size_t pos = start >> BITS_PER_LEVEL;
     size_t lastpos = last >> BITS_PER_LEVEL;
     bool changed = false;
+    unsigned long *elem;
     size_t i;
 
     i = pos;
@@ -523,7 +649,8 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        elem = hb_word_ptr(hb, level, i, false);
+        if (elem && hb_reset_elem(elem, start, next - 1)) {
             changed = true;
         } else {
             pos++;
@@ -535,13 +662,17 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+            elem = hb_word_ptr(hb, level, i, false);
+            if (elem) {
+                changed |= (*elem != 0);
+                *elem = 0UL;
+            }
         }
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    elem = hb_word_ptr(hb, level, i, false);
+    if (elem && hb_reset_elem(elem, start, last)) {
         changed = true;
     } else {
         lastpos--;
@@ -581,6 +712,15 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
         hb->meta) {
         hbitmap_set(hb->meta, start, count);
     }
+
+    /* Give back the chunks that the range covers entirely.  Partially
+     * covered ones are kept, so that toggling a few bits back and forth
+     * does not allocate and free a chunk every time.
+     */
+    hb_free_chunks(hb, DIV_ROUND_UP(first, HB_CHUNK_BITS),
+                   last + 1 == hb->size ?
+                   hb_chunks(hb->sizes[HBITMAP_LEVELS - 1]) :
+                   (last + 1) / HB_CHUNK_BITS);
 }
 
 void hbitmap_reset_all(HBitmap *hb)
@@ -588,7 +728,8 @@ void hbitmap_reset_all(HBitmap *hb)
     unsigned int i;
 
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
-    for (i = HBITMAP_LEVELS; --i >= 1; ) {
+    hb_free_chunks(hb, 0, hb_chunks(hb->sizes[HBITMAP_LEVELS - 1]));
+    for (i = HBITMAP_LEVELS - 1; --i >= 1; ) {
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
     }
 
@@ -621,7 +762,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_leaf(hb, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -638,7 +779,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -652,20 +793,19 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
 uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
-    uint64_t el_count;
-    unsigned long *cur;
+    uint64_t first_el, el_count;
 
     if (!count) {
         return 0;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
+    serialization_chunk(hb, start, count, &first_el, &el_count);
 
     return el_count * sizeof(unsigned long);
 }
@@ -673,8 +813,7 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
 void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
-    uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end, el_count;
 
     if (!count) {
         return;
@@ -683,9 +822,9 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        unsigned long el = hb_leaf(hb, cur);
 
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
         cur++;
@@ -696,8 +835,8 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               uint64_t start, uint64_t count,
                               bool finish)
 {
-    uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end, el_count;
+    unsigned long el, *elem;
 
     if (!count) {
         return;
@@ -706,12 +845,13 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
+        memcpy(&el, buf, sizeof(el));
+        el = (BITS_PER_LONG == 32 ? le32_to_cpu(el) : le64_to_cpu(el));
 
-        if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
-        } else {
-            le64_to_cpus((uint64_t *)cur);
+        /* Chunks that only receive zeroes are left unallocated */
+        elem = hb_word_ptr(hb, HBITMAP_LEVELS - 1, cur, el != 0);
+        if (elem) {
+            *elem = el;
         }
 
         buf += sizeof(unsigned long);
@@ -725,15 +865,14 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
 void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
-    uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, el_count;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    hb_fill_leaves(hb, first, el_count, 0);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -742,15 +881,14 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
 void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
-    uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, el_count;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    hb_fill_leaves(hb, first, el_count, 0xff);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -770,7 +908,7 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
+            if (hb_word(bitmap, lev + 1, i)) {
                 bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
                     1UL << (i & (BITS_PER_LONG - 1));
             }
@@ -785,7 +923,9 @@ void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
     assert(!hb->meta);
-    for (i = HBITMAP_LEVELS; i-- > 0; ) {
+    hb_free_chunks(hb, 0, hb_chunks(hb->sizes[HBITMAP_LEVELS - 1]));
+    g_free(hb->leaves);
+    for (i = HBITMAP_LEVELS - 1; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
     g_free(hb);
@@ -808,7 +948,12 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
+        if (i == HBITMAP_LEVELS - 1) {
+            hb->leaves = g_new(unsigned long *, hb_chunks(size));
+            hb_init_chunks(hb, 0, hb_chunks(size));
+        } else {
+            hb->levels[i] = g_new0(unsigned long, size);
+        }
     }
 
     /* We necessarily have free bits in level 0 due to the definition
@@ -862,6 +1007,18 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         }
         old = hb->sizes[i];
         hb->sizes[i] = size;
+        if (i == HBITMAP_LEVELS - 1) {
+            /* Bits past the new end were reset above, and words past the
+             * old end of the last chunk were never written, so only whole
+             * chunks need to be freed or added.
+             */
+            if (shrink) {
+                hb_free_chunks(hb, hb_chunks(size), hb_chunks(old));
+            }
+            hb->leaves = g_renew(unsigned long *, hb->leaves, hb_chunks(size));
+            hb_init_chunks(hb, hb_chunks(old), hb_chunks(size));
+            continue;
+        }
         hb->levels[i] = g_renew(unsigned long, hb->levels[i], size);
         if (!shrink) {
             memset(&hb->levels[i][old], 0x00,
@@ -900,8 +1057,10 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
  */
 void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
+    const int last = HBITMAP_LEVELS - 1;
+    const uint64_t up_words = HB_CHUNK_WORDS >> BITS_PER_LEVEL;
+    uint64_t c, j, end;
     int i;
-    uint64_t j;
 
     assert(a->orig_size == result->orig_size);
     assert(b->orig_size == result->orig_size);
@@ -929,12 +1088,35 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* Only the chunks of the last level that are in use in either bitmap,
+     * and the words of the level above that cover them, need to be merged;
+     * the levels above that are BITS_PER_LONG^2 times smaller than the
+     * bitmap and are merged whole.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    if (a != result && b != result) {
+        hbitmap_reset_all(result);
+    }
+    for (c = 0; c < hb_chunks(a->sizes[last]); c++) {
+        const unsigned long *ca = a->leaves[c];
+        const unsigned long *cb = b->leaves[c];
+        unsigned long *cr;
+
+        if (ca == hb_zero_chunk && cb == hb_zero_chunk) {
+            continue;
+        }
+        cr = hb_word_ptr(result, last, c << HB_CHUNK_SHIFT, true);
+        for (j = 0; j < HB_CHUNK_WORDS; j++) {
+            cr[j] = ca[j] | cb[j];
+        }
+
+        end = MIN((c + 1) * up_words, a->sizes[last - 1]);
+        for (j = c * up_words; j < end; j++) {
+            result->levels[last - 1][j] = a->levels[last - 1][j] |
+                                          b->levels[last - 1][j];
+        }
+    }
+    for (i = last - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
@@ -946,10 +1128,18 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
-    size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    uint64_t words = bitmap->sizes[HBITMAP_LEVELS - 1];
+    uint64_t c, chunks = hb_chunks(words);
+    g_autofree struct iovec *iov = g_new(struct iovec, chunks);
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+
+    /* Hash the same data as if the last level was a single array */
+    for (c = 0; c < chunks; c++) {
+        iov[c].iov_base = bitmap->leaves[c];
+        iov[c].iov_len = MIN(words - (c << HB_CHUNK_SHIFT), HB_CHUNK_WORDS) *
+                         sizeof(unsigned long);
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, chunks, &hash, errp);
 
     return hash;
 }
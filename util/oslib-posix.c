@@ -399,13 +399,16 @@ static void *do_madv_populate_write_pages(void *arg)
 }
 
 static inline int get_memset_num_threads(size_t hpagesize, size_t numpages,
-                                         int max_threads)
+                                         int max_threads, int n_tcs)
 {
     long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
     int ret = 1;
 
     if (host_procs > 0) {
         ret = MIN(MIN(host_procs, MAX_MEM_PREALLOC_THREAD_COUNT), max_threads);
+        /* Each context, usually a host NUMA node, gets its own threads */
+        ret = MIN(ret * MAX(n_tcs, 1), host_procs);
+        ret = MAX(ret, n_tcs);
     }
 
     /* Especially with gigantic pages, don't create more threads than pages. */
@@ -434,8 +437,8 @@ static int wait_and_free_mem_prealloc_context(MemsetContext *context)
 }
 
 static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
-                           int max_threads, ThreadContext *tc, bool async,
-                           bool use_madv_populate_write)
+                           int max_threads, ThreadContext **tcs, int n_tcs,
+                           bool async, bool use_madv_populate_write)
 {
     static gsize initialized = 0;
     MemsetContext *context = g_malloc0(sizeof(MemsetContext));
@@ -448,12 +451,12 @@ static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
      * Asynchronous preallocation is only allowed when using MADV_POPULATE_WRITE
      * and prealloc context for thread placement.
      */
-    if (!use_madv_populate_write || !tc) {
+    if (!use_madv_populate_write || !n_tcs) {
         async = false;
     }
 
     context->num_threads =
-        get_memset_num_threads(hpagesize, numpages, max_threads);
+        get_memset_num_threads(hpagesize, numpages, max_threads, n_tcs);
 
     if (g_once_init_enter(&initialized)) {
         qemu_mutex_init(&page_mutex);
@@ -464,9 +467,9 @@ static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
     if (use_madv_populate_write) {
         /*
          * Avoid creating a single thread for MADV_POPULATE_WRITE when
-         * preallocating synchronously.
+         * preallocating synchronously and the thread need not be placed.
          */
-        if (context->num_threads == 1 && !async) {
+        if (context->num_threads == 1 && !async && !n_tcs) {
             ret = 0;
             if (qemu_madvise(area, hpagesize * numpages,
                              QEMU_MADV_POPULATE_WRITE)) {
@@ -484,6 +487,10 @@ static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
     numpages_per_thread = numpages / context->num_threads;
     leftover = numpages % context->num_threads;
     for (i = 0; i < context->num_threads; i++) {
+        /* Consecutive threads, and thus ranges, share a context */
+        ThreadContext *tc = n_tcs ?
+            tcs[(size_t)i * n_tcs / context->num_threads] : NULL;
+
         context->threads[i].addr = addr;
         context->threads[i].numpages = numpages_per_thread + (i < leftover);
         context->threads[i].hpagesize = hpagesize;
@@ -501,16 +508,6 @@ static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
         addr += context->threads[i].numpages * hpagesize;
     }
 
-    if (async) {
-        /*
-         * async requests currently require the BQL. Add it to the list and kick
-         * preallocation off during qemu_finish_async_prealloc_mem().
-         */
-        assert(bql_locked());
-        QLIST_INSERT_HEAD(&memset_contexts, context, next);
-        return 0;
-    }
-
     if (!use_madv_populate_write) {
         sigbus_memset_context = context;
     }
@@ -520,6 +517,19 @@ static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
     qemu_cond_broadcast(&page_cond);
     qemu_mutex_unlock(&page_mutex);
 
+    if (async) {
+        /*
+         * async requests currently require the BQL.  The threads keep
+         * populating in the background, overlapping with the rest of machine
+         * creation; qemu_finish_async_prealloc_mem() collects them.
+         * MADV_POPULATE_WRITE does not modify memory content, so the guest
+         * RAM may already be written to in the meantime.
+         */
+        assert(bql_locked());
+        QLIST_INSERT_HEAD(&memset_contexts, context, next);
+        return 0;
+    }
+
     ret = wait_and_free_mem_prealloc_context(context);
 
     if (!use_madv_populate_write) {
@@ -535,17 +545,6 @@ bool qemu_finish_async_prealloc_mem(Error **errp)
 
     /* Waiting for preallocation requires the BQL. */
     assert(bql_locked());
-    if (QLIST_EMPTY(&memset_contexts)) {
-        return true;
-    }
-
-    qemu_mutex_lock(&page_mutex);
-    QLIST_FOREACH(context, &memset_contexts, next) {
-        context->all_threads_created = true;
-    }
-    qemu_cond_broadcast(&page_cond);
-    qemu_mutex_unlock(&page_mutex);
-
     QLIST_FOREACH_SAFE(context, &memset_contexts, next, next_context) {
         QLIST_REMOVE(context, next);
         tmp = wait_and_free_mem_prealloc_context(context);
@@ -570,6 +569,14 @@ static bool madv_populate_write_possible(char *area, size_t pagesize)
 
 bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
                        ThreadContext *tc, bool async, Error **errp)
+{
+    return qemu_prealloc_mem_nodes(fd, area, sz, max_threads,
+                                   tc ? &tc : NULL, tc ? 1 : 0, async, errp);
+}
+
+bool qemu_prealloc_mem_nodes(int fd, char *area, size_t sz, int max_threads,
+                             ThreadContext **tcs, int n_tcs, bool async,
+                             Error **errp)
 {
     static gsize initialized;
     int ret;
@@ -611,8 +618,8 @@ bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
     }
 
     /* touch pages simultaneously */
-    ret = touch_all_pages(area, hpagesize, numpages, max_threads, tc, async,
-                          use_madv_populate_write);
+    ret = touch_all_pages(area, hpagesize, numpages, max_threads, tcs, n_tcs,
+                          async, use_madv_populate_write);
     if (ret) {
         error_setg_errno(errp, -ret,
                          "qemu_prealloc_mem: preallocating memory failed");
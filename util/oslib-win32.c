@@ -266,6 +266,14 @@ int getpagesize(void)
 
 bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
                        ThreadContext *tc, bool async, Error **errp)
+{
+    return qemu_prealloc_mem_nodes(fd, area, sz, max_threads, NULL, 0, false,
+                                   errp);
+}
+
+bool qemu_prealloc_mem_nodes(int fd, char *area, size_t sz, int max_threads,
+                             ThreadContext **tcs, int n_tcs, bool async,
+                             Error **errp)
 {
     int i;
     size_t pagesize = qemu_real_host_page_size();
@@ -19,6 +19,7 @@
 #include "qemu/coroutine_int.h"
 #include "qemu/coroutine-tls.h"
 #include "qemu/cutils.h"
+#include "qemu/stats64.h"
 #include "block/aio.h"
 
 enum {
@@ -64,8 +65,13 @@ static CoroutinePool global_pool = QSLIST_HEAD_INITIALIZER(global_pool);
 static unsigned int global_pool_size;
 static unsigned int global_pool_max_size = COROUTINE_POOL_BATCH_MAX_SIZE;
 
+static Stat64 pool_hits;
+static Stat64 pool_misses;
+
 QEMU_DEFINE_STATIC_CO_TLS(CoroutinePool, local_pool);
 QEMU_DEFINE_STATIC_CO_TLS(Notifier, local_pool_cleanup_notifier);
+/* Pool hits not yet added to pool_hits, to keep atomics off the fast path */
+QEMU_DEFINE_STATIC_CO_TLS(unsigned int, local_pool_hits);
 
 static CoroutinePoolBatch *coroutine_pool_batch_new(void)
 {
@@ -178,11 +184,23 @@ static Coroutine *coroutine_pool_get(void)
 {
     Coroutine *co;
 
+    unsigned int hits;
+
     co = coroutine_pool_get_local();
     if (!co) {
         coroutine_pool_refill_local();
         co = coroutine_pool_get_local();
+        if (!co) {
+            return NULL;
+        }
+    }
+
+    hits = get_local_pool_hits() + 1;
+    if (hits == COROUTINE_POOL_BATCH_MAX_SIZE) {
+        stat64_add(&pool_hits, hits);
+        hits = 0;
     }
+    set_local_pool_hits(hits);
     return co;
 }
 
@@ -223,6 +241,7 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
     }
 
     if (!co) {
+        stat64_add(&pool_misses, 1);
         co = qemu_coroutine_new();
     }
 
@@ -361,6 +380,16 @@ void qemu_coroutine_dec_pool_size(unsigned int removing_pool_size)
     global_pool_max_size -= removing_pool_size;
 }
 
+void qemu_coroutine_get_stats(CoroutineStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+#ifndef _WIN32
+    qemu_coroutine_stack_stats(stats);
+#endif
+    stats->pool_hits = stat64_get(&pool_hits);
+    stats->pool_misses = stat64_get(&pool_misses);
+}
+
 static unsigned int get_global_pool_hard_max_size(void)
 {
 #ifdef __linux__
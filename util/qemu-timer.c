@@ -61,12 +61,35 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
  * used by different AioContexts / threads. Each clock also has
  * a list of the QEMUTimerLists associated with it, in order that
  * reenabling the clock can call all the notifiers.
+ *
+ * Pending timers are kept in a hierarchical timer wheel, so that they
+ * can be added and removed without walking a sorted list.  Level L of
+ * the wheel holds the timers whose expiry time first differs from
+ * wheel_time in bits [L * TIMER_WHEEL_BITS, (L + 1) * TIMER_WHEEL_BITS),
+ * in the slot given by those bits of the expiry time.  Hence all timers
+ * of a level expire before those of the next, and slots of a level are
+ * ordered by expiry time.  wheel_time only moves forward up to the
+ * earliest deadline, at which point the slots that it enters are
+ * spread over lower levels.  Timers that are added with an expiry time
+ * before wheel_time are rare, and go to a sorted list of their own.
  */
 
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  DIV_ROUND_UP(64, TIMER_WHEEL_BITS)
+
+typedef QTAILQ_HEAD(, QEMUTimer) QEMUTimerSlot;
+
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
+    /* The timer that expires first, or NULL */
     QEMUTimer *active_timers;
+    QEMUTimerSlot expired;
+    int64_t wheel_time;
+    uint32_t level_mask;
+    uint64_t slot_mask[TIMER_WHEEL_LEVELS];
+    QEMUTimerSlot wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -93,14 +116,156 @@ static bool timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+static QEMUTimerSlot *timer_wheel_slot(QEMUTimerList *timer_list,
+                                       int64_t expire_time,
+                                       unsigned *level, unsigned *slot)
+{
+    uint64_t diff = expire_time ^ timer_list->wheel_time;
+
+    if (expire_time < timer_list->wheel_time) {
+        return &timer_list->expired;
+    }
+    *level = diff ? (63 - clz64(diff)) / TIMER_WHEEL_BITS : 0;
+    *slot = (expire_time >> (*level * TIMER_WHEEL_BITS)) &
+            (TIMER_WHEEL_SLOTS - 1);
+    return &timer_list->wheel[*level][*slot];
+}
+
+static void timer_wheel_insert(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    unsigned level = 0, slot = 0;
+    QEMUTimerSlot *head = timer_wheel_slot(timer_list, ts->expire_time,
+                                           &level, &slot);
+    QEMUTimer *t;
+
+    if (head == &timer_list->expired) {
+        /* Timers with the same expiry time run in the order they were set */
+        QTAILQ_FOREACH(t, head, node) {
+            if (t->expire_time > ts->expire_time) {
+                QTAILQ_INSERT_BEFORE(t, ts, node);
+                return;
+            }
+        }
+        QTAILQ_INSERT_TAIL(head, ts, node);
+        return;
+    }
+
+    QTAILQ_INSERT_TAIL(head, ts, node);
+    timer_list->slot_mask[level] |= 1ull << slot;
+    timer_list->level_mask |= 1u << level;
+}
+
+static void timer_wheel_remove(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    unsigned level = 0, slot = 0;
+    QEMUTimerSlot *head = timer_wheel_slot(timer_list, ts->expire_time,
+                                           &level, &slot);
+
+    QTAILQ_REMOVE(head, ts, node);
+    if (head != &timer_list->expired && QTAILQ_EMPTY(head)) {
+        timer_list->slot_mask[level] &= ~(1ull << slot);
+        if (!timer_list->slot_mask[level]) {
+            timer_list->level_mask &= ~(1u << level);
+        }
+    }
+}
+
+/*
+ * Return the first timer to expire among those that have no attribute
+ * outside @attr_mask.  Only the first nonempty slot that has such a timer
+ * needs to be searched.
+ */
+static QEMUTimer *timerlist_first_locked(QEMUTimerList *timer_list,
+                                         int attr_mask)
+{
+    uint32_t levels = timer_list->level_mask;
+    QEMUTimer *t, *first = NULL;
+
+    QTAILQ_FOREACH(t, &timer_list->expired, node) {
+        if (!(t->attributes & ~attr_mask)) {
+            return t;
+        }
+    }
+
+    while (levels) {
+        unsigned level = ctz32(levels);
+        uint64_t slots = timer_list->slot_mask[level];
+
+        levels &= levels - 1;
+        while (slots) {
+            unsigned slot = ctz64(slots);
+
+            slots &= slots - 1;
+            QTAILQ_FOREACH(t, &timer_list->wheel[level][slot], node) {
+                if (!(t->attributes & ~attr_mask) &&
+                    (!first || t->expire_time < first->expire_time)) {
+                    first = t;
+                }
+            }
+            if (first) {
+                return first;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Move wheel_time forward to @current_time, or to the first deadline
+ * if that is earlier.  Only the slot that wheel_time enters on each
+ * level can hold timers that now belong to a lower level.
+ */
+static void timer_wheel_advance(QEMUTimerList *timer_list,
+                                int64_t current_time)
+{
+    QEMUTimer *first = timer_list->active_timers;
+    QEMUTimer *t, *next;
+    unsigned level, slot;
+
+    if (first) {
+        current_time = MIN(current_time, first->expire_time);
+    }
+    if (current_time <= timer_list->wheel_time) {
+        return;
+    }
+    timer_list->wheel_time = current_time;
+
+    for (level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+        QEMUTimerSlot *head;
+
+        slot = (current_time >> (level * TIMER_WHEEL_BITS)) &
+               (TIMER_WHEEL_SLOTS - 1);
+        if (!(timer_list->slot_mask[level] & (1ull << slot))) {
+            continue;
+        }
+
+        head = &timer_list->wheel[level][slot];
+        timer_list->slot_mask[level] &= ~(1ull << slot);
+        if (!timer_list->slot_mask[level]) {
+            timer_list->level_mask &= ~(1u << level);
+        }
+        QTAILQ_FOREACH_SAFE(t, head, node, next) {
+            QTAILQ_REMOVE(head, t, node);
+            timer_wheel_insert(timer_list, t);
+        }
+    }
+}
+
 QEMUTimerList *timerlist_new(QEMUClockType type,
                              QEMUTimerListNotifyCB *cb,
                              void *opaque)
 {
     QEMUTimerList *timer_list;
     QEMUClock *clock = qemu_clock_ptr(type);
+    unsigned level, slot;
 
     timer_list = g_new0(QEMUTimerList, 1);
+    QTAILQ_INIT(&timer_list->expired);
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            QTAILQ_INIT(&timer_list->wheel[level][slot]);
+        }
+    }
     qemu_event_init(&timer_list->timers_done_ev, true);
     timer_list->clock = clock;
     timer_list->notify_cb = cb;
@@ -265,11 +430,8 @@ int64_t qemu_clock_deadline_ns_all(QEMUClockType type, int attr_mask)
             continue;
         }
         qemu_mutex_lock(&timer_list->active_timers_lock);
-        ts = timer_list->active_timers;
         /* Skip all external timers */
-        while (ts && (ts->attributes & ~attr_mask)) {
-            ts = ts->next;
-        }
+        ts = timerlist_first_locked(timer_list, attr_mask);
         if (!ts) {
             qemu_mutex_unlock(&timer_list->active_timers_lock);
             continue;
@@ -380,41 +542,32 @@ void timer_deinit(QEMUTimer *ts)
 
 static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
+    if (ts->expire_time == -1) {
+        return;
+    }
 
+    timer_wheel_remove(timer_list, ts);
     ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            qatomic_set(pt, t->next);
-            break;
-        }
-        pt = &t->next;
+    if (ts == timer_list->active_timers) {
+        qatomic_set(&timer_list->active_timers,
+                    timerlist_first_locked(timer_list, QEMU_TIMER_ATTR_ALL));
     }
 }
 
 static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
                                 QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimer *first = timer_list->active_timers;
 
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
-    for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
-            break;
-        }
-        pt = &t->next;
-    }
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    qatomic_set(pt, ts);
+    timer_wheel_insert(timer_list, ts);
 
-    return pt == &timer_list->active_timers;
+    /* An earlier timer with the same expiry time stays first */
+    if (!first || ts->expire_time < first->expire_time) {
+        qatomic_set(&timer_list->active_timers, ts);
+        return true;
+    }
+    return false;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -565,9 +718,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
         }
 
         /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
-        ts->expire_time = -1;
+        timer_del_locked(timer_list, ts);
         cb = ts->cb;
         opaque = ts->opaque;
 
@@ -578,6 +729,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
 
         progress = true;
     }
+    timer_wheel_advance(timer_list, current_time);
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
 out:
@@ -48,6 +48,15 @@
  * ht->map pointer is set, and the old map is freed once no RCU readers can see
  * it anymore.
  *
+ * Automatic resizes, and those started with qht_resize_start(), are done
+ * incrementally instead: the old map points to the new one through
+ * @resize_to, and head buckets are copied one at a time, in order, under their
+ * lock.  Writers that find their bucket already copied update the new map
+ * (removals update both), and lookups that miss in the old map try the new
+ * one.  Buckets are copied a few at a time by the writers that come along, so
+ * no writer is stalled for the whole copy.  Once all buckets are copied,
+ * ht->map is set to the new map.
+ *
  * Writers check for concurrent resizes by comparing ht->map before and after
  * acquiring their bucket lock. If they don't match, a resize has occurred
  * while the bucket spinlock was being acquired.
@@ -176,6 +185,9 @@ struct qht_tsan_lock {
  * @n_added_buckets: number of added (i.e. "non-head") buckets
  * @n_added_buckets_threshold: threshold to trigger an upward resize once the
  *                             number of added buckets surpasses it.
+ * @resize_to: map that an incremental resize is copying the entries to.
+ * @n_moved: number of head buckets, from the first, already copied to
+ *           @resize_to.  Written with the bucket lock and ht->lock held.
  * @tsan_bucket_locks: Array of striped locks to be used only under TSAN.
  *
  * Buckets are tracked in what we call a "map", i.e. this structure.
@@ -186,6 +198,8 @@ struct qht_map {
     size_t n_buckets;
     size_t n_added_buckets;
     size_t n_added_buckets_threshold;
+    struct qht_map *resize_to;
+    size_t n_moved;
 #ifdef CONFIG_TSAN
     struct qht_tsan_lock tsan_bucket_locks[QHT_TSAN_BUCKET_LOCKS];
 #endif
@@ -194,9 +208,13 @@ struct qht_map {
 /* trigger a resize when n_added_buckets > n_buckets / div */
 #define QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV 8
 
+/* head buckets copied by each writer that helps an incremental resize */
+#define QHT_RESIZE_STEP_BUCKETS 64
+
 static void qht_do_resize_reset(struct qht *ht, struct qht_map *new,
                                 bool reset);
-static void qht_grow_maybe(struct qht *ht);
+static void qht_resize_finish__locked(struct qht *ht);
+static void qht_resize_maybe(struct qht *ht);
 
 #ifdef QHT_DEBUG
 
@@ -355,14 +373,19 @@ void qht_map_lock_buckets__no_stale(struct qht *ht, struct qht_map **pmap)
 
     map = qatomic_rcu_read(&ht->map);
     qht_map_lock_buckets(map);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
+    if (likely(!qht_map_is_stale__locked(ht, map) &&
+               !qatomic_read(&map->resize_to))) {
         *pmap = map;
         return;
     }
     qht_map_unlock_buckets(map);
 
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
+    /*
+     * We raced with a resize, or one is in progress and some entries may only
+     * be in the new map; acquire ht->lock to finish it and see ht->map.
+     */
     qht_lock(ht);
+    qht_resize_finish__locked(ht);
     map = ht->map;
     qht_map_lock_buckets(map);
     qht_unlock(ht);
@@ -446,6 +469,8 @@ static struct qht_map *qht_map_create(size_t n_buckets)
     map->n_buckets = n_buckets;
 
     map->n_added_buckets = 0;
+    map->resize_to = NULL;
+    map->n_moved = 0;
     map->n_added_buckets_threshold = n_buckets /
         QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV;
 
@@ -479,6 +504,9 @@ void qht_init(struct qht *ht, qht_cmp_func_t cmp, size_t n_elems,
 /* call only when there are no readers/writers left */
 void qht_destroy(struct qht *ht)
 {
+    if (ht->map->resize_to) {
+        qht_map_destroy(ht->map->resize_to);
+    }
     qht_map_destroy(ht->map);
     memset(ht, 0, sizeof(*ht));
 }
@@ -542,6 +570,7 @@ bool qht_reset_size(struct qht *ht, size_t n_elems)
     n_buckets = qht_elems_to_buckets(n_elems);
 
     qht_lock(ht);
+    qht_resize_finish__locked(ht);
     map = ht->map;
     if (n_buckets != map->n_buckets) {
         new = qht_map_create(n_buckets);
@@ -593,15 +622,14 @@ void *qht_lookup__slowpath(const struct qht_bucket *b, qht_lookup_func_t func,
     return ret;
 }
 
-void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
-                        qht_lookup_func_t func)
+static inline
+void *qht_map_lookup(const struct qht_map *map, const void *userp,
+                     uint32_t hash, qht_lookup_func_t func)
 {
     const struct qht_bucket *b;
-    const struct qht_map *map;
     unsigned int version;
     void *ret;
 
-    map = qatomic_rcu_read(&ht->map);
     b = qht_map_to_bucket(map, hash);
 
     version = seqlock_read_begin(&b->sequence);
@@ -616,6 +644,26 @@ void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
     return qht_lookup__slowpath(b, func, userp, hash);
 }
 
+void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
+                        qht_lookup_func_t func)
+{
+    const struct qht_map *map;
+    void *ret;
+
+    map = qatomic_rcu_read(&ht->map);
+    ret = qht_map_lookup(map, userp, hash, func);
+    if (likely(ret)) {
+        return ret;
+    }
+
+    /* Entries added during an incremental resize may only be in the new map */
+    map = qatomic_rcu_read(&map->resize_to);
+    if (unlikely(map)) {
+        return qht_map_lookup(map, userp, hash, func);
+    }
+    return NULL;
+}
+
 void *qht_lookup(const struct qht *ht, const void *userp, uint32_t hash)
 {
     return qht_lookup_custom(ht, userp, hash, ht->cmp);
@@ -671,25 +719,15 @@ static void *qht_insert__locked(const struct qht *ht, struct qht_map *map,
     return NULL;
 }
 
-static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
+/*
+ * Call with the bucket lock held.  Returns true if the entries of @head were
+ * already copied by an incremental resize, and writers must update the new
+ * map.
+ */
+static inline bool qht_bucket_is_moved__locked(const struct qht_map *map,
+                                               const struct qht_bucket *head)
 {
-    struct qht_map *map;
-
-    /*
-     * If the lock is taken it probably means there's an ongoing resize,
-     * so bail out.
-     */
-    if (qht_trylock(ht)) {
-        return;
-    }
-    map = ht->map;
-    /* another thread might have just performed the resize we were after */
-    if (qht_map_needs_resize(map)) {
-        struct qht_map *new = qht_map_create(map->n_buckets * 2);
-
-        qht_do_resize(ht, new);
-    }
-    qht_unlock(ht);
+    return (size_t)(head - map->buckets) < qatomic_read(&map->n_moved);
 }
 
 bool qht_insert(struct qht *ht, void *p, uint32_t hash, void **existing)
@@ -703,12 +741,22 @@ bool qht_insert(struct qht *ht, void *p, uint32_t hash, void **existing)
     qht_debug_assert(p);
 
     b = qht_bucket_lock__no_stale(ht, hash, &map);
-    prev = qht_insert__locked(ht, map, b, p, hash, &needs_resize);
+    if (unlikely(qht_bucket_is_moved__locked(map, b))) {
+        struct qht_map *new = map->resize_to;
+        struct qht_bucket *nb = qht_map_to_bucket(new, hash);
+
+        qht_bucket_lock(new, nb);
+        prev = qht_insert__locked(ht, new, nb, p, hash, NULL);
+        qht_bucket_unlock(new, nb);
+    } else {
+        prev = qht_insert__locked(ht, map, b, p, hash, &needs_resize);
+    }
+    needs_resize |= !!qatomic_read(&map->resize_to);
     qht_bucket_debug__locked(b);
     qht_bucket_unlock(map, b);
 
-    if (unlikely(needs_resize) && ht->mode & QHT_MODE_AUTO_RESIZE) {
-        qht_grow_maybe(ht);
+    if (unlikely(needs_resize)) {
+        qht_resize_maybe(ht);
     }
     if (likely(prev == NULL)) {
         return true;
@@ -808,6 +856,7 @@ bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
 {
     struct qht_bucket *b;
     struct qht_map *map;
+    bool resizing;
     bool ret;
 
     /* NULL pointers are not supported */
@@ -815,8 +864,21 @@ bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
 
     b = qht_bucket_lock__no_stale(ht, hash, &map);
     ret = qht_remove__locked(b, p, hash);
+    if (unlikely(qht_bucket_is_moved__locked(map, b))) {
+        struct qht_map *new = map->resize_to;
+        struct qht_bucket *nb = qht_map_to_bucket(new, hash);
+
+        qht_bucket_lock(new, nb);
+        ret |= qht_remove__locked(nb, p, hash);
+        qht_bucket_unlock(new, nb);
+    }
+    resizing = qatomic_read(&map->resize_to);
     qht_bucket_debug__locked(b);
     qht_bucket_unlock(map, b);
+
+    if (unlikely(resizing)) {
+        qht_resize_maybe(ht);
+    }
     return ret;
 }
 
@@ -872,8 +934,7 @@ do_qht_iter(struct qht *ht, const struct qht_iter *iter, void *userp)
 {
     struct qht_map *map;
 
-    map = qatomic_rcu_read(&ht->map);
-    qht_map_lock_buckets(map);
+    qht_map_lock_buckets__no_stale(ht, &map);
     qht_map_iter__all_locked(map, iter, userp);
     qht_map_unlock_buckets(map);
 }
@@ -914,6 +975,93 @@ static void qht_map_copy(void *p, uint32_t hash, void *userp)
     qht_insert__locked(ht, new, b, p, hash, NULL);
 }
 
+static void qht_map_move_entry(void *p, uint32_t hash, void *userp)
+{
+    struct qht_map_copy_data *data = userp;
+    struct qht_bucket *b = qht_map_to_bucket(data->new, hash);
+
+    /* writers of copied buckets may be updating the new map */
+    qht_bucket_lock(data->new, b);
+    qht_insert__locked(data->ht, data->new, b, p, hash, NULL);
+    qht_bucket_unlock(data->new, b);
+}
+
+/*
+ * Copy up to @n head buckets of an incremental resize to the new map, and
+ * switch to the new map once all of them are copied.  Call with ht->lock held.
+ * Returns true if the resize is still in progress.
+ */
+static bool qht_resize_step__locked(struct qht *ht, size_t n)
+{
+    const struct qht_iter iter = {
+        .f.retvoid = qht_map_move_entry,
+        .type = QHT_ITER_VOID,
+    };
+    struct qht_map *map = ht->map;
+    struct qht_map_copy_data data = {
+        .ht = ht,
+        .new = map->resize_to,
+    };
+    size_t i, end;
+
+    if (!data.new) {
+        return false;
+    }
+
+    end = map->n_moved + MIN(n, map->n_buckets - map->n_moved);
+    for (i = map->n_moved; i < end; i++) {
+        struct qht_bucket *head = &map->buckets[i];
+
+        qht_bucket_lock(map, head);
+        qht_bucket_iter(head, &iter, &data);
+        qatomic_set(&map->n_moved, i + 1);
+        qht_bucket_unlock(map, head);
+    }
+    if (end < map->n_buckets) {
+        return true;
+    }
+
+    qatomic_rcu_set(&ht->map, data.new);
+    call_rcu(map, qht_map_destroy, rcu);
+    return false;
+}
+
+static void qht_resize_finish__locked(struct qht *ht)
+{
+    qht_resize_step__locked(ht, SIZE_MAX);
+}
+
+/* Call with ht->lock held */
+static void qht_resize_start__locked(struct qht *ht, size_t n_buckets)
+{
+    qatomic_rcu_set(&ht->map->resize_to, qht_map_create(n_buckets));
+    qht_resize_step__locked(ht, QHT_RESIZE_STEP_BUCKETS);
+}
+
+/* Grow the table, or help an incremental resize make progress */
+static __attribute__((noinline)) void qht_resize_maybe(struct qht *ht)
+{
+    struct qht_map *map;
+
+    /*
+     * If the lock is taken it probably means there's another thread
+     * resizing, so bail out.
+     */
+    if (qht_trylock(ht)) {
+        return;
+    }
+    map = ht->map;
+    if (map->resize_to) {
+        qht_resize_step__locked(ht, QHT_RESIZE_STEP_BUCKETS);
+    } else if (ht->mode & QHT_MODE_AUTO_RESIZE) {
+        /* another thread might have just performed the resize we were after */
+        if (qht_map_needs_resize(map)) {
+            qht_resize_start__locked(ht, map->n_buckets * 2);
+        }
+    }
+    qht_unlock(ht);
+}
+
 /*
  * Atomically perform a resize and/or reset.
  * Call with ht->lock held.
@@ -928,6 +1076,7 @@ static void qht_do_resize_reset(struct qht *ht, struct qht_map *new, bool reset)
     struct qht_map_copy_data data;
 
     old = ht->map;
+    g_assert(!old->resize_to);
     qht_map_lock_buckets(old);
 
     if (reset) {
@@ -956,6 +1105,7 @@ bool qht_resize(struct qht *ht, size_t n_elems)
     size_t ret = false;
 
     qht_lock(ht);
+    qht_resize_finish__locked(ht);
     if (n_buckets != ht->map->n_buckets) {
         struct qht_map *new;
 
@@ -968,26 +1118,39 @@ bool qht_resize(struct qht *ht, size_t n_elems)
     return ret;
 }
 
-/* pass @stats to qht_statistics_destroy() when done */
-void qht_statistics_init(const struct qht *ht, struct qht_stats *stats)
+bool qht_resize_start(struct qht *ht, size_t n_elems)
 {
-    const struct qht_map *map;
-    int i;
-
-    map = qatomic_rcu_read(&ht->map);
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+    bool ret = false;
 
-    stats->used_head_buckets = 0;
-    stats->entries = 0;
-    qdist_init(&stats->chain);
-    qdist_init(&stats->occupancy);
-    /* bail out if the qht has not yet been initialized */
-    if (unlikely(map == NULL)) {
-        stats->head_buckets = 0;
-        return;
+    qht_lock(ht);
+    if (!ht->map->resize_to && n_buckets != ht->map->n_buckets) {
+        qht_resize_start__locked(ht, n_buckets);
+        ret = true;
     }
-    stats->head_buckets = map->n_buckets;
+    qht_unlock(ht);
 
-    for (i = 0; i < map->n_buckets; i++) {
+    return ret;
+}
+
+bool qht_resize_step(struct qht *ht)
+{
+    bool ret;
+
+    qht_lock(ht);
+    ret = qht_resize_step__locked(ht, QHT_RESIZE_STEP_BUCKETS);
+    qht_unlock(ht);
+
+    return ret;
+}
+
+static void qht_map_statistics(const struct qht_map *map, size_t first,
+                               struct qht_stats *stats)
+{
+    size_t i;
+
+    stats->head_buckets += map->n_buckets - first;
+    for (i = first; i < map->n_buckets; i++) {
         const struct qht_bucket *head = &map->buckets[i];
         const struct qht_bucket *b;
         unsigned int version;
@@ -1024,6 +1187,38 @@ void qht_statistics_init(const struct qht *ht, struct qht_stats *stats)
     }
 }
 
+/* pass @stats to qht_statistics_destroy() when done */
+void qht_statistics_init(const struct qht *ht, struct qht_stats *stats)
+{
+    const struct qht_map *map;
+    const struct qht_map *new;
+
+    map = qatomic_rcu_read(&ht->map);
+
+    stats->head_buckets = 0;
+    stats->used_head_buckets = 0;
+    stats->entries = 0;
+    qdist_init(&stats->chain);
+    qdist_init(&stats->occupancy);
+    /* bail out if the qht has not yet been initialized */
+    if (unlikely(map == NULL)) {
+        return;
+    }
+
+    /*
+     * During an incremental resize, count the buckets that were not copied
+     * yet and the whole new map.  Entries of buckets copied concurrently
+     * may be counted twice.
+     */
+    new = qatomic_rcu_read(&map->resize_to);
+    if (new) {
+        qht_map_statistics(map, qatomic_read(&map->n_moved), stats);
+        qht_map_statistics(new, 0, stats);
+    } else {
+        qht_map_statistics(map, 0, stats);
+    }
+}
+
 void qht_statistics_destroy(struct qht_stats *stats)
 {
     qdist_destroy(&stats->occupancy);
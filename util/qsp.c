@@ -50,6 +50,12 @@
  *   rcu_read_lock/unlock slows down atomic_add-bench -m by 24%. Having
  *   a snapshot that is updated on qsp_reset() avoids this overhead.
  *
+ * Profiling every acquisition is too expensive for production use, so
+ * qsp_set_sample_period() can restrict it to one in N events of each thread.
+ * Sampled events are weighted by N.  The BQL is additionally profiled
+ * from acquisition to release, with a log2 histogram of its hold times, to
+ * find the call sites that keep it for long.
+ *
  * Related Work:
  * - Lennart Poettering's mutrace: http://0pointer.de/blog/projects/mutrace.html
  * - Lozi, David, Thomas, Lawall and Muller. "Remote Core Locking: Migrating
@@ -85,6 +91,9 @@ struct QSPEntry {
     const QSPCallSite *callsite;
     aligned_uint64_t n_acqs;
     aligned_uint64_t ns;
+    /* BQL only */
+    aligned_uint64_t hold_ns;
+    aligned_uint64_t hold_hist[QSP_HOLD_TIME_BUCKETS];
     unsigned int n_objs; /* count of coalesced objs; only used for reporting */
 };
 typedef struct QSPEntry QSPEntry;
@@ -107,6 +116,14 @@ static size_t qsp_qemu_path_len;
 /* the address of qsp_thread gives us a unique 'thread ID' */
 static __thread int qsp_thread;
 
+static unsigned int qsp_sample_period = 1;
+static __thread unsigned int qsp_sample_count;
+
+/* the BQL acquisition that is being timed by this thread, if any */
+static __thread QSPEntry *qsp_bql_holder;
+static __thread int64_t qsp_bql_acquired;
+static __thread unsigned int qsp_bql_weight;
+
 /*
  * Call sites are the same for all threads, so we track them in a separate hash
  * table to save memory.
@@ -125,6 +142,7 @@ static const char * const qsp_typenames[] = {
 };
 
 QemuMutexLockFunc bql_mutex_lock_func = qemu_mutex_lock_impl;
+QemuMutexUnlockFunc bql_mutex_unlock_func = qemu_mutex_unlock_impl;
 QemuMutexLockFunc qemu_mutex_lock_func = qemu_mutex_lock_impl;
 QemuMutexTrylockFunc qemu_mutex_trylock_func = qemu_mutex_trylock_impl;
 QemuRecMutexLockFunc qemu_rec_mutex_lock_func = qemu_rec_mutex_lock_impl;
@@ -344,50 +362,72 @@ static QSPEntry *qsp_entry_get(const void *obj, const char *file, int line,
  * @e is in the global hash table; it is only written to by the current thread,
  * so we write to it atomically (as in "write once") to prevent torn reads.
  */
-static inline void do_qsp_entry_record(QSPEntry *e, int64_t delta, bool acq)
+static inline void do_qsp_entry_record(QSPEntry *e, int64_t delta, bool acq,
+                                       unsigned int weight)
 {
-    qatomic_set_u64(&e->ns, e->ns + delta);
+    qatomic_set_u64(&e->ns, e->ns + delta * weight);
     if (acq) {
-        qatomic_set_u64(&e->n_acqs, e->n_acqs + 1);
+        qatomic_set_u64(&e->n_acqs, e->n_acqs + weight);
     }
 }
 
-static inline void qsp_entry_record(QSPEntry *e, int64_t delta)
+static inline void qsp_entry_record(QSPEntry *e, int64_t delta,
+                                    unsigned int weight)
 {
-    do_qsp_entry_record(e, delta, true);
+    do_qsp_entry_record(e, delta, true, weight);
+}
+
+/* Returns the weight of the current event, or 0 if it is not sampled */
+static inline unsigned int qsp_sample(void)
+{
+    unsigned int period = qatomic_read(&qsp_sample_period);
+
+    if (++qsp_sample_count < period) {
+        return 0;
+    }
+    qsp_sample_count = 0;
+    return period;
 }
 
 #define QSP_GEN_VOID(type_, qsp_t_, func_, impl_)                       \
     static void func_(type_ *obj, const char *file, int line)           \
     {                                                                   \
+        unsigned int weight = qsp_sample();                             \
         QSPEntry *e;                                                    \
         int64_t t0, t1;                                                 \
                                                                         \
+        if (!weight) {                                                  \
+            impl_(obj, file, line);                                     \
+            return;                                                     \
+        }                                                               \
         t0 = get_clock();                                               \
         impl_(obj, file, line);                                         \
         t1 = get_clock();                                               \
                                                                         \
         e = qsp_entry_get(obj, file, line, qsp_t_);                     \
-        qsp_entry_record(e, t1 - t0);                                   \
+        qsp_entry_record(e, t1 - t0, weight);                           \
     }
 
 #define QSP_GEN_RET1(type_, qsp_t_, func_, impl_)                       \
     static int func_(type_ *obj, const char *file, int line)            \
     {                                                                   \
+        unsigned int weight = qsp_sample();                             \
         QSPEntry *e;                                                    \
         int64_t t0, t1;                                                 \
         int err;                                                        \
                                                                         \
+        if (!weight) {                                                  \
+            return impl_(obj, file, line);                              \
+        }                                                               \
         t0 = get_clock();                                               \
         err = impl_(obj, file, line);                                   \
         t1 = get_clock();                                               \
                                                                         \
         e = qsp_entry_get(obj, file, line, qsp_t_);                     \
-        do_qsp_entry_record(e, t1 - t0, !err);                          \
+        do_qsp_entry_record(e, t1 - t0, !err, weight);                  \
         return err;                                                     \
     }
 
-QSP_GEN_VOID(QemuMutex, QSP_BQL_MUTEX, qsp_bql_mutex_lock, qemu_mutex_lock_impl)
 QSP_GEN_VOID(QemuMutex, QSP_MUTEX, qsp_mutex_lock, qemu_mutex_lock_impl)
 QSP_GEN_RET1(QemuMutex, QSP_MUTEX, qsp_mutex_trylock, qemu_mutex_trylock_impl)
 
@@ -399,34 +439,100 @@ QSP_GEN_RET1(QemuRecMutex, QSP_REC_MUTEX, qsp_rec_mutex_trylock,
 #undef QSP_GEN_RET1
 #undef QSP_GEN_VOID
 
+static void qsp_bql_mutex_lock(QemuMutex *obj, const char *file, int line)
+{
+    unsigned int weight = qsp_sample();
+    QSPEntry *e;
+    int64_t t0, t1;
+
+    if (!weight) {
+        qemu_mutex_lock_impl(obj, file, line);
+        qsp_bql_holder = NULL;
+        return;
+    }
+    t0 = get_clock();
+    qemu_mutex_lock_impl(obj, file, line);
+    t1 = get_clock();
+
+    e = qsp_entry_get(obj, file, line, QSP_BQL_MUTEX);
+    qsp_entry_record(e, t1 - t0, weight);
+
+    /* the hold time is accounted to the call site that took the lock */
+    qsp_bql_holder = e;
+    qsp_bql_acquired = t1;
+    qsp_bql_weight = weight;
+}
+
+static void qsp_bql_hold_end(void)
+{
+    QSPEntry *e = qsp_bql_holder;
+    int64_t delta = get_clock() - qsp_bql_acquired;
+    unsigned int bucket = 0;
+
+    if (delta > 1) {
+        bucket = MIN(63 - clz64(delta), QSP_HOLD_TIME_BUCKETS - 1);
+    }
+    qatomic_set_u64(&e->hold_ns, e->hold_ns + delta * qsp_bql_weight);
+    qatomic_set_u64(&e->hold_hist[bucket],
+                    e->hold_hist[bucket] + qsp_bql_weight);
+    qsp_bql_holder = NULL;
+}
+
+static void qsp_bql_mutex_unlock(QemuMutex *obj, const char *file, int line)
+{
+    if (qsp_bql_holder) {
+        qsp_bql_hold_end();
+    }
+    qemu_mutex_unlock_impl(obj, file, line);
+}
+
+/* Waiting on a condition variable releases the BQL */
+static inline void qsp_cond_release(QemuMutex *mutex)
+{
+    if (qsp_bql_holder && qsp_bql_holder->callsite->obj == mutex) {
+        qsp_bql_hold_end();
+    }
+}
+
 static void
 qsp_cond_wait(QemuCond *cond, QemuMutex *mutex, const char *file, int line)
 {
+    unsigned int weight = qsp_sample();
     QSPEntry *e;
     int64_t t0, t1;
 
+    qsp_cond_release(mutex);
+    if (!weight) {
+        qemu_cond_wait_impl(cond, mutex, file, line);
+        return;
+    }
     t0 = get_clock();
     qemu_cond_wait_impl(cond, mutex, file, line);
     t1 = get_clock();
 
     e = qsp_entry_get(cond, file, line, QSP_CONDVAR);
-    qsp_entry_record(e, t1 - t0);
+    qsp_entry_record(e, t1 - t0, weight);
 }
 
 static bool
 qsp_cond_timedwait(QemuCond *cond, QemuMutex *mutex, int ms,
                    const char *file, int line)
 {
+    unsigned int weight = qsp_sample();
     QSPEntry *e;
     int64_t t0, t1;
     bool ret;
 
+    qsp_cond_release(mutex);
+    if (!weight) {
+        return qemu_cond_timedwait_impl(cond, mutex, ms, file, line);
+    }
     t0 = get_clock();
     ret = qemu_cond_timedwait_impl(cond, mutex, ms, file, line);
     t1 = get_clock();
 
     e = qsp_entry_get(cond, file, line, QSP_CONDVAR);
-    qsp_entry_record(e, t1 - t0);
+    qsp_entry_record(e, t1 - t0, weight);
     return ret;
 }
 
@@ -440,6 +546,7 @@ void qsp_enable(void)
     qatomic_set(&qemu_mutex_lock_func, qsp_mutex_lock);
     qatomic_set(&qemu_mutex_trylock_func, qsp_mutex_trylock);
     qatomic_set(&bql_mutex_lock_func, qsp_bql_mutex_lock);
+    qatomic_set(&bql_mutex_unlock_func, qsp_bql_mutex_unlock);
     qatomic_set(&qemu_rec_mutex_lock_func, qsp_rec_mutex_lock);
     qatomic_set(&qemu_rec_mutex_trylock_func, qsp_rec_mutex_trylock);
     qatomic_set(&qemu_cond_wait_func, qsp_cond_wait);
@@ -451,12 +558,23 @@ void qsp_disable(void)
     qatomic_set(&qemu_mutex_lock_func, qemu_mutex_lock_impl);
     qatomic_set(&qemu_mutex_trylock_func, qemu_mutex_trylock_impl);
     qatomic_set(&bql_mutex_lock_func, qemu_mutex_lock_impl);
+    qatomic_set(&bql_mutex_unlock_func, qemu_mutex_unlock_impl);
     qatomic_set(&qemu_rec_mutex_lock_func, qemu_rec_mutex_lock_impl);
     qatomic_set(&qemu_rec_mutex_trylock_func, qemu_rec_mutex_trylock_impl);
     qatomic_set(&qemu_cond_wait_func, qemu_cond_wait_impl);
     qatomic_set(&qemu_cond_timedwait_func, qemu_cond_timedwait_impl);
 }
 
+void qsp_set_sample_period(unsigned int period)
+{
+    qatomic_set(&qsp_sample_period, MAX(period, 1));
+}
+
+unsigned int qsp_get_sample_period(void)
+{
+    return qatomic_read(&qsp_sample_period);
+}
+
 static gint qsp_tree_cmp(gconstpointer ap, gconstpointer bp, gpointer up)
 {
     const QSPEntry *a = ap;
@@ -525,6 +643,19 @@ static void qsp_sort(void *p, uint32_t h, void *userp)
     g_tree_insert(tree, e, NULL);
 }
 
+/* @src may be updated concurrently by its thread; read it atomically */
+static void qsp_entry_add(QSPEntry *dst, const QSPEntry *src)
+{
+    int i;
+
+    dst->ns += qatomic_read_u64(&src->ns);
+    dst->n_acqs += qatomic_read_u64(&src->n_acqs);
+    dst->hold_ns += qatomic_read_u64(&src->hold_ns);
+    for (i = 0; i < QSP_HOLD_TIME_BUCKETS; i++) {
+        dst->hold_hist[i] += qatomic_read_u64(&src->hold_hist[i]);
+    }
+}
+
 static void qsp_aggregate(void *p, uint32_t h, void *up)
 {
     struct qht *ht = up;
@@ -534,12 +665,7 @@ static void qsp_aggregate(void *p, uint32_t h, void *up)
 
     hash = qsp_entry_no_thread_hash(e);
     agg = qsp_entry_find(ht, e, hash);
-    /*
-     * The entry is in the global hash table; read from it atomically (as in
-     * "read once").
-     */
-    agg->ns += qatomic_read_u64(&e->ns);
-    agg->n_acqs += qatomic_read_u64(&e->n_acqs);
+    qsp_entry_add(agg, e);
 }
 
 static void qsp_iter_diff(void *p, uint32_t hash, void *htp)
@@ -547,6 +673,7 @@ static void qsp_iter_diff(void *p, uint32_t hash, void *htp)
     struct qht *ht = htp;
     QSPEntry *old = p;
     QSPEntry *new;
+    int i;
 
     new = qht_lookup(ht, old, hash);
     /* entries are never deleted, so we must have this one */
@@ -554,12 +681,17 @@ static void qsp_iter_diff(void *p, uint32_t hash, void *htp)
     /* our reading of the stats happened after the snapshot was taken */
     g_assert(new->n_acqs >= old->n_acqs);
     g_assert(new->ns >= old->ns);
+    g_assert(new->hold_ns >= old->hold_ns);
 
     new->n_acqs -= old->n_acqs;
     new->ns -= old->ns;
+    new->hold_ns -= old->hold_ns;
+    for (i = 0; i < QSP_HOLD_TIME_BUCKETS; i++) {
+        new->hold_hist[i] -= old->hold_hist[i];
+    }
 
     /* No point in reporting an empty entry */
-    if (new->n_acqs == 0 && new->ns == 0) {
+    if (new->n_acqs == 0 && new->ns == 0 && new->hold_ns == 0) {
         bool removed = qht_remove(ht, new, hash);
 
         g_assert(removed);
@@ -587,8 +719,7 @@ static void qsp_iter_callsite_coalesce(void *p, uint32_t h, void *htp)
     } else if (e->callsite->obj != old->callsite->obj) {
         e->n_objs++;
     }
-    e->ns += old->ns;
-    e->n_acqs += old->n_acqs;
+    qsp_entry_add(e, old);
 }
 
 static void qsp_ht_delete(void *p, uint32_t h, void *htp)
@@ -785,6 +916,44 @@ void qsp_report(size_t max, enum QSPSortBy sort_by,
     report_destroy(&rep);
 }
 
+struct QSPCallSiteIter {
+    QSPCallSiteFunc *fn;
+    void *opaque;
+};
+typedef struct QSPCallSiteIter QSPCallSiteIter;
+
+static gboolean qsp_tree_call_site(gpointer key, gpointer value, gpointer udata)
+{
+    const QSPEntry *e = key;
+    QSPCallSiteIter *iter = udata;
+    g_autofree char *at = qsp_at(e->callsite);
+    QSPCallSiteStats stats = {
+        .type = qsp_typenames[e->callsite->type],
+        .call_site = at,
+        .n_acqs = e->n_acqs,
+        .wait_ns = e->ns,
+        .has_hold_time = e->callsite->type == QSP_BQL_MUTEX,
+        .hold_ns = e->hold_ns,
+    };
+
+    memcpy(stats.hold_hist, e->hold_hist, sizeof(stats.hold_hist));
+    iter->fn(&stats, iter->opaque);
+    return FALSE;
+}
+
+void qsp_foreach_call_site(QSPCallSiteFunc *fn, void *opaque)
+{
+    enum QSPSortBy sort_by = QSP_SORT_BY_TOTAL_WAIT_TIME;
+    GTree *tree = g_tree_new_full(qsp_tree_cmp, &sort_by, g_free, NULL);
+    QSPCallSiteIter iter = { .fn = fn, .opaque = opaque };
+
+    qsp_init();
+
+    qsp_mktree(tree, true);
+    g_tree_foreach(tree, qsp_tree_call_site, &iter);
+    g_tree_destroy(tree);
+}
+
 static void qsp_snapshot_destroy(QSPSnapshot *snap)
 {
     qht_iter(&snap->ht, qsp_ht_delete, NULL);
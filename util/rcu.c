@@ -32,6 +32,7 @@
 #include "qemu/thread.h"
 #include "qemu/main-loop.h"
 #include "qemu/lockable.h"
+#include "qemu/stats64.h"
 #if defined(CONFIG_MALLOC_TRIM)
 #include <malloc.h>
 #endif
@@ -47,6 +48,9 @@ unsigned long rcu_gp_ctr = RCU_GP_LOCKED;
 
 QemuEvent rcu_gp_event;
 static int in_drain_call_rcu;
+static int rcu_expedite;
+static Stat64 rcu_grace_periods;
+static Stat64 rcu_expedited_grace_periods;
 static QemuMutex rcu_registry_lock;
 static QemuMutex rcu_sync_lock;
 
@@ -106,7 +110,8 @@ static void wait_for_readers(void)
                  * get some extra futex wakeups.
                  */
                 qatomic_set(&index->waiting, false);
-            } else if (qatomic_read(&in_drain_call_rcu)) {
+            } else if (qatomic_read(&in_drain_call_rcu) ||
+                       qatomic_read(&rcu_expedite)) {
                 notifier_list_notify(&index->force_rcu, NULL);
             }
         }
@@ -171,17 +176,30 @@ void synchronize_rcu(void)
 
         wait_for_readers();
     }
+
+    stat64_add(&rcu_grace_periods, 1);
+    if (qatomic_read(&rcu_expedite)) {
+        stat64_add(&rcu_expedited_grace_periods, 1);
+    }
 }
 
 
 #define RCU_CALL_MIN_SIZE        30
 
+/*
+ * With this many callbacks waiting, readers are asked to leave their
+ * critical sections as in drain_call_rcu(), so that the memory is freed
+ * as soon as possible.
+ */
+#define RCU_CALL_EXPEDITE_SIZE   1000
+
 /* Multi-producer, single-consumer queue based on urcu/static/wfqueue.h
  * from liburcu.  Note that head is only used by the consumer.
  */
 static struct rcu_head dummy;
 static struct rcu_head *head = &dummy, **tail = &dummy.next;
 static int rcu_call_count;
+static int rcu_call_pending;
 static QemuEvent rcu_call_ready_event;
 
 static void enqueue(struct rcu_head *node)
@@ -282,7 +300,13 @@ static void *call_rcu_thread(void *opaque)
         }
 
         qatomic_sub(&rcu_call_count, n);
-        synchronize_rcu();
+        if (n >= RCU_CALL_EXPEDITE_SIZE) {
+            qatomic_inc(&rcu_expedite);
+            synchronize_rcu();
+            qatomic_dec(&rcu_expedite);
+        } else {
+            synchronize_rcu();
+        }
         bql_lock();
         while (n > 0) {
             node = try_dequeue();
@@ -299,6 +323,7 @@ static void *call_rcu_thread(void *opaque)
 
             n--;
             node->func(node);
+            qatomic_dec(&rcu_call_pending);
         }
         bql_unlock();
     }
@@ -309,10 +334,17 @@ void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
 {
     node->func = func;
     enqueue(node);
+    qatomic_inc(&rcu_call_pending);
     qatomic_inc(&rcu_call_count);
     qemu_event_set(&rcu_call_ready_event);
 }
 
+void rcu_get_stats(RCUStats *stats)
+{
+    stats->pending_callbacks = qatomic_read(&rcu_call_pending);
+    stats->grace_periods = stat64_get(&rcu_grace_periods);
+    stats->expedited_grace_periods = stat64_get(&rcu_expedited_grace_periods);
+}
 
 struct rcu_drain {
     struct rcu_head rcu;
@@ -19,6 +19,14 @@ membarrier(int cmd, int flags)
 {
     return syscall(__NR_membarrier, cmd, flags);
 }
+
+/*
+ * MEMBARRIER_CMD_SHARED waits for a scheduler RCU grace period, which
+ * takes milliseconds.  The private expedited command only interrupts the
+ * CPUs that are running threads of this process, and is used if the
+ * kernel supports it.
+ */
+static int membarrier_cmd = MEMBARRIER_CMD_SHARED;
 #endif
 
 void smp_mb_global(void)
@@ -26,7 +34,9 @@ void smp_mb_global(void)
 #if defined CONFIG_WIN32
     FlushProcessWriteBuffers();
 #elif defined CONFIG_LINUX
-    membarrier(MEMBARRIER_CMD_SHARED, 0);
+    if (membarrier(membarrier_cmd, 0) < 0) {
+        membarrier(MEMBARRIER_CMD_SHARED, 0);
+    }
 #else
 #error --enable-membarrier is not supported on this operating system.
 #endif
@@ -46,5 +56,10 @@ void smp_mb_global_init(void)
         error_report("Please upgrade your system to a newer version of Linux");
         exit(1);
     }
+    if ((ret & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+        (ret & MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED) &&
+        membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0) {
+        membarrier_cmd = MEMBARRIER_CMD_PRIVATE_EXPEDITED;
+    }
 #endif
 }
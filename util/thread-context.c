@@ -354,3 +354,24 @@ void thread_context_create_thread(ThreadContext *tc, QemuThread *thread,
     }
     qemu_mutex_unlock(&tc->mutex);
 }
+
+bool thread_context_set_thread_affinity(ThreadContext *tc, QemuThread *thread,
+                                        Error **errp)
+{
+    unsigned long *bitmap;
+    int nbits, ret;
+
+    ret = qemu_thread_get_affinity(&tc->thread, &bitmap, &nbits);
+    if (ret) {
+        error_setg(errp, "Getting CPU affinity failed: %s", strerror(ret));
+        return false;
+    }
+
+    ret = qemu_thread_set_affinity(thread, bitmap, nbits);
+    g_free(bitmap);
+    if (ret) {
+        error_setg(errp, "Setting CPU affinity failed: %s", strerror(ret));
+        return false;
+    }
+    return true;
+}
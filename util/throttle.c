@@ -462,6 +462,37 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
+static const BucketType bucket_types_size[THROTTLE_MAX][2] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+};
+static const BucketType bucket_types_units[THROTTLE_MAX][2] = {
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+};
+
+static void throttle_do_account(ThrottleState *ts, ThrottleDirection direction,
+                                double units, uint64_t size)
+{
+    unsigned i;
+
+    for (i = 0; i < ARRAY_SIZE(bucket_types_size[THROTTLE_READ]); i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[direction][i]];
+        bkt->level += size;
+        if (bkt->burst_length > 1) {
+            bkt->burst_level += size;
+        }
+
+        bkt = &ts->cfg.buckets[bucket_types_units[direction][i]];
+        bkt->level += units;
+        if (bkt->burst_length > 1) {
+            bkt->burst_level += units;
+        }
+    }
+}
+
 /* do the accounting for this operation
  *
  * @direction: throttle direction
@@ -470,16 +501,7 @@ bool throttle_schedule_timer(ThrottleState *ts,
 void throttle_account(ThrottleState *ts, ThrottleDirection direction,
                       uint64_t size)
 {
-    static const BucketType bucket_types_size[THROTTLE_MAX][2] = {
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
-    };
-    static const BucketType bucket_types_units[THROTTLE_MAX][2] = {
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
-    };
     double units = 1.0;
-    unsigned i;
 
     assert(direction < THROTTLE_MAX);
     /* if cfg.op_size is defined and smaller than size we compute unit count */
@@ -487,23 +509,54 @@ void throttle_account(ThrottleState *ts, ThrottleDirection direction,
         units = (double) size / ts->cfg.op_size;
     }
 
+    throttle_do_account(ts, direction, units, size);
+}
+
+/* compute how much I/O the average limits allow during a period of time
+ *
+ * @direction: throttle direction
+ * @ns:        the length of the period in nanoseconds
+ * @units:     the number of operations, UINT64_MAX if not limited
+ * @size:      the number of bytes, UINT64_MAX if not limited
+ */
+void throttle_compute_credit(ThrottleState *ts, ThrottleDirection direction,
+                             uint32_t ns, uint64_t *units, uint64_t *size)
+{
+    unsigned i;
+
+    assert(direction < THROTTLE_MAX);
+    *units = UINT64_MAX;
+    *size = UINT64_MAX;
+
     for (i = 0; i < ARRAY_SIZE(bucket_types_size[THROTTLE_READ]); i++) {
         LeakyBucket *bkt;
 
         bkt = &ts->cfg.buckets[bucket_types_size[direction][i]];
-        bkt->level += size;
-        if (bkt->burst_length > 1) {
-            bkt->burst_level += size;
+        if (bkt->avg) {
+            *size = MIN(*size, muldiv64(bkt->avg, ns, NANOSECONDS_PER_SECOND));
         }
 
         bkt = &ts->cfg.buckets[bucket_types_units[direction][i]];
-        bkt->level += units;
-        if (bkt->burst_length > 1) {
-            bkt->burst_level += units;
+        if (bkt->avg) {
+            *units = MIN(*units,
+                         muldiv64(bkt->avg, ns, NANOSECONDS_PER_SECOND));
         }
     }
 }
 
+/* account I/O in advance, ignoring cfg.op_size
+ *
+ * @direction: throttle direction
+ * @units:     the number of operations
+ * @size:      the number of bytes
+ */
+void throttle_account_credit(ThrottleState *ts, ThrottleDirection direction,
+                             uint64_t units, uint64_t size)
+{
+    assert(direction < THROTTLE_MAX);
+    throttle_do_account(ts, direction, units, size);
+}
+
 /* return a ThrottleConfig based on the options in a ThrottleLimits
  *
  * @arg:    the ThrottleLimits object to read from
@@ -27,7 +27,12 @@
  * protocol messages over the UNIX domain socket.
  *
  * When virtqueues are set up libvhost-user calls set_watch() to monitor kick
- * fds. These fds are also handled in the VuServer->ctx AioContext.
+ * fds. These fds are also handled in the VuServer->ctx AioContext, unless
+ * VuServer->vq_ctx gives the virtqueue its own AioContext. Such virtqueues
+ * are processed in their own thread while vu_client_trip() may change the
+ * memory table or the rings, so their kick fds are stopped (from their own
+ * thread) and their requests waited for before each vhost-user message is
+ * handled, see vu_pause_vqs().
  *
  * Both vu_client_trip() and kick fd monitoring can be stopped by shutting down
  * the socket connection. Shutting down the socket connection causes
@@ -77,14 +82,15 @@ static void panic_cb(VuDev *vu_dev, const char *buf)
 
 void vhost_user_server_inc_in_flight(VuServer *server)
 {
-    assert(!server->wait_idle);
+    /* Virtqueues in their own thread may still be kicked until paused */
+    assert(!qatomic_read(&server->wait_idle) || server->vq_ctx);
     qatomic_inc(&server->in_flight);
 }
 
 void vhost_user_server_dec_in_flight(VuServer *server)
 {
     if (qatomic_fetch_dec(&server->in_flight) == 1) {
-        if (server->wait_idle) {
+        if (qatomic_xchg(&server->wait_idle, false)) {
             aio_co_wake(server->co_trip);
         }
     }
@@ -95,6 +101,85 @@ bool vhost_user_server_has_in_flight(VuServer *server)
     return qatomic_load_acquire(&server->in_flight) > 0;
 }
 
+/* Called from server->co_trip */
+static void coroutine_fn vu_wait_idle(VuServer *server)
+{
+    while (vhost_user_server_has_in_flight(server)) {
+        qatomic_set_mb(&server->wait_idle, true);
+        if (!vhost_user_server_has_in_flight(server) &&
+            qatomic_xchg(&server->wait_idle, false)) {
+            /* The last request completed before seeing wait_idle */
+            break;
+        }
+        qemu_coroutine_yield();
+    }
+}
+
+static void kick_handler(void *opaque);
+
+static AioContext *vu_fd_watch_ctx(VuServer *server, VuFdWatch *vu_fd_watch)
+{
+    return vu_fd_watch->ctx ?: server->ctx;
+}
+
+static void vu_pause_vq_bh(void *opaque)
+{
+    VuFdWatch *vu_fd_watch = opaque;
+    VuServer *server = container_of(vu_fd_watch->vu_dev, VuServer, vu_dev);
+
+    aio_set_fd_handler(vu_fd_watch->ctx, vu_fd_watch->fd,
+                       NULL, NULL, NULL, NULL, NULL);
+    vhost_user_server_dec_in_flight(server);
+}
+
+/*
+ * Stop the kick fds of the virtqueues that have their own AioContext.
+ * This is done by a BH in that AioContext so that no kick_handler() is
+ * running there anymore once it is done; the BHs count as in flight.
+ */
+static void vu_stop_vq_watches(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        if (vu_fd_watch->ctx) {
+            vhost_user_server_inc_in_flight(server);
+            aio_bh_schedule_oneshot(vu_fd_watch->ctx, vu_pause_vq_bh,
+                                    vu_fd_watch);
+        }
+    }
+}
+
+/* Called from server->co_trip before handling a message */
+static void coroutine_fn vu_pause_vqs(VuServer *server)
+{
+    if (!server->vq_ctx || server->vq_paused) {
+        return;
+    }
+
+    server->vq_paused = true;
+    vu_stop_vq_watches(server);
+    vu_wait_idle(server);
+}
+
+/* Called from server->co_trip once the previous message was handled */
+static void vu_resume_vqs(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+
+    if (!server->vq_paused || !server->ctx) {
+        return;
+    }
+
+    server->vq_paused = false;
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        if (vu_fd_watch->ctx) {
+            aio_set_fd_handler(vu_fd_watch->ctx, vu_fd_watch->fd,
+                               kick_handler, NULL, NULL, NULL, vu_fd_watch);
+        }
+    }
+}
+
 static bool coroutine_fn
 vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
 {
@@ -115,6 +200,7 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
     }
 
     assert(qemu_in_coroutine());
+    vu_resume_vqs(server);
     do {
         size_t nfds = 0;
         int *fds = NULL;
@@ -187,6 +273,7 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
         }
     }
 
+    vu_pause_vqs(server);
     return true;
 
 fail:
@@ -212,18 +299,16 @@ static coroutine_fn void vu_client_trip(void *opaque)
         }
     }
 
-    if (vhost_user_server_has_in_flight(server)) {
-        /* Wait for requests to complete before we can unmap the memory */
-        server->wait_idle = true;
-        qemu_coroutine_yield();
-        server->wait_idle = false;
-    }
+    /* Wait for requests to complete before we can unmap the memory */
+    vu_pause_vqs(server);
+    vu_wait_idle(server);
     assert(!vhost_user_server_has_in_flight(server));
 
     vu_deinit(vu_dev);
 
     /* vu_deinit() should have called remove_watch() */
     assert(QTAILQ_EMPTY(&server->vu_fd_watches));
+    server->vq_paused = false;
 
     object_unref(OBJECT(server->sioc));
     server->sioc = NULL;
@@ -291,11 +376,19 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
 
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
-        qemu_socket_set_nonblock(fd);
-        aio_set_fd_handler(server->ctx, fd, kick_handler,
-                           NULL, NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+
+        /* Kick fds are the only ones watched, with the vq index as @pvt */
+        if (server->vq_ctx && (intptr_t)pvt < server->max_queues) {
+            vu_fd_watch->ctx = server->vq_ctx[(intptr_t)pvt];
+        }
+
+        qemu_socket_set_nonblock(fd);
+        if (!vu_fd_watch->ctx || !server->vq_paused) {
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), fd,
+                               kick_handler, NULL, NULL, NULL, vu_fd_watch);
+        }
     }
 }
 
@@ -313,7 +406,10 @@ static void remove_watch(VuDev *vu_dev, int fd)
     if (!vu_fd_watch) {
         return;
     }
-    aio_set_fd_handler(server->ctx, fd, NULL, NULL, NULL, NULL, NULL);
+    if (!vu_fd_watch->ctx || !server->vq_paused) {
+        aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), fd,
+                           NULL, NULL, NULL, NULL, NULL);
+    }
 
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
     g_free(vu_fd_watch);
@@ -373,10 +469,13 @@ void vhost_user_server_stop(VuServer *server)
         VuFdWatch *vu_fd_watch;
 
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+            if (!vu_fd_watch->ctx) {
+                aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
+                                   NULL, NULL, NULL, NULL, vu_fd_watch);
+            }
         }
 
+        /* vu_client_trip() stops the others when it terminates */
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
 
         AIO_WAIT_WHILE(server->ctx, server->co_trip);
@@ -412,7 +511,11 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
     }
 
     QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-        aio_set_fd_handler(ctx, vu_fd_watch->fd, kick_handler, NULL,
+        if (vu_fd_watch->ctx && server->vq_paused) {
+            continue;
+        }
+        aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                           vu_fd_watch->fd, kick_handler, NULL,
                            NULL, NULL, vu_fd_watch);
     }
 
@@ -444,8 +547,15 @@ void vhost_user_server_detach_aio_context(VuServer *server)
         VuFdWatch *vu_fd_watch;
 
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+            if (!vu_fd_watch->ctx) {
+                aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
+                                   NULL, NULL, NULL, NULL, vu_fd_watch);
+            }
+        }
+
+        /* Drained callers poll for the BHs through the in-flight counter */
+        if (!server->vq_paused) {
+            vu_stop_vq_watches(server);
         }
     }
 
@@ -462,6 +572,7 @@ void vhost_user_server_detach_aio_context(VuServer *server)
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *socket_addr,
                              AioContext *ctx,
+                             AioContext **vq_ctx,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp)
@@ -491,6 +602,7 @@ bool vhost_user_server_start(VuServer *server,
         .vu_iface              = vu_iface,
         .max_queues            = max_queues,
         .ctx                   = ctx,
+        .vq_ctx                = vq_ctx,
     };
 
     qio_net_listener_set_name(server->listener, "vhost-user-backend-listener");